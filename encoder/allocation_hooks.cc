@@ -0,0 +1,77 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+//
+// Replacements of the global operator new and delete that report each
+// allocation to |AllocationTracker|. Linked into the encoder when the
+// WEBMLIVE_ENABLE_ALLOCATION_CHECK CMake option is on.
+#include <stdlib.h>
+
+#include <new>
+
+#include "encoder/allocation_tracker.h"
+
+namespace {
+
+const bool g_hooks_installed =
+    webmlive::AllocationTracker::SetHooksInstalled();
+
+void* tracked_malloc(size_t size) {
+  webmlive::AllocationTracker::OnAllocation(size);
+  return malloc(size > 0 ? size : 1);
+}
+
+}  // namespace
+
+void* operator new(size_t size) {
+  void* const ptr = tracked_malloc(size);
+  if (!ptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void* operator new[](size_t size) {
+  void* const ptr = tracked_malloc(size);
+  if (!ptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+  return tracked_malloc(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+  return tracked_malloc(size);
+}
+
+void operator delete(void* ptr) noexcept {
+  free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+  free(ptr);
+}
+
+// C++14 sized deallocation calls these instead of the unsized forms.
+void operator delete(void* ptr, size_t) noexcept {
+  free(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept {
+  free(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+  free(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+  free(ptr);
+}
@@ -0,0 +1,225 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/allocation_tracker.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <dbghelp.h>
+#elif defined(__GLIBC__)
+#include <execinfo.h>
+#include <stdlib.h>
+#endif
+
+#include <cstring>
+#include <sstream>
+#include <vector>
+
+#include "glog/logging.h"
+
+namespace webmlive {
+
+namespace {
+
+// Frames of the tracker and the operator new replacement above the
+// allocating call.
+const int kSkippedFrames = 3;
+
+// Name of the tracked calling thread, or NULL, and whether the thread is
+// recording an allocation.
+thread_local const char* t_thread_name = NULL;
+thread_local bool t_in_hook = false;
+
+// Returns |name| without its trailing digits.
+std::string strip_index(const std::string& name) {
+  size_t length = name.length();
+  while (length > 0 && name[length - 1] >= '0' && name[length - 1] <= '9') {
+    --length;
+  }
+  return name.substr(0, length);
+}
+
+// FNV-1a hash of the |num_frames| return addresses at |frames|.
+uint64 hash_frames(void* const* frames, int num_frames) {
+  uint64 hash = 14695981039346656037ULL;
+  for (int i = 0; i < num_frames; ++i) {
+    uint64 address = reinterpret_cast<uintptr_t>(frames[i]);
+    for (int b = 0; b < 8; ++b) {
+      hash = (hash ^ (address & 0xff)) * 1099511628211ULL;
+      address >>= 8;
+    }
+  }
+  return hash;
+}
+
+}  // namespace
+
+const char* const AllocationTracker::kPipelineThreads[] = {
+  "video_capture", "audio_capture", "desktop_capture", "file_reader",
+  "replay", "converter", "encoder", "audio_encoder", "video_encoder",
+  "scaler", "rendition", "uploader", "push_sink", "fanout", NULL,
+};
+
+bool AllocationTracker::hooks_installed_ = false;
+
+AllocationTracker::AllocationTracker()
+    : armed_(false), allocations_(0), sites_dropped_(0) {
+}
+
+AllocationTracker::~AllocationTracker() {
+}
+
+AllocationTracker* AllocationTracker::Instance() {
+  static AllocationTracker tracker;
+  return &tracker;
+}
+
+void AllocationTracker::OnAllocation(size_t size) {
+  if (!t_thread_name || t_in_hook) {
+    return;
+  }
+  AllocationTracker* const ptr_tracker = Instance();
+  if (!ptr_tracker->armed_.load(std::memory_order_relaxed)) {
+    return;
+  }
+  // Allocations made by |Record()|, and by the logging it may do, are not
+  // recorded.
+  t_in_hook = true;
+  ptr_tracker->Record(size);
+  t_in_hook = false;
+}
+
+void AllocationTracker::TrackThread(const std::string& name) {
+  const std::string base_name = strip_index(name);
+  for (int i = 0; kPipelineThreads[i]; ++i) {
+    if (base_name == kPipelineThreads[i]) {
+      t_thread_name = kPipelineThreads[i];
+      return;
+    }
+  }
+}
+
+void AllocationTracker::TrackCurrentThread(const char* name) {
+  t_thread_name = name;
+}
+
+bool AllocationTracker::SetHooksInstalled() {
+  hooks_installed_ = true;
+  return true;
+}
+
+void AllocationTracker::Arm() {
+  armed_.store(true, std::memory_order_relaxed);
+}
+
+void AllocationTracker::Disarm() {
+  armed_.store(false, std::memory_order_relaxed);
+}
+
+int64 AllocationTracker::LogReport() {
+  std::vector<Site> sites;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (SiteMap::const_iterator iter = sites_.begin(); iter != sites_.end();
+         ++iter) {
+      sites.push_back(iter->second);
+    }
+  }
+  const int64 total = allocations();
+  if (total == 0) {
+    LOG(INFO) << "allocation check: no allocations on pipeline threads.";
+    return 0;
+  }
+  LOG(ERROR) << "allocation check: " << total << " allocations on pipeline "
+             << "threads at " << sites.size() << " call sites"
+             << (sites_dropped() ? " (more sites not kept)." : ".");
+  for (size_t i = 0; i < sites.size(); ++i) {
+    std::string stack;
+    Symbolize(sites[i], &stack);
+    LOG(ERROR) << "thread " << sites[i].thread_name << ": "
+               << sites[i].count << " allocations, " << sites[i].bytes
+               << " bytes, at:\n" << stack;
+  }
+  return total;
+}
+
+void AllocationTracker::Record(size_t size) {
+  Site site;
+  site.thread_name = t_thread_name;
+#ifdef _WIN32
+  site.num_frames = CaptureStackBackTrace(kSkippedFrames, kMaxFrames,
+                                          site.frames, NULL);
+#elif defined(__GLIBC__)
+  void* frames[kMaxFrames + kSkippedFrames];
+  const int num_frames = backtrace(frames, kMaxFrames + kSkippedFrames);
+  for (int i = kSkippedFrames; i < num_frames; ++i) {
+    site.frames[site.num_frames++] = frames[i];
+  }
+#endif
+  const uint64 hash = hash_frames(site.frames, site.num_frames) ^
+                      reinterpret_cast<uintptr_t>(site.thread_name);
+  allocations_.fetch_add(1, std::memory_order_relaxed);
+  std::lock_guard<std::mutex> lock(mutex_);
+  SiteMap::iterator iter = sites_.find(hash);
+  if (iter == sites_.end()) {
+    if (sites_.size() >= static_cast<size_t>(kMaxSites)) {
+      sites_dropped_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    iter = sites_.insert(std::make_pair(hash, site)).first;
+  }
+  ++iter->second.count;
+  iter->second.bytes += static_cast<int64>(size);
+}
+
+void AllocationTracker::Symbolize(const Site& site, std::string* ptr_stack) {
+  std::ostringstream stack;
+#ifdef _WIN32
+  static bool symbols_loaded = false;
+  const HANDLE process = GetCurrentProcess();
+  if (!symbols_loaded) {
+    SymSetOptions(SYMOPT_DEFERRED_LOADS | SYMOPT_LOAD_LINES |
+                  SYMOPT_UNDNAME);
+    symbols_loaded = SymInitialize(process, NULL, TRUE) == TRUE;
+  }
+  const int kMaxNameLength = 256;
+  std::vector<uint8> symbol_buffer(sizeof(SYMBOL_INFO) + kMaxNameLength);
+  SYMBOL_INFO* const ptr_symbol =
+      reinterpret_cast<SYMBOL_INFO*>(&symbol_buffer[0]);
+  for (int i = 0; i < site.num_frames; ++i) {
+    const DWORD64 address = reinterpret_cast<DWORD64>(site.frames[i]);
+    stack << "    #" << i << " 0x" << std::hex << address << std::dec;
+    memset(ptr_symbol, 0, symbol_buffer.size());
+    ptr_symbol->SizeOfStruct = sizeof(SYMBOL_INFO);
+    ptr_symbol->MaxNameLen = kMaxNameLength;
+    DWORD64 symbol_offset = 0;
+    if (symbols_loaded &&
+        SymFromAddr(process, address, &symbol_offset, ptr_symbol)) {
+      stack << " " << ptr_symbol->Name;
+      IMAGEHLP_LINE64 line = {0};
+      line.SizeOfStruct = sizeof(line);
+      DWORD line_offset = 0;
+      if (SymGetLineFromAddr64(process, address, &line_offset, &line)) {
+        stack << " (" << line.FileName << ":" << line.LineNumber << ")";
+      }
+    }
+    stack << "\n";
+  }
+#elif defined(__GLIBC__)
+  char** const symbols = backtrace_symbols(site.frames, site.num_frames);
+  for (int i = 0; i < site.num_frames; ++i) {
+    stack << "    #" << i << " "
+          << (symbols ? symbols[i] : "?") << "\n";
+  }
+  free(symbols);
+#else
+  stack << "    (call stacks are not supported on this platform)\n";
+#endif
+  *ptr_stack = stack.str();
+}
+
+}  // namespace webmlive
@@ -0,0 +1,117 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_ALLOCATION_TRACKER_H_
+#define WEBMLIVE_ENCODER_ALLOCATION_TRACKER_H_
+
+#include <atomic>
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+
+namespace webmlive {
+
+// Verifies that the pipeline runs without heap allocations once warmed up.
+// While armed, each operator new call made on a tracked thread is recorded
+// with its call stack, by call site. Allocations reach |OnAllocation()|
+// through the operator new replacements in allocation_hooks.cc, which the
+// encoder is built with when the WEBMLIVE_ENABLE_ALLOCATION_CHECK CMake
+// option is on, and through those of encoder_bench.
+//
+// Threads are tracked when |ThreadRegistry| registers them with a name of
+// |kPipelineThreads|: the capture, encode, mux and upload threads.
+//
+// Notes:
+// - Allocations made while recording one, and those made by C code through
+//   malloc, are not seen.
+// - At most |kMaxSites| call sites are kept; later sites are counted in
+//   |sites_dropped()| only.
+class AllocationTracker {
+ public:
+  // Frames captured per allocation, not counting the tracker's own.
+  static const int kMaxFrames = 24;
+  static const int kMaxSites = 64;
+
+  // Names of the tracked threads, without trailing digits, NULL-terminated.
+  static const char* const kPipelineThreads[];
+
+  static AllocationTracker* Instance();
+
+  // Called by the operator new replacements for each allocation of |size|
+  // bytes. Does nothing unless the tracker is armed and the calling thread
+  // is tracked.
+  static void OnAllocation(size_t size);
+
+  // Tracks the calling thread, named |name|, when |name| without trailing
+  // digits is one of |kPipelineThreads|. Called by
+  // |ThreadRegistry::Register()|.
+  static void TrackThread(const std::string& name);
+
+  // Tracks the calling thread as |name|, a string literal.
+  static void TrackCurrentThread(const char* name);
+
+  // Called once by allocation_hooks.cc when the hooks are linked in.
+  static bool SetHooksInstalled();
+
+  // Returns true when operator new calls reach |OnAllocation()|.
+  static bool hooks_installed() { return hooks_installed_; }
+
+  // Starts and stops recording. Thread safe.
+  void Arm();
+  void Disarm();
+
+  // Logs each call site that allocated while armed, with its symbolized call
+  // stack, and returns the number of allocations recorded. Call after
+  // |Disarm()|.
+  int64 LogReport();
+
+  int64 allocations() const {
+    return allocations_.load(std::memory_order_relaxed);
+  }
+  int64 sites_dropped() const {
+    return sites_dropped_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  struct Site {
+    Site() : thread_name(NULL), count(0), bytes(0), num_frames(0) {}
+    const char* thread_name;
+    int64 count;
+    int64 bytes;
+    void* frames[kMaxFrames];
+    int num_frames;
+  };
+  typedef std::map<uint64, Site> SiteMap;
+
+  AllocationTracker();
+  ~AllocationTracker();
+
+  // Records an allocation of |size| bytes on a tracked thread.
+  void Record(size_t size);
+
+  // Appends the symbolized frames of |site| to |ptr_stack|.
+  static void Symbolize(const Site& site, std::string* ptr_stack);
+
+  static bool hooks_installed_;
+
+  std::atomic<bool> armed_;
+  std::atomic<int64> allocations_;
+  std::atomic<int64> sites_dropped_;
+
+  // Call sites by hash of their frames, protected by |mutex_|.
+  SiteMap sites_;
+  std::mutex mutex_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(AllocationTracker);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_ALLOCATION_TRACKER_H_
@@ -0,0 +1,483 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/arq_sender.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#ifndef _WIN32
+#include <sys/select.h>
+#include <sys/socket.h>
+#endif
+
+#include "glog/logging.h"
+
+namespace {
+
+#ifdef _WIN32
+const SOCKET kInvalidSocket = INVALID_SOCKET;
+#else
+const int kInvalidSocket = -1;
+#endif
+
+// Largest UDP payload.
+const int kMaxPacketSize = 65507;
+
+// Size of the buffer datagrams from the receiver are read into. Longer NAK
+// lists are truncated, and the rest of the ranges are reported again.
+const int kReceiveBufferSize = 2048;
+
+// Limit of the payload bytes in flight. |Send()| waits for acknowledgements
+// or drops above it.
+const int kMaxBytesInFlight = 8 * 1024 * 1024;
+
+// Interval between handshakes while waiting for the receiver, and between
+// keepalives while idle, in milliseconds.
+const int kHandshakeInterval = 250;
+const int kKeepaliveInterval = 200;
+
+// Bounds of the retransmission timeout, and the timeout used before the
+// first round trip time sample, in milliseconds.
+const int kMinRetransmitTimeout = 20;
+const int kMaxRetransmitTimeout = 2000;
+const int kInitialRetransmitTimeout = 250;
+
+// Longest wait in |Poll()| between timer checks, in milliseconds.
+const int kTimerInterval = 10;
+
+typedef std::chrono::steady_clock Clock;
+
+int ElapsedMs(Clock::time_point since, Clock::time_point now) {
+  return static_cast<int>(
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+          now - since).count());
+}
+
+void WriteUint32(uint32 value, uint8* ptr_data) {
+  ptr_data[0] = static_cast<uint8>(value >> 24);
+  ptr_data[1] = static_cast<uint8>(value >> 16);
+  ptr_data[2] = static_cast<uint8>(value >> 8);
+  ptr_data[3] = static_cast<uint8>(value);
+}
+
+uint32 ReadUint32(const uint8* ptr_data) {
+  return (static_cast<uint32>(ptr_data[0]) << 24) |
+         (static_cast<uint32>(ptr_data[1]) << 16) |
+         (static_cast<uint32>(ptr_data[2]) << 8) |
+         static_cast<uint32>(ptr_data[3]);
+}
+
+}  // anonymous namespace
+
+namespace webmlive {
+
+ArqSender::ArqSender()
+    : socket_(kInvalidSocket),
+      open_(false),
+      bytes_in_flight_(0),
+      next_sequence_(0),
+      pending_flags_(0),
+      reliable_unit_(false),
+      send_credit_(0),
+      srtt_ms_(-1),
+      rtt_deviation_ms_(0) {
+  memset(&stats_, 0, sizeof(stats_));
+  stats_.rtt_ms = -1;
+}
+
+int ArqSender::Open(Socket socket, const ArqSenderSettings& settings) {
+  if (socket == kInvalidSocket || settings.latency < 1 ||
+      settings.max_bandwidth < 0 || settings.packet_size <= kHeaderSize ||
+      settings.packet_size > kMaxPacketSize || settings.peer_timeout < 1) {
+    LOG(ERROR) << "invalid ARQ sender settings.";
+    return kInvalidArg;
+  }
+  settings_ = settings;
+  socket_ = socket;
+  in_flight_.clear();
+  bytes_in_flight_ = 0;
+  next_sequence_ = 0;
+  pending_.clear();
+  pending_.reserve(settings_.packet_size - kHeaderSize);
+  pending_flags_ = 0;
+  reliable_unit_ = false;
+  srtt_ms_ = -1;
+  rtt_deviation_ms_ = 0;
+  stats_.rtt_ms = -1;
+  stats_.packets_in_flight = 0;
+  stats_.bytes_in_flight = 0;
+  const Clock::time_point now = Clock::now();
+  open_time_ = now;
+  last_send_time_ = now;
+  last_receive_time_ = now;
+  send_credit_ = settings_.packet_size;
+  credit_time_ = now;
+  open_ = true;
+  return kSuccess;
+}
+
+bool ArqSender::Handshake(int timeout_ms) {
+  if (!open_) {
+    return false;
+  }
+  const Clock::time_point start = Clock::now();
+  for (;;) {
+    SendControl(kPacketHandshake, next_sequence_, true,
+                static_cast<uint32>(settings_.latency));
+    const int remaining = timeout_ms - ElapsedMs(start, Clock::now());
+    if (remaining <= 0) {
+      return false;
+    }
+    fd_set read_set;
+    FD_ZERO(&read_set);
+    FD_SET(socket_, &read_set);
+    const int wait = std::min(remaining, kHandshakeInterval);
+    timeval timeout;
+    timeout.tv_sec = wait / 1000;
+    timeout.tv_usec = (wait % 1000) * 1000;
+    if (select(static_cast<int>(socket_ + 1), &read_set, NULL, NULL,
+               &timeout) <= 0) {
+      continue;
+    }
+    uint8 buffer[kReceiveBufferSize];
+    const int length = recv(socket_, reinterpret_cast<char*>(buffer),
+                            sizeof(buffer), 0);
+    if (length >= kHeaderSize && buffer[0] == kPacketHandshake) {
+      last_receive_time_ = Clock::now();
+      return true;
+    }
+  }
+}
+
+void ArqSender::Close() {
+  open_ = false;
+  socket_ = kInvalidSocket;
+  in_flight_.clear();
+  bytes_in_flight_ = 0;
+  pending_.clear();
+  stats_.packets_in_flight = 0;
+  stats_.bytes_in_flight = 0;
+}
+
+bool ArqSender::BeginUnit(bool reliable) {
+  if (!Flush()) {
+    return false;
+  }
+  pending_flags_ = kFlagUnitStart;
+  reliable_unit_ = reliable;
+  return true;
+}
+
+bool ArqSender::Send(const uint8* ptr_data, int32 length) {
+  if (!open_ || (!ptr_data && length > 0)) {
+    return false;
+  }
+  const size_t payload_size = settings_.packet_size - kHeaderSize;
+  while (length > 0) {
+    const int32 count = static_cast<int32>(
+        std::min<size_t>(payload_size - pending_.size(), length));
+    pending_.insert(pending_.end(), ptr_data, ptr_data + count);
+    ptr_data += count;
+    length -= count;
+    if (pending_.size() == payload_size && !SendPending()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ArqSender::Flush() {
+  if (!open_) {
+    return false;
+  }
+  return pending_.empty() || SendPending();
+}
+
+bool ArqSender::Poll(int timeout_ms) {
+  if (!open_) {
+    return false;
+  }
+  const Clock::time_point start = Clock::now();
+  for (;;) {
+    Receive(std::max(0, std::min(timeout_ms - ElapsedMs(start, Clock::now()),
+                                 kTimerInterval)));
+    const Clock::time_point now = Clock::now();
+    if (ElapsedMs(last_receive_time_, now) > settings_.peer_timeout) {
+      LOG(WARNING) << "no answer from the ARQ receiver for "
+                   << settings_.peer_timeout << " ms.";
+      return false;
+    }
+    DropLatePackets();
+    if (!in_flight_.empty() &&
+        ElapsedMs(in_flight_.front().last_sent, now) > RetransmitTimeout()) {
+      Retransmit(&in_flight_.front());
+    }
+    if (ElapsedMs(last_send_time_, now) > kKeepaliveInterval) {
+      SendControl(kPacketKeepalive, next_sequence_, false, 0);
+    }
+    if (ElapsedMs(start, now) >= timeout_ms) {
+      return true;
+    }
+  }
+}
+
+void ArqSender::GetStats(ArqSenderStats* ptr_stats) const {
+  if (ptr_stats) {
+    *ptr_stats = stats_;
+  }
+}
+
+bool ArqSender::SequenceBefore(uint32 a, uint32 b) {
+  return static_cast<int32>(a - b) < 0;
+}
+
+uint32 ArqSender::Timestamp() const {
+  // Wraps after 49 days; receivers compare timestamps modulo 2^32.
+  return static_cast<uint32>(
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+          Clock::now() - open_time_).count());
+}
+
+void ArqSender::WriteHeader(PacketType type, uint8 flags, uint32 sequence,
+                            uint8* ptr_packet) const {
+  ptr_packet[0] = static_cast<uint8>(type);
+  ptr_packet[1] = flags;
+  WriteUint32(sequence, ptr_packet + 2);
+  WriteUint32(Timestamp(), ptr_packet + 6);
+}
+
+bool ArqSender::SendDatagram(const uint8* ptr_data, int32 length) {
+#ifdef MSG_NOSIGNAL
+  const int kSendFlags = MSG_NOSIGNAL;
+#else
+  const int kSendFlags = 0;
+#endif
+  last_send_time_ = Clock::now();
+  return send(socket_, reinterpret_cast<const char*>(ptr_data), length,
+              kSendFlags) == length;
+}
+
+bool ArqSender::SendControl(PacketType type, uint32 sequence, bool has_value,
+                            uint32 value) {
+  uint8 packet[kHeaderSize + 4];
+  WriteHeader(type, 0, sequence, packet);
+  if (has_value) {
+    WriteUint32(value, packet + kHeaderSize);
+  }
+  return SendDatagram(packet, has_value ? kHeaderSize + 4 : kHeaderSize);
+}
+
+bool ArqSender::SendPending() {
+  const int32 payload_length = static_cast<int32>(pending_.size());
+  while (bytes_in_flight_ + payload_length > kMaxBytesInFlight) {
+    if (!Poll(kTimerInterval)) {
+      return false;
+    }
+  }
+  const int32 packet_length = kHeaderSize + payload_length;
+  if (settings_.max_bandwidth > 0) {
+    // Bytes per millisecond.
+    const double rate = settings_.max_bandwidth / 8.0;
+    RefillCredit();
+    while (send_credit_ < packet_length) {
+      const int wait = static_cast<int>((packet_length - send_credit_) / rate);
+      if (!Poll(std::max(wait, 1))) {
+        return false;
+      }
+      RefillCredit();
+    }
+    send_credit_ -= packet_length;
+  }
+
+  in_flight_.push_back(Packet());
+  Packet& packet = in_flight_.back();
+  packet.sequence = next_sequence_++;
+  packet.reliable = reliable_unit_;
+  packet.data.resize(packet_length);
+  WriteHeader(kPacketData, pending_flags_, packet.sequence, &packet.data[0]);
+  memcpy(&packet.data[kHeaderSize], &pending_[0], payload_length);
+  packet.first_sent = Clock::now();
+  packet.last_sent = packet.first_sent;
+  SendDatagram(&packet.data[0], packet_length);
+  bytes_in_flight_ += payload_length;
+  pending_.clear();
+  pending_flags_ = 0;
+
+  ++stats_.packets_sent;
+  stats_.packets_in_flight = static_cast<int32>(in_flight_.size());
+  stats_.bytes_in_flight = bytes_in_flight_;
+  return true;
+}
+
+bool ArqSender::Retransmit(Packet* ptr_packet) {
+  // The timestamp is rewritten so that the receiver's echo measures this
+  // send. Retransmissions take send credit without waiting for it.
+  ptr_packet->data[1] |= kFlagRetransmit;
+  WriteUint32(Timestamp(), &ptr_packet->data[6]);
+  ptr_packet->last_sent = Clock::now();
+  send_credit_ -= static_cast<double>(ptr_packet->data.size());
+  ++stats_.packets_retransmitted;
+  return SendDatagram(&ptr_packet->data[0],
+                      static_cast<int32>(ptr_packet->data.size()));
+}
+
+void ArqSender::RefillCredit() {
+  const Clock::time_point now = Clock::now();
+  const double elapsed_ms = std::chrono::duration<double, std::milli>(
+      now - credit_time_).count();
+  credit_time_ = now;
+  // Credit saved while idle is capped, so that bursts stay short.
+  const double max_credit = 4.0 * settings_.packet_size;
+  send_credit_ = std::min(
+      send_credit_ + elapsed_ms * settings_.max_bandwidth / 8.0, max_credit);
+}
+
+int ArqSender::RetransmitTimeout() const {
+  if (srtt_ms_ < 0) {
+    return kInitialRetransmitTimeout;
+  }
+  const int timeout = static_cast<int>(srtt_ms_ + 4 * rtt_deviation_ms_);
+  return std::max(kMinRetransmitTimeout,
+                  std::min(timeout, kMaxRetransmitTimeout));
+}
+
+void ArqSender::Receive(int timeout_ms) {
+  uint8 buffer[kReceiveBufferSize];
+  for (;;) {
+    fd_set read_set;
+    FD_ZERO(&read_set);
+    FD_SET(socket_, &read_set);
+    timeval timeout;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_usec = (timeout_ms % 1000) * 1000;
+    if (select(static_cast<int>(socket_ + 1), &read_set, NULL, NULL,
+               &timeout) <= 0) {
+      return;
+    }
+    // Errors, such as the port unreachable reports of a receiver that has
+    // not started yet, are ignored; |settings_.peer_timeout| ends the
+    // connection when the receiver does not answer.
+    const int length = recv(socket_, reinterpret_cast<char*>(buffer),
+                            sizeof(buffer), 0);
+    if (length > 0) {
+      HandlePacket(buffer, length);
+    }
+    timeout_ms = 0;
+  }
+}
+
+void ArqSender::HandlePacket(const uint8* ptr_data, int32 length) {
+  if (length < kHeaderSize) {
+    return;
+  }
+  last_receive_time_ = Clock::now();
+  const uint32 sequence = ReadUint32(ptr_data + 2);
+  const uint32 timestamp = ReadUint32(ptr_data + 6);
+  switch (ptr_data[0]) {
+    case kPacketAck:
+      HandleAck(sequence, timestamp);
+      break;
+    case kPacketNak:
+      HandleNak(ptr_data + kHeaderSize, length - kHeaderSize);
+      break;
+    default:
+      // Handshake repeats and keepalives only show that the receiver is up.
+      break;
+  }
+}
+
+void ArqSender::HandleAck(uint32 sequence, uint32 echo_timestamp) {
+  const int32 rtt = static_cast<int32>(Timestamp() - echo_timestamp);
+  if (rtt >= 0 && rtt < kMaxRetransmitTimeout * 4) {
+    if (srtt_ms_ < 0) {
+      srtt_ms_ = rtt;
+      rtt_deviation_ms_ = rtt / 2.0;
+    } else {
+      rtt_deviation_ms_ += (std::abs(srtt_ms_ - rtt) - rtt_deviation_ms_) / 4;
+      srtt_ms_ += (rtt - srtt_ms_) / 8;
+    }
+    stats_.rtt_ms = static_cast<int32>(srtt_ms_ + 0.5);
+  }
+  while (!in_flight_.empty() &&
+         SequenceBefore(in_flight_.front().sequence, sequence)) {
+    const int32 payload_length =
+        static_cast<int32>(in_flight_.front().data.size()) - kHeaderSize;
+    bytes_in_flight_ -= payload_length;
+    stats_.bytes_acked += payload_length;
+    in_flight_.pop_front();
+  }
+  stats_.packets_in_flight = static_cast<int32>(in_flight_.size());
+  stats_.bytes_in_flight = bytes_in_flight_;
+}
+
+void ArqSender::HandleNak(const uint8* ptr_ranges, int32 length) {
+  const Clock::time_point now = Clock::now();
+  // A packet already sent again within a round trip is not sent again for a
+  // repeated report.
+  const int min_interval = srtt_ms_ < 0 ? kMinRetransmitTimeout :
+      std::max(kMinRetransmitTimeout, static_cast<int>(srtt_ms_));
+  for (; length >= 8; ptr_ranges += 8, length -= 8) {
+    uint32 first = ReadUint32(ptr_ranges);
+    const uint32 last = ReadUint32(ptr_ranges + 4);
+    if (SequenceBefore(last, first) ||
+        !SequenceBefore(last, next_sequence_)) {
+      continue;
+    }
+    const uint32 oldest =
+        in_flight_.empty() ? next_sequence_ : in_flight_.front().sequence;
+    if (SequenceBefore(first, oldest)) {
+      // The packets were dropped, and the receiver missed the drop notice.
+      const uint32 dropped_last = SequenceBefore(last, oldest) ? last :
+          oldest - 1;
+      SendControl(kPacketDrop, first, true, dropped_last);
+      if (dropped_last == last) {
+        continue;
+      }
+      first = oldest;
+    }
+    for (uint32 index = first - oldest;
+         index <= last - oldest && index < in_flight_.size(); ++index) {
+      Packet& packet = in_flight_[index];
+      if (!packet.reported_lost) {
+        packet.reported_lost = true;
+        ++stats_.packets_lost;
+      }
+      if (ElapsedMs(packet.last_sent, now) >= min_interval) {
+        Retransmit(&packet);
+      }
+    }
+  }
+}
+
+void ArqSender::DropLatePackets() {
+  const Clock::time_point now = Clock::now();
+  bool dropped = false;
+  uint32 first = 0;
+  uint32 last = 0;
+  while (!in_flight_.empty() && !in_flight_.front().reliable &&
+         ElapsedMs(in_flight_.front().first_sent, now) > settings_.latency) {
+    const Packet& packet = in_flight_.front();
+    if (!dropped) {
+      first = packet.sequence;
+      dropped = true;
+    }
+    last = packet.sequence;
+    bytes_in_flight_ -= static_cast<int32>(packet.data.size()) - kHeaderSize;
+    ++stats_.packets_dropped;
+    in_flight_.pop_front();
+  }
+  if (dropped) {
+    VLOG(1) << "ARQ packets " << first << " to " << last << " dropped late.";
+    SendControl(kPacketDrop, first, true, last);
+    stats_.packets_in_flight = static_cast<int32>(in_flight_.size());
+    stats_.bytes_in_flight = bytes_in_flight_;
+  }
+}
+
+}  // namespace webmlive
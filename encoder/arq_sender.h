@@ -0,0 +1,276 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_ARQ_SENDER_H_
+#define WEBMLIVE_ENCODER_ARQ_SENDER_H_
+
+#include <chrono>
+#include <deque>
+#include <vector>
+
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+
+#ifdef _WIN32
+#include <winsock2.h>
+#endif
+
+namespace webmlive {
+
+struct ArqSenderSettings {
+  // Default time a packet may take to be delivered, in milliseconds.
+  static const int kDefaultLatency = 500;
+
+  // Default datagram size, in bytes. Leaves room for IPv6, tunnel and VPN
+  // headers within a 1500 byte MTU.
+  static const int kDefaultPacketSize = 1316;
+
+  // Default time without a packet from the receiver after which the peer is
+  // lost, in milliseconds.
+  static const int kDefaultPeerTimeout = 5000;
+
+  ArqSenderSettings()
+      : latency(kDefaultLatency),
+        max_bandwidth(0),
+        packet_size(kDefaultPacketSize),
+        peer_timeout(kDefaultPeerTimeout) {}
+
+  // Time a packet may take to be delivered, in milliseconds. It is
+  // retransmitted until then, and dropped afterwards. Should be several
+  // round trip times.
+  int latency;
+
+  // Send rate limit, in kilobits per second, retransmissions included. 0
+  // sends as fast as the socket accepts.
+  int max_bandwidth;
+
+  // Datagram size, in bytes, header included.
+  int packet_size;
+
+  // Time without a packet from the receiver after which |Poll()| and
+  // |Send()| fail, in milliseconds.
+  int peer_timeout;
+};
+
+struct ArqSenderStats {
+  // Smoothed round trip time, in milliseconds. -1 before the first sample.
+  int32 rtt_ms;
+
+  // Data packets sent for the first time, and sent again.
+  int64 packets_sent;
+  int64 packets_retransmitted;
+
+  // Sequence numbers the receiver reported missing, and packets given up on
+  // after |ArqSenderSettings::latency|.
+  int64 packets_lost;
+  int64 packets_dropped;
+
+  // Payload bytes acknowledged by the receiver.
+  int64 bytes_acked;
+
+  // Packets and payload bytes sent and not yet acknowledged.
+  int32 packets_in_flight;
+  int32 bytes_in_flight;
+};
+
+// Sends a byte stream over a connected UDP socket with automatic repeat
+// request: the receiver acknowledges the packets it has and asks for those
+// it misses, and the sender retransmits them until
+// |ArqSenderSettings::latency| has passed. Unlike TCP, a lost packet does
+// not close the send window, so throughput holds up on links with a long
+// round trip and random loss.
+//
+// Each datagram starts with a header:
+//
+//   type (1 byte) | flags (1 byte) | sequence (4 bytes) | timestamp (4 bytes)
+//
+// Integers are big endian, and timestamps are milliseconds of the sender's
+// clock since |Open()|. Packet types:
+// - |kPacketHandshake|: opens the connection at sequence 0; the payload is
+//   the latency, 4 bytes. The receiver answers with a handshake.
+// - |kPacketData|: stream bytes. |kFlagUnitStart| marks the packet that
+//   starts a unit of the stream, and |kFlagRetransmit| a packet sent again.
+// - |kPacketAck|, from the receiver: all packets before |sequence| have been
+//   received. |timestamp| echoes that of the packet acknowledged, which
+//   gives the round trip time.
+// - |kPacketNak|, from the receiver: the payload lists ranges of missing
+//   sequence numbers as pairs of first and last, 4 bytes each.
+// - |kPacketDrop|: packets |sequence| through the 4 byte payload will not be
+//   sent again. The receiver skips them and discards data up to the next
+//   unit start, so that it never delivers a partial unit.
+// - |kPacketKeepalive|: sent while idle; the receiver answers with an ack.
+//
+// Notes:
+// - Not thread safe. The socket is not owned.
+// - Packets of a unit begun with |BeginUnit(true)| are never dropped.
+class ArqSender {
+ public:
+#ifdef _WIN32
+  typedef SOCKET Socket;
+#else
+  typedef int Socket;
+#endif
+
+  enum {
+    kInvalidArg = -1,
+    kSuccess = 0,
+  };
+
+  enum PacketType {
+    kPacketHandshake = 1,
+    kPacketData = 2,
+    kPacketAck = 3,
+    kPacketNak = 4,
+    kPacketDrop = 5,
+    kPacketKeepalive = 6,
+  };
+
+  enum PacketFlags {
+    kFlagUnitStart = 1,
+    kFlagRetransmit = 2,
+  };
+
+  // Size of the packet header, in bytes.
+  static const int kHeaderSize = 10;
+
+  ArqSender();
+  ~ArqSender() {}
+
+  // Starts a connection on |socket|, a UDP socket connected to the
+  // receiver. Returns |kSuccess| upon success.
+  int Open(Socket socket, const ArqSenderSettings& settings);
+
+  // Sends a handshake, and waits up to |timeout_ms| milliseconds for the
+  // receiver's. Returns true once the receiver has answered.
+  bool Handshake(int timeout_ms);
+
+  // Ends the connection. Unacknowledged packets are discarded.
+  void Close();
+
+  // Starts a unit of the stream in a new packet. The packets of a |reliable|
+  // unit are retransmitted until acknowledged, however late. Returns false
+  // when the peer is lost.
+  bool BeginUnit(bool reliable);
+
+  // Appends |length| bytes from |ptr_data| to the stream, and sends the
+  // packets they fill. Blocks while the send window is full or the send
+  // rate is over |ArqSenderSettings::max_bandwidth|. Returns false when the
+  // peer is lost.
+  bool Send(const uint8* ptr_data, int32 length);
+
+  // Sends the packet being filled. Returns false when the peer is lost.
+  bool Flush();
+
+  // Handles packets from the receiver for up to |timeout_ms| milliseconds,
+  // retransmits and drops packets as due, and keeps the connection alive.
+  // Returns false when the peer is lost.
+  bool Poll(int timeout_ms);
+
+  // Copies current stats to |ptr_stats|. Counters accumulate over
+  // connections.
+  void GetStats(ArqSenderStats* ptr_stats) const;
+
+ private:
+  // A data packet sent and not yet acknowledged.
+  struct Packet {
+    Packet() : sequence(0), reliable(false), reported_lost(false) {}
+
+    uint32 sequence;
+    std::vector<uint8> data;
+    std::chrono::steady_clock::time_point first_sent;
+    std::chrono::steady_clock::time_point last_sent;
+    bool reliable;
+
+    // Set once a NAK has listed the packet.
+    bool reported_lost;
+  };
+
+  // Returns true when sequence number |a| comes before |b|.
+  static bool SequenceBefore(uint32 a, uint32 b);
+
+  // Returns the milliseconds since |Open()|.
+  uint32 Timestamp() const;
+
+  // Writes a header of |type| with |flags|, |sequence| and the current
+  // timestamp to |ptr_packet|.
+  void WriteHeader(PacketType type, uint8 flags, uint32 sequence,
+                   uint8* ptr_packet) const;
+
+  // Sends |length| bytes from |ptr_data| as one datagram. Returns false
+  // upon failure, which is not fatal: lost data packets are retransmitted.
+  bool SendDatagram(const uint8* ptr_data, int32 length);
+
+  // Sends a control packet of |type| with |sequence| and up to one 4 byte
+  // |value| as payload.
+  bool SendControl(PacketType type, uint32 sequence, bool has_value,
+                   uint32 value);
+
+  // Sends |pending_| as a data packet, after waiting for room in the send
+  // window and for send credit.
+  bool SendPending();
+
+  // Sends |ptr_packet| again.
+  bool Retransmit(Packet* ptr_packet);
+
+  // Refills |send_credit_| from the time elapsed at |max_bandwidth|.
+  void RefillCredit();
+
+  // Returns the time after which an unacknowledged packet is sent again, in
+  // milliseconds.
+  int RetransmitTimeout() const;
+
+  // Waits up to |timeout_ms| milliseconds for datagrams from the receiver,
+  // and handles all that have arrived.
+  void Receive(int timeout_ms);
+
+  // Handles one datagram from the receiver.
+  void HandlePacket(const uint8* ptr_data, int32 length);
+  void HandleAck(uint32 sequence, uint32 echo_timestamp);
+  void HandleNak(const uint8* ptr_ranges, int32 length);
+
+  // Drops packets older than |settings_.latency|, other than reliable
+  // ones, and tells the receiver.
+  void DropLatePackets();
+
+  ArqSenderSettings settings_;
+  Socket socket_;
+  bool open_;
+
+  // Packets sent and not yet acknowledged, by contiguous ascending sequence
+  // number, and their payload bytes.
+  std::deque<Packet> in_flight_;
+  int32 bytes_in_flight_;
+
+  // Sequence number of the next data packet.
+  uint32 next_sequence_;
+
+  // Payload of the packet being filled, its flags, and whether its unit is
+  // reliable.
+  std::vector<uint8> pending_;
+  uint8 pending_flags_;
+  bool reliable_unit_;
+
+  // Bytes that may be sent now at |settings_.max_bandwidth|, and when it was
+  // last refilled.
+  double send_credit_;
+  std::chrono::steady_clock::time_point credit_time_;
+
+  std::chrono::steady_clock::time_point open_time_;
+  std::chrono::steady_clock::time_point last_send_time_;
+  std::chrono::steady_clock::time_point last_receive_time_;
+
+  // Smoothed round trip time, and its mean deviation, in milliseconds.
+  double srtt_ms_;
+  double rtt_deviation_ms_;
+
+  ArqSenderStats stats_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(ArqSender);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_ARQ_SENDER_H_
@@ -0,0 +1,267 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/async_sink_adapter.h"
+
+#include <chrono>
+#include <new>
+
+#include "encoder/thread_util.h"
+#include "glog/logging.h"
+
+namespace webmlive {
+
+namespace {
+
+// Time the writer thread waits between |Ready()| checks, in milliseconds.
+const int kReadyPollInterval = 1;
+
+}  // namespace
+
+AsyncSinkAdapter::AsyncSinkAdapter()
+    : ptr_sink_(NULL),
+      ptr_callback_(NULL),
+      credit_(kDefaultCredit),
+      ptr_scheduler_(NULL),
+      channel_(-1),
+      in_flight_(0),
+      scheduled_run_(false),
+      write_scheduled_(false),
+      stop_(false) {
+}
+
+AsyncSinkAdapter::~AsyncSinkAdapter() {
+  Stop();
+}
+
+int AsyncSinkAdapter::Init(DataSinkInterface* ptr_sink, int credit) {
+  if (!ptr_sink || credit < 1) {
+    LOG(ERROR) << "invalid async sink adapter settings.";
+    return kInvalidArg;
+  }
+  ptr_sink_ = ptr_sink;
+  credit_ = credit;
+  return kSuccess;
+}
+
+int AsyncSinkAdapter::Init(DataSinkInterface* ptr_sink, int credit,
+                           TaskScheduler* ptr_scheduler, int channel) {
+  if (!ptr_scheduler || channel < 0) {
+    LOG(ERROR) << "invalid async sink adapter scheduler settings.";
+    return kInvalidArg;
+  }
+  const int status = Init(ptr_sink, credit);
+  if (status == kSuccess) {
+    ptr_scheduler_ = ptr_scheduler;
+    channel_ = channel;
+  }
+  return status;
+}
+
+int AsyncSinkAdapter::Run() {
+  if (!ptr_sink_ || !ptr_callback_ || writer_thread_ || scheduled_run_) {
+    LOG(ERROR) << "async sink adapter not initialized, or already running.";
+    return kRunFailed;
+  }
+  stop_ = false;
+  if (ptr_scheduler_) {
+    if (!ptr_scheduler_->running()) {
+      LOG(ERROR) << "async sink adapter task scheduler not running.";
+      return kRunFailed;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    scheduled_run_ = true;
+    return kSuccess;
+  }
+  writer_thread_.reset(
+      new (std::nothrow) std::thread(  // NOLINT
+          &AsyncSinkAdapter::WriterThread, this));
+  if (!writer_thread_) {
+    LOG(ERROR) << "cannot construct writer thread.";
+    return kRunFailed;
+  }
+  return kSuccess;
+}
+
+void AsyncSinkAdapter::Stop() {
+  if (ptr_scheduler_) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (!scheduled_run_) {
+        return;
+      }
+      stop_ = true;
+      // A scheduler that stopped has discarded the posted task, which will
+      // not clear |write_scheduled_|.
+      while (write_scheduled_ &&
+             !chunk_ready_.wait_for(
+                 lock, std::chrono::milliseconds(kReadyPollInterval),
+                 [this] { return !write_scheduled_; })) {
+        if (!ptr_scheduler_->running()) {
+          write_scheduled_ = false;
+        }
+      }
+      scheduled_run_ = false;
+    }
+    AbandonChunks();
+    return;
+  }
+  if (!writer_thread_) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  chunk_ready_.notify_all();
+  writer_thread_->join();
+  writer_thread_.reset();
+}
+
+int AsyncSinkAdapter::in_flight() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return in_flight_;
+}
+
+int AsyncSinkAdapter::SetCallback(DataSinkCallbackInterface* ptr_callback) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  ptr_callback_ = ptr_callback;
+  return credit_;
+}
+
+bool AsyncSinkAdapter::SubmitChunk(const SharedWebmChunk& chunk) {
+  if (!chunk) {
+    LOG(ERROR) << "invalid async sink chunk.";
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (stop_ || (!writer_thread_ && !scheduled_run_) ||
+      in_flight_ >= credit_) {
+    return false;
+  }
+  chunks_.push_back(chunk);
+  ++in_flight_;
+  if (scheduled_run_ && !write_scheduled_) {
+    write_scheduled_ = true;
+    PostWriteTask(0);
+    if (!write_scheduled_) {
+      chunks_.pop_back();
+      --in_flight_;
+      return false;
+    }
+  }
+  chunk_ready_.notify_one();
+  return true;
+}
+
+void AsyncSinkAdapter::WriterThread() {
+  ScopedThreadRegistration registration("async_sink");
+  VLOG(1) << "async sink writer started.";
+  for (;;) {
+    SharedWebmChunk chunk;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      chunk_ready_.wait(lock, [this] { return stop_ || !chunks_.empty(); });
+      if (stop_) {
+        break;
+      }
+      chunk = chunks_.front();
+      chunks_.pop_front();
+    }
+    const bool written = WaitForSink() && ptr_sink_->WriteChunk(chunk);
+    if (!written) {
+      LOG(ERROR) << "async sink write failed: " << chunk->id();
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      --in_flight_;
+    }
+    ptr_callback_->OnChunkComplete(chunk, written);
+  }
+
+  AbandonChunks();
+}
+
+bool AsyncSinkAdapter::WaitForSink() {
+  while (!ptr_sink_->Ready()) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (chunk_ready_.wait_for(lock,
+                              std::chrono::milliseconds(kReadyPollInterval),
+                              [this] { return stop_; })) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void AsyncSinkAdapter::WriteTask() {
+  SharedWebmChunk chunk;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stop_ || chunks_.empty()) {
+      write_scheduled_ = false;
+      chunk_ready_.notify_all();
+      return;
+    }
+  }
+  if (!ptr_sink_->Ready()) {
+    // The worker moves on to other channels' tasks instead of waiting.
+    std::lock_guard<std::mutex> lock(mutex_);
+    PostWriteTask(kReadyPollInterval);
+    return;
+  }
+  {
+    // Only this task takes chunks while it is scheduled.
+    std::lock_guard<std::mutex> lock(mutex_);
+    chunk = chunks_.front();
+    chunks_.pop_front();
+  }
+  const bool written = ptr_sink_->WriteChunk(chunk);
+  if (!written) {
+    LOG(ERROR) << "async sink write failed: " << chunk->id();
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    --in_flight_;
+  }
+  ptr_callback_->OnChunkComplete(chunk, written);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (stop_ || chunks_.empty()) {
+    write_scheduled_ = false;
+    chunk_ready_.notify_all();
+    return;
+  }
+  PostWriteTask(0);
+}
+
+void AsyncSinkAdapter::PostWriteTask(int delay_ms) {
+  const TaskScheduler::Task task = [this] { WriteTask(); };
+  if (!ptr_scheduler_->PostAfter(channel_, delay_ms, task)) {
+    LOG(ERROR) << "cannot post async sink write task.";
+    write_scheduled_ = false;
+    chunk_ready_.notify_all();
+  }
+}
+
+void AsyncSinkAdapter::AbandonChunks() {
+  // Chunks left behind are reported, so that their submitter does not wait
+  // for them.
+  std::deque<SharedWebmChunk> abandoned;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    abandoned.swap(chunks_);
+    in_flight_ = 0;
+  }
+  for (size_t i = 0; i < abandoned.size(); ++i) {
+    ptr_callback_->OnChunkComplete(abandoned[i], false);
+  }
+  VLOG(1) << "async sink writer stopped, " << abandoned.size()
+          << " chunk(s) abandoned.";
+}
+
+}  // namespace webmlive
@@ -0,0 +1,123 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_ASYNC_SINK_ADAPTER_H_
+#define WEBMLIVE_ENCODER_ASYNC_SINK_ADAPTER_H_
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "encoder/basictypes.h"
+#include "encoder/data_sink.h"
+#include "encoder/encoder_base.h"
+#include "encoder/task_scheduler.h"
+#include "encoder/webm_chunk.h"
+
+namespace webmlive {
+
+// Makes a |DataSinkInterface| asynchronous: submitted chunks are written to
+// the wrapped sink by a writer thread, which waits for |Ready()| and reports
+// each write through |DataSinkCallbackInterface::OnChunkComplete()|. The
+// polling of |Ready()| moves from the submitter to the writer thread.
+//
+// Notes:
+// - |Init| must be called before any other method, and |Run| starts the
+//   writer thread.
+// - Chunks are written in submission order, one at a time.
+// - The wrapped sink is called from the writer thread only, apart from what
+//   its owner calls directly.
+// - An adapter initialized with a |TaskScheduler| has no thread of its own:
+//   each write runs as a task of its channel, and the scheduler's workers
+//   poll |Ready()| by reposting the task after |kReadyPollInterval|.
+class AsyncSinkAdapter : public AsyncDataSinkInterface {
+ public:
+  // Default number of chunks submitted and not yet complete.
+  static const int kDefaultCredit = 4;
+
+  enum {
+    kRunFailed = -2,
+    kInvalidArg = -1,
+    kSuccess = 0,
+  };
+
+  AsyncSinkAdapter();
+  virtual ~AsyncSinkAdapter();
+
+  // Wraps |ptr_sink|, which is not owned and must outlive the adapter, with
+  // |credit| chunks in flight at most. Returns |kSuccess| upon success.
+  int Init(DataSinkInterface* ptr_sink, int credit);
+
+  // Wraps |ptr_sink| as above, writing with tasks posted to |channel| of
+  // |ptr_scheduler|, which is not owned and must outlive the adapter.
+  int Init(DataSinkInterface* ptr_sink, int credit,
+           TaskScheduler* ptr_scheduler, int channel);
+
+  // Starts the writer thread, or the posting of write tasks.
+  int Run();
+
+  // Stops the writer thread after the write in progress, if any. Chunks not
+  // yet written complete with |success| false.
+  void Stop();
+
+  // Returns the number of chunks submitted and not yet complete.
+  int in_flight() const;
+
+  // AsyncDataSinkInterface methods.
+  virtual int SetCallback(DataSinkCallbackInterface* ptr_callback);
+  virtual bool SubmitChunk(const SharedWebmChunk& chunk);
+
+ private:
+  // Writer thread function.
+  void WriterThread();
+
+  // Waits for |ptr_sink_| to be ready. Returns false when stopped first.
+  bool WaitForSink();
+
+  // Write task of scheduler mode: writes the next chunk when |ptr_sink_| is
+  // ready, and reposts itself while chunks wait.
+  void WriteTask();
+
+  // Posts |WriteTask()|, after |delay_ms| milliseconds when positive. Clears
+  // |write_scheduled_| when the scheduler refuses it. Must be called with
+  // |mutex_| held.
+  void PostWriteTask(int delay_ms);
+
+  // Completes the chunks not yet written with |success| false.
+  void AbandonChunks();
+
+  DataSinkInterface* ptr_sink_;
+  DataSinkCallbackInterface* ptr_callback_;
+  int credit_;
+  std::unique_ptr<std::thread> writer_thread_;
+
+  // Scheduler and channel of scheduler mode, NULL and -1 otherwise.
+  TaskScheduler* ptr_scheduler_;
+  int channel_;
+
+  // Chunks waiting for the writer thread, and the number submitted and not
+  // yet complete, which includes the chunk being written. Protected by
+  // |mutex_|.
+  std::deque<SharedWebmChunk> chunks_;
+  int in_flight_;
+
+  // Scheduler mode: true between |Run()| and |Stop()|, and while a write
+  // task is posted or running. Protected by |mutex_|.
+  bool scheduled_run_;
+  bool write_scheduled_;
+
+  bool stop_;
+  mutable std::mutex mutex_;
+  std::condition_variable chunk_ready_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(AsyncSinkAdapter);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_ASYNC_SINK_ADAPTER_H_
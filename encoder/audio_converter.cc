@@ -0,0 +1,514 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/audio_converter.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "encoder/pcm_deinterleave.h"
+#include "glog/logging.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || \
+    defined(__i386__)
+#define WEBMLIVE_HAVE_X86 1
+#include <emmintrin.h>
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(_M_ARM64)
+#define WEBMLIVE_HAVE_NEON 1
+#include <arm_neon.h>
+#endif
+
+// See pcm_deinterleave.cc.
+#if defined(WEBMLIVE_HAVE_X86) && !defined(_MSC_VER)
+#define WEBMLIVE_TARGET(isa) __attribute__((target(isa)))
+#else
+#define WEBMLIVE_TARGET(isa)
+#endif
+
+namespace {
+
+using webmlive::AudioConverter;
+
+const double kPi = 3.14159265358979323846;
+
+// Filter taps per phase when the output rate is not lower than the input
+// rate. Downsampling scales the length by the rate ratio, which keeps the
+// transition band the same width relative to the output rate.
+const int kBaseTaps = 64;
+
+// Cutoff frequency as a fraction of the lower Nyquist frequency, and the
+// Kaiser window shape. Together they give about 80 dB of stopband rejection
+// from the lower Nyquist frequency, and a passband above 20 kHz at 48 kHz.
+const double kCutoff = 0.92;
+const double kKaiserBeta = 8.0;
+
+// Limits on the resampling ratio, and on the filter phases of a ratio.
+const int kMaxRateRatio = 8;
+const int kMaxPhases = 1024;
+
+// Vorbis index of each WAVE ordered channel, by channel count.
+const int kVorbisChannelIndex[AudioConverter::kMaxChannels]
+                             [AudioConverter::kMaxChannels] = {
+  {0},
+  {0, 1},
+  {0, 2, 1},
+  {0, 1, 2, 3},
+  {0, 2, 1, 3, 4},
+  {0, 2, 1, 5, 3, 4},
+  {0, 2, 1, 6, 5, 3, 4},
+  {0, 2, 1, 7, 5, 6, 3, 4},
+};
+
+// Default WAVE channel masks, by channel count: mono, stereo, 3.0, quad, 5.0,
+// 5.1, 6.1 and 7.1.
+const uint32 kDefaultChannelMasks[AudioConverter::kMaxChannels] = {
+  0x4, 0x3, 0x7, 0x33, 0x37, 0x3f, 0x70f, 0x63f,
+};
+
+// Left and right gains of each WAVE speaker position, by bit of the channel
+// mask. Center speakers go to both sides at -3 dB, surround speakers to their
+// side at -3 dB, and the LFE is dropped.
+const float kMinus3dB = 0.7071068f;
+const float kSpeakerGains[][2] = {
+  {1.0f, 0.0f},              // Front left.
+  {0.0f, 1.0f},              // Front right.
+  {kMinus3dB, kMinus3dB},    // Front center.
+  {0.0f, 0.0f},              // LFE.
+  {kMinus3dB, 0.0f},         // Back left.
+  {0.0f, kMinus3dB},         // Back right.
+  {1.0f, 0.0f},              // Front left of center.
+  {0.0f, 1.0f},              // Front right of center.
+  {0.5f, 0.5f},              // Back center.
+  {kMinus3dB, 0.0f},         // Side left.
+  {0.0f, kMinus3dB},         // Side right.
+  {0.5f, 0.5f},              // Top center.
+  {kMinus3dB, 0.0f},         // Top front left.
+  {0.5f, 0.5f},              // Top front center.
+  {0.0f, kMinus3dB},         // Top front right.
+  {kMinus3dB, 0.0f},         // Top back left.
+  {0.5f, 0.5f},              // Top back center.
+  {0.0f, kMinus3dB},         // Top back right.
+};
+const int kNumSpeakerPositions =
+    sizeof(kSpeakerGains) / sizeof(kSpeakerGains[0]);
+
+int Gcd(int a, int b) {
+  while (b) {
+    const int remainder = a % b;
+    a = b;
+    b = remainder;
+  }
+  return a;
+}
+
+int CountChannels(uint32 channel_mask) {
+  int channels = 0;
+  for (; channel_mask; channel_mask &= channel_mask - 1) {
+    ++channels;
+  }
+  return channels;
+}
+
+double Sinc(double x) {
+  return x == 0.0 ? 1.0 : std::sin(kPi * x) / (kPi * x);
+}
+
+// Zeroth order modified Bessel function of the first kind, for the Kaiser
+// window.
+double BesselI0(double x) {
+  double sum = 1.0;
+  double term = 1.0;
+  for (int k = 1; term > sum * 1e-12; ++k) {
+    const double factor = x / (2.0 * k);
+    term *= factor * factor;
+    sum += term;
+  }
+  return sum;
+}
+
+//
+// Scalar kernels. Also used for the samples remaining after a SIMD loop.
+//
+
+void MixPlaneC(const float* ptr_input, float gain, int num_samples,
+               float* ptr_output) {
+  for (int i = 0; i < num_samples; ++i) {
+    ptr_output[i] += gain * ptr_input[i];
+  }
+}
+
+float DotProductC(const float* ptr_a, const float* ptr_b, int length) {
+  float sum = 0.0f;
+  for (int i = 0; i < length; ++i) {
+    sum += ptr_a[i] * ptr_b[i];
+  }
+  return sum;
+}
+
+#if defined(WEBMLIVE_HAVE_X86)
+
+WEBMLIVE_TARGET("sse2")
+void MixPlaneSse2(const float* ptr_input, float gain, int num_samples,
+                  float* ptr_output) {
+  const __m128 gains = _mm_set1_ps(gain);
+  int i = 0;
+  for (; i + 4 <= num_samples; i += 4) {
+    const __m128 input = _mm_loadu_ps(ptr_input + i);
+    const __m128 output = _mm_loadu_ps(ptr_output + i);
+    _mm_storeu_ps(ptr_output + i, _mm_add_ps(output, _mm_mul_ps(input, gains)));
+  }
+  MixPlaneC(ptr_input + i, gain, num_samples - i, ptr_output + i);
+}
+
+// Two accumulators hide the latency of the additions.
+WEBMLIVE_TARGET("sse2")
+float DotProductSse2(const float* ptr_a, const float* ptr_b, int length) {
+  __m128 sum0 = _mm_setzero_ps();
+  __m128 sum1 = _mm_setzero_ps();
+  int i = 0;
+  for (; i + 8 <= length; i += 8) {
+    sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(ptr_a + i),
+                                       _mm_loadu_ps(ptr_b + i)));
+    sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(ptr_a + i + 4),
+                                       _mm_loadu_ps(ptr_b + i + 4)));
+  }
+  __m128 sum = _mm_add_ps(sum0, sum1);
+  sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+  sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+  return _mm_cvtss_f32(sum) + DotProductC(ptr_a + i, ptr_b + i, length - i);
+}
+
+WEBMLIVE_TARGET("avx2")
+float DotProductAvx2(const float* ptr_a, const float* ptr_b, int length) {
+  __m256 sum0 = _mm256_setzero_ps();
+  __m256 sum1 = _mm256_setzero_ps();
+  int i = 0;
+  for (; i + 16 <= length; i += 16) {
+    sum0 = _mm256_add_ps(sum0, _mm256_mul_ps(_mm256_loadu_ps(ptr_a + i),
+                                             _mm256_loadu_ps(ptr_b + i)));
+    sum1 = _mm256_add_ps(sum1, _mm256_mul_ps(_mm256_loadu_ps(ptr_a + i + 8),
+                                             _mm256_loadu_ps(ptr_b + i + 8)));
+  }
+  const __m256 sum256 = _mm256_add_ps(sum0, sum1);
+  __m128 sum = _mm_add_ps(_mm256_castps256_ps128(sum256),
+                          _mm256_extractf128_ps(sum256, 1));
+  sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+  sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+  return _mm_cvtss_f32(sum) + DotProductC(ptr_a + i, ptr_b + i, length - i);
+}
+
+#elif defined(WEBMLIVE_HAVE_NEON)
+
+void MixPlaneNeon(const float* ptr_input, float gain, int num_samples,
+                  float* ptr_output) {
+  int i = 0;
+  for (; i + 4 <= num_samples; i += 4) {
+    vst1q_f32(ptr_output + i, vmlaq_n_f32(vld1q_f32(ptr_output + i),
+                                          vld1q_f32(ptr_input + i), gain));
+  }
+  MixPlaneC(ptr_input + i, gain, num_samples - i, ptr_output + i);
+}
+
+float DotProductNeon(const float* ptr_a, const float* ptr_b, int length) {
+  float32x4_t sum0 = vdupq_n_f32(0.0f);
+  float32x4_t sum1 = vdupq_n_f32(0.0f);
+  int i = 0;
+  for (; i + 8 <= length; i += 8) {
+    sum0 = vmlaq_f32(sum0, vld1q_f32(ptr_a + i), vld1q_f32(ptr_b + i));
+    sum1 = vmlaq_f32(sum1, vld1q_f32(ptr_a + i + 4), vld1q_f32(ptr_b + i + 4));
+  }
+  const float32x4_t sum = vaddq_f32(sum0, sum1);
+  float32x2_t half = vadd_f32(vget_low_f32(sum), vget_high_f32(sum));
+  half = vpadd_f32(half, half);
+  return vget_lane_f32(half, 0) +
+         DotProductC(ptr_a + i, ptr_b + i, length - i);
+}
+
+#endif  // WEBMLIVE_HAVE_X86
+
+}  // anonymous namespace
+
+namespace webmlive {
+
+const int AudioConverter::kMaxChannels;
+
+MixPlaneFunc SelectMixPlane(int cpu_features) {
+#if defined(WEBMLIVE_HAVE_X86)
+  if (cpu_features & kCpuFeatureSse2) return &MixPlaneSse2;
+#elif defined(WEBMLIVE_HAVE_NEON)
+  if (cpu_features & kCpuFeatureNeon) return &MixPlaneNeon;
+#endif
+  return &MixPlaneC;
+}
+
+DotProductFunc SelectDotProduct(int cpu_features) {
+#if defined(WEBMLIVE_HAVE_X86)
+  if (cpu_features & kCpuFeatureAvx2) return &DotProductAvx2;
+  if (cpu_features & kCpuFeatureSse2) return &DotProductSse2;
+#elif defined(WEBMLIVE_HAVE_NEON)
+  if (cpu_features & kCpuFeatureNeon) return &DotProductNeon;
+#endif
+  return &DotProductC;
+}
+
+int VorbisChannelIndex(int channels, int channel) {
+  if (channels < 1 || channels > AudioConverter::kMaxChannels ||
+      channel < 0 || channel >= channels) {
+    return channel;
+  }
+  return kVorbisChannelIndex[channels - 1][channel];
+}
+
+AudioConverter::AudioConverter()
+    : mix_plane_(SelectMixPlane(GetCpuFeatures())),
+      dot_product_(SelectDotProduct(GetCpuFeatures())),
+      input_channels_(0),
+      output_channels_(0),
+      identity_mix_(true),
+      resample_(false),
+      phases_(1),
+      step_(1),
+      taps_(0),
+      phase_(0),
+      history_length_(0),
+      work_length_(0) {
+  memset(gains_, 0, sizeof(gains_));
+  memset(input_planes_, 0, sizeof(input_planes_));
+}
+
+int AudioConverter::Init(int input_channels, int input_rate,
+                         uint32 channel_mask, int output_channels,
+                         int output_rate) {
+  if (input_channels < 1 || input_channels > kMaxChannels ||
+      output_channels < 1 || output_channels > kMaxChannels ||
+      input_rate <= 0 || output_rate <= 0) {
+    LOG(ERROR) << "invalid audio conversion " << input_channels << "x"
+               << input_rate << " to " << output_channels << "x"
+               << output_rate;
+    return kInvalidArg;
+  }
+  identity_mix_ = input_channels == output_channels;
+  if (!identity_mix_ && output_channels > 2) {
+    LOG(ERROR) << "cannot remix " << input_channels << " channels to "
+               << output_channels;
+    return kUnsupportedFormat;
+  }
+  if (input_rate > output_rate * kMaxRateRatio ||
+      output_rate > input_rate * kMaxRateRatio) {
+    LOG(ERROR) << "cannot resample " << input_rate << " Hz to "
+               << output_rate << " Hz, the ratio is too large.";
+    return kUnsupportedFormat;
+  }
+  const int divisor = Gcd(input_rate, output_rate);
+  phases_ = output_rate / divisor;
+  step_ = input_rate / divisor;
+  if (phases_ > kMaxPhases) {
+    LOG(ERROR) << "cannot resample " << input_rate << " Hz to "
+               << output_rate << " Hz, " << phases_ << " filter phases.";
+    return kUnsupportedFormat;
+  }
+  input_channels_ = input_channels;
+  output_channels_ = output_channels;
+  resample_ = phases_ != step_;
+  if (!identity_mix_) {
+    InitDownmix(channel_mask);
+  }
+  phase_ = 0;
+  history_length_ = 0;
+  work_length_ = 0;
+  if (resample_) {
+    InitFilter(input_rate, output_rate);
+
+    // Silence for the first output sample to be centered on the first input
+    // sample.
+    history_length_ = taps_ / 2 - 1;
+    for (int c = 0; c < output_channels_; ++c) {
+      work_[c].assign(history_length_, 0.0f);
+    }
+  }
+  LOG(INFO) << "AudioConverter " << input_channels_ << "x" << input_rate
+            << " to " << output_channels_ << "x" << output_rate
+            << " phases=" << phases_ << " taps=" << taps_;
+  return kSuccess;
+}
+
+float* const* AudioConverter::InputPlanes(int num_samples) {
+  const size_t length = std::max(num_samples, 1);
+  const size_t work_length = history_length_ + length;
+  for (int c = 0; c < input_channels_; ++c) {
+    if (resample_ && identity_mix_) {
+      // Input goes straight into the resampler.
+      if (work_[c].size() < work_length) {
+        work_[c].resize(work_length);
+      }
+      input_planes_[c] = &work_[c][history_length_];
+    } else {
+      if (input_[c].size() < length) {
+        input_[c].resize(length);
+      }
+      input_planes_[c] = &input_[c][0];
+    }
+  }
+  if (resample_ && !identity_mix_) {
+    for (int c = 0; c < output_channels_; ++c) {
+      if (work_[c].size() < work_length) {
+        work_[c].resize(work_length);
+      }
+    }
+  }
+  return input_planes_;
+}
+
+int AudioConverter::MaxOutputSamples(int num_samples) const {
+  if (!resample_) {
+    return num_samples;
+  }
+  const int64 available = history_length_ + num_samples;
+  return static_cast<int>(available * phases_ / step_) + 1;
+}
+
+int AudioConverter::Convert(int num_samples, float* const* ptr_output) {
+  if (num_samples < 1) {
+    return 0;
+  }
+  if (!resample_) {
+    for (int c = 0; c < output_channels_; ++c) {
+      MixChannel(c, num_samples,
+                 ptr_output[VorbisChannelIndex(output_channels_, c)]);
+    }
+    return num_samples;
+  }
+  if (!identity_mix_) {
+    for (int c = 0; c < output_channels_; ++c) {
+      MixChannel(c, num_samples, &work_[c][history_length_]);
+    }
+  }
+  work_length_ = history_length_ + num_samples;
+  return Resample(ptr_output);
+}
+
+void AudioConverter::InitDownmix(uint32 channel_mask) {
+  if (CountChannels(channel_mask) != input_channels_) {
+    channel_mask = kDefaultChannelMasks[input_channels_ - 1];
+  }
+  memset(gains_, 0, sizeof(gains_));
+  int channel = 0;
+  for (int bit = 0; bit < 32 && channel < input_channels_; ++bit) {
+    if (!(channel_mask & (1u << bit))) {
+      continue;
+    }
+    // Positions beyond the table are treated as centered.
+    const float left = bit < kNumSpeakerPositions ? kSpeakerGains[bit][0] :
+                                                    0.5f;
+    const float right = bit < kNumSpeakerPositions ? kSpeakerGains[bit][1] :
+                                                     0.5f;
+    if (output_channels_ == 1) {
+      gains_[0][channel] = left + right;
+    } else {
+      gains_[0][channel] = left;
+      gains_[1][channel] = right;
+    }
+    ++channel;
+  }
+
+  // Normalize each output to unity gain, so that a full scale signal on
+  // every input channel cannot clip.
+  for (int out = 0; out < output_channels_; ++out) {
+    float sum = 0.0f;
+    for (int c = 0; c < input_channels_; ++c) {
+      sum += gains_[out][c];
+    }
+    for (int c = 0; sum > 0.0f && c < input_channels_; ++c) {
+      gains_[out][c] /= sum;
+    }
+  }
+}
+
+// Output samples fall between input samples: the phase of an output sample
+// is its offset from the preceding input sample, in 1 / |phases_| input
+// samples. Each phase's filter is the windowed sinc centered on that offset,
+// with its taps on the |taps_| input samples around it.
+void AudioConverter::InitFilter(int input_rate, int output_rate) {
+  const double ratio =
+      std::min(1.0, static_cast<double>(output_rate) / input_rate);
+  taps_ = static_cast<int>(std::ceil(kBaseTaps / ratio));
+  taps_ = (taps_ + 7) & ~7;
+  filter_.resize(static_cast<size_t>(taps_) * phases_);
+  const double half_length = taps_ / 2;
+  const double cutoff = ratio * kCutoff;
+  const double window_scale = 1.0 / BesselI0(kKaiserBeta);
+  for (int phase = 0; phase < phases_; ++phase) {
+    float* const ptr_coefficients = &filter_[phase * taps_];
+    double sum = 0.0;
+    for (int tap = 0; tap < taps_; ++tap) {
+      // Distance from the output sample to the tap, in input samples.
+      const double distance =
+          tap - (half_length - 1) - static_cast<double>(phase) / phases_;
+      const double position = distance / half_length;
+      const double window =
+          BesselI0(kKaiserBeta *
+                   std::sqrt(std::max(0.0, 1.0 - position * position))) *
+          window_scale;
+      const double coefficient = cutoff * Sinc(cutoff * distance) * window;
+      ptr_coefficients[tap] = static_cast<float>(coefficient);
+      sum += coefficient;
+    }
+
+    // Unity DC gain for every phase.
+    for (int tap = 0; tap < taps_; ++tap) {
+      ptr_coefficients[tap] = static_cast<float>(ptr_coefficients[tap] / sum);
+    }
+  }
+}
+
+void AudioConverter::MixChannel(int channel, int num_samples,
+                                float* ptr_output) {
+  if (identity_mix_) {
+    memcpy(ptr_output, &input_[channel][0], num_samples * sizeof(float));
+    return;
+  }
+  memset(ptr_output, 0, num_samples * sizeof(float));
+  for (int c = 0; c < input_channels_; ++c) {
+    const float gain = gains_[channel][c];
+    if (gain != 0.0f) {
+      mix_plane_(&input_[c][0], gain, num_samples, ptr_output);
+    }
+  }
+}
+
+int AudioConverter::Resample(float* const* ptr_output) {
+  float* planes[kMaxChannels];
+  for (int c = 0; c < output_channels_; ++c) {
+    planes[c] = ptr_output[VorbisChannelIndex(output_channels_, c)];
+  }
+  int position = 0;
+  int num_output = 0;
+  while (position + taps_ <= work_length_) {
+    const float* const ptr_coefficients = &filter_[phase_ * taps_];
+    for (int c = 0; c < output_channels_; ++c) {
+      planes[c][num_output] =
+          dot_product_(ptr_coefficients, &work_[c][position], taps_);
+    }
+    ++num_output;
+    phase_ += step_;
+    position += phase_ / phases_;
+    phase_ %= phases_;
+  }
+
+  // Keep the input the next output samples need.
+  history_length_ = work_length_ - position;
+  for (int c = 0; c < output_channels_; ++c) {
+    memmove(&work_[c][0], &work_[c][position],
+            history_length_ * sizeof(float));
+  }
+  work_length_ = history_length_;
+  return num_output;
+}
+
+}  // namespace webmlive
@@ -0,0 +1,139 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_AUDIO_CONVERTER_H_
+#define WEBMLIVE_ENCODER_AUDIO_CONVERTER_H_
+
+#include <vector>
+
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+
+namespace webmlive {
+
+// Adds |gain| times the |num_samples| samples at |ptr_input| to the samples at
+// |ptr_output|.
+typedef void (*MixPlaneFunc)(const float* ptr_input, float gain,
+                             int num_samples, float* ptr_output);
+
+// Returns the dot product of the |length| samples at |ptr_a| and |ptr_b|.
+typedef float (*DotProductFunc)(const float* ptr_a, const float* ptr_b,
+                                int length);
+
+// Return the fastest kernels on a CPU supporting |cpu_features|, a mask of
+// |CpuFeature| values.
+MixPlaneFunc SelectMixPlane(int cpu_features);
+DotProductFunc SelectDotProduct(int cpu_features);
+
+// Returns the index Vorbis gives channel |channel| of |channels| channel
+// audio in WAVE order. WAVE orders channels by speaker position: left, right,
+// center, LFE, then the surround channels. Vorbis puts the center between
+// left and right, and the LFE last.
+int VorbisChannelIndex(int channels, int channel);
+
+// Converts deinterleaved float audio to another sample rate and channel
+// layout, writing the output channels in Vorbis order. Channels are remixed
+// first: to the same layout, or down to (or up from) mono and stereo with
+// ITU style gains for the center and surround speakers. LFE channels are
+// dropped by a downmix. The remixed channels are then resampled by a
+// polyphase FIR filter: a Kaiser windowed sinc with a cutoff just below the
+// lower of the two Nyquist frequencies, stored as one filter per output
+// phase. The filter input starts with half a filter of silence, so output
+// sample times match the input's.
+class AudioConverter {
+ public:
+  enum {
+    kUnsupportedFormat = -3,
+    kNoMemory = -2,
+    kInvalidArg = -1,
+    kSuccess = 0,
+  };
+
+  // Largest channel count with a defined Vorbis channel order.
+  static const int kMaxChannels = 8;
+
+  AudioConverter();
+  ~AudioConverter() {}
+
+  // Sets up conversion of |input_channels| channels of |input_rate| audio to
+  // |output_channels| channels of |output_rate| audio. |channel_mask| holds
+  // the WAVE speaker positions of the input channels; 0 selects the default
+  // layout for |input_channels|. Returns |kSuccess|, or |kUnsupportedFormat|
+  // when the channel counts cannot be converted (only remapping and mono or
+  // stereo output are supported), or when the rates are more than a factor
+  // of eight apart or have no ratio of small integers.
+  int Init(int input_channels, int input_rate, uint32 channel_mask,
+           int output_channels, int output_rate);
+
+  // Returns the planes that receive the next |num_samples| input samples of
+  // each channel. The planes are valid until the next |Convert()| call.
+  float* const* InputPlanes(int num_samples);
+
+  // Returns the most output samples |Convert()| can produce from
+  // |num_samples| input samples.
+  int MaxOutputSamples(int num_samples) const;
+
+  // Converts the |num_samples| samples written to |InputPlanes()|, and
+  // stores the output in the Vorbis ordered planes of |ptr_output|, which
+  // must hold |MaxOutputSamples()| samples each. Returns the number of
+  // samples written. Input the filter still needs is kept for the next call.
+  int Convert(int num_samples, float* const* ptr_output);
+
+  int input_channels() const { return input_channels_; }
+  int output_channels() const { return output_channels_; }
+
+ private:
+  // Sets |gains_| for a remix to mono or stereo.
+  void InitDownmix(uint32 channel_mask);
+
+  // Builds |filter_| for upsampling by |phases_| and downsampling by |step_|.
+  void InitFilter(int input_rate, int output_rate);
+
+  // Mixes |num_samples| samples of |input_| into output channel |channel| at
+  // |ptr_output|.
+  void MixChannel(int channel, int num_samples, float* ptr_output);
+
+  // Resamples |work_| into |ptr_output|. Returns the number of samples
+  // written.
+  int Resample(float* const* ptr_output);
+
+  MixPlaneFunc mix_plane_;
+  DotProductFunc dot_product_;
+  int input_channels_;
+  int output_channels_;
+
+  // Output channels are copies of the input channels; no remix is needed.
+  bool identity_mix_;
+  bool resample_;
+
+  // Remix gains of each input channel, by output channel.
+  float gains_[2][kMaxChannels];
+
+  // Resampling ratio |phases_| / |step_|, in lowest terms.
+  int phases_;
+  int step_;
+
+  // Polyphase filter: |taps_| coefficients per phase, in input order.
+  int taps_;
+  std::vector<float> filter_;
+
+  // Phase of the next output sample.
+  int phase_;
+
+  // Input planes of a remix, and the remixed planes awaiting resampling.
+  // |history_length_| samples of each |work_| plane are kept between calls.
+  std::vector<float> input_[kMaxChannels];
+  std::vector<float> work_[kMaxChannels];
+  float* input_planes_[kMaxChannels];
+  int history_length_;
+  int work_length_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(AudioConverter);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_AUDIO_CONVERTER_H_
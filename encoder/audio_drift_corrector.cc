@@ -0,0 +1,217 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/audio_drift_corrector.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "glog/logging.h"
+
+namespace webmlive {
+
+namespace {
+
+// Frames of silence that precede the first input, so that the first output
+// frame has the neighbors the interpolation reads.
+const int kLeadingFrames = 1;
+
+const float kInt16Scale = 32768.0f;
+
+// Returns the 4 point cubic Hermite interpolation at |t|, in [0, 1), between
+// |x0| and |x1|, with |xm1| and |x2| their outer neighbors.
+float Interpolate(float xm1, float x0, float x1, float x2, float t) {
+  const float c1 = 0.5f * (x1 - xm1);
+  const float c2 = xm1 - 2.5f * x0 + 2.0f * x1 - 0.5f * x2;
+  const float c3 = 0.5f * (x2 - xm1) + 1.5f * (x0 - x1);
+  return ((c3 * t + c2) * t + c1) * t + x0;
+}
+
+}  // namespace
+
+AudioDriftCorrector::AudioDriftCorrector()
+    : float_samples_(false),
+      channels_(0),
+      block_align_(0),
+      sample_rate_(0),
+      max_deviation_(0),
+      resync_threshold_(0),
+      started_(false),
+      anchor_ms_(0),
+      samples_in_(0),
+      samples_out_(0),
+      resyncs_(0),
+      drift_ms_(0),
+      rate_correction_(0),
+      ratio_(1.0),
+      position_(0) {}
+
+int AudioDriftCorrector::Init(const AudioConfig& config,
+                              const AudioDriftSettings& settings) {
+  if (settings.max_ppm <= 0 || settings.max_ppm > 10000 ||
+      settings.resync_threshold <= 0) {
+    LOG(ERROR) << "invalid audio drift settings.";
+    return kInvalidArg;
+  }
+  const bool pcm16 =
+      config.format_tag == kAudioFormatPcm && config.bits_per_sample == 16;
+  const bool pcm_float =
+      config.format_tag == kAudioFormatIeeeFloat &&
+      config.bits_per_sample == 32;
+  if ((!pcm16 && !pcm_float) || config.channels < 1 ||
+      config.sample_rate == 0 ||
+      config.block_align != config.channels * config.bits_per_sample / 8) {
+    LOG(ERROR) << "cannot correct drift of audio format "
+               << config.format_tag << ", " << config.bits_per_sample
+               << " bits.";
+    return kUnsupportedFormat;
+  }
+  float_samples_ = pcm_float;
+  channels_ = config.channels;
+  block_align_ = config.block_align;
+  sample_rate_ = static_cast<int>(config.sample_rate);
+  max_deviation_ = settings.max_ppm / 1000000.0;
+  resync_threshold_ = settings.resync_threshold;
+  started_ = false;
+  samples_in_ = samples_out_ = resyncs_ = 0;
+  drift_ms_ = 0;
+  rate_correction_ = 0;
+  ratio_ = 1.0;
+  work_.assign(kLeadingFrames * channels_, 0.0f);
+  position_ = kLeadingFrames;
+  std::lock_guard<std::mutex> lock(mutex_);
+  stats_ = AudioDriftStats();
+  return kSuccess;
+}
+
+int AudioDriftCorrector::Correct(const PcmSpan& input, PcmSpan* ptr_output) {
+  if (!ptr_output || !input.ptr_data || input.length < 0 || channels_ == 0) {
+    return kInvalidArg;
+  }
+  const int num_frames = input.length / block_align_;
+  UpdateDrift(input.timestamp, num_frames);
+  AppendInput(input.ptr_data, num_frames);
+  const int output_frames = Resample();
+  samples_in_ += num_frames;
+  samples_out_ += output_frames;
+
+  ptr_output->ptr_data = output_.empty() ? NULL : &output_[0];
+  ptr_output->length = output_frames * block_align_;
+  ptr_output->timestamp = input.timestamp;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  stats_.drift_ms = drift_ms_;
+  stats_.correction_ppm = (ratio_ - 1.0) * 1000000.0;
+  stats_.samples_in = samples_in_;
+  stats_.samples_out = samples_out_;
+  stats_.resyncs = resyncs_;
+  return kSuccess;
+}
+
+void AudioDriftCorrector::GetStats(AudioDriftStats* ptr_stats) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  *ptr_stats = stats_;
+}
+
+void AudioDriftCorrector::UpdateDrift(int64 timestamp, int num_frames) {
+  if (!started_) {
+    started_ = true;
+    anchor_ms_ = static_cast<double>(timestamp);
+    return;
+  }
+
+  // The first frame of the input follows the frames produced, and the
+  // input frames still waiting in |work_|, which are produced at |ratio_|.
+  const double pending_frames =
+      static_cast<double>(work_.size() / channels_) - position_;
+  const double output_ms = anchor_ms_ +
+      (samples_out_ + pending_frames * ratio_) * 1000.0 / sample_rate_;
+  const double drift_ms = output_ms - timestamp;
+  if (std::fabs(drift_ms) > resync_threshold_) {
+    LOG(WARNING) << "audio drift of " << drift_ms << " ms, resyncing.";
+    anchor_ms_ -= drift_ms;
+    drift_ms_ = 0;
+    ++resyncs_;
+    return;
+  }
+
+  // Inputs move the estimate by their share of the smoothing window.
+  const double input_ms = num_frames * 1000.0 / sample_rate_;
+  const double weight = std::min(input_ms / kSmoothingMs, 1.0);
+  drift_ms_ += weight * (drift_ms - drift_ms_);
+
+  // The integral term learns the clock rate difference, so that a steady
+  // drift is corrected to 0 rather than to the drift the proportional term
+  // needs.
+  rate_correction_ -= drift_ms_ * input_ms / kCorrectionMs / kIntegralMs;
+  rate_correction_ = std::max(-max_deviation_,
+                              std::min(rate_correction_, max_deviation_));
+  ratio_ = 1.0 + rate_correction_ - drift_ms_ / kCorrectionMs;
+  ratio_ = std::max(1.0 - max_deviation_,
+                    std::min(ratio_, 1.0 + max_deviation_));
+}
+
+void AudioDriftCorrector::AppendInput(const uint8* ptr_data, int num_frames) {
+  const size_t kept = work_.size();
+  const int num_samples = num_frames * channels_;
+  work_.resize(kept + num_samples);
+  if (num_samples == 0) {
+    return;
+  }
+  float* const ptr_work = &work_[kept];
+  if (float_samples_) {
+    memcpy(ptr_work, ptr_data, num_samples * sizeof(float));
+    return;
+  }
+  const int16* const ptr_samples = reinterpret_cast<const int16*>(ptr_data);
+  for (int i = 0; i < num_samples; ++i) {
+    ptr_work[i] = ptr_samples[i] / kInt16Scale;
+  }
+}
+
+int AudioDriftCorrector::Resample() {
+  const int work_frames = static_cast<int>(work_.size()) / channels_;
+  const double step = 1.0 / ratio_;
+
+  // Each output reads the frame before its position and the two after it.
+  const int max_frames = static_cast<int>(
+      std::max(0.0, (work_frames - 2 - position_) / step)) + 1;
+  output_.resize(static_cast<size_t>(max_frames) * block_align_);
+  float* const ptr_float = reinterpret_cast<float*>(output_.data());
+  int16* const ptr_int16 = reinterpret_cast<int16*>(output_.data());
+  int frames = 0;
+  while (frames < max_frames && position_ + 2 < work_frames) {
+    const int index = static_cast<int>(position_);
+    const float t = static_cast<float>(position_ - index);
+    const float* const ptr_frame = &work_[index * channels_];
+    for (int c = 0; c < channels_; ++c) {
+      const float sample =
+          Interpolate(ptr_frame[c - channels_], ptr_frame[c],
+                      ptr_frame[c + channels_], ptr_frame[c + 2 * channels_],
+                      t);
+      const int out = frames * channels_ + c;
+      if (float_samples_) {
+        ptr_float[out] = sample;
+      } else {
+        const float scaled = std::floor(sample * kInt16Scale + 0.5f);
+        ptr_int16[out] = static_cast<int16>(
+            std::max(-kInt16Scale, std::min(scaled, kInt16Scale - 1.0f)));
+      }
+    }
+    ++frames;
+    position_ += step;
+  }
+
+  // Keep the frame before the next position, and all after it.
+  const int dropped = std::max(static_cast<int>(position_) - 1, 0);
+  work_.erase(work_.begin(), work_.begin() + dropped * channels_);
+  position_ -= dropped;
+  return frames;
+}
+
+}  // namespace webmlive
@@ -0,0 +1,165 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_AUDIO_DRIFT_CORRECTOR_H_
+#define WEBMLIVE_ENCODER_AUDIO_DRIFT_CORRECTOR_H_
+
+#include <mutex>
+#include <vector>
+
+#include "encoder/audio_encoder.h"
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+
+namespace webmlive {
+
+struct AudioDriftSettings {
+  static const int kDefaultMaxPpm = 1000;
+  static const int kDefaultResyncThreshold = 250;
+
+  AudioDriftSettings()
+      : enabled(false),
+        max_ppm(kDefaultMaxPpm),
+        resync_threshold(kDefaultResyncThreshold) {}
+
+  // Resample the audio input so that its sample count follows the capture
+  // timestamps.
+  bool enabled;
+
+  // Largest resampling correction, in parts per million of the sample rate.
+  int max_ppm;
+
+  // Drift, in milliseconds, beyond which the input is taken to have skipped:
+  // the corrector restarts from the input timestamp rather than resampling
+  // the gap away.
+  int resync_threshold;
+};
+
+struct AudioDriftStats {
+  AudioDriftStats()
+      : drift_ms(0), correction_ppm(0), samples_in(0), samples_out(0),
+        resyncs(0) {}
+
+  // Smoothed time of the corrected audio, counted in samples from the first
+  // input, minus the capture timestamps, in milliseconds. Positive while the
+  // audio device clock runs faster than the capture clock.
+  double drift_ms;
+
+  // Current resampling correction, in parts per million: negative while
+  // samples are removed.
+  double correction_ppm;
+
+  // Sample frames received and produced.
+  int64 samples_in;
+  int64 samples_out;
+
+  // Discontinuities beyond |AudioDriftSettings::resync_threshold|.
+  int64 resyncs;
+};
+
+// Keeps the audio stream on the capture clock. Audio encoders time their
+// output by counting samples from the first input, so an audio device clock
+// that drifts from the clock of the capture timestamps, and of the video,
+// moves the audio away from the video a little more every second.
+//
+// The corrector compares the time of each input, counted in corrected
+// samples, with its capture timestamp, smooths the difference over
+// |kSmoothingMs|, and resamples the input to remove the smoothed difference
+// over |kCorrectionMs|, on top of a clock rate difference learnt over
+// |kIntegralMs|. The resampling ratio stays within
+// |AudioDriftSettings::max_ppm| of 1, which keeps the pitch change
+// inaudible. Samples are interpolated with a 4 point cubic Hermite spline;
+// at a ratio of 1 they pass through unchanged.
+//
+// Notes:
+// - |Init()| must be called before any other method.
+// - |Correct()| must be called from one thread; |GetStats()| may be called
+//   from any.
+class AudioDriftCorrector {
+ public:
+  // Time constant of the drift estimate, time over which the estimated drift
+  // is corrected, and time constant of the clock rate estimate, in
+  // milliseconds.
+  static const int kSmoothingMs = 10000;
+  static const int kCorrectionMs = 30000;
+  static const int kIntegralMs = 120000;
+
+  enum {
+    kUnsupportedFormat = -3,
+    kNoMemory = -2,
+    kInvalidArg = -1,
+    kSuccess = 0,
+  };
+
+  AudioDriftCorrector();
+  ~AudioDriftCorrector() {}
+
+  // Sets up correction of |config| audio with |settings|. Returns |kSuccess|,
+  // |kInvalidArg| for invalid settings, or |kUnsupportedFormat| when
+  // |config| is not 16 bit or float PCM.
+  int Init(const AudioConfig& config, const AudioDriftSettings& settings);
+
+  // Resamples the samples of |input|, which must be in the |Init()| format,
+  // and stores them in |ptr_output|. The output has the timestamp of
+  // |input|, may be empty, and is valid until the next call.
+  int Correct(const PcmSpan& input, PcmSpan* ptr_output);
+
+  // Copies the current drift estimate and counters to |ptr_stats|.
+  void GetStats(AudioDriftStats* ptr_stats) const;
+
+ private:
+  // Updates |drift_ms_| and |ratio_| for an input of |num_frames| frames
+  // captured at |timestamp|.
+  void UpdateDrift(int64 timestamp, int num_frames);
+
+  // Converts |num_frames| frames at |ptr_data| to float, and appends them to
+  // |work_|.
+  void AppendInput(const uint8* ptr_data, int num_frames);
+
+  // Interpolates |work_| at steps of 1 / |ratio_| from |position_| into
+  // |output_|, and drops the frames no later output needs. Returns the
+  // number of frames written.
+  int Resample();
+
+  bool float_samples_;
+  int channels_;
+  int block_align_;
+  int sample_rate_;
+  double max_deviation_;
+  int resync_threshold_;
+
+  // Capture time of the first sample, moved by resyncs, and the frames
+  // produced since.
+  bool started_;
+  double anchor_ms_;
+  int64 samples_in_;
+  int64 samples_out_;
+  int64 resyncs_;
+
+  // Smoothed drift, the estimated clock rate difference, and the output to
+  // input sample rate ratio correcting both.
+  double drift_ms_;
+  double rate_correction_;
+  double ratio_;
+
+  // Interleaved float input, starting with the frames kept for the
+  // interpolation of the next outputs, and the input position of the next
+  // output frame in it.
+  std::vector<float> work_;
+  double position_;
+
+  // Output of the last |Correct()| call, in the input format.
+  std::vector<uint8> output_;
+
+  AudioDriftStats stats_;
+  mutable std::mutex mutex_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(AudioDriftCorrector);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_AUDIO_DRIFT_CORRECTOR_H_
@@ -8,6 +8,7 @@
 #include "encoder/audio_encoder.h"
 
 #include <new>
+#include <utility>
 
 #include "glog/logging.h"
 
@@ -20,6 +21,16 @@ AudioBuffer::AudioBuffer()
       buffer_length_(0) {
 }
 
+AudioBuffer::AudioBuffer(AudioBuffer&& other) noexcept
+    : AudioBuffer() {
+  Swap(&other);
+}
+
+AudioBuffer& AudioBuffer::operator=(AudioBuffer&& other) noexcept {
+  Swap(&other);
+  return *this;
+}
+
 AudioBuffer::~AudioBuffer() {
 }
 
@@ -36,13 +47,9 @@ int AudioBuffer::Init(const AudioConfig& config,
     LOG(ERROR) << "AudioBuffer cannot Init with a NULL or empty buffer.";
     return kInvalidArg;
   }
-  if (data_length > buffer_capacity_) {
-    buffer_.reset(new (std::nothrow) uint8[data_length]);  // NOLINT
-    if (!buffer_) {
-      LOG(ERROR) << "AudioBuffer Init cannot allocate buffer.";
-      return kNoMemory;
-    }
-    buffer_capacity_ = data_length;
+  if (data_length > buffer_capacity_ && AllocateBuffer(data_length)) {
+    LOG(ERROR) << "AudioBuffer Init cannot allocate buffer.";
+    return kNoMemory;
   }
   config_ = config;
   buffer_length_ = data_length;
@@ -52,42 +59,137 @@ int AudioBuffer::Init(const AudioConfig& config,
   return kSuccess;
 }
 
+int AudioBuffer::InitFromStorage(const AudioConfig& config,
+                                 int64 timestamp,
+                                 int64 duration,
+                                 MediaBuffer* ptr_storage,
+                                 int32* ptr_capacity,
+                                 int32 data_length) {
+  if (duration < 0) {
+    LOG(ERROR) << "AudioBuffer duration cannot be less than 0.";
+    return kInvalidArg;
+  }
+  if (!ptr_storage || !ptr_storage->get() || !ptr_capacity ||
+      data_length <= 0 || data_length > *ptr_capacity) {
+    LOG(ERROR) << "AudioBuffer cannot InitFromStorage with invalid storage.";
+    return kInvalidArg;
+  }
+  buffer_.swap(*ptr_storage);
+  const int32 capacity = buffer_capacity_;
+  buffer_capacity_ = *ptr_capacity;
+  *ptr_capacity = capacity;
+  config_ = config;
+  buffer_length_ = data_length;
+  timestamp_ = timestamp;
+  duration_ = duration;
+  return kSuccess;
+}
+
 int AudioBuffer::Clone(AudioBuffer* ptr_buffer) const {
   if (!ptr_buffer) {
     return kInvalidArg;
   }
-  return ptr_buffer->Init(config_,
-                          timestamp_,
-                          duration_,
-                          buffer_.get(),
-                          buffer_length_);
+  if (ptr_buffer == this) {
+    return kSuccess;
+  }
+  if (buffer_length_ > ptr_buffer->buffer_capacity_ &&
+      ptr_buffer->AllocateBuffer(buffer_capacity_)) {
+    LOG(ERROR) << "AudioBuffer Clone cannot allocate buffer.";
+    return kNoMemory;
+  }
+  if (buffer_length_ > 0) {
+    memcpy(ptr_buffer->buffer_.get(), buffer_.get(), buffer_length_);
+  }
+  ptr_buffer->buffer_length_ = buffer_length_;
+  ptr_buffer->config_ = config_;
+  ptr_buffer->timestamp_ = timestamp_;
+  ptr_buffer->duration_ = duration_;
+  return kSuccess;
+}
+
+int AudioBuffer::Reserve(int32 capacity) {
+  if (capacity > buffer_capacity_ && AllocateBuffer(capacity)) {
+    LOG(ERROR) << "AudioBuffer Reserve cannot allocate buffer.";
+    return kNoMemory;
+  }
+  return kSuccess;
 }
 
 void AudioBuffer::Swap(AudioBuffer* ptr_buffer) {
-  CHECK_NOTNULL(buffer_.get());
-  CHECK_NOTNULL(ptr_buffer->buffer_.get());
+  std::swap(config_, ptr_buffer->config_);
+  std::swap(duration_, ptr_buffer->duration_);
+  std::swap(timestamp_, ptr_buffer->timestamp_);
+  std::swap(buffer_length_, ptr_buffer->buffer_length_);
+  std::swap(buffer_capacity_, ptr_buffer->buffer_capacity_);
+  buffer_.swap(ptr_buffer->buffer_);
+}
+
+int AudioBuffer::AllocateBuffer(int32 size) {
+  // Free the current buffer first, so that its block can be reused.
+  buffer_.reset();
+  buffer_length_ = 0;
+  buffer_ = AllocateMediaBuffer(arena_, size, &buffer_capacity_);
+  return buffer_ ? kSuccess : kNoMemory;
+}
 
-  const AudioConfig temp = config_;
-  config_ = ptr_buffer->config_;
-  ptr_buffer->config_ = temp;
+///////////////////////////////////////////////////////////////////////////////
+// AudioPacketBatch
+//
+
+AudioPacketBatch::AudioPacketBatch() : capacity_(0), size_(0) {
+}
 
-  int64 temp_time = duration_;
-  duration_ = ptr_buffer->duration_;
-  ptr_buffer->duration_ = temp_time;
+AudioPacketBatch::~AudioPacketBatch() {
+}
 
-  temp_time = timestamp_;
-  timestamp_ = ptr_buffer->timestamp_;
-  ptr_buffer->duration_ = temp_time;
+int AudioPacketBatch::Init(int capacity,
+                           const std::shared_ptr<MediaArena>& arena) {
+  if (capacity <= 0) {
+    LOG(ERROR) << "AudioPacketBatch capacity must be positive.";
+    return kInvalidArg;
+  }
+  if (buffers_) {
+    LOG(ERROR) << "AudioPacketBatch already initialized.";
+    return kAlreadyInitialized;
+  }
+  buffers_.reset(new (std::nothrow) AudioBuffer[capacity]);  // NOLINT
+  if (!buffers_) {
+    LOG(ERROR) << "AudioPacketBatch Init cannot allocate buffers.";
+    return kNoMemory;
+  }
+  for (int i = 0; i < capacity; ++i) {
+    buffers_[i].set_arena(arena);
+  }
+  capacity_ = capacity;
+  size_ = 0;
+  return kSuccess;
+}
 
-  int32 temp_size = buffer_length_;
-  buffer_length_ = ptr_buffer->buffer_length_;
-  ptr_buffer->buffer_length_ = temp_size;
+///////////////////////////////////////////////////////////////////////////////
+// AudioEncoder
+//
 
-  temp_size = buffer_capacity_;
-  buffer_capacity_ = ptr_buffer->buffer_capacity_;
-  ptr_buffer->buffer_capacity_ = temp_size;
+int AudioEncoder::EncodePlanar(const PlanarPcm&) {
+  return kUnsupportedFormat;
+}
 
-  buffer_.swap(ptr_buffer->buffer_);
+int AudioEncoder::ReadCompressedAudioBatch(AudioPacketBatch* ptr_batch) {
+  if (!ptr_batch) {
+    LOG(ERROR) << "ReadCompressedAudioBatch requires a non-NULL ptr_batch.";
+    return kInvalidArg;
+  }
+  const int initial_size = ptr_batch->size();
+  AudioBuffer* ptr_buffer;
+  while ((ptr_buffer = ptr_batch->next_buffer()) != NULL) {
+    const int status = ReadCompressedAudio(ptr_buffer);
+    if (status == kNoSamples) {
+      break;
+    } else if (status) {
+      return status;
+    }
+    ptr_batch->Append();
+  }
+  return ptr_batch->size() > initial_size ? kSuccess : kNoSamples;
 }
 
 }  // namespace webmlive
@@ -9,9 +9,11 @@
 #define WEBMLIVE_ENCODER_AUDIO_ENCODER_H_
 
 #include <memory>
+#include <vector>
 
 #include "encoder/basictypes.h"
 #include "encoder/encoder_base.h"
+#include "encoder/media_arena.h"
 
 namespace webmlive {
 
@@ -19,6 +21,7 @@ enum AudioFormat {
   kAudioFormatPcm = 1,
   kAudioFormatVorbis = 2,
   kAudioFormatIeeeFloat = 3,
+  kAudioFormatOpus = 4,
 };
 
 // Audio configuration control structure. Values set to 0 mean use default.
@@ -53,6 +56,11 @@ class AudioBuffer {
     kSuccess = 0,
   };
   AudioBuffer();
+
+  // Moving takes |other|'s storage and leaves it with this buffer's previous
+  // storage. Never allocates.
+  AudioBuffer(AudioBuffer&& other) noexcept;
+  AudioBuffer& operator=(AudioBuffer&& other) noexcept;
   ~AudioBuffer();
 
   // Allocates storage for |ptr_data|, sets internal fields to values of
@@ -64,13 +72,32 @@ class AudioBuffer {
            const uint8* ptr_data,
            int32 data_length);
 
-  // Copies |AudioBuffer| data to |ptr_buffer|. Performs allocation if
-  // necessary. Returns |kSuccess| when successful. Returns |kInvalidArg| when
-  // |ptr_buffer| is NULL. Returns |kNoMemory| when memory allocation fails.
+  // Same as |Init()|, but takes the first |data_length| bytes of
+  // |*ptr_storage|, which holds |*ptr_capacity| bytes, without copying. The
+  // storage is swapped with the |AudioBuffer|'s own, which is returned in
+  // |ptr_storage| and |ptr_capacity| for reuse by the caller. Returns
+  // |kInvalidArg| when an argument is NULL, or when |data_length| is less
+  // than 1 or greater than |*ptr_capacity|.
+  int InitFromStorage(const AudioConfig& config,
+                      int64 timestamp,
+                      int64 duration,
+                      MediaBuffer* ptr_storage,
+                      int32* ptr_capacity,
+                      int32 data_length);
+
+  // Copies |AudioBuffer| data to |ptr_buffer|, reusing |ptr_buffer|'s storage
+  // when it is large enough. Returns |kSuccess| when successful. Returns
+  // |kInvalidArg| when |ptr_buffer| is NULL. Returns |kNoMemory| when memory
+  // allocation fails.
   int Clone(AudioBuffer* ptr_buffer) const;
 
-  // Swaps |AudioBuffer| member data with |ptr_buffer|'s. The |AudioBuffer|s
-  // must have non-NULL buffers.
+  // Ensures that |buffer()| can store at least |capacity| bytes. Existing
+  // buffer data is discarded when reallocation is necessary. Returns
+  // |kSuccess| when successful, or |kNoMemory| when allocation fails.
+  int Reserve(int32 capacity);
+
+  // Swaps |AudioBuffer| member data with |ptr_buffer|'s. Either buffer may be
+  // NULL.
   void Swap(AudioBuffer* ptr_buffer);
 
   // Accessors/Mutators.
@@ -82,16 +109,110 @@ class AudioBuffer {
   int32 buffer_capacity() const { return buffer_capacity_; }
   const AudioConfig& config() const { return config_; }
 
+  // Arena the buffer allocates storage from, or NULL for the heap. Like
+  // |VideoFrame|'s, the arena is not exchanged by |Swap()|.
+  const std::shared_ptr<MediaArena>& arena() const { return arena_; }
+  void set_arena(const std::shared_ptr<MediaArena>& arena) { arena_ = arena; }
+
  private:
+  // Replaces |buffer_| with a buffer of at least |size| bytes from |arena_|,
+  // discarding the buffer data. Returns |kSuccess| when successful, or
+  // |kNoMemory| when allocation fails.
+  int AllocateBuffer(int32 size);
+
   int64 timestamp_;
   int64 duration_;
-  std::unique_ptr<uint8[]> buffer_;
+  MediaBuffer buffer_;
   int32 buffer_capacity_;
   int32 buffer_length_;
   AudioConfig config_;
+  std::shared_ptr<MediaArena> arena_;
   WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(AudioBuffer);
 };
 
+// Fixed-capacity list of compressed |AudioBuffer|s, filled by
+// |AudioEncoder::ReadCompressedAudioBatch()| and written in one call by
+// |LiveWebmMuxer::WriteAudioBuffers()|. The buffers are allocated by |Init()|
+// and keep their storage from batch to batch, so a steady stream of packets
+// allocates nothing.
+class AudioPacketBatch {
+ public:
+  enum {
+    kAlreadyInitialized = -3,
+    kNoMemory = -2,
+    kInvalidArg = -1,
+    kSuccess = 0,
+  };
+
+  // Default |Init()| capacity: enough for the packets a multichannel Vorbis
+  // or short-frame Opus stream produces between two encoder passes.
+  static const int kDefaultCapacity = 16;
+
+  AudioPacketBatch();
+  ~AudioPacketBatch();
+
+  // Allocates |capacity| buffers that take their storage from |arena|, and
+  // returns |kSuccess|. Returns |kInvalidArg| when |capacity| is not
+  // positive, |kNoMemory| when allocation fails, and |kAlreadyInitialized|
+  // when |Init()| has already been called.
+  int Init(int capacity, const std::shared_ptr<MediaArena>& arena);
+
+  // Returns the buffer that the next packet is to be stored in, or NULL when
+  // the batch is full. The packet is added by |Append()|; until then the
+  // buffer is not part of the batch.
+  AudioBuffer* next_buffer() {
+    return size_ < capacity_ ? &buffers_[size_] : NULL;
+  }
+
+  // Adds the buffer returned by |next_buffer()| to the batch.
+  void Append() { ++size_; }
+
+  // Empties the batch. The buffers keep their storage.
+  void Clear() { size_ = 0; }
+
+  // Returns the packet at |index|, which must be less than |size()|. The
+  // packet is non-const to allow |AudioBuffer::Swap()| by the reader.
+  AudioBuffer* at(int index) const { return &buffers_[index]; }
+
+  int size() const { return size_; }
+  int capacity() const { return capacity_; }
+  bool empty() const { return size_ == 0; }
+  bool full() const { return size_ == capacity_; }
+
+ private:
+  std::unique_ptr<AudioBuffer[]> buffers_;
+  int capacity_;
+  int size_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(AudioPacketBatch);
+};
+
+// Interleaved uncompressed samples stored elsewhere, such as in a
+// |PcmRingBuffer|, in the format the consumer was initialized with.
+struct PcmSpan {
+  PcmSpan() : ptr_data(NULL), length(0), timestamp(0) {}
+
+  // Samples, and their length in bytes: a whole number of sample frames.
+  const uint8* ptr_data;
+  int32 length;
+
+  // Time of the first sample, in milliseconds.
+  int64 timestamp;
+};
+
+// Deinterleaved float samples stored elsewhere, such as in a
+// |PlanarAudioBlock|: one plane of |num_frames| samples per channel, in
+// input channel order, at the sample rate the consumer was initialized with.
+struct PlanarPcm {
+  PlanarPcm() : ptr_planes(NULL), channels(0), num_frames(0), timestamp(0) {}
+
+  const float* const* ptr_planes;
+  int channels;
+  int num_frames;
+
+  // Time of the first sample, in milliseconds.
+  int64 timestamp;
+};
+
 // Pure interface class that provides a simple callback allowing the
 // implementor class to receive |AudioBuffer| pointers.
 class AudioSamplesCallbackInterface {
@@ -121,7 +242,10 @@ struct VorbisConfig {
         maximum_bitrate(kUseDefault),
         bitrate_based_quality(true),
         impulse_block_bias(kUseDefault),
-        lowpass_frequency(kUseDefault) {}
+        lowpass_frequency(kUseDefault),
+        sample_rate(kUseDefault),
+        channels(kUseDefault),
+        warmup(false) {}
 
   // Rate control values. Set the min and max values to |kUseDefault| to
   // encode at an average bitrate. Use the same value for minimum, average, and
@@ -147,6 +271,148 @@ struct VorbisConfig {
 
   // Hard-lowpass frequency. Valid range is 2 to 99.
   double lowpass_frequency;
+
+  // Encoded sample rate and channel count. |kUseDefault| keeps the input
+  // value. Input is resampled to |sample_rate| within a factor of eight of the
+  // input rate. |channels| must match the input, or be 1 or 2 to downmix (or
+  // upmix) the input.
+  int sample_rate;
+  int channels;
+
+  // Encode and discard silence in a scratch libvorbis state during
+  // |VorbisEncoder::Init()|, and size the input buffer of the real one, so
+  // that the first input is not slowed by first-use allocations and page
+  // faults. The encoded stream is unchanged.
+  bool warmup;
+};
+
+struct OpusConfig {
+  // Special value that means use the default value for the current option.
+  static const int kUseDefault = -200;
+  OpusConfig()
+      : bitrate(64),
+        complexity(kUseDefault),
+        frame_duration(20),
+        low_delay(false) {}
+
+  // Target bitrate, in kilobits.
+  int bitrate;
+
+  // Encoder complexity, 0 to 10.
+  int complexity;
+
+  // Duration of each Opus packet in milliseconds: 10, 20, 40 or 60.
+  int frame_duration;
+
+  // Use OPUS_APPLICATION_RESTRICTED_LOWDELAY instead of
+  // OPUS_APPLICATION_AUDIO. Disables the speech optimized SILK layer, which
+  // reduces algorithmic delay.
+  bool low_delay;
+};
+
+// WebM audio track header data produced by an |AudioEncoder|.
+struct AudioCodecPrivate {
+  AudioCodecPrivate()
+      : format(kAudioFormatVorbis),
+        codec_delay(0),
+        seek_pre_roll(0) {}
+
+  // Compressed audio format. Selects the WebM CodecID.
+  AudioFormat format;
+
+  // CodecPrivate element data.
+  std::vector<uint8> data;
+
+  // CodecDelay and SeekPreRoll element values, in nanoseconds.
+  uint64 codec_delay;
+  uint64 seek_pre_roll;
+};
+
+struct WebmEncoderConfig;
+
+// Audio encoder interface. |WebmEncoder| creates the implementation selected
+// by |WebmEncoderConfig::audio_codec|.
+// Note: users must call |Init()| before any other method.
+class AudioEncoder {
+ public:
+  enum {
+    // A codec library function returned an error.
+    kCodecError = -202,
+
+    // Internal error within the encoder.
+    kEncoderError = -201,
+
+    // The input format or encoder configuration is not supported.
+    kUnsupportedFormat = -200,
+
+    kNoMemory = -2,
+    kInvalidArg = -1,
+    kSuccess = 0,
+
+    // |ReadCompressedAudio()| has no samples available.
+    kNoSamples = 1,
+  };
+
+  virtual ~AudioEncoder() {}
+
+  // Initializes the encoder for |config.actual_audio_config| input using the
+  // codec settings in |config|. Returns |kSuccess| when successful.
+  virtual int Init(const WebmEncoderConfig& config) = 0;
+
+  // Passes the samples in |uncompressed_buffer| to the encoder. Returns
+  // |kSuccess| after successful handoff of samples to the encoder.
+  virtual int Encode(const AudioBuffer& uncompressed_buffer) = 0;
+
+  // Same as |Encode()|, for samples read in place from |span|, which must be
+  // in the |config.actual_audio_config| format passed to |Init()|.
+  virtual int EncodeSpan(const PcmSpan& span) = 0;
+
+  // Same as |EncodeSpan()|, for samples already deinterleaved to float, which
+  // lets several encoders share one conversion of their input. The default
+  // implementation returns |kUnsupportedFormat|.
+  virtual int EncodePlanar(const PlanarPcm& pcm);
+
+  // Returns compressed audio via |ptr_buffer| when available. Returns
+  // |kNoSamples| when the encoder has no data ready. Returns |kSuccess| when
+  // samples are written to |ptr_buffer|.
+  virtual int ReadCompressedAudio(AudioBuffer* ptr_buffer) = 0;
+
+  // Appends all compressed audio available, up to the capacity of
+  // |ptr_batch|, to |ptr_batch|. Returns |kSuccess| when at least one packet
+  // is appended, and |kNoSamples| when none is. When the batch fills, more
+  // audio may remain: consume and |Clear()| the batch, and call again. The
+  // default implementation calls |ReadCompressedAudio()| once per packet.
+  virtual int ReadCompressedAudioBatch(AudioPacketBatch* ptr_batch);
+
+  // Changes the target bitrate, in kilobits, of audio encoded from now on.
+  // Returns |kSuccess| when successful, or |kUnsupportedFormat| when the
+  // codec cannot change its bitrate mid-stream.
+  virtual int SetBitrate(int bitrate) = 0;
+
+  // Tells the encoder whether the input is silent, so that it can spend
+  // fewer bits on audio encoded from now on. Returns |kSuccess| when
+  // successful.
+  virtual int SetSilent(bool silent) = 0;
+
+  // Sets the arena compressed audio storage is allocated from. Call before
+  // |Init()|.
+  virtual void set_arena(const std::shared_ptr<MediaArena>& arena) = 0;
+
+  // Copies the WebM track header data for the compressed stream to
+  // |ptr_private|. Returns |kSuccess| when successful.
+  virtual int GetCodecPrivate(AudioCodecPrivate* ptr_private) const = 0;
+
+  // Returns the configuration of compressed buffers returned by
+  // |ReadCompressedAudio()|.
+  virtual const AudioConfig* audio_config() const = 0;
+
+  // Returns the timestamp of the last buffer read from
+  // |ReadCompressedAudio()|.
+  virtual int64 last_timestamp() const = 0;
+
+  // Returns the time of the end of the audio encoded so far, which allows
+  // users to determine the timestamp of the next compressed buffer.
+  virtual int64 time_encoded() const = 0;
 };
 
 }  // namespace webmlive
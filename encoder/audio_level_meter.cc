@@ -0,0 +1,250 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/audio_level_meter.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "glog/logging.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || \
+    defined(__i386__)
+#define WEBMLIVE_HAVE_X86 1
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(_M_ARM64)
+#define WEBMLIVE_HAVE_NEON 1
+#include <arm_neon.h>
+#endif
+
+// See pcm_deinterleave.cc.
+#if defined(WEBMLIVE_HAVE_X86) && !defined(_MSC_VER)
+#define WEBMLIVE_TARGET(isa) __attribute__((target(isa)))
+#else
+#define WEBMLIVE_TARGET(isa)
+#endif
+
+namespace {
+
+using webmlive::AudioLevelStats;
+
+// Samples of each channel deinterleaved and measured at once.
+const int kBlockSamples = 256;
+
+void SampleLevelC(const float* ptr_samples, int num_samples, float* ptr_peak,
+                  float* ptr_sum_squares) {
+  float peak = 0.0f;
+  float sum_squares = 0.0f;
+  for (int i = 0; i < num_samples; ++i) {
+    peak = std::max(peak, std::fabs(ptr_samples[i]));
+    sum_squares += ptr_samples[i] * ptr_samples[i];
+  }
+  *ptr_peak = peak;
+  *ptr_sum_squares = sum_squares;
+}
+
+// Returns |level|, a linear amplitude, in dBFS.
+double ToDecibels(double level) {
+  if (level <= 0.0) {
+    return AudioLevelStats::kMinLevel;
+  }
+  return std::max(20.0 * std::log10(level),
+                  static_cast<double>(AudioLevelStats::kMinLevel));
+}
+
+#if defined(WEBMLIVE_HAVE_X86)
+
+// Clearing the sign bit takes the absolute value.
+WEBMLIVE_TARGET("sse2")
+void SampleLevelSse2(const float* ptr_samples, int num_samples,
+                     float* ptr_peak, float* ptr_sum_squares) {
+  const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+  __m128 peak = _mm_setzero_ps();
+  __m128 sum = _mm_setzero_ps();
+  int i = 0;
+  for (; i + 4 <= num_samples; i += 4) {
+    const __m128 samples = _mm_loadu_ps(ptr_samples + i);
+    peak = _mm_max_ps(peak, _mm_and_ps(samples, abs_mask));
+    sum = _mm_add_ps(sum, _mm_mul_ps(samples, samples));
+  }
+  peak = _mm_max_ps(peak, _mm_movehl_ps(peak, peak));
+  peak = _mm_max_ss(peak, _mm_shuffle_ps(peak, peak, 1));
+  sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+  sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+  float tail_peak = 0.0f;
+  float tail_sum = 0.0f;
+  SampleLevelC(ptr_samples + i, num_samples - i, &tail_peak, &tail_sum);
+  *ptr_peak = std::max(_mm_cvtss_f32(peak), tail_peak);
+  *ptr_sum_squares = _mm_cvtss_f32(sum) + tail_sum;
+}
+
+#elif defined(WEBMLIVE_HAVE_NEON)
+
+void SampleLevelNeon(const float* ptr_samples, int num_samples,
+                     float* ptr_peak, float* ptr_sum_squares) {
+  float32x4_t peak = vdupq_n_f32(0.0f);
+  float32x4_t sum = vdupq_n_f32(0.0f);
+  int i = 0;
+  for (; i + 4 <= num_samples; i += 4) {
+    const float32x4_t samples = vld1q_f32(ptr_samples + i);
+    peak = vmaxq_f32(peak, vabsq_f32(samples));
+    sum = vmlaq_f32(sum, samples, samples);
+  }
+  float32x2_t peak2 = vmax_f32(vget_low_f32(peak), vget_high_f32(peak));
+  peak2 = vpmax_f32(peak2, peak2);
+  float32x2_t sum2 = vadd_f32(vget_low_f32(sum), vget_high_f32(sum));
+  sum2 = vpadd_f32(sum2, sum2);
+  float tail_peak = 0.0f;
+  float tail_sum = 0.0f;
+  SampleLevelC(ptr_samples + i, num_samples - i, &tail_peak, &tail_sum);
+  *ptr_peak = std::max(vget_lane_f32(peak2, 0), tail_peak);
+  *ptr_sum_squares = vget_lane_f32(sum2, 0) + tail_sum;
+}
+
+#endif  // WEBMLIVE_HAVE_X86
+
+}  // anonymous namespace
+
+namespace webmlive {
+
+SampleLevelFunc SelectSampleLevel(int cpu_features) {
+#if defined(WEBMLIVE_HAVE_X86)
+  if (cpu_features & kCpuFeatureSse2) return &SampleLevelSse2;
+#elif defined(WEBMLIVE_HAVE_NEON)
+  if (cpu_features & kCpuFeatureNeon) return &SampleLevelNeon;
+#endif
+  return &SampleLevelC;
+}
+
+AudioLevelMeter::AudioLevelMeter()
+    : deinterleave_(NULL),
+      sample_level_(SelectSampleLevel(GetCpuFeatures())),
+      channels_(0),
+      block_align_(0),
+      sample_rate_(0),
+      window_samples_(0),
+      window_length_(0),
+      threshold_(0),
+      quiet_samples_(0),
+      hold_samples_(0),
+      silent_(false),
+      silent_samples_(0) {
+  for (int i = 0; i < AudioConverter::kMaxChannels; ++i) {
+    planes_[i] = NULL;
+    window_peak_[i] = 0;
+    window_sum_squares_[i] = 0;
+  }
+}
+
+int AudioLevelMeter::Init(const AudioConfig& config,
+                          const AudioLevelSettings& settings) {
+  if (settings.silence_threshold > 0 || settings.silence_hold < 0) {
+    LOG(ERROR) << "invalid audio silence settings.";
+    return kInvalidArg;
+  }
+  if (config.channels < 1 || config.channels > AudioConverter::kMaxChannels ||
+      config.sample_rate == 0 || config.block_align == 0) {
+    LOG(ERROR) << "cannot meter " << config.channels << " channel audio.";
+    return kUnsupportedFormat;
+  }
+  deinterleave_ = SelectPcmDeinterleave(
+      static_cast<AudioFormat>(config.format_tag), config.channels,
+      GetCpuFeatures());
+  if (!deinterleave_) {
+    LOG(ERROR) << "cannot meter audio format " << config.format_tag;
+    return kUnsupportedFormat;
+  }
+  channels_ = config.channels;
+  block_align_ = config.block_align;
+  sample_rate_ = static_cast<int>(config.sample_rate);
+  block_.assign(kBlockSamples * channels_, 0.0f);
+  for (int i = 0; i < channels_; ++i) {
+    planes_[i] = &block_[i * kBlockSamples];
+  }
+  window_length_ = std::max(sample_rate_ * kWindowMs / 1000, 1);
+  threshold_ = static_cast<float>(
+      std::pow(10.0, settings.silence_threshold / 20.0));
+  hold_samples_ = static_cast<int64>(sample_rate_) * settings.silence_hold /
+                  1000;
+  std::lock_guard<std::mutex> lock(mutex_);
+  stats_ = AudioLevelStats();
+  stats_.channels = channels_;
+  return kSuccess;
+}
+
+void AudioLevelMeter::Measure(const PcmSpan& span) {
+  if (!deinterleave_ || !span.ptr_data) {
+    return;
+  }
+  const uint8* ptr_data = span.ptr_data;
+  int remaining = span.length / block_align_;
+  while (remaining > 0) {
+    const int num_samples = std::min(remaining, kBlockSamples);
+    deinterleave_(ptr_data, num_samples, channels_, planes_);
+    MeasureBlock(num_samples);
+    ptr_data += num_samples * block_align_;
+    remaining -= num_samples;
+  }
+}
+
+void AudioLevelMeter::GetStats(AudioLevelStats* ptr_stats) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  *ptr_stats = stats_;
+}
+
+void AudioLevelMeter::MeasureBlock(int num_samples) {
+  float block_peak = 0.0f;
+  for (int i = 0; i < channels_; ++i) {
+    float peak = 0.0f;
+    float sum_squares = 0.0f;
+    sample_level_(planes_[i], num_samples, &peak, &sum_squares);
+    window_peak_[i] = std::max(window_peak_[i], peak);
+    window_sum_squares_[i] += sum_squares;
+    block_peak = std::max(block_peak, peak);
+  }
+
+  // Sound ends silence at once; quiet starts it only after the hold.
+  if (block_peak >= threshold_) {
+    quiet_samples_ = 0;
+    if (silent_) {
+      silent_ = false;
+      VLOG(1) << "audio input no longer silent.";
+    }
+  } else {
+    quiet_samples_ += num_samples;
+    if (!silent_ && quiet_samples_ >= hold_samples_) {
+      silent_ = true;
+      VLOG(1) << "audio input silent.";
+      std::lock_guard<std::mutex> lock(mutex_);
+      ++stats_.silent_periods;
+    }
+  }
+  if (silent_) {
+    silent_samples_ += num_samples;
+  }
+
+  window_samples_ += num_samples;
+  if (window_samples_ >= window_length_) {
+    EndWindow();
+  }
+}
+
+void AudioLevelMeter::EndWindow() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (int i = 0; i < channels_; ++i) {
+    stats_.peak[i] = ToDecibels(window_peak_[i]);
+    stats_.rms[i] =
+        ToDecibels(std::sqrt(window_sum_squares_[i] / window_samples_));
+    window_peak_[i] = 0;
+    window_sum_squares_[i] = 0;
+  }
+  stats_.silent = silent_;
+  stats_.silent_ms = silent_samples_ * 1000 / sample_rate_;
+  window_samples_ = 0;
+}
+
+}  // namespace webmlive
@@ -0,0 +1,164 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_AUDIO_LEVEL_METER_H_
+#define WEBMLIVE_ENCODER_AUDIO_LEVEL_METER_H_
+
+#include <mutex>
+#include <vector>
+
+#include "encoder/audio_converter.h"
+#include "encoder/audio_encoder.h"
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+#include "encoder/pcm_deinterleave.h"
+
+namespace webmlive {
+
+// Stores the largest absolute value of the |num_samples| samples at
+// |ptr_samples| in |ptr_peak|, and the sum of their squares in
+// |ptr_sum_squares|.
+typedef void (*SampleLevelFunc)(const float* ptr_samples, int num_samples,
+                                float* ptr_peak, float* ptr_sum_squares);
+
+// Returns the fastest level kernel on a CPU supporting |cpu_features|, a
+// mask of |CpuFeature| values.
+SampleLevelFunc SelectSampleLevel(int cpu_features);
+
+struct AudioLevelSettings {
+  static const int kDefaultSilenceThreshold = -60;
+  static const int kDefaultSilenceHold = 2000;
+
+  AudioLevelSettings()
+      : enabled(false),
+        silence_threshold(kDefaultSilenceThreshold),
+        silence_hold(kDefaultSilenceHold),
+        silence_encoding(false) {}
+
+  // Measure the levels of the audio input.
+  bool enabled;
+
+  // Peak level, in dBFS, below which audio is silence, and the time audio
+  // must stay below it, in milliseconds, before the input is silent.
+  int silence_threshold;
+  int silence_hold;
+
+  // Tell the audio encoder while the input is silent, so that it spends
+  // fewer bits on it. See |AudioEncoder::SetSilent()|. Requires |enabled|.
+  bool silence_encoding;
+};
+
+struct AudioLevelStats {
+  AudioLevelStats()
+      : channels(0), silent(false), silent_periods(0), silent_ms(0) {
+    for (int i = 0; i < AudioConverter::kMaxChannels; ++i) {
+      peak[i] = rms[i] = kMinLevel;
+    }
+  }
+
+  // Level reported for digital silence, in dBFS.
+  static const int kMinLevel = -100;
+
+  // Peak and RMS level of each input channel, in WAVE order, over the last
+  // metering window, in dBFS.
+  int channels;
+  double peak[AudioConverter::kMaxChannels];
+  double rms[AudioConverter::kMaxChannels];
+
+  // True while the input is silent, the silent periods begun, and their
+  // total length in milliseconds.
+  bool silent;
+  int64 silent_periods;
+  int64 silent_ms;
+};
+
+// Measures the peak and RMS levels of PCM audio, per channel, over windows
+// of |kWindowMs| milliseconds, and detects silence: audio whose peak stays
+// below |AudioLevelSettings::silence_threshold| on all channels for
+// |AudioLevelSettings::silence_hold| milliseconds. Sound ends silence on the
+// first block above the threshold.
+//
+// Samples are deinterleaved to float a block at a time by the
+// |SelectPcmDeinterleave()| kernels, and measured by the
+// |SelectSampleLevel()| kernels.
+//
+// Notes:
+// - |Init()| must be called before any other method.
+// - |Measure()| and |silent()| must be called from one thread;
+//   |GetStats()| may be called from any.
+class AudioLevelMeter {
+ public:
+  // Metering window length, in milliseconds.
+  static const int kWindowMs = 300;
+
+  enum {
+    kUnsupportedFormat = -3,
+    kNoMemory = -2,
+    kInvalidArg = -1,
+    kSuccess = 0,
+  };
+
+  AudioLevelMeter();
+  ~AudioLevelMeter() {}
+
+  // Sets up metering of |config| audio with |settings|. Returns |kSuccess|,
+  // |kInvalidArg| for invalid settings, or |kUnsupportedFormat| when
+  // |config| is not 16 bit or float PCM of 1 to
+  // |AudioConverter::kMaxChannels| channels.
+  int Init(const AudioConfig& config, const AudioLevelSettings& settings);
+
+  // Measures the samples of |span|, which must be in the |Init()| format.
+  void Measure(const PcmSpan& span);
+
+  // Returns true while the input is silent.
+  bool silent() const { return silent_; }
+
+  // Copies the levels of the last window and the silence counters to
+  // |ptr_stats|.
+  void GetStats(AudioLevelStats* ptr_stats) const;
+
+ private:
+  // Measures the |num_samples| samples of each channel in |planes_|.
+  void MeasureBlock(int num_samples);
+
+  // Publishes the levels of the window that ended, and starts the next.
+  void EndWindow();
+
+  PcmDeinterleaveFunc deinterleave_;
+  SampleLevelFunc sample_level_;
+  int channels_;
+  int block_align_;
+  int sample_rate_;
+
+  // Deinterleaved samples of the block being measured.
+  std::vector<float> block_;
+  float* planes_[AudioConverter::kMaxChannels];
+
+  // Peak and sum of squares of each channel over the window, and the
+  // samples measured in it, of |window_length_|.
+  float window_peak_[AudioConverter::kMaxChannels];
+  double window_sum_squares_[AudioConverter::kMaxChannels];
+  int window_samples_;
+  int window_length_;
+
+  // Linear silence threshold, samples below it in a row, and the count
+  // that makes the input silent.
+  float threshold_;
+  int64 quiet_samples_;
+  int64 hold_samples_;
+  bool silent_;
+  int64 silent_samples_;
+
+  // Published levels and counters. Protected by |mutex_|.
+  AudioLevelStats stats_;
+  mutable std::mutex mutex_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(AudioLevelMeter);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_AUDIO_LEVEL_METER_H_
@@ -0,0 +1,169 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/av_interleaver.h"
+
+#include <new>
+#include <utility>
+
+#include "encoder/log_util.h"
+#include "glog/logging.h"
+
+namespace webmlive {
+
+AVInterleaver::AVInterleaver()
+    : max_latency_(kDefaultMaxLatency),
+      stream_timeout_(kDefaultStreamTimeout),
+      late_packets_(0),
+      audio_midpoints_(false) {
+}
+
+AVInterleaver::~AVInterleaver() {
+}
+
+int AVInterleaver::Init(bool audio_enabled, bool video_enabled,
+                        int64 max_latency, int64 stream_timeout) {
+  if (!audio_enabled && !video_enabled) {
+    LOG(ERROR) << "audio and video disabled.";
+    return kInvalidArg;
+  }
+  audio_.enabled = audio_enabled;
+  video_.enabled = video_enabled;
+  max_latency_ = kDefaultMaxLatency;
+  if (max_latency > 0) {
+    max_latency_ = max_latency;
+  }
+  stream_timeout_ = kDefaultStreamTimeout;
+  if (stream_timeout > 0) {
+    stream_timeout_ = stream_timeout;
+  }
+
+  // A stream that never starts times out like one that stalls.
+  const Clock::time_point now = Clock::now();
+  audio_.last_push_time = now;
+  video_.last_push_time = now;
+  return kSuccess;
+}
+
+int AVInterleaver::PushAudio(AudioBuffer* ptr_buffer) {
+  return Push(ptr_buffer, &audio_);
+}
+
+int AVInterleaver::PushVideo(VideoFrame* ptr_frame) {
+  return Push(ptr_frame, &video_);
+}
+
+AVInterleaver::PacketType AVInterleaver::NextPacket(bool flush) {
+  const bool have_audio = !audio_.packets.empty();
+  const bool have_video = !video_.packets.empty();
+  if (have_audio && have_video) {
+    // Video goes first on a tie so that a keyframe starts its cluster ahead
+    // of the audio that shares its timestamp.
+    return OrderTimestamp(*audio_.packets.front()) <
+           OrderTimestamp(*video_.packets.front()) ?
+        kAudioPacket : kVideoPacket;
+  }
+  if (have_audio) {
+    return flush || Due(audio_, video_, Clock::now()) ?
+        kAudioPacket : kNoPacket;
+  }
+  if (have_video) {
+    return flush || Due(video_, audio_, Clock::now()) ?
+        kVideoPacket : kNoPacket;
+  }
+  return kNoPacket;
+}
+
+int AVInterleaver::PopAudio(AudioBuffer* ptr_buffer) {
+  return Pop(ptr_buffer, &audio_, video_);
+}
+
+int AVInterleaver::PopVideo(VideoFrame* ptr_frame) {
+  return Pop(ptr_frame, &video_, audio_);
+}
+
+int64 AVInterleaver::OrderTimestamp(const AudioBuffer& buffer) const {
+  return audio_midpoints_ ? buffer.timestamp() + buffer.duration() / 2 :
+      buffer.timestamp();
+}
+
+template <class Type>
+int AVInterleaver::Push(Type* ptr_packet, StreamQueue<Type>* ptr_queue) {
+  if (!ptr_packet || !ptr_queue->enabled) {
+    return kInvalidArg;
+  }
+  std::unique_ptr<Type> packet;
+  if (ptr_queue->free_packets.empty()) {
+    packet.reset(new (std::nothrow) Type());  // NOLINT
+    if (!packet) {
+      LOG(ERROR) << "out of memory.";
+      return kNoMemory;
+    }
+  } else {
+    packet = std::move(ptr_queue->free_packets.back());
+    ptr_queue->free_packets.pop_back();
+  }
+  packet->Swap(ptr_packet);
+  ptr_queue->newest_timestamp = OrderTimestamp(*packet);
+  ptr_queue->last_push_time = Clock::now();
+  ptr_queue->packets.push_back(std::move(packet));
+  return kSuccess;
+}
+
+template <class Type, class OtherType>
+int AVInterleaver::Pop(Type* ptr_packet, StreamQueue<Type>* ptr_queue,
+                       const StreamQueue<OtherType>& other_queue) {
+  if (!ptr_packet) {
+    return kInvalidArg;
+  }
+  if (ptr_queue->packets.empty()) {
+    return kEmpty;
+  }
+  std::unique_ptr<Type> packet = std::move(ptr_queue->packets.front());
+  ptr_queue->packets.pop_front();
+  packet->Swap(ptr_packet);
+  ptr_queue->free_packets.push_back(std::move(packet));
+  ptr_queue->popped_timestamp = OrderTimestamp(*ptr_packet);
+  if (ptr_queue->popped_timestamp < other_queue.popped_timestamp) {
+    ++late_packets_;
+    WEBMLIVE_LOG_EVERY_MS(WARNING, kLogIntervalMs)
+        << "interleaved packet at " << ptr_queue->popped_timestamp
+        << " behind other stream at " << other_queue.popped_timestamp
+        << ", " << late_packets_ << " late packet(s).";
+  }
+  return kSuccess;
+}
+
+template <class Type, class OtherType>
+bool AVInterleaver::Due(const StreamQueue<Type>& queue,
+                        const StreamQueue<OtherType>& other_queue,
+                        Clock::time_point now) const {
+  if (!other_queue.enabled) {
+    return true;
+  }
+  const int64 timestamp = OrderTimestamp(*queue.packets.front());
+
+  // The other stream is in timestamp order, so it cannot produce a packet
+  // before its newest one.
+  if (other_queue.newest_timestamp >= timestamp) {
+    return true;
+  }
+  if (queue.newest_timestamp - timestamp >= max_latency_) {
+    return true;
+  }
+  const int64 idle_time = std::chrono::duration_cast<std::chrono::milliseconds>(
+      now - other_queue.last_push_time).count();
+  if (idle_time >= stream_timeout_) {
+    WEBMLIVE_LOG_EVERY_MS(WARNING, kLogIntervalMs)
+        << "interleaving without a stalled stream, last packet at "
+        << other_queue.newest_timestamp;
+    return true;
+  }
+  return false;
+}
+
+}  // namespace webmlive
@@ -0,0 +1,155 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_AV_INTERLEAVER_H_
+#define WEBMLIVE_ENCODER_AV_INTERLEAVER_H_
+
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "encoder/audio_encoder.h"
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+#include "encoder/video_encoder.h"
+
+namespace webmlive {
+
+// Merges compressed audio and video into a single timestamp ordered sequence
+// for muxing. The encoders produce each stream in timestamp order, so the
+// merge only compares the oldest queued packet of each stream: a packet is
+// released once the other stream has queued a packet at or after its
+// timestamp. Two limits keep a stalled stream from holding up the other:
+// - A packet is released once packets of its own stream that are
+//   |max_latency| milliseconds newer have been queued.
+// - A stream that queues nothing for |stream_timeout| milliseconds of wall
+//   clock time stops holding up the other stream until it resumes.
+// Packets released behind the other stream because of either limit are
+// counted by |late_packets()|.
+//
+// Notes:
+// - Not thread safe.
+// - Queued packets are swapped in and out, never copied, and their storage is
+//   recycled.
+class AVInterleaver {
+ public:
+  enum {
+    kNoMemory = -2,
+    kInvalidArg = -1,
+    kSuccess = 0,
+
+    // |PopAudio| or |PopVideo| found no queued packet.
+    kEmpty = 1,
+  };
+
+  // Packet due for muxing, returned by |NextPacket|.
+  enum PacketType {
+    kNoPacket = 0,
+    kAudioPacket = 1,
+    kVideoPacket = 2,
+  };
+
+  // Default limits, in milliseconds.
+  static const int64 kDefaultMaxLatency = 500;
+  static const int64 kDefaultStreamTimeout = 2000;
+
+  AVInterleaver();
+  ~AVInterleaver();
+
+  // Prepares the interleaver for the enabled streams. Limits less than 1 use
+  // the defaults. Returns |kSuccess| upon success, or |kInvalidArg| when both
+  // streams are disabled.
+  int Init(bool audio_enabled, bool video_enabled,
+           int64 max_latency, int64 stream_timeout);
+
+  // Orders audio packets by the middle of their duration instead of their
+  // start, so that each video packet is released before the audio packet
+  // starting nearest it. |SegmentAligner| relies on this order. Must be
+  // called before the first push.
+  void set_audio_midpoints(bool audio_midpoints) {
+    audio_midpoints_ = audio_midpoints;
+  }
+
+  // Queues the contents of |ptr_buffer| or |ptr_frame|, which receive
+  // recycled storage in return. Returns |kSuccess| upon success.
+  int PushAudio(AudioBuffer* ptr_buffer);
+  int PushVideo(VideoFrame* ptr_frame);
+
+  // Returns the type of the packet due for muxing, or |kNoPacket| when no
+  // packet can be released yet. When |flush| is true every queued packet is
+  // due, in timestamp order.
+  PacketType NextPacket(bool flush);
+
+  // Returns true when packets of only the other stream are queued, so that
+  // |NextPacket()| waits on a packet of this stream to release them.
+  bool WaitingForAudio() const {
+    return audio_.enabled && audio_.packets.empty() && !video_.packets.empty();
+  }
+  bool WaitingForVideo() const {
+    return video_.enabled && video_.packets.empty() && !audio_.packets.empty();
+  }
+
+  // Moves the oldest queued packet of the stream into |ptr_buffer| or
+  // |ptr_frame|. Returns |kSuccess| upon success, or |kEmpty|.
+  int PopAudio(AudioBuffer* ptr_buffer);
+  int PopVideo(VideoFrame* ptr_frame);
+
+  // Number of packets released with a timestamp before that of the last
+  // packet released from the other stream. Audio timestamps are midpoints
+  // with |set_audio_midpoints()|.
+  int64 late_packets() const { return late_packets_; }
+
+ private:
+  typedef std::chrono::steady_clock Clock;
+
+  // Queued packets of a single stream, oldest first. |newest_timestamp| is
+  // the |OrderTimestamp()| of the last packet queued, and |popped_timestamp|
+  // that of the last packet released; both are -1 before the first.
+  template <class Type>
+  struct StreamQueue {
+    StreamQueue()
+        : enabled(false), newest_timestamp(-1), popped_timestamp(-1) {}
+    bool enabled;
+    std::deque<std::unique_ptr<Type>> packets;
+    std::vector<std::unique_ptr<Type>> free_packets;
+    int64 newest_timestamp;
+    int64 popped_timestamp;
+    Clock::time_point last_push_time;
+  };
+
+  // Returns the time by which packets are ordered.
+  int64 OrderTimestamp(const AudioBuffer& buffer) const;
+  int64 OrderTimestamp(const VideoFrame& frame) const {
+    return frame.timestamp();
+  }
+
+  template <class Type>
+  int Push(Type* ptr_packet, StreamQueue<Type>* ptr_queue);
+  template <class Type, class OtherType>
+  int Pop(Type* ptr_packet, StreamQueue<Type>* ptr_queue,
+          const StreamQueue<OtherType>& other_queue);
+
+  // Returns true when the oldest packet of |queue| can be released while
+  // |other_queue| is empty.
+  template <class Type, class OtherType>
+  bool Due(const StreamQueue<Type>& queue,
+           const StreamQueue<OtherType>& other_queue,
+           Clock::time_point now) const;
+
+  StreamQueue<AudioBuffer> audio_;
+  StreamQueue<VideoFrame> video_;
+  int64 max_latency_;
+  int64 stream_timeout_;
+  int64 late_packets_;
+  bool audio_midpoints_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(AVInterleaver);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_AV_INTERLEAVER_H_
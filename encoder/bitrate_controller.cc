@@ -0,0 +1,142 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/bitrate_controller.h"
+
+#include <algorithm>
+
+#include "glog/logging.h"
+
+namespace webmlive {
+
+namespace {
+
+// Multiplicative decrease applied to the video bitrate on congestion.
+const double kDecreaseFactor = 0.85;
+
+// Share of the measured throughput the bitrates may use after congestion.
+const double kThroughputHeadroom = 0.9;
+
+// Additive increase, as a fraction of the video bitrate, applied after
+// |kIdleSamplesForIncrease| samples with an empty upload queue.
+const double kIncreaseFactor = 0.1;
+const int kIdleSamplesForIncrease = 3;
+
+}  // namespace
+
+BitrateController::BitrateController()
+    : video_bitrate_(0),
+      audio_bitrate_(0),
+      throughput_(0),
+      loss_percent_(0),
+      last_time_ms_(-1),
+      last_bytes_uploaded_(0),
+      last_packets_sent_(0),
+      last_packets_lost_(0),
+      idle_samples_(0) {
+}
+
+BitrateController::~BitrateController() {
+}
+
+int BitrateController::Init(const BitrateControllerSettings& settings) {
+  if (settings.min_bitrate < 1 || settings.min_bitrate > settings.max_bitrate ||
+      settings.min_audio_bitrate < 0 ||
+      settings.min_audio_bitrate > settings.max_audio_bitrate) {
+    LOG(ERROR) << "invalid bitrate range.";
+    return kInvalidArg;
+  }
+  settings_ = settings;
+  if (settings_.interval < 1) {
+    settings_.interval = BitrateControllerSettings::kDefaultInterval;
+  }
+  video_bitrate_ = settings_.max_bitrate;
+  audio_bitrate_ = settings_.max_audio_bitrate;
+  throughput_ = 0;
+  loss_percent_ = 0;
+  last_time_ms_ = -1;
+  last_bytes_uploaded_ = 0;
+  last_packets_sent_ = 0;
+  last_packets_lost_ = 0;
+  idle_samples_ = 0;
+  return kSuccess;
+}
+
+bool BitrateController::Update(int64 time_ms, int64 bytes_uploaded,
+                               int32 queued_uploads) {
+  return Update(time_ms, bytes_uploaded, queued_uploads, 0, 0);
+}
+
+bool BitrateController::Update(int64 time_ms, int64 bytes_uploaded,
+                               int32 queued_uploads, int64 packets_sent,
+                               int64 packets_lost) {
+  if (last_time_ms_ < 0) {
+    last_time_ms_ = time_ms;
+    last_bytes_uploaded_ = bytes_uploaded;
+    last_packets_sent_ = packets_sent;
+    last_packets_lost_ = packets_lost;
+    return false;
+  }
+  const int64 elapsed_ms = time_ms - last_time_ms_;
+  if (elapsed_ms < settings_.interval) {
+    return false;
+  }
+  throughput_ = static_cast<int>(
+      (bytes_uploaded - last_bytes_uploaded_) * 8 / elapsed_ms);
+  const int64 sent = packets_sent - last_packets_sent_;
+  loss_percent_ = sent > 0 ?
+      static_cast<int>((packets_lost - last_packets_lost_) * 100 / sent) : 0;
+  last_time_ms_ = time_ms;
+  last_bytes_uploaded_ = bytes_uploaded;
+  last_packets_sent_ = packets_sent;
+  last_packets_lost_ = packets_lost;
+
+  int video_bitrate = video_bitrate_;
+  if (queued_uploads > settings_.max_queued_uploads ||
+      loss_percent_ > settings_.max_loss_percent) {
+    idle_samples_ = 0;
+    const int sustainable =
+        static_cast<int>(throughput_ * kThroughputHeadroom) - audio_bitrate_;
+    video_bitrate = std::min(
+        static_cast<int>(video_bitrate_ * kDecreaseFactor), sustainable);
+  } else if (queued_uploads == 0 &&
+             loss_percent_ * 2 <= settings_.max_loss_percent) {
+    if (++idle_samples_ >= kIdleSamplesForIncrease) {
+      idle_samples_ = 0;
+      video_bitrate += std::max(
+          static_cast<int>(video_bitrate_ * kIncreaseFactor), 1);
+    }
+  } else {
+    idle_samples_ = 0;
+  }
+  video_bitrate = std::max(settings_.min_bitrate,
+                           std::min(video_bitrate, settings_.max_bitrate));
+  if (video_bitrate == video_bitrate_) {
+    return false;
+  }
+  VLOG(1) << "throughput " << throughput_ << " kbps, " << queued_uploads
+          << " queued upload(s), " << loss_percent_
+          << "% loss: video bitrate " << video_bitrate_ << " -> "
+          << video_bitrate << " kbps.";
+  video_bitrate_ = video_bitrate;
+  audio_bitrate_ = AudioBitrateFor(video_bitrate);
+  return true;
+}
+
+int BitrateController::AudioBitrateFor(int video_bitrate) const {
+  const int video_range = settings_.max_bitrate - settings_.min_bitrate;
+  const int audio_range =
+      settings_.max_audio_bitrate - settings_.min_audio_bitrate;
+  if (video_range == 0 || audio_range == 0) {
+    return settings_.max_audio_bitrate;
+  }
+  return settings_.min_audio_bitrate +
+      static_cast<int>(static_cast<int64>(audio_range) *
+                       (video_bitrate - settings_.min_bitrate) / video_range);
+}
+
+}  // namespace webmlive
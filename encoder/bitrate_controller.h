@@ -0,0 +1,132 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_BITRATE_CONTROLLER_H_
+#define WEBMLIVE_ENCODER_BITRATE_CONTROLLER_H_
+
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+
+namespace webmlive {
+
+struct BitrateControllerSettings {
+  // Default time between throughput samples, in milliseconds.
+  static const int kDefaultInterval = 1000;
+
+  // Default number of queued uploads above which the uplink is congested.
+  static const int kDefaultMaxQueuedUploads = 2;
+
+  // Default packet loss above which the uplink is congested, in percent.
+  static const int kDefaultMaxLossPercent = 5;
+
+  BitrateControllerSettings()
+      : min_bitrate(0),
+        max_bitrate(0),
+        min_audio_bitrate(0),
+        max_audio_bitrate(0),
+        interval(kDefaultInterval),
+        max_queued_uploads(kDefaultMaxQueuedUploads),
+        max_loss_percent(kDefaultMaxLossPercent) {}
+
+  // Video bitrate floor and ceiling, in kilobits. The controller starts at
+  // |max_bitrate|.
+  int min_bitrate;
+  int max_bitrate;
+
+  // Audio bitrate floor and ceiling, in kilobits. The audio bitrate keeps
+  // the same position within its range as the video bitrate does within
+  // its own. Equal values keep the audio bitrate fixed.
+  int min_audio_bitrate;
+  int max_audio_bitrate;
+
+  // Time between throughput samples, in milliseconds.
+  int interval;
+
+  // Number of uploads waiting in the upload queue above which the uplink is
+  // treated as congested.
+  int max_queued_uploads;
+
+  // Share of the packets sent reported lost above which the uplink is
+  // treated as congested, in percent. Used with loss feedback only.
+  int max_loss_percent;
+};
+
+// Upload feedback controller. Samples the bytes uploaded and the upload
+// queue depth every |BitrateControllerSettings::interval| milliseconds, and
+// chooses target bitrates that the uplink can sustain:
+// - When more than |max_queued_uploads| uploads are waiting, the video
+//   bitrate drops to the lower of 85% of its current value and 90% of the
+//   throughput measured during the last interval, less the audio bitrate.
+// - The same applies when the transport reports more than
+//   |max_loss_percent| of the packets sent during the interval lost.
+// - After three consecutive samples with an empty queue, and less than half
+//   that loss, the video bitrate rises by 10%.
+// Both are clamped to the configured floor and ceiling. The gap between
+// the conditions provides hysteresis: a queue that is short but not empty
+// holds the bitrate.
+//
+// Notes:
+// - Not thread safe.
+class BitrateController {
+ public:
+  enum {
+    kInvalidArg = -1,
+    kSuccess = 0,
+  };
+
+  BitrateController();
+  ~BitrateController();
+
+  // Copies |settings|. Returns |kSuccess| upon success, or |kInvalidArg|
+  // when a floor is less than 1 or above its ceiling.
+  int Init(const BitrateControllerSettings& settings);
+
+  // Feeds an upload stats sample taken at |time_ms|, a monotonic time in
+  // milliseconds: the total number of bytes uploaded so far, and the number
+  // of uploads waiting in the queue. Returns true when the target bitrates
+  // changed.
+  bool Update(int64 time_ms, int64 bytes_uploaded, int32 queued_uploads);
+
+  // As above, with the loss feedback of a packet transport: the total
+  // number of packets sent, and of those reported lost, so far.
+  bool Update(int64 time_ms, int64 bytes_uploaded, int32 queued_uploads,
+              int64 packets_sent, int64 packets_lost);
+
+  // Current targets, in kilobits.
+  int video_bitrate() const { return video_bitrate_; }
+  int audio_bitrate() const { return audio_bitrate_; }
+
+  // Throughput measured over the last interval, in kilobits per second.
+  int throughput() const { return throughput_; }
+
+  // Packet loss measured over the last interval, in percent.
+  int loss_percent() const { return loss_percent_; }
+
+ private:
+  // Returns the audio bitrate matching |video_bitrate|.
+  int AudioBitrateFor(int video_bitrate) const;
+
+  BitrateControllerSettings settings_;
+  int video_bitrate_;
+  int audio_bitrate_;
+  int throughput_;
+  int loss_percent_;
+
+  // Previous sample. |last_time_ms_| is -1 before the first.
+  int64 last_time_ms_;
+  int64 last_bytes_uploaded_;
+  int64 last_packets_sent_;
+  int64 last_packets_lost_;
+
+  // Consecutive samples taken with an empty upload queue.
+  int idle_samples_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(BitrateController);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_BITRATE_CONTROLLER_H_
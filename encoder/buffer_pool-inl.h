@@ -8,15 +8,165 @@
 #ifndef WEBMLIVE_ENCODER_BUFFER_POOL_INL_H_
 #define WEBMLIVE_ENCODER_BUFFER_POOL_INL_H_
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
 #include <mutex>
 #include <queue>
 
 #include "encoder/basictypes.h"
 #include "encoder/buffer_pool.h"
 #include "encoder/encoder_base.h"
+#include "encoder/memory_accounting.h"
 
 namespace webmlive {
 
+///////////////////////////////////////////////////////////////////////////////
+// BufferPoolCounters
+//
+
+inline BufferPoolCounters::BufferPoolCounters()
+    : start_(std::chrono::steady_clock::now()),
+      memory_subsystem_(-1),
+      commits_(0),
+      full_rejections_(0),
+      growth_allocations_(0),
+      capacity_(0),
+      high_water_mark_(0),
+      commit_time_sum_(0),
+      lock_waits_(0),
+      lock_wait_ns_(0),
+      bytes_committed_(0),
+      peak_bytes_(0),
+      decommits_(0),
+      drops_(0),
+      removal_time_sum_(0),
+      bytes_removed_(0) {
+}
+
+inline void BufferPoolCounters::Reset(int32 capacity) {
+  start_ = std::chrono::steady_clock::now();
+  commits_.store(0);
+  full_rejections_.store(0);
+  growth_allocations_.store(0);
+  capacity_.store(capacity);
+  high_water_mark_.store(0);
+  commit_time_sum_.store(0);
+  lock_waits_.store(0);
+  lock_wait_ns_.store(0);
+  bytes_committed_.store(0);
+  peak_bytes_.store(0);
+  decommits_.store(0);
+  drops_.store(0);
+  removal_time_sum_.store(0);
+  bytes_removed_.store(0);
+}
+
+inline double BufferPoolCounters::ElapsedUs() const {
+  return std::chrono::duration<double, std::micro>(
+      std::chrono::steady_clock::now() - start_).count();
+}
+
+inline void BufferPoolCounters::OnCommit(int32 occupancy, int64 bytes) {
+  Add<int64>(&commits_, 1);
+  Add<double>(&commit_time_sum_, ElapsedUs());
+  if (occupancy > high_water_mark_.load(std::memory_order_relaxed)) {
+    high_water_mark_.store(occupancy, std::memory_order_relaxed);
+  }
+  Add<int64>(&bytes_committed_, bytes);
+  const int64 active_bytes = bytes_committed_.load(std::memory_order_relaxed) -
+                             bytes_removed_.load(std::memory_order_relaxed);
+  if (active_bytes > peak_bytes_.load(std::memory_order_relaxed)) {
+    peak_bytes_.store(active_bytes, std::memory_order_relaxed);
+  }
+  if (memory_subsystem_ >= 0) {
+    MemoryAccountant::Instance()->Add(memory_subsystem_, bytes);
+  }
+}
+
+inline void BufferPoolCounters::OnReject() {
+  Add<int64>(&full_rejections_, 1);
+}
+
+inline void BufferPoolCounters::OnGrow(int32 capacity) {
+  Add<int64>(&growth_allocations_, 1);
+  capacity_.store(capacity, std::memory_order_relaxed);
+}
+
+inline void BufferPoolCounters::OnRemove(int32 count, bool dropped,
+                                         int64 bytes) {
+  if (count <= 0) {
+    return;
+  }
+  Add<int64>(dropped ? &drops_ : &decommits_, count);
+  Add<double>(&removal_time_sum_, count * ElapsedUs());
+  Add<int64>(&bytes_removed_, bytes);
+  if (memory_subsystem_ >= 0) {
+    MemoryAccountant::Instance()->Add(memory_subsystem_, -bytes);
+  }
+}
+
+inline void BufferPoolCounters::OnLockWait(int64 wait_ns) {
+  Add<int64>(&lock_waits_, 1);
+  Add<int64>(&lock_wait_ns_, wait_ns);
+}
+
+inline void BufferPoolCounters::GetStats(int32 occupancy,
+                                         BufferPoolStats* ptr_stats) const {
+  const int64 commits = commits_.load(std::memory_order_relaxed);
+  const int64 decommits = decommits_.load(std::memory_order_relaxed);
+  const int64 drops = drops_.load(std::memory_order_relaxed);
+  ptr_stats->commits = commits;
+  ptr_stats->decommits = decommits;
+  ptr_stats->drops = drops;
+  ptr_stats->full_rejections =
+      full_rejections_.load(std::memory_order_relaxed);
+  ptr_stats->growth_allocations =
+      growth_allocations_.load(std::memory_order_relaxed);
+  ptr_stats->capacity = capacity_.load(std::memory_order_relaxed);
+  ptr_stats->limit = ptr_stats->capacity;
+  ptr_stats->occupancy = occupancy;
+  ptr_stats->high_water_mark =
+      high_water_mark_.load(std::memory_order_relaxed);
+  ptr_stats->lock_waits = lock_waits_.load(std::memory_order_relaxed);
+  ptr_stats->lock_wait_us =
+      lock_wait_ns_.load(std::memory_order_relaxed) / 1000;
+  ptr_stats->bytes = std::max<int64>(
+      bytes_committed_.load(std::memory_order_relaxed) -
+          bytes_removed_.load(std::memory_order_relaxed),
+      0);
+  ptr_stats->peak_bytes = peak_bytes_.load(std::memory_order_relaxed);
+
+  const double elapsed_us = ElapsedUs();
+  const double active_us =
+      (commits - decommits - drops) * elapsed_us -
+      commit_time_sum_.load(std::memory_order_relaxed) +
+      removal_time_sum_.load(std::memory_order_relaxed);
+  ptr_stats->average_occupancy =
+      elapsed_us > 0 ? std::max(active_us, 0.0) / elapsed_us : 0;
+}
+
+// Gives |ptr_buffer| |arena| and a buffer of at least |capacity| bytes from it,
+// and writes the buffer so that its pages are mapped. Returns false when the
+// buffer cannot be allocated.
+template <class Type>
+inline bool PrewarmBufferObject(const std::shared_ptr<MediaArena>& arena,
+                                int32 capacity, Type* ptr_buffer) {
+  ptr_buffer->set_arena(arena);
+  if (ptr_buffer->Reserve(capacity)) {
+    return false;
+  }
+  memset(ptr_buffer->buffer(), 0, ptr_buffer->buffer_capacity());
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// BufferPool
+//
+
 template <class Type>
 inline BufferPool<Type>::~BufferPool() {
   std::lock_guard<std::mutex> lock(mutex_);
@@ -25,6 +175,7 @@ inline BufferPool<Type>::~BufferPool() {
     inactive_buffers_.pop();
   }
   while (!active_buffers_.empty()) {
+    counters_.OnRemove(1, true, active_buffers_.front()->buffer_capacity());
     delete active_buffers_.front();
     active_buffers_.pop();
   }
@@ -48,18 +199,57 @@ inline int BufferPool<Type>::Init(bool allow_growth, int num_buffers) {
     inactive_buffers_.push(ptr_buffer);
   }
   allow_growth_ = allow_growth;
+  counters_.Reset(num_buffers);
   return kSuccess;
 }
 
+// Cycles each new buffer object through |inactive_buffers_| once, prewarming
+// it on the way.
+template <class Type>
+inline int BufferPool<Type>::InitPrewarmed(
+    bool allow_growth, int num_buffers, int32 buffer_capacity,
+    const std::shared_ptr<MediaArena>& arena) {
+  if (buffer_capacity <= 0) {
+    return kInvalidArg;
+  }
+  const int status = Init(allow_growth, num_buffers);
+  if (status) {
+    return status;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (int i = 0; i < num_buffers; ++i) {
+    Type* const ptr_buffer = inactive_buffers_.front();
+    inactive_buffers_.pop();
+    inactive_buffers_.push(ptr_buffer);
+    if (!PrewarmBufferObject(arena, buffer_capacity, ptr_buffer)) {
+      return kNoMemory;
+    }
+  }
+  return kSuccess;
+}
+
+template <class Type>
+inline std::unique_lock<std::mutex> BufferPool<Type>::Lock() {
+  std::unique_lock<std::mutex> lock(mutex_, std::try_to_lock);
+  if (!lock.owns_lock()) {
+    const std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    lock.lock();
+    counters_.OnLockWait(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count());
+  }
+  return lock;
+}
+
 // Obtains lock, copies |ptr_buffer| data into front buffer object from
-// |inactive_buffers_|, and moves the filled buffer object into
-// |active_buffers_|.
+// |inactive_buffers_|, moves the filled buffer object into |active_buffers_|,
+// and wakes any thread waiting in |WaitForActive()|.
 template <class Type>
 inline int BufferPool<Type>::Commit(Type* ptr_buffer) {
   if (!ptr_buffer || !ptr_buffer->buffer()) {
     return kInvalidArg;
   }
-  std::lock_guard<std::mutex> lock(mutex_);
+  std::unique_lock<std::mutex> lock = Lock();
   if (inactive_buffers_.empty()) {
     if (allow_growth_) {
       Type* const ptr_buffer = new (std::nothrow) Type;  // NOLINT
@@ -67,7 +257,11 @@ inline int BufferPool<Type>::Commit(Type* ptr_buffer) {
         return kNoMemory;
       }
       inactive_buffers_.push(ptr_buffer);
+      const size_t capacity =
+          inactive_buffers_.size() + active_buffers_.size();
+      counters_.OnGrow(static_cast<int32>(capacity));
     } else {
+      counters_.OnReject();
       return kFull;
     }
   }
@@ -81,6 +275,9 @@ inline int BufferPool<Type>::Commit(Type* ptr_buffer) {
   // Move the now active buffer object into the active queue.
   inactive_buffers_.pop();
   active_buffers_.push(ptr_pool_buffer);
+  counters_.OnCommit(static_cast<int32>(active_buffers_.size()),
+                     ptr_pool_buffer->buffer_capacity());
+  active_ready_.notify_one();
   return kSuccess;
 }
 
@@ -92,13 +289,14 @@ inline int BufferPool<Type>::Decommit(Type* ptr_buffer) {
   if (!ptr_buffer) {
     return kInvalidArg;
   }
-  std::lock_guard<std::mutex> lock(mutex_);
+  std::unique_lock<std::mutex> lock = Lock();
   if (active_buffers_.empty()) {
     return kEmpty;
   }
 
   // Put active buffer data in user buffer.
   Type* const ptr_active_buffer = active_buffers_.front();
+  const int64 bytes = ptr_active_buffer->buffer_capacity();
   if (Exchange(ptr_active_buffer, ptr_buffer)) {
     return kNoMemory;
   }
@@ -106,16 +304,50 @@ inline int BufferPool<Type>::Decommit(Type* ptr_buffer) {
   // Put the now inactive buffer back in the pool.
   active_buffers_.pop();
   inactive_buffers_.push(ptr_active_buffer);
+  counters_.OnRemove(1, false, bytes);
+  inactive_ready_.notify_one();
+  return kSuccess;
+}
+
+template <class Type>
+inline int BufferPool<Type>::DecommitBatch(int32 max_buffers,
+                                           Type* ptr_buffers,
+                                           int32* ptr_count) {
+  if (!ptr_buffers || !ptr_count || max_buffers < 1) {
+    return kInvalidArg;
+  }
+  *ptr_count = 0;
+  std::unique_lock<std::mutex> lock = Lock();
+  int32 count = 0;
+  int64 bytes = 0;
+  while (count < max_buffers && !active_buffers_.empty()) {
+    Type* const ptr_active_buffer = active_buffers_.front();
+    bytes += ptr_active_buffer->buffer_capacity();
+    Exchange(ptr_active_buffer, &ptr_buffers[count++]);
+    active_buffers_.pop();
+    inactive_buffers_.push(ptr_active_buffer);
+  }
+  if (count == 0) {
+    return kEmpty;
+  }
+  counters_.OnRemove(count, false, bytes);
+  inactive_ready_.notify_all();
+  *ptr_count = count;
   return kSuccess;
 }
 
 template <class Type>
 inline void BufferPool<Type>::Flush() {
   std::lock_guard<std::mutex> lock(mutex_);
+  const int32 count = static_cast<int32>(active_buffers_.size());
+  int64 bytes = 0;
   while (!active_buffers_.empty()) {
+    bytes += active_buffers_.front()->buffer_capacity();
     inactive_buffers_.push(active_buffers_.front());
     active_buffers_.pop();
   }
+  counters_.OnRemove(count, true, bytes);
+  inactive_ready_.notify_all();
 }
 
 template <class Type>
@@ -123,14 +355,7 @@ inline int BufferPool<Type>::Exchange(Type* ptr_source, Type* ptr_target) {
   if (!ptr_source || !ptr_target) {
     return kInvalidArg;
   }
-  if (ptr_target->buffer()) {
-    ptr_target->Swap(ptr_source);
-  } else {
-    const int32 status = ptr_source->Clone(ptr_target);
-    if (status) {
-      return kNoMemory;
-    }
-  }
+  ptr_target->Swap(ptr_source);
   return kSuccess;
 }
 
@@ -152,8 +377,11 @@ template <class Type>
 inline void BufferPool<Type>::DropActiveBuffer() {
   std::lock_guard<std::mutex> lock(mutex_);
   if (!active_buffers_.empty()) {
+    const int64 bytes = active_buffers_.front()->buffer_capacity();
     inactive_buffers_.push(active_buffers_.front());
     active_buffers_.pop();
+    counters_.OnRemove(1, true, bytes);
+    inactive_ready_.notify_one();
   }
 }
 
@@ -163,6 +391,283 @@ inline bool BufferPool<Type>::IsEmpty() const {
   return active_buffers_.empty();
 }
 
+// Obtains lock and waits on |active_ready_| until |active_buffers_| is not
+// empty or |timeout_ms| expires.
+template <class Type>
+inline int BufferPool<Type>::WaitForActive(int timeout_ms) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  const bool have_active =
+      active_ready_.wait_for(lock, std::chrono::milliseconds(timeout_ms),
+                             [this] { return !active_buffers_.empty(); });
+  return have_active ? kSuccess : kEmpty;
+}
+
+// Obtains lock and waits on |inactive_ready_| until |inactive_buffers_| is not
+// empty or |timeout_ms| expires.
+template <class Type>
+inline int BufferPool<Type>::WaitForInactive(int timeout_ms) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  const bool have_inactive =
+      inactive_ready_.wait_for(lock, std::chrono::milliseconds(timeout_ms),
+                               [this] {
+                                 return allow_growth_ ||
+                                        !inactive_buffers_.empty();
+                               });
+  return have_inactive ? kSuccess : kFull;
+}
+
+template <class Type>
+inline void BufferPool<Type>::GetStats(BufferPoolStats* ptr_stats) const {
+  if (!ptr_stats) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  counters_.GetStats(static_cast<int32>(active_buffers_.size()), ptr_stats);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SpscBufferPool
+//
+
+template <class Type>
+inline SpscBufferPool<Type>::~SpscBufferPool() {
+  if (slots_) {
+    const int32 head = head_.load(std::memory_order_relaxed);
+    const int32 tail = tail_.load(std::memory_order_relaxed);
+    counters_.OnRemove(tail >= head ? tail - head : tail + capacity_ - head,
+                       true, SlotBytes(head, tail));
+  }
+}
+
+template <class Type>
+inline int SpscBufferPool<Type>::Init(bool allow_growth, int num_buffers) {
+  if (num_buffers <= 0 || allow_growth) {
+    return kInvalidArg;
+  }
+  if (slots_) {
+    return kAlreadyInitialized;
+  }
+  const int32 capacity = num_buffers + 1;
+  slots_.reset(new (std::nothrow) Type[capacity]);  // NOLINT
+  if (!slots_) {
+    return kNoMemory;
+  }
+  capacity_ = capacity;
+  limit_.store(num_buffers);
+  head_.store(0);
+  tail_.store(0);
+  counters_.Reset(num_buffers);
+  return kSuccess;
+}
+
+template <class Type>
+inline void SpscBufferPool<Type>::set_limit(int32 limit) {
+  limit_.store(std::max(1, std::min(limit, Capacity())),
+               std::memory_order_relaxed);
+  // Waiting producers may have room now.
+  inactive_ready_.notify_one();
+}
+
+template <class Type>
+inline int SpscBufferPool<Type>::InitPrewarmed(
+    bool allow_growth, int num_buffers, int32 buffer_capacity,
+    const std::shared_ptr<MediaArena>& arena) {
+  if (buffer_capacity <= 0) {
+    return kInvalidArg;
+  }
+  const int status = Init(allow_growth, num_buffers);
+  if (status) {
+    return status;
+  }
+  for (int32 i = 0; i < capacity_; ++i) {
+    if (!PrewarmBufferObject(arena, buffer_capacity, &slots_[i])) {
+      return kNoMemory;
+    }
+  }
+  return kSuccess;
+}
+
+// Copies |ptr_buffer| into the slot at |tail_|, and then publishes the slot to
+// the consumer by advancing |tail_| with release semantics.
+template <class Type>
+inline int SpscBufferPool<Type>::Commit(Type* ptr_buffer) {
+  if (!ptr_buffer || !ptr_buffer->buffer()) {
+    return kInvalidArg;
+  }
+  if (!slots_) {
+    return kNoBuffers;
+  }
+  const int32 tail = tail_.load(std::memory_order_relaxed);
+  const int32 next_tail = NextIndex(tail);
+  const int32 head = head_.load(std::memory_order_acquire);
+  const int32 active = (tail >= head) ? tail - head : tail + capacity_ - head;
+  if (next_tail == head || active >= limit()) {
+    counters_.OnReject();
+    return kFull;
+  }
+  if (Exchange(ptr_buffer, &slots_[tail])) {
+    return kNoMemory;
+  }
+  const int64 bytes = slots_[tail].buffer_capacity();
+  tail_.store(next_tail, std::memory_order_release);
+  counters_.OnCommit(next_tail >= head ? next_tail - head :
+                                         next_tail + capacity_ - head,
+                     bytes);
+  active_ready_.notify_one();
+  return kSuccess;
+}
+
+// Copies the slot at |head_| to |ptr_buffer|, and then returns the slot to the
+// producer by advancing |head_| with release semantics.
+template <class Type>
+inline int SpscBufferPool<Type>::Decommit(Type* ptr_buffer) {
+  if (!ptr_buffer) {
+    return kInvalidArg;
+  }
+  const int32 head = head_.load(std::memory_order_relaxed);
+  if (head == tail_.load(std::memory_order_acquire)) {
+    return kEmpty;
+  }
+  const int64 bytes = slots_[head].buffer_capacity();
+  if (Exchange(&slots_[head], ptr_buffer)) {
+    return kNoMemory;
+  }
+  head_.store(NextIndex(head), std::memory_order_release);
+  counters_.OnRemove(1, false, bytes);
+  inactive_ready_.notify_one();
+  return kSuccess;
+}
+
+template <class Type>
+inline int SpscBufferPool<Type>::DecommitBatch(int32 max_buffers,
+                                               Type* ptr_buffers,
+                                               int32* ptr_count) {
+  if (!ptr_buffers || !ptr_count || max_buffers < 1) {
+    return kInvalidArg;
+  }
+  *ptr_count = 0;
+  int32 head = head_.load(std::memory_order_relaxed);
+  const int32 tail = tail_.load(std::memory_order_acquire);
+  if (head == tail) {
+    return kEmpty;
+  }
+  int32 count = 0;
+  int64 bytes = 0;
+  for (; count < max_buffers && head != tail; head = NextIndex(head)) {
+    bytes += slots_[head].buffer_capacity();
+    Exchange(&slots_[head], &ptr_buffers[count++]);
+  }
+  head_.store(head, std::memory_order_release);
+  counters_.OnRemove(count, false, bytes);
+  inactive_ready_.notify_one();
+  *ptr_count = count;
+  return kSuccess;
+}
+
+template <class Type>
+inline void SpscBufferPool<Type>::Flush() {
+  const int32 head = head_.load(std::memory_order_relaxed);
+  const int32 tail = tail_.load(std::memory_order_acquire);
+  const int64 bytes = SlotBytes(head, tail);
+  head_.store(tail, std::memory_order_release);
+  counters_.OnRemove(tail >= head ? tail - head : tail + capacity_ - head,
+                     true, bytes);
+  inactive_ready_.notify_one();
+}
+
+template <class Type>
+inline int SpscBufferPool<Type>::Exchange(Type* ptr_source, Type* ptr_target) {
+  if (!ptr_source || !ptr_target) {
+    return kInvalidArg;
+  }
+  ptr_target->Swap(ptr_source);
+  return kSuccess;
+}
+
+template <class Type>
+inline int64 SpscBufferPool<Type>::SlotBytes(int32 head, int32 tail) const {
+  int64 bytes = 0;
+  for (int32 index = head; index != tail; index = NextIndex(index)) {
+    bytes += slots_[index].buffer_capacity();
+  }
+  return bytes;
+}
+
+template <class Type>
+inline int SpscBufferPool<Type>::ActiveBufferTimestamp(int64* ptr_timestamp) {
+  if (!ptr_timestamp) {
+    return kInvalidArg;
+  }
+  const int32 head = head_.load(std::memory_order_relaxed);
+  if (head == tail_.load(std::memory_order_acquire)) {
+    return kEmpty;
+  }
+  *ptr_timestamp = slots_[head].timestamp();
+  return kSuccess;
+}
+
+template <class Type>
+inline void SpscBufferPool<Type>::DropActiveBuffer() {
+  const int32 head = head_.load(std::memory_order_relaxed);
+  if (head != tail_.load(std::memory_order_acquire)) {
+    const int64 bytes = slots_[head].buffer_capacity();
+    head_.store(NextIndex(head), std::memory_order_release);
+    counters_.OnRemove(1, true, bytes);
+    inactive_ready_.notify_one();
+  }
+}
+
+template <class Type>
+inline bool SpscBufferPool<Type>::IsEmpty() const {
+  return head_.load(std::memory_order_acquire) ==
+         tail_.load(std::memory_order_acquire);
+}
+
+template <class Type>
+inline bool SpscBufferPool<Type>::IsFull() const {
+  return ActiveCount() >= limit();
+}
+
+template <class Type>
+inline int32 SpscBufferPool<Type>::ActiveCount() const {
+  const int32 head = head_.load(std::memory_order_acquire);
+  const int32 tail = tail_.load(std::memory_order_acquire);
+  return (tail >= head) ? tail - head : tail + capacity_ - head;
+}
+
+template <class Type>
+inline int SpscBufferPool<Type>::WaitForActive(int timeout_ms) {
+  std::unique_lock<std::mutex> lock(wait_mutex_);
+  const bool have_active =
+      active_ready_.wait_for(lock, std::chrono::milliseconds(timeout_ms),
+                             [this] { return !IsEmpty(); });
+  return have_active ? kSuccess : kEmpty;
+}
+
+template <class Type>
+inline void SpscBufferPool<Type>::WaitForCommit(int timeout_ms) {
+  std::unique_lock<std::mutex> lock(wait_mutex_);
+  active_ready_.wait_for(lock, std::chrono::milliseconds(timeout_ms));
+}
+
+template <class Type>
+inline int SpscBufferPool<Type>::WaitForInactive(int timeout_ms) {
+  std::unique_lock<std::mutex> lock(wait_mutex_);
+  const bool have_inactive =
+      inactive_ready_.wait_for(lock, std::chrono::milliseconds(timeout_ms),
+                               [this] { return !IsFull(); });
+  return have_inactive ? kSuccess : kFull;
+}
+
+template <class Type>
+inline void SpscBufferPool<Type>::GetStats(BufferPoolStats* ptr_stats) const {
+  if (!ptr_stats) {
+    return;
+  }
+  counters_.GetStats(ActiveCount(), ptr_stats);
+  ptr_stats->limit = limit();
+}
+
 }  // namespace webmlive
 
 #endif  // WEBMLIVE_ENCODER_BUFFER_POOL_INL_H_
@@ -8,20 +8,165 @@
 #ifndef WEBMLIVE_ENCODER_BUFFER_POOL_H_
 #define WEBMLIVE_ENCODER_BUFFER_POOL_H_
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
 #include <mutex>
 #include <queue>
 
 #include "encoder/basictypes.h"
 #include "encoder/encoder_base.h"
+#include "encoder/media_arena.h"
 
 namespace webmlive {
 
+// Counters of a |BufferPool| or |SpscBufferPool|, returned by their
+// |GetStats()| methods.
+struct BufferPoolStats {
+  BufferPoolStats()
+      : commits(0),
+        decommits(0),
+        drops(0),
+        full_rejections(0),
+        growth_allocations(0),
+        capacity(0),
+        limit(0),
+        occupancy(0),
+        high_water_mark(0),
+        average_occupancy(0),
+        lock_waits(0),
+        lock_wait_us(0),
+        bytes(0),
+        peak_bytes(0) {}
+
+  // Buffer objects committed, decommitted, and dropped by |Flush()| or
+  // |DropActiveBuffer()|.
+  int64 commits;
+  int64 decommits;
+  int64 drops;
+
+  // Commits that returned |kFull|, and buffer objects allocated by |Commit()|
+  // in pools that allow growth.
+  int64 full_rejections;
+  int64 growth_allocations;
+
+  // Buffer objects held by the pool, those active now, and the most active at
+  // once.
+  int32 capacity;
+
+  // Active buffer objects allowed by |SpscBufferPool::set_limit()|;
+  // |capacity| for other pools.
+  int32 limit;
+  int32 occupancy;
+  int32 high_water_mark;
+
+  // Active buffer objects averaged over the time since |Init()|.
+  double average_occupancy;
+
+  // Lock acquisitions that had to wait for another thread, and the total time
+  // spent waiting, in microseconds. Always 0 for |SpscBufferPool|.
+  int64 lock_waits;
+  int64 lock_wait_us;
+
+  // Buffer capacity of the active buffer objects, in bytes, and the most at
+  // once.
+  int64 bytes;
+  int64 peak_bytes;
+};
+
+// Occupancy accounting for the buffer pools. Producer side events
+// (|OnCommit()|, |OnReject()|, |OnGrow()|) and consumer side events
+// (|OnRemove()|) each have one writer at a time, either because the pool is
+// single producer and single consumer or because the pool's lock is held, so
+// counters are advanced with relaxed loads and stores instead of atomic
+// read-modify-write operations. |GetStats()| may be called from any thread.
+//
+// The time-weighted occupancy takes no clock reads beyond one per event: the
+// integral of the occupancy since |Reset()| is the sum of the time each buffer
+// object committed has been active, which is the commit count times the
+// elapsed time less the sum of commit times, minus the same terms for
+// removals.
+class BufferPoolCounters {
+ public:
+  BufferPoolCounters();
+
+  // Clears the counters, and starts the occupancy average now.
+  void Reset(int32 capacity);
+
+  // Also accounts the bytes of active buffer objects to |subsystem| of
+  // |MemoryAccountant|. Must be called before the pool is shared.
+  void set_memory_subsystem(int subsystem) { memory_subsystem_ = subsystem; }
+
+  // Producer: a buffer object holding |bytes| was committed, leaving
+  // |occupancy| active.
+  void OnCommit(int32 occupancy, int64 bytes);
+
+  // Producer: a commit returned |kFull|.
+  void OnReject();
+
+  // Producer: a buffer object was allocated, growing the pool to |capacity|.
+  void OnGrow(int32 capacity);
+
+  // Consumer: |count| buffer objects holding |bytes| were decommitted, or
+  // dropped when |dropped| is true.
+  void OnRemove(int32 count, bool dropped, int64 bytes);
+
+  // A lock acquisition waited |wait_ns| nanoseconds.
+  void OnLockWait(int64 wait_ns);
+
+  // Copies the counters to |ptr_stats|, with |occupancy| active buffer
+  // objects.
+  void GetStats(int32 occupancy, BufferPoolStats* ptr_stats) const;
+
+ private:
+  // Returns the time since |Reset()|, in microseconds.
+  double ElapsedUs() const;
+
+  template <typename T>
+  static void Add(std::atomic<T>* ptr_counter, T value) {
+    ptr_counter->store(ptr_counter->load(std::memory_order_relaxed) + value,
+                       std::memory_order_relaxed);
+  }
+
+  // Written by |Reset()| and |set_memory_subsystem()| only, before the pool
+  // is shared. |memory_subsystem_| is -1 when bytes are not accounted.
+  std::chrono::steady_clock::time_point start_;
+  int memory_subsystem_;
+
+  // Producer side.
+  std::atomic<int64> commits_;
+  std::atomic<int64> full_rejections_;
+  std::atomic<int64> growth_allocations_;
+  std::atomic<int32> capacity_;
+  std::atomic<int32> high_water_mark_;
+  std::atomic<double> commit_time_sum_;
+  std::atomic<int64> lock_waits_;
+  std::atomic<int64> lock_wait_ns_;
+  std::atomic<int64> bytes_committed_;
+  std::atomic<int64> peak_bytes_;
+
+  // Consumer side, kept off of the producer's cache line.
+  alignas(64) std::atomic<int64> decommits_;
+  std::atomic<int64> drops_;
+  std::atomic<double> removal_time_sum_;
+  std::atomic<int64> bytes_removed_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(BufferPoolCounters);
+};
+
 // Buffer pooling object used to pass data between threads. In order to be
 // managed by this class Buffer objects must implement the following methods:
 //   uint8* buffer() const;
+//   int32 buffer_capacity() const;
 //   int64 timestamp() const;
-//   int Clone(Type*);
-//   int Swap(Type*);
+//   void Swap(Type*);
+// |Swap| must accept objects with NULL buffers. Data moves between the
+// caller's objects and the pool's by swapping storage, so once every object
+// has a buffer large enough for its data no allocation takes place.
+// |InitPrewarmed()| reaches that state at |Init()| time, and additionally
+// requires:
+//   void set_arena(const std::shared_ptr<MediaArena>&);
+//   int Reserve(int32);
 template <class Type>
 class BufferPool {
  public:
@@ -51,18 +196,33 @@ class BufferPool {
   // already been called.
   int Init(bool allow_growth, int num_buffers);
 
-  // Grabs a buffer object pointer from |inactive_buffers_|, copies the data
-  // from |ptr_buffer|, and pushes it into |active_buffers_|. Returns |kSuccess|
-  // when able to store the data. Returns |kFull| when |inactive_buffers_| is
-  // empty AND |allow_growth_| is false. Avoids copy using |Type::Swap| whenever
-  // possible.
+  // Same as |Init()|, and then gives each buffer object |arena| and a buffer
+  // of at least |buffer_capacity| bytes from it. The buffers are written once
+  // so that their pages are mapped, and the first commits swap in storage
+  // that is ready for frames of the negotiated format instead of empty
+  // objects. Returns |kNoMemory| when the buffers cannot be allocated.
+  int InitPrewarmed(bool allow_growth, int num_buffers, int32 buffer_capacity,
+                    const std::shared_ptr<MediaArena>& arena);
+
+  // Grabs a buffer object pointer from |inactive_buffers_|, swaps the data
+  // from |ptr_buffer| into it, and pushes it into |active_buffers_|. Returns
+  // |kSuccess| when able to store the data. Returns |kFull| when
+  // |inactive_buffers_| is empty AND |allow_growth_| is false. |ptr_buffer| is
+  // left holding the pool object's previous storage, which may be NULL.
   int Commit(Type* ptr_buffer);
 
-  // Grabs a buffer object from |active_buffers_| and copies it to |ptr_buffer|.
-  // Returns |kSuccess| when able to copy the buffer. Returns |kEmpty| when
+  // Grabs a buffer object from |active_buffers_| and swaps it into
+  // |ptr_buffer|. Returns |kSuccess| when successful. Returns |kEmpty| when
   // |active_buffers_| contains no buffer objects.
   int Decommit(Type* ptr_buffer);
 
+  // Same as |Decommit()|, but swaps up to |max_buffers| buffer objects, oldest
+  // first, into the array at |ptr_buffers| under one lock acquisition, and
+  // stores the number swapped in |ptr_count|. Counters are updated and
+  // waiters signalled once per batch. Returns |kInvalidArg| when an argument
+  // is NULL or |max_buffers| is less than 1.
+  int DecommitBatch(int32 max_buffers, Type* ptr_buffers, int32* ptr_count);
+
   // Drops all queued buffer objects by moving them all from |active_buffers_|
   // to |inactive_buffers_|.
   void Flush();
@@ -80,19 +240,193 @@ class BufferPool {
   // Returns true when |active_buffers_| is empty.
   bool IsEmpty() const;
 
+  // Blocks the calling thread until a buffer object is available in
+  // |active_buffers_|, or until |timeout_ms| milliseconds pass. Returns
+  // |kSuccess| when a buffer is available, or |kEmpty| when the wait times out.
+  int WaitForActive(int timeout_ms);
+
+  // Blocks the calling thread until a buffer object is available in
+  // |inactive_buffers_|, or until |timeout_ms| milliseconds pass. Returns
+  // |kSuccess| when |Commit()| can store a buffer without growing the pool, or
+  // when growth is allowed. Returns |kFull| when the wait times out.
+  int WaitForInactive(int timeout_ms);
+
+  // Copies the pool counters to |ptr_stats|.
+  void GetStats(BufferPoolStats* ptr_stats) const;
+
+  // Accounts the bytes of active buffer objects to |subsystem| of
+  // |MemoryAccountant|. Must be called before the pool is shared.
+  void set_memory_subsystem(int subsystem) {
+    counters_.set_memory_subsystem(subsystem);
+  }
+
  private:
-  // Moves or copies |ptr_source| to |ptr_target| using |Type::Swap| or
-  // |Type::Clone| based on presence of non-NULL buffer pointer in
-  // |ptr_target|.
+  // Moves |ptr_source| to |ptr_target| using |Type::Swap|. Never allocates.
   int Exchange(Type* ptr_source, Type* ptr_target);
 
+  // Locks |mutex_|, and counts the time spent waiting when another thread
+  // holds it.
+  std::unique_lock<std::mutex> Lock();
+
   bool allow_growth_;
+  BufferPoolCounters counters_;
   mutable std::mutex mutex_;
   std::queue<Type*> inactive_buffers_;
   std::queue<Type*> active_buffers_;
+
+  // Signalled by |Commit()| each time a buffer object is pushed into
+  // |active_buffers_|.
+  std::condition_variable active_ready_;
+
+  // Signalled each time a buffer object is returned to |inactive_buffers_|.
+  std::condition_variable inactive_ready_;
   WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(BufferPool);
 };
 
+// Single producer/single consumer variant of |BufferPool|. Buffer objects are
+// stored in a fixed capacity ring, and |Commit()|/|Decommit()| synchronize
+// through atomic head and tail indices instead of a mutex. Exactly one thread
+// may call |Commit()|, and exactly one thread may call the consumer methods
+// (|Decommit()|, |Flush()|, |ActiveBufferTimestamp()|, |DropActiveBuffer()|).
+// |IsEmpty()| may be called from either thread.
+//
+// |WaitForActive()| and |WaitForInactive()| sleep on condition variables that
+// the other side signals without taking the wait mutex, so a wakeup can be
+// missed; waits are always bounded by their timeout.
+template <class Type>
+class SpscBufferPool {
+ public:
+  enum {
+    kAlreadyInitialized = BufferPool<Type>::kAlreadyInitialized,
+    kNoBuffers = BufferPool<Type>::kNoBuffers,
+    kNoMemory = BufferPool<Type>::kNoMemory,
+    kInvalidArg = BufferPool<Type>::kInvalidArg,
+    kSuccess = BufferPool<Type>::kSuccess,
+    kEmpty = BufferPool<Type>::kEmpty,
+    kFull = BufferPool<Type>::kFull,
+  };
+
+  static const int32 kDefaultBufferCount =
+      BufferPool<Type>::kDefaultBufferCount;
+
+  // Size used to keep the producer and consumer indices on separate cache
+  // lines.
+  static const int kCacheLineSize = 64;
+
+  SpscBufferPool() : capacity_(0), limit_(0), head_(0), tail_(0) {}
+  ~SpscBufferPool();
+
+  // Allocates storage for |num_buffers| buffer objects and returns |kSuccess|.
+  // Returns |kInvalidArg| when |num_buffers| is <= 0, or when |allow_growth|
+  // is true: the ring cannot grow without locking. Returns
+  // |kAlreadyInitialized| when |Init()| has already been called.
+  int Init(bool allow_growth, int num_buffers);
+
+  // Same as |BufferPool::InitPrewarmed()|. Every slot of the ring is
+  // prewarmed, including the one kept free to tell a full ring from an empty
+  // one.
+  int InitPrewarmed(bool allow_growth, int num_buffers, int32 buffer_capacity,
+                    const std::shared_ptr<MediaArena>& arena);
+
+  // Producer: swaps |ptr_buffer| into the ring. Returns |kFull| without
+  // blocking when the ring is full.
+  int Commit(Type* ptr_buffer);
+
+  // Consumer: swaps the oldest buffer object in the ring into |ptr_buffer|.
+  // Returns |kEmpty| when the ring is empty.
+  int Decommit(Type* ptr_buffer);
+
+  // Consumer: same as |BufferPool::DecommitBatch()|. The head index is
+  // published once for the whole batch.
+  int DecommitBatch(int32 max_buffers, Type* ptr_buffers, int32* ptr_count);
+
+  // Consumer: drops all buffer objects in the ring.
+  void Flush();
+
+  // Consumer: writes the timestamp of the buffer available in the next call to
+  // |Decommit()| to |ptr_timestamp|. Returns |kEmpty| when the ring is empty.
+  int ActiveBufferTimestamp(int64* ptr_timestamp);
+
+  // Consumer: drops the oldest buffer object in the ring.
+  void DropActiveBuffer();
+
+  // Returns true when the ring is empty.
+  bool IsEmpty() const;
+
+  // Returns true when |limit()| buffer objects are active and |Commit()|
+  // would return |kFull|.
+  bool IsFull() const;
+
+  // Returns the number of buffer objects in the ring. May be called from
+  // either thread; the count may change immediately.
+  int32 ActiveCount() const;
+
+  // Returns the number of buffer objects the ring can hold.
+  int32 Capacity() const { return capacity_ > 0 ? capacity_ - 1 : 0; }
+
+  // Sets the number of active buffer objects beyond which |Commit()| returns
+  // |kFull|, clamped to [1, |Capacity()|]. Buffer objects already active
+  // above a lowered limit stay until decommitted. May be called from either
+  // thread. |Init()| sets the limit to |Capacity()|.
+  void set_limit(int32 limit);
+  int32 limit() const { return limit_.load(std::memory_order_relaxed); }
+
+  // Consumer: waits up to |timeout_ms| for a buffer object. Returns |kSuccess|
+  // when one is available, or |kEmpty| on timeout.
+  int WaitForActive(int timeout_ms);
+
+  // Consumer: waits up to |timeout_ms| for the next |Commit()|, also when
+  // buffer objects are already active. May return early.
+  void WaitForCommit(int timeout_ms);
+
+  // Producer: waits up to |timeout_ms| for a free slot. Returns |kSuccess|
+  // when one is available, or |kFull| on timeout.
+  int WaitForInactive(int timeout_ms);
+
+  // Copies the pool counters to |ptr_stats|. May be called from any thread.
+  void GetStats(BufferPoolStats* ptr_stats) const;
+
+  // Same as |BufferPool::set_memory_subsystem()|.
+  void set_memory_subsystem(int subsystem) {
+    counters_.set_memory_subsystem(subsystem);
+  }
+
+ private:
+  // Returns the ring index following |index|.
+  int32 NextIndex(int32 index) const {
+    return (index + 1 == capacity_) ? 0 : index + 1;
+  }
+
+  // Same as |BufferPool::Exchange()|.
+  int Exchange(Type* ptr_source, Type* ptr_target);
+
+  // Returns the buffer capacity of the slots from |head| up to |tail|.
+  int64 SlotBytes(int32 head, int32 tail) const;
+
+  // Ring storage: |capacity_| is one more than the number of usable buffer
+  // objects so that a full ring can be distinguished from an empty ring.
+  std::unique_ptr<Type[]> slots_;
+  int32 capacity_;
+
+  // See |set_limit()|.
+  std::atomic<int32> limit_;
+
+  // Index of the oldest active slot. Written only by the consumer.
+  alignas(kCacheLineSize) std::atomic<int32> head_;
+
+  // Index of the next free slot. Written only by the producer.
+  alignas(kCacheLineSize) std::atomic<int32> tail_;
+
+  // Commit, removal and occupancy counters.
+  BufferPoolCounters counters_;
+
+  // Wakeup support for |WaitForActive()| and |WaitForInactive()|.
+  alignas(kCacheLineSize) std::mutex wait_mutex_;
+  std::condition_variable active_ready_;
+  std::condition_variable inactive_ready_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(SpscBufferPool);
+};
+
 }  // namespace webmlive
 
 #endif  // WEBMLIVE_ENCODER_BUFFER_POOL_H_
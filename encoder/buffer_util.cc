@@ -7,38 +7,204 @@
 // be found in the AUTHORS file in the root of the source tree.
 #include "encoder/buffer_util.h"
 
+#include <algorithm>
 #include <mutex>
 #include <thread>
 
+#include "encoder/memory_accounting.h"
 #include "encoder/webm_buffer_parser.h"
 #include "glog/logging.h"
 
 namespace webmlive {
 
+BufferQueue::~BufferQueue() {
+  // Buffers not released by their users are lost with the queue.
+  AddBytes(-bytes_);
+  while (!buffer_q_.empty()) {
+    delete buffer_q_.front();
+    buffer_q_.pop_front();
+  }
+  for (size_t i = 0; i < free_buffers_.size(); ++i) {
+    delete free_buffers_[i];
+  }
+}
+
+void BufferQueue::set_max_bytes(int64 max_bytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  max_bytes_ = std::max(max_bytes, static_cast<int64>(0));
+}
+
 bool BufferQueue::EnqueueBuffer(const std::string& id,
                                 const uint8* data, int length) {
-  Buffer* buffer = new (std::nothrow) Buffer;
+  std::lock_guard<std::mutex> lock(mutex_);
+  Buffer* buffer = AllocBuffer(length);
   if (!buffer) {
-    LOG(ERROR) << "No memory in BufferQueue::EnqueueBuffer";
     return false;
   }
   buffer->id = id;
-  buffer->data.insert(buffer->data.begin(), data, data + length);
+  buffer->data.assign(data, data + length);
+  PushBuffer(buffer, length);
+  return true;
+}
+
+bool BufferQueue::EnqueueChunk(const SharedWebmChunk& chunk) {
+  if (!chunk) {
+    LOG(ERROR) << "NULL chunk in BufferQueue::EnqueueChunk";
+    return false;
+  }
   std::lock_guard<std::mutex> lock(mutex_);
-  buffer_q_.push(buffer);
+  Buffer* buffer = AllocBuffer(chunk->length());
+  if (!buffer) {
+    return false;
+  }
+  buffer->id = chunk->id();
+  buffer->chunk = chunk;
+  PushBuffer(buffer, chunk->length());
   return true;
 }
 
 BufferQueue::Buffer* BufferQueue::DequeueBuffer() {
-  BufferQueue::Buffer* buffer = NULL;
-  std::unique_lock<std::mutex> lock(mutex_, std::try_to_lock);
-  if (lock.owns_lock()) {
-    buffer = buffer_q_.front();
-    buffer_q_.pop();
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (buffer_q_.empty()) {
+    return NULL;
+  }
+  return TakeBuffer(buffer_q_.begin());
+}
+
+BufferQueue::Buffer* BufferQueue::DequeueBuffer(
+    const PriorityFunction& priority) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (buffer_q_.empty()) {
+    return NULL;
+  }
+  std::deque<Buffer*>::iterator best = buffer_q_.begin();
+  double best_priority = priority(**best);
+  for (std::deque<Buffer*>::iterator iter = best + 1;
+       iter != buffer_q_.end(); ++iter) {
+    const double buffer_priority = priority(**iter);
+    if (buffer_priority < best_priority) {
+      best = iter;
+      best_priority = buffer_priority;
+    }
+  }
+  return TakeBuffer(best);
+}
+
+BufferQueue::Buffer* BufferQueue::DequeueBufferIf(const MatchFunction& match) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (buffer_q_.empty() || !match(*buffer_q_.front())) {
+    return NULL;
+  }
+  return TakeBuffer(buffer_q_.begin());
+}
+
+void BufferQueue::ForEachBuffer(const VisitFunction& visit) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (std::deque<Buffer*>::const_iterator iter = buffer_q_.begin();
+       iter != buffer_q_.end(); ++iter) {
+    visit(**iter);
+  }
+}
+
+// Drops the chunk reference and clears the data, keeping its capacity up to
+// |kMaxRetainedBytes|, before storing |ptr_buffer| for reuse. Nodes beyond
+// those the queue can hold are deleted.
+void BufferQueue::ReleaseBuffer(Buffer* ptr_buffer) {
+  if (!ptr_buffer) {
+    return;
+  }
+  const int64 length = ptr_buffer->length();
+  ptr_buffer->id.clear();
+  ptr_buffer->chunk.reset();
+  if (ptr_buffer->data.capacity() >
+      static_cast<size_t>(kMaxRetainedBytes)) {
+    std::vector<uint8>().swap(ptr_buffer->data);
+  } else {
+    ptr_buffer->data.clear();
+  }
+  const size_t max_free = static_cast<size_t>(
+      max_buffers_ > 0 ? max_buffers_ : static_cast<int>(kMaxFreeBuffers));
+  std::lock_guard<std::mutex> lock(mutex_);
+  AddBytes(-length);
+  if (free_buffers_.size() >= max_free) {
+    delete ptr_buffer;
+    return;
   }
+  free_buffers_.push_back(ptr_buffer);
+}
+
+bool BufferQueue::IsFull() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return (max_buffers_ > 0 &&
+          static_cast<int>(buffer_q_.size()) >= max_buffers_) ||
+         (max_bytes_ > 0 && queued_bytes_ >= max_bytes_);
+}
+
+bool BufferQueue::IsEmpty() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return buffer_q_.empty();
+}
+
+int BufferQueue::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return static_cast<int>(buffer_q_.size());
+}
+
+int64 BufferQueue::bytes() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return bytes_;
+}
+
+int64 BufferQueue::peak_bytes() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return peak_bytes_;
+}
+
+BufferQueue::Buffer* BufferQueue::AllocBuffer(int64 length) {
+  if (max_buffers_ > 0 && static_cast<int>(buffer_q_.size()) >= max_buffers_) {
+    VLOG(1) << "BufferQueue full";
+    return NULL;
+  }
+  if (max_bytes_ > 0 && !buffer_q_.empty() &&
+      queued_bytes_ + length > max_bytes_) {
+    VLOG(1) << "BufferQueue byte limit reached";
+    return NULL;
+  }
+  if (!free_buffers_.empty()) {
+    Buffer* const buffer = free_buffers_.back();
+    free_buffers_.pop_back();
+    return buffer;
+  }
+  Buffer* const buffer = new (std::nothrow) Buffer;  // NOLINT
+  if (!buffer) {
+    LOG(ERROR) << "No memory in BufferQueue";
+  }
+  return buffer;
+}
+
+void BufferQueue::PushBuffer(Buffer* ptr_buffer, int64 length) {
+  ptr_buffer->queued_time = std::chrono::steady_clock::now();
+  buffer_q_.push_back(ptr_buffer);
+  queued_bytes_ += length;
+  AddBytes(length);
+}
+
+BufferQueue::Buffer* BufferQueue::TakeBuffer(
+    std::deque<Buffer*>::iterator iter) {
+  Buffer* const buffer = *iter;
+  buffer_q_.erase(iter);
+  queued_bytes_ -= buffer->length();
   return buffer;
 }
 
+void BufferQueue::AddBytes(int64 bytes) {
+  bytes_ += bytes;
+  peak_bytes_ = std::max(peak_bytes_, bytes_);
+  if (memory_subsystem_ >= 0) {
+    MemoryAccountant::Instance()->Add(memory_subsystem_, bytes);
+  }
+}
+
 // Attempts to obtain lock on |mutex_|. Returns value of |locked_| if the lock
 // is obtained, assumes locked and returns true otherwise.
 bool LockableBuffer::IsLocked() {
@@ -60,11 +226,28 @@ int LockableBuffer::Init(const uint8* const ptr_data, int32 length) {
     LOG(ERROR) << "invalid arg(s).";
     return kInvalidArg;
   }
+  chunk_.reset();
   buffer_.clear();
   buffer_.assign(ptr_data, ptr_data + length);
   return kSuccess;
 }
 
+// Confirms buffer is unlocked via call to |IsLocked|, obtains lock on
+// |mutex_|, and stores |chunk|.
+int LockableBuffer::Init(const SharedWebmChunk& chunk) {
+  if (IsLocked()) {
+    return kLocked;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!chunk || chunk->length() <= 0) {
+    LOG(ERROR) << "invalid arg(s).";
+    return kInvalidArg;
+  }
+  buffer_.clear();
+  chunk_ = chunk;
+  return kSuccess;
+}
+
 // Confirms buffer is locked via call to |IsLocked|, obtains lock on
 // |mutex_|, and copies the user data into |buffer_|.
 int LockableBuffer::GetBuffer(uint8** ptr_buffer, int32* ptr_length) {
@@ -75,11 +258,33 @@ int LockableBuffer::GetBuffer(uint8** ptr_buffer, int32* ptr_length) {
     LOG(ERROR) << "buffer not locked!";
     return kNotLocked;
   }
+  if (chunk_) {
+    LOG(ERROR) << "buffer holds a WebmChunk!";
+    return kInvalidArg;
+  }
   *ptr_buffer = &buffer_[0];
   *ptr_length = buffer_.size();
   return kSuccess;
 }
 
+int LockableBuffer::GetBuffer(const uint8** ptr_buffer, int32* ptr_length) {
+  if (!ptr_buffer || !ptr_length) {
+    return kInvalidArg;
+  }
+  if (!IsLocked()) {
+    LOG(ERROR) << "buffer not locked!";
+    return kNotLocked;
+  }
+  if (chunk_) {
+    *ptr_buffer = chunk_->data();
+    *ptr_length = chunk_->length();
+  } else {
+    *ptr_buffer = &buffer_[0];
+    *ptr_length = buffer_.size();
+  }
+  return kSuccess;
+}
+
 // Obtains lock on |mutex_| and sets |locked_| to true.
 int LockableBuffer::Lock() {
   std::lock_guard<std::mutex> lock(mutex_);
@@ -107,7 +312,7 @@ int LockableBuffer::Unlock() {
 // WebmChunkBuffer
 //
 
-WebmChunkBuffer::WebmChunkBuffer() : chunk_length_(0) {}
+WebmChunkBuffer::WebmChunkBuffer() : chunk_length_(0), read_pos_(0) {}
 WebmChunkBuffer::~WebmChunkBuffer() {}
 
 // Checks if a chunk is ready, or attempts to parse some data by calling
@@ -121,7 +326,9 @@ bool WebmChunkBuffer::ChunkReady(int32* ptr_chunk_length) {
       *ptr_chunk_length = chunk_length_;
       return true;
     }
-    if (parser_->Parse(buffer_, &chunk_length_) == kSuccess) {
+    const int32 unread = static_cast<int32>(buffer_.size() - read_pos_);
+    const uint8* const ptr_unread = unread > 0 ? &buffer_[read_pos_] : NULL;
+    if (parser_->Parse(ptr_unread, unread, &chunk_length_) == kSuccess) {
       *ptr_chunk_length = chunk_length_;
       return true;
     }
@@ -129,12 +336,17 @@ bool WebmChunkBuffer::ChunkReady(int32* ptr_chunk_length) {
   return false;
 }
 
-// Inserts data from |ptr_data| at the end of |buffer_|.
+// Inserts data from |ptr_data| at the end of |buffer_|, after moving the
+// unread data to the front when more of |buffer_| has been read than not.
 int WebmChunkBuffer::BufferData(const uint8* const ptr_data, int32 length) {
   if (!ptr_data || length < 1) {
     LOG(ERROR) << "invalid arg(s).";
     return kInvalidArg;
   }
+  if (read_pos_ > 0 && read_pos_ >= buffer_.size() - read_pos_) {
+    buffer_.erase(buffer_.begin(), buffer_.begin() + read_pos_);
+    read_pos_ = 0;
+  }
   buffer_.insert(buffer_.end(), ptr_data, ptr_data+length);
   LOG(INFO) << "buffer_ size=" << buffer_.size();
   return kSuccess;
@@ -147,12 +359,14 @@ int WebmChunkBuffer::Init() {
     LOG(ERROR) << "out of memory";
     return kOutOfMemory;
   }
+  buffer_.clear();
+  read_pos_ = 0;
+  chunk_length_ = 0;
   return parser_->Init();
 }
 
-// Copies the buffered chunk data into |ptr_buf|, erases it from |buffer_|, and
-// resets |chunk_length_| to 0.  Resetting |chunk_length_| allows parsing to
-// resume in |ChunkReady|.
+// Copies the buffered chunk data into |ptr_buf| and consumes it via the view
+// returned by the other |ReadChunk()|.
 int WebmChunkBuffer::ReadChunk(uint8* ptr_buf, int32 length) {
   if (!ptr_buf) {
     LOG(ERROR) << "NULL buffer pointer";
@@ -162,9 +376,30 @@ int WebmChunkBuffer::ReadChunk(uint8* ptr_buf, int32 length) {
     LOG(ERROR) << "not enough space for chunk";
     return kUserBufferTooSmall;
   }
-  memcpy(ptr_buf, &buffer_[0], chunk_length_);
-  Buffer::iterator erase_end_pos = buffer_.begin() + chunk_length_;
-  buffer_.erase(buffer_.begin(), erase_end_pos);
+  if (chunk_length_ == 0) {
+    return kSuccess;
+  }
+  const uint8* ptr_chunk = NULL;
+  int32 chunk_length = 0;
+  const int status = ReadChunk(&ptr_chunk, &chunk_length);
+  if (status == kSuccess) {
+    memcpy(ptr_buf, ptr_chunk, chunk_length);
+  }
+  return status;
+}
+
+// Advances |read_pos_| past the buffered chunk, and resets |chunk_length_| to
+// 0.  Resetting |chunk_length_| allows parsing to resume in |ChunkReady|.
+// The read bytes stay in |buffer_| until |BufferData()| reclaims them, so the
+// returned view stays valid until then.
+int WebmChunkBuffer::ReadChunk(const uint8** ptr_chunk, int32* ptr_length) {
+  if (!ptr_chunk || !ptr_length || chunk_length_ == 0) {
+    LOG(ERROR) << "invalid arg(s) or no chunk ready.";
+    return kInvalidArg;
+  }
+  *ptr_chunk = &buffer_[read_pos_];
+  *ptr_length = chunk_length_;
+  read_pos_ += chunk_length_;
   chunk_length_ = 0;
   return kSuccess;
 }
@@ -8,40 +8,169 @@
 #ifndef WEBMLIVE_ENCODER_BUFFER_UTIL_H_
 #define WEBMLIVE_ENCODER_BUFFER_UTIL_H_
 
+#include <chrono>
+#include <deque>
+#include <functional>
 #include <memory>
 #include <mutex>
-#include <queue>
+#include <string>
 #include <vector>
 
 #include "encoder/basictypes.h"
 #include "encoder/encoder_base.h"
+#include "encoder/webm_chunk.h"
 
 namespace webmlive {
 
-// Thread safe buffer queue. Allows unbounded growth of internal queue.
+// Thread safe FIFO buffer queue, for any number of producers. Bounded when
+// constructed with a non-zero |max_buffers|, and by bytes after
+// |set_max_bytes()|. |Buffer| objects are pooled: users return dequeued
+// buffers via |ReleaseBuffer()|, and their nodes and data storage are reused
+// by later enqueues, so that a queue in steady state does not allocate. A
+// priority function passed to |DequeueBuffer()| takes buffers out of order.
 class BufferQueue {
  public:
+  // Free |Buffer| nodes kept for reuse by an unbounded queue. Bounded queues
+  // keep |max_buffers| nodes.
+  static const int kMaxFreeBuffers = 16;
+
+  // Data storage a released |Buffer| keeps for reuse. Larger storage, left by
+  // a burst of large buffers, is freed.
+  static const int32 kMaxRetainedBytes = 4 * 1024 * 1024;
+
   struct Buffer {
+    // Returns the buffered data; the data of |chunk| when it is non-NULL.
+    const uint8* ptr_data() const {
+      if (chunk)
+        return chunk->data();
+      return data.empty() ? NULL : &data[0];
+    }
+    int32 length() const {
+      return chunk ? chunk->length() : static_cast<int32>(data.size());
+    }
+
     std::string id;
     std::vector<uint8> data;
+    SharedWebmChunk chunk;
+
+    // Time the buffer was enqueued.
+    std::chrono::steady_clock::time_point queued_time;
   };
 
-  BufferQueue() {}
-  ~BufferQueue() {}
+  // Returns the priority of a queued buffer: lower values are dequeued
+  // first.
+  typedef std::function<double(const Buffer&)> PriorityFunction;
+
+  // Returns true when a queued buffer is to be dequeued, or visits one.
+  typedef std::function<bool(const Buffer&)> MatchFunction;
+  typedef std::function<void(const Buffer&)> VisitFunction;
+
+  // Creates an unbounded queue.
+  BufferQueue()
+      : max_buffers_(0),
+        max_bytes_(0),
+        queued_bytes_(0),
+        bytes_(0),
+        peak_bytes_(0),
+        memory_subsystem_(-1) {}
+
+  // Creates a queue holding at most |max_buffers| buffers. A |max_buffers|
+  // value less than 1 creates an unbounded queue.
+  explicit BufferQueue(int max_buffers)
+      : max_buffers_(max_buffers),
+        max_bytes_(0),
+        queued_bytes_(0),
+        bytes_(0),
+        peak_bytes_(0),
+        memory_subsystem_(-1) {}
+  ~BufferQueue();
 
-  // Copies |data| into a new |Buffer| and assigns |id|. Blocks while waiting to
-  // obtain lock on |mutex_|. Returns true when |data| is successfully enqueued.
+  // Also accounts the bytes held by the queue to |subsystem| of
+  // |MemoryAccountant|. Must be called before the first buffer is enqueued.
+  void set_memory_subsystem(int subsystem) { memory_subsystem_ = subsystem; }
+
+  // Limits the bytes of the queued buffers to |max_bytes|: an enqueue that
+  // would exceed it fails, unless the queue is empty so that a buffer larger
+  // than the limit is still accepted alone. 0 removes the limit. Buffers
+  // dequeued and not yet released do not count.
+  void set_max_bytes(int64 max_bytes);
+
+  // Copies |data| into a |Buffer| and assigns |id|. Blocks while waiting to
+  // obtain lock on |mutex_|. Returns true when |data| is successfully
+  // enqueued. Returns false when the queue is full, by count or by bytes.
   bool EnqueueBuffer(const std::string& id, const uint8* data, int length);
 
-  // Returns a buffer if one is available. Does not block waiting on |mutex_|;
-  // gives up and returns NULL when unable to obtain lock. Non-NULL |Buffer|
-  // pointer memory is owned by caller.
+  // Enqueues a |Buffer| that references |chunk|; the chunk data is not copied.
+  // Returns false when the queue is full.
+  bool EnqueueChunk(const SharedWebmChunk& chunk);
+
+  // Returns the oldest buffer, or NULL when the queue is empty. Blocks while
+  // waiting to obtain lock on |mutex_|. Non-NULL |Buffer| pointers must be
+  // returned to the queue via |ReleaseBuffer()|.
   Buffer* DequeueBuffer();
 
+  // Same as above, but returns the queued buffer of lowest |priority|, the
+  // oldest of those of equal priority. |priority| is called with |mutex_|
+  // held.
+  Buffer* DequeueBuffer(const PriorityFunction& priority);
+
+  // Same as above, but returns the oldest queued buffer only when |match|
+  // returns true for it. |match| is called with |mutex_| held.
+  Buffer* DequeueBufferIf(const MatchFunction& match);
+
+  // Calls |visit| with each queued buffer, oldest first, with |mutex_| held.
+  void ForEachBuffer(const VisitFunction& visit) const;
+
+  // Returns |ptr_buffer| to the pool of free buffers.
+  void ReleaseBuffer(Buffer* ptr_buffer);
+
+  // Returns true when |EnqueueBuffer()| would fail because the queue is full,
+  // by count or by bytes.
+  bool IsFull() const;
+
+  // Returns true when no buffers are queued.
+  bool IsEmpty() const;
+
+  // Returns the number of queued buffers.
+  int size() const;
+
+  // Returns the bytes of the buffers queued, or dequeued and not yet
+  // released, and the most held at once.
+  int64 bytes() const;
+  int64 peak_bytes() const;
+
  private:
-  bool locked_;
-  std::mutex mutex_;
-  std::queue<Buffer*> buffer_q_;
+  // Returns a free |Buffer| for |length| bytes, or NULL when the queue is
+  // full or out of memory. |mutex_| must be held.
+  Buffer* AllocBuffer(int64 length);
+
+  // Appends |ptr_buffer| of |length| bytes to |buffer_q_|. |mutex_| must be
+  // held.
+  void PushBuffer(Buffer* ptr_buffer, int64 length);
+
+  // Removes the buffer at |iter| from |buffer_q_| and returns it. |mutex_|
+  // must be held.
+  Buffer* TakeBuffer(std::deque<Buffer*>::iterator iter);
+
+  // Adds |bytes| to |bytes_|, and to |MemoryAccountant| when accounted.
+  // |mutex_| must be held.
+  void AddBytes(int64 bytes);
+
+  const int max_buffers_;
+  int64 max_bytes_;
+  mutable std::mutex mutex_;
+  std::deque<Buffer*> buffer_q_;
+  std::vector<Buffer*> free_buffers_;
+
+  // Bytes of the buffers in |buffer_q_|.
+  int64 queued_bytes_;
+
+  // Bytes of the buffers queued, or dequeued and not yet released, and the
+  // most held at once.
+  int64 bytes_;
+  int64 peak_bytes_;
+  int memory_subsystem_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(BufferQueue);
 };
 
 // Simple buffer object with locking facilities for passing data between
@@ -68,9 +197,17 @@ class LockableBuffer {
   // Copies data into the buffer. Does nothing and returns |kLocked| if the
   // buffer is already locked.
   int Init(const uint8* const ptr_data, int32 length);
+  // Stores a reference to |chunk| instead of copying its data. Does nothing
+  // and returns |kLocked| if the buffer is already locked.
+  int Init(const SharedWebmChunk& chunk);
   // Returns pointer to internal buffer.  Does nothing and returns |kNotLocked|
-  // if called with the buffer unlocked.
+  // if called with the buffer unlocked. Returns |kInvalidArg| when the buffer
+  // holds a |WebmChunk|; use the const overload.
   int GetBuffer(uint8** ptr_buffer, int32* ptr_length);
+  // Returns pointer to the buffered data, which is the |WebmChunk| data when
+  // the buffer was initialized with a chunk.  Does nothing and returns
+  // |kNotLocked| if called with the buffer unlocked.
+  int GetBuffer(const uint8** ptr_buffer, int32* ptr_length);
   // Lock the buffer.  Returns |kLocked| if already locked.
   int Lock();
   // Unlock the buffer. Returns |kNotLocked| if buffer already unlocked.
@@ -83,17 +220,26 @@ class LockableBuffer {
   std::mutex mutex_;
   // Internal buffer.
   std::vector<uint8> buffer_;
+  // Chunk passed to |Init()|. Used instead of |buffer_| when non-NULL.
+  SharedWebmChunk chunk_;
   WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(LockableBuffer);
 };
 
 // Class for buffering unparsed WebM data that provides users with access to
 // complete WebM "chunks" for consumption of data in manageable bits. Stores
 // unparsed WebM data in a vector until a "chunk" is ready for consumption.
+// Reading a chunk only advances a read cursor; the consumed bytes are
+// reclaimed by |BufferData()| once they outnumber the unread bytes, so each
+// byte is moved at most once on average.
 //
 // A chunk in this context is one of two things:
 // * The first time |ChunkReady| returns true, the chunk is made up of the
 //   EBML header, segment info, and segment tracks elements.
 // * All subsequent chunks are complete clusters.
+//
+// Chunks read from |LiveWebmMuxer| are already split, and describe themselves
+// through |WebmChunk::descriptor()|; this class is only needed for WebM data
+// from other sources.
 class WebmBufferParser;  // Forward declare |WebmChunkBuffer|'s parser object.
 class WebmChunkBuffer {
  public:
@@ -116,7 +262,12 @@ class WebmChunkBuffer {
   // |buffer_| when |kSuccess| is returned.  Returns |kUserBufferTooSmall| if
   // |length| is less than |chunk_length|.
   int ReadChunk(uint8* ptr_buf, int32 length);
-  // Initializes |parser_| and returns |kSuccess|.
+  // Removes the ready chunk from the buffer without copying it, and stores
+  // a pointer to its data and its length. The data remains valid until the
+  // next |BufferData()| or |Init()| call. Returns |kInvalidArg| when no chunk
+  // is ready.
+  int ReadChunk(const uint8** ptr_chunk, int32* ptr_length);
+  // Initializes |parser_|, discards buffered data, and returns |kSuccess|.
   int Init();
   // Returns the length of the currently parsed and buffered chunk, or 0 if
   // a complete chunk is not buffered.
@@ -128,8 +279,10 @@ class WebmChunkBuffer {
   std::unique_ptr<WebmBufferParser> parser_;
   // Length of the buffered chunk, or 0 if one is not buffered.
   int32 chunk_length_;
-  // Data buffer.
+  // Data buffer. Bytes before |read_pos_| have been read, and the unread
+  // data, which begins with the buffered chunk, follows.
   Buffer buffer_;
+  size_t read_pos_;
   WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(WebmChunkBuffer);
 };
 
@@ -0,0 +1,390 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/capture_dump.h"
+
+#include <cstring>
+
+#include "encoder/log_util.h"
+#include "encoder/thread_util.h"
+#include "glog/logging.h"
+
+namespace webmlive {
+
+namespace {
+
+// Most free record buffers kept for reuse.
+const size_t kMaxFreeRecords = 16;
+
+void PutLe16(uint16 value, uint8* ptr_data) {
+  ptr_data[0] = static_cast<uint8>(value);
+  ptr_data[1] = static_cast<uint8>(value >> 8);
+}
+
+void PutLe32(uint32 value, uint8* ptr_data) {
+  for (int i = 0; i < 4; ++i) {
+    ptr_data[i] = static_cast<uint8>(value >> (8 * i));
+  }
+}
+
+void PutLe64(uint64 value, uint8* ptr_data) {
+  for (int i = 0; i < 8; ++i) {
+    ptr_data[i] = static_cast<uint8>(value >> (8 * i));
+  }
+}
+
+uint16 GetLe16(const uint8* ptr_data) {
+  return static_cast<uint16>(ptr_data[0] | ptr_data[1] << 8);
+}
+
+uint32 GetLe32(const uint8* ptr_data) {
+  uint32 value = 0;
+  for (int i = 3; i >= 0; --i) {
+    value = (value << 8) | ptr_data[i];
+  }
+  return value;
+}
+
+uint64 GetLe64(const uint8* ptr_data) {
+  uint64 value = 0;
+  for (int i = 7; i >= 0; --i) {
+    value = (value << 8) | ptr_data[i];
+  }
+  return value;
+}
+
+bool SameVideoConfig(const VideoConfig& a, const VideoConfig& b) {
+  return a.format == b.format && a.width == b.width && a.height == b.height &&
+         a.stride == b.stride && a.uv_stride == b.uv_stride &&
+         a.frame_rate == b.frame_rate;
+}
+
+bool SameAudioConfig(const AudioConfig& a, const AudioConfig& b) {
+  return a.format_tag == b.format_tag && a.channels == b.channels &&
+         a.sample_rate == b.sample_rate &&
+         a.bytes_per_second == b.bytes_per_second &&
+         a.block_align == b.block_align &&
+         a.bits_per_sample == b.bits_per_sample &&
+         a.valid_bits_per_sample == b.valid_bits_per_sample &&
+         a.channel_mask == b.channel_mask;
+}
+
+void PutVideoConfig(const VideoConfig& config, uint8* ptr_data) {
+  PutLe32(static_cast<uint32>(config.format), ptr_data);
+  PutLe32(static_cast<uint32>(config.width), ptr_data + 4);
+  PutLe32(static_cast<uint32>(config.height), ptr_data + 8);
+  PutLe32(static_cast<uint32>(config.stride), ptr_data + 12);
+  PutLe32(static_cast<uint32>(config.uv_stride), ptr_data + 16);
+  uint64 frame_rate_bits = 0;
+  memcpy(&frame_rate_bits, &config.frame_rate, sizeof(frame_rate_bits));
+  PutLe64(frame_rate_bits, ptr_data + 20);
+}
+
+void PutAudioConfig(const AudioConfig& config, uint8* ptr_data) {
+  PutLe16(config.format_tag, ptr_data);
+  PutLe16(config.channels, ptr_data + 2);
+  PutLe32(config.sample_rate, ptr_data + 4);
+  PutLe32(config.bytes_per_second, ptr_data + 8);
+  PutLe16(config.block_align, ptr_data + 12);
+  PutLe16(config.bits_per_sample, ptr_data + 14);
+  PutLe16(config.valid_bits_per_sample, ptr_data + 16);
+  PutLe16(0, ptr_data + 18);  // Reserved.
+  PutLe32(config.channel_mask, ptr_data + 20);
+}
+
+}  // namespace
+
+void ParseCaptureDumpRecordHeader(const uint8* ptr_data,
+                                  CaptureDumpRecordHeader* ptr_header) {
+  ptr_header->type = GetLe32(ptr_data);
+  ptr_header->length = GetLe32(ptr_data + 4);
+  ptr_header->timestamp = static_cast<int64>(GetLe64(ptr_data + 8));
+  ptr_header->duration = static_cast<int64>(GetLe64(ptr_data + 16));
+  ptr_header->arrival_us = static_cast<int64>(GetLe64(ptr_data + 24));
+}
+
+void ParseCaptureDumpVideoConfig(const uint8* ptr_data,
+                                 VideoConfig* ptr_config) {
+  ptr_config->format = static_cast<VideoFormat>(GetLe32(ptr_data));
+  ptr_config->width = static_cast<int32>(GetLe32(ptr_data + 4));
+  ptr_config->height = static_cast<int32>(GetLe32(ptr_data + 8));
+  ptr_config->stride = static_cast<int32>(GetLe32(ptr_data + 12));
+  ptr_config->uv_stride = static_cast<int32>(GetLe32(ptr_data + 16));
+  const uint64 frame_rate_bits = GetLe64(ptr_data + 20);
+  memcpy(&ptr_config->frame_rate, &frame_rate_bits, sizeof(frame_rate_bits));
+}
+
+void ParseCaptureDumpAudioConfig(const uint8* ptr_data,
+                                 AudioConfig* ptr_config) {
+  ptr_config->format_tag = GetLe16(ptr_data);
+  ptr_config->channels = GetLe16(ptr_data + 2);
+  ptr_config->sample_rate = GetLe32(ptr_data + 4);
+  ptr_config->bytes_per_second = GetLe32(ptr_data + 8);
+  ptr_config->block_align = GetLe16(ptr_data + 12);
+  ptr_config->bits_per_sample = GetLe16(ptr_data + 14);
+  ptr_config->valid_bits_per_sample = GetLe16(ptr_data + 16);
+  ptr_config->channel_mask = GetLe32(ptr_data + 20);
+}
+
+CaptureDumpWriter::CaptureDumpWriter()
+    : ptr_file_(NULL),
+      have_video_config_(false),
+      have_audio_config_(false),
+      queued_bytes_(0),
+      stop_(false),
+      write_failed_(false) {
+}
+
+CaptureDumpWriter::~CaptureDumpWriter() {
+  Close();
+}
+
+int CaptureDumpWriter::Open(const std::string& path) {
+  if (ptr_file_) {
+    LOG(ERROR) << "capture dump already open.";
+    return kInvalidArg;
+  }
+  ptr_file_ = fopen(path.c_str(), "wb");
+  if (!ptr_file_) {
+    LOG(ERROR) << "cannot create capture dump " << path;
+    return kOpenFailed;
+  }
+  uint8 header[kCaptureDumpFileHeaderSize];
+  PutLe32(kCaptureDumpMagic, header);
+  PutLe32(kCaptureDumpVersion, header + 4);
+  if (fwrite(header, 1, sizeof(header), ptr_file_) != sizeof(header)) {
+    LOG(ERROR) << "cannot write capture dump header.";
+    fclose(ptr_file_);
+    ptr_file_ = NULL;
+    return kWriteFailed;
+  }
+  stats_ = CaptureDumpStats();
+  stats_.bytes_written = sizeof(header);
+  stop_ = false;
+  write_failed_ = false;
+  have_video_config_ = false;
+  have_audio_config_ = false;
+  open_time_ = std::chrono::steady_clock::now();
+  thread_.reset(new (std::nothrow) std::thread(  // NOLINT
+      &CaptureDumpWriter::WriterThread, this));
+  if (!thread_) {
+    LOG(ERROR) << "out of memory.";
+    fclose(ptr_file_);
+    ptr_file_ = NULL;
+    return kOpenFailed;
+  }
+  LOG(INFO) << "writing capture dump " << path;
+  return kSuccess;
+}
+
+void CaptureDumpWriter::WriteVideoFrame(const VideoFrame& frame) {
+  if (!ptr_file_) {
+    return;
+  }
+  const int64 arrival_us = ArrivalTime();
+  const VideoConfig& config = frame.config();
+  const bool new_config =
+      !have_video_config_ || !SameVideoConfig(config, video_config_);
+  Record config_record;
+  if (new_config) {
+    config_record = NewRecord(kCaptureDumpVideoConfig,
+                              kCaptureDumpVideoConfigSize, frame.timestamp(),
+                              frame.duration(), arrival_us);
+    if (!config_record) {
+      Drop(Record());
+      return;
+    }
+    PutVideoConfig(config,
+                   &(*config_record)[kCaptureDumpRecordHeaderSize]);
+  }
+  Record record = NewRecord(kCaptureDumpVideoFrame, frame.buffer_length(),
+                            frame.timestamp(), frame.duration(), arrival_us);
+  if (!record) {
+    Drop(std::move(config_record));
+    return;
+  }
+  memcpy(&(*record)[kCaptureDumpRecordHeaderSize], frame.buffer(),
+         frame.buffer_length());
+  Enqueue(std::move(config_record), std::move(record), true);
+  have_video_config_ = true;
+  video_config_ = config;
+}
+
+void CaptureDumpWriter::WriteAudioBuffer(const AudioBuffer& buffer) {
+  if (!ptr_file_) {
+    return;
+  }
+  const int64 arrival_us = ArrivalTime();
+  const AudioConfig& config = buffer.config();
+  const bool new_config =
+      !have_audio_config_ || !SameAudioConfig(config, audio_config_);
+  Record config_record;
+  if (new_config) {
+    config_record = NewRecord(kCaptureDumpAudioConfig,
+                              kCaptureDumpAudioConfigSize, buffer.timestamp(),
+                              buffer.duration(), arrival_us);
+    if (!config_record) {
+      Drop(Record());
+      return;
+    }
+    PutAudioConfig(config,
+                   &(*config_record)[kCaptureDumpRecordHeaderSize]);
+  }
+  Record record = NewRecord(kCaptureDumpAudioBuffer, buffer.buffer_length(),
+                            buffer.timestamp(), buffer.duration(), arrival_us);
+  if (!record) {
+    Drop(std::move(config_record));
+    return;
+  }
+  memcpy(&(*record)[kCaptureDumpRecordHeaderSize], buffer.buffer(),
+         buffer.buffer_length());
+  Enqueue(std::move(config_record), std::move(record), false);
+  have_audio_config_ = true;
+  audio_config_ = config;
+}
+
+int CaptureDumpWriter::Close() {
+  if (!ptr_file_) {
+    return kSuccess;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  wake_.notify_one();
+  if (thread_) {
+    thread_->join();
+    thread_.reset();
+  }
+  bool failed = write_failed_;
+  if (fclose(ptr_file_)) {
+    failed = true;
+  }
+  ptr_file_ = NULL;
+  free_records_.clear();
+  LOG(INFO) << "capture dump closed: " << stats_.video_frames
+            << " video frames, " << stats_.audio_buffers
+            << " audio buffers, " << stats_.bytes_written << " bytes, "
+            << stats_.records_dropped << " dropped.";
+  if (failed) {
+    LOG(ERROR) << "capture dump is incomplete: a write failed.";
+    return kWriteFailed;
+  }
+  return kSuccess;
+}
+
+void CaptureDumpWriter::GetStats(CaptureDumpStats* ptr_stats) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  *ptr_stats = stats_;
+}
+
+CaptureDumpWriter::Record CaptureDumpWriter::NewRecord(uint32 type,
+                                                       int32 length,
+                                                       int64 timestamp,
+                                                       int64 duration,
+                                                       int64 arrival_us) {
+  const int64 record_size = kCaptureDumpRecordHeaderSize + length;
+  Record record;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (write_failed_ || queued_bytes_ + record_size > kMaxQueuedBytes) {
+      return Record();
+    }
+    queued_bytes_ += record_size;
+    if (!free_records_.empty()) {
+      record = std::move(free_records_.back());
+      free_records_.pop_back();
+    }
+  }
+  if (!record) {
+    record.reset(new (std::nothrow) std::vector<uint8>());  // NOLINT
+    if (!record) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      queued_bytes_ -= record_size;
+      return Record();
+    }
+  }
+  // Resizing a reused buffer reallocates only when it is too small.
+  record->resize(static_cast<size_t>(record_size));
+  uint8* const ptr_header = &(*record)[0];
+  PutLe32(type, ptr_header);
+  PutLe32(static_cast<uint32>(length), ptr_header + 4);
+  PutLe64(static_cast<uint64>(timestamp), ptr_header + 8);
+  PutLe64(static_cast<uint64>(duration), ptr_header + 16);
+  PutLe64(static_cast<uint64>(arrival_us), ptr_header + 24);
+  return record;
+}
+
+void CaptureDumpWriter::Enqueue(Record config_record, Record record,
+                                bool video) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (config_record) {
+      queue_.push_back(std::move(config_record));
+    }
+    queue_.push_back(std::move(record));
+    if (video) {
+      ++stats_.video_frames;
+    } else {
+      ++stats_.audio_buffers;
+    }
+  }
+  wake_.notify_one();
+}
+
+void CaptureDumpWriter::Drop(Record config_record) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (config_record) {
+    Recycle(std::move(config_record));
+  }
+  ++stats_.records_dropped;
+  WEBMLIVE_LOG_EVERY_MS(WARNING, 1000)
+      << "capture dump queue full, dropped a sample.";
+}
+
+void CaptureDumpWriter::Recycle(Record record) {
+  queued_bytes_ -= static_cast<int64>(record->size());
+  if (free_records_.size() < kMaxFreeRecords) {
+    free_records_.push_back(std::move(record));
+  }
+}
+
+int64 CaptureDumpWriter::ArrivalTime() const {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - open_time_).count();
+}
+
+void CaptureDumpWriter::WriterThread() {
+  ScopedThreadRegistration registration("capture_dump");
+  for (;;) {
+    Record record;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      wake_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+      if (queue_.empty()) {
+        break;
+      }
+      record = std::move(queue_.front());
+      queue_.pop_front();
+    }
+    bool written = false;
+    if (!write_failed_) {
+      written = fwrite(&(*record)[0], 1, record->size(), ptr_file_) ==
+                record->size();
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (written) {
+      stats_.bytes_written += static_cast<int64>(record->size());
+    } else if (!write_failed_) {
+      LOG(ERROR) << "capture dump write failed.";
+      write_failed_ = true;
+    }
+    Recycle(std::move(record));
+  }
+}
+
+}  // namespace webmlive
@@ -0,0 +1,194 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_CAPTURE_DUMP_H_
+#define WEBMLIVE_ENCODER_CAPTURE_DUMP_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "encoder/audio_encoder.h"
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+#include "encoder/video_encoder.h"
+
+namespace webmlive {
+
+// Capture dump format. All values are little endian.
+//
+// A dump starts with |kCaptureDumpMagic| and |kCaptureDumpVersion|, 4 bytes
+// each, followed by records. Each record is a |kCaptureDumpRecordHeaderSize|
+// byte header and |length| payload bytes:
+//   uint32 type        |CaptureDumpRecordType|.
+//   uint32 length      Payload length in bytes.
+//   int64 timestamp    Sample timestamp in milliseconds.
+//   int64 duration     Sample duration in milliseconds.
+//   int64 arrival_us   Delivery time of the sample in microseconds since the
+//                      dump was opened.
+//
+// Config records carry the |VideoConfig| or |AudioConfig| of the samples of
+// their stream that follow, and precede the first sample of the stream and
+// each sample whose config differs from the previous one. Sample records
+// carry the sample data exactly as delivered by the media source: video in
+// its capture format, before conversion to I420.
+const uint32 kCaptureDumpMagic = 0x44434C57;  // "WLCD"
+const uint32 kCaptureDumpVersion = 1;
+const int32 kCaptureDumpFileHeaderSize = 8;
+const int32 kCaptureDumpRecordHeaderSize = 32;
+const int32 kCaptureDumpVideoConfigSize = 28;
+const int32 kCaptureDumpAudioConfigSize = 24;
+
+enum CaptureDumpRecordType {
+  kCaptureDumpVideoConfig = 1,
+  kCaptureDumpAudioConfig = 2,
+  kCaptureDumpVideoFrame = 3,
+  kCaptureDumpAudioBuffer = 4,
+};
+
+struct CaptureDumpRecordHeader {
+  CaptureDumpRecordHeader()
+      : type(0), length(0), timestamp(0), duration(0), arrival_us(0) {}
+  uint32 type;
+  uint32 length;
+  int64 timestamp;
+  int64 duration;
+  int64 arrival_us;
+};
+
+// Parses the record header at |ptr_data|, |kCaptureDumpRecordHeaderSize|
+// bytes long.
+void ParseCaptureDumpRecordHeader(const uint8* ptr_data,
+                                  CaptureDumpRecordHeader* ptr_header);
+
+// Parse config record payloads, |kCaptureDumpVideoConfigSize| and
+// |kCaptureDumpAudioConfigSize| bytes long.
+void ParseCaptureDumpVideoConfig(const uint8* ptr_data,
+                                 VideoConfig* ptr_config);
+void ParseCaptureDumpAudioConfig(const uint8* ptr_data,
+                                 AudioConfig* ptr_config);
+
+struct CaptureDumpStats {
+  CaptureDumpStats()
+      : video_frames(0), audio_buffers(0), bytes_written(0),
+        records_dropped(0) {}
+
+  // Samples written to the dump.
+  int64 video_frames;
+  int64 audio_buffers;
+
+  // Total bytes written, headers included.
+  int64 bytes_written;
+
+  // Samples not written because the write queue was full.
+  int64 records_dropped;
+};
+
+// Records the samples a media source delivers to a capture dump, for replay
+// by |CaptureReplaySource|. Samples are copied on the delivering thread, and
+// written to the file by a writer thread, so slow storage does not stall
+// capture. Samples that arrive while |kMaxQueuedBytes| are waiting to be
+// written are dropped, and counted in |CaptureDumpStats::records_dropped|.
+//
+// Notes:
+// - Each stream must be written from one thread at a time; the audio and
+//   video streams may be written from different threads.
+// - Buffers of written records are reused, so a dump of a steady stream
+//   does not allocate once the queue has reached its working size.
+class CaptureDumpWriter {
+ public:
+  enum {
+    kWriteFailed = -3,
+    kOpenFailed = -2,
+    kInvalidArg = -1,
+    kSuccess = 0,
+  };
+
+  // Most record bytes waiting to be written.
+  static const int64 kMaxQueuedBytes = 256 * 1024 * 1024;
+
+  CaptureDumpWriter();
+  ~CaptureDumpWriter();
+
+  // Creates the dump at |path|, writes its header, and starts the writer
+  // thread. Returns |kSuccess| upon success.
+  int Open(const std::string& path);
+
+  // Appends |frame| or |buffer|, and a config record when its config is new,
+  // to the dump. Does nothing when the dump is not open.
+  void WriteVideoFrame(const VideoFrame& frame);
+  void WriteAudioBuffer(const AudioBuffer& buffer);
+
+  // Writes all queued records, stops the writer thread and closes the dump.
+  // Must be called once samples are no longer delivered. Returns
+  // |kWriteFailed| when any write failed.
+  int Close();
+
+  // Copies current stats to |ptr_stats|. Thread safe.
+  void GetStats(CaptureDumpStats* ptr_stats);
+
+  bool is_open() const { return ptr_file_ != NULL; }
+
+ private:
+  typedef std::unique_ptr<std::vector<uint8> > Record;
+
+  // Returns a record buffer holding the header of a record of |type| with
+  // |length| payload bytes, and counts it as queued. Returns NULL when the
+  // queue is full or a write has failed.
+  Record NewRecord(uint32 type, int32 length, int64 timestamp,
+                   int64 duration, int64 arrival_us);
+
+  // Queues |config_record|, when non-NULL, and |record| for writing, and
+  // counts a video frame or audio buffer.
+  void Enqueue(Record config_record, Record record, bool video);
+
+  // Returns |config_record|, when non-NULL, to the free records, and counts
+  // a dropped sample.
+  void Drop(Record config_record);
+
+  // Returns |record| to the free records. Must be called with |mutex_| held.
+  void Recycle(Record record);
+
+  // Returns the time since |Open()| in microseconds.
+  int64 ArrivalTime() const;
+
+  // Writes queued records until |Close()| is called and the queue is empty.
+  void WriterThread();
+
+  FILE* ptr_file_;
+  std::unique_ptr<std::thread> thread_;
+  std::chrono::steady_clock::time_point open_time_;
+
+  // Configs of the last records of each stream, used only by the stream's
+  // delivering thread.
+  bool have_video_config_;
+  VideoConfig video_config_;
+  bool have_audio_config_;
+  AudioConfig audio_config_;
+
+  // Records waiting to be written, buffers of written records, and the
+  // payload bytes queued, protected by |mutex_|.
+  std::deque<Record> queue_;
+  std::vector<Record> free_records_;
+  int64 queued_bytes_;
+  bool stop_;
+  bool write_failed_;
+  CaptureDumpStats stats_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(CaptureDumpWriter);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_CAPTURE_DUMP_H_
@@ -0,0 +1,186 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/capture_profile_cache.h"
+
+#include <cmath>
+#include <fstream>
+#include <sstream>
+
+#include "glog/logging.h"
+
+namespace webmlive {
+
+namespace {
+
+// Line keys of the profile file. Each profile starts with a |kDeviceKey|
+// line holding the device path, followed by one line of each other key but
+// |kMediaTypeKey|, which has a line per media type, and ends with an
+// |kEndKey| line.
+const char kDeviceKey[] = "device";
+const char kRequestKey[] = "request";
+const char kConnectKey[] = "connect";
+const char kStartupKey[] = "startup_ms";
+const char kMediaTypeKey[] = "type";
+const char kEndKey[] = "end";
+
+// Frame rates stored with fewer digits than requested still match.
+const double kFrameRateTolerance = 0.001;
+
+// Returns true when |value| is a |VideoFormat| value, and stores it in
+// |ptr_format|.
+bool ToVideoFormat(int value, VideoFormat* ptr_format) {
+  if (value < 0 || value >= kVideoFormatCount) {
+    return false;
+  }
+  *ptr_format = static_cast<VideoFormat>(value);
+  return true;
+}
+
+}  // namespace
+
+int CaptureProfileCache::Load(const std::string& path) {
+  if (path.empty()) {
+    LOG(ERROR) << "empty capture profile file name.";
+    return kInvalidArg;
+  }
+  path_ = path;
+  profiles_.clear();
+  std::ifstream file(path.c_str());
+  if (!file) {
+    LOG(INFO) << "no capture profiles in " << path << " yet.";
+    return kSuccess;
+  }
+  std::string line;
+  std::string device;
+  CaptureProfile profile;
+  bool valid = false;
+  for (int line_number = 1; std::getline(file, line); ++line_number) {
+    std::istringstream line_stream(line);
+    std::string key;
+    if (!(line_stream >> key)) {
+      continue;
+    }
+    if (key == kDeviceKey) {
+      line_stream >> std::ws;
+      std::getline(line_stream, device);
+      profile = CaptureProfile();
+      valid = !device.empty();
+      continue;
+    }
+    if (!valid) {
+      continue;
+    }
+    int format = 0;
+    int field_order = 0;
+    VideoConfig& actual = profile.actual_config;
+    if (key == kRequestKey) {
+      VideoConfig& requested = profile.requested_config;
+      valid = static_cast<bool>(line_stream >> requested.width
+                                             >> requested.height
+                                             >> requested.frame_rate
+                                             >> profile.passthrough);
+    } else if (key == kConnectKey) {
+      valid = (line_stream >> format >> actual.width >> actual.height
+                           >> actual.stride >> actual.frame_rate
+                           >> field_order) &&
+              ToVideoFormat(format, &profile.format) &&
+              field_order >= kVideoProgressive &&
+              field_order <= kVideoBottomFieldFirst;
+      actual.format = profile.format;
+      actual.field_order = static_cast<VideoFieldOrder>(field_order);
+    } else if (key == kStartupKey) {
+      valid = static_cast<bool>(line_stream >> profile.startup_ms);
+    } else if (key == kMediaTypeKey) {
+      CaptureMediaType media_type;
+      valid = (line_stream >> format >> media_type.width >> media_type.height
+                           >> media_type.frame_rate) &&
+              ToVideoFormat(format, &media_type.format);
+      profile.media_types.push_back(media_type);
+    } else if (key == kEndKey) {
+      if (actual.width > 0 && actual.height != 0) {
+        profiles_[device] = profile;
+      } else {
+        valid = false;
+      }
+    }
+    if (!valid) {
+      LOG(WARNING) << "dropping capture profile of " << device << ": bad "
+                   << key << " on line " << line_number << " of " << path;
+    } else if (key == kEndKey) {
+      valid = false;
+    }
+  }
+  LOG(INFO) << "loaded " << profiles_.size() << " capture profiles from "
+            << path;
+  return kSuccess;
+}
+
+int CaptureProfileCache::Save() const {
+  std::ofstream file(path_.c_str(), std::ios::trunc);
+  if (path_.empty() || !file) {
+    LOG(ERROR) << "cannot open capture profile file: " << path_;
+    return kFileError;
+  }
+  // Enough digits for frame rates like 30000/1001 to read back unchanged.
+  file.precision(10);
+  typedef std::map<std::string, CaptureProfile>::const_iterator Iterator;
+  for (Iterator iter = profiles_.begin(); iter != profiles_.end(); ++iter) {
+    const CaptureProfile& profile = iter->second;
+    const VideoConfig& requested = profile.requested_config;
+    const VideoConfig& actual = profile.actual_config;
+    file << kDeviceKey << " " << iter->first << "\n"
+         << kRequestKey << " " << requested.width << " " << requested.height
+         << " " << requested.frame_rate << " " << profile.passthrough << "\n"
+         << kConnectKey << " " << profile.format << " " << actual.width
+         << " " << actual.height << " " << actual.stride << " "
+         << actual.frame_rate << " " << actual.field_order << "\n"
+         << kStartupKey << " " << profile.startup_ms << "\n";
+    for (size_t i = 0; i < profile.media_types.size(); ++i) {
+      const CaptureMediaType& media_type = profile.media_types[i];
+      file << kMediaTypeKey << " " << media_type.format << " "
+           << media_type.width << " " << media_type.height << " "
+           << media_type.frame_rate << "\n";
+    }
+    file << kEndKey << "\n";
+  }
+  file.flush();
+  if (!file) {
+    LOG(ERROR) << "cannot write capture profile file: " << path_;
+    return kFileError;
+  }
+  return kSuccess;
+}
+
+bool CaptureProfileCache::Find(const std::string& device,
+                               CaptureProfile* ptr_profile) const {
+  const std::map<std::string, CaptureProfile>::const_iterator iter =
+      profiles_.find(device);
+  if (iter == profiles_.end()) {
+    return false;
+  }
+  *ptr_profile = iter->second;
+  return true;
+}
+
+void CaptureProfileCache::Store(const std::string& device,
+                                const CaptureProfile& profile) {
+  profiles_[device] = profile;
+}
+
+bool CaptureProfileCache::Matches(const CaptureProfile& profile,
+                                  const VideoConfig& requested_config,
+                                  bool passthrough) {
+  const VideoConfig& cached = profile.requested_config;
+  return cached.width == requested_config.width &&
+         cached.height == requested_config.height &&
+         fabs(cached.frame_rate - requested_config.frame_rate) <
+             kFrameRateTolerance &&
+         profile.passthrough == passthrough;
+}
+
+}  // namespace webmlive
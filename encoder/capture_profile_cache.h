@@ -0,0 +1,104 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_CAPTURE_PROFILE_CACHE_H_
+#define WEBMLIVE_ENCODER_CAPTURE_PROFILE_CACHE_H_
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+#include "encoder/video_encoder.h"
+
+namespace webmlive {
+
+// A video media type offered by a capture device.
+struct CaptureMediaType {
+  CaptureMediaType()
+      : format(kVideoFormatI420), width(0), height(0), frame_rate(0) {}
+
+  VideoFormat format;
+  int32 width;
+  int32 height;
+  double frame_rate;
+};
+
+// What connecting a capture device took: the settings it was connected
+// for, what it offers, and what it connected with.
+struct CaptureProfile {
+  CaptureProfile()
+      : passthrough(false), format(kVideoFormatI420), startup_ms(0) {}
+
+  // Requested size and frame rate, and |WebmEncoderConfig::video_passthrough|:
+  // the profile applies only to connections made with the same ones.
+  VideoConfig requested_config;
+  bool passthrough;
+
+  // Media types the device offered.
+  std::vector<CaptureMediaType> media_types;
+
+  // Format the device was connected with, and the negotiated width, height,
+  // stride, frame rate and field order.
+  VideoFormat format;
+  VideoConfig actual_config;
+
+  // Time the full probe and connection took, in milliseconds.
+  int64 startup_ms;
+};
+
+// Capture device profiles, keyed by device path, kept in a text file across
+// runs. A device whose profile matches the request is connected straight
+// with the stored format, without probing its media types; the full probe
+// runs, and replaces the profile, only when that fails.
+//
+// Notes:
+// - Not thread safe: one thread builds the capture graph.
+// - A file that cannot be read is an empty cache; profiles of devices
+//   missing from it are added by |Store()|.
+class CaptureProfileCache {
+ public:
+  enum {
+    kFileError = -2,
+    kInvalidArg = -1,
+    kSuccess = 0,
+  };
+
+  CaptureProfileCache() {}
+  ~CaptureProfileCache() {}
+
+  // Reads the profiles of |path|. Returns |kSuccess|, also when |path| does
+  // not exist yet, and |kInvalidArg| when |path| is empty. Malformed
+  // profiles are logged and dropped.
+  int Load(const std::string& path);
+
+  // Writes all profiles to the file passed to |Load()|. Returns |kSuccess|,
+  // or |kFileError| when the file cannot be written.
+  int Save() const;
+
+  // Copies the profile of |device| to |ptr_profile|. Returns false when
+  // there is none.
+  bool Find(const std::string& device, CaptureProfile* ptr_profile) const;
+
+  // Adds or replaces the profile of |device|.
+  void Store(const std::string& device, const CaptureProfile& profile);
+
+  // Returns true when |profile| was made for |requested_config| and
+  // |passthrough|.
+  static bool Matches(const CaptureProfile& profile,
+                      const VideoConfig& requested_config, bool passthrough);
+
+ private:
+  std::string path_;
+  std::map<std::string, CaptureProfile> profiles_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(CaptureProfileCache);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_CAPTURE_PROFILE_CACHE_H_
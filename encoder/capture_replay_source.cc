@@ -0,0 +1,319 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/capture_replay_source.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include "encoder/thread_util.h"
+#include "encoder/webm_encoder.h"
+#include "glog/logging.h"
+
+namespace webmlive {
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+// Interval in milliseconds at which waits check for |Stop|.
+const int kStopPollInterval = 10;
+
+uint32 ReadLe32(const uint8* ptr_data) {
+  return static_cast<uint32>(ptr_data[0]) |
+         static_cast<uint32>(ptr_data[1]) << 8 |
+         static_cast<uint32>(ptr_data[2]) << 16 |
+         static_cast<uint32>(ptr_data[3]) << 24;
+}
+
+}  // namespace
+
+CaptureReplaySource::CaptureReplaySource()
+    : free_run_(false),
+      video_enabled_(false),
+      frames_read_(0),
+      ptr_video_callback_(NULL),
+      audio_enabled_(false),
+      buffers_read_(0),
+      ptr_audio_callback_(NULL),
+      stop_(false),
+      ended_(false) {
+}
+
+CaptureReplaySource::~CaptureReplaySource() {
+  Stop();
+}
+
+int CaptureReplaySource::Init(
+    const WebmEncoderConfig& config,
+    AudioSamplesCallbackInterface* ptr_audio_callback,
+    VideoFrameCallbackInterface* ptr_video_callback) {
+  if (config.disable_audio && config.disable_video) {
+    LOG(ERROR) << "audio and video disabled.";
+    return WebmEncoder::kInvalidArg;
+  }
+  free_run_ = config.free_run;
+
+  // Find the config of the first sample of each stream. Only the record
+  // headers are parsed, so this is quick for a mapped dump.
+  MediaFileReader scan_reader;
+  int status = OpenDump(config.replay_file, &scan_reader);
+  if (status) {
+    return status;
+  }
+  bool have_video_config = false;
+  bool have_audio_config = false;
+  bool found_video = false;
+  bool found_audio = false;
+  CaptureDumpRecordHeader header;
+  const uint8* ptr_payload = NULL;
+  while ((!found_video || !found_audio) &&
+         ReadRecord(&scan_reader, &header, &ptr_payload)) {
+    if (header.type == kCaptureDumpVideoConfig && !found_video) {
+      ParseCaptureDumpVideoConfig(ptr_payload, &video_config_);
+      have_video_config = true;
+    } else if (header.type == kCaptureDumpAudioConfig && !found_audio) {
+      ParseCaptureDumpAudioConfig(ptr_payload, &audio_config_);
+      have_audio_config = true;
+    } else if (header.type == kCaptureDumpVideoFrame) {
+      found_video = have_video_config;
+    } else if (header.type == kCaptureDumpAudioBuffer) {
+      found_audio = have_audio_config;
+    }
+  }
+
+  if (!config.disable_video && found_video) {
+    if (!ptr_video_callback) {
+      LOG(ERROR) << "NULL video callback.";
+      return WebmEncoder::kInvalidArg;
+    }
+    ptr_video_callback_ = ptr_video_callback;
+    video_enabled_ = true;
+    LOG(INFO) << "replaying video: " << video_config_.width << "x"
+              << video_config_.height << " format " << video_config_.format
+              << " at " << video_config_.frame_rate << " fps.";
+  }
+  if (!config.disable_audio && found_audio) {
+    if (!ptr_audio_callback) {
+      LOG(ERROR) << "NULL audio callback.";
+      return WebmEncoder::kInvalidArg;
+    }
+    ptr_audio_callback_ = ptr_audio_callback;
+    audio_enabled_ = true;
+    LOG(INFO) << "replaying audio: " << audio_config_.channels
+              << " channels at " << audio_config_.sample_rate << " Hz.";
+  }
+  if (!video_enabled_ && !audio_enabled_) {
+    LOG(ERROR) << "capture dump has no samples of the enabled streams.";
+    return WebmEncoder::kInvalidArg;
+  }
+  status = OpenDump(config.replay_file, &reader_);
+  if (status) {
+    return status;
+  }
+  LOG(INFO) << "replaying capture dump " << config.replay_file
+            << (reader_.mapped() ? " (mapped)" : "")
+            << (free_run_ ? ", free running." : ", at recorded pace.");
+  return WebmEncoder::kSuccess;
+}
+
+int CaptureReplaySource::Run() {
+  if (thread_) {
+    LOG(ERROR) << "already running.";
+    return WebmEncoder::kRunFailed;
+  }
+  stop_ = false;
+  ended_ = false;
+  thread_.reset(new (std::nothrow) std::thread(  // NOLINT
+      &CaptureReplaySource::ReplayThread, this));
+  if (!thread_) {
+    LOG(ERROR) << "out of memory.";
+    return WebmEncoder::kNoMemory;
+  }
+  return WebmEncoder::kSuccess;
+}
+
+int CaptureReplaySource::CheckStatus() {
+  return ended_ ? WebmEncoder::kAVCaptureEnded : WebmEncoder::kSuccess;
+}
+
+void CaptureReplaySource::Stop() {
+  stop_ = true;
+  if (thread_) {
+    thread_->join();
+    thread_.reset();
+  }
+}
+
+int CaptureReplaySource::OpenDump(const std::string& path,
+                                  MediaFileReader* ptr_reader) {
+  if (path == "-") {
+    // The dump is read twice: once by |Init()|, and once for replay.
+    LOG(ERROR) << "capture dumps cannot be replayed from standard input.";
+    return WebmEncoder::kInvalidArg;
+  }
+  if (ptr_reader->Open(path)) {
+    LOG(ERROR) << "cannot open capture dump " << path;
+    return WebmEncoder::kInitFailed;
+  }
+  const uint8* const ptr_header =
+      ptr_reader->Read(kCaptureDumpFileHeaderSize);
+  if (!ptr_header || ReadLe32(ptr_header) != kCaptureDumpMagic) {
+    LOG(ERROR) << path << " is not a capture dump.";
+    return WebmEncoder::kInvalidArg;
+  }
+  const uint32 version = ReadLe32(ptr_header + 4);
+  if (version != kCaptureDumpVersion) {
+    LOG(ERROR) << "unsupported capture dump version " << version;
+    return WebmEncoder::kInvalidArg;
+  }
+  return WebmEncoder::kSuccess;
+}
+
+bool CaptureReplaySource::ReadRecord(MediaFileReader* ptr_reader,
+                                     CaptureDumpRecordHeader* ptr_header,
+                                     const uint8** ptr_payload) {
+  const uint8* const ptr_data =
+      ptr_reader->Read(kCaptureDumpRecordHeaderSize);
+  if (!ptr_data) {
+    return false;
+  }
+  ParseCaptureDumpRecordHeader(ptr_data, ptr_header);
+  // A dump whose writer did not finish ends with a partial record.
+  const uint8* const ptr_record_payload =
+      ptr_header->length > 0 ? ptr_reader->Read(ptr_header->length) : NULL;
+  if (ptr_header->length > 0 && !ptr_record_payload) {
+    LOG(WARNING) << "capture dump ends with a partial record.";
+    return false;
+  }
+  const bool video_config = ptr_header->type == kCaptureDumpVideoConfig;
+  const bool audio_config = ptr_header->type == kCaptureDumpAudioConfig;
+  if ((video_config && ptr_header->length <
+                           static_cast<uint32>(kCaptureDumpVideoConfigSize)) ||
+      (audio_config && ptr_header->length <
+                           static_cast<uint32>(kCaptureDumpAudioConfigSize))) {
+    LOG(ERROR) << "invalid capture dump config record.";
+    return false;
+  }
+  *ptr_payload = ptr_record_payload;
+  return true;
+}
+
+bool CaptureReplaySource::ReadSample(CaptureDumpRecordHeader* ptr_header) {
+  const uint8* ptr_payload = NULL;
+  while (ReadRecord(&reader_, ptr_header, &ptr_payload)) {
+    switch (ptr_header->type) {
+      case kCaptureDumpVideoConfig:
+        ParseCaptureDumpVideoConfig(ptr_payload, &frame_config_);
+        break;
+      case kCaptureDumpAudioConfig:
+        ParseCaptureDumpAudioConfig(ptr_payload, &buffer_config_);
+        break;
+      case kCaptureDumpVideoFrame:
+        if (video_enabled_) {
+          const int status = frame_.InitNative(
+              frame_config_, true, ptr_header->timestamp,
+              ptr_header->duration, ptr_payload, ptr_header->length);
+          if (status) {
+            LOG(ERROR) << "video frame init failed: " << status;
+            return false;
+          }
+          ++frames_read_;
+          return true;
+        }
+        break;
+      case kCaptureDumpAudioBuffer:
+        if (audio_enabled_) {
+          const int status = audio_buffer_.Init(
+              buffer_config_, ptr_header->timestamp, ptr_header->duration,
+              ptr_payload, ptr_header->length);
+          if (status) {
+            LOG(ERROR) << "audio buffer init failed: " << status;
+            return false;
+          }
+          ++buffers_read_;
+          return true;
+        }
+        break;
+      default:
+        // Records of later versions of the format are skipped.
+        break;
+    }
+  }
+  return false;
+}
+
+void CaptureReplaySource::DeliverVideoFrame() {
+  for (;;) {
+    const int status = ptr_video_callback_->OnVideoFrameReceived(&frame_);
+    if (status != VideoFrameCallbackInterface::kDropped) {
+      if (status) {
+        LOG(ERROR) << "OnVideoFrameReceived failed: " << status;
+      }
+      return;
+    }
+    if (!free_run_ || stop_) {
+      return;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+void CaptureReplaySource::DeliverAudioBuffer() {
+  for (;;) {
+    // |WebmEncoder| reports a full queue as |kNoMemory|.
+    const int status = ptr_audio_callback_->OnSamplesReceived(&audio_buffer_);
+    if (status != AudioSamplesCallbackInterface::kNoMemory || !free_run_) {
+      if (status) {
+        LOG(ERROR) << "OnSamplesReceived failed: " << status;
+      }
+      return;
+    }
+    if (stop_) {
+      return;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+void CaptureReplaySource::ReplayThread() {
+  ScopedThreadRegistration registration("replay");
+  const Clock::time_point start_time = Clock::now();
+  CaptureDumpRecordHeader header;
+  bool have_sample = ReadSample(&header);
+  const int64 first_arrival_us = header.arrival_us;
+  while (!stop_ && have_sample) {
+    if (!free_run_) {
+      const Clock::time_point due_time =
+          start_time +
+          std::chrono::microseconds(header.arrival_us - first_arrival_us);
+      // Sleep in short steps so |Stop| is not delayed by long gaps.
+      Clock::time_point now = Clock::now();
+      while (!stop_ && now < due_time) {
+        std::this_thread::sleep_until(std::min(
+            due_time, now + std::chrono::milliseconds(kStopPollInterval)));
+        now = Clock::now();
+      }
+      if (stop_) {
+        break;
+      }
+    }
+    if (header.type == kCaptureDumpVideoFrame) {
+      DeliverVideoFrame();
+    } else {
+      DeliverAudioBuffer();
+    }
+    have_sample = ReadSample(&header);
+  }
+  if (!stop_) {
+    LOG(INFO) << "capture dump replay ended: " << frames_read_
+              << " video frames, " << buffers_read_ << " audio buffers.";
+  }
+  ended_ = true;
+}
+
+}  // namespace webmlive
@@ -0,0 +1,134 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_CAPTURE_REPLAY_SOURCE_H_
+#define WEBMLIVE_ENCODER_CAPTURE_REPLAY_SOURCE_H_
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "encoder/audio_encoder.h"
+#include "encoder/basictypes.h"
+#include "encoder/capture_dump.h"
+#include "encoder/encoder_base.h"
+#include "encoder/file_media_source.h"
+#include "encoder/media_source.h"
+#include "encoder/video_encoder.h"
+
+namespace webmlive {
+
+// Media source that replays a capture dump written by |CaptureDumpWriter|,
+// and delivers its samples through the same callbacks, with the same
+// configs, timestamps and data that the recording media source delivered.
+// Video frames are delivered in their capture format, so replay exercises
+// conversion to I420 exactly as capture did. The dump is memory mapped when
+// possible, and sample data is copied once, into the |VideoFrame| or
+// |AudioBuffer| that carries it.
+//
+// By default samples are delivered at the pace they were recorded at: each
+// sample is delivered at its recorded delivery time, so capture jitter and
+// bursts are reproduced. In free-run mode samples are delivered as fast as
+// |WebmEncoder| accepts them, and samples the encoder cannot queue are
+// retried rather than dropped, as by |FileMediaSource|.
+//
+// Notes:
+// - A stream missing from the dump is reported by |has_video()| and
+//   |has_audio()| after |Init()|; |WebmEncoder| disables it.
+// - |CheckStatus| returns |WebmEncoder::kAVCaptureEnded| once all samples
+//   have been delivered.
+class CaptureReplaySource : public MediaSourceInterface {
+ public:
+  CaptureReplaySource();
+  virtual ~CaptureReplaySource();
+
+  // Opens |config.replay_file|, and reads the first configs of its streams.
+  // Returns |kSuccess| upon success, or a |WebmEncoder| status code upon
+  // failure.
+  virtual int Init(const WebmEncoderConfig& config,
+                   AudioSamplesCallbackInterface* ptr_audio_callback,
+                   VideoFrameCallbackInterface* ptr_video_callback);
+
+  // Replays hold one video stream.
+  virtual int SetCameraCallback(int, VideoFrameCallbackInterface*) {
+    return WebmEncoder::kNotImplemented;
+  }
+
+  // Starts the replay thread.
+  virtual int Run();
+
+  virtual int CheckStatus();
+
+  // Stops the replay thread.
+  virtual void Stop();
+
+  // Replays do not stall: they are not restarted.
+  virtual int Restart() { return WebmEncoder::kNotImplemented; }
+
+  virtual AudioConfig actual_audio_config() const { return audio_config_; }
+  virtual VideoConfig actual_video_config() const { return video_config_; }
+  virtual VideoConfig actual_camera_config(int) const {
+    return VideoConfig();
+  }
+
+  // Returns true when the dump holds samples of the stream, and the stream
+  // is enabled.
+  bool has_video() const { return video_enabled_; }
+  bool has_audio() const { return audio_enabled_; }
+
+ private:
+  // Opens |path| with |ptr_reader|, and checks the dump header.
+  static int OpenDump(const std::string& path, MediaFileReader* ptr_reader);
+
+  // Reads the next record header into |ptr_header|, and its payload into
+  // |ptr_payload|. Returns false at the end of the dump.
+  static bool ReadRecord(MediaFileReader* ptr_reader,
+                         CaptureDumpRecordHeader* ptr_header,
+                         const uint8** ptr_payload);
+
+  // Reads records up to the next sample of an enabled stream, and stores it
+  // in |frame_| or |audio_buffer_|. Returns false at the end of the dump.
+  bool ReadSample(CaptureDumpRecordHeader* ptr_header);
+
+  // Passes |frame_| or |audio_buffer_| to its callback. In free-run mode,
+  // waits until the callback accepts the sample or |stop_| is set.
+  void DeliverVideoFrame();
+  void DeliverAudioBuffer();
+
+  // Reads and delivers samples until the dump ends or |stop_| is set.
+  void ReplayThread();
+
+  bool free_run_;
+  MediaFileReader reader_;
+
+  // Video samples, and the config of the next frame.
+  bool video_enabled_;
+  int64 frames_read_;
+  VideoConfig video_config_;
+  VideoConfig frame_config_;
+  VideoFrame frame_;
+  VideoFrameCallbackInterface* ptr_video_callback_;
+
+  // Audio samples, and the config of the next buffer.
+  bool audio_enabled_;
+  int64 buffers_read_;
+  AudioConfig audio_config_;
+  AudioConfig buffer_config_;
+  AudioBuffer audio_buffer_;
+  AudioSamplesCallbackInterface* ptr_audio_callback_;
+
+  // Set by |Stop|, and by the replay thread once all samples are delivered.
+  std::atomic<bool> stop_;
+  std::atomic<bool> ended_;
+  std::unique_ptr<std::thread> thread_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(CaptureReplaySource);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_CAPTURE_REPLAY_SOURCE_H_
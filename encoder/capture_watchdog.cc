@@ -0,0 +1,327 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/capture_watchdog.h"
+
+#include <algorithm>
+#include <chrono>
+#include <new>
+
+#include "encoder/thread_util.h"
+#include "glog/logging.h"
+
+namespace webmlive {
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+int64 NowMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+      Clock::now().time_since_epoch()).count();
+}
+
+// Compressed frames cannot be repeated: they depend on the frames before.
+bool IsRawFormat(VideoFormat format) {
+  return format != kVideoFormatVP8 && format != kVideoFormatVP9;
+}
+
+}  // namespace
+
+const int CaptureWatchdog::kCheckInterval;
+
+CaptureWatchdog::CaptureWatchdog()
+    : frame_period_(0),
+      last_input_ms_(0),
+      restarts_(0),
+      exhausted_(false),
+      source_lost_(false),
+      restarting_(false),
+      offset_(0),
+      offset_restarts_(0),
+      slate_end_(-1),
+      snapshot_timestamp_(0),
+      have_snapshot_(false),
+      filling_(false),
+      stop_(false),
+      failures_in_row_(0) {
+}
+
+CaptureWatchdog::~CaptureWatchdog() {
+  Stop();
+}
+
+int CaptureWatchdog::Init(const CaptureWatchdogSettings& settings,
+                          double frame_rate, const StatusFunction& check,
+                          const StatusFunction& restart,
+                          const DeliverFunction& deliver) {
+  if (!settings.enabled || settings.stall_timeout <= 0 ||
+      settings.max_restarts <= 0 || frame_rate < 0 || !check || !restart ||
+      !deliver) {
+    LOG(ERROR) << "invalid capture watchdog settings.";
+    return kInvalidArg;
+  }
+  settings_ = settings;
+  frame_period_ = frame_rate > 0 ? 1000.0 / frame_rate : 0;
+  check_ = check;
+  restart_ = restart;
+  deliver_ = deliver;
+  return kSuccess;
+}
+
+int CaptureWatchdog::Run() {
+  if (watchdog_thread_) {
+    LOG(ERROR) << "capture watchdog already running.";
+    return kRunFailed;
+  }
+  last_input_ms_ = NowMs();
+  stop_ = false;
+  watchdog_thread_.reset(
+      new (std::nothrow) std::thread(  // NOLINT
+          &CaptureWatchdog::WatchdogThread, this));
+  if (!watchdog_thread_) {
+    LOG(ERROR) << "cannot construct capture watchdog thread.";
+    return kRunFailed;
+  }
+  return kSuccess;
+}
+
+void CaptureWatchdog::Stop() {
+  if (watchdog_thread_) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    wake_.notify_one();
+    watchdog_thread_->join();
+    watchdog_thread_.reset();
+  }
+  {
+    std::lock_guard<std::mutex> video_lock(video_mutex_);
+    filling_ = false;
+  }
+  JoinFiller();
+}
+
+int CaptureWatchdog::DeliverVideoFrame(VideoFrame* ptr_frame) {
+  last_input_ms_ = NowMs();
+  std::lock_guard<std::mutex> video_lock(video_mutex_);
+  filling_ = false;
+  int64 timestamp = 0;
+  {
+    std::lock_guard<std::mutex> timeline_lock(timeline_mutex_);
+    timestamp = MapTimestamp(ptr_frame->timestamp(), &video_);
+  }
+  ptr_frame->set_timestamp(timestamp);
+  if (frame_period_ > 0 && IsRawFormat(ptr_frame->format()) &&
+      (!have_snapshot_ ||
+       timestamp - snapshot_timestamp_ >= kSnapshotInterval)) {
+    have_snapshot_ = ptr_frame->Clone(&snapshot_) == VideoFrame::kSuccess;
+    snapshot_timestamp_ = timestamp;
+  }
+  return deliver_(ptr_frame);
+}
+
+void CaptureWatchdog::OnAudioBuffer(AudioBuffer* ptr_buffer) {
+  last_input_ms_ = NowMs();
+  std::lock_guard<std::mutex> timeline_lock(timeline_mutex_);
+  ptr_buffer->set_timestamp(MapTimestamp(ptr_buffer->timestamp(), &audio_));
+}
+
+bool CaptureWatchdog::ExtendSourceLoss(int64 timestamp) {
+  {
+    std::lock_guard<std::mutex> timeline_lock(timeline_mutex_);
+    if (!source_lost_) {
+      return false;
+    }
+    if (timestamp > slate_end_) {
+      slate_end_ = timestamp;
+    }
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++stats_.slate_loops;
+  return true;
+}
+
+void CaptureWatchdog::GetStats(CaptureWatchdogStats* ptr_stats) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  *ptr_stats = stats_;
+}
+
+int64 CaptureWatchdog::MapTimestamp(int64 timestamp,
+                                    StreamState* ptr_stream) {
+  const int64 now = NowMs();
+  const int64 restarts = restarts_;
+  const bool restarted = restarts != offset_restarts_;
+
+  // Input while no restart runs comes from the lost source itself.
+  const bool recovered = source_lost_ && (restarted || !restarting_);
+  if (restarted || recovered) {
+    const StreamState& last =
+        video_.last_time_ms >= audio_.last_time_ms ? video_ : audio_;
+    if (recovered && slate_end_ >= 0) {
+      // A slate covered the gap: carry on from its end.
+      offset_ = slate_end_ - timestamp;
+    } else if (restarted && last.started) {
+      // First input from the restarted source. Its clock starts over: carry
+      // on from the stream that delivered last, by the wall time since.
+      offset_ = last.last_timestamp + (now - last.last_time_ms) - timestamp;
+    }
+    if (last.started) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stats_.gap_ms += now - last.last_time_ms;
+    }
+    offset_restarts_ = restarts;
+    source_lost_ = false;
+    VLOG(1) << "capture timestamps offset by " << offset_ << " ms.";
+  }
+  int64 mapped = timestamp + offset_;
+  if (ptr_stream->started && mapped <= ptr_stream->last_timestamp) {
+    mapped = ptr_stream->last_timestamp + 1;
+  }
+  ptr_stream->started = true;
+  ptr_stream->last_timestamp = mapped;
+  ptr_stream->last_time_ms = now;
+  return mapped;
+}
+
+void CaptureWatchdog::WatchdogThread() {
+  ScopedThreadRegistration registration("watchdog");
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      wake_.wait_for(lock, std::chrono::milliseconds(kCheckInterval),
+                     [this]() { return stop_; });
+      if (stop_) {
+        break;
+      }
+    }
+    // Join a filler thread that has seen video again.
+    bool filling = false;
+    {
+      std::lock_guard<std::mutex> video_lock(video_mutex_);
+      filling = filling_;
+    }
+    if (!filling) {
+      JoinFiller();
+    }
+
+    const int status = check_();
+    const int64 idle = NowMs() - last_input_ms_;
+    if (status == kSuccess && idle < settings_.stall_timeout) {
+      continue;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (status != kSuccess) {
+        ++stats_.aborts;
+        LOG(WARNING) << "capture source failed (" << status
+                     << "), restarting it.";
+      } else {
+        ++stats_.stalls;
+        LOG(WARNING) << "no capture input for " << idle
+                     << " ms, restarting the source.";
+      }
+    }
+    if (!RestartSource()) {
+      break;
+    }
+  }
+}
+
+bool CaptureWatchdog::RestartSource() {
+  {
+    std::lock_guard<std::mutex> timeline_lock(timeline_mutex_);
+    if (!source_lost_) {
+      source_lost_ = true;
+      slate_end_ = -1;
+    }
+  }
+  StartFilling();
+  restarting_ = true;
+  const int status = restart_();
+  restarting_ = false;
+
+  // The source has |stall_timeout| from now to deliver again.
+  last_input_ms_ = NowMs();
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (status == kSuccess) {
+    ++restarts_;
+    ++stats_.restarts;
+    failures_in_row_ = 0;
+    LOG(INFO) << "capture source restarted.";
+    return true;
+  }
+  ++stats_.restart_failures;
+  LOG(ERROR) << "capture source restart failed (" << status << ").";
+  if (++failures_in_row_ >= settings_.max_restarts) {
+    LOG(ERROR) << "capture source restart failed " << failures_in_row_
+               << " times in a row, giving up.";
+    exhausted_ = true;
+    return false;
+  }
+  return true;
+}
+
+void CaptureWatchdog::StartFilling() {
+  {
+    std::lock_guard<std::mutex> video_lock(video_mutex_);
+    if (filling_ || !have_snapshot_) {
+      return;
+    }
+  }
+  JoinFiller();
+  std::lock_guard<std::mutex> video_lock(video_mutex_);
+  filling_ = true;
+  filler_thread_.reset(
+      new (std::nothrow) std::thread(  // NOLINT
+          &CaptureWatchdog::FillerThread, this));
+  if (!filler_thread_) {
+    LOG(ERROR) << "cannot construct capture filler thread.";
+    filling_ = false;
+  }
+}
+
+void CaptureWatchdog::JoinFiller() {
+  if (filler_thread_) {
+    filler_thread_->join();
+    filler_thread_.reset();
+  }
+}
+
+void CaptureWatchdog::FillerThread() {
+  ScopedThreadRegistration registration("filler");
+  const std::chrono::microseconds period(
+      static_cast<int64>(frame_period_ * 1000));
+  const int64 duration = std::max<int64>(1, static_cast<int64>(frame_period_));
+  Clock::time_point next_frame = Clock::now();
+  for (;;) {
+    next_frame += period;
+    std::this_thread::sleep_until(next_frame);
+    std::lock_guard<std::mutex> video_lock(video_mutex_);
+    if (!filling_) {
+      break;
+    }
+    if (snapshot_.Clone(&filler_frame_) != VideoFrame::kSuccess) {
+      LOG(ERROR) << "cannot copy a capture filler frame.";
+      filling_ = false;
+      break;
+    }
+    {
+      std::lock_guard<std::mutex> timeline_lock(timeline_mutex_);
+      video_.last_timestamp += duration;
+      video_.last_time_ms = NowMs();
+      filler_frame_.set_timestamp(video_.last_timestamp);
+    }
+    filler_frame_.set_duration(duration);
+    deliver_(&filler_frame_);
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++stats_.filler_frames;
+  }
+}
+
+}  // namespace webmlive
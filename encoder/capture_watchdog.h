@@ -0,0 +1,244 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_CAPTURE_WATCHDOG_H_
+#define WEBMLIVE_ENCODER_CAPTURE_WATCHDOG_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "encoder/audio_encoder.h"
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+#include "encoder/video_encoder.h"
+
+namespace webmlive {
+
+struct CaptureWatchdogSettings {
+  static const int kDefaultStallTimeout = 2000;
+  static const int kDefaultMaxRestarts = 5;
+
+  CaptureWatchdogSettings()
+      : enabled(false),
+        stall_timeout(kDefaultStallTimeout),
+        max_restarts(kDefaultMaxRestarts),
+        slate(false) {}
+
+  // Restart the capture source in place when it stalls or aborts, instead
+  // of ending the encode.
+  bool enabled;
+
+  // Time without input, in milliseconds, after which the source is stalled.
+  int stall_timeout;
+
+  // Restarts that may fail in a row before the encode ends.
+  int max_restarts;
+
+  // Cover the gap with a pre-encoded slate, see |FallbackSlate|, instead of
+  // repeated frames: the output carries on from the end of the slate.
+  bool slate;
+};
+
+struct CaptureWatchdogStats {
+  CaptureWatchdogStats()
+      : stalls(0), aborts(0), restarts(0), restart_failures(0),
+        filler_frames(0), gap_ms(0), slate_loops(0) {}
+
+  // Restarts caused by a source without input for
+  // |CaptureWatchdogSettings::stall_timeout|, and by a source reporting a
+  // failure.
+  int64 stalls;
+  int64 aborts;
+
+  // Restarts that succeeded, and those that failed.
+  int64 restarts;
+  int64 restart_failures;
+
+  // Repeated frames that filled the gaps, and the total length of the gaps
+  // from the last input before a restart to the first input after it.
+  int64 filler_frames;
+  int64 gap_ms;
+
+  // Slate loops the output was extended by while the source was lost.
+  int64 slate_loops;
+};
+
+// Keeps a capture source alive. A thread named "watchdog" polls the source's
+// status, and restarts the source when it reports a failure or delivers
+// nothing for |CaptureWatchdogSettings::stall_timeout| milliseconds, while
+// the encoders, muxers and the segment timeline carry on. The source is only
+// checked and restarted from the watchdog thread.
+//
+// The gap is filled: while the source is down, a filler thread delivers a
+// copy of a recent frame at the frame rate, so that the output stays
+// continuous. Timestamps delivered after a restart, which start again from
+// the new source's clock, are moved to continue the stream from where the
+// wall clock says it is.
+//
+// With |CaptureWatchdogSettings::slate|, the consumer covers the gap instead:
+// |source_lost()| is true from the moment the source is restarted until it
+// delivers again, and the consumer reserves output time for its slate with
+// |ExtendSourceLoss()|. The first input after that continues from the end
+// of the slate.
+//
+// Captured frames are passed to the video consumer by |DeliverVideoFrame()|,
+// which serializes them with the filler frames, so that the consumer sees one
+// producer. Captured audio passes through |OnAudioBuffer()|.
+//
+// Notes:
+// - |Init()| must be called before any other method, and |Run()| starts the
+//   watchdog thread once the source runs.
+// - Frames of compressed formats are never repeated.
+class CaptureWatchdog {
+ public:
+  // Return the status of the capture source, and restart it: 0 when it
+  // runs.
+  typedef std::function<int()> StatusFunction;
+
+  // Passes a frame to the video consumer, returning its status.
+  typedef std::function<int(VideoFrame*)> DeliverFunction;
+
+  // Stream time between the frames copied for filling, in milliseconds.
+  static const int kSnapshotInterval = 1000;
+
+  // Interval at which the watchdog thread checks the source, in
+  // milliseconds.
+  static const int kCheckInterval = 50;
+
+  enum {
+    kRunFailed = -2,
+    kInvalidArg = -1,
+    kSuccess = 0,
+  };
+
+  CaptureWatchdog();
+  ~CaptureWatchdog();
+
+  // Stores |settings|. |frame_rate| paces the filler frames, which are not
+  // made when it is 0. Returns |kInvalidArg| when |settings| are not enabled
+  // or invalid, or a function is missing.
+  int Init(const CaptureWatchdogSettings& settings, double frame_rate,
+           const StatusFunction& check, const StatusFunction& restart,
+           const DeliverFunction& deliver);
+
+  // Starts the watchdog thread.
+  int Run();
+
+  // Stops the watchdog and filler threads.
+  void Stop();
+
+  // Passes a captured frame to the deliver function and returns its status:
+  // moves its timestamp after a restart, ends filling, and copies the frame
+  // for filling every |kSnapshotInterval|. Thread safe.
+  int DeliverVideoFrame(VideoFrame* ptr_frame);
+
+  // Passes captured audio: moves its timestamp after a restart. Thread safe.
+  void OnAudioBuffer(AudioBuffer* ptr_buffer);
+
+  // Returns true once |CaptureWatchdogSettings::max_restarts| restarts have
+  // failed in a row: the source is given up.
+  bool exhausted() const { return exhausted_; }
+
+  // Returns true from the restart of a source until its first input.
+  bool source_lost() const { return source_lost_; }
+
+  // Moves the time the first input after the loss is given to at least
+  // |timestamp|, and returns true, or returns false once the source has
+  // delivered input again. Thread safe.
+  bool ExtendSourceLoss(int64 timestamp);
+
+  // Output time reserved by |ExtendSourceLoss()| since the source was last
+  // lost, or -1 when none was.
+  int64 slate_end() const { return slate_end_; }
+
+  // Copies the counters to |ptr_stats|. Thread safe.
+  void GetStats(CaptureWatchdogStats* ptr_stats) const;
+
+ private:
+  // Timeline of a captured stream, in output milliseconds, and the wall
+  // clock time of its last input.
+  struct StreamState {
+    StreamState()
+        : started(false), restarts(0), last_timestamp(0), last_time_ms(0) {}
+    bool started;
+    int64 restarts;
+    int64 last_timestamp;
+    int64 last_time_ms;
+  };
+
+  // Returns |timestamp| moved onto the output timeline of |ptr_stream|.
+  int64 MapTimestamp(int64 timestamp, StreamState* ptr_stream);
+
+  // Watchdog and filler thread functions.
+  void WatchdogThread();
+  void FillerThread();
+
+  // Restarts the source while filling the gap. Returns true while the
+  // watchdog should go on.
+  bool RestartSource();
+
+  // Starts delivering filler frames, which go on until the source delivers
+  // video again, and joins the filler thread.
+  void StartFilling();
+  void JoinFiller();
+
+  CaptureWatchdogSettings settings_;
+  double frame_period_;
+  StatusFunction check_;
+  StatusFunction restart_;
+  DeliverFunction deliver_;
+
+  // Wall clock time of the newest input, and restarts that succeeded; read
+  // by the capture callbacks without |mutex_|.
+  std::atomic<int64> last_input_ms_;
+  std::atomic<int64> restarts_;
+  std::atomic<bool> exhausted_;
+
+  // Set from the first restart after input until the next input, and while
+  // |restart_| runs. Written under |timeline_mutex_|.
+  std::atomic<bool> source_lost_;
+  std::atomic<bool> restarting_;
+
+  // Video and audio timelines, the offset added to timestamps after the last
+  // restart, the restart it was computed for, and the time reserved by
+  // |ExtendSourceLoss()|. Protected by |timeline_mutex_|; |slate_end_| is
+  // also read without it.
+  StreamState video_;
+  StreamState audio_;
+  int64 offset_;
+  int64 offset_restarts_;
+  std::atomic<int64> slate_end_;
+  std::mutex timeline_mutex_;
+
+  // Frame copied for filling and its stream time, the frame being delivered
+  // by the filler thread, and whether it is filling. Protected by
+  // |video_mutex_|, which is held while frames are delivered.
+  VideoFrame snapshot_;
+  int64 snapshot_timestamp_;
+  bool have_snapshot_;
+  VideoFrame filler_frame_;
+  bool filling_;
+  std::mutex video_mutex_;
+  std::unique_ptr<std::thread> filler_thread_;
+
+  // Watchdog thread state and the counters, protected by |mutex_|.
+  std::unique_ptr<std::thread> watchdog_thread_;
+  bool stop_;
+  int failures_in_row_;
+  CaptureWatchdogStats stats_;
+  mutable std::mutex mutex_;
+  std::condition_variable wake_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(CaptureWatchdog);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_CAPTURE_WATCHDOG_H_
@@ -0,0 +1,285 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/control_server.h"
+
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <sstream>
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+#include "encoder/thread_util.h"
+#include "glog/logging.h"
+
+namespace {
+
+#ifdef _WIN32
+const SOCKET kInvalidSocket = INVALID_SOCKET;
+#else
+const int kInvalidSocket = -1;
+#endif
+
+// Limits on the size of request headers and bodies, in bytes.
+const size_t kMaxHeaderLength = 4096;
+const size_t kMaxBodyLength = 65536;
+
+// Time |ServerThread()| waits for a connection before checking |stop_|, and
+// the longest time it waits for a client to send its request, in
+// milliseconds.
+const int kAcceptPollInterval = 200;
+const int kReceiveTimeout = 1000;
+
+const char kHeaderEnd[] = "\r\n\r\n";
+const char kContentLength[] = "content-length:";
+
+// Returns the reason phrase of the HTTP status |code|.
+const char* ReasonPhrase(int code) {
+  switch (code) {
+    case 200: return "OK";
+    case 201: return "Created";
+    case 202: return "Accepted";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 409: return "Conflict";
+    case 413: return "Payload Too Large";
+    default: return "Internal Server Error";
+  }
+}
+
+}  // anonymous namespace
+
+namespace webmlive {
+
+ControlServer::ControlServer()
+    : ptr_handler_(NULL),
+      listen_socket_(kInvalidSocket),
+      initialized_(false),
+      stop_(false),
+      requests_(0) {
+}
+
+ControlServer::~ControlServer() {
+  Stop();
+  if (listen_socket_ != kInvalidSocket) {
+    CloseSocket(listen_socket_);
+  }
+#ifdef _WIN32
+  if (initialized_) {
+    WSACleanup();
+  }
+#endif
+}
+
+int ControlServer::Init(const ControlServerSettings& settings,
+                        ControlHandlerInterface* ptr_handler) {
+  if (settings.port <= 0 || settings.port > 65535 || !ptr_handler) {
+    LOG(ERROR) << "invalid control port: " << settings.port
+               << " or NULL handler.";
+    return kInvalidArg;
+  }
+  settings_ = settings;
+  ptr_handler_ = ptr_handler;
+
+#ifdef _WIN32
+  WSADATA wsa_data;
+  if (WSAStartup(MAKEWORD(2, 2), &wsa_data)) {
+    LOG(ERROR) << "WSAStartup failed.";
+    return kSocketError;
+  }
+#endif
+  initialized_ = true;
+
+  listen_socket_ = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (listen_socket_ == kInvalidSocket) {
+    LOG(ERROR) << "cannot create control socket.";
+    return kSocketError;
+  }
+  const int reuse_address = 1;
+  setsockopt(listen_socket_, SOL_SOCKET, SO_REUSEADDR,
+             reinterpret_cast<const char*>(&reuse_address),
+             sizeof(reuse_address));
+
+  // The API starts and stops encoders: keep it off the network.
+  sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(static_cast<uint16>(settings_.port));
+  if (bind(listen_socket_, reinterpret_cast<const sockaddr*>(&address),
+           sizeof(address)) ||
+      listen(listen_socket_, SOMAXCONN)) {
+    LOG(ERROR) << "cannot listen on control port " << settings_.port;
+    return kSocketError;
+  }
+  LOG(INFO) << "control server listening on 127.0.0.1:" << settings_.port;
+  return kSuccess;
+}
+
+int ControlServer::Run() {
+  if (listen_socket_ == kInvalidSocket || server_thread_) {
+    LOG(ERROR) << "control server not initialized, or already running.";
+    return kRunFailed;
+  }
+  stop_ = false;
+  server_thread_.reset(
+      new (std::nothrow) std::thread(  // NOLINT
+          &ControlServer::ServerThread, this));
+  if (!server_thread_) {
+    LOG(ERROR) << "cannot construct control server thread.";
+    return kRunFailed;
+  }
+  return kSuccess;
+}
+
+void ControlServer::Stop() {
+  if (!server_thread_) {
+    return;
+  }
+  stop_ = true;
+  server_thread_->join();
+  server_thread_.reset();
+}
+
+void ControlServer::ServerThread() {
+  ScopedThreadRegistration registration("control");
+  LOG(INFO) << "control ServerThread started.";
+  while (!stop_) {
+    fd_set read_set;
+    FD_ZERO(&read_set);
+    FD_SET(listen_socket_, &read_set);
+    timeval timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_usec = kAcceptPollInterval * 1000;
+    const int ready = select(static_cast<int>(listen_socket_) + 1, &read_set,
+                             NULL, NULL, &timeout);
+    if (ready <= 0) {
+      continue;
+    }
+    const Socket client_socket = accept(listen_socket_, NULL, NULL);
+    if (client_socket == kInvalidSocket) {
+      continue;
+    }
+    ServeConnection(client_socket);
+    CloseSocket(client_socket);
+  }
+  LOG(INFO) << "control ServerThread finished.";
+}
+
+void ControlServer::ServeConnection(Socket socket) {
+  // A client that connects and sends nothing must not stall the server.
+#ifdef _WIN32
+  const DWORD receive_timeout = kReceiveTimeout;
+#else
+  timeval receive_timeout;
+  receive_timeout.tv_sec = kReceiveTimeout / 1000;
+  receive_timeout.tv_usec = (kReceiveTimeout % 1000) * 1000;
+#endif
+  setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO,
+             reinterpret_cast<const char*>(&receive_timeout),
+             sizeof(receive_timeout));
+
+  std::string request;
+  size_t header_end = std::string::npos;
+  while ((header_end = request.find(kHeaderEnd)) == std::string::npos) {
+    if (request.length() > kMaxHeaderLength) {
+      return;
+    }
+    char data[1024];
+    const int bytes_read = recv(socket, data, sizeof(data), 0);
+    if (bytes_read <= 0) {
+      return;
+    }
+    request.append(data, bytes_read);
+  }
+  header_end += strlen(kHeaderEnd);
+
+  // Header names are case insensitive.
+  std::string headers = request.substr(0, header_end);
+  for (size_t i = 0; i < headers.length(); ++i) {
+    headers[i] = static_cast<char>(tolower(headers[i]));
+  }
+  size_t body_length = 0;
+  const size_t length_field = headers.find(kContentLength);
+  if (length_field != std::string::npos) {
+    body_length = strtoul(
+        headers.c_str() + length_field + strlen(kContentLength), NULL, 10);
+  }
+
+  int code = 200;
+  std::string response_body;
+  if (body_length > kMaxBodyLength) {
+    code = 413;
+  } else {
+    while (request.length() < header_end + body_length) {
+      char data[1024];
+      const int bytes_read = recv(socket, data, sizeof(data), 0);
+      if (bytes_read <= 0) {
+        return;
+      }
+      request.append(data, bytes_read);
+    }
+
+    // Request line: METHOD SP target SP version.
+    const size_t method_end = request.find(' ');
+    const size_t target_end = request.find(' ', method_end + 1);
+    const std::string method = request.substr(0, method_end);
+    std::string target;
+    if (method_end != std::string::npos && target_end != std::string::npos) {
+      target = request.substr(method_end + 1, target_end - method_end - 1);
+    }
+    code = ptr_handler_->HandleControlRequest(
+        method, target, request.substr(header_end, body_length),
+        &response_body);
+  }
+
+  std::ostringstream response;
+  response << "HTTP/1.1 " << code << " " << ReasonPhrase(code) << "\r\n"
+           << "Content-Type: text/plain\r\n"
+           << "Content-Length: " << response_body.length() << "\r\n"
+           << "Cache-Control: no-cache\r\n"
+           << "Connection: close\r\n\r\n"
+           << response_body;
+  ++requests_;
+
+#ifdef MSG_NOSIGNAL
+  const int kSendFlags = MSG_NOSIGNAL;
+#else
+  const int kSendFlags = 0;
+#endif
+  const std::string response_data = response.str();
+  const char* ptr_data = response_data.data();
+  int length = static_cast<int>(response_data.length());
+  while (length > 0) {
+    const int bytes_sent = send(socket, ptr_data, length, kSendFlags);
+    if (bytes_sent <= 0) {
+      return;
+    }
+    ptr_data += bytes_sent;
+    length -= bytes_sent;
+  }
+}
+
+void ControlServer::CloseSocket(Socket socket) {
+#ifdef _WIN32
+  closesocket(socket);
+#else
+  close(socket);
+#endif
+}
+
+}  // namespace webmlive
@@ -0,0 +1,116 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_CONTROL_SERVER_H_
+#define WEBMLIVE_ENCODER_CONTROL_SERVER_H_
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+
+#ifdef _WIN32
+#include <winsock2.h>
+#endif
+
+namespace webmlive {
+
+struct ControlServerSettings {
+  ControlServerSettings() : port(0) {}
+
+  // TCP port the server listens on, on the loopback interface only.
+  int port;
+};
+
+// Answers the requests of a |ControlServer|.
+class ControlHandlerInterface {
+ public:
+  // Answers the request |method| for |path|, which carried |body|. Stores the
+  // response body, plain text, in |ptr_response| and returns the HTTP status
+  // code of the response. Called on the server thread.
+  virtual int HandleControlRequest(const std::string& method,
+                                   const std::string& path,
+                                   const std::string& body,
+                                   std::string* ptr_response) = 0;
+
+ protected:
+  virtual ~ControlHandlerInterface() {}
+};
+
+// Serves a local HTTP control API: each request, with its body when it has
+// a Content-Length, is passed to a |ControlHandlerInterface|, and its
+// answer sent back as text/plain. Only connections from the local host are
+// possible: the server listens on the loopback interface.
+//
+// Notes:
+// - |Init| must be called before any other method.
+// - Requests are served one at a time by the server thread, and each
+//   connection is closed after its response, like |MetricsServer|.
+class ControlServer {
+ public:
+  enum {
+    // Socket setup failed.
+    kSocketError = -703,
+
+    // Invalid argument supplied to method call.
+    kInvalidArg = -702,
+
+    // Server |Run| failed.
+    kRunFailed = -701,
+
+    // Success.
+    kSuccess = 0,
+  };
+
+  ControlServer();
+  ~ControlServer();
+
+  // Copies |settings|, stores |ptr_handler|, which must outlive the server,
+  // and opens the listening socket. Returns |kSuccess| upon success.
+  int Init(const ControlServerSettings& settings,
+           ControlHandlerInterface* ptr_handler);
+
+  // Runs the thread that serves requests.
+  int Run();
+
+  // Stops the server thread after the request in progress, if any.
+  void Stop();
+
+  // Returns the number of requests answered.
+  int64 requests() const { return requests_.load(); }
+
+ private:
+#ifdef _WIN32
+  typedef SOCKET Socket;
+#else
+  typedef int Socket;
+#endif
+
+  // Accepts and serves connections until |stop_| is set.
+  void ServerThread();
+
+  // Reads one request from |socket| and answers it.
+  void ServeConnection(Socket socket);
+
+  static void CloseSocket(Socket socket);
+
+  ControlServerSettings settings_;
+  ControlHandlerInterface* ptr_handler_;
+  Socket listen_socket_;
+  bool initialized_;
+  std::atomic<bool> stop_;
+  std::unique_ptr<std::thread> server_thread_;
+  std::atomic<int64> requests_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(ControlServer);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_CONTROL_SERVER_H_
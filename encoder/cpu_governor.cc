@@ -0,0 +1,158 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/cpu_governor.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+#include "glog/logging.h"
+
+namespace webmlive {
+
+namespace {
+
+// Fastest realtime speeds of libvpx, the |VpxConfig::max_speed| defaults.
+const int kVp8MaxSpeed = 16;
+const int kVp9MaxSpeed = 8;
+
+}  // namespace
+
+CpuGovernor::CpuGovernor()
+    : budget_cores_(0), started_(false), interval_start_ms_(0) {}
+
+int CpuGovernor::Init(const CpuGovernorSettings& settings, int cores) {
+  if (!settings.enabled || settings.budget < 1 || settings.budget > 100 ||
+      cores < 1) {
+    LOG(ERROR) << "invalid CPU governor settings.";
+    return kInvalidArg;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  budget_cores_ = cores * settings.budget / 100.0;
+  started_ = false;
+  channels_.clear();
+  return kSuccess;
+}
+
+int CpuGovernor::AddChannel(int priority, const VpxConfig& vpx_config) {
+  if (vpx_config.speed == VpxConfig::kUseDefault) {
+    return -1;
+  }
+  Channel channel;
+  channel.active = true;
+  channel.priority = priority;
+  channel.speed_sign = vpx_config.speed < 0 ? -1 : 1;
+  channel.min_speed = std::abs(vpx_config.speed);
+  channel.max_speed = vpx_config.max_speed != VpxConfig::kUseDefault ?
+      std::abs(vpx_config.max_speed) :
+      (vpx_config.codec == kVideoFormatVP9 ? kVp9MaxSpeed : kVp8MaxSpeed);
+  channel.max_speed = std::max(channel.max_speed, channel.min_speed);
+  channel.speed = channel.min_speed;
+  std::lock_guard<std::mutex> lock(mutex_);
+  channels_.push_back(channel);
+  return static_cast<int>(channels_.size()) - 1;
+}
+
+void CpuGovernor::RemoveChannel(int channel) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (channel >= 0 && channel < static_cast<int>(channels_.size())) {
+    channels_[channel].active = false;
+  }
+}
+
+int CpuGovernor::Update(int channel, int64 now_ms, int64 encode_us) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (channel < 0 || channel >= static_cast<int>(channels_.size()) ||
+      !channels_[channel].active) {
+    return VpxConfig::kUseDefault;
+  }
+  Channel& state = channels_[channel];
+  if (!state.started) {
+    state.started = true;
+    state.interval_start_us = encode_us;
+  }
+  state.encode_us = encode_us;
+  if (!started_) {
+    started_ = true;
+    interval_start_ms_ = now_ms;
+  } else if (now_ms - interval_start_ms_ >= kInterval) {
+    CheckBudget(now_ms);
+  }
+  const int speed = state.pending_speed;
+  state.pending_speed = VpxConfig::kUseDefault;
+  return speed;
+}
+
+void CpuGovernor::GetStats(
+    std::vector<CpuGovernorChannelStats>* ptr_stats) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  ptr_stats->resize(channels_.size());
+  for (size_t i = 0; i < channels_.size(); ++i) {
+    const Channel& channel = channels_[i];
+    CpuGovernorChannelStats& stats = (*ptr_stats)[i];
+    stats.priority = channel.priority;
+    stats.speed = channel.speed_sign * channel.speed;
+    stats.load = channel.load;
+    stats.speed_changes = channel.speed_changes;
+  }
+}
+
+void CpuGovernor::CheckBudget(int64 now_ms) {
+  const double interval_us = (now_ms - interval_start_ms_) * 1000.0;
+  interval_start_ms_ = now_ms;
+  double load_us = 0;
+  for (size_t i = 0; i < channels_.size(); ++i) {
+    Channel& channel = channels_[i];
+    const int64 channel_us = channel.encode_us - channel.interval_start_us;
+    channel.interval_start_us = channel.encode_us;
+    channel.load = channel_us * 100.0 / interval_us;
+    if (channel.active) {
+      load_us += channel_us;
+    }
+  }
+
+  const double budget_us = budget_cores_ * interval_us;
+  Channel* ptr_target = NULL;
+  if (load_us > budget_us) {
+    // The last channel of the lowest priority gives way first.
+    for (size_t i = 0; i < channels_.size(); ++i) {
+      Channel& channel = channels_[i];
+      if (channel.active && channel.speed < channel.max_speed &&
+          (!ptr_target || channel.priority <= ptr_target->priority)) {
+        ptr_target = &channel;
+      }
+    }
+    if (ptr_target) {
+      SetSpeed(ptr_target->speed + 1, ptr_target);
+    }
+  } else if (load_us < budget_us * (100 - kReleaseMargin) / 100) {
+    // The first channel of the highest priority recovers first.
+    for (size_t i = 0; i < channels_.size(); ++i) {
+      Channel& channel = channels_[i];
+      if (channel.active && channel.speed > channel.min_speed &&
+          (!ptr_target || channel.priority > ptr_target->priority)) {
+        ptr_target = &channel;
+      }
+    }
+    if (ptr_target) {
+      SetSpeed(ptr_target->speed - 1, ptr_target);
+    }
+  }
+}
+
+void CpuGovernor::SetSpeed(int speed, Channel* ptr_channel) {
+  LOG(INFO) << "CPU governor: channel "
+            << ptr_channel - &channels_[0] << " priority "
+            << ptr_channel->priority << " speed "
+            << ptr_channel->speed_sign * ptr_channel->speed << " -> "
+            << ptr_channel->speed_sign * speed;
+  ptr_channel->speed = speed;
+  ptr_channel->pending_speed = ptr_channel->speed_sign * speed;
+  ++ptr_channel->speed_changes;
+}
+
+}  // namespace webmlive
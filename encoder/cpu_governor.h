@@ -0,0 +1,151 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_CPU_GOVERNOR_H_
+#define WEBMLIVE_ENCODER_CPU_GOVERNOR_H_
+
+#include <mutex>
+#include <vector>
+
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+#include "encoder/video_encoder.h"
+
+namespace webmlive {
+
+struct CpuGovernorSettings {
+  static const int kDefaultBudget = 85;
+
+  CpuGovernorSettings() : enabled(false), budget(kDefaultBudget) {}
+
+  // Share the encode time of a host's channels out by priority.
+  bool enabled;
+
+  // Encode time all channels may use, in percent of the host's cores.
+  int budget;
+};
+
+struct CpuGovernorChannelStats {
+  CpuGovernorChannelStats()
+      : priority(0), speed(0), load(0), speed_changes(0) {}
+
+  int priority;
+
+  // Current |VpxConfig::speed| of the channel.
+  int speed;
+
+  // Encode time of the channel over the last interval, in percent of one
+  // core.
+  double load;
+
+  // Speed changes the governor made.
+  int64 speed_changes;
+};
+
+// Keeps the encoders of the channels of a host within a share of its cores.
+// Each channel reports the encode time of its encoders, and every
+// |kInterval| the governor compares their sum with the budget: over it, the
+// channel of the lowest priority that can go faster gets a one step faster
+// libvpx speed; below the budget by |kReleaseMargin| percent, the channel of
+// the highest priority running faster than its configured speed steps back
+// toward it. Low priority channels thus give up quality first when the host
+// saturates, and the important channels keep realtime encoding; speeds
+// return, important channels first, once load drops.
+//
+// Speeds stay between the configured speed of the channel, which is its best
+// quality, and its |VpxConfig::max_speed|.
+//
+// Notes:
+// - |Init()| and |AddChannel()| must be called before |Update()|.
+// - Thread safe: each channel calls |Update()| from its own thread.
+class CpuGovernor {
+ public:
+  // Time between budget checks, in milliseconds.
+  static const int kInterval = 1000;
+
+  // Percent of the budget the load must fall below before speeds step back.
+  static const int kReleaseMargin = 15;
+
+  enum {
+    kInvalidArg = -1,
+    kSuccess = 0,
+  };
+
+  CpuGovernor();
+  ~CpuGovernor() {}
+
+  // Sets up a budget of |settings.budget| percent of |cores| cores. Returns
+  // |kInvalidArg| when |settings| are not enabled or invalid.
+  int Init(const CpuGovernorSettings& settings, int cores);
+
+  // Adds a channel of |priority| encoding with |vpx_config|. Returns the
+  // channel's index, or -1 when |vpx_config| leaves the speed at its
+  // default: the channel is then not governed.
+  int AddChannel(int priority, const VpxConfig& vpx_config);
+
+  // Stops governing |channel|, whose encode time no longer counts.
+  void RemoveChannel(int channel);
+
+  // Records |encode_us|, the total encode time of |channel| in microseconds,
+  // at |now_ms|, and checks the budget once |kInterval| has passed. Returns
+  // the speed |channel| must switch to, or |VpxConfig::kUseDefault| to keep
+  // its speed.
+  int Update(int channel, int64 now_ms, int64 encode_us);
+
+  // Copies the state of each channel to |ptr_stats|, by index.
+  void GetStats(std::vector<CpuGovernorChannelStats>* ptr_stats) const;
+
+ private:
+  struct Channel {
+    Channel()
+        : active(false), priority(0), speed_sign(1), min_speed(0),
+          max_speed(0), speed(0), pending_speed(VpxConfig::kUseDefault),
+          started(false), encode_us(0), interval_start_us(0), load(0),
+          speed_changes(0) {}
+    bool active;
+    int priority;
+
+    // |VpxConfig::speed| as a sign and magnitude; larger magnitudes are
+    // faster.
+    int speed_sign;
+    int min_speed;
+    int max_speed;
+    int speed;
+
+    // Speed chosen and not yet returned by |Update()|.
+    int pending_speed;
+
+    // Latest total encode time, and the total at the start of the interval.
+    bool started;
+    int64 encode_us;
+    int64 interval_start_us;
+
+    double load;
+    int64 speed_changes;
+  };
+
+  // Measures the interval ending at |now_ms| and moves one channel's speed.
+  // Called with |mutex_| held.
+  void CheckBudget(int64 now_ms);
+
+  // Sets |ptr_channel| to the speed magnitude |speed|, and queues it for
+  // |Update()|.
+  void SetSpeed(int speed, Channel* ptr_channel);
+
+  // Cores the encoders of the channels may keep busy.
+  double budget_cores_;
+
+  bool started_;
+  int64 interval_start_ms_;
+  std::vector<Channel> channels_;
+  mutable std::mutex mutex_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(CpuGovernor);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_CPU_GOVERNOR_H_
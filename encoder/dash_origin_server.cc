@@ -0,0 +1,551 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/dash_origin_server.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <new>
+#include <sstream>
+#include <utility>
+#include <vector>
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include "encoder/thread_util.h"
+#include "glog/logging.h"
+
+namespace {
+
+#ifdef _WIN32
+const SOCKET kInvalidSocket = INVALID_SOCKET;
+#else
+const int kInvalidSocket = -1;
+#endif
+
+// Limit on the size of request headers, in bytes.
+const size_t kMaxRequestLength = 8192;
+
+// Time |ListenerThread()| waits for a connection before checking |stop_|, in
+// milliseconds.
+const int kAcceptPollInterval = 200;
+
+const char kHeaderEnd[] = "\r\n\r\n";
+const char kManifestSuffix[] = ".mpd";
+const char kSegmentSuffix[] = ".chk";
+
+bool EndsWith(const std::string& str, const char* suffix) {
+  const size_t suffix_length = strlen(suffix);
+  return str.length() >= suffix_length &&
+         str.compare(str.length() - suffix_length, suffix_length, suffix) == 0;
+}
+
+// Parses the |t| parameter of the request query |query| into |ptr_time|.
+// Returns false when |query| has no valid |t| parameter.
+bool ParseTimeParameter(const std::string& query, int64* ptr_time) {
+  size_t start = 0;
+  while (start < query.length()) {
+    size_t end = query.find('&', start);
+    if (end == std::string::npos) {
+      end = query.length();
+    }
+    if (end > start + 2 && query.compare(start, 2, "t=") == 0) {
+      const std::string value = query.substr(start + 2, end - start - 2);
+      char* ptr_end = NULL;
+      *ptr_time = strtoll(value.c_str(), &ptr_end, 10);
+      return *ptr_end == '\0';
+    }
+    start = end + 1;
+  }
+  return false;
+}
+
+}  // anonymous namespace
+
+namespace webmlive {
+
+DashOriginServer::DashOriginServer()
+    : listen_socket_(kInvalidSocket),
+      initialized_(false),
+      stop_(false) {
+  memset(&stats_, 0, sizeof(stats_));
+}
+
+DashOriginServer::~DashOriginServer() {
+  Stop();
+  if (listen_socket_ != kInvalidSocket) {
+    CloseSocket(listen_socket_);
+  }
+#ifdef _WIN32
+  if (initialized_) {
+    WSACleanup();
+  }
+#endif
+}
+
+int DashOriginServer::Init(const DashOriginServerSettings& settings) {
+  if (settings.port <= 0 || settings.port > 65535) {
+    LOG(ERROR) << "invalid server port: " << settings.port;
+    return kInvalidArg;
+  }
+  if (settings.segment_count <= 0 || settings.time_shift_window < 0 ||
+      settings.wait_timeout < 0) {
+    LOG(ERROR) << "invalid server settings.";
+    return kInvalidArg;
+  }
+  settings_ = settings;
+
+#ifdef _WIN32
+  WSADATA wsa_data;
+  if (WSAStartup(MAKEWORD(2, 2), &wsa_data)) {
+    LOG(ERROR) << "WSAStartup failed.";
+    return kSocketError;
+  }
+#endif
+  initialized_ = true;
+
+  listen_socket_ = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (listen_socket_ == kInvalidSocket) {
+    LOG(ERROR) << "cannot create server socket.";
+    return kSocketError;
+  }
+  const int reuse_address = 1;
+  setsockopt(listen_socket_, SOL_SOCKET, SO_REUSEADDR,
+             reinterpret_cast<const char*>(&reuse_address),
+             sizeof(reuse_address));
+
+  sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  address.sin_port = htons(static_cast<uint16>(settings_.port));
+  if (bind(listen_socket_, reinterpret_cast<const sockaddr*>(&address),
+           sizeof(address)) ||
+      listen(listen_socket_, SOMAXCONN)) {
+    LOG(ERROR) << "cannot listen on port " << settings_.port;
+    return kSocketError;
+  }
+  LOG(INFO) << "DASH origin server listening on port " << settings_.port;
+  return kSuccess;
+}
+
+int DashOriginServer::Run() {
+  if (listen_socket_ == kInvalidSocket || listener_thread_) {
+    LOG(ERROR) << "server not initialized, or already running.";
+    return kRunFailed;
+  }
+  stop_ = false;
+  listener_thread_.reset(
+      new (std::nothrow) std::thread(  // NOLINT
+          &DashOriginServer::ListenerThread, this));
+  if (!listener_thread_) {
+    LOG(ERROR) << "cannot construct listener thread.";
+    return kRunFailed;
+  }
+  return kSuccess;
+}
+
+void DashOriginServer::Stop() {
+  if (!listener_thread_) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  file_written_.notify_all();
+  listener_thread_->join();
+  listener_thread_.reset();
+
+  // Shutting down the sockets wakes connection threads blocked in recv() or
+  // send().
+  for (auto& connection : connections_) {
+#ifdef _WIN32
+    shutdown(connection->socket, SD_BOTH);
+#else
+    shutdown(connection->socket, SHUT_RDWR);
+#endif
+  }
+  for (auto& connection : connections_) {
+    connection->thread.join();
+    CloseSocket(connection->socket);
+  }
+  connections_.clear();
+}
+
+int DashOriginServer::GetStats(DashOriginServerStats* ptr_stats) {
+  if (!ptr_stats) {
+    return kInvalidArg;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  *ptr_stats = stats_;
+  return kSuccess;
+}
+
+bool DashOriginServer::WriteData(const uint8* ptr_data, int32 data_length,
+                                 const std::string& id) {
+  if (!ptr_data || data_length < 0 || id.empty()) {
+    LOG(ERROR) << "invalid server write.";
+    return false;
+  }
+  WebmChunk::Data data(ptr_data, ptr_data + data_length);
+  WebmChunkDescriptor descriptor;
+  descriptor.length = data_length;
+  SharedWebmChunk chunk(
+      new (std::nothrow) WebmChunk(id, descriptor, 0, &data,  // NOLINT
+                                   SharedWebmChunkDataPool()));
+  if (!chunk) {
+    LOG(ERROR) << "out of memory.";
+    return false;
+  }
+  return WriteChunk(chunk);
+}
+
+bool DashOriginServer::WriteChunk(const SharedWebmChunk& chunk) {
+  if (!chunk || chunk->id().empty()) {
+    LOG(ERROR) << "invalid server chunk.";
+    return false;
+  }
+  const std::string& name = chunk->id();
+
+  // Media segments expire once their representation has
+  // |settings_.segment_count| newer ones, or once they fall out of the
+  // time-shift window. The representation is named by the segment name up to
+  // the segment number. Chunks are released outside the lock; they may return
+  // their storage to a muxer pool.
+  SharedWebmChunk replaced_chunk;
+  std::vector<SharedWebmChunk> expired_chunks;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    SharedWebmChunk& file = files_[name];
+    replaced_chunk.swap(file);
+    file = chunk;
+    if (EndsWith(name, kSegmentSuffix)) {
+      if (replaced_chunk) {
+        stats_.bytes_held -= replaced_chunk->length();
+      } else {
+        ++stats_.segments_held;
+      }
+      stats_.bytes_held += chunk->length();
+      SegmentIndex& segments = segments_[name.substr(0, name.rfind('_'))];
+      HeldSegment& held = segments[chunk->timestamp()];
+      held.name = name;
+      held.end_time = chunk->timestamp() + chunk->duration();
+      while (!segments.empty()) {
+        const HeldSegment& oldest = segments.begin()->second;
+        const bool expired = settings_.time_shift_window > 0 ?
+            oldest.end_time < segments.rbegin()->second.end_time -
+                              settings_.time_shift_window :
+            static_cast<int>(segments.size()) > settings_.segment_count;
+        if (!expired) {
+          break;
+        }
+        std::map<std::string, SharedWebmChunk>::iterator expired_file =
+            files_.find(oldest.name);
+        if (expired_file != files_.end()) {
+          --stats_.segments_held;
+          stats_.bytes_held -= expired_file->second->length();
+          expired_chunks.push_back(expired_file->second);
+          files_.erase(expired_file);
+        }
+        segments.erase(segments.begin());
+      }
+    }
+  }
+  file_written_.notify_all();
+  return true;
+}
+
+void DashOriginServer::ListenerThread() {
+  ScopedThreadRegistration registration("dash_listener");
+  LOG(INFO) << "ListenerThread started.";
+  while (!stop_) {
+    ReapConnections();
+
+    fd_set read_set;
+    FD_ZERO(&read_set);
+    FD_SET(listen_socket_, &read_set);
+    timeval timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_usec = kAcceptPollInterval * 1000;
+    const int ready = select(static_cast<int>(listen_socket_) + 1, &read_set,
+                             NULL, NULL, &timeout);
+    if (ready <= 0) {
+      continue;
+    }
+    const Socket client_socket = accept(listen_socket_, NULL, NULL);
+    if (client_socket == kInvalidSocket) {
+      continue;
+    }
+    std::unique_ptr<Connection> connection(
+        new (std::nothrow) Connection());  // NOLINT
+    if (!connection) {
+      LOG(ERROR) << "out of memory.";
+      CloseSocket(client_socket);
+      continue;
+    }
+    connection->socket = client_socket;
+    connection->thread = std::thread(&DashOriginServer::ConnectionThread, this,
+                                     connection.get());
+    connections_.push_back(std::move(connection));
+  }
+  LOG(INFO) << "ListenerThread finished.";
+}
+
+void DashOriginServer::ReapConnections() {
+  std::list<std::unique_ptr<Connection>>::iterator connection =
+      connections_.begin();
+  while (connection != connections_.end()) {
+    if ((*connection)->done) {
+      (*connection)->thread.join();
+      CloseSocket((*connection)->socket);
+      connection = connections_.erase(connection);
+    } else {
+      ++connection;
+    }
+  }
+}
+
+void DashOriginServer::ConnectionThread(Connection* ptr_connection) {
+  ScopedThreadRegistration registration("dash_connection");
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++stats_.connections;
+  }
+  const Socket socket = ptr_connection->socket;
+  std::string buffer;
+  std::string request;
+  bool keep_alive = true;
+  while (keep_alive && !stop_ && ReadRequest(socket, &buffer, &request)) {
+    // Request line: METHOD SP target SP version.
+    const size_t method_end = request.find(' ');
+    const size_t target_end = request.find(' ', method_end + 1);
+    const size_t line_end = request.find("\r\n");
+    if (method_end == std::string::npos || target_end == std::string::npos ||
+        target_end > line_end) {
+      break;
+    }
+    const std::string method = request.substr(0, method_end);
+    std::string name =
+        request.substr(method_end + 1, target_end - method_end - 1);
+    const std::string version =
+        request.substr(target_end + 1, line_end - target_end - 1);
+    std::string query;
+    const size_t query_start = name.find('?');
+    if (query_start != std::string::npos) {
+      query = name.substr(query_start + 1);
+      name.erase(query_start);
+    }
+    if (!name.empty() && name[0] == '/') {
+      name.erase(0, 1);
+    }
+
+    std::string headers = request.substr(line_end);
+    std::transform(headers.begin(), headers.end(), headers.begin(), ::tolower);
+    keep_alive = version != "HTTP/1.0" &&
+                 headers.find("\r\nconnection: close") == std::string::npos;
+
+    // Files are served from a flat namespace, so names with a path
+    // separator are never found. A request with a time names a
+    // representation, and is answered with its segment at that time.
+    const bool head = (method == "HEAD");
+    const bool supported = (method == "GET" || head);
+    int64 time = 0;
+    const bool time_request = ParseTimeParameter(query, &time);
+    std::string segment_name;
+    SharedWebmChunk file;
+    if (supported && !name.empty() && name.find('/') == std::string::npos) {
+      file = time_request ? FindSegmentAt(name, time, &segment_name) :
+                            FindFile(name);
+    }
+    std::ostringstream response;
+    if (!supported) {
+      response << "HTTP/1.1 405 Method Not Allowed\r\n"
+               << "Allow: GET, HEAD\r\n"
+               << "Content-Length: 0\r\n";
+    } else if (!file) {
+      response << "HTTP/1.1 404 Not Found\r\n"
+               << "Content-Length: 0\r\n";
+    } else {
+      const bool manifest = EndsWith(name, kManifestSuffix);
+      // The segment at a time can change while the window moves, so the
+      // answer to a time request is not cached.
+      response << "HTTP/1.1 200 OK\r\n"
+               << "Content-Type: "
+               << (manifest ? "application/dash+xml" : "video/webm") << "\r\n"
+               << "Content-Length: " << file->length() << "\r\n"
+               << "Cache-Control: "
+               << (manifest || time_request ? "no-cache" : "max-age=3600")
+               << "\r\n";
+      if (time_request) {
+        response << "Content-Location: " << segment_name << "\r\n";
+      }
+    }
+    response << "Access-Control-Allow-Origin: *\r\n"
+             << "Connection: " << (keep_alive ? "keep-alive" : "close")
+             << "\r\n\r\n";
+    const std::string response_headers = response.str();
+    bool send_ok = SendAll(socket,
+                           reinterpret_cast<const uint8*>(
+                               response_headers.data()),
+                           static_cast<int32>(response_headers.length()));
+    const int32 body_length = (file && !head) ? file->length() : 0;
+    if (send_ok && body_length > 0) {
+      send_ok = SendAll(socket, file->data(), body_length);
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ++stats_.requests;
+      if (!file) {
+        ++stats_.not_found;
+      } else if (send_ok) {
+        stats_.bytes_sent += body_length;
+      }
+    }
+    if (!send_ok) {
+      break;
+    }
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    --stats_.connections;
+  }
+  ptr_connection->done = true;
+}
+
+bool DashOriginServer::ReadRequest(Socket socket, std::string* ptr_buffer,
+                                   std::string* ptr_request) {
+  size_t header_end = ptr_buffer->find(kHeaderEnd);
+  while (header_end == std::string::npos) {
+    if (ptr_buffer->length() > kMaxRequestLength) {
+      LOG(WARNING) << "request headers too long.";
+      return false;
+    }
+    char data[1024];
+    const int bytes_read = recv(socket, data, sizeof(data), 0);
+    if (bytes_read <= 0) {
+      return false;
+    }
+    // The end of the headers may straddle the previous read.
+    const size_t search_start =
+        ptr_buffer->length() > 3 ? ptr_buffer->length() - 3 : 0;
+    ptr_buffer->append(data, bytes_read);
+    header_end = ptr_buffer->find(kHeaderEnd, search_start);
+  }
+  header_end += strlen(kHeaderEnd);
+  ptr_request->assign(*ptr_buffer, 0, header_end);
+  ptr_buffer->erase(0, header_end);
+  return true;
+}
+
+SharedWebmChunk DashOriginServer::FindFile(const std::string& name) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  std::map<std::string, SharedWebmChunk>::const_iterator file =
+      files_.find(name);
+  if (file == files_.end() && settings_.wait_timeout > 0) {
+    ++stats_.waits;
+    const std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::now() +
+        std::chrono::milliseconds(settings_.wait_timeout);
+    file_written_.wait_until(lock, deadline, [this, &name, &file] {
+      file = files_.find(name);
+      return stop_ || file != files_.end();
+    });
+  }
+  return file != files_.end() ? file->second : SharedWebmChunk();
+}
+
+SharedWebmChunk DashOriginServer::FindSegmentAt(
+    const std::string& representation, int64 time, std::string* ptr_name) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  ++stats_.time_requests;
+  const HeldSegment* ptr_segment = NULL;
+  auto find_segment = [this, &representation, time, &ptr_segment] {
+    std::map<std::string, SegmentIndex>::const_iterator segments =
+        segments_.find(representation);
+    if (segments != segments_.end()) {
+      SegmentIndex::const_iterator segment = SegmentAt(segments->second, time);
+      if (segment != segments->second.end()) {
+        ptr_segment = &segment->second;
+      }
+    }
+    return ptr_segment != NULL;
+  };
+  if (!find_segment() && settings_.wait_timeout > 0) {
+    ++stats_.waits;
+    const std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::now() +
+        std::chrono::milliseconds(settings_.wait_timeout);
+    file_written_.wait_until(lock, deadline, [this, &find_segment] {
+      return stop_ || find_segment();
+    });
+  }
+  if (!ptr_segment) {
+    return SharedWebmChunk();
+  }
+  std::map<std::string, SharedWebmChunk>::const_iterator file =
+      files_.find(ptr_segment->name);
+  if (file == files_.end()) {
+    return SharedWebmChunk();
+  }
+  *ptr_name = ptr_segment->name;
+  return file->second;
+}
+
+// Segments are keyed by start time, so the segment containing |time| is the
+// last one starting at or before it, when it has not ended yet.
+DashOriginServer::SegmentIndex::const_iterator DashOriginServer::SegmentAt(
+    const SegmentIndex& segments, int64 time) {
+  SegmentIndex::const_iterator segment = segments.upper_bound(time);
+  if (segment != segments.begin()) {
+    const SegmentIndex::const_iterator previous = std::prev(segment);
+    if (time < previous->second.end_time) {
+      return previous;
+    }
+  }
+  return segment;
+}
+
+bool DashOriginServer::SendAll(Socket socket, const uint8* ptr_data,
+                               int32 length) {
+#ifdef MSG_NOSIGNAL
+  const int kSendFlags = MSG_NOSIGNAL;
+#else
+  const int kSendFlags = 0;
+#endif
+  while (length > 0) {
+    const int bytes_sent = send(socket,
+                                reinterpret_cast<const char*>(ptr_data),
+                                length, kSendFlags);
+    if (bytes_sent <= 0) {
+      return false;
+    }
+    ptr_data += bytes_sent;
+    length -= bytes_sent;
+  }
+  return true;
+}
+
+void DashOriginServer::CloseSocket(Socket socket) {
+#ifdef _WIN32
+  closesocket(socket);
+#else
+  close(socket);
+#endif
+}
+
+}  // namespace webmlive
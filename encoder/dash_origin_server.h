@@ -0,0 +1,235 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_DASH_ORIGIN_SERVER_H_
+#define WEBMLIVE_ENCODER_DASH_ORIGIN_SERVER_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "encoder/basictypes.h"
+#include "encoder/data_sink.h"
+#include "encoder/encoder_base.h"
+#include "encoder/webm_chunk.h"
+
+#ifdef _WIN32
+#include <winsock2.h>
+#endif
+
+namespace webmlive {
+
+struct DashOriginServerSettings {
+  // Default number of media segments kept for each representation.
+  static const int kDefaultSegmentCount = 10;
+
+  // Default time a request for a missing file waits for it, in milliseconds.
+  static const int kDefaultWaitTimeout = 10000;
+
+  DashOriginServerSettings()
+      : port(0),
+        segment_count(kDefaultSegmentCount),
+        time_shift_window(0),
+        wait_timeout(kDefaultWaitTimeout) {}
+
+  // TCP port the server listens on.
+  int port;
+
+  // Number of media segments kept for each representation.
+  int segment_count;
+
+  // Time-shift window in milliseconds. When non-zero, media segments are
+  // kept until they end more than |time_shift_window| before the end of the
+  // newest segment of their representation, and |segment_count| is ignored.
+  int time_shift_window;
+
+  // Longest time a request for a file not yet written waits for it, in
+  // milliseconds. 0 answers such requests immediately with 404.
+  int wait_timeout;
+};
+
+struct DashOriginServerStats {
+  // Number of requests answered.
+  int64 requests;
+
+  // Number of requests answered with 404.
+  int64 not_found;
+
+  // Number of requests that waited for their file to be written.
+  int64 waits;
+
+  // Number of requests for a segment by time.
+  int64 time_requests;
+
+  // Number and total size of the media segments held.
+  int64 segments_held;
+  int64 bytes_held;
+
+  // Total number of response body bytes sent.
+  int64 bytes_sent;
+
+  // Number of open client connections.
+  int32 connections;
+};
+
+// HTTP origin server for DASH output held in memory. Chunks passed to
+// |WriteChunk()| are served by name, the MPD and initialization segments
+// until they are replaced, and media segments until the representation has
+// |DashOriginServerSettings::segment_count| newer ones. A request for a file
+// that has not been written yet waits for it, so players can ask for the
+// next segment before it exists and receive it as soon as it is muxed.
+//
+// With a |DashOriginServerSettings::time_shift_window|, the server holds the
+// last minutes of each representation for players seeking back in the live
+// stream. Segments can also be requested by time: a request for the
+// representation name, i.e. a segment name up to its segment number, with a
+// |t| query parameter in milliseconds, e.g. "live_v0?t=61000", is answered
+// with the segment that contains that time, or the first segment after it.
+// Times are those of the segments in the dynamic MPD's SegmentTimeline, and
+// the response names the segment in its Content-Location header.
+//
+// Response bodies are sent from the |WebmChunk| holding the file, without
+// copying; the server keeps a reference to the chunk while it is sent.
+//
+// Notes:
+// - |Init| must be called before any other method.
+// - Only GET and HEAD are supported. Each connection is served by its own
+//   thread, and kept alive between requests.
+class DashOriginServer : public DataSinkInterface {
+ public:
+  enum {
+    // Socket setup failed.
+    kSocketError = -503,
+
+    // Invalid argument supplied to method call.
+    kInvalidArg = -502,
+
+    // Server |Run| failed.
+    kRunFailed = -501,
+
+    // Success.
+    kSuccess = 0,
+  };
+
+  DashOriginServer();
+  virtual ~DashOriginServer();
+
+  // Copies |settings|, and opens the listening socket. Returns |kSuccess|
+  // upon success.
+  int Init(const DashOriginServerSettings& settings);
+
+  // Runs the thread that accepts connections.
+  int Run();
+
+  // Closes all connections, and stops the server threads.
+  void Stop();
+
+  // Locks |mutex_| and copies current stats to |ptr_stats|.
+  int GetStats(DashOriginServerStats* ptr_stats);
+
+  // DataSinkInterface methods. |WriteData()| copies the data into a chunk
+  // named |id|, and |WriteChunk()| keeps a reference to |chunk|. Both
+  // replace a previous file of the same name.
+  virtual bool Ready() const { return true; }
+  virtual bool WriteData(const uint8* ptr_data, int32 data_length,
+                         const std::string& id);
+  virtual bool WriteChunk(const SharedWebmChunk& chunk);
+
+ private:
+#ifdef _WIN32
+  typedef SOCKET Socket;
+#else
+  typedef int Socket;
+#endif
+
+  // A client connection and the thread serving it. |done| is set by the
+  // thread when it exits.
+  struct Connection {
+    Connection() : socket(0), done(false) {}
+    Socket socket;
+    std::atomic<bool> done;
+    std::thread thread;
+  };
+
+  // Accepts connections until |stop_| is set.
+  void ListenerThread();
+
+  // Serves requests on |ptr_connection| until the client closes it, a
+  // socket error occurs, or |stop_| is set.
+  void ConnectionThread(Connection* ptr_connection);
+
+  // Reads the next request's headers from |socket| into |ptr_request|.
+  // |ptr_buffer| holds data received but not yet consumed: the start of a
+  // pipelined request. Returns false when the connection is closed, or the
+  // headers are too long.
+  static bool ReadRequest(Socket socket, std::string* ptr_buffer,
+                          std::string* ptr_request);
+
+  // Media segment held for a representation.
+  struct HeldSegment {
+    std::string name;
+    int64 end_time;
+  };
+
+  // Held segments of a representation by start time, oldest first.
+  typedef std::map<int64, HeldSegment> SegmentIndex;
+
+  // Looks up the file named |name|, waiting up to |settings_.wait_timeout|
+  // for it when it is missing. Returns NULL when the file was not written in
+  // time.
+  SharedWebmChunk FindFile(const std::string& name);
+
+  // Looks up the segment of |representation| that contains |time|, or the
+  // first one after it, and stores its name in |ptr_name|. Waits for the
+  // segment as |FindFile()| does when |time| is past the newest segment.
+  // Returns NULL when there is no such segment.
+  SharedWebmChunk FindSegmentAt(const std::string& representation,
+                                int64 time, std::string* ptr_name);
+
+  // Returns the held segment of |segments| that contains |time|, or the first
+  // one after it. Must be called with |mutex_| held.
+  static SegmentIndex::const_iterator SegmentAt(const SegmentIndex& segments,
+                                                int64 time);
+
+  // Joins and discards threads of closed connections.
+  void ReapConnections();
+
+  // Sends |length| bytes from |ptr_data|. Returns false upon failure.
+  static bool SendAll(Socket socket, const uint8* ptr_data, int32 length);
+  static void CloseSocket(Socket socket);
+
+  DashOriginServerSettings settings_;
+  Socket listen_socket_;
+  bool initialized_;
+  std::atomic<bool> stop_;
+  std::unique_ptr<std::thread> listener_thread_;
+
+  // Connections, accessed only by |ListenerThread| and |Stop|.
+  std::list<std::unique_ptr<Connection>> connections_;
+
+  // Files by name, and the media segments of each representation. Protected
+  // by |mutex_|.
+  std::map<std::string, SharedWebmChunk> files_;
+  std::map<std::string, SegmentIndex> segments_;
+
+  // Stats. Protected by |mutex_|.
+  DashOriginServerStats stats_;
+
+  // Signalled when a file is written, or when |stop_| is set.
+  std::condition_variable file_written_;
+  std::mutex mutex_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(DashOriginServer);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_DASH_ORIGIN_SERVER_H_
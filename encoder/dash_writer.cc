@@ -7,8 +7,14 @@
 // be found in the AUTHORS file in the root of the source tree.
 #include "encoder/dash_writer.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <ctime>
+#include <iomanip>
 #include <ios>
 #include <sstream>
+#include <utility>
 
 #include "glog/logging.h"
 
@@ -22,7 +28,12 @@ const char kDefaultSchema[] = "urn:mpeg:dash:schema:mpd:2011";
 const int kDefaultMinBufferTime = 1;
 const int kDefaultMediaPresentationDuration = 36000;  // 10 hours.
 const char kDefaultType[] = "static";
+const char kDynamicType[] = "dynamic";
 const char kDefaultProfiles[] = "urn:mpeg:dash:profile:isoff-live:2011";
+
+// The live profile requires SegmentTemplate; single-file output uses
+// SegmentList.
+const char kSingleFileProfiles[] = "urn:mpeg:dash:profile:full:2011";
 const int kDefaultStartTime = 0;
 const int kDefaultMaxWidth = 1920;
 const int kDefaultMaxHeight = 1080;
@@ -43,17 +54,96 @@ const int kDefaultAudioChannels = 2;
 const char kAudioMimeType[] = "audio/webm";
 const char kVideoMimeType[] = "video/webm";
 const char kAudioCodecs[] = "vorbis";
+const char kOpusAudioCodecs[] = "opus";
 const char kVideoCodecs[] = "vp9";
+const char kVp8VideoCodecs[] = "vp8";
 const char kAudioId[] = "1";
 const char kVideoId[] = "2";
 
 // Base strings for initialization and chunk names.
 const char kChunkPattern[] = "_$RepresentationID$_$Number$.chk";
 const char kInitializationPattern[] = "_$RepresentationID$.hdr";
+const char kRepresentationIdField[] = "$RepresentationID$";
+const char kNumberField[] = "$Number$";
+
+// Suffix of the per-Representation file of single-file output.
+const char kSingleFileSuffix[] = ".webm";
+const char kSegmentIndexSuffix[] = ".idx";
 
 const char kAudioSchemeUri[] =
   "urn:mpeg:dash:23003:3:audio_channel_configuration:2011";
 
+// Returns |time| as a UTC xs:dateTime.
+std::string UtcTimeString(std::time_t time) {
+  std::tm utc_time;
+#ifdef _WIN32
+  gmtime_s(&utc_time, &time);
+#else
+  gmtime_r(&time, &utc_time);
+#endif
+  char time_string[32];
+  strftime(time_string, sizeof(time_string), "%Y-%m-%dT%H:%M:%SZ",
+           &utc_time);
+  return time_string;
+}
+
+// Returns |milliseconds| as an xs:duration.
+std::string DurationString(int64 milliseconds) {
+  std::ostringstream duration;
+  duration << "PT" << milliseconds / 1000;
+  if (milliseconds % 1000) {
+    duration << "." << std::setw(3) << std::setfill('0')
+             << milliseconds % 1000;
+  }
+  duration << "S";
+  return duration.str();
+}
+
+// Returns the Representation ID of audio |rendition|.
+std::string AudioRepresentationId(int rendition) {
+  std::ostringstream rep_id;
+  rep_id << kAudioId;
+  if (rendition > 0) {
+    rep_id << "_" << rendition;
+  }
+  return rep_id.str();
+}
+
+// Returns the Representation ID of video |rendition|.
+std::string VideoRepresentationId(int rendition) {
+  std::ostringstream rep_id;
+  rep_id << kVideoId;
+  if (rendition > 0) {
+    rep_id << "_" << rendition;
+  }
+  return rep_id.str();
+}
+
+// Returns the codecs string of video encoded with |codec|.
+const char* VideoCodecs(VideoFormat codec) {
+  return codec == kVideoFormatVP8 ? kVp8VideoCodecs : kVideoCodecs;
+}
+
+// Returns |pattern| with each |field| replaced by |value|.
+std::string ReplaceField(const std::string& pattern, const std::string& field,
+                         const std::string& value) {
+  std::string expanded = pattern;
+  for (size_t pos = expanded.find(field); pos != std::string::npos;
+       pos = expanded.find(field, pos + value.length())) {
+    expanded.replace(pos, field.length(), value);
+  }
+  return expanded;
+}
+
+// Replaces |ptr_template| with |value|, the template of a Representation,
+// unless |value| is empty and the Representation inherits its
+// AdaptationSet's.
+void OverrideTemplate(const std::string& value, std::string* ptr_template) {
+  if (!value.empty()) {
+    *ptr_template = value;
+  }
+}
+
 //
 // AdaptationSet
 //
@@ -107,7 +197,12 @@ DashConfig::DashConfig()
         min_buffer_time(kDefaultMinBufferTime),
         media_presentation_duration(kDefaultMediaPresentationDuration),
         start_time(kDefaultStartTime),
-        period_duration(kDefaultPeriodDuration) {}
+        period_duration(kDefaultPeriodDuration),
+        segment_duration(kDefaultChunkDuration),
+        minimum_update_period(kDefaultChunkDuration),
+        time_shift_buffer_depth(0),
+        single_file(false),
+        bandwidth_window(0) {}
 
 //
 // DashWriter
@@ -123,27 +218,48 @@ bool DashWriter::Init(const WebmEncoderConfig& webm_config) {
 
   if (!webm_config.disable_audio) {
     config_.audio_as.enabled = true;
-    config_.audio_as.bandwidth =
-        webm_config.vorbis_config.average_bitrate * 1000;
+    if (webm_config.audio_codec == kAudioFormatOpus) {
+      config_.audio_as.codecs = kOpusAudioCodecs;
+      config_.audio_as.bandwidth = webm_config.opus_config.bitrate * 1000;
+    } else {
+      config_.audio_as.bandwidth =
+          webm_config.vorbis_config.average_bitrate * 1000;
+    }
     config_.audio_as.media = name_ + kChunkPattern;
     config_.audio_as.initialization = name_ + kInitializationPattern;
     config_.audio_as.rep_id = kAudioId;
     config_.audio_as.audio_sampling_rate =
-        webm_config.actual_audio_config.sample_rate;
-    config_.audio_as.value = webm_config.actual_audio_config.channels;
+        webm_config.encoded_audio_config.sample_rate;
+    config_.audio_as.value = webm_config.encoded_audio_config.channels;
     config_.audio_as.start_number = webm_config.dash_start_number;
+
+    config_.audio_as.renditions.clear();
+    for (size_t i = 0; i < webm_config.audio_renditions.size(); ++i) {
+      AudioAdaptationSet::Rendition rendition;
+      rendition.rep_id = AudioRepresentationId(static_cast<int>(i) + 1);
+      // Renditions are Vorbis, also when the primary stream is Opus.
+      rendition.codecs = kAudioCodecs;
+      rendition.bandwidth =
+          webm_config.audio_renditions[i].vorbis_config.average_bitrate * 1000;
+      config_.audio_as.renditions.push_back(rendition);
+    }
   }
   if (!webm_config.disable_video) {
     config_.video_as.enabled = true;
+    config_.video_as.codecs = VideoCodecs(webm_config.vpx_config.codec);
     config_.video_as.bandwidth = webm_config.vpx_config.bitrate * 1000;
     config_.video_as.media = name_ + kChunkPattern;
     config_.video_as.initialization = name_ + kInitializationPattern;
     config_.video_as.rep_id = kVideoId;
-    config_.video_as.width = webm_config.actual_video_config.width;
-    config_.video_as.height = webm_config.actual_video_config.height;
+    // Players show the visible region of cropped and padded video.
+    config_.video_as.width = VisibleWidth(webm_config.actual_video_config);
+    config_.video_as.height = VisibleHeight(webm_config.actual_video_config);
     config_.video_as.start_number = webm_config.dash_start_number;
 
-    if (webm_config.vpx_config.decimate != VpxConfig::kUseDefault) {
+    if (webm_config.output_frame_rate > 0) {
+      config_.video_as.frame_rate = static_cast<int>(
+          std::ceil(webm_config.output_frame_rate));
+    } else if (webm_config.vpx_config.decimate != VpxConfig::kUseDefault) {
       config_.video_as.frame_rate = static_cast<int>(
           std::ceil(webm_config.actual_video_config.frame_rate /
                     webm_config.vpx_config.decimate));
@@ -155,10 +271,81 @@ bool DashWriter::Init(const WebmEncoderConfig& webm_config) {
     if (config_.video_as.frame_rate > config_.video_as.max_frame_rate) {
       config_.video_as.max_frame_rate = config_.video_as.frame_rate;
     }
+
+    config_.video_as.renditions.clear();
+    for (size_t i = 0; i < webm_config.video_renditions.size(); ++i) {
+      const VideoRenditionConfig& rendition_config =
+          webm_config.video_renditions[i];
+      VideoAdaptationSet::Rendition rendition;
+      rendition.rep_id = VideoRepresentationId(static_cast<int>(i) + 1);
+      rendition.codecs = VideoCodecs(rendition_config.vpx_config.codec);
+      rendition.width = rendition_config.width ?
+          rendition_config.width : config_.video_as.width;
+      rendition.height = rendition_config.height ?
+          rendition_config.height : config_.video_as.height;
+      rendition.bandwidth = rendition_config.vpx_config.bitrate * 1000;
+      rendition.frame_rate = config_.video_as.frame_rate;
+      config_.video_as.renditions.push_back(rendition);
+
+      if (rendition.width > config_.video_as.max_width) {
+        config_.video_as.max_width = rendition.width;
+      }
+      if (rendition.height > config_.video_as.max_height) {
+        config_.video_as.max_height = rendition.height;
+      }
+    }
+
+    // Cameras are encoded at their capture size and rate.
+    const int first_camera_rendition =
+        static_cast<int>(webm_config.video_renditions.size()) + 1;
+    for (size_t i = 0; i < webm_config.video_cameras.size(); ++i) {
+      const VideoCameraConfig& camera_config = webm_config.video_cameras[i];
+      const VideoConfig& camera_video = camera_config.actual_video_config;
+      VideoAdaptationSet::Rendition rendition;
+      rendition.camera = static_cast<int>(i) + 1;
+      rendition.rep_id = VideoRepresentationId(first_camera_rendition +
+                                               static_cast<int>(i));
+      rendition.codecs = VideoCodecs(camera_config.vpx_config.codec);
+      rendition.width = camera_video.width;
+      rendition.height = std::abs(camera_video.height);
+      rendition.bandwidth = camera_config.vpx_config.bitrate * 1000;
+      rendition.frame_rate =
+          static_cast<int>(std::ceil(camera_video.frame_rate));
+      config_.video_as.renditions.push_back(rendition);
+    }
   }
 
-  config_.audio_as.chunk_duration = webm_config.vpx_config.keyframe_interval;
-  config_.video_as.chunk_duration = webm_config.vpx_config.keyframe_interval;
+  config_.segment_duration = webm_config.vpx_config.keyframe_interval;
+  if (webm_config.segment_duration > 0) {
+    config_.segment_duration = webm_config.segment_duration;
+
+    // Video segments begin with a keyframe only when segment and keyframe
+    // interval match.
+    if (webm_config.segment_duration !=
+        webm_config.vpx_config.keyframe_interval) {
+      config_.video_as.start_with_sap = 0;
+    }
+  }
+  config_.audio_as.chunk_duration = config_.segment_duration;
+  config_.video_as.chunk_duration = config_.segment_duration;
+
+  if (webm_config.dash_dynamic) {
+    config_.type = kDynamicType;
+    config_.availability_start_time = UtcTimeString(std::time(NULL));
+    config_.minimum_update_period = webm_config.dash_update_period > 0 ?
+        webm_config.dash_update_period : config_.segment_duration;
+    config_.time_shift_buffer_depth = webm_config.dash_window;
+    if (config_.time_shift_buffer_depth == 0 &&
+        !webm_config.dash_write_files && webm_config.dash_server.port > 0) {
+      // Players can only fetch the segments the DASH origin server holds.
+      config_.time_shift_buffer_depth =
+          webm_config.dash_server.time_shift_window;
+    }
+    config_.single_file = webm_config.dash_single_file;
+    config_.bandwidth_window = webm_config.dash_bandwidth_window;
+    BuildDynamicFragments();
+  }
+  InitMeters();
 
   initialized_ = true;
   return true;
@@ -170,6 +357,10 @@ bool DashWriter::WriteManifest(std::string* out_manifest) {
     LOG(ERROR) << "DashWriter not initialized before call to WriteManifest()";
     return false;
   }
+  if (dynamic()) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return WriteDynamicManifest(out_manifest);
+  }
 
   std::ostringstream manifest;
 
@@ -217,26 +408,299 @@ bool DashWriter::WriteManifest(std::string* out_manifest) {
   return true;
 }
 
-std::string DashWriter::IdForChunk(AdaptationSet::MediaType media_type,
-                                   int64 chunk_num) const {
-  CHECK(initialized_);
-  std::string initialization;
-  std::string media;
-  if (media_type == AdaptationSet::kAudio) {
-    initialization = name_ + "_" + kAudioId + ".hdr";
-    media  = name_ + "_" + kAudioId + "_";
+void DashWriter::AddSegment(AdaptationSet::MediaType media_type,
+                            int rendition, int64 timestamp, int64 duration,
+                            int64 length) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  BandwidthMeter* const meter = MeterFor(media_type, rendition);
+  if (meter) {
+    MeasureSegment(timestamp + duration, duration, length, meter);
+  }
+  if (!dynamic()) {
+    return;
+  }
+  Timeline* const timeline = TimelineFor(media_type, rendition);
+  if (!timeline) {
+    LOG(ERROR) << "no timeline for media type " << media_type
+               << " rendition " << rendition;
+    return;
+  }
+
+  // A segment that follows the open run without a gap, and has the same
+  // duration, extends it. Otherwise the run is closed and cached.
+  Run& run = timeline->run;
+  if (run.start >= 0 && duration == run.duration && timestamp == run.end()) {
+    ++run.repeat;
   } else {
-    initialization = name_ + "_" + kVideoId + ".hdr";
-    media  = name_ + "_" + kVideoId + "_";
+    if (run.start >= 0) {
+      AppendTimelineEntry(run, &run.xml);
+      timeline->runs.push_back(Run());
+      std::swap(timeline->runs.back(), run);
+    }
+    run.start = timestamp;
+    run.duration = duration;
+    run.repeat = 0;
   }
+  if (config_.single_file) {
+    std::ostringstream url;
+    url << list_indent_ << "<SegmentURL mediaRange=\""
+        << timeline->file_length << "-"
+        << timeline->file_length + length - 1 << "\"/>\n";
+    timeline->segment_urls.push_back(url.str());
+    timeline->file_length += length;
+  }
+  if (config_.time_shift_buffer_depth > 0) {
+    TrimTimeline(timestamp + duration - config_.time_shift_buffer_depth,
+                 timeline);
+  }
+  int* const ptr_bandwidth = BandwidthFor(media_type, rendition);
+  if (config_.bandwidth_window > 0 && meter && ptr_bandwidth &&
+      meter->stats.window_peak_bandwidth > 0 &&
+      meter->stats.window_peak_bandwidth != *ptr_bandwidth) {
+    *ptr_bandwidth = static_cast<int>(meter->stats.window_peak_bandwidth);
+    WriteBandwidthAttribute(*ptr_bandwidth, timeline);
+  }
+  ++segments_added_;
+}
 
-  std::ostringstream id;
+void DashWriter::AddInitialization(AdaptationSet::MediaType media_type,
+                                   int rendition, int64 length) {
+  if (!dynamic() || !config_.single_file) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  Timeline* const timeline = TimelineFor(media_type, rendition);
+  if (!timeline) {
+    LOG(ERROR) << "no timeline for media type " << media_type
+               << " rendition " << rendition;
+    return;
+  }
+  timeline->file_length = length;
+  BuildListHeadTail(timeline);
+}
+
+void DashWriter::SetBandwidth(AdaptationSet::MediaType media_type,
+                              int rendition, int bandwidth) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  int* const ptr_bandwidth = BandwidthFor(media_type, rendition);
+  BandwidthMeter* const meter = MeterFor(media_type, rendition);
+  if (!ptr_bandwidth || !meter) {
+    LOG(ERROR) << "no Representation for media type " << media_type
+               << " rendition " << rendition;
+    return;
+  }
+  meter->stats.configured_bandwidth = bandwidth;
+  const bool measured = dynamic() && config_.bandwidth_window > 0 &&
+                        meter->stats.segments > 0;
+  if (measured) {
+    return;
+  }
+  *ptr_bandwidth = bandwidth;
+  if (dynamic()) {
+    WriteBandwidthAttribute(bandwidth, TimelineFor(media_type, rendition));
+  }
+}
+
+void DashWriter::GetRepresentationStats(
+    std::vector<RepresentationStats>* ptr_stats) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  ptr_stats->clear();
+  for (size_t i = 0; i < audio_meters_.size(); ++i) {
+    ptr_stats->push_back(audio_meters_[i].stats);
+  }
+  for (size_t i = 0; i < video_meters_.size(); ++i) {
+    ptr_stats->push_back(video_meters_[i].stats);
+  }
+}
+
+void DashWriter::InitMeters() {
+  audio_meters_.clear();
+  if (config_.audio_as.enabled) {
+    audio_meters_.resize(config_.audio_as.renditions.size() + 1);
+    audio_meters_[0].stats.rep_id = config_.audio_as.rep_id;
+    audio_meters_[0].stats.configured_bandwidth = config_.audio_as.bandwidth;
+    for (size_t i = 0; i < config_.audio_as.renditions.size(); ++i) {
+      const AudioAdaptationSet::Rendition& rendition =
+          config_.audio_as.renditions[i];
+      audio_meters_[i + 1].stats.rep_id = rendition.rep_id;
+      audio_meters_[i + 1].stats.configured_bandwidth = rendition.bandwidth;
+    }
+  }
+  video_meters_.clear();
+  if (!config_.video_as.enabled) {
+    return;
+  }
+  video_meters_.resize(config_.video_as.renditions.size() + 1);
+  video_meters_[0].stats.rep_id = config_.video_as.rep_id;
+  video_meters_[0].stats.configured_bandwidth = config_.video_as.bandwidth;
+  for (size_t i = 0; i < config_.video_as.renditions.size(); ++i) {
+    const VideoAdaptationSet::Rendition& rendition =
+        config_.video_as.renditions[i];
+    video_meters_[i + 1].stats.rep_id = rendition.rep_id;
+    video_meters_[i + 1].stats.configured_bandwidth = rendition.bandwidth;
+  }
+}
+
+void DashWriter::MeasureSegment(int64 end, int64 duration, int64 length,
+                                BandwidthMeter* ptr_meter) {
+  RepresentationStats& stats = ptr_meter->stats;
+  ++stats.segments;
+  stats.bytes += length;
+  if (duration <= 0) {
+    return;
+  }
+  stats.duration += duration;
+  stats.average_bandwidth = stats.bytes * 8 * 1000 / stats.duration;
+  const int64 bitrate = length * 8 * 1000 / duration;
+  if (bitrate > stats.peak_bandwidth) {
+    stats.peak_bandwidth = bitrate;
+  }
+
+  // Segments smaller than a newer one are never again the window's peak.
+  std::deque<std::pair<int64, int64> >& window = ptr_meter->window;
+  while (!window.empty() && window.back().second <= bitrate) {
+    window.pop_back();
+  }
+  window.push_back(std::make_pair(end, bitrate));
+  const int64 window_length = config_.bandwidth_window > 0 ?
+      config_.bandwidth_window : DashConfig::kDefaultBandwidthWindow;
+  while (window.front().first <= end - window_length) {
+    window.pop_front();
+  }
+  stats.window_peak_bandwidth = window.front().second;
+}
+
+int* DashWriter::BandwidthFor(AdaptationSet::MediaType media_type,
+                              int rendition) {
+  if (media_type == AdaptationSet::kAudio) {
+    if (rendition == 0) {
+      return &config_.audio_as.bandwidth;
+    }
+    if (rendition > 0 &&
+        rendition <= static_cast<int>(config_.audio_as.renditions.size())) {
+      return &config_.audio_as.renditions[rendition - 1].bandwidth;
+    }
+    return NULL;
+  }
+  if (rendition == 0) {
+    return &config_.video_as.bandwidth;
+  }
+  if (rendition > 0 &&
+      rendition <= static_cast<int>(config_.video_as.renditions.size())) {
+    return &config_.video_as.renditions[rendition - 1].bandwidth;
+  }
+  return NULL;
+}
+
+void DashWriter::WriteBandwidthAttribute(int bandwidth,
+                                         Timeline* ptr_timeline) {
+  const std::string attribute = "bandwidth=\"";
+  const size_t attribute_pos = ptr_timeline ?
+      ptr_timeline->head.find(attribute) : std::string::npos;
+  if (attribute_pos == std::string::npos) {
+    return;
+  }
+  const size_t value_pos = attribute_pos + attribute.length();
+  const size_t value_end = ptr_timeline->head.find('"', value_pos);
+  std::ostringstream value;
+  value << bandwidth;
+  ptr_timeline->head.replace(value_pos, value_end - value_pos, value.str());
+}
+
+DashWriter::RepresentationTemplate DashWriter::TemplateFor(
+    AdaptationSet::MediaType media_type, int rendition) const {
+  const bool audio = (media_type == AdaptationSet::kAudio);
+  const AdaptationSet& adaptation_set = audio ?
+      static_cast<const AdaptationSet&>(config_.audio_as) : config_.video_as;
+  RepresentationTemplate templates;
+  templates.rep_id = audio ? AudioRepresentationId(rendition) :
+                             VideoRepresentationId(rendition);
+  templates.codecs = adaptation_set.codecs;
+  templates.media = adaptation_set.media;
+  templates.initialization = adaptation_set.initialization;
+  if (rendition < 1) {
+    return templates;
+  }
+  const size_t index = rendition - 1;
+  if (audio && index < config_.audio_as.renditions.size()) {
+    const AudioAdaptationSet::Rendition& entry =
+        config_.audio_as.renditions[index];
+    templates.rep_id = entry.rep_id;
+    OverrideTemplate(entry.codecs, &templates.codecs);
+    OverrideTemplate(entry.media, &templates.media);
+    OverrideTemplate(entry.initialization, &templates.initialization);
+  } else if (!audio && index < config_.video_as.renditions.size()) {
+    const VideoAdaptationSet::Rendition& entry =
+        config_.video_as.renditions[index];
+    templates.rep_id = entry.rep_id;
+    OverrideTemplate(entry.codecs, &templates.codecs);
+    OverrideTemplate(entry.media, &templates.media);
+    OverrideTemplate(entry.initialization, &templates.initialization);
+  }
+  return templates;
+}
+
+std::string DashWriter::StaticRepresentationTail(
+    const AdaptationSet& adaptation_set,
+    const RepresentationTemplate& templates) {
+  if (templates.media == adaptation_set.media &&
+      templates.initialization == adaptation_set.initialization) {
+    return "></Representation>\n";
+  }
+  std::ostringstream tail;
+  tail << ">\n";
+  IncreaseIndent();
+  tail << indent_
+       << "<SegmentTemplate "
+       << "timescale=\"" << adaptation_set.timescale << "\" "
+       << "duration=\"" << adaptation_set.chunk_duration << "\" "
+       << "media=\"" << templates.media << "\" "
+       << "startNumber=\"" << adaptation_set.start_number << "\" "
+       << "initialization=\"" << templates.initialization << "\"/>\n";
+  DecreaseIndent();
+  tail << indent_ << "</Representation>\n";
+  return tail.str();
+}
+
+bool DashWriter::dynamic() const {
+  return config_.type == kDynamicType;
+}
+
+int64 DashWriter::segments_added() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return segments_added_;
+}
+
+std::string DashWriter::IdForChunk(AdaptationSet::MediaType media_type,
+                                   int rendition,
+                                   int64 chunk_num) const {
+  CHECK(initialized_);
+  const RepresentationTemplate templates = TemplateFor(media_type, rendition);
   if (chunk_num == 0) {
-    id << initialization << "";
-  } else {
-    id << media << chunk_num << ".chk";
+    return ReplaceField(templates.initialization, kRepresentationIdField,
+                        templates.rep_id);
   }
-  return id.str();
+  std::ostringstream number;
+  number << chunk_num;
+  return ReplaceField(
+      ReplaceField(templates.media, kRepresentationIdField, templates.rep_id),
+      kNumberField, number.str());
+}
+
+std::string DashWriter::FileForRepresentation(
+    AdaptationSet::MediaType media_type, int rendition) const {
+  CHECK(initialized_);
+  const std::string rep_id = (media_type == AdaptationSet::kAudio) ?
+      AudioRepresentationId(rendition) : VideoRepresentationId(rendition);
+  return name_ + "_" + rep_id + kSingleFileSuffix;
+}
+
+std::string DashWriter::IndexForRepresentation(
+    AdaptationSet::MediaType media_type, int rendition) const {
+  CHECK(initialized_);
+  const std::string rep_id = (media_type == AdaptationSet::kAudio) ?
+      AudioRepresentationId(rendition) : VideoRepresentationId(rendition);
+  return name_ + "_" + rep_id + kSegmentIndexSuffix;
 }
 
 void DashWriter::WriteAudioAdaptationSet(std::string* adaptation_set) {
@@ -287,8 +751,23 @@ void DashWriter::WriteAudioAdaptationSet(std::string* adaptation_set) {
            << "codecs=\"" << audio_as.codecs << "\" "
            << "startWithSAP=\"" << audio_as.start_with_sap << "\" "
            << "bandwidth=\"" << audio_as.bandwidth << "\" "
-           << "></Representation>"
-           << "\n";
+           << StaticRepresentationTail(audio_as,
+                                       TemplateFor(AdaptationSet::kAudio, 0));
+
+  // Write the Representation elements of the additional renditions.
+  for (size_t i = 0; i < audio_as.renditions.size(); ++i) {
+    const AudioAdaptationSet::Rendition& rendition = audio_as.renditions[i];
+    const RepresentationTemplate templates =
+        TemplateFor(AdaptationSet::kAudio, static_cast<int>(i) + 1);
+    a_stream << indent_
+             << "<Representation "
+             << "id=\"" << rendition.rep_id << "\" "
+             << "mimeType=\"" << audio_as.mimetype << "\" "
+             << "codecs=\"" << templates.codecs << "\" "
+             << "startWithSAP=\"" << audio_as.start_with_sap << "\" "
+             << "bandwidth=\"" << rendition.bandwidth << "\" "
+             << StaticRepresentationTail(audio_as, templates);
+  }
 
   // Close open the AdaptationSet element.
   DecreaseIndent();
@@ -296,58 +775,459 @@ void DashWriter::WriteAudioAdaptationSet(std::string* adaptation_set) {
   *adaptation_set = a_stream.str();
 }
 
+// Writes the AdaptationSet of the primary capture and its renditions, then
+// one AdaptationSet per other codec and per camera.
 void DashWriter::WriteVideoAdaptationSet(std::string* adaptation_set) {
   CHECK_NOTNULL(adaptation_set);
-  std::ostringstream v_stream;
   const VideoAdaptationSet& video_as = config_.video_as;
+  adaptation_set->clear();
+  const int num_sets = VideoSetCount();
+  for (int video_set = 0; video_set < num_sets; ++video_set) {
+    // Open the AdaptationSet element, and write its ContentComponent.
+    BuildVideoAdaptationSetHead(video_set, adaptation_set);
+    std::ostringstream v_stream;
 
-  // Open the AdaptationSet element.
+    // Write SegmentTemplate element.
+    v_stream << indent_
+             << "<SegmentTemplate "
+             << "timescale=\"" << video_as.timescale << "\" "
+             << "duration=\"" << video_as.chunk_duration << "\" "
+             << "media=\"" << video_as.media << "\" "
+             << "startNumber=\"" << video_as.start_number << "\" "
+             << "initialization=\"" << video_as.initialization << "\"/>"
+             << "\n";
+
+    // Write the Representation element.
+    if (video_set == 0) {
+      v_stream << indent_
+               << "<Representation "
+               << "id=\"" << video_as.rep_id << "\" "
+               << "mimeType=\"" << video_as.mimetype << "\" "
+               << "codecs=\"" << video_as.codecs << "\" "
+               << "width=\"" << video_as.width << "\" "
+               << "height=\"" << video_as.height << "\" "
+               << "startWithSAP=\"" << video_as.start_with_sap << "\" "
+               << "bandwidth=\"" << video_as.bandwidth << "\" "
+               << "frameRate=\"" << video_as.frame_rate << "\" "
+               << StaticRepresentationTail(
+                      video_as, TemplateFor(AdaptationSet::kVideo, 0));
+    }
+
+    // Write the Representation elements of the additional renditions.
+    for (size_t i = 0; i < video_as.renditions.size(); ++i) {
+      const VideoAdaptationSet::Rendition& rendition = video_as.renditions[i];
+      if (VideoSetOf(static_cast<int>(i) + 1) != video_set) {
+        continue;
+      }
+      const RepresentationTemplate templates =
+          TemplateFor(AdaptationSet::kVideo, static_cast<int>(i) + 1);
+      v_stream << indent_
+               << "<Representation "
+               << "id=\"" << rendition.rep_id << "\" "
+               << "mimeType=\"" << video_as.mimetype << "\" "
+               << "codecs=\"" << templates.codecs << "\" "
+               << "width=\"" << rendition.width << "\" "
+               << "height=\"" << rendition.height << "\" "
+               << "startWithSAP=\"" << video_as.start_with_sap << "\" "
+               << "bandwidth=\"" << rendition.bandwidth << "\" "
+               << "frameRate=\"" << rendition.frame_rate << "\" "
+               << StaticRepresentationTail(video_as, templates);
+    }
+
+    // Close open the AdaptationSet element.
+    DecreaseIndent();
+    v_stream << indent_ << "</AdaptationSet>\n";
+    adaptation_set->append(v_stream.str());
+  }
+}
+
+void DashWriter::VideoSetKeys(
+    std::vector<std::pair<int, std::string> >* ptr_keys) const {
+  ptr_keys->clear();
+  ptr_keys->push_back(std::make_pair(0, config_.video_as.codecs));
+  const std::vector<VideoAdaptationSet::Rendition>& renditions =
+      config_.video_as.renditions;
+  for (size_t i = 0; i < renditions.size(); ++i) {
+    const std::pair<int, std::string> key(
+        renditions[i].camera,
+        TemplateFor(AdaptationSet::kVideo, static_cast<int>(i) + 1).codecs);
+    if (std::find(ptr_keys->begin(), ptr_keys->end(), key) ==
+        ptr_keys->end()) {
+      ptr_keys->push_back(key);
+    }
+  }
+}
+
+int DashWriter::VideoSetCount() const {
+  std::vector<std::pair<int, std::string> > keys;
+  VideoSetKeys(&keys);
+  return static_cast<int>(keys.size());
+}
+
+int DashWriter::VideoSetOf(int rendition) const {
+  const VideoAdaptationSet& video_as = config_.video_as;
+  if (rendition < 1 ||
+      rendition > static_cast<int>(video_as.renditions.size())) {
+    return 0;
+  }
+  std::vector<std::pair<int, std::string> > keys;
+  VideoSetKeys(&keys);
+  const std::pair<int, std::string> key(
+      video_as.renditions[rendition - 1].camera,
+      TemplateFor(AdaptationSet::kVideo, rendition).codecs);
+  return static_cast<int>(
+      std::find(keys.begin(), keys.end(), key) - keys.begin());
+}
+
+// The AdaptationSets of cameras and of other codecs take their maximums from
+// their Representations.
+void DashWriter::BuildVideoAdaptationSetHead(int video_set,
+                                             std::string* ptr_head) {
+  const VideoAdaptationSet& video_as = config_.video_as;
+  int max_width = video_as.max_width;
+  int max_height = video_as.max_height;
+  int max_frame_rate = video_as.max_frame_rate;
+  if (video_set > 0) {
+    max_width = max_height = max_frame_rate = 0;
+    for (size_t i = 0; i < video_as.renditions.size(); ++i) {
+      const VideoAdaptationSet::Rendition& rendition = video_as.renditions[i];
+      if (VideoSetOf(static_cast<int>(i) + 1) == video_set) {
+        max_width = std::max(max_width, rendition.width);
+        max_height = std::max(max_height, rendition.height);
+        max_frame_rate = std::max(max_frame_rate, rendition.frame_rate);
+      }
+    }
+  }
+  std::ostringstream v_stream;
   v_stream << indent_
            << "<AdaptationSet "
            << "segmentAlignment=\""
            << std::boolalpha << video_as.segment_alignment << "\" "
            << "bitstreamSwitching=\"" << video_as.bitstream_switching << "\" "
-           << "maxWidth=\"" << video_as.max_width << "\" "
-           << "maxHeight=\"" << video_as.max_height << "\" "
-           << "maxFrameRate=\"" << video_as.max_frame_rate << "\">"
+           << "maxWidth=\"" << max_width << "\" "
+           << "maxHeight=\"" << max_height << "\" "
+           << "maxFrameRate=\"" << max_frame_rate << "\">"
            << "\n";
   IncreaseIndent();
-
-  // Write ContentComponent element.
   v_stream << indent_
            << "<ContentComponent "
            << "id=\"" << video_as.cc_id << "\" "
            << "contentType=\"" << video_as.content_type << "\"/>"
            << "\n";
+  ptr_head->append(v_stream.str());
+}
 
-  // Write SegmentTemplate element.
-  v_stream << indent_
-           << "<SegmentTemplate "
-           << "timescale=\"" << video_as.timescale << "\" "
-           << "duration=\"" << video_as.chunk_duration << "\" "
-           << "media=\"" << video_as.media << "\" "
-           << "startNumber=\"" << video_as.start_number << "\" "
-           << "initialization=\"" << video_as.initialization << "\"/>"
-           << "\n";
+void DashWriter::BuildDynamicFragments() {
+  ResetIndent();
+  IncreaseIndent();
+  period_head_ = indent_ + "<Period id=\"0\" start=\"PT0S\">\n";
+  period_tail_ = indent_ + "</Period>\n</MPD>\n";
+  IncreaseIndent();
+  as_tail_ = indent_ + "</AdaptationSet>\n";
+  const std::string rep_indent = indent_ + kIndentStep;
+  if (config_.single_file) {
+    // The SegmentURLs follow the SegmentTimeline.
+    list_indent_ = rep_indent + kIndentStep + kIndentStep;
+    timeline_tail_ = list_indent_ + "</SegmentTimeline>\n";
+    list_tail_ = rep_indent + kIndentStep + "</SegmentList>\n" +
+                 rep_indent + "</Representation>\n";
+  } else {
+    timeline_tail_ = rep_indent + kIndentStep + kIndentStep +
+                     "</SegmentTimeline>\n" +
+                     rep_indent + kIndentStep + "</SegmentTemplate>\n" +
+                     rep_indent + "</Representation>\n";
+  }
+  entry_indent_ = rep_indent + kIndentStep + kIndentStep + kIndentStep;
 
-  // Write the Representation element.
-  v_stream << indent_
-           << "<Representation "
-           << "id=\"" << video_as.rep_id << "\" "
-           << "mimeType=\"" << video_as.mimetype << "\" "
-           << "codecs=\"" << video_as.codecs << "\" "
-           << "width=\"" << video_as.width << "\" "
-           << "height=\"" << video_as.height << "\" "
-           << "startWithSAP=\"" << video_as.start_with_sap << "\" "
-           << "bandwidth=\"" << video_as.bandwidth << "\" "
-           << "frameRate=\"" << video_as.frame_rate << "\" "
-           << "></Representation>"
-           << "\n";
+  const AudioAdaptationSet& audio_as = config_.audio_as;
+  if (audio_as.enabled) {
+    std::ostringstream a_stream;
+    a_stream << indent_
+             << "<AdaptationSet "
+             << "segmentAlignment=\""
+             << std::boolalpha << audio_as.segment_alignment << "\" "
+             << "audioSamplingRate=\"" << audio_as.audio_sampling_rate
+             << "\" "
+             << "bitstreamSwitching=\"" << audio_as.bitstream_switching
+             << "\">\n";
+    IncreaseIndent();
+    a_stream << indent_
+             << "<AudioChannelConfiguration "
+             << "schemeIdUri=\"" << audio_as.scheme_id_uri << "\" "
+             << "value=\"" << audio_as.value << "\">"
+             << "</AudioChannelConfiguration>\n";
+    a_stream << indent_
+             << "<ContentComponent "
+             << "id=\"" << audio_as.cc_id << "\" "
+             << "contentType=\"" << audio_as.content_type << "\"/>\n";
+    audio_as_head_ = a_stream.str();
 
-  // Close open the AdaptationSet element.
+    // The primary Representation, then one per rendition.
+    audio_timelines_.assign(audio_as.renditions.size() + 1, Timeline());
+    for (size_t i = 0; i < audio_timelines_.size(); ++i) {
+      const bool primary = (i == 0);
+      const RepresentationTemplate templates =
+          TemplateFor(AdaptationSet::kAudio, static_cast<int>(i));
+      std::ostringstream representation;
+      representation
+          << "id=\"" << templates.rep_id << "\" "
+          << "mimeType=\"" << audio_as.mimetype << "\" "
+          << "codecs=\"" << templates.codecs << "\" "
+          << "startWithSAP=\"" << audio_as.start_with_sap << "\" "
+          << "bandwidth=\""
+          << (primary ? audio_as.bandwidth :
+                        audio_as.renditions[i - 1].bandwidth)
+          << "\"";
+      BuildTimelineHead(audio_as, templates, representation.str(),
+                        &audio_timelines_[i]);
+    }
+    DecreaseIndent();
+  }
+
+  const VideoAdaptationSet& video_as = config_.video_as;
+  video_timelines_.clear();
+  video_set_heads_.clear();
+  if (video_as.enabled) {
+    video_as_head_.clear();
+    BuildVideoAdaptationSetHead(0, &video_as_head_);
+    DecreaseIndent();
+    video_set_heads_.resize(VideoSetCount() - 1);
+    for (size_t i = 0; i < video_set_heads_.size(); ++i) {
+      BuildVideoAdaptationSetHead(static_cast<int>(i) + 1,
+                                  &video_set_heads_[i]);
+      DecreaseIndent();
+    }
+    IncreaseIndent();
+
+    // The primary Representation, then one per rendition.
+    video_timelines_.resize(video_as.renditions.size() + 1);
+    for (size_t i = 0; i < video_timelines_.size(); ++i) {
+      const bool primary = (i == 0);
+      const VideoAdaptationSet::Rendition* const ptr_rendition =
+          primary ? NULL : &video_as.renditions[i - 1];
+      const RepresentationTemplate templates =
+          TemplateFor(AdaptationSet::kVideo, static_cast<int>(i));
+      std::ostringstream representation;
+      representation
+          << "id=\"" << templates.rep_id << "\" "
+          << "mimeType=\"" << video_as.mimetype << "\" "
+          << "codecs=\"" << templates.codecs << "\" "
+          << "width=\"" << (primary ? video_as.width : ptr_rendition->width)
+          << "\" "
+          << "height=\""
+          << (primary ? video_as.height : ptr_rendition->height) << "\" "
+          << "startWithSAP=\"" << video_as.start_with_sap << "\" "
+          << "bandwidth=\""
+          << (primary ? video_as.bandwidth : ptr_rendition->bandwidth)
+          << "\" "
+          << "frameRate=\""
+          << (primary ? video_as.frame_rate : ptr_rendition->frame_rate)
+          << "\"";
+      BuildTimelineHead(video_as, templates, representation.str(),
+                        &video_timelines_[i]);
+      video_timelines_[i].adaptation_set =
+          VideoSetOf(static_cast<int>(i));
+    }
+    DecreaseIndent();
+  }
+  ResetIndent();
+  manifest_size_ = 0;
+}
+
+void DashWriter::BuildTimelineHead(const AdaptationSet& adaptation_set,
+                                   const RepresentationTemplate& templates,
+                                   const std::string& representation,
+                                   Timeline* ptr_timeline) {
+  std::ostringstream head;
+  head << indent_ << "<Representation " << representation << ">\n";
+  IncreaseIndent();
+  ptr_timeline->start_number =
+      strtoll(adaptation_set.start_number.c_str(), NULL, 10);
+  if (config_.single_file) {
+    head << indent_
+         << "<BaseURL>" << name_ << "_" << templates.rep_id
+         << kSingleFileSuffix
+         << "</BaseURL>\n"
+         << indent_
+         << "<SegmentList "
+         << "timescale=\"" << adaptation_set.timescale << "\" "
+         << "startNumber=\"";
+    ptr_timeline->head = head.str();
+    BuildListHeadTail(ptr_timeline);
+    DecreaseIndent();
+    return;
+  }
+  head << indent_
+       << "<SegmentTemplate "
+       << "timescale=\"" << adaptation_set.timescale << "\" "
+       << "media=\"" << templates.media << "\" "
+       << "startNumber=\"";
+  ptr_timeline->head = head.str();
+
+  std::ostringstream head_tail;
+  head_tail << "\" "
+            << "initialization=\"" << templates.initialization << "\">\n";
+  IncreaseIndent();
+  head_tail << indent_ << "<SegmentTimeline>\n";
+  DecreaseIndent();
   DecreaseIndent();
-  v_stream << indent_ << "</AdaptationSet>\n";
-  *adaptation_set = v_stream.str();
+  ptr_timeline->head_tail = head_tail.str();
+}
+
+void DashWriter::BuildListHeadTail(Timeline* ptr_timeline) const {
+  std::ostringstream head_tail;
+  head_tail << "\">\n";
+  if (ptr_timeline->file_length > 0) {
+    head_tail << list_indent_ << "<Initialization range=\"0-"
+              << ptr_timeline->file_length - 1 << "\"/>\n";
+  }
+  head_tail << list_indent_ << "<SegmentTimeline>\n";
+  ptr_timeline->head_tail = head_tail.str();
+}
+
+void DashWriter::AppendTimelineEntry(const Run& run,
+                                     std::string* ptr_xml) const {
+  std::ostringstream entry;
+  entry << entry_indent_ << "<S t=\"" << run.start << "\" d=\""
+        << run.duration << "\"";
+  if (run.repeat > 0) {
+    entry << " r=\"" << run.repeat << "\"";
+  }
+  entry << "/>\n";
+  ptr_xml->append(entry.str());
+}
+
+void DashWriter::TrimTimeline(int64 window_start, Timeline* ptr_timeline) {
+  const int64 start_number = ptr_timeline->start_number;
+  TrimRuns(window_start, ptr_timeline);
+
+  // Drop the SegmentURLs of the dropped segments.
+  std::deque<std::string>& segment_urls = ptr_timeline->segment_urls;
+  for (int64 i = start_number;
+       i < ptr_timeline->start_number && !segment_urls.empty(); ++i) {
+    segment_urls.pop_front();
+  }
+}
+
+void DashWriter::TrimRuns(int64 window_start, Timeline* ptr_timeline) {
+  std::deque<Run>& runs = ptr_timeline->runs;
+  while (!runs.empty() && runs.front().end() <= window_start) {
+    ptr_timeline->start_number += runs.front().repeat + 1;
+    runs.pop_front();
+  }
+
+  // Drop the expired segments of a run that straddles the window start. The
+  // open run always holds the newest segment, which never expires.
+  Run& run = runs.empty() ? ptr_timeline->run : runs.front();
+  if (run.start < 0 || run.start + run.duration > window_start) {
+    return;
+  }
+  const int64 expired = (window_start - run.start) / run.duration;
+  run.start += expired * run.duration;
+  run.repeat -= expired;
+  ptr_timeline->start_number += expired;
+  if (!run.xml.empty()) {
+    run.xml.clear();
+    AppendTimelineEntry(run, &run.xml);
+  }
+}
+
+bool DashWriter::WriteDynamicManifest(std::string* out_manifest) {
+  std::ostringstream mpd;
+  mpd << "<?xml version=\"1.0\"?>\n"
+      << "<MPD "
+      << "xmlns=\"" << kDefaultSchema << "\" "
+      << "type=\"" << config_.type << "\" "
+      << "availabilityStartTime=\"" << config_.availability_start_time
+      << "\" "
+      << "publishTime=\"" << UtcTimeString(std::time(NULL)) << "\" "
+      << "minimumUpdatePeriod=\""
+      << DurationString(config_.minimum_update_period) << "\" ";
+  if (config_.time_shift_buffer_depth > 0) {
+    mpd << "timeShiftBufferDepth=\""
+        << DurationString(config_.time_shift_buffer_depth) << "\" ";
+  }
+  mpd << "minBufferTime=\"PT" << config_.min_buffer_time << "S\" "
+      << "profiles=\""
+      << (config_.single_file ? kSingleFileProfiles : kDefaultProfiles)
+      << "\">\n";
+
+  // Size the output for the previous manifest.
+  std::string& manifest = *out_manifest;
+  manifest.clear();
+  manifest.reserve(manifest_size_);
+  manifest.append(mpd.str());
+  manifest.append(period_head_);
+  if (config_.audio_as.enabled) {
+    manifest.append(audio_as_head_);
+    for (size_t i = 0; i < audio_timelines_.size(); ++i) {
+      AppendTimeline(audio_timelines_[i], &manifest);
+    }
+    manifest.append(as_tail_);
+  }
+  if (config_.video_as.enabled) {
+    // The primary capture and its renditions, then each other codec and
+    // each camera.
+    for (size_t video_set = 0; video_set <= video_set_heads_.size();
+         ++video_set) {
+      manifest.append(video_set == 0 ? video_as_head_ :
+                      video_set_heads_[video_set - 1]);
+      for (size_t i = 0; i < video_timelines_.size(); ++i) {
+        if (video_timelines_[i].adaptation_set ==
+            static_cast<int>(video_set)) {
+          AppendTimeline(video_timelines_[i], &manifest);
+        }
+      }
+      manifest.append(as_tail_);
+    }
+  }
+  manifest.append(period_tail_);
+  manifest_size_ = manifest.size();
+  VLOG(1) << "\nmanifest:\n" << manifest;
+  return true;
+}
+
+void DashWriter::AppendTimeline(const Timeline& timeline,
+                                std::string* ptr_manifest) const {
+  std::ostringstream start_number;
+  start_number << timeline.start_number;
+  ptr_manifest->append(timeline.head);
+  ptr_manifest->append(start_number.str());
+  ptr_manifest->append(timeline.head_tail);
+  for (size_t i = 0; i < timeline.runs.size(); ++i) {
+    ptr_manifest->append(timeline.runs[i].xml);
+  }
+  if (timeline.run.start >= 0) {
+    AppendTimelineEntry(timeline.run, ptr_manifest);
+  }
+  ptr_manifest->append(timeline_tail_);
+  if (config_.single_file) {
+    for (size_t i = 0; i < timeline.segment_urls.size(); ++i) {
+      ptr_manifest->append(timeline.segment_urls[i]);
+    }
+    ptr_manifest->append(list_tail_);
+  }
+}
+
+DashWriter::Timeline* DashWriter::TimelineFor(
+    AdaptationSet::MediaType media_type, int rendition) {
+  std::vector<Timeline>& timelines =
+      (media_type == AdaptationSet::kAudio) ? audio_timelines_ :
+                                              video_timelines_;
+  if (rendition < 0 || rendition >= static_cast<int>(timelines.size())) {
+    return NULL;
+  }
+  return &timelines[rendition];
+}
+
+DashWriter::BandwidthMeter* DashWriter::MeterFor(
+    AdaptationSet::MediaType media_type, int rendition) {
+  std::vector<BandwidthMeter>& meters =
+      (media_type == AdaptationSet::kAudio) ? audio_meters_ : video_meters_;
+  if (rendition < 0 || rendition >= static_cast<int>(meters.size())) {
+    return NULL;
+  }
+  return &meters[rendition];
 }
 
 void DashWriter::IncreaseIndent() {
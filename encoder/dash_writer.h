@@ -8,8 +8,13 @@
 #ifndef WEBMLIVE_ENCODER_DASH_WRITER_H_
 #define WEBMLIVE_ENCODER_DASH_WRITER_H_
 
+#include <deque>
+#include <mutex>
 #include <string>
+#include <utility>
+#include <vector>
 
+#include "encoder/basictypes.h"
 #include "encoder/webm_encoder.h"
 
 namespace webmlive {
@@ -42,7 +47,6 @@ public:
  std::string initialization;
 
  // Representation properties.
- // TODO(tomfinegan): Support multiple Representation elements.
  std::string rep_id;
  std::string mimetype;
  std::string codecs;
@@ -61,6 +65,21 @@ class AudioAdaptationSet : public AdaptationSet {
   // AudioChannelConfiguration.
   std::string scheme_id_uri;
   int value;  // Audio channels.
+
+  // Additional Representations, one per entry in
+  // |WebmEncoderConfig::audio_renditions|. They share the sampling rate and
+  // channels of the primary Representation described above, and its codecs
+  // and SegmentTemplate unless their own |codecs|, |media| and
+  // |initialization| are set.
+  struct Rendition {
+    Rendition() : bandwidth(0) {}
+    std::string rep_id;
+    std::string codecs;
+    std::string media;
+    std::string initialization;
+    int bandwidth;
+  };
+  std::vector<Rendition> renditions;
 };
 
 class VideoAdaptationSet : public AdaptationSet {
@@ -77,9 +96,38 @@ class VideoAdaptationSet : public AdaptationSet {
   int width;
   int height;
   int frame_rate;
+
+  // Additional Representations, one per entry in
+  // |WebmEncoderConfig::video_renditions|, then one per entry in
+  // |WebmEncoderConfig::video_cameras|. They share the codecs and
+  // SegmentTemplate of the primary Representation described above unless
+  // their own |codecs|, |media| and |initialization| are set. Each camera is
+  // written to an AdaptationSet of its own, and so is each codecs string of
+  // a camera or of the primary capture: players switch Representations only
+  // within a codec.
+  struct Rendition {
+    Rendition() : width(0), height(0), bandwidth(0), frame_rate(0),
+                  camera(0) {}
+    std::string rep_id;
+    std::string codecs;
+    std::string media;
+    std::string initialization;
+    int width;
+    int height;
+    int bandwidth;
+    int frame_rate;
+
+    // Position of the camera in |WebmEncoderConfig::video_cameras| plus one,
+    // or 0 for a rendition of the primary capture.
+    int camera;
+  };
+  std::vector<Rendition> renditions;
 };
 
 struct DashConfig {
+  // Peak bitrate measurement window when |bandwidth_window| is 0.
+  static const int kDefaultBandwidthWindow = 30000;
+
   DashConfig();
 
   // MPD properties.
@@ -91,15 +139,62 @@ struct DashConfig {
   int start_time;
   int period_duration;
 
+  // Duration of each media segment in milliseconds. Sets the SegmentTemplate
+  // duration of both adaptation sets.
+  int segment_duration;
+
+  // Dynamic MPD properties, used when |type| is "dynamic".
+  // |availability_start_time| is a UTC xs:dateTime, and
+  // |minimum_update_period| is in milliseconds.
+  std::string availability_start_time;
+  int minimum_update_period;
+
+  // Length in milliseconds of the SegmentTimeline of a dynamic manifest.
+  // Older segments are removed from the manifest. 0 lists every segment.
+  int time_shift_buffer_depth;
+
+  // Write each Representation to one file, named by
+  // |DashWriter::FileForRepresentation()|. A dynamic manifest lists the
+  // segments by byte range in a SegmentList.
+  bool single_file;
+
+  // Length in milliseconds of the window over which the peak segment
+  // bitrate is measured. When set, a dynamic manifest advertises the peak as
+  // the bandwidth of each Representation. When 0, the configured bandwidth
+  // is advertised, and the peak is measured over |kDefaultBandwidthWindow|.
+  int bandwidth_window;
+
   // Audio/Video adaptation sets.
   // TODO(tomfinegan): Support multiple adaptation sets per media type.
   AudioAdaptationSet audio_as;
   VideoAdaptationSet video_as;
 };
 
+// Writes the DASH manifest. A static manifest describes segments with a
+// fixed SegmentTemplate duration. A dynamic manifest lists the segments
+// passed to |AddSegment()| in a SegmentTimeline per Representation: each
+// segment extends a cached XML fragment instead of causing the manifest to be
+// rebuilt, and |WriteManifest()| joins the cached fragments. When
+// |DashConfig::time_shift_buffer_depth| is set, segments that fall out of the
+// window are dropped from the front of the timeline, and startNumber advances
+// past them.
+//
+// With |DashConfig::single_file|, each Representation of a dynamic manifest
+// has a BaseURL naming its file, and a SegmentList instead of the
+// SegmentTemplate: the Initialization range and SegmentTimeline are followed
+// by a SegmentURL with the mediaRange of each listed segment. The file is the
+// initialization segment followed by every media segment in order, so ranges
+// follow from the lengths passed to |AddInitialization()| and
+// |AddSegment()|.
+//
+// The sizes and durations of the segments passed to |AddSegment()| are
+// measured per Representation, for |GetRepresentationStats()| and, when
+// |DashConfig::bandwidth_window| is set, for the bandwidth a dynamic manifest
+// advertises.
 class DashWriter {
  public:
-  DashWriter() : initialized_(false){}
+  DashWriter()
+      : initialized_(false), segments_added_(0), manifest_size_(0) {}
   ~DashWriter() {}
 
   DashConfig config() const { return config_; }
@@ -111,17 +206,202 @@ class DashWriter {
   bool Init(const WebmEncoderConfig& webm_config);
 
   // Writes the DASH manifest built from |config| to |manifest|. Returns true
-  // when successful.
+  // when successful. Thread safe for dynamic manifests.
   bool WriteManifest(std::string* manifest);
 
-  // Returns a string suitable for identifying a chunk.
-  std::string IdForChunk(AdaptationSet::MediaType media_type,
+  // Records a complete media segment of the Representation selected by
+  // |media_type| and |rendition|, which are as in |IdForChunk()|. |timestamp|
+  // and |duration| are in milliseconds, and |length| is in bytes. Does
+  // nothing unless the manifest is dynamic. Thread safe.
+  void AddSegment(AdaptationSet::MediaType media_type, int rendition,
+                  int64 timestamp, int64 duration, int64 length);
+
+  // Records the |length| in bytes of the initialization segment that starts
+  // the file of the Representation selected by |media_type| and |rendition|.
+  // Does nothing unless the manifest is dynamic and |DashConfig::single_file|
+  // is set. Thread safe.
+  void AddInitialization(AdaptationSet::MediaType media_type, int rendition,
+                         int64 length);
+
+  // Sets the bandwidth, in bits per second, of the Representation selected by
+  // |media_type| and |rendition|, which are as in |IdForChunk()|. Manifests
+  // written afterwards advertise it, unless they advertise the measured
+  // bandwidth of a Representation with segments. Thread safe.
+  void SetBandwidth(AdaptationSet::MediaType media_type, int rendition,
+                    int bandwidth);
+
+  // Copies the measured segment statistics of each Representation to
+  // |ptr_stats|, audio first. Thread safe.
+  void GetRepresentationStats(
+      std::vector<RepresentationStats>* ptr_stats) const;
+
+  // Returns true when the manifest is dynamic.
+  bool dynamic() const;
+
+  // Returns the number of segments recorded by |AddSegment()|. Thread safe.
+  int64 segments_added() const;
+
+  // Returns a string suitable for identifying a chunk: its name as expanded
+  // from the initialization, or media, template of its Representation.
+  // |rendition| selects the Representation of |media_type|: 0 for the
+  // primary stream, or the index of an entry in
+  // |VideoAdaptationSet::renditions| or |AudioAdaptationSet::renditions|
+  // plus one.
+  std::string IdForChunk(AdaptationSet::MediaType media_type, int rendition,
                          int64 chunk_num) const;
 
+  // Returns the name of the file that holds the segments of the
+  // Representation selected by |media_type| and |rendition| when
+  // |DashConfig::single_file| is set.
+  std::string FileForRepresentation(AdaptationSet::MediaType media_type,
+                                    int rendition) const;
+
+  // Returns the name of the |SegmentIndexRecord| file of the Representation
+  // selected by |media_type| and |rendition|.
+  std::string IndexForRepresentation(AdaptationSet::MediaType media_type,
+                                     int rendition) const;
+
  private:
+  // A run of |repeat| + 1 segments of |duration| starting at |start|, and
+  // its S element in |xml|.
+  struct Run {
+    Run() : start(-1), duration(0), repeat(0) {}
+    int64 end() const { return start + (repeat + 1) * duration; }
+    int64 start;
+    int64 duration;
+    int64 repeat;
+    std::string xml;
+  };
+
+  // SegmentTimeline of one Representation. |runs| holds the closed runs; the
+  // open run |run| is written by |WriteManifest()| until a segment that does
+  // not extend it closes it. The SegmentTemplate, or SegmentList, opening tag
+  // is split around its startNumber value, |start_number|, into |head| and
+  // |head_tail|. For single-file output, |file_length| is the length of the
+  // Representation's file, and |segment_urls| holds the SegmentURL element of
+  // each listed segment, oldest first. |adaptation_set| is the
+  // Representation's AdaptationSet among those of its media type.
+  struct Timeline {
+    Timeline() : start_number(1), file_length(0), adaptation_set(0) {}
+    std::string head;
+    std::string head_tail;
+    int64 start_number;
+    std::deque<Run> runs;
+    Run run;
+    int64 file_length;
+    std::deque<std::string> segment_urls;
+    int adaptation_set;
+  };
+
+  // Id, codecs and segment name templates of one Representation, those of
+  // its AdaptationSet filled in for the ones it does not set.
+  struct RepresentationTemplate {
+    std::string rep_id;
+    std::string codecs;
+    std::string media;
+    std::string initialization;
+  };
+
+  // Measured segments of one Representation. |window| holds the end time
+  // and bitrate of the segments of the bandwidth window that can still be
+  // its peak: each bitrate is above those of the entries after it.
+  struct BandwidthMeter {
+    RepresentationStats stats;
+    std::deque<std::pair<int64, int64> > window;
+  };
+
+  // Prepares a meter per Representation.
+  void InitMeters();
+
+  // Adds a segment of |duration| milliseconds and |length| bytes ending at
+  // |end| to |ptr_meter|.
+  void MeasureSegment(int64 end, int64 duration, int64 length,
+                      BandwidthMeter* ptr_meter);
+
+  // Returns the advertised bandwidth of the Representation selected by
+  // |media_type| and |rendition|, or NULL.
+  int* BandwidthFor(AdaptationSet::MediaType media_type, int rendition);
+
+  // Rewrites the bandwidth attribute of the cached Representation tag of
+  // |ptr_timeline|.
+  void WriteBandwidthAttribute(int bandwidth, Timeline* ptr_timeline);
+
+  // Returns the templates of the Representation selected by |media_type|
+  // and |rendition|. A |rendition| out of range gets the templates of its
+  // AdaptationSet.
+  RepresentationTemplate TemplateFor(AdaptationSet::MediaType media_type,
+                                     int rendition) const;
+
+  // Returns what follows the attributes of a Representation of a static
+  // manifest, up to its closing tag. A Representation with a media template
+  // of its own gets a SegmentTemplate that overrides that of
+  // |adaptation_set|.
+  std::string StaticRepresentationTail(
+      const AdaptationSet& adaptation_set,
+      const RepresentationTemplate& templates);
+
   void WriteAudioAdaptationSet(std::string* adaptation_set);
   void WriteVideoAdaptationSet(std::string* adaptation_set);
 
+  // Stores the camera and codecs of each video AdaptationSet in |ptr_keys|:
+  // the primary Representation's first, then each other pair in the order
+  // of |config_.video_as.renditions|.
+  void VideoSetKeys(std::vector<std::pair<int, std::string> >* ptr_keys)
+      const;
+
+  // Returns the number of video AdaptationSets.
+  int VideoSetCount() const;
+
+  // Returns the video AdaptationSet of the video Representation
+  // |rendition|, 0 for the primary capture and its renditions of the same
+  // codec.
+  int VideoSetOf(int rendition) const;
+
+  // Appends the AdaptationSet opening tag and ContentComponent of video
+  // AdaptationSet |video_set| to |ptr_head|, and increases the indent.
+  void BuildVideoAdaptationSetHead(int video_set, std::string* ptr_head);
+
+  // Builds the cached fragments of the dynamic manifest.
+  void BuildDynamicFragments();
+
+  // Builds the Representation and SegmentTemplate, or SegmentList, opening
+  // tags of a dynamic manifest in |ptr_timeline|. |templates| name the
+  // Representation and its segments, and |representation| holds its
+  // attributes.
+  void BuildTimelineHead(const AdaptationSet& adaptation_set,
+                         const RepresentationTemplate& templates,
+                         const std::string& representation,
+                         Timeline* ptr_timeline);
+
+  // Builds the |head_tail| of a SegmentList: its Initialization element, when
+  // the initialization segment length is known, and the SegmentTimeline
+  // opening tag.
+  void BuildListHeadTail(Timeline* ptr_timeline) const;
+
+  // Appends the S element of |run| to |ptr_xml|.
+  void AppendTimelineEntry(const Run& run, std::string* ptr_xml) const;
+
+  // Drops the segments of |ptr_timeline| that end at or before
+  // |window_start|, and their SegmentURLs.
+  void TrimTimeline(int64 window_start, Timeline* ptr_timeline);
+
+  // Drops the runs, and the parts of runs, that |TrimTimeline()| drops.
+  void TrimRuns(int64 window_start, Timeline* ptr_timeline);
+
+  // Appends |timeline| and the tags that close it to |ptr_manifest|.
+  void AppendTimeline(const Timeline& timeline,
+                      std::string* ptr_manifest) const;
+
+  // Joins the cached fragments. |mutex_| must be held.
+  bool WriteDynamicManifest(std::string* manifest);
+
+  // Returns the timeline selected by |media_type| and |rendition|, or NULL.
+  Timeline* TimelineFor(AdaptationSet::MediaType media_type, int rendition);
+
+  // Returns the meter selected by |media_type| and |rendition|, or NULL.
+  BandwidthMeter* MeterFor(AdaptationSet::MediaType media_type,
+                           int rendition);
+
   void IncreaseIndent();
   void DecreaseIndent();
   void ResetIndent();
@@ -130,6 +410,27 @@ class DashWriter {
   DashConfig config_;
   std::string indent_;
   std::string name_;
+
+  // Dynamic manifest state. Protected by |mutex_|.
+  std::string period_head_;
+  std::string audio_as_head_;
+  std::string video_as_head_;
+  std::vector<std::string> video_set_heads_;
+  std::string timeline_tail_;
+  std::string list_tail_;
+  std::string list_indent_;
+  std::string as_tail_;
+  std::string period_tail_;
+  std::string entry_indent_;
+  std::vector<Timeline> audio_timelines_;
+  std::vector<Timeline> video_timelines_;
+  int64 segments_added_;
+  size_t manifest_size_;
+
+  // Segment measurements, for static manifests too. Protected by |mutex_|.
+  std::vector<BandwidthMeter> audio_meters_;
+  std::vector<BandwidthMeter> video_meters_;
+  mutable std::mutex mutex_;
 };
 
 }  // namespace webmlive
@@ -11,6 +11,7 @@
 #include <string>
 
 #include "encoder/basictypes.h"
+#include "encoder/webm_chunk.h"
 
 namespace webmlive {
 
@@ -25,6 +26,63 @@ class DataSinkInterface {
   // Writes data to the sink and returns true when successful.
   virtual bool WriteData(const uint8* ptr_data, int32 data_length,
                          const std::string& id) = 0;
+
+  // Passes |chunk| to the sink and returns true when successful. Sinks that
+  // keep a reference to |chunk| avoid copying its data. The default
+  // implementation passes the chunk data to |WriteData()|.
+  virtual bool WriteChunk(const SharedWebmChunk& chunk) {
+    return WriteData(chunk->data(), chunk->length(), chunk->id());
+  }
+
+  // Streaming interface: sends the chunk identified by |id| while it is still
+  // being produced. |BeginStream()| opens the stream, |WriteStreamData()|
+  // appends data to it, and |EndStream()| marks the end of the chunk. The
+  // methods return true when successful. The default implementations return
+  // false: sinks that do not support streaming accept only complete chunks.
+  virtual bool BeginStream(const std::string& /*id*/) { return false; }
+  virtual bool WriteStreamData(const std::string& /*id*/,
+                               const uint8* /*ptr_data*/,
+                               int32 /*data_length*/) {
+    return false;
+  }
+  virtual bool EndStream(const std::string& /*id*/) { return false; }
+
+  // Tells the sink the initialization segment of its stream, as kept by the
+  // muxer, before or after the segment is written. Sinks that send it again,
+  // for example after a reconnect, use |chunk| instead of a copy of their
+  // own. Called again when the segment changes. The default implementation
+  // does nothing.
+  virtual void SetInitSegment(const SharedWebmChunk& /*chunk*/) {}
+};
+
+// Receives the completion of each chunk passed to
+// |AsyncDataSinkInterface::SubmitChunk()|.
+class DataSinkCallbackInterface {
+ public:
+  virtual ~DataSinkCallbackInterface() {}
+
+  // Called once the sink is done with |chunk|, with |success| false when the
+  // chunk was not written. Returns the credit |chunk| used. Called on a
+  // thread owned by the sink, in submission order.
+  virtual void OnChunkComplete(const SharedWebmChunk& chunk, bool success) = 0;
+};
+
+// Asynchronous data sink. Flow control is by credit instead of polling
+// |DataSinkInterface::Ready()|: the sink grants a number of chunks up front,
+// each |SubmitChunk()| uses one, and each |OnChunkComplete()| returns one.
+class AsyncDataSinkInterface {
+ public:
+  virtual ~AsyncDataSinkInterface() {}
+
+  // Sends completions to |ptr_callback|, which must outlive the sink, and
+  // returns the credit granted, at least 1. Must be called before
+  // |SubmitChunk()|.
+  virtual int SetCallback(DataSinkCallbackInterface* ptr_callback) = 0;
+
+  // Passes |chunk| to the sink, and returns without waiting for it to be
+  // written. Returns false when the sink refuses |chunk|, for want of credit
+  // or once stopped; no completion is reported for it then.
+  virtual bool SubmitChunk(const SharedWebmChunk& chunk) = 0;
 };
 
 }  // namespace webmlive
@@ -0,0 +1,275 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/data_sink_fanout.h"
+
+#include <algorithm>
+#include <chrono>
+#include <new>
+
+#include "encoder/log_util.h"
+#include "encoder/thread_util.h"
+#include "glog/logging.h"
+
+namespace webmlive {
+
+namespace {
+
+// Longest delay between retries of a chunk, in milliseconds.
+const int kMaxRetryDelay = 4000;
+
+// Interval at which a destination that is not ready is polled, in
+// milliseconds.
+const int kReadyPollInterval = 5;
+
+}  // namespace
+
+DataSinkFanout::DataSinkFanout() : running_(false), stop_(false) {
+}
+
+DataSinkFanout::~DataSinkFanout() {
+  Stop();
+}
+
+int DataSinkFanout::Init(const DataSinkFanoutSettings& settings) {
+  if (settings.max_queued_chunks < 1 || settings.max_retries < 0 ||
+      settings.retry_delay < 1) {
+    LOG(ERROR) << "invalid fan-out settings.";
+    return kInvalidArg;
+  }
+  settings_ = settings;
+  return kSuccess;
+}
+
+int DataSinkFanout::AddSink(DataSinkInterface* ptr_sink,
+                            const std::string& name) {
+  if (!ptr_sink || running_) {
+    return kInvalidArg;
+  }
+  std::unique_ptr<Destination> destination(
+      new (std::nothrow) Destination());  // NOLINT
+  if (!destination) {
+    LOG(ERROR) << "out of memory.";
+    return kNoMemory;
+  }
+  destination->ptr_sink = ptr_sink;
+  destination->stats.name = name;
+  destination->stats.chunks_written = 0;
+  destination->stats.bytes_written = 0;
+  destination->stats.chunks_dropped = 0;
+  destination->stats.write_failures = 0;
+  destination->stats.queued_chunks = 0;
+  destination->stats.healthy = true;
+  destinations_.push_back(std::move(destination));
+  return kSuccess;
+}
+
+int DataSinkFanout::Run() {
+  if (running_ || destinations_.empty()) {
+    LOG(ERROR) << "fan-out already running, or has no destinations.";
+    return kRunFailed;
+  }
+  stop_ = false;
+  for (size_t i = 0; i < destinations_.size(); ++i) {
+    Destination* const ptr_destination = destinations_[i].get();
+    ptr_destination->thread =
+        std::thread(&DataSinkFanout::DestinationThread, this, ptr_destination);
+  }
+  running_ = true;
+  return kSuccess;
+}
+
+void DataSinkFanout::Stop() {
+  if (!running_) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+    for (size_t i = 0; i < destinations_.size(); ++i) {
+      destinations_[i]->queue_ready.notify_all();
+    }
+  }
+  for (size_t i = 0; i < destinations_.size(); ++i) {
+    if (destinations_[i]->thread.joinable()) {
+      destinations_[i]->thread.join();
+    }
+  }
+  running_ = false;
+}
+
+int DataSinkFanout::GetStats(
+    std::vector<DataSinkFanoutStats>* ptr_stats) const {
+  if (!ptr_stats) {
+    return kInvalidArg;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  ptr_stats->clear();
+  for (size_t i = 0; i < destinations_.size(); ++i) {
+    ptr_stats->push_back(destinations_[i]->stats);
+  }
+  return kSuccess;
+}
+
+bool DataSinkFanout::WriteData(const uint8* ptr_data, int32 data_length,
+                               const std::string& id) {
+  if (!ptr_data || data_length < 0) {
+    LOG(ERROR) << "invalid fan-out write.";
+    return false;
+  }
+  WebmChunk::Data data(ptr_data, ptr_data + data_length);
+  WebmChunkDescriptor descriptor;
+  descriptor.length = data_length;
+  SharedWebmChunk chunk(
+      new (std::nothrow) WebmChunk(id, descriptor, 0, &data,  // NOLINT
+                                   SharedWebmChunkDataPool()));
+  if (!chunk) {
+    LOG(ERROR) << "out of memory.";
+    return false;
+  }
+  return WriteChunk(chunk);
+}
+
+bool DataSinkFanout::WriteChunk(const SharedWebmChunk& chunk) {
+  if (!chunk) {
+    LOG(ERROR) << "invalid fan-out chunk.";
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (size_t i = 0; i < destinations_.size(); ++i) {
+    Destination& destination = *destinations_[i];
+    if (static_cast<int>(destination.queue.size()) >=
+        settings_.max_queued_chunks) {
+      std::deque<SharedWebmChunk>::iterator drop = destination.queue.begin();
+      if (*drop == init_segment_) {
+        ++drop;
+      }
+      if (drop != destination.queue.end()) {
+        destination.queue.erase(drop);
+        ++destination.stats.chunks_dropped;
+      }
+      WEBMLIVE_LOG_EVERY_MS(WARNING, kLogIntervalMs)
+          << destination.stats.name << " is falling behind, "
+          << destination.stats.chunks_dropped << " chunk(s) dropped.";
+    }
+    destination.queue.push_back(chunk);
+    destination.stats.queued_chunks =
+        static_cast<int32>(destination.queue.size());
+    destination.queue_ready.notify_one();
+  }
+  return true;
+}
+
+void DataSinkFanout::SetInitSegment(const SharedWebmChunk& chunk) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  init_segment_ = chunk;
+  for (size_t i = 0; i < destinations_.size(); ++i) {
+    destinations_[i]->init_pending = true;
+  }
+}
+
+void DataSinkFanout::DestinationThread(Destination* ptr_destination) {
+  ScopedThreadRegistration registration("fanout");
+  VLOG(1) << "fan-out destination " << ptr_destination->stats.name
+          << " started.";
+  for (;;) {
+    SharedWebmChunk chunk;
+    SharedWebmChunk init_segment;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      ptr_destination->queue_ready.wait(lock, [this, ptr_destination] {
+        return stop_ || !ptr_destination->queue.empty();
+      });
+
+      // A stopped destination writes its queue unless it is unhealthy.
+      if (ptr_destination->queue.empty() ||
+          (stop_ && !ptr_destination->stats.healthy)) {
+        ptr_destination->stats.chunks_dropped +=
+            ptr_destination->queue.size();
+        ptr_destination->queue.clear();
+        ptr_destination->stats.queued_chunks = 0;
+        break;
+      }
+      chunk = ptr_destination->queue.front();
+      ptr_destination->queue.pop_front();
+      ptr_destination->stats.queued_chunks =
+          static_cast<int32>(ptr_destination->queue.size());
+      if (ptr_destination->init_pending) {
+        init_segment = init_segment_;
+        ptr_destination->init_pending = false;
+      }
+    }
+    // The sink is told of the segment by this thread, as it is of chunks.
+    if (init_segment) {
+      ptr_destination->ptr_sink->SetInitSegment(init_segment);
+    }
+    Deliver(ptr_destination, chunk);
+  }
+  VLOG(1) << "fan-out destination " << ptr_destination->stats.name
+          << " stopped.";
+}
+
+bool DataSinkFanout::Deliver(Destination* ptr_destination,
+                             const SharedWebmChunk& chunk) {
+  DataSinkFanoutStats& stats = ptr_destination->stats;
+  int delay = settings_.retry_delay;
+  for (int attempt = 0; ; ++attempt) {
+    // Waiting for a destination that is not ready counts as a failed
+    // attempt, and as the delay before the next one.
+    const bool ready = WaitForReady(ptr_destination, delay);
+    if (ready && ptr_destination->ptr_sink->WriteChunk(chunk)) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ++stats.chunks_written;
+      stats.bytes_written += chunk->length();
+      if (!stats.healthy) {
+        LOG(INFO) << stats.name << " recovered.";
+        stats.healthy = true;
+      }
+      return true;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    ++stats.write_failures;
+    if (attempt >= settings_.max_retries || (stop_ && !stats.healthy)) {
+      ++stats.chunks_dropped;
+      stats.healthy = false;
+      LOG(WARNING) << stats.name << " dropped chunk " << chunk->id()
+                   << " after " << attempt + 1 << " attempt(s).";
+      return false;
+    }
+    if (ready) {
+      // The write failed; back off before the retry.
+      ptr_destination->queue_ready.wait_for(
+          lock, std::chrono::milliseconds(delay),
+          [this, &stats] { return stop_ && !stats.healthy; });
+    }
+    delay = std::min(delay * 2, kMaxRetryDelay);
+  }
+}
+
+bool DataSinkFanout::WaitForReady(Destination* ptr_destination,
+                                  int timeout_ms) {
+  const std::chrono::steady_clock::time_point deadline =
+      std::chrono::steady_clock::now() +
+      std::chrono::milliseconds(timeout_ms);
+  while (!ptr_destination->ptr_sink->Ready()) {
+    if (std::chrono::steady_clock::now() >= deadline) {
+      return false;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (stop_ && !ptr_destination->stats.healthy) {
+        return false;
+      }
+    }
+    std::this_thread::sleep_for(
+        std::chrono::milliseconds(kReadyPollInterval));
+  }
+  return true;
+}
+
+}  // namespace webmlive
@@ -0,0 +1,174 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_DATA_SINK_FANOUT_H_
+#define WEBMLIVE_ENCODER_DATA_SINK_FANOUT_H_
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "encoder/basictypes.h"
+#include "encoder/data_sink.h"
+#include "encoder/encoder_base.h"
+#include "encoder/webm_chunk.h"
+
+namespace webmlive {
+
+struct DataSinkFanoutSettings {
+  // Default number of chunks queued for each destination.
+  static const int kDefaultMaxQueuedChunks = 16;
+
+  // Default number of retries of a failed chunk write.
+  static const int kDefaultMaxRetries = 3;
+
+  // Default delay before the first retry of a chunk, in milliseconds.
+  static const int kDefaultRetryDelay = 250;
+
+  DataSinkFanoutSettings()
+      : max_queued_chunks(kDefaultMaxQueuedChunks),
+        max_retries(kDefaultMaxRetries),
+        retry_delay(kDefaultRetryDelay) {}
+
+  // Number of chunks each destination queues. When a queue is full its
+  // oldest chunk is dropped.
+  int max_queued_chunks;
+
+  // Number of times a chunk that a destination is not ready for, or fails to
+  // write, is retried before it is dropped.
+  int max_retries;
+
+  // Delay before the first retry of a chunk, in milliseconds. Each further
+  // retry doubles it.
+  int retry_delay;
+};
+
+// Counters of one |DataSinkFanout| destination.
+struct DataSinkFanoutStats {
+  // Name passed to |DataSinkFanout::AddSink()|.
+  std::string name;
+
+  // Number of chunks, and bytes, written to the destination.
+  int64 chunks_written;
+  int64 bytes_written;
+
+  // Number of chunks dropped: by a full queue, or after |max_retries|.
+  int64 chunks_dropped;
+
+  // Number of failed write attempts, retries included.
+  int64 write_failures;
+
+  // Number of chunks waiting for the destination.
+  int32 queued_chunks;
+
+  // False from the time a chunk is dropped after |max_retries| until a
+  // write succeeds.
+  bool healthy;
+};
+
+// Data sink that passes every chunk to several destinations: for example a
+// primary ingest, a backup ingest, and a local archive. Each destination
+// has its own queue and thread, so a slow or failed destination never holds
+// up the others or the encoder. Queues hold references to the chunks
+// written, and every destination receives the same |WebmChunk|; chunk data
+// is never copied per destination.
+//
+// Notes:
+// - |Init| must be called before any other method, and destinations are
+//   added with |AddSink| before |Run|.
+// - |Ready()| always returns true: chunks are dropped from a full queue
+//   instead of blocking the producer.
+// - Streaming is not supported; chunks are passed on once complete.
+// - A full queue never drops the initialization segment set by
+//   |SetInitSegment()|, which each destination thread passes on to its sink
+//   before the next chunk.
+class DataSinkFanout : public DataSinkInterface {
+ public:
+  enum {
+    // |Run| failed.
+    kRunFailed = -3,
+    kNoMemory = -2,
+    kInvalidArg = -1,
+    kSuccess = 0,
+  };
+
+  DataSinkFanout();
+  virtual ~DataSinkFanout();
+
+  // Copies |settings|. Returns |kSuccess| upon success.
+  int Init(const DataSinkFanoutSettings& settings);
+
+  // Adds the destination |ptr_sink|, which is not owned, and must outlive
+  // the fan-out. |name| identifies the destination in logs and stats.
+  // Returns |kSuccess| upon success.
+  int AddSink(DataSinkInterface* ptr_sink, const std::string& name);
+
+  // Starts a thread per destination.
+  int Run();
+
+  // Stops the destination threads. Each thread writes the chunks still in
+  // its queue before it exits, unless its destination is unhealthy.
+  void Stop();
+
+  // Copies the counters of each destination, in the order added, to
+  // |ptr_stats|. Returns |kSuccess| upon success.
+  int GetStats(std::vector<DataSinkFanoutStats>* ptr_stats) const;
+
+  // DataSinkInterface methods. |WriteData()| copies the data into a chunk
+  // named |id| shared by all destinations, and |WriteChunk()| queues a
+  // reference to |chunk| for each destination.
+  virtual bool Ready() const { return true; }
+  virtual bool WriteData(const uint8* ptr_data, int32 data_length,
+                         const std::string& id);
+  virtual bool WriteChunk(const SharedWebmChunk& chunk);
+  virtual void SetInitSegment(const SharedWebmChunk& chunk);
+
+ private:
+  // A destination, its queue, and the thread writing to it. |queue|,
+  // |init_pending| and |stats| are protected by |mutex_|.
+  struct Destination {
+    Destination() : ptr_sink(NULL), init_pending(false) {}
+    DataSinkInterface* ptr_sink;
+    std::deque<SharedWebmChunk> queue;
+    bool init_pending;
+    DataSinkFanoutStats stats;
+    std::condition_variable queue_ready;
+    std::thread thread;
+  };
+
+  // Writes chunks from |ptr_destination|'s queue until |stop_| is set and
+  // the queue is empty.
+  void DestinationThread(Destination* ptr_destination);
+
+  // Writes |chunk| to |ptr_destination|, retrying with backoff while the
+  // destination is not ready or the write fails. Returns true when the
+  // chunk is written.
+  bool Deliver(Destination* ptr_destination, const SharedWebmChunk& chunk);
+
+  // Waits up to |timeout_ms| for |ptr_destination| to become ready. Returns
+  // false when it does not, or when a stop of an unhealthy destination is
+  // requested.
+  bool WaitForReady(Destination* ptr_destination, int timeout_ms);
+
+  DataSinkFanoutSettings settings_;
+  bool running_;
+  bool stop_;
+  std::vector<std::unique_ptr<Destination>> destinations_;
+
+  // The stream's initialization segment. Protected by |mutex_|.
+  SharedWebmChunk init_segment_;
+  mutable std::mutex mutex_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(DataSinkFanout);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_DATA_SINK_FANOUT_H_
@@ -0,0 +1,642 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+//
+// Component benchmarks. Runs color conversion, VPx and Vorbis encoding,
+// muxing, and buffer pool hand off on synthetic input, and reports for each
+// case:
+// - operations per second; an operation is one frame or audio buffer,
+// - MB/s of uncompressed input, or of compressed frames for the muxer,
+// - operator new allocations per operation,
+// - median, 99th percentile and largest operation time.
+// Used to compare libvpx, libyuv and libwebm builds before updating them.
+// With --check_allocations, allocations made by the operations of each case
+// after its first |kAllocationCheckWarmup| are reported with their call
+// stacks, and the benchmark fails when there are any.
+#include "encoder/encoder_base.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "encoder/allocation_tracker.h"
+#include "encoder/audio_encoder.h"
+#include "encoder/buffer_pool-inl.h"
+#include "encoder/video_encoder.h"
+#include "encoder/vorbis_encoder.h"
+#include "encoder/vpx_encoder.h"
+#include "encoder/webm_chunk.h"
+#include "encoder/webm_encoder.h"
+#include "encoder/webm_mux.h"
+#include "glog/logging.h"
+
+namespace {
+
+// Allocations made through the operator new replacements below.
+std::atomic<int64> g_allocations(0);
+
+// Operations of each case run before allocations are checked, and whether
+// they are.
+const size_t kAllocationCheckWarmup = 10;
+bool g_check_allocations = false;
+
+void* counted_malloc(size_t size) {
+  g_allocations.fetch_add(1, std::memory_order_relaxed);
+  webmlive::AllocationTracker::OnAllocation(size);
+  return malloc(size > 0 ? size : 1);
+}
+
+}  // namespace
+
+void* operator new(size_t size) {
+  void* const ptr = counted_malloc(size);
+  if (!ptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void* operator new[](size_t size) {
+  void* const ptr = counted_malloc(size);
+  if (!ptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+  return counted_malloc(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+  return counted_malloc(size);
+}
+
+void operator delete(void* ptr) noexcept {
+  free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+  free(ptr);
+}
+
+// C++14 sized deallocation calls these instead of the unsized forms.
+void operator delete(void* ptr, size_t) noexcept {
+  free(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept {
+  free(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+  free(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+  free(ptr);
+}
+
+typedef std::chrono::steady_clock Clock;
+
+// Results of one benchmark case.
+struct BenchResult {
+  BenchResult() : bytes(0), allocations(0), seconds(0) {}
+
+  std::string component;
+  std::string name;
+
+  // Bytes processed, allocations made, and time spent by all operations.
+  int64 bytes;
+  int64 allocations;
+  double seconds;
+
+  // Time of each operation, in nanoseconds.
+  std::vector<int64> op_ns;
+};
+
+// Times a single operation of |ptr_result|'s case.
+class OpTimer {
+ public:
+  explicit OpTimer(BenchResult* ptr_result)
+      : ptr_result_(ptr_result),
+        allocations_(g_allocations.load(std::memory_order_relaxed)),
+        start_(Clock::now()) {
+    if (g_check_allocations &&
+        ptr_result_->op_ns.size() >= kAllocationCheckWarmup) {
+      webmlive::AllocationTracker::Instance()->Arm();
+    }
+  }
+  ~OpTimer() {
+    const int64 ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        Clock::now() - start_).count();
+    webmlive::AllocationTracker::Instance()->Disarm();
+    ptr_result_->allocations +=
+        g_allocations.load(std::memory_order_relaxed) - allocations_;
+    ptr_result_->seconds += ns / 1e9;
+    ptr_result_->op_ns.push_back(ns);
+  }
+
+ private:
+  BenchResult* const ptr_result_;
+  const int64 allocations_;
+  const Clock::time_point start_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(OpTimer);
+};
+
+// Returns the |percentile| percent operation time of |sorted_ns|, in
+// microseconds.
+double percentile_us(const std::vector<int64>& sorted_ns, double percentile) {
+  if (sorted_ns.empty()) {
+    return 0;
+  }
+  const size_t index = std::min(
+      sorted_ns.size() - 1,
+      static_cast<size_t>(sorted_ns.size() * percentile / 100));
+  return sorted_ns[index] / 1000.0;
+}
+
+void print_header() {
+  printf("%-8s %-28s %10s %9s %10s %10s %10s %10s\n", "name", "case",
+         "ops/s", "MB/s", "allocs/op", "p50 us", "p99 us", "max us");
+}
+
+void print_result(BenchResult* ptr_result) {
+  std::vector<int64>& op_ns = ptr_result->op_ns;
+  if (op_ns.empty() || ptr_result->seconds <= 0) {
+    printf("%-8s %-28s failed\n", ptr_result->component.c_str(),
+           ptr_result->name.c_str());
+    return;
+  }
+  std::sort(op_ns.begin(), op_ns.end());
+  const double ops = static_cast<double>(op_ns.size());
+  printf("%-8s %-28s %10.1f %9.1f %10.2f %10.1f %10.1f %10.1f\n",
+         ptr_result->component.c_str(), ptr_result->name.c_str(),
+         ops / ptr_result->seconds,
+         ptr_result->bytes / ptr_result->seconds / (1024 * 1024),
+         ptr_result->allocations / ops, percentile_us(op_ns, 50),
+         percentile_us(op_ns, 99), op_ns.back() / 1000.0);
+  fflush(stdout);
+}
+
+const char* format_name(webmlive::VideoFormat format) {
+  switch (format) {
+    case webmlive::kVideoFormatI420:
+      return "i420";
+    case webmlive::kVideoFormatYV12:
+      return "yv12";
+    case webmlive::kVideoFormatNV12:
+      return "nv12";
+    case webmlive::kVideoFormatYUY2:
+      return "yuy2";
+    case webmlive::kVideoFormatYUYV:
+      return "yuyv";
+    case webmlive::kVideoFormatUYVY:
+      return "uyvy";
+    case webmlive::kVideoFormatRGB:
+      return "rgb24";
+    case webmlive::kVideoFormatRGBA:
+      return "rgb32";
+    case webmlive::kVideoFormatVP8:
+      return "vp8";
+    case webmlive::kVideoFormatVP9:
+      return "vp9";
+    case webmlive::kVideoFormatMJPG:
+      return "mjpg";
+    default:
+      return "unknown";
+  }
+}
+
+std::string case_name(const char* prefix, int width, int height) {
+  std::ostringstream name;
+  name << prefix << " " << width << "x" << height;
+  return name.str();
+}
+
+// Generates uncompressed frames of |format|: a gradient that moves from frame
+// to frame, with noise so that the encoder has detail to code.
+class FrameGenerator {
+ public:
+  FrameGenerator(webmlive::VideoFormat format, int width, int height)
+      : seed_(1) {
+    config_.format = format;
+    config_.width = width;
+    config_.height = height;
+    config_.frame_rate = 30;
+    int bits_per_pixel = webmlive::kI420BitCount;
+    switch (format) {
+      case webmlive::kVideoFormatYUY2:
+      case webmlive::kVideoFormatYUYV:
+      case webmlive::kVideoFormatUYVY:
+        bits_per_pixel = webmlive::kYUY2BitCount;
+        break;
+      case webmlive::kVideoFormatRGB:
+        bits_per_pixel = webmlive::kRGBBitCount;
+        break;
+      case webmlive::kVideoFormatRGBA:
+        bits_per_pixel = webmlive::kRGBABitCount;
+        break;
+      default:
+        break;
+    }
+    const bool planar = bits_per_pixel == webmlive::kI420BitCount;
+    config_.stride = planar ? width : width * bits_per_pixel / 8;
+    data_.resize(static_cast<size_t>(width) * height * bits_per_pixel / 8);
+  }
+
+  // Fills |data()| with frame |frame_num|.
+  void Generate(int64 frame_num) {
+    const int offset = static_cast<int>(frame_num * 3);
+    const int row_length = static_cast<int>(data_.size() / config_.height);
+    for (size_t i = 0; i < data_.size(); ++i) {
+      seed_ = seed_ * 1103515245 + 12345;
+      const int x = static_cast<int>(i % row_length);
+      const int y = static_cast<int>(i / row_length);
+      data_[i] = static_cast<uint8>(x + y + offset + ((seed_ >> 16) & 0xf));
+    }
+  }
+
+  const webmlive::VideoConfig& config() const { return config_; }
+  const uint8* data() const { return &data_[0]; }
+  int32 length() const { return static_cast<int32>(data_.size()); }
+
+ private:
+  webmlive::VideoConfig config_;
+  std::vector<uint8> data_;
+  uint32 seed_;
+};
+
+// Generates interleaved PCM or IEEE float audio: a 440 Hz tone on every
+// channel.
+class PcmGenerator {
+ public:
+  PcmGenerator(uint16 format_tag, int sample_rate, int channels)
+      : sample_num_(0) {
+    config_.format_tag = format_tag;
+    config_.channels = static_cast<uint16>(channels);
+    config_.sample_rate = sample_rate;
+    config_.bits_per_sample = format_tag == webmlive::kAudioFormatIeeeFloat ?
+        32 : 16;
+    config_.valid_bits_per_sample = config_.bits_per_sample;
+    config_.block_align =
+        static_cast<uint16>(channels * config_.bits_per_sample / 8);
+    config_.bytes_per_second = config_.block_align * sample_rate;
+  }
+
+  // Fills |data()| with the next |num_samples| samples per channel.
+  void Generate(int num_samples) {
+    data_.resize(static_cast<size_t>(num_samples) * config_.block_align);
+    const double kTwoPi = 6.283185307179586;
+    for (int i = 0; i < num_samples; ++i, ++sample_num_) {
+      const double value =
+          0.5 * sin(kTwoPi * 440 * sample_num_ / config_.sample_rate);
+      for (int channel = 0; channel < config_.channels; ++channel) {
+        const size_t index = i * config_.channels + channel;
+        if (config_.format_tag == webmlive::kAudioFormatIeeeFloat) {
+          const float sample = static_cast<float>(value);
+          memcpy(&data_[index * sizeof(sample)], &sample, sizeof(sample));
+        } else {
+          const int16 sample = static_cast<int16>(value * 32767);
+          memcpy(&data_[index * sizeof(sample)], &sample, sizeof(sample));
+        }
+      }
+    }
+  }
+
+  const webmlive::AudioConfig& config() const { return config_; }
+  const uint8* data() const { return &data_[0]; }
+  int32 length() const { return static_cast<int32>(data_.size()); }
+
+ private:
+  webmlive::AudioConfig config_;
+  std::vector<uint8> data_;
+  int64 sample_num_;
+};
+
+struct Resolution {
+  int width;
+  int height;
+};
+
+const Resolution kResolutions[] = {
+  {640, 360},
+  {1280, 720},
+  {1920, 1080},
+};
+const int kNumResolutions = sizeof(kResolutions) / sizeof(kResolutions[0]);
+
+// Times |VideoFrame::Init()|, which converts packed capture formats to I420
+// with libyuv, and copies planar formats.
+void bench_convert(int num_frames) {
+  const webmlive::VideoFormat kFormats[] = {
+    webmlive::kVideoFormatI420, webmlive::kVideoFormatNV12,
+    webmlive::kVideoFormatYUY2, webmlive::kVideoFormatUYVY,
+    webmlive::kVideoFormatRGB, webmlive::kVideoFormatRGBA,
+  };
+  for (int r = 0; r < kNumResolutions; ++r) {
+    for (size_t f = 0; f < sizeof(kFormats) / sizeof(kFormats[0]); ++f) {
+      FrameGenerator generator(kFormats[f], kResolutions[r].width,
+                               kResolutions[r].height);
+      BenchResult result;
+      result.component = "convert";
+      result.name = case_name(format_name(kFormats[f]),
+                              kResolutions[r].width, kResolutions[r].height);
+      webmlive::VideoFrame frame;
+      for (int i = 0; i < num_frames; ++i) {
+        generator.Generate(i);
+        int status;
+        {
+          OpTimer timer(&result);
+          status = frame.Init(generator.config(), true, i * 33, 33,
+                              generator.data(), generator.length());
+        }
+        if (status) {
+          LOG(ERROR) << "VideoFrame Init failed: " << status;
+          result.op_ns.clear();
+          break;
+        }
+        result.bytes += generator.length();
+      }
+      print_result(&result);
+    }
+  }
+}
+
+// Times |VpxEncoder::EncodeFrame()| at a bitrate that scales with the frame
+// area, 2000 kbps at 1280x720.
+void bench_vpx(int num_frames) {
+  const webmlive::VideoFormat kCodecs[] = {
+    webmlive::kVideoFormatVP8, webmlive::kVideoFormatVP9,
+  };
+  for (int r = 0; r < kNumResolutions; ++r) {
+    for (size_t c = 0; c < sizeof(kCodecs) / sizeof(kCodecs[0]); ++c) {
+      const int width = kResolutions[r].width;
+      const int height = kResolutions[r].height;
+      FrameGenerator generator(webmlive::kVideoFormatI420, width, height);
+      webmlive::WebmEncoderConfig config;
+      config.actual_video_config = generator.config();
+      config.vpx_config.codec = kCodecs[c];
+      config.vpx_config.bitrate =
+          static_cast<int>(2000LL * width * height / (1280 * 720));
+      BenchResult result;
+      result.component = "vpx";
+      result.name = case_name(format_name(kCodecs[c]), width, height);
+      webmlive::VpxEncoder encoder;
+      int status = encoder.Init(config);
+      if (status) {
+        LOG(ERROR) << "VpxEncoder Init failed: " << status;
+        print_result(&result);
+        continue;
+      }
+      webmlive::VideoFrame raw_frame;
+      webmlive::VideoFrame vpx_frame;
+      for (int i = 0; i < num_frames; ++i) {
+        generator.Generate(i);
+        status = raw_frame.Init(generator.config(), false, i * 33, 33,
+                                generator.data(), generator.length());
+        if (status == webmlive::VideoFrame::kSuccess) {
+          OpTimer timer(&result);
+          status = encoder.EncodeFrame(raw_frame, &vpx_frame);
+        }
+        if (status && status != webmlive::VpxEncoder::kDropped) {
+          LOG(ERROR) << "VPx encode failed: " << status;
+          result.op_ns.clear();
+          break;
+        }
+        result.bytes += generator.length();
+      }
+      print_result(&result);
+    }
+  }
+}
+
+// Times |VorbisEncoder::Encode()| of 1024 sample buffers, and the reads of
+// the compressed audio it produces.
+void bench_vorbis(int num_buffers) {
+  const int kSamplesPerBuffer = 1024;
+  const uint16 kFormats[] = {
+    webmlive::kAudioFormatPcm, webmlive::kAudioFormatIeeeFloat,
+  };
+  const int kSampleRates[] = {44100, 48000};
+  for (size_t f = 0; f < sizeof(kFormats) / sizeof(kFormats[0]); ++f) {
+    for (size_t s = 0; s < sizeof(kSampleRates) / sizeof(kSampleRates[0]);
+         ++s) {
+      PcmGenerator generator(kFormats[f], kSampleRates[s], 2);
+      BenchResult result;
+      result.component = "vorbis";
+      std::ostringstream name;
+      name << (kFormats[f] == webmlive::kAudioFormatPcm ? "s16" : "f32")
+           << " " << kSampleRates[s] << " Hz stereo";
+      result.name = name.str();
+      webmlive::VorbisEncoder encoder;
+      int status = encoder.Init(generator.config(), webmlive::VorbisConfig());
+      if (status) {
+        LOG(ERROR) << "VorbisEncoder Init failed: " << status;
+        print_result(&result);
+        continue;
+      }
+      webmlive::AudioBuffer raw_buffer;
+      webmlive::AudioBuffer vorbis_buffer;
+      const int64 duration = kSamplesPerBuffer * 1000LL / kSampleRates[s];
+      for (int i = 0; i < num_buffers; ++i) {
+        generator.Generate(kSamplesPerBuffer);
+        status = raw_buffer.Init(generator.config(), i * duration, duration,
+                                 generator.data(), generator.length());
+        if (status == webmlive::AudioBuffer::kSuccess) {
+          OpTimer timer(&result);
+          status = encoder.Encode(raw_buffer);
+          while (status == webmlive::VorbisEncoder::kSuccess) {
+            status = encoder.ReadCompressedAudio(&vorbis_buffer);
+          }
+        }
+        if (status != webmlive::VorbisEncoder::kNoSamples) {
+          LOG(ERROR) << "Vorbis encode failed: " << status;
+          result.op_ns.clear();
+          break;
+        }
+        result.bytes += generator.length();
+      }
+      print_result(&result);
+    }
+  }
+}
+
+// Times |LiveWebmMuxer::WriteVideoFrame()| of synthetic VP8 frames at the
+// |bench_vpx()| bitrates, with a keyframe every two seconds, and the reads of
+// the chunks it produces.
+void bench_mux(int num_frames) {
+  for (int r = 0; r < kNumResolutions; ++r) {
+    const int width = kResolutions[r].width;
+    const int height = kResolutions[r].height;
+    webmlive::VideoConfig video_config;
+    video_config.format = webmlive::kVideoFormatVP8;
+    video_config.width = width;
+    video_config.height = height;
+    video_config.frame_rate = 30;
+    const int64 kbps = 2000LL * width * height / (1280 * 720);
+    std::vector<uint8> payload(static_cast<size_t>(kbps * 1000 / 8 / 30));
+    std::vector<uint8> keyframe_payload(payload.size() * 8);
+    for (size_t i = 0; i < keyframe_payload.size(); ++i) {
+      keyframe_payload[i] = static_cast<uint8>(i * 7 + 3);
+    }
+    memcpy(&payload[0], &keyframe_payload[0], payload.size());
+
+    BenchResult result;
+    result.component = "mux";
+    result.name = case_name("vp8", width, height);
+    webmlive::LiveWebmMuxer muxer;
+    int status = muxer.Init(0, "bench");
+    if (status == webmlive::LiveWebmMuxer::kSuccess) {
+      status = muxer.AddTrack(video_config);
+    }
+    if (status) {
+      LOG(ERROR) << "LiveWebmMuxer setup failed: " << status;
+      print_result(&result);
+      continue;
+    }
+    webmlive::VideoFrame frame;
+    int64 chunk_num = 0;
+    for (int i = 0; i < num_frames; ++i) {
+      const bool keyframe = (i % 60) == 0;
+      const std::vector<uint8>& data = keyframe ? keyframe_payload : payload;
+      status = frame.Init(video_config, keyframe, i * 33, 33, &data[0],
+                          static_cast<int32>(data.size()));
+      if (status == webmlive::VideoFrame::kSuccess) {
+        OpTimer timer(&result);
+        status = muxer.WriteVideoFrame(frame);
+        int32 chunk_length = 0;
+        while (status == webmlive::LiveWebmMuxer::kSuccess &&
+               muxer.ChunkReady(&chunk_length)) {
+          std::ostringstream id;
+          id << "chunk" << chunk_num++;
+          webmlive::SharedWebmChunk chunk;
+          status = muxer.ReadChunk(id.str(), &chunk);
+        }
+      }
+      if (status) {
+        LOG(ERROR) << "mux failed: " << status;
+        result.op_ns.clear();
+        break;
+      }
+      result.bytes += data.size();
+    }
+    print_result(&result);
+  }
+}
+
+// Times a |Commit()| and |Decommit()| round trip of a 1280x720 I420 frame
+// through an empty |Pool|.
+template <class Pool>
+void bench_pool(const char* name, int num_frames) {
+  FrameGenerator generator(webmlive::kVideoFormatI420, 1280, 720);
+  generator.Generate(0);
+  BenchResult result;
+  result.component = "pool";
+  result.name = name;
+  Pool pool;
+  int status = pool.Init(false, Pool::kDefaultBufferCount);
+  webmlive::VideoFrame frame;
+  if (status == Pool::kSuccess) {
+    status = frame.Init(generator.config(), true, 0, 33, generator.data(),
+                        generator.length());
+  }
+  if (status) {
+    LOG(ERROR) << "pool setup failed: " << status;
+    print_result(&result);
+    return;
+  }
+  for (int i = 0; i < num_frames; ++i) {
+    OpTimer timer(&result);
+    status = pool.Commit(&frame);
+    if (status == Pool::kSuccess) {
+      status = pool.Decommit(&frame);
+    }
+    if (status) {
+      LOG(ERROR) << "pool round trip failed: " << status;
+      result.op_ns.clear();
+      break;
+    }
+  }
+  print_result(&result);
+}
+
+void usage(const char** argv) {
+  printf("Usage: %s [--component <name>] [--frames <count>]\n", argv[0]);
+  printf("              [--check_allocations]\n");
+  printf("  --component <name>  Run only convert, vpx, vorbis, mux or pool.\n");
+  printf("  --frames <count>    Operations per case. By default convert\n");
+  printf("                      runs 200, vpx 100, vorbis 1000, mux 3000,\n");
+  printf("                      and pool 100000.\n");
+  printf("  --check_allocations Report allocations made after the first\n");
+  printf("                      %d operations of each case, and fail\n",
+         static_cast<int>(kAllocationCheckWarmup));
+  printf("                      when there are any.\n");
+}
+
+int main(int argc, const char** argv) {
+  google::InitGoogleLogging(argv[0]);
+  std::string component;
+  int frames = 0;
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp("--component", argv[i]) && i + 1 < argc) {
+      component = argv[++i];
+    } else if (!strcmp("--frames", argv[i]) && i + 1 < argc) {
+      frames = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--check_allocations", argv[i])) {
+      g_check_allocations = true;
+    } else {
+      usage(argv);
+      google::ShutdownGoogleLogging();
+      return (!strcmp("-h", argv[i]) || !strcmp("--help", argv[i])) ?
+          EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  if (g_check_allocations) {
+    webmlive::AllocationTracker::TrackCurrentThread("bench");
+  }
+  print_header();
+  if (component.empty() || component == "convert") {
+    bench_convert(frames > 0 ? frames : 200);
+  }
+  if (component.empty() || component == "vpx") {
+    bench_vpx(frames > 0 ? frames : 100);
+  }
+  if (component.empty() || component == "vorbis") {
+    bench_vorbis(frames > 0 ? frames : 1000);
+  }
+  if (component.empty() || component == "mux") {
+    bench_mux(frames > 0 ? frames : 3000);
+  }
+  if (component.empty() || component == "pool") {
+    const int pool_frames = frames > 0 ? frames : 100000;
+    bench_pool<webmlive::BufferPool<webmlive::VideoFrame> >("mutex",
+                                                            pool_frames);
+    bench_pool<webmlive::SpscBufferPool<webmlive::VideoFrame> >("spsc",
+                                                                pool_frames);
+  }
+  int exit_code = EXIT_SUCCESS;
+  if (g_check_allocations &&
+      webmlive::AllocationTracker::Instance()->LogReport() > 0) {
+    printf("allocation check failed: %d allocations after warmup.\n",
+           static_cast<int>(
+               webmlive::AllocationTracker::Instance()->allocations()));
+    exit_code = EXIT_FAILURE;
+  }
+  google::ShutdownGoogleLogging();
+  return exit_code;
+}
@@ -7,16 +7,49 @@
 // be found in the AUTHORS file in the root of the source tree.
 #include "encoder/encoder_base.h"
 
-#include <conio.h>
 #include <stdio.h>
+#ifdef _WIN32
+#include <conio.h>
 #include <tchar.h>
+#else
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <fstream>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include "encoder/allocation_tracker.h"
+#include "encoder/bitrate_controller.h"
 #include "encoder/buffer_util.h"
+#include "encoder/control_server.h"
+#include "encoder/cpu_governor.h"
+#include "encoder/data_sink_fanout.h"
+#include "encoder/etw_trace.h"
+#include "encoder/fault_injection_sink.h"
 #include "encoder/http_uploader.h"
+#include "encoder/latency_tracer.h"
+#include "encoder/log_util.h"
+#include "encoder/memory_accounting.h"
+#include "encoder/metrics_server.h"
+#include "encoder/numa_topology.h"
+#include "encoder/push_sink.h"
+#include "encoder/segment_ring_writer.h"
+#include "encoder/task_scheduler.h"
+#include "encoder/thread_util.h"
+#include "encoder/upload_pacer.h"
+#include "encoder/vpx_context_pool.h"
 #include "encoder/webm_encoder.h"
 #include "glog/logging.h"
 
@@ -33,16 +66,171 @@ const std::string kMetadataQueryFragment = "&metadata=1";
 const std::string kWebmItagQueryFragment = "&itag=43";
 const std::string kCodecVp8 = "vp8";
 const std::string kCodecVp9 = "vp9";
+const std::string kEncoderSoftware = "software";
+const std::string kEncoderHardware = "hardware";
+const std::string kEncoderAuto = "auto";
 typedef std::vector<std::string> StringVector;
+typedef std::map<std::string, webmlive::ThreadSettings> ThreadSettingsMap;
+
+// Time between metrics page updates, in milliseconds.
+const int64 kMetricsUpdateInterval = 1000;
+
+// Capture buffer and cluster durations, in milliseconds, of
+// --audio_low_latency.
+const int kLowLatencyAudioPeriod = 10;
+const int kLowLatencyAudioSegment = 100;
+
+// Set by |install_stop_handler()|'s handler in headless mode.
+std::atomic<bool> stop_requested(false);
+
+// Control of a channel of |service_main()|, shared by the channel's
+// |encoder_main()| loop and the control server thread.
+struct ChannelControl {
+  ChannelControl()
+      : stop(false), keyframe(false), reconfigure(false),
+        encoded_duration(0) {}
+
+  // Set to stop the channel.
+  std::atomic<bool> stop;
+
+  // Set to have the loop request a keyframe.
+  std::atomic<bool> keyframe;
+
+  // Changes the loop passes to |WebmEncoder::Reconfigure()|, pending while
+  // |reconfigure| is set. Protected by |mutex|.
+  std::mutex mutex;
+  bool reconfigure;
+  webmlive::EncoderReconfiguration reconfig;
+
+  // Clip the loop passes to |WebmEncoder::SpliceClip()|, pending while not
+  // empty. Protected by |mutex|.
+  std::string splice_clip;
+
+  // Encoded duration, in milliseconds, published by the loop.
+  std::atomic<int64> encoded_duration;
+};
 
 struct WebmEncoderConfig {
+  WebmEncoderConfig()
+      : adaptive_bitrate(false),
+        low_latency_audio(false),
+        upload_pacing(0),
+        upload_limit(0),
+        inject_faults(false),
+        headless(false),
+        host_workers(0),
+        channel_priority(webmlive::TaskScheduler::kDefaultPriority),
+        ptr_cpu_governor(NULL),
+        governor_channel(-1),
+        ptr_control(NULL),
+        vpx_context_pool(4),
+        allocation_check_warmup(-1) {}
+
   // Uploader settings.
   webmlive::HttpUploaderSettings uploader_settings;
 
   // WebM encoder settings.
   webmlive::WebmEncoderConfig enc_config;
+
+  // Adjust the encoder bitrates to the upload throughput. Bitrates left at 0
+  // in |bitrate_settings| are derived from |enc_config|.
+  bool adaptive_bitrate;
+  webmlive::BitrateControllerSettings bitrate_settings;
+
+  // Encode audio only, tuned for capture to origin latency. See
+  // |apply_low_latency_audio()|.
+  bool low_latency_audio;
+
+  // Upload pacing rate, as a percentage of the nominal audio and video
+  // bitrate, and the limit of all uploads of the process, in kilobits per
+  // second. 0 disables either.
+  int upload_pacing;
+  int upload_limit;
+
+  // Additional upload targets. Each receives the chunks sent to
+  // |uploader_settings.target_url| through a |DataSinkFanout|.
+  StringVector backup_urls;
+
+  // Shared memory ring that also receives the chunks sent to
+  // |uploader_settings.target_url|, through the |DataSinkFanout|. Disabled
+  // when |shm_sink.shm_name| is empty.
+  webmlive::SegmentRingSettings shm_sink;
+
+  // Push sink settings. A non-empty |push_settings.host| replaces the HTTP
+  // uploader with a |PushSink|.
+  webmlive::PushSinkSettings push_settings;
+
+  // Faults injected between the encoder and its data sink when
+  // |inject_faults| is true, for benchmarking. See
+  // |webmlive::FaultInjectionSink|.
+  bool inject_faults;
+  webmlive::FaultInjectionSettings fault_injection;
+
+  // Run without console input and output: the encoder stops on a console
+  // control event, such as Ctrl+C or a service manager shutdown, instead of
+  // a key press.
+  bool headless;
+
+  // File of the channels to run in this process, one command line per line,
+  // with the number of workers of the shared |webmlive::TaskScheduler|; 0
+  // runs one per hardware thread. Empty runs the one channel of the command
+  // line. See |host_main()|. A single DASH channel also drains its muxers
+  // on the scheduler.
+  std::string host_file;
+  int host_workers;
+
+  // Share of a host's scheduler time and encode cores given to the channel.
+  int channel_priority;
+
+  // Encode time budget of a host's channels. See |webmlive::CpuGovernor|.
+  webmlive::CpuGovernorSettings cpu_governor;
+
+  // Governor of the host running the channel, and the channel's index in
+  // it, or NULL and -1 when the channel's speed is not governed. Set by
+  // |host_main()|.
+  webmlive::CpuGovernor* ptr_cpu_governor;
+  int governor_channel;
+
+  // Control server settings. A non-zero |control_settings.port| runs the
+  // process as a service whose channels are created, stopped and
+  // reconfigured through a local HTTP API. See |service_main()|.
+  webmlive::ControlServerSettings control_settings;
+
+  // Control of the channel when |service_main()| runs it, or NULL. Set by
+  // |service_main()|.
+  ChannelControl* ptr_control;
+
+  // Idle libvpx contexts |service_main()| keeps for channels it starts
+  // again with the same codec and frame size; 0 disables the pool.
+  int vpx_context_pool;
+
+  // Metrics server settings. A non-zero |metrics_settings.port| serves the
+  // encoder and sink counters over HTTP.
+  webmlive::MetricsServerSettings metrics_settings;
+
+  // Priority, affinity and MMCSS task of the encoder's threads, by thread
+  // name. See |webmlive::ThreadRegistry|.
+  ThreadSettingsMap thread_settings;
+
+  // Seconds after which allocations on the pipeline threads are recorded
+  // until the encoder stops, or -1 to record none. See
+  // |webmlive::AllocationTracker|.
+  int allocation_check_warmup;
+};
+
+// Counters at the last metrics page update, from which the rates on the next
+// page are computed.
+struct MetricsState {
+  MetricsState() : time_ms(0), bytes_uploaded(0) {
+    memset(&encode_stats, 0, sizeof(encode_stats));
+  }
+  int64 time_ms;
+  int64 bytes_uploaded;
+  webmlive::EncodeStats encode_stats;
 };
 
+typedef std::vector<std::unique_ptr<webmlive::HttpUploader>> UploaderList;
+
 }  // anonymous namespace
 
 // Prints usage.
@@ -50,11 +238,9 @@ void usage(const char** argv) {
   printf("%s v%s\n", webmlive::kEncoderName, webmlive::kEncoderVersion);
   printf("Usage: %s <args>\n", argv[0]);
   printf("  Notes:\n");
-  printf("    - DASH output is currently hard coded on and cannot be\n");
-  printf("      disabled.\n");
-  printf("    - Uploading is currently DISABLED! The --url parameter will\n");
-  printf("      be ignored. DASH file output to the is the only currently\n");
-  printf("      supported output method. The following note still applies.\n");
+  printf("    - DASH output is on unless --mux is used without --dash.\n");
+  printf("    - DASH output is written to files only. The --url parameter\n");
+  printf("      applies to the muxed stream enabled by --mux.\n");
   printf("    - If an URL is provided without a query string present in the\n");
   printf("      URL, the stream_id and stream_name args are required.\n");
   printf("  General options:\n");
@@ -67,6 +253,128 @@ void usage(const char** argv) {
   printf("    --vdevidx <source index>       Select video capture device by\n");
   printf("                                   index. Ignored when --vdev is\n");
   printf("                                   used.\n");
+  printf("    --vcamera <name|index>[:<kbps>]\n");
+  printf("                                   Also captures the camera, in\n");
+  printf("                                   the DASH AdaptationSet of its\n");
+  printf("                                   own, at its capture size and\n");
+  printf("                                   <kbps> or --vpx_bitrate. May\n");
+  printf("                                   be repeated.\n");
+  printf("    --vprofiles <file>             Keep the capture formats of\n");
+  printf("                                   video devices in this file,\n");
+  printf("                                   and reconnect them without\n");
+  printf("                                   probing on the next start.\n");
+  printf("    --vfile <file>                 Read video from a Y4M or raw\n");
+  printf("                                   I420 file instead of a device.\n");
+  printf("                                   Raw I420 requires --vwidth and\n");
+  printf("                                   --vheight. Use - for stdin.\n");
+  printf("    --afile <file>                 Read audio from a WAV file\n");
+  printf("                                   instead of a device. Use - for\n");
+  printf("                                   stdin. With --vfile or --afile\n");
+  printf("                                   only, the other stream is\n");
+  printf("                                   disabled.\n");
+  printf("    --capture_dump <file>          Record the captured samples,\n");
+  printf("                                   before conversion, to a\n");
+  printf("                                   capture dump.\n");
+  printf("    --archive_file <file>          Also record the stream to a\n");
+  printf("                                   seekable WebM file with Cues.\n");
+  printf("    --replay <file>                Replay a capture dump instead\n");
+  printf("                                   of capturing, at its recorded\n");
+  printf("                                   pace.\n");
+  printf("    --regulate_timestamps          Smooth capture timestamp\n");
+  printf("                                   jitter before encoding.\n");
+  printf("    --thumbnail_interval <ms>      Also send a WebP thumbnail\n");
+  printf("                                   of the video to the upload\n");
+  printf("                                   target, as %s, at this\n",
+         webmlive::Thumbnailer::kThumbnailId);
+  printf("                                   interval.\n");
+  printf("    --thumbnail_width <pixels>     Thumbnail width; the height\n");
+  printf("                                   keeps the aspect ratio.\n");
+  printf("                                   Default is %d.\n",
+         webmlive::ThumbnailSettings::kDefaultWidth);
+  printf("    --thumbnail_quality <0-100>    Thumbnail quality. Default\n");
+  printf("                                   is %d.\n",
+         webmlive::ThumbnailSettings::kDefaultQuality);
+  printf("    --quality_interval <keyframes> Decode every Nth keyframe\n");
+  printf("                                   and report its PSNR and\n");
+  printf("                                   SSIM.\n");
+  printf("    --quality_max_cpu <percent>    CPU cap of the quality\n");
+  printf("                                   monitor, in percent of one\n");
+  printf("                                   core. Default is %d.\n",
+         webmlive::QualitySettings::kDefaultMaxCpu);
+  printf("    --text_track <subtitles|captions>\n");
+  printf("                                   Mux a live WebVTT text track\n");
+  printf("                                   of this kind.\n");
+  printf("    --text_input <file>            WebVTT file or named pipe\n");
+  printf("                                   read for cues. Each cue is\n");
+  printf("                                   shown when it arrives.\n");
+  printf("    --text_stream_timing           Use the --text_input cue\n");
+  printf("                                   timings as stream times.\n");
+  printf("    --text_language <code>         ISO 639-2 text track language.\n");
+  printf("    --text_name <name>             Text track name.\n");
+  printf("    --encrypt_key_id <hex>         Encrypt audio and video with\n");
+  printf("                                   WebM AES-CTR encryption,\n");
+  printf("                                   under this key id.\n");
+  printf("    --encrypt_key <hex>            AES-128 content key, 32 hex\n");
+  printf("                                   digits. Required with\n");
+  printf("                                   --encrypt_key_id.\n");
+  printf("    --capture_watchdog             Restart stalled or failed\n");
+  printf("                                   capture devices in place,\n");
+  printf("                                   repeating frames meanwhile.\n");
+  printf("    --capture_slate                Enable the capture watchdog,\n");
+  printf("                                   and mux a pre-encoded black\n");
+  printf("                                   and silent slate while the\n");
+  printf("                                   devices are lost.\n");
+  printf("    --stall_timeout <ms>           Time without capture input\n");
+  printf("                                   after which the watchdog\n");
+  printf("                                   restarts the devices.\n");
+  printf("    --max_restarts <count>         Failed restarts in a row\n");
+  printf("                                   after which the encode ends.\n");
+  printf("    --headless                     Do not read the keyboard or\n");
+  printf("                                   print progress. Stops on\n");
+  printf("                                   Ctrl+C, or when the console\n");
+  printf("                                   or session closes.\n");
+  printf("    --alloc_check <seconds>        Log allocations made on the\n");
+  printf("                                   capture, encode, mux and\n");
+  printf("                                   upload threads after the\n");
+  printf("                                   warmup, with call stacks,\n");
+  printf("                                   and exit with failure when\n");
+  printf("                                   there are any.\n");
+  printf("    --metrics_port <port>          Serve encoder, queue and\n");
+  printf("                                   upload counters over HTTP\n");
+  printf("                                   at /metrics, in Prometheus\n");
+  printf("                                   text format.\n");
+  printf("    --thread_priority <name:level> Set the priority of the named\n");
+  printf("                                   threads: idle, lowest,\n");
+  printf("                                   below_normal, normal,\n");
+  printf("                                   above_normal, highest or\n");
+  printf("                                   time_critical.\n");
+  printf("    --thread_affinity <name:mask>  Run the named threads on the\n");
+  printf("                                   processors in mask, for\n");
+  printf("                                   example 0x3.\n");
+  printf("    --thread_mmcss <name:task>     Run the named threads in the\n");
+  printf("                                   MMCSS task, for example\n");
+  printf("                                   Capture or Pro Audio.\n");
+  printf("    --capture_mmcss                Run the capture threads in\n");
+  printf("                                   the Capture and Pro Audio\n");
+  printf("                                   MMCSS tasks.\n");
+  printf("                                   Thread names: encoder,\n");
+  printf("                                   audio_encoder, video_encoder,\n");
+  printf("                                   scaler, rendition<N>,\n");
+  printf("                                   converter, video_capture,\n");
+  printf("                                   audio_capture,\n");
+  printf("                                   desktop_capture, file_reader,\n");
+  printf("                                   replay, capture_dump,\n");
+  printf("                                   uploader, push_sink, fanout,\n");
+  printf("                                   file_writer, dash_listener,\n");
+  printf("                                   dash_connection, metrics and\n");
+  printf("                                   main. A name without its\n");
+  printf("                                   index applies to all indexes.\n");
+  printf("    --free_run                     Read input files or the\n");
+  printf("                                   capture dump as fast as\n");
+  printf("                                   the encoder accepts samples\n");
+  printf("                                   instead of in real time. Do\n");
+  printf("                                   not combine with\n");
+  printf("                                   --vdrop_stale.\n");
   printf("  DASH encoding options:\n");
   printf("    When the --dash argument is present an MPD file is produced\n");
   printf("    that allows the WebM output to be consumed by DASH WebM\n");
@@ -76,6 +384,10 @@ void usage(const char** argv) {
   printf("    Default DASH name is webmlive. Default DASH dir is the\n");
   printf("    current working directory.\n");
   printf("    --dash                         Enables DASH output.\n");
+  printf("    --mux                          Mux audio and video into one\n");
+  printf("                                   WebM stream sent to the --url\n");
+  printf("                                   target. With --dash, both\n");
+  printf("                                   outputs share the encoders.\n");
   printf("    --dash_dir <dir>               Output directory. Directory\n");
   printf("                                   must exist.\n");
   printf("    --dash_name <name>             MPD file name and DASH chunk\n");
@@ -83,26 +395,379 @@ void usage(const char** argv) {
   printf("    --dash_start_number <string>   Use string specified instead \n");
   printf("                                   of the value 1 for the\n");
   printf("                                   SegmentTemplate startNumber.\n");
+  printf("    --dash_dynamic                 Write a live (dynamic) MPD\n");
+  printf("                                   that lists segments as they\n");
+  printf("                                   are written.\n");
+  printf("    --dash_update_period <ms>      Dynamic MPD rewrite period.\n");
+  printf("                                   Default is the segment\n");
+  printf("                                   duration.\n");
+  printf("    --dash_window <ms>             Delete segments older than\n");
+  printf("                                   this, and drop them from a\n");
+  printf("                                   dynamic MPD. Default keeps\n");
+  printf("                                   all segments.\n");
+  printf("    --dash_single_file             Append the segments of each\n");
+  printf("                                   representation to one file,\n");
+  printf("                                   listed by byte range in a\n");
+  printf("                                   dynamic MPD.\n");
+  printf("    --dash_segment_index           Append a binary index record\n");
+  printf("                                   per segment to a .idx file\n");
+  printf("                                   per representation.\n");
+  printf("    --dash_bandwidth_window <ms>   Advertise the peak segment\n");
+  printf("                                   bitrate of this window in a\n");
+  printf("                                   dynamic MPD, not configured\n");
+  printf("                                   bitrates.\n");
+  printf("    --dash_serve <port>            Serve the MPD and recent\n");
+  printf("                                   segments over HTTP from\n");
+  printf("                                   memory.\n");
+  printf("    --dash_serve_segments <count>  Segments kept in memory for\n");
+  printf("                                   each representation.\n");
+  printf("                                   Default is 10.\n");
+  printf("    --dash_serve_window <ms>       Time-shift window held in\n");
+  printf("                                   memory for each\n");
+  printf("                                   representation, instead of\n");
+  printf("                                   --dash_serve_segments.\n");
+  printf("                                   Default follows --dash_window.\n");
+  printf("    --dash_serve_wait <ms>         Time a request for a segment\n");
+  printf("                                   not yet written waits for it.\n");
+  printf("                                   Default is 10000.\n");
+  printf("    --dash_no_files                Do not write DASH files; use\n");
+  printf("                                   with --dash_serve or\n");
+  printf("                                   --segment_ring.\n");
+  printf("    --segment_ring <path>          Also write DASH segments to a\n");
+  printf("                                   memory-mapped ring file for\n");
+  printf("                                   readers on this host.\n");
+  printf("    --segment_ring_size <MB>       Ring data size. Default is\n");
+  printf("                                   64.\n");
+  printf("    --segment_ring_slots <count>   Most segments held in the\n");
+  printf("                                   ring. Default is 256.\n");
+  printf("    --segment_ring_shm <name>      Use the shared memory object\n");
+  printf("                                   <name> for the ring instead\n");
+  printf("                                   of a file.\n");
+  printf("    --ring_overrun <evict|skip>    What a write that would evict\n");
+  printf("                                   segments a ring reader has\n");
+  printf("                                   not consumed does, for\n");
+  printf("                                   --segment_ring and --shm_sink.\n");
+  printf("                                   Default is evict.\n");
+  printf("    --dash_sink_manifest           Also send the MPD to the\n");
+  printf("                                   upload target, or --push\n");
+  printf("                                   address, when it changes.\n");
+  printf("    --file_sync <none|manifests|all>\n");
+  printf("                                   Output files flushed to disk\n");
+  printf("                                   before they are published.\n");
+  printf("                                   Default is none.\n");
+  printf("    --segment_duration <ms>        Start a segment at each\n");
+  printf("                                   multiple of this duration,\n");
+  printf("                                   independently of keyframes.\n");
+  printf("                                   Default is the keyframe\n");
+  printf("                                   interval.\n");
+  printf("    --adaptive_segments <min>,<max>\n");
+  printf("                                   Lengthen segments when muxed\n");
+  printf("                                   chunk uploads take most of\n");
+  printf("                                   their duration, and shorten\n");
+  printf("                                   them when uploads are quick,\n");
+  printf("                                   between these durations in\n");
+  printf("                                   ms. Requires --async_sink.\n");
+  printf("    --adaptive_segment_load <low>,<high>\n");
+  printf("                                   Upload times, in percent of\n");
+  printf("                                   the segment duration, that\n");
+  printf("                                   shorten and lengthen\n");
+  printf("                                   segments. Default is %d,%d.\n",
+         webmlive::SegmentDurationSettings::kDefaultLowLoad,
+         webmlive::SegmentDurationSettings::kDefaultHighLoad);
+  printf("    --max_cluster_bytes <bytes>    Split muxed stream clusters\n");
+  printf("                                   at this size. Default is no\n");
+  printf("                                   limit.\n");
+  printf("    --align_segments               Start DASH audio segments at\n");
+  printf("                                   the audio packets nearest\n");
+  printf("                                   the video segment starts.\n");
+  printf("    --pipeline                     Encode audio, encode video,\n");
+  printf("                                   and mux on separate threads.\n");
+  printf("    --interleave_latency <ms>      Longest time, in stream time,\n");
+  printf("                                   that audio or video waits for\n");
+  printf("                                   the other stream before it is\n");
+  printf("                                   muxed. Default is %d.\n",
+         static_cast<int>(webmlive::AVInterleaver::kDefaultMaxLatency));
+  printf("    --interleave_timeout <ms>      Wall clock time after which a\n");
+  printf("                                   stalled stream no longer holds\n");
+  printf("                                   up the other. Default is %d.\n",
+         static_cast<int>(webmlive::AVInterleaver::kDefaultStreamTimeout));
   printf("  HTTP uploader options:\n");
   printf("    Sends WebM chunks to an HTTP server via HTTP POST. Enabled\n");
   printf("    when the --url argument is present.\n");
   printf("    --url <target URL>             Target for HTTP POSTs.\n");
+  printf("    --backup_url <target URL>      Additional target, sent the\n");
+  printf("                                   same chunks with its own\n");
+  printf("                                   queue and retries. May be\n");
+  printf("                                   repeated. Disables\n");
+  printf("                                   --stream_chunks.\n");
+  printf("    --shm_sink <name>              Also publish the chunks to the\n");
+  printf("                                   shared memory ring <name>, for\n");
+  printf("                                   readers on this host. Disables\n");
+  printf("                                   --stream_chunks.\n");
+  printf("    --shm_sink_size <MB>           Ring data size. Default is\n");
+  printf("                                   64.\n");
+  printf("    --failover_url <target URL>    Backup ingest target, which\n");
+  printf("                                   uploads switch to when the\n");
+  printf("                                   target fails or slows down,\n");
+  printf("                                   and back from once it\n");
+  printf("                                   recovers. May be repeated.\n");
+  printf("    --failover_errors <count>      Failed uploads in a row that\n");
+  printf("                                   switch targets. Default is\n");
+  printf("                                   %d.\n",
+         webmlive::HttpUploaderSettings::kDefaultFailoverErrors);
+  printf("    --failover_latency_ms <ms>     Upload time above which an\n");
+  printf("                                   upload counts against the\n");
+  printf("                                   target. Default is %d.\n",
+         webmlive::HttpUploaderSettings::kDefaultFailoverLatencyMs);
   printf("    --header <name:value>          Adds HTTP header and value.\n");
   printf("                                   Sent with all POSTs.\n");
   printf("    --form_post                    Send WebM chunks as file data\n");
   printf("                                   in a form (a la RFC 1867).\n");
+  printf("    --put_objects                  PUT each chunk to object\n");
+  printf("                                   storage as <url><chunk ID>,\n");
+  printf("                                   --max_uploads at once. Use\n");
+  printf("                                   --header for credentials.\n");
+  printf("    --multipart_part_bytes <bytes> With --put_objects, objects\n");
+  printf("                                   larger than this are sent\n");
+  printf("                                   in parallel parts of this\n");
+  printf("                                   size. 0 disables. Default is\n");
+  printf("                                   %d.\n",
+         webmlive::HttpUploaderSettings::kDefaultMultipartPartBytes);
   printf("    --var <name:value>             Adds form variable and value.\n");
   printf("                                   Sent with all POSTs.\n");
   printf("    --stream_id <stream ID>        Stream ID to include in POST\n");
   printf("                                   query string.\n");
+  printf("    --max_uploads <count>          Maximum number of concurrent\n");
+  printf("                                   POSTs. Default is %d.\n",
+         webmlive::HttpUploaderSettings::kDefaultMaxUploads);
+  printf("    --max_queue_kb <kilobytes>     Data waiting for upload beyond\n");
+  printf("                                   which the uploader refuses\n");
+  printf("                                   more. 0, the default, limits\n");
+  printf("                                   by count only.\n");
+  printf("    --http2                        Multiplex concurrent POSTs\n");
+  printf("                                   over one HTTP/2 connection.\n");
+  printf("    --warm_connections <count>     Connections opened before the\n");
+  printf("                                   first POST; those not in use\n");
+  printf("                                   are kept as standby. 0\n");
+  printf("                                   disables. Default is %d.\n",
+         webmlive::HttpUploaderSettings::kDefaultWarmConnections);
+  printf("    --max_retries <count>          Retries of a failed POST; a\n");
+  printf("                                   POST cut off by a connection\n");
+  printf("                                   error resumes where it\n");
+  printf("                                   stopped. Default is %d.\n",
+         webmlive::HttpUploaderSettings::kDefaultMaxRetries);
+  printf("    --upload_priority              Upload headers and manifests\n");
+  printf("                                   first, then audio, then video\n");
+  printf("                                   by representation; lower\n");
+  printf("                                   renditions first when uploads\n");
+  printf("                                   back up.\n");
+  printf("    --upload_coalesce <bytes>      With --form_post, send\n");
+  printf("                                   consecutive small chunks of up\n");
+  printf("                                   to this many bytes in total\n");
+  printf("                                   in one POST. 0 disables.\n");
+  printf("    --upload_coalesce_ms <ms>      Time a small chunk waits for\n");
+  printf("                                   others to share its POST.\n");
+  printf("                                   Default is %d.\n",
+         webmlive::HttpUploaderSettings::kDefaultCoalesceDelayMs);
+  printf("    --upload_pacing <percent>      Pace uploads to this share of\n");
+  printf("                                   the nominal bitrate, so that\n");
+  printf("                                   keyframe chunks do not burst.\n");
+  printf("                                   At least 100. 0 disables.\n");
+  printf("    --upload_burst_ms <ms>         Burst sent at full speed\n");
+  printf("                                   before pacing applies, as time\n");
+  printf("                                   at the pacing rate. Default\n");
+  printf("                                   is %d.\n",
+         webmlive::UploadPacer::kDefaultBurstMs);
+  printf("    --upload_limit <kbps>          Upload rate limit shared by\n");
+  printf("                                   the uploader and its backups.\n");
+  printf("                                   0 disables.\n");
+  printf("    --adaptive_bitrate             Lower the video bitrate when\n");
+  printf("                                   uploads back up, and raise it\n");
+  printf("                                   again once they keep up. Opus\n");
+  printf("                                   audio follows, down to half\n");
+  printf("                                   its bitrate.\n");
+  printf("    --min_bitrate <kbps>           Adaptive video bitrate floor.\n");
+  printf("                                   Default is a quarter of\n");
+  printf("                                   --vpx_bitrate.\n");
+  printf("    --max_bitrate <kbps>           Adaptive video bitrate\n");
+  printf("                                   ceiling. Default is\n");
+  printf("                                   --vpx_bitrate.\n");
   printf("    --stream_name <stream name>    Stream name to include in POST\n");
   printf("                                   query string.\n");
+  printf("    --stream_chunks                Upload each chunk while it is\n");
+  printf("                                   muxed using chunked transfer\n");
+  printf("                                   encoding. The chunk ID is sent\n");
+  printf("                                   in the chunk query parameter.\n");
+  printf("                                   Not supported with\n");
+  printf("                                   --form_post.\n");
+  printf("    --async_sink                   Write muxed chunks to the\n");
+  printf("                                   uploader or push sink from a\n");
+  printf("                                   separate thread, which reports\n");
+  printf("                                   each write back to the\n");
+  printf("                                   encoder. Not supported with\n");
+  printf("                                   --stream_chunks.\n");
+  printf("    --sink_policy <unbounded|drop_oldest|drop_video|signal|\n");
+  printf("                   spill>\n");
+  printf("                                   Handling of chunks that wait\n");
+  printf("                                   for slow uploads: queue all,\n");
+  printf("                                   drop the oldest, drop video\n");
+  printf("                                   and keep audio, lower the\n");
+  printf("                                   bitrate (enables\n");
+  printf("                                   --adaptive_bitrate), or move\n");
+  printf("                                   the oldest to\n");
+  printf("                                   --sink_spill_file and upload\n");
+  printf("                                   them after the live ones.\n");
+  printf("                                   Default is unbounded.\n");
+  printf("    --sink_spill_file <path>       Spill file of the spill\n");
+  printf("                                   policy; its index is written\n");
+  printf("                                   to <path>.idx.\n");
+  printf("    --sink_spill_rate <kbps>       Upload rate of spilled\n");
+  printf("                                   chunks. Default is 0, as\n");
+  printf("                                   fast as the sink accepts.\n");
+  printf("    --sink_queue_limit <kB>        Queued chunk data above which\n");
+  printf("                                   --sink_policy applies.\n");
+  printf("                                   Default is %d.\n",
+         static_cast<int>(
+             webmlive::WebmEncoderConfig::kDefaultSinkQueueLimit / 1024));
+  printf("    --memory_budget <MB>           Media data held by the\n");
+  printf("                                   encoder above which\n");
+  printf("                                   --sink_policy applies, to\n");
+  printf("                                   the extent of the excess.\n");
+  printf("                                   Default is no budget.\n");
+  printf("    --stop_timeout <ms>            Time allowed at shutdown to\n");
+  printf("                                   flush and upload the final\n");
+  printf("                                   chunks; what is left is\n");
+  printf("                                   abandoned. 0 waits without\n");
+  printf("                                   limit. Default is %d.\n",
+         webmlive::WebmEncoderConfig::kDefaultStopTimeout);
+  printf("    --large_pages                  Back raw video frames with\n");
+  printf("                                   large pages, which need the\n");
+  printf("                                   Lock pages in memory\n");
+  printf("                                   privilege. Falls back to\n");
+  printf("                                   normal pages.\n");
+  printf("    --numa_node <node>             Run the channel's threads\n");
+  printf("                                   on the processors of the\n");
+  printf("                                   NUMA node, and allocate its\n");
+  printf("                                   media buffers from the\n");
+  printf("                                   node's memory.\n");
+  printf("  Host options:\n");
+  printf("    Runs many channels in one process. Each line of the host\n");
+  printf("    file holds the options of one channel; # starts a comment.\n");
+  printf("    Channels run headless, and write their muxed stream through\n");
+  printf("    the workers of one shared scheduler.\n");
+  printf("    --host <file>                  Run the channels of the file.\n");
+  printf("    --host_workers <count>         Scheduler worker threads.\n");
+  printf("    --service <port>               Run as a service: channels\n");
+  printf("                                   are created, listed, stopped\n");
+  printf("                                   and reconfigured through an\n");
+  printf("                                   HTTP API on the loopback\n");
+  printf("                                   port.\n");
+  printf("    --vpx_context_pool <contexts>  Idle libvpx contexts a\n");
+  printf("                                   service keeps for channel\n");
+  printf("                                   restarts. 0 disables.\n");
+  printf("                                   Default is 4.\n");
+  printf("                                   Default is one per hardware\n");
+  printf("                                   thread.\n");
+  printf("    --channel_priority <1-%d>      Share of the scheduler and of\n",
+         webmlive::TaskScheduler::kMaxPriority);
+  printf("                                   the encode cores given to the\n");
+  printf("                                   channel, relative to the\n");
+  printf("                                   others. Default is %d.\n",
+         webmlive::TaskScheduler::kDefaultPriority);
+  printf("    --cpu_budget <percent>         Keep the encoders of all\n");
+  printf("                                   channels within the percent\n");
+  printf("                                   of the host's cores, making\n");
+  printf("                                   the libvpx speed of lower\n");
+  printf("                                   priority channels faster\n");
+  printf("                                   first. Channels need a\n");
+  printf("                                   --vpx_speed. Default is %d.\n",
+         webmlive::CpuGovernorSettings::kDefaultBudget);
+  printf("  Push options:\n");
+  printf("    Sends WebM chunks over one persistent connection as\n");
+  printf("    length-prefixed frames. Replaces the HTTP uploader.\n");
+  printf("    --push <host:port>             Ingest server address.\n");
+  printf("    --push_queue_limit <kB>        Queued data above which the\n");
+  printf("                                   oldest chunks are dropped.\n");
+  printf("                                   Default is %d.\n",
+         webmlive::PushSinkSettings::kDefaultMaxQueuedBytes / 1024);
+  printf("    --push_udp                     Push over UDP, retransmitting\n");
+  printf("                                   lost packets, instead of TCP.\n");
+  printf("                                   For links with a long round\n");
+  printf("                                   trip and random loss.\n");
+  printf("    --push_latency <ms>            Time lost UDP packets are\n");
+  printf("                                   retransmitted for before they\n");
+  printf("                                   are dropped. Default is %d.\n",
+         webmlive::ArqSenderSettings::kDefaultLatency);
+  printf("    --push_bandwidth <kbps>        UDP send rate limit,\n");
+  printf("                                   retransmissions included.\n");
+  printf("                                   Default is unlimited.\n");
+  printf("  Sink fault injection options:\n");
+  printf("    Degrade the data sink, HTTP uploader or push sink, to\n");
+  printf("    benchmark the pipeline, for example with --free_run.\n");
+  printf("    --inject_latency <ms>[,<jitter>]\n");
+  printf("                                   Time the sink is busy after\n");
+  printf("                                   each chunk, plus up to\n");
+  printf("                                   <jitter> ms at random.\n");
+  printf("    --inject_bandwidth <kbps>      Rate the sink accepts data\n");
+  printf("                                   at.\n");
+  printf("    --inject_failures <percent>    Chunk writes that fail.\n");
+  printf("    --inject_drops <percent>       Chunks accepted but\n");
+  printf("                                   discarded.\n");
+  printf("    --inject_outages <interval>,<ms>\n");
+  printf("                                   Sink unavailable for <ms>\n");
+  printf("                                   every <interval> ms.\n");
+  printf("    --inject_seed <seed>           Seed of the injected jitter,\n");
+  printf("                                   failures and drops. Default\n");
+  printf("                                   is %u.\n",
+         webmlive::FaultInjectionSettings::kDefaultSeed);
   printf("  Audio source configuration options:\n");
   printf("    --adisable                     Disable audio capture.\n");
   printf("    --amanual                      Attempt manual configuration.\n");
   printf("    --achannels <channels>         Number of audio channels.\n");
   printf("    --arate <sample rate>          Audio sample rate.\n");
   printf("    --asize <sample size>          Audio bits per sample.\n");
+  printf("    --aperiod <ms>                 Audio buffer length. Default\n");
+  printf("                                   is the device's.\n");
+  printf("    --audio_api <dshow|wasapi|wasapi_exclusive>\n");
+  printf("                                   Audio capture API. WASAPI\n");
+  printf("                                   captures event driven, in\n");
+  printf("                                   --aperiod buffers. Default\n");
+  printf("                                   is dshow.\n");
+  printf("    --audio_low_latency            Audio only profile tuned for\n");
+  printf("                                   latency: disables video, and\n");
+  printf("                                   uses %d ms audio buffers, %d ms\n",
+         kLowLatencyAudioPeriod, kLowLatencyAudioSegment);
+  printf("                                   clusters, Opus with short\n");
+  printf("                                   low delay packets, and\n");
+  printf("                                   --stream_chunks when the sink\n");
+  printf("                                   streams.\n");
+  printf("    --audio_ring <ms>              Captured audio the encoder can\n");
+  printf("                                   fall behind by. Default is\n");
+  printf("                                   %d.\n",
+         webmlive::PcmRingBuffer::kDefaultDuration);
+  printf("    --audio_overflow <drop_newest|drop_oldest>\n");
+  printf("                                   Audio dropped when the\n");
+  printf("                                   encoder falls further behind.\n");
+  printf("                                   Default is drop_newest.\n");
+  printf("    --audio_levels                 Measure per-channel audio\n");
+  printf("                                   levels and silence.\n");
+  printf("    --silence_encoding             Spend fewer bits on silent\n");
+  printf("                                   audio: Opus DTX, or Vorbis\n");
+  printf("                                   digital silence. Implies\n");
+  printf("                                   --audio_levels.\n");
+  printf("    --silence_threshold <dBFS>     Peak level below which audio\n");
+  printf("                                   is silence. Default is %d.\n",
+         webmlive::AudioLevelSettings::kDefaultSilenceThreshold);
+  printf("    --silence_hold <ms>            Time below the threshold\n");
+  printf("                                   before audio is silent.\n");
+  printf("                                   Default is %d.\n",
+         webmlive::AudioLevelSettings::kDefaultSilenceHold);
+  printf("    --audio_drift_correction       Resample audio to follow the\n");
+  printf("                                   capture clock, keeping it in\n");
+  printf("                                   sync with video over time.\n");
+  printf("    --audio_drift_max_ppm <ppm>    Largest drift correction.\n");
+  printf("                                   Default is %d.\n",
+         webmlive::AudioDriftSettings::kDefaultMaxPpm);
   printf("  Vorbis encoder options:\n");
   printf("    --vorbis_bitrate <kbps>            Average bitrate.\n");
   printf("    --vorbis_minimum_bitrate <kbps>    Minimum bitrate.\n");
@@ -112,28 +777,185 @@ void usage(const char** argv) {
   printf("                                       bitrate.\n");
   printf("    --vorbis_iblock_bias <-15.0-0.0>   Impulse block bias.\n");
   printf("    --vorbis_lowpass_frequency <2-99>  Hard-low pass frequency.\n");
+  printf("    --vorbis_sample_rate <Hz>          Resample audio to the\n");
+  printf("                                       rate before encoding.\n");
+  printf("    --vorbis_channels <channels>       Encoded channel count: the\n");
+  printf("                                       input count, or 1 or 2 to\n");
+  printf("                                       downmix.\n");
+  printf("    --vorbis_warmup                    Warm up libvorbis at\n");
+  printf("                                       startup.\n");
+  printf("    --vorbis_rendition <kbps>          Adds a DASH audio\n");
+  printf("                                       rendition encoded at\n");
+  printf("                                       <kbps> using the other\n");
+  printf("                                       Vorbis settings. May be\n");
+  printf("                                       repeated.\n");
+  printf("  Opus encoder options:\n");
+  printf("    --opus                             Encode audio with Opus\n");
+  printf("                                       instead of Vorbis.\n");
+  printf("    --opus_bitrate <kbps>              Target bitrate.\n");
+  printf("    --opus_complexity <0-10>           Encoder complexity.\n");
+  printf("    --opus_frame_duration <ms>         Packet duration: 10, 20,\n");
+  printf("                                       40 or 60.\n");
+  printf("    --opus_low_delay                   Use the restricted low\n");
+  printf("                                       delay mode.\n");
   printf("  Video source configuration options:\n");
   printf("    --vdisable                         Disable video capture.\n");
+  printf("    --vdesktop                         Capture the desktop. Use\n");
+  printf("                                       --vdevidx to select the\n");
+  printf("                                       monitor.\n");
   printf("    --vmanual                          Attempt manual\n");
   printf("                                       configuration.\n");
   printf("    --vwidth <width>                   Width in pixels.\n");
   printf("    --vheight <height>                 Height in pixels.\n");
   printf("    --vframe_rate <width>              Frames per second.\n");
+  printf("    --vcrop <l,t,w,h>                  Encode only the w x h\n");
+  printf("                                       region at l,t of the\n");
+  printf("                                       captured frames. l and t\n");
+  printf("                                       must be even.\n");
+  printf("    --vpad <alignment>                 Encode the frames padded\n");
+  printf("                                       to a multiple of\n");
+  printf("                                       alignment pixels, up to\n");
+  printf("                                       64. Players crop the\n");
+  printf("                                       padding.\n");
+  printf("    --vout_frame_rate <fps>            Encoded frames per second.\n");
+  printf("                                       Captured frames are\n");
+  printf("                                       dropped and retimed to an\n");
+  printf("                                       even cadence at this rate.\n");
+  printf("    --vdrop_stale                      Skip stale queued frames\n");
+  printf("                                       when encoding lags.\n");
+  printf("    --vlatency_budget <ms>             Maximum age of frames kept\n");
+  printf("                                       by --vdrop_stale, relative\n");
+  printf("                                       to the newest frame.\n");
+  printf("                                       Default is 0.\n");
+  printf("    --vpool_adaptive <min>,<max>       Size the raw frame queue\n");
+  printf("                                       from encode time and\n");
+  printf("                                       capture jitter, between\n");
+  printf("                                       these depths in frames.\n");
+  printf("    --vsegment_rate <percent>          Steer the video bitrate so\n");
+  printf("                                       each segment lands within\n");
+  printf("                                       this share of its byte\n");
+  printf("                                       budget.\n");
+  printf("    --vconvert_threads <n>             Threads converting frames\n");
+  printf("                                       to I420. 0 converts\n");
+  printf("                                       on the capture thread.\n");
+  printf("                                       Default is 2.\n");
+  printf("    --gpu_video_processing             Convert and scale frames\n");
+  printf("                                       with the GPU video\n");
+  printf("                                       processor when available.\n");
+  printf("    --deinterlace <auto|force>         Deinterlace captured\n");
+  printf("                                       frames: auto when the\n");
+  printf("                                       source reports interlaced\n");
+  printf("                                       video, force always, as\n");
+  printf("                                       top field first for\n");
+  printf("                                       progressive sources.\n");
+  printf("    --deinterlace_threshold <n>        Comb detection threshold,\n");
+  printf("                                       0 to 255. Default is 10.\n");
+  printf("    --video_passthrough                Mux VP8 or VP9 frames from\n");
+  printf("                                       the video source without\n");
+  printf("                                       re-encoding them.\n");
+  printf("    --vcapture_times                   Write the capture wall\n");
+  printf("                                       clock time of each frame\n");
+  printf("                                       with it, for measuring\n");
+  printf("                                       delivery latency with\n");
+  printf("                                       latency_verifier.\n");
   printf("  VPx encoder options:\n");
   printf("    --vpx_bitrate <kbps>               Video bitrate.\n");
   printf("    --vpx_codec <codec>                Video codec, vp8 or vp9.\n");
   printf("                                       The default codec is vp8.\n");
   printf("    --vpx_decimate <decimate factor>   FPS reduction factor.\n");
+  printf("                                       Same as --vout_frame_rate\n");
+  printf("                                       at the capture rate\n");
+  printf("                                       divided by it.\n");
+  printf("    --vpx_encoder <backend>            Encoder backend: software,\n");
+  printf("                                       hardware or auto. The\n");
+  printf("                                       default is software.\n");
   printf("    --vpx_keyframe_interval <milliseconds>  Time between\n");
   printf("                                            keyframes.\n");
+  printf("    --vpx_aligned_keyframes            Place keyframes on exact\n");
+  printf("                                       multiples of the keyframe\n");
+  printf("                                       interval.\n");
+  printf("    --vpx_intra_refresh                Refresh the picture\n");
+  printf("                                       progressively instead of\n");
+  printf("                                       with periodic keyframes,\n");
+  printf("                                       for a flat bitrate.\n");
+  printf("                                       Keyframes are encoded on\n");
+  printf("                                       request only. Requires\n");
+  printf("                                       --muxed_output alone.\n");
+  printf("    --vpx_min_keyframe_request_interval <milliseconds>\n");
+  printf("                                       Shortest time from a\n");
+  printf("                                       keyframe to a requested\n");
+  printf("                                       one.\n");
+  printf("    --vpx_scene_cut <percent>          Place keyframes on scene\n");
+  printf("                                       cuts, frames differing by\n");
+  printf("                                       at least <percent> from\n");
+  printf("                                       the previous one. Try 30.\n");
+  printf("    --vpx_min_scene_cut_interval <milliseconds>\n");
+  printf("                                       Shortest time from a\n");
+  printf("                                       keyframe to one on a scene\n");
+  printf("                                       cut. The default is 500.\n");
   printf("    --vpx_min_q <min q value>          Quantizer minimum.\n");
   printf("    --vpx_max_q <max q value>          Quantizer maximum.\n");
   printf("    --vpx_noise_sensitivity <0-1>      Blurs adjacent frames to\n");
   printf("                                       reduce the noise level of\n");
   printf("                                       input video.\n");
   printf("    --vpx_static_threshold <threshold> Static threshold.\n");
+  printf("    --vpx_static_detection <threshold> Skip unchanged blocks and\n");
+  printf("                                       frames; mean absolute\n");
+  printf("                                       luma difference allowed.\n");
+  printf("    --vpx_roi <l,t,w,h:delta_q>        Region of interest, as\n");
+  printf("                                       fractions of the frame,\n");
+  printf("                                       with a quantizer offset.\n");
+  printf("                                       Negative offsets spend\n");
+  printf("                                       more bits. VP8 only.\n");
+  printf("                                       Repeatable.\n");
   printf("    --vpx_speed <speed value>          Speed.\n");
+  printf("    --vpx_adaptive_speed               Raise speed from\n");
+  printf("                                       --vpx_speed when encoding\n");
+  printf("                                       falls behind realtime.\n");
+  printf("    --vpx_max_speed <speed value>      Fastest adaptive speed.\n");
+  printf("    --vpx_latency_budget <ms>          Encoder delay allowed for\n");
+  printf("                                       lookahead and alt-ref\n");
+  printf("                                       frames. Default is 0.\n");
+  printf("    --vpx_warmup_frames <frames>       Frames encoded and\n");
+  printf("                                       discarded at startup so\n");
+  printf("                                       the first frame encodes\n");
+  printf("                                       at steady-state latency.\n");
+  printf("    --vpx_parallel_gops <count>        Closed GOPs encoded at\n");
+  printf("                                       once, for --free_run\n");
+  printf("                                       input files and capture\n");
+  printf("                                       dumps. Default is 0.\n");
+  printf("    --vpx_temporal_layers <1-3>        Temporal scalability\n");
+  printf("                                       layers. Default is 1.\n");
+  printf("    --vpx_spatial_layers <1-3>         VP9 spatial scalability\n");
+  printf("                                       layers. Default is 1.\n");
+  printf("    --adaptive_resolution              Lower the frame size, then\n");
+  printf("                                       the frame rate, while the\n");
+  printf("                                       fastest adaptive speed\n");
+  printf("                                       cannot keep realtime.\n");
   printf("    --vpx_threads <num threads>        Number of encode threads.\n");
+  printf("                                       Chosen from frame size and\n");
+  printf("                                       cores when omitted.\n");
+  printf("    --vpx_cpu_cores <count>            Cores available to this\n");
+  printf("                                       encoder, shared by all\n");
+  printf("                                       renditions. Defaults to\n");
+  printf("                                       all hardware threads.\n");
+  printf("    --vpx_calibrate                    Choose --vpx_speed and\n");
+  printf("                                       --vpx_threads at startup\n");
+  printf("                                       by encoding a short\n");
+  printf("                                       synthetic clip with each\n");
+  printf("                                       candidate.\n");
+  printf("    --vpx_calibrate_codec              Also choose --vpx_codec,\n");
+  printf("                                       VP9 first.\n");
+  printf("    --vpx_calibrate_margin <percent>   Speed above realtime a\n");
+  printf("                                       candidate needs. Default\n");
+  printf("                                       is %d.\n",
+         webmlive::VpxCalibrationSettings::kDefaultSafetyMargin);
+  printf("    --vpx_calibrate_frames <count>     Clip length. Default is\n");
+  printf("                                       %d.\n",
+         webmlive::VpxCalibrationSettings::kDefaultClipFrames);
+  printf("    --vpx_calibrate_cache <file>       Keep results per host\n");
+  printf("                                       type in <file>, and\n");
+  printf("                                       calibrate only once.\n");
   printf("    --vpx_overshoot <percent>          Overshoot percentage.\n");
   printf("    --vpx_undershoot <percent>         Undershoot percentage.\n");
   printf("    --vpx_max_buffer <length>          Client buffer length (ms).\n");
@@ -142,6 +964,22 @@ void usage(const char** argv) {
   printf("    --vpx_max_kf_bitrate <percent>     Max keyframe bitrate.\n");
   printf("    --vpx_sharpness <0-7>              Loop filter sharpness.\n");
   printf("    --vpx_error_resilience             Enables error resilience.\n");
+  printf("    --vpx_rendition <W>x<H>:<kbps>     Adds a DASH video\n");
+  printf("                                       rendition encoded at\n");
+  printf("                                       <kbps> using the other VPx\n");
+  printf("                                       settings. 0x0\n");
+  printf("                                       uses the capture size. May\n");
+  printf("                                       be repeated. A @<node>\n");
+  printf("                                       suffix encodes it on that\n");
+  printf("                                       NUMA node, and a\n");
+  printf("                                       /<codec>[,<codec>] suffix\n");
+  printf("                                       encodes it once per codec\n");
+  printf("                                       listed, from the same\n");
+  printf("                                       frames, into a DASH\n");
+  printf("                                       AdaptationSet per codec.\n");
+  printf("                                       0x0:<kbps>/vp8 next to VP9\n");
+  printf("                                       adds VP8 for older\n");
+  printf("                                       players.\n");
   printf("  VP8 specific encoder options:\n");
   printf("    --vp8_token_partitions <0-3>       Number of token\n");
   printf("                                       partitions.\n");
@@ -155,6 +993,8 @@ void usage(const char** argv) {
   printf("    --vp9_gf_cbr_boost <percent>       Golden frame bitrate\n");
   printf("                                       boost.\n");
   printf("    --vp9_tile_cols <cols>             Number of tile columns\n");
+  printf("                                       (chosen automatically when\n");
+  printf("                                       omitted)\n");
   printf("                                       expressed in log2 units:\n");
   printf("                                         0 = 1 tile column\n");
   printf("                                         1 = 2 tile columns\n");
@@ -192,6 +1032,177 @@ int store_string_map_entries(const StringVector& unparsed_entries,
   return kSuccess;
 }
 
+// Fields of |webmlive::ThreadSettings| set from the command line.
+enum ThreadSettingField {
+  kThreadPriority,
+  kThreadAffinity,
+  kThreadMmcssTask,
+};
+
+// Parses thread settings in the format name:value from |entries|, and stores
+// them in the |field| of the settings for each name in |out_settings|.
+int store_thread_settings(const StringVector& entries,
+                          ThreadSettingField field,
+                          ThreadSettingsMap& out_settings) {
+  std::map<std::string, std::string> values;
+  int status = store_string_map_entries(entries, values);
+  if (status) {
+    return status;
+  }
+  for (std::map<std::string, std::string>::const_iterator iter =
+           values.begin();
+       iter != values.end(); ++iter) {
+    webmlive::ThreadSettings& settings = out_settings[iter->first];
+    if (field == kThreadPriority) {
+      if (!webmlive::ParseThreadPriority(iter->second, &settings.priority)) {
+        LOG(ERROR) << "ERROR: unknown thread priority " << iter->second;
+        return kBadFormat;
+      }
+    } else if (field == kThreadAffinity) {
+      settings.affinity_mask = strtoull(iter->second.c_str(), NULL, 0);
+    } else {
+      settings.mmcss_task = iter->second;
+    }
+  }
+  return kSuccess;
+}
+
+// Parses rendition descriptions in the format
+// <width>x<height>:<kbps>[@<node>][/<codec>[,<codec>...]] from
+// |unparsed_renditions|, and appends renditions using |vpx_config| with the
+// parsed bitrate and NUMA node to |out_renditions|: one per codec listed, or
+// one with the codec of |vpx_config| when there is no list.
+int store_renditions(const StringVector& unparsed_renditions,
+                     const webmlive::VpxConfig& vpx_config,
+                     std::vector<webmlive::VideoRenditionConfig>&
+                         out_renditions) {
+  StringVector::const_iterator entry_iter = unparsed_renditions.begin();
+  while (entry_iter != unparsed_renditions.end()) {
+    webmlive::VideoRenditionConfig rendition;
+    int bitrate = 0;
+    const int fields = sscanf(entry_iter->c_str(), "%dx%d:%d@%d",
+                              &rendition.width, &rendition.height, &bitrate,
+                              &rendition.numa_node);
+    std::vector<webmlive::VideoFormat> codecs;
+    const size_t slash = entry_iter->find('/');
+    if (slash == std::string::npos) {
+      codecs.push_back(vpx_config.codec);
+    } else {
+      std::istringstream codec_list(entry_iter->substr(slash + 1));
+      std::string codec;
+      while (std::getline(codec_list, codec, ',')) {
+        if (codec == kCodecVp8) {
+          codecs.push_back(webmlive::kVideoFormatVP8);
+        } else if (codec == kCodecVp9) {
+          codecs.push_back(webmlive::kVideoFormatVP9);
+        } else {
+          codecs.clear();
+          break;
+        }
+      }
+    }
+    if (fields < 3 || rendition.width < 0 || rendition.height < 0 ||
+        bitrate <= 0 || (fields == 4 && rendition.numa_node < 0) ||
+        codecs.empty()) {
+      LOG(ERROR) << "ERROR: cannot parse rendition, should be "
+                 << "<width>x<height>:<kbps>[@<node>][/<codec>[,<codec>]], "
+                 << "got=" << entry_iter->c_str();
+      return kBadFormat;
+    }
+    rendition.vpx_config = vpx_config;
+    rendition.vpx_config.bitrate = bitrate;
+    for (size_t i = 0; i < codecs.size(); ++i) {
+      rendition.vpx_config.codec = codecs[i];
+      out_renditions.push_back(rendition);
+    }
+    ++entry_iter;
+  }
+  return kSuccess;
+}
+
+// Parses the bitrates in |unparsed_renditions|, and appends audio renditions
+// using |vorbis_config| with the parsed bitrate to |out_renditions|.
+int store_audio_renditions(const StringVector& unparsed_renditions,
+                           const webmlive::VorbisConfig& vorbis_config,
+                           std::vector<webmlive::AudioRenditionConfig>&
+                               out_renditions) {
+  StringVector::const_iterator entry_iter = unparsed_renditions.begin();
+  while (entry_iter != unparsed_renditions.end()) {
+    webmlive::AudioRenditionConfig rendition;
+    const int bitrate = strtol(entry_iter->c_str(), NULL, 10);
+    if (bitrate <= 0) {
+      LOG(ERROR) << "ERROR: cannot parse audio rendition, should be "
+                 << "<kbps>, got=" << entry_iter->c_str();
+      return kBadFormat;
+    }
+    rendition.vorbis_config = vorbis_config;
+    rendition.vorbis_config.average_bitrate = bitrate;
+    out_renditions.push_back(rendition);
+    ++entry_iter;
+  }
+  return kSuccess;
+}
+
+// Parses camera descriptions in the format <name|index>[:<kbps>] from
+// |unparsed_cameras|, and appends cameras using |vpx_config|, with the parsed
+// bitrate when present, to |out_cameras|. Descriptions of digits only select
+// the device by index.
+int store_cameras(const StringVector& unparsed_cameras,
+                  const webmlive::VpxConfig& vpx_config,
+                  std::vector<webmlive::VideoCameraConfig>& out_cameras) {
+  const char kDigits[] = "0123456789";
+  StringVector::const_iterator entry_iter = unparsed_cameras.begin();
+  while (entry_iter != unparsed_cameras.end()) {
+    webmlive::VideoCameraConfig camera;
+    camera.vpx_config = vpx_config;
+    std::string device = *entry_iter;
+    const size_t colon = device.rfind(':');
+    if (colon != std::string::npos && colon + 1 < device.size() &&
+        device.find_first_not_of(kDigits, colon + 1) == std::string::npos) {
+      camera.vpx_config.bitrate = strtol(device.c_str() + colon + 1, NULL, 10);
+      device.erase(colon);
+    }
+    if (device.empty() || camera.vpx_config.bitrate <= 0) {
+      LOG(ERROR) << "ERROR: cannot parse camera, should be "
+                 << "<name|index>[:<kbps>], got=" << entry_iter->c_str();
+      return kBadFormat;
+    }
+    if (device.find_first_not_of(kDigits) == std::string::npos) {
+      camera.device_index = strtol(device.c_str(), NULL, 10);
+    } else {
+      camera.device_name = device;
+    }
+    out_cameras.push_back(camera);
+    ++entry_iter;
+  }
+  return kSuccess;
+}
+
+// Parses regions of interest in the format
+// <left>,<top>,<width>,<height>:<delta_q>, with the position and size as
+// fractions of the frame, from |unparsed_regions|, and appends them to
+// |out_regions|.
+int store_regions_of_interest(
+    const StringVector& unparsed_regions,
+    std::vector<webmlive::RegionOfInterest>& out_regions) {
+  StringVector::const_iterator entry_iter = unparsed_regions.begin();
+  while (entry_iter != unparsed_regions.end()) {
+    webmlive::RegionOfInterest region;
+    const int fields = sscanf(entry_iter->c_str(), "%lf,%lf,%lf,%lf:%d",
+                              &region.left, &region.top, &region.width,
+                              &region.height, &region.delta_q);
+    if (fields != 5) {
+      LOG(ERROR) << "ERROR: cannot parse region of interest, should be "
+                 << "<left>,<top>,<width>,<height>:<delta_q>, got="
+                 << entry_iter->c_str();
+      return kBadFormat;
+    }
+    out_regions.push_back(region);
+    ++entry_iter;
+  }
+  return kSuccess;
+}
+
 // Returns true when |arg_index| + 1 is <= |argc|, and |argv[arg_index+1]| is
 // non-null. Command line parser helper function.
 bool arg_has_value(int arg_index, int argc, const char** argv) {
@@ -203,11 +1214,54 @@ bool arg_has_value(int arg_index, int argc, const char** argv) {
   return has_value;
 }
 
+// Applies --audio_low_latency to |ptr_config|: video is disabled, and the
+// audio buffer, cluster and Opus packet durations left at their defaults are
+// shortened, so that each stage of the path from capture to the origin holds
+// the audio briefly. Chunks are streamed as they are muxed when the sink
+// supports it: over a push connection, or one HTTP POST target.
+void apply_low_latency_audio(WebmEncoderConfig* ptr_config) {
+  webmlive::WebmEncoderConfig& enc_config = ptr_config->enc_config;
+  enc_config.disable_video = true;
+  if (enc_config.audio_buffer_period == 0) {
+    enc_config.audio_buffer_period = kLowLatencyAudioPeriod;
+  }
+  if (enc_config.segment_duration == 0) {
+    enc_config.segment_duration = kLowLatencyAudioSegment;
+  }
+#ifdef WEBMLIVE_HAVE_OPUS
+  enc_config.audio_codec = webmlive::kAudioFormatOpus;
+  if (enc_config.opus_config.frame_duration ==
+      webmlive::OpusConfig().frame_duration) {
+    enc_config.opus_config.frame_duration = kLowLatencyAudioPeriod;
+  }
+  enc_config.opus_config.low_delay = true;
+#else
+  LOG(WARNING) << "built without Opus: --audio_low_latency encodes Vorbis, "
+               << "which adds its packet delay.";
+#endif
+  const bool streaming_sink = !ptr_config->push_settings.host.empty() ||
+      (!ptr_config->uploader_settings.target_url.empty() &&
+       ptr_config->backup_urls.empty() &&
+       ptr_config->shm_sink.shm_name.empty() &&
+       ptr_config->uploader_settings.post_mode == webmlive::HTTP_POST);
+  if (streaming_sink && !enc_config.async_sink) {
+    enc_config.stream_chunks = true;
+  }
+}
+
 // Parses command line and stores user settings.
 void parse_command_line(int argc, const char** argv,
                         WebmEncoderConfig& config) {
   StringVector unparsed_headers;
   StringVector unparsed_vars;
+  StringVector unparsed_renditions;
+  StringVector unparsed_audio_renditions;
+  StringVector unparsed_cameras;
+  StringVector unparsed_regions;
+  StringVector unparsed_priorities;
+  StringVector unparsed_affinities;
+  StringVector unparsed_mmcss_tasks;
+  bool capture_mmcss = false;
   webmlive::HttpUploaderSettings& uploader_settings = config.uploader_settings;
   webmlive::WebmEncoderConfig& enc_config = config.enc_config;
   config.uploader_settings.post_mode = webmlive::HTTP_POST;
@@ -223,6 +1277,8 @@ void parse_command_line(int argc, const char** argv,
     //
     else if (!strcmp("--dash", argv[i])) {
       enc_config.dash_encode = true;
+    } else if (!strcmp("--mux", argv[i])) {
+      enc_config.muxed_output = true;
     } else if (!strcmp("--dash_dir", argv[i]) && arg_has_value(i, argc, argv)) {
       enc_config.dash_dir = argv[++i];
       const char last_char = enc_config.dash_dir[enc_config.dash_dir.length()];
@@ -235,6 +1291,105 @@ void parse_command_line(int argc, const char** argv,
     } else if (!strcmp("--dash_start_number", argv[i]) &&
                arg_has_value(i, argc, argv)) {
       enc_config.dash_start_number = argv[++i];
+    } else if (!strcmp("--dash_dynamic", argv[i])) {
+      enc_config.dash_dynamic = true;
+    } else if (!strcmp("--dash_update_period", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.dash_update_period = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--dash_window", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.dash_window = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--dash_single_file", argv[i])) {
+      enc_config.dash_single_file = true;
+    } else if (!strcmp("--dash_segment_index", argv[i])) {
+      enc_config.dash_segment_index = true;
+    } else if (!strcmp("--dash_bandwidth_window", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.dash_bandwidth_window = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--dash_serve", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.dash_server.port = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--dash_serve_segments", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.dash_server.segment_count = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--dash_serve_window", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.dash_server.time_shift_window = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--dash_serve_wait", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.dash_server.wait_timeout = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--segment_ring", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.segment_ring.path = argv[++i];
+    } else if (!strcmp("--segment_ring_size", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.segment_ring.size = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--segment_ring_slots", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.segment_ring.index_slots = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--segment_ring_shm", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.segment_ring.shm_name = argv[++i];
+    } else if (!strcmp("--ring_overrun", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      const std::string policy = argv[++i];
+      webmlive::SegmentRingSettings::OverrunPolicy overrun =
+          webmlive::SegmentRingSettings::kOverrunEvict;
+      if (policy == "skip")
+        overrun = webmlive::SegmentRingSettings::kOverrunSkip;
+      else if (policy != "evict")
+        LOG(ERROR) << "Invalid --ring_overrun value: " << policy;
+      enc_config.segment_ring.overrun = overrun;
+      config.shm_sink.overrun = overrun;
+    } else if (!strcmp("--dash_no_files", argv[i])) {
+      enc_config.dash_write_files = false;
+    } else if (!strcmp("--dash_sink_manifest", argv[i])) {
+      enc_config.dash_sink_manifest = true;
+    } else if (!strcmp("--file_sync", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      const std::string policy = argv[++i];
+      if (policy == "none")
+        enc_config.file_sync_policy = webmlive::FileWriter::kSyncNone;
+      else if (policy == "manifests")
+        enc_config.file_sync_policy = webmlive::FileWriter::kSyncReplacements;
+      else if (policy == "all")
+        enc_config.file_sync_policy = webmlive::FileWriter::kSyncAll;
+      else
+        LOG(ERROR) << "Invalid --file_sync value: " << policy;
+    } else if (!strcmp("--segment_duration", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.segment_duration = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--adaptive_segments", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      webmlive::SegmentDurationSettings& durations =
+          enc_config.adaptive_segments;
+      if (sscanf(argv[++i], "%d,%d", &durations.min_duration,
+                 &durations.max_duration) == 2) {
+        durations.enabled = true;
+      } else {
+        LOG(ERROR) << "Invalid --adaptive_segments value: " << argv[i];
+      }
+    } else if (!strcmp("--adaptive_segment_load", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      webmlive::SegmentDurationSettings& durations =
+          enc_config.adaptive_segments;
+      if (sscanf(argv[++i], "%d,%d", &durations.low_load,
+                 &durations.high_load) != 2) {
+        LOG(ERROR) << "Invalid --adaptive_segment_load value: " << argv[i];
+      }
+    } else if (!strcmp("--max_cluster_bytes", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.max_cluster_bytes = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--align_segments", argv[i])) {
+      enc_config.align_segments = true;
+    } else if (!strcmp("--pipeline", argv[i])) {
+      enc_config.pipeline_encode = true;
+    } else if (!strcmp("--interleave_latency", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.max_interleave_latency = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--interleave_timeout", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.interleave_stream_timeout = strtol(argv[++i], NULL, 10);
     }
 
     //
@@ -242,11 +1397,34 @@ void parse_command_line(int argc, const char** argv,
     //
     else if (!strcmp("--url", argv[i]) && arg_has_value(i, argc, argv)) {
       uploader_settings.target_url = argv[++i];
+    } else if (!strcmp("--backup_url", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      config.backup_urls.push_back(argv[++i]);
+    } else if (!strcmp("--shm_sink", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      config.shm_sink.shm_name = argv[++i];
+    } else if (!strcmp("--shm_sink_size", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      config.shm_sink.size = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--failover_url", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      uploader_settings.failover_urls.push_back(argv[++i]);
+    } else if (!strcmp("--failover_errors", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      uploader_settings.failover_errors = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--failover_latency_ms", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      uploader_settings.failover_latency_ms = strtol(argv[++i], NULL, 10);
     } else if (!strcmp("--header", argv[i]) && arg_has_value(i, argc, argv)) {
       unparsed_headers.push_back(argv[++i]);
     } else if (!strcmp("--form_post", argv[i]) &&
                arg_has_value(i, argc, argv)) {
       uploader_settings.post_mode = webmlive::HTTP_FORM_POST;
+    } else if (!strcmp("--put_objects", argv[i])) {
+      uploader_settings.post_mode = webmlive::HTTP_PUT;
+    } else if (!strcmp("--multipart_part_bytes", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      uploader_settings.multipart_part_bytes = strtol(argv[++i], NULL, 10);
     } else if (!strcmp("--var", argv[i]) && arg_has_value(i, argc, argv)) {
       unparsed_vars.push_back(argv[++i]);
     } else if (!strcmp("--stream_name", argv[i]) &&
@@ -255,6 +1433,153 @@ void parse_command_line(int argc, const char** argv,
     } else if (!strcmp("--stream_id", argv[i]) &&
                arg_has_value(i, argc, argv)) {
       uploader_settings.stream_id = argv[++i];
+    } else if (!strcmp("--max_uploads", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      uploader_settings.max_uploads = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--max_queue_kb", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      uploader_settings.max_queue_bytes = strtol(argv[++i], NULL, 10) * 1024LL;
+    } else if (!strcmp("--http2", argv[i])) {
+      uploader_settings.http2 = true;
+    } else if (!strcmp("--warm_connections", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      uploader_settings.warm_connections = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--max_retries", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      uploader_settings.max_retries = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--upload_priority", argv[i])) {
+      uploader_settings.prioritize = true;
+    } else if (!strcmp("--upload_coalesce", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      uploader_settings.coalesce_bytes = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--upload_coalesce_ms", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      uploader_settings.coalesce_delay_ms = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--upload_pacing", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      config.upload_pacing = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--upload_burst_ms", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      uploader_settings.pacing_burst_ms = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--upload_limit", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      config.upload_limit = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--adaptive_bitrate", argv[i])) {
+      config.adaptive_bitrate = true;
+    } else if (!strcmp("--min_bitrate", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      config.bitrate_settings.min_bitrate = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--max_bitrate", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      config.bitrate_settings.max_bitrate = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--stream_chunks", argv[i])) {
+      enc_config.stream_chunks = true;
+    } else if (!strcmp("--async_sink", argv[i])) {
+      enc_config.async_sink = true;
+    } else if (!strcmp("--sink_policy", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      typedef webmlive::WebmEncoderConfig EncoderConfig;
+      const std::string policy = argv[++i];
+      if (policy == "unbounded")
+        enc_config.sink_policy = EncoderConfig::kSinkQueueUnbounded;
+      else if (policy == "drop_oldest")
+        enc_config.sink_policy = EncoderConfig::kSinkDropOldest;
+      else if (policy == "drop_video")
+        enc_config.sink_policy = EncoderConfig::kSinkDropVideo;
+      else if (policy == "signal")
+        enc_config.sink_policy = EncoderConfig::kSinkSignal;
+      else if (policy == "spill")
+        enc_config.sink_policy = EncoderConfig::kSinkSpill;
+      else
+        LOG(ERROR) << "Invalid --sink_policy value: " << policy;
+    } else if (!strcmp("--sink_spill_file", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.sink_spill.path = argv[++i];
+    } else if (!strcmp("--sink_spill_rate", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.sink_spill.catchup_kbps =
+          std::max(0, static_cast<int>(strtol(argv[++i], NULL, 10)));
+    } else if (!strcmp("--sink_queue_limit", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.sink_queue_limit = strtol(argv[++i], NULL, 10) * 1024LL;
+    } else if (!strcmp("--memory_budget", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.memory_budget = strtol(argv[++i], NULL, 10) * 1024LL * 1024;
+    } else if (!strcmp("--stop_timeout", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.stop_timeout =
+          std::max(0, static_cast<int>(strtol(argv[++i], NULL, 10)));
+    } else if (!strcmp("--large_pages", argv[i])) {
+      enc_config.large_pages = true;
+    } else if (!strcmp("--numa_node", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.numa_node = strtol(argv[++i], NULL, 10);
+    }
+
+    //
+    // Push options.
+    //
+    else if (!strcmp("--push", argv[i]) && arg_has_value(i, argc, argv)) {
+      const std::string address = argv[++i];
+      const size_t colon = address.rfind(':');
+      if (colon == std::string::npos) {
+        LOG(ERROR) << "Invalid --push address: " << address;
+      } else {
+        config.push_settings.host = address.substr(0, colon);
+        config.push_settings.port =
+            strtol(address.c_str() + colon + 1, NULL, 10);
+      }
+    } else if (!strcmp("--push_queue_limit", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      config.push_settings.max_queued_bytes =
+          strtol(argv[++i], NULL, 10) * 1024;
+    } else if (!strcmp("--push_udp", argv[i])) {
+      config.push_settings.transport =
+          webmlive::PushSinkSettings::kTransportUdpArq;
+    } else if (!strcmp("--push_latency", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      config.push_settings.arq.latency = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--push_bandwidth", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      config.push_settings.arq.max_bandwidth = strtol(argv[++i], NULL, 10);
+    }
+
+    //
+    // Sink fault injection options.
+    //
+    else if (!strcmp("--inject_latency", argv[i]) &&
+             arg_has_value(i, argc, argv)) {
+      webmlive::FaultInjectionSettings& faults = config.fault_injection;
+      if (sscanf(argv[++i], "%d,%d", &faults.latency_ms,
+                 &faults.jitter_ms) >= 1) {
+        config.inject_faults = true;
+      } else {
+        LOG(ERROR) << "Invalid --inject_latency value: " << argv[i];
+      }
+    } else if (!strcmp("--inject_bandwidth", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      config.fault_injection.bandwidth_kbps = strtol(argv[++i], NULL, 10);
+      config.inject_faults = true;
+    } else if (!strcmp("--inject_failures", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      config.fault_injection.failure_percent = strtol(argv[++i], NULL, 10);
+      config.inject_faults = true;
+    } else if (!strcmp("--inject_drops", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      config.fault_injection.drop_percent = strtol(argv[++i], NULL, 10);
+      config.inject_faults = true;
+    } else if (!strcmp("--inject_outages", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      webmlive::FaultInjectionSettings& faults = config.fault_injection;
+      if (sscanf(argv[++i], "%d,%d", &faults.outage_interval_ms,
+                 &faults.outage_ms) == 2) {
+        config.inject_faults = true;
+      } else {
+        LOG(ERROR) << "Invalid --inject_outages value: " << argv[i];
+      }
+    } else if (!strcmp("--inject_seed", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      config.fault_injection.seed = strtoul(argv[++i], NULL, 10);
     }
 
     //
@@ -278,6 +1603,53 @@ void parse_command_line(int argc, const char** argv,
     } else if (!strcmp("--asize", argv[i]) && arg_has_value(i, argc, argv)) {
       enc_config.requested_audio_config.bits_per_sample =
           static_cast<uint16>(strtol(argv[++i], NULL, 10));
+    } else if (!strcmp("--aperiod", argv[i]) && arg_has_value(i, argc, argv)) {
+      enc_config.audio_buffer_period = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--audio_api", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      const std::string api = argv[++i];
+      if (api == "dshow")
+        enc_config.audio_source =
+            webmlive::WebmEncoderConfig::kAudioSourceDirectShow;
+      else if (api == "wasapi")
+        enc_config.audio_source =
+            webmlive::WebmEncoderConfig::kAudioSourceWasapi;
+      else if (api == "wasapi_exclusive")
+        enc_config.audio_source =
+            webmlive::WebmEncoderConfig::kAudioSourceWasapiExclusive;
+      else
+        LOG(ERROR) << "Invalid --audio_api value: " << api;
+    } else if (!strcmp("--audio_low_latency", argv[i])) {
+      config.low_latency_audio = true;
+    } else if (!strcmp("--audio_ring", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.audio_ring_duration = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--audio_overflow", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      const std::string policy = argv[++i];
+      if (policy == "drop_newest")
+        enc_config.audio_overflow_policy = webmlive::PcmRingBuffer::kDropNewest;
+      else if (policy == "drop_oldest")
+        enc_config.audio_overflow_policy = webmlive::PcmRingBuffer::kDropOldest;
+      else
+        LOG(ERROR) << "Invalid --audio_overflow value: " << policy;
+    } else if (!strcmp("--audio_levels", argv[i])) {
+      enc_config.audio_levels.enabled = true;
+    } else if (!strcmp("--silence_encoding", argv[i])) {
+      enc_config.audio_levels.enabled = true;
+      enc_config.audio_levels.silence_encoding = true;
+    } else if (!strcmp("--silence_threshold", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.audio_levels.silence_threshold =
+          strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--silence_hold", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.audio_levels.silence_hold = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--audio_drift_correction", argv[i])) {
+      enc_config.audio_drift.enabled = true;
+    } else if (!strcmp("--audio_drift_max_ppm", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.audio_drift.max_ppm = strtol(argv[++i], NULL, 10);
     }
 
     //
@@ -285,10 +1657,131 @@ void parse_command_line(int argc, const char** argv,
     //
     else if (!strcmp("--vdisable", argv[i])) {
       enc_config.disable_video = true;
+    } else if (!strcmp("--vdesktop", argv[i])) {
+      enc_config.video_source =
+          webmlive::WebmEncoderConfig::kVideoSourceDesktop;
     } else if (!strcmp("--vdev", argv[i]) && arg_has_value(i, argc, argv)) {
       enc_config.video_device_name = argv[++i];
     } else if (!strcmp("--vdevidx", argv[i]) && arg_has_value(i, argc, argv)) {
       enc_config.video_device_index = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--vcamera", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      unparsed_cameras.push_back(argv[++i]);
+    } else if (!strcmp("--vprofiles", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.capture_profile_file = argv[++i];
+    } else if (!strcmp("--vfile", argv[i]) && arg_has_value(i, argc, argv)) {
+      enc_config.video_input_file = argv[++i];
+    } else if (!strcmp("--afile", argv[i]) && arg_has_value(i, argc, argv)) {
+      enc_config.audio_input_file = argv[++i];
+    } else if (!strcmp("--capture_dump", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.capture_dump_file = argv[++i];
+    } else if (!strcmp("--archive_file", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.archive_file = argv[++i];
+    } else if (!strcmp("--replay", argv[i]) && arg_has_value(i, argc, argv)) {
+      enc_config.replay_file = argv[++i];
+    } else if (!strcmp("--regulate_timestamps", argv[i])) {
+      enc_config.regulate_timestamps = true;
+    } else if (!strcmp("--thumbnail_interval", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.thumbnail.interval = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--thumbnail_width", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.thumbnail.width = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--thumbnail_quality", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.thumbnail.quality = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--quality_interval", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.quality.interval = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--quality_max_cpu", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.quality.max_cpu = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--text_track", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      const std::string kind = argv[++i];
+      enc_config.text_track.enabled = true;
+      if (kind == "subtitles")
+        enc_config.text_track.kind = webmlive::TextTrackSettings::kSubtitles;
+      else if (kind == "captions")
+        enc_config.text_track.kind = webmlive::TextTrackSettings::kCaptions;
+      else
+        LOG(ERROR) << "Invalid --text_track value: " << kind;
+    } else if (!strcmp("--text_input", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.text_track.input_file = argv[++i];
+    } else if (!strcmp("--text_stream_timing", argv[i])) {
+      enc_config.text_track.live_timing = false;
+    } else if (!strcmp("--text_language", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.text_track.language = argv[++i];
+    } else if (!strcmp("--text_name", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.text_track.name = argv[++i];
+    } else if (!strcmp("--encrypt_key_id", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.encryption.enabled = true;
+      if (!webmlive::ParseHexBytes(argv[++i], &enc_config.encryption.key_id))
+        LOG(ERROR) << "Invalid --encrypt_key_id value: " << argv[i];
+    } else if (!strcmp("--encrypt_key", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.encryption.enabled = true;
+      if (!webmlive::ParseHexBytes(argv[++i], &enc_config.encryption.key))
+        LOG(ERROR) << "Invalid --encrypt_key value.";
+    } else if (!strcmp("--capture_watchdog", argv[i])) {
+      enc_config.capture_watchdog.enabled = true;
+    } else if (!strcmp("--capture_slate", argv[i])) {
+      enc_config.capture_watchdog.enabled = true;
+      enc_config.capture_watchdog.slate = true;
+    } else if (!strcmp("--stall_timeout", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.capture_watchdog.enabled = true;
+      enc_config.capture_watchdog.stall_timeout = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--max_restarts", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.capture_watchdog.enabled = true;
+      enc_config.capture_watchdog.max_restarts = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--headless", argv[i])) {
+      config.headless = true;
+    } else if (!strcmp("--host", argv[i]) && arg_has_value(i, argc, argv)) {
+      config.host_file = argv[++i];
+    } else if (!strcmp("--host_workers", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      config.host_workers = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--service", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      config.control_settings.port = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--vpx_context_pool", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      config.vpx_context_pool = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--channel_priority", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      config.channel_priority = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--cpu_budget", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      config.cpu_governor.enabled = true;
+      config.cpu_governor.budget = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--alloc_check", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      config.allocation_check_warmup = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--metrics_port", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      config.metrics_settings.port = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--thread_priority", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      unparsed_priorities.push_back(argv[++i]);
+    } else if (!strcmp("--thread_affinity", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      unparsed_affinities.push_back(argv[++i]);
+    } else if (!strcmp("--thread_mmcss", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      unparsed_mmcss_tasks.push_back(argv[++i]);
+    } else if (!strcmp("--capture_mmcss", argv[i])) {
+      capture_mmcss = true;
+    } else if (!strcmp("--free_run", argv[i])) {
+      enc_config.free_run = true;
     } else if (!strcmp("--vmanual", argv[i])) {
       enc_config.ui_opts.manual_video_config = true;
     } else if (!strcmp("--vwidth", argv[i]) && arg_has_value(i, argc, argv)) {
@@ -298,6 +1791,59 @@ void parse_command_line(int argc, const char** argv,
     } else if (!strcmp("--vframe_rate", argv[i]) &&
                arg_has_value(i, argc, argv)) {
       enc_config.requested_video_config.frame_rate = strtod(argv[++i], NULL);
+    } else if (!strcmp("--vcrop", argv[i]) && arg_has_value(i, argc, argv)) {
+      webmlive::VideoConfig& video_config = enc_config.requested_video_config;
+      if (sscanf(argv[++i], "%d,%d,%d,%d", &video_config.crop_left,
+                 &video_config.crop_top, &video_config.crop_width,
+                 &video_config.crop_height) != 4) {
+        LOG(ERROR) << "Invalid --vcrop value: " << argv[i];
+      }
+    } else if (!strcmp("--vpad", argv[i]) && arg_has_value(i, argc, argv)) {
+      enc_config.requested_video_config.pad_alignment =
+          strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--vout_frame_rate", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.output_frame_rate = strtod(argv[++i], NULL);
+    } else if (!strcmp("--vdrop_stale", argv[i])) {
+      enc_config.video_drop_policy =
+          webmlive::WebmEncoderConfig::kDropStaleFrames;
+    } else if (!strcmp("--vlatency_budget", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.video_latency_budget = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--vpool_adaptive", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      webmlive::PoolDepthSettings& depth = enc_config.video_pool_depth;
+      if (sscanf(argv[++i], "%d,%d", &depth.min_depth, &depth.max_depth) ==
+          2) {
+        depth.enabled = true;
+      } else {
+        LOG(ERROR) << "Invalid --vpool_adaptive value: " << argv[i];
+      }
+    } else if (!strcmp("--vsegment_rate", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.segment_rate.enabled = true;
+      enc_config.segment_rate.tolerance = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--vconvert_threads", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.video_conversion_threads = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--gpu_video_processing", argv[i])) {
+      enc_config.gpu_video_processing = true;
+    } else if (!strcmp("--deinterlace", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      const std::string mode = argv[++i];
+      if (mode == "auto")
+        enc_config.deinterlace.mode = webmlive::DeinterlaceSettings::kAuto;
+      else if (mode == "force")
+        enc_config.deinterlace.mode = webmlive::DeinterlaceSettings::kForce;
+      else
+        LOG(ERROR) << "Invalid --deinterlace value: " << mode;
+    } else if (!strcmp("--deinterlace_threshold", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.deinterlace.threshold = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--video_passthrough", argv[i])) {
+      enc_config.video_passthrough = true;
+    } else if (!strcmp("--vcapture_times", argv[i])) {
+      enc_config.capture_time_watermarks = true;
     }
 
     //
@@ -320,6 +1866,35 @@ void parse_command_line(int argc, const char** argv,
     } else if (!strcmp("--vorbis_lowpass_frequency", argv[i]) &&
                arg_has_value(i, argc, argv)) {
       enc_config.vorbis_config.lowpass_frequency = strtod(argv[++i], NULL);
+    } else if (!strcmp("--vorbis_sample_rate", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.vorbis_config.sample_rate = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--vorbis_channels", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.vorbis_config.channels = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--vorbis_warmup", argv[i])) {
+      enc_config.vorbis_config.warmup = true;
+    } else if (!strcmp("--vorbis_rendition", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      unparsed_audio_renditions.push_back(argv[++i]);
+    }
+
+    //
+    // Opus encoder options.
+    //
+    else if (!strcmp("--opus", argv[i])) {
+      enc_config.audio_codec = webmlive::kAudioFormatOpus;
+    } else if (!strcmp("--opus_bitrate", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.opus_config.bitrate = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--opus_complexity", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.opus_config.complexity = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--opus_frame_duration", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.opus_config.frame_duration = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--opus_low_delay", argv[i])) {
+      enc_config.opus_config.low_delay = true;
     }
 
     //
@@ -327,9 +1902,27 @@ void parse_command_line(int argc, const char** argv,
     else if (!strcmp("--vpx_keyframe_interval", argv[i]) &&
                arg_has_value(i, argc, argv)) {
       enc_config.vpx_config.keyframe_interval = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--vpx_aligned_keyframes", argv[i])) {
+      enc_config.vpx_config.aligned_keyframes = true;
+    } else if (!strcmp("--vpx_intra_refresh", argv[i])) {
+      enc_config.vpx_config.intra_refresh = true;
+    } else if (!strcmp("--vpx_min_keyframe_request_interval", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.vpx_config.min_keyframe_request_interval =
+          strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--vpx_scene_cut", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.vpx_config.scene_cut_threshold = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--vpx_min_scene_cut_interval", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.vpx_config.min_scene_cut_interval =
+          strtol(argv[++i], NULL, 10);
     } else if (!strcmp("--vpx_bitrate", argv[i]) &&
                arg_has_value(i, argc, argv)) {
       enc_config.vpx_config.bitrate = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--vpx_rendition", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      unparsed_renditions.push_back(argv[++i]);
     } else if (!strcmp("--vpx_codec", argv[i]) &&
                arg_has_value(i, argc, argv)) {
       std::string vpx_codec_value = argv[++i];
@@ -339,6 +1932,17 @@ void parse_command_line(int argc, const char** argv,
         enc_config.vpx_config.codec = webmlive::kVideoFormatVP9;
       else
         LOG(ERROR) << "Invalid --vpx_codec value: " << vpx_codec_value;
+    } else if (!strcmp("--vpx_encoder", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      const std::string backend = argv[++i];
+      if (backend == kEncoderSoftware)
+        enc_config.vpx_config.encoder_backend = webmlive::kVideoEncoderSoftware;
+      else if (backend == kEncoderHardware)
+        enc_config.vpx_config.encoder_backend = webmlive::kVideoEncoderHardware;
+      else if (backend == kEncoderAuto)
+        enc_config.vpx_config.encoder_backend = webmlive::kVideoEncoderAuto;
+      else
+        LOG(ERROR) << "Invalid --vpx_encoder value: " << backend;
     } else if (!strcmp("--vpx_decimate", argv[i]) &&
                arg_has_value(i, argc, argv)) {
       enc_config.vpx_config.decimate = strtol(argv[++i], NULL, 10);
@@ -354,12 +1958,57 @@ void parse_command_line(int argc, const char** argv,
     } else if (!strcmp("--vpx_speed", argv[i]) &&
                arg_has_value(i, argc, argv)) {
       enc_config.vpx_config.speed = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--vpx_adaptive_speed", argv[i])) {
+      enc_config.vpx_config.adaptive_speed = true;
+    } else if (!strcmp("--adaptive_resolution", argv[i])) {
+      enc_config.adaptive_resolution = true;
+    } else if (!strcmp("--vpx_max_speed", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.vpx_config.max_speed = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--vpx_calibrate", argv[i])) {
+      enc_config.vpx_calibration.enabled = true;
+    } else if (!strcmp("--vpx_calibrate_codec", argv[i])) {
+      enc_config.vpx_calibration.enabled = true;
+      enc_config.vpx_calibration.choose_codec = true;
+    } else if (!strcmp("--vpx_calibrate_margin", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.vpx_calibration.safety_margin = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--vpx_calibrate_frames", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.vpx_calibration.clip_frames = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--vpx_calibrate_cache", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.vpx_calibration.cache_path = argv[++i];
+    } else if (!strcmp("--vpx_latency_budget", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.vpx_config.latency_budget = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--vpx_warmup_frames", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.vpx_config.warmup_frames = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--vpx_parallel_gops", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.vpx_config.parallel_gops = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--vpx_temporal_layers", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.vpx_config.temporal_layers = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--vpx_spatial_layers", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.vpx_config.spatial_layers = strtol(argv[++i], NULL, 10);
     } else if (!strcmp("--vpx_static_threshold", argv[i]) &&
                arg_has_value(i, argc, argv)) {
       enc_config.vpx_config.static_threshold = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--vpx_static_detection", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.vpx_config.static_detection = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--vpx_roi", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      unparsed_regions.push_back(argv[++i]);
     } else if (!strcmp("--vpx_threads", argv[i]) &&
                arg_has_value(i, argc, argv)) {
       enc_config.vpx_config.thread_count = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--vpx_cpu_cores", argv[i]) &&
+               arg_has_value(i, argc, argv)) {
+      enc_config.vpx_config.cpu_cores = strtol(argv[++i], NULL, 10);
     } else if (!strcmp("--vpx_overshoot", argv[i]) &&
                arg_has_value(i, argc, argv)) {
       enc_config.vpx_config.overshoot = strtol(argv[++i], NULL, 10);
@@ -419,56 +2068,1479 @@ void parse_command_line(int argc, const char** argv,
 
   // Store user form variables.
   store_string_map_entries(unparsed_vars, uploader_settings.form_variables);
-}
 
-// Calls |Init| and |Run| on |uploader| to start the uploader thread, which
-// uploads buffers when |UploadBuffer| is called on the uploader.
-int start_uploader(WebmEncoderConfig* ptr_config,
-                   webmlive::HttpUploader* ptr_uploader) {
-  int status = ptr_uploader->Init(ptr_config->uploader_settings);
-  if (status) {
-    LOG(ERROR) << "uploader Init failed, status=" << status;
-    return status;
+  // Store thread settings. --thread_mmcss overrides --capture_mmcss, and
+  // --thread_priority the low priorities of the thumbnail and quality
+  // monitor threads.
+  config.thread_settings["thumbnail"].priority =
+      webmlive::kThreadPriorityBelowNormal;
+  config.thread_settings["quality"].priority =
+      webmlive::kThreadPriorityLowest;
+  if (capture_mmcss) {
+    config.thread_settings["video_capture"].mmcss_task = "Capture";
+    config.thread_settings["desktop_capture"].mmcss_task = "Capture";
+    config.thread_settings["audio_capture"].mmcss_task = "Pro Audio";
   }
+  store_thread_settings(unparsed_priorities, kThreadPriority,
+                        config.thread_settings);
+  store_thread_settings(unparsed_affinities, kThreadAffinity,
+                        config.thread_settings);
+  store_thread_settings(unparsed_mmcss_tasks, kThreadMmcssTask,
+                        config.thread_settings);
 
-  if (ptr_config->uploader_settings.target_url.find('?') == std::string::npos) {
-    // When the URL lacks a query string the URL must be reconstructed.
-    std::ostringstream url;
+  store_regions_of_interest(unparsed_regions,
+                            enc_config.vpx_config.regions_of_interest);
 
-    // Rebuild it with query params included.
-    url << ptr_config->uploader_settings.target_url
-        << "?ns=" << ptr_config->uploader_settings.stream_name
-        << "&id=" << ptr_config->uploader_settings.stream_id
-        << kAgentQueryFragment
-        << kWebmItagQueryFragment;
+  // Store video renditions and cameras, and audio renditions. Done last:
+  // they copy the VPx and Vorbis settings.
+  store_renditions(unparsed_renditions, enc_config.vpx_config,
+                   enc_config.video_renditions);
+  store_audio_renditions(unparsed_audio_renditions, enc_config.vorbis_config,
+                         enc_config.audio_renditions);
+  store_cameras(unparsed_cameras, enc_config.vpx_config,
+                enc_config.video_cameras);
 
-    ptr_config->uploader_settings.target_url = url.str();
+  // Place the thread of each rendition with a node there, unless it has
+  // placement settings of its own.
+  for (size_t i = 0; i < enc_config.video_renditions.size(); ++i) {
+    const int node = enc_config.video_renditions[i].numa_node;
+    if (node == webmlive::NumaTopology::kNoNode) {
+      continue;
+    }
+    std::ostringstream thread_name;
+    thread_name << "rendition" << i + 1;
+    webmlive::ThreadSettings& settings =
+        config.thread_settings[thread_name.str()];
+    if (settings.affinity_mask == 0 &&
+        settings.numa_node == webmlive::NumaTopology::kNoNode) {
+      settings.numa_node = node;
+    }
   }
 
-  // Run the uploader (it goes idle and waits for a buffer).
-  status = ptr_uploader->Run();
+  // Applied last: the profile keeps the durations set by other options.
+  if (config.low_latency_audio) {
+    apply_low_latency_audio(&config);
+  }
+}
+
+// Returns true when |node| is |NumaTopology::kNoNode| or a node of the host.
+bool valid_numa_node(int node) {
+  return node == webmlive::NumaTopology::kNoNode ||
+         webmlive::NumaTopology::Instance()->FindNode(node) != NULL;
+}
+
+// Fills in the bitrates left at 0 in |ptr_config->bitrate_settings|, and
+// initializes |ptr_controller| with them.
+int init_bitrate_controller(WebmEncoderConfig* ptr_config,
+                            webmlive::BitrateController* ptr_controller) {
+  const webmlive::WebmEncoderConfig& enc_config = ptr_config->enc_config;
+  webmlive::BitrateControllerSettings& settings = ptr_config->bitrate_settings;
+  if (settings.max_bitrate == 0) {
+    settings.max_bitrate = enc_config.vpx_config.bitrate;
+  }
+  if (settings.min_bitrate == 0) {
+    settings.min_bitrate = std::max(settings.max_bitrate / 4, 1);
+  }
+
+  // Only Opus can change its bitrate mid-stream; Vorbis audio is fixed.
+  if (enc_config.disable_audio) {
+    settings.min_audio_bitrate = settings.max_audio_bitrate = 0;
+  } else if (enc_config.audio_codec == webmlive::kAudioFormatOpus) {
+    settings.max_audio_bitrate = enc_config.opus_config.bitrate;
+    settings.min_audio_bitrate = enc_config.opus_config.bitrate / 2;
+  } else {
+    settings.min_audio_bitrate = settings.max_audio_bitrate =
+        enc_config.vorbis_config.average_bitrate;
+  }
+  return ptr_controller->Init(settings);
+}
+
+// Sets the pacing rate of the uploaders from |ptr_config->upload_pacing| and
+// the nominal bitrates, and the process upload limit.
+void init_upload_pacing(WebmEncoderConfig* ptr_config) {
+  const webmlive::WebmEncoderConfig& enc_config = ptr_config->enc_config;
+  webmlive::HttpUploaderSettings& settings = ptr_config->uploader_settings;
+  if (ptr_config->upload_pacing > 0) {
+    int kbps = enc_config.disable_video ? 0 : enc_config.vpx_config.bitrate;
+    if (!enc_config.disable_audio) {
+      kbps += enc_config.audio_codec == webmlive::kAudioFormatOpus ?
+          enc_config.opus_config.bitrate :
+          enc_config.vorbis_config.average_bitrate;
+    }
+    settings.pacing_kbps =
+        static_cast<int>(static_cast<int64>(kbps) *
+                         ptr_config->upload_pacing / 100);
+    LOG(INFO) << "upload pacing: " << settings.pacing_kbps << " kbps";
+  }
+  if (ptr_config->upload_limit > 0) {
+    webmlive::UploadPacer::Instance()->SetRate(ptr_config->upload_limit,
+                                               settings.pacing_burst_ms);
+    LOG(INFO) << "upload limit: " << ptr_config->upload_limit << " kbps";
+  }
+}
+
+// Calls |Init| and |Run| on |uploader| to start the uploader thread, which
+// uploads buffers when |UploadBuffer| is called on the uploader.
+int start_uploader(WebmEncoderConfig* ptr_config,
+                   webmlive::HttpUploader* ptr_uploader) {
+  int status = ptr_uploader->Init(ptr_config->uploader_settings);
+  if (status) {
+    LOG(ERROR) << "uploader Init failed, status=" << status;
+    return status;
+  }
+
+  // Object URLs are named by the chunk ID instead.
+  if (ptr_config->uploader_settings.post_mode != webmlive::HTTP_PUT &&
+      ptr_config->uploader_settings.target_url.find('?') == std::string::npos) {
+    // When the URL lacks a query string the URL must be reconstructed.
+    std::ostringstream url;
+
+    // Rebuild it with query params included.
+    url << ptr_config->uploader_settings.target_url
+        << "?ns=" << ptr_config->uploader_settings.stream_name
+        << "&id=" << ptr_config->uploader_settings.stream_id
+        << kAgentQueryFragment
+        << kWebmItagQueryFragment;
+
+    ptr_config->uploader_settings.target_url = url.str();
+  }
+
+  // Run the uploader (it goes idle and waits for a buffer).
+  status = ptr_uploader->Run();
   if (status) {
     LOG(ERROR) << "uploader Run failed, status=" << status;
   }
   return status;
 }
 
+// Starts an uploader for each of |ptr_config->backup_urls| in
+// |ptr_backups|, maps |ptr_shm_sink| when |ptr_config->shm_sink| is enabled,
+// and passes |ptr_uploader|, the backups and the ring to |ptr_fanout|, which
+// is then run.
+int start_fanout(WebmEncoderConfig* ptr_config,
+                 webmlive::HttpUploader* ptr_uploader,
+                 UploaderList* ptr_backups,
+                 webmlive::SegmentRingWriter* ptr_shm_sink,
+                 webmlive::DataSinkFanout* ptr_fanout) {
+  int status = ptr_fanout->Init(webmlive::DataSinkFanoutSettings());
+  if (status == kSuccess) {
+    status = ptr_fanout->AddSink(ptr_uploader,
+                                 ptr_config->uploader_settings.target_url);
+  }
+  if (status == kSuccess && !ptr_config->shm_sink.shm_name.empty()) {
+    status = ptr_shm_sink->Init(ptr_config->shm_sink);
+    if (status == kSuccess) {
+      status = ptr_fanout->AddSink(ptr_shm_sink,
+                                   ptr_config->shm_sink.shm_name);
+    }
+  }
+  for (size_t i = 0; status == kSuccess &&
+       i < ptr_config->backup_urls.size(); ++i) {
+    std::unique_ptr<webmlive::HttpUploader> backup(
+        new (std::nothrow) webmlive::HttpUploader());  // NOLINT
+    if (!backup) {
+      return kNoMemory;
+    }
+    WebmEncoderConfig backup_config = *ptr_config;
+    backup_config.uploader_settings.target_url = ptr_config->backup_urls[i];
+    backup_config.uploader_settings.failover_urls.clear();
+    status = start_uploader(&backup_config, backup.get());
+    if (status == kSuccess) {
+      status = ptr_fanout->AddSink(backup.get(), ptr_config->backup_urls[i]);
+    }
+    ptr_backups->push_back(std::move(backup));
+  }
+  if (status == kSuccess) {
+    status = ptr_fanout->Run();
+  }
+  return status;
+}
+
+// Returns the milliseconds left of |stop_timeout| since |stop_time|, for
+// |HttpUploader::Stop(int)|: -1 when |stop_timeout| is 0, which waits
+// without limit.
+int stop_time_remaining(int stop_timeout,
+                        std::chrono::steady_clock::time_point stop_time) {
+  if (stop_timeout <= 0) {
+    return -1;
+  }
+  const int64 elapsed_ms = std::chrono::duration_cast<
+      std::chrono::milliseconds>(std::chrono::steady_clock::now() -
+                                 stop_time).count();
+  return static_cast<int>(std::max<int64>(stop_timeout - elapsed_ms, 0));
+}
+
+// Stops |ptr_fanout|, then the uploaders it fed, which share |timeout_ms| to
+// deliver the chunks they hold. See |HttpUploader::Stop(int)|.
+void stop_fanout(webmlive::DataSinkFanout* ptr_fanout,
+                 UploaderList* ptr_backups, int timeout_ms) {
+  const std::chrono::steady_clock::time_point stop_time =
+      std::chrono::steady_clock::now();
+  ptr_fanout->Stop();
+  std::vector<webmlive::DataSinkFanoutStats> fanout_stats;
+  if (ptr_fanout->GetStats(&fanout_stats) ==
+      webmlive::DataSinkFanout::kSuccess) {
+    for (size_t i = 0; i < fanout_stats.size(); ++i) {
+      const webmlive::DataSinkFanoutStats& stats = fanout_stats[i];
+      LOG(INFO) << stats.name << ": chunks written: " << stats.chunks_written
+                << " dropped: " << stats.chunks_dropped
+                << " failed writes: " << stats.write_failures;
+    }
+  }
+  // The uploaders keep uploading while each is stopped in turn.
+  for (size_t i = 0; i < ptr_backups->size(); ++i) {
+    (*ptr_backups)[i]->Stop(timeout_ms > 0 ?
+        stop_time_remaining(timeout_ms, stop_time) : timeout_ms);
+  }
+}
+
+// Calls |Init| and |Run| on |ptr_push_sink| to start the push sender thread,
+// which connects to the ingest server.
+int start_push_sink(const WebmEncoderConfig& config,
+                    webmlive::PushSink* ptr_push_sink) {
+  int status = ptr_push_sink->Init(config.push_settings);
+  if (status) {
+    LOG(ERROR) << "push sink Init failed, status=" << status;
+    return status;
+  }
+  status = ptr_push_sink->Run();
+  if (status) {
+    LOG(ERROR) << "push sink Run failed, status=" << status;
+  }
+  return status;
+}
+
+// Logs the median, 95th percentile and largest sample of |histogram|.
+void log_upload_histogram(const char* name,
+                          const webmlive::UploadHistogram& histogram) {
+  LOG(INFO) << name << ": samples " << histogram.count << " p50 "
+            << histogram.Percentile(50) << " p95 "
+            << histogram.Percentile(95) << " max " << histogram.max;
+}
+
+// Logs the counters of a buffer pool that has seen use.
+void log_pool_stats(const char* name, const webmlive::BufferPoolStats& stats) {
+  if (stats.commits == 0 && stats.full_rejections == 0) {
+    return;
+  }
+  LOG(INFO) << name << " pool: commits " << stats.commits << " decommits "
+            << stats.decommits << " drops " << stats.drops << " full "
+            << stats.full_rejections << " grown "
+            << stats.growth_allocations << " high water "
+            << stats.high_water_mark << "/" << stats.capacity
+            << " limit " << stats.limit << " average occupancy "
+            << stats.average_occupancy
+            << " lock waits " << stats.lock_waits << " ("
+            << stats.lock_wait_us << " us) bytes " << stats.bytes
+            << " peak bytes " << stats.peak_bytes;
+}
+
+// Logs the counters of a pipeline stage that has run.
+void log_stage_stats(const char* name,
+                     const webmlive::PipelineStageStats& stats) {
+  if (stats.steps == 0 && stats.idle_steps == 0) {
+    return;
+  }
+  LOG(INFO) << name << " stage: steps " << stats.steps << " idle "
+            << stats.idle_steps << " busy " << stats.busy_us / 1000
+            << " ms backpressure waits " << stats.backpressure_waits << " ("
+            << stats.backpressure_us / 1000 << " ms) status "
+            << stats.status;
+}
+
+// Logs the current and peak media data bytes of each subsystem.
+void log_memory_stats() {
+  webmlive::MemoryStats memory_stats;
+  webmlive::MemoryAccountant::Instance()->GetStats(&memory_stats);
+  for (int i = 0; i < webmlive::kNumMemorySubsystems; ++i) {
+    LOG(INFO) << "memory " << webmlive::MemorySubsystemName(i) << ": bytes "
+              << memory_stats.bytes[i] << " peak "
+              << memory_stats.peak_bytes[i];
+  }
+  LOG(INFO) << "memory total: bytes " << memory_stats.total_bytes
+            << " peak " << memory_stats.peak_total_bytes;
+}
+
+#ifdef WEBMLIVE_LATENCY_TRACING
+// Logs the median, 95th percentile and largest latency of each traced stage,
+// in microseconds.
+void log_latency_stats() {
+  webmlive::LatencyStats latency_stats;
+  webmlive::LatencyTracer::Instance()->GetStats(true, &latency_stats);
+  LOG(INFO) << "latency trace events: " << latency_stats.events
+            << " dropped: " << latency_stats.events_dropped
+            << " unmatched: " << latency_stats.events_unmatched;
+  const char* const kStreamNames[webmlive::kNumLatencyStreams] = {
+    "video", "audio"
+  };
+  for (int i = 0; i < webmlive::kNumLatencyStreams; ++i) {
+    for (int j = webmlive::kLatencyCommitted;
+         j < webmlive::kNumLatencyStages; ++j) {
+      const webmlive::LatencyHistogram& histogram = latency_stats.stages[i][j];
+      if (histogram.count > 0) {
+        LOG(INFO) << kStreamNames[i] << " latency to "
+                  << webmlive::LatencyStageName(j) << " (us): samples "
+                  << histogram.count << " p50 " << histogram.Percentile(50)
+                  << " p95 " << histogram.Percentile(95) << " max "
+                  << histogram.max;
+      }
+    }
+    const webmlive::LatencyHistogram& total = latency_stats.end_to_end[i];
+    if (total.count > 0) {
+      LOG(INFO) << kStreamNames[i] << " latency end to end (us): samples "
+                << total.count << " p50 " << total.Percentile(50) << " p95 "
+                << total.Percentile(95) << " max " << total.max;
+    }
+  }
+}
+#endif  // WEBMLIVE_LATENCY_TRACING
+
+// Logs the NUMA nodes of the host and the node of the channel.
+void log_numa_topology() {
+  const webmlive::NumaTopology* const topology =
+      webmlive::NumaTopology::Instance();
+  for (size_t i = 0; i < topology->nodes().size(); ++i) {
+    const webmlive::NumaNode& node = topology->nodes()[i];
+    LOG(INFO) << "NUMA node " << node.node << ": processors "
+              << node.processors << " group " << node.processor_group
+              << " mask 0x" << std::hex << node.processor_mask << std::dec
+              << " available bytes " << topology->AvailableBytes(node.node);
+  }
+  LOG(INFO) << "NUMA channel node "
+            << webmlive::ThreadRegistry::Instance()->default_numa_node();
+}
+
+// Logs the CPU use of the encoder's threads.
+void log_thread_cpu_stats() {
+  std::vector<webmlive::ThreadCpuStats> thread_stats;
+  webmlive::ThreadRegistry::Instance()->GetCpuStats(&thread_stats);
+  for (size_t i = 0; i < thread_stats.size(); ++i) {
+    const webmlive::ThreadCpuStats& stats = thread_stats[i];
+    LOG(INFO) << "thread " << stats.name << ": threads " << stats.threads
+              << " CPU time " << stats.cpu_time_us / 1000 << " ms cycles "
+              << stats.cycles;
+  }
+}
+
+#ifdef _WIN32
+// Stops the encoder loop of a headless run. The encoder and sinks are
+// stopped by |encoder_main()|, which has until the process is ended to do so
+// after a close or shutdown event.
+BOOL WINAPI console_control_handler(DWORD /*control_type*/) {
+  stop_requested = true;
+  return TRUE;
+}
+
+bool key_pressed() {
+  return _kbhit() != 0;
+}
+#else
+// Stops the encoder loop of a headless run on SIGINT or SIGTERM.
+void stop_signal_handler(int /*signal_number*/) {
+  stop_requested = true;
+}
+
+// Returns true once a line is available on stdin: the terminal is line
+// buffered.
+bool key_pressed() {
+  pollfd stdin_fd = {STDIN_FILENO, POLLIN, 0};
+  return poll(&stdin_fd, 1, 0) > 0 && (stdin_fd.revents & POLLIN) != 0;
+}
+#endif  // _WIN32
+
+// Routes console close events, or SIGINT and SIGTERM, to |stop_requested|.
+void install_stop_handler() {
+#ifdef _WIN32
+  SetConsoleCtrlHandler(console_control_handler, TRUE);
+#else
+  signal(SIGINT, stop_signal_handler);
+  signal(SIGTERM, stop_signal_handler);
+#endif
+}
+
+// Returns true when the encoder loop should stop: on a key press, or on a
+// console control event when |headless|.
+bool stop_requested_by_user(bool headless) {
+  return headless ? stop_requested.load() : key_pressed();
+}
+
+#ifdef WEBMLIVE_LATENCY_TRACING
+// Adds the latency trace histograms to |ptr_metrics|, as the median and 95th
+// percentile of each traced stage, in microseconds.
+void add_latency_metrics(webmlive::MetricsBuilder* ptr_metrics) {
+  webmlive::LatencyStats latency_stats;
+  webmlive::LatencyTracer::Instance()->GetStats(false, &latency_stats);
+  const char* const kStreamNames[webmlive::kNumLatencyStreams] = {
+    "video", "audio"
+  };
+  const double kQuantiles[] = {50, 95};
+  for (size_t q = 0; q < sizeof(kQuantiles) / sizeof(kQuantiles[0]); ++q) {
+    for (int i = 0; i < webmlive::kNumLatencyStreams; ++i) {
+      for (int j = webmlive::kLatencyCommitted;
+           j < webmlive::kNumLatencyStages; ++j) {
+        const webmlive::LatencyHistogram& histogram =
+            latency_stats.stages[i][j];
+        if (histogram.count == 0) {
+          continue;
+        }
+        std::ostringstream labels;
+        labels << "stream=\"" << kStreamNames[i] << "\",stage=\""
+               << webmlive::LatencyStageName(j) << "\",quantile=\""
+               << kQuantiles[q] / 100 << "\"";
+        ptr_metrics->AddGauge(
+            "webmlive_stage_latency_us",
+            "Latency from the previous traced stage, in microseconds.",
+            labels.str(), static_cast<double>(histogram.Percentile(
+                kQuantiles[q])));
+      }
+    }
+  }
+  for (size_t q = 0; q < sizeof(kQuantiles) / sizeof(kQuantiles[0]); ++q) {
+    for (int i = 0; i < webmlive::kNumLatencyStreams; ++i) {
+      const webmlive::LatencyHistogram& total = latency_stats.end_to_end[i];
+      if (total.count == 0) {
+        continue;
+      }
+      std::ostringstream labels;
+      labels << "stream=\"" << kStreamNames[i] << "\",quantile=\""
+             << kQuantiles[q] / 100 << "\"";
+      ptr_metrics->AddGauge(
+          "webmlive_end_to_end_latency_us",
+          "Latency from capture to the data sink, in microseconds.",
+          labels.str(), static_cast<double>(total.Percentile(kQuantiles[q])));
+    }
+  }
+}
+#endif  // WEBMLIVE_LATENCY_TRACING
+
+// Adds the buffer pool counters of |pool_stats| to |ptr_metrics|.
+void add_pool_metrics(const webmlive::EncoderPoolStats& pool_stats,
+                      webmlive::MetricsBuilder* ptr_metrics) {
+  const char* const kPoolNames[] = {
+    "video_input", "audio_input", "video_output", "audio_output", "scaler"
+  };
+  const webmlive::BufferPoolStats* const pools[] = {
+    &pool_stats.video_input, &pool_stats.audio_input,
+    &pool_stats.video_output, &pool_stats.audio_output, &pool_stats.scaler
+  };
+  const int kNumPools = sizeof(kPoolNames) / sizeof(kPoolNames[0]);
+  std::string labels[kNumPools];
+  for (int i = 0; i < kNumPools; ++i) {
+    labels[i] = std::string("pool=\"") + kPoolNames[i] + "\"";
+  }
+  for (int i = 0; i < kNumPools; ++i) {
+    ptr_metrics->AddGauge("webmlive_pool_occupancy",
+                          "Buffers waiting in a buffer pool.", labels[i],
+                          static_cast<double>(pools[i]->occupancy));
+  }
+  for (int i = 0; i < kNumPools; ++i) {
+    ptr_metrics->AddGauge("webmlive_pool_capacity",
+                          "Buffers a buffer pool holds.", labels[i],
+                          static_cast<double>(pools[i]->capacity));
+  }
+  for (int i = 0; i < kNumPools; ++i) {
+    ptr_metrics->AddCounter("webmlive_pool_full_rejections_total",
+                            "Buffers refused by a full buffer pool.",
+                            labels[i],
+                            static_cast<double>(pools[i]->full_rejections));
+  }
+  const char* const kStageNames[] = { "audio_encoder", "video_encoder" };
+  const webmlive::PipelineStageStats* const stages[] = {
+    &pool_stats.audio_encoder, &pool_stats.video_encoder
+  };
+  const int kNumStages = sizeof(kStageNames) / sizeof(kStageNames[0]);
+  for (int i = 0; i < kNumStages; ++i) {
+    const std::string stage_labels =
+        std::string("stage=\"") + kStageNames[i] + "\"";
+    ptr_metrics->AddCounter("webmlive_stage_backpressure_seconds_total",
+                            "Time a pipeline stage waited for a full queue.",
+                            stage_labels,
+                            stages[i]->backpressure_us / 1000000.0);
+  }
+}
+
+// Adds the media data bytes held by each subsystem, and their total, to
+// |ptr_metrics|.
+void add_memory_metrics(webmlive::MetricsBuilder* ptr_metrics) {
+  webmlive::MemoryStats memory_stats;
+  webmlive::MemoryAccountant::Instance()->GetStats(&memory_stats);
+  std::string labels[webmlive::kNumMemorySubsystems];
+  for (int i = 0; i < webmlive::kNumMemorySubsystems; ++i) {
+    labels[i] = std::string("subsystem=\"") +
+                webmlive::MemorySubsystemName(i) + "\"";
+  }
+  const char kBytesName[] = "webmlive_memory_bytes";
+  const char kBytesHelp[] = "Media data bytes held.";
+  const char kPeakName[] = "webmlive_memory_peak_bytes";
+  const char kPeakHelp[] = "Most media data bytes held at once.";
+  for (int i = 0; i < webmlive::kNumMemorySubsystems; ++i) {
+    ptr_metrics->AddGauge(kBytesName, kBytesHelp, labels[i],
+                          static_cast<double>(memory_stats.bytes[i]));
+  }
+  ptr_metrics->AddGauge(kBytesName, kBytesHelp, "subsystem=\"total\"",
+                        static_cast<double>(memory_stats.total_bytes));
+  for (int i = 0; i < webmlive::kNumMemorySubsystems; ++i) {
+    ptr_metrics->AddGauge(kPeakName, kPeakHelp, labels[i],
+                          static_cast<double>(memory_stats.peak_bytes[i]));
+  }
+  ptr_metrics->AddGauge(kPeakName, kPeakHelp, "subsystem=\"total\"",
+                        static_cast<double>(memory_stats.peak_total_bytes));
+}
+
+// Adds the per frame type profile of |profile_stats| to |ptr_metrics|: frame
+// and encode time totals, and the median and 95th percentile encode time and
+// size, and the mean quantizer, of the frames of the profile window.
+void add_frame_profile_metrics(const webmlive::FrameProfileStats& profile_stats,
+                               webmlive::MetricsBuilder* ptr_metrics) {
+  std::string labels[webmlive::kNumFrameProfileTypes];
+  for (int i = 0; i < webmlive::kNumFrameProfileTypes; ++i) {
+    labels[i] = std::string("type=\"") + webmlive::FrameProfileTypeName(i) +
+                "\"";
+  }
+  for (int i = 0; i < webmlive::kNumFrameProfileTypes; ++i) {
+    ptr_metrics->AddCounter("webmlive_video_frames_by_type_total",
+                            "Video frames encoded, by frame type.", labels[i],
+                            static_cast<double>(profile_stats.frames[i]));
+  }
+  for (int i = 0; i < webmlive::kNumFrameProfileTypes; ++i) {
+    ptr_metrics->AddCounter("webmlive_video_encode_seconds_by_type_total",
+                            "Video encode wall time, by frame type.",
+                            labels[i], profile_stats.encode_us[i] / 1000000.0);
+  }
+  ptr_metrics->AddGauge("webmlive_video_frame_profile_window_seconds",
+                        "Stream time covered by the frame type profile.", "",
+                        profile_stats.window_ms / 1000.0);
+  const double kQuantiles[] = {50, 95};
+  for (size_t q = 0; q < sizeof(kQuantiles) / sizeof(kQuantiles[0]); ++q) {
+    for (int i = 0; i < webmlive::kNumFrameProfileTypes; ++i) {
+      const webmlive::FrameTypeProfile& profile = profile_stats.types[i];
+      if (profile.encode_us.count == 0) {
+        continue;
+      }
+      std::ostringstream quantile_labels;
+      quantile_labels << labels[i] << ",quantile=\"" << kQuantiles[q] / 100
+                      << "\"";
+      ptr_metrics->AddGauge(
+          "webmlive_video_frame_encode_us",
+          "Video encode wall time per frame, in microseconds.",
+          quantile_labels.str(),
+          static_cast<double>(profile.encode_us.Percentile(kQuantiles[q])));
+    }
+  }
+  for (size_t q = 0; q < sizeof(kQuantiles) / sizeof(kQuantiles[0]); ++q) {
+    for (int i = 0; i < webmlive::kNumFrameProfileTypes; ++i) {
+      const webmlive::FrameTypeProfile& profile = profile_stats.types[i];
+      if (profile.bytes.count == 0) {
+        continue;
+      }
+      std::ostringstream quantile_labels;
+      quantile_labels << labels[i] << ",quantile=\"" << kQuantiles[q] / 100
+                      << "\"";
+      ptr_metrics->AddGauge(
+          "webmlive_video_frame_bytes", "Compressed video frame size.",
+          quantile_labels.str(),
+          static_cast<double>(profile.bytes.Percentile(kQuantiles[q])));
+    }
+  }
+  for (int i = 0; i < webmlive::kNumFrameProfileTypes; ++i) {
+    const webmlive::FrameProfileHistogram& quantizer =
+        profile_stats.types[i].quantizer;
+    if (quantizer.count == 0) {
+      continue;
+    }
+    ptr_metrics->AddGauge("webmlive_video_frame_quantizer",
+                          "Mean quantizer of the video frames, 0 to 63.",
+                          labels[i],
+                          static_cast<double>(quantizer.sum) / quantizer.count);
+  }
+}
+
+// Adds the use of the process's idle libvpx contexts to |ptr_metrics|.
+void add_vpx_context_pool_metrics(webmlive::MetricsBuilder* ptr_metrics) {
+  webmlive::VpxContextPoolStats pool_stats;
+  webmlive::VpxContextPool::Instance()->GetStats(&pool_stats);
+  ptr_metrics->AddCounter("webmlive_vpx_contexts_reused_total",
+                          "VPx encoders started with a pooled context.", "",
+                          static_cast<double>(pool_stats.reused));
+  ptr_metrics->AddCounter("webmlive_vpx_contexts_created_total",
+                          "VPx contexts created while the pool had none.",
+                          "", static_cast<double>(pool_stats.created));
+  ptr_metrics->AddCounter("webmlive_vpx_contexts_evicted_total",
+                          "Idle VPx contexts destroyed to make room.", "",
+                          static_cast<double>(pool_stats.evicted));
+  ptr_metrics->AddGauge("webmlive_vpx_contexts_idle",
+                        "Idle VPx contexts in the pool.", "",
+                        pool_stats.idle);
+}
+
+// Adds the NUMA topology, and the channel's placement on it, to
+// |ptr_metrics|.
+void add_numa_metrics(const webmlive::MediaArenaStats& arena_stats,
+                      webmlive::MetricsBuilder* ptr_metrics) {
+  const webmlive::NumaTopology* const topology =
+      webmlive::NumaTopology::Instance();
+  std::vector<std::string> labels(topology->nodes().size());
+  for (size_t i = 0; i < labels.size(); ++i) {
+    std::ostringstream label;
+    label << "node=\"" << topology->nodes()[i].node << "\"";
+    labels[i] = label.str();
+  }
+  for (size_t i = 0; i < labels.size(); ++i) {
+    ptr_metrics->AddGauge("webmlive_numa_node_processors",
+                          "Processors of the NUMA node.", labels[i],
+                          topology->nodes()[i].processors);
+  }
+  for (size_t i = 0; i < labels.size(); ++i) {
+    ptr_metrics->AddGauge(
+        "webmlive_numa_node_available_bytes",
+        "Free memory of the NUMA node, or -1 when unknown.", labels[i],
+        static_cast<double>(
+            topology->AvailableBytes(topology->nodes()[i].node)));
+  }
+  ptr_metrics->AddGauge(
+      "webmlive_numa_channel_node",
+      "NUMA node the channel runs on, or -1 when it is not placed.", "",
+      webmlive::ThreadRegistry::Instance()->default_numa_node());
+  ptr_metrics->AddGauge(
+      "webmlive_numa_arena_node_bytes",
+      "Media buffer slab bytes allocated from the memory of a chosen node.",
+      "", static_cast<double>(arena_stats.node_bytes));
+}
+
+// Adds the capture timestamp regulation counters of each stream to
+// |ptr_metrics|.
+void add_timestamp_metrics(const webmlive::CaptureTimestampStats& stats,
+                           webmlive::MetricsBuilder* ptr_metrics) {
+  const std::string kVideo = "stream=\"video\"";
+  const std::string kAudio = "stream=\"audio\"";
+  const webmlive::TimestampRegulatorStats& video = stats.video;
+  const webmlive::TimestampRegulatorStats& audio = stats.audio;
+  const char kAnomaliesName[] = "webmlive_capture_timestamp_anomalies_total";
+  const char kAnomaliesHelp[] =
+      "Capture timestamps repeated, skipped, or discontinuous.";
+  ptr_metrics->AddCounter(kAnomaliesName, kAnomaliesHelp,
+                          kVideo + ",kind=\"duplicate\"",
+                          static_cast<double>(video.duplicates));
+  ptr_metrics->AddCounter(kAnomaliesName, kAnomaliesHelp,
+                          kVideo + ",kind=\"skip\"",
+                          static_cast<double>(video.skips));
+  ptr_metrics->AddCounter(kAnomaliesName, kAnomaliesHelp,
+                          kVideo + ",kind=\"resync\"",
+                          static_cast<double>(video.resyncs));
+  ptr_metrics->AddCounter(kAnomaliesName, kAnomaliesHelp,
+                          kAudio + ",kind=\"duplicate\"",
+                          static_cast<double>(audio.duplicates));
+  ptr_metrics->AddCounter(kAnomaliesName, kAnomaliesHelp,
+                          kAudio + ",kind=\"skip\"",
+                          static_cast<double>(audio.skips));
+  ptr_metrics->AddCounter(kAnomaliesName, kAnomaliesHelp,
+                          kAudio + ",kind=\"resync\"",
+                          static_cast<double>(audio.resyncs));
+  const char kJitterName[] = "webmlive_capture_jitter_ms";
+  const char kJitterHelp[] =
+      "Smoothed deviation of capture timestamps from the regulated clock.";
+  ptr_metrics->AddGauge(kJitterName, kJitterHelp, kVideo, video.jitter_ms);
+  ptr_metrics->AddGauge(kJitterName, kJitterHelp, kAudio, audio.jitter_ms);
+  const char kDriftName[] = "webmlive_capture_drift_ppm";
+  const char kDriftHelp[] =
+      "Capture clock drift from the nominal rate, in parts per million.";
+  ptr_metrics->AddGauge(kDriftName, kDriftHelp, kVideo, video.drift_ppm);
+  ptr_metrics->AddGauge(kDriftName, kDriftHelp, kAudio, audio.drift_ppm);
+}
+
+// Adds the per-channel audio levels and the silence counters to
+// |ptr_metrics|.
+void add_audio_level_metrics(const webmlive::AudioLevelStats& stats,
+                             webmlive::MetricsBuilder* ptr_metrics) {
+  for (int i = 0; i < stats.channels; ++i) {
+    std::ostringstream labels;
+    labels << "channel=\"" << i << "\"";
+    ptr_metrics->AddGauge("webmlive_audio_peak_dbfs",
+                          "Audio input peak level over the last window.",
+                          labels.str(), stats.peak[i]);
+    ptr_metrics->AddGauge("webmlive_audio_rms_dbfs",
+                          "Audio input RMS level over the last window.",
+                          labels.str(), stats.rms[i]);
+  }
+  ptr_metrics->AddGauge("webmlive_audio_silent",
+                        "1 while the audio input is silent.", "",
+                        stats.silent ? 1.0 : 0.0);
+  ptr_metrics->AddCounter("webmlive_audio_silent_periods_total",
+                          "Silent periods of the audio input.", "",
+                          static_cast<double>(stats.silent_periods));
+  ptr_metrics->AddCounter("webmlive_audio_silent_ms_total",
+                          "Time the audio input was silent.", "",
+                          static_cast<double>(stats.silent_ms));
+}
+
+// Adds the audio drift estimate and correction to |ptr_metrics|.
+void add_audio_drift_metrics(const webmlive::AudioDriftStats& stats,
+                             webmlive::MetricsBuilder* ptr_metrics) {
+  ptr_metrics->AddGauge("webmlive_audio_drift_ms",
+                        "Smoothed audio sample time minus capture time.", "",
+                        stats.drift_ms);
+  ptr_metrics->AddGauge("webmlive_audio_drift_correction_ppm",
+                        "Audio resampling correction.", "",
+                        stats.correction_ppm);
+  ptr_metrics->AddCounter("webmlive_audio_drift_resyncs_total",
+                          "Audio discontinuities the drift corrector "
+                          "restarted on.", "",
+                          static_cast<double>(stats.resyncs));
+}
+
+// Adds the container statistics of each muxer to |ptr_metrics|. The cluster
+// size distribution is exported as cumulative |le| buckets.
+void add_muxer_metrics(const std::vector<webmlive::MuxerStats>& muxer_stats,
+                       webmlive::MetricsBuilder* ptr_metrics) {
+  typedef webmlive::MuxerStats MuxerStats;
+  std::vector<std::string> labels(muxer_stats.size());
+  for (size_t i = 0; i < muxer_stats.size(); ++i) {
+    labels[i] = "muxer=\"" + muxer_stats[i].muxer_id + "\"";
+  }
+  const char kBytesName[] = "webmlive_muxer_bytes_total";
+  const char kBytesHelp[] = "Bytes muxed, by element type.";
+  for (size_t i = 0; i < muxer_stats.size(); ++i) {
+    const MuxerStats& stats = muxer_stats[i];
+    ptr_metrics->AddCounter(kBytesName, kBytesHelp,
+                            labels[i] + ",element=\"metadata\"",
+                            static_cast<double>(stats.metadata_bytes));
+    ptr_metrics->AddCounter(kBytesName, kBytesHelp,
+                            labels[i] + ",element=\"cluster_header\"",
+                            static_cast<double>(stats.cluster_header_bytes));
+    ptr_metrics->AddCounter(kBytesName, kBytesHelp,
+                            labels[i] + ",element=\"block_header\"",
+                            static_cast<double>(stats.block_header_bytes));
+    ptr_metrics->AddCounter(kBytesName, kBytesHelp,
+                            labels[i] + ",element=\"block_payload\"",
+                            static_cast<double>(stats.block_payload_bytes));
+  }
+  for (size_t i = 0; i < muxer_stats.size(); ++i) {
+    const MuxerStats& stats = muxer_stats[i];
+    int64 clusters = 0;
+    int64 bound = MuxerStats::kFirstClusterSizeBound;
+    for (int j = 0; j < MuxerStats::kClusterSizeBuckets; ++j, bound <<= 2) {
+      clusters += stats.cluster_size_counts[j];
+      std::ostringstream le;
+      if (j < MuxerStats::kClusterSizeBuckets - 1) {
+        le << bound;
+      } else {
+        le << "+Inf";
+      }
+      ptr_metrics->AddCounter("webmlive_muxer_cluster_bytes_bucket",
+                              "Clusters muxed, by size.",
+                              labels[i] + ",le=\"" + le.str() + "\"",
+                              static_cast<double>(clusters));
+    }
+  }
+  for (size_t i = 0; i < muxer_stats.size(); ++i) {
+    ptr_metrics->AddCounter("webmlive_muxer_splices_total",
+                            "Clips spliced into the stream.", labels[i],
+                            static_cast<double>(muxer_stats[i].splices));
+  }
+  for (size_t i = 0; i < muxer_stats.size(); ++i) {
+    ptr_metrics->AddCounter(
+        "webmlive_muxer_splice_dropped_frames_total",
+        "Live frames dropped after a splice.", labels[i],
+        static_cast<double>(muxer_stats[i].splice_dropped_frames));
+  }
+  for (size_t i = 0; i < muxer_stats.size(); ++i) {
+    ptr_metrics->AddCounter("webmlive_muxer_cluster_bytes_sum",
+                            "Bytes of the clusters muxed.", labels[i],
+                            static_cast<double>(muxer_stats[i].cluster_bytes));
+  }
+  for (size_t i = 0; i < muxer_stats.size(); ++i) {
+    ptr_metrics->AddCounter("webmlive_muxer_cluster_bytes_count",
+                            "Clusters muxed.", labels[i],
+                            static_cast<double>(muxer_stats[i].clusters));
+  }
+  for (size_t i = 0; i < muxer_stats.size(); ++i) {
+    ptr_metrics->AddGauge("webmlive_muxer_max_cluster_bytes",
+                          "Largest cluster muxed.", labels[i],
+                          static_cast<double>(
+                              muxer_stats[i].max_cluster_bytes));
+  }
+  for (size_t i = 0; i < muxer_stats.size(); ++i) {
+    ptr_metrics->AddCounter("webmlive_muxer_blocks_total",
+                            "Blocks muxed.", labels[i],
+                            static_cast<double>(muxer_stats[i].blocks));
+  }
+  for (size_t i = 0; i < muxer_stats.size(); ++i) {
+    ptr_metrics->AddGauge("webmlive_muxer_max_cluster_blocks",
+                          "Most blocks muxed in one cluster.", labels[i],
+                          static_cast<double>(
+                              muxer_stats[i].max_cluster_blocks));
+  }
+  const char kGapName[] = "webmlive_muxer_interleave_gap_ms";
+  const char kGapHelp[] =
+      "Timestamp of the last frame muxed minus that of the last frame of "
+      "the other media type.";
+  for (size_t i = 0; i < muxer_stats.size(); ++i) {
+    ptr_metrics->AddGauge(kGapName, kGapHelp,
+                          labels[i] + ",track=\"audio\"",
+                          static_cast<double>(
+                              muxer_stats[i].audio_interleave_gap));
+    ptr_metrics->AddGauge(kGapName, kGapHelp,
+                          labels[i] + ",track=\"video\"",
+                          static_cast<double>(
+                              muxer_stats[i].video_interleave_gap));
+  }
+  const char kMaxGapName[] = "webmlive_muxer_max_interleave_gap_ms";
+  const char kMaxGapHelp[] = "Largest interleave gap of the muxer.";
+  for (size_t i = 0; i < muxer_stats.size(); ++i) {
+    ptr_metrics->AddGauge(kMaxGapName, kMaxGapHelp,
+                          labels[i] + ",track=\"audio\"",
+                          static_cast<double>(
+                              muxer_stats[i].max_audio_interleave_gap));
+    ptr_metrics->AddGauge(kMaxGapName, kMaxGapHelp,
+                          labels[i] + ",track=\"video\"",
+                          static_cast<double>(
+                              muxer_stats[i].max_video_interleave_gap));
+  }
+  for (size_t i = 0; i < muxer_stats.size(); ++i) {
+    ptr_metrics->AddCounter("webmlive_muxer_chunks_read_total",
+                            "Chunks read from the muxer.", labels[i],
+                            static_cast<double>(muxer_stats[i].chunks_read));
+  }
+  for (size_t i = 0; i < muxer_stats.size(); ++i) {
+    ptr_metrics->AddCounter("webmlive_muxer_read_latency_us_total",
+                            "Time from the end of each chunk until it was "
+                            "read.", labels[i],
+                            static_cast<double>(
+                                muxer_stats[i].read_latency_us));
+  }
+  for (size_t i = 0; i < muxer_stats.size(); ++i) {
+    ptr_metrics->AddGauge("webmlive_muxer_max_read_latency_us",
+                          "Largest time from the end of a chunk until it was "
+                          "read.", labels[i],
+                          static_cast<double>(
+                              muxer_stats[i].max_read_latency_us));
+  }
+}
+
+// Adds the CPU use of the encoder's threads to |ptr_metrics|.
+void add_thread_metrics(webmlive::MetricsBuilder* ptr_metrics) {
+  std::vector<webmlive::ThreadCpuStats> thread_stats;
+  webmlive::ThreadRegistry::Instance()->GetCpuStats(&thread_stats);
+  std::vector<std::string> labels(thread_stats.size());
+  for (size_t i = 0; i < thread_stats.size(); ++i) {
+    labels[i] = "thread=\"" + thread_stats[i].name + "\"";
+  }
+  for (size_t i = 0; i < thread_stats.size(); ++i) {
+    ptr_metrics->AddCounter(
+        "webmlive_thread_cpu_seconds_total",
+        "User and kernel time of the threads with a name.", labels[i],
+        thread_stats[i].cpu_time_us / 1000000.0);
+  }
+  for (size_t i = 0; i < thread_stats.size(); ++i) {
+    ptr_metrics->AddCounter("webmlive_thread_cycles_total",
+                            "CPU cycles of the threads with a name.",
+                            labels[i],
+                            static_cast<double>(thread_stats[i].cycles));
+  }
+}
+
+// Builds the metrics page from the encoder and sink counters, and publishes
+// it to |ptr_server|. |ptr_upload_stats| is NULL when the push sink is in
+// use, and |ptr_push_stats| NULL otherwise. |ptr_fault_sink| is NULL unless
+// faults are injected. Rates are computed over the time
+// since the previous page, whose counters are kept in |ptr_state|.
+void publish_metrics(int64 now_ms, const webmlive::WebmEncoder& encoder,
+                     const webmlive::SinkStats& sink_stats,
+                     const webmlive::HttpUploaderStats* ptr_upload_stats,
+                     const webmlive::PushSinkStats* ptr_push_stats,
+                     const webmlive::FaultInjectionSink* ptr_fault_sink,
+                     MetricsState* ptr_state,
+                     webmlive::MetricsServer* ptr_server) {
+  webmlive::EncodeStats encode_stats;
+  webmlive::VideoDropStats drop_stats;
+  webmlive::EncoderPoolStats pool_stats;
+  if (encoder.GetEncodeStats(&encode_stats) ||
+      encoder.GetVideoDropStats(&drop_stats) ||
+      encoder.GetPoolStats(&pool_stats)) {
+    LOG(ERROR) << "cannot read encoder stats for metrics.";
+    return;
+  }
+  const std::string kVideo = "stream=\"video\"";
+  const std::string kAudio = "stream=\"audio\"";
+  webmlive::MetricsBuilder metrics;
+
+  // Encoders.
+  metrics.AddCounter("webmlive_encoded_total",
+                     "Video frames and audio buffers encoded.", kVideo,
+                     static_cast<double>(encode_stats.video_frames_encoded));
+  metrics.AddCounter("webmlive_encoded_total",
+                     "Video frames and audio buffers encoded.", kAudio,
+                     static_cast<double>(encode_stats.audio_buffers_encoded));
+  metrics.AddCounter("webmlive_encode_seconds_total", "Time spent encoding.",
+                     kVideo, encode_stats.video_encode_us / 1000000.0);
+  metrics.AddCounter("webmlive_encode_seconds_total", "Time spent encoding.",
+                     kAudio, encode_stats.audio_encode_us / 1000000.0);
+  metrics.AddGauge("webmlive_video_degradation_level",
+                   "Adaptive resolution level of the primary video stream.",
+                   "", encode_stats.video_degradation_level);
+  metrics.AddCounter("webmlive_video_forced_keyframes_total",
+                     "Keyframes forced by keyframe requests.", "",
+                     static_cast<double>(encode_stats.video_forced_keyframes));
+  metrics.AddCounter("webmlive_video_scene_cut_keyframes_total",
+                     "Keyframes placed on scene cuts.", "",
+                     static_cast<double>(
+                         encode_stats.video_scene_cut_keyframes));
+  metrics.AddCounter("webmlive_video_degradation_changes_total",
+                     "Adaptive resolution level changes.", "",
+                     static_cast<double>(
+                         encode_stats.video_degradation_changes));
+  metrics.AddCounter("webmlive_muxed_bytes_total", "Compressed bytes muxed.",
+                     kVideo, static_cast<double>(encode_stats.video_bytes));
+  metrics.AddCounter("webmlive_muxed_bytes_total", "Compressed bytes muxed.",
+                     kAudio, static_cast<double>(encode_stats.audio_bytes));
+
+  // Pauses.
+  webmlive::PauseStats pause_stats;
+  if (encoder.GetPauseStats(&pause_stats) == webmlive::WebmEncoder::kSuccess) {
+    metrics.AddGauge("webmlive_paused", "1 while output is paused.", "",
+                     pause_stats.paused ? 1 : 0);
+    metrics.AddCounter("webmlive_paused_discarded_total",
+                       "Frames and audio buffers captured while paused.",
+                       kVideo,
+                       static_cast<double>(pause_stats.frames_discarded));
+    metrics.AddCounter("webmlive_paused_discarded_total",
+                       "Frames and audio buffers captured while paused.",
+                       kAudio,
+                       static_cast<double>(
+                           pause_stats.audio_buffers_discarded));
+  }
+
+  const MetricsState& last = *ptr_state;
+  const int64 frames = encode_stats.video_frames_encoded -
+                       last.encode_stats.video_frames_encoded;
+  const double interval = (now_ms - last.time_ms) / 1000.0;
+  const int64 bytes_uploaded = ptr_upload_stats ?
+      ptr_upload_stats->total_bytes_uploaded +
+          ptr_upload_stats->bytes_sent_current :
+      ptr_push_stats->bytes_sent;
+  if (last.time_ms > 0 && interval > 0) {
+    metrics.AddGauge("webmlive_video_fps",
+                     "Video frames encoded per second since the last update.",
+                     "", frames / interval);
+    if (frames > 0) {
+      metrics.AddGauge(
+          "webmlive_video_encode_ms",
+          "Average video encode time per frame since the last update.", "",
+          (encode_stats.video_encode_us - last.encode_stats.video_encode_us) /
+              1000.0 / frames);
+    }
+    metrics.AddGauge(
+        "webmlive_bitrate_kbps",
+        "Compressed bitrate muxed since the last update, in kilobits.",
+        kVideo,
+        (encode_stats.video_bytes - last.encode_stats.video_bytes) * 8 /
+            1000.0 / interval);
+    metrics.AddGauge(
+        "webmlive_bitrate_kbps",
+        "Compressed bitrate muxed since the last update, in kilobits.",
+        kAudio,
+        (encode_stats.audio_bytes - last.encode_stats.audio_bytes) * 8 /
+            1000.0 / interval);
+    metrics.AddGauge(
+        "webmlive_upload_kbps",
+        "Bitrate sent to the data sink since the last update, in kilobits.",
+        "", (bytes_uploaded - last.bytes_uploaded) * 8 / 1000.0 / interval);
+  }
+  ptr_state->time_ms = now_ms;
+  ptr_state->bytes_uploaded = bytes_uploaded;
+  ptr_state->encode_stats = encode_stats;
+
+  // Drops.
+  metrics.AddCounter("webmlive_video_frames_captured_total",
+                     "Video frames delivered by the capture source.", "",
+                     static_cast<double>(drop_stats.frames_captured));
+  const char kDropsName[] = "webmlive_video_frames_dropped_total";
+  const char kDropsHelp[] = "Video frames dropped.";
+  metrics.AddCounter(kDropsName, kDropsHelp, "reason=\"queue_full\"",
+                     static_cast<double>(drop_stats.queue_full_drops));
+  metrics.AddCounter(kDropsName, kDropsHelp, "reason=\"stale\"",
+                     static_cast<double>(drop_stats.stale_drops));
+  metrics.AddCounter(kDropsName, kDropsHelp, "reason=\"encoder\"",
+                     static_cast<double>(drop_stats.encoder_drops));
+  metrics.AddCounter(kDropsName, kDropsHelp, "reason=\"degradation\"",
+                     static_cast<double>(drop_stats.degradation_drops));
+  metrics.AddCounter(kDropsName, kDropsHelp, "reason=\"sink\"",
+                     static_cast<double>(sink_stats.dropped_video_frames));
+  metrics.AddCounter("webmlive_sink_chunks_dropped_total",
+                     "Chunks dropped by the sink policy.", "",
+                     static_cast<double>(sink_stats.dropped_chunks));
+  metrics.AddCounter("webmlive_sink_chunks_spilled_total",
+                     "Chunks moved to the spill file by the sink policy.", "",
+                     static_cast<double>(sink_stats.spilled_chunks));
+  metrics.AddCounter("webmlive_sink_chunks_replayed_total",
+                     "Spilled chunks written to the data sink.", "",
+                     static_cast<double>(sink_stats.replayed_chunks));
+  metrics.AddGauge("webmlive_sink_spill_pending_bytes",
+                   "Bytes in the spill file not yet written to the sink.", "",
+                   static_cast<double>(sink_stats.spill_pending_bytes));
+  webmlive::CaptureTimestampStats timestamp_stats;
+  if (encoder.GetTimestampStats(&timestamp_stats) ==
+      webmlive::WebmEncoder::kSuccess) {
+    add_timestamp_metrics(timestamp_stats, &metrics);
+  }
+  webmlive::FrameRateConverterStats frame_rate_stats;
+  if (encoder.GetFrameRateStats(&frame_rate_stats) ==
+      webmlive::WebmEncoder::kSuccess) {
+    metrics.AddCounter("webmlive_frame_rate_dropped_frames_total",
+                       "Captured frames dropped by frame rate conversion.", "",
+                       static_cast<double>(frame_rate_stats.frames_dropped));
+    metrics.AddCounter("webmlive_frame_rate_skipped_slots_total",
+                       "Output frame slots no captured frame filled.", "",
+                       static_cast<double>(frame_rate_stats.slots_skipped));
+  }
+  webmlive::SegmentAlignerStats align_stats;
+  if (encoder.GetSegmentAlignmentStats(&align_stats) ==
+      webmlive::WebmEncoder::kSuccess) {
+    metrics.AddCounter("webmlive_segment_boundaries_merged_total",
+                       "Video segment starts without an audio segment of "
+                       "their own.", "",
+                       static_cast<double>(align_stats.merged_boundaries));
+    metrics.AddGauge("webmlive_segment_alignment_max_offset_ms",
+                     "Largest distance from a video segment start to its "
+                     "audio segment start.", "",
+                     static_cast<double>(align_stats.max_offset_ms));
+  }
+  webmlive::SegmentRateStats rate_stats;
+  if (encoder.GetSegmentRateStats(&rate_stats) ==
+      webmlive::WebmEncoder::kSuccess) {
+    metrics.AddCounter("webmlive_segment_rate_segments_total",
+                       "Video segments completed under segment rate control.",
+                       "", static_cast<double>(rate_stats.segments));
+    metrics.AddCounter("webmlive_segment_rate_within_tolerance_total",
+                       "Video segments within tolerance of their budget.", "",
+                       static_cast<double>(
+                           rate_stats.segments_within_tolerance));
+    metrics.AddCounter("webmlive_segment_rate_bitrate_changes_total",
+                       "Bitrate changes made by segment rate control.", "",
+                       static_cast<double>(rate_stats.bitrate_changes));
+  }
+  webmlive::SegmentDurationStats duration_stats;
+  if (encoder.GetSegmentDurationStats(&duration_stats) ==
+      webmlive::WebmEncoder::kSuccess) {
+    metrics.AddCounter("webmlive_segment_duration_changes_total",
+                       "Segment duration changes made from upload times.", "",
+                       static_cast<double>(duration_stats.lengthened +
+                                           duration_stats.shortened));
+    metrics.AddGauge("webmlive_segment_duration_ms",
+                     "Segment duration last scheduled.", "",
+                     static_cast<double>(duration_stats.duration));
+    metrics.AddGauge("webmlive_segment_upload_load_percent",
+                     "Highest upload time of the last segment period, in "
+                     "percent of the segment duration.", "",
+                     static_cast<double>(duration_stats.last_load));
+  }
+  webmlive::AudioLevelStats level_stats;
+  if (encoder.GetAudioLevelStats(&level_stats) ==
+      webmlive::WebmEncoder::kSuccess) {
+    add_audio_level_metrics(level_stats, &metrics);
+  }
+  webmlive::AudioDriftStats drift_stats;
+  if (encoder.GetAudioDriftStats(&drift_stats) ==
+      webmlive::WebmEncoder::kSuccess) {
+    add_audio_drift_metrics(drift_stats, &metrics);
+  }
+  std::vector<webmlive::MuxerStats> muxer_stats;
+  if (encoder.GetMuxerStats(&muxer_stats) ==
+      webmlive::WebmEncoder::kSuccess) {
+    add_muxer_metrics(muxer_stats, &metrics);
+  }
+  webmlive::TextTrackStats text_stats;
+  if (encoder.GetTextTrackStats(&text_stats) ==
+      webmlive::WebmEncoder::kSuccess) {
+    metrics.AddCounter("webmlive_text_cues_written_total",
+                       "Text track cues muxed.", "",
+                       static_cast<double>(text_stats.cues_written));
+    metrics.AddCounter("webmlive_text_cues_dropped_total",
+                       "Text track cues dropped with the cue queue full.", "",
+                       static_cast<double>(text_stats.cues_dropped));
+    metrics.AddCounter("webmlive_text_cues_late_total",
+                       "Text track cues muxed after their start time.", "",
+                       static_cast<double>(text_stats.cues_late));
+    metrics.AddCounter("webmlive_text_parse_errors_total",
+                       "Malformed WebVTT cue blocks skipped.", "",
+                       static_cast<double>(text_stats.parse_errors));
+  }
+  webmlive::EncryptionStats encryption_stats;
+  if (encoder.GetEncryptionStats(&encryption_stats) ==
+      webmlive::WebmEncoder::kSuccess) {
+    metrics.AddCounter("webmlive_encrypted_blocks_total",
+                       "Audio and video blocks encrypted.", "",
+                       static_cast<double>(encryption_stats.blocks_encrypted));
+    metrics.AddCounter("webmlive_encrypted_bytes_total",
+                       "Payload bytes of the blocks encrypted.", "",
+                       static_cast<double>(encryption_stats.bytes_encrypted));
+    metrics.AddCounter("webmlive_encryption_key_rotations_total",
+                       "Content keys rotated in at segment starts.", "",
+                       static_cast<double>(encryption_stats.key_rotations));
+  }
+  std::vector<webmlive::RepresentationStats> representation_stats;
+  if (encoder.GetRepresentationStats(&representation_stats) ==
+      webmlive::WebmEncoder::kSuccess) {
+    for (size_t i = 0; i < representation_stats.size(); ++i) {
+      const webmlive::RepresentationStats& stats = representation_stats[i];
+      const std::string labels =
+          std::string("representation=\"") + stats.rep_id + "\"";
+      metrics.AddCounter("webmlive_dash_segments_total",
+                         "DASH media segments written.", labels,
+                         static_cast<double>(stats.segments));
+      metrics.AddCounter("webmlive_dash_segment_bytes_total",
+                         "Bytes of the DASH media segments written.", labels,
+                         static_cast<double>(stats.bytes));
+      metrics.AddGauge("webmlive_dash_configured_bandwidth_bps",
+                       "Bandwidth of the configured bitrate.", labels,
+                       static_cast<double>(stats.configured_bandwidth));
+      metrics.AddGauge("webmlive_dash_average_bandwidth_bps",
+                       "Measured bitrate of all segments.", labels,
+                       static_cast<double>(stats.average_bandwidth));
+      metrics.AddGauge("webmlive_dash_peak_bandwidth_bps",
+                       "Highest measured segment bitrate.", labels,
+                       static_cast<double>(stats.peak_bandwidth));
+      metrics.AddGauge("webmlive_dash_window_peak_bandwidth_bps",
+                       "Highest segment bitrate of the bandwidth window.",
+                       labels,
+                       static_cast<double>(stats.window_peak_bandwidth));
+    }
+  }
+  webmlive::CaptureWatchdogStats watchdog_stats;
+  if (encoder.GetCaptureWatchdogStats(&watchdog_stats) ==
+      webmlive::WebmEncoder::kSuccess) {
+    metrics.AddCounter("webmlive_capture_stalls_total",
+                       "Capture restarts after a stall without input.", "",
+                       static_cast<double>(watchdog_stats.stalls));
+    metrics.AddCounter("webmlive_capture_aborts_total",
+                       "Capture restarts after a source failure.", "",
+                       static_cast<double>(watchdog_stats.aborts));
+    metrics.AddCounter("webmlive_capture_restarts_total",
+                       "Capture source restarts that succeeded.", "",
+                       static_cast<double>(watchdog_stats.restarts));
+    metrics.AddCounter("webmlive_capture_restart_failures_total",
+                       "Capture source restarts that failed.", "",
+                       static_cast<double>(watchdog_stats.restart_failures));
+    metrics.AddCounter("webmlive_capture_filler_frames_total",
+                       "Repeated frames delivered during capture gaps.", "",
+                       static_cast<double>(watchdog_stats.filler_frames));
+    metrics.AddCounter("webmlive_capture_gap_milliseconds_total",
+                       "Capture time lost to restarts.", "",
+                       static_cast<double>(watchdog_stats.gap_ms));
+    metrics.AddCounter("webmlive_capture_slate_loops_total",
+                       "Fallback slate loops muxed while capture was lost.",
+                       "", static_cast<double>(watchdog_stats.slate_loops));
+  }
+  webmlive::ThumbnailStats thumbnail_stats;
+  if (encoder.GetThumbnailStats(&thumbnail_stats) ==
+      webmlive::WebmEncoder::kSuccess) {
+    metrics.AddCounter("webmlive_thumbnails_encoded_total",
+                       "Thumbnails encoded.", "",
+                       static_cast<double>(thumbnail_stats.thumbnails_encoded));
+    metrics.AddCounter("webmlive_thumbnails_skipped_total",
+                       "Thumbnails skipped while the previous one was being "
+                       "encoded.", "",
+                       static_cast<double>(thumbnail_stats.thumbnails_skipped));
+    metrics.AddCounter("webmlive_thumbnails_written_total",
+                       "Thumbnails written to the data sink.", "",
+                       static_cast<double>(sink_stats.thumbnails_written));
+  }
+  webmlive::QualityStats quality_stats;
+  if (encoder.GetQualityStats(&quality_stats) ==
+      webmlive::WebmEncoder::kSuccess) {
+    metrics.AddCounter("webmlive_quality_samples_total",
+                       "Keyframes decoded and measured.", "",
+                       static_cast<double>(quality_stats.samples));
+    metrics.AddCounter("webmlive_quality_samples_skipped_total",
+                       "Keyframe samples skipped while the monitor was busy "
+                       "or over its CPU cap.", "",
+                       static_cast<double>(quality_stats.samples_skipped));
+    metrics.AddCounter("webmlive_quality_sample_failures_total",
+                       "Keyframe samples that could not be measured.", "",
+                       static_cast<double>(quality_stats.sample_failures));
+    if (quality_stats.samples > 0) {
+      metrics.AddGauge("webmlive_quality_psnr_db",
+                       "PSNR of the last measured keyframe.", "",
+                       quality_stats.last_psnr);
+      metrics.AddGauge("webmlive_quality_ssim",
+                       "Luma SSIM of the last measured keyframe.", "",
+                       quality_stats.last_ssim);
+    }
+  }
+
+  // Queues.
+  add_pool_metrics(pool_stats, &metrics);
+  metrics.AddGauge("webmlive_sink_queued_chunks",
+                   "Chunks waiting in the encoder for the data sink.", "",
+                   sink_stats.queued_chunks);
+  metrics.AddGauge("webmlive_sink_queued_bytes",
+                   "Chunk bytes waiting in the encoder for the data sink.",
+                   "", static_cast<double>(sink_stats.queued_bytes));
+  metrics.AddGauge("webmlive_sink_in_flight_chunks",
+                   "Chunks submitted to the async data sink and not yet "
+                   "written.", "", sink_stats.in_flight_chunks);
+  metrics.AddGauge("webmlive_over_memory_budget",
+                   "1 while media data exceeds the memory budget.", "",
+                   sink_stats.over_memory_budget ? 1 : 0);
+  add_memory_metrics(&metrics);
+  add_vpx_context_pool_metrics(&metrics);
+  webmlive::FrameProfileStats profile_stats;
+  if (encoder.GetFrameProfileStats(&profile_stats) ==
+      webmlive::WebmEncoder::kSuccess) {
+    add_frame_profile_metrics(profile_stats, &metrics);
+  }
+  webmlive::MediaArenaStats arena_stats;
+  encoder.GetArenaStats(&arena_stats);
+  add_numa_metrics(arena_stats, &metrics);
+
+  // Data sink.
+  metrics.AddCounter("webmlive_sink_bytes_sent_total",
+                     "Bytes sent by the data sink.", "",
+                     static_cast<double>(bytes_uploaded));
+  if (ptr_upload_stats) {
+    metrics.AddGauge("webmlive_upload_queued",
+                     "Buffers waiting in the upload queue.", "",
+                     ptr_upload_stats->queued_uploads);
+    metrics.AddGauge("webmlive_upload_queued_bytes",
+                     "Bytes waiting in the upload queue or being uploaded.",
+                     "", static_cast<double>(ptr_upload_stats->queued_bytes));
+    metrics.AddCounter("webmlive_upload_retries_total",
+                       "Failed uploads retried.", "",
+                       static_cast<double>(ptr_upload_stats->upload_retries));
+    metrics.AddCounter("webmlive_upload_pacing_waits_total",
+                       "Uploads paused for pacing tokens.", "",
+                       static_cast<double>(ptr_upload_stats->pacing_waits));
+    metrics.AddCounter("webmlive_upload_coalesced_requests_total",
+                       "Requests that sent more than one chunk.", "",
+                       static_cast<double>(
+                           ptr_upload_stats->coalesced_requests));
+    metrics.AddCounter("webmlive_upload_failovers_total",
+                       "Switches between ingest targets.", "",
+                       static_cast<double>(ptr_upload_stats->failovers));
+    metrics.AddGauge("webmlive_upload_active_target",
+                     "Ingest target uploads go to; 0 is the primary.", "",
+                     ptr_upload_stats->active_target);
+    metrics.AddGauge("webmlive_upload_time_p95_ms",
+                     "95th percentile of the upload time, in milliseconds.",
+                     "", static_cast<double>(
+                         ptr_upload_stats->upload_time_ms.Percentile(95)));
+  } else {
+    metrics.AddGauge("webmlive_push_queued_chunks",
+                     "Chunks waiting in the push sink queue.", "",
+                     ptr_push_stats->queued_chunks);
+    metrics.AddGauge("webmlive_push_connected",
+                     "1 while the push sink is connected.", "",
+                     ptr_push_stats->connected ? 1 : 0);
+    metrics.AddCounter("webmlive_push_chunks_dropped_total",
+                       "Chunks dropped by the push sink.", "",
+                       static_cast<double>(ptr_push_stats->chunks_dropped));
+    const webmlive::ArqSenderStats& arq = ptr_push_stats->arq;
+    if (arq.packets_sent > 0) {
+      metrics.AddGauge("webmlive_push_rtt_ms",
+                       "Smoothed UDP push round trip time, in milliseconds.",
+                       "", arq.rtt_ms);
+      metrics.AddCounter("webmlive_push_packets_retransmitted_total",
+                         "UDP push packets sent again.", "",
+                         static_cast<double>(arq.packets_retransmitted));
+      metrics.AddCounter("webmlive_push_packets_lost_total",
+                         "UDP push packets the receiver reported missing.",
+                         "", static_cast<double>(arq.packets_lost));
+      metrics.AddCounter("webmlive_push_packets_dropped_total",
+                         "UDP push packets given up on as too late.", "",
+                         static_cast<double>(arq.packets_dropped));
+    }
+  }
+  if (ptr_fault_sink) {
+    webmlive::FaultInjectionStats fault_stats;
+    ptr_fault_sink->GetStats(&fault_stats);
+    metrics.AddCounter("webmlive_injected_failures_total",
+                       "Chunk writes failed by fault injection.", "",
+                       static_cast<double>(fault_stats.failures));
+    metrics.AddCounter("webmlive_injected_drops_total",
+                       "Chunks discarded by fault injection.", "",
+                       static_cast<double>(fault_stats.drops));
+    metrics.AddCounter("webmlive_injected_outage_rejects_total",
+                       "Chunks refused during injected outages.", "",
+                       static_cast<double>(fault_stats.outage_rejects));
+    metrics.AddCounter("webmlive_injected_outages_total",
+                       "Injected sink outages.", "",
+                       static_cast<double>(fault_stats.outages));
+    metrics.AddCounter("webmlive_injected_busy_milliseconds_total",
+                       "Injected latency and bandwidth delay.", "",
+                       static_cast<double>(fault_stats.busy_ms));
+  }
+
+  add_thread_metrics(&metrics);
+#ifdef WEBMLIVE_LATENCY_TRACING
+  add_latency_metrics(&metrics);
+#endif
+  ptr_server->Publish(metrics.text());
+}
+
+// Stops whichever of |ptr_push_sink|, or |ptr_fanout| and |ptr_uploader|,
+// is in use.
+void stop_sinks(bool use_push, bool use_fanout,
+                webmlive::PushSink* ptr_push_sink,
+                webmlive::DataSinkFanout* ptr_fanout,
+                UploaderList* ptr_backups,
+                webmlive::HttpUploader* ptr_uploader) {
+  if (use_push) {
+    ptr_push_sink->Stop();
+    return;
+  }
+  if (use_fanout) {
+    stop_fanout(ptr_fanout, ptr_backups, 0);
+  }
+  ptr_uploader->Stop();
+}
+
+// Reports the encode time of |ptr_encoder| to the channel's |CpuGovernor|, and
+// applies the speed it returns. A channel whose encoder cannot take the
+// speed leaves the governor.
+void govern_speed(WebmEncoderConfig* ptr_config,
+                  webmlive::WebmEncoder* ptr_encoder) {
+  webmlive::EncodeStats encode_stats;
+  if (ptr_encoder->GetEncodeStats(&encode_stats) !=
+      webmlive::WebmEncoder::kSuccess) {
+    return;
+  }
+  const int64 now_ms =
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::steady_clock::now().time_since_epoch()).count();
+  const int speed = ptr_config->ptr_cpu_governor->Update(
+      ptr_config->governor_channel, now_ms,
+      encode_stats.video_encode_us + encode_stats.audio_encode_us);
+  if (speed == webmlive::VpxConfig::kUseDefault) {
+    return;
+  }
+  webmlive::EncoderReconfiguration reconfig;
+  reconfig.video_speed = speed;
+  if (ptr_encoder->Reconfigure(reconfig) !=
+      webmlive::WebmEncoder::kSuccess) {
+    LOG(WARNING) << "speed change to " << speed << " failed; the channel "
+                 << "leaves the CPU governor.";
+    ptr_config->ptr_cpu_governor->RemoveChannel(
+        ptr_config->governor_channel);
+    ptr_config->ptr_cpu_governor = NULL;
+  }
+}
+
+// Applies the keyframe request, the splice and the reconfiguration pending
+// in |ptr_control|, if any, to |ptr_encoder|, and publishes its encoded
+// duration.
+void control_channel(ChannelControl* ptr_control,
+                     webmlive::WebmEncoder* ptr_encoder) {
+  ptr_control->encoded_duration = ptr_encoder->encoded_duration();
+  if (ptr_control->keyframe.exchange(false) &&
+      ptr_encoder->RequestKeyframe() != webmlive::WebmEncoder::kSuccess) {
+    LOG(WARNING) << "channel keyframe request failed.";
+  }
+  webmlive::EncoderReconfiguration reconfig;
+  bool reconfigure = false;
+  std::string splice_clip;
+  {
+    std::lock_guard<std::mutex> lock(ptr_control->mutex);
+    splice_clip.swap(ptr_control->splice_clip);
+    reconfigure = ptr_control->reconfigure;
+    reconfig = ptr_control->reconfig;
+    ptr_control->reconfigure = false;
+  }
+  if (!splice_clip.empty() &&
+      ptr_encoder->SpliceClip(splice_clip) != webmlive::WebmEncoder::kSuccess) {
+    LOG(WARNING) << "channel splice of " << splice_clip << " failed.";
+  }
+  if (reconfigure &&
+      ptr_encoder->Reconfigure(reconfig) != webmlive::WebmEncoder::kSuccess) {
+    LOG(WARNING) << "channel reconfiguration failed.";
+  }
+}
+
 int encoder_main(WebmEncoderConfig* ptr_config) {
+  webmlive::ScopedThreadRegistration registration("main");
   webmlive::WebmEncoderConfig& enc_config = ptr_config->enc_config;
   webmlive::HttpUploader uploader;
+  UploaderList backup_uploaders;
+  webmlive::SegmentRingWriter shm_sink;
+  webmlive::DataSinkFanout fanout;
+  webmlive::PushSink push_sink;
+
+  // A push address replaces the HTTP uploader, its backups and the shared
+  // memory sink.
+  const bool use_push = !ptr_config->push_settings.host.empty();
+  if (use_push && (!ptr_config->uploader_settings.target_url.empty() ||
+                   !ptr_config->backup_urls.empty() ||
+                   !ptr_config->shm_sink.shm_name.empty())) {
+    LOG(WARNING) << "--url, --backup_url and --shm_sink are ignored with "
+                 << "--push.";
+  }
+
+  // With backup targets or a shared memory sink every chunk goes through the
+  // fan-out, which does not stream.
+  const bool use_fanout = !use_push &&
+      (!ptr_config->backup_urls.empty() ||
+       !ptr_config->shm_sink.shm_name.empty());
+
+  // The signal policy leaves the backlog to the bitrate controller.
+  if (enc_config.sink_policy == webmlive::WebmEncoderConfig::kSinkSignal) {
+    ptr_config->adaptive_bitrate = true;
+  }
+  if (use_fanout && enc_config.stream_chunks) {
+    LOG(WARNING) << "--stream_chunks is not supported with --backup_url "
+                 << "or --shm_sink, disabling.";
+    enc_config.stream_chunks = false;
+  }
+  webmlive::DataSinkInterface* ptr_data_sink = &uploader;
+  if (use_push) {
+    ptr_data_sink = &push_sink;
+  } else if (use_fanout) {
+    ptr_data_sink = &fanout;
+  }
+  webmlive::FaultInjectionSink fault_sink;
+  if (ptr_config->inject_faults) {
+    if (fault_sink.Init(ptr_config->fault_injection, ptr_data_sink)) {
+      LOG(ERROR) << "invalid sink fault injection settings.";
+      return EXIT_FAILURE;
+    }
+    ptr_data_sink = &fault_sink;
+  }
+
+  // Start the sinks first: they connect to the server while the encoder
+  // opens its devices.
+  int status = kSuccess;
+  if (use_push) {
+    // Start the push sender thread.
+    status = start_push_sink(*ptr_config, &push_sink);
+    if (status) {
+      LOG(ERROR) << "start_push_sink failed, status=" << status;
+      return EXIT_FAILURE;
+    }
+  } else {
+    // Start the uploader thread.
+    init_upload_pacing(ptr_config);
+    status = start_uploader(ptr_config, &uploader);
+    if (status) {
+      LOG(ERROR) << "start_uploader failed, status=" << status;
+      return EXIT_FAILURE;
+    }
+  }
+  if (use_fanout) {
+    status = start_fanout(ptr_config, &uploader, &backup_uploaders,
+                          &shm_sink, &fanout);
+    if (status) {
+      LOG(ERROR) << "start_fanout failed, status=" << status;
+      stop_fanout(&fanout, &backup_uploaders, 0);
+      uploader.Stop();
+      return EXIT_FAILURE;
+    }
+  }
 
   // Init the WebM encoder.
   webmlive::WebmEncoder encoder;
-  int status = encoder.Init(enc_config, &uploader);
+  status = encoder.Init(enc_config, ptr_data_sink);
   if (status) {
     LOG(ERROR) << "WebmEncoder Run failed, status=" << status;
-    return EXIT_FAILURE;
-  }
-
-  // Start the uploader thread.
-  status = start_uploader(ptr_config, &uploader);
-  if (status) {
-    LOG(ERROR) << "start_uploader failed, status=" << status;
+    stop_sinks(use_push, use_fanout, &push_sink, &fanout, &backup_uploaders,
+               &uploader);
     return EXIT_FAILURE;
   }
 
@@ -476,39 +3548,466 @@ int encoder_main(WebmEncoderConfig* ptr_config) {
   status = encoder.Run();
   if (status) {
     LOG(ERROR) << "start_encoder failed, status=" << status;
-    uploader.Stop();
+    stop_sinks(use_push, use_fanout, &push_sink, &fanout, &backup_uploaders,
+               &uploader);
     return EXIT_FAILURE;
   }
 
+  webmlive::BitrateController bitrate_controller;
+  if (ptr_config->adaptive_bitrate) {
+    status = init_bitrate_controller(ptr_config, &bitrate_controller);
+    if (status) {
+      LOG(ERROR) << "BitrateController Init failed, status=" << status;
+      encoder.Stop();
+      stop_sinks(use_push, use_fanout, &push_sink, &fanout,
+                 &backup_uploaders, &uploader);
+      return EXIT_FAILURE;
+    }
+    if (bitrate_controller.video_bitrate() != enc_config.vpx_config.bitrate) {
+      encoder.SetTargetBitrate(bitrate_controller.video_bitrate(), 0);
+    }
+  }
+  const bool adaptive_audio =
+      ptr_config->bitrate_settings.min_audio_bitrate !=
+      ptr_config->bitrate_settings.max_audio_bitrate;
+
+  webmlive::MetricsServer metrics_server;
+  const bool use_metrics = ptr_config->metrics_settings.port != 0;
+  if (use_metrics) {
+    status = metrics_server.Init(ptr_config->metrics_settings);
+    if (!status) {
+      status = metrics_server.Run();
+    }
+    if (status) {
+      LOG(ERROR) << "MetricsServer start failed, status=" << status;
+      encoder.Stop();
+      stop_sinks(use_push, use_fanout, &push_sink, &fanout,
+                 &backup_uploaders, &uploader);
+      return EXIT_FAILURE;
+    }
+  }
+  MetricsState metrics_state;
+  int64 next_metrics_ms = 0;
+
   webmlive::HttpUploaderStats stats;
-  printf("\nPress the any key to quit...\n");
+  webmlive::PushSinkStats push_stats;
+  if (ptr_config->headless) {
+    install_stop_handler();
+  } else {
+    printf("\nPress the any key to quit...\n");
+  }
+
+  const std::chrono::steady_clock::time_point run_time =
+      std::chrono::steady_clock::now();
+  bool allocation_check_armed = false;
 
-  while (!_kbhit()) {
+  // The encoder finishes on its own when input files end.
+  while (!stop_requested_by_user(ptr_config->headless) &&
+         !(ptr_config->ptr_control && ptr_config->ptr_control->stop) &&
+         !encoder.finished()) {
+    if (ptr_config->allocation_check_warmup >= 0 && !allocation_check_armed &&
+        std::chrono::steady_clock::now() - run_time >=
+            std::chrono::seconds(ptr_config->allocation_check_warmup)) {
+      LOG(INFO) << "allocation check started.";
+      if (!webmlive::AllocationTracker::hooks_installed()) {
+        LOG(WARNING) << "built without WEBMLIVE_ENABLE_ALLOCATION_CHECK, "
+                     << "checking video frame buffers only.";
+      }
+      webmlive::AllocationTracker::Instance()->Arm();
+      allocation_check_armed = true;
+    }
     // Output current duration and upload progress
-    if (uploader.GetStats(&stats) == webmlive::HttpUploader::kSuccess) {
-      printf("\rencoded duration: %04f seconds, uploaded: %I64d @ %d kBps",
-             (encoder.encoded_duration() / 1000.0),
-             stats.bytes_sent_current + stats.total_bytes_uploaded,
-             static_cast<int>(stats.bytes_per_second / 1000));
+    int64 bytes_uploaded = 0;
+    int32 queued_uploads = 0;
+    int64 packets_sent = 0;
+    int64 packets_lost = 0;
+    bool have_stats = false;
+    if (use_push) {
+      have_stats =
+          push_sink.GetStats(&push_stats) == webmlive::PushSink::kSuccess;
+      if (have_stats) {
+        if (!ptr_config->headless) {
+          printf("\rencoded duration: %04f seconds, pushed: %" PRId64 "%s",
+                 (encoder.encoded_duration() / 1000.0),
+                 static_cast<int64_t>(push_stats.bytes_sent),
+                 push_stats.connected ? "" : " (connecting)");
+        }
+        bytes_uploaded = push_stats.bytes_sent;
+        queued_uploads = push_stats.queued_chunks;
+        if (ptr_config->push_settings.transport ==
+            webmlive::PushSinkSettings::kTransportUdpArq) {
+          // Over UDP, sent data may still be lost: throughput is what the
+          // receiver acknowledged, and loss feedback congestion.
+          bytes_uploaded = push_stats.arq.bytes_acked;
+          packets_sent = push_stats.arq.packets_sent;
+          packets_lost = push_stats.arq.packets_lost;
+        }
+      }
+    } else if (uploader.GetStats(&stats) == webmlive::HttpUploader::kSuccess) {
+      have_stats = true;
+      if (!ptr_config->headless) {
+        printf("\rencoded duration: %04f seconds, uploaded: %" PRId64
+               " @ %d kBps",
+               (encoder.encoded_duration() / 1000.0),
+               static_cast<int64_t>(stats.bytes_sent_current +
+                                    stats.total_bytes_uploaded),
+               static_cast<int>(stats.bytes_per_second / 1000));
+      }
+      bytes_uploaded = stats.bytes_sent_current + stats.total_bytes_uploaded;
+      queued_uploads = stats.queued_uploads;
+    }
+    if (have_stats) {
+      const int64 now_ms =
+          std::chrono::duration_cast<std::chrono::milliseconds>(
+              std::chrono::steady_clock::now().time_since_epoch()).count();
+      // Chunks waiting in the encoder for the uploader count as queued
+      // uploads.
+      webmlive::SinkStats sink_stats;
+      if (encoder.GetSinkStats(&sink_stats) ==
+          webmlive::WebmEncoder::kSuccess) {
+        queued_uploads +=
+            sink_stats.queued_chunks + sink_stats.in_flight_chunks;
+        if (use_metrics && now_ms >= next_metrics_ms) {
+          publish_metrics(now_ms, encoder, sink_stats,
+                          use_push ? NULL : &stats,
+                          use_push ? &push_stats : NULL,
+                          ptr_config->inject_faults ? &fault_sink : NULL,
+                          &metrics_state, &metrics_server);
+          next_metrics_ms = now_ms + kMetricsUpdateInterval;
+        }
+      }
+      if (ptr_config->adaptive_bitrate &&
+          bitrate_controller.Update(now_ms, bytes_uploaded, queued_uploads,
+                                    packets_sent, packets_lost)) {
+        encoder.SetTargetBitrate(
+            bitrate_controller.video_bitrate(),
+            adaptive_audio ? bitrate_controller.audio_bitrate() : 0);
+      }
     }
-    Sleep(100);
+    if (ptr_config->ptr_cpu_governor) {
+      govern_speed(ptr_config, &encoder);
+    }
+    if (ptr_config->ptr_control) {
+      control_channel(ptr_config->ptr_control, &encoder);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+
+  if (ptr_config->ptr_cpu_governor) {
+    ptr_config->ptr_cpu_governor->RemoveChannel(ptr_config->governor_channel);
   }
 
+  // Stopping the encoder flushes and frees the pipeline, which allocates.
+  webmlive::AllocationTracker::Instance()->Disarm();
   LOG(INFO) << "stopping encoder...";
+  const std::chrono::steady_clock::time_point stop_time =
+      std::chrono::steady_clock::now();
   encoder.Stop();
+  if (use_metrics) {
+    LOG(INFO) << "metrics requests served: " << metrics_server.requests();
+    metrics_server.Stop();
+  }
+
+  webmlive::VideoDropStats drop_stats;
+  if (encoder.GetVideoDropStats(&drop_stats) ==
+      webmlive::WebmEncoder::kSuccess) {
+    LOG(INFO) << "video frames captured: " << drop_stats.frames_captured
+              << " dropped (queue full): " << drop_stats.queue_full_drops
+              << " dropped (stale): " << drop_stats.stale_drops
+              << " dropped (encoder): " << drop_stats.encoder_drops
+              << " dropped (degradation): " << drop_stats.degradation_drops;
+  }
+  webmlive::CaptureTimestampStats timestamp_stats;
+  if (enc_config.regulate_timestamps &&
+      encoder.GetTimestampStats(&timestamp_stats) ==
+          webmlive::WebmEncoder::kSuccess) {
+    const webmlive::TimestampRegulatorStats* const streams[] = {
+      &timestamp_stats.video, &timestamp_stats.audio,
+    };
+    const char* const names[] = {"video", "audio"};
+    for (int i = 0; i < 2; ++i) {
+      LOG(INFO) << names[i] << " timestamps regulated: " << streams[i]->inputs
+                << " duplicates: " << streams[i]->duplicates
+                << " skips: " << streams[i]->skips
+                << " resyncs: " << streams[i]->resyncs
+                << " jitter: " << streams[i]->jitter_ms << " ms"
+                << " max jitter: " << streams[i]->max_jitter_ms << " ms"
+                << " drift: " << streams[i]->drift_ppm << " ppm"
+                << " period: " << streams[i]->period_ms << " ms";
+    }
+  }
+  webmlive::FrameRateConverterStats frame_rate_stats;
+  if (encoder.GetFrameRateStats(&frame_rate_stats) ==
+      webmlive::WebmEncoder::kSuccess) {
+    LOG(INFO) << "frame rate converted to " << frame_rate_stats.frame_rate
+              << " fps: frames in: " << frame_rate_stats.frames_in
+              << " out: " << frame_rate_stats.frames_out
+              << " dropped: " << frame_rate_stats.frames_dropped
+              << " skipped slots: " << frame_rate_stats.slots_skipped
+              << " resyncs: " << frame_rate_stats.resyncs;
+  }
+  webmlive::SinkStats sink_stats;
+  if (encoder.GetSinkStats(&sink_stats) == webmlive::WebmEncoder::kSuccess) {
+    LOG(INFO) << "sink max queued bytes: " << sink_stats.max_queued_bytes
+              << " dropped chunks: " << sink_stats.dropped_chunks
+              << " dropped video frames: " << sink_stats.dropped_video_frames
+              << " blocked: " << sink_stats.blocked_ms << " ms";
+    if (enc_config.sink_policy == webmlive::WebmEncoderConfig::kSinkSpill) {
+      LOG(INFO) << "sink spilled chunks: " << sink_stats.spilled_chunks
+                << " bytes: " << sink_stats.spilled_bytes
+                << " replayed: " << sink_stats.replayed_chunks
+                << " pending bytes: " << sink_stats.spill_pending_bytes;
+    }
+    if (enc_config.dash_sink_manifest) {
+      LOG(INFO) << "sink manifests written: " << sink_stats.manifests_written
+                << " unchanged: " << sink_stats.manifests_unchanged;
+    }
+  }
+  webmlive::ThumbnailStats thumbnail_stats;
+  if (encoder.GetThumbnailStats(&thumbnail_stats) ==
+      webmlive::WebmEncoder::kSuccess) {
+    LOG(INFO) << "thumbnails encoded: " << thumbnail_stats.thumbnails_encoded
+              << " skipped: " << thumbnail_stats.thumbnails_skipped
+              << " written: " << sink_stats.thumbnails_written
+              << " bytes: " << thumbnail_stats.thumbnail_bytes
+              << " encode time: " << thumbnail_stats.encode_time_us / 1000
+              << " ms";
+  }
+  webmlive::QualityStats quality_stats;
+  if (encoder.GetQualityStats(&quality_stats) ==
+      webmlive::WebmEncoder::kSuccess) {
+    LOG(INFO) << "quality samples: " << quality_stats.samples
+              << " skipped: " << quality_stats.samples_skipped
+              << " failed: " << quality_stats.sample_failures
+              << " monitor time: " << quality_stats.monitor_time_us / 1000
+              << " ms";
+    if (quality_stats.samples > 0) {
+      LOG(INFO) << "quality PSNR mean: "
+                << quality_stats.psnr_sum / quality_stats.samples
+                << " dB min: " << quality_stats.min_psnr
+                << " dB SSIM mean: "
+                << quality_stats.ssim_sum / quality_stats.samples
+                << " min: " << quality_stats.min_ssim;
+    }
+  }
+  webmlive::SegmentRateStats rate_stats;
+  if (encoder.GetSegmentRateStats(&rate_stats) ==
+      webmlive::WebmEncoder::kSuccess) {
+    LOG(INFO) << "segment rate control: segments: " << rate_stats.segments
+              << " within tolerance: " << rate_stats.segments_within_tolerance
+              << " bitrate changes: " << rate_stats.bitrate_changes;
+  }
+  webmlive::SegmentDurationStats duration_stats;
+  if (encoder.GetSegmentDurationStats(&duration_stats) ==
+      webmlive::WebmEncoder::kSuccess) {
+    LOG(INFO) << "adaptive segments: uploads: " << duration_stats.uploads
+              << " lengthened: " << duration_stats.lengthened
+              << " shortened: " << duration_stats.shortened
+              << " duration: " << duration_stats.duration << " ms";
+  }
+  webmlive::AudioLevelStats level_stats;
+  if (encoder.GetAudioLevelStats(&level_stats) ==
+      webmlive::WebmEncoder::kSuccess) {
+    LOG(INFO) << "audio silent periods: " << level_stats.silent_periods
+              << " silent time: " << level_stats.silent_ms << " ms";
+  }
+  webmlive::AudioDriftStats drift_stats;
+  if (encoder.GetAudioDriftStats(&drift_stats) ==
+      webmlive::WebmEncoder::kSuccess) {
+    LOG(INFO) << "audio drift: " << drift_stats.drift_ms << " ms"
+              << " correction: " << drift_stats.correction_ppm << " ppm"
+              << " samples in: " << drift_stats.samples_in
+              << " out: " << drift_stats.samples_out
+              << " resyncs: " << drift_stats.resyncs;
+  }
+  std::vector<webmlive::MuxerStats> muxer_stats;
+  if (encoder.GetMuxerStats(&muxer_stats) ==
+      webmlive::WebmEncoder::kSuccess) {
+    for (size_t i = 0; i < muxer_stats.size(); ++i) {
+      const webmlive::MuxerStats& stats = muxer_stats[i];
+      const int64 average_cluster_bytes =
+          stats.clusters > 0 ? stats.cluster_bytes / stats.clusters : 0;
+      const int64 average_read_latency_us =
+          stats.chunks_read > 0 ? stats.read_latency_us / stats.chunks_read :
+                                  0;
+      LOG(INFO) << "muxer " << stats.muxer_id
+                << " clusters: " << stats.clusters
+                << " bytes min/avg/max: " << stats.min_cluster_bytes << "/"
+                << average_cluster_bytes << "/" << stats.max_cluster_bytes
+                << " blocks: " << stats.blocks
+                << " max per cluster: " << stats.max_cluster_blocks
+                << " block overhead: " << stats.block_header_bytes
+                << " payload: " << stats.block_payload_bytes
+                << " max interleave gap audio/video ms: "
+                << stats.max_audio_interleave_gap << "/"
+                << stats.max_video_interleave_gap
+                << " read latency avg/max us: " << average_read_latency_us
+                << "/" << stats.max_read_latency_us;
+    }
+  }
+  webmlive::TextTrackStats text_stats;
+  if (encoder.GetTextTrackStats(&text_stats) ==
+      webmlive::WebmEncoder::kSuccess) {
+    LOG(INFO) << "text cues written: " << text_stats.cues_written
+              << " late: " << text_stats.cues_late
+              << " dropped: " << text_stats.cues_dropped
+              << " parse errors: " << text_stats.parse_errors;
+  }
+  webmlive::EncryptionStats encryption_stats;
+  if (encoder.GetEncryptionStats(&encryption_stats) ==
+      webmlive::WebmEncoder::kSuccess) {
+    LOG(INFO) << "blocks encrypted: " << encryption_stats.blocks_encrypted
+              << " bytes: " << encryption_stats.bytes_encrypted
+              << " key rotations: " << encryption_stats.key_rotations;
+  }
+  std::vector<webmlive::RepresentationStats> representation_stats;
+  if (encoder.GetRepresentationStats(&representation_stats) ==
+      webmlive::WebmEncoder::kSuccess) {
+    for (size_t i = 0; i < representation_stats.size(); ++i) {
+      const webmlive::RepresentationStats& stats = representation_stats[i];
+      LOG(INFO) << "representation " << stats.rep_id
+                << " segments: " << stats.segments
+                << " bytes: " << stats.bytes
+                << " configured bps: " << stats.configured_bandwidth
+                << " average bps: " << stats.average_bandwidth
+                << " peak bps: " << stats.peak_bandwidth;
+    }
+  }
+  webmlive::CaptureWatchdogStats watchdog_stats;
+  if (encoder.GetCaptureWatchdogStats(&watchdog_stats) ==
+      webmlive::WebmEncoder::kSuccess) {
+    LOG(INFO) << "capture stalls: " << watchdog_stats.stalls
+              << " aborts: " << watchdog_stats.aborts
+              << " restarts: " << watchdog_stats.restarts
+              << " failed restarts: " << watchdog_stats.restart_failures
+              << " filler frames: " << watchdog_stats.filler_frames
+              << " slate loops: " << watchdog_stats.slate_loops
+              << " gap: " << watchdog_stats.gap_ms << " ms";
+  }
+  webmlive::EncoderPoolStats pool_stats;
+  if (encoder.GetPoolStats(&pool_stats) == webmlive::WebmEncoder::kSuccess) {
+    log_pool_stats("video input", pool_stats.video_input);
+    log_pool_stats("audio input", pool_stats.audio_input);
+    log_pool_stats("video output", pool_stats.video_output);
+    log_pool_stats("audio output", pool_stats.audio_output);
+    log_pool_stats("scaler", pool_stats.scaler);
+    log_stage_stats("audio encoder", pool_stats.audio_encoder);
+    log_stage_stats("video encoder", pool_stats.video_encoder);
+  }
+#ifdef WEBMLIVE_LATENCY_TRACING
+  log_latency_stats();
+#endif
+  log_thread_cpu_stats();
+  log_memory_stats();
+  log_numa_topology();
+  int exit_code = EXIT_SUCCESS;
+  if (allocation_check_armed &&
+      webmlive::AllocationTracker::Instance()->LogReport() > 0) {
+    exit_code = EXIT_FAILURE;
+  }
+  std::vector<webmlive::BitrateChange> bitrate_changes;
+  if (ptr_config->adaptive_bitrate &&
+      encoder.GetBitrateChanges(&bitrate_changes) ==
+          webmlive::WebmEncoder::kSuccess) {
+    LOG(INFO) << "bitrate changes: " << bitrate_changes.size()
+              << " final video bitrate: " << bitrate_controller.video_bitrate()
+              << " kbps";
+  }
+  if (ptr_config->inject_faults) {
+    webmlive::FaultInjectionStats fault_stats;
+    fault_sink.GetStats(&fault_stats);
+    LOG(INFO) << "injected faults: chunks passed: " << fault_stats.chunks
+              << " bytes: " << fault_stats.bytes
+              << " failures: " << fault_stats.failures
+              << " drops: " << fault_stats.drops
+              << " outages: " << fault_stats.outages
+              << " outage rejects: " << fault_stats.outage_rejects
+              << " busy: " << fault_stats.busy_ms << " ms";
+  }
+  if (use_push) {
+    LOG(INFO) << "stopping push sink...";
+    push_sink.Stop();
+    if (push_sink.GetStats(&push_stats) == webmlive::PushSink::kSuccess) {
+      LOG(INFO) << "push frames sent: " << push_stats.frames_sent
+                << " bytes sent: " << push_stats.bytes_sent
+                << " connects: " << push_stats.connects
+                << " connect failures: " << push_stats.connect_failures
+                << " send failures: " << push_stats.send_failures
+                << " chunks dropped: " << push_stats.chunks_dropped;
+      const webmlive::ArqSenderStats& arq = push_stats.arq;
+      if (arq.packets_sent > 0) {
+        LOG(INFO) << "push UDP packets sent: " << arq.packets_sent
+                  << " retransmitted: " << arq.packets_retransmitted
+                  << " lost: " << arq.packets_lost
+                  << " dropped: " << arq.packets_dropped
+                  << " rtt: " << arq.rtt_ms << " ms";
+      }
+    }
+    return exit_code;
+  }
+  // The uploaders deliver the final chunks in what is left of the stop
+  // timeout, while the fan-out and the other uploaders drain theirs.
+  if (use_fanout) {
+    LOG(INFO) << "stopping fan-out...";
+    stop_fanout(&fanout, &backup_uploaders,
+                stop_time_remaining(enc_config.stop_timeout, stop_time));
+    webmlive::SegmentRingStats ring_stats;
+    if (!ptr_config->shm_sink.shm_name.empty() &&
+        shm_sink.GetStats(&ring_stats) ==
+        webmlive::SegmentRingWriter::kSuccess) {
+      LOG(INFO) << "shm sink segments written: " << ring_stats.segments_written
+                << " overrun: " << ring_stats.segments_overrun
+                << " skipped: " << ring_stats.segments_skipped
+                << " dropped: " << ring_stats.segments_dropped;
+    }
+  }
   LOG(INFO) << "stopping uploader...";
-  uploader.Stop();
+  uploader.Stop(stop_time_remaining(enc_config.stop_timeout, stop_time));
+  if (uploader.GetStats(&stats) == webmlive::HttpUploader::kSuccess) {
+    LOG(INFO) << "upload connections warmed: " << stats.connections_warmed
+              << " max queued bytes: " << stats.max_queued_bytes
+              << " uploads abandoned: " << stats.uploads_abandoned
+              << " (" << stats.bytes_abandoned << " bytes)"
+              << " pacing waits: " << stats.pacing_waits;
+    if (!ptr_config->uploader_settings.failover_urls.empty()) {
+      LOG(INFO) << "ingest failovers: " << stats.failovers
+                << " active target: " << stats.active_target
+                << " replayed uploads: " << stats.replayed_uploads;
+    }
+    if (ptr_config->uploader_settings.coalesce_bytes > 0) {
+      LOG(INFO) << "coalesced requests: " << stats.coalesced_requests
+                << " buffers: " << stats.coalesced_buffers;
+    }
+    if (ptr_config->uploader_settings.post_mode == webmlive::HTTP_PUT) {
+      LOG(INFO) << "multipart uploads: " << stats.multipart_uploads
+                << " parts: " << stats.multipart_parts
+                << " failed: " << stats.multipart_failures;
+    }
+    log_upload_histogram("upload queue delay (ms)", stats.queue_delay_ms);
+    log_upload_histogram("upload time to first byte (ms)",
+                         stats.time_to_first_byte_ms);
+    log_upload_histogram("upload time (ms)", stats.upload_time_ms);
+    log_upload_histogram("upload throughput (kbps)", stats.throughput_kbps);
+  }
 
-  return EXIT_SUCCESS;
+  return exit_code;
 }
 
-int main(int argc, const char** argv) {
-  google::InitGoogleLogging(argv[0]);
-  WebmEncoderConfig config;
-  parse_command_line(argc, argv, config);
-
-  // validate params
-  if (!config.uploader_settings.target_url.empty()) {
+// Returns true when the settings of |config| can run, logging the reason
+// when they cannot.
+bool valid_config(const WebmEncoderConfig& config) {
+  bool numa_nodes_valid = valid_numa_node(config.enc_config.numa_node);
+  for (size_t i = 0; i < config.enc_config.video_renditions.size(); ++i) {
+    numa_nodes_valid = numa_nodes_valid &&
+        valid_numa_node(config.enc_config.video_renditions[i].numa_node);
+  }
+  if (!numa_nodes_valid) {
+    LOG(ERROR) << "a NUMA node given is not a node of this host.";
+    log_numa_topology();
+    return false;
+  }
+  if (!config.uploader_settings.target_url.empty() &&
+      config.uploader_settings.post_mode != webmlive::HTTP_PUT) {
     // Confirm |stream_id| and |stream_name| are present when no query string
     // is present in |target_url|.
     if ((config.uploader_settings.stream_id.empty() ||
@@ -516,12 +4015,710 @@ int main(int argc, const char** argv) {
         config.uploader_settings.target_url.find('?') == std::string::npos) {
       LOG(ERROR) << "stream_id and stream_name are required when the target "
                  << "URL lacks a query string!\n";
-      return EXIT_FAILURE;
+      return false;
     }
   }
+  if (config.upload_pacing != 0 && config.upload_pacing < 100) {
+    LOG(ERROR) << "upload_pacing must be 0, or 100 or more.";
+    return false;
+  }
+  if (config.enc_config.stream_chunks && config.push_settings.host.empty() &&
+      (config.uploader_settings.target_url.empty() ||
+       config.uploader_settings.post_mode != webmlive::HTTP_POST)) {
+    LOG(ERROR) << "stream_chunks requires a target URL or a push address, "
+               << "and cannot be combined with form_post or put_objects.";
+    return false;
+  }
+  if (config.channel_priority < 1 ||
+      config.channel_priority > webmlive::TaskScheduler::kMaxPriority) {
+    LOG(ERROR) << "channel_priority must be 1 to "
+               << webmlive::TaskScheduler::kMaxPriority << ".";
+    return false;
+  }
+  if (config.host_workers < 0) {
+    LOG(ERROR) << "host_workers must be 0 or more.";
+    return false;
+  }
+  if (config.control_settings.port < 0 ||
+      config.control_settings.port > 65535) {
+    LOG(ERROR) << "service port must be 1 to 65535.";
+    return false;
+  }
+  if (config.control_settings.port && !config.host_file.empty()) {
+    LOG(ERROR) << "service cannot be combined with host.";
+    return false;
+  }
+  if (config.vpx_context_pool < 0) {
+    LOG(ERROR) << "vpx_context_pool must be 0 or more.";
+    return false;
+  }
+  if (config.cpu_governor.enabled &&
+      (config.cpu_governor.budget < 1 || config.cpu_governor.budget > 100)) {
+    LOG(ERROR) << "cpu_budget must be 1 to 100.";
+    return false;
+  }
+  return true;
+}
+
+// Splits the channel options of |line| on white space into |ptr_args|,
+// after the program name; text after a # is a comment. Returns false when
+// |line| holds no options.
+bool split_channel_options(std::string line, StringVector* ptr_args) {
+  const size_t comment = line.find('#');
+  if (comment != std::string::npos) {
+    line.erase(comment);
+  }
+  std::istringstream line_stream(line);
+  ptr_args->assign(1, webmlive::kEncoderName);
+  std::string arg;
+  while (line_stream >> arg) {
+    ptr_args->push_back(arg);
+  }
+  return ptr_args->size() > 1;
+}
+
+// Parses the channel options |args| into |ptr_channel|. Returns false when
+// the channel is invalid, asks for help, or would host or serve channels
+// itself.
+bool parse_channel(const StringVector& args, WebmEncoderConfig* ptr_channel) {
+  std::vector<const char*> argv;
+  for (size_t i = 0; i < args.size(); ++i) {
+    // Help exits the process.
+    if (args[i] == "-h" || args[i] == "-?" || args[i] == "--help") {
+      return false;
+    }
+    argv.push_back(args[i].c_str());
+  }
+  parse_command_line(static_cast<int>(argv.size()), &argv[0], *ptr_channel);
+  return ptr_channel->host_file.empty() &&
+         !ptr_channel->control_settings.port && valid_config(*ptr_channel);
+}
+
+// Reads the channels of |host_config.host_file| into |ptr_channels|. Each
+// line holds the options of one channel. See |split_channel_options()|.
+// Returns false when the file cannot be read, or a channel is invalid.
+bool read_host_file(const WebmEncoderConfig& host_config,
+                    std::vector<WebmEncoderConfig>* ptr_channels) {
+  std::ifstream host_file(host_config.host_file.c_str());
+  if (!host_file) {
+    LOG(ERROR) << "cannot open host file: " << host_config.host_file;
+    return false;
+  }
+  std::string line;
+  for (int line_number = 1; std::getline(host_file, line); ++line_number) {
+    StringVector args;
+    if (!split_channel_options(line, &args)) {
+      continue;
+    }
+    ptr_channels->push_back(WebmEncoderConfig());
+    if (!parse_channel(args, &ptr_channels->back())) {
+      LOG(ERROR) << "invalid channel on line " << line_number << " of "
+                 << host_config.host_file;
+      return false;
+    }
+  }
+  if (ptr_channels->empty()) {
+    LOG(ERROR) << "no channels in host file: " << host_config.host_file;
+    return false;
+  }
+  return true;
+}
+
+// Runs the channels of |host_config.host_file| in this process, each with
+// the |encoder_main()| of a process of its own, apart from what the channels
+// share:
+// - The muxed stream of each channel is written through an
+//   |AsyncSinkAdapter| on a channel of the process's |TaskScheduler|, so
+//   that the sink writes of all channels share its workers instead of a
+//   thread each. Scheduler time goes to the channels by |channel_priority|.
+// - The encode cores of the host are divided among the channels that leave
+//   --vpx_cpu_cores unset, in proportion to |channel_priority|, so that the
+//   libvpx threads of all channels do not oversubscribe the host.
+// - With --cpu_budget, a |CpuGovernor| keeps the encode time of all channels
+//   within the budget by changing their libvpx speeds, by priority.
+// - Thread settings, the default NUMA node and the upload limit of the host
+//   command line apply to all channels.
+// Channels run headless; all stop on one console control event. Returns
+// EXIT_FAILURE when a channel fails.
+int host_main(const WebmEncoderConfig& host_config) {
+  std::vector<WebmEncoderConfig> channels;
+  if (!read_host_file(host_config, &channels)) {
+    return EXIT_FAILURE;
+  }
 
-  LOG(INFO) << "url: " << config.uploader_settings.target_url.c_str();
-  int exit_code = encoder_main(&config);
+  webmlive::TaskScheduler* const scheduler =
+      webmlive::TaskScheduler::Instance();
+  if (scheduler->Init(host_config.host_workers)) {
+    return EXIT_FAILURE;
+  }
+  int total_priority = 0;
+  for (size_t i = 0; i < channels.size(); ++i) {
+    total_priority += channels[i].channel_priority;
+  }
+  const int cores = std::max(
+      static_cast<int>(std::thread::hardware_concurrency()), 1);
+  webmlive::CpuGovernor governor;
+  const bool use_governor = host_config.cpu_governor.enabled &&
+      governor.Init(host_config.cpu_governor, cores) ==
+          webmlive::CpuGovernor::kSuccess;
+  for (size_t i = 0; i < channels.size(); ++i) {
+    WebmEncoderConfig& channel = channels[i];
+    channel.headless = true;
+    if (!channel.thread_settings.empty() ||
+        channel.enc_config.numa_node != webmlive::NumaTopology::kNoNode) {
+      LOG(WARNING) << "channel " << i << ": thread settings apply to all "
+                   << "channels; using those of the host command line.";
+    }
+    if (!channel.enc_config.stream_chunks) {
+      channel.enc_config.async_sink = true;
+      std::ostringstream name;
+      name << "channel" << i;
+      channel.enc_config.task_channel =
+          scheduler->AddChannel(name.str(), channel.channel_priority);
+    }
+    if (channel.enc_config.dash_encode) {
+      std::ostringstream name;
+      name << "channel" << i << "_dash";
+      channel.enc_config.dash_drain_channel =
+          scheduler->AddChannel(name.str(), channel.channel_priority);
+    }
+    webmlive::VpxConfig& vpx_config = channel.enc_config.vpx_config;
+    if (vpx_config.cpu_cores == webmlive::VpxConfig::kUseDefault) {
+      vpx_config.cpu_cores =
+          std::max(1, cores * channel.channel_priority / total_priority);
+    }
+    if (use_governor) {
+      channel.governor_channel =
+          governor.AddChannel(channel.channel_priority, vpx_config);
+      if (channel.governor_channel < 0) {
+        LOG(WARNING) << "channel " << i << ": --cpu_budget requires "
+                     << "--vpx_speed; the channel's speed is not governed.";
+      } else {
+        channel.ptr_cpu_governor = &governor;
+      }
+    }
+    LOG(INFO) << "channel " << i << " url: "
+              << channel.uploader_settings.target_url
+              << " priority: " << channel.channel_priority
+              << " vpx cores: " << vpx_config.cpu_cores;
+  }
+  if (scheduler->Run()) {
+    return EXIT_FAILURE;
+  }
+
+  std::vector<int> exit_codes(channels.size(), EXIT_FAILURE);
+  std::vector<std::unique_ptr<std::thread>> channel_threads;
+  for (size_t i = 0; i < channels.size(); ++i) {
+    WebmEncoderConfig* const ptr_channel = &channels[i];
+    int* const ptr_exit_code = &exit_codes[i];
+    channel_threads.push_back(std::unique_ptr<std::thread>(
+        new (std::nothrow) std::thread([ptr_channel, ptr_exit_code] {  // NOLINT
+          *ptr_exit_code = encoder_main(ptr_channel);
+        })));
+    if (!channel_threads.back()) {
+      LOG(ERROR) << "cannot construct channel " << i << " thread.";
+      stop_requested = true;
+      break;
+    }
+  }
+  for (size_t i = 0; i < channel_threads.size(); ++i) {
+    if (channel_threads[i]) {
+      channel_threads[i]->join();
+    }
+  }
+  scheduler->Stop();
+
+  std::vector<webmlive::TaskChannelStats> channel_stats;
+  int64 steals = 0;
+  if (scheduler->GetStats(&channel_stats, &steals) ==
+      webmlive::TaskScheduler::kSuccess) {
+    for (size_t i = 0; i < channel_stats.size(); ++i) {
+      LOG(INFO) << "scheduler " << channel_stats[i].name << " priority "
+                << channel_stats[i].priority << " tasks "
+                << channel_stats[i].tasks_run << " time "
+                << channel_stats[i].task_time_us / 1000 << " ms";
+    }
+    LOG(INFO) << "scheduler tasks stolen: " << steals;
+  }
+  if (use_governor) {
+    std::vector<webmlive::CpuGovernorChannelStats> governor_stats;
+    governor.GetStats(&governor_stats);
+    for (size_t i = 0; i < governor_stats.size(); ++i) {
+      LOG(INFO) << "CPU governor channel " << i << " priority "
+                << governor_stats[i].priority << " speed "
+                << governor_stats[i].speed << " speed changes "
+                << governor_stats[i].speed_changes;
+    }
+  }
+  int exit_code = EXIT_SUCCESS;
+  for (size_t i = 0; i < exit_codes.size(); ++i) {
+    if (exit_codes[i] != EXIT_SUCCESS) {
+      LOG(ERROR) << "channel " << i << " failed.";
+      exit_code = EXIT_FAILURE;
+    }
+  }
+  return exit_code;
+}
+
+// Channels of |service_main()|, started, listed, stopped and reconfigured
+// through its control server:
+//   GET /channels
+//     Lists the channels, one per line: name, state, encoded seconds and
+//     target URL.
+//   PUT /channels/<name>
+//     Starts the channel with the options of the request body, a line of
+//     the format of a host file line. A finished channel is replaced.
+//   DELETE /channels/<name>
+//     Stops the channel.
+//   POST /channels/<name>/reconfigure
+//     Passes the video_bitrate=, audio_bitrate=, speed= and
+//     keyframe_interval= values of the request body to the running
+//     channel's |WebmEncoder::Reconfigure()|.
+//   POST /channels/<name>/keyframe
+//     Has the running channel encode a keyframe, for example for a new
+//     viewer of a stream encoded with intra refresh.
+//   POST /channels/<name>/splice
+//     Splices the WebM clip at the path of the request body, a slate or an
+//     ad, into the running channel, see |WebmEncoder::SpliceClip()|.
+// Channels run headless, and write their muxed stream through the shared
+// |TaskScheduler| as in |host_main()|.
+//
+// Notes:
+// - Requests are handled on the control server thread alone, and
+//   |StopChannels()| is called once the server is stopped: the channel map
+//   needs no lock.
+class ChannelService : public webmlive::ControlHandlerInterface {
+ public:
+  ChannelService() {}
+  virtual ~ChannelService() { StopChannels(); }
+
+  virtual int HandleControlRequest(const std::string& method,
+                                   const std::string& path,
+                                   const std::string& body,
+                                   std::string* ptr_response);
+
+  // Stops all channels, and waits for them to finish. Returns false when a
+  // channel failed.
+  bool StopChannels();
+
+ private:
+  struct Channel {
+    Channel() : finished(false), exit_code(EXIT_FAILURE) {}
+    WebmEncoderConfig config;
+    ChannelControl control;
+    std::unique_ptr<std::thread> thread;
+
+    // Set, after |exit_code|, when the channel's |encoder_main()| returns.
+    std::atomic<bool> finished;
+    int exit_code;
+  };
+  typedef std::map<std::string, std::unique_ptr<Channel>> ChannelMap;
+
+  int StartChannel(const std::string& name, const std::string& options,
+                   std::string* ptr_response);
+  int StopChannel(const std::string& name, std::string* ptr_response);
+  int ReconfigureChannel(const std::string& name, const std::string& changes,
+                         std::string* ptr_response);
+  int RequestKeyframe(const std::string& name, std::string* ptr_response);
+  int SpliceClip(const std::string& name, const std::string& path,
+                 std::string* ptr_response);
+  void ListChannels(std::string* ptr_response) const;
+
+  // Returns the id of the scheduler channel |name|, added with |priority|
+  // on first use: scheduler channels are never removed, so a channel
+  // started again reuses its own, at its first priority.
+  int TaskChannel(const std::string& name, int priority);
+
+  ChannelMap channels_;
+  std::map<std::string, int> task_channels_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(ChannelService);
+};
+
+int ChannelService::HandleControlRequest(const std::string& method,
+                                         const std::string& path,
+                                         const std::string& body,
+                                         std::string* ptr_response) {
+  const std::string kChannels = "/channels";
+  const std::string kReconfigure = "/reconfigure";
+  const std::string kKeyframe = "/keyframe";
+  const std::string kSplice = "/splice";
+  if (path == kChannels) {
+    if (method != "GET") {
+      return 405;
+    }
+    ListChannels(ptr_response);
+    return 200;
+  }
+  if (path.compare(0, kChannels.length() + 1, kChannels + "/")) {
+    return 404;
+  }
+  std::string name = path.substr(kChannels.length() + 1);
+  bool reconfigure = false;
+  bool keyframe = false;
+  bool splice = false;
+  if (name.length() > kReconfigure.length() &&
+      !name.compare(name.length() - kReconfigure.length(),
+                    kReconfigure.length(), kReconfigure)) {
+    name.erase(name.length() - kReconfigure.length());
+    reconfigure = true;
+  } else if (name.length() > kKeyframe.length() &&
+             !name.compare(name.length() - kKeyframe.length(),
+                           kKeyframe.length(), kKeyframe)) {
+    name.erase(name.length() - kKeyframe.length());
+    keyframe = true;
+  } else if (name.length() > kSplice.length() &&
+             !name.compare(name.length() - kSplice.length(),
+                           kSplice.length(), kSplice)) {
+    name.erase(name.length() - kSplice.length());
+    splice = true;
+  }
+  bool valid_name = !name.empty();
+  for (size_t i = 0; i < name.length(); ++i) {
+    valid_name = valid_name &&
+        (isalnum(static_cast<unsigned char>(name[i])) || name[i] == '_' ||
+         name[i] == '-');
+  }
+  if (!valid_name) {
+    *ptr_response = "channel names are letters, digits, _ and -.\n";
+    return 400;
+  }
+  if (reconfigure) {
+    return method == "POST" ?
+        ReconfigureChannel(name, body, ptr_response) : 405;
+  }
+  if (keyframe) {
+    return method == "POST" ? RequestKeyframe(name, ptr_response) : 405;
+  }
+  if (splice) {
+    return method == "POST" ? SpliceClip(name, body, ptr_response) : 405;
+  }
+  if (method == "PUT") {
+    return StartChannel(name, body, ptr_response);
+  }
+  if (method == "DELETE") {
+    return StopChannel(name, ptr_response);
+  }
+  return 405;
+}
+
+bool ChannelService::StopChannels() {
+  bool channels_succeeded = true;
+  for (ChannelMap::iterator iter = channels_.begin();
+       iter != channels_.end(); ++iter) {
+    iter->second->control.stop = true;
+  }
+  for (ChannelMap::iterator iter = channels_.begin();
+       iter != channels_.end(); ++iter) {
+    iter->second->thread->join();
+    if (iter->second->exit_code != EXIT_SUCCESS) {
+      LOG(ERROR) << "channel " << iter->first << " failed.";
+      channels_succeeded = false;
+    }
+  }
+  channels_.clear();
+  return channels_succeeded;
+}
+
+int ChannelService::StartChannel(const std::string& name,
+                                 const std::string& options,
+                                 std::string* ptr_response) {
+  ChannelMap::iterator iter = channels_.find(name);
+  if (iter != channels_.end()) {
+    if (!iter->second->finished) {
+      *ptr_response = "channel " + name + " is running.\n";
+      return 409;
+    }
+    iter->second->thread->join();
+    channels_.erase(iter);
+  }
+  std::unique_ptr<Channel> channel(new (std::nothrow) Channel());  // NOLINT
+  if (!channel) {
+    LOG(ERROR) << "cannot construct channel " << name;
+    return 500;
+  }
+  StringVector args;
+  WebmEncoderConfig& config = channel->config;
+  if (!split_channel_options(options, &args) ||
+      !parse_channel(args, &config)) {
+    *ptr_response = "invalid options for channel " + name + ".\n";
+    return 400;
+  }
+  config.headless = true;
+  config.ptr_control = &channel->control;
+  if (!config.thread_settings.empty() ||
+      config.enc_config.numa_node != webmlive::NumaTopology::kNoNode) {
+    LOG(WARNING) << "channel " << name << ": thread settings apply to all "
+                 << "channels; using those of the service command line.";
+  }
+  if (!config.enc_config.stream_chunks) {
+    config.enc_config.async_sink = true;
+    config.enc_config.task_channel =
+        TaskChannel(name, config.channel_priority);
+  }
+  if (config.enc_config.dash_encode) {
+    config.enc_config.dash_drain_channel =
+        TaskChannel(name + "_dash", config.channel_priority);
+  }
+  if (config.enc_config.task_channel < 0 ||
+      config.enc_config.dash_drain_channel < 0) {
+    LOG(ERROR) << "cannot add scheduler channels of channel " << name;
+    return 500;
+  }
+
+  Channel* const ptr_channel = channel.get();
+  channel->thread.reset(
+      new (std::nothrow) std::thread([ptr_channel] {  // NOLINT
+        ptr_channel->exit_code = encoder_main(&ptr_channel->config);
+        ptr_channel->finished = true;
+      }));
+  if (!channel->thread) {
+    LOG(ERROR) << "cannot construct channel " << name << " thread.";
+    return 500;
+  }
+  LOG(INFO) << "channel " << name << " started, url: "
+            << config.uploader_settings.target_url
+            << " priority: " << config.channel_priority;
+  channels_[name] = std::move(channel);
+  *ptr_response = "channel " + name + " started.\n";
+  return 201;
+}
+
+int ChannelService::StopChannel(const std::string& name,
+                                std::string* ptr_response) {
+  const ChannelMap::iterator iter = channels_.find(name);
+  if (iter == channels_.end()) {
+    *ptr_response = "no channel " + name + ".\n";
+    return 404;
+  }
+  iter->second->control.stop = true;
+  iter->second->thread->join();
+  const bool failed = iter->second->exit_code != EXIT_SUCCESS;
+  channels_.erase(iter);
+  LOG(INFO) << "channel " << name << (failed ? " failed." : " stopped.");
+  *ptr_response = "channel " + name + (failed ? " failed.\n" : " stopped.\n");
+  return 200;
+}
+
+int ChannelService::ReconfigureChannel(const std::string& name,
+                                       const std::string& changes,
+                                       std::string* ptr_response) {
+  const ChannelMap::iterator iter = channels_.find(name);
+  if (iter == channels_.end() || iter->second->finished) {
+    *ptr_response = "no running channel " + name + ".\n";
+    return iter == channels_.end() ? 404 : 409;
+  }
+  webmlive::EncoderReconfiguration reconfig;
+  std::istringstream changes_stream(changes);
+  std::string change;
+  while (changes_stream >> change) {
+    const size_t equals = change.find('=');
+    char* ptr_end = NULL;
+    const int value = equals == std::string::npos ? 0 :
+        strtol(change.c_str() + equals + 1, &ptr_end, 10);
+    const std::string key = change.substr(0, equals);
+    int* ptr_field = NULL;
+    if (key == "video_bitrate") {
+      ptr_field = &reconfig.video_bitrate;
+    } else if (key == "audio_bitrate") {
+      ptr_field = &reconfig.audio_bitrate;
+    } else if (key == "speed") {
+      ptr_field = &reconfig.video_speed;
+    } else if (key == "keyframe_interval") {
+      ptr_field = &reconfig.keyframe_interval;
+    }
+    if (!ptr_field || !ptr_end || *ptr_end ||
+        ptr_end == change.c_str() + equals + 1) {
+      *ptr_response = "invalid change: " + change + "\n";
+      return 400;
+    }
+    *ptr_field = value;
+  }
+
+  // Changes not yet applied by the channel's loop are kept, unless
+  // replaced.
+  typedef webmlive::EncoderReconfiguration Reconfig;
+  ChannelControl& control = iter->second->control;
+  std::lock_guard<std::mutex> lock(control.mutex);
+  Reconfig& pending = control.reconfig;
+  if (!control.reconfigure) {
+    pending = Reconfig();
+  }
+  if (reconfig.video_bitrate != Reconfig::kUnchanged) {
+    pending.video_bitrate = reconfig.video_bitrate;
+  }
+  if (reconfig.audio_bitrate != Reconfig::kUnchanged) {
+    pending.audio_bitrate = reconfig.audio_bitrate;
+  }
+  if (reconfig.video_speed != Reconfig::kUnchanged) {
+    pending.video_speed = reconfig.video_speed;
+  }
+  if (reconfig.keyframe_interval != Reconfig::kUnchanged) {
+    pending.keyframe_interval = reconfig.keyframe_interval;
+  }
+  control.reconfigure = true;
+  *ptr_response = "channel " + name + " reconfiguration queued.\n";
+  return 202;
+}
+
+int ChannelService::RequestKeyframe(const std::string& name,
+                                    std::string* ptr_response) {
+  const ChannelMap::iterator iter = channels_.find(name);
+  if (iter == channels_.end() || iter->second->finished) {
+    *ptr_response = "no running channel " + name + ".\n";
+    return iter == channels_.end() ? 404 : 409;
+  }
+  iter->second->control.keyframe = true;
+  *ptr_response = "channel " + name + " keyframe requested.\n";
+  return 202;
+}
+
+int ChannelService::SpliceClip(const std::string& name,
+                               const std::string& path,
+                               std::string* ptr_response) {
+  const ChannelMap::iterator iter = channels_.find(name);
+  if (iter == channels_.end() || iter->second->finished) {
+    *ptr_response = "no running channel " + name + ".\n";
+    return iter == channels_.end() ? 404 : 409;
+  }
+  std::string clip = path;
+  while (!clip.empty() && isspace(static_cast<unsigned char>(clip.back()))) {
+    clip.erase(clip.length() - 1);
+  }
+  if (clip.empty()) {
+    *ptr_response = "the request body must name a clip.\n";
+    return 400;
+  }
+  ChannelControl& control = iter->second->control;
+  std::lock_guard<std::mutex> lock(control.mutex);
+  control.splice_clip = clip;
+  *ptr_response = "channel " + name + " splice of " + clip + " requested.\n";
+  return 202;
+}
+
+void ChannelService::ListChannels(std::string* ptr_response) const {
+  std::ostringstream list;
+  for (ChannelMap::const_iterator iter = channels_.begin();
+       iter != channels_.end(); ++iter) {
+    const Channel& channel = *iter->second;
+    const char* const state = !channel.finished ? "running" :
+        channel.exit_code == EXIT_SUCCESS ? "finished" : "failed";
+    list << iter->first << " " << state << " "
+         << channel.control.encoded_duration / 1000.0 << " "
+         << channel.config.uploader_settings.target_url << "\n";
+  }
+  *ptr_response = list.str();
+}
+
+int ChannelService::TaskChannel(const std::string& name, int priority) {
+  const std::map<std::string, int>::const_iterator iter =
+      task_channels_.find(name);
+  if (iter != task_channels_.end()) {
+    return iter->second;
+  }
+  const int id =
+      webmlive::TaskScheduler::Instance()->AddChannel(name, priority);
+  if (id >= 0) {
+    task_channels_[name] = id;
+  }
+  return id;
+}
+
+// Runs a |ChannelService| that serves its API on the loopback port
+// |service_config.control_settings.port| until a console control event.
+// Logging, the thread registry and the scheduler are set up once for all
+// the channels the service starts, which do without a process each.
+// Returns EXIT_FAILURE when the service cannot start, or a channel fails.
+int service_main(const WebmEncoderConfig& service_config) {
+  webmlive::TaskScheduler* const scheduler =
+      webmlive::TaskScheduler::Instance();
+  if (scheduler->Init(service_config.host_workers) || scheduler->Run()) {
+    return EXIT_FAILURE;
+  }
+  webmlive::VpxContextPool* const vpx_pool =
+      webmlive::VpxContextPool::Instance();
+  vpx_pool->set_capacity(service_config.vpx_context_pool);
+  int exit_code = EXIT_FAILURE;
+  ChannelService service;
+  {
+    webmlive::ControlServer control_server;
+    if (!control_server.Init(service_config.control_settings, &service) &&
+        !control_server.Run()) {
+      install_stop_handler();
+      while (!stop_requested) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      }
+      control_server.Stop();
+      LOG(INFO) << "control requests: " << control_server.requests();
+      exit_code = EXIT_SUCCESS;
+    }
+  }
+  if (!service.StopChannels()) {
+    exit_code = EXIT_FAILURE;
+  }
+  webmlive::VpxContextPoolStats pool_stats;
+  vpx_pool->GetStats(&pool_stats);
+  LOG(INFO) << "VPx contexts reused: " << pool_stats.reused << " created: "
+            << pool_stats.created << " evicted: " << pool_stats.evicted;
+  vpx_pool->set_capacity(0);
+  scheduler->Stop();
+  return exit_code;
+}
+
+int main(int argc, const char** argv) {
+  google::InitGoogleLogging(argv[0]);
+  webmlive::AsyncLogger async_logger;
+  if (async_logger.Init()) {
+    LOG(WARNING) << "AsyncLogger Init failed, logging synchronously.";
+  }
+  WebmEncoderConfig config;
+  parse_command_line(argc, argv, config);
+  if (!valid_config(config)) {
+    async_logger.Stop();
+    google::ShutdownGoogleLogging();
+    return EXIT_FAILURE;
+  }
+  for (ThreadSettingsMap::const_iterator iter = config.thread_settings.begin();
+       iter != config.thread_settings.end(); ++iter) {
+    webmlive::ThreadRegistry::Instance()->SetSettings(iter->first,
+                                                      iter->second);
+  }
+  webmlive::ThreadRegistry::Instance()->set_default_numa_node(
+      config.enc_config.numa_node);
+
+  webmlive::EtwTraceRegister();
+  int exit_code = EXIT_SUCCESS;
+  if (config.control_settings.port) {
+    LOG(INFO) << "service port: " << config.control_settings.port;
+    exit_code = service_main(config);
+  } else if (!config.host_file.empty()) {
+    LOG(INFO) << "host: " << config.host_file;
+    exit_code = host_main(config);
+  } else {
+    LOG(INFO) << "url: " << config.uploader_settings.target_url.c_str();
+
+    // The chunks of each DASH muxer are written by tasks on the shared
+    // scheduler, so that the muxers' segment writes run concurrently.
+    webmlive::TaskScheduler* const scheduler =
+        webmlive::TaskScheduler::Instance();
+    bool drain_tasks = false;
+    if (config.enc_config.dash_encode) {
+      drain_tasks = !scheduler->Init(config.host_workers) &&
+                    !scheduler->Run();
+      if (drain_tasks) {
+        config.enc_config.dash_drain_channel = scheduler->AddChannel(
+            "dash", webmlive::TaskScheduler::kDefaultPriority);
+      } else {
+        LOG(WARNING) << "task scheduler failed, DASH chunks are written "
+                     << "by the muxing threads.";
+      }
+    }
+    exit_code = encoder_main(&config);
+    if (drain_tasks) {
+      scheduler->Stop();
+    }
+  }
+  webmlive::EtwTraceUnregister();
+  async_logger.Stop();
   google::ShutdownGoogleLogging();
   return exit_code;
 }
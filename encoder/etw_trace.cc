@@ -0,0 +1,137 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/etw_trace.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <TraceLoggingProvider.h>
+#include <winmeta.h>
+#endif
+
+#include "encoder/latency_tracer.h"
+
+#ifdef _WIN32
+// {9ade2d5d-9067-52eb-0ccd-025e9eab36fc}, the EventSource GUID of the name.
+TRACELOGGING_DEFINE_PROVIDER(
+    g_webmlive_provider, "WebmLive",
+    (0x9ade2d5d, 0x9067, 0x52eb,
+     0x0c, 0xcd, 0x02, 0x5e, 0x9e, 0xab, 0x36, 0xfc));
+#endif
+
+namespace webmlive {
+
+namespace {
+
+#ifdef _WIN32
+// Keywords that select events in a trace session.
+const uint64 kKeywordPipeline = 0x1;
+const uint64 kKeywordUpload = 0x2;
+
+const char* StreamName(int stream) {
+  return stream == kLatencyAudio ? "audio" : "video";
+}
+
+// Writes the |stage| event |name| with |opcode|.
+#define WEBMLIVE_ETW_WRITE_STAGE(name, opcode)                        \
+  TraceLoggingWrite(g_webmlive_provider, name,                       \
+                    TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),       \
+                    TraceLoggingKeyword(kKeywordPipeline),           \
+                    TraceLoggingOpcode(opcode),                      \
+                    TraceLoggingString(StreamName(stream), "Stream"), \
+                    TraceLoggingInt64(timestamp, "Timestamp"))
+#endif  // _WIN32
+
+}  // namespace
+
+void EtwTraceRegister() {
+#ifdef _WIN32
+  TraceLoggingRegister(g_webmlive_provider);
+#endif
+}
+
+void EtwTraceUnregister() {
+#ifdef _WIN32
+  TraceLoggingUnregister(g_webmlive_provider);
+#endif
+}
+
+void EtwTraceStage(int stream, int stage, int64 timestamp) {
+#ifdef _WIN32
+  if (stream < 0 ||
+      !TraceLoggingProviderEnabled(g_webmlive_provider,
+                                   WINEVENT_LEVEL_VERBOSE,
+                                   kKeywordPipeline)) {
+    return;
+  }
+  switch (stage) {
+    case kLatencyReceived:
+      WEBMLIVE_ETW_WRITE_STAGE("Received", WINEVENT_OPCODE_INFO);
+      break;
+    case kLatencyCommitted:
+      WEBMLIVE_ETW_WRITE_STAGE("PoolCommit", WINEVENT_OPCODE_INFO);
+      break;
+    case kLatencyDecommitted:
+      WEBMLIVE_ETW_WRITE_STAGE("PoolDecommit", WINEVENT_OPCODE_INFO);
+      break;
+    case kLatencyEncodeStart:
+      WEBMLIVE_ETW_WRITE_STAGE("Encode", WINEVENT_OPCODE_START);
+      break;
+    case kLatencyEncodeEnd:
+      WEBMLIVE_ETW_WRITE_STAGE("Encode", WINEVENT_OPCODE_STOP);
+      break;
+    case kLatencyMuxed:
+      WEBMLIVE_ETW_WRITE_STAGE("Muxed", WINEVENT_OPCODE_INFO);
+      break;
+    case kLatencyChunkReady:
+      WEBMLIVE_ETW_WRITE_STAGE("ChunkReady", WINEVENT_OPCODE_INFO);
+      break;
+    case kLatencySinkWritten:
+      WEBMLIVE_ETW_WRITE_STAGE("SinkWritten", WINEVENT_OPCODE_INFO);
+      break;
+  }
+#else
+  (void)stream;
+  (void)stage;
+  (void)timestamp;
+#endif
+}
+
+void EtwTraceUploadBegin(const std::string& id, int64 bytes) {
+#ifdef _WIN32
+  TraceLoggingWrite(g_webmlive_provider, "Upload",
+                    TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),
+                    TraceLoggingKeyword(kKeywordUpload),
+                    TraceLoggingOpcode(WINEVENT_OPCODE_START),
+                    TraceLoggingString(id.c_str(), "Id"),
+                    TraceLoggingInt64(bytes, "Bytes"));
+#else
+  (void)id;
+  (void)bytes;
+#endif
+}
+
+void EtwTraceUploadEnd(const std::string& id, int64 bytes, int result,
+                       int64 response_code) {
+#ifdef _WIN32
+  TraceLoggingWrite(g_webmlive_provider, "Upload",
+                    TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),
+                    TraceLoggingKeyword(kKeywordUpload),
+                    TraceLoggingOpcode(WINEVENT_OPCODE_STOP),
+                    TraceLoggingString(id.c_str(), "Id"),
+                    TraceLoggingInt64(bytes, "Bytes"),
+                    TraceLoggingInt32(result, "Result"),
+                    TraceLoggingInt64(response_code, "ResponseCode"));
+#else
+  (void)id;
+  (void)bytes;
+  (void)result;
+  (void)response_code;
+#endif
+}
+
+}  // namespace webmlive
@@ -0,0 +1,62 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_ETW_TRACE_H_
+#define WEBMLIVE_ENCODER_ETW_TRACE_H_
+
+#include <string>
+
+#include "encoder/basictypes.h"
+
+// Event Tracing for Windows events at the pipeline stages traced by
+// |WEBMLIVE_TRACE_LATENCY()|, and at the start and end of uploads, so that
+// WPA and xperf traces show the encoder's phases next to scheduling, disk
+// and network activity. Events are compiled out unless
+// |WEBMLIVE_ETW_TRACING| is defined; arguments are not evaluated when they
+// are. When compiled in, an event costs one test of a provider flag unless a
+// trace session has enabled the provider.
+//
+// The provider is named "WebmLive", with GUID
+// {9ade2d5d-9067-52eb-0ccd-025e9eab36fc} derived from the name, so sessions
+// can enable it by name, e.g. "xperf -start webmlive -on *WebmLive" or
+// "wpr -start webmlive.wprp". Events use the TraceLogging format, which
+// describes itself: no manifest needs to be registered to decode them.
+#ifdef WEBMLIVE_ETW_TRACING
+#define WEBMLIVE_ETW_UPLOAD_BEGIN(id, bytes) \
+  webmlive::EtwTraceUploadBegin(id, bytes)
+#define WEBMLIVE_ETW_UPLOAD_END(id, bytes, result, response_code) \
+  webmlive::EtwTraceUploadEnd(id, bytes, result, response_code)
+#else
+#define WEBMLIVE_ETW_UPLOAD_BEGIN(id, bytes) \
+  while (false) webmlive::EtwTraceUploadBegin(id, bytes)
+#define WEBMLIVE_ETW_UPLOAD_END(id, bytes, result, response_code) \
+  while (false) webmlive::EtwTraceUploadEnd(id, bytes, result, response_code)
+#endif
+
+namespace webmlive {
+
+// Registers and unregisters the provider. Events written outside
+// |EtwTraceRegister()| and |EtwTraceUnregister()| are discarded. Call from
+// the main thread before and after the encoder runs.
+void EtwTraceRegister();
+void EtwTraceUnregister();
+
+// Writes the event of |stage|, a |LatencyStage|, for the |stream|
+// |LatencyStream| frame or buffer with capture timestamp |timestamp|. The
+// encode stages are written as the start and stop of an "Encode" activity.
+// Called by |WEBMLIVE_TRACE_LATENCY()|.
+void EtwTraceStage(int stream, int stage, int64 timestamp);
+
+// Write the start and stop of an "Upload" activity for the chunk or stream
+// |id|. |result| is the libcurl result code.
+void EtwTraceUploadBegin(const std::string& id, int64 bytes);
+void EtwTraceUploadEnd(const std::string& id, int64 bytes, int result,
+                       int64 response_code);
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_ETW_TRACE_H_
@@ -0,0 +1,250 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/fallback_slate.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+#include "encoder/video_encoder.h"
+#include "encoder/webm_encoder.h"
+#include "encoder/webm_mux.h"
+#include "glog/logging.h"
+#include "libwebm/mkvmuxer.hpp"
+
+namespace webmlive {
+
+namespace {
+
+// Video limited range black.
+const uint8 kBlackLuma = 16;
+const uint8 kBlackChroma = 128;
+
+// Frame rate of the loop when the stream's is unknown.
+const double kDefaultFrameRate = 30.0;
+
+// Length of the silent buffers passed to the audio encoder, in
+// milliseconds.
+const int kSilenceBufferDuration = 10;
+
+}  // namespace
+
+const int FallbackSlate::kLoopDuration;
+
+FallbackSlate::FallbackSlate()
+    : start_time_(-1), loops_(0), mismatch_(false), loops_muxed_(0) {
+  clip_.Reset("fallback slate");
+}
+
+FallbackSlate::~FallbackSlate() {
+}
+
+int FallbackSlate::EncodeVideo(const WebmEncoderConfig& config) {
+  const VideoConfig encoded = EncodedVideoConfig(config.actual_video_config);
+  const int32 width = encoded.width;
+  const int32 height = abs(encoded.height);
+  if (width <= 0 || height <= 0) {
+    LOG(ERROR) << "cannot encode a " << width << "x" << height << " slate.";
+    return kInvalidArg;
+  }
+
+  // Plain top-down I420 frames of the track size, encoded by libvpx with a
+  // single keyframe, which starts the loop.
+  WebmEncoderConfig slate_config = config;
+  VideoConfig& raw_config = slate_config.actual_video_config;
+  raw_config = VideoConfig();
+  raw_config.format = kVideoFormatI420;
+  raw_config.width = width;
+  raw_config.height = height;
+  raw_config.stride = width;
+  raw_config.uv_stride = (width + 1) / 2;
+  raw_config.frame_rate =
+      encoded.frame_rate > 0 ? encoded.frame_rate : kDefaultFrameRate;
+  VpxConfig& vpx_config = slate_config.vpx_config;
+  vpx_config.encoder_backend = kVideoEncoderSoftware;
+  vpx_config.keyframe_interval = kLoopDuration * 2;
+  vpx_config.aligned_keyframes = false;
+  vpx_config.intra_refresh = false;
+  vpx_config.scene_cut_threshold = 0;
+  vpx_config.adaptive_speed = false;
+  vpx_config.latency_budget = 0;
+  vpx_config.temporal_layers = 1;
+  vpx_config.spatial_layers = 1;
+  vpx_config.regions_of_interest.clear();
+  vpx_config.warmup_frames = 0;
+  vpx_config.parallel_gops = 0;
+  VideoEncoder encoder;
+  if (encoder.Init(slate_config)) {
+    LOG(ERROR) << "slate video encoder Init failed.";
+    return kEncoderError;
+  }
+
+  const int32 luma_size = width * height;
+  const int32 chroma_size = raw_config.uv_stride * ((height + 1) / 2);
+  std::vector<uint8> black(luma_size + chroma_size * 2, kBlackChroma);
+  std::fill(black.begin(), black.begin() + luma_size, kBlackLuma);
+  clip_.SetVideoTrack(vpx_config.codec == kVideoFormatVP9 ?
+                          mkvmuxer::Tracks::kVp9CodecId :
+                          mkvmuxer::Tracks::kVp8CodecId,
+                      width, height);
+
+  // Frame times are spread over the loop so that the last frame ends it.
+  const int num_frames = std::max(
+      1, static_cast<int>(raw_config.frame_rate * kLoopDuration / 1000 + 0.5));
+  VideoFrame raw_frame;
+  VideoFrame vpx_frame;
+  for (int i = 0; i <= num_frames; ++i) {
+    int32 status = VideoEncoder::kDropped;
+    if (i < num_frames) {
+      const int64 timestamp = static_cast<int64>(i) * kLoopDuration /
+                              num_frames;
+      const int64 duration = static_cast<int64>(i + 1) * kLoopDuration /
+                             num_frames - timestamp;
+      if (raw_frame.Init(raw_config, false, timestamp, duration, &black[0],
+                         static_cast<int32>(black.size()))) {
+        LOG(ERROR) << "cannot init a slate frame.";
+        return kNoMemory;
+      }
+      status = encoder.EncodeFrame(raw_frame, &vpx_frame);
+    } else if (encoder.Flush() == VideoEncoder::kSuccess) {
+      status = encoder.ReadPendingFrame(&vpx_frame);
+    }
+    while (status == VideoEncoder::kSuccess) {
+      if (clip_.AddFrame(false, vpx_frame.buffer(), vpx_frame.buffer_length(),
+                         vpx_frame.timestamp(), vpx_frame.duration(),
+                         vpx_frame.keyframe())) {
+        return kEncoderError;
+      }
+      status = encoder.ReadPendingFrame(&vpx_frame);
+    }
+    if (status != VideoEncoder::kDropped) {
+      LOG(ERROR) << "slate video encode failed: " << status;
+      return kEncoderError;
+    }
+  }
+  if (clip_.video().frames.empty()) {
+    LOG(ERROR) << "slate video encoder produced no frames.";
+    return kEncoderError;
+  }
+  clip_.set_duration(kLoopDuration);
+  LOG(INFO) << "slate video: " << clip_.video().frames.size() << " "
+            << clip_.video().codec_id << " frames, " << width << "x"
+            << height << ".";
+  return kSuccess;
+}
+
+int FallbackSlate::EncodeAudio(const AudioConfig& input_config,
+                               AudioEncoder* ptr_encoder) {
+  if (!ptr_encoder || input_config.block_align <= 0 ||
+      input_config.sample_rate <= 0) {
+    return kInvalidArg;
+  }
+  AudioCodecPrivate codec_private;
+  if (ptr_encoder->GetCodecPrivate(&codec_private)) {
+    LOG(ERROR) << "slate audio encoder GetCodecPrivate failed.";
+    return kEncoderError;
+  }
+  const AudioConfig& encoded_config = *ptr_encoder->audio_config();
+  clip_.SetAudioTrack(codec_private.format == kAudioFormatOpus ?
+                          mkvmuxer::Tracks::kOpusCodecId :
+                          mkvmuxer::Tracks::kVorbisCodecId,
+                      codec_private.data, encoded_config.sample_rate,
+                      encoded_config.channels);
+
+  // Silence is fed until a packet past the loop comes out of the encoder's
+  // lookahead, or twice the loop has gone in.
+  const int32 buffer_frames =
+      input_config.sample_rate * kSilenceBufferDuration / 1000;
+  const std::vector<uint8> silence(buffer_frames * input_config.block_align,
+                                   0);
+  AudioBuffer input_buffer;
+  AudioBuffer packet;
+  bool covered = false;
+  for (int64 timestamp = 0; timestamp < kLoopDuration * 2 && !covered;
+       timestamp += kSilenceBufferDuration) {
+    if (input_buffer.Init(input_config, timestamp, kSilenceBufferDuration,
+                          &silence[0], static_cast<int32>(silence.size())) ||
+        ptr_encoder->Encode(input_buffer)) {
+      LOG(ERROR) << "slate audio encode failed.";
+      return kEncoderError;
+    }
+    int status;
+    while ((status = ptr_encoder->ReadCompressedAudio(&packet)) ==
+           AudioEncoder::kSuccess) {
+      if (packet.timestamp() >= kLoopDuration) {
+        covered = true;
+      } else if (clip_.AddFrame(true, packet.buffer(),
+                                packet.buffer_length(), packet.timestamp(),
+                                packet.duration(), true)) {
+        return kEncoderError;
+      }
+    }
+    if (status != AudioEncoder::kNoSamples) {
+      LOG(ERROR) << "slate audio read failed: " << status;
+      return kEncoderError;
+    }
+  }
+  if (clip_.audio().frames.empty()) {
+    LOG(ERROR) << "slate audio encoder produced no packets.";
+    return kEncoderError;
+  }
+  clip_.set_duration(kLoopDuration);
+  LOG(INFO) << "slate audio: " << clip_.audio().frames.size() << " "
+            << clip_.audio().codec_id << " packets.";
+  return kSuccess;
+}
+
+bool FallbackSlate::LoopsDue(int64 start_time, int64 end_time) const {
+  if (start_time < 0 || !ready()) {
+    return false;
+  }
+  if (start_time != start_time_) {
+    return start_time + kLoopDuration <= end_time;
+  }
+  return !mismatch_ && start_time + (loops_ + 1) * kLoopDuration <= end_time;
+}
+
+int FallbackSlate::Follow(int64 start_time, int64 end_time,
+                          const std::vector<LiveWebmMuxer*>& muxers) {
+  if (!LoopsDue(start_time, end_time)) {
+    return kSuccess;
+  }
+  if (start_time != start_time_) {
+    start_time_ = start_time;
+    loops_ = 0;
+    mismatch_ = false;
+    for (size_t i = 0; i < muxers.size() && !mismatch_; ++i) {
+      if (!muxers[i]->CanSplice(clip_)) {
+        LOG(ERROR) << "fallback slate does not match muxer "
+                   << muxers[i]->muxer_id() << ", not muxing it.";
+        mismatch_ = true;
+      }
+    }
+  }
+  while (LoopsDue(start_time, end_time)) {
+    const int64 loop_start = start_time_ + loops_ * kLoopDuration;
+    ++loops_;
+    for (size_t i = 0; i < muxers.size(); ++i) {
+      if (loop_start < muxers[i]->muxer_time()) {
+        LOG(WARNING) << "muxer " << muxers[i]->muxer_id() << " is past the "
+                     << "slate loop at " << loop_start << " ms, skipping it.";
+        continue;
+      }
+      int64 loop_end = 0;
+      const int status = muxers[i]->SpliceClip(clip_, loop_start, &loop_end);
+      if (status) {
+        LOG(ERROR) << "muxer " << muxers[i]->muxer_id()
+                   << " slate SpliceClip failed: " << status;
+        return status;
+      }
+    }
+    ++loops_muxed_;
+  }
+  return kSuccess;
+}
+
+}  // namespace webmlive
@@ -0,0 +1,100 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_FALLBACK_SLATE_H_
+#define WEBMLIVE_ENCODER_FALLBACK_SLATE_H_
+
+#include <vector>
+
+#include "encoder/audio_encoder.h"
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+#include "encoder/webm_splice_clip.h"
+
+namespace webmlive {
+
+class LiveWebmMuxer;
+struct WebmEncoderConfig;
+
+// A loop of black video and silent audio, encoded once in the codec
+// configuration of a stream, that covers the stream's output while the
+// capture source is lost (|CaptureWatchdogSettings::slate|). Loops are
+// written by |LiveWebmMuxer::SpliceClip()|: nothing is encoded while the
+// source is down.
+//
+// The loops follow a schedule shared by all slates of an encoder, so that
+// every stream leaves the slate at the same time. Loop k of the schedule
+// starting at |start_time| covers the |kLoopDuration| milliseconds from
+// |start_time + k * kLoopDuration|, and is muxed once the end of the
+// schedule passes its end.
+//
+// Notes:
+// - Not thread safe: |Follow()| is called by the thread that writes the
+//   muxers.
+// - The audio loop decodes only with the codec private data of the stream,
+//   which an encoder configured like the stream's reproduces.
+class FallbackSlate {
+ public:
+  enum {
+    kEncoderError = -3,
+    kNoMemory = -2,
+    kInvalidArg = -1,
+    kSuccess = 0,
+  };
+
+  // Length of a loop, in milliseconds.
+  static const int kLoopDuration = 1000;
+
+  FallbackSlate();
+  ~FallbackSlate();
+
+  // Encodes a loop of black frames of the encoded size of
+  // |config.actual_video_config| with the codec of |config.vpx_config|,
+  // using libvpx. Returns |kSuccess|, |kInvalidArg| when the frame size is
+  // not set, or |kEncoderError|.
+  int EncodeVideo(const WebmEncoderConfig& config);
+
+  // Encodes a loop of silent |input_config| samples with |ptr_encoder|,
+  // which must be initialized for them and encode nothing else. Returns
+  // |kSuccess|, |kInvalidArg| when |ptr_encoder| is NULL or |input_config|
+  // has no sample size, or |kEncoderError|.
+  int EncodeAudio(const AudioConfig& input_config, AudioEncoder* ptr_encoder);
+
+  // Muxes the loops of the schedule from |start_time| that end by
+  // |end_time|, in milliseconds, into each of |muxers|, skipping those
+  // already muxed. A new |start_time| starts a new schedule. A loop that
+  // would precede the frames a muxer has written is skipped for it, and a
+  // schedule whose muxers cannot splice the slate is left to them, with an
+  // error logged. Returns |kSuccess|, or the |LiveWebmMuxer::SpliceClip()|
+  // status that failed.
+  int Follow(int64 start_time, int64 end_time,
+             const std::vector<LiveWebmMuxer*>& muxers);
+
+  // Returns true when |Follow()| has loops of the schedule to mux.
+  bool LoopsDue(int64 start_time, int64 end_time) const;
+
+  // Returns false until a loop is encoded.
+  bool ready() const { return clip_.duration() > 0; }
+
+  // Loops muxed by |Follow()|.
+  int64 loops_muxed() const { return loops_muxed_; }
+
+ private:
+  WebmSpliceClip clip_;
+
+  // Start of the schedule followed, or -1 before the first, the loops of it
+  // muxed or skipped, and whether its muxers cannot splice |clip_|.
+  int64 start_time_;
+  int64 loops_;
+  bool mismatch_;
+  int64 loops_muxed_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(FallbackSlate);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_FALLBACK_SLATE_H_
@@ -0,0 +1,171 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/fault_injection_sink.h"
+
+#include <algorithm>
+#include <new>
+
+#include "glog/logging.h"
+
+namespace webmlive {
+
+FaultInjectionSink::FaultInjectionSink() : ptr_sink_(NULL) {
+}
+
+FaultInjectionSink::~FaultInjectionSink() {
+}
+
+int FaultInjectionSink::Init(const FaultInjectionSettings& settings,
+                             DataSinkInterface* ptr_sink) {
+  if (settings.latency_ms < 0 || settings.jitter_ms < 0 ||
+      settings.bandwidth_kbps < 0 || settings.failure_percent < 0 ||
+      settings.drop_percent < 0 ||
+      settings.failure_percent + settings.drop_percent > 100 ||
+      settings.outage_interval_ms < 0 || settings.outage_ms < 0 ||
+      (settings.outage_interval_ms > 0 &&
+       settings.outage_ms >= settings.outage_interval_ms)) {
+    LOG(ERROR) << "invalid fault injection settings.";
+    return kInvalidArg;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  settings_ = settings;
+  ptr_sink_ = ptr_sink;
+  random_.seed(settings_.seed);
+  start_time_ = Clock::now();
+  busy_until_ = start_time_;
+  stats_ = FaultInjectionStats();
+  LOG(INFO) << "injecting sink faults: latency " << settings_.latency_ms
+            << "+" << settings_.jitter_ms << " ms, "
+            << settings_.bandwidth_kbps << " kbps, "
+            << settings_.failure_percent << "% failures, "
+            << settings_.drop_percent << "% drops, outages of "
+            << settings_.outage_ms << " ms every "
+            << settings_.outage_interval_ms << " ms.";
+  return kSuccess;
+}
+
+void FaultInjectionSink::GetStats(FaultInjectionStats* ptr_stats) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  bool in_outage = false;
+  *ptr_stats = stats_;
+  ptr_stats->outages = CountOutages(Clock::now(), &in_outage);
+}
+
+bool FaultInjectionSink::Ready() const {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const Clock::time_point now = Clock::now();
+    bool in_outage = false;
+    CountOutages(now, &in_outage);
+    if (in_outage || now < busy_until_) {
+      return false;
+    }
+  }
+  return !ptr_sink_ || ptr_sink_->Ready();
+}
+
+bool FaultInjectionSink::WriteData(const uint8* ptr_data, int32 data_length,
+                                   const std::string& id) {
+  if (!ptr_data || data_length < 0) {
+    LOG(ERROR) << "invalid fault injection write.";
+    return false;
+  }
+  WebmChunk::Data data(ptr_data, ptr_data + data_length);
+  WebmChunkDescriptor descriptor;
+  descriptor.length = data_length;
+  SharedWebmChunk chunk(
+      new (std::nothrow) WebmChunk(id, descriptor, 0, &data,  // NOLINT
+                                   SharedWebmChunkDataPool()));
+  if (!chunk) {
+    LOG(ERROR) << "out of memory.";
+    return false;
+  }
+  return WriteChunk(chunk);
+}
+
+bool FaultInjectionSink::WriteChunk(const SharedWebmChunk& chunk) {
+  if (!chunk) {
+    return false;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const Clock::time_point now = Clock::now();
+    bool in_outage = false;
+    CountOutages(now, &in_outage);
+    if (in_outage) {
+      ++stats_.outage_rejects;
+      return false;
+    }
+
+    // The chunk keeps the sink busy whether it is sent or not.
+    int64 busy_ms = settings_.latency_ms;
+    if (settings_.jitter_ms > 0) {
+      busy_ms += random_() % (settings_.jitter_ms + 1);
+    }
+    if (settings_.bandwidth_kbps > 0) {
+      busy_ms += static_cast<int64>(chunk->length()) * 8 /
+                 settings_.bandwidth_kbps;
+    }
+    busy_until_ = std::max(busy_until_, now) +
+                  std::chrono::milliseconds(busy_ms);
+    stats_.busy_ms += busy_ms;
+
+    if (Roll(settings_.failure_percent)) {
+      ++stats_.failures;
+      return false;
+    }
+    if (Roll(settings_.drop_percent) || !ptr_sink_) {
+      ++stats_.drops;
+      return true;
+    }
+    ++stats_.chunks;
+    stats_.bytes += chunk->length();
+  }
+  return ptr_sink_->WriteChunk(chunk);
+}
+
+bool FaultInjectionSink::BeginStream(const std::string& id) {
+  return ptr_sink_ && ptr_sink_->BeginStream(id);
+}
+
+bool FaultInjectionSink::WriteStreamData(const std::string& id,
+                                         const uint8* ptr_data,
+                                         int32 data_length) {
+  return ptr_sink_ && ptr_sink_->WriteStreamData(id, ptr_data, data_length);
+}
+
+bool FaultInjectionSink::EndStream(const std::string& id) {
+  return ptr_sink_ && ptr_sink_->EndStream(id);
+}
+
+void FaultInjectionSink::SetInitSegment(const SharedWebmChunk& chunk) {
+  if (ptr_sink_) {
+    ptr_sink_->SetInitSegment(chunk);
+  }
+}
+
+int64 FaultInjectionSink::CountOutages(Clock::time_point now,
+                                       bool* ptr_in_outage) const {
+  *ptr_in_outage = false;
+  if (settings_.outage_interval_ms <= 0 || settings_.outage_ms <= 0) {
+    return 0;
+  }
+  // Each interval ends with its outage, so that the stream starts cleanly.
+  const int64 elapsed_ms = std::chrono::duration_cast<
+      std::chrono::milliseconds>(now - start_time_).count();
+  const int64 interval = settings_.outage_interval_ms;
+  const int64 outage_start = interval - settings_.outage_ms;
+  *ptr_in_outage = elapsed_ms % interval >= outage_start;
+  return elapsed_ms / interval + (*ptr_in_outage ? 1 : 0);
+}
+
+bool FaultInjectionSink::Roll(int percent) {
+  return percent > 0 && static_cast<int>(random_() % 100) < percent;
+}
+
+}  // namespace webmlive
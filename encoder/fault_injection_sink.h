@@ -0,0 +1,144 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_FAULT_INJECTION_SINK_H_
+#define WEBMLIVE_ENCODER_FAULT_INJECTION_SINK_H_
+
+#include <chrono>
+#include <mutex>
+#include <random>
+#include <string>
+
+#include "encoder/basictypes.h"
+#include "encoder/data_sink.h"
+#include "encoder/encoder_base.h"
+#include "encoder/webm_chunk.h"
+
+namespace webmlive {
+
+struct FaultInjectionSettings {
+  // Default seed of the random number generator.
+  static const uint32 kDefaultSeed = 1;
+
+  FaultInjectionSettings()
+      : latency_ms(0), jitter_ms(0), bandwidth_kbps(0), failure_percent(0),
+        drop_percent(0), outage_interval_ms(0), outage_ms(0),
+        seed(kDefaultSeed) {}
+
+  // Time the sink stays busy after each chunk, in milliseconds, plus a
+  // random time of up to |jitter_ms|.
+  int latency_ms;
+  int jitter_ms;
+
+  // Rate the sink accepts data at, in kilobits per second: each chunk keeps
+  // it busy for as long as sending its data takes. 0 is unlimited.
+  int bandwidth_kbps;
+
+  // Percentage of chunks for which |WriteChunk()| fails, and of chunks it
+  // accepts but discards.
+  int failure_percent;
+  int drop_percent;
+
+  // Every |outage_interval_ms| the sink is unavailable, neither ready nor
+  // accepting chunks, for |outage_ms|. 0 disables outages.
+  int outage_interval_ms;
+  int outage_ms;
+
+  // Seed of the random number generator, so that runs are reproducible.
+  uint32 seed;
+};
+
+// Counters of a |FaultInjectionSink|.
+struct FaultInjectionStats {
+  FaultInjectionStats()
+      : chunks(0), bytes(0), failures(0), drops(0), outage_rejects(0),
+        outages(0), busy_ms(0) {}
+
+  // Chunks passed on to the sink wrapped, and their total length.
+  int64 chunks;
+  int64 bytes;
+
+  // Chunks failed, discarded, and refused during an outage.
+  int64 failures;
+  int64 drops;
+  int64 outage_rejects;
+
+  // Outages begun since |Init()|.
+  int64 outages;
+
+  // Total time the chunks kept the sink busy, in milliseconds.
+  int64 busy_ms;
+};
+
+// Data sink decorator that injects latency, bandwidth limits, failures and
+// outages between the encoder and another data sink, for benchmarking the
+// pipeline's behavior under a slow or unreliable network. Paired with file
+// sources run with |WebmEncoderConfig::free_run| it reproduces a degraded
+// upload without a network at all.
+//
+// Notes:
+// - Delays are not spent in |WriteChunk()|: like |HttpUploader|, the sink
+//   returns false from |Ready()| until the previous chunk would have been
+//   sent, so that callers see the same back pressure.
+// - Streaming calls and |SetInitSegment()| are passed on unchanged.
+// - Thread safe.
+class FaultInjectionSink : public DataSinkInterface {
+ public:
+  enum {
+    kInvalidArg = -1,
+    kSuccess = 0,
+  };
+
+  FaultInjectionSink();
+  virtual ~FaultInjectionSink();
+
+  // Copies |settings| and stores |ptr_sink|, which is not owned and must
+  // outlive the sink. A NULL |ptr_sink| discards every chunk accepted.
+  // Returns |kSuccess|, or |kInvalidArg| when a setting is out of range.
+  int Init(const FaultInjectionSettings& settings,
+           DataSinkInterface* ptr_sink);
+
+  // Copies the counters to |ptr_stats|.
+  void GetStats(FaultInjectionStats* ptr_stats) const;
+
+  // DataSinkInterface methods. |WriteData()| copies the data into a chunk
+  // named |id| and passes it to |WriteChunk()|.
+  virtual bool Ready() const;
+  virtual bool WriteData(const uint8* ptr_data, int32 data_length,
+                         const std::string& id);
+  virtual bool WriteChunk(const SharedWebmChunk& chunk);
+  virtual bool BeginStream(const std::string& id);
+  virtual bool WriteStreamData(const std::string& id, const uint8* ptr_data,
+                               int32 data_length);
+  virtual bool EndStream(const std::string& id);
+  virtual void SetInitSegment(const SharedWebmChunk& chunk);
+
+ private:
+  typedef std::chrono::steady_clock Clock;
+
+  // Returns the number of outages begun by |now|, and stores whether one is
+  // in progress in |ptr_in_outage|.
+  int64 CountOutages(Clock::time_point now, bool* ptr_in_outage) const;
+
+  // Returns true with a probability of |percent|. Requires |mutex_|.
+  bool Roll(int percent);
+
+  FaultInjectionSettings settings_;
+  DataSinkInterface* ptr_sink_;
+  Clock::time_point start_time_;
+
+  // Time until which the sink is busy with the last chunk.
+  Clock::time_point busy_until_;
+  std::mt19937 random_;
+  FaultInjectionStats stats_;
+  mutable std::mutex mutex_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(FaultInjectionSink);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_FAULT_INJECTION_SINK_H_
@@ -0,0 +1,719 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/file_media_source.h"
+
+#include <fcntl.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+#include "encoder/thread_util.h"
+#include "encoder/webm_encoder.h"
+#include "glog/logging.h"
+
+namespace webmlive {
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+// Size of the buffer used for unmapped input, and of the reads that fill it.
+const size_t kReadBufferSize = 1024 * 1024;
+
+// Interval in milliseconds at which waits check for |Stop|.
+const int kStopPollInterval = 10;
+
+// Longest Y4M stream or frame header line accepted.
+const size_t kMaxY4mLineLength = 1024;
+
+const char kY4mSignature[] = "YUV4MPEG2 ";
+const size_t kY4mSignatureLength = sizeof(kY4mSignature) - 1;
+
+// WAVE_FORMAT_EXTENSIBLE.
+const uint16 kWavFormatExtensible = 0xFFFE;
+
+uint16 ReadLe16(const uint8* ptr_data) {
+  return static_cast<uint16>(ptr_data[0] | ptr_data[1] << 8);
+}
+
+uint32 ReadLe32(const uint8* ptr_data) {
+  return static_cast<uint32>(ptr_data[0]) |
+         static_cast<uint32>(ptr_data[1]) << 8 |
+         static_cast<uint32>(ptr_data[2]) << 16 |
+         static_cast<uint32>(ptr_data[3]) << 24;
+}
+
+// Parses a Y4M "F" or "A" parameter value of the form "num:den".
+bool ParseRatio(const std::string& value, int32* ptr_num, int32* ptr_den) {
+  const size_t colon = value.find(':');
+  if (colon == std::string::npos) {
+    return false;
+  }
+  *ptr_num = atoi(value.substr(0, colon).c_str());
+  *ptr_den = atoi(value.substr(colon + 1).c_str());
+  return *ptr_num > 0 && *ptr_den > 0;
+}
+
+}  // namespace
+
+///////////////////////////////////////////////////////////////////////////////
+// MediaFileReader
+//
+
+MediaFileReader::MediaFileReader()
+    : ptr_mapping_(NULL),
+      mapping_size_(0),
+      mapping_pos_(0),
+#ifdef _WIN32
+      file_(INVALID_HANDLE_VALUE),
+      file_mapping_(NULL),
+#endif
+      ptr_file_(NULL),
+      owns_file_(false),
+      buffer_pos_(0),
+      buffer_end_(0) {
+}
+
+MediaFileReader::~MediaFileReader() {
+  Close();
+}
+
+int MediaFileReader::Open(const std::string& path) {
+  if (path.empty()) {
+    LOG(ERROR) << "empty input file name.";
+    return kInvalidArg;
+  }
+  Close();
+  if (path == "-") {
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+#endif
+    ptr_file_ = stdin;
+    owns_file_ = false;
+  } else if (!Map(path)) {
+    // Not a regular file, or too large to map into the address space.
+    ptr_file_ = fopen(path.c_str(), "rb");
+    if (!ptr_file_) {
+      LOG(ERROR) << "cannot open " << path;
+      return kOpenFailed;
+    }
+    owns_file_ = true;
+  }
+  if (ptr_file_) {
+    buffer_.resize(kReadBufferSize);
+  }
+  return kSuccess;
+}
+
+const uint8* MediaFileReader::Peek(size_t length) {
+  if (ptr_mapping_) {
+    if (mapping_size_ - mapping_pos_ < length) {
+      return NULL;
+    }
+    return ptr_mapping_ + mapping_pos_;
+  }
+  if (Fill(length) < length) {
+    return NULL;
+  }
+  return &buffer_[buffer_pos_];
+}
+
+const uint8* MediaFileReader::Read(size_t length) {
+  const uint8* const ptr_data = Peek(length);
+  if (ptr_data) {
+    Consume(length);
+  }
+  return ptr_data;
+}
+
+const uint8* MediaFileReader::ReadAtMost(size_t max_length,
+                                         size_t* ptr_length) {
+  size_t length = 0;
+  const uint8* ptr_data = NULL;
+  if (ptr_mapping_) {
+    length = std::min(max_length, mapping_size_ - mapping_pos_);
+    ptr_data = ptr_mapping_ + mapping_pos_;
+  } else {
+    length = std::min(max_length, Fill(max_length));
+    ptr_data = buffer_.empty() ? NULL : &buffer_[buffer_pos_];
+  }
+  *ptr_length = length;
+  if (length == 0) {
+    return NULL;
+  }
+  Consume(length);
+  return ptr_data;
+}
+
+bool MediaFileReader::ReadLine(size_t max_length, std::string* ptr_line) {
+  ptr_line->clear();
+  for (;;) {
+    const uint8* const ptr_char = Read(1);
+    if (!ptr_char) {
+      return !ptr_line->empty();
+    }
+    if (*ptr_char == '\n') {
+      return true;
+    }
+    if (ptr_line->length() >= max_length) {
+      LOG(ERROR) << "input line longer than " << max_length << " bytes.";
+      return false;
+    }
+    ptr_line->push_back(static_cast<char>(*ptr_char));
+  }
+}
+
+void MediaFileReader::Skip(size_t length) {
+  while (length > 0) {
+    const size_t chunk_length = std::min(length, kReadBufferSize);
+    if (!Read(chunk_length)) {
+      return;
+    }
+    length -= chunk_length;
+  }
+}
+
+bool MediaFileReader::Map(const std::string& path) {
+#ifdef _WIN32
+  file_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+                      OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (file_ == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  LARGE_INTEGER file_size = {0};
+  if (GetFileType(file_) != FILE_TYPE_DISK ||
+      !GetFileSizeEx(file_, &file_size) || file_size.QuadPart <= 0 ||
+      static_cast<uint64>(file_size.QuadPart) > SIZE_MAX) {
+    Close();
+    return false;
+  }
+  file_mapping_ = CreateFileMappingA(file_, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (!file_mapping_) {
+    Close();
+    return false;
+  }
+  ptr_mapping_ = reinterpret_cast<const uint8*>(
+      MapViewOfFile(file_mapping_, FILE_MAP_READ, 0, 0, 0));
+  if (!ptr_mapping_) {
+    Close();
+    return false;
+  }
+  mapping_size_ = static_cast<size_t>(file_size.QuadPart);
+#else
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode) ||
+      file_stat.st_size <= 0) {
+    close(fd);
+    return false;
+  }
+  void* const ptr_mapping = mmap(NULL, static_cast<size_t>(file_stat.st_size),
+                                 PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping holds its own reference to the file.
+  close(fd);
+  if (ptr_mapping == MAP_FAILED) {
+    return false;
+  }
+  madvise(ptr_mapping, static_cast<size_t>(file_stat.st_size),
+          MADV_SEQUENTIAL);
+  ptr_mapping_ = reinterpret_cast<const uint8*>(ptr_mapping);
+  mapping_size_ = static_cast<size_t>(file_stat.st_size);
+#endif
+  mapping_pos_ = 0;
+  return true;
+}
+
+size_t MediaFileReader::Fill(size_t length) {
+  if (!ptr_file_) {
+    return 0;
+  }
+  if (buffer_end_ - buffer_pos_ < length) {
+    // Move the unconsumed bytes to the front of |buffer_|, grow it when
+    // |length| exceeds its size, and refill it.
+    const size_t available = buffer_end_ - buffer_pos_;
+    if (available > 0 && buffer_pos_ > 0) {
+      memmove(&buffer_[0], &buffer_[buffer_pos_], available);
+    }
+    buffer_pos_ = 0;
+    buffer_end_ = available;
+    if (buffer_.size() < length) {
+      buffer_.resize(length);
+    }
+    while (buffer_end_ < length) {
+      const size_t bytes_read = fread(&buffer_[buffer_end_], 1,
+                                      buffer_.size() - buffer_end_,
+                                      ptr_file_);
+      if (bytes_read == 0) {
+        break;
+      }
+      buffer_end_ += bytes_read;
+    }
+  }
+  return buffer_end_ - buffer_pos_;
+}
+
+void MediaFileReader::Consume(size_t length) {
+  if (ptr_mapping_) {
+    mapping_pos_ += length;
+  } else {
+    buffer_pos_ += length;
+  }
+}
+
+void MediaFileReader::Close() {
+#ifdef _WIN32
+  if (ptr_mapping_) {
+    UnmapViewOfFile(ptr_mapping_);
+  }
+  if (file_mapping_) {
+    CloseHandle(file_mapping_);
+    file_mapping_ = NULL;
+  }
+  if (file_ != INVALID_HANDLE_VALUE) {
+    CloseHandle(file_);
+    file_ = INVALID_HANDLE_VALUE;
+  }
+#else
+  if (ptr_mapping_) {
+    munmap(const_cast<uint8*>(ptr_mapping_), mapping_size_);
+  }
+#endif
+  ptr_mapping_ = NULL;
+  mapping_size_ = 0;
+  mapping_pos_ = 0;
+  if (ptr_file_ && owns_file_) {
+    fclose(ptr_file_);
+  }
+  ptr_file_ = NULL;
+  owns_file_ = false;
+  buffer_.clear();
+  buffer_pos_ = 0;
+  buffer_end_ = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FileMediaSource
+//
+
+FileMediaSource::FileMediaSource()
+    : free_run_(false),
+      video_enabled_(false),
+      y4m_(false),
+      frame_size_(0),
+      frame_rate_num_(0),
+      frame_rate_den_(0),
+      frames_read_(0),
+      ptr_video_callback_(NULL),
+      audio_enabled_(false),
+      audio_bytes_left_(-1),
+      audio_buffer_size_(0),
+      samples_read_(0),
+      ptr_audio_callback_(NULL),
+      stop_(false),
+      ended_(false) {
+}
+
+FileMediaSource::~FileMediaSource() {
+  Stop();
+}
+
+int FileMediaSource::Init(const WebmEncoderConfig& config,
+                          AudioSamplesCallbackInterface* ptr_audio_callback,
+                          VideoFrameCallbackInterface* ptr_video_callback) {
+  if (config.disable_audio && config.disable_video) {
+    LOG(ERROR) << "audio and video disabled.";
+    return WebmEncoder::kInvalidArg;
+  }
+  free_run_ = config.free_run;
+  if (!config.disable_video) {
+    if (!ptr_video_callback) {
+      LOG(ERROR) << "NULL video callback.";
+      return WebmEncoder::kInvalidArg;
+    }
+    ptr_video_callback_ = ptr_video_callback;
+    const int status = InitVideo(config);
+    if (status) {
+      LOG(ERROR) << "video input init failed: " << status;
+      return status;
+    }
+    video_enabled_ = true;
+  }
+  if (!config.disable_audio) {
+    if (!ptr_audio_callback) {
+      LOG(ERROR) << "NULL audio callback.";
+      return WebmEncoder::kInvalidArg;
+    }
+    ptr_audio_callback_ = ptr_audio_callback;
+    const int status = InitAudio(config);
+    if (status) {
+      LOG(ERROR) << "audio input init failed: " << status;
+      return status;
+    }
+    audio_enabled_ = true;
+  }
+  return WebmEncoder::kSuccess;
+}
+
+int FileMediaSource::Run() {
+  if (thread_) {
+    LOG(ERROR) << "already running.";
+    return WebmEncoder::kRunFailed;
+  }
+  stop_ = false;
+  ended_ = false;
+  thread_.reset(new (std::nothrow) std::thread(  // NOLINT
+      &FileMediaSource::ReaderThread, this));
+  if (!thread_) {
+    LOG(ERROR) << "out of memory.";
+    return WebmEncoder::kNoMemory;
+  }
+  return WebmEncoder::kSuccess;
+}
+
+int FileMediaSource::CheckStatus() {
+  return ended_ ? WebmEncoder::kAVCaptureEnded : WebmEncoder::kSuccess;
+}
+
+void FileMediaSource::Stop() {
+  stop_ = true;
+  if (thread_) {
+    thread_->join();
+    thread_.reset();
+  }
+}
+
+int FileMediaSource::InitVideo(const WebmEncoderConfig& config) {
+  int status = video_reader_.Open(config.video_input_file);
+  if (status) {
+    return WebmEncoder::kNoVideoSource;
+  }
+  int32 width = config.requested_video_config.width;
+  int32 height = config.requested_video_config.height;
+  VideoFieldOrder field_order = kVideoProgressive;
+  const uint8* const ptr_signature = video_reader_.Peek(kY4mSignatureLength);
+  y4m_ = ptr_signature &&
+         !memcmp(ptr_signature, kY4mSignature, kY4mSignatureLength);
+  if (y4m_) {
+    // Stream header: "YUV4MPEG2" followed by space separated parameters,
+    // each a single letter and a value.
+    std::string header;
+    if (!video_reader_.ReadLine(kMaxY4mLineLength, &header)) {
+      LOG(ERROR) << "cannot read Y4M header.";
+      return WebmEncoder::kNoVideoSource;
+    }
+    std::istringstream tokens(header.substr(kY4mSignatureLength));
+    std::string token;
+    while (tokens >> token) {
+      const std::string value = token.substr(1);
+      switch (token[0]) {
+        case 'W':
+          width = atoi(value.c_str());
+          break;
+        case 'H':
+          height = atoi(value.c_str());
+          break;
+        case 'F':
+          if (!ParseRatio(value, &frame_rate_num_, &frame_rate_den_)) {
+            LOG(ERROR) << "invalid Y4M frame rate: " << value;
+            return WebmEncoder::kNoVideoSource;
+          }
+          break;
+        case 'C':
+          if (value != "420" && value != "420jpeg" && value != "420paldv" &&
+              value != "420mpeg2") {
+            LOG(ERROR) << "unsupported Y4M color space: " << value;
+            return WebmEncoder::kNoVideoSource;
+          }
+          break;
+        case 'I':
+          // Mixed ("m") and unknown interlacing are taken as progressive.
+          if (value == "t") {
+            field_order = kVideoTopFieldFirst;
+          } else if (value == "b") {
+            field_order = kVideoBottomFieldFirst;
+          }
+          break;
+        default:
+          // Aspect ratio and extensions do not change the frame layout.
+          break;
+      }
+    }
+  } else {
+    const double frame_rate = config.requested_video_config.frame_rate;
+    if (frame_rate > 0) {
+      frame_rate_num_ = static_cast<int32>(frame_rate * 1000 + 0.5);
+      frame_rate_den_ = 1000;
+    }
+  }
+  if (width <= 0 || height <= 0) {
+    LOG(ERROR) << "video input size unknown; raw I420 input requires the "
+               << "requested video width and height.";
+    return WebmEncoder::kNoVideoSource;
+  }
+  if (frame_rate_num_ <= 0 || frame_rate_den_ <= 0) {
+    frame_rate_num_ = kDefaultFrameRate;
+    frame_rate_den_ = 1;
+  }
+  frame_size_ = width * height + 2 * ((width + 1) / 2) * ((height + 1) / 2);
+  video_config_.format = kVideoFormatI420;
+  video_config_.width = width;
+  video_config_.height = height;
+  video_config_.stride = width;
+  video_config_.uv_stride = 0;
+  video_config_.frame_rate =
+      static_cast<double>(frame_rate_num_) / frame_rate_den_;
+  video_config_.field_order = field_order;
+  frames_read_ = 0;
+  LOG(INFO) << "video input " << config.video_input_file << ": "
+            << (y4m_ ? "Y4M " : "I420 ") << width << "x" << height << " at "
+            << video_config_.frame_rate << " fps"
+            << (video_reader_.mapped() ? " (mapped)." : ".");
+  return WebmEncoder::kSuccess;
+}
+
+int FileMediaSource::InitAudio(const WebmEncoderConfig& config) {
+  int status = audio_reader_.Open(config.audio_input_file);
+  if (status) {
+    return WebmEncoder::kNoAudioSource;
+  }
+  const uint8* ptr_data = audio_reader_.Read(12);
+  if (!ptr_data || memcmp(ptr_data, "RIFF", 4) ||
+      memcmp(ptr_data + 8, "WAVE", 4)) {
+    LOG(ERROR) << "audio input is not a WAV file.";
+    return WebmEncoder::kNoAudioSource;
+  }
+
+  // Walk the chunks up to the data chunk.
+  bool have_format = false;
+  for (;;) {
+    ptr_data = audio_reader_.Read(8);
+    if (!ptr_data) {
+      LOG(ERROR) << "WAV data chunk not found.";
+      return WebmEncoder::kNoAudioSource;
+    }
+    const uint32 chunk_size = ReadLe32(ptr_data + 4);
+    if (!memcmp(ptr_data, "data", 4)) {
+      if (!have_format) {
+        LOG(ERROR) << "WAV data chunk precedes fmt chunk.";
+        return WebmEncoder::kNoAudioSource;
+      }
+      // Streaming writers leave the size 0 or 0xFFFFFFFF; read to the end.
+      audio_bytes_left_ =
+          (chunk_size == 0 || chunk_size == 0xFFFFFFFF) ? -1 : chunk_size;
+      break;
+    }
+    // Chunks are padded to an even size.
+    const uint32 padded_size = chunk_size + (chunk_size & 1);
+    if (!memcmp(ptr_data, "fmt ", 4)) {
+      if (chunk_size < 16) {
+        LOG(ERROR) << "invalid WAV fmt chunk.";
+        return WebmEncoder::kNoAudioSource;
+      }
+      ptr_data = audio_reader_.Peek(chunk_size);
+      if (!ptr_data) {
+        LOG(ERROR) << "truncated WAV fmt chunk.";
+        return WebmEncoder::kNoAudioSource;
+      }
+      uint16 format_tag = ReadLe16(ptr_data);
+      audio_config_.channels = ReadLe16(ptr_data + 2);
+      audio_config_.sample_rate = ReadLe32(ptr_data + 4);
+      audio_config_.bytes_per_second = ReadLe32(ptr_data + 8);
+      audio_config_.block_align = ReadLe16(ptr_data + 12);
+      audio_config_.bits_per_sample = ReadLe16(ptr_data + 14);
+      audio_config_.valid_bits_per_sample = audio_config_.bits_per_sample;
+      audio_config_.channel_mask = 0;
+      if (format_tag == kWavFormatExtensible && chunk_size >= 40) {
+        // The first two bytes of the sub-format GUID hold the format tag.
+        audio_config_.valid_bits_per_sample = ReadLe16(ptr_data + 18);
+        audio_config_.channel_mask = ReadLe32(ptr_data + 20);
+        format_tag = ReadLe16(ptr_data + 24);
+      }
+      audio_config_.format_tag = format_tag;
+      have_format = true;
+    }
+    audio_reader_.Skip(padded_size);
+  }
+
+  const AudioConfig& format = audio_config_;
+  const bool pcm16 =
+      format.format_tag == kAudioFormatPcm && format.bits_per_sample == 16;
+  const bool float32 = format.format_tag == kAudioFormatIeeeFloat &&
+                       format.bits_per_sample == 32;
+  if ((!pcm16 && !float32) || format.channels == 0 ||
+      format.sample_rate == 0 ||
+      format.block_align != format.channels * format.bits_per_sample / 8) {
+    LOG(ERROR) << "unsupported WAV format: tag " << format.format_tag
+               << " channels " << format.channels << " rate "
+               << format.sample_rate << " bits " << format.bits_per_sample;
+    return WebmEncoder::kNoAudioSource;
+  }
+  const int period = config.audio_buffer_period > 0 ?
+      config.audio_buffer_period : kDefaultAudioBufferPeriod;
+  const int64 samples_per_buffer =
+      std::max<int64>(1, static_cast<int64>(format.sample_rate) * period /
+                             1000);
+  audio_buffer_size_ =
+      static_cast<int32>(samples_per_buffer * format.block_align);
+  samples_read_ = 0;
+  LOG(INFO) << "audio input " << config.audio_input_file << ": "
+            << format.channels << " channels at " << format.sample_rate
+            << " Hz, " << (pcm16 ? "16 bit PCM" : "32 bit float")
+            << (audio_reader_.mapped() ? " (mapped)." : ".");
+  return WebmEncoder::kSuccess;
+}
+
+bool FileMediaSource::ReadVideoFrame() {
+  if (y4m_) {
+    std::string frame_header;
+    if (!video_reader_.ReadLine(kMaxY4mLineLength, &frame_header)) {
+      return false;
+    }
+    if (frame_header.compare(0, 5, "FRAME") != 0) {
+      LOG(ERROR) << "invalid Y4M frame header after frame " << frames_read_;
+      return false;
+    }
+  }
+  const uint8* const ptr_data = video_reader_.Read(frame_size_);
+  if (!ptr_data) {
+    return false;
+  }
+  const int64 timestamp =
+      frames_read_ * 1000 * frame_rate_den_ / frame_rate_num_;
+  const int64 next_timestamp =
+      (frames_read_ + 1) * 1000 * frame_rate_den_ / frame_rate_num_;
+  const int status = frame_.InitNative(video_config_, true, timestamp,
+                                       next_timestamp - timestamp, ptr_data,
+                                       frame_size_);
+  if (status) {
+    LOG(ERROR) << "video frame init failed: " << status;
+    return false;
+  }
+  ++frames_read_;
+  return true;
+}
+
+bool FileMediaSource::ReadAudioBuffer() {
+  const int32 block_align = audio_config_.block_align;
+  int32 length = audio_buffer_size_;
+  if (audio_bytes_left_ >= 0 && audio_bytes_left_ < length) {
+    length = static_cast<int32>(audio_bytes_left_ / block_align * block_align);
+  }
+  size_t bytes_read = 0;
+  const uint8* const ptr_data = audio_reader_.ReadAtMost(length, &bytes_read);
+  // Drop a trailing partial block.
+  length = static_cast<int32>(bytes_read / block_align * block_align);
+  if (!ptr_data || length <= 0) {
+    return false;
+  }
+  if (audio_bytes_left_ >= 0) {
+    audio_bytes_left_ -= length;
+  }
+  const int64 num_samples = length / block_align;
+  const int64 sample_rate = audio_config_.sample_rate;
+  const int64 timestamp = samples_read_ * 1000 / sample_rate;
+  const int64 next_timestamp = (samples_read_ + num_samples) * 1000 /
+                               sample_rate;
+  const int status = audio_buffer_.Init(audio_config_, timestamp,
+                                        next_timestamp - timestamp, ptr_data,
+                                        length);
+  if (status) {
+    LOG(ERROR) << "audio buffer init failed: " << status;
+    return false;
+  }
+  samples_read_ += num_samples;
+  return true;
+}
+
+void FileMediaSource::DeliverVideoFrame() {
+  for (;;) {
+    const int status = ptr_video_callback_->OnVideoFrameReceived(&frame_);
+    if (status != VideoFrameCallbackInterface::kDropped) {
+      if (status) {
+        LOG(ERROR) << "OnVideoFrameReceived failed: " << status;
+      }
+      return;
+    }
+    if (!free_run_ || stop_) {
+      return;
+    }
+    // The encoder queue is full; |frame_| is unchanged, so wait for the
+    // encoder to catch up and offer it again.
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+void FileMediaSource::DeliverAudioBuffer() {
+  for (;;) {
+    // |WebmEncoder| reports a full queue as |kNoMemory|.
+    const int status = ptr_audio_callback_->OnSamplesReceived(&audio_buffer_);
+    if (status != AudioSamplesCallbackInterface::kNoMemory || !free_run_) {
+      if (status) {
+        LOG(ERROR) << "OnSamplesReceived failed: " << status;
+      }
+      return;
+    }
+    if (stop_) {
+      return;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+void FileMediaSource::ReaderThread() {
+  ScopedThreadRegistration registration("file_reader");
+  const Clock::time_point start_time = Clock::now();
+  bool have_video = video_enabled_ && ReadVideoFrame();
+  bool have_audio = audio_enabled_ && ReadAudioBuffer();
+  while (!stop_ && (have_video || have_audio)) {
+    const bool video_next = have_video &&
+        (!have_audio || frame_.timestamp() <= audio_buffer_.timestamp());
+    if (!free_run_) {
+      const int64 timestamp =
+          video_next ? frame_.timestamp() : audio_buffer_.timestamp();
+      const Clock::time_point due_time =
+          start_time + std::chrono::milliseconds(timestamp);
+      // Sleep in short steps so |Stop| is not delayed by long gaps.
+      Clock::time_point now = Clock::now();
+      while (!stop_ && now < due_time) {
+        std::this_thread::sleep_until(std::min(
+            due_time, now + std::chrono::milliseconds(kStopPollInterval)));
+        now = Clock::now();
+      }
+      if (stop_) {
+        break;
+      }
+    }
+    if (video_next) {
+      DeliverVideoFrame();
+      have_video = ReadVideoFrame();
+    } else {
+      DeliverAudioBuffer();
+      have_audio = ReadAudioBuffer();
+    }
+  }
+  if (!stop_) {
+    LOG(INFO) << "media input ended: " << frames_read_ << " video frames, "
+              << samples_read_ << " audio samples.";
+  }
+  ended_ = true;
+}
+
+}  // namespace webmlive
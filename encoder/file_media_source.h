@@ -0,0 +1,214 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_FILE_MEDIA_SOURCE_H_
+#define WEBMLIVE_ENCODER_FILE_MEDIA_SOURCE_H_
+
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "encoder/audio_encoder.h"
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+#include "encoder/media_source.h"
+#include "encoder/video_encoder.h"
+
+namespace webmlive {
+
+// Sequential reader of a media file or pipe. Regular files are memory mapped,
+// so |Read| returns pointers into the mapping and input is copied only once,
+// into the |VideoFrame| or |AudioBuffer| that carries it. Pipes, and files
+// that cannot be mapped, are read into an internal buffer.
+class MediaFileReader {
+ public:
+  enum {
+    kOpenFailed = -3,
+    kNoMemory = -2,
+    kInvalidArg = -1,
+    kSuccess = 0,
+  };
+
+  MediaFileReader();
+  ~MediaFileReader();
+
+  // Opens |path|. A |path| of "-" reads standard input. Returns |kSuccess|
+  // upon success.
+  int Open(const std::string& path);
+
+  // Returns a pointer to the next |length| bytes without consuming them, or
+  // NULL when fewer than |length| bytes remain. The pointer is valid until
+  // the next call to |Peek| or |Read|.
+  const uint8* Peek(size_t length);
+
+  // Same as |Peek|, but consumes the bytes.
+  const uint8* Read(size_t length);
+
+  // Reads a line terminated by '\n', or by the end of input, into
+  // |ptr_line| without the terminator. Returns false at the end of input.
+  bool ReadLine(size_t max_length, std::string* ptr_line);
+
+  // Consumes and returns up to |max_length| bytes, fewer only at the end of
+  // input, and stores the number returned in |ptr_length|. Returns NULL when
+  // no input remains.
+  const uint8* ReadAtMost(size_t max_length, size_t* ptr_length);
+
+  // Consumes up to |length| bytes.
+  void Skip(size_t length);
+
+  // Returns true when the input is memory mapped.
+  bool mapped() const { return ptr_mapping_ != NULL; }
+
+ private:
+  // Maps |path|. Returns false when the file cannot be mapped.
+  bool Map(const std::string& path);
+
+  // Reads from |ptr_file_| until |buffer_| holds at least |length| unconsumed
+  // bytes or input ends, and returns the number of unconsumed bytes.
+  size_t Fill(size_t length);
+
+  // Advances the read position by |length| bytes.
+  void Consume(size_t length);
+  void Close();
+
+  // Memory mapped input and the read position within it.
+  const uint8* ptr_mapping_;
+  size_t mapping_size_;
+  size_t mapping_pos_;
+#ifdef _WIN32
+  HANDLE file_;
+  HANDLE file_mapping_;
+#endif
+
+  // Unmapped input: bytes |buffer_pos_| through |buffer_end_| of |buffer_|
+  // have been read from |ptr_file_| but not consumed.
+  FILE* ptr_file_;
+  bool owns_file_;
+  std::vector<uint8> buffer_;
+  size_t buffer_pos_;
+  size_t buffer_end_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(MediaFileReader);
+};
+
+// Media source that reads video from a Y4M or raw I420 file, and audio from a
+// WAV file, and delivers them through the same callbacks as a capture
+// device. Samples are delivered from a single thread in timestamp order.
+//
+// By default input is paced to real time. In free-run mode samples are
+// delivered as fast as |WebmEncoder| accepts them, and samples the encoder
+// cannot queue are retried rather than dropped, so encoding runs as fast as
+// the CPU allows and output is repeatable.
+//
+// Notes:
+// - Y4M input must be 8 bit 4:2:0. Raw I420 input is sized by the requested
+//   video configuration.
+// - WAV input must be 16 bit PCM or 32 bit float.
+// - |CheckStatus| returns |WebmEncoder::kAVCaptureEnded| once all input has
+//   been delivered.
+class FileMediaSource : public MediaSourceInterface {
+ public:
+  // Length of audio buffers when |WebmEncoderConfig::audio_buffer_period| is
+  // 0.
+  static const int kDefaultAudioBufferPeriod = 20;
+
+  // Frame rate of raw I420 input when none is requested.
+  static const int kDefaultFrameRate = 30;
+
+  FileMediaSource();
+  virtual ~FileMediaSource();
+
+  // Opens |config.video_input_file| and |config.audio_input_file|, for the
+  // streams |config| enables, and reads their headers. Returns |kSuccess|
+  // upon success, or a |WebmEncoder| status code upon failure.
+  virtual int Init(const WebmEncoderConfig& config,
+                   AudioSamplesCallbackInterface* ptr_audio_callback,
+                   VideoFrameCallbackInterface* ptr_video_callback);
+
+  // Files hold one video stream.
+  virtual int SetCameraCallback(int, VideoFrameCallbackInterface*) {
+    return WebmEncoder::kNotImplemented;
+  }
+
+  // Starts the reader thread.
+  virtual int Run();
+
+  virtual int CheckStatus();
+
+  // Stops the reader thread.
+  virtual void Stop();
+
+  // Files do not stall: they are not restarted.
+  virtual int Restart() { return WebmEncoder::kNotImplemented; }
+
+  virtual AudioConfig actual_audio_config() const { return audio_config_; }
+  virtual VideoConfig actual_video_config() const { return video_config_; }
+  virtual VideoConfig actual_camera_config(int) const {
+    return VideoConfig();
+  }
+
+ private:
+  // Reads the Y4M stream header, or prepares raw I420 input, and sets
+  // |video_config_|.
+  int InitVideo(const WebmEncoderConfig& config);
+
+  // Parses the WAV header up to the start of the sample data.
+  int InitAudio(const WebmEncoderConfig& config);
+
+  // Reads the next video frame into |frame_|. Returns false at the end of
+  // input.
+  bool ReadVideoFrame();
+
+  // Reads the next audio buffer into |audio_buffer_|. Returns false at the
+  // end of input.
+  bool ReadAudioBuffer();
+
+  // Passes |frame_| or |audio_buffer_| to its callback. In free-run mode,
+  // waits until the callback accepts the sample or |stop_| is set.
+  void DeliverVideoFrame();
+  void DeliverAudioBuffer();
+
+  // Reads and delivers samples until input ends or |stop_| is set.
+  void ReaderThread();
+
+  bool free_run_;
+
+  // Video input.
+  MediaFileReader video_reader_;
+  bool video_enabled_;
+  bool y4m_;
+  int32 frame_size_;
+  int32 frame_rate_num_;
+  int32 frame_rate_den_;
+  int64 frames_read_;
+  VideoConfig video_config_;
+  VideoFrame frame_;
+  VideoFrameCallbackInterface* ptr_video_callback_;
+
+  // Audio input. |audio_bytes_left_| is the remaining size of the WAV data
+  // chunk, or -1 when the size is unknown.
+  MediaFileReader audio_reader_;
+  bool audio_enabled_;
+  int64 audio_bytes_left_;
+  int32 audio_buffer_size_;
+  int64 samples_read_;
+  AudioConfig audio_config_;
+  AudioBuffer audio_buffer_;
+  AudioSamplesCallbackInterface* ptr_audio_callback_;
+
+  // Set by |Stop|, and by the reader thread once all input is delivered.
+  std::atomic<bool> stop_;
+  std::atomic<bool> ended_;
+  std::unique_ptr<std::thread> thread_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(FileMediaSource);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_FILE_MEDIA_SOURCE_H_
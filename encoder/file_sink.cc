@@ -0,0 +1,102 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/file_sink.h"
+
+#include "encoder/file_writer.h"
+#include "glog/logging.h"
+
+namespace webmlive {
+
+FileSink::FileSink() : ptr_writer_(NULL), failed_(false) {
+}
+
+int FileSink::Init(FileWriter* ptr_writer, const std::string& directory) {
+  if (!ptr_writer) {
+    LOG(ERROR) << "NULL file writer.";
+    return kInvalidArg;
+  }
+  ptr_writer_ = ptr_writer;
+  directory_ = directory;
+  return kSuccess;
+}
+
+bool FileSink::WriteChunkToFile(const std::string& name,
+                                const SharedWebmChunk& chunk) {
+  if (!ptr_writer_ || !chunk) {
+    LOG(ERROR) << "invalid file sink chunk.";
+    return false;
+  }
+  const int status = ptr_writer_->EnqueueChunk(directory_ + name, chunk);
+  return CountWrite(status, name, chunk->length(), true);
+}
+
+bool FileSink::AppendChunkToFile(const std::string& name,
+                                 const SharedWebmChunk& chunk) {
+  if (!ptr_writer_ || !chunk) {
+    LOG(ERROR) << "invalid file sink chunk.";
+    return false;
+  }
+  const int status = ptr_writer_->EnqueueAppend(directory_ + name, chunk);
+  return CountWrite(status, name, chunk->length(), true);
+}
+
+void FileSink::GetStats(FileSinkStats* ptr_stats) const {
+  if (!ptr_stats) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  *ptr_stats = stats_;
+}
+
+bool FileSink::Ready() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return ptr_writer_ && !failed_;
+}
+
+bool FileSink::WriteData(const uint8* ptr_data, int32 data_length,
+                         const std::string& id) {
+  if (!ptr_writer_ || !ptr_data || data_length < 0 || id.empty()) {
+    LOG(ERROR) << "invalid file sink write.";
+    return false;
+  }
+  const int status =
+      ptr_writer_->EnqueueReplacement(directory_ + id, ptr_data, data_length);
+  return CountWrite(status, id, data_length, false);
+}
+
+bool FileSink::WriteChunk(const SharedWebmChunk& chunk) {
+  if (!chunk) {
+    LOG(ERROR) << "invalid file sink chunk.";
+    return false;
+  }
+  return WriteChunkToFile(chunk->id(), chunk);
+}
+
+bool FileSink::CountWrite(int status, const std::string& name, int32 length,
+                          bool chunk) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (status != FileWriter::kSuccess) {
+    if (!failed_) {
+      LOG(ERROR) << "file sink write of " << directory_ + name
+                 << " failed, status=" << status
+                 << "; no more files are written.";
+    }
+    failed_ = true;
+    ++stats_.write_errors;
+    return false;
+  }
+  if (chunk) {
+    ++stats_.chunks_written;
+  } else {
+    ++stats_.data_written;
+  }
+  stats_.bytes_written += length;
+  return true;
+}
+
+}  // namespace webmlive
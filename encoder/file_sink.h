@@ -0,0 +1,99 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_FILE_SINK_H_
+#define WEBMLIVE_ENCODER_FILE_SINK_H_
+
+#include <mutex>
+#include <string>
+
+#include "encoder/basictypes.h"
+#include "encoder/data_sink.h"
+#include "encoder/encoder_base.h"
+#include "encoder/webm_chunk.h"
+
+namespace webmlive {
+
+class FileWriter;
+
+struct FileSinkStats {
+  FileSinkStats() : chunks_written(0), data_written(0), bytes_written(0),
+                    write_errors(0) {}
+
+  // Chunks and data writes passed to the |FileWriter|, and their bytes.
+  int64 chunks_written;
+  int64 data_written;
+  int64 bytes_written;
+
+  // Writes refused because the |FileWriter| failed a write.
+  int64 write_errors;
+};
+
+// Data sink that writes to files in a directory through a |FileWriter|, which
+// performs the I/O on its own thread, flushes files as its sync policy says,
+// and preallocates each file's size before writing it.
+//
+// Notes:
+// - |WriteChunk()| writes each chunk to a new file named by its id, and
+//   |WriteData()| replaces the file named |id|, as for a manifest update.
+//   Chunk data is not copied.
+// - Writes block while the |FileWriter| queue is full.
+// - Once the |FileWriter| fails a write, a full disk for example, the error
+//   is logged, |Ready()| returns false, and every later write fails.
+// - The methods may be called from any thread.
+class FileSink : public DataSinkInterface {
+ public:
+  enum {
+    kInvalidArg = -1,
+    kSuccess = 0,
+  };
+
+  FileSink();
+  virtual ~FileSink() {}
+
+  // Writes files through |ptr_writer|, which is not owned and must outlive
+  // the sink, to |directory|, which is prefixed to file names and so ends
+  // with a path separator. Returns |kSuccess| upon success.
+  int Init(FileWriter* ptr_writer, const std::string& directory);
+
+  // Writes |chunk| to a new file |name| instead of one named by its id, or
+  // appends it to the file |name|. Return true when the write is enqueued.
+  bool WriteChunkToFile(const std::string& name, const SharedWebmChunk& chunk);
+  bool AppendChunkToFile(const std::string& name,
+                         const SharedWebmChunk& chunk);
+
+  // Copies current stats to |ptr_stats|.
+  void GetStats(FileSinkStats* ptr_stats) const;
+
+  const std::string& directory() const { return directory_; }
+
+  // DataSinkInterface methods.
+  virtual bool Ready() const;
+  virtual bool WriteData(const uint8* ptr_data, int32 data_length,
+                         const std::string& id);
+  virtual bool WriteChunk(const SharedWebmChunk& chunk);
+
+ private:
+  // Counts a write of |length| bytes enqueued with |status|, as a chunk
+  // when |chunk| is true. Logs the first failure. Returns true when
+  // |status| is success.
+  bool CountWrite(int status, const std::string& name, int32 length,
+                  bool chunk);
+
+  FileWriter* ptr_writer_;
+  std::string directory_;
+
+  // Set once a write is refused. Protected by |mutex_|.
+  bool failed_;
+  FileSinkStats stats_;
+  mutable std::mutex mutex_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(FileSink);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_FILE_SINK_H_
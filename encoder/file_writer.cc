@@ -0,0 +1,385 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/file_writer.h"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "encoder/encoder_base.h"
+#include "encoder/thread_util.h"
+#include "glog/logging.h"
+
+namespace webmlive {
+
+FileWriter::FileWriter()
+    : stop_(false),
+      has_stop_deadline_(false),
+      write_failed_(false),
+      max_queue_depth_(kDefaultMaxQueueDepth),
+      sync_policy_(kSyncNone) {
+  memset(&stats_, 0, sizeof(stats_));
+}
+
+FileWriter::~FileWriter() {
+  if (writer_thread_) {
+    Stop();
+  }
+}
+
+int FileWriter::Init(int32 max_queue_depth, SyncPolicy sync_policy) {
+  if (max_queue_depth <= 0) {
+    LOG(ERROR) << "invalid max queue depth: " << max_queue_depth;
+    return kInvalidArg;
+  }
+  if (sync_policy < kSyncNone || sync_policy > kSyncAll) {
+    LOG(ERROR) << "invalid sync policy: " << sync_policy;
+    return kInvalidArg;
+  }
+  max_queue_depth_ = max_queue_depth;
+  sync_policy_ = sync_policy;
+  return kSuccess;
+}
+
+// Run |WriterThread| using |std::thread|.
+int FileWriter::Run() {
+  assert(!writer_thread_);
+  using std::bind;
+  using std::shared_ptr;
+  using std::thread;
+  using std::nothrow;
+  writer_thread_ = shared_ptr<thread>(
+      new (nothrow) thread(bind(&FileWriter::WriterThread,  // NOLINT
+                                this)));
+  if (!writer_thread_) {
+    LOG(ERROR) << "cannot construct writer thread.";
+    return kRunFailed;
+  }
+  return kSuccess;
+}
+
+// Sets |stop_|, wakes |WriterThread|, and waits for it to empty |queue_| and
+// exit.
+int FileWriter::Stop() {
+  assert(writer_thread_);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  file_ready_.notify_one();
+  writer_thread_->join();
+  writer_thread_.reset();
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (stats_.files_abandoned > 0) {
+    LOG(WARNING) << "file writer stopped with " << stats_.files_abandoned
+                 << " queued file(s) unwritten.";
+  }
+  return write_failed_ ? kWriteFailed : kSuccess;
+}
+
+int FileWriter::Stop(int timeout_ms) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    has_stop_deadline_ = true;
+    stop_deadline_ = std::chrono::steady_clock::now() +
+                     std::chrono::milliseconds(std::max(timeout_ms, 0));
+  }
+  return Stop();
+}
+
+int FileWriter::EnqueueFile(const std::string& path, const uint8* ptr_data,
+                            int32 data_length) {
+  return EnqueueCopy(path, ptr_data, data_length, kWrite);
+}
+
+int FileWriter::EnqueueReplacement(const std::string& path,
+                                   const uint8* ptr_data, int32 data_length) {
+  return EnqueueCopy(path, ptr_data, data_length, kReplace);
+}
+
+int FileWriter::EnqueueCopy(const std::string& path, const uint8* ptr_data,
+                            int32 data_length, Operation operation) {
+  if (path.empty() || !ptr_data || data_length < 0) {
+    LOG(ERROR) << "invalid file write request.";
+    return kInvalidArg;
+  }
+
+  // Copy the data before taking the lock; |WriterThread| may be waiting.
+  std::unique_ptr<PendingFile> file(new (std::nothrow) PendingFile);  // NOLINT
+  if (!file) {
+    LOG(ERROR) << "out of memory.";
+    return kWriteFailed;
+  }
+  file->path = path;
+  file->data.assign(ptr_data, ptr_data + data_length);
+  file->operation = operation;
+  return Enqueue(std::move(file));
+}
+
+int FileWriter::EnqueueChunk(const std::string& path,
+                             const SharedWebmChunk& chunk) {
+  if (path.empty() || !chunk) {
+    LOG(ERROR) << "invalid chunk write request.";
+    return kInvalidArg;
+  }
+  std::unique_ptr<PendingFile> file(new (std::nothrow) PendingFile);  // NOLINT
+  if (!file) {
+    LOG(ERROR) << "out of memory.";
+    return kWriteFailed;
+  }
+  file->path = path;
+  file->chunk = chunk;
+  return Enqueue(std::move(file));
+}
+
+int FileWriter::EnqueueAppend(const std::string& path,
+                              const SharedWebmChunk& chunk) {
+  if (path.empty() || !chunk) {
+    LOG(ERROR) << "invalid chunk append request.";
+    return kInvalidArg;
+  }
+  std::unique_ptr<PendingFile> file(new (std::nothrow) PendingFile);  // NOLINT
+  if (!file) {
+    LOG(ERROR) << "out of memory.";
+    return kWriteFailed;
+  }
+  file->path = path;
+  file->chunk = chunk;
+  file->operation = kAppend;
+  return Enqueue(std::move(file));
+}
+
+int FileWriter::EnqueueRemoval(const std::string& path) {
+  if (path.empty()) {
+    LOG(ERROR) << "invalid file removal request.";
+    return kInvalidArg;
+  }
+  std::unique_ptr<PendingFile> file(new (std::nothrow) PendingFile);  // NOLINT
+  if (!file) {
+    LOG(ERROR) << "out of memory.";
+    return kWriteFailed;
+  }
+  file->path = path;
+  file->operation = kRemove;
+  return Enqueue(std::move(file));
+}
+
+int FileWriter::Enqueue(std::unique_ptr<PendingFile> file) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (static_cast<int32>(queue_.size()) >= max_queue_depth_) {
+    ++stats_.queue_full_waits;
+    LOG(WARNING) << "file write queue full, waiting. depth="
+                 << queue_.size();
+    space_ready_.wait(lock, [this] {
+      return write_failed_ ||
+          static_cast<int32>(queue_.size()) < max_queue_depth_;
+    });
+  }
+  if (write_failed_) {
+    return kWriteFailed;
+  }
+  queue_.push_back(std::move(file));
+  stats_.queue_depth = static_cast<int32>(queue_.size());
+  stats_.max_queue_depth = std::max(stats_.max_queue_depth,
+                                    stats_.queue_depth);
+  lock.unlock();
+  file_ready_.notify_one();
+  return kSuccess;
+}
+
+int FileWriter::GetStats(FileWriterStats* ptr_stats) {
+  if (!ptr_stats) {
+    return kInvalidArg;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  *ptr_stats = stats_;
+  return kSuccess;
+}
+
+#ifdef _WIN32
+bool FileWriter::WriteFileData(const std::string& path, const uint8* ptr_data,
+                               int32 data_length, bool append, bool sync) {
+  // An appended file is read while it grows.
+  HANDLE file = CreateFileA(path.c_str(),
+                            append ? FILE_APPEND_DATA : GENERIC_WRITE,
+                            append ? FILE_SHARE_READ : 0, NULL,
+                            append ? OPEN_ALWAYS : CREATE_ALWAYS,
+                            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+                            NULL);
+  if (file == INVALID_HANDLE_VALUE) {
+    LOG(ERROR) << "Unable to open file: " << path;
+    return false;
+  }
+  // Reserve a new file's size up front, so that it is laid out in one
+  // extent. Failure is harmless; the write allocates as it goes.
+  if (!append && data_length > 0) {
+    FILE_ALLOCATION_INFO allocation = {};
+    allocation.AllocationSize.QuadPart = data_length;
+    SetFileInformationByHandle(file, FileAllocationInfo, &allocation,
+                               sizeof(allocation));
+  }
+  bool write_ok = true;
+  int32 bytes_left = data_length;
+  while (write_ok && bytes_left > 0) {
+    DWORD bytes_written = 0;
+    write_ok = ::WriteFile(file, ptr_data + data_length - bytes_left,
+                           bytes_left, &bytes_written, NULL) != FALSE;
+    bytes_left -= bytes_written;
+  }
+  if (write_ok && sync) {
+    write_ok = FlushFileBuffers(file) != FALSE;
+  }
+  CloseHandle(file);
+  return write_ok;
+}
+#else
+bool FileWriter::WriteFileData(const std::string& path, const uint8* ptr_data,
+                               int32 data_length, bool append, bool sync) {
+  const int fd = open(path.c_str(),
+                      O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC),
+                      0644);
+  if (fd < 0) {
+    LOG(ERROR) << "Unable to open file: " << path;
+    return false;
+  }
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+#ifdef __linux__
+  // Reserve a new file's size up front, so that it is laid out in one
+  // extent. Failure is harmless; the write allocates as it goes.
+  if (!append && data_length > 0) {
+    posix_fallocate(fd, 0, data_length);
+  }
+#endif
+  bool write_ok = true;
+  int32 bytes_left = data_length;
+  while (write_ok && bytes_left > 0) {
+    const ssize_t bytes_written =
+        write(fd, ptr_data + data_length - bytes_left, bytes_left);
+    if (bytes_written < 0) {
+      write_ok = (errno == EINTR);
+    } else {
+      bytes_left -= static_cast<int32>(bytes_written);
+    }
+  }
+  if (write_ok && sync) {
+    write_ok = fsync(fd) == 0;
+  }
+  write_ok = (close(fd) == 0) && write_ok;
+  return write_ok;
+}
+#endif
+
+bool FileWriter::PublishFile(const std::string& path, const uint8* ptr_data,
+                             int32 data_length, bool sync) {
+  const std::string temp_path = path + ".tmp";
+  if (!WriteFileData(temp_path, ptr_data, data_length, false, sync)) {
+    remove(temp_path.c_str());
+    return false;
+  }
+#ifdef _WIN32
+  // rename() fails on Windows when |path| exists.
+  const bool renamed = MoveFileExA(temp_path.c_str(), path.c_str(),
+                                   MOVEFILE_REPLACE_EXISTING) != FALSE;
+#else
+  const bool renamed = rename(temp_path.c_str(), path.c_str()) == 0;
+#endif
+  if (!renamed) {
+    LOG(ERROR) << "Unable to rename " << temp_path << " to " << path;
+    remove(temp_path.c_str());
+  }
+  return renamed;
+}
+
+void FileWriter::WriterThread() {
+  ScopedThreadRegistration registration("file_writer");
+  LOG(INFO) << "WriterThread started.";
+  for (;;) {
+    std::unique_ptr<PendingFile> file;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      file_ready_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+      if (queue_.empty()) {
+        // |stop_| is set and all files have been written.
+        break;
+      }
+      if (stop_ && has_stop_deadline_ &&
+          std::chrono::steady_clock::now() >= stop_deadline_) {
+        stats_.files_abandoned += queue_.size();
+        stats_.queue_depth = 0;
+        queue_.clear();
+        space_ready_.notify_all();
+        break;
+      }
+      file = std::move(queue_.front());
+      queue_.pop_front();
+    }
+
+    if (file->operation == kRemove) {
+      const bool removed = remove(file->path.c_str()) == 0;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats_.queue_depth = static_cast<int32>(queue_.size());
+        if (removed) {
+          ++stats_.files_removed;
+        }
+      }
+      if (!removed) {
+        LOG(WARNING) << "Unable to remove file: " << file->path;
+      }
+      space_ready_.notify_one();
+      continue;
+    }
+
+    typedef std::chrono::steady_clock Clock;
+    const Clock::time_point start = Clock::now();
+    const uint8* const ptr_data =
+        file->chunk ? file->chunk->data() :
+        (file->data.empty() ? NULL : &file->data[0]);
+    const int32 data_length = file->chunk ?
+        file->chunk->length() : static_cast<int32>(file->data.size());
+    const bool sync = sync_policy_ == kSyncAll ||
+        (sync_policy_ == kSyncReplacements && file->operation == kReplace);
+    const bool write_ok = file->operation == kAppend ?
+        WriteFileData(file->path, ptr_data, data_length, true, sync) :
+        PublishFile(file->path, ptr_data, data_length, sync);
+    const int64 write_ms = std::chrono::duration_cast<
+        std::chrono::milliseconds>(Clock::now() - start).count();
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stats_.queue_depth = static_cast<int32>(queue_.size());
+      stats_.last_write_ms = write_ms;
+      stats_.max_write_ms = std::max(stats_.max_write_ms, write_ms);
+      stats_.total_write_ms += write_ms;
+      if (write_ok) {
+        ++stats_.files_written;
+        stats_.bytes_written += data_length;
+      } else {
+        LOG(ERROR) << "file write failed: " << file->path;
+        write_failed_ = true;
+      }
+    }
+    space_ready_.notify_one();
+    VLOG(1) << "WriterThread wrote " << file->path << " in " << write_ms
+            << "ms";
+  }
+  LOG(INFO) << "WriterThread finished.";
+}
+
+}  // namespace webmlive
@@ -0,0 +1,232 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_FILE_WRITER_H_
+#define WEBMLIVE_ENCODER_FILE_WRITER_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "encoder/basictypes.h"
+#include "encoder/webm_chunk.h"
+
+namespace webmlive {
+
+struct FileWriterStats {
+  // Number of files waiting to be written.
+  int32 queue_depth;
+
+  // Largest value |queue_depth| has reached.
+  int32 max_queue_depth;
+
+  // Total number of files written.
+  int64 files_written;
+
+  // Total number of bytes written.
+  int64 bytes_written;
+
+  // Total number of files removed by |FileWriter::EnqueueRemoval()|.
+  int64 files_removed;
+
+  // Duration of the most recent write, in milliseconds.
+  int64 last_write_ms;
+
+  // Longest duration of a single write, in milliseconds.
+  int64 max_write_ms;
+
+  // Total time spent writing files, in milliseconds.
+  int64 total_write_ms;
+
+  // Number of times |FileWriter::EnqueueFile()| blocked on a full queue.
+  int64 queue_full_waits;
+
+  // Files and removals discarded from the queue when |FileWriter::Stop(int)|
+  // reached its deadline.
+  int64 files_abandoned;
+};
+
+// Writes files from a dedicated thread. Users enqueue complete files (a path
+// and the file contents), and the writer thread writes each one to a
+// temporary file that is renamed to its path once complete. Readers of the
+// path, such as an HTTP server publishing the output directory, never see a
+// partially written file. Queue depth is bounded: |EnqueueFile()| blocks when
+// the queue is full, which keeps memory use constant when the disk cannot
+// keep up.
+//
+// Notes:
+// - |Init| must be called before any other method.
+// - Files are written in the order they are enqueued.
+// - Each file is written with a single unbuffered write, with the sequential
+//   access hint where the platform provides one.
+// - |Stop| writes all queued files before stopping the writer thread, unless
+//   given a timeout.
+class FileWriter {
+ public:
+  enum {
+    // A previous write failed. No more files are accepted.
+    kWriteFailed = -404,
+
+    // Invalid argument supplied to method call.
+    kInvalidArg = -403,
+
+    // Writer |Init| failed.
+    kInitFailed = -402,
+
+    // Writer |Run| failed.
+    kRunFailed = -401,
+
+    // Success.
+    kSuccess = 0,
+  };
+
+  // Files whose data is flushed to storage before they are renamed into
+  // place, so that a published file survives a system crash.
+  enum SyncPolicy {
+    // None; the operating system writes data back on its own schedule.
+    kSyncNone = 0,
+
+    // Files enqueued by |EnqueueReplacement()|, such as manifests.
+    kSyncReplacements = 1,
+
+    // All files.
+    kSyncAll = 2,
+  };
+
+  static const int32 kDefaultMaxQueueDepth = 16;
+
+  FileWriter();
+  ~FileWriter();
+
+  // Sets the maximum number of files waiting to be written, and the files
+  // flushed to storage. Returns |kSuccess| upon success.
+  int Init(int32 max_queue_depth, SyncPolicy sync_policy);
+
+  // Runs the writer thread.
+  int Run();
+
+  // Writes all queued files, and then stops the writer thread. Returns
+  // |kWriteFailed| when any write failed.
+  int Stop();
+
+  // Same as |Stop()|, but writes queued files for at most |timeout_ms|
+  // milliseconds. Files still queued at the deadline are discarded and
+  // counted in |FileWriterStats::files_abandoned|; a write in progress at
+  // the deadline completes.
+  int Stop(int timeout_ms);
+
+  // Copies |ptr_data| and enqueues it for writing to the file at |path|.
+  // Blocks while the queue is full. Returns |kSuccess| upon success. Returns
+  // |kWriteFailed| when a previous write failed.
+  int EnqueueFile(const std::string& path, const uint8* ptr_data,
+                  int32 data_length);
+
+  // Enqueues |chunk| for writing to the file at |path|. The chunk data is not
+  // copied. Otherwise behaves as |EnqueueFile()|.
+  int EnqueueChunk(const std::string& path, const SharedWebmChunk& chunk);
+
+  // Enqueues |chunk| for appending to the file at |path|, which is created
+  // when missing. The data is written in place, not through a temporary file:
+  // readers must only read the byte ranges of appends already complete.
+  // Appends are counted as files written. Otherwise behaves as
+  // |EnqueueChunk()|.
+  int EnqueueAppend(const std::string& path, const SharedWebmChunk& chunk);
+
+  // Same as |EnqueueFile()|, for a file that replaces the previous contents
+  // of |path|. Readers of |path| see either the previous contents or the new
+  // contents, never a partial write.
+  int EnqueueReplacement(const std::string& path, const uint8* ptr_data,
+                         int32 data_length);
+
+  // Enqueues removal of the file at |path|. Files are removed in queue order,
+  // after the files enqueued before them have been written. A failed removal
+  // is logged, but does not fail later writes. Otherwise behaves as
+  // |EnqueueFile()|.
+  int EnqueueRemoval(const std::string& path);
+
+  // Locks |mutex_| and copies current stats to |ptr_stats|.
+  int GetStats(FileWriterStats* ptr_stats);
+
+ private:
+  // Operations performed by |WriterThread|.
+  enum Operation {
+    kWrite,
+    kReplace,
+    kAppend,
+    kRemove,
+  };
+
+  // A file waiting to be written or removed. The contents are in |chunk| when
+  // it is non-NULL, and in |data| otherwise.
+  struct PendingFile {
+    PendingFile() : operation(kWrite) {}
+    std::string path;
+    std::vector<uint8> data;
+    SharedWebmChunk chunk;
+    Operation operation;
+  };
+
+  // Copies |ptr_data| into a new |PendingFile| and enqueues it.
+  int EnqueueCopy(const std::string& path, const uint8* ptr_data,
+                  int32 data_length, Operation operation);
+
+  // Adds |ptr_file| to |queue_|, blocking while |queue_| is full.
+  int Enqueue(std::unique_ptr<PendingFile> ptr_file);
+
+  // Creates |path|, or opens it for appending when |append| is true, and
+  // writes |data_length| bytes from |ptr_data| to it, flushing the data to
+  // storage when |sync| is true. Returns true when successful.
+  static bool WriteFileData(const std::string& path, const uint8* ptr_data,
+                            int32 data_length, bool append, bool sync);
+
+  // Writes the data to a temporary file, and renames it to |path|. Returns
+  // true when successful.
+  static bool PublishFile(const std::string& path, const uint8* ptr_data,
+                          int32 data_length, bool sync);
+
+  // Writes files from |queue_| until |stop_| is true and |queue_| is empty.
+  void WriterThread();
+
+  // Set by |Stop|. Protected by |mutex_|.
+  bool stop_;
+
+  // Set by |Stop(int)|: |WriterThread| discards the files still queued once
+  // |stop_deadline_| passes. Protected by |mutex_|.
+  bool has_stop_deadline_;
+  std::chrono::steady_clock::time_point stop_deadline_;
+
+  // Set when a write fails. Protected by |mutex_|.
+  bool write_failed_;
+
+  int32 max_queue_depth_;
+  SyncPolicy sync_policy_;
+
+  // Files waiting to be written. Protected by |mutex_|.
+  std::deque<std::unique_ptr<PendingFile>> queue_;
+
+  // Stats. Protected by |mutex_|.
+  FileWriterStats stats_;
+
+  // Signalled when a file is enqueued, or when |stop_| is set.
+  std::condition_variable file_ready_;
+
+  // Signalled when |WriterThread| removes a file from |queue_|.
+  std::condition_variable space_ready_;
+
+  std::mutex mutex_;
+  std::shared_ptr<std::thread> writer_thread_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(FileWriter);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_FILE_WRITER_H_
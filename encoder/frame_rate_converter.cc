@@ -0,0 +1,78 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/frame_rate_converter.h"
+
+#include <cmath>
+
+#include "glog/logging.h"
+
+namespace webmlive {
+
+FrameRateConverter::FrameRateConverter()
+    : period_(0),
+      started_(false),
+      next_slot_(0) {
+}
+
+int FrameRateConverter::Init(double frame_rate) {
+  if (frame_rate <= 0 || frame_rate > kMaxFrameRate) {
+    LOG(ERROR) << "invalid output frame rate: " << frame_rate;
+    return kInvalidArg;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  period_ = 1000.0 / frame_rate;
+  started_ = false;
+  next_slot_ = 0;
+  stats_ = FrameRateConverterStats();
+  stats_.frame_rate = frame_rate;
+  return kSuccess;
+}
+
+bool FrameRateConverter::Convert(int64 timestamp, int64* ptr_timestamp,
+                                 int64* ptr_duration) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++stats_.frames_in;
+
+  // Slots from the next free one to the one nearest |timestamp|. Negative
+  // values mean the nearest slot is already filled.
+  double slots = 0;
+  if (started_) {
+    slots = std::floor((timestamp - next_slot_) / period_ + 0.5);
+    if (std::fabs(timestamp - next_slot_) > kResyncThreshold) {
+      ++stats_.resyncs;
+      started_ = false;
+    }
+  }
+  if (!started_) {
+    started_ = true;
+    next_slot_ = static_cast<double>(timestamp);
+    slots = 0;
+  }
+  if (slots < 0) {
+    ++stats_.frames_dropped;
+    return false;
+  }
+  stats_.slots_skipped += static_cast<int64>(slots);
+  const double slot = next_slot_ + slots * period_;
+  next_slot_ = slot + period_;
+  ++stats_.frames_out;
+
+  // Rounding both ends of the slot keeps the durations summing to the
+  // stream time.
+  const int64 start = static_cast<int64>(std::floor(slot + 0.5));
+  *ptr_timestamp = start;
+  *ptr_duration = static_cast<int64>(std::floor(next_slot_ + 0.5)) - start;
+  return true;
+}
+
+void FrameRateConverter::GetStats(FrameRateConverterStats* ptr_stats) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  *ptr_stats = stats_;
+}
+
+}  // namespace webmlive
@@ -0,0 +1,99 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_FRAME_RATE_CONVERTER_H_
+#define WEBMLIVE_ENCODER_FRAME_RATE_CONVERTER_H_
+
+#include <mutex>
+
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+
+namespace webmlive {
+
+struct FrameRateConverterStats {
+  FrameRateConverterStats()
+      : frame_rate(0), frames_in(0), frames_out(0), frames_dropped(0),
+        slots_skipped(0), resyncs(0) {}
+
+  // Output frame rate.
+  double frame_rate;
+
+  // Frames passed to |FrameRateConverter::Convert()|, those kept, and those
+  // dropped because their output slot was already filled.
+  int64 frames_in;
+  int64 frames_out;
+  int64 frames_dropped;
+
+  // Output slots left empty because no input frame was nearest to them: the
+  // capture source ran slower than the output rate.
+  int64 slots_skipped;
+
+  // Discontinuities after which the output grid restarted at the input.
+  int64 resyncs;
+};
+
+// Converts a stream of video frame timestamps, at any rate and cadence, to
+// frames at exactly |frame_rate|. Output frames lie on a grid of slots
+// |1000 / frame_rate| milliseconds apart that starts at the first input; each
+// input is assigned the slot nearest to its timestamp, and kept only when
+// that slot is still free. Kept frames take the slot time as their
+// timestamp and the slot length as their duration, so output cadence is
+// even whatever the input cadence, at the cost of moving each frame by at
+// most half a slot.
+//
+// Frames are never duplicated: an input slower than |frame_rate| leaves
+// slots empty.
+//
+// Notes:
+// - |Convert()| is not reentrant.
+// - |GetStats()| may be called from any thread.
+class FrameRateConverter {
+ public:
+  // Distance, in milliseconds, between an input and its nearest slot beyond
+  // which the grid restarts at the input timestamp.
+  static const int kResyncThreshold = 1000;
+
+  // Highest |Init()| frame rate: slots are at least a millisecond apart.
+  static const int kMaxFrameRate = 1000;
+
+  enum {
+    kInvalidArg = -1,
+    kSuccess = 0,
+  };
+
+  FrameRateConverter();
+  ~FrameRateConverter() {}
+
+  // Sets the output frame rate. Returns |kSuccess|, or |kInvalidArg| when
+  // |frame_rate| is not positive or above |kMaxFrameRate|.
+  int Init(double frame_rate);
+
+  // Returns true when the frame captured at |timestamp| is kept, and stores
+  // its output timestamp and duration in |ptr_timestamp| and
+  // |ptr_duration|. Returns false when the frame is to be dropped.
+  bool Convert(int64 timestamp, int64* ptr_timestamp, int64* ptr_duration);
+
+  // Copies the current stats to |ptr_stats|.
+  void GetStats(FrameRateConverterStats* ptr_stats) const;
+
+ private:
+  // Slot length, in milliseconds.
+  double period_;
+
+  // True once the grid has started, and the time of the next free slot.
+  bool started_;
+  double next_slot_;
+
+  FrameRateConverterStats stats_;
+  mutable std::mutex mutex_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(FrameRateConverter);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_FRAME_RATE_CONVERTER_H_
@@ -0,0 +1,142 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/frame_type_profiler.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace webmlive {
+
+const char* FrameProfileTypeName(int type) {
+  switch (type) {
+    case kFrameProfileKey:
+      return "key";
+    case kFrameProfileInter:
+      return "inter";
+    case kFrameProfileDroppable:
+      return "droppable";
+    case kFrameProfileInvisible:
+      return "invisible";
+    default:
+      return "unknown";
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FrameProfileHistogram
+//
+
+FrameProfileHistogram::FrameProfileHistogram() : count(0), sum(0), max(0) {
+  memset(buckets, 0, sizeof(buckets));
+}
+
+void FrameProfileHistogram::Add(int64 value) {
+  value = std::max(value, static_cast<int64>(0));
+  int bucket = 0;
+  int64 bound = 1;
+  while (bucket < kNumBuckets - 1 && value >= bound) {
+    ++bucket;
+    bound *= 2;
+  }
+  ++buckets[bucket];
+  ++count;
+  sum += value;
+  max = std::max(max, value);
+}
+
+void FrameProfileHistogram::Merge(const FrameProfileHistogram& other) {
+  for (int i = 0; i < kNumBuckets; ++i) {
+    buckets[i] += other.buckets[i];
+  }
+  count += other.count;
+  sum += other.sum;
+  max = std::max(max, other.max);
+}
+
+int64 FrameProfileHistogram::Percentile(double percentile) const {
+  if (count == 0) {
+    return 0;
+  }
+  const double rank = count * std::min(std::max(percentile, 0.0), 100.0) / 100;
+  int64 samples = 0;
+  int64 bound = 1;
+  for (int i = 0; i < kNumBuckets - 1; ++i) {
+    samples += buckets[i];
+    if (samples > 0 && samples >= rank) {
+      return std::min(bound, max);
+    }
+    bound *= 2;
+  }
+  return max;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FrameTypeProfiler
+//
+
+FrameTypeProfiler::FrameTypeProfiler() : last_index_(-1) {
+  for (int i = 0; i < kNumFrameProfileTypes; ++i) {
+    frames_[i] = 0;
+    encode_us_[i] = 0;
+  }
+}
+
+void FrameTypeProfiler::Add(int type, int64 timestamp, int64 encode_us,
+                            int64 bytes, int quantizer) {
+  if (type < 0 || type >= kNumFrameProfileTypes) {
+    return;
+  }
+  const int64 index = std::max(timestamp, static_cast<int64>(0)) /
+                      kSliceDuration;
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++frames_[type];
+  encode_us_[type] += encode_us;
+  last_index_ = std::max(last_index_, index);
+  if (index <= last_index_ - kNumSlices) {
+    return;
+  }
+  Slice& slice = slices_[index % kNumSlices];
+  if (slice.index != index) {
+    slice = Slice();
+    slice.index = index;
+  }
+  FrameTypeProfile& profile = slice.types[type];
+  profile.encode_us.Add(encode_us);
+  profile.bytes.Add(bytes);
+  if (quantizer >= 0) {
+    profile.quantizer.Add(quantizer);
+  }
+}
+
+void FrameTypeProfiler::GetStats(FrameProfileStats* ptr_stats) const {
+  *ptr_stats = FrameProfileStats();
+  std::lock_guard<std::mutex> lock(mutex_);
+  int64 first_index = last_index_;
+  for (int i = 0; i < kNumSlices; ++i) {
+    const Slice& slice = slices_[i];
+    if (slice.index < 0 || slice.index <= last_index_ - kNumSlices) {
+      continue;
+    }
+    first_index = std::min(first_index, slice.index);
+    for (int type = 0; type < kNumFrameProfileTypes; ++type) {
+      FrameTypeProfile& profile = ptr_stats->types[type];
+      profile.encode_us.Merge(slice.types[type].encode_us);
+      profile.bytes.Merge(slice.types[type].bytes);
+      profile.quantizer.Merge(slice.types[type].quantizer);
+    }
+  }
+  if (last_index_ >= 0) {
+    ptr_stats->window_ms = (last_index_ - first_index + 1) * kSliceDuration;
+  }
+  for (int type = 0; type < kNumFrameProfileTypes; ++type) {
+    ptr_stats->frames[type] = frames_[type];
+    ptr_stats->encode_us[type] = encode_us_[type];
+  }
+}
+
+}  // namespace webmlive
@@ -0,0 +1,136 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_FRAME_TYPE_PROFILER_H_
+#define WEBMLIVE_ENCODER_FRAME_TYPE_PROFILER_H_
+
+#include <mutex>
+
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+
+namespace webmlive {
+
+// Compressed frame types profiled by |FrameTypeProfiler|, from the libvpx
+// packet flags.
+enum FrameProfileType {
+  // VPX_FRAME_IS_KEY.
+  kFrameProfileKey = 0,
+  // Inter frames other libvpx frames may reference.
+  kFrameProfileInter = 1,
+  // VPX_FRAME_IS_DROPPABLE: inter frames no frame references, such as those
+  // of the top temporal layer.
+  kFrameProfileDroppable = 2,
+  // VPX_FRAME_IS_INVISIBLE: alternate reference frames.
+  kFrameProfileInvisible = 3,
+  kNumFrameProfileTypes = 4,
+};
+
+// Returns a short name for |type|, for logging and metrics labels.
+const char* FrameProfileTypeName(int type);
+
+// Fixed-bucket histogram of frame samples. Bucket 0 counts samples below 1,
+// bucket i samples from 2^(i - 1) up to 2^i, and the last bucket all larger
+// samples.
+struct FrameProfileHistogram {
+  static const int kNumBuckets = 32;
+
+  FrameProfileHistogram();
+
+  // Counts |value| in its bucket.
+  void Add(int64 value);
+
+  // Adds the samples of |other|.
+  void Merge(const FrameProfileHistogram& other);
+
+  // Returns an upper bound of the |percentile| percent smallest samples, or
+  // 0 when there are no samples. See |UploadHistogram::Percentile()|.
+  int64 Percentile(double percentile) const;
+
+  // Number of samples, their sum, and the largest sample.
+  int64 count;
+  int64 sum;
+  int64 max;
+
+  int64 buckets[kNumBuckets];
+};
+
+// Samples of the frames of one |FrameProfileType|: the encode wall time
+// spent on them in microseconds, their compressed size in bytes, and the
+// quantizer libvpx used for them on the 0-63 scale of
+// |VpxConfig::min_quantizer|.
+struct FrameTypeProfile {
+  FrameProfileHistogram encode_us;
+  FrameProfileHistogram bytes;
+  FrameProfileHistogram quantizer;
+};
+
+struct FrameProfileStats {
+  FrameProfileStats() : window_ms(0) {
+    for (int i = 0; i < kNumFrameProfileTypes; ++i) {
+      frames[i] = 0;
+      encode_us[i] = 0;
+    }
+  }
+
+  // Samples of the frames of the last |window_ms| of the stream, by type.
+  FrameTypeProfile types[kNumFrameProfileTypes];
+  int64 window_ms;
+
+  // Frames profiled since the encoder started, and their encode wall time in
+  // microseconds, by type.
+  int64 frames[kNumFrameProfileTypes];
+  int64 encode_us[kNumFrameProfileTypes];
+};
+
+// Rolling per frame type profile of a video encoder. Samples are kept in
+// |kNumSlices| slices of |kSliceDuration| milliseconds of stream time; a
+// slice is reused once the stream moves |kNumSlices| slices past it, so
+// |GetStats()| covers the last minute or so of the stream at a fixed cost.
+//
+// Notes:
+// - Thread safe; |Add()| takes an uncontended lock once per frame.
+// - Frames more than the window behind the latest one are counted in the
+//   totals only.
+class FrameTypeProfiler {
+ public:
+  static const int64 kSliceDuration = 10000;
+  static const int kNumSlices = 6;
+
+  FrameTypeProfiler();
+
+  // Profiles a frame of |type| at |timestamp|, in milliseconds, that took
+  // |encode_us| of encode wall time and |bytes| of compressed data. A
+  // negative |quantizer| is not counted.
+  void Add(int type, int64 timestamp, int64 encode_us, int64 bytes,
+           int quantizer);
+
+  // Merges the slices of the window into |ptr_stats|.
+  void GetStats(FrameProfileStats* ptr_stats) const;
+
+ private:
+  struct Slice {
+    Slice() : index(-1) {}
+    // |timestamp| / |kSliceDuration| of the frames of the slice, or -1 when
+    // it holds none.
+    int64 index;
+    FrameTypeProfile types[kNumFrameProfileTypes];
+  };
+
+  // Slices, the slice index of the latest frame, and the totals, protected
+  // by |mutex_|.
+  Slice slices_[kNumSlices];
+  int64 last_index_;
+  int64 frames_[kNumFrameProfileTypes];
+  int64 encode_us_[kNumFrameProfileTypes];
+  mutable std::mutex mutex_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(FrameTypeProfiler);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_FRAME_TYPE_PROFILER_H_
@@ -7,20 +7,31 @@
 // be found in the AUTHORS file in the root of the source tree.
 #include "encoder/http_uploader.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
-#include <ctime>
+#include <cctype>
+#include <chrono>
+#include <cstring>
 #include <condition_variable>
+#include <deque>
 #include <functional>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <queue>
+#include <sstream>
 #include <string>
 #include <thread>
 #include <vector>
 
 #include "encoder/buffer_util.h"
+#include "encoder/etw_trace.h"
+#include "encoder/memory_accounting.h"
+#include "encoder/thread_util.h"
 #include "curl/curl.h"
 #include "curl/easy.h"
+#include "curl/multi.h"
 #include "glog/logging.h"
 #include "libwebm/mkvparser.hpp"
 
@@ -29,19 +40,70 @@
              << curl_easy_strerror(CURL_ERR)
 #define LOG_CURLFORM_ERR(CURL_ERR, MSG_STR) \
   LOG(ERROR) << MSG_STR << " err=" << CURL_ERR
+#define LOG_CURLM_ERR(CURLM_ERR, MSG_STR) \
+  LOG(ERROR) << MSG_STR << " err=" << CURLM_ERR << ":" \
+             << curl_multi_strerror(CURLM_ERR)
 
 namespace webmlive {
 
 static const char* kExpectHeader = "Expect:";
 static const char* kContentTypeHeader = "Content-Type: video/webm";
+static const char* kChunkedHeader = "Transfer-Encoding: chunked";
 static const char* kFormName = "webm_file";
+static const char* kBatchIndexName = "webm_batch_index";
 static const char* kWebmMimeType = "video/webm";
 static const int kUnknownFileSize = -1;
-static const int kBytesRequiredForResume = 32*1024;
+
+// Multipart upload query strings, XML elements and response header.
+static const char kInitiateMultipartQuery[] = "uploads";
+static const char kUploadIdStart[] = "<UploadId>";
+static const char kUploadIdEnd[] = "</UploadId>";
+static const char kResponseError[] = "<Error>";
+static const char kETagHeader[] = "etag:";
+
+// Most response bytes kept for a multipart request. Initiate and complete
+// responses are short XML documents.
+static const size_t kMaxMultipartResponse = 64 * 1024;
+
+// Delay before the first retry of a failed upload, in milliseconds. Each
+// further retry of the upload doubles the delay, up to |kMaxRetryDelay|.
+static const int kRetryDelay = 250;
+static const int kMaxRetryDelay = 8000;
+
+// Response sent by a server that cannot resume an upload at the offset in
+// the Content-Range header.
+static const long kRangeNotSatisfiable = 416;  // NOLINT
+
+// Weight of each request outcome in the health score of an ingest target,
+// the score below which uploads fail over, and the good probes of the
+// primary target after which they fail back.
+static const double kTargetHealthWeight = 0.25;
+static const double kMinTargetHealth = 0.5;
+static const int kProbesToFailBack = 3;
+
+// Priorities of header and audio buffers with
+// |HttpUploaderSettings::prioritize|. Video priorities are 0 or more.
+static const double kHeaderPriority = -2;
+static const double kAudioPriority = -1;
+
+// Weight of each segment in the average segment size of a video
+// representation.
+static const double kSegmentSizeWeight = 0.25;
+
+// HTTP/2 multiplexing, stream weights and |CURL_HTTP_VERSION_2TLS| are
+// available in libcurl 7.47 and later.
+#if LIBCURL_VERSION_NUM >= 0x072F00
+#define WEBMLIVE_CURL_HAS_HTTP2 1
+#endif
+
+// HTTP/2 stream weights, 1 to 256, of uploads by content. Manifests and
+// initialization segments are small and block playback of everything else.
+static const int kHeaderStreamWeight = 256;
+static const int kAudioStreamWeight = 64;
+static const int kDefaultStreamWeight = 16;
 
 class HttpUploaderImpl {
  public:
-  typedef std::queue<std::string> UrlQueue;
   enum {
     // Libcurl reported an unexpected error.
     kLibCurlError = -401,
@@ -55,19 +117,34 @@ class HttpUploaderImpl {
     // in |ProgressCallback|.
     kProgressCallbackStopRequest = 1,
 
-    // Returned by |Upload| when |WaitForUserData| was notified with an
-    // unlocked |upload_buffer_|, which means |Stop| is waiting for
-    // |UploadThread| to exit.
+    // Returned by |WaitForUserData| when |Stop| is waiting for |UploadThread|
+    // to exit.
     kStopping = 2,
   };
 
+  // Maximum time in milliseconds |UploadThread| waits in |curl_multi_wait|.
+  // Bounds the delay before a newly queued buffer starts uploading while other
+  // uploads are in flight.
+  static const int kMultiWaitTimeout = 10;
+
+  // Tokens a paced upload waits for before it resumes, so that it sends a
+  // read's worth of data instead of a few bytes per wake.
+  static const int kPacingResumeBytes = 16 * 1024;
+
+  // Queued buffers from which video is dequeued smallest representation
+  // first. See |HttpUploaderSettings::prioritize|.
+  static const int kPressureQueuedUploads = HttpUploader::kMaxQueuedUploads / 2;
+
   HttpUploaderImpl();
   ~HttpUploaderImpl();
 
-  // Returns true when the uploader is ready to start an upload. Always returns
-  // true when no uploads have been attempted.
+  // Returns true when the upload queue is empty and no upload is running.
+  // Always returns true when no uploads have been attempted.
   bool UploadComplete() const;
 
+  // Returns true when |upload_queue_| has room.
+  bool QueueReady() const;
+
   // Copies user settings and configures libcurl.
   int Init(const HttpUploaderSettings& settings);
 
@@ -77,68 +154,485 @@ class HttpUploaderImpl {
   // Runs |UploadThread|, and starts waiting for user data.
   int Run();
 
-  // Uploads user data.
-  int UploadBuffer(const uint8* ptr_buffer, int32 length);
+  // Adds user data identified by |id| to |upload_queue_|.
+  int UploadBuffer(const uint8* ptr_buffer, int32 length,
+                   const std::string& id);
+
+  // Adds |chunk| to |upload_queue_| without copying its data.
+  int UploadChunk(const SharedWebmChunk& chunk);
 
-  // Stops the uploader.
-  int Stop();
+  // Stream methods. See |HttpUploader|.
+  int StartStreamUpload(const std::string& id);
+  int UploadStreamData(const std::string& id, const uint8* ptr_buffer,
+                       int32 length);
+  int EndStreamUpload(const std::string& id);
 
-  // Adds |target_url| to |url_queue_|. Each time |UploadBuffer| is called, an
-  // URL is popped off the queue and assigned to |target_url_|
-  void EnqueueTargetUrl(const std::string& target_url);
+  // Stops the uploader after up to |timeout_ms| milliseconds of uploading
+  // what is queued. See |HttpUploader::Stop(int)|.
+  int Stop(int timeout_ms);
 
  private:
-  // Used by |UploadThread|. Returns true if user has called |Stop|.
+  // An ingest server uploads are sent to. Used only by |UploadThread|.
+  struct IngestTarget {
+    IngestTarget() : health(1), failures(0), good_probes(0) {}
+
+    std::string url;
+
+    // Moving average of request outcomes, from 0 when all fail to 1 when
+    // all succeed in time, and the number of requests failed in a row.
+    double health;
+    int failures;
+
+    // Good probes in a row of the primary target while a backup is active.
+    int good_probes;
+  };
+
+  // Video segments dequeued for a representation, and their average size.
+  struct Representation {
+    Representation() : segments(0), average_bytes(0) {}
+    int64 segments;
+    double average_bytes;
+  };
+
+  // Latest data of a header, such as the init segment, sent again to a new
+  // target after a failover: |chunk|, or |data| when |chunk| is NULL.
+  struct HeaderCopy {
+    SharedWebmChunk chunk;
+    std::vector<uint8> data;
+  };
+
+  // A chunk uploaded while it is being produced. Protected by |mutex_|.
+  struct Stream {
+    Stream() : read_pos(0), ended(false), failed(false) {}
+
+    std::string id;
+
+    // Time |StartStreamUpload| opened the stream.
+    std::chrono::steady_clock::time_point queued_time;
+
+    // Bytes |read_pos| through the end of |data| are waiting for libcurl.
+    std::vector<uint8> data;
+    size_t read_pos;
+
+    // Set by |EndStreamUpload|.
+    bool ended;
+
+    // Set when the upload ends before the stream does.
+    bool failed;
+  };
+  typedef std::shared_ptr<Stream> SharedStream;
+
+  // Requests of a multipart upload.
+  enum MultipartStep {
+    kMultipartNone,
+    kMultipartInitiate,
+    kMultipartPart,
+    kMultipartComplete,
+    kMultipartAbort,
+  };
+
+  // An object sent with an S3 multipart upload: a POST initiates the upload
+  // and returns its id, a PUT sends each part, and a POST completes the
+  // upload with the ETag of each part. A failed upload is aborted with a
+  // DELETE, so that the storage service drops its parts. Used only by
+  // |UploadThread|.
+  struct MultipartUpload {
+    MultipartUpload()
+        : ptr_buffer(NULL),
+          num_parts(0),
+          next_part(0),
+          parts_in_flight(0),
+          parts_done(0),
+          initiated(false),
+          failed(false),
+          final_request(false),
+          target(0) {}
+
+    // The object data, owned until the upload ends.
+    BufferQueue::Buffer* ptr_buffer;
+
+    // Upload id returned by the initiate request.
+    std::string upload_id;
+
+    // Number of parts, parts started so far, parts in flight, and parts
+    // uploaded, and the ETag of each part.
+    int num_parts;
+    int next_part;
+    int parts_in_flight;
+    int parts_done;
+    std::vector<std::string> etags;
+
+    // Body of the complete request.
+    std::string complete_body;
+
+    // |initiated| is set once |upload_id| is known, |failed| when a request
+    // fails, and |final_request| once the complete or abort request starts.
+    bool initiated;
+    bool failed;
+    bool final_request;
+
+    // Index in |targets_| of the target all requests of the upload go to.
+    size_t target;
+  };
+  typedef std::shared_ptr<MultipartUpload> SharedMultipart;
+
+  // A request slot. Each slot owns a libcurl easy handle that is reused for
+  // every request the slot sends, which allows libcurl to keep connections
+  // to the server alive between requests.
+  struct Transfer {
+    Transfer()
+        : ptr_uploader(NULL),
+          ptr_curl(NULL),
+          ptr_form(NULL),
+          ptr_form_end(NULL),
+          ptr_range_headers(NULL),
+          ptr_buffer(NULL),
+          in_multi(false),
+          paused(false),
+          pacing_paused(false),
+          bytes_sent(0),
+          read_pos(0),
+          retries(0),
+          resume_offset(0),
+          retry_pending(false),
+          warming(false),
+          multipart_step(kMultipartNone),
+          part_number(0),
+          ptr_body(NULL),
+          body_length(0),
+          target(0),
+          probing(false),
+          replay(false),
+          batch_bytes(0) {}
+
+    // Returns true when the slot has an upload, or a warm-up request, in
+    // flight.
+    bool busy() const { return ptr_buffer || stream || warming || multipart; }
+
+    HttpUploaderImpl* ptr_uploader;
+    CURL* ptr_curl;
+
+    // Libcurl form variable/data chain, and pointer to its end.
+    curl_httppost* ptr_form;
+    curl_httppost* ptr_form_end;
+
+    // |ptr_headers_| plus the Content-Range header of a resumed upload.
+    curl_slist* ptr_range_headers;
+
+    // Buffer or stream being uploaded. Both are NULL when the slot is idle.
+    BufferQueue::Buffer* ptr_buffer;
+    SharedStream stream;
+
+    // True while |ptr_curl| is attached to |ptr_multi_|.
+    bool in_multi;
+
+    // True while |ReadCallback| has paused |ptr_curl| waiting for stream
+    // data. Protected by |mutex_|.
+    bool paused;
+
+    // True while |ReadCallback| has paused |ptr_curl| waiting for pacing
+    // tokens. Used only by |UploadThread|.
+    bool pacing_paused;
+
+    // Bytes sent by the current request. Protected by |mutex_|.
+    double bytes_sent;
+
+    // Offset in |ptr_buffer| of the next byte |ReadCallback| passes to
+    // libcurl. Used only by |UploadThread|.
+    int32 read_pos;
+
+    // Retries of |ptr_buffer| so far, and the offset of the first byte the
+    // next request sends. |retry_pending| is set while the slot waits for
+    // |retry_time| to send the next request.
+    int retries;
+    int32 resume_offset;
+    bool retry_pending;
+    std::chrono::steady_clock::time_point retry_time;
+
+    // True while the slot sends a HEAD request that opens a connection to
+    // the server ahead of uploads.
+    bool warming;
+
+    // Multipart upload the slot sends a request of, the request, and the
+    // part number, from 1, of a |kMultipartPart| request. Its body is the
+    // |body_length| bytes at |ptr_body|.
+    SharedMultipart multipart;
+    MultipartStep multipart_step;
+    int part_number;
+    const uint8* ptr_body;
+    int32 body_length;
+
+    // Response body and ETag header received for a multipart request.
+    std::string response;
+    std::string etag;
+
+    // Index in |targets_| of the target the request is sent to. |probing| is
+    // set when a warm-up request probes the primary target, and |replay|
+    // when |ptr_buffer| belongs to |replay_queue_|.
+    size_t target;
+    bool probing;
+    bool replay;
+
+    // Buffers sent after |ptr_buffer| in the same form post, and their total
+    // length. Owned by the slot until |EndTransfer|.
+    std::vector<BufferQueue::Buffer*> batch;
+    int32 batch_bytes;
+  };
+
+  // Used by |UploadThread|. Returns true if user has called |Stop|, and its
+  // deadline has passed.
   bool StopRequested();
 
-  // Pass our callbacks, |ProgressCallback| and |WriteCallback|, to libcurl.
-  CURLcode SetCurlCallbacks();
+  // Returns true when |Stop| is waiting for uploads to drain and nothing is
+  // left to upload. Used only by |UploadThread|.
+  bool DrainComplete();
+
+  // Counts the uploads in flight, and the buffers and streams still waiting,
+  // in |stats_| as abandoned. Called by |UploadThread| before it exits.
+  void RecordAbandonedUploads();
+
+  // Creates the libcurl easy handle for |ptr_transfer|, and passes it our
+  // callbacks and |ptr_headers_|.
+  int InitTransfer(Transfer* ptr_transfer);
+
+  // Pass our callbacks, |ProgressCallback|, |WriteCallback|, |ReadCallback|
+  // and |SeekCallback|, to libcurl.
+  CURLcode SetCurlCallbacks(Transfer* ptr_transfer);
+
+  // Returns true when |id| identifies a header, manifest or init segment.
+  static bool IsHeaderId(const std::string& id);
+
+  // Returns true when |id| identifies audio.
+  static bool IsAudioId(const std::string& id);
+
+  // Returns the representation of the video segment identified by |id|: the
+  // id without its extension and trailing "_<number>".
+  static std::string RepresentationId(const std::string& id);
 
-  // Pass user HTTP headers to libcurl, and disable HTTP 100 responses.
-  CURLcode SetHeaders();
+  // Returns the priority of |buffer| with |settings_.prioritize|, under
+  // pressure when |pressure| is true. See
+  // |HttpUploaderSettings::prioritize|.
+  double UploadPriority(const BufferQueue::Buffer& buffer,
+                        bool pressure) const;
 
-  // Configures libcurl to POST data buffers as file data in a form/multipart
-  // HTTP POST.
-  int SetupFormPost(const uint8* const ptr_buffer, int32 length);
+  // Dequeues the next buffer of |upload_queue_|, by priority with
+  // |settings_.prioritize|.
+  BufferQueue::Buffer* DequeueUpload();
 
-  // Configures libcurl to POST data buffers as HTTP POST content-data.
-  int SetupPost(const uint8* const ptr_buffer, int32 length);
+  // Returns true when queued buffers may share a request. See
+  // |HttpUploaderSettings::coalesce_bytes|.
+  bool CoalescingEnabled() const;
 
-  // Upload user data with libcurl.
-  int Upload();
+  // Returns true when the buffers in |upload_queue_| would all fit in one
+  // request, and the oldest may wait for more to join it.
+  bool HoldForCoalescing();
 
-  // Wakes up |UploadThread| when users pass data through |UploadBuffer|.
+  // Dequeues the buffers that follow |ptr_transfer->ptr_buffer| in
+  // |upload_queue_| and fit in its request into |ptr_transfer->batch|.
+  void CoalesceUploads(Transfer* ptr_transfer);
+
+  // Returns the HTTP/2 stream weight of an upload identified by |id|.
+  static int StreamWeight(const std::string& id);
+
+  // Sets the HTTP/2 stream weight of the next request sent by
+  // |ptr_transfer| when |settings_.http2| is true.
+  int SetStreamWeight(Transfer* ptr_transfer, const std::string& id);
+
+  // Builds |ptr_headers_| from the user HTTP headers, and disables HTTP 100
+  // responses.
+  void BuildHeaders();
+
+  // Configures libcurl to POST |length| bytes read by |ReadCallback| as file
+  // data in a form/multipart HTTP POST, followed by the buffers of
+  // |ptr_transfer->batch|.
+  int SetupFormPost(Transfer* ptr_transfer, int32 length);
+
+  // Configures libcurl to POST |length| bytes read by |ReadCallback| as HTTP
+  // POST content-data.
+  int SetupPost(Transfer* ptr_transfer, int32 length);
+
+  // Configures libcurl to PUT |length| bytes read by |ReadCallback|.
+  int SetupPut(Transfer* ptr_transfer, int32 length);
+
+  // Returns the URL of the object identified by |id| in |HTTP_PUT| mode:
+  // |target_url| with |id| appended ahead of the query string, and |query|
+  // added to the query string when not empty.
+  static std::string ObjectUrl(const std::string& target_url,
+                               const std::string& id,
+                               const std::string& query);
+
+  // Returns the id of the buffer, stream or multipart upload of
+  // |transfer|.
+  static const std::string& TransferId(const Transfer& transfer);
+
+  // Returns true when |buffer| is sent with a multipart upload.
+  bool UseMultipart(const BufferQueue::Buffer& buffer) const;
+
+  // Starts a multipart upload of |ptr_buffer|, which |ptr_transfer| initiates.
+  // The buffer is owned by the upload until it ends, even when this fails.
+  int StartMultipartUpload(Transfer* ptr_transfer,
+                           BufferQueue::Buffer* ptr_buffer);
+
+  // Assigns the next request waiting in |multipart_uploads_| to idle
+  // |ptr_transfer|. Returns false when no request is waiting.
+  bool NextMultipartRequest(Transfer* ptr_transfer);
+
+  // Configures the multipart request assigned to |ptr_transfer|, and adds its
+  // easy handle to |ptr_multi_|.
+  int StartMultipartTransfer(Transfer* ptr_transfer);
+
+  // Records the outcome of the multipart request of |ptr_transfer|, ends the
+  // transfer, and ends its upload when no more requests remain.
+  void FinishMultipartRequest(Transfer* ptr_transfer, bool success);
+
+  // Returns the buffers of the multipart uploads left in
+  // |multipart_uploads_| to |upload_queue_|. Called by |UploadThread| before
+  // it exits.
+  void ReleaseMultipartUploads();
+
+  // Configures idle |ptr_transfer| to upload |ptr_buffer|, and adds its easy
+  // handle to |ptr_multi_|.
+  int StartTransfer(Transfer* ptr_transfer, BufferQueue::Buffer* ptr_buffer);
+
+  // Configures idle |ptr_transfer| to upload |stream| with chunked transfer
+  // encoding, and adds its easy handle to |ptr_multi_|.
+  int StartStreamTransfer(Transfer* ptr_transfer, const SharedStream& stream);
+
+  // Configures idle |ptr_transfer| to send a HEAD request to |target|, which
+  // leaves a connection to the server in the connection cache of
+  // |ptr_multi_|, and adds its easy handle to |ptr_multi_|.
+  int StartWarmTransfer(Transfer* ptr_transfer, size_t target);
+
+  // Starts warm-up requests in up to |count| idle slots.
+  void WarmConnections(int count);
+
+  // Unpauses stream uploads that have data waiting, or that have ended.
+  void ResumeStreamTransfers();
+
+  // Takes up to |length| tokens from |pacer_| and the process pacer for a
+  // read by |ptr_transfer|, and returns the number of bytes it may send.
+  // Marks |ptr_transfer| paced when that is 0.
+  size_t PaceRead(Transfer* ptr_transfer, size_t length);
+
+  // Unpauses uploads paced by |PaceRead| once both pacers have tokens.
+  void ResumePacedTransfers();
+
+  // Updates the health of the target of |ptr_transfer| with the outcome of
+  // its request, which took |seconds|, and fails over when the active
+  // target is no longer healthy.
+  void RecordTargetResult(Transfer* ptr_transfer, bool success,
+                          double seconds);
+
+  // Updates the probe count of the primary target with the outcome of a
+  // probe, and fails back once enough probes in a row are good.
+  void RecordProbeResult(bool success);
+
+  // Starts a probe of the primary target in an idle slot when a backup is
+  // active and the probe interval has passed.
+  void ProbePrimaryTarget();
+
+  // Sends later uploads to |target|, and the buffer uploads of other targets
+  // in flight or waiting for a retry to |target| again, except that of
+  // |ptr_done|, whose request has ended. Queues the header copies in
+  // |replay_queue_|.
+  void SwitchTarget(size_t target, Transfer* ptr_done);
+
+  // Starts uploads of pending streams, and then of queued buffers, while idle
+  // slots remain in |transfers_|. Returns the number of uploads in flight.
+  int StartQueuedTransfers();
+
+  // Reads completion messages from |ptr_multi_|, updates stats, and returns
+  // the buffers of completed uploads to |upload_queue_|.
+  void FinishTransfers();
+
+  // Schedules another attempt at the upload of |ptr_transfer| when its
+  // request failed with |result| or |response_code| and retries remain.
+  // |bytes_uploaded| is the number of bytes the request sent. Returns true
+  // when a retry is scheduled.
+  bool ScheduleRetry(Transfer* ptr_transfer, CURLcode result,
+                     long response_code,  // NOLINT
+                     double bytes_uploaded);
+
+  // Releases the easy handle and buffer of |ptr_transfer|, and marks the slot
+  // idle.
+  void EndTransfer(Transfer* ptr_transfer);
+
+  // Wakes |UploadThread| after a buffer is added to |upload_queue_|.
+  void NotifyUploadThread();
+
+  // Idles |UploadThread| until a buffer is available in |upload_queue_|.
+  // Returns |kStopping| when |Stop| is called, and while draining once
+  // nothing is left to upload.
   int WaitForUserData();
 
   // Libcurl progress callback function.  Acquires |mutex_| and updates
-  // |stats_|.
-  static int ProgressCallback(void* ptr_this,
+  // |stats_|. |ptr_transfer| is the |Transfer| making progress.
+  static int ProgressCallback(void* ptr_transfer,
                               double, double,  // we ignore download progress
                               double upload_total, double upload_current);
 
-  // Logs HTTP response data received by libcurl.
+  // Logs HTTP response data received by libcurl. Keeps the response to a
+  // multipart request in |Transfer::response|.
   static size_t WriteCallback(char* buffer, size_t size, size_t nitems,
-                              void* ptr_this);
-
-  // Acquires |mutex_|, resets |stats_| and sets |start_ticks_|.
+                              void* ptr_transfer);
+
+  // Keeps the ETag header of the response to a multipart request in
+  // |Transfer::etag|.
+  static size_t HeaderCallback(char* buffer, size_t size, size_t nitems,
+                               void* ptr_transfer);
+
+  // Libcurl read callback. Copies request body data to |buffer| straight from
+  // the buffer or chunk being uploaded. For streams, pauses the transfer when
+  // the stream has no data waiting, and returns 0 to end the request once
+  // the stream has ended and all of its data is sent.
+  static size_t ReadCallback(char* buffer, size_t size, size_t nitems,
+                             void* ptr_transfer);
+
+  // Libcurl seek callback. Moves |read_pos| of a buffer upload to |offset|
+  // within the request body when libcurl must send the body again. Streams
+  // cannot seek: their data is discarded once sent.
+  static int SeekCallback(void* ptr_transfer, curl_off_t offset, int origin);
+
+  // Adds the queueing delay of an upload enqueued at |queued_time| to
+  // |stats_|. Acquires |mutex_|.
+  void RecordQueueDelay(std::chrono::steady_clock::time_point queued_time);
+
+  // Adds the timing and throughput of the request completed by |ptr_curl|,
+  // which sent |bytes_uploaded| bytes, to |stats_|. Acquires |mutex_|.
+  void RecordRequestTiming(CURL* ptr_curl, double bytes_uploaded);
+
+  // Acquires |mutex_|, resets |stats_| and sets |start_time_|.
   void ResetStats();
 
-  // Thread function. Wakes when |WaitForUserData| is notified by
-  // |UploadBuffer|, and calls |Upload| to POST user data to the HTTP server
-  // using libcurl.
+  // Thread function. Drives all uploads through |ptr_multi_|: starts uploads
+  // of queued buffers in idle slots, and idles in |WaitForUserData| when no
+  // uploads are in flight and |upload_queue_| is empty.
   void UploadThread();
 
-  // Stop flag. Internal callers use |StopRequested| to allow for
-  // synchronization via |mutex_|.  Set by |Stop|, and responded to in
-  // |UploadThread|.
-  bool stop_;
+  // Stop flag, read without |mutex_| by |StopRequested| from the libcurl
+  // callbacks. Set by |Stop|, or by |StopRequested| once |drain_deadline_|
+  // passes, and responded to in |UploadThread|.
+  std::atomic<bool> stop_;
+
+  // Set by |Stop| when given a timeout: |UploadThread| keeps uploading until
+  // nothing is left, or until |drain_deadline_| when |has_drain_deadline_|.
+  // Written with |mutex_| held; the deadline is set before |draining_|, and
+  // not changed after.
+  std::atomic<bool> draining_;
+  bool has_drain_deadline_;
+  std::chrono::steady_clock::time_point drain_deadline_;
 
   // Upload complete/ready to upload flag.  Initializes to true to allow
   // users of the uploader to base all Upload calls on |UploadComplete|.
-  bool upload_complete_;
+  // Written with |mutex_| held, read by |UploadComplete| without it.
+  std::atomic<bool> upload_complete_;
+
+  // Size of |open_streams_| plus |pending_streams_|, for |UploadComplete|.
+  // Written with |mutex_| held.
+  std::atomic<int32> queued_streams_;
 
   // Condition variable used to wake |UploadThread| when a user code passes a
-  // buffer to |UploadBuffer|.
+  // buffer to |UploadBuffer| or |UploadChunk|.
   std::condition_variable buffer_ready_;
 
   // Mutex for synchronization of public method calls with |UploadThread|
@@ -149,31 +643,76 @@ class HttpUploaderImpl {
   std::shared_ptr<std::thread> upload_thread_;
 
   // Uploader start time.  Reset when via |ResetStatts| when |Init| is called.
-  clock_t start_ticks_;
+  std::chrono::steady_clock::time_point start_time_;
+
+  // Libcurl multi handle. Runs the easy handles in |transfers_|.
+  CURLM* ptr_multi_;
+
+  // Libcurl share handle. Shares DNS entries and TLS sessions between the
+  // easy handles in |transfers_|, so that connections after the first
+  // resume the TLS session instead of negotiating a new one. Used only by
+  // |UploadThread|, which needs no share locks.
+  CURLSH* ptr_share_;
+
+  // Request slots; |settings_.max_uploads| entries. Sized once by |Init|.
+  std::vector<Transfer> transfers_;
 
-  // Libcurl pointer.
-  CURL* ptr_curl_;
+  // Number of slots in |transfers_| with uploads in flight, and with uploads
+  // waiting to be retried. Used only by |UploadThread|.
+  int active_transfers_;
+  int retrying_transfers_;
 
-  // Libcurl form variable/data chain.
-  curl_httppost* ptr_form_;
+  // Set by |StartQueuedTransfers| while queued buffers wait for others to
+  // share their request. Used only by |UploadThread|.
+  bool coalesce_hold_;
 
-  // Pointer to end of libcurl form chain.
-  curl_httppost* ptr_form_end_;
+  // Multipart uploads in progress, oldest first. Used only by
+  // |UploadThread|.
+  std::deque<SharedMultipart> multipart_uploads_;
 
-  // Pointer to list of user HTTP headers.
+  // Pointer to list of user HTTP headers. Shared by all easy handles.
   curl_slist* ptr_headers_;
 
+  // |ptr_headers_| plus the chunked transfer encoding header, for streams.
+  curl_slist* ptr_stream_headers_;
+
+  // Streams open for writing, by id, and streams waiting for a request slot.
+  // Protected by |mutex_|.
+  std::map<std::string, SharedStream> open_streams_;
+  std::deque<SharedStream> pending_streams_;
+
   // Uploader settings.
   HttpUploaderSettings settings_;
 
+  // Paces the requests of the uploader to |settings_.pacing_kbps|.
+  UploadPacer pacer_;
+
+  // Ingest targets: |settings_.target_url|, followed by
+  // |settings_.failover_urls|. |active_target_| is the index of the target
+  // new requests go to, and |next_probe_time_| the time of the next probe of
+  // the primary while a backup is active. Used only by |UploadThread|.
+  std::vector<IngestTarget> targets_;
+  size_t active_target_;
+  std::chrono::steady_clock::time_point next_probe_time_;
+
+  // Header data by id, kept with failover targets. Protected by |mutex_|.
+  std::map<std::string, HeaderCopy> header_copies_;
+
+  // Header copies waiting to be sent to the new target after a failover.
+  // Used only by |UploadThread|, ahead of |upload_queue_|.
+  BufferQueue replay_queue_;
+
+  // Video representations by id, with |settings_.prioritize|. Used only by
+  // |UploadThread|.
+  std::map<std::string, Representation> representations_;
+
   // Basic stats stored by |ProgressCallback|.
   HttpUploaderStats stats_;
 
-  // Simple buffer object that remains locked while libcurl uploads data in
-  // |Upload|.  This second locking mechanism is in place to allow |mutex_| to
-  // be unlocked while uploads are in progress (which prevents public methods
-  // from blocking).
-  LockableBuffer upload_buffer_;
+  // Bounded FIFO of buffers waiting for upload. Has its own lock, which allows
+  // |mutex_| to be unlocked while uploads are in progress (which prevents
+  // public methods from blocking).
+  BufferQueue upload_queue_;
 
   // The name of the file on the local system.  Note that it is not being read,
   // it's information included within the form data contained within the HTTP
@@ -183,6 +722,47 @@ class HttpUploaderImpl {
   WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(HttpUploaderImpl);
 };
 
+const int HttpUploaderImpl::kMultiWaitTimeout;
+
+///////////////////////////////////////////////////////////////////////////////
+// UploadHistogram
+//
+
+UploadHistogram::UploadHistogram(int64 bucket_base)
+    : base(bucket_base), count(0), sum(0), max(0) {
+  memset(buckets, 0, sizeof(buckets));
+}
+
+void UploadHistogram::Add(int64 value) {
+  int bucket = 0;
+  int64 bound = base;
+  while (bucket < kNumBuckets - 1 && value >= bound) {
+    bound *= 2;
+    ++bucket;
+  }
+  ++buckets[bucket];
+  ++count;
+  sum += value;
+  max = std::max(max, value);
+}
+
+int64 UploadHistogram::Percentile(double percentile) const {
+  if (count == 0) {
+    return 0;
+  }
+  const double rank = count * std::min(std::max(percentile, 0.0), 100.0) / 100;
+  int64 samples = 0;
+  int64 bound = base;
+  for (int i = 0; i < kNumBuckets - 1; ++i) {
+    samples += buckets[i];
+    if (samples > 0 && samples >= rank) {
+      return std::min(bound, max);
+    }
+    bound *= 2;
+  }
+  return max;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // HttpUploader
 //
@@ -225,12 +805,48 @@ int HttpUploader::Run() {
 
 // Return result of |Stop| on |ptr_uploader_|.
 int HttpUploader::Stop() {
-  return ptr_uploader_->Stop();
+  return ptr_uploader_->Stop(0);
+}
+
+// Return result of |Stop| on |ptr_uploader_|.
+int HttpUploader::Stop(int timeout_ms) {
+  return ptr_uploader_->Stop(timeout_ms);
+}
+
+// Return result of |QueueReady| on |ptr_uploader_|.
+bool HttpUploader::QueueReady() const {
+  return ptr_uploader_->QueueReady();
 }
 
 // Return result of |UploadBuffer| on |ptr_uploader_|.
+int HttpUploader::UploadBuffer(const uint8* ptr_buffer, int32 length,
+                               const std::string& id) {
+  return ptr_uploader_->UploadBuffer(ptr_buffer, length, id);
+}
+
 int HttpUploader::UploadBuffer(const uint8* ptr_buffer, int32 length) {
-  return ptr_uploader_->UploadBuffer(ptr_buffer, length);
+  return ptr_uploader_->UploadBuffer(ptr_buffer, length, std::string());
+}
+
+// Return result of |UploadChunk| on |ptr_uploader_|.
+int HttpUploader::UploadChunk(const SharedWebmChunk& chunk) {
+  return ptr_uploader_->UploadChunk(chunk);
+}
+
+// Return result of |StartStreamUpload| on |ptr_uploader_|.
+int HttpUploader::StartStreamUpload(const std::string& id) {
+  return ptr_uploader_->StartStreamUpload(id);
+}
+
+// Return result of |UploadStreamData| on |ptr_uploader_|.
+int HttpUploader::UploadStreamData(const std::string& id,
+                                   const uint8* ptr_buffer, int32 length) {
+  return ptr_uploader_->UploadStreamData(id, ptr_buffer, length);
+}
+
+// Return result of |EndStreamUpload| on |ptr_uploader_|.
+int HttpUploader::EndStreamUpload(const std::string& id) {
+  return ptr_uploader_->EndStreamUpload(id);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -238,79 +854,200 @@ int HttpUploader::UploadBuffer(const uint8* ptr_buffer, int32 length) {
 //
 
 HttpUploaderImpl::HttpUploaderImpl()
-    : ptr_curl_(NULL),
-      ptr_form_(NULL),
-      ptr_form_end_(NULL),
+    : stop_(false),
+      draining_(false),
+      has_drain_deadline_(false),
+      upload_complete_(true),
+      queued_streams_(0),
+      ptr_multi_(NULL),
+      ptr_share_(NULL),
+      active_transfers_(0),
+      retrying_transfers_(0),
+      coalesce_hold_(false),
       ptr_headers_(NULL),
-      stop_(false),
-      upload_complete_(true) {
+      ptr_stream_headers_(NULL),
+      active_target_(0),
+      upload_queue_(HttpUploader::kMaxQueuedUploads) {
+  upload_queue_.set_memory_subsystem(kMemoryUploader);
+  replay_queue_.set_memory_subsystem(kMemoryUploader);
 }
 
 HttpUploaderImpl::~HttpUploaderImpl() {
-  if (ptr_curl_) {
-    curl_easy_cleanup(ptr_curl_);
-    ptr_curl_ = NULL;
+  for (size_t i = 0; i < transfers_.size(); ++i) {
+    Transfer& transfer = transfers_[i];
+    if (transfer.ptr_curl) {
+      curl_easy_cleanup(transfer.ptr_curl);
+      transfer.ptr_curl = NULL;
+    }
+    if (transfer.ptr_form) {
+      curl_formfree(transfer.ptr_form);
+      transfer.ptr_form = NULL;
+      transfer.ptr_form_end = NULL;
+    }
+    if (transfer.ptr_range_headers) {
+      curl_slist_free_all(transfer.ptr_range_headers);
+      transfer.ptr_range_headers = NULL;
+    }
+  }
+  if (ptr_multi_) {
+    curl_multi_cleanup(ptr_multi_);
+    ptr_multi_ = NULL;
   }
-  if (ptr_form_) {
-    curl_formfree(ptr_form_);
-    ptr_form_ = NULL;
-    ptr_form_end_ = NULL;
+  if (ptr_share_) {
+    curl_share_cleanup(ptr_share_);
+    ptr_share_ = NULL;
   }
   if (ptr_headers_) {
     curl_slist_free_all(ptr_headers_);
     ptr_headers_ = NULL;
   }
+  if (ptr_stream_headers_) {
+    curl_slist_free_all(ptr_stream_headers_);
+    ptr_stream_headers_ = NULL;
+  }
 }
 
-// Obtain lock on |mutex_| and return value of |upload_complete_|.
+// Returns the value of |upload_complete_| when |upload_queue_| is empty and
+// no streams are open or pending. Does not take |mutex_|, so callers polling
+// from other threads never contend with |UploadThread|.
 bool HttpUploaderImpl::UploadComplete() const {
-  bool complete = false;
-  std::unique_lock<std::mutex> lock(mutex_, std::try_to_lock);
-  if (lock.owns_lock()) {
-    complete = upload_complete_;
-  }
-  return complete;
+  return upload_complete_ && queued_streams_ == 0 &&
+         upload_queue_.IsEmpty() && replay_queue_.IsEmpty();
 }
 
-// Initializes the upload:
+bool HttpUploaderImpl::QueueReady() const {
+  return !upload_queue_.IsFull();
+}
+
+// Initializes the uploader:
 // - copies user settings
-// - sets basic libcurl settings (progress and write callbacks)
-// - calls SetHeaders to pass user headers to libcurl
+// - creates the libcurl multi and share handles
+// - calls BuildHeaders to build the user header list
+// - creates one easy handle per request slot via InitTransfer
 int HttpUploaderImpl::Init(const HttpUploaderSettings& settings) {
   if (settings.target_url.empty()) {
     LOG(ERROR) << "Empty target URL.";
     return HttpUploader::kUrlConfigError;
   }
+  if (settings.max_uploads < 1) {
+    LOG(ERROR) << "Invalid max_uploads: " << settings.max_uploads;
+    return HttpUploader::kInvalidArg;
+  }
+  if (settings.warm_connections < 0) {
+    LOG(ERROR) << "Invalid warm_connections: " << settings.warm_connections;
+    return HttpUploader::kInvalidArg;
+  }
+  if (settings.max_queue_bytes < 0) {
+    LOG(ERROR) << "Invalid max_queue_bytes: " << settings.max_queue_bytes;
+    return HttpUploader::kInvalidArg;
+  }
+  if (settings.multipart_part_bytes < 0) {
+    LOG(ERROR) << "Invalid multipart_part_bytes: "
+               << settings.multipart_part_bytes;
+    return HttpUploader::kInvalidArg;
+  }
+
+  if (settings.pacing_kbps < 0) {
+    LOG(ERROR) << "Invalid pacing_kbps: " << settings.pacing_kbps;
+    return HttpUploader::kInvalidArg;
+  }
+  if (settings.coalesce_bytes < 0 || settings.coalesce_delay_ms < 0) {
+    LOG(ERROR) << "Invalid coalesce_bytes or coalesce_delay_ms.";
+    return HttpUploader::kInvalidArg;
+  }
+  if (!settings.failover_urls.empty() &&
+      (settings.failover_errors < 1 || settings.failover_latency_ms < 1 ||
+       settings.failover_probe_ms < 1)) {
+    LOG(ERROR) << "Invalid failover settings.";
+    return HttpUploader::kInvalidArg;
+  }
+  for (size_t i = 0; i < settings.failover_urls.size(); ++i) {
+    if (settings.failover_urls[i].empty()) {
+      LOG(ERROR) << "Empty failover URL.";
+      return HttpUploader::kUrlConfigError;
+    }
+  }
 
   // copy user settings
   settings_ = settings;
+  settings_.warm_connections =
+      std::min(settings_.warm_connections, settings_.max_uploads);
+  pacer_.SetRate(settings_.pacing_kbps, settings_.pacing_burst_ms);
+  upload_queue_.set_max_bytes(settings_.max_queue_bytes);
+  targets_.resize(1 + settings_.failover_urls.size());
+  targets_[0].url = settings_.target_url;
+  for (size_t i = 0; i < settings_.failover_urls.size(); ++i) {
+    targets_[i + 1].url = settings_.failover_urls[i];
+  }
 
   // Init libcurl.
-  ptr_curl_ = curl_easy_init();
-  if (!ptr_curl_) {
-    LOG(ERROR) << "curl_easy_init failed!";
+  ptr_multi_ = curl_multi_init();
+  if (!ptr_multi_) {
+    LOG(ERROR) << "curl_multi_init failed!";
     return kLibCurlError;
   }
 
-  // Enable progress reports from libcurl.
-  CURLcode curl_ret = curl_easy_setopt(ptr_curl_, CURLOPT_NOPROGRESS, FALSE);
-  if (curl_ret != CURLE_OK) {
-    LOG_CURL_ERR(curl_ret, "curl progress enable failed.");
+  // Keep one connection per request slot in the connection cache.
+  CURLMcode multi_ret = curl_multi_setopt(
+      ptr_multi_, CURLMOPT_MAXCONNECTS, static_cast<long>(  // NOLINT
+          settings_.max_uploads));
+  if (multi_ret != CURLM_OK) {
+    LOG_CURLM_ERR(multi_ret, "setopt CURLMOPT_MAXCONNECTS failed.");
     return kLibCurlError;
   }
 
-  // Set callbacks.
-  curl_ret = SetCurlCallbacks();
-  if (curl_ret != CURLE_OK) {
-    LOG_CURL_ERR(curl_ret, "curl callback setup failed.");
+  if (settings_.http2) {
+#ifdef WEBMLIVE_CURL_HAS_HTTP2
+    // Run every request slot as a stream of one connection to the server.
+    multi_ret = curl_multi_setopt(ptr_multi_, CURLMOPT_PIPELINING,
+                                  CURLPIPE_MULTIPLEX);
+    if (multi_ret != CURLM_OK) {
+      LOG_CURLM_ERR(multi_ret, "setopt CURLMOPT_PIPELINING failed.");
+      return kLibCurlError;
+    }
+    multi_ret = curl_multi_setopt(ptr_multi_, CURLMOPT_MAX_HOST_CONNECTIONS,
+                                  1L);
+    if (multi_ret != CURLM_OK) {
+      LOG_CURLM_ERR(multi_ret, "setopt CURLMOPT_MAX_HOST_CONNECTIONS failed.");
+      return kLibCurlError;
+    }
+#else
+    LOG(WARNING) << "libcurl lacks HTTP/2 multiplexing, using HTTP/1.1.";
+    settings_.http2 = false;
+#endif
+  }
+  if (settings_.http2) {
+    // Uploads share one connection; there is no standby.
+    settings_.warm_connections = std::min(settings_.warm_connections, 1);
+  }
+
+  ptr_share_ = curl_share_init();
+  if (!ptr_share_) {
+    LOG(ERROR) << "curl_share_init failed!";
+    return kLibCurlError;
+  }
+  CURLSHcode share_ret =
+      curl_share_setopt(ptr_share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  if (share_ret == CURLSHE_OK) {
+    share_ret = curl_share_setopt(ptr_share_, CURLSHOPT_SHARE,
+                                  CURL_LOCK_DATA_SSL_SESSION);
+  }
+  if (share_ret != CURLSHE_OK) {
+    LOG(ERROR) << "curl_share_setopt failed: "
+               << curl_share_strerror(share_ret);
     return kLibCurlError;
   }
 
-  // Disable HTTP 100 responses, and set user HTTP headers.
-  curl_ret = SetHeaders();
-  if (curl_ret) {
-    LOG_CURL_ERR(curl_ret, "unable to set headers.");
-    return HttpUploader::kHeaderError;
+  // Disable HTTP 100 responses, and build user HTTP headers.
+  BuildHeaders();
+
+  transfers_.resize(settings_.max_uploads);
+  for (size_t i = 0; i < transfers_.size(); ++i) {
+    const int status = InitTransfer(&transfers_[i]);
+    if (status) {
+      LOG(ERROR) << "InitTransfer failed, status=" << status;
+      return status;
+    }
   }
 
   local_file_name_ = settings_.local_file;
@@ -329,6 +1066,27 @@ int HttpUploaderImpl::GetStats(HttpUploaderStats* ptr_stats) {
   ptr_stats->bytes_per_second = stats_.bytes_per_second;
   ptr_stats->bytes_sent_current = stats_.bytes_sent_current;
   ptr_stats->total_bytes_uploaded = stats_.total_bytes_uploaded;
+  ptr_stats->queued_uploads = upload_queue_.size();
+  ptr_stats->queued_bytes = upload_queue_.bytes();
+  ptr_stats->max_queued_bytes = upload_queue_.peak_bytes();
+  ptr_stats->upload_retries = stats_.upload_retries;
+  ptr_stats->resumed_uploads = stats_.resumed_uploads;
+  ptr_stats->connections_warmed = stats_.connections_warmed;
+  ptr_stats->multipart_uploads = stats_.multipart_uploads;
+  ptr_stats->multipart_parts = stats_.multipart_parts;
+  ptr_stats->multipart_failures = stats_.multipart_failures;
+  ptr_stats->uploads_abandoned = stats_.uploads_abandoned;
+  ptr_stats->bytes_abandoned = stats_.bytes_abandoned;
+  ptr_stats->pacing_waits = stats_.pacing_waits;
+  ptr_stats->failovers = stats_.failovers;
+  ptr_stats->active_target = stats_.active_target;
+  ptr_stats->replayed_uploads = stats_.replayed_uploads;
+  ptr_stats->coalesced_requests = stats_.coalesced_requests;
+  ptr_stats->coalesced_buffers = stats_.coalesced_buffers;
+  ptr_stats->queue_delay_ms = stats_.queue_delay_ms;
+  ptr_stats->time_to_first_byte_ms = stats_.time_to_first_byte_ms;
+  ptr_stats->upload_time_ms = stats_.upload_time_ms;
+  ptr_stats->throughput_kbps = stats_.throughput_kbps;
   return kSuccess;
 }
 
@@ -345,143 +1103,558 @@ int HttpUploaderImpl::Run() {
   return kSuccess;
 }
 
-// Try to obtain lock on |mutex_|, and upload the user buffer stored in
-// |upload_buffer_| if the buffer is unlocked.  If the lock is obtained and the
-// buffer is unlocked, |UploadBuffer| locks the buffer and notifies the upload
-// thread through call to |notify_one| on the |buffer_ready_| condition
-// variable.
-int HttpUploaderImpl::UploadBuffer(const uint8* ptr_buf, int32 length) {
-  int status = HttpUploader::kUploadInProgress;
-  std::unique_lock<std::mutex> lock(mutex_, std::try_to_lock);
-  if (lock.owns_lock() && !upload_buffer_.IsLocked()) {
-    // Lock obtained; (re)initialize |upload_buffer_| with the user data...
-    status = upload_buffer_.Init(ptr_buf, length);
-    if (status) {
-      LOG(ERROR) << "upload_buffer_ Init failed, status=" << status;
-      return status;
-    }
+// Copies the user data into |upload_queue_|, and wakes |UploadThread|. Returns
+// |kQueueFull| without blocking when |upload_queue_| has no room. Buffers
+// without an id take |settings_.stream_id|.
+int HttpUploaderImpl::UploadBuffer(const uint8* ptr_buf, int32 length,
+                                   const std::string& id) {
+  if (!ptr_buf || length <= 0) {
+    LOG(ERROR) << "invalid upload buffer.";
+    return HttpUploader::kInvalidArg;
+  }
+  const std::string& buffer_id = id.empty() ? settings_.stream_id : id;
+  if (settings_.post_mode == webmlive::HTTP_PUT && buffer_id.empty()) {
+    LOG(ERROR) << "object upload without a name.";
+    return HttpUploader::kInvalidArg;
+  }
+  if (!upload_queue_.EnqueueBuffer(buffer_id, ptr_buf, length)) {
+    VLOG(1) << "upload queue full.";
+    return HttpUploader::kQueueFull;
+  }
+  if (!settings_.failover_urls.empty() && IsHeaderId(buffer_id)) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    HeaderCopy& copy = header_copies_[buffer_id];
+    copy.chunk.reset();
+    copy.data.assign(ptr_buf, ptr_buf + length);
+  }
+  LOG(INFO) << "queued upload of " << length << " bytes";
+  NotifyUploadThread();
+  return kSuccess;
+}
 
-    // Lock |upload_buffer_|; it's unlocked by |UploadThread| once libcurl
-    // finishes its run.
-    status = upload_buffer_.Lock();
-    if (status) {
-      LOG(ERROR) << "upload_buffer_ Lock failed, status=" << status;
-      return status;
-    }
-    upload_complete_ = false;
+// Same as |UploadBuffer|, but |upload_queue_| holds a reference to |chunk|
+// instead of a copy of its data.
+int HttpUploaderImpl::UploadChunk(const SharedWebmChunk& chunk) {
+  if (!chunk || chunk->length() <= 0) {
+    LOG(ERROR) << "invalid upload chunk.";
+    return HttpUploader::kInvalidArg;
+  }
+  if (!upload_queue_.EnqueueChunk(chunk)) {
+    VLOG(1) << "upload queue full.";
+    return HttpUploader::kQueueFull;
+  }
+  if (!settings_.failover_urls.empty() && IsHeaderId(chunk->id())) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    HeaderCopy& copy = header_copies_[chunk->id()];
+    copy.chunk = chunk;
+    copy.data.clear();
+  }
+  LOG(INFO) << "queued upload of chunk " << chunk->id() << ", "
+            << chunk->length() << " bytes";
+  NotifyUploadThread();
+  return kSuccess;
+}
 
-    // Wake |UploadThread|.
-    LOG(INFO) << "waking uploader with " << length << " bytes";
-    buffer_ready_.notify_one();
+// Adds a stream to |open_streams_| and |pending_streams_|, and wakes
+// |UploadThread|.
+int HttpUploaderImpl::StartStreamUpload(const std::string& id) {
+  if (settings_.post_mode != webmlive::HTTP_POST) {
+    LOG(ERROR) << "streams require HTTP_POST mode.";
+    return HttpUploader::kStreamError;
   }
-  return status;
+  SharedStream stream(new (std::nothrow) Stream());  // NOLINT
+  if (!stream) {
+    LOG(ERROR) << "cannot construct Stream.";
+    return HttpUploader::kStreamError;
+  }
+  stream->id = id;
+  stream->queued_time = std::chrono::steady_clock::now();
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (open_streams_.find(id) != open_streams_.end()) {
+    LOG(ERROR) << "stream already open: " << id;
+    return HttpUploader::kStreamError;
+  }
+  open_streams_[id] = stream;
+  pending_streams_.push_back(stream);
+  queued_streams_ += 2;
+  if (!settings_.failover_urls.empty() && IsHeaderId(id)) {
+    HeaderCopy& copy = header_copies_[id];
+    copy.chunk.reset();
+    copy.data.clear();
+  }
+  buffer_ready_.notify_one();
+  VLOG(1) << "opened stream " << id;
+  return kSuccess;
 }
 
-// Stops |UploadThread|. First it wakes the thread by calling |notify_one| on
-// the |buffer_ready_| condition variable without locking |upload_buffer_|,
-// which causes |Upload| to return |kStopping| to |UploadThread|, breaking the
-// loop. This takes care of stopping if the uploader was waiting for user data
-// in |WaitForUserData|.
-// It then obtains lock on |mutex_|, sets |stop_| to true, and releases lock to
-// ensure a running upload stops when |StopRequested| is called within the
-// libcurl callbacks.
-int HttpUploaderImpl::Stop() {
-  assert(upload_thread_);
-  if (UploadComplete()) {
-    // Wake up the upload thread
-    buffer_ready_.notify_one();
+// Appends the user data to the stream. |UploadThread| resumes the transfer if
+// it is paused waiting for data.
+int HttpUploaderImpl::UploadStreamData(const std::string& id,
+                                       const uint8* ptr_buffer,
+                                       int32 length) {
+  if (!ptr_buffer || length <= 0) {
+    LOG(ERROR) << "invalid stream buffer.";
+    return HttpUploader::kInvalidArg;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::map<std::string, SharedStream>::iterator stream_iter =
+      open_streams_.find(id);
+  if (stream_iter == open_streams_.end()) {
+    LOG(ERROR) << "stream not open: " << id;
+    return HttpUploader::kStreamError;
+  }
+  Stream& stream = *stream_iter->second;
+  if (stream.failed) {
+    LOG(ERROR) << "stream upload failed: " << id;
+    return HttpUploader::kStreamError;
+  }
+  const size_t bytes_waiting = stream.data.size() - stream.read_pos;
+  if (bytes_waiting + static_cast<size_t>(length) >
+      static_cast<size_t>(HttpUploader::kMaxStreamBufferBytes)) {
+    LOG(ERROR) << "stream buffer full: " << id;
+    return HttpUploader::kStreamError;
+  }
+  stream.data.insert(stream.data.end(), ptr_buffer, ptr_buffer + length);
+  if (!settings_.failover_urls.empty() && IsHeaderId(id)) {
+    std::vector<uint8>& copy = header_copies_[id].data;
+    copy.insert(copy.end(), ptr_buffer, ptr_buffer + length);
+  }
+  return kSuccess;
+}
+
+// Marks the stream ended, and removes it from |open_streams_|. The transfer
+// keeps the stream until the data left in it has been sent.
+int HttpUploaderImpl::EndStreamUpload(const std::string& id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::map<std::string, SharedStream>::iterator stream_iter =
+      open_streams_.find(id);
+  if (stream_iter == open_streams_.end()) {
+    LOG(ERROR) << "stream not open: " << id;
+    return HttpUploader::kStreamError;
   }
+  const bool failed = stream_iter->second->failed;
+  stream_iter->second->ended = true;
+  open_streams_.erase(stream_iter);
+  --queued_streams_;
+  VLOG(1) << "ended stream " << id;
+  if (failed) {
+    LOG(ERROR) << "stream upload failed: " << id;
+    return HttpUploader::kStreamError;
+  }
+  return kSuccess;
+}
+
+// Obtains lock on |mutex_| to avoid racing with the predicate check in
+// |WaitForUserData|, and wakes |UploadThread|.
+void HttpUploaderImpl::NotifyUploadThread() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  buffer_ready_.notify_one();
+}
+
+// Stops |UploadThread|. Obtains lock on |mutex_|, sets |stop_| to true, or
+// |draining_| when |timeout_ms| is not 0, and
+// releases lock to ensure running uploads stop when |StopRequested| is called
+// within the libcurl callbacks. It then wakes the thread by calling
+// |notify_one| on the |buffer_ready_| condition variable, which causes
+// |WaitForUserData| to return |kStopping| if the uploader was idle. Buffers
+// still in |upload_queue_| when the thread stops are discarded.
+int HttpUploaderImpl::Stop(int timeout_ms) {
+  assert(upload_thread_);
   mutex_.lock();
-  stop_ = true;
+  if (timeout_ms != 0) {
+    draining_ = true;
+    has_drain_deadline_ = timeout_ms > 0;
+    drain_deadline_ = std::chrono::steady_clock::now() +
+                      std::chrono::milliseconds(timeout_ms);
+  } else {
+    stop_ = true;
+  }
   mutex_.unlock();
+  buffer_ready_.notify_one();
   upload_thread_->join();
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (stats_.uploads_abandoned > 0) {
+    LOG(WARNING) << "uploader stopped with " << stats_.uploads_abandoned
+                 << " upload(s), " << stats_.bytes_abandoned
+                 << " bytes, undelivered.";
+  }
   return kSuccess;
 }
 
-// Try to obtain lock on |mutex_|, and return the value of |stop_| if lock is
-// obtained.  Returns false if unable to obtain the lock.
+// Returns the value of |stop_| without taking |mutex_|. Sets |stop_| once
+// |drain_deadline_| passes while draining.
 bool HttpUploaderImpl::StopRequested() {
-  bool stop_requested = false;
-  std::unique_lock<std::mutex> lock(mutex_, std::try_to_lock);
-  if (lock.owns_lock()) {
-    stop_requested = stop_;
+  if (stop_) {
+    return true;
+  }
+  if (draining_ && has_drain_deadline_ &&
+      std::chrono::steady_clock::now() >= drain_deadline_ &&
+      !stop_.exchange(true)) {
+    LOG(WARNING) << "upload drain deadline passed, aborting uploads.";
+  }
+  return stop_;
+}
+
+bool HttpUploaderImpl::DrainComplete() {
+  if (active_transfers_ > 0 || retrying_transfers_ > 0 ||
+      !multipart_uploads_.empty()) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  return draining_ && upload_queue_.IsEmpty() && replay_queue_.IsEmpty() &&
+         open_streams_.empty() && pending_streams_.empty();
+}
+
+// Uploads in flight hold their buffers, which |upload_queue_| counts in its
+// bytes until they are released. Warm-up requests carry no data.
+void HttpUploaderImpl::RecordAbandonedUploads() {
+  int64 uploads = upload_queue_.size() + replay_queue_.size();
+  int64 bytes = 0;
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (size_t i = 0; i < transfers_.size(); ++i) {
+    const Transfer& transfer = transfers_[i];
+    if (transfer.ptr_buffer) {
+      uploads += 1 + transfer.batch.size();
+    } else if (transfer.stream) {
+      ++uploads;
+      bytes += transfer.stream->data.size() - transfer.stream->read_pos;
+    }
+  }
+  uploads += pending_streams_.size() + multipart_uploads_.size();
+  for (size_t i = 0; i < pending_streams_.size(); ++i) {
+    bytes += pending_streams_[i]->data.size();
+  }
+  stats_.uploads_abandoned += uploads;
+  stats_.bytes_abandoned += bytes + upload_queue_.bytes() +
+                           replay_queue_.bytes();
+}
+
+// Creates the easy handle for |ptr_transfer|, and sets the options shared by
+// all requests sent through it.
+int HttpUploaderImpl::InitTransfer(Transfer* ptr_transfer) {
+  ptr_transfer->ptr_uploader = this;
+  ptr_transfer->ptr_curl = curl_easy_init();
+  if (!ptr_transfer->ptr_curl) {
+    LOG(ERROR) << "curl_easy_init failed!";
+    return kLibCurlError;
   }
-  return stop_requested;
+  CURL* const ptr_curl = ptr_transfer->ptr_curl;
+
+  // Enable progress reports from libcurl.
+  CURLcode curl_ret = curl_easy_setopt(ptr_curl, CURLOPT_NOPROGRESS, 0L);
+  if (curl_ret != CURLE_OK) {
+    LOG_CURL_ERR(curl_ret, "curl progress enable failed.");
+    return kLibCurlError;
+  }
+
+  // Set callbacks.
+  curl_ret = SetCurlCallbacks(ptr_transfer);
+  if (curl_ret != CURLE_OK) {
+    LOG_CURL_ERR(curl_ret, "curl callback setup failed.");
+    return kLibCurlError;
+  }
+
+  // Pass the user HTTP headers to libcurl.
+  curl_ret = curl_easy_setopt(ptr_curl, CURLOPT_HTTPHEADER, ptr_headers_);
+  if (curl_ret != CURLE_OK) {
+    LOG_CURL_ERR(curl_ret, "setopt CURLOPT_HTTPHEADER failed.");
+    return HttpUploader::kHeaderError;
+  }
+
+  // Keep idle connections open between requests.
+  curl_ret = curl_easy_setopt(ptr_curl, CURLOPT_TCP_KEEPALIVE, 1L);
+  if (curl_ret != CURLE_OK) {
+    LOG_CURL_ERR(curl_ret, "setopt CURLOPT_TCP_KEEPALIVE failed.");
+    return kLibCurlError;
+  }
+
+  // Share DNS entries and TLS sessions with the other slots.
+  curl_ret = curl_easy_setopt(ptr_curl, CURLOPT_SHARE, ptr_share_);
+  if (curl_ret != CURLE_OK) {
+    LOG_CURL_ERR(curl_ret, "setopt CURLOPT_SHARE failed.");
+    return kLibCurlError;
+  }
+
+#ifdef WEBMLIVE_CURL_HAS_HTTP2
+  if (settings_.http2) {
+    curl_ret = curl_easy_setopt(ptr_curl, CURLOPT_HTTP_VERSION,
+                                static_cast<long>(  // NOLINT
+                                    CURL_HTTP_VERSION_2TLS));
+    if (curl_ret != CURLE_OK) {
+      LOG_CURL_ERR(curl_ret, "setopt CURLOPT_HTTP_VERSION failed.");
+      return kLibCurlError;
+    }
+
+    // Requests started while the connection is being set up wait for it
+    // rather than opening connections of their own.
+    curl_ret = curl_easy_setopt(ptr_curl, CURLOPT_PIPEWAIT, 1L);
+    if (curl_ret != CURLE_OK) {
+      LOG_CURL_ERR(curl_ret, "setopt CURLOPT_PIPEWAIT failed.");
+      return kLibCurlError;
+    }
+  }
+#endif
+  return kSuccess;
 }
 
-// Pass callback function pointers (|ProgressCallback| and |WriteCallback|),
-// and data, |this|, to libcurl.
-CURLcode HttpUploaderImpl::SetCurlCallbacks() {
+// Pass callback function pointers (|ProgressCallback|, |WriteCallback|,
+// |HeaderCallback|, |ReadCallback| and |SeekCallback|), and data,
+// |ptr_transfer|, to libcurl.
+CURLcode HttpUploaderImpl::SetCurlCallbacks(Transfer* ptr_transfer) {
+  CURL* const ptr_curl = ptr_transfer->ptr_curl;
   // set the progress callback function pointer
-  CURLcode err = curl_easy_setopt(ptr_curl_, CURLOPT_PROGRESSFUNCTION,
+  CURLcode err = curl_easy_setopt(ptr_curl, CURLOPT_PROGRESSFUNCTION,
                                   ProgressCallback);
   if (err != CURLE_OK) {
     LOG_CURL_ERR(err, "curl progress callback setup failed.");
     return err;
   }
   // set progress callback data pointer
-  err = curl_easy_setopt(ptr_curl_, CURLOPT_PROGRESSDATA,
-                         reinterpret_cast<void*>(this));
+  err = curl_easy_setopt(ptr_curl, CURLOPT_PROGRESSDATA,
+                         reinterpret_cast<void*>(ptr_transfer));
   if (err != CURLE_OK) {
     LOG_CURL_ERR(err, "curl progress callback data setup failed.");
     return err;
   }
   // set write callback function pointer
-  err = curl_easy_setopt(ptr_curl_, CURLOPT_WRITEFUNCTION, WriteCallback);
+  err = curl_easy_setopt(ptr_curl, CURLOPT_WRITEFUNCTION, WriteCallback);
   if (err != CURLE_OK) {
     LOG_CURL_ERR(err, "curl write callback setup failed.");
     return err;
   }
   // set write callback data pointer
-  err = curl_easy_setopt(ptr_curl_, CURLOPT_WRITEDATA,
-                         reinterpret_cast<void*>(this));
+  err = curl_easy_setopt(ptr_curl, CURLOPT_WRITEDATA,
+                         reinterpret_cast<void*>(ptr_transfer));
   if (err != CURLE_OK) {
     LOG_CURL_ERR(err, "curl write callback data setup failed.");
     return err;
   }
-  return err;
-}
-
-// Disable HTTP 100 responses (send empty Expect header), and pass user HTTP
-// headers into lib curl.
-CURLcode HttpUploaderImpl::SetHeaders() {
-  // Tell libcurl to omit "Expect: 100-continue" from requests
-  ptr_headers_ = curl_slist_append(ptr_headers_, kExpectHeader);
-  if (settings_.post_mode == webmlive::HTTP_POST) {
-    // In form posts the video/webm mime-type is included in the form itself,
-    // but in plain old HTTP posts the Content-Type must be video/webm.
-    ptr_headers_ = curl_slist_append(ptr_headers_, kContentTypeHeader);
+  err = curl_easy_setopt(ptr_curl, CURLOPT_HEADERFUNCTION, HeaderCallback);
+  if (err != CURLE_OK) {
+    LOG_CURL_ERR(err, "curl header callback setup failed.");
+    return err;
   }
-  typedef std::map<std::string, std::string> StringMap;
-  StringMap::const_iterator header_iter = settings_.headers.begin();
-  // add user headers
-  for (; header_iter != settings_.headers.end(); ++header_iter) {
-    std::ostringstream header;
-    header << header_iter->first.c_str() << ":" << header_iter->second.c_str();
-    ptr_headers_ = curl_slist_append(ptr_headers_, header.str().c_str());
+  err = curl_easy_setopt(ptr_curl, CURLOPT_HEADERDATA,
+                         reinterpret_cast<void*>(ptr_transfer));
+  if (err != CURLE_OK) {
+    LOG_CURL_ERR(err, "curl header callback data setup failed.");
+    return err;
+  }
+  // Request bodies are always read through |ReadCallback|; libcurl uses it
+  // whenever no post fields are set.
+  err = curl_easy_setopt(ptr_curl, CURLOPT_READFUNCTION, ReadCallback);
+  if (err != CURLE_OK) {
+    LOG_CURL_ERR(err, "curl read callback setup failed.");
+    return err;
+  }
+  err = curl_easy_setopt(ptr_curl, CURLOPT_READDATA,
+                         reinterpret_cast<void*>(ptr_transfer));
+  if (err != CURLE_OK) {
+    LOG_CURL_ERR(err, "curl read callback data setup failed.");
+    return err;
   }
-  CURLcode err = curl_easy_setopt(ptr_curl_, CURLOPT_HTTPHEADER, ptr_headers_);
+  err = curl_easy_setopt(ptr_curl, CURLOPT_SEEKFUNCTION, SeekCallback);
   if (err != CURLE_OK) {
-    LOG_CURL_ERR(err, "setopt CURLOPT_HTTPHEADER failed err=");
+    LOG_CURL_ERR(err, "curl seek callback setup failed.");
+    return err;
+  }
+  err = curl_easy_setopt(ptr_curl, CURLOPT_SEEKDATA,
+                         reinterpret_cast<void*>(ptr_transfer));
+  if (err != CURLE_OK) {
+    LOG_CURL_ERR(err, "curl seek callback data setup failed.");
+    return err;
   }
   return err;
 }
 
-// Sets necessary curl options for form based file upload, and adds the user
-// form variables.
-int HttpUploaderImpl::SetupFormPost(const uint8* const ptr_buffer,
-                                    int32 length) {
-  if (ptr_form_) {
-    curl_formfree(ptr_form_);
-    ptr_form_ = NULL;
-    ptr_form_end_ = NULL;
-  }
-  typedef std::map<std::string, std::string> StringMap;
-  StringMap::const_iterator var_iter = settings_.form_variables.begin();
+bool HttpUploaderImpl::IsHeaderId(const std::string& id) {
+  const size_t length = id.length();
+  return id == "header" ||
+      (length > 4 && (id.compare(length - 4, 4, ".hdr") == 0 ||
+                      id.compare(length - 4, 4, ".mpd") == 0));
+}
+
+bool HttpUploaderImpl::IsAudioId(const std::string& id) {
+  return id.find("audio") != std::string::npos;
+}
+
+// DASH segment ids end in "_<number>.chk".
+std::string HttpUploaderImpl::RepresentationId(const std::string& id) {
+  std::string rep_id = id.substr(0, id.rfind('.'));
+  const size_t number_pos = rep_id.find_last_not_of("0123456789");
+  if (number_pos != std::string::npos && number_pos + 1 < rep_id.length() &&
+      rep_id[number_pos] == '_') {
+    rep_id.erase(number_pos);
+  }
+  return rep_id;
+}
+
+double HttpUploaderImpl::UploadPriority(const BufferQueue::Buffer& buffer,
+                                        bool pressure) const {
+  if (IsHeaderId(buffer.id)) {
+    return kHeaderPriority;
+  }
+  if (IsAudioId(buffer.id)) {
+    return kAudioPriority;
+  }
+  const std::map<std::string, Representation>::const_iterator rep_iter =
+      representations_.find(RepresentationId(buffer.id));
+  if (rep_iter == representations_.end()) {
+    return pressure ? buffer.length() : 0;
+  }
+  const Representation& rep = rep_iter->second;
+  return pressure ? rep.average_bytes : static_cast<double>(rep.segments);
+}
+
+BufferQueue::Buffer* HttpUploaderImpl::DequeueUpload() {
+  if (!settings_.prioritize) {
+    return upload_queue_.DequeueBuffer();
+  }
+  const bool pressure = upload_queue_.size() >= kPressureQueuedUploads;
+  BufferQueue::Buffer* const ptr_buffer = upload_queue_.DequeueBuffer(
+      [this, pressure](const BufferQueue::Buffer& buffer) {
+        return UploadPriority(buffer, pressure);
+      });
+  if (ptr_buffer && !IsHeaderId(ptr_buffer->id) &&
+      !IsAudioId(ptr_buffer->id)) {
+    Representation& rep = representations_[RepresentationId(ptr_buffer->id)];
+    rep.average_bytes = (rep.segments == 0) ? ptr_buffer->length() :
+        rep.average_bytes * (1 - kSegmentSizeWeight) +
+        ptr_buffer->length() * kSegmentSizeWeight;
+    ++rep.segments;
+  }
+  return ptr_buffer;
+}
+
+// The buffers after the first are passed to libcurl whole, which bypasses
+// |ReadCallback| and its pacing.
+bool HttpUploaderImpl::CoalescingEnabled() const {
+  return settings_.coalesce_bytes > 0 &&
+         settings_.post_mode == webmlive::HTTP_FORM_POST &&
+         pacer_.kbps() == 0 && UploadPacer::Instance()->kbps() == 0;
+}
+
+bool HttpUploaderImpl::HoldForCoalescing() {
+  if (!CoalescingEnabled() || settings_.coalesce_delay_ms == 0) {
+    return false;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (draining_) {
+      return false;
+    }
+  }
+  int buffers = 0;
+  int64 bytes = 0;
+  std::chrono::steady_clock::time_point oldest_time;
+  upload_queue_.ForEachBuffer(
+      [&buffers, &bytes, &oldest_time](const BufferQueue::Buffer& buffer) {
+        if (buffers++ == 0) {
+          oldest_time = buffer.queued_time;
+        }
+        bytes += buffer.length();
+      });
+  return buffers > 0 && buffers < HttpUploader::kMaxCoalescedBuffers &&
+         bytes < settings_.coalesce_bytes &&
+         std::chrono::steady_clock::now() - oldest_time <
+             std::chrono::milliseconds(settings_.coalesce_delay_ms);
+}
+
+void HttpUploaderImpl::CoalesceUploads(Transfer* ptr_transfer) {
+  int32 bytes = ptr_transfer->ptr_buffer->length();
+  const int32 max_bytes = settings_.coalesce_bytes;
+  while (static_cast<int>(ptr_transfer->batch.size()) + 1 <
+         HttpUploader::kMaxCoalescedBuffers) {
+    BufferQueue::Buffer* const ptr_next = upload_queue_.DequeueBufferIf(
+        [bytes, max_bytes](const BufferQueue::Buffer& buffer) {
+          return buffer.length() <= max_bytes - bytes;
+        });
+    if (!ptr_next) {
+      break;
+    }
+    bytes += ptr_next->length();
+    ptr_transfer->batch.push_back(ptr_next);
+  }
+  ptr_transfer->batch_bytes = bytes - ptr_transfer->ptr_buffer->length();
+  if (!ptr_transfer->batch.empty()) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++stats_.coalesced_requests;
+    stats_.coalesced_buffers += ptr_transfer->batch.size() + 1;
+  }
+}
+
+int HttpUploaderImpl::StreamWeight(const std::string& id) {
+  if (IsHeaderId(id)) {
+    return kHeaderStreamWeight;
+  }
+  if (IsAudioId(id)) {
+    return kAudioStreamWeight;
+  }
+  return kDefaultStreamWeight;
+}
+
+int HttpUploaderImpl::SetStreamWeight(Transfer* ptr_transfer,
+                                      const std::string& id) {
+#ifdef WEBMLIVE_CURL_HAS_HTTP2
+  if (settings_.http2) {
+    const CURLcode err = curl_easy_setopt(
+        ptr_transfer->ptr_curl, CURLOPT_STREAM_WEIGHT,
+        static_cast<long>(StreamWeight(id)));  // NOLINT
+    if (err != CURLE_OK) {
+      LOG_CURL_ERR(err, "setopt CURLOPT_STREAM_WEIGHT failed.");
+      return kLibCurlError;
+    }
+  }
+#else
+  (void)ptr_transfer;
+  (void)id;
+#endif
+  return kSuccess;
+}
+
+// Disable HTTP 100 responses (send empty Expect header), and add user HTTP
+// headers to |ptr_headers_|.
+void HttpUploaderImpl::BuildHeaders() {
+  // Tell libcurl to omit "Expect: 100-continue" from requests
+  ptr_headers_ = curl_slist_append(ptr_headers_, kExpectHeader);
+  if (settings_.post_mode == webmlive::HTTP_POST) {
+    // In form posts the video/webm mime-type is included in the form itself,
+    // but in plain old HTTP posts the Content-Type must be video/webm.
+    ptr_headers_ = curl_slist_append(ptr_headers_, kContentTypeHeader);
+  }
+  ptr_stream_headers_ = curl_slist_append(ptr_stream_headers_, kExpectHeader);
+  ptr_stream_headers_ =
+      curl_slist_append(ptr_stream_headers_, kContentTypeHeader);
+  ptr_stream_headers_ = curl_slist_append(ptr_stream_headers_, kChunkedHeader);
+  typedef std::map<std::string, std::string> StringMap;
+  StringMap::const_iterator header_iter = settings_.headers.begin();
+  // add user headers
+  for (; header_iter != settings_.headers.end(); ++header_iter) {
+    std::ostringstream header;
+    header << header_iter->first.c_str() << ":" << header_iter->second.c_str();
+    ptr_headers_ = curl_slist_append(ptr_headers_, header.str().c_str());
+    ptr_stream_headers_ =
+        curl_slist_append(ptr_stream_headers_, header.str().c_str());
+  }
+}
+
+// Sets necessary curl options for form based file upload, and adds the user
+// form variables. The file part is a stream read by |ReadCallback|, which
+// keeps libcurl from copying the buffer into the form.
+int HttpUploaderImpl::SetupFormPost(Transfer* ptr_transfer, int32 length) {
+  curl_httppost*& ptr_form = ptr_transfer->ptr_form;
+  curl_httppost*& ptr_form_end = ptr_transfer->ptr_form_end;
+  if (ptr_form) {
+    curl_formfree(ptr_form);
+    ptr_form = NULL;
+    ptr_form_end = NULL;
+  }
+  typedef std::map<std::string, std::string> StringMap;
+  StringMap::const_iterator var_iter = settings_.form_variables.begin();
   CURLFORMcode err;
   // add user form variables
   for (; var_iter != settings_.form_variables.end(); ++var_iter) {
-    err = curl_formadd(&ptr_form_, &ptr_form_end_,
+    err = curl_formadd(&ptr_form, &ptr_form_end,
                        CURLFORM_COPYNAME, var_iter->first.c_str(),
                        CURLFORM_COPYCONTENTS, var_iter->second.c_str(),
                        CURLFORM_END);
@@ -490,21 +1663,55 @@ int HttpUploaderImpl::SetupFormPost(const uint8* const ptr_buffer,
       return HttpUploader::kFormError;
     }
   }
+  // A coalesced request lists its buffers ahead of their parts.
+  const std::vector<BufferQueue::Buffer*>& batch = ptr_transfer->batch;
+  if (!batch.empty()) {
+    std::ostringstream index;
+    index << ptr_transfer->ptr_buffer->id << ":" << length;
+    for (size_t i = 0; i < batch.size(); ++i) {
+      index << "," << batch[i]->id << ":" << batch[i]->length();
+    }
+    err = curl_formadd(&ptr_form, &ptr_form_end,
+                       CURLFORM_COPYNAME, kBatchIndexName,
+                       CURLFORM_COPYCONTENTS, index.str().c_str(),
+                       CURLFORM_END);
+    if (err != CURL_FORMADD_OK) {
+      LOG_CURLFORM_ERR(err, "curl_formadd batch index failed.");
+      return HttpUploader::kFormError;
+    }
+  }
   // add buffer to form
-  err = curl_formadd(&ptr_form_, &ptr_form_end_,
+  err = curl_formadd(&ptr_form, &ptr_form_end,
                      CURLFORM_COPYNAME, kFormName,
-                     CURLFORM_BUFFER, local_file_name_.c_str(),
-                     CURLFORM_BUFFERPTR, ptr_buffer,
-                     CURLFORM_BUFFERLENGTH, length,
+                     CURLFORM_STREAM, reinterpret_cast<void*>(ptr_transfer),
+                     CURLFORM_CONTENTSLENGTH,
+                     static_cast<long>(length),  // NOLINT
+                     CURLFORM_FILENAME, local_file_name_.c_str(),
                      CURLFORM_CONTENTTYPE, kWebmMimeType,
                      CURLFORM_END);
   if (err != CURL_FORMADD_OK) {
-    LOG_CURLFORM_ERR(err, "curl_formadd CURLFORM_FILE failed.");
+    LOG_CURLFORM_ERR(err, "curl_formadd CURLFORM_STREAM failed.");
     return err;
   }
+  // The other buffers of the request are passed by pointer, without a copy;
+  // the slot owns them until the request ends.
+  for (size_t i = 0; i < batch.size(); ++i) {
+    err = curl_formadd(&ptr_form, &ptr_form_end,
+                       CURLFORM_COPYNAME, kFormName,
+                       CURLFORM_BUFFER, local_file_name_.c_str(),
+                       CURLFORM_BUFFERPTR, batch[i]->ptr_data(),
+                       CURLFORM_BUFFERLENGTH,
+                       static_cast<long>(batch[i]->length()),  // NOLINT
+                       CURLFORM_CONTENTTYPE, kWebmMimeType,
+                       CURLFORM_END);
+    if (err != CURL_FORMADD_OK) {
+      LOG_CURLFORM_ERR(err, "curl_formadd CURLFORM_BUFFERPTR failed.");
+      return err;
+    }
+  }
   // pass the form to libcurl
-  CURLcode err_setopt = curl_easy_setopt(ptr_curl_, CURLOPT_HTTPPOST,
-                                         ptr_form_);
+  CURLcode err_setopt = curl_easy_setopt(ptr_transfer->ptr_curl,
+                                         CURLOPT_HTTPPOST, ptr_form);
   if (err_setopt != CURLE_OK) {
     LOG_CURL_ERR(err_setopt, "setopt CURLOPT_HTTPPOST failed.");
     return err_setopt;
@@ -513,22 +1720,30 @@ int HttpUploaderImpl::SetupFormPost(const uint8* const ptr_buffer,
 }
 
 // Configures libcurl to POST data buffers as HTTP POST content-data.
-int HttpUploaderImpl::SetupPost(const uint8* const ptr_buffer, int32 length) {
-  CURLcode err_setopt = curl_easy_setopt(ptr_curl_, CURLOPT_POST, ptr_form_);
+int HttpUploaderImpl::SetupPost(Transfer* ptr_transfer, int32 length) {
+  CURL* const ptr_curl = ptr_transfer->ptr_curl;
+  // The easy handle may have last sent a PUT of a multipart upload.
+  CURLcode err_setopt = curl_easy_setopt(ptr_curl, CURLOPT_UPLOAD, 0L);
   if (err_setopt != CURLE_OK) {
-    LOG_CURL_ERR(err_setopt, "setopt CURLOPT_HTTPPOST failed.");
+    LOG_CURL_ERR(err_setopt, "setopt CURLOPT_UPLOAD failed.");
     return err_setopt;
   }
-  // Pass |ptr_buffer| to libcurl; it's used in the call to |curl_easy_perform|
-  err_setopt = curl_easy_setopt(ptr_curl_, CURLOPT_POSTFIELDS, ptr_buffer);
+  err_setopt = curl_easy_setopt(ptr_curl, CURLOPT_POST, 1L);
+  if (err_setopt != CURLE_OK) {
+    LOG_CURL_ERR(err_setopt, "setopt CURLOPT_POST failed.");
+    return err_setopt;
+  }
+  // Without post fields libcurl reads the body from |ReadCallback|, which
+  // copies it straight from the buffer being uploaded.
+  err_setopt = curl_easy_setopt(ptr_curl, CURLOPT_POSTFIELDS, NULL);
   if (err_setopt != CURLE_OK) {
     LOG_CURL_ERR(err_setopt, "setopt CURLOPT_POSTFIELDS failed.");
     return err_setopt;
   }
-  // Tell libcurl the size of |ptr_buffer|.  If libcurl is not informed of the
-  // size before the call to |curl_easy_perform|, it will use strlen to
-  // determine the length of the data.
-  err_setopt = curl_easy_setopt(ptr_curl_, CURLOPT_POSTFIELDSIZE, length);
+  // Tell libcurl the size of the body. Without it libcurl would send the body
+  // with chunked transfer encoding.
+  err_setopt = curl_easy_setopt(ptr_curl, CURLOPT_POSTFIELDSIZE,
+                                static_cast<long>(length));  // NOLINT
   if (err_setopt != CURLE_OK) {
     LOG_CURL_ERR(err_setopt, "setopt CURLOPT_POSTFIELDSIZE failed.");
     return err_setopt;
@@ -536,74 +1751,1066 @@ int HttpUploaderImpl::SetupPost(const uint8* const ptr_buffer, int32 length) {
   return kSuccess;
 }
 
-// Upload data using libcurl.
-int HttpUploaderImpl::Upload() {
-  if (!upload_buffer_.IsLocked()) {
-    LOG(INFO) << "woke with unlocked buffer, stopping.";
-    return kStopping;
+// Configures libcurl to PUT data buffers. Without an input file libcurl reads
+// the body from |ReadCallback|.
+int HttpUploaderImpl::SetupPut(Transfer* ptr_transfer, int32 length) {
+  CURL* const ptr_curl = ptr_transfer->ptr_curl;
+  CURLcode err_setopt = curl_easy_setopt(ptr_curl, CURLOPT_UPLOAD, 1L);
+  if (err_setopt != CURLE_OK) {
+    LOG_CURL_ERR(err_setopt, "setopt CURLOPT_UPLOAD failed.");
+    return err_setopt;
+  }
+  err_setopt = curl_easy_setopt(ptr_curl, CURLOPT_INFILESIZE_LARGE,
+                                static_cast<curl_off_t>(length));
+  if (err_setopt != CURLE_OK) {
+    LOG_CURL_ERR(err_setopt, "setopt CURLOPT_INFILESIZE_LARGE failed.");
+    return err_setopt;
+  }
+  return kSuccess;
+}
+
+std::string HttpUploaderImpl::ObjectUrl(const std::string& target_url,
+                                        const std::string& id,
+                                        const std::string& query) {
+  const size_t query_pos = target_url.find('?');
+  std::string url = target_url.substr(0, query_pos) + id;
+  std::string url_query = query;
+  if (query_pos != std::string::npos && query_pos + 1 < target_url.length()) {
+    if (!url_query.empty()) {
+      url_query += "&";
+    }
+    url_query += target_url.substr(query_pos + 1);
   }
+  if (!url_query.empty()) {
+    url += "?" + url_query;
+  }
+  return url;
+}
 
-  uint8* ptr_data = NULL;
-  int32 length = 0;
-  int status = upload_buffer_.GetBuffer(&ptr_data, &length);
-  if (status) {
-    LOG(ERROR) << "error, could not get buffer pointer, status=" << status;
+const std::string& HttpUploaderImpl::TransferId(const Transfer& transfer) {
+  if (transfer.ptr_buffer) {
+    return transfer.ptr_buffer->id;
+  }
+  if (transfer.multipart) {
+    return transfer.multipart->ptr_buffer->id;
+  }
+  return transfer.stream->id;
+}
+
+// Configures the request and adds the easy handle to |ptr_multi_|. The buffer
+// is owned by |ptr_transfer| until |EndTransfer|, even when this fails.
+int HttpUploaderImpl::StartTransfer(Transfer* ptr_transfer,
+                                    BufferQueue::Buffer* ptr_buffer) {
+  ptr_transfer->ptr_buffer = ptr_buffer;
+  const int32 offset = ptr_transfer->resume_offset;
+  const uint8* const ptr_data = ptr_buffer->ptr_data();
+  const int32 length = ptr_buffer->length();
+  if (!ptr_data || offset >= length) {
+    LOG(ERROR) << "error, empty upload buffer.";
     return HttpUploader::kRunFailed;
   }
 
-  LOG(INFO) << "upload buffer size=" << length;
-  CURLcode err = curl_easy_setopt(ptr_curl_, CURLOPT_URL,
-                                  settings_.target_url.c_str());
+  // A resumed upload describes the part of the buffer it sends.
+  curl_slist* ptr_headers = ptr_headers_;
+  if (offset > 0) {
+    curl_slist_free_all(ptr_transfer->ptr_range_headers);
+    ptr_transfer->ptr_range_headers = NULL;
+    for (curl_slist* ptr_header = ptr_headers_; ptr_header;
+         ptr_header = ptr_header->next) {
+      ptr_transfer->ptr_range_headers =
+          curl_slist_append(ptr_transfer->ptr_range_headers, ptr_header->data);
+    }
+    std::ostringstream range;
+    range << "Content-Range: bytes " << offset << "-" << length - 1 << "/"
+          << length;
+    ptr_transfer->ptr_range_headers = curl_slist_append(
+        ptr_transfer->ptr_range_headers, range.str().c_str());
+    ptr_headers = ptr_transfer->ptr_range_headers;
+  }
+
+  LOG(INFO) << "upload buffer size=" << length << " offset=" << offset;
+  if (!ptr_transfer->batch.empty()) {
+    LOG(INFO) << "coalesced with " << ptr_transfer->batch.size()
+              << " buffer(s) of " << ptr_transfer->batch_bytes << " bytes.";
+  }
+  ptr_transfer->target = active_target_;
+  const std::string& target_url = targets_[active_target_].url;
+  const std::string url = (settings_.post_mode == webmlive::HTTP_PUT) ?
+      ObjectUrl(target_url, ptr_buffer->id, std::string()) : target_url;
+  CURLcode err = curl_easy_setopt(ptr_transfer->ptr_curl, CURLOPT_URL,
+                                  url.c_str());
   if (err != CURLE_OK) {
     LOG_CURL_ERR(err, "could not pass URL to curl.");
     return HttpUploader::kUrlConfigError;
   }
 
+  // The easy handle may have last sent a stream, or a resumed upload.
+  err = curl_easy_setopt(ptr_transfer->ptr_curl, CURLOPT_HTTPHEADER,
+                         ptr_headers);
+  if (err != CURLE_OK) {
+    LOG_CURL_ERR(err, "setopt CURLOPT_HTTPHEADER failed.");
+    return HttpUploader::kHeaderError;
+  }
+
+  if (SetStreamWeight(ptr_transfer, ptr_buffer->id)) {
+    return kLibCurlError;
+  }
+
+  // |ReadCallback| starts at the resume offset; form posts always send the
+  // whole buffer.
+  ptr_transfer->read_pos = offset;
   if (settings_.post_mode == webmlive::HTTP_FORM_POST) {
-    if (SetupFormPost(ptr_data, length)) {
+    if (SetupFormPost(ptr_transfer, length)) {
       LOG(ERROR) << "SetupFormPost failed!";
       return HttpUploader::kRunFailed;
     }
+  } else if (settings_.post_mode == webmlive::HTTP_PUT) {
+    if (SetupPut(ptr_transfer, length - offset)) {
+      LOG(ERROR) << "SetupPut failed!";
+      return HttpUploader::kRunFailed;
+    }
   } else {
-    if (SetupPost(ptr_data, length)) {
+    if (SetupPost(ptr_transfer, length - offset)) {
       LOG(ERROR) << "SetupPost failed!";
       return HttpUploader::kRunFailed;
     }
   }
 
-  err = curl_easy_perform(ptr_curl_);
+  const CURLMcode multi_err =
+      curl_multi_add_handle(ptr_multi_, ptr_transfer->ptr_curl);
+  if (multi_err != CURLM_OK) {
+    LOG_CURLM_ERR(multi_err, "curl_multi_add_handle failed.");
+    return kLibCurlError;
+  }
+  ptr_transfer->in_multi = true;
+  ++active_transfers_;
+  if (ptr_transfer->retries == 0) {
+    RecordQueueDelay(ptr_buffer->queued_time);
+    for (size_t i = 0; i < ptr_transfer->batch.size(); ++i) {
+      RecordQueueDelay(ptr_transfer->batch[i]->queued_time);
+    }
+  }
+  WEBMLIVE_ETW_UPLOAD_BEGIN(ptr_buffer->id,
+                            length - offset + ptr_transfer->batch_bytes);
+  return kSuccess;
+}
+
+// Configures the stream request and adds the easy handle to |ptr_multi_|.
+// With no post fields set and a read callback installed, libcurl reads the
+// request body from |ReadCallback|; the chunked transfer encoding header in
+// |ptr_stream_headers_| lets it send the body without knowing its length.
+int HttpUploaderImpl::StartStreamTransfer(Transfer* ptr_transfer,
+                                          const SharedStream& stream) {
+  ptr_transfer->stream = stream;
+  ptr_transfer->target = active_target_;
+  CURL* const ptr_curl = ptr_transfer->ptr_curl;
+  const std::string& target_url = targets_[active_target_].url;
+  std::ostringstream url;
+  url << target_url
+      << (target_url.find('?') == std::string::npos ? "?" : "&")
+      << "chunk=" << stream->id;
+  CURLcode err = curl_easy_setopt(ptr_curl, CURLOPT_URL, url.str().c_str());
+  if (err != CURLE_OK) {
+    LOG_CURL_ERR(err, "could not pass URL to curl.");
+    return HttpUploader::kUrlConfigError;
+  }
+  err = curl_easy_setopt(ptr_curl, CURLOPT_HTTPHEADER, ptr_stream_headers_);
+  if (err != CURLE_OK) {
+    LOG_CURL_ERR(err, "setopt CURLOPT_HTTPHEADER failed.");
+    return HttpUploader::kHeaderError;
+  }
+  err = curl_easy_setopt(ptr_curl, CURLOPT_POST, 1L);
+  if (err != CURLE_OK) {
+    LOG_CURL_ERR(err, "setopt CURLOPT_POST failed.");
+    return HttpUploader::kStreamError;
+  }
+  err = curl_easy_setopt(ptr_curl, CURLOPT_POSTFIELDS, NULL);
   if (err != CURLE_OK) {
-    LOG_CURL_ERR(err, "curl_easy_perform failed.");
+    LOG_CURL_ERR(err, "setopt CURLOPT_POSTFIELDS failed.");
+    return HttpUploader::kStreamError;
+  }
+  err = curl_easy_setopt(ptr_curl, CURLOPT_POSTFIELDSIZE, -1L);
+  if (err != CURLE_OK) {
+    LOG_CURL_ERR(err, "setopt CURLOPT_POSTFIELDSIZE failed.");
+    return HttpUploader::kStreamError;
+  }
+  if (SetStreamWeight(ptr_transfer, stream->id)) {
+    return HttpUploader::kStreamError;
+  }
+
+  const CURLMcode multi_err = curl_multi_add_handle(ptr_multi_, ptr_curl);
+  if (multi_err != CURLM_OK) {
+    LOG_CURLM_ERR(multi_err, "curl_multi_add_handle failed.");
+    return kLibCurlError;
+  }
+  ptr_transfer->in_multi = true;
+  ++active_transfers_;
+  RecordQueueDelay(stream->queued_time);
+  WEBMLIVE_ETW_UPLOAD_BEGIN(stream->id, 0);
+  LOG(INFO) << "stream upload started: " << stream->id;
+  return kSuccess;
+}
+
+bool HttpUploaderImpl::UseMultipart(const BufferQueue::Buffer& buffer) const {
+  return settings_.post_mode == webmlive::HTTP_PUT &&
+         settings_.multipart_part_bytes > 0 &&
+         buffer.length() > settings_.multipart_part_bytes;
+}
+
+int HttpUploaderImpl::StartMultipartUpload(Transfer* ptr_transfer,
+                                           BufferQueue::Buffer* ptr_buffer) {
+  SharedMultipart upload(new (std::nothrow) MultipartUpload());  // NOLINT
+  if (!upload) {
+    LOG(ERROR) << "cannot construct MultipartUpload.";
+    upload_queue_.ReleaseBuffer(ptr_buffer);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (active_transfers_ == 0 && multipart_uploads_.empty()) {
+      upload_complete_ = true;
+    }
+    return HttpUploader::kRunFailed;
+  }
+  const int64 part_bytes = settings_.multipart_part_bytes;
+  upload->ptr_buffer = ptr_buffer;
+  upload->target = active_target_;
+  upload->num_parts =
+      static_cast<int>((ptr_buffer->length() + part_bytes - 1) / part_bytes);
+  upload->etags.resize(upload->num_parts);
+  multipart_uploads_.push_back(upload);
+  RecordQueueDelay(ptr_buffer->queued_time);
+  LOG(INFO) << "multipart upload of " << ptr_buffer->id << ", "
+            << ptr_buffer->length() << " bytes in " << upload->num_parts
+            << " parts.";
+
+  ptr_transfer->multipart = upload;
+  ptr_transfer->multipart_step = kMultipartInitiate;
+  const int status = StartMultipartTransfer(ptr_transfer);
+  if (status) {
+    FinishMultipartRequest(ptr_transfer, false);
+  }
+  return status;
+}
+
+// Parts are handed out in order, and the complete or abort request of an
+// upload only once none of its parts are in flight.
+bool HttpUploaderImpl::NextMultipartRequest(Transfer* ptr_transfer) {
+  for (size_t i = 0; i < multipart_uploads_.size(); ++i) {
+    const SharedMultipart& upload = multipart_uploads_[i];
+    if (!upload->initiated || upload->final_request) {
+      continue;
+    }
+    MultipartStep step = kMultipartNone;
+    if (upload->failed) {
+      if (upload->parts_in_flight == 0) {
+        step = kMultipartAbort;
+      }
+    } else if (upload->next_part < upload->num_parts) {
+      step = kMultipartPart;
+    } else if (upload->parts_done == upload->num_parts) {
+      step = kMultipartComplete;
+    }
+    if (step == kMultipartNone) {
+      continue;
+    }
+    ptr_transfer->multipart = upload;
+    ptr_transfer->multipart_step = step;
+    if (step == kMultipartPart) {
+      ptr_transfer->part_number = ++upload->next_part;
+      ++upload->parts_in_flight;
+    } else {
+      upload->final_request = true;
+    }
+    return true;
+  }
+  return false;
+}
+
+int HttpUploaderImpl::StartMultipartTransfer(Transfer* ptr_transfer) {
+  MultipartUpload& upload = *ptr_transfer->multipart;
+  const BufferQueue::Buffer& buffer = *upload.ptr_buffer;
+  const MultipartStep step = ptr_transfer->multipart_step;
+  ptr_transfer->ptr_body = NULL;
+  ptr_transfer->body_length = 0;
+  ptr_transfer->read_pos = 0;
+  ptr_transfer->response.clear();
+  ptr_transfer->etag.clear();
+
+  std::ostringstream query;
+  if (step == kMultipartInitiate) {
+    query << kInitiateMultipartQuery;
+  } else if (step == kMultipartPart) {
+    const int64 offset = static_cast<int64>(ptr_transfer->part_number - 1) *
+                         settings_.multipart_part_bytes;
+    query << "partNumber=" << ptr_transfer->part_number
+          << "&uploadId=" << upload.upload_id;
+    ptr_transfer->ptr_body = buffer.ptr_data() + offset;
+    ptr_transfer->body_length = static_cast<int32>(std::min(
+        static_cast<int64>(settings_.multipart_part_bytes),
+        buffer.length() - offset));
   } else {
-    int resp_code = 0;
-    curl_easy_getinfo(ptr_curl_, CURLINFO_RESPONSE_CODE, &resp_code);
-    LOG(INFO) << "server response code: " << resp_code;
+    query << "uploadId=" << upload.upload_id;
+    if (step == kMultipartComplete) {
+      std::ostringstream body;
+      body << "<CompleteMultipartUpload>";
+      for (int i = 0; i < upload.num_parts; ++i) {
+        body << "<Part><PartNumber>" << i + 1 << "</PartNumber><ETag>"
+             << upload.etags[i] << "</ETag></Part>";
+      }
+      body << "</CompleteMultipartUpload>";
+      upload.complete_body = body.str();
+      ptr_transfer->ptr_body =
+          reinterpret_cast<const uint8*>(upload.complete_body.data());
+      ptr_transfer->body_length =
+          static_cast<int32>(upload.complete_body.length());
+    }
   }
 
-  // Update total bytes uploaded.
-  double bytes_uploaded = 0;
-  err = curl_easy_getinfo(ptr_curl_, CURLINFO_SIZE_UPLOAD, &bytes_uploaded);
+  CURL* const ptr_curl = ptr_transfer->ptr_curl;
+  ptr_transfer->target = upload.target;
+  const std::string url =
+      ObjectUrl(targets_[upload.target].url, buffer.id, query.str());
+  CURLcode err = curl_easy_setopt(ptr_curl, CURLOPT_URL, url.c_str());
   if (err != CURLE_OK) {
-    LOG_CURL_ERR(err, "curl_easy_getinfo CURLINFO_SIZE_UPLOAD failed.");
-  } else {
+    LOG_CURL_ERR(err, "could not pass URL to curl.");
+    return HttpUploader::kUrlConfigError;
+  }
+  err = curl_easy_setopt(ptr_curl, CURLOPT_HTTPHEADER, ptr_headers_);
+  if (err != CURLE_OK) {
+    LOG_CURL_ERR(err, "setopt CURLOPT_HTTPHEADER failed.");
+    return HttpUploader::kHeaderError;
+  }
+  const int status = (step == kMultipartPart) ?
+      SetupPut(ptr_transfer, ptr_transfer->body_length) :
+      SetupPost(ptr_transfer, ptr_transfer->body_length);
+  if (status) {
+    LOG(ERROR) << "multipart request setup failed!";
+    return HttpUploader::kRunFailed;
+  }
+  if (step == kMultipartAbort) {
+    err = curl_easy_setopt(ptr_curl, CURLOPT_CUSTOMREQUEST, "DELETE");
+    if (err != CURLE_OK) {
+      LOG_CURL_ERR(err, "setopt CURLOPT_CUSTOMREQUEST failed.");
+      return kLibCurlError;
+    }
+  }
+  if (SetStreamWeight(ptr_transfer, buffer.id)) {
+    return kLibCurlError;
+  }
+
+  const CURLMcode multi_err = curl_multi_add_handle(ptr_multi_, ptr_curl);
+  if (multi_err != CURLM_OK) {
+    LOG_CURLM_ERR(multi_err, "curl_multi_add_handle failed.");
+    return kLibCurlError;
+  }
+  ptr_transfer->in_multi = true;
+  ++active_transfers_;
+  WEBMLIVE_ETW_UPLOAD_BEGIN(buffer.id, ptr_transfer->body_length);
+  VLOG(1) << "multipart request " << step << " of " << buffer.id
+          << " part=" << ptr_transfer->part_number;
+  return kSuccess;
+}
+
+void HttpUploaderImpl::FinishMultipartRequest(Transfer* ptr_transfer,
+                                              bool success) {
+  const SharedMultipart upload = ptr_transfer->multipart;
+  const std::string& id = upload->ptr_buffer->id;
+  const std::string& response = ptr_transfer->response;
+  bool done = false;
+  switch (ptr_transfer->multipart_step) {
+    case kMultipartInitiate: {
+      const size_t start = response.find(kUploadIdStart);
+      const size_t end = response.find(kUploadIdEnd);
+      const size_t id_pos = start + strlen(kUploadIdStart);
+      char* ptr_upload_id = NULL;
+      if (success && start != std::string::npos &&
+          end != std::string::npos && end > id_pos) {
+        ptr_upload_id = curl_easy_escape(ptr_transfer->ptr_curl,
+                                         response.data() + id_pos,
+                                         static_cast<int>(end - id_pos));
+      }
+      if (ptr_upload_id) {
+        upload->upload_id = ptr_upload_id;
+        upload->initiated = true;
+        curl_free(ptr_upload_id);
+      } else {
+        // There is nothing to abort.
+        LOG(ERROR) << "multipart upload initiate failed: " << id;
+        upload->failed = true;
+        done = true;
+      }
+      break;
+    }
+    case kMultipartPart:
+      --upload->parts_in_flight;
+      if (success && !ptr_transfer->etag.empty()) {
+        upload->etags[ptr_transfer->part_number - 1] = ptr_transfer->etag;
+        ++upload->parts_done;
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++stats_.multipart_parts;
+      } else {
+        LOG(ERROR) << "multipart upload part " << ptr_transfer->part_number
+                   << " failed: " << id;
+        upload->failed = true;
+      }
+      break;
+    case kMultipartComplete:
+      // The service may report an error in the body of a 200 response.
+      if (!success || response.find(kResponseError) != std::string::npos) {
+        LOG(ERROR) << "multipart upload complete failed: " << id;
+        upload->failed = true;
+        upload->final_request = false;
+      } else {
+        LOG(INFO) << "multipart upload complete: " << id;
+        done = true;
+      }
+      break;
+    case kMultipartAbort:
+      if (!success) {
+        LOG(WARNING) << "multipart upload abort failed: " << id;
+      }
+      done = true;
+      break;
+    default:
+      break;
+  }
+  if (done) {
+    multipart_uploads_.erase(std::find(multipart_uploads_.begin(),
+                                       multipart_uploads_.end(), upload));
     std::lock_guard<std::mutex> lock(mutex_);
-    stats_.bytes_sent_current = 0;
-    stats_.total_bytes_uploaded += static_cast<int64>(bytes_uploaded);
+    if (upload->failed) {
+      ++stats_.multipart_failures;
+    } else {
+      ++stats_.multipart_uploads;
+    }
+  }
+  EndTransfer(ptr_transfer);
+  if (done) {
+    upload_queue_.ReleaseBuffer(upload->ptr_buffer);
   }
+}
+
+void HttpUploaderImpl::ReleaseMultipartUploads() {
+  while (!multipart_uploads_.empty()) {
+    upload_queue_.ReleaseBuffer(multipart_uploads_.front()->ptr_buffer);
+    multipart_uploads_.pop_front();
+  }
+}
 
+int HttpUploaderImpl::StartWarmTransfer(Transfer* ptr_transfer,
+                                        size_t target) {
+  CURL* const ptr_curl = ptr_transfer->ptr_curl;
+  ptr_transfer->warming = true;
+  ptr_transfer->target = target;
+  CURLcode err = curl_easy_setopt(ptr_curl, CURLOPT_URL,
+                                  targets_[target].url.c_str());
+  if (err != CURLE_OK) {
+    LOG_CURL_ERR(err, "could not pass URL to curl.");
+    return HttpUploader::kUrlConfigError;
+  }
+  err = curl_easy_setopt(ptr_curl, CURLOPT_HTTPHEADER, ptr_headers_);
+  if (err != CURLE_OK) {
+    LOG_CURL_ERR(err, "setopt CURLOPT_HTTPHEADER failed.");
+    return HttpUploader::kHeaderError;
+  }
+  err = curl_easy_setopt(ptr_curl, CURLOPT_UPLOAD, 0L);
+  if (err != CURLE_OK) {
+    LOG_CURL_ERR(err, "setopt CURLOPT_UPLOAD failed.");
+    return kLibCurlError;
+  }
+  err = curl_easy_setopt(ptr_curl, CURLOPT_NOBODY, 1L);
+  if (err != CURLE_OK) {
+    LOG_CURL_ERR(err, "setopt CURLOPT_NOBODY failed.");
+    return kLibCurlError;
+  }
+  const CURLMcode multi_err = curl_multi_add_handle(ptr_multi_, ptr_curl);
+  if (multi_err != CURLM_OK) {
+    LOG_CURLM_ERR(multi_err, "curl_multi_add_handle failed.");
+    return kLibCurlError;
+  }
+  ptr_transfer->in_multi = true;
+  ++active_transfers_;
   return kSuccess;
 }
 
+void HttpUploaderImpl::WarmConnections(int count) {
+  for (size_t i = 0; count > 0 && i < transfers_.size(); ++i) {
+    Transfer& transfer = transfers_[i];
+    if (transfer.busy()) {
+      continue;
+    }
+    const int status = StartWarmTransfer(&transfer, active_target_);
+    if (status) {
+      LOG(ERROR) << "connection warm-up failed, status=" << status;
+      EndTransfer(&transfer);
+    }
+    --count;
+  }
+}
+
+// |curl_easy_pause| may call |ReadCallback|, which locks |mutex_|, so the
+// lock is released before each transfer is resumed.
+void HttpUploaderImpl::ResumeStreamTransfers() {
+  for (size_t i = 0; i < transfers_.size(); ++i) {
+    Transfer& transfer = transfers_[i];
+    bool resume = false;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (transfer.stream && transfer.paused &&
+          (transfer.stream->ended ||
+           transfer.stream->read_pos < transfer.stream->data.size())) {
+        transfer.paused = false;
+        resume = true;
+      }
+    }
+    if (resume) {
+      const CURLcode err = curl_easy_pause(transfer.ptr_curl, CURLPAUSE_CONT);
+      if (err != CURLE_OK) {
+        LOG_CURL_ERR(err, "curl_easy_pause failed.");
+      }
+    }
+  }
+}
+
+size_t HttpUploaderImpl::PaceRead(Transfer* ptr_transfer, size_t length) {
+  const int64 taken = pacer_.Take(length);
+  const int64 granted = UploadPacer::Instance()->Take(taken);
+  pacer_.Return(taken - granted);
+  if (granted == 0) {
+    ptr_transfer->pacing_paused = true;
+  }
+  return static_cast<size_t>(granted);
+}
+
+// Paced uploads wait for a read's worth of tokens, instead of resuming for
+// the first byte.
+void HttpUploaderImpl::ResumePacedTransfers() {
+  for (size_t i = 0; i < transfers_.size(); ++i) {
+    Transfer& transfer = transfers_[i];
+    if (!transfer.pacing_paused ||
+        !pacer_.Available(kPacingResumeBytes) ||
+        !UploadPacer::Instance()->Available(kPacingResumeBytes)) {
+      continue;
+    }
+    transfer.pacing_paused = false;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ++stats_.pacing_waits;
+    }
+    // |curl_easy_pause| may call |ReadCallback|, which locks |mutex_|.
+    const CURLcode err = curl_easy_pause(transfer.ptr_curl, CURLPAUSE_CONT);
+    if (err != CURLE_OK) {
+      LOG_CURL_ERR(err, "curl_easy_pause failed.");
+    }
+  }
+}
+
+void HttpUploaderImpl::RecordTargetResult(Transfer* ptr_transfer,
+                                          bool success, double seconds) {
+  if (targets_.size() < 2) {
+    return;
+  }
+  // Streams last as long as the chunk takes to produce, and multipart
+  // requests each send a part of an object.
+  const bool slow = !ptr_transfer->stream && !ptr_transfer->multipart &&
+                    seconds * 1000 > settings_.failover_latency_ms;
+  IngestTarget& target = targets_[ptr_transfer->target];
+  target.health = target.health * (1 - kTargetHealthWeight) +
+                  ((success && !slow) ? kTargetHealthWeight : 0);
+  target.failures = success ? 0 : target.failures + 1;
+  if (ptr_transfer->target != active_target_ ||
+      (target.failures < settings_.failover_errors &&
+       target.health >= kMinTargetHealth)) {
+    return;
+  }
+  LOG(WARNING) << "ingest target " << active_target_ << " unhealthy, "
+               << target.failures << " failure(s) in a row, health "
+               << target.health;
+
+  // The healthiest other target, the first of those equally healthy.
+  size_t next = active_target_;
+  for (size_t i = 0; i < targets_.size(); ++i) {
+    if (i == active_target_) {
+      continue;
+    }
+    if (next == active_target_ || targets_[i].health > targets_[next].health) {
+      next = i;
+    }
+  }
+  SwitchTarget(next, ptr_transfer);
+}
+
+void HttpUploaderImpl::RecordProbeResult(bool success) {
+  IngestTarget& primary = targets_[0];
+  primary.good_probes = success ? primary.good_probes + 1 : 0;
+  VLOG(1) << "primary ingest probe " << (success ? "good" : "failed")
+          << ", " << primary.good_probes << " good in a row.";
+  if (active_target_ != 0 && primary.good_probes >= kProbesToFailBack) {
+    LOG(INFO) << "primary ingest target recovered.";
+    SwitchTarget(0, NULL);
+  }
+}
+
+void HttpUploaderImpl::ProbePrimaryTarget() {
+  if (active_target_ == 0) {
+    return;
+  }
+  const std::chrono::steady_clock::time_point now =
+      std::chrono::steady_clock::now();
+  if (now < next_probe_time_) {
+    return;
+  }
+  for (size_t i = 0; i < transfers_.size(); ++i) {
+    Transfer& transfer = transfers_[i];
+    if (transfer.busy() || transfer.retry_pending) {
+      continue;
+    }
+    next_probe_time_ =
+        now + std::chrono::milliseconds(settings_.failover_probe_ms);
+    transfer.probing = true;
+    const int status = StartWarmTransfer(&transfer, 0);
+    if (status) {
+      LOG(ERROR) << "primary ingest probe failed, status=" << status;
+      EndTransfer(&transfer);
+    }
+    return;
+  }
+}
+
+// The new target has not seen the uploads of the old one: they start over
+// at once, with their retries reset.
+void HttpUploaderImpl::SwitchTarget(size_t target, Transfer* ptr_done) {
+  LOG(WARNING) << "switching uploads from ingest target " << active_target_
+               << " to " << target << ": " << targets_[target].url;
+  active_target_ = target;
+  targets_[target].health = 1;
+  targets_[target].failures = 0;
+  targets_[0].good_probes = 0;
+  next_probe_time_ = std::chrono::steady_clock::now() +
+                     std::chrono::milliseconds(settings_.failover_probe_ms);
+
+  int64 replayed = 0;
+  for (size_t i = 0; i < transfers_.size(); ++i) {
+    Transfer& transfer = transfers_[i];
+    if (&transfer == ptr_done || !transfer.ptr_buffer ||
+        transfer.target == target) {
+      continue;
+    }
+    if (transfer.in_multi) {
+      const CURLMcode err =
+          curl_multi_remove_handle(ptr_multi_, transfer.ptr_curl);
+      if (err != CURLM_OK) {
+        LOG_CURLM_ERR(err, "curl_multi_remove_handle failed.");
+      }
+      transfer.in_multi = false;
+      --active_transfers_;
+      std::lock_guard<std::mutex> lock(mutex_);
+      stats_.bytes_sent_current -= static_cast<int64>(transfer.bytes_sent);
+      transfer.bytes_sent = 0;
+    }
+    if (!transfer.retry_pending) {
+      transfer.retry_pending = true;
+      ++retrying_transfers_;
+    }
+    transfer.pacing_paused = false;
+    transfer.retries = 0;
+    transfer.resume_offset = 0;
+    transfer.retry_time = std::chrono::steady_clock::now();
+    ++replayed;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (std::map<std::string, HeaderCopy>::const_iterator iter =
+           header_copies_.begin();
+       iter != header_copies_.end(); ++iter) {
+    const HeaderCopy& copy = iter->second;
+    bool queued = false;
+    if (copy.chunk) {
+      queued = replay_queue_.EnqueueChunk(copy.chunk);
+    } else if (!copy.data.empty()) {
+      queued = replay_queue_.EnqueueBuffer(
+          iter->first, &copy.data[0], static_cast<int>(copy.data.size()));
+    }
+    if (queued) {
+      ++replayed;
+    }
+  }
+  upload_complete_ = false;
+  ++stats_.failovers;
+  stats_.active_target = static_cast<int32>(target);
+  stats_.replayed_uploads += replayed;
+}
+
+int HttpUploaderImpl::StartQueuedTransfers() {
+  const std::chrono::steady_clock::time_point now =
+      std::chrono::steady_clock::now();
+  coalesce_hold_ = false;
+  for (size_t i = 0; i < transfers_.size(); ++i) {
+    Transfer& transfer = transfers_[i];
+    if (transfer.retry_pending) {
+      if (now >= transfer.retry_time) {
+        transfer.retry_pending = false;
+        --retrying_transfers_;
+        const int status = transfer.multipart ?
+            StartMultipartTransfer(&transfer) :
+            StartTransfer(&transfer, transfer.ptr_buffer);
+        if (status) {
+          LOG(ERROR) << "buffer upload retry failed, status=" << status;
+          if (transfer.multipart) {
+            FinishMultipartRequest(&transfer, false);
+          } else {
+            EndTransfer(&transfer);
+          }
+        }
+      }
+      continue;
+    }
+    if (transfer.busy()) {
+      continue;
+    }
+
+    // Header copies replayed after a failover go before the media that
+    // needs them.
+    BufferQueue::Buffer* const ptr_replay = replay_queue_.DequeueBuffer();
+    if (ptr_replay) {
+      transfer.replay = true;
+      const int status = StartTransfer(&transfer, ptr_replay);
+      if (status) {
+        LOG(ERROR) << "header replay failed, status=" << status;
+        EndTransfer(&transfer);
+      }
+      continue;
+    }
+
+    // Streams go first: they are being produced in real time.
+    SharedStream stream;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!pending_streams_.empty()) {
+        stream = pending_streams_.front();
+        pending_streams_.pop_front();
+        --queued_streams_;
+        upload_complete_ = false;
+      }
+    }
+    if (stream) {
+      const int status = StartStreamTransfer(&transfer, stream);
+      if (status) {
+        LOG(ERROR) << "stream upload failed, status=" << status;
+        EndTransfer(&transfer);
+      }
+      continue;
+    }
+
+    // Then the parts of objects already started, which complete them sooner
+    // than starting more objects would.
+    if (NextMultipartRequest(&transfer)) {
+      const int status = StartMultipartTransfer(&transfer);
+      if (status) {
+        LOG(ERROR) << "multipart request failed, status=" << status;
+        FinishMultipartRequest(&transfer, false);
+      }
+      continue;
+    }
+
+    if (HoldForCoalescing()) {
+      coalesce_hold_ = true;
+      break;
+    }
+    BufferQueue::Buffer* const ptr_buffer = DequeueUpload();
+    if (!ptr_buffer) {
+      // |upload_queue_| is empty; try again on the next pass.
+      break;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      upload_complete_ = false;
+    }
+    if (UseMultipart(*ptr_buffer)) {
+      const int status = StartMultipartUpload(&transfer, ptr_buffer);
+      if (status) {
+        LOG(ERROR) << "multipart upload failed, status=" << status;
+      }
+      continue;
+    }
+    if (CoalescingEnabled() &&
+        ptr_buffer->length() <= settings_.coalesce_bytes) {
+      transfer.ptr_buffer = ptr_buffer;
+      CoalesceUploads(&transfer);
+    }
+    const int status = StartTransfer(&transfer, ptr_buffer);
+    if (status) {
+      LOG(ERROR) << "buffer upload failed, status=" << status;
+      // TODO(tomfinegan): Report upload failure, and provide access to
+      //                   response code and data.
+      EndTransfer(&transfer);
+    }
+  }
+  return active_transfers_ + retrying_transfers_;
+}
+
+void HttpUploaderImpl::FinishTransfers() {
+  int messages_left = 0;
+  CURLMsg* ptr_msg = NULL;
+  while ((ptr_msg = curl_multi_info_read(ptr_multi_, &messages_left))) {
+    if (ptr_msg->msg != CURLMSG_DONE) {
+      continue;
+    }
+    Transfer* ptr_transfer = NULL;
+    for (size_t i = 0; i < transfers_.size(); ++i) {
+      if (transfers_[i].ptr_curl == ptr_msg->easy_handle) {
+        ptr_transfer = &transfers_[i];
+        break;
+      }
+    }
+    if (!ptr_transfer) {
+      LOG(ERROR) << "completion message for unknown easy handle.";
+      continue;
+    }
+
+    CURL* const ptr_curl = ptr_transfer->ptr_curl;
+    const CURLcode result = ptr_msg->data.result;
+    if (ptr_transfer->warming) {
+      // The response does not matter: the connection stays in the cache.
+      double connect_time = 0;
+      curl_easy_getinfo(ptr_curl, CURLINFO_APPCONNECT_TIME, &connect_time);
+      if (connect_time == 0) {
+        curl_easy_getinfo(ptr_curl, CURLINFO_CONNECT_TIME, &connect_time);
+      }
+      if (ptr_transfer->probing) {
+        long probe_code = 0;  // NOLINT
+        curl_easy_getinfo(ptr_curl, CURLINFO_RESPONSE_CODE, &probe_code);
+        double total_time = 0;
+        curl_easy_getinfo(ptr_curl, CURLINFO_TOTAL_TIME, &total_time);
+        EndTransfer(ptr_transfer);
+        RecordProbeResult(result == CURLE_OK && probe_code < 500 &&
+                          total_time * 1000 < settings_.failover_latency_ms);
+        continue;
+      }
+      if (result != CURLE_OK) {
+        LOG_CURL_ERR(result, "connection warm-up failed.");
+      } else {
+        LOG(INFO) << "connection warmed, setup took "
+                  << static_cast<int>(connect_time * 1000) << " ms.";
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++stats_.connections_warmed;
+      }
+      EndTransfer(ptr_transfer);
+      continue;
+    }
+
+    long resp_code = 0;  // NOLINT
+    if (result != CURLE_OK) {
+      LOG_CURL_ERR(result, "upload failed.");
+    } else {
+      curl_easy_getinfo(ptr_curl, CURLINFO_RESPONSE_CODE, &resp_code);
+      LOG(INFO) << "server response code: " << resp_code;
+    }
+
+    // Update total bytes uploaded.
+    double bytes_uploaded = 0;
+    const CURLcode err =
+        curl_easy_getinfo(ptr_curl, CURLINFO_SIZE_UPLOAD, &bytes_uploaded);
+    if (err != CURLE_OK) {
+      LOG_CURL_ERR(err, "curl_easy_getinfo CURLINFO_SIZE_UPLOAD failed.");
+    } else {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stats_.bytes_sent_current -= static_cast<int64>(ptr_transfer->bytes_sent);
+      stats_.total_bytes_uploaded += static_cast<int64>(bytes_uploaded);
+    }
+    if (result == CURLE_OK) {
+      RecordRequestTiming(ptr_curl, bytes_uploaded);
+    }
+    WEBMLIVE_ETW_UPLOAD_END(TransferId(*ptr_transfer),
+                            static_cast<int64>(bytes_uploaded), result,
+                            resp_code);
+    double total_time = 0;
+    curl_easy_getinfo(ptr_curl, CURLINFO_TOTAL_TIME, &total_time);
+    RecordTargetResult(ptr_transfer, result == CURLE_OK && resp_code >= 200 &&
+                       resp_code < 300, total_time);
+    if (!ScheduleRetry(ptr_transfer, result, resp_code, bytes_uploaded)) {
+      if (ptr_transfer->multipart) {
+        FinishMultipartRequest(ptr_transfer, result == CURLE_OK &&
+                               resp_code >= 200 && resp_code < 300);
+      } else {
+        EndTransfer(ptr_transfer);
+      }
+    }
+
+    // Replace the connection the failed request may have lost, so that the
+    // retry or the next upload finds one open.
+    if (result != CURLE_OK && settings_.warm_connections > 0 &&
+        !StopRequested()) {
+      WarmConnections(1);
+    }
+  }
+}
+
+bool HttpUploaderImpl::ScheduleRetry(Transfer* ptr_transfer, CURLcode result,
+                                     long response_code,  // NOLINT
+                                     double bytes_uploaded) {
+  // Streams cannot be retried: their data is discarded once sent.
+  BufferQueue::Buffer* const ptr_buffer = ptr_transfer->ptr_buffer;
+  const bool failed = result != CURLE_OK || response_code >= 500 ||
+                      response_code == kRangeNotSatisfiable;
+
+  // A buffer whose target failed over starts over on the new one, with its
+  // retries reset.
+  const bool moved = ptr_buffer && ptr_transfer->target != active_target_;
+  if ((!ptr_buffer && !ptr_transfer->multipart) || !failed ||
+      (!moved && ptr_transfer->retries >= settings_.max_retries) ||
+      StopRequested()) {
+    return false;
+  }
+  if (moved) {
+    ptr_transfer->retries = 0;
+    ptr_transfer->resume_offset = 0;
+  }
+
+  // Only a request cut off by a connection error resumes; a server that
+  // answered has seen the whole request. libcurl counts bytes passed to the
+  // socket, so a server unable to pick up at the offset answers 416.
+  // Multipart requests start over.
+  int32 offset = 0;
+  if (ptr_buffer && !moved && result != CURLE_OK &&
+      settings_.post_mode == webmlive::HTTP_POST &&
+      ptr_buffer->length() >= HttpUploader::kBytesRequiredForResume) {
+    offset = std::min(
+        ptr_transfer->resume_offset + static_cast<int32>(bytes_uploaded),
+        ptr_buffer->length() - 1);
+  }
+
+  const CURLMcode err =
+      curl_multi_remove_handle(ptr_multi_, ptr_transfer->ptr_curl);
+  if (err != CURLM_OK) {
+    LOG_CURLM_ERR(err, "curl_multi_remove_handle failed.");
+  }
+  ptr_transfer->in_multi = false;
+  --active_transfers_;
+
+  const int delay = moved ? 0 : std::min(kRetryDelay << ptr_transfer->retries,
+                                         kMaxRetryDelay);
+  ++ptr_transfer->retries;
+  ptr_transfer->resume_offset = offset;
+  ptr_transfer->retry_pending = true;
+  ptr_transfer->retry_time =
+      std::chrono::steady_clock::now() + std::chrono::milliseconds(delay);
+  ++retrying_transfers_;
+  LOG(WARNING) << "retrying upload " << TransferId(*ptr_transfer) << " in "
+               << delay
+               << "ms, attempt " << ptr_transfer->retries << " of "
+               << settings_.max_retries << ", offset " << offset;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  ptr_transfer->bytes_sent = 0;
+  ++stats_.upload_retries;
+  if (offset > 0) {
+    ++stats_.resumed_uploads;
+  }
+  if (moved) {
+    ++stats_.replayed_uploads;
+  }
+  return true;
+}
+
+// Removes the easy handle from |ptr_multi_| when it was added, and returns the
+// buffer to |upload_queue_|. The easy handle itself is kept for reuse.
+void HttpUploaderImpl::EndTransfer(Transfer* ptr_transfer) {
+  if (!ptr_transfer->busy()) {
+    return;
+  }
+  if (ptr_transfer->in_multi) {
+    const CURLMcode err =
+        curl_multi_remove_handle(ptr_multi_, ptr_transfer->ptr_curl);
+    if (err != CURLM_OK) {
+      LOG_CURLM_ERR(err, "curl_multi_remove_handle failed.");
+    }
+    ptr_transfer->in_multi = false;
+    --active_transfers_;
+  }
+  if (ptr_transfer->ptr_buffer) {
+    BufferQueue& queue =
+        ptr_transfer->replay ? replay_queue_ : upload_queue_;
+    queue.ReleaseBuffer(ptr_transfer->ptr_buffer);
+  }
+  for (size_t i = 0; i < ptr_transfer->batch.size(); ++i) {
+    upload_queue_.ReleaseBuffer(ptr_transfer->batch[i]);
+  }
+  ptr_transfer->batch.clear();
+  ptr_transfer->batch_bytes = 0;
+  ptr_transfer->replay = false;
+  if (ptr_transfer->retry_pending) {
+    --retrying_transfers_;
+  }
+  ptr_transfer->retries = 0;
+  ptr_transfer->resume_offset = 0;
+  ptr_transfer->retry_pending = false;
+  ptr_transfer->pacing_paused = false;
+  if (ptr_transfer->warming) {
+    // Later requests send a body.
+    curl_easy_setopt(ptr_transfer->ptr_curl, CURLOPT_NOBODY, 0L);
+    ptr_transfer->warming = false;
+    ptr_transfer->probing = false;
+  }
+  if (ptr_transfer->multipart_step == kMultipartAbort) {
+    // Later requests use the method their options select.
+    curl_easy_setopt(ptr_transfer->ptr_curl, CURLOPT_CUSTOMREQUEST, NULL);
+  }
+  ptr_transfer->multipart.reset();
+  ptr_transfer->multipart_step = kMultipartNone;
+  ptr_transfer->part_number = 0;
+  ptr_transfer->ptr_body = NULL;
+  ptr_transfer->body_length = 0;
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (ptr_transfer->stream) {
+    // Writes to a stream whose upload ended early fail.
+    Stream& stream = *ptr_transfer->stream;
+    if (!stream.ended || stream.read_pos < stream.data.size()) {
+      LOG(ERROR) << "stream upload ended early: " << stream.id;
+      stream.failed = true;
+    }
+    ptr_transfer->stream.reset();
+    ptr_transfer->paused = false;
+  }
+  ptr_transfer->ptr_buffer = NULL;
+  ptr_transfer->bytes_sent = 0;
+  if (active_transfers_ == 0 && multipart_uploads_.empty()) {
+    upload_complete_ = true;
+  }
+}
+
 // Idle the upload thread while awaiting user data.
 int HttpUploaderImpl::WaitForUserData() {
   std::unique_lock<std::mutex> lock(mutex_);
-  buffer_ready_.wait(lock);  // Unlock |mutex_| and idle the thread while we
-                             // wait for the next chunk of user data.
-  return kSuccess;
+  // Unlock |mutex_| and idle the thread while we wait for the next chunk of
+  // user data.
+  buffer_ready_.wait(lock, [this] {
+    return stop_ || draining_ || !upload_queue_.IsEmpty() ||
+           !replay_queue_.IsEmpty() || !pending_streams_.empty();
+  });
+  if (draining_ && !stop_) {
+    // Streams still open may produce more data; wait for it, or for them to
+    // end, until the drain deadline.
+    const std::function<bool()> drained = [this] {
+      return stop_ || open_streams_.empty() || !upload_queue_.IsEmpty() ||
+             !pending_streams_.empty();
+    };
+    bool ready = true;
+    if (has_drain_deadline_) {
+      ready = buffer_ready_.wait_until(lock, drain_deadline_, drained);
+    } else {
+      buffer_ready_.wait(lock, drained);
+    }
+    if (!ready) {
+      LOG(WARNING) << "upload drain deadline passed with open streams.";
+      stop_ = true;
+    }
+  }
+  const bool idle = upload_queue_.IsEmpty() && replay_queue_.IsEmpty() &&
+                    pending_streams_.empty();
+  return (stop_ || (draining_ && idle)) ? kStopping : kSuccess;
 }
 
 // Handle libcurl progress updates.
-int HttpUploaderImpl::ProgressCallback(void* ptr_this,
+int HttpUploaderImpl::ProgressCallback(void* ptr_transfer,
                                        double download_total,
                                        double download_current,
                                        double upload_total,
@@ -611,20 +2818,27 @@ int HttpUploaderImpl::ProgressCallback(void* ptr_this,
   // Ignore the download progress variables.
   download_total;
   download_current;
-  HttpUploaderImpl* ptr_uploader_ =
-    reinterpret_cast<HttpUploaderImpl*>(ptr_this);
+  Transfer* const ptr_xfer = reinterpret_cast<Transfer*>(ptr_transfer);
+  HttpUploaderImpl* ptr_uploader_ = ptr_xfer->ptr_uploader;
   if (ptr_uploader_->StopRequested()) {
     LOG(ERROR) << "stop requested.";
     return kProgressCallbackStopRequest;
   }
   std::lock_guard<std::mutex> lock(ptr_uploader_->mutex_);
   HttpUploaderStats& stats = ptr_uploader_->stats_;
-  stats.bytes_sent_current = static_cast<int64>(upload_current);
-  double ticks_elapsed = clock() - ptr_uploader_->start_ticks_;
-  double ticks_per_sec = CLOCKS_PER_SEC;
-  stats.bytes_per_second =
-      (upload_current + stats.total_bytes_uploaded) /
-      (ticks_elapsed / ticks_per_sec);
+
+  // |bytes_sent_current| is the sum of bytes sent by all requests in flight.
+  stats.bytes_sent_current +=
+      static_cast<int64>(upload_current) -
+      static_cast<int64>(ptr_xfer->bytes_sent);
+  ptr_xfer->bytes_sent = upload_current;
+  const double seconds_elapsed = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - ptr_uploader_->start_time_).count();
+  if (seconds_elapsed > 0) {
+    stats.bytes_per_second =
+        (stats.bytes_sent_current + stats.total_bytes_uploaded) /
+        seconds_elapsed;
+  }
   VLOG(4) << "total=" << static_cast<int>(upload_total) << " bytes_per_sec="
           << static_cast<int>(stats.bytes_per_second);
   return 0;
@@ -633,57 +2847,251 @@ int HttpUploaderImpl::ProgressCallback(void* ptr_this,
 // Handle HTTP response data.
 size_t HttpUploaderImpl::WriteCallback(char* buffer, size_t size,
                                        size_t nitems,
-                                       void* ptr_this) {
+                                       void* ptr_transfer) {
   VLOG(4) << "size=" << size << " nitems=" << nitems;
   // TODO(tomfinegan): store response data for users
   std::string tmp;
   tmp.assign(buffer, size*nitems);
   LOG(INFO) << "from server:\n" << tmp.c_str();
-  HttpUploaderImpl* ptr_uploader_ =
-    reinterpret_cast<HttpUploaderImpl*>(ptr_this);
+  Transfer* const ptr_xfer = reinterpret_cast<Transfer*>(ptr_transfer);
+  HttpUploaderImpl* ptr_uploader_ = ptr_xfer->ptr_uploader;
   if (ptr_uploader_->StopRequested()) {
     LOG(INFO) << "stop requested.";
     return kWriteCallbackStopRequest;
   }
+  if (ptr_xfer->multipart &&
+      ptr_xfer->response.length() < kMaxMultipartResponse) {
+    ptr_xfer->response.append(
+        buffer, std::min(size * nitems,
+                         kMaxMultipartResponse - ptr_xfer->response.length()));
+  }
   return size*nitems;
 }
 
+// Header names are matched without regard to case.
+size_t HttpUploaderImpl::HeaderCallback(char* buffer, size_t size,
+                                        size_t nitems,
+                                        void* ptr_transfer) {
+  const size_t length = size * nitems;
+  Transfer* const ptr_xfer = reinterpret_cast<Transfer*>(ptr_transfer);
+  const size_t name_length = strlen(kETagHeader);
+  if (!ptr_xfer->multipart || length <= name_length) {
+    return length;
+  }
+  for (size_t i = 0; i < name_length; ++i) {
+    if (tolower(static_cast<unsigned char>(buffer[i])) != kETagHeader[i]) {
+      return length;
+    }
+  }
+  const char* const kWhitespace = " \t\r\n";
+  const std::string value(buffer + name_length, length - name_length);
+  const size_t first = value.find_first_not_of(kWhitespace);
+  if (first != std::string::npos) {
+    const size_t last = value.find_last_not_of(kWhitespace);
+    ptr_xfer->etag = value.substr(first, last - first + 1);
+  }
+  return length;
+}
+
+// Feed buffer and stream data to libcurl.
+size_t HttpUploaderImpl::ReadCallback(char* buffer, size_t size,
+                                      size_t nitems,
+                                      void* ptr_transfer) {
+  Transfer* const ptr_xfer = reinterpret_cast<Transfer*>(ptr_transfer);
+  HttpUploaderImpl* ptr_uploader_ = ptr_xfer->ptr_uploader;
+
+  // Buffers are owned by |UploadThread|, which runs this callback, until the
+  // upload ends; no lock is needed.
+  if (ptr_xfer->multipart) {
+    if (ptr_uploader_->StopRequested()) {
+      LOG(INFO) << "stop requested.";
+      return CURL_READFUNC_ABORT;
+    }
+    const size_t bytes_left =
+        static_cast<size_t>(ptr_xfer->body_length - ptr_xfer->read_pos);
+    size_t length = std::min(bytes_left, size * nitems);
+    if (length > 0) {
+      length = ptr_uploader_->PaceRead(ptr_xfer, length);
+      if (length == 0) {
+        return CURL_READFUNC_PAUSE;
+      }
+      memcpy(buffer, ptr_xfer->ptr_body + ptr_xfer->read_pos, length);
+    }
+    ptr_xfer->read_pos += static_cast<int32>(length);
+    return length;
+  }
+  const BufferQueue::Buffer* const ptr_buffer = ptr_xfer->ptr_buffer;
+  if (ptr_buffer) {
+    if (ptr_uploader_->StopRequested()) {
+      LOG(INFO) << "stop requested.";
+      return CURL_READFUNC_ABORT;
+    }
+    const size_t bytes_left =
+        static_cast<size_t>(ptr_buffer->length() - ptr_xfer->read_pos);
+    size_t length = std::min(bytes_left, size * nitems);
+    if (length > 0) {
+      length = ptr_uploader_->PaceRead(ptr_xfer, length);
+      if (length == 0) {
+        return CURL_READFUNC_PAUSE;
+      }
+    }
+    memcpy(buffer, ptr_buffer->ptr_data() + ptr_xfer->read_pos, length);
+    ptr_xfer->read_pos += static_cast<int32>(length);
+    return length;
+  }
+
+  std::lock_guard<std::mutex> lock(ptr_uploader_->mutex_);
+  if (ptr_uploader_->stop_) {
+    LOG(INFO) << "stop requested.";
+    return CURL_READFUNC_ABORT;
+  }
+  Stream& stream = *ptr_xfer->stream;
+  const size_t bytes_waiting = stream.data.size() - stream.read_pos;
+  if (bytes_waiting == 0) {
+    if (stream.ended) {
+      return 0;
+    }
+    ptr_xfer->paused = true;
+    return CURL_READFUNC_PAUSE;
+  }
+  const size_t length =
+      ptr_uploader_->PaceRead(ptr_xfer, std::min(bytes_waiting, size * nitems));
+  if (length == 0) {
+    return CURL_READFUNC_PAUSE;
+  }
+  memcpy(buffer, &stream.data[stream.read_pos], length);
+  stream.read_pos += length;
+  if (stream.read_pos == stream.data.size()) {
+    stream.data.clear();
+    stream.read_pos = 0;
+  }
+  return length;
+}
+
+// Rewind a buffer upload. Offsets are relative to the first byte the request
+// sends, which is |resume_offset| in the buffer.
+int HttpUploaderImpl::SeekCallback(void* ptr_transfer, curl_off_t offset,
+                                   int origin) {
+  Transfer* const ptr_xfer = reinterpret_cast<Transfer*>(ptr_transfer);
+  if (ptr_xfer->multipart && origin == SEEK_SET) {
+    if (offset < 0 || offset > ptr_xfer->body_length) {
+      LOG(ERROR) << "invalid multipart seek offset: " << offset;
+      return CURL_SEEKFUNC_FAIL;
+    }
+    ptr_xfer->read_pos = static_cast<int32>(offset);
+    return CURL_SEEKFUNC_OK;
+  }
+  const BufferQueue::Buffer* const ptr_buffer = ptr_xfer->ptr_buffer;
+  if (!ptr_buffer || origin != SEEK_SET) {
+    return CURL_SEEKFUNC_CANTSEEK;
+  }
+  const int64 pos = ptr_xfer->resume_offset + static_cast<int64>(offset);
+  if (offset < 0 || pos > ptr_buffer->length()) {
+    LOG(ERROR) << "invalid upload seek offset: " << offset;
+    return CURL_SEEKFUNC_FAIL;
+  }
+  VLOG(1) << "upload " << ptr_buffer->id << " rewound to " << pos;
+  ptr_xfer->read_pos = static_cast<int32>(pos);
+  return CURL_SEEKFUNC_OK;
+}
+
+void HttpUploaderImpl::RecordQueueDelay(
+    std::chrono::steady_clock::time_point queued_time) {
+  const int64 delay_ms =
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::steady_clock::now() - queued_time).count();
+  std::lock_guard<std::mutex> lock(mutex_);
+  stats_.queue_delay_ms.Add(delay_ms);
+}
+
+// libcurl measures request phases with its own monotonic clock, from the
+// start of the request.
+void HttpUploaderImpl::RecordRequestTiming(CURL* ptr_curl,
+                                           double bytes_uploaded) {
+  double first_byte_seconds = 0;
+  double total_seconds = 0;
+  CURLcode err = curl_easy_getinfo(ptr_curl, CURLINFO_STARTTRANSFER_TIME,
+                                   &first_byte_seconds);
+  if (err != CURLE_OK) {
+    LOG_CURL_ERR(err, "curl_easy_getinfo CURLINFO_STARTTRANSFER_TIME failed.");
+    return;
+  }
+  err = curl_easy_getinfo(ptr_curl, CURLINFO_TOTAL_TIME, &total_seconds);
+  if (err != CURLE_OK) {
+    LOG_CURL_ERR(err, "curl_easy_getinfo CURLINFO_TOTAL_TIME failed.");
+    return;
+  }
+  const int64 first_byte_ms = static_cast<int64>(first_byte_seconds * 1000);
+  const int64 total_ms = static_cast<int64>(total_seconds * 1000);
+  std::lock_guard<std::mutex> lock(mutex_);
+  stats_.time_to_first_byte_ms.Add(first_byte_ms);
+  stats_.upload_time_ms.Add(total_ms);
+  if (total_seconds > 0) {
+    // Bytes per second to kilobits per second.
+    stats_.throughput_kbps.Add(
+        static_cast<int64>(bytes_uploaded * 8 / total_seconds / 1000));
+  }
+}
+
 // Reset uploaded byte count, and store upload start time.
 void HttpUploaderImpl::ResetStats() {
   std::lock_guard<std::mutex> lock(mutex_);
-  stats_.bytes_per_second = 0;
-  stats_.bytes_sent_current = 0;
-  stats_.total_bytes_uploaded = 0;
-  start_ticks_ = clock();
+  stats_ = HttpUploaderStats();
+  start_time_ = std::chrono::steady_clock::now();
 }
 
-// Upload thread.  Wakes when user provides a buffer via call to
-// |UploadBuffer|.
+// Upload thread. Runs up to |settings_.max_uploads| requests concurrently
+// through |ptr_multi_|. Wakes when user provides a buffer via call to
+// |UploadBuffer| or |UploadChunk|, and starts queued uploads in order as
+// request slots become idle.
 void HttpUploaderImpl::UploadThread() {
+  ScopedThreadRegistration registration("uploader");
   LOG(INFO) << "upload thread running...";
-  while (!StopRequested()) {
-    LOG(INFO) << "upload thread waiting for buffer...";
-    WaitForUserData();
-    LOG(INFO) << "uploading buffer...";
-    int status = Upload();
-    if (status == kStopping) {
-      break;
+
+  // Connect while the encoder starts up, ahead of the first chunk.
+  WarmConnections(settings_.warm_connections);
+  while (!StopRequested() && !DrainComplete()) {
+    ProbePrimaryTarget();
+    if (StartQueuedTransfers() == 0) {
+      if (coalesce_hold_) {
+        // Queued buffers wait for others to share their request.
+        std::this_thread::sleep_for(
+            std::chrono::milliseconds(kMultiWaitTimeout));
+        continue;
+      }
+      LOG(INFO) << "upload thread waiting for buffer...";
+      if (WaitForUserData() == kStopping) {
+        break;
+      }
+      continue;
     }
-    if (status) {
-      LOG(ERROR) << "buffer upload failed, status=" << status;
-      // TODO(tomfinegan): Report upload failure, and provide access to
-      //                   response code and data.
-    } else {
-      std::lock_guard<std::mutex> lock(mutex_);
-      LOG(INFO) << "unlocking upload buffer...";
-      status = upload_buffer_.Unlock();
-      if (status) {
-        LOG(ERROR) << "unable to unlock buffer, status=" << status;
-        // keep spinning, for now...
+
+    ResumeStreamTransfers();
+    ResumePacedTransfers();
+    int running = 0;
+    CURLMcode err = curl_multi_perform(ptr_multi_, &running);
+    if (err != CURLM_OK) {
+      LOG_CURLM_ERR(err, "curl_multi_perform failed.");
+    }
+    FinishTransfers();
+    if (running > 0) {
+      err = curl_multi_wait(ptr_multi_, NULL, 0, kMultiWaitTimeout, NULL);
+      if (err != CURLM_OK) {
+        LOG_CURLM_ERR(err, "curl_multi_wait failed.");
       }
-      upload_complete_ = true;
+    } else if (retrying_transfers_ > 0) {
+      // Only retries are waiting; sleep until the next one may be due.
+      std::this_thread::sleep_for(
+          std::chrono::milliseconds(kMultiWaitTimeout));
     }
   }
+
+  // Abandon uploads still in flight.
+  RecordAbandonedUploads();
+  for (size_t i = 0; i < transfers_.size(); ++i) {
+    EndTransfer(&transfers_[i]);
+  }
+  ReleaseMultipartUploads();
   LOG(INFO) << "thread done";
 }
 
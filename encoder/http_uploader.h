@@ -12,19 +12,64 @@
 #include <memory>
 #include <queue>
 #include <string>
+#include <vector>
 
 #include "encoder/basictypes.h"
 #include "encoder/data_sink.h"
 #include "encoder/encoder_base.h"
+#include "encoder/upload_pacer.h"
 
 namespace webmlive {
 
 enum UploadMode {
   HTTP_POST = 0,
   HTTP_FORM_POST = 1,
+
+  // Each buffer is PUT as an object of S3 or GCS compatible object storage,
+  // named by appending its id to the target URL.
+  HTTP_PUT = 2,
 };
 
 struct HttpUploaderSettings {
+  // Default maximum number of concurrent uploads.
+  static const int kDefaultMaxUploads = 4;
+
+  // Default number of times a failed upload is retried.
+  static const int kDefaultMaxRetries = 3;
+
+  // Default number of connections opened before the first upload.
+  static const int kDefaultWarmConnections = 2;
+
+  // Default size of the parts of a multipart upload.
+  static const int32 kDefaultMultipartPartBytes = 8 * 1024 * 1024;
+
+  // Default failover thresholds and primary probe interval. See
+  // |failover_urls|.
+  static const int kDefaultFailoverErrors = 3;
+  static const int kDefaultFailoverLatencyMs = 4000;
+  static const int kDefaultFailoverProbeMs = 5000;
+
+  // Default time a small buffer waits for others to share its request. See
+  // |coalesce_bytes|.
+  static const int kDefaultCoalesceDelayMs = 100;
+
+  HttpUploaderSettings()
+      : post_mode(HTTP_POST),
+        max_uploads(kDefaultMaxUploads),
+        max_queue_bytes(0),
+        http2(false),
+        max_retries(kDefaultMaxRetries),
+        warm_connections(kDefaultWarmConnections),
+        multipart_part_bytes(kDefaultMultipartPartBytes),
+        pacing_kbps(0),
+        pacing_burst_ms(UploadPacer::kDefaultBurstMs),
+        failover_errors(kDefaultFailoverErrors),
+        failover_latency_ms(kDefaultFailoverLatencyMs),
+        failover_probe_ms(kDefaultFailoverProbeMs),
+        prioritize(false),
+        coalesce_bytes(0),
+        coalesce_delay_ms(kDefaultCoalesceDelayMs) {}
+
   // Form variables and HTTP headers are stored within
   // map<std::string,std::string>.
   typedef std::map<std::string, std::string> StringMap;
@@ -51,10 +96,152 @@ struct HttpUploaderSettings {
 
   // Target URL.
   std::string target_url;
+
+  // Maximum number of uploads in flight at once. Each upload slot keeps its
+  // connection to the server open between requests.
+  int max_uploads;
+
+  // Bytes of the buffers waiting in the upload queue beyond which the
+  // uploader is not |Ready()| and refuses more, on top of the
+  // |HttpUploader::kMaxQueuedUploads| limit. 0 limits by count only.
+  int64 max_queue_bytes;
+
+  // Multiplex all uploads in flight over a single HTTP/2 connection, one
+  // stream per upload. Initialization segments are weighted above audio
+  // segments, and audio above video, so that the server receives what
+  // players need first. Uploads fall back to HTTP/1.1 when the server does
+  // not negotiate HTTP/2 over TLS, or libcurl lacks HTTP/2 support.
+  bool http2;
+
+  // Number of times an upload that fails with a connection error or a 5xx
+  // response is retried, with exponential backoff between attempts. See
+  // |HttpUploader| for resumed retries. 0 disables retries.
+  int max_retries;
+
+  // Connections opened to the server by |HttpUploader::Run()| ahead of the
+  // first upload, so that DNS resolution and the TCP and TLS handshakes are
+  // done by the time the first chunk is ready. Connections beyond the one
+  // in use stay open as standby, and a connection error opens a replacement.
+  // Capped at |max_uploads|, and at 1 with |http2|. 0 disables warming.
+  int warm_connections;
+
+  // In |HTTP_PUT| mode, objects larger than |multipart_part_bytes| are sent
+  // with a multipart upload in parts of this size, which are uploaded in
+  // parallel over the request slots. Object storage requires parts but the
+  // last to be 5 MiB or more. 0 disables multipart uploads.
+  int32 multipart_part_bytes;
+
+  // Upload rate limit, in kilobits per second, over all requests of the
+  // uploader, and the burst sent at full speed before it applies, as
+  // milliseconds of sending at the limit. A keyframe segment then reaches
+  // the network at the limit instead of as fast as TCP allows. The
+  // uploaders of the process are also bound by |UploadPacer::Instance()|.
+  // 0 disables pacing.
+  int pacing_kbps;
+  int pacing_burst_ms;
+
+  // Backup ingest targets, in order of preference, with the same form as
+  // |target_url|. Each target has a health score, which requests sent to it
+  // update: a failed request, or one slower than |failover_latency_ms|,
+  // lowers it. Uploads fail over to the healthiest backup once the active
+  // target has failed |failover_errors| requests in a row, or its score
+  // drops below half. The init segment and the uploads unacknowledged by
+  // the failed target are then sent again to the new target. While a backup
+  // is active the primary, |target_url|, is probed with a HEAD request every
+  // |failover_probe_ms|, and uploads fail back after three good probes.
+  // Streams in flight, and multipart uploads, stay on their target.
+  std::vector<std::string> failover_urls;
+  int failover_errors;
+  int failover_latency_ms;
+  int failover_probe_ms;
+
+  // Take queued buffers by class instead of in order: headers, manifests
+  // and init segments first, then audio, then video. Video segments share
+  // the request slots by representation, in step: the representation with
+  // the fewest segments sent goes next. Under pressure, once half of
+  // |HttpUploader::kMaxQueuedUploads| are waiting, the representation with
+  // the smallest segments goes first instead, so that the lower renditions
+  // keep playing while the top rendition falls behind. Audio ids contain
+  // "audio", and the representation of a video segment is its id up to the
+  // segment number.
+  bool prioritize;
+
+  // In |HTTP_FORM_POST| mode, consecutive queued buffers of up to
+  // |coalesce_bytes| in total, such as short audio segments, or an audio
+  // segment and the video segment that follows it, are sent in one request
+  // instead of one request each. Each buffer is a file part of the form, as
+  // it would be alone, in queue order, and the "webm_batch_index" form
+  // variable lists "<id>:<length>" of each part, separated by commas. While
+  // the buffers waiting would all fit in one request, the oldest waits up to
+  // |coalesce_delay_ms| for more to join it. A request sends at most
+  // |HttpUploader::kMaxCoalescedBuffers| buffers. 0 disables coalescing,
+  // which is also off in other modes and with pacing.
+  int32 coalesce_bytes;
+  int coalesce_delay_ms;
+};
+
+// Fixed-bucket histogram of upload samples. Bucket bounds are powers of two
+// times |base|: bucket 0 counts samples below |base|, bucket i samples from
+// |base| * 2^(i - 1) up to |base| * 2^i, and the last bucket all larger
+// samples.
+struct UploadHistogram {
+  static const int kNumBuckets = 16;
+
+  explicit UploadHistogram(int64 bucket_base);
+
+  // Counts |value| in its bucket.
+  void Add(int64 value);
+
+  // Returns an upper bound of the |percentile| percent smallest samples: the
+  // upper bound of the bucket that holds the sample at |percentile|, or
+  // |max| for the last bucket. Returns 0 when there are no samples.
+  int64 Percentile(double percentile) const;
+
+  // Upper bound of bucket 0.
+  int64 base;
+
+  // Number of samples, their sum, and the largest sample.
+  int64 count;
+  int64 sum;
+  int64 max;
+
+  int64 buckets[kNumBuckets];
 };
 
 struct HttpUploaderStats {
-  // Upload average bytes per second.
+  // Bucket bases of the |HttpUploaderStats| histograms: 1 millisecond, and 64
+  // kilobits per second.
+  static const int64 kTimeHistogramBase = 1;
+  static const int64 kThroughputHistogramBase = 64;
+
+  HttpUploaderStats()
+      : bytes_per_second(0),
+        bytes_sent_current(0),
+        total_bytes_uploaded(0),
+        queued_uploads(0),
+        queued_bytes(0),
+        max_queued_bytes(0),
+        upload_retries(0),
+        resumed_uploads(0),
+        connections_warmed(0),
+        multipart_uploads(0),
+        multipart_parts(0),
+        multipart_failures(0),
+        uploads_abandoned(0),
+        bytes_abandoned(0),
+        pacing_waits(0),
+        failovers(0),
+        active_target(0),
+        replayed_uploads(0),
+        coalesced_requests(0),
+        coalesced_buffers(0),
+        queue_delay_ms(kTimeHistogramBase),
+        time_to_first_byte_ms(kTimeHistogramBase),
+        upload_time_ms(kTimeHistogramBase),
+        throughput_kbps(kThroughputHistogramBase) {}
+
+  // Average upload bytes per second since |HttpUploader::Init()|, measured
+  // with a monotonic clock.
   double bytes_per_second;
 
   // Bytes sent for current upload.
@@ -62,6 +249,63 @@ struct HttpUploaderStats {
 
   // Total number of bytes uploaded.
   int64 total_bytes_uploaded;
+
+  // Number of buffers waiting in the upload queue.
+  int32 queued_uploads;
+
+  // Bytes of the buffers waiting in the upload queue or being uploaded, and
+  // the most at once.
+  int64 queued_bytes;
+  int64 max_queued_bytes;
+
+  // Number of failed uploads retried, and the number of those that resumed
+  // after the bytes already sent instead of starting over.
+  int64 upload_retries;
+  int64 resumed_uploads;
+
+  // Number of connections opened ahead of uploads. See
+  // |HttpUploaderSettings::warm_connections|.
+  int64 connections_warmed;
+
+  // Multipart uploads completed, parts uploaded, and multipart uploads that
+  // failed and were aborted. See |HttpUploaderSettings::multipart_part_bytes|.
+  int64 multipart_uploads;
+  int64 multipart_parts;
+  int64 multipart_failures;
+
+  // Buffers and streams not delivered when the uploader stopped: those still
+  // queued, and those aborted in flight. |bytes_abandoned| is their length.
+  int64 uploads_abandoned;
+  int64 bytes_abandoned;
+
+  // Number of times a request waited for pacing tokens. See
+  // |HttpUploaderSettings::pacing_kbps|.
+  int64 pacing_waits;
+
+  // Target switches, the index of the target uploads go to, 0 for
+  // |HttpUploaderSettings::target_url| and i for failover URL i - 1, and the
+  // uploads sent again after a switch.
+  int64 failovers;
+  int32 active_target;
+  int64 replayed_uploads;
+
+  // Requests that sent more than one buffer, and the buffers they sent. See
+  // |HttpUploaderSettings::coalesce_bytes|.
+  int64 coalesced_requests;
+  int64 coalesced_buffers;
+
+  // Request timing, in milliseconds of a monotonic clock. |queue_delay_ms|
+  // is the time from enqueueing a buffer or opening a stream until its first
+  // request starts. |time_to_first_byte_ms| runs from the start of a request
+  // to the first response byte, and |upload_time_ms| to the end of the
+  // request. Retried requests are each counted; failed requests are not.
+  UploadHistogram queue_delay_ms;
+  UploadHistogram time_to_first_byte_ms;
+  UploadHistogram upload_time_ms;
+
+  // Effective throughput of each completed request, in kilobits per second:
+  // the bytes it sent over |upload_time_ms|.
+  UploadHistogram throughput_kbps;
 };
 
 class HttpUploaderImpl;
@@ -71,12 +315,40 @@ class HttpUploaderImpl;
 //
 // Notes:
 // - |Init| must be called before any other method.
-// - |EnqueueTargetUrl| must be used to control target for HTTP requests. URLs
-//   enqueued are used in sequence, and only removed from the queue after
-//   successful uploads.
+// - |Run| opens |HttpUploaderSettings::warm_connections| connections to the
+//   server with HEAD requests, ahead of the first upload.
+// - Requests go to |HttpUploaderSettings::target_url|, or to one of
+//   |HttpUploaderSettings::failover_urls| while the primary is unhealthy.
+// - Buffers passed to |UploadBuffer| and |UploadChunk| wait in a FIFO of at
+//   most |kMaxQueuedUploads| entries, and are uploaded in order, unless
+//   |HttpUploaderSettings::prioritize| is set.
+// - |StartStreamUpload|, |UploadStreamData| and |EndStreamUpload| upload a
+//   chunk with HTTP chunked transfer encoding while it is being produced.
+//   Streams are sent with plain HTTP posts only, and take idle request slots
+//   ahead of queued buffers. The chunk id is passed to the server in the
+//   |chunk| URL query parameter.
+// - A failed buffer upload is retried up to
+//   |HttpUploaderSettings::max_retries| times. In |HTTP_POST| mode a retry of
+//   a buffer of at least |kBytesRequiredForResume| bytes sends only the bytes
+//   after those already sent, with a "Content-Range: bytes
+//   <first>-<last>/<length>" header. A server that cannot resume answers 416,
+//   and the next retry sends the whole buffer. Streams are not retried.
+// - In |HTTP_FORM_POST| mode small buffers may share a request, see
+//   |HttpUploaderSettings::coalesce_bytes|; the request is retried as a
+//   whole.
+// - In |HTTP_PUT| mode each buffer is PUT to the target URL plus the buffer
+//   id, before any query string, and uploads of different buffers run in
+//   parallel. A buffer larger than |HttpUploaderSettings::multipart_part_bytes|
+//   is sent with an S3 multipart upload: its parts are PUT in parallel, and
+//   each request is retried as a buffer upload is. Requests carry the user
+//   HTTP headers, which hold the credentials of the storage service. Streams
+//   are not supported.
 class HttpUploader : public DataSinkInterface {
  public:
   enum {
+    // Stream upload failed, or streams are not supported by the post mode.
+    kStreamError = -308,
+
     // Bad URL.
     kUrlConfigError = -307,
 
@@ -100,14 +372,36 @@ class HttpUploader : public DataSinkInterface {
 
     // Upload already running.
     kUploadInProgress = 1,
+
+    // Upload queue is full.
+    kQueueFull = 2,
   };
+
+  // Maximum number of buffers waiting for upload.
+  static const int kMaxQueuedUploads = 8;
+
+  // Maximum number of buffers sent in one request. See
+  // |HttpUploaderSettings::coalesce_bytes|.
+  static const int kMaxCoalescedBuffers = 4;
+
+  // Smallest buffer, in bytes, whose failed upload resumes rather than
+  // starts over.
+  static const int32 kBytesRequiredForResume = 32 * 1024;
+
+  // Maximum number of bytes a stream holds while waiting for upload.
+  static const int32 kMaxStreamBufferBytes = 8 * 1024 * 1024;
+
   HttpUploader();
   virtual ~HttpUploader();
 
-  // Tests for upload completion. Returns true when the uploader is ready to
-  // start an upload. Always returns true when no uploads have been attempted.
+  // Tests for upload completion. Returns true when the upload queue is empty
+  // and no upload is running. Always returns true when no uploads have been
+  // attempted.
   bool UploadComplete() const;
 
+  // Returns true when the upload queue has room for another buffer.
+  bool QueueReady() const;
+
   // Constructs |HttpUploaderImpl|, which copies |settings|. Returns |kSuccess|
   // upon success.
   int Init(const HttpUploaderSettings& settings);
@@ -119,17 +413,68 @@ class HttpUploader : public DataSinkInterface {
   // Runs the uploader thread.
   int Run();
 
-  // Stops the uploader thread.
+  // Stops the uploader thread. Uploads in flight are aborted, and queued
+  // buffers are discarded.
   int Stop();
 
-  // Sends a buffer to the uploader thread.
+  // Continues uploading for up to |timeout_ms| milliseconds, until the
+  // buffers queued and streams open have been delivered, and then stops the
+  // uploader thread. Uploads not finished by the deadline are aborted from
+  // the libcurl progress callback, and counted in
+  // |HttpUploaderStats::uploads_abandoned|. Streams must be ended before the
+  // call to complete. A |timeout_ms| of 0 behaves as |Stop()|, and a
+  // negative one waits without limit.
+  int Stop(int timeout_ms);
+
+  // Copies a buffer into the upload queue. Returns |kQueueFull| when the
+  // queue has no room.
   int UploadBuffer(const uint8* ptr_buffer, int32 length);
 
+  // Same as above, for a buffer identified by |id|, which names its object in
+  // |HTTP_PUT| mode.
+  int UploadBuffer(const uint8* ptr_buffer, int32 length,
+                   const std::string& id);
+
+  // Adds |chunk| to the upload queue. The uploader keeps a reference to
+  // |chunk| until the upload completes instead of copying its data; in both
+  // post modes the request body is read straight from the chunk. Returns
+  // |kQueueFull| when the queue has no room.
+  int UploadChunk(const SharedWebmChunk& chunk);
+
+  // Opens a stream for the chunk identified by |id|. The upload starts when a
+  // request slot is idle. Returns |kStreamError| when a stream with |id| is
+  // open, or when |HttpUploaderSettings::post_mode| is not |HTTP_POST|.
+  int StartStreamUpload(const std::string& id);
+
+  // Copies |ptr_buffer| to the stream identified by |id|. Returns
+  // |kStreamError| when the stream is not open, its upload failed, or it
+  // holds more than |kMaxStreamBufferBytes| waiting for upload.
+  int UploadStreamData(const std::string& id, const uint8* ptr_buffer,
+                       int32 length);
+
+  // Ends the stream identified by |id|; its upload completes once the data
+  // written to it has been sent. Returns |kStreamError| when the stream is
+  // not open.
+  int EndStreamUpload(const std::string& id);
+
   // DataSinkInterface methods.
-  virtual bool Ready() const { return UploadComplete(); }
+  virtual bool Ready() const { return QueueReady(); }
   virtual bool WriteData(const uint8* ptr_buffer, int32 length,
-                         const std::string& /*id*/) {
-    return (UploadBuffer(ptr_buffer, length) == kSuccess);
+                         const std::string& id) {
+    return (UploadBuffer(ptr_buffer, length, id) == kSuccess);
+  }
+  virtual bool WriteChunk(const SharedWebmChunk& chunk) {
+    return (UploadChunk(chunk) == kSuccess);
+  }
+  virtual bool BeginStream(const std::string& id) {
+    return (StartStreamUpload(id) == kSuccess);
+  }
+  virtual bool WriteStreamData(const std::string& id, const uint8* ptr_buffer,
+                               int32 length) {
+    return (UploadStreamData(id, ptr_buffer, length) == kSuccess);
+  }
+  virtual bool EndStream(const std::string& id) {
+    return (EndStreamUpload(id) == kSuccess);
   }
 
  private:
@@ -0,0 +1,89 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/init_segment_cache.h"
+
+#include <cstring>
+
+#include "glog/logging.h"
+
+namespace webmlive {
+
+namespace {
+
+bool SameData(const WebmChunk& chunk, const WebmChunk& other) {
+  return chunk.length() == other.length() &&
+         (chunk.length() == 0 ||
+          memcmp(chunk.data(), other.data(), chunk.length()) == 0);
+}
+
+}  // namespace
+
+InitSegmentCache::InitSegmentCache() : max_versions_(kDefaultMaxVersions) {
+}
+
+void InitSegmentCache::set_max_versions(int max_versions) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  max_versions_ = max_versions > 0 ? max_versions : 1;
+}
+
+SharedWebmChunk InitSegmentCache::Intern(const std::string& config_key,
+                                         const SharedWebmChunk& chunk) {
+  if (!chunk) {
+    return chunk;
+  }
+  // The version evicted, if any, is released outside the lock; it may return
+  // its storage to a muxer pool.
+  SharedWebmChunk evicted;
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (std::deque<Version>::iterator version = versions_.begin();
+       version != versions_.end(); ++version) {
+    if (version->config_key != config_key) {
+      continue;
+    }
+    if (SameData(*version->chunk, *chunk)) {
+      ++stats_.shared;
+      return version->chunk;
+    }
+    VLOG(1) << "initialization segment of " << config_key << " replaced.";
+    evicted.swap(version->chunk);
+    version->chunk = chunk;
+    return chunk;
+  }
+  Version version;
+  version.config_key = config_key;
+  version.chunk = chunk;
+  versions_.push_back(version);
+  if (versions_.size() > max_versions_) {
+    evicted.swap(versions_.front().chunk);
+    versions_.pop_front();
+    ++stats_.evicted;
+  }
+  stats_.versions = static_cast<int32>(versions_.size());
+  return chunk;
+}
+
+SharedWebmChunk InitSegmentCache::Find(const std::string& config_key) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (std::deque<Version>::const_iterator version = versions_.begin();
+       version != versions_.end(); ++version) {
+    if (version->config_key == config_key) {
+      return version->chunk;
+    }
+  }
+  return SharedWebmChunk();
+}
+
+void InitSegmentCache::GetStats(InitSegmentCacheStats* ptr_stats) const {
+  if (!ptr_stats) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  *ptr_stats = stats_;
+}
+
+}  // namespace webmlive
@@ -0,0 +1,86 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_INIT_SEGMENT_CACHE_H_
+#define WEBMLIVE_ENCODER_INIT_SEGMENT_CACHE_H_
+
+#include <deque>
+#include <mutex>
+#include <string>
+
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+#include "encoder/webm_chunk.h"
+
+namespace webmlive {
+
+struct InitSegmentCacheStats {
+  InitSegmentCacheStats() : versions(0), shared(0), evicted(0) {}
+
+  // Number of versions held.
+  int32 versions;
+
+  // Number of |InitSegmentCache::Intern()| calls answered with a version
+  // already held.
+  int64 shared;
+
+  // Number of versions evicted to make room for newer ones.
+  int64 evicted;
+};
+
+// Initialization segments by track configuration. Muxers whose tracks are
+// configured alike write identical initialization segments, and keep one
+// copy through the cache; a stream reconfigured mid-stream gets a new
+// version, and the previous ones are kept for consumers still on them.
+//
+// Notes:
+// - Configurations are compared by key, and their segments by content: a
+//   segment that differs from the version held for its key replaces it.
+// - The |WebmChunk::id()| of a shared version is that of the segment first
+//   stored, which may name another muxer's output.
+// - Thread safe.
+class InitSegmentCache {
+ public:
+  // Default number of versions held.
+  static const int kDefaultMaxVersions = 16;
+
+  InitSegmentCache();
+  ~InitSegmentCache() {}
+
+  // Sets the number of versions held. The oldest versions are evicted when
+  // there are more.
+  void set_max_versions(int max_versions);
+
+  // Returns the version held for |config_key| when its data equals that of
+  // |chunk|. Otherwise stores |chunk| as the version of |config_key| and
+  // returns it.
+  SharedWebmChunk Intern(const std::string& config_key,
+                         const SharedWebmChunk& chunk);
+
+  // Returns the version held for |config_key|, or NULL.
+  SharedWebmChunk Find(const std::string& config_key) const;
+
+  // Locks |mutex_| and copies current stats to |ptr_stats|.
+  void GetStats(InitSegmentCacheStats* ptr_stats) const;
+
+ private:
+  struct Version {
+    std::string config_key;
+    SharedWebmChunk chunk;
+  };
+
+  // Versions held, oldest first. Protected by |mutex_|.
+  std::deque<Version> versions_;
+  size_t max_versions_;
+  InitSegmentCacheStats stats_;
+  mutable std::mutex mutex_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(InitSegmentCache);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_INIT_SEGMENT_CACHE_H_
@@ -0,0 +1,264 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/latency_tracer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <limits>
+#include <new>
+
+#include "glog/logging.h"
+
+namespace webmlive {
+
+namespace {
+
+int64 NowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+}  // namespace
+
+const char* LatencyStageName(int stage) {
+  switch (stage) {
+    case kLatencyReceived:
+      return "received";
+    case kLatencyCommitted:
+      return "committed";
+    case kLatencyDecommitted:
+      return "decommitted";
+    case kLatencyEncodeStart:
+      return "encode_start";
+    case kLatencyEncodeEnd:
+      return "encode_end";
+    case kLatencyMuxed:
+      return "muxed";
+    case kLatencyChunkReady:
+      return "chunk_ready";
+    case kLatencySinkWritten:
+      return "sink_written";
+  }
+  return "unknown";
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LatencyHistogram
+//
+
+LatencyHistogram::LatencyHistogram() : count(0), sum(0), max(0) {
+  memset(buckets, 0, sizeof(buckets));
+}
+
+void LatencyHistogram::Add(int64 value_us) {
+  value_us = std::max(value_us, static_cast<int64>(0));
+  int bucket = 0;
+  int64 bound = 1;
+  while (bucket < kNumBuckets - 1 && value_us >= bound) {
+    ++bucket;
+    bound *= 2;
+  }
+  ++buckets[bucket];
+  ++count;
+  sum += value_us;
+  max = std::max(max, value_us);
+}
+
+int64 LatencyHistogram::Percentile(double percentile) const {
+  if (count == 0) {
+    return 0;
+  }
+  const double rank = count * std::min(std::max(percentile, 0.0), 100.0) / 100;
+  int64 samples = 0;
+  int64 bound = 1;
+  for (int i = 0; i < kNumBuckets - 1; ++i) {
+    samples += buckets[i];
+    if (samples > 0 && samples >= rank) {
+      return std::min(bound, max);
+    }
+    bound *= 2;
+  }
+  return max;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LatencyTracer::Ring
+//
+
+bool LatencyTracer::Ring::Push(const Event& event) {
+  const uint32 head = head_.load(std::memory_order_relaxed);
+  if (head - tail_.load(std::memory_order_acquire) >= kRingSize) {
+    return false;
+  }
+  events_[head & (kRingSize - 1)] = event;
+  head_.store(head + 1, std::memory_order_release);
+  return true;
+}
+
+void LatencyTracer::Ring::PopAll(std::vector<Event>* ptr_events) {
+  const uint32 tail = tail_.load(std::memory_order_relaxed);
+  const uint32 head = head_.load(std::memory_order_acquire);
+  for (uint32 i = tail; i != head; ++i) {
+    ptr_events->push_back(events_[i & (kRingSize - 1)]);
+  }
+  tail_.store(head, std::memory_order_release);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LatencyTracer
+//
+
+LatencyTracer::LatencyTracer() : events_dropped_(0), next_collect_ms_(0) {
+}
+
+LatencyTracer::~LatencyTracer() {
+}
+
+LatencyTracer* LatencyTracer::Instance() {
+  static LatencyTracer tracer;
+  return &tracer;
+}
+
+void LatencyTracer::Trace(int stream, int stage, int64 timestamp) {
+#ifdef WEBMLIVE_ETW_TRACING
+  EtwTraceStage(stream, stage, timestamp);
+#endif
+  if (stream < 0 || stream >= kNumLatencyStreams || stage < 0 ||
+      stage >= kNumLatencyStages) {
+    return;
+  }
+  LatencyTracer* const ptr_tracer = Instance();
+
+  // The ring is looked up once per thread; a thread refused a ring drops its
+  // events without retrying.
+  thread_local Ring* ptr_ring = NULL;
+  thread_local bool ring_requested = false;
+  if (!ring_requested) {
+    ring_requested = true;
+    ptr_ring = ptr_tracer->AddRing();
+  }
+
+  Event event;
+  event.time_ns = NowNs();
+  event.timestamp = timestamp;
+  event.stream = static_cast<int8>(stream);
+  event.stage = static_cast<int8>(stage);
+  if (!ptr_ring || !ptr_ring->Push(event)) {
+    ptr_tracer->events_dropped_.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+LatencyTracer::Ring* LatencyTracer::AddRing() {
+  std::lock_guard<std::mutex> lock(ring_mutex_);
+  if (rings_.size() >= static_cast<size_t>(kMaxThreads)) {
+    LOG(WARNING) << "latency trace thread limit reached, events from this "
+                 << "thread are dropped.";
+    return NULL;
+  }
+  std::unique_ptr<Ring> ring(new (std::nothrow) Ring);  // NOLINT
+  if (!ring) {
+    LOG(ERROR) << "out of memory allocating latency trace ring.";
+    return NULL;
+  }
+  rings_.push_back(std::move(ring));
+  return rings_.back().get();
+}
+
+void LatencyTracer::Collect(bool force) {
+  if (!force) {
+    const int64 now_ms = NowNs() / 1000000;
+    int64 next_collect_ms = next_collect_ms_.load(std::memory_order_relaxed);
+    if (now_ms < next_collect_ms ||
+        !next_collect_ms_.compare_exchange_strong(
+            next_collect_ms, now_ms + kCollectIntervalMs,
+            std::memory_order_relaxed)) {
+      return;
+    }
+  }
+  std::lock_guard<std::mutex> lock(collect_mutex_);
+  CollectEvents(false);
+}
+
+void LatencyTracer::GetStats(bool flush, LatencyStats* ptr_stats) {
+  CHECK_NOTNULL(ptr_stats);
+  std::lock_guard<std::mutex> lock(collect_mutex_);
+  CollectEvents(flush);
+  *ptr_stats = stats_;
+  ptr_stats->events_dropped =
+      events_dropped_.load(std::memory_order_relaxed);
+}
+
+void LatencyTracer::CollectEvents(bool flush) {
+  std::vector<Ring*> rings;
+  {
+    std::lock_guard<std::mutex> lock(ring_mutex_);
+    for (size_t i = 0; i < rings_.size(); ++i) {
+      rings.push_back(rings_[i].get());
+    }
+  }
+  for (size_t i = 0; i < rings.size(); ++i) {
+    rings[i]->PopAll(&pending_);
+  }
+  std::stable_sort(pending_.begin(), pending_.end(),
+                   [](const Event& a, const Event& b) {
+                     return a.time_ns < b.time_ns;
+                   });
+
+  const int64 cutoff_ns = flush ? std::numeric_limits<int64>::max() :
+      NowNs() - kReorderWindowMs * 1000000;
+  size_t num_ready = 0;
+  while (num_ready < pending_.size() &&
+         pending_[num_ready].time_ns <= cutoff_ns) {
+    Aggregate(pending_[num_ready]);
+    ++num_ready;
+  }
+  pending_.erase(pending_.begin(), pending_.begin() + num_ready);
+}
+
+void LatencyTracer::Aggregate(const Event& event) {
+  ++stats_.events;
+  Mark mark;
+  mark.time_ns = event.time_ns;
+  mark.origin_ns = event.time_ns;
+
+  // Measure from the closest earlier stage traced for the buffer. Marks at or
+  // before the one matched belong to buffers that have moved on, or were
+  // dropped, and are discarded.
+  bool matched = false;
+  for (int stage = event.stage - 1; stage >= 0 && !matched; --stage) {
+    MarkMap& earlier = marks_[event.stream][stage];
+    MarkMap::iterator it = earlier.upper_bound(event.timestamp);
+    if (it == earlier.begin()) {
+      continue;
+    }
+    --it;
+    stats_.stages[event.stream][event.stage].Add(
+        (event.time_ns - it->second.time_ns) / 1000);
+    mark.origin_ns = it->second.origin_ns;
+    earlier.erase(earlier.begin(), ++it);
+    matched = true;
+  }
+  if (!matched && event.stage != kLatencyReceived) {
+    ++stats_.events_unmatched;
+    return;
+  }
+
+  if (event.stage == kLatencySinkWritten) {
+    stats_.end_to_end[event.stream].Add(
+        (event.time_ns - mark.origin_ns) / 1000);
+    return;
+  }
+  MarkMap& marks = marks_[event.stream][event.stage];
+  marks[event.timestamp] = mark;
+  while (marks.size() > kMaxMarks) {
+    marks.erase(marks.begin());
+  }
+}
+
+}  // namespace webmlive
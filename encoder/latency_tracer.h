@@ -0,0 +1,234 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_LATENCY_TRACER_H_
+#define WEBMLIVE_ENCODER_LATENCY_TRACER_H_
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+#include "encoder/etw_trace.h"
+
+// Per-stage latency tracing of frames and audio buffers, from capture to the
+// data sink. Trace points are compiled out unless |WEBMLIVE_LATENCY_TRACING|
+// or |WEBMLIVE_ETW_TRACING| is defined; arguments are not evaluated when they
+// are. With |WEBMLIVE_ETW_TRACING|, each trace point also writes an ETW event;
+// see etw_trace.h.
+#ifdef WEBMLIVE_LATENCY_TRACING
+#define WEBMLIVE_TRACE_LATENCY(stream, stage, timestamp) \
+  webmlive::LatencyTracer::Trace(stream, stage, timestamp)
+#define WEBMLIVE_COLLECT_LATENCY() \
+  webmlive::LatencyTracer::Instance()->Collect(false)
+#else
+#ifdef WEBMLIVE_ETW_TRACING
+#define WEBMLIVE_TRACE_LATENCY(stream, stage, timestamp) \
+  webmlive::EtwTraceStage(stream, stage, timestamp)
+#else
+#define WEBMLIVE_TRACE_LATENCY(stream, stage, timestamp) \
+  while (false) webmlive::LatencyTracer::Trace(stream, stage, timestamp)
+#endif
+#define WEBMLIVE_COLLECT_LATENCY() \
+  while (false) webmlive::LatencyTracer::Instance()->Collect(false)
+#endif
+
+namespace webmlive {
+
+// Points at which a frame or audio buffer is traced, in pipeline order.
+enum LatencyStage {
+  // Entry of the capture callback: |OnVideoFrameReceived()| or
+  // |OnSamplesReceived()|.
+  kLatencyReceived = 0,
+
+  // Commit to, and decommit from, the input buffer pool.
+  kLatencyCommitted = 1,
+  kLatencyDecommitted = 2,
+
+  // Start and end of |EncodeFrame()| or |Encode()|.
+  kLatencyEncodeStart = 3,
+  kLatencyEncodeEnd = 4,
+
+  // |WriteVideoFrame()| or |WriteAudioBuffer()| complete for all muxers.
+  kLatencyMuxed = 5,
+
+  // |ChunkReady()| returned true for the chunk starting at the timestamp.
+  kLatencyChunkReady = 6,
+
+  // The chunk was accepted by the data sink.
+  kLatencySinkWritten = 7,
+
+  kNumLatencyStages = 8,
+};
+
+enum LatencyStream {
+  kLatencyVideo = 0,
+  kLatencyAudio = 1,
+  kNumLatencyStreams = 2,
+};
+
+// Returns a short name for |stage|, for logging.
+const char* LatencyStageName(int stage);
+
+// Fixed-bucket histogram of latency samples, in microseconds. Bucket 0 counts
+// samples below 1 microsecond, bucket i samples from 2^(i - 1) up to 2^i
+// microseconds, and the last bucket all larger samples.
+struct LatencyHistogram {
+  static const int kNumBuckets = 24;
+
+  LatencyHistogram();
+
+  // Counts |value_us| in its bucket.
+  void Add(int64 value_us);
+
+  // Returns an upper bound of the |percentile| percent smallest samples, or
+  // 0 when there are no samples. See |UploadHistogram::Percentile()|.
+  int64 Percentile(double percentile) const;
+
+  // Number of samples, their sum, and the largest sample.
+  int64 count;
+  int64 sum;
+  int64 max;
+
+  int64 buckets[kNumBuckets];
+};
+
+struct LatencyStats {
+  LatencyStats() : events(0), events_dropped(0), events_unmatched(0) {}
+
+  // Time from the closest earlier traced stage of the same frame or buffer
+  // to each stage, by stream. Stage |kLatencyReceived| has no samples.
+  // Events are matched to the latest earlier stage event at or before their
+  // timestamp: an audio encoder need not keep input timestamps, and chunks
+  // are traced at the timestamp of their first block.
+  LatencyHistogram stages[kNumLatencyStreams][kNumLatencyStages];
+
+  // Time from |kLatencyReceived| to |kLatencySinkWritten|, by stream.
+  LatencyHistogram end_to_end[kNumLatencyStreams];
+
+  // Number of events aggregated, dropped because a trace buffer was full,
+  // and with no earlier stage to measure from.
+  int64 events;
+  int64 events_dropped;
+  int64 events_unmatched;
+};
+
+// Collects latency trace events. Each thread that traces gets a fixed-size
+// single-producer, single-consumer ring of events on its first event, so
+// that |Trace()| takes no lock: it reads a monotonic clock, and stores the
+// event when the ring has room, or counts it as dropped. |Collect()| moves
+// events from the rings into the stage histograms.
+//
+// Notes:
+// - Rings are never freed, and at most |kMaxThreads| threads are traced.
+// - Events from different threads are ordered by time before they are
+//   aggregated. Events newer than |kReorderWindowMs| are held back for the
+//   next |Collect()| to give every thread time to publish the ones before.
+class LatencyTracer {
+ public:
+  // Number of events held by each ring. Must be a power of two.
+  static const uint32 kRingSize = 4096;
+
+  static const int kMaxThreads = 64;
+
+  // Minimum time between two unforced |Collect()| calls, and the age of
+  // events held back by |Collect()|, in milliseconds.
+  static const int64 kCollectIntervalMs = 100;
+  static const int64 kReorderWindowMs = 50;
+
+  // Number of samples kept per stage for matching later stages.
+  static const size_t kMaxMarks = 512;
+
+  static LatencyTracer* Instance();
+
+  // Records |stage| of the |stream| frame or buffer with capture timestamp
+  // |timestamp|, from the calling thread. Events with a negative |stream|
+  // are ignored. Use |WEBMLIVE_TRACE_LATENCY()|.
+  static void Trace(int stream, int stage, int64 timestamp);
+
+  // Aggregates the events in the rings. Returns without collecting when
+  // |force| is false and the last collection was less than
+  // |kCollectIntervalMs| ago. Thread safe.
+  void Collect(bool force);
+
+  // Collects, and copies the histograms to |ptr_stats|. All events are
+  // aggregated when |flush| is true. Thread safe.
+  void GetStats(bool flush, LatencyStats* ptr_stats);
+
+ private:
+  struct Event {
+    int64 time_ns;
+    int64 timestamp;
+    int8 stream;
+    int8 stage;
+  };
+
+  class Ring {
+   public:
+    Ring() : head_(0), tail_(0) {}
+
+    // Producer side. Returns false when the ring is full.
+    bool Push(const Event& event);
+
+    // Consumer side. Appends all published events to |ptr_events|.
+    void PopAll(std::vector<Event>* ptr_events);
+
+   private:
+    Event events_[kRingSize];
+    std::atomic<uint32> head_;
+    std::atomic<uint32> tail_;
+    WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(Ring);
+  };
+
+  // Time and |kLatencyReceived| time of a traced stage.
+  struct Mark {
+    int64 time_ns;
+    int64 origin_ns;
+  };
+  typedef std::map<int64, Mark> MarkMap;
+
+  LatencyTracer();
+  ~LatencyTracer();
+
+  // Returns a new ring for the calling thread, or NULL when |kMaxThreads|
+  // rings exist.
+  Ring* AddRing();
+
+  // Moves events from the rings to |pending_|, and aggregates those older
+  // than |kReorderWindowMs|, or all of them when |flush| is true. Must be
+  // called with |collect_mutex_| held.
+  void CollectEvents(bool flush);
+
+  // Aggregates |event|. Must be called with |collect_mutex_| held.
+  void Aggregate(const Event& event);
+
+  // Rings, protected by |ring_mutex_|.
+  std::vector<std::unique_ptr<Ring> > rings_;
+  std::mutex ring_mutex_;
+
+  // Events dropped by |Trace()|.
+  std::atomic<int64> events_dropped_;
+
+  // Next time an unforced |Collect()| runs, in milliseconds.
+  std::atomic<int64> next_collect_ms_;
+
+  // Events held back, recent marks by stream and stage, and the histograms.
+  // Protected by |collect_mutex_|.
+  std::vector<Event> pending_;
+  MarkMap marks_[kNumLatencyStreams][kNumLatencyStages];
+  LatencyStats stats_;
+  std::mutex collect_mutex_;
+
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(LatencyTracer);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_LATENCY_TRACER_H_
@@ -0,0 +1,329 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+//
+// Delivery latency verifier. Reads WebM streams or segments written with
+// --vcapture_times, and measures for each video frame the time from its
+// capture to its delivery: the wall clock time at which the verifier reads
+// the frame minus the capture time carried in the frame's BlockAdditional.
+// Run it on data as it arrives, for example piped from the HTTP client that
+// fetches each segment, on a host whose clock is synchronized with the
+// encoder host's, or with --clock_offset set to the difference.
+#include "encoder/encoder_base.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "encoder/webm_mux.h"
+
+namespace {
+
+// EBML IDs of the elements that lead to a capture time, and of the capture
+// time's elements. All other elements are skipped.
+const uint32 kEbmlSegmentId = 0x18538067;
+const uint32 kEbmlClusterId = 0x1F43B675;
+const uint32 kEbmlBlockGroupId = 0xA0;
+const uint32 kEbmlBlockAdditionsId = 0x75A1;
+const uint32 kEbmlBlockMoreId = 0xA6;
+const uint32 kEbmlBlockAddIdId = 0xEE;
+const uint32 kEbmlBlockAdditionalId = 0xA5;
+
+// Largest BlockAddID or BlockAdditional read; larger ones are skipped.
+const uint64 kMaxAdditionLength = 64;
+
+// Number of bytes read at once.
+const size_t kReadSize = 64 * 1024;
+
+int64 now_us() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Reads the EBML variable length integer at |ptr_data|. Returns its length,
+// 0 when more than |available| bytes are needed, or -1 when it is invalid.
+// |ptr_all_ones| is set when all value bits are 1: an unknown element size.
+// IDs keep their length marker bit, and sizes do not.
+int read_vint(const uint8* ptr_data, size_t available, bool keep_marker,
+              uint64* ptr_value, bool* ptr_all_ones) {
+  if (available == 0) {
+    return 0;
+  }
+  int length = 1;
+  uint8 marker = 0x80;
+  while (length <= 8 && !(ptr_data[0] & marker)) {
+    ++length;
+    marker >>= 1;
+  }
+  if (length > 8) {
+    return -1;
+  }
+  if (static_cast<size_t>(length) > available) {
+    return 0;
+  }
+  uint64 value = keep_marker ? ptr_data[0] : (ptr_data[0] & (marker - 1));
+  bool all_ones = (ptr_data[0] & (marker - 1)) == marker - 1;
+  for (int i = 1; i < length; ++i) {
+    value = (value << 8) | ptr_data[i];
+    all_ones = all_ones && ptr_data[i] == 0xff;
+  }
+  *ptr_value = value;
+  *ptr_all_ones = all_ones;
+  return length;
+}
+
+// Finds capture times in a WebM byte stream delivered in pieces. Descends
+// into the Segment, Cluster, BlockGroup, BlockAdditions and BlockMore
+// elements, whose sizes may be unknown, and skips all others without
+// buffering them.
+class CaptureTimeScanner {
+ public:
+  CaptureTimeScanner()
+      : position_(0),
+        skip_(0),
+        block_more_end_(-1),
+        add_id_(1),
+        have_additional_(false),
+        capture_time_(0) {}
+
+  // Parses |length| bytes from |ptr_data|, read at |arrival_time|, and
+  // appends the latency of each capture time completed to |ptr_latencies|,
+  // in microseconds. Returns false when the stream is not valid WebM.
+  bool Parse(const uint8* ptr_data, size_t length, int64 arrival_time,
+             std::vector<int64>* ptr_latencies) {
+    buffer_.insert(buffer_.end(), ptr_data, ptr_data + length);
+    size_t offset = 0;
+    for (;;) {
+      if (skip_ > 0) {
+        const uint64 skipped =
+            std::min(skip_, static_cast<uint64>(buffer_.size() - offset));
+        offset += static_cast<size_t>(skipped);
+        skip_ -= skipped;
+        if (skip_ > 0) {
+          break;
+        }
+        EndElement(position_ + offset, arrival_time, ptr_latencies);
+      }
+      const uint8* const ptr_element = buffer_.data() + offset;
+      const size_t available = buffer_.size() - offset;
+      uint64 id = 0;
+      uint64 size = 0;
+      bool unused = false;
+      bool unknown_size = false;
+      const int id_length =
+          read_vint(ptr_element, available, true, &id, &unused);
+      if (id_length < 0 || id_length > 4) {
+        return false;
+      } else if (id_length == 0) {
+        break;
+      }
+      const int size_length =
+          read_vint(ptr_element + id_length, available - id_length, false,
+                    &size, &unknown_size);
+      if (size_length < 0) {
+        return false;
+      } else if (size_length == 0) {
+        break;
+      }
+      const size_t header_length = id_length + size_length;
+
+      if (id == kEbmlSegmentId || id == kEbmlClusterId ||
+          id == kEbmlBlockGroupId || id == kEbmlBlockAdditionsId ||
+          id == kEbmlBlockMoreId) {
+        offset += header_length;
+        if (id == kEbmlBlockMoreId) {
+          if (unknown_size) {
+            return false;
+          }
+          block_more_end_ = position_ + offset + size;
+          add_id_ = 1;
+          have_additional_ = false;
+          EndElement(position_ + offset, arrival_time, ptr_latencies);
+        }
+        continue;
+      }
+      if (unknown_size) {
+        return false;
+      }
+      if ((id == kEbmlBlockAddIdId || id == kEbmlBlockAdditionalId) &&
+          block_more_end_ >= 0 && size <= kMaxAdditionLength) {
+        if (available < header_length + size) {
+          break;
+        }
+        uint64 value = 0;
+        for (uint64 i = 0; i < size; ++i) {
+          value = (value << 8) | ptr_element[header_length + i];
+        }
+        if (id == kEbmlBlockAddIdId) {
+          add_id_ = value;
+        } else {
+          have_additional_ =
+              size == webmlive::LiveWebmMuxer::kCaptureTimeLength;
+          capture_time_ = static_cast<int64>(value);
+        }
+        offset += header_length + static_cast<size_t>(size);
+        EndElement(position_ + offset, arrival_time, ptr_latencies);
+        continue;
+      }
+      offset += header_length;
+      skip_ = size;
+      if (skip_ == 0) {
+        EndElement(position_ + offset, arrival_time, ptr_latencies);
+      }
+    }
+    buffer_.erase(buffer_.begin(), buffer_.begin() + offset);
+    position_ += offset;
+    return true;
+  }
+
+ private:
+  // Completes the open BlockMore when |position| is its end.
+  void EndElement(int64 position, int64 arrival_time,
+                  std::vector<int64>* ptr_latencies) {
+    if (block_more_end_ < 0 || position < block_more_end_) {
+      return;
+    }
+    if (have_additional_ &&
+        add_id_ == webmlive::LiveWebmMuxer::kCaptureTimeAddId) {
+      ptr_latencies->push_back(arrival_time - capture_time_);
+    }
+    block_more_end_ = -1;
+  }
+
+  // Bytes not yet parsed, and the stream position of the first of them.
+  std::vector<uint8> buffer_;
+  int64 position_;
+
+  // Bytes of a skipped element not yet received.
+  uint64 skip_;
+
+  // Stream position at which the open BlockMore ends, or -1, and what it
+  // holds so far.
+  int64 block_more_end_;
+  uint64 add_id_;
+  bool have_additional_;
+  int64 capture_time_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(CaptureTimeScanner);
+};
+
+// Returns the |percentile| percent smallest of |sorted_values|.
+int64 percentile(const std::vector<int64>& sorted_values, double percentile) {
+  const size_t index = static_cast<size_t>(
+      (sorted_values.size() - 1) * percentile / 100 + 0.5);
+  return sorted_values[std::min(index, sorted_values.size() - 1)];
+}
+
+// Reads |file_name|, or stdin when it is "-", and appends the latency of each
+// capture time in it to |ptr_latencies|. Returns false upon failure.
+bool scan_file(const std::string& file_name, int64 clock_offset_us,
+               bool print_frames, std::vector<int64>* ptr_latencies) {
+  FILE* file = stdin;
+  if (file_name != "-") {
+    file = fopen(file_name.c_str(), "rb");
+    if (!file) {
+      fprintf(stderr, "cannot open %s\n", file_name.c_str());
+      return false;
+    }
+  }
+  CaptureTimeScanner scanner;
+  std::vector<uint8> data(kReadSize);
+  std::vector<int64> latencies;
+  bool ok = true;
+  size_t bytes_read = 0;
+  while (ok && (bytes_read = fread(&data[0], 1, data.size(), file)) > 0) {
+    ok = scanner.Parse(&data[0], bytes_read, now_us() + clock_offset_us,
+                       &latencies);
+  }
+  if (file != stdin) {
+    fclose(file);
+  }
+  if (!ok) {
+    fprintf(stderr, "%s: invalid WebM data\n", file_name.c_str());
+  }
+  for (size_t i = 0; i < latencies.size(); ++i) {
+    if (print_frames) {
+      printf("%s: frame latency %.1f ms\n", file_name.c_str(),
+             latencies[i] / 1000.0);
+    }
+    ptr_latencies->push_back(latencies[i]);
+  }
+  return ok;
+}
+
+void usage(const char** argv) {
+  printf("Usage: %s [options] <file|-> [<file> ...]\n", argv[0]);
+  printf("  Reads WebM segments or streams written with --vcapture_times,\n");
+  printf("  and reports the delay from capture to reading of each video\n");
+  printf("  frame. - reads stdin.\n");
+  printf("  Options:\n");
+  printf("    -h | --help                Show this message and exit.\n");
+  printf("    --clock_offset <ms>        Added to the local clock to match\n");
+  printf("                               the encoder host's.\n");
+  printf("    --print_frames             Print the latency of each frame.\n");
+}
+
+}  // namespace
+
+int main(int argc, const char** argv) {
+  std::vector<std::string> files;
+  int64 clock_offset_us = 0;
+  bool print_frames = false;
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp("--clock_offset", argv[i]) && i + 1 < argc) {
+      clock_offset_us = strtol(argv[++i], NULL, 10) * 1000LL;
+    } else if (!strcmp("--print_frames", argv[i])) {
+      print_frames = true;
+    } else if (!strcmp("-h", argv[i]) || !strcmp("--help", argv[i])) {
+      usage(argv);
+      return EXIT_SUCCESS;
+    } else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+      usage(argv);
+      return EXIT_FAILURE;
+    } else {
+      files.push_back(argv[i]);
+    }
+  }
+  if (files.empty()) {
+    usage(argv);
+    return EXIT_FAILURE;
+  }
+#ifdef _WIN32
+  _setmode(_fileno(stdin), _O_BINARY);
+#endif
+
+  std::vector<int64> latencies;
+  bool ok = true;
+  for (size_t i = 0; i < files.size(); ++i) {
+    ok = scan_file(files[i], clock_offset_us, print_frames, &latencies) && ok;
+  }
+  if (latencies.empty()) {
+    printf("no capture times found.\n");
+    return EXIT_FAILURE;
+  }
+  std::sort(latencies.begin(), latencies.end());
+  int64 sum = 0;
+  for (size_t i = 0; i < latencies.size(); ++i) {
+    sum += latencies[i];
+  }
+  printf("frames: %d latency (ms): min %.1f mean %.1f p50 %.1f p95 %.1f "
+         "max %.1f\n", static_cast<int>(latencies.size()),
+         latencies.front() / 1000.0,
+         static_cast<double>(sum) / latencies.size() / 1000.0,
+         percentile(latencies, 50) / 1000.0,
+         percentile(latencies, 95) / 1000.0, latencies.back() / 1000.0);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,268 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/linux/alsa_audio_capture.h"
+
+#include <alsa/asoundlib.h>
+#include <time.h>
+
+#include <algorithm>
+#include <new>
+#include <sstream>
+
+#include "encoder/log_util.h"
+#include "encoder/thread_util.h"
+#include "encoder/webm_encoder.h"
+#include "glog/logging.h"
+
+namespace webmlive {
+
+namespace {
+
+// Bytes per sample of the captured format, S16_LE.
+const int kBytesPerSample = 2;
+
+int64 MonotonicMicros() {
+  timespec now = {};
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return static_cast<int64>(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+}
+
+}  // namespace
+
+AlsaAudioCapture::AlsaAudioCapture()
+    : ptr_pcm_(NULL),
+      period_frames_(0),
+      start_time_us_(0),
+      anchor_time_us_(-1),
+      frames_since_anchor_(0),
+      storage_capacity_(0),
+      ptr_callback_(NULL),
+      stop_(false),
+      status_(kSuccess) {
+}
+
+AlsaAudioCapture::~AlsaAudioCapture() {
+  Stop();
+}
+
+int AlsaAudioCapture::Init(const std::string& device_name, int device_index,
+                           const AudioConfig& requested, int period_ms,
+                           AudioSamplesCallbackInterface* ptr_callback) {
+  if (!ptr_callback || period_ms < 0) {
+    LOG(ERROR) << "NULL audio callback, or negative period.";
+    return kInvalidArg;
+  }
+  Stop();
+  ptr_callback_ = ptr_callback;
+  std::string name = device_name;
+  if (name.empty()) {
+    std::ostringstream plughw;
+    plughw << "plughw:" << device_index;
+    name = device_index == kUseDefaultDevice ? "default" : plughw.str();
+  }
+  int result = snd_pcm_open(&ptr_pcm_, name.c_str(), SND_PCM_STREAM_CAPTURE,
+                            0);
+  if (result < 0) {
+    LOG(ERROR) << "cannot open ALSA device " << name << ": "
+               << snd_strerror(result);
+    ptr_pcm_ = NULL;
+    return kNoDevice;
+  }
+
+  snd_pcm_hw_params_t* ptr_params = NULL;
+  if (snd_pcm_hw_params_malloc(&ptr_params) < 0) {
+    Stop();
+    return kNoMemory;
+  }
+  unsigned int channels = requested.channels > 0 ? requested.channels : 2;
+  unsigned int sample_rate =
+      requested.sample_rate > 0 ? requested.sample_rate : 44100;
+  const int period = period_ms > 0 ? period_ms : kDefaultPeriodMs;
+  snd_pcm_uframes_t period_frames = sample_rate * period / kTimebase;
+  snd_pcm_uframes_t buffer_frames = period_frames * kPeriodsPerBuffer;
+  int dir = 0;
+  result = snd_pcm_hw_params_any(ptr_pcm_, ptr_params);
+  if (result >= 0) {
+    result = snd_pcm_hw_params_set_access(ptr_pcm_, ptr_params,
+                                          SND_PCM_ACCESS_RW_INTERLEAVED);
+  }
+  if (result >= 0) {
+    result = snd_pcm_hw_params_set_format(ptr_pcm_, ptr_params,
+                                          SND_PCM_FORMAT_S16_LE);
+  }
+  if (result >= 0) {
+    result = snd_pcm_hw_params_set_channels_near(ptr_pcm_, ptr_params,
+                                                 &channels);
+  }
+  if (result >= 0) {
+    result = snd_pcm_hw_params_set_rate_near(ptr_pcm_, ptr_params,
+                                             &sample_rate, &dir);
+  }
+  if (result >= 0) {
+    result = snd_pcm_hw_params_set_period_size_near(ptr_pcm_, ptr_params,
+                                                    &period_frames, &dir);
+  }
+  if (result >= 0) {
+    result = snd_pcm_hw_params_set_buffer_size_near(ptr_pcm_, ptr_params,
+                                                    &buffer_frames);
+  }
+  if (result >= 0) {
+    result = snd_pcm_hw_params(ptr_pcm_, ptr_params);
+  }
+  snd_pcm_hw_params_free(ptr_params);
+  if (result < 0 || period_frames == 0) {
+    LOG(ERROR) << "cannot configure ALSA device " << name << ": "
+               << snd_strerror(result);
+    Stop();
+    return kDeviceError;
+  }
+
+  actual_config_ = AudioConfig();
+  actual_config_.format_tag = kAudioFormatPcm;
+  actual_config_.channels = static_cast<uint16>(channels);
+  actual_config_.sample_rate = sample_rate;
+  actual_config_.bits_per_sample = kBytesPerSample * 8;
+  actual_config_.valid_bits_per_sample = actual_config_.bits_per_sample;
+  actual_config_.block_align =
+      static_cast<uint16>(channels * kBytesPerSample);
+  actual_config_.bytes_per_second =
+      sample_rate * actual_config_.block_align;
+  period_frames_ = static_cast<int32>(period_frames);
+  const int32 period_size = period_frames_ * actual_config_.block_align;
+  if (storage_capacity_ < period_size) {
+    storage_ = AllocateMediaBuffer(std::shared_ptr<MediaArena>(),
+                                   period_size, &storage_capacity_);
+    if (!storage_) {
+      storage_capacity_ = 0;
+      Stop();
+      return kNoMemory;
+    }
+  }
+  LOG(INFO) << "ALSA capture from " << name << ": " << channels
+            << " channels at " << sample_rate << " Hz, periods of "
+            << period_frames_ << " frames.";
+  return kSuccess;
+}
+
+int AlsaAudioCapture::Run(int64 start_time_us) {
+  if (!ptr_pcm_ || thread_) {
+    LOG(ERROR) << "ALSA capture not initialized, or already running.";
+    return kDeviceError;
+  }
+  start_time_us_ = start_time_us;
+  anchor_time_us_ = -1;
+  frames_since_anchor_ = 0;
+  int result = snd_pcm_prepare(ptr_pcm_);
+  if (result >= 0) {
+    result = snd_pcm_start(ptr_pcm_);
+  }
+  if (result < 0) {
+    LOG(ERROR) << "cannot start ALSA capture: " << snd_strerror(result);
+    return kDeviceError;
+  }
+  stop_ = false;
+  status_ = kSuccess;
+  thread_.reset(new (std::nothrow) std::thread(  // NOLINT
+      &AlsaAudioCapture::CaptureThread, this));
+  if (!thread_) {
+    LOG(ERROR) << "out of memory.";
+    return kNoMemory;
+  }
+  return kSuccess;
+}
+
+void AlsaAudioCapture::Stop() {
+  stop_ = true;
+  if (thread_) {
+    thread_->join();
+    thread_.reset();
+  }
+  if (ptr_pcm_) {
+    snd_pcm_drop(ptr_pcm_);
+    snd_pcm_close(ptr_pcm_);
+    ptr_pcm_ = NULL;
+  }
+}
+
+void AlsaAudioCapture::CaptureThread() {
+  ScopedThreadRegistration registration("audio_capture");
+  while (!stop_) {
+    const int ready = snd_pcm_wait(ptr_pcm_, kWaitTimeoutMs);
+    if (ready == 0) {
+      continue;
+    }
+    if (ready < 0 && snd_pcm_recover(ptr_pcm_, ready, 1) < 0) {
+      LOG(ERROR) << "ALSA wait failed: " << snd_strerror(ready);
+      status_ = kDeviceError;
+      break;
+    }
+    if (ReadPeriod()) {
+      status_ = kDeviceError;
+      break;
+    }
+  }
+}
+
+int AlsaAudioCapture::ReadPeriod() {
+  const int32 period_size = period_frames_ * actual_config_.block_align;
+  if (storage_capacity_ < period_size) {
+    storage_ = AllocateMediaBuffer(std::shared_ptr<MediaArena>(),
+                                   period_size, &storage_capacity_);
+    if (!storage_) {
+      LOG(ERROR) << "cannot allocate audio capture storage.";
+      storage_capacity_ = 0;
+      return kNoMemory;
+    }
+  }
+  const snd_pcm_sframes_t frames =
+      snd_pcm_readi(ptr_pcm_, storage_.get(), period_frames_);
+  if (frames < 0) {
+    // Samples were lost: restart the device and the timestamps with it.
+    WEBMLIVE_LOG_EVERY_MS(WARNING, kLogIntervalMs)
+        << "ALSA capture overrun: " << snd_strerror(frames);
+    anchor_time_us_ = -1;
+    frames_since_anchor_ = 0;
+    return snd_pcm_recover(ptr_pcm_, static_cast<int>(frames), 1) < 0 ?
+        kDeviceError : kSuccess;
+  }
+  if (frames == 0) {
+    return kSuccess;
+  }
+  const int64 sample_rate = actual_config_.sample_rate;
+  if (anchor_time_us_ < 0) {
+    // The first sample was captured |frames| plus the frames still
+    // buffered ago.
+    snd_pcm_sframes_t delay = 0;
+    if (snd_pcm_delay(ptr_pcm_, &delay) < 0) {
+      delay = 0;
+    }
+    anchor_time_us_ =
+        MonotonicMicros() - (frames + delay) * 1000000 / sample_rate;
+  }
+  const int64 timestamp =
+      std::max<int64>(0, (anchor_time_us_ - start_time_us_ +
+                          frames_since_anchor_ * 1000000 / sample_rate) /
+                         1000);
+  const int64 duration = frames * kTimebase / sample_rate;
+  frames_since_anchor_ += frames;
+  const int status = buffer_.InitFromStorage(
+      actual_config_, timestamp, duration, &storage_, &storage_capacity_,
+      static_cast<int32>(frames * actual_config_.block_align));
+  if (status) {
+    LOG(ERROR) << "audio buffer init failed: " << status;
+    return kDeviceError;
+  }
+  const int samples_status = ptr_callback_->OnSamplesReceived(&buffer_);
+  if (samples_status) {
+    WEBMLIVE_LOG_EVERY_MS(WARNING, kLogIntervalMs)
+        << "OnSamplesReceived failed: " << samples_status;
+  }
+  return kSuccess;
+}
+
+}  // namespace webmlive
@@ -0,0 +1,116 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_LINUX_ALSA_AUDIO_CAPTURE_H_
+#define WEBMLIVE_ENCODER_LINUX_ALSA_AUDIO_CAPTURE_H_
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "encoder/audio_encoder.h"
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+#include "encoder/media_arena.h"
+
+typedef struct _snd_pcm snd_pcm_t;
+
+namespace webmlive {
+
+// Audio capture from an ALSA PCM device, in 16 bit interleaved PCM. On hosts
+// running PipeWire or PulseAudio, their ALSA plugins make the "default"
+// device capture from the sound server.
+//
+// Each period is read into storage that |AudioBuffer::InitFromStorage()|
+// takes without copying, and the storage the buffer held is read into next.
+//
+// Notes:
+// - Timestamps are milliseconds on the monotonic clock since the start time
+//   passed to |Run()|. They follow the sample count from the first period,
+//   and are anchored again when the device overruns and samples are lost.
+// - Buffers are delivered on the capture thread.
+class AlsaAudioCapture {
+ public:
+  enum {
+    kDeviceError = -4,
+    kNoDevice = -3,
+    kNoMemory = -2,
+    kInvalidArg = -1,
+    kSuccess = 0,
+  };
+
+  // Period length when none is requested, in milliseconds.
+  static const int kDefaultPeriodMs = 20;
+
+  // Number of periods the device buffers.
+  static const int kPeriodsPerBuffer = 4;
+
+  // Longest time the capture thread waits for a period before checking for
+  // |Stop()|, in milliseconds.
+  static const int kWaitTimeoutMs = 100;
+
+  AlsaAudioCapture();
+  ~AlsaAudioCapture();
+
+  // Opens the PCM |device_name|, such as "default" or "hw:1,0", or when
+  // |device_name| is empty the card at |device_index| through the "plughw"
+  // plugin, and "default" for |kUseDefaultDevice|. Sets the channel count
+  // and sample rate closest to |requested|, and periods of |period_ms|, or
+  // |kDefaultPeriodMs| when 0. Returns |kSuccess|, |kNoDevice| when the
+  // device cannot be opened, |kDeviceError| when it cannot be configured, or
+  // |kInvalidArg| when |ptr_callback| is NULL or |period_ms| is negative.
+  int Init(const std::string& device_name, int device_index,
+           const AudioConfig& requested, int period_ms,
+           AudioSamplesCallbackInterface* ptr_callback);
+
+  // Starts capture and the capture thread. |start_time_us| is the monotonic
+  // time, in microseconds, of timestamp 0. Returns |kSuccess| or
+  // |kDeviceError|.
+  int Run(int64 start_time_us);
+
+  // Stops the capture thread, and closes the device.
+  void Stop();
+
+  // Returns |kSuccess| while samples are captured, or |kDeviceError| once
+  // the device failed.
+  int status() const { return status_; }
+
+  const AudioConfig& actual_config() const { return actual_config_; }
+
+ private:
+  // Reads and delivers periods until |stop_| is set or the device fails.
+  void CaptureThread();
+
+  // Reads one period into |storage_| and delivers it. Returns |kSuccess|,
+  // also when the device overran and was restarted, or |kDeviceError|.
+  int ReadPeriod();
+
+  snd_pcm_t* ptr_pcm_;
+  AudioConfig actual_config_;
+  int32 period_frames_;
+  int64 start_time_us_;
+
+  // Timestamp, in microseconds, of the first sample read since the device
+  // started or last overran, and the number of frames read since.
+  int64 anchor_time_us_;
+  int64 frames_since_anchor_;
+
+  MediaBuffer storage_;
+  int32 storage_capacity_;
+  AudioBuffer buffer_;
+
+  AudioSamplesCallbackInterface* ptr_callback_;
+  std::atomic<bool> stop_;
+  std::atomic<int> status_;
+  std::unique_ptr<std::thread> thread_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(AlsaAudioCapture);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_LINUX_ALSA_AUDIO_CAPTURE_H_
@@ -0,0 +1,138 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/linux/media_source_linux.h"
+
+#include <time.h>
+
+#include "glog/logging.h"
+
+namespace webmlive {
+
+MediaSourceImpl::MediaSourceImpl()
+    : audio_enabled_(false),
+      video_enabled_(false),
+      start_time_us_(-1),
+      ptr_audio_callback_(NULL),
+      ptr_video_callback_(NULL) {
+}
+
+MediaSourceImpl::~MediaSourceImpl() {
+  Stop();
+}
+
+int MediaSourceImpl::Init(const WebmEncoderConfig& config,
+                          AudioSamplesCallbackInterface* ptr_audio_callback,
+                          VideoFrameCallbackInterface* ptr_video_callback) {
+  if (config.disable_audio && config.disable_video) {
+    LOG(ERROR) << "audio and video disabled.";
+    return WebmEncoder::kInvalidArg;
+  }
+  if (!config.disable_video &&
+      config.video_source != WebmEncoderConfig::kVideoSourceDevice) {
+    LOG(ERROR) << "only V4L2 devices capture video on Linux.";
+    return WebmEncoder::kNotImplemented;
+  }
+  if (!config.video_cameras.empty()) {
+    LOG(ERROR) << "additional cameras are not supported on Linux.";
+    return WebmEncoder::kNotImplemented;
+  }
+  config_ = config;
+  video_enabled_ = !config.disable_video;
+  audio_enabled_ = !config.disable_audio;
+  ptr_audio_callback_ = ptr_audio_callback;
+  ptr_video_callback_ = ptr_video_callback;
+  return OpenDevices();
+}
+
+int MediaSourceImpl::OpenDevices() {
+  if (video_enabled_) {
+    const int status = video_capture_.Init(
+        config_.video_device_name, config_.video_device_index,
+        config_.requested_video_config, ptr_video_callback_);
+    if (status == V4l2VideoCapture::kNoDevice) {
+      return WebmEncoder::kNoVideoSource;
+    } else if (status) {
+      LOG(ERROR) << "V4L2 capture Init failed: " << status;
+      return WebmEncoder::kVideoConfigureError;
+    }
+  }
+  if (audio_enabled_) {
+    const int status = audio_capture_.Init(
+        config_.audio_device_name, config_.audio_device_index,
+        config_.requested_audio_config, config_.audio_buffer_period,
+        ptr_audio_callback_);
+    if (status == AlsaAudioCapture::kNoDevice) {
+      return WebmEncoder::kNoAudioSource;
+    } else if (status) {
+      LOG(ERROR) << "ALSA capture Init failed: " << status;
+      return WebmEncoder::kAudioConfigureError;
+    }
+  }
+  return WebmEncoder::kSuccess;
+}
+
+int MediaSourceImpl::Run() {
+  if (start_time_us_ < 0) {
+    timespec now = {};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    start_time_us_ =
+        static_cast<int64>(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+  }
+  if (video_enabled_ && video_capture_.Run(start_time_us_)) {
+    LOG(ERROR) << "V4L2 capture Run failed, cannot run capture!";
+    return WebmEncoder::kRunFailed;
+  }
+  if (audio_enabled_ && audio_capture_.Run(start_time_us_)) {
+    LOG(ERROR) << "ALSA capture Run failed, cannot run capture!";
+    video_capture_.Stop();
+    return WebmEncoder::kRunFailed;
+  }
+  return WebmEncoder::kSuccess;
+}
+
+int MediaSourceImpl::CheckStatus() {
+  if ((video_enabled_ && video_capture_.status()) ||
+      (audio_enabled_ && audio_capture_.status())) {
+    LOG(ERROR) << "Capture device stopped!";
+    return WebmEncoder::kAVCaptureStopped;
+  }
+  return WebmEncoder::kSuccess;
+}
+
+void MediaSourceImpl::Stop() {
+  video_capture_.Stop();
+  audio_capture_.Stop();
+}
+
+// The devices must come back with the settings they had: the encoders were
+// configured for them.
+int MediaSourceImpl::Restart() {
+  const AudioConfig audio_config = audio_capture_.actual_config();
+  const VideoConfig video_config = video_capture_.actual_config();
+  Stop();
+  int status = OpenDevices();
+  if (status == WebmEncoder::kSuccess &&
+      (audio_config.channels != audio_capture_.actual_config().channels ||
+       audio_config.sample_rate !=
+           audio_capture_.actual_config().sample_rate ||
+       video_config.format != video_capture_.actual_config().format ||
+       video_config.width != video_capture_.actual_config().width ||
+       video_config.height != video_capture_.actual_config().height)) {
+    LOG(ERROR) << "capture devices restarted with different settings.";
+    status = WebmEncoder::kAVCaptureStopped;
+  }
+  if (status == WebmEncoder::kSuccess) {
+    status = Run();
+  }
+  if (status) {
+    Stop();
+  }
+  return status;
+}
+
+}  // namespace webmlive
@@ -0,0 +1,90 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_LINUX_MEDIA_SOURCE_LINUX_H_
+#define WEBMLIVE_ENCODER_LINUX_MEDIA_SOURCE_LINUX_H_
+
+#include "encoder/audio_encoder.h"
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+#include "encoder/linux/alsa_audio_capture.h"
+#include "encoder/linux/v4l2_video_capture.h"
+#include "encoder/media_source.h"
+#include "encoder/video_encoder.h"
+#include "encoder/webm_encoder.h"
+
+namespace webmlive {
+
+// Capture devices of Linux hosts: video from a V4L2 device, and audio from
+// an ALSA device, selected like the DirectShow devices by the device names
+// and indexes of |WebmEncoderConfig|. Both streams are timestamped against
+// the monotonic clock from the same start time.
+//
+// Notes:
+// - Additional cameras and desktop capture are not supported.
+// - |Restart()| keeps the start time, so that timestamps continue.
+class MediaSourceImpl : public MediaSourceInterface {
+ public:
+  MediaSourceImpl();
+  virtual ~MediaSourceImpl();
+
+  // Opens and configures the devices of the streams |config| enables.
+  // Returns |kSuccess|, |WebmEncoder::kNoVideoSource| or
+  // |WebmEncoder::kNoAudioSource| when a device is missing,
+  // |WebmEncoder::kVideoConfigureError| or
+  // |WebmEncoder::kAudioConfigureError| when one cannot be configured, and
+  // |WebmEncoder::kNotImplemented| for sources other than a capture device.
+  virtual int Init(const WebmEncoderConfig& config,
+                   AudioSamplesCallbackInterface* ptr_audio_callback,
+                   VideoFrameCallbackInterface* ptr_video_callback);
+
+  // One V4L2 device is captured.
+  virtual int SetCameraCallback(int, VideoFrameCallbackInterface*) {
+    return WebmEncoder::kNotImplemented;
+  }
+
+  // Starts capture. Returns |kSuccess| or |WebmEncoder::kRunFailed|.
+  virtual int Run();
+
+  // Returns |WebmEncoder::kAVCaptureStopped| once a device failed.
+  virtual int CheckStatus();
+
+  virtual void Stop();
+
+  // Closes the devices and opens them again with the settings of |Init()|.
+  // Returns |WebmEncoder::kAVCaptureStopped| when they come back with other
+  // settings.
+  virtual int Restart();
+
+  virtual AudioConfig actual_audio_config() const {
+    return audio_capture_.actual_config();
+  }
+  virtual VideoConfig actual_video_config() const {
+    return video_capture_.actual_config();
+  }
+  virtual VideoConfig actual_camera_config(int) const {
+    return VideoConfig();
+  }
+
+ private:
+  // Opens the devices of |config_|.
+  int OpenDevices();
+
+  WebmEncoderConfig config_;
+  bool audio_enabled_;
+  bool video_enabled_;
+  int64 start_time_us_;
+  AlsaAudioCapture audio_capture_;
+  V4l2VideoCapture video_capture_;
+  AudioSamplesCallbackInterface* ptr_audio_callback_;
+  VideoFrameCallbackInterface* ptr_video_callback_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(MediaSourceImpl);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_LINUX_MEDIA_SOURCE_LINUX_H_
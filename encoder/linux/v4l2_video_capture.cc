@@ -0,0 +1,529 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/linux/v4l2_video_capture.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/videodev2.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include <sstream>
+
+#include "encoder/log_util.h"
+#include "encoder/thread_util.h"
+#include "encoder/webm_encoder.h"
+#include "glog/logging.h"
+
+namespace webmlive {
+
+namespace {
+
+// Capture formats, in order of preference: those libvpx accepts without
+// conversion first, and MJPEG, which must be decoded, last.
+struct V4l2Format {
+  uint32 pixel_format;
+  VideoFormat format;
+};
+const V4l2Format kV4l2Formats[] = {
+  {V4L2_PIX_FMT_YUV420, kVideoFormatI420},
+  {V4L2_PIX_FMT_NV12, kVideoFormatNV12},
+  {V4L2_PIX_FMT_YVU420, kVideoFormatYV12},
+  {V4L2_PIX_FMT_YUYV, kVideoFormatYUY2},
+  {V4L2_PIX_FMT_UYVY, kVideoFormatUYVY},
+  {V4L2_PIX_FMT_MJPEG, kVideoFormatMJPG},
+};
+const int kNumV4l2Formats = sizeof(kV4l2Formats) / sizeof(kV4l2Formats[0]);
+
+// Number of /dev/video* nodes searched for devices.
+const int kMaxDeviceNodes = 64;
+
+// Retries |request| on |fd| while it is interrupted by a signal.
+int Ioctl(int fd, unsigned long request, void* ptr_arg) {  // NOLINT
+  int result = 0;
+  do {
+    result = ioctl(fd, request, ptr_arg);
+  } while (result == -1 && errno == EINTR);
+  return result;
+}
+
+int64 MonotonicMicros() {
+  timespec now = {};
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return static_cast<int64>(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+}
+
+VideoFieldOrder FieldOrderFromV4l2(uint32 field) {
+  switch (field) {
+    case V4L2_FIELD_INTERLACED_TB:
+    case V4L2_FIELD_SEQ_TB:
+      return kVideoTopFieldFirst;
+    case V4L2_FIELD_INTERLACED_BT:
+    case V4L2_FIELD_SEQ_BT:
+      return kVideoBottomFieldFirst;
+    default:
+      return kVideoProgressive;
+  }
+}
+
+}  // namespace
+
+V4l2VideoCapture::V4l2VideoCapture()
+    : fd_(-1),
+      user_pointers_(false),
+      streaming_(false),
+      frame_size_(0),
+      frame_duration_(0),
+      start_time_us_(0),
+      ptr_callback_(NULL),
+      stop_(false),
+      status_(kSuccess) {
+}
+
+V4l2VideoCapture::~V4l2VideoCapture() {
+  Stop();
+}
+
+int V4l2VideoCapture::Init(const std::string& device_name, int device_index,
+                           const VideoConfig& requested,
+                           VideoFrameCallbackInterface* ptr_callback) {
+  if (!ptr_callback) {
+    LOG(ERROR) << "NULL video callback.";
+    return kInvalidArg;
+  }
+  Stop();
+  ptr_callback_ = ptr_callback;
+  int status = OpenDevice(device_name, device_index);
+  if (status) {
+    return status;
+  }
+  status = SetFormat(requested);
+  if (status) {
+    Stop();
+    return status;
+  }
+  conversion_plan_.reset();
+  if (VideoFrame::NeedsConversion(actual_config_.format) ||
+      actual_config_.format == kVideoFormatNV12) {
+    std::shared_ptr<VideoConversionPlan> plan =
+        std::make_shared<VideoConversionPlan>();
+    if (plan->Init(actual_config_) == VideoConversionPlan::kSuccess) {
+      conversion_plan_ = plan;
+    }
+  }
+  status = InitUserPointerBuffers();
+  if (status) {
+    LOG(INFO) << "user pointer streaming unavailable, mapping buffers.";
+    status = InitMappedBuffers();
+  }
+  if (status) {
+    Stop();
+    return status;
+  }
+  LOG(INFO) << "V4L2 capture " << actual_config_.width << "x"
+            << actual_config_.height << " format " << actual_config_.format
+            << " stride " << actual_config_.stride << " at "
+            << actual_config_.frame_rate << " fps, "
+            << (user_pointers_ ? "zero copy." : "memory mapped.");
+  return kSuccess;
+}
+
+int V4l2VideoCapture::Run(int64 start_time_us) {
+  if (fd_ < 0 || thread_) {
+    LOG(ERROR) << "V4L2 capture not initialized, or already running.";
+    return kDeviceError;
+  }
+  start_time_us_ = start_time_us;
+  v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  if (Ioctl(fd_, VIDIOC_STREAMON, &type)) {
+    PLOG(ERROR) << "VIDIOC_STREAMON failed";
+    return kDeviceError;
+  }
+  streaming_ = true;
+  stop_ = false;
+  status_ = kSuccess;
+  thread_.reset(new (std::nothrow) std::thread(  // NOLINT
+      &V4l2VideoCapture::CaptureThread, this));
+  if (!thread_) {
+    LOG(ERROR) << "out of memory.";
+    return kNoMemory;
+  }
+  return kSuccess;
+}
+
+void V4l2VideoCapture::Stop() {
+  stop_ = true;
+  if (thread_) {
+    thread_->join();
+    thread_.reset();
+  }
+  if (fd_ < 0) {
+    return;
+  }
+  if (streaming_) {
+    v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (Ioctl(fd_, VIDIOC_STREAMOFF, &type)) {
+      PLOG(WARNING) << "VIDIOC_STREAMOFF failed";
+    }
+    streaming_ = false;
+  }
+  FreeBuffers();
+  close(fd_);
+  fd_ = -1;
+}
+
+int V4l2VideoCapture::OpenCaptureDevice(const std::string& path,
+                                        std::string* ptr_card) {
+  const int fd = open(path.c_str(), O_RDWR | O_NONBLOCK);
+  if (fd < 0) {
+    return -1;
+  }
+  v4l2_capability capability;
+  memset(&capability, 0, sizeof(capability));
+  uint32 caps = 0;
+  if (!Ioctl(fd, VIDIOC_QUERYCAP, &capability)) {
+    caps = (capability.capabilities & V4L2_CAP_DEVICE_CAPS) ?
+        capability.device_caps : capability.capabilities;
+  }
+  if (!(caps & V4L2_CAP_VIDEO_CAPTURE) || !(caps & V4L2_CAP_STREAMING)) {
+    close(fd);
+    return -1;
+  }
+  *ptr_card = reinterpret_cast<const char*>(capability.card);
+  return fd;
+}
+
+int V4l2VideoCapture::OpenDevice(const std::string& device_name,
+                                 int device_index) {
+  std::string card;
+  if (!device_name.empty() && device_name[0] == '/') {
+    fd_ = OpenCaptureDevice(device_name, &card);
+  } else {
+    // Devices are counted in node order, skipping the nodes of drivers that
+    // do not capture, such as the metadata nodes of UVC cameras.
+    const int index = device_index == kUseDefaultDevice ? 0 : device_index;
+    int num_devices = 0;
+    for (int node = 0; fd_ < 0 && node < kMaxDeviceNodes; ++node) {
+      std::ostringstream path;
+      path << "/dev/video" << node;
+      const int fd = OpenCaptureDevice(path.str(), &card);
+      if (fd < 0) {
+        continue;
+      }
+      const bool match = device_name.empty() ? num_devices == index :
+                                               card == device_name;
+      ++num_devices;
+      if (match) {
+        fd_ = fd;
+      } else {
+        close(fd);
+      }
+    }
+  }
+  if (fd_ < 0) {
+    if (device_name.empty()) {
+      LOG(ERROR) << "no V4L2 capture device at index " << device_index;
+    } else {
+      LOG(ERROR) << "no V4L2 capture device " << device_name;
+    }
+    return kNoDevice;
+  }
+  LOG(INFO) << "opened V4L2 capture device " << card << ".";
+  return kSuccess;
+}
+
+int V4l2VideoCapture::SetFormat(const VideoConfig& requested) {
+  // Formats the device offers.
+  std::vector<uint32> device_formats;
+  v4l2_fmtdesc format_desc;
+  memset(&format_desc, 0, sizeof(format_desc));
+  format_desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  while (!Ioctl(fd_, VIDIOC_ENUM_FMT, &format_desc)) {
+    device_formats.push_back(format_desc.pixelformat);
+    ++format_desc.index;
+  }
+
+  v4l2_format current;
+  memset(&current, 0, sizeof(current));
+  current.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  if (Ioctl(fd_, VIDIOC_G_FMT, &current)) {
+    PLOG(ERROR) << "VIDIOC_G_FMT failed";
+    return kDeviceError;
+  }
+  frame_size_ = 0;
+  frame_duration_ = 0;
+
+  // The first pass takes only formats the driver sets to the requested size:
+  // cameras often offer large frames only as MJPEG, and would otherwise fall
+  // back to small raw frames.
+  const bool sized = requested.width > 0 && requested.height > 0;
+  for (int i = 0; i < 2 * kNumV4l2Formats; ++i) {
+    const bool exact_size = sized && i < kNumV4l2Formats;
+    const V4l2Format& candidate = kV4l2Formats[i % kNumV4l2Formats];
+    bool offered = false;
+    for (size_t j = 0; j < device_formats.size(); ++j) {
+      offered = offered || device_formats[j] == candidate.pixel_format;
+    }
+    const bool decodable =
+        !VideoFrame::NeedsConversion(candidate.format) ||
+        VideoConversionPlan::CanConvert(candidate.format);
+    if (!offered || !decodable) {
+      continue;
+    }
+    v4l2_format format = current;
+    format.fmt.pix.pixelformat = candidate.pixel_format;
+    format.fmt.pix.field = V4L2_FIELD_ANY;
+    if (requested.width > 0 && requested.height > 0) {
+      format.fmt.pix.width = requested.width;
+      format.fmt.pix.height = requested.height;
+    }
+    format.fmt.pix.bytesperline = 0;
+    if (Ioctl(fd_, VIDIOC_S_FMT, &format) ||
+        format.fmt.pix.pixelformat != candidate.pixel_format) {
+      continue;
+    }
+    // |VideoConfig| describes padded planar frames only with aligned planes,
+    // which drivers do not provide: padded planar formats are skipped.
+    const v4l2_pix_format& pix = format.fmt.pix;
+    const bool planar = candidate.format == kVideoFormatI420 ||
+                        candidate.format == kVideoFormatYV12 ||
+                        candidate.format == kVideoFormatNV12;
+    if (planar && pix.bytesperline != pix.width) {
+      LOG(INFO) << "skipping padded planar format " << candidate.format
+                << ".";
+      continue;
+    }
+    if (exact_size && (static_cast<int>(pix.width) != requested.width ||
+                       static_cast<int>(pix.height) != requested.height)) {
+      continue;
+    }
+    actual_config_ = VideoConfig();
+    actual_config_.format = candidate.format;
+    actual_config_.width = pix.width;
+    actual_config_.height = pix.height;
+    actual_config_.stride = pix.bytesperline;
+    actual_config_.uv_stride = 0;
+    actual_config_.field_order = FieldOrderFromV4l2(pix.field);
+    frame_size_ = pix.sizeimage;
+    break;
+  }
+  if (frame_size_ <= 0) {
+    LOG(ERROR) << "V4L2 device offers no supported format.";
+    return kDeviceError;
+  }
+
+  // Frame rate, when the driver lets it be set.
+  v4l2_streamparm parm;
+  memset(&parm, 0, sizeof(parm));
+  parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  if (!Ioctl(fd_, VIDIOC_G_PARM, &parm) && requested.frame_rate > 0 &&
+      (parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME)) {
+    parm.parm.capture.timeperframe.numerator = 1000;
+    parm.parm.capture.timeperframe.denominator =
+        static_cast<uint32>(requested.frame_rate * 1000);
+    if (Ioctl(fd_, VIDIOC_S_PARM, &parm)) {
+      PLOG(WARNING) << "VIDIOC_S_PARM failed";
+    }
+  }
+  const v4l2_fract& time_per_frame = parm.parm.capture.timeperframe;
+  if (time_per_frame.numerator > 0 && time_per_frame.denominator > 0) {
+    actual_config_.frame_rate =
+        static_cast<double>(time_per_frame.denominator) /
+        time_per_frame.numerator;
+    frame_duration_ = static_cast<int64>(kTimebase) *
+                      time_per_frame.numerator / time_per_frame.denominator;
+  }
+  return kSuccess;
+}
+
+int V4l2VideoCapture::InitUserPointerBuffers() {
+  v4l2_requestbuffers request;
+  memset(&request, 0, sizeof(request));
+  request.count = kNumBuffers;
+  request.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  request.memory = V4L2_MEMORY_USERPTR;
+  if (Ioctl(fd_, VIDIOC_REQBUFS, &request)) {
+    return kDeviceError;
+  }
+  user_pointers_ = true;
+  for (int i = 0; i < kNumBuffers; ++i) {
+    if (frames_[i].Reserve(frame_size_)) {
+      LOG(ERROR) << "cannot allocate capture frame " << i;
+      FreeBuffers();
+      return kNoMemory;
+    }
+    if (QueueBuffer(i)) {
+      FreeBuffers();
+      return kDeviceError;
+    }
+  }
+  return kSuccess;
+}
+
+int V4l2VideoCapture::InitMappedBuffers() {
+  v4l2_requestbuffers request;
+  memset(&request, 0, sizeof(request));
+  request.count = kNumBuffers;
+  request.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  request.memory = V4L2_MEMORY_MMAP;
+  if (Ioctl(fd_, VIDIOC_REQBUFS, &request) || request.count < 2) {
+    PLOG(ERROR) << "VIDIOC_REQBUFS failed";
+    return kDeviceError;
+  }
+  user_pointers_ = false;
+  for (uint32 i = 0; i < request.count; ++i) {
+    v4l2_buffer buffer;
+    memset(&buffer, 0, sizeof(buffer));
+    buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buffer.memory = V4L2_MEMORY_MMAP;
+    buffer.index = i;
+    if (Ioctl(fd_, VIDIOC_QUERYBUF, &buffer)) {
+      PLOG(ERROR) << "VIDIOC_QUERYBUF failed";
+      FreeBuffers();
+      return kDeviceError;
+    }
+    MappedBuffer mapped;
+    mapped.length = buffer.length;
+    mapped.ptr_data = mmap(NULL, buffer.length, PROT_READ | PROT_WRITE,
+                           MAP_SHARED, fd_, buffer.m.offset);
+    if (mapped.ptr_data == MAP_FAILED) {
+      PLOG(ERROR) << "cannot map capture buffer " << i;
+      FreeBuffers();
+      return kDeviceError;
+    }
+    mapped_buffers_.push_back(mapped);
+    if (QueueBuffer(i)) {
+      FreeBuffers();
+      return kDeviceError;
+    }
+  }
+  return kSuccess;
+}
+
+int V4l2VideoCapture::QueueBuffer(int index) {
+  v4l2_buffer buffer;
+  memset(&buffer, 0, sizeof(buffer));
+  buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  buffer.index = index;
+  if (user_pointers_) {
+    buffer.memory = V4L2_MEMORY_USERPTR;
+    buffer.m.userptr = reinterpret_cast<unsigned long>(  // NOLINT
+        frames_[index].buffer());
+    buffer.length = frame_size_;
+  } else {
+    buffer.memory = V4L2_MEMORY_MMAP;
+  }
+  if (Ioctl(fd_, VIDIOC_QBUF, &buffer)) {
+    PLOG(ERROR) << "VIDIOC_QBUF failed for buffer " << index;
+    return kDeviceError;
+  }
+  return kSuccess;
+}
+
+void V4l2VideoCapture::FreeBuffers() {
+  for (size_t i = 0; i < mapped_buffers_.size(); ++i) {
+    munmap(mapped_buffers_[i].ptr_data, mapped_buffers_[i].length);
+  }
+  mapped_buffers_.clear();
+  v4l2_requestbuffers request;
+  memset(&request, 0, sizeof(request));
+  request.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  request.memory = user_pointers_ ? V4L2_MEMORY_USERPTR : V4L2_MEMORY_MMAP;
+  Ioctl(fd_, VIDIOC_REQBUFS, &request);
+  user_pointers_ = false;
+}
+
+void V4l2VideoCapture::CaptureThread() {
+  ScopedThreadRegistration registration("video_capture");
+  while (!stop_) {
+    pollfd poll_fd = {fd_, POLLIN, 0};
+    const int ready = poll(&poll_fd, 1, kPollTimeoutMs);
+    if (ready < 0 && errno != EINTR) {
+      PLOG(ERROR) << "poll on V4L2 device failed";
+      status_ = kDeviceError;
+      break;
+    }
+    if (ready <= 0) {
+      continue;
+    }
+    v4l2_buffer buffer;
+    memset(&buffer, 0, sizeof(buffer));
+    buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buffer.memory = user_pointers_ ? V4L2_MEMORY_USERPTR : V4L2_MEMORY_MMAP;
+    if (Ioctl(fd_, VIDIOC_DQBUF, &buffer)) {
+      if (errno == EAGAIN) {
+        continue;
+      }
+      PLOG(ERROR) << "VIDIOC_DQBUF failed";
+      status_ = kDeviceError;
+      break;
+    }
+    if (buffer.flags & V4L2_BUF_FLAG_ERROR) {
+      WEBMLIVE_LOG_EVERY_MS(WARNING, kLogIntervalMs)
+          << "V4L2 device returned a corrupt frame.";
+      if (QueueBuffer(buffer.index)) {
+        status_ = kDeviceError;
+        break;
+      }
+      continue;
+    }
+    int64 capture_time_us = MonotonicMicros();
+    if ((buffer.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) ==
+        V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) {
+      capture_time_us =
+          static_cast<int64>(buffer.timestamp.tv_sec) * 1000000 +
+          buffer.timestamp.tv_usec;
+    }
+    if (DeliverFrame(buffer.index, buffer.bytesused, capture_time_us)) {
+      status_ = kDeviceError;
+      break;
+    }
+  }
+}
+
+int V4l2VideoCapture::DeliverFrame(int index, int32 length,
+                                   int64 capture_time_us) {
+  const int64 timestamp =
+      std::max<int64>(0, (capture_time_us - start_time_us_) / 1000);
+  VideoFrame* ptr_frame = user_pointers_ ? &frames_[index] : &frame_;
+  int status = VideoFrame::kSuccess;
+  if (user_pointers_) {
+    status = ptr_frame->InitInPlace(actual_config_,
+                                    true,  // always "keyframes"
+                                    timestamp, frame_duration_, length);
+  } else {
+    status = ptr_frame->InitNative(
+        actual_config_, true, timestamp, frame_duration_,
+        reinterpret_cast<const uint8*>(mapped_buffers_[index].ptr_data),
+        length);
+  }
+  if (status) {
+    LOG(ERROR) << "V4L2 frame init failed: " << status;
+    return kDeviceError;
+  }
+  ptr_frame->set_conversion_plan(conversion_plan_);
+  const int frame_status = ptr_callback_->OnVideoFrameReceived(ptr_frame);
+  if (frame_status && frame_status != VideoFrameCallbackInterface::kDropped) {
+    LOG(ERROR) << "OnVideoFrameReceived failed, status=" << frame_status;
+  }
+  // The callback may have swapped the frame's buffer; queue the buffer the
+  // frame now owns.
+  if (user_pointers_ && ptr_frame->Reserve(frame_size_)) {
+    LOG(ERROR) << "cannot allocate capture frame " << index;
+    return kNoMemory;
+  }
+  return QueueBuffer(index);
+}
+
+}  // namespace webmlive
@@ -0,0 +1,151 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_LINUX_V4L2_VIDEO_CAPTURE_H_
+#define WEBMLIVE_ENCODER_LINUX_V4L2_VIDEO_CAPTURE_H_
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+#include "encoder/video_encoder.h"
+
+namespace webmlive {
+
+// Video capture from a Video4Linux2 device with streaming I/O.
+//
+// Frames are captured with user pointer streaming into the buffers of
+// |VideoFrame|s, as |VideoFrameSample| does for DirectShow: the driver writes
+// a frame into the buffer of one of |frames_|, the frame is passed to the
+// callback, which swaps the buffer into its pool, and the buffer the frame
+// holds then is queued to the driver in its place. Frames are not copied.
+// Devices that do not support user pointers are streamed from memory mapped
+// driver buffers, and each frame is copied once, into |frame_|.
+//
+// Notes:
+// - Frames are delivered in the device's format, which is I420, NV12, YV12,
+//   YUYV or UYVY, preferred in that order. Compressed formats such as Motion
+//   JPEG are not supported.
+// - Timestamps are milliseconds on the monotonic clock since the start time
+//   passed to |Run()|.
+// - Frames are delivered on the capture thread.
+class V4l2VideoCapture {
+ public:
+  enum {
+    kDeviceError = -4,
+    kNoDevice = -3,
+    kNoMemory = -2,
+    kInvalidArg = -1,
+    kSuccess = 0,
+  };
+
+  // Number of buffers queued to the driver.
+  static const int kNumBuffers = 4;
+
+  // Longest time the capture thread waits for a frame before checking for
+  // |Stop()|, in milliseconds.
+  static const int kPollTimeoutMs = 100;
+
+  V4l2VideoCapture();
+  ~V4l2VideoCapture();
+
+  // Opens the device |device_name|, a path such as /dev/video0 or the card
+  // name its driver reports, or when |device_name| is empty the capture
+  // device at |device_index| among the /dev/video* devices, the first for
+  // |kUseDefaultDevice|. Sets the format closest to |requested|, and queues
+  // the capture buffers. Returns |kSuccess|, |kNoDevice| when no device
+  // matches, |kDeviceError| when the device has no usable format or cannot
+  // stream, or |kInvalidArg| when |ptr_callback| is NULL.
+  int Init(const std::string& device_name, int device_index,
+           const VideoConfig& requested,
+           VideoFrameCallbackInterface* ptr_callback);
+
+  // Starts streaming and the capture thread. |start_time_us| is the
+  // monotonic time, in microseconds, of timestamp 0. Returns |kSuccess| or
+  // |kDeviceError|.
+  int Run(int64 start_time_us);
+
+  // Stops the capture thread and streaming, and closes the device.
+  void Stop();
+
+  // Returns |kSuccess| while frames are captured, or |kDeviceError| once the
+  // device failed.
+  int status() const { return status_; }
+
+  const VideoConfig& actual_config() const { return actual_config_; }
+
+  // True when frames are captured into |VideoFrame| buffers.
+  bool zero_copy() const { return user_pointers_; }
+
+ private:
+  // Driver buffer of memory mapped streaming.
+  struct MappedBuffer {
+    void* ptr_data;
+    size_t length;
+  };
+
+  // Opens |path| when it is a video capture device that streams, and stores
+  // its card name in |ptr_card|. Returns the file descriptor, or -1.
+  static int OpenCaptureDevice(const std::string& path,
+                               std::string* ptr_card);
+
+  // Opens the device |Init()| describes in |fd_|.
+  int OpenDevice(const std::string& device_name, int device_index);
+
+  // Sets the first format of |kV4l2Formats| the device supports, at the size
+  // and frame rate closest to |requested|, and stores it in
+  // |actual_config_|.
+  int SetFormat(const VideoConfig& requested);
+
+  // Requests |kNumBuffers| driver buffers, and queues them.
+  int InitUserPointerBuffers();
+  int InitMappedBuffers();
+
+  // Queues buffer |index| to the driver.
+  int QueueBuffer(int index);
+
+  // Releases the driver buffers.
+  void FreeBuffers();
+
+  // Dequeues and delivers frames until |stop_| is set or the device fails.
+  void CaptureThread();
+
+  // Delivers the frame of |index| holding |length| bytes captured at
+  // |capture_time_us|, and queues the buffer again.
+  int DeliverFrame(int index, int32 length, int64 capture_time_us);
+
+  int fd_;
+  bool user_pointers_;
+  bool streaming_;
+  int32 frame_size_;
+  int64 frame_duration_;
+  int64 start_time_us_;
+  VideoConfig actual_config_;
+  std::shared_ptr<const VideoConversionPlan> conversion_plan_;
+
+  // Frames whose buffers are queued with user pointer streaming.
+  VideoFrame frames_[kNumBuffers];
+
+  // Driver buffers of memory mapped streaming, and the frame they are copied
+  // into.
+  std::vector<MappedBuffer> mapped_buffers_;
+  VideoFrame frame_;
+
+  VideoFrameCallbackInterface* ptr_callback_;
+  std::atomic<bool> stop_;
+  std::atomic<int> status_;
+  std::unique_ptr<std::thread> thread_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(V4l2VideoCapture);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_LINUX_V4L2_VIDEO_CAPTURE_H_
@@ -0,0 +1,192 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/log_util.h"
+
+#include <chrono>
+#include <functional>
+#include <new>
+#include <sstream>
+#include <utility>
+
+namespace webmlive {
+
+bool LogRateLimiter::Allow(int64 interval_ms) {
+  const int64 now = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  int64 next_log_time = next_log_time_.load(std::memory_order_relaxed);
+  if (now < next_log_time) {
+    return false;
+  }
+  // Only the thread that advances |next_log_time_| logs.
+  return next_log_time_.compare_exchange_strong(next_log_time,
+                                                now + interval_ms,
+                                                std::memory_order_relaxed);
+}
+
+AsyncLogger::SeverityLogger::SeverityLogger(AsyncLogger* ptr_owner,
+                                            int severity,
+                                            google::base::Logger* ptr_wrapped)
+    : ptr_owner_(ptr_owner),
+      severity_(severity),
+      ptr_wrapped_(ptr_wrapped) {
+}
+
+void AsyncLogger::SeverityLogger::Write(bool force_flush, time_t timestamp,
+                                        const char* message,
+                                        int message_len) {
+  ptr_owner_->Enqueue(severity_, force_flush, timestamp, message,
+                      message_len);
+}
+
+void AsyncLogger::SeverityLogger::Flush() {
+  ptr_owner_->Flush(severity_);
+}
+
+uint32 AsyncLogger::SeverityLogger::LogSize() {
+  return ptr_wrapped_->LogSize();
+}
+
+AsyncLogger::AsyncLogger()
+    : queued_bytes_(0),
+      messages_dropped_(0),
+      writing_(false),
+      stop_(false) {
+}
+
+AsyncLogger::~AsyncLogger() {
+  Stop();
+}
+
+int AsyncLogger::Init() {
+  if (thread_) {
+    LOG(ERROR) << "AsyncLogger already running.";
+    return kInvalidArg;
+  }
+  stop_ = false;
+  thread_.reset(
+      new (std::nothrow) std::thread(  // NOLINT
+          std::bind(&AsyncLogger::WriterThread, this)));
+  if (!thread_) {
+    LOG(ERROR) << "AsyncLogger cannot create writer thread.";
+    return kNoMemory;
+  }
+  for (int severity = 0; severity < kNumSeverities; ++severity) {
+    loggers_[severity].reset(
+        new (std::nothrow) SeverityLogger(  // NOLINT
+            this, severity, google::base::GetLogger(severity)));
+    if (!loggers_[severity]) {
+      LOG(ERROR) << "AsyncLogger out of memory.";
+      Stop();
+      return kNoMemory;
+    }
+    google::base::SetLogger(severity, loggers_[severity].get());
+  }
+  return kSuccess;
+}
+
+void AsyncLogger::Stop() {
+  // glog holds its own lock while calling loggers, and while replacing them,
+  // so no thread is inside a |SeverityLogger| once it has been replaced.
+  for (int severity = 0; severity < kNumSeverities; ++severity) {
+    if (loggers_[severity]) {
+      google::base::SetLogger(severity, loggers_[severity]->wrapped());
+    }
+  }
+  if (thread_) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    message_ready_.notify_one();
+    thread_->join();
+    thread_.reset();
+  }
+  for (int severity = 0; severity < kNumSeverities; ++severity) {
+    if (loggers_[severity]) {
+      loggers_[severity]->wrapped()->Flush();
+      loggers_[severity].reset();
+    }
+  }
+}
+
+void AsyncLogger::Enqueue(int severity, bool force_flush, time_t timestamp,
+                          const char* message, int message_len) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (queued_bytes_ + message_len > kMaxQueuedBytes) {
+      ++messages_dropped_;
+      return;
+    }
+    queue_.push_back(Message());
+    Message& queued = queue_.back();
+    queued.severity = severity;
+    queued.force_flush = force_flush;
+    queued.timestamp = timestamp;
+    queued.text.assign(message, message_len);
+    queued_bytes_ += message_len;
+  }
+  message_ready_.notify_one();
+}
+
+void AsyncLogger::Flush(int severity) {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!queue_.empty() || writing_) {
+      queue_empty_.wait(lock);
+    }
+  }
+  loggers_[severity]->wrapped()->Flush();
+}
+
+void AsyncLogger::WriterThread() {
+  std::deque<Message> batch;
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    while (!stop_ && queue_.empty()) {
+      message_ready_.wait(lock);
+    }
+    if (stop_ && queue_.empty()) {
+      break;
+    }
+
+    // Take the whole queue so producers wait only for the swap.
+    batch.swap(queue_);
+    queued_bytes_ = 0;
+    const int64 messages_dropped = messages_dropped_;
+    messages_dropped_ = 0;
+    writing_ = true;
+    lock.unlock();
+
+    for (size_t i = 0; i < batch.size(); ++i) {
+      const Message& message = batch[i];
+      loggers_[message.severity]->wrapped()->Write(
+          message.force_flush, message.timestamp, message.text.data(),
+          static_cast<int>(message.text.length()));
+    }
+    if (messages_dropped > 0) {
+      std::ostringstream notice;
+      notice << "AsyncLogger dropped " << messages_dropped
+             << " message(s).\n";
+      const std::string notice_text = notice.str();
+      loggers_[google::GLOG_INFO]->wrapped()->Write(
+          true, time(NULL), notice_text.data(),
+          static_cast<int>(notice_text.length()));
+    }
+    batch.clear();
+
+    lock.lock();
+    writing_ = false;
+    if (queue_.empty()) {
+      queue_empty_.notify_all();
+    }
+  }
+  writing_ = false;
+  queue_empty_.notify_all();
+}
+
+}  // namespace webmlive
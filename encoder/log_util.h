@@ -0,0 +1,178 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_LOG_UTIL_H_
+#define WEBMLIVE_ENCODER_LOG_UTIL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <ctime>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+#include "glog/logging.h"
+
+// Logging for code that runs once per frame or audio buffer. Messages are
+// compiled out unless |WEBMLIVE_HOT_PATH_LOGGING| is defined, and are then
+// sampled: only every |WEBMLIVE_HOT_LOG_INTERVAL|th message from each call
+// site is logged. Arguments are not evaluated for messages not logged.
+#ifndef WEBMLIVE_HOT_LOG_INTERVAL
+#define WEBMLIVE_HOT_LOG_INTERVAL 100
+#endif
+
+#ifdef WEBMLIVE_HOT_PATH_LOGGING
+#define WEBMLIVE_HOT_LOG(severity) \
+  LOG_IF(severity, ([]() -> bool { \
+      static webmlive::LogSampler sampler; \
+      return sampler.Sample(WEBMLIVE_HOT_LOG_INTERVAL); \
+    }()))
+#else
+#define WEBMLIVE_HOT_LOG(severity) LOG_IF(severity, false)
+#endif
+
+// Logs at most one message from the call site every |interval_ms|
+// milliseconds. Meant for drop and overrun warnings that can fire once per
+// frame when the encoder falls behind.
+#define WEBMLIVE_LOG_EVERY_MS(severity, interval_ms) \
+  LOG_IF(severity, ([](int64 interval) -> bool { \
+      static webmlive::LogRateLimiter limiter; \
+      return limiter.Allow(interval); \
+    }(interval_ms)))
+
+#define WEBMLIVE_LOG_ERROR_EVERY_MS(interval_ms) \
+  WEBMLIVE_LOG_EVERY_MS(ERROR, interval_ms)
+
+namespace webmlive {
+
+// Interval used for rate-limited warnings on the capture and encode paths.
+const int64 kLogIntervalMs = 1000;
+
+// Counts messages from a single call site. Thread safe.
+class LogSampler {
+ public:
+  LogSampler() : count_(0) {}
+
+  // Returns true for the first message, and every |interval|th one after.
+  bool Sample(int interval) {
+    return count_.fetch_add(1, std::memory_order_relaxed) % interval == 0;
+  }
+
+ private:
+  std::atomic<int64> count_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(LogSampler);
+};
+
+// Limits a single call site to one message per interval. Thread safe.
+class LogRateLimiter {
+ public:
+  LogRateLimiter() : next_log_time_(0) {}
+
+  // Returns true when |interval_ms| has elapsed since the last time |Allow|
+  // returned true.
+  bool Allow(int64 interval_ms);
+
+ private:
+  std::atomic<int64> next_log_time_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(LogRateLimiter);
+};
+
+// Moves glog's log file writes to a background thread. |Init| replaces the
+// INFO, WARNING and ERROR loggers with wrappers that copy each message into a
+// queue and return; the writer thread passes queued messages to the original
+// loggers. FATAL messages stay synchronous so they reach disk before the
+// process aborts. Output to stderr is done by glog itself and is unaffected.
+//
+// When the writer falls behind by more than |kMaxQueuedBytes|, messages are
+// dropped, and the number dropped is logged once the writer catches up.
+class AsyncLogger {
+ public:
+  enum {
+    kNoMemory = -2,
+    kInvalidArg = -1,
+    kSuccess = 0,
+  };
+
+  static const size_t kMaxQueuedBytes = 4 * 1024 * 1024;
+
+  AsyncLogger();
+  ~AsyncLogger();
+
+  // Installs the wrappers and starts the writer thread. Must be called after
+  // |google::InitGoogleLogging|.
+  int Init();
+
+  // Restores the original loggers, writes all queued messages, and stops the
+  // writer thread. Must be called before |google::ShutdownGoogleLogging|.
+  void Stop();
+
+ private:
+  // Logger installed for a single severity.
+  class SeverityLogger : public google::base::Logger {
+   public:
+    SeverityLogger(AsyncLogger* ptr_owner, int severity,
+                   google::base::Logger* ptr_wrapped);
+    virtual ~SeverityLogger() {}
+    virtual void Write(bool force_flush, time_t timestamp,
+                       const char* message, int message_len);
+    virtual void Flush();
+    virtual uint32 LogSize();
+    google::base::Logger* wrapped() const { return ptr_wrapped_; }
+
+   private:
+    AsyncLogger* const ptr_owner_;
+    const int severity_;
+    google::base::Logger* const ptr_wrapped_;
+    WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(SeverityLogger);
+  };
+
+  struct Message {
+    int severity;
+    bool force_flush;
+    time_t timestamp;
+    std::string text;
+  };
+
+  // Queues a message for |severity|'s logger.
+  void Enqueue(int severity, bool force_flush, time_t timestamp,
+               const char* message, int message_len);
+
+  // Waits until all queued messages are written, then flushes the logger for
+  // |severity|.
+  void Flush(int severity);
+
+  // Writes queued messages until |stop_| is set and the queue is empty.
+  void WriterThread();
+
+  static const int kNumSeverities = google::GLOG_FATAL;
+  std::unique_ptr<SeverityLogger> loggers_[kNumSeverities];
+
+  // Queued messages and their total size. Protected by |mutex_|.
+  std::deque<Message> queue_;
+  size_t queued_bytes_;
+
+  // Messages dropped since the last drop notice. Protected by |mutex_|.
+  int64 messages_dropped_;
+
+  // True while the writer thread is writing a batch. Protected by |mutex_|.
+  bool writing_;
+  bool stop_;
+
+  std::mutex mutex_;
+  std::condition_variable message_ready_;
+  std::condition_variable queue_empty_;
+  std::unique_ptr<std::thread> thread_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(AsyncLogger);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_LOG_UTIL_H_
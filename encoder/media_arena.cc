@@ -0,0 +1,393 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/media_arena.h"
+
+#if defined _MSC_VER
+#include <malloc.h>
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#elif defined(__linux__)
+#include <sys/mman.h>
+#endif
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+
+#include "encoder/allocation_tracker.h"
+#include "glog/logging.h"
+
+namespace webmlive {
+
+namespace {
+
+// Rounds |size| up to a multiple of |kMediaBufferAlignment|.
+int32 AlignSize(int32 size) {
+  return (size + kMediaBufferAlignment - 1) & ~(kMediaBufferAlignment - 1);
+}
+
+// Returns |size| bytes aligned to |kMediaBufferAlignment|, or NULL.
+uint8* AlignedAlloc(size_t size) {
+  // Media buffers bypass operator new; report them to the allocation check
+  // directly.
+  AllocationTracker::OnAllocation(size);
+#if defined _MSC_VER
+  return static_cast<uint8*>(_aligned_malloc(size, kMediaBufferAlignment));
+#else
+  void* ptr_buffer = NULL;
+  if (posix_memalign(&ptr_buffer, kMediaBufferAlignment, size)) {
+    return NULL;
+  }
+  return static_cast<uint8*>(ptr_buffer);
+#endif
+}
+
+void AlignedFree(uint8* ptr_buffer) {
+#if defined _MSC_VER
+  _aligned_free(ptr_buffer);
+#else
+  free(ptr_buffer);
+#endif
+}
+
+#if defined(__linux__)
+// Size of x86-64 and arm64 huge pages, used for transparent huge pages.
+const size_t kHugePageSize = 2 * 1024 * 1024;
+#endif
+
+// Returns the size of the large pages available to the process, or 0 when
+// there are none. On Windows the "Lock pages in memory" privilege must be
+// held by the user; it is enabled in the process token here.
+size_t QueryLargePageSize() {
+#ifdef _WIN32
+  HANDLE token = NULL;
+  if (!OpenProcessToken(GetCurrentProcess(),
+                        TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token)) {
+    LOG(WARNING) << "cannot open the process token, large pages disabled.";
+    return 0;
+  }
+  TOKEN_PRIVILEGES privileges = {0};
+  privileges.PrivilegeCount = 1;
+  privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+  // AdjustTokenPrivileges() succeeds without enabling privileges the user
+  // does not hold, and reports ERROR_NOT_ALL_ASSIGNED instead.
+  const bool enabled =
+      LookupPrivilegeValue(NULL, SE_LOCK_MEMORY_NAME,
+                           &privileges.Privileges[0].Luid) &&
+      AdjustTokenPrivileges(token, FALSE, &privileges, 0, NULL, NULL) &&
+      GetLastError() == ERROR_SUCCESS;
+  CloseHandle(token);
+  if (!enabled) {
+    LOG(WARNING) << "large pages require the \"Lock pages in memory\" "
+                 << "privilege, using normal pages.";
+    return 0;
+  }
+  return GetLargePageMinimum();
+#elif defined(__linux__)
+  // Slabs fall back to transparent huge pages when no hugetlbfs pages are
+  // reserved.
+  return kHugePageSize;
+#else
+  return 0;
+#endif
+}
+
+// Returns |QueryLargePageSize()|, which is queried once.
+size_t LargePageSize() {
+  static const size_t page_size = QueryLargePageSize();
+  return page_size;
+}
+
+// Returns |size| bytes of pages allocated with |flags| from the memory of
+// NUMA node |node|, or from anywhere when |node| is |NumaTopology::kNoNode|.
+// Returns NULL on failure.
+#ifdef _WIN32
+uint8* VirtualAllocOnNode(size_t size, DWORD flags, int node) {
+  if (node == NumaTopology::kNoNode) {
+    return static_cast<uint8*>(
+        VirtualAlloc(NULL, size, flags, PAGE_READWRITE));
+  }
+  return static_cast<uint8*>(
+      VirtualAllocExNuma(GetCurrentProcess(), NULL, size, flags,
+                         PAGE_READWRITE, static_cast<DWORD>(node)));
+}
+#endif
+
+// Returns |size| bytes of locked large pages, preferably from NUMA node
+// |node|, or NULL.
+uint8* LargePageAlloc(size_t size, int node) {
+#ifdef _WIN32
+  return VirtualAllocOnNode(size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES,
+                            node);
+#elif defined(__linux__) && defined(MAP_HUGETLB)
+  void* const ptr_pages = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                               -1, 0);
+  (void)node;
+  return ptr_pages == MAP_FAILED ? NULL : static_cast<uint8*>(ptr_pages);
+#else
+  (void)size;
+  (void)node;
+  return NULL;
+#endif
+}
+
+// Returns |size| bytes of normal pages from the memory of NUMA node |node|,
+// or NULL when the platform cannot place pages on a node.
+uint8* NodePageAlloc(size_t size, int node) {
+#ifdef _WIN32
+  return VirtualAllocOnNode(size, MEM_RESERVE | MEM_COMMIT, node);
+#else
+  (void)size;
+  (void)node;
+  return NULL;
+#endif
+}
+
+// Frees pages from |LargePageAlloc()| or |NodePageAlloc()|.
+void FreePages(uint8* ptr_pages, size_t size) {
+#ifdef _WIN32
+  (void)size;
+  VirtualFree(ptr_pages, 0, MEM_RELEASE);
+#elif defined(__linux__)
+  munmap(ptr_pages, size);
+#else
+  (void)ptr_pages;
+  (void)size;
+#endif
+}
+
+}  // namespace
+
+const int MediaArena::kMaxSizeClasses;
+
+void MediaBufferDeleter::operator()(uint8* ptr_buffer) const {
+  if (arena && size_class >= 0) {
+    arena->FreeBlock(ptr_buffer, size_class);
+  } else {
+    AlignedFree(ptr_buffer);
+  }
+}
+
+MediaBuffer AllocateMediaBuffer(const std::shared_ptr<MediaArena>& arena,
+                                int32 size, int32* ptr_capacity) {
+  MediaBuffer buffer;
+  int32 capacity = 0;
+  if (size > 0 &&
+      size <= std::numeric_limits<int32>::max() - kMediaBufferAlignment) {
+    const int size_class = arena ? arena->FindSizeClass(size) : -1;
+    if (size_class >= 0) {
+      MediaBufferDeleter deleter;
+      deleter.arena = arena;
+      deleter.size_class = size_class;
+      buffer = MediaBuffer(arena->AllocateBlock(size_class), deleter);
+      capacity = arena->classes_[size_class].block_size;
+    } else {
+      // Round the size up as well: SIMD code may read whole vectors at the
+      // end of the last row.
+      buffer.reset(AlignedAlloc(AlignSize(size)));
+      capacity = size;
+      if (arena && buffer) {
+        std::lock_guard<std::mutex> lock(arena->mutex_);
+        ++arena->stats_.heap_allocations;
+      }
+    }
+  }
+  if (ptr_capacity) {
+    *ptr_capacity = buffer ? capacity : 0;
+  }
+  return buffer;
+}
+
+MediaArena::MediaArena() : numa_node_(NumaTopology::kNoNode) {
+}
+
+MediaArena::~MediaArena() {
+  for (size_t i = 0; i < slabs_.size(); ++i) {
+    if (slabs_[i].backing == kSlabLargePages ||
+        slabs_[i].backing == kSlabNodePages) {
+      FreePages(slabs_[i].ptr_data, slabs_[i].size);
+    } else {
+      AlignedFree(slabs_[i].ptr_data);
+    }
+  }
+}
+
+int MediaArena::AddSizeClass(int32 block_size, int blocks_per_slab,
+                             bool large_pages) {
+  if (block_size <= 0 || blocks_per_slab <= 0 ||
+      block_size > std::numeric_limits<int32>::max() - kMediaBufferAlignment) {
+    LOG(ERROR) << "invalid MediaArena size class: block_size=" << block_size
+               << " blocks_per_slab=" << blocks_per_slab;
+    return kInvalidArg;
+  }
+  SizeClass size_class;
+  size_class.block_size = AlignSize(block_size);
+  size_class.blocks_per_slab = blocks_per_slab;
+  size_class.large_pages = large_pages;
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (size_t i = 0; i < classes_.size(); ++i) {
+    if (classes_[i].block_size == size_class.block_size) {
+      return kSuccess;
+    }
+  }
+  if (classes_.size() >= static_cast<size_t>(kMaxSizeClasses)) {
+    LOG(ERROR) << "MediaArena cannot add more than " << kMaxSizeClasses
+               << " size classes.";
+    return kInvalidArg;
+  }
+  classes_.push_back(size_class);
+  return kSuccess;
+}
+
+void MediaArena::GetStats(MediaArenaStats* ptr_stats) const {
+  if (ptr_stats) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    *ptr_stats = stats_;
+  }
+}
+
+int MediaArena::FindSizeClass(int32 size) const {
+  int size_class = -1;
+  for (size_t i = 0; i < classes_.size(); ++i) {
+    if (classes_[i].block_size >= size &&
+        (size_class < 0 ||
+         classes_[i].block_size < classes_[size_class].block_size)) {
+      size_class = static_cast<int>(i);
+    }
+  }
+  return size_class;
+}
+
+uint8* MediaArena::AllocateBlock(int size_class) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  SizeClass& block_class = classes_[size_class];
+  uint8* ptr_block = block_class.ptr_free_list;
+  if (ptr_block) {
+    memcpy(&block_class.ptr_free_list, ptr_block, sizeof(ptr_block));
+  } else {
+    if (block_class.ptr_next == block_class.ptr_end) {
+      // The slab is padded by one alignment unit: SIMD code may read whole
+      // vectors past the end of the last block.
+      const int64 slab_size =
+          static_cast<int64>(block_class.block_size) *
+          block_class.blocks_per_slab + kMediaBufferAlignment;
+      if (slab_size > std::numeric_limits<int32>::max()) {
+        LOG(ERROR) << "MediaArena slab of " << slab_size << " bytes too large.";
+        return NULL;
+      }
+      Slab slab;
+      if (!AllocateSlab(static_cast<size_t>(slab_size), block_class.large_pages,
+                        &slab)) {
+        LOG(ERROR) << "MediaArena cannot allocate a " << slab_size
+                   << " byte slab.";
+        return NULL;
+      }
+      slabs_.push_back(slab);
+      ++stats_.slabs;
+      stats_.slab_bytes += slab.size;
+      if (block_class.large_pages) {
+        LOG(INFO) << "MediaArena " << block_class.block_size << " byte blocks: "
+                  << slab.size << " byte slab in " << BackingName(slab.backing)
+                  << ".";
+      }
+
+      // Rounding up to whole large pages may leave room for more blocks.
+      const size_t num_blocks =
+          (slab.size - kMediaBufferAlignment) / block_class.block_size;
+      block_class.ptr_next = slab.ptr_data;
+      block_class.ptr_end = slab.ptr_data + num_blocks * block_class.block_size;
+    }
+    ptr_block = block_class.ptr_next;
+    block_class.ptr_next += block_class.block_size;
+  }
+  ++stats_.blocks_in_use;
+  stats_.bytes_in_use += block_class.block_size;
+  return ptr_block;
+}
+
+const char* MediaArena::BackingName(SlabBacking backing) {
+  switch (backing) {
+    case kSlabLargePages:
+      return "large pages";
+    case kSlabHugePages:
+      return "transparent huge pages";
+    case kSlabNodePages:
+      return "NUMA node pages";
+    case kSlabHeap:
+      break;
+  }
+  return "normal pages";
+}
+
+bool MediaArena::AllocateSlab(size_t size, bool large_pages, Slab* ptr_slab) {
+  ptr_slab->ptr_data = NULL;
+  ptr_slab->size = size;
+  ptr_slab->backing = kSlabHeap;
+  const size_t page_size = large_pages ? LargePageSize() : 0;
+  if (page_size > 0) {
+    const size_t rounded_size = (size + page_size - 1) / page_size * page_size;
+    uint8* const ptr_pages = LargePageAlloc(rounded_size, numa_node_);
+    if (ptr_pages) {
+      AllocationTracker::OnAllocation(rounded_size);
+      ptr_slab->ptr_data = ptr_pages;
+      ptr_slab->size = rounded_size;
+      ptr_slab->backing = kSlabLargePages;
+      stats_.large_page_bytes += rounded_size;
+#ifdef _WIN32
+      if (numa_node_ != NumaTopology::kNoNode) {
+        stats_.node_bytes += rounded_size;
+      }
+#endif
+      return true;
+    }
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    // No hugetlbfs pages are reserved: ask for transparent huge pages, which
+    // the kernel provides when it can assemble them.
+    AllocationTracker::OnAllocation(rounded_size);
+    void* ptr_data = NULL;
+    if (!posix_memalign(&ptr_data, kHugePageSize, rounded_size)) {
+      ptr_slab->ptr_data = static_cast<uint8*>(ptr_data);
+      ptr_slab->size = rounded_size;
+      if (!madvise(ptr_data, rounded_size, MADV_HUGEPAGE)) {
+        ptr_slab->backing = kSlabHugePages;
+        stats_.huge_page_bytes += rounded_size;
+        return true;
+      }
+      ++stats_.large_page_fallbacks;
+      return true;
+    }
+#endif
+    ++stats_.large_page_fallbacks;
+  } else if (large_pages) {
+    ++stats_.large_page_fallbacks;
+  }
+  if (numa_node_ != NumaTopology::kNoNode) {
+    uint8* const ptr_pages = NodePageAlloc(size, numa_node_);
+    if (ptr_pages) {
+      AllocationTracker::OnAllocation(size);
+      ptr_slab->ptr_data = ptr_pages;
+      ptr_slab->backing = kSlabNodePages;
+      stats_.node_bytes += size;
+      return true;
+    }
+  }
+  ptr_slab->ptr_data = AlignedAlloc(size);
+  return ptr_slab->ptr_data != NULL;
+}
+
+void MediaArena::FreeBlock(uint8* ptr_block, int size_class) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  SizeClass& block_class = classes_[size_class];
+  memcpy(ptr_block, &block_class.ptr_free_list, sizeof(ptr_block));
+  block_class.ptr_free_list = ptr_block;
+  --stats_.blocks_in_use;
+  stats_.bytes_in_use -= block_class.block_size;
+}
+
+}  // namespace webmlive
@@ -0,0 +1,213 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_MEDIA_ARENA_H_
+#define WEBMLIVE_ENCODER_MEDIA_ARENA_H_
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+#include "encoder/numa_topology.h"
+
+namespace webmlive {
+
+class MediaArena;
+
+// Alignment in bytes of media buffers, arena blocks and slabs.
+const int32 kMediaBufferAlignment = 64;
+
+// Frees |MediaBuffer| storage: arena blocks are returned to the free list of
+// their size class, and other buffers are freed with the aligned allocator.
+// The deleter holds a reference to the arena, so storage may outlive the
+// arena's owner.
+struct MediaBufferDeleter {
+  MediaBufferDeleter() : size_class(-1) {}
+  void operator()(uint8* ptr_buffer) const;
+
+  std::shared_ptr<MediaArena> arena;
+  int size_class;
+};
+
+// Storage of |VideoFrame| and |AudioBuffer| data.
+typedef std::unique_ptr<uint8[], MediaBufferDeleter> MediaBuffer;
+
+// Returns a |kMediaBufferAlignment| aligned buffer of at least |size| bytes
+// taken from |arena|, or from the heap when |arena| is NULL or has no size
+// class for |size|. Writes the usable size of the buffer to |ptr_capacity|.
+// Returns an empty buffer when |size| is not positive or allocation fails.
+MediaBuffer AllocateMediaBuffer(const std::shared_ptr<MediaArena>& arena,
+                                int32 size, int32* ptr_capacity);
+
+// Counters of a |MediaArena|, returned by |MediaArena::GetStats()|.
+struct MediaArenaStats {
+  MediaArenaStats()
+      : slabs(0),
+        slab_bytes(0),
+        large_page_bytes(0),
+        huge_page_bytes(0),
+        large_page_fallbacks(0),
+        node_bytes(0),
+        blocks_in_use(0),
+        bytes_in_use(0),
+        heap_allocations(0) {}
+
+  // Slabs allocated, and their total size.
+  int64 slabs;
+  int64 slab_bytes;
+
+  // Slab bytes backed by locked large pages, and by transparent huge pages,
+  // and the slabs of large page classes that got neither.
+  int64 large_page_bytes;
+  int64 huge_page_bytes;
+  int64 large_page_fallbacks;
+
+  // Slab bytes allocated from the memory of the arena's NUMA node.
+  int64 node_bytes;
+
+  // Blocks handed out and not yet freed, and their total size.
+  int64 blocks_in_use;
+  int64 bytes_in_use;
+
+  // Buffers larger than the largest size class, allocated from the heap.
+  int64 heap_allocations;
+};
+
+// Slab allocator for the media buffers of one |WebmEncoder|. Buffers are
+// taken from size classes matched to the stream's raw frame, compressed frame
+// and audio period sizes. Each class carves fixed size blocks out of slabs
+// allocated a few blocks at a time: allocation pops the class's free list, or
+// bumps a pointer through its newest slab, and only allocates from the heap
+// when the slab is used up. Freed blocks return to the free list, so memory
+// is reused at the same sizes instead of fragmenting the heap over long runs.
+// Slabs are released when the arena is destroyed, which happens once its
+// owner and every buffer taken from it are gone.
+//
+// Classes of large blocks, such as raw frames, can ask for slabs backed by
+// large pages, which spare the TLB misses of walking a frame in 4 KB pages:
+// on Windows locked large pages from VirtualAlloc(MEM_LARGE_PAGES), which need
+// the "Lock pages in memory" privilege; on Linux hugetlbfs pages from
+// mmap(MAP_HUGETLB), or transparent huge pages when none are reserved.
+// Slabs that get neither use normal pages; |MediaArenaStats| reports the
+// backing in use.
+//
+// An arena placed on a NUMA node allocates its slabs from the node's memory
+// on Windows, through VirtualAllocExNuma(), whichever thread first touches
+// them. Elsewhere slab pages land on the node of the thread that first
+// touches them.
+//
+// Notes:
+// - Size classes must be added before the arena is shared between threads.
+//   Allocation and freeing are thread safe.
+// - 32 classes at most: a few per stream.
+// - A request takes the smallest class that holds it; requests larger than
+//   every class go to the heap.
+class MediaArena {
+ public:
+  enum {
+    kInvalidArg = -1,
+    kSuccess = 0,
+  };
+
+  static const int kMaxSizeClasses = 32;
+
+  MediaArena();
+  ~MediaArena();
+
+  // Adds a class of |block_size| byte blocks, rounded up to
+  // |kMediaBufferAlignment|, carved from slabs of |blocks_per_slab| blocks.
+  // Slabs are backed by large pages when |large_pages| is true and the
+  // system grants them, and are then rounded up to whole large pages.
+  // Returns |kInvalidArg| when an argument is not positive, or when
+  // |kMaxSizeClasses| classes exist. A class of the same block size is not
+  // added twice.
+  int AddSizeClass(int32 block_size, int blocks_per_slab, bool large_pages);
+
+  // Allocates the slabs from the memory of NUMA node |node|, or where the
+  // system places them when |node| is |NumaTopology::kNoNode|, the default.
+  // Must be called before the first allocation.
+  void set_numa_node(int node) { numa_node_ = node; }
+  int numa_node() const { return numa_node_; }
+
+  // Copies the arena counters to |ptr_stats|. Thread safe.
+  void GetStats(MediaArenaStats* ptr_stats) const;
+
+ private:
+  friend struct MediaBufferDeleter;
+  friend MediaBuffer AllocateMediaBuffer(
+      const std::shared_ptr<MediaArena>& arena, int32 size,
+      int32* ptr_capacity);
+
+  struct SizeClass {
+    SizeClass()
+        : block_size(0),
+          blocks_per_slab(0),
+          large_pages(false),
+          ptr_free_list(NULL),
+          ptr_next(NULL),
+          ptr_end(NULL) {}
+    int32 block_size;
+    int blocks_per_slab;
+    bool large_pages;
+
+    // Freed blocks, each holding a pointer to the next, and the unused part
+    // of the newest slab.
+    uint8* ptr_free_list;
+    uint8* ptr_next;
+    uint8* ptr_end;
+  };
+
+  // Returns the index of the smallest class holding |size| bytes, or -1.
+  int FindSizeClass(int32 size) const;
+
+  // Returns a block of class |size_class|, or NULL when a slab cannot be
+  // allocated.
+  uint8* AllocateBlock(int size_class);
+
+  // Returns |ptr_block| to the free list of class |size_class|.
+  void FreeBlock(uint8* ptr_block, int size_class);
+
+  // Page backing of a slab.
+  enum SlabBacking {
+    kSlabHeap,
+    kSlabLargePages,
+    kSlabHugePages,
+
+    // Normal pages from the memory of |numa_node_|.
+    kSlabNodePages,
+  };
+  struct Slab {
+    uint8* ptr_data;
+    size_t size;
+    SlabBacking backing;
+  };
+
+  // Allocates a slab of at least |size| bytes, in large pages when
+  // |large_pages| is true and they are available. Returns false when no
+  // memory is available. Called with |mutex_| held.
+  bool AllocateSlab(size_t size, bool large_pages, Slab* ptr_slab);
+
+  // Returns a name for |backing|, for logging.
+  static const char* BackingName(SlabBacking backing);
+
+  // Classes in the order they were added; a block's class is its index.
+  // Free lists and slab pointers are protected by |mutex_|.
+  std::vector<SizeClass> classes_;
+
+  // Slabs, freed by the destructor. Protected by |mutex_|, as is |stats_|.
+  std::vector<Slab> slabs_;
+  MediaArenaStats stats_;
+  int numa_node_;
+  mutable std::mutex mutex_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(MediaArena);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_MEDIA_ARENA_H_
@@ -0,0 +1,66 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_MEDIA_SOURCE_H_
+#define WEBMLIVE_ENCODER_MEDIA_SOURCE_H_
+
+#include "encoder/audio_encoder.h"
+#include "encoder/video_encoder.h"
+#include "encoder/webm_encoder.h"
+
+namespace webmlive {
+
+// Interface of the sources that feed |WebmEncoder|: capture devices, and
+// media files.
+class MediaSourceInterface {
+ public:
+  virtual ~MediaSourceInterface() {}
+
+  // Prepares the source for the streams |config| enables. Samples are passed
+  // to |ptr_audio_callback| and |ptr_video_callback| once |Run| is called.
+  // Returns |kSuccess| upon success, or a |WebmEncoder| status code upon
+  // failure.
+  virtual int Init(const WebmEncoderConfig& config,
+                   AudioSamplesCallbackInterface* ptr_audio_callback,
+                   VideoFrameCallbackInterface* ptr_video_callback) = 0;
+
+  // Sets the callback receiving the frames of |config.video_cameras[camera]|
+  // of the config later passed to |Init|. Must be called before |Init|.
+  // Returns |WebmEncoder::kNotImplemented| when the source captures a single
+  // video stream.
+  virtual int SetCameraCallback(int camera,
+                                VideoFrameCallbackInterface* ptr_callback) = 0;
+
+  // Starts delivery of samples. Returns |kSuccess| upon success, or a
+  // |WebmEncoder| status code upon failure.
+  virtual int Run() = 0;
+
+  // Returns |kSuccess| while the source is running,
+  // |WebmEncoder::kAVCaptureEnded| once all input has been delivered, or a
+  // |WebmEncoder| error code when the source has stopped on its own.
+  virtual int CheckStatus() = 0;
+
+  // Stops delivery of samples.
+  virtual void Stop() = 0;
+
+  // Stops the source and starts it again with the settings of |Init|, after
+  // it stalled or stopped on its own. Returns |kSuccess| once it runs again,
+  // |WebmEncoder::kNotImplemented| when the source cannot restart, or a
+  // |WebmEncoder| error code.
+  virtual int Restart() = 0;
+
+  // Settings of the delivered samples.
+  virtual AudioConfig actual_audio_config() const = 0;
+  virtual VideoConfig actual_video_config() const = 0;
+
+  // Settings of the frames of camera |camera|, valid after |Init|.
+  virtual VideoConfig actual_camera_config(int camera) const = 0;
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_MEDIA_SOURCE_H_
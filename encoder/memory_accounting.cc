@@ -0,0 +1,99 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/memory_accounting.h"
+
+#include "glog/logging.h"
+
+namespace webmlive {
+
+const char* MemorySubsystemName(int subsystem) {
+  switch (subsystem) {
+    case kMemoryVideoInput:
+      return "video_input";
+    case kMemoryAudioInput:
+      return "audio_input";
+    case kMemoryScaler:
+      return "scaler";
+    case kMemoryVideoOutput:
+      return "video_output";
+    case kMemoryAudioOutput:
+      return "audio_output";
+    case kMemoryMuxer:
+      return "muxer";
+    case kMemorySinkQueue:
+      return "sink_queue";
+    case kMemoryUploader:
+      return "uploader";
+  }
+  return "unknown";
+}
+
+MemoryStats::MemoryStats() : total_bytes(0), peak_total_bytes(0) {
+  for (int i = 0; i < kNumMemorySubsystems; ++i) {
+    bytes[i] = 0;
+    peak_bytes[i] = 0;
+  }
+}
+
+MemoryAccountant::MemoryAccountant()
+    : total_bytes_(0), peak_total_bytes_(0) {
+  for (int i = 0; i < kNumMemorySubsystems; ++i) {
+    bytes_[i].store(0);
+    peak_bytes_[i].store(0);
+  }
+}
+
+MemoryAccountant::~MemoryAccountant() {
+}
+
+MemoryAccountant* MemoryAccountant::Instance() {
+  static MemoryAccountant accountant;
+  return &accountant;
+}
+
+void MemoryAccountant::Add(int subsystem, int64 bytes) {
+  if (subsystem < 0 || subsystem >= kNumMemorySubsystems) {
+    LOG(ERROR) << "invalid memory subsystem " << subsystem;
+    return;
+  }
+  if (bytes == 0) {
+    return;
+  }
+  const int64 subsystem_bytes =
+      bytes_[subsystem].fetch_add(bytes, std::memory_order_relaxed) + bytes;
+  const int64 total_bytes =
+      total_bytes_.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+  if (bytes > 0) {
+    UpdatePeak(&peak_bytes_[subsystem], subsystem_bytes);
+    UpdatePeak(&peak_total_bytes_, total_bytes);
+  }
+}
+
+void MemoryAccountant::GetStats(MemoryStats* ptr_stats) const {
+  if (!ptr_stats) {
+    return;
+  }
+  for (int i = 0; i < kNumMemorySubsystems; ++i) {
+    ptr_stats->bytes[i] = bytes_[i].load(std::memory_order_relaxed);
+    ptr_stats->peak_bytes[i] = peak_bytes_[i].load(std::memory_order_relaxed);
+  }
+  ptr_stats->total_bytes = total_bytes_.load(std::memory_order_relaxed);
+  ptr_stats->peak_total_bytes =
+      peak_total_bytes_.load(std::memory_order_relaxed);
+}
+
+void MemoryAccountant::UpdatePeak(std::atomic<int64>* ptr_peak,
+                                  int64 value) {
+  int64 peak = ptr_peak->load(std::memory_order_relaxed);
+  while (value > peak &&
+         !ptr_peak->compare_exchange_weak(peak, value,
+                                          std::memory_order_relaxed)) {
+  }
+}
+
+}  // namespace webmlive
@@ -0,0 +1,99 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_MEMORY_ACCOUNTING_H_
+#define WEBMLIVE_ENCODER_MEMORY_ACCOUNTING_H_
+
+#include <atomic>
+
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+
+namespace webmlive {
+
+// Parts of the pipeline that hold media data, in pipeline order.
+enum MemorySubsystem {
+  // Captured frames and audio buffers waiting for the encoders.
+  kMemoryVideoInput = 0,
+  kMemoryAudioInput = 1,
+
+  // Frames waiting for the rendition scaler and the rendition encoders.
+  kMemoryScaler = 2,
+
+  // Compressed frames and audio buffers waiting for the muxers.
+  kMemoryVideoOutput = 3,
+  kMemoryAudioOutput = 4,
+
+  // Chunk data buffered by the muxers: complete chunks not yet read, and the
+  // chunk being written.
+  kMemoryMuxer = 5,
+
+  // Muxed stream chunks waiting for the data sink.
+  kMemorySinkQueue = 6,
+
+  // Buffers queued in, or being sent by, the HTTP uploaders.
+  kMemoryUploader = 7,
+
+  kNumMemorySubsystems = 8,
+};
+
+// Returns a short name for |subsystem|, for logging.
+const char* MemorySubsystemName(int subsystem);
+
+struct MemoryStats {
+  MemoryStats();
+
+  // Bytes held by each subsystem now, and the most each has held at once.
+  int64 bytes[kNumMemorySubsystems];
+  int64 peak_bytes[kNumMemorySubsystems];
+
+  // Bytes held by all subsystems now, and the most held at once.
+  int64 total_bytes;
+  int64 peak_total_bytes;
+};
+
+// Accounts for the media data held by each |MemorySubsystem| of the process.
+// Subsystems report the bytes they take and release with |Add()|, which
+// takes no lock: it updates the subsystem and total counters atomically, and
+// raises their peaks when they are exceeded.
+//
+// The accounting covers media data only: the buffers moving through the
+// pipeline, which grow with backlogs. The sizes of idle buffers kept for
+// reuse, and of the libraries' own state, are not counted.
+class MemoryAccountant {
+ public:
+  static MemoryAccountant* Instance();
+
+  // Adds |bytes|, negative when memory is released, to |subsystem|. Thread
+  // safe.
+  void Add(int subsystem, int64 bytes);
+
+  // Returns the bytes held by all subsystems. Thread safe.
+  int64 total_bytes() const {
+    return total_bytes_.load(std::memory_order_relaxed);
+  }
+
+  // Copies the counters to |ptr_stats|. Thread safe.
+  void GetStats(MemoryStats* ptr_stats) const;
+
+ private:
+  MemoryAccountant();
+  ~MemoryAccountant();
+
+  // Raises |ptr_peak| to |value| when |value| is larger.
+  static void UpdatePeak(std::atomic<int64>* ptr_peak, int64 value);
+
+  std::atomic<int64> bytes_[kNumMemorySubsystems];
+  std::atomic<int64> peak_bytes_[kNumMemorySubsystems];
+  std::atomic<int64> total_bytes_;
+  std::atomic<int64> peak_total_bytes_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(MemoryAccountant);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_MEMORY_ACCOUNTING_H_
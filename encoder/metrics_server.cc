@@ -0,0 +1,303 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/metrics_server.h"
+
+#include <cstring>
+#include <new>
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+#include "encoder/thread_util.h"
+#include "glog/logging.h"
+
+namespace {
+
+#ifdef _WIN32
+const SOCKET kInvalidSocket = INVALID_SOCKET;
+#else
+const int kInvalidSocket = -1;
+#endif
+
+// Limit on the size of request headers, in bytes.
+const size_t kMaxRequestLength = 4096;
+
+// Time |ServerThread()| waits for a connection before checking |stop_|, and
+// the longest time it waits for a client to send its request, in
+// milliseconds.
+const int kAcceptPollInterval = 200;
+const int kReceiveTimeout = 1000;
+
+// Significant digits of sample values; counters stay exact up to 10^15.
+const int kValuePrecision = 15;
+
+const char kHeaderEnd[] = "\r\n\r\n";
+const char kMetricsPath[] = "/metrics";
+
+}  // anonymous namespace
+
+namespace webmlive {
+
+///////////////////////////////////////////////////////////////////////////////
+// MetricsBuilder
+//
+
+MetricsBuilder::MetricsBuilder() {
+  text_.precision(kValuePrecision);
+}
+
+void MetricsBuilder::AddCounter(const std::string& name,
+                                const std::string& help,
+                                const std::string& labels, double value) {
+  AddSample(name, help, "counter", labels, value);
+}
+
+void MetricsBuilder::AddGauge(const std::string& name,
+                              const std::string& help,
+                              const std::string& labels, double value) {
+  AddSample(name, help, "gauge", labels, value);
+}
+
+void MetricsBuilder::AddSample(const std::string& name,
+                               const std::string& help, const char* type,
+                               const std::string& labels, double value) {
+  if (names_.insert(name).second) {
+    text_ << "# HELP " << name << " " << help << "\n"
+          << "# TYPE " << name << " " << type << "\n";
+  }
+  text_ << name;
+  if (!labels.empty()) {
+    text_ << "{" << labels << "}";
+  }
+  text_ << " " << value << "\n";
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// MetricsServer
+//
+
+MetricsServer::MetricsServer()
+    : listen_socket_(kInvalidSocket),
+      initialized_(false),
+      stop_(false),
+      published_page_(NULL),
+      requests_(0) {
+}
+
+MetricsServer::~MetricsServer() {
+  Stop();
+  delete published_page_.exchange(NULL);
+  if (listen_socket_ != kInvalidSocket) {
+    CloseSocket(listen_socket_);
+  }
+#ifdef _WIN32
+  if (initialized_) {
+    WSACleanup();
+  }
+#endif
+}
+
+int MetricsServer::Init(const MetricsServerSettings& settings) {
+  if (settings.port <= 0 || settings.port > 65535) {
+    LOG(ERROR) << "invalid metrics port: " << settings.port;
+    return kInvalidArg;
+  }
+  settings_ = settings;
+
+#ifdef _WIN32
+  WSADATA wsa_data;
+  if (WSAStartup(MAKEWORD(2, 2), &wsa_data)) {
+    LOG(ERROR) << "WSAStartup failed.";
+    return kSocketError;
+  }
+#endif
+  initialized_ = true;
+
+  listen_socket_ = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (listen_socket_ == kInvalidSocket) {
+    LOG(ERROR) << "cannot create metrics socket.";
+    return kSocketError;
+  }
+  const int reuse_address = 1;
+  setsockopt(listen_socket_, SOL_SOCKET, SO_REUSEADDR,
+             reinterpret_cast<const char*>(&reuse_address),
+             sizeof(reuse_address));
+
+  sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  address.sin_port = htons(static_cast<uint16>(settings_.port));
+  if (bind(listen_socket_, reinterpret_cast<const sockaddr*>(&address),
+           sizeof(address)) ||
+      listen(listen_socket_, SOMAXCONN)) {
+    LOG(ERROR) << "cannot listen on metrics port " << settings_.port;
+    return kSocketError;
+  }
+  LOG(INFO) << "metrics server listening on port " << settings_.port;
+  return kSuccess;
+}
+
+int MetricsServer::Run() {
+  if (listen_socket_ == kInvalidSocket || server_thread_) {
+    LOG(ERROR) << "metrics server not initialized, or already running.";
+    return kRunFailed;
+  }
+  stop_ = false;
+  server_thread_.reset(
+      new (std::nothrow) std::thread(  // NOLINT
+          &MetricsServer::ServerThread, this));
+  if (!server_thread_) {
+    LOG(ERROR) << "cannot construct metrics server thread.";
+    return kRunFailed;
+  }
+  return kSuccess;
+}
+
+void MetricsServer::Stop() {
+  if (!server_thread_) {
+    return;
+  }
+  stop_ = true;
+  server_thread_->join();
+  server_thread_.reset();
+}
+
+void MetricsServer::Publish(const std::string& page) {
+  std::string* const ptr_page =
+      new (std::nothrow) std::string(page);  // NOLINT
+  if (!ptr_page) {
+    LOG(ERROR) << "out of memory.";
+    return;
+  }
+  // A page not yet taken by the server thread is replaced.
+  delete published_page_.exchange(ptr_page, std::memory_order_acq_rel);
+}
+
+void MetricsServer::ServerThread() {
+  ScopedThreadRegistration registration("metrics");
+  LOG(INFO) << "metrics ServerThread started.";
+  while (!stop_) {
+    fd_set read_set;
+    FD_ZERO(&read_set);
+    FD_SET(listen_socket_, &read_set);
+    timeval timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_usec = kAcceptPollInterval * 1000;
+    const int ready = select(static_cast<int>(listen_socket_) + 1, &read_set,
+                             NULL, NULL, &timeout);
+    if (ready <= 0) {
+      continue;
+    }
+    const Socket client_socket = accept(listen_socket_, NULL, NULL);
+    if (client_socket == kInvalidSocket) {
+      continue;
+    }
+    ServeConnection(client_socket);
+    CloseSocket(client_socket);
+  }
+  LOG(INFO) << "metrics ServerThread finished.";
+}
+
+void MetricsServer::ServeConnection(Socket socket) {
+  // A client that connects and sends nothing must not stall the server.
+#ifdef _WIN32
+  const DWORD receive_timeout = kReceiveTimeout;
+#else
+  timeval receive_timeout;
+  receive_timeout.tv_sec = kReceiveTimeout / 1000;
+  receive_timeout.tv_usec = (kReceiveTimeout % 1000) * 1000;
+#endif
+  setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO,
+             reinterpret_cast<const char*>(&receive_timeout),
+             sizeof(receive_timeout));
+
+  std::string request;
+  while (request.find(kHeaderEnd) == std::string::npos) {
+    if (request.length() > kMaxRequestLength) {
+      return;
+    }
+    char data[1024];
+    const int bytes_read = recv(socket, data, sizeof(data), 0);
+    if (bytes_read <= 0) {
+      return;
+    }
+    request.append(data, bytes_read);
+  }
+
+  std::string* const ptr_published =
+      published_page_.exchange(NULL, std::memory_order_acq_rel);
+  if (ptr_published) {
+    page_.reset(ptr_published);
+  }
+
+  // Request line: METHOD SP target SP version.
+  const size_t method_end = request.find(' ');
+  const size_t target_end = request.find(' ', method_end + 1);
+  const std::string method = request.substr(0, method_end);
+  std::string target;
+  if (method_end != std::string::npos && target_end != std::string::npos) {
+    target = request.substr(method_end + 1, target_end - method_end - 1);
+    target = target.substr(0, target.find('?'));
+  }
+
+  const bool head = (method == "HEAD");
+  const bool found = (target == kMetricsPath && page_);
+  std::ostringstream response;
+  if (method != "GET" && !head) {
+    response << "HTTP/1.1 405 Method Not Allowed\r\n"
+             << "Allow: GET, HEAD\r\n"
+             << "Content-Length: 0\r\n";
+  } else if (!found) {
+    response << "HTTP/1.1 404 Not Found\r\n"
+             << "Content-Length: 0\r\n";
+  } else {
+    response << "HTTP/1.1 200 OK\r\n"
+             << "Content-Type: text/plain; version=0.0.4\r\n"
+             << "Content-Length: " << page_->length() << "\r\n"
+             << "Cache-Control: no-cache\r\n";
+  }
+  response << "Connection: close\r\n\r\n";
+  if (found && !head) {
+    response << *page_;
+  }
+  ++requests_;
+
+#ifdef MSG_NOSIGNAL
+  const int kSendFlags = MSG_NOSIGNAL;
+#else
+  const int kSendFlags = 0;
+#endif
+  const std::string response_data = response.str();
+  const char* ptr_data = response_data.data();
+  int length = static_cast<int>(response_data.length());
+  while (length > 0) {
+    const int bytes_sent = send(socket, ptr_data, length, kSendFlags);
+    if (bytes_sent <= 0) {
+      return;
+    }
+    ptr_data += bytes_sent;
+    length -= bytes_sent;
+  }
+}
+
+void MetricsServer::CloseSocket(Socket socket) {
+#ifdef _WIN32
+  closesocket(socket);
+#else
+  close(socket);
+#endif
+}
+
+}  // namespace webmlive
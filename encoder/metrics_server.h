@@ -0,0 +1,140 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_METRICS_SERVER_H_
+#define WEBMLIVE_ENCODER_METRICS_SERVER_H_
+
+#include <atomic>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+
+#ifdef _WIN32
+#include <winsock2.h>
+#endif
+
+namespace webmlive {
+
+struct MetricsServerSettings {
+  MetricsServerSettings() : port(0) {}
+
+  // TCP port the server listens on.
+  int port;
+};
+
+// Builds a metrics page in the Prometheus text exposition format. Samples of
+// one metric must be added one after the other; the HELP and TYPE lines are
+// written before the first.
+class MetricsBuilder {
+ public:
+  MetricsBuilder();
+
+  // Adds a sample of the counter or gauge |name|. |labels| is empty, or a
+  // comma separated list of label="value" pairs.
+  void AddCounter(const std::string& name, const std::string& help,
+                  const std::string& labels, double value);
+  void AddGauge(const std::string& name, const std::string& help,
+                const std::string& labels, double value);
+
+  // Returns the page.
+  std::string text() const { return text_.str(); }
+
+ private:
+  void AddSample(const std::string& name, const std::string& help,
+                 const char* type, const std::string& labels, double value);
+
+  std::set<std::string> names_;
+  std::ostringstream text_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(MetricsBuilder);
+};
+
+// Serves the page last passed to |Publish()| over HTTP, to GET and HEAD
+// requests for /metrics.
+//
+// |Publish()| and the server thread hand pages over through one atomic
+// pointer, so neither waits for the other: a scrape never holds up the
+// thread publishing, and a page published while a scrape is being sent is
+// picked up by the next scrape.
+//
+// Notes:
+// - |Init| must be called before any other method.
+// - Requests are served one at a time by the listener thread, and each
+//   connection is closed after its response.
+class MetricsServer {
+ public:
+  enum {
+    // Socket setup failed.
+    kSocketError = -603,
+
+    // Invalid argument supplied to method call.
+    kInvalidArg = -602,
+
+    // Server |Run| failed.
+    kRunFailed = -601,
+
+    // Success.
+    kSuccess = 0,
+  };
+
+  MetricsServer();
+  ~MetricsServer();
+
+  // Copies |settings|, and opens the listening socket. Returns |kSuccess|
+  // upon success.
+  int Init(const MetricsServerSettings& settings);
+
+  // Runs the thread that serves requests.
+  int Run();
+
+  // Stops the server thread.
+  void Stop();
+
+  // Replaces the page served. Thread safe, and does not block.
+  void Publish(const std::string& page);
+
+  // Returns the number of requests answered.
+  int64 requests() const { return requests_.load(); }
+
+ private:
+#ifdef _WIN32
+  typedef SOCKET Socket;
+#else
+  typedef int Socket;
+#endif
+
+  // Accepts and serves connections until |stop_| is set.
+  void ServerThread();
+
+  // Reads one request from |socket| and answers it.
+  void ServeConnection(Socket socket);
+
+  static void CloseSocket(Socket socket);
+
+  MetricsServerSettings settings_;
+  Socket listen_socket_;
+  bool initialized_;
+  std::atomic<bool> stop_;
+  std::unique_ptr<std::thread> server_thread_;
+
+  // Page published and not yet taken by |ServerThread()|, or NULL.
+  std::atomic<std::string*> published_page_;
+
+  // Page served. Accessed only by |ServerThread()|.
+  std::unique_ptr<std::string> page_;
+
+  std::atomic<int64> requests_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(MetricsServer);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_METRICS_SERVER_H_
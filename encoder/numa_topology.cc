@@ -0,0 +1,126 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/numa_topology.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include <algorithm>
+#include <thread>
+
+#include "glog/logging.h"
+
+namespace webmlive {
+
+#ifdef _WIN32
+namespace {
+
+// Returns the number of bits set in |mask|.
+int count_bits(uint64 mask) {
+  int bits = 0;
+  for (; mask; mask &= mask - 1) {
+    ++bits;
+  }
+  return bits;
+}
+
+}  // namespace
+#endif
+
+NumaTopology::NumaTopology() {
+#ifdef _WIN32
+  ULONG highest_node = 0;
+  if (GetNumaHighestNodeNumber(&highest_node)) {
+    for (ULONG i = 0; i <= highest_node; ++i) {
+      GROUP_AFFINITY affinity = {0};
+      if (!GetNumaNodeProcessorMaskEx(static_cast<USHORT>(i), &affinity) ||
+          affinity.Mask == 0) {
+        continue;
+      }
+      NumaNode node;
+      node.node = static_cast<int>(i);
+      node.processor_group = affinity.Group;
+      node.processor_mask = affinity.Mask;
+      node.processors = count_bits(node.processor_mask);
+      nodes_.push_back(node);
+    }
+  }
+#endif
+  if (nodes_.empty()) {
+    NumaNode node;
+    node.processors =
+        std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    node.processor_mask = node.processors >= 64 ?
+        ~0ULL : (1ULL << node.processors) - 1;
+    nodes_.push_back(node);
+  }
+}
+
+NumaTopology* NumaTopology::Instance() {
+  static NumaTopology topology;
+  return &topology;
+}
+
+const NumaNode* NumaTopology::FindNode(int node) const {
+  for (size_t i = 0; i < nodes_.size(); ++i) {
+    if (nodes_[i].node == node) {
+      return &nodes_[i];
+    }
+  }
+  return NULL;
+}
+
+int64 NumaTopology::AvailableBytes(int node) const {
+#ifdef _WIN32
+  ULONGLONG bytes = 0;
+  if (FindNode(node) &&
+      GetNumaAvailableMemoryNodeEx(static_cast<USHORT>(node), &bytes)) {
+    return static_cast<int64>(bytes);
+  }
+#else
+  (void)node;
+#endif
+  return -1;
+}
+
+int NumaTopology::CurrentNode() const {
+#ifdef _WIN32
+  PROCESSOR_NUMBER processor = {0};
+  GetCurrentProcessorNumberEx(&processor);
+  USHORT node = 0;
+  if (GetNumaProcessorNodeEx(&processor, &node)) {
+    return static_cast<int>(node);
+  }
+  return kNoNode;
+#else
+  // The single node holds every processor.
+  return nodes_[0].node;
+#endif
+}
+
+bool NumaTopology::RunOnNode(int node) const {
+  const NumaNode* const ptr_node = FindNode(node);
+  if (!ptr_node) {
+    LOG(WARNING) << "cannot run on NUMA node " << node << ": no such node.";
+    return false;
+  }
+#ifdef _WIN32
+  GROUP_AFFINITY affinity = {0};
+  affinity.Group = static_cast<WORD>(ptr_node->processor_group);
+  affinity.Mask = static_cast<KAFFINITY>(ptr_node->processor_mask);
+  if (!SetThreadGroupAffinity(GetCurrentThread(), &affinity, NULL)) {
+    LOG(WARNING) << "cannot run on NUMA node " << node << ", error "
+                 << GetLastError();
+    return false;
+  }
+#endif
+  return true;
+}
+
+}  // namespace webmlive
@@ -0,0 +1,77 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_NUMA_TOPOLOGY_H_
+#define WEBMLIVE_ENCODER_NUMA_TOPOLOGY_H_
+
+#include <vector>
+
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+
+namespace webmlive {
+
+// A NUMA node of the host, and the processors it holds.
+struct NumaNode {
+  NumaNode() : node(0), processor_group(0), processor_mask(0), processors(0) {}
+
+  // Node number, as used by |ThreadSettings::numa_node| and
+  // |MediaArena::set_numa_node()|.
+  int node;
+
+  // Processor group of the node's processors, and their mask within it.
+  int processor_group;
+  uint64 processor_mask;
+
+  // Number of processors in |processor_mask|.
+  int processors;
+};
+
+// NUMA topology of the host, queried on first use. On Windows nodes come from
+// GetNumaNodeProcessorMaskEx(); nodes without processors are left out. Hosts
+// without NUMA, and other platforms, report a single node 0 holding every
+// processor.
+//
+// A channel, or a group of renditions, placed on a node keeps its threads on
+// the node's processors and takes its media buffers from the node's memory,
+// so that frames are not read across the interconnect. See
+// |ThreadSettings::numa_node| and |MediaArena::set_numa_node()|.
+class NumaTopology {
+ public:
+  // No node: threads and memory are left where the system puts them.
+  static const int kNoNode = -1;
+
+  static NumaTopology* Instance();
+
+  int num_nodes() const { return static_cast<int>(nodes_.size()); }
+  const std::vector<NumaNode>& nodes() const { return nodes_; }
+
+  // Returns the node numbered |node|, or NULL when the host has none.
+  const NumaNode* FindNode(int node) const;
+
+  // Returns the free memory of |node| now, in bytes, or -1 when unknown.
+  int64 AvailableBytes(int node) const;
+
+  // Returns the node of the processor running the calling thread, or
+  // |kNoNode| when unknown.
+  int CurrentNode() const;
+
+  // Restricts the calling thread to the processors of |node|. Returns false
+  // when the host has no such node, or the affinity cannot be set.
+  bool RunOnNode(int node) const;
+
+ private:
+  NumaTopology();
+  ~NumaTopology() {}
+
+  std::vector<NumaNode> nodes_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(NumaTopology);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_NUMA_TOPOLOGY_H_
@@ -0,0 +1,387 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/opus_encoder.h"
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+#include "encoder/webm_encoder.h"
+#include "glog/logging.h"
+#include "libopus/include/opus.h"
+
+namespace {
+
+// Size of the OpusHead structure stored in the WebM CodecPrivate element.
+const int kOpusHeadSize = 19;
+
+// Packet storage per millisecond of audio per channel. Comfortably above the
+// largest packet libopus produces (1275 bytes per 20 ms frame per channel).
+const int32 kMaxPacketBytesPerMillisecond = 128;
+
+void WriteLe16(uint16 value, uint8* ptr_dst) {
+  ptr_dst[0] = static_cast<uint8>(value & 0xff);
+  ptr_dst[1] = static_cast<uint8>((value >> 8) & 0xff);
+}
+
+void WriteLe32(uint32 value, uint8* ptr_dst) {
+  WriteLe16(static_cast<uint16>(value & 0xffff), ptr_dst);
+  WriteLe16(static_cast<uint16>((value >> 16) & 0xffff), ptr_dst + 2);
+}
+
+bool ValidOpusSampleRate(int sample_rate) {
+  return sample_rate == 8000 || sample_rate == 12000 ||
+         sample_rate == 16000 || sample_rate == 24000 ||
+         sample_rate == 48000;
+}
+
+bool ValidOpusFrameDuration(int frame_duration) {
+  return frame_duration == 10 || frame_duration == 20 ||
+         frame_duration == 40 || frame_duration == 60;
+}
+
+}  // namespace
+
+namespace webmlive {
+
+OpusEncoder::OpusEncoder()
+    : ptr_encoder_(NULL),
+      frame_size_(0),
+      frame_bytes_(0),
+      pre_skip_(0),
+      max_packet_size_(0),
+      input_format_tag_(0),
+      input_length_(0),
+      samples_encoded_(0),
+      first_input_timestamp_(-1),
+      last_timestamp_(0) {
+}
+
+OpusEncoder::~OpusEncoder() {
+  if (ptr_encoder_) {
+    opus_encoder_destroy(ptr_encoder_);
+  }
+}
+
+int OpusEncoder::Init(const WebmEncoderConfig& config) {
+  return Init(config.actual_audio_config, config.opus_config);
+}
+
+// Bitrate values are multiplied by 1000. |WebmEncoderConfig| and its children
+// express bitrates in kilobits. Libopus bitrates are in bits.
+int OpusEncoder::Init(const AudioConfig& audio_config,
+                      const OpusConfig& opus_config) {
+  if (ptr_encoder_) {
+    LOG(ERROR) << "OpusEncoder already initialized.";
+    return kEncoderError;
+  }
+  if (audio_config.channels <= 0 || audio_config.channels > 2) {
+    LOG(ERROR) << "invalid/unsupported number of audio channels.";
+    return kUnsupportedFormat;
+  }
+  if (!ValidOpusSampleRate(audio_config.sample_rate)) {
+    LOG(ERROR) << "sample rate " << audio_config.sample_rate
+               << " not supported by libopus.";
+    return kUnsupportedFormat;
+  }
+  const uint16& format_tag = audio_config.format_tag;
+  if (format_tag != kAudioFormatPcm && format_tag != kAudioFormatIeeeFloat) {
+    LOG(ERROR) << "input must be uncompressed.";
+    return kUnsupportedFormat;
+  }
+  if (format_tag == kAudioFormatPcm && audio_config.bits_per_sample != 16) {
+    LOG(ERROR) << "PCM input must be 16 bits per sample.";
+    return kUnsupportedFormat;
+  }
+  const int kBitsPerIeeeFloat = sizeof(float) * 8;  // NOLINT(runtime/sizeof)
+  if (format_tag == kAudioFormatIeeeFloat &&
+      audio_config.bits_per_sample != kBitsPerIeeeFloat) {
+    LOG(ERROR) << "IEEE floating point input must be 32 bits per sample.";
+    return kUnsupportedFormat;
+  }
+  if (!ValidOpusFrameDuration(opus_config.frame_duration)) {
+    LOG(ERROR) << "invalid Opus frame duration: "
+               << opus_config.frame_duration;
+    return kUnsupportedFormat;
+  }
+
+  const int application = opus_config.low_delay ?
+      OPUS_APPLICATION_RESTRICTED_LOWDELAY : OPUS_APPLICATION_AUDIO;
+  int status = OPUS_OK;
+  ptr_encoder_ = opus_encoder_create(audio_config.sample_rate,
+                                     audio_config.channels,
+                                     application,
+                                     &status);
+  if (!ptr_encoder_ || status != OPUS_OK) {
+    LOG(ERROR) << "opus_encoder_create failed: " << status;
+    ptr_encoder_ = NULL;
+    return kCodecError;
+  }
+  status = opus_encoder_ctl(ptr_encoder_,
+                            OPUS_SET_BITRATE(opus_config.bitrate * 1000));
+  if (status != OPUS_OK) {
+    LOG(ERROR) << "OPUS_SET_BITRATE failed: " << status;
+    return kCodecError;
+  }
+  if (opus_config.complexity != OpusConfig::kUseDefault) {
+    status = opus_encoder_ctl(ptr_encoder_,
+                              OPUS_SET_COMPLEXITY(opus_config.complexity));
+    if (status != OPUS_OK) {
+      LOG(ERROR) << "OPUS_SET_COMPLEXITY failed: " << status;
+      return kCodecError;
+    }
+  }
+
+  // Libopus reports lookahead at the input rate; OpusHead pre-skip is always
+  // expressed at 48 kHz.
+  opus_int32 lookahead = 0;
+  status = opus_encoder_ctl(ptr_encoder_, OPUS_GET_LOOKAHEAD(&lookahead));
+  if (status != OPUS_OK) {
+    LOG(ERROR) << "OPUS_GET_LOOKAHEAD failed: " << status;
+    return kCodecError;
+  }
+  pre_skip_ = lookahead * (kOpusSampleRate / audio_config.sample_rate);
+
+  frame_size_ = audio_config.sample_rate * opus_config.frame_duration / 1000;
+  frame_bytes_ = frame_size_ * audio_config.block_align;
+  max_packet_size_ = kMaxPacketBytesPerMillisecond *
+      opus_config.frame_duration * audio_config.channels;
+  input_.resize(frame_bytes_);
+  input_length_ = 0;
+  input_format_tag_ = format_tag;
+
+  audio_config_ = audio_config;
+  audio_config_.format_tag = kAudioFormatOpus;
+  opus_config_ = opus_config;
+  LOG(INFO) << "OpusEncoder frame_size_=" << frame_size_
+            << " pre_skip_=" << pre_skip_;
+  return kSuccess;
+}
+
+int OpusEncoder::Encode(const AudioBuffer& input_buffer) {
+  if (!ptr_encoder_) {
+    LOG(ERROR) << "cannot Encode before Init.";
+    return kEncoderError;
+  }
+  if (!input_buffer.buffer() || input_buffer.buffer_length() <= 0) {
+    LOG(ERROR) << "cannot Encode an empty input buffer.";
+    return kInvalidArg;
+  }
+  const AudioConfig& ac = input_buffer.config();
+  if (ac.format_tag != input_format_tag_ ||
+      ac.channels != audio_config_.channels ||
+      ac.sample_rate != audio_config_.sample_rate) {
+    LOG(ERROR) << "cannot Encode, input format differs from Init format.";
+    return kInvalidArg;
+  }
+  PcmSpan span;
+  span.ptr_data = input_buffer.buffer();
+  span.length = input_buffer.buffer_length();
+  span.timestamp = input_buffer.timestamp();
+  return EncodeSpan(span);
+}
+
+int OpusEncoder::EncodeSpan(const PcmSpan& span) {
+  if (!ptr_encoder_) {
+    LOG(ERROR) << "cannot Encode before Init.";
+    return kEncoderError;
+  }
+  if (!span.ptr_data || span.length <= 0) {
+    LOG(ERROR) << "cannot Encode an empty input span.";
+    return kInvalidArg;
+  }
+  if (first_input_timestamp_ == -1) {
+    first_input_timestamp_ = span.timestamp;
+    LOG(INFO) << "OpusEncoder first_input_timestamp_="
+              << first_input_timestamp_;
+  }
+
+  // Top up the partial frame from the last call, then encode complete frames
+  // directly from |span|, and stage the remainder.
+  const uint8* ptr_input = span.ptr_data;
+  int32 input_remaining = span.length;
+  if (input_length_ > 0) {
+    const int32 copy_length =
+        std::min(frame_bytes_ - input_length_, input_remaining);
+    memcpy(&input_[input_length_], ptr_input, copy_length);
+    input_length_ += copy_length;
+    ptr_input += copy_length;
+    input_remaining -= copy_length;
+    if (input_length_ < frame_bytes_) {
+      return kSuccess;
+    }
+    const int status = EncodeFrame(&input_[0]);
+    if (status) {
+      return status;
+    }
+    input_length_ = 0;
+  }
+  while (input_remaining >= frame_bytes_) {
+    const int status = EncodeFrame(ptr_input);
+    if (status) {
+      return status;
+    }
+    ptr_input += frame_bytes_;
+    input_remaining -= frame_bytes_;
+  }
+  if (input_remaining > 0) {
+    memcpy(&input_[0], ptr_input, input_remaining);
+    input_length_ = input_remaining;
+  }
+  return kSuccess;
+}
+
+int OpusEncoder::ReadCompressedAudio(AudioBuffer* ptr_buffer) {
+  if (!ptr_buffer) {
+    LOG(ERROR) << "ReadCompressedAudio requires a non-NULL ptr_buffer.";
+    return kInvalidArg;
+  }
+  if (packets_.empty()) {
+    return kNoSamples;
+  }
+  Packet& packet = packets_.front();
+
+  // Hand the packet storage to |ptr_buffer|; its previous storage is kept for
+  // a future packet.
+  const int status = ptr_buffer->InitFromStorage(audio_config_,
+                                                 packet.timestamp,
+                                                 packet.duration,
+                                                 &packet.data,
+                                                 &packet.capacity,
+                                                 packet.length);
+  if (status) {
+    LOG(ERROR) << "AudioBuffer Init failed: " << status;
+    return kCodecError;
+  }
+  last_timestamp_ = packet.timestamp;
+  packet.length = 0;
+  free_packets_.push_back(std::move(packet));
+  packets_.pop_front();
+  return kSuccess;
+}
+
+int OpusEncoder::SetBitrate(int bitrate) {
+  if (!ptr_encoder_ || bitrate <= 0) {
+    return kInvalidArg;
+  }
+  const int status =
+      opus_encoder_ctl(ptr_encoder_, OPUS_SET_BITRATE(bitrate * 1000));
+  if (status != OPUS_OK) {
+    LOG(ERROR) << "OPUS_SET_BITRATE failed: " << status;
+    return kCodecError;
+  }
+  opus_config_.bitrate = bitrate;
+  return kSuccess;
+}
+
+int OpusEncoder::SetSilent(bool silent) {
+  if (!ptr_encoder_) {
+    return kInvalidArg;
+  }
+  const int status = opus_encoder_ctl(ptr_encoder_, OPUS_SET_DTX(silent));
+  if (status != OPUS_OK) {
+    LOG(ERROR) << "OPUS_SET_DTX failed: " << status;
+    return kCodecError;
+  }
+  return kSuccess;
+}
+
+int OpusEncoder::GetCodecPrivate(AudioCodecPrivate* ptr_private) const {
+  if (!ptr_private) {
+    LOG(ERROR) << "cannot GetCodecPrivate with NULL out param.";
+    return kInvalidArg;
+  }
+  if (!ptr_encoder_) {
+    LOG(ERROR) << "cannot GetCodecPrivate before Init.";
+    return kEncoderError;
+  }
+
+  // OpusHead: magic signature, version, channel count, pre-skip, input sample
+  // rate, output gain, and channel mapping family. Multi-byte values are
+  // little endian.
+  std::vector<uint8>& data = ptr_private->data;
+  data.assign(kOpusHeadSize, 0);
+  memcpy(&data[0], "OpusHead", 8);
+  data[8] = 1;
+  data[9] = static_cast<uint8>(audio_config_.channels);
+  WriteLe16(static_cast<uint16>(pre_skip_), &data[10]);
+  WriteLe32(static_cast<uint32>(audio_config_.sample_rate), &data[12]);
+  // Bytes 16 and 17 are the output gain, and byte 18 is mapping family 0
+  // (mono or stereo); all are zero.
+
+  ptr_private->format = kAudioFormatOpus;
+  ptr_private->codec_delay =
+      static_cast<uint64>(pre_skip_) * 1000000000ULL / kOpusSampleRate;
+  ptr_private->seek_pre_roll = kSeekPreRoll;
+  return kSuccess;
+}
+
+int64 OpusEncoder::time_encoded() const {
+  if (first_input_timestamp_ < 0) {
+    return 0;
+  }
+  if (!packets_.empty()) {
+    return packets_.front().timestamp;
+  }
+  return first_input_timestamp_ + SamplesToMilliseconds(samples_encoded_);
+}
+
+int OpusEncoder::EncodeFrame(const uint8* ptr_samples) {
+  Packet packet;
+  if (!free_packets_.empty()) {
+    packet = std::move(free_packets_.back());
+    free_packets_.pop_back();
+  }
+  if (!packet.data || packet.capacity < max_packet_size_) {
+    packet.data.reset();
+    packet.data = AllocateMediaBuffer(arena_, max_packet_size_,
+                                      &packet.capacity);
+    if (!packet.data) {
+      LOG(ERROR) << "cannot EncodeFrame, no memory.";
+      return kNoMemory;
+    }
+  }
+
+  opus_int32 length = 0;
+  if (input_format_tag_ == kAudioFormatPcm) {
+    length = opus_encode(ptr_encoder_,
+                         reinterpret_cast<const opus_int16*>(ptr_samples),
+                         frame_size_, packet.data.get(), packet.capacity);
+  } else {
+    length = opus_encode_float(ptr_encoder_,
+                               reinterpret_cast<const float*>(ptr_samples),
+                               frame_size_, packet.data.get(),
+                               packet.capacity);
+  }
+  if (length < 0) {
+    LOG(ERROR) << "opus_encode failed: " << length;
+    free_packets_.push_back(std::move(packet));
+    return kCodecError;
+  }
+
+  const int64 start_time = SamplesToMilliseconds(samples_encoded_);
+  samples_encoded_ += frame_size_;
+  const int64 end_time = SamplesToMilliseconds(samples_encoded_);
+  packet.timestamp = first_input_timestamp_ + start_time;
+  packet.duration = end_time - start_time;
+  packet.length = length;
+  packets_.push_back(std::move(packet));
+  return kSuccess;
+}
+
+int64 OpusEncoder::SamplesToMilliseconds(int64 num_samples) const {
+  const double sample_rate = audio_config_.sample_rate;
+  const double sample_count = static_cast<double>(num_samples);
+  double seconds = 0;
+  if (sample_rate != 0) {
+    seconds = sample_count / sample_rate;
+  }
+  return static_cast<int64>(seconds * 1000);
+}
+
+}  // namespace webmlive
@@ -0,0 +1,160 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_OPUS_ENCODER_H_
+#define WEBMLIVE_ENCODER_OPUS_ENCODER_H_
+
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "encoder/audio_encoder.h"
+#include "encoder/basictypes.h"
+
+// Forward declaration of the libopus encoder state.
+struct OpusEncoder;
+
+namespace webmlive {
+
+// Libopus wrapper class providing an |AudioEncoder| that produces one Opus
+// packet per |ReadCompressedAudio()| call.
+// Note: users must call |Init()| before any other method.
+class OpusEncoder : public AudioEncoder {
+ public:
+  enum {
+    // A libopus function returned an error.
+    kCodecError = AudioEncoder::kCodecError,
+
+    // Internal error within |OpusEncoder|.
+    kEncoderError = AudioEncoder::kEncoderError,
+
+    // |audio_config| or |opus_config| settings are not supported.
+    kUnsupportedFormat = AudioEncoder::kUnsupportedFormat,
+    kNoMemory = AudioEncoder::kNoMemory,
+    kInvalidArg = AudioEncoder::kInvalidArg,
+    kSuccess = AudioEncoder::kSuccess,
+
+    // |ReadCompressedAudio()| has no samples available.
+    kNoSamples = AudioEncoder::kNoSamples,
+  };
+
+  // Opus timestamps are always in 48 kHz samples.
+  static const int kOpusSampleRate = 48000;
+
+  // WebM SeekPreRoll value recommended for Opus, in nanoseconds.
+  static const uint64 kSeekPreRoll = 80000000;
+
+  OpusEncoder();
+  virtual ~OpusEncoder();
+
+  // |AudioEncoder| method. Calls |Init()| with |config.actual_audio_config|
+  // and |config.opus_config|.
+  virtual int Init(const WebmEncoderConfig& config);
+
+  // Initializes libopus using the settings stored in |audio_config| and
+  // |opus_config|. Input must be 16 bit PCM or float, mono or stereo, at a
+  // sample rate supported by libopus (8, 12, 16, 24 or 48 kHz). Returns
+  // |kSuccess| after successful libopus initialization.
+  int Init(const AudioConfig& audio_config, const OpusConfig& opus_config);
+
+  // Stages the samples in |uncompressed_buffer| and encodes every complete
+  // Opus frame. Returns |kSuccess| after successful handoff of samples to the
+  // encoder.
+  virtual int Encode(const AudioBuffer& uncompressed_buffer);
+
+  // Same as |Encode()|, for samples read in place from |span|.
+  virtual int EncodeSpan(const PcmSpan& span);
+
+  // Returns the oldest encoded Opus packet via |ptr_buffer|. Returns
+  // |kNoSamples| when no packet is ready. Returns |kSuccess| when a packet is
+  // written to |ptr_buffer|.
+  virtual int ReadCompressedAudio(AudioBuffer* ptr_buffer);
+
+  // Passes |bitrate| to libopus with OPUS_SET_BITRATE. Returns |kCodecError|
+  // when libopus rejects it.
+  virtual int SetBitrate(int bitrate);
+
+  // Turns libopus discontinuous transmission on while the input is silent,
+  // with OPUS_SET_DTX. Returns |kCodecError| when libopus rejects it.
+  virtual int SetSilent(bool silent);
+
+  // Allocates packet storage from |arena|.
+  virtual void set_arena(const std::shared_ptr<MediaArena>& arena) {
+    arena_ = arena;
+  }
+
+  // Stores the OpusHead structure, the pre-skip as CodecDelay, and
+  // |kSeekPreRoll| in |ptr_private|.
+  virtual int GetCodecPrivate(AudioCodecPrivate* ptr_private) const;
+
+  // Accessors.
+  virtual const AudioConfig* audio_config() const { return &audio_config_; }
+  const OpusConfig* opus_config() const { return &opus_config_; }
+
+  // Returns the number of 48 kHz samples decoders discard at stream start.
+  int pre_skip() const { return pre_skip_; }
+
+  // Returns the timestamp of the last encoded buffer read from
+  // |ReadCompressedAudio()|.
+  virtual int64 last_timestamp() const { return last_timestamp_; }
+
+  // Returns the timestamp of the next packet |ReadCompressedAudio()| will
+  // return.
+  virtual int64 time_encoded() const;
+
+ private:
+  struct Packet {
+    Packet() : timestamp(0), duration(0), length(0), capacity(0) {}
+    MediaBuffer data;
+    int64 timestamp;
+    int64 duration;
+    int32 length;
+    int32 capacity;
+  };
+
+  // Encodes the |frame_size_| samples at |ptr_samples| and queues the result
+  // in |packets_|. Returns |kSuccess| when successful.
+  int EncodeFrame(const uint8* ptr_samples);
+
+  // Converts |num_samples| at the input sample rate to milliseconds.
+  int64 SamplesToMilliseconds(int64 num_samples) const;
+
+  ::OpusEncoder* ptr_encoder_;
+  AudioConfig audio_config_;
+  OpusConfig opus_config_;
+
+  // Samples per channel in each Opus frame, and the matching byte count.
+  int frame_size_;
+  int32 frame_bytes_;
+  int pre_skip_;
+
+  // Maximum Opus packet size for |frame_size_|.
+  int32 max_packet_size_;
+
+  // Input sample format: |kAudioFormatPcm| or |kAudioFormatIeeeFloat|.
+  uint16 input_format_tag_;
+
+  // Interleaved input that does not yet fill a frame.
+  std::vector<uint8> input_;
+  int32 input_length_;
+
+  // Encoded packets waiting for |ReadCompressedAudio()|, and storage from
+  // packets that have been read. Packet storage is swapped into the output
+  // |AudioBuffer|, so steady state encoding does not allocate.
+  std::deque<Packet> packets_;
+  std::vector<Packet> free_packets_;
+  std::shared_ptr<MediaArena> arena_;
+
+  int64 samples_encoded_;
+  int64 first_input_timestamp_;
+  int64 last_timestamp_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(OpusEncoder);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_OPUS_ENCODER_H_
@@ -0,0 +1,321 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/parallel_gop_encoder.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+#include <sstream>
+#include <utility>
+
+#include "encoder/thread_util.h"
+#include "glog/logging.h"
+
+#if defined _MSC_VER
+// Disable warning C4505(unreferenced local function has been removed) in MSVC.
+// The warning is emitted for vp8.h and vp8cx.h (included by vpx_encoder.h).
+#pragma warning(disable:4505)
+#endif
+#include "encoder/vpx_encoder.h"
+#include "encoder/webm_encoder.h"
+
+namespace webmlive {
+
+ParallelGopEncoder::ParallelGopEncoder()
+    : ptr_frame_profiler_(NULL),
+      width_(0),
+      height_(0),
+      force_keyframe_(false),
+      stop_(false),
+      frames_in_(0),
+      frames_out_(0),
+      last_keyframe_time_(0),
+      last_timestamp_(0) {
+}
+
+ParallelGopEncoder::~ParallelGopEncoder() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  gop_queued_.notify_all();
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    if (workers_[i]) {
+      workers_[i]->join();
+    }
+  }
+}
+
+int ParallelGopEncoder::Init(const WebmEncoderConfig& config) {
+  const int num_workers = config.vpx_config.parallel_gops;
+  if (num_workers < 2) {
+    LOG(ERROR) << "parallel GOP encoding requires at least 2 GOPs, got "
+               << num_workers;
+    return kInvalidArg;
+  }
+  ptr_config_.reset(new (std::nothrow) WebmEncoderConfig(config));  // NOLINT
+  if (!ptr_config_) {
+    return kNoMemory;
+  }
+
+  // The workers share the cores of the encoder.
+  VpxConfig& vpx_config = ptr_config_->vpx_config;
+  int cores = vpx_config.cpu_cores;
+  if (cores == VpxConfig::kUseDefault) {
+    cores = static_cast<int>(std::thread::hardware_concurrency());
+  }
+  vpx_config.cpu_cores = std::max(1, cores / num_workers);
+  vpx_config.adaptive_speed = false;
+  vpx_config.warmup_frames = 0;
+  vpx_config.parallel_gops = 0;
+  vpx_config_ = vpx_config;
+
+  // Settings libvpx rejects fail here rather than on the first GOP.
+  VpxEncoder probe;
+  const int status = probe.Init(*ptr_config_);
+  if (status) {
+    LOG(ERROR) << "GOP encoder Init failed: " << status;
+    return status;
+  }
+
+  stop_ = false;
+  for (int i = 0; i < num_workers; ++i) {
+    workers_.push_back(std::unique_ptr<std::thread>(
+        new (std::nothrow) std::thread(  // NOLINT
+            &ParallelGopEncoder::WorkerThread, this, i)));
+    if (!workers_.back()) {
+      LOG(ERROR) << "cannot construct GOP encoder thread.";
+      return kEncoderError;
+    }
+  }
+  LOG(INFO) << num_workers << " parallel GOP encoders, "
+            << vpx_config.cpu_cores << " cores each.";
+  return kSuccess;
+}
+
+int ParallelGopEncoder::EncodeFrame(const VideoFrame& raw_frame,
+                                    VideoFrame* ptr_vpx_frame) {
+  if (!raw_frame.buffer()) {
+    LOG(ERROR) << "NULL raw VideoFrame buffer!";
+    return kInvalidArg;
+  }
+  ++frames_in_;
+
+  // GOPs start where |VpxEncoder| would place a keyframe.
+  const int64 timestamp = raw_frame.timestamp();
+  const int64 interval = vpx_config_.keyframe_interval;
+  bool new_gop = !open_gop_ || force_keyframe_;
+  if (open_gop_ && interval > 0) {
+    if (vpx_config_.aligned_keyframes) {
+      new_gop |= timestamp / interval > last_keyframe_time_ / interval;
+    } else {
+      new_gop |= timestamp - last_keyframe_time_ > interval;
+    }
+  }
+  force_keyframe_ = false;
+  if (new_gop) {
+    if (open_gop_) {
+      QueueOpenGop();
+    }
+    open_gop_.reset(new (std::nothrow) Gop());  // NOLINT
+    if (!open_gop_) {
+      return kNoMemory;
+    }
+    open_gop_->vpx_config = vpx_config_;
+    open_gop_->width = width_;
+    open_gop_->height = height_;
+    last_keyframe_time_ = timestamp;
+  }
+  open_gop_->frames.emplace_back();
+  if (raw_frame.Clone(&open_gop_->frames.back())) {
+    LOG(ERROR) << "cannot copy raw frame into GOP.";
+    open_gop_->frames.pop_back();
+    return kNoMemory;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  return TakeFrame(ptr_vpx_frame);
+}
+
+int ParallelGopEncoder::ReadPendingFrame(VideoFrame* ptr_vpx_frame) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return TakeFrame(ptr_vpx_frame);
+}
+
+int ParallelGopEncoder::Flush() {
+  if (open_gop_) {
+    QueueOpenGop();
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (size_t i = 0; i < gops_.size(); ++i) {
+    while (!gops_[i]->done) {
+      gop_done_.wait(lock);
+    }
+    if (gops_[i]->status) {
+      return gops_[i]->status;
+    }
+  }
+  return kSuccess;
+}
+
+int32 ParallelGopEncoder::pending_frames() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  int32 frames = 0;
+  for (size_t i = 0; i < gops_.size(); ++i) {
+    if (!gops_[i]->done || gops_[i]->status) {
+      break;
+    }
+    frames += static_cast<int32>(gops_[i]->output.size());
+  }
+  return frames;
+}
+
+int ParallelGopEncoder::SetBitrate(int bitrate) {
+  vpx_config_.bitrate = bitrate;
+  return kSuccess;
+}
+
+int ParallelGopEncoder::SetFrameSize(int32 width, int32 height) {
+  const VideoConfig encoded =
+      EncodedVideoConfig(ptr_config_->actual_video_config);
+  if (width <= 0 || height <= 0 || width > encoded.width ||
+      height > abs(encoded.height)) {
+    LOG(ERROR) << "invalid VPx frame size " << width << "x" << height;
+    return kInvalidArg;
+  }
+  width_ = width;
+  height_ = height;
+  force_keyframe_ = true;
+  return kSuccess;
+}
+
+int ParallelGopEncoder::SetSpeed(int speed) {
+  vpx_config_.speed = speed;
+  return kSuccess;
+}
+
+int ParallelGopEncoder::SetKeyframeInterval(int keyframe_interval) {
+  vpx_config_.keyframe_interval = keyframe_interval;
+  return kSuccess;
+}
+
+int ParallelGopEncoder::SetRegionsOfInterest(
+    const std::vector<RegionOfInterest>& regions) {
+  if (vpx_config_.codec != kVideoFormatVP8 && !regions.empty()) {
+    LOG(ERROR) << "regions of interest require VP8.";
+    return kInvalidArg;
+  }
+  vpx_config_.regions_of_interest = regions;
+  return kSuccess;
+}
+
+void ParallelGopEncoder::WorkerThread(int index) {
+  std::ostringstream thread_name;
+  thread_name << "gop_encoder" << index;
+  ScopedThreadRegistration registration(thread_name.str());
+  for (;;) {
+    Gop* ptr_gop = NULL;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      while (!stop_ && queue_.empty()) {
+        gop_queued_.wait(lock);
+      }
+      if (stop_) {
+        return;
+      }
+      ptr_gop = queue_.front();
+      queue_.pop_front();
+    }
+    const int status = EncodeGop(ptr_gop);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ptr_gop->status = status;
+      ptr_gop->done = true;
+    }
+    gop_done_.notify_all();
+  }
+}
+
+int ParallelGopEncoder::EncodeGop(Gop* ptr_gop) {
+  Gop& gop = *ptr_gop;
+  const int64 start_time = gop.frames.front().timestamp();
+  WebmEncoderConfig config = *ptr_config_;
+  config.vpx_config = gop.vpx_config;
+  VpxEncoder encoder;
+  encoder.set_frame_profiler(ptr_frame_profiler_);
+  int status = encoder.Init(config);
+  if (status == kSuccess && gop.width > 0) {
+    status = encoder.SetFrameSize(gop.width, gop.height);
+  }
+
+  // The first frame is a keyframe, so the GOP decodes on its own.
+  encoder.ForceKeyframe();
+  VideoFrame vpx_frame;
+  while (status == kSuccess && !gop.frames.empty()) {
+    status = encoder.EncodeFrame(gop.frames.front(), &vpx_frame);
+    gop.frames.pop_front();
+    while (status == kSuccess) {
+      gop.output.emplace_back();
+      gop.output.back().Swap(&vpx_frame);
+      status = encoder.ReadPendingFrame(&vpx_frame);
+    }
+    if (status == kDropped) {
+      status = kSuccess;
+    }
+  }
+  if (status == kSuccess) {
+    status = encoder.Flush();
+  }
+  while (status == kSuccess &&
+         encoder.ReadPendingFrame(&vpx_frame) == kSuccess) {
+    gop.output.emplace_back();
+    gop.output.back().Swap(&vpx_frame);
+  }
+  gop.frames.clear();
+  if (status) {
+    LOG(ERROR) << "GOP at " << start_time << " encode failed: " << status;
+  }
+  return status;
+}
+
+void ParallelGopEncoder::QueueOpenGop() {
+  if (open_gop_->frames.empty()) {
+    open_gop_.reset();
+    return;
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  queue_.push_back(open_gop_.get());
+  gops_.push_back(std::move(open_gop_));
+  gop_queued_.notify_one();
+  while (gops_.size() > workers_.size() && !gops_.front()->done) {
+    gop_done_.wait(lock);
+  }
+}
+
+int ParallelGopEncoder::TakeFrame(VideoFrame* ptr_vpx_frame) {
+  while (!gops_.empty() && gops_.front()->done) {
+    Gop& gop = *gops_.front();
+    if (gop.status) {
+      return gop.status;
+    }
+    if (!gop.output.empty()) {
+      ptr_vpx_frame->Swap(&gop.output.front());
+      gop.output.pop_front();
+      if (gop.output.empty()) {
+        gops_.pop_front();
+      }
+      ++frames_out_;
+      last_timestamp_ = ptr_vpx_frame->timestamp();
+      return kSuccess;
+    }
+    gops_.pop_front();
+  }
+  return kDropped;
+}
+
+}  // namespace webmlive
@@ -0,0 +1,182 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_PARALLEL_GOP_ENCODER_H_
+#define WEBMLIVE_ENCODER_PARALLEL_GOP_ENCODER_H_
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+#include "encoder/frame_type_profiler.h"
+#include "encoder/video_encoder.h"
+
+namespace webmlive {
+
+// libvpx encoding of input that need not be encoded in real time, such as
+// free running input files: the input is cut into closed GOPs at keyframe
+// interval boundaries, and |VpxConfig::parallel_gops| worker threads each
+// encode a GOP from its keyframe on with a |VpxEncoder| of their own.
+// Compressed frames are returned in input order, GOP after GOP, so the muxer
+// sees one stream.
+//
+// Notes:
+// - Each GOP is encoded from a fresh rate control state; bitrate, speed,
+//   keyframe interval and region changes apply from the next GOP.
+//   |SetFrameSize()| and |ForceKeyframe()| start a new GOP.
+// - Adaptive speed and encoder warmup are realtime features, and are off in
+//   the GOP encoders. Each gets |VpxConfig::cpu_cores| / |parallel_gops| of
+//   the cores for its threads.
+// - |EncodeFrame()| blocks while |parallel_gops| GOPs are encoding or
+//   waiting to be returned, so that the raw frames held stay bounded. Frames
+//   come out a GOP behind the input; |Flush()| waits for all of them.
+class ParallelGopEncoder : public VideoEncoderBackend {
+ public:
+  enum {
+    kCodecError = VideoEncoder::kCodecError,
+    kEncoderError = VideoEncoder::kEncoderError,
+    kNoMemory = VideoEncoder::kNoMemory,
+    kInvalidArg = VideoEncoder::kInvalidArg,
+    kSuccess = VideoEncoder::kSuccess,
+    kDropped = VideoEncoder::kDropped,
+  };
+
+  ParallelGopEncoder();
+  virtual ~ParallelGopEncoder();
+
+  // Checks that libvpx accepts the GOP encoder settings derived from
+  // |config|, and starts the worker threads. Returns |kInvalidArg| when
+  // |config.vpx_config.parallel_gops| is below 2, the status of the
+  // |VpxEncoder| that rejected the settings, or |kEncoderError| when a
+  // thread cannot be started.
+  virtual int Init(const WebmEncoderConfig& config);
+
+  // Adds a copy of |raw_frame| to the GOP being collected, which is queued
+  // for a worker when |raw_frame| starts the next one, and returns the
+  // oldest compressed frame of the GOPs encoded. Returns |kDropped| when the
+  // oldest GOP is still encoding, and the status of a GOP whose encode
+  // failed.
+  virtual int EncodeFrame(const VideoFrame& raw_frame,
+                          VideoFrame* ptr_vpx_frame);
+  virtual int ReadPendingFrame(VideoFrame* ptr_vpx_frame);
+
+  // Queues the GOP being collected, and waits for all GOPs to be encoded.
+  // Returns the status of the first GOP that failed, or |kSuccess|.
+  virtual int Flush();
+
+  // Returns the number of compressed frames of the GOPs encoded ahead of the
+  // first one still encoding or failed.
+  virtual int32 pending_frames() const;
+
+  virtual void SetInputBacklog(int32, int32) {}
+  virtual void ForceKeyframe() { force_keyframe_ = true; }
+  virtual int SetBitrate(int bitrate);
+  virtual int SetFrameSize(int32 width, int32 height);
+  virtual int SetSpeed(int speed);
+  virtual int SetKeyframeInterval(int keyframe_interval);
+
+  // libvpx in the tree has ROI maps for VP8 only: VP9 regions are rejected
+  // with |kInvalidArg|.
+  virtual int SetRegionsOfInterest(
+      const std::vector<RegionOfInterest>& regions);
+
+  // Input is not realtime; the load is always |VideoEncoder::kLoadNormal|.
+  virtual int load_state() const { return VideoEncoder::kLoadNormal; }
+
+  virtual const char* name() const { return "libvpx parallel GOP"; }
+
+  // Accessors. |last_keyframe_time()| is the start of the GOP being
+  // collected, which is the time of the last keyframe of the input.
+  virtual int64 frames_in() const { return frames_in_; }
+  virtual int64 frames_out() const { return frames_out_; }
+  virtual int64 last_keyframe_time() const { return last_keyframe_time_; }
+  virtual int64 last_timestamp() const { return last_timestamp_; }
+  virtual int speed() const { return vpx_config_.speed; }
+
+  // Profiles the frames of all GOP encoders in |ptr_profiler|, which must
+  // outlive the encoder. Must be called before |Init()|.
+  void set_frame_profiler(FrameTypeProfiler* ptr_profiler) {
+    ptr_frame_profiler_ = ptr_profiler;
+  }
+
+ private:
+  // A closed GOP: its raw frames, the settings and frame size it is encoded
+  // with, and its compressed frames. A worker owns all but |done| and
+  // |status| until |done| is set; the encoding thread owns it after.
+  struct Gop {
+    Gop() : width(0), height(0), done(false), status(kSuccess) {}
+    std::deque<VideoFrame> frames;
+    VpxConfig vpx_config;
+    int32 width;
+    int32 height;
+    std::deque<VideoFrame> output;
+    bool done;
+    int status;
+  };
+
+  // Worker thread function: encodes the GOPs of |queue_| until |stop_|.
+  void WorkerThread(int index);
+
+  // Encodes |ptr_gop| from a keyframe with a new |VpxEncoder|, and frees its
+  // raw frames. Returns the status of the |VpxEncoder| call that failed, or
+  // |kSuccess|.
+  int EncodeGop(Gop* ptr_gop);
+
+  // Appends |open_gop_| to |gops_| and |queue_|, and wakes a worker; a GOP
+  // without frames is dropped. Waits while more than |parallel_gops| GOPs
+  // are queued, encoding, or waiting to be returned.
+  void QueueOpenGop();
+
+  // Moves the oldest compressed frame of the leading encoded GOPs to
+  // |ptr_vpx_frame|, and drops the GOPs it empties. Returns |kDropped| when
+  // the oldest GOP is not encoded, or the status of a GOP that failed. Must
+  // be called with |mutex_| held.
+  int TakeFrame(VideoFrame* ptr_vpx_frame);
+
+  // Settings passed to |Init()| with the GOP encoder adjustments; read by
+  // workers, never changed after |Init()|.
+  std::unique_ptr<WebmEncoderConfig> ptr_config_;
+
+  // Profile shared by the GOP encoders, or NULL.
+  FrameTypeProfiler* ptr_frame_profiler_;
+
+  // VPx settings and frame size of the next GOP, owned by the encoding
+  // thread.
+  VpxConfig vpx_config_;
+  int32 width_;
+  int32 height_;
+
+  // The GOP being collected, and whether the next frame starts a new one.
+  std::unique_ptr<Gop> open_gop_;
+  bool force_keyframe_;
+
+  // Closed GOPs not yet returned in full, oldest first, and those waiting for
+  // a worker, protected by |mutex_|. |gop_queued_| is signaled when a GOP is
+  // queued or |stop_| is set, and |gop_done_| when a GOP is encoded.
+  std::deque<std::unique_ptr<Gop>> gops_;
+  std::deque<Gop*> queue_;
+  bool stop_;
+  mutable std::mutex mutex_;
+  std::condition_variable gop_queued_;
+  std::condition_variable gop_done_;
+  std::vector<std::unique_ptr<std::thread>> workers_;
+
+  int64 frames_in_;
+  int64 frames_out_;
+  int64 last_keyframe_time_;
+  int64 last_timestamp_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(ParallelGopEncoder);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_PARALLEL_GOP_ENCODER_H_
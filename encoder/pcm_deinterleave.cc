@@ -0,0 +1,482 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/pcm_deinterleave.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || \
+    defined(__i386__)
+#define WEBMLIVE_HAVE_X86 1
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#include <emmintrin.h>
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(_M_ARM64)
+#define WEBMLIVE_HAVE_NEON 1
+#include <arm_neon.h>
+#endif
+
+// Allows GCC and clang to compile single functions for instruction sets that
+// are not enabled for the whole translation unit. MSVC needs no annotation.
+#if defined(WEBMLIVE_HAVE_X86) && !defined(_MSC_VER)
+#define WEBMLIVE_TARGET(isa) __attribute__((target(isa)))
+#else
+#define WEBMLIVE_TARGET(isa)
+#endif
+
+namespace {
+
+// Multiplier for converting 16 bit samples to float. A power of two, so
+// results match division by 32768 exactly.
+const float kS16Scale = 1.0f / 32768.0f;
+
+//
+// Scalar kernels. Also used for the frames remaining after a SIMD loop.
+//
+
+// Converts frames [|begin|, |end|) of |ptr_samples|.
+inline void ConvertS16(const int16* ptr_samples, int begin, int end,
+                       int channels, float* const* ptr_planes) {
+  for (int i = begin; i < end; ++i) {
+    for (int c = 0; c < channels; ++c) {
+      ptr_planes[c][i] = ptr_samples[i * channels + c] * kS16Scale;
+    }
+  }
+}
+
+inline void ConvertFloat(const float* ptr_samples, int begin, int end,
+                         int channels, float* const* ptr_planes) {
+  for (int i = begin; i < end; ++i) {
+    for (int c = 0; c < channels; ++c) {
+      ptr_planes[c][i] = ptr_samples[i * channels + c];
+    }
+  }
+}
+
+void DeinterleaveS16(const void* ptr_samples, int num_frames, int channels,
+                     float* const* ptr_planes) {
+  ConvertS16(static_cast<const int16*>(ptr_samples), 0, num_frames, channels,
+             ptr_planes);
+}
+
+void DeinterleaveFloat(const void* ptr_samples, int num_frames, int channels,
+                       float* const* ptr_planes) {
+  ConvertFloat(static_cast<const float*>(ptr_samples), 0, num_frames, channels,
+               ptr_planes);
+}
+
+// Fixed channel count versions of the above. A constant channel count lets the
+// compiler unroll the inner loop.
+template <int kChannels>
+void DeinterleaveS16Fixed(const void* ptr_samples, int num_frames,
+                          int /* channels */, float* const* ptr_planes) {
+  ConvertS16(static_cast<const int16*>(ptr_samples), 0, num_frames, kChannels,
+             ptr_planes);
+}
+
+template <int kChannels>
+void DeinterleaveFloatFixed(const void* ptr_samples, int num_frames,
+                            int /* channels */, float* const* ptr_planes) {
+  ConvertFloat(static_cast<const float*>(ptr_samples), 0, num_frames,
+               kChannels, ptr_planes);
+}
+
+#if defined(WEBMLIVE_HAVE_X86)
+
+//
+// SSE2 kernels.
+//
+
+// Sign extends the 16 bit samples in the low halves of |samples|' 32 bit
+// lanes, converts them to float, and stores them at |ptr_plane|.
+WEBMLIVE_TARGET("sse2")
+inline void StoreLowS16Sse2(__m128i samples, float* ptr_plane) {
+  const __m128i low = _mm_srai_epi32(_mm_slli_epi32(samples, 16), 16);
+  _mm_storeu_ps(ptr_plane,
+                _mm_mul_ps(_mm_cvtepi32_ps(low), _mm_set1_ps(kS16Scale)));
+}
+
+// Same as |StoreLowS16Sse2()| for the high halves.
+WEBMLIVE_TARGET("sse2")
+inline void StoreHighS16Sse2(__m128i samples, float* ptr_plane) {
+  const __m128i high = _mm_srai_epi32(samples, 16);
+  _mm_storeu_ps(ptr_plane,
+                _mm_mul_ps(_mm_cvtepi32_ps(high), _mm_set1_ps(kS16Scale)));
+}
+
+// Converts the eight 16 bit samples in |samples| and stores them at
+// |ptr_plane|.
+WEBMLIVE_TARGET("sse2")
+inline void StoreS16x8Sse2(__m128i samples, float* ptr_plane) {
+  StoreHighS16Sse2(_mm_unpacklo_epi16(samples, samples), ptr_plane);
+  StoreHighS16Sse2(_mm_unpackhi_epi16(samples, samples), ptr_plane + 4);
+}
+
+WEBMLIVE_TARGET("sse2")
+void DeinterleaveS16MonoSse2(const void* ptr_samples, int num_frames,
+                             int /* channels */, float* const* ptr_planes) {
+  const int16* const samples = static_cast<const int16*>(ptr_samples);
+  int i = 0;
+  for (; i + 8 <= num_frames; i += 8) {
+    StoreS16x8Sse2(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(samples + i)),
+        ptr_planes[0] + i);
+  }
+  ConvertS16(samples, i, num_frames, 1, ptr_planes);
+}
+
+// Each 32 bit lane holds one frame: left in the low half, right in the high
+// half.
+WEBMLIVE_TARGET("sse2")
+void DeinterleaveS16StereoSse2(const void* ptr_samples, int num_frames,
+                               int /* channels */, float* const* ptr_planes) {
+  const int16* const samples = static_cast<const int16*>(ptr_samples);
+  int i = 0;
+  for (; i + 4 <= num_frames; i += 4) {
+    const __m128i frames =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(samples + i * 2));
+    StoreLowS16Sse2(frames, ptr_planes[0] + i);
+    StoreHighS16Sse2(frames, ptr_planes[1] + i);
+  }
+  ConvertS16(samples, i, num_frames, 2, ptr_planes);
+}
+
+// Each 7.1 frame fills one register; eight frames are transposed into eight
+// channel registers.
+WEBMLIVE_TARGET("sse2")
+void DeinterleaveS16Surround71Sse2(const void* ptr_samples, int num_frames,
+                                   int /* channels */,
+                                   float* const* ptr_planes) {
+  const int16* const samples = static_cast<const int16*>(ptr_samples);
+  const __m128i* const frames = reinterpret_cast<const __m128i*>(samples);
+  int i = 0;
+  for (; i + 8 <= num_frames; i += 8) {
+    const __m128i f0 = _mm_loadu_si128(frames + i + 0);
+    const __m128i f1 = _mm_loadu_si128(frames + i + 1);
+    const __m128i f2 = _mm_loadu_si128(frames + i + 2);
+    const __m128i f3 = _mm_loadu_si128(frames + i + 3);
+    const __m128i f4 = _mm_loadu_si128(frames + i + 4);
+    const __m128i f5 = _mm_loadu_si128(frames + i + 5);
+    const __m128i f6 = _mm_loadu_si128(frames + i + 6);
+    const __m128i f7 = _mm_loadu_si128(frames + i + 7);
+
+    // Pairs of frames: channels 0-3 and 4-7.
+    const __m128i a0 = _mm_unpacklo_epi16(f0, f1);
+    const __m128i a1 = _mm_unpackhi_epi16(f0, f1);
+    const __m128i a2 = _mm_unpacklo_epi16(f2, f3);
+    const __m128i a3 = _mm_unpackhi_epi16(f2, f3);
+    const __m128i a4 = _mm_unpacklo_epi16(f4, f5);
+    const __m128i a5 = _mm_unpackhi_epi16(f4, f5);
+    const __m128i a6 = _mm_unpacklo_epi16(f6, f7);
+    const __m128i a7 = _mm_unpackhi_epi16(f6, f7);
+
+    // Groups of four frames: two channels per register.
+    const __m128i b0 = _mm_unpacklo_epi32(a0, a2);
+    const __m128i b1 = _mm_unpackhi_epi32(a0, a2);
+    const __m128i b2 = _mm_unpacklo_epi32(a1, a3);
+    const __m128i b3 = _mm_unpackhi_epi32(a1, a3);
+    const __m128i b4 = _mm_unpacklo_epi32(a4, a6);
+    const __m128i b5 = _mm_unpackhi_epi32(a4, a6);
+    const __m128i b6 = _mm_unpacklo_epi32(a5, a7);
+    const __m128i b7 = _mm_unpackhi_epi32(a5, a7);
+
+    // All eight frames: one channel per register.
+    StoreS16x8Sse2(_mm_unpacklo_epi64(b0, b4), ptr_planes[0] + i);
+    StoreS16x8Sse2(_mm_unpackhi_epi64(b0, b4), ptr_planes[1] + i);
+    StoreS16x8Sse2(_mm_unpacklo_epi64(b1, b5), ptr_planes[2] + i);
+    StoreS16x8Sse2(_mm_unpackhi_epi64(b1, b5), ptr_planes[3] + i);
+    StoreS16x8Sse2(_mm_unpacklo_epi64(b2, b6), ptr_planes[4] + i);
+    StoreS16x8Sse2(_mm_unpackhi_epi64(b2, b6), ptr_planes[5] + i);
+    StoreS16x8Sse2(_mm_unpacklo_epi64(b3, b7), ptr_planes[6] + i);
+    StoreS16x8Sse2(_mm_unpackhi_epi64(b3, b7), ptr_planes[7] + i);
+  }
+  ConvertS16(samples, i, num_frames, 8, ptr_planes);
+}
+
+WEBMLIVE_TARGET("sse2")
+void DeinterleaveFloatStereoSse2(const void* ptr_samples, int num_frames,
+                                 int /* channels */,
+                                 float* const* ptr_planes) {
+  const float* const samples = static_cast<const float*>(ptr_samples);
+  int i = 0;
+  for (; i + 4 <= num_frames; i += 4) {
+    const __m128 frames01 = _mm_loadu_ps(samples + i * 2);
+    const __m128 frames23 = _mm_loadu_ps(samples + i * 2 + 4);
+    _mm_storeu_ps(ptr_planes[0] + i,
+                  _mm_shuffle_ps(frames01, frames23, _MM_SHUFFLE(2, 0, 2, 0)));
+    _mm_storeu_ps(ptr_planes[1] + i,
+                  _mm_shuffle_ps(frames01, frames23, _MM_SHUFFLE(3, 1, 3, 1)));
+  }
+  ConvertFloat(samples, i, num_frames, 2, ptr_planes);
+}
+
+// Transposes 4x4 blocks: channels 0-3 and 4-7 of four frames at a time.
+WEBMLIVE_TARGET("sse2")
+void DeinterleaveFloatSurround71Sse2(const void* ptr_samples, int num_frames,
+                                     int /* channels */,
+                                     float* const* ptr_planes) {
+  const float* const samples = static_cast<const float*>(ptr_samples);
+  int i = 0;
+  for (; i + 4 <= num_frames; i += 4) {
+    const float* const block = samples + i * 8;
+    for (int half = 0; half < 2; ++half) {
+      __m128 r0 = _mm_loadu_ps(block + half * 4);
+      __m128 r1 = _mm_loadu_ps(block + half * 4 + 8);
+      __m128 r2 = _mm_loadu_ps(block + half * 4 + 16);
+      __m128 r3 = _mm_loadu_ps(block + half * 4 + 24);
+      _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+      _mm_storeu_ps(ptr_planes[half * 4 + 0] + i, r0);
+      _mm_storeu_ps(ptr_planes[half * 4 + 1] + i, r1);
+      _mm_storeu_ps(ptr_planes[half * 4 + 2] + i, r2);
+      _mm_storeu_ps(ptr_planes[half * 4 + 3] + i, r3);
+    }
+  }
+  ConvertFloat(samples, i, num_frames, 8, ptr_planes);
+}
+
+//
+// AVX2 kernels.
+//
+
+// Converts the 32 bit integer samples in |samples| and stores them at
+// |ptr_plane|.
+WEBMLIVE_TARGET("avx2")
+inline void StoreS32x8Avx2(__m256i samples, float* ptr_plane) {
+  _mm256_storeu_ps(ptr_plane, _mm256_mul_ps(_mm256_cvtepi32_ps(samples),
+                                            _mm256_set1_ps(kS16Scale)));
+}
+
+WEBMLIVE_TARGET("avx2")
+void DeinterleaveS16MonoAvx2(const void* ptr_samples, int num_frames,
+                             int /* channels */, float* const* ptr_planes) {
+  const int16* const samples = static_cast<const int16*>(ptr_samples);
+  int i = 0;
+  for (; i + 8 <= num_frames; i += 8) {
+    const __m128i frames =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(samples + i));
+    StoreS32x8Avx2(_mm256_cvtepi16_epi32(frames), ptr_planes[0] + i);
+  }
+  ConvertS16(samples, i, num_frames, 1, ptr_planes);
+}
+
+WEBMLIVE_TARGET("avx2")
+void DeinterleaveS16StereoAvx2(const void* ptr_samples, int num_frames,
+                               int /* channels */, float* const* ptr_planes) {
+  const int16* const samples = static_cast<const int16*>(ptr_samples);
+  int i = 0;
+  for (; i + 8 <= num_frames; i += 8) {
+    const __m256i frames =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(samples + i * 2));
+    StoreS32x8Avx2(_mm256_srai_epi32(_mm256_slli_epi32(frames, 16), 16),
+                   ptr_planes[0] + i);
+    StoreS32x8Avx2(_mm256_srai_epi32(frames, 16), ptr_planes[1] + i);
+  }
+  ConvertS16(samples, i, num_frames, 2, ptr_planes);
+}
+
+// |_mm256_shuffle_ps()| works within 128 bit lanes, so the results hold frames
+// 0 1 4 5 2 3 6 7 and are put in order by a 64 bit permute.
+WEBMLIVE_TARGET("avx2")
+void DeinterleaveFloatStereoAvx2(const void* ptr_samples, int num_frames,
+                                 int /* channels */,
+                                 float* const* ptr_planes) {
+  const float* const samples = static_cast<const float*>(ptr_samples);
+  int i = 0;
+  for (; i + 8 <= num_frames; i += 8) {
+    const __m256 frames0123 = _mm256_loadu_ps(samples + i * 2);
+    const __m256 frames4567 = _mm256_loadu_ps(samples + i * 2 + 8);
+    const __m256 left = _mm256_shuffle_ps(frames0123, frames4567,
+                                          _MM_SHUFFLE(2, 0, 2, 0));
+    const __m256 right = _mm256_shuffle_ps(frames0123, frames4567,
+                                           _MM_SHUFFLE(3, 1, 3, 1));
+    _mm256_storeu_ps(ptr_planes[0] + i, _mm256_castpd_ps(_mm256_permute4x64_pd(
+        _mm256_castps_pd(left), _MM_SHUFFLE(3, 1, 2, 0))));
+    _mm256_storeu_ps(ptr_planes[1] + i, _mm256_castpd_ps(_mm256_permute4x64_pd(
+        _mm256_castps_pd(right), _MM_SHUFFLE(3, 1, 2, 0))));
+  }
+  ConvertFloat(samples, i, num_frames, 2, ptr_planes);
+}
+
+//
+// CPU detection.
+//
+
+// Stores the eax, ebx, ecx and edx values returned by the cpuid instruction
+// for |leaf| and |subleaf| in |ptr_info|.
+void Cpuid(int leaf, int subleaf, int* ptr_info) {
+#if defined(_MSC_VER)
+  __cpuidex(ptr_info, leaf, subleaf);
+#else
+  unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+  __cpuid_count(leaf, subleaf, eax, ebx, ecx, edx);
+  ptr_info[0] = static_cast<int>(eax);
+  ptr_info[1] = static_cast<int>(ebx);
+  ptr_info[2] = static_cast<int>(ecx);
+  ptr_info[3] = static_cast<int>(edx);
+#endif
+}
+
+// Returns the low 32 bits of XCR0, the register showing which register sets
+// the operating system saves. Callers must check for OSXSAVE support first.
+unsigned int ReadXcr0() {
+#if defined(_MSC_VER)
+  return static_cast<unsigned int>(_xgetbv(0));
+#else
+  unsigned int eax = 0, edx = 0;
+  __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+  return eax;
+#endif
+}
+
+#elif defined(WEBMLIVE_HAVE_NEON)
+
+//
+// NEON kernels.
+//
+
+// Converts the eight 16 bit samples in |samples| and stores them at
+// |ptr_plane|.
+inline void StoreS16x8Neon(int16x8_t samples, float* ptr_plane) {
+  vst1q_f32(ptr_plane, vmulq_n_f32(
+      vcvtq_f32_s32(vmovl_s16(vget_low_s16(samples))), kS16Scale));
+  vst1q_f32(ptr_plane + 4, vmulq_n_f32(
+      vcvtq_f32_s32(vmovl_s16(vget_high_s16(samples))), kS16Scale));
+}
+
+void DeinterleaveS16MonoNeon(const void* ptr_samples, int num_frames,
+                             int /* channels */, float* const* ptr_planes) {
+  const int16* const samples = static_cast<const int16*>(ptr_samples);
+  int i = 0;
+  for (; i + 8 <= num_frames; i += 8) {
+    StoreS16x8Neon(vld1q_s16(samples + i), ptr_planes[0] + i);
+  }
+  ConvertS16(samples, i, num_frames, 1, ptr_planes);
+}
+
+void DeinterleaveS16StereoNeon(const void* ptr_samples, int num_frames,
+                               int /* channels */, float* const* ptr_planes) {
+  const int16* const samples = static_cast<const int16*>(ptr_samples);
+  int i = 0;
+  for (; i + 8 <= num_frames; i += 8) {
+    const int16x8x2_t frames = vld2q_s16(samples + i * 2);
+    StoreS16x8Neon(frames.val[0], ptr_planes[0] + i);
+    StoreS16x8Neon(frames.val[1], ptr_planes[1] + i);
+  }
+  ConvertS16(samples, i, num_frames, 2, ptr_planes);
+}
+
+void DeinterleaveFloatStereoNeon(const void* ptr_samples, int num_frames,
+                                 int /* channels */,
+                                 float* const* ptr_planes) {
+  const float* const samples = static_cast<const float*>(ptr_samples);
+  int i = 0;
+  for (; i + 4 <= num_frames; i += 4) {
+    const float32x4x2_t frames = vld2q_f32(samples + i * 2);
+    vst1q_f32(ptr_planes[0] + i, frames.val[0]);
+    vst1q_f32(ptr_planes[1] + i, frames.val[1]);
+  }
+  ConvertFloat(samples, i, num_frames, 2, ptr_planes);
+}
+
+#endif  // WEBMLIVE_HAVE_X86
+
+}  // anonymous namespace
+
+namespace webmlive {
+
+int GetCpuFeatures() {
+  int features = 0;
+#if defined(WEBMLIVE_HAVE_X86)
+  int info[4] = {0};
+  Cpuid(0, 0, info);
+  const int max_leaf = info[0];
+  if (max_leaf < 1) {
+    return features;
+  }
+  Cpuid(1, 0, info);
+  const int kSse2Bit = 1 << 26;    // edx
+  const int kOsxsaveBit = 1 << 27;  // ecx
+  const int kAvxBit = 1 << 28;      // ecx
+  if (info[3] & kSse2Bit) {
+    features |= kCpuFeatureSse2;
+  }
+
+  // AVX2 requires the OS to save the upper halves of the ymm registers.
+  const int kXmmYmmState = 0x6;
+  const bool os_saves_ymm = (info[2] & kOsxsaveBit) && (info[2] & kAvxBit) &&
+                            (ReadXcr0() & kXmmYmmState) == kXmmYmmState;
+  if (os_saves_ymm && max_leaf >= 7) {
+    Cpuid(7, 0, info);
+    const int kAvx2Bit = 1 << 5;  // ebx
+    if (info[1] & kAvx2Bit) {
+      features |= kCpuFeatureAvx2;
+    }
+  }
+#elif defined(WEBMLIVE_HAVE_NEON)
+  // The build enables NEON for the whole binary.
+  features |= kCpuFeatureNeon;
+#endif
+  return features;
+}
+
+PcmDeinterleaveFunc SelectPcmDeinterleave(AudioFormat format, int channels,
+                                          int cpu_features) {
+  if (channels < 1) {
+    return NULL;
+  }
+  if (format == kAudioFormatPcm) {
+#if defined(WEBMLIVE_HAVE_X86)
+    if (cpu_features & kCpuFeatureAvx2) {
+      if (channels == 1) return &DeinterleaveS16MonoAvx2;
+      if (channels == 2) return &DeinterleaveS16StereoAvx2;
+    }
+    if (cpu_features & kCpuFeatureSse2) {
+      if (channels == 1) return &DeinterleaveS16MonoSse2;
+      if (channels == 2) return &DeinterleaveS16StereoSse2;
+      if (channels == 8) return &DeinterleaveS16Surround71Sse2;
+    }
+#elif defined(WEBMLIVE_HAVE_NEON)
+    if (cpu_features & kCpuFeatureNeon) {
+      if (channels == 1) return &DeinterleaveS16MonoNeon;
+      if (channels == 2) return &DeinterleaveS16StereoNeon;
+    }
+#endif
+    switch (channels) {
+      case 1: return &DeinterleaveS16Fixed<1>;
+      case 2: return &DeinterleaveS16Fixed<2>;
+      case 6: return &DeinterleaveS16Fixed<6>;
+      case 8: return &DeinterleaveS16Fixed<8>;
+      default: return &DeinterleaveS16;
+    }
+  } else if (format == kAudioFormatIeeeFloat) {
+#if defined(WEBMLIVE_HAVE_X86)
+    if (cpu_features & kCpuFeatureAvx2) {
+      if (channels == 2) return &DeinterleaveFloatStereoAvx2;
+    }
+    if (cpu_features & kCpuFeatureSse2) {
+      if (channels == 2) return &DeinterleaveFloatStereoSse2;
+      if (channels == 8) return &DeinterleaveFloatSurround71Sse2;
+    }
+#elif defined(WEBMLIVE_HAVE_NEON)
+    if (cpu_features & kCpuFeatureNeon) {
+      if (channels == 2) return &DeinterleaveFloatStereoNeon;
+    }
+#endif
+    switch (channels) {
+      case 1: return &DeinterleaveFloatFixed<1>;
+      case 2: return &DeinterleaveFloatFixed<2>;
+      case 6: return &DeinterleaveFloatFixed<6>;
+      case 8: return &DeinterleaveFloatFixed<8>;
+      default: return &DeinterleaveFloat;
+    }
+  }
+  return NULL;
+}
+
+}  // namespace webmlive
@@ -0,0 +1,46 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_PCM_DEINTERLEAVE_H_
+#define WEBMLIVE_ENCODER_PCM_DEINTERLEAVE_H_
+
+#include "encoder/audio_encoder.h"
+#include "encoder/basictypes.h"
+
+namespace webmlive {
+
+// Deinterleaves |num_frames| frames of |channels| channel interleaved audio
+// from |ptr_samples| into the per channel buffers in |ptr_planes|, converting
+// samples to float in the range [-1.0, 1.0]. Each buffer in |ptr_planes| must
+// hold |num_frames| samples.
+typedef void (*PcmDeinterleaveFunc)(const void* ptr_samples,
+                                    int num_frames,
+                                    int channels,
+                                    float* const* ptr_planes);
+
+// Instruction set extensions used by the deinterleave kernels.
+enum CpuFeature {
+  kCpuFeatureSse2 = 1 << 0,
+  kCpuFeatureAvx2 = 1 << 1,
+  kCpuFeatureNeon = 1 << 2,
+};
+
+// Returns a mask of |CpuFeature| values supported by the CPU and operating
+// system. Features the compiler cannot target are never reported.
+int GetCpuFeatures();
+
+// Returns the fastest deinterleave function for |channels| channel input in
+// |format| on a CPU supporting |cpu_features|. Mono, stereo, 5.1 and 7.1 have
+// dedicated kernels; other channel counts use a generic loop. Returns NULL
+// when |format| is not |kAudioFormatPcm| (16 bit) or |kAudioFormatIeeeFloat|,
+// or when |channels| is less than 1.
+PcmDeinterleaveFunc SelectPcmDeinterleave(AudioFormat format, int channels,
+                                          int cpu_features);
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_PCM_DEINTERLEAVE_H_
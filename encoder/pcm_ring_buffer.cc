@@ -0,0 +1,249 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/pcm_ring_buffer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <limits>
+#include <new>
+
+#include "encoder/buffer_pool-inl.h"
+#include "glog/logging.h"
+
+namespace webmlive {
+
+const int32 PcmRingBuffer::kMinWrites;
+
+PcmRingBuffer::PcmRingBuffer()
+    : policy_(kDropNewest),
+      block_align_(0),
+      capacity_(0),
+      max_writes_(0),
+      write_head_(0),
+      write_tail_(0),
+      read_pos_(0),
+      write_pos_(0),
+      span_length_(0) {
+}
+
+PcmRingBuffer::~PcmRingBuffer() {
+  // Return the accounted bytes of writes still in the ring.
+  std::lock_guard<std::mutex> lock(mutex_);
+  int64 bytes = 0;
+  for (int32 i = write_head_; i != write_tail_; i = NextWrite(i)) {
+    bytes += writes_[i].length;
+  }
+  counters_.OnRemove(WriteCount(), true, bytes);
+}
+
+int PcmRingBuffer::Init(const AudioConfig& config, int duration,
+                        OverflowPolicy policy) {
+  if (storage_) {
+    LOG(ERROR) << "PcmRingBuffer already initialized.";
+    return kAlreadyInitialized;
+  }
+  int32 block_align = config.block_align;
+  if (block_align == 0) {
+    block_align = config.channels * config.bits_per_sample / 8;
+  }
+  if (duration <= 0 || block_align <= 0 || config.sample_rate == 0) {
+    LOG(ERROR) << "cannot Init PcmRingBuffer, invalid duration or config.";
+    return kInvalidArg;
+  }
+
+  // Round the storage up to whole sample frames, so that the end of the ring
+  // falls between frames.
+  const int64 frames =
+      (static_cast<int64>(config.sample_rate) * duration + 999) / 1000;
+  const int64 capacity = frames * block_align;
+  if (capacity > std::numeric_limits<int32>::max()) {
+    LOG(ERROR) << "cannot Init PcmRingBuffer, " << duration
+               << "ms of audio exceeds the ring size limit.";
+    return kInvalidArg;
+  }
+  int32 allocated = 0;
+  storage_ = AllocateMediaBuffer(std::shared_ptr<MediaArena>(),
+                                 static_cast<int32>(capacity), &allocated);
+  const int32 max_writes = std::max(kMinWrites, duration) + 1;
+  writes_.reset(new (std::nothrow) WriteRecord[max_writes]);  // NOLINT
+  if (!storage_ || !writes_) {
+    LOG(ERROR) << "cannot Init PcmRingBuffer, no memory.";
+    storage_.reset();
+    writes_.reset();
+    return kNoMemory;
+  }
+
+  // Map the pages now instead of on the capture thread's first writes.
+  memset(storage_.get(), 0, allocated);
+  config_ = config;
+  config_.block_align = static_cast<uint16>(block_align);
+  policy_ = policy;
+  block_align_ = block_align;
+  capacity_ = static_cast<int32>(capacity);
+  max_writes_ = max_writes;
+  counters_.Reset(max_writes_ - 1);
+  LOG(INFO) << "PcmRingBuffer capacity " << capacity_ << " bytes ("
+            << duration << "ms), " << max_writes_ - 1 << " writes.";
+  return kSuccess;
+}
+
+int PcmRingBuffer::Write(int64 timestamp, const uint8* ptr_data,
+                         int32 length) {
+  if (!ptr_data || length <= 0 || length > capacity_ ||
+      length % block_align_ != 0) {
+    return kInvalidArg;
+  }
+  int status = kSuccess;
+  int64 position = 0;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    status = Reserve(length);
+    position = write_pos_;
+  }
+  if (status == kFull) {
+    counters_.OnReject();
+    return kFull;
+  }
+
+  // The reserved bytes are not visible to the consumer until |write_pos_|
+  // moves past them, so they are copied without the lock.
+  const int32 offset = static_cast<int32>(position % capacity_);
+  const int32 first_length = std::min(length, capacity_ - offset);
+  memcpy(storage_.get() + offset, ptr_data, first_length);
+  if (first_length < length) {
+    memcpy(storage_.get(), ptr_data + first_length, length - first_length);
+  }
+
+  int32 occupancy = 0;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    WriteRecord& record = writes_[write_tail_];
+    record.position = position;
+    record.length = length;
+    record.timestamp = timestamp;
+    write_tail_ = NextWrite(write_tail_);
+    write_pos_ = position + length;
+    occupancy = WriteCount();
+  }
+  counters_.OnCommit(occupancy, length);
+  data_ready_.notify_one();
+  return status;
+}
+
+int PcmRingBuffer::Read(PcmSpan* ptr_span) {
+  if (!ptr_span) {
+    return kInvalidArg;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (span_length_ > 0) {
+    LOG(ERROR) << "cannot Read from PcmRingBuffer, a span is held.";
+    return kInvalidArg;
+  }
+  if (write_head_ == write_tail_) {
+    return kEmpty;
+  }
+  int64 timestamp = 0;
+  int32 length = 0;
+  FrontSpan(&timestamp, &length);
+  ptr_span->ptr_data = storage_.get() + read_pos_ % capacity_;
+  ptr_span->length = length;
+  ptr_span->timestamp = timestamp;
+  span_length_ = length;
+  return kSuccess;
+}
+
+void PcmRingBuffer::Release() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (span_length_ == 0) {
+    return;
+  }
+  read_pos_ += span_length_;
+  span_length_ = 0;
+  const WriteRecord& record = writes_[write_head_];
+  if (read_pos_ >= record.position + record.length) {
+    counters_.OnRemove(1, false, record.length);
+    write_head_ = NextWrite(write_head_);
+  }
+}
+
+int PcmRingBuffer::FrontTimestamp(int64* ptr_timestamp) const {
+  if (!ptr_timestamp) {
+    return kInvalidArg;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (write_head_ == write_tail_) {
+    return kEmpty;
+  }
+  int32 length = 0;
+  FrontSpan(ptr_timestamp, &length);
+  return kSuccess;
+}
+
+bool PcmRingBuffer::IsEmpty() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return write_head_ == write_tail_;
+}
+
+int PcmRingBuffer::WaitForData(int timeout_ms) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  const bool ready = data_ready_.wait_for(
+      lock, std::chrono::milliseconds(timeout_ms),
+      [this] { return write_head_ != write_tail_; });
+  return ready ? kSuccess : kEmpty;
+}
+
+void PcmRingBuffer::WaitForWrite(int timeout_ms) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  data_ready_.wait_for(lock, std::chrono::milliseconds(timeout_ms));
+}
+
+void PcmRingBuffer::GetStats(BufferPoolStats* ptr_stats) const {
+  if (!ptr_stats) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  counters_.GetStats(WriteCount(), ptr_stats);
+}
+
+int32 PcmRingBuffer::WriteCount() const {
+  const int32 count = write_tail_ - write_head_;
+  return count >= 0 ? count : count + max_writes_;
+}
+
+int PcmRingBuffer::Reserve(int32 length) {
+  int status = kSuccess;
+  for (;;) {
+    const int64 bytes_free = capacity_ - (write_pos_ - read_pos_);
+    if (bytes_free >= length && NextWrite(write_tail_) != write_head_) {
+      return status;
+    }
+    // The oldest write can be dropped when the consumer holds no span of it.
+    if (policy_ != kDropOldest || span_length_ > 0 ||
+        write_head_ == write_tail_) {
+      return kFull;
+    }
+    const WriteRecord& record = writes_[write_head_];
+    read_pos_ = record.position + record.length;
+    counters_.OnRemove(1, true, record.length);
+    write_head_ = NextWrite(write_head_);
+    status = kDroppedOldest;
+  }
+}
+
+void PcmRingBuffer::FrontSpan(int64* ptr_timestamp, int32* ptr_length) const {
+  const WriteRecord& record = writes_[write_head_];
+  const int64 frames_read = (read_pos_ - record.position) / block_align_;
+  *ptr_timestamp =
+      record.timestamp + frames_read * 1000 / config_.sample_rate;
+  const int64 record_end = record.position + record.length;
+  const int64 ring_end = read_pos_ - read_pos_ % capacity_ + capacity_;
+  *ptr_length = static_cast<int32>(std::min(record_end, ring_end) - read_pos_);
+}
+
+}  // namespace webmlive
@@ -0,0 +1,202 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_PCM_RING_BUFFER_H_
+#define WEBMLIVE_ENCODER_PCM_RING_BUFFER_H_
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+
+#include "encoder/audio_encoder.h"
+#include "encoder/basictypes.h"
+#include "encoder/buffer_pool.h"
+#include "encoder/encoder_base.h"
+#include "encoder/media_arena.h"
+
+namespace webmlive {
+
+// Fixed size ring of interleaved uncompressed audio, which carries captured
+// samples from the capture thread to the audio encoder. The storage is
+// allocated and written once by |Init()|, sized to hold a configured duration
+// of audio, so captured buffers are copied into it instead of becoming queued
+// |AudioBuffer| objects. The timestamp of each write is recorded with it,
+// and the consumer reads the samples back in place as |PcmSpan|s.
+//
+// Exactly one thread may call |Write()|, and exactly one thread may call the
+// consumer methods (|Read()|, |Release()|, |FrontTimestamp()|, |IsEmpty()|
+// and |WaitForData()|). Samples are copied in and read out without holding
+// the lock, which guards only the read and write positions.
+//
+// Notes:
+// - A span holds the samples of one write, or of the part of it before the
+//   end of the ring, so every span has the exact timestamp of its first
+//   sample.
+// - Writes are recorded in a ring of |max_writes()| entries, which counts
+//   toward the ring being full like the sample storage does.
+class PcmRingBuffer {
+ public:
+  enum {
+    kAlreadyInitialized = -3,
+    kNoMemory = -2,
+    kInvalidArg = -1,
+    kSuccess = 0,
+
+    // No samples in the ring.
+    kEmpty = 1,
+
+    // The write did not fit in the ring and was dropped.
+    kFull = 2,
+
+    // The write was stored after the oldest samples in the ring were
+    // dropped to make room.
+    kDroppedOldest = 3,
+  };
+
+  // Handling of a write that does not fit in the ring.
+  enum OverflowPolicy {
+    // The write is dropped, and the samples in the ring are kept.
+    kDropNewest = 0,
+
+    // The oldest samples are dropped until the write fits, which bounds the
+    // delay of the samples the encoder reads. Samples the consumer holds a
+    // span of cannot be dropped; when the write does not fit without them it
+    // is dropped instead.
+    kDropOldest = 1,
+  };
+
+  // Default duration of audio the ring holds, in milliseconds.
+  static const int kDefaultDuration = 2000;
+
+  // Fewest writes recorded; at least one per millisecond of |duration| is.
+  static const int32 kMinWrites = 64;
+
+  PcmRingBuffer();
+  ~PcmRingBuffer();
+
+  // Allocates storage for |duration| milliseconds of audio in the format of
+  // |config|, which must be uncompressed, and returns |kSuccess|. Returns
+  // |kInvalidArg| when |duration| is not positive or |config| describes no
+  // samples, |kNoMemory| when allocation fails, and |kAlreadyInitialized|
+  // when |Init()| has already been called.
+  int Init(const AudioConfig& config, int duration, OverflowPolicy policy);
+
+  // Producer: copies the |length| bytes of interleaved samples at |ptr_data|,
+  // the first captured at |timestamp| milliseconds, into the ring. Returns
+  // |kSuccess|, or |kDroppedOldest| when |kDropOldest| made room for them.
+  // Returns |kFull| when they were dropped, and |kInvalidArg| when |ptr_data|
+  // is NULL, or |length| is not a whole number of sample frames, or exceeds
+  // |capacity()|.
+  int Write(int64 timestamp, const uint8* ptr_data, int32 length);
+
+  // Consumer: points |ptr_span| at the oldest samples in the ring, which stay
+  // valid until |Release()|, and returns |kSuccess|. Returns |kEmpty| when
+  // the ring is empty, and |kInvalidArg| when |ptr_span| is NULL or a span is
+  // already held.
+  int Read(PcmSpan* ptr_span);
+
+  // Consumer: removes the samples of the span returned by |Read()| from the
+  // ring. Does nothing when no span is held.
+  void Release();
+
+  // Consumer: writes the timestamp of the span available in the next call to
+  // |Read()| to |ptr_timestamp|. Returns |kEmpty| when the ring is empty.
+  int FrontTimestamp(int64* ptr_timestamp) const;
+
+  // Returns true when the ring holds no samples.
+  bool IsEmpty() const;
+
+  // Consumer: waits up to |timeout_ms| for samples. Returns |kSuccess| when
+  // samples are available, or |kEmpty| on timeout.
+  int WaitForData(int timeout_ms);
+
+  // Consumer: waits up to |timeout_ms| for the next |Write()|, also when
+  // samples are already available. May return early.
+  void WaitForWrite(int timeout_ms);
+
+  // Copies the ring counters to |ptr_stats|. Writes are counted as buffer
+  // objects: a write is committed by |Write()|, and decommitted once the
+  // consumer releases its last sample. May be called from any thread.
+  void GetStats(BufferPoolStats* ptr_stats) const;
+
+  // Same as |BufferPool::set_memory_subsystem()|. Accounts the bytes of
+  // writes waiting in the ring.
+  void set_memory_subsystem(int subsystem) {
+    counters_.set_memory_subsystem(subsystem);
+  }
+
+  const AudioConfig& config() const { return config_; }
+
+  // Size of the sample storage, in bytes, and the number of writes the ring
+  // can hold.
+  int32 capacity() const { return capacity_; }
+  int32 max_writes() const { return max_writes_ > 0 ? max_writes_ - 1 : 0; }
+
+ private:
+  struct WriteRecord {
+    WriteRecord() : position(0), length(0), timestamp(0) {}
+    int64 position;
+    int32 length;
+    int64 timestamp;
+  };
+
+  // Returns the index in |writes_| following |index|.
+  int32 NextWrite(int32 index) const {
+    return (index + 1 == max_writes_) ? 0 : index + 1;
+  }
+
+  // Returns the number of recorded writes. Called with |mutex_| held.
+  int32 WriteCount() const;
+
+  // Makes room for |length| bytes and one more write record, dropping the
+  // oldest writes when |policy_| allows. Returns |kSuccess|,
+  // |kDroppedOldest| or |kFull|. Called with |mutex_| held.
+  int Reserve(int32 length);
+
+  // Returns the timestamp of the sample at |read_pos_| and the length of the
+  // span starting there. Called with |mutex_| held on a non-empty ring.
+  void FrontSpan(int64* ptr_timestamp, int32* ptr_length) const;
+
+  AudioConfig config_;
+  OverflowPolicy policy_;
+  int32 block_align_;
+
+  // Sample storage.
+  MediaBuffer storage_;
+  int32 capacity_;
+
+  // Write records, from |write_head_| up to |write_tail_|. |max_writes_| is
+  // one more than the number of usable entries so that a full ring can be
+  // distinguished from an empty ring.
+  std::unique_ptr<WriteRecord[]> writes_;
+  int32 max_writes_;
+  int32 write_head_;
+  int32 write_tail_;
+
+  // Stream positions, in bytes since |Init()|, of the oldest sample and of
+  // the end of the newest write. Their offsets in |storage_| are the
+  // positions modulo |capacity_|.
+  int64 read_pos_;
+  int64 write_pos_;
+
+  // Length of the span held by the consumer, or 0.
+  int32 span_length_;
+
+  // Write and removal counters. Removals are counted with |mutex_| held
+  // since both threads remove writes.
+  BufferPoolCounters counters_;
+
+  // Protects the members above after |Init()|. |data_ready_| is signalled
+  // after each write.
+  mutable std::mutex mutex_;
+  std::condition_variable data_ready_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(PcmRingBuffer);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_PCM_RING_BUFFER_H_
@@ -0,0 +1,106 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/pipeline_stage.h"
+
+#include <new>
+
+#include "encoder/thread_util.h"
+#include "glog/logging.h"
+
+namespace webmlive {
+
+PipelineStage::PipelineStage()
+    : stop_(false), status_(kSuccess), steps_(0), idle_steps_(0),
+      busy_us_(0), backpressure_waits_(0), backpressure_us_(0) {
+}
+
+PipelineStage::~PipelineStage() {
+  Stop();
+}
+
+int PipelineStage::Start(const std::string& name,
+                         const StopFunc& stop_requested,
+                         const StepFunc& step) {
+  if (!stop_requested || !step) {
+    LOG(ERROR) << "pipeline stage " << name << " needs step and stop "
+               << "functions.";
+    return kInvalidArg;
+  }
+  if (thread_) {
+    LOG(ERROR) << "pipeline stage " << name_ << " already started.";
+    return kRunning;
+  }
+  name_ = name;
+  stop_requested_ = stop_requested;
+  step_ = step;
+  stop_ = false;
+  status_ = kSuccess;
+  thread_ = std::shared_ptr<std::thread>(
+      new (std::nothrow) std::thread(  // NOLINT
+          std::bind(&PipelineStage::StageThread, this)));
+  if (!thread_) {
+    LOG(ERROR) << "cannot construct pipeline stage " << name_ << " thread!";
+    return kNoMemory;
+  }
+  return kSuccess;
+}
+
+void PipelineStage::Stop() {
+  if (!thread_) {
+    return;
+  }
+  stop_ = true;
+  thread_->join();
+  thread_.reset();
+}
+
+bool PipelineStage::StopRequested() const {
+  return stop_.load(std::memory_order_relaxed) || stop_requested_();
+}
+
+void PipelineStage::GetStats(PipelineStageStats* ptr_stats) const {
+  ptr_stats->steps = steps_.load(std::memory_order_relaxed);
+  ptr_stats->idle_steps = idle_steps_.load(std::memory_order_relaxed);
+  ptr_stats->busy_us = busy_us_.load(std::memory_order_relaxed);
+  ptr_stats->backpressure_waits =
+      backpressure_waits_.load(std::memory_order_relaxed);
+  ptr_stats->backpressure_us =
+      backpressure_us_.load(std::memory_order_relaxed);
+  ptr_stats->status = status();
+}
+
+void PipelineStage::StageThread() {
+  ScopedThreadRegistration registration(name_);
+  LOG(INFO) << "pipeline stage " << name_ << " started.";
+  int status = kSuccess;
+  while (!StopRequested()) {
+    const Clock::time_point step_start = Clock::now();
+    status = step_();
+    if (status == kIdle) {
+      Add(&idle_steps_, static_cast<int64>(1));
+      continue;
+    }
+    Add(&steps_, static_cast<int64>(1));
+    Add(&busy_us_, ElapsedUs(step_start));
+    if (status != kSuccess) {
+      break;
+    }
+  }
+  if (status < 0) {
+    LOG(ERROR) << "pipeline stage " << name_ << " failed: " << status;
+    status_.store(status, std::memory_order_release);
+  }
+  LOG(INFO) << "pipeline stage " << name_ << " finished.";
+}
+
+int64 PipelineStage::ElapsedUs(Clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      Clock::now() - start).count();
+}
+
+}  // namespace webmlive
@@ -0,0 +1,168 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_PIPELINE_STAGE_H_
+#define WEBMLIVE_ENCODER_PIPELINE_STAGE_H_
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+
+namespace webmlive {
+
+// Counters of a |PipelineStage|.
+struct PipelineStageStats {
+  PipelineStageStats()
+      : steps(0), idle_steps(0), busy_us(0), backpressure_waits(0),
+        backpressure_us(0), status(0) {}
+
+  // Steps that did work, and steps that found no input.
+  int64 steps;
+  int64 idle_steps;
+
+  // Time spent in steps that did work, in microseconds, including the
+  // backpressure waits below.
+  int64 busy_us;
+
+  // Waits of |PipelineStage::Push()| for a full output queue, and their total
+  // time in microseconds.
+  int64 backpressure_waits;
+  int64 backpressure_us;
+
+  // Status the stage stopped with: |PipelineStage::kSuccess| while running
+  // or after a clean stop, else the error returned by its step.
+  int status;
+};
+
+// A thread of the encoder pipeline that repeatedly runs one step, which reads
+// input from a bounded queue, processes it, and pushes the result to the
+// next queue. The queues are |BufferPool|s or |SpscBufferPool|s owned by the
+// caller; the stage supplies the loop, the backpressure waits on a full
+// output queue, the shutdown handshake and the counters, so that each stage
+// only implements its step.
+//
+// The step returns |kSuccess| after doing work, |kIdle| when it found no input
+// within its own bounded wait, |kFinished| to end the stage cleanly, and a
+// negative status to stop it with an error. The stage stops before the next
+// step once |Stop()| is called or the stop function passed to |Start()|
+// returns true; input left in the queues is drained by the caller after
+// |Stop()| returns.
+//
+// Notes:
+// - |Start()| and |Stop()| must be called from the same thread.
+// - |Push()|, |StopRequested()| may be called from the step only.
+// - |GetStats()|, |status()| are thread safe.
+class PipelineStage {
+ public:
+  typedef std::function<int()> StepFunc;
+  typedef std::function<bool()> StopFunc;
+
+  enum {
+    kRunning = -3,
+    kNoMemory = -2,
+    kInvalidArg = -1,
+    kSuccess = 0,
+
+    // Step results.
+    kIdle = 1,
+    kFinished = 2,
+  };
+
+  // Maximum time in milliseconds |Push()| sleeps before checking for a stop.
+  static const int kDefaultWaitTimeout = 10;
+
+  PipelineStage();
+
+  // Stops the stage.
+  ~PipelineStage();
+
+  // Starts a thread registered as |name| with |ThreadRegistry| that runs
+  // |step| until the stage stops. |stop_requested| is checked before each
+  // step and during backpressure waits. Returns |kSuccess|, |kInvalidArg|
+  // when a function is empty, |kRunning| when the stage is already started,
+  // or |kNoMemory|.
+  int Start(const std::string& name, const StopFunc& stop_requested,
+            const StepFunc& step);
+
+  // Requests a stop and joins the thread. Does nothing when the stage is not
+  // started.
+  void Stop();
+
+  // Returns true once |Stop()| is called or the stop function returns true.
+  bool StopRequested() const;
+
+  // Commits |ptr_buffer| to |ptr_queue|, a |BufferPool| or |SpscBufferPool|,
+  // waiting while it is full and the stage is not stopping. Returns the
+  // status of |Commit()|: |kFull| only when the stage stopped with the queue
+  // still full.
+  template <class Queue, class Buffer>
+  int Push(Queue* ptr_queue, Buffer* ptr_buffer);
+
+  // Returns the status the stage stopped with. See |PipelineStageStats|.
+  int status() const { return status_.load(std::memory_order_acquire); }
+
+  // Copies the counters to |ptr_stats|.
+  void GetStats(PipelineStageStats* ptr_stats) const;
+
+  const std::string& name() const { return name_; }
+
+ private:
+  typedef std::chrono::steady_clock Clock;
+
+  // Thread function: runs |step_| until the stage stops.
+  void StageThread();
+
+  // Returns the microseconds from |start| until now.
+  static int64 ElapsedUs(Clock::time_point start);
+
+  template <typename T>
+  static void Add(std::atomic<T>* ptr_counter, T value) {
+    ptr_counter->store(ptr_counter->load(std::memory_order_relaxed) + value,
+                       std::memory_order_relaxed);
+  }
+
+  std::string name_;
+  StopFunc stop_requested_;
+  StepFunc step_;
+  std::atomic<bool> stop_;
+  std::atomic<int> status_;
+  std::shared_ptr<std::thread> thread_;
+
+  // Written by the stage thread only.
+  std::atomic<int64> steps_;
+  std::atomic<int64> idle_steps_;
+  std::atomic<int64> busy_us_;
+  std::atomic<int64> backpressure_waits_;
+  std::atomic<int64> backpressure_us_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(PipelineStage);
+};
+
+template <class Queue, class Buffer>
+int PipelineStage::Push(Queue* ptr_queue, Buffer* ptr_buffer) {
+  int status = ptr_queue->Commit(ptr_buffer);
+  if (status != Queue::kFull) {
+    return status;
+  }
+  const Clock::time_point wait_start = Clock::now();
+  while (status == Queue::kFull && !StopRequested()) {
+    Add(&backpressure_waits_, static_cast<int64>(1));
+    ptr_queue->WaitForInactive(kDefaultWaitTimeout);
+    status = ptr_queue->Commit(ptr_buffer);
+  }
+  Add(&backpressure_us_, ElapsedUs(wait_start));
+  return status;
+}
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_PIPELINE_STAGE_H_
@@ -0,0 +1,123 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/pool_depth_controller.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "glog/logging.h"
+
+namespace webmlive {
+
+PoolDepthController::PoolDepthController()
+    : min_depth_(0),
+      max_depth_(0),
+      frame_period_us_(0),
+      depth_(0),
+      have_encode_(false),
+      encode_mean_(0),
+      encode_variance_(0),
+      have_interval_(false),
+      interval_mean_(0),
+      interval_variance_(0),
+      last_arrival_us_(0),
+      full_rejections_(0),
+      frames_below_(0),
+      depth_increases_(0),
+      depth_decreases_(0) {}
+
+int PoolDepthController::Init(const PoolDepthSettings& settings,
+                              double frame_rate, int initial_depth) {
+  if (settings.min_depth < 1 || settings.max_depth < settings.min_depth) {
+    LOG(ERROR) << "invalid pool depth bounds: " << settings.min_depth << "-"
+               << settings.max_depth;
+    return kInvalidArg;
+  }
+  min_depth_ = settings.min_depth;
+  max_depth_ = settings.max_depth;
+  frame_period_us_ = (frame_rate > 0) ? 1000000.0 / frame_rate : 0;
+  depth_ = std::max(min_depth_, std::min(initial_depth, max_depth_));
+  have_encode_ = have_interval_ = false;
+  encode_mean_ = encode_variance_ = 0;
+  interval_mean_ = interval_variance_ = 0;
+  last_arrival_us_ = 0;
+  full_rejections_ = 0;
+  frames_below_ = 0;
+  depth_increases_ = depth_decreases_ = 0;
+  return kSuccess;
+}
+
+int PoolDepthController::Update(int64 arrival_us, int64 encode_us,
+                                int64 full_rejections) {
+  if (have_encode_) {
+    Fold(static_cast<double>(encode_us), &encode_mean_, &encode_variance_);
+  } else {
+    encode_mean_ = static_cast<double>(encode_us);
+    have_encode_ = true;
+  }
+  if (last_arrival_us_ != 0 && arrival_us > last_arrival_us_) {
+    const double interval = static_cast<double>(arrival_us - last_arrival_us_);
+    if (have_interval_) {
+      Fold(interval, &interval_mean_, &interval_variance_);
+    } else {
+      interval_mean_ = interval;
+      have_interval_ = true;
+    }
+  }
+  last_arrival_us_ = arrival_us;
+
+  int target = TargetDepth();
+  if (full_rejections > full_rejections_) {
+    // A full pool is the estimate falling short; give it another frame.
+    target = std::max(target, std::min(depth_ + 1, max_depth_));
+  }
+  full_rejections_ = full_rejections;
+
+  if (target > depth_) {
+    LOG(INFO) << "pool depth " << depth_ << " -> " << target << ", encode "
+              << encode_mean_ / 1000 << " ms, arrival jitter "
+              << std::sqrt(interval_variance_) / 1000 << " ms.";
+    depth_ = target;
+    frames_below_ = 0;
+    ++depth_increases_;
+  } else if (target < depth_) {
+    if (++frames_below_ >= kShrinkFrames) {
+      --depth_;
+      frames_below_ = 0;
+      ++depth_decreases_;
+      VLOG(1) << "pool depth shrunk to " << depth_;
+    }
+  } else {
+    frames_below_ = 0;
+  }
+  return depth_;
+}
+
+void PoolDepthController::Fold(double value, double* ptr_mean,
+                               double* ptr_variance) {
+  const double weight = 1.0 / kSmoothingFrames;
+  const double difference = value - *ptr_mean;
+  *ptr_mean += weight * difference;
+  *ptr_variance = (1.0 - weight) *
+      (*ptr_variance + weight * difference * difference);
+}
+
+int PoolDepthController::TargetDepth() const {
+  const double period_us =
+      (frame_period_us_ > 0) ? frame_period_us_ : interval_mean_;
+  if (period_us <= 0) {
+    return depth_;
+  }
+  const double backlog_us = encode_mean_ +
+      kDeviations * (std::sqrt(encode_variance_) +
+                     std::sqrt(interval_variance_));
+  const int target = 1 + static_cast<int>(std::ceil(backlog_us / period_us));
+  return std::max(min_depth_, std::min(target, max_depth_));
+}
+
+}  // namespace webmlive
@@ -0,0 +1,120 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_POOL_DEPTH_CONTROLLER_H_
+#define WEBMLIVE_ENCODER_POOL_DEPTH_CONTROLLER_H_
+
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+
+namespace webmlive {
+
+struct PoolDepthSettings {
+  static const int kDefaultMinDepth = 2;
+  static const int kDefaultMaxDepth = 16;
+
+  PoolDepthSettings()
+      : enabled(false),
+        min_depth(kDefaultMinDepth),
+        max_depth(kDefaultMaxDepth) {}
+
+  // Size the raw video pool from the observed encode times and capture
+  // jitter instead of using a fixed depth.
+  bool enabled;
+
+  // Bounds of the depth, in frames. Storage for |max_depth| frames is
+  // allocated up front.
+  int min_depth;
+  int max_depth;
+};
+
+// Chooses the depth of a frame pool between a capture thread and an encoder
+// from the time the encoder takes per frame and the regularity of frame
+// arrivals. The pool must hold the frames that arrive while the encoder works
+// on a slow frame, and those that arrive early: the depth covers the smoothed
+// encode time plus |kDeviations| standard deviations of the encode time and
+// of the arrival interval, in frame periods, plus the frame being encoded.
+//
+// The depth grows at once when the estimate rises, or when the pool rejected
+// a frame, and shrinks one frame at a time after the estimate has stayed
+// below it for |kShrinkFrames| frames, so that a pool emptied by a fast
+// encoder does not give up the room a periodic hiccup needs. A slow frame
+// therefore costs drops at most once, while buffering latency falls back
+// within seconds of a steady encoder.
+//
+// Notes:
+// - |Init()| must be called before any other method.
+// - Not thread safe: |Update()| is called from the encoder thread.
+class PoolDepthController {
+ public:
+  // Weight of a frame in the smoothed estimates, as 1 / |kSmoothingFrames|.
+  static const int kSmoothingFrames = 30;
+
+  // Frames the estimate stays below the depth before it shrinks by one.
+  static const int kShrinkFrames = 150;
+
+  // Standard deviations of headroom.
+  static const int kDeviations = 3;
+
+  enum {
+    kInvalidArg = -1,
+    kSuccess = 0,
+  };
+
+  PoolDepthController();
+  ~PoolDepthController() {}
+
+  // Sets up depth control within |settings| for a stream of |frame_rate|
+  // frames per second, starting at |initial_depth| clamped to the bounds. A
+  // |frame_rate| of 0 or less uses the measured arrival interval. Returns
+  // |kInvalidArg| when the bounds are invalid.
+  int Init(const PoolDepthSettings& settings, double frame_rate,
+           int initial_depth);
+
+  // Folds in a frame that arrived at |arrival_us|, in microseconds on any
+  // clock, and took |encode_us| microseconds to encode. |full_rejections| is
+  // the total number of frames the pool has rejected. Returns the new depth.
+  int Update(int64 arrival_us, int64 encode_us, int64 full_rejections);
+
+  // Accessors.
+  int depth() const { return depth_; }
+  int64 depth_increases() const { return depth_increases_; }
+  int64 depth_decreases() const { return depth_decreases_; }
+
+ private:
+  // Folds |value| into the exponentially weighted |*ptr_mean| and
+  // |*ptr_variance|.
+  void Fold(double value, double* ptr_mean, double* ptr_variance);
+
+  // Returns the depth the current estimates call for, within the bounds.
+  int TargetDepth() const;
+
+  int min_depth_;
+  int max_depth_;
+  double frame_period_us_;
+  int depth_;
+
+  // Smoothed encode time and arrival interval, and their variances, in
+  // microseconds.
+  bool have_encode_;
+  double encode_mean_;
+  double encode_variance_;
+  bool have_interval_;
+  double interval_mean_;
+  double interval_variance_;
+
+  int64 last_arrival_us_;
+  int64 full_rejections_;
+  int frames_below_;
+  int64 depth_increases_;
+  int64 depth_decreases_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(PoolDepthController);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_POOL_DEPTH_CONTROLLER_H_
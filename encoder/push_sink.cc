@@ -0,0 +1,698 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/push_sink.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <new>
+#include <sstream>
+#include <utility>
+
+#ifdef _WIN32
+#include <ws2tcpip.h>
+#else
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include "encoder/log_util.h"
+#include "encoder/thread_util.h"
+#include "glog/logging.h"
+
+namespace {
+
+#ifdef _WIN32
+const SOCKET kInvalidSocket = INVALID_SOCKET;
+#else
+const int kInvalidSocket = -1;
+#endif
+
+// Longest delay between reconnect attempts, in milliseconds.
+const int kMaxReconnectDelay = 8000;
+
+// Time |Connect()| waits for a connection before checking |stop_|, in
+// milliseconds.
+const int kConnectPollInterval = 200;
+
+// Time the sender thread waits for a frame before handling the UDP
+// transport's packets again, in milliseconds.
+const int kArqPollInterval = 10;
+
+// Returns true when |id| names a DASH manifest, which is never taken as the
+// initialization segment.
+bool IsManifest(const std::string& id) {
+  const char kManifestSuffix[] = ".mpd";
+  const size_t suffix_length = sizeof(kManifestSuffix) - 1;
+  return id.length() > suffix_length &&
+         id.compare(id.length() - suffix_length, suffix_length,
+                    kManifestSuffix) == 0;
+}
+
+}  // anonymous namespace
+
+namespace webmlive {
+
+const uint8* PushSink::Frame::ptr_payload() const {
+  if (type == kFrameChunk) {
+    return chunk ? chunk->data() : NULL;
+  }
+  return data.empty() ? NULL : &data[0];
+}
+
+int32 PushSink::Frame::payload_length() const {
+  if (type == kFrameChunk) {
+    return chunk ? chunk->length() : 0;
+  }
+  return static_cast<int32>(data.size());
+}
+
+PushSink::PushSink()
+    : initialized_(false),
+      socket_(kInvalidSocket),
+      queued_bytes_(0),
+      queued_chunks_(0),
+      sending_unit_(false),
+      init_sent_(false),
+      stop_(false) {
+  memset(&stats_, 0, sizeof(stats_));
+}
+
+PushSink::~PushSink() {
+  Stop();
+#ifdef _WIN32
+  if (initialized_) {
+    WSACleanup();
+  }
+#endif
+}
+
+int PushSink::Init(const PushSinkSettings& settings) {
+  if (settings.host.empty() || settings.port <= 0 || settings.port > 65535) {
+    LOG(ERROR) << "invalid push sink address: " << settings.host << ":"
+               << settings.port;
+    return kInvalidArg;
+  }
+  if (settings.max_queued_bytes < 1 || settings.reconnect_delay < 1 ||
+      settings.connect_timeout < 1) {
+    LOG(ERROR) << "invalid push sink settings.";
+    return kInvalidArg;
+  }
+  if (settings.transport == PushSinkSettings::kTransportUdpArq &&
+      (settings.arq.latency < 1 || settings.arq.max_bandwidth < 0 ||
+       settings.arq.packet_size <= ArqSender::kHeaderSize)) {
+    LOG(ERROR) << "invalid push sink UDP settings.";
+    return kInvalidArg;
+  }
+  settings_ = settings;
+
+#ifdef _WIN32
+  if (!initialized_) {
+    WSADATA wsa_data;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa_data)) {
+      LOG(ERROR) << "WSAStartup failed.";
+      return kSocketError;
+    }
+  }
+#endif
+  initialized_ = true;
+  return kSuccess;
+}
+
+int PushSink::Run() {
+  if (!initialized_ || sender_thread_) {
+    LOG(ERROR) << "push sink not initialized, or already running.";
+    return kRunFailed;
+  }
+  stop_ = false;
+  sender_thread_.reset(
+      new (std::nothrow) std::thread(  // NOLINT
+          &PushSink::SenderThread, this));
+  if (!sender_thread_) {
+    LOG(ERROR) << "cannot construct sender thread.";
+    return kRunFailed;
+  }
+  return kSuccess;
+}
+
+void PushSink::Stop() {
+  if (!sender_thread_) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  frame_ready_.notify_all();
+  sender_thread_->join();
+  sender_thread_.reset();
+}
+
+int PushSink::GetStats(PushSinkStats* ptr_stats) const {
+  if (!ptr_stats) {
+    return kInvalidArg;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  *ptr_stats = stats_;
+  ptr_stats->queued_chunks = queued_chunks_;
+  ptr_stats->queued_bytes = queued_bytes_;
+  return kSuccess;
+}
+
+bool PushSink::Ready() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return queued_bytes_ < settings_.max_queued_bytes;
+}
+
+bool PushSink::WriteData(const uint8* ptr_data, int32 data_length,
+                         const std::string& id) {
+  if (!ptr_data || data_length < 0) {
+    LOG(ERROR) << "invalid push sink write.";
+    return false;
+  }
+  WebmChunk::Data data(ptr_data, ptr_data + data_length);
+  WebmChunkDescriptor descriptor;
+  descriptor.length = data_length;
+  SharedWebmChunk chunk(
+      new (std::nothrow) WebmChunk(id, descriptor, 0, &data,  // NOLINT
+                                   SharedWebmChunkDataPool()));
+  if (!chunk) {
+    LOG(ERROR) << "out of memory.";
+    return false;
+  }
+  return WriteChunk(chunk);
+}
+
+bool PushSink::WriteChunk(const SharedWebmChunk& chunk) {
+  if (!chunk || chunk->id().length() > kMaxIdLength) {
+    LOG(ERROR) << "invalid push sink chunk.";
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  Frame frame;
+  frame.type = kFrameChunk;
+  frame.id = chunk->id();
+  frame.chunk = chunk;
+  if (chunk == init_chunk_ ||
+      (init_id_.empty() && !IsManifest(chunk->id()))) {
+    init_id_ = chunk->id();
+    init_chunk_ = chunk;
+    frame.init = true;
+  }
+  EnqueueFrame(&frame);
+  return true;
+}
+
+bool PushSink::BeginStream(const std::string& id) {
+  if (id.empty() || id.length() > kMaxIdLength) {
+    LOG(ERROR) << "invalid push sink stream id.";
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  dropped_stream_id_.clear();
+  if (init_id_.empty()) {
+    // The initialization segment is collected, and queued as one chunk by
+    // |EndStream()|.
+    init_id_ = id;
+    init_data_.clear();
+    return true;
+  }
+  Frame frame;
+  frame.type = kFrameStreamBegin;
+  frame.id = id;
+  EnqueueFrame(&frame);
+  return true;
+}
+
+bool PushSink::WriteStreamData(const std::string& id, const uint8* ptr_data,
+                               int32 data_length) {
+  if (!ptr_data || data_length <= 0) {
+    LOG(ERROR) << "invalid push sink stream write.";
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (id == dropped_stream_id_) {
+    return true;
+  }
+  if (id == init_id_ && !init_chunk_) {
+    init_data_.insert(init_data_.end(), ptr_data, ptr_data + data_length);
+    return true;
+  }
+  Frame frame;
+  frame.type = kFrameStreamData;
+  frame.id = id;
+  frame.data.assign(ptr_data, ptr_data + data_length);
+  EnqueueFrame(&frame);
+  return true;
+}
+
+bool PushSink::EndStream(const std::string& id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (id == dropped_stream_id_) {
+    dropped_stream_id_.clear();
+    return true;
+  }
+  Frame frame;
+  if (id == init_id_ && !init_chunk_) {
+    WebmChunkDescriptor descriptor;
+    descriptor.length = static_cast<int32>(init_data_.size());
+    init_chunk_.reset(
+        new (std::nothrow) WebmChunk(id, descriptor, 0,  // NOLINT
+                                     &init_data_, SharedWebmChunkDataPool()));
+    if (!init_chunk_) {
+      LOG(ERROR) << "out of memory.";
+      return false;
+    }
+    frame.type = kFrameChunk;
+    frame.chunk = init_chunk_;
+    frame.init = true;
+  } else {
+    frame.type = kFrameStreamEnd;
+  }
+  frame.id = id;
+  EnqueueFrame(&frame);
+  return true;
+}
+
+void PushSink::SetInitSegment(const SharedWebmChunk& chunk) {
+  if (!chunk) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!init_id_.empty() && !init_chunk_) {
+    // The segment is being streamed; |EndStream()| queues the copy.
+    return;
+  }
+  init_id_ = chunk->id();
+  init_chunk_ = chunk;
+}
+
+bool PushSink::StartsUnit(const Frame& frame) {
+  return frame.type == kFrameChunk || frame.type == kFrameStreamBegin;
+}
+
+int32 PushSink::FrameSize(const Frame& frame) {
+  return kFrameHeaderSize + static_cast<int32>(frame.id.length()) +
+      frame.payload_length();
+}
+
+void PushSink::EnqueueFrame(Frame* ptr_frame) {
+  queued_bytes_ += FrameSize(*ptr_frame);
+  if (StartsUnit(*ptr_frame)) {
+    ++queued_chunks_;
+  }
+  queue_.push_back(std::move(*ptr_frame));
+  EnforceQueueLimit();
+  frame_ready_.notify_one();
+}
+
+void PushSink::EnforceQueueLimit() {
+  while (queued_bytes_ > settings_.max_queued_bytes) {
+    // Frames ahead of the first unit start belong to the unit the sender
+    // thread is partway through.
+    size_t start = 0;
+    while (start < queue_.size() &&
+           (!StartsUnit(queue_[start]) || queue_[start].init)) {
+      ++start;
+    }
+    // The newest unit is kept even when it alone exceeds the limit.
+    if (start + 1 >= queue_.size()) {
+      break;
+    }
+    DropUnit(start);
+    WEBMLIVE_LOG_EVERY_MS(WARNING, kLogIntervalMs)
+        << "push sink is falling behind, " << stats_.chunks_dropped
+        << " chunk(s) dropped.";
+  }
+}
+
+void PushSink::DropUnit(size_t start) {
+  const std::string id = queue_[start].id;
+  bool complete = queue_[start].type == kFrameChunk;
+  size_t end = start + 1;
+  while (!complete && end < queue_.size()) {
+    complete = queue_[end].type == kFrameStreamEnd;
+    ++end;
+  }
+  for (size_t i = start; i < end; ++i) {
+    queued_bytes_ -= FrameSize(queue_[i]);
+  }
+  queue_.erase(queue_.begin() + start, queue_.begin() + end);
+  --queued_chunks_;
+  ++stats_.chunks_dropped;
+  if (!complete) {
+    dropped_stream_id_ = id;
+  }
+}
+
+void PushSink::DropPartialUnit() {
+  bool complete = false;
+  size_t end = 0;
+  while (!complete && end < queue_.size() && !StartsUnit(queue_[end])) {
+    complete = queue_[end].type == kFrameStreamEnd;
+    queued_bytes_ -= FrameSize(queue_[end]);
+    ++end;
+  }
+  queue_.erase(queue_.begin(), queue_.begin() + end);
+  if (!complete) {
+    dropped_stream_id_ = sending_id_;
+  }
+  sending_unit_ = false;
+}
+
+void PushSink::SenderThread() {
+  ScopedThreadRegistration registration("push_sink");
+  VLOG(1) << "push sink sender started.";
+  int delay = settings_.reconnect_delay;
+  for (;;) {
+    if (socket_ == kInvalidSocket) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stop_) {
+          break;
+        }
+      }
+      if (!Connect()) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        ++stats_.connect_failures;
+        WEBMLIVE_LOG_EVERY_MS(WARNING, kLogIntervalMs)
+            << "cannot connect to " << settings_.host << ":"
+            << settings_.port << ", retrying in " << delay << " ms.";
+        frame_ready_.wait_for(lock, std::chrono::milliseconds(delay),
+                              [this] { return stop_; });
+        delay = std::min(delay * 2, kMaxReconnectDelay);
+        continue;
+      }
+      delay = settings_.reconnect_delay;
+    }
+
+    Frame frame;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (UseArq()) {
+        frame_ready_.wait_for(lock, std::chrono::milliseconds(kArqPollInterval),
+                              [this] { return stop_ || !queue_.empty(); });
+      } else {
+        frame_ready_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+      }
+      if (queue_.empty() && stop_) {
+        break;
+      }
+    }
+    if (UseArq()) {
+      // Acknowledgements and retransmission requests are handled between
+      // frames, and while idle.
+      const bool alive = arq_.Poll(0);
+      std::lock_guard<std::mutex> lock(mutex_);
+      arq_.GetStats(&stats_.arq);
+      if (!alive) {
+        ++stats_.send_failures;
+        if (sending_unit_) {
+          DropPartialUnit();
+        }
+        LOG(WARNING) << "connection to " << settings_.host << ":"
+                     << settings_.port << " lost.";
+        Disconnect();
+        continue;
+      }
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (queue_.empty()) {
+        continue;
+      }
+      frame = std::move(queue_.front());
+      queue_.pop_front();
+      queued_bytes_ -= FrameSize(frame);
+      if (StartsUnit(frame)) {
+        --queued_chunks_;
+      }
+      if (frame.init) {
+        init_sent_ = true;
+      }
+      sending_unit_ = frame.type == kFrameStreamBegin ||
+                      frame.type == kFrameStreamData;
+      sending_id_ = frame.id;
+    }
+
+    const bool sent = SendFrame(frame);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (UseArq()) {
+      arq_.GetStats(&stats_.arq);
+    }
+    if (sent) {
+      ++stats_.frames_sent;
+      stats_.bytes_sent += FrameSize(frame);
+      continue;
+    }
+    ++stats_.send_failures;
+    if (!frame.init) {
+      ++stats_.chunks_dropped;
+    }
+    if (sending_unit_) {
+      DropPartialUnit();
+    }
+    LOG(WARNING) << "connection to " << settings_.host << ":"
+                 << settings_.port << " lost sending " << frame.id << ".";
+    Disconnect();
+  }
+  if (UseArq() && socket_ != kInvalidSocket) {
+    // Gives the packets in flight their chance of retransmission.
+    arq_.Poll(settings_.arq.latency);
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (socket_ != kInvalidSocket) {
+    if (UseArq()) {
+      arq_.GetStats(&stats_.arq);
+    }
+    Disconnect();
+  }
+  VLOG(1) << "push sink sender stopped.";
+}
+
+bool PushSink::Connect() {
+  std::ostringstream port;
+  port << settings_.port;
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = UseArq() ? SOCK_DGRAM : SOCK_STREAM;
+  hints.ai_protocol = UseArq() ? IPPROTO_UDP : IPPROTO_TCP;
+  addrinfo* ptr_addresses = NULL;
+  if (getaddrinfo(settings_.host.c_str(), port.str().c_str(), &hints,
+                  &ptr_addresses) || !ptr_addresses) {
+    return false;
+  }
+
+  Socket connection = kInvalidSocket;
+  for (const addrinfo* ptr_address = ptr_addresses;
+       ptr_address && connection == kInvalidSocket;
+       ptr_address = ptr_address->ai_next) {
+    connection = socket(ptr_address->ai_family, ptr_address->ai_socktype,
+                        ptr_address->ai_protocol);
+    if (connection == kInvalidSocket) {
+      continue;
+    }
+
+    // Connect without blocking, so that |Stop()| is not held up by an
+    // unresponsive server.
+#ifdef _WIN32
+    u_long non_blocking = 1;
+    ioctlsocket(connection, FIONBIO, &non_blocking);
+#else
+    const int flags = fcntl(connection, F_GETFL, 0);
+    fcntl(connection, F_SETFL, flags | O_NONBLOCK);
+#endif
+    bool connected = !connect(connection, ptr_address->ai_addr,
+                              static_cast<int>(ptr_address->ai_addrlen));
+    for (int waited = 0; !connected && waited < settings_.connect_timeout;
+         waited += kConnectPollInterval) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stop_) {
+          break;
+        }
+      }
+      fd_set write_set;
+      FD_ZERO(&write_set);
+      FD_SET(connection, &write_set);
+      timeval timeout;
+      timeout.tv_sec = 0;
+      timeout.tv_usec = kConnectPollInterval * 1000;
+      const int result = select(static_cast<int>(connection + 1), NULL,
+                                &write_set, NULL, &timeout);
+      if (result < 0) {
+        break;
+      }
+      if (result > 0) {
+        int error = 0;
+        socklen_t error_length = sizeof(error);
+        getsockopt(connection, SOL_SOCKET, SO_ERROR,
+                   reinterpret_cast<char*>(&error), &error_length);
+        connected = error == 0;
+        break;
+      }
+    }
+    if (!connected) {
+      CloseSocket(connection);
+      connection = kInvalidSocket;
+      continue;
+    }
+#ifdef _WIN32
+    non_blocking = 0;
+    ioctlsocket(connection, FIONBIO, &non_blocking);
+#else
+    fcntl(connection, F_SETFL, flags);
+#endif
+    if (!UseArq()) {
+      // Frames are written whole; Nagle's algorithm would only delay them.
+      const int enable = 1;
+      setsockopt(connection, IPPROTO_TCP, TCP_NODELAY,
+                 reinterpret_cast<const char*>(&enable), sizeof(enable));
+      setsockopt(connection, SOL_SOCKET, SO_KEEPALIVE,
+                 reinterpret_cast<const char*>(&enable), sizeof(enable));
+    }
+
+    // A send blocked for |connect_timeout| fails, and the connection is
+    // treated as lost.
+#ifdef _WIN32
+    const DWORD send_timeout = settings_.connect_timeout;
+#else
+    timeval send_timeout;
+    send_timeout.tv_sec = settings_.connect_timeout / 1000;
+    send_timeout.tv_usec = (settings_.connect_timeout % 1000) * 1000;
+#endif
+    setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO,
+               reinterpret_cast<const char*>(&send_timeout),
+               sizeof(send_timeout));
+    if (UseArq() && !OpenArq(connection)) {
+      CloseSocket(connection);
+      connection = kInvalidSocket;
+    }
+  }
+  freeaddrinfo(ptr_addresses);
+  if (connection == kInvalidSocket) {
+    return false;
+  }
+
+  Frame init_frame;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    socket_ = connection;
+    ++stats_.connects;
+    stats_.connected = true;
+    if (init_sent_) {
+      init_frame.id = init_id_;
+      init_frame.chunk = init_chunk_;
+      init_frame.init = true;
+    }
+  }
+  LOG(INFO) << "push sink connected to " << settings_.host << ":"
+            << settings_.port;
+  if (init_frame.chunk) {
+    if (!SendFrame(init_frame)) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ++stats_.send_failures;
+      Disconnect();
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++stats_.frames_sent;
+    stats_.bytes_sent += FrameSize(init_frame);
+  }
+  return true;
+}
+
+bool PushSink::OpenArq(Socket connection) {
+  if (arq_.Open(connection, settings_.arq) != ArqSender::kSuccess) {
+    return false;
+  }
+  for (int waited = 0; waited < settings_.connect_timeout;
+       waited += kConnectPollInterval) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (stop_) {
+        break;
+      }
+    }
+    if (arq_.Handshake(kConnectPollInterval)) {
+      return true;
+    }
+  }
+  arq_.Close();
+  return false;
+}
+
+bool PushSink::SendFrame(const Frame& frame) {
+  const int32 payload_length = frame.payload_length();
+  uint8 header[kFrameHeaderSize];
+  header[0] = static_cast<uint8>(frame.type);
+  header[1] = static_cast<uint8>(frame.id.length());
+  header[2] = static_cast<uint8>(payload_length >> 24);
+  header[3] = static_cast<uint8>(payload_length >> 16);
+  header[4] = static_cast<uint8>(payload_length >> 8);
+  header[5] = static_cast<uint8>(payload_length);
+  if (UseArq()) {
+    if (StartsUnit(frame) && !arq_.BeginUnit(frame.init)) {
+      return false;
+    }
+    return arq_.Send(header, kFrameHeaderSize) &&
+           arq_.Send(reinterpret_cast<const uint8*>(frame.id.data()),
+                     static_cast<int32>(frame.id.length())) &&
+           arq_.Send(frame.ptr_payload(), payload_length) && arq_.Flush();
+  }
+  return SendAll(socket_, header, kFrameHeaderSize) &&
+         SendAll(socket_, reinterpret_cast<const uint8*>(frame.id.data()),
+                 static_cast<int32>(frame.id.length())) &&
+         SendAll(socket_, frame.ptr_payload(), payload_length);
+}
+
+void PushSink::Disconnect() {
+  if (UseArq()) {
+    arq_.Close();
+  }
+  if (socket_ != kInvalidSocket) {
+    CloseSocket(socket_);
+    socket_ = kInvalidSocket;
+  }
+  stats_.connected = false;
+}
+
+bool PushSink::SendAll(Socket socket, const uint8* ptr_data, int32 length) {
+#ifdef MSG_NOSIGNAL
+  const int kSendFlags = MSG_NOSIGNAL;
+#else
+  const int kSendFlags = 0;
+#endif
+  while (length > 0) {
+    const int bytes_sent = send(socket,
+                                reinterpret_cast<const char*>(ptr_data),
+                                length, kSendFlags);
+    if (bytes_sent <= 0) {
+      return false;
+    }
+    ptr_data += bytes_sent;
+    length -= bytes_sent;
+  }
+  return true;
+}
+
+void PushSink::CloseSocket(Socket socket) {
+#ifdef _WIN32
+  closesocket(socket);
+#else
+  close(socket);
+#endif
+}
+
+}  // namespace webmlive
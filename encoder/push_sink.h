@@ -0,0 +1,311 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_PUSH_SINK_H_
+#define WEBMLIVE_ENCODER_PUSH_SINK_H_
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "encoder/arq_sender.h"
+#include "encoder/basictypes.h"
+#include "encoder/data_sink.h"
+#include "encoder/encoder_base.h"
+#include "encoder/webm_chunk.h"
+
+#ifdef _WIN32
+#include <winsock2.h>
+#endif
+
+namespace webmlive {
+
+struct PushSinkSettings {
+  enum Transport {
+    // One TCP connection.
+    kTransportTcp = 0,
+
+    // UDP with retransmission of lost packets through |ArqSender|.
+    kTransportUdpArq = 1,
+  };
+
+  // Default limit of the data queued for the connection, in bytes.
+  static const int kDefaultMaxQueuedBytes = 4 * 1024 * 1024;
+
+  // Default delay before the first reconnect attempt, in milliseconds.
+  static const int kDefaultReconnectDelay = 500;
+
+  // Default connect timeout, in milliseconds.
+  static const int kDefaultConnectTimeout = 5000;
+
+  PushSinkSettings()
+      : port(0),
+        transport(kTransportTcp),
+        max_queued_bytes(kDefaultMaxQueuedBytes),
+        reconnect_delay(kDefaultReconnectDelay),
+        connect_timeout(kDefaultConnectTimeout) {}
+
+  // Ingest server host name or address, and port.
+  std::string host;
+  int port;
+
+  // Transport of the frames, and the settings of the UDP transport.
+  Transport transport;
+  ArqSenderSettings arq;
+
+  // Data queued for the connection above which |PushSink::Ready()| returns
+  // false, and the oldest queued chunks are dropped.
+  int max_queued_bytes;
+
+  // Delay before the first reconnect attempt after a connection fails, in
+  // milliseconds. Each further attempt doubles it, up to eight seconds.
+  int reconnect_delay;
+
+  // Time a connection attempt, or a send, may take, in milliseconds.
+  int connect_timeout;
+};
+
+struct PushSinkStats {
+  // Number of frames, and bytes including frame headers, sent.
+  int64 frames_sent;
+  int64 bytes_sent;
+
+  // Number of connections established, and of failed connection attempts.
+  int64 connects;
+  int64 connect_failures;
+
+  // Number of connections lost while sending.
+  int64 send_failures;
+
+  // Number of chunks and streams dropped: from a full queue, or because
+  // their connection was lost while they were sent.
+  int64 chunks_dropped;
+
+  // Chunks and streams, and bytes, waiting for the connection.
+  int32 queued_chunks;
+  int32 queued_bytes;
+
+  // True while connected to the ingest server.
+  bool connected;
+
+  // Counters of the UDP transport.
+  ArqSenderStats arq;
+};
+
+// Data sink that pushes chunks to an ingest server over one long-lived TCP
+// connection, without per-chunk request setup. Each chunk is sent as a
+// frame:
+//
+//   type (1 byte) | id length (1 byte) | payload length (4 bytes) | id |
+//   payload
+//
+// Payload lengths are big endian. A complete chunk is one |kFrameChunk|
+// frame; a chunk streamed while it is muxed is a |kFrameStreamBegin| frame,
+// |kFrameStreamData| frames as data arrives, and a |kFrameStreamEnd| frame.
+//
+// The first chunk or stream written, other than a DASH manifest (an id
+// ending in ".mpd"), is the initialization segment. It is always sent as one
+// |kFrameChunk| frame, and every connection after the first starts with it.
+// A chunk or stream cut short by a lost connection is dropped, and media
+// resumes at the next chunk or stream boundary: the receiver never sees a
+// partial chunk.
+//
+// With |PushSinkSettings::kTransportUdpArq| the frames are sent through an
+// |ArqSender| instead, for links with a long round trip and random loss where
+// TCP stalls: lost packets are retransmitted until
+// |ArqSenderSettings::latency|, and then given up on. Each chunk and stream
+// starts a new packet, and the receiver discards the rest of a unit that
+// lost a packet, so it still never sees a partial chunk. The initialization
+// segment is never given up on.
+//
+// Notes:
+// - |Init| must be called before any other method, and |Run| starts the
+//   sender thread, which connects and reconnects with backoff.
+// - Complete chunks are sent from the |WebmChunk| without copying; stream
+//   data is copied, as its buffer is reused by the muxer.
+// - Streams must be written one at a time, in order.
+class PushSink : public DataSinkInterface {
+ public:
+  enum {
+    // Socket setup failed.
+    kSocketError = -4,
+
+    // |Run| failed.
+    kRunFailed = -3,
+    kNoMemory = -2,
+    kInvalidArg = -1,
+    kSuccess = 0,
+  };
+
+  // Frame types.
+  enum FrameType {
+    kFrameChunk = 1,
+    kFrameStreamBegin = 2,
+    kFrameStreamData = 3,
+    kFrameStreamEnd = 4,
+  };
+
+  // Size of the fixed part of the frame header, in bytes.
+  static const int kFrameHeaderSize = 6;
+
+  // Longest chunk identifier that fits in a frame header.
+  static const size_t kMaxIdLength = 255;
+
+  PushSink();
+  virtual ~PushSink();
+
+  // Copies |settings|. Returns |kSuccess| upon success.
+  int Init(const PushSinkSettings& settings);
+
+  // Starts the sender thread.
+  int Run();
+
+  // Sends what is queued while the connection holds, then stops the sender
+  // thread and closes the connection. A send that makes no progress for
+  // |PushSinkSettings::connect_timeout| ends the connection.
+  void Stop();
+
+  // Copies the sink counters to |ptr_stats|. Returns |kSuccess| upon
+  // success.
+  int GetStats(PushSinkStats* ptr_stats) const;
+
+  // DataSinkInterface methods. |Ready()| returns true while the queue has
+  // room.
+  virtual bool Ready() const;
+  virtual bool WriteData(const uint8* ptr_data, int32 data_length,
+                         const std::string& id);
+  virtual bool WriteChunk(const SharedWebmChunk& chunk);
+  virtual bool BeginStream(const std::string& id);
+  virtual bool WriteStreamData(const std::string& id, const uint8* ptr_data,
+                               int32 data_length);
+  virtual bool EndStream(const std::string& id);
+  virtual void SetInitSegment(const SharedWebmChunk& chunk);
+
+ private:
+#ifdef _WIN32
+  typedef SOCKET Socket;
+#else
+  typedef int Socket;
+#endif
+
+  // A queued frame. |chunk| holds the payload of |kFrameChunk| frames, and
+  // |data| that of |kFrameStreamData| frames. |init| marks the frame of the
+  // initialization segment, which is never dropped.
+  struct Frame {
+    Frame() : type(kFrameChunk), init(false) {}
+    const uint8* ptr_payload() const;
+    int32 payload_length() const;
+
+    FrameType type;
+    std::string id;
+    SharedWebmChunk chunk;
+    std::vector<uint8> data;
+    bool init;
+  };
+
+  // Returns true when |frame| starts a chunk or a stream.
+  static bool StartsUnit(const Frame& frame);
+
+  // Returns the number of bytes |frame| takes on the wire.
+  static int32 FrameSize(const Frame& frame);
+
+  // Moves |ptr_frame| to the end of |queue_|, drops the oldest chunks while
+  // the queue is over its limit, and wakes the sender thread. Must be called
+  // with |mutex_| held.
+  void EnqueueFrame(Frame* ptr_frame);
+
+  // Drops the oldest chunks and streams, other than the one being sent and
+  // the initialization segment, while |queued_bytes_| exceeds
+  // |settings_.max_queued_bytes|. Must be called with |mutex_| held.
+  void EnforceQueueLimit();
+
+  // Removes the frames of the unit starting at |queue_| index |start|. When
+  // the unit is a stream still being written, its remaining frames are
+  // discarded as they arrive. Must be called with |mutex_| held.
+  void DropUnit(size_t start);
+
+  // Drops the rest of the chunk or stream partly sent on a lost connection.
+  // Must be called with |mutex_| held.
+  void DropPartialUnit();
+
+  // Sender thread function.
+  void SenderThread();
+
+  // Connects to |settings_.host|, and sends the initialization segment when
+  // an earlier connection has started on it. Returns true when connected.
+  bool Connect();
+
+  // Opens |arq_| on |connection|, and waits for the receiver's handshake.
+  // Returns true when the receiver answered.
+  bool OpenArq(Socket connection);
+
+  // Returns true when frames are sent through |arq_|.
+  bool UseArq() const {
+    return settings_.transport == PushSinkSettings::kTransportUdpArq;
+  }
+
+  // Sends |frame| on |socket_|, or through |arq_|. Returns false upon
+  // failure.
+  bool SendFrame(const Frame& frame);
+
+  // Closes |socket_| after a failure.
+  void Disconnect();
+
+  // Sends |length| bytes from |ptr_data|. Returns false upon failure.
+  static bool SendAll(Socket socket, const uint8* ptr_data, int32 length);
+  static void CloseSocket(Socket socket);
+
+  PushSinkSettings settings_;
+  bool initialized_;
+  std::unique_ptr<std::thread> sender_thread_;
+
+  // Connection to the ingest server. Written by the sender thread with
+  // |mutex_| held.
+  Socket socket_;
+
+  // UDP transport on |socket_|. Used only by the sender thread, which copies
+  // its stats to |stats_|.
+  ArqSender arq_;
+
+  // Frames waiting for the connection, the bytes they hold, and the number
+  // of chunks and streams they belong to. Protected by |mutex_|.
+  std::deque<Frame> queue_;
+  int32 queued_bytes_;
+  int32 queued_chunks_;
+
+  // True while the sender thread is partway through a chunk or stream,
+  // |sending_id_|. Protected by |mutex_|.
+  bool sending_unit_;
+  std::string sending_id_;
+
+  // Stream whose remaining frames are discarded. Protected by |mutex_|.
+  std::string dropped_stream_id_;
+
+  // The initialization segment: its identifier, the stream data collected
+  // while it is streamed, and the complete chunk. |init_sent_| is set once
+  // the sender thread has taken it from |queue_|; connections after that
+  // start with |init_chunk_|, which |SetInitSegment()| replaces with the
+  // muxer's copy. Protected by |mutex_|.
+  std::string init_id_;
+  std::vector<uint8> init_data_;
+  SharedWebmChunk init_chunk_;
+  bool init_sent_;
+
+  PushSinkStats stats_;
+  bool stop_;
+  mutable std::mutex mutex_;
+  std::condition_variable frame_ready_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(PushSink);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_PUSH_SINK_H_
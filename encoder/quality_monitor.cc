@@ -0,0 +1,325 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+
+#if defined _MSC_VER
+// Disable warning C4505(unreferenced local function has been removed) in MSVC,
+// emitted for vp8dx.h.
+#pragma warning(disable:4505)
+#endif
+#include "encoder/quality_monitor.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <new>
+
+#include "encoder/thread_util.h"
+#include "glog/logging.h"
+#include "libvpx/vpx/vp8dx.h"
+
+namespace webmlive {
+
+namespace {
+
+// PSNR of identical images, as libvpx reports it.
+const double kMaxPsnr = 100.0;
+
+// SSIM window size and step, in pixels, and the stabilizing constants for
+// 8 bit samples.
+const int kSsimWindow = 8;
+const int kSsimStep = 4;
+const double kSsimC1 = (0.01 * 255) * (0.01 * 255);
+const double kSsimC2 = (0.03 * 255) * (0.03 * 255);
+
+// Returns the sum of squared differences of the |width|x|height| planes at
+// |ptr_a| and |ptr_b|.
+uint64 PlaneSse(const uint8* ptr_a, int32 stride_a, const uint8* ptr_b,
+                int32 stride_b, int32 width, int32 height) {
+  uint64 sse = 0;
+  for (int32 y = 0; y < height; ++y) {
+    const uint8* const row_a = ptr_a + y * stride_a;
+    const uint8* const row_b = ptr_b + y * stride_b;
+    for (int32 x = 0; x < width; ++x) {
+      const int diff = row_a[x] - row_b[x];
+      sse += diff * diff;
+    }
+  }
+  return sse;
+}
+
+// Returns the mean SSIM of |kSsimWindow| square windows, |kSsimStep| apart,
+// of the |width|x|height| planes at |ptr_a| and |ptr_b|.
+double PlaneSsim(const uint8* ptr_a, int32 stride_a, const uint8* ptr_b,
+                 int32 stride_b, int32 width, int32 height) {
+  const int kSamples = kSsimWindow * kSsimWindow;
+  double ssim_sum = 0;
+  int64 windows = 0;
+  for (int32 top = 0; top + kSsimWindow <= height; top += kSsimStep) {
+    for (int32 left = 0; left + kSsimWindow <= width; left += kSsimStep) {
+      uint32 sum_a = 0, sum_b = 0;
+      uint32 sum_aa = 0, sum_bb = 0, sum_ab = 0;
+      for (int y = 0; y < kSsimWindow; ++y) {
+        const uint8* const row_a = ptr_a + (top + y) * stride_a + left;
+        const uint8* const row_b = ptr_b + (top + y) * stride_b + left;
+        for (int x = 0; x < kSsimWindow; ++x) {
+          const uint32 a = row_a[x];
+          const uint32 b = row_b[x];
+          sum_a += a;
+          sum_b += b;
+          sum_aa += a * a;
+          sum_bb += b * b;
+          sum_ab += a * b;
+        }
+      }
+      const double mean_a = static_cast<double>(sum_a) / kSamples;
+      const double mean_b = static_cast<double>(sum_b) / kSamples;
+      const double var_a = static_cast<double>(sum_aa) / kSamples -
+                           mean_a * mean_a;
+      const double var_b = static_cast<double>(sum_bb) / kSamples -
+                           mean_b * mean_b;
+      const double covar = static_cast<double>(sum_ab) / kSamples -
+                           mean_a * mean_b;
+      ssim_sum += ((2 * mean_a * mean_b + kSsimC1) * (2 * covar + kSsimC2)) /
+                  ((mean_a * mean_a + mean_b * mean_b + kSsimC1) *
+                   (var_a + var_b + kSsimC2));
+      ++windows;
+    }
+  }
+  return windows ? ssim_sum / windows : 1.0;
+}
+
+}  // namespace
+
+QualityMonitor::QualityMonitor()
+    : keyframe_count_(0),
+      codec_ready_(false),
+      codec_format_(kVideoFormatVP8),
+      busy_(false),
+      stop_(false) {
+  memset(&vpx_context_, 0, sizeof(vpx_context_));
+}
+
+QualityMonitor::~QualityMonitor() {
+  Stop();
+  if (codec_ready_) {
+    vpx_codec_destroy(&vpx_context_);
+  }
+}
+
+int QualityMonitor::Init(const QualitySettings& settings) {
+  if (settings.interval <= 0 || settings.max_cpu < 1 ||
+      settings.max_cpu > 100) {
+    LOG(ERROR) << "invalid quality monitor settings.";
+    return kInvalidArg;
+  }
+  settings_ = settings;
+  return kSuccess;
+}
+
+int QualityMonitor::Run() {
+  if (settings_.interval <= 0 || worker_thread_) {
+    LOG(ERROR) << "quality monitor not initialized, or already running.";
+    return kRunFailed;
+  }
+  stop_ = false;
+  worker_thread_.reset(
+      new (std::nothrow) std::thread(  // NOLINT
+          &QualityMonitor::WorkerThread, this));
+  if (!worker_thread_) {
+    LOG(ERROR) << "cannot construct quality monitor thread.";
+    return kRunFailed;
+  }
+  return kSuccess;
+}
+
+void QualityMonitor::Stop() {
+  if (!worker_thread_) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  frame_ready_.notify_one();
+  worker_thread_->join();
+  worker_thread_.reset();
+  source_.Reset();
+}
+
+bool QualityMonitor::Due() {
+  if (!worker_thread_ || keyframe_count_++ % settings_.interval) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (busy_ || std::chrono::steady_clock::now() < resume_time_) {
+    ++stats_.samples_skipped;
+    return false;
+  }
+  return true;
+}
+
+bool QualityMonitor::SubmitFrame(const SharedVideoFrame& source,
+                                 const VideoFrame& keyframe) {
+  if (source.empty() || !keyframe.keyframe()) {
+    return false;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (busy_) {
+      ++stats_.samples_skipped;
+      return false;
+    }
+    if (keyframe.Clone(&keyframe_)) {
+      LOG(ERROR) << "cannot copy quality sample keyframe.";
+      return false;
+    }
+    source_ = source;
+    busy_ = true;
+  }
+  frame_ready_.notify_one();
+  return true;
+}
+
+void QualityMonitor::GetStats(QualityStats* ptr_stats) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  *ptr_stats = stats_;
+}
+
+void QualityMonitor::WorkerThread() {
+  ScopedThreadRegistration registration("quality");
+  for (;;) {
+    SharedVideoFrame source;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      frame_ready_.wait(lock, [this] { return stop_ || !source_.empty(); });
+      if (stop_) {
+        break;
+      }
+      source.Swap(&source_);
+    }
+    const std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    double psnr = 0;
+    double ssim = 0;
+    const int status = MeasureFrame(*source, &psnr, &ssim);
+    source.Reset();
+    const std::chrono::steady_clock::time_point end =
+        std::chrono::steady_clock::now();
+    const std::chrono::microseconds time =
+        std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+    if (status) {
+      LOG(ERROR) << "quality sample failed: " << status;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    busy_ = false;
+    resume_time_ =
+        end + time * (100 - settings_.max_cpu) / settings_.max_cpu;
+    stats_.monitor_time_us += time.count();
+    if (status) {
+      ++stats_.sample_failures;
+      continue;
+    }
+    if (!stats_.samples || psnr < stats_.min_psnr) {
+      stats_.min_psnr = psnr;
+    }
+    if (!stats_.samples || ssim < stats_.min_ssim) {
+      stats_.min_ssim = ssim;
+    }
+    ++stats_.samples;
+    stats_.last_psnr = psnr;
+    stats_.psnr_sum += psnr;
+    stats_.last_ssim = ssim;
+    stats_.ssim_sum += ssim;
+  }
+}
+
+int QualityMonitor::MeasureFrame(const VideoFrame& source, double* ptr_psnr,
+                                 double* ptr_ssim) {
+  const VideoFrame* ptr_source = &source;
+  if (source.format() == kVideoFormatNV12) {
+    if (converted_frame_.InitConverted(source)) {
+      return kDecoderError;
+    }
+    ptr_source = &converted_frame_;
+  }
+  VideoPlanes source_planes;
+  if (!VideoFrame::GetVisiblePlanes(ptr_source->config(),
+                                    ptr_source->buffer(), &source_planes) ||
+      InitCodec(keyframe_.format())) {
+    return kDecoderError;
+  }
+  if (vpx_codec_decode(&vpx_context_, keyframe_.buffer(),
+                       keyframe_.buffer_length(), NULL, 0)) {
+    LOG(ERROR) << "quality vpx_codec_decode failed: "
+               << vpx_codec_error(&vpx_context_);
+    return kDecoderError;
+  }
+  vpx_codec_iter_t iter = NULL;
+  const vpx_image_t* const ptr_image =
+      vpx_codec_get_frame(&vpx_context_, &iter);
+  const int32 width = VisibleWidth(ptr_source->config());
+  const int32 height = VisibleHeight(ptr_source->config());
+  // Padding, when the encoder added some, is at the right and the bottom of
+  // the decoded image.
+  if (!ptr_image || ptr_image->fmt != VPX_IMG_FMT_I420 ||
+      static_cast<int32>(ptr_image->d_w) < width ||
+      static_cast<int32>(ptr_image->d_h) < height) {
+    LOG(ERROR) << "quality sample decoded to no image, or one that does not "
+               << "match its " << width << "x" << height << " source.";
+    return kDecoderError;
+  }
+
+  const int32 uv_width = (width + 1) / 2;
+  const int32 uv_height = (height + 1) / 2;
+  const int kPlanes[] = {VPX_PLANE_Y, VPX_PLANE_U, VPX_PLANE_V};
+  uint64 sse = 0;
+  for (int i = 0; i < 3; ++i) {
+    sse += PlaneSse(source_planes.data[i], source_planes.stride[i],
+                    ptr_image->planes[kPlanes[i]],
+                    ptr_image->stride[kPlanes[i]],
+                    i ? uv_width : width, i ? uv_height : height);
+  }
+  const double samples =
+      static_cast<double>(width) * height + 2.0 * uv_width * uv_height;
+  *ptr_psnr = sse ?
+      std::min(kMaxPsnr, 10 * log10(255.0 * 255.0 * samples / sse)) :
+      kMaxPsnr;
+  *ptr_ssim = PlaneSsim(source_planes.data[0], source_planes.stride[0],
+                        ptr_image->planes[VPX_PLANE_Y],
+                        ptr_image->stride[VPX_PLANE_Y], width, height);
+  return kSuccess;
+}
+
+int QualityMonitor::InitCodec(VideoFormat format) {
+  if (format != kVideoFormatVP8 && format != kVideoFormatVP9) {
+    LOG(ERROR) << "quality samples must be VP8 or VP9.";
+    return kInvalidArg;
+  }
+  if (codec_ready_) {
+    if (format == codec_format_) {
+      return kSuccess;
+    }
+    vpx_codec_destroy(&vpx_context_);
+    codec_ready_ = false;
+  }
+  // Samples are measured one at a time, on this thread alone.
+  vpx_codec_dec_cfg_t libvpx_config = {};
+  libvpx_config.threads = 1;
+  vpx_codec_iface_t* const ptr_iface = format == kVideoFormatVP9 ?
+      vpx_codec_vp9_dx() : vpx_codec_vp8_dx();
+  if (vpx_codec_dec_init(&vpx_context_, ptr_iface, &libvpx_config, 0)) {
+    LOG(ERROR) << "quality vpx_codec_dec_init failed: "
+               << vpx_codec_error(&vpx_context_);
+    return kDecoderError;
+  }
+  codec_ready_ = true;
+  codec_format_ = format;
+  return kSuccess;
+}
+
+}  // namespace webmlive
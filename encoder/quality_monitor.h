@@ -0,0 +1,157 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_QUALITY_MONITOR_H_
+#define WEBMLIVE_ENCODER_QUALITY_MONITOR_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+#include "encoder/shared_video_frame.h"
+#include "encoder/video_encoder.h"
+#include "libvpx/vpx/vpx_decoder.h"
+
+namespace webmlive {
+
+struct QualitySettings {
+  static const int kDefaultMaxCpu = 5;
+
+  QualitySettings() : interval(0), max_cpu(kDefaultMaxCpu) {}
+
+  // Keyframes between samples: every |interval|th keyframe is decoded and
+  // measured. 0, the default, disables the monitor.
+  int interval;
+
+  // CPU time the monitor may use, in percent of one core.
+  int max_cpu;
+};
+
+struct QualityStats {
+  QualityStats()
+      : samples(0), samples_skipped(0), sample_failures(0), last_psnr(0),
+        psnr_sum(0), min_psnr(0), last_ssim(0), ssim_sum(0), min_ssim(0),
+        monitor_time_us(0) {}
+
+  // Keyframes measured, those skipped because the monitor was busy or over
+  // its CPU cap, and those that failed to decode or did not match the size
+  // of their source.
+  int64 samples;
+  int64 samples_skipped;
+  int64 sample_failures;
+
+  // PSNR of the Y, U and V planes together, in dB, of the last sample, the
+  // sum over all samples, and the lowest.
+  double last_psnr;
+  double psnr_sum;
+  double min_psnr;
+
+  // SSIM of the Y plane, 0 to 1, likewise.
+  double last_ssim;
+  double ssim_sum;
+  double min_ssim;
+
+  // Time spent converting, decoding and measuring, in microseconds.
+  int64 monitor_time_us;
+};
+
+// Measures the quality of the encoded video: every |QualitySettings::interval|
+// keyframes, the compressed keyframe and a reference to the raw frame it was
+// encoded from are passed to a worker thread named "quality", which decodes
+// the keyframe with libvpx and computes its PSNR and SSIM against the raw
+// frame. Keyframes decode on their own, so the decoder sees no other frames.
+//
+// CPU use is capped at |QualitySettings::max_cpu| percent of one core: after
+// a sample that took T, samples are skipped for T * (100 - max_cpu) /
+// max_cpu. A sample due while the worker is still busy is skipped too.
+//
+// Notes:
+// - |Init()| must be called before any other method, and |Run()| starts the
+//   worker thread.
+// - |Due()| and |SubmitFrame()| must be called from one thread.
+class QualityMonitor {
+ public:
+  enum {
+    kDecoderError = -3,
+    kRunFailed = -2,
+    kInvalidArg = -1,
+    kSuccess = 0,
+  };
+
+  QualityMonitor();
+  ~QualityMonitor();
+
+  // Stores |settings|, and returns |kSuccess|, or |kInvalidArg| when the
+  // interval is not positive, or the CPU cap is out of range.
+  int Init(const QualitySettings& settings);
+
+  // Starts the worker thread.
+  int Run();
+
+  // Stops the worker thread after the sample in progress, if any.
+  void Stop();
+
+  // Counts a keyframe, and returns true when it is to be sampled. Counts a
+  // skipped sample when it is due but the worker is busy or over its cap.
+  bool Due();
+
+  // Passes |source|, the I420, YV12 or NV12 frame |keyframe| was encoded
+  // from, and a copy of |keyframe|, a VP8 or VP9 keyframe, to the worker.
+  // Returns false when the worker is busy or the copy fails.
+  bool SubmitFrame(const SharedVideoFrame& source, const VideoFrame& keyframe);
+
+  // Copies the quality measurements to |ptr_stats|. Thread safe.
+  void GetStats(QualityStats* ptr_stats) const;
+
+ private:
+  // Worker thread function.
+  void WorkerThread();
+
+  // Decodes |keyframe_| and compares it with |source|, storing the results
+  // in |ptr_psnr| and |ptr_ssim|. Returns |kSuccess| when successful.
+  int MeasureFrame(const VideoFrame& source, double* ptr_psnr,
+                   double* ptr_ssim);
+
+  // Sets up |vpx_context_| for |format|, unless it is set up for it already.
+  int InitCodec(VideoFormat format);
+
+  QualitySettings settings_;
+  std::unique_ptr<std::thread> worker_thread_;
+
+  // Keyframes counted by |Due()|. Used only by the submitting thread.
+  int64 keyframe_count_;
+
+  // Used only by the worker thread: the decoder and its format, and the
+  // source converted to I420 when submitted as NV12.
+  vpx_codec_ctx_t vpx_context_;
+  bool codec_ready_;
+  VideoFormat codec_format_;
+  VideoFrame converted_frame_;
+
+  // Source frame and keyframe waiting for the worker, or being measured by
+  // it, the time before which samples are skipped, and the measurements.
+  // Protected by |mutex_|; |keyframe_| is written only while |busy_| is
+  // false, and read by the worker without the lock.
+  SharedVideoFrame source_;
+  VideoFrame keyframe_;
+  bool busy_;
+  std::chrono::steady_clock::time_point resume_time_;
+  QualityStats stats_;
+
+  bool stop_;
+  mutable std::mutex mutex_;
+  std::condition_variable frame_ready_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(QualityMonitor);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_QUALITY_MONITOR_H_
@@ -0,0 +1,88 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/scene_cut_detector.h"
+
+#include <cstdlib>
+#include <cstring>
+
+#include "glog/logging.h"
+
+namespace webmlive {
+
+SceneCutDetector::SceneCutDetector()
+    : threshold_(0), have_reference_(false), width_(0), height_(0),
+      histogram_change_(0), cell_change_(0) {
+  memset(histogram_, 0, sizeof(histogram_));
+  memset(cell_sums_, 0, sizeof(cell_sums_));
+  memset(cell_samples_, 0, sizeof(cell_samples_));
+}
+
+int SceneCutDetector::Init(int threshold) {
+  if (threshold < 1 || threshold > 100) {
+    LOG(ERROR) << "invalid scene cut threshold: " << threshold;
+    return kInvalidArg;
+  }
+  threshold_ = threshold;
+  have_reference_ = false;
+  return kSuccess;
+}
+
+bool SceneCutDetector::Detect(const uint8* ptr_luma, int32 stride,
+                              int32 width, int32 height) {
+  if (!ptr_luma || width < kGridSize || height < kGridSize) {
+    return false;
+  }
+  uint32 histogram[kHistogramBins] = {0};
+  uint32 cell_sums[kNumCells] = {0};
+  uint32 cell_samples[kNumCells] = {0};
+  uint32 samples = 0;
+  for (int32 y = 0; y < height; y += kSampleStep) {
+    const uint8* const ptr_row = ptr_luma + y * stride;
+    const int cell_row = y * kGridSize / height * kGridSize;
+    for (int32 x = 0; x < width; x += kSampleStep) {
+      const uint8 luma = ptr_row[x];
+      const int cell = cell_row + x * kGridSize / width;
+      ++histogram[luma * kHistogramBins / 256];
+      cell_sums[cell] += luma;
+      ++cell_samples[cell];
+      ++samples;
+    }
+  }
+
+  bool cut = false;
+  if (have_reference_ && width == width_ && height == height_) {
+    // Histograms differ by at most twice the sample count, and cell means by
+    // at most 255.
+    uint32 histogram_distance = 0;
+    for (int i = 0; i < kHistogramBins; ++i) {
+      histogram_distance += histogram[i] > histogram_[i] ?
+          histogram[i] - histogram_[i] : histogram_[i] - histogram[i];
+    }
+    histogram_change_ =
+        static_cast<int>(histogram_distance * 50ULL / samples);
+    int cell_distance = 0;
+    for (int i = 0; i < kNumCells; ++i) {
+      if (cell_samples[i] > 0) {
+        cell_distance += std::abs(
+            static_cast<int>(cell_sums[i] / cell_samples[i]) -
+            static_cast<int>(cell_sums_[i] / cell_samples_[i]));
+      }
+    }
+    cell_change_ = cell_distance * 100 / (kNumCells * 255);
+    cut = histogram_change_ >= threshold_ && cell_change_ * 2 >= threshold_;
+  }
+  memcpy(histogram_, histogram, sizeof(histogram_));
+  memcpy(cell_sums_, cell_sums, sizeof(cell_sums_));
+  memcpy(cell_samples_, cell_samples, sizeof(cell_samples_));
+  width_ = width;
+  height_ = height;
+  have_reference_ = true;
+  return cut;
+}
+
+}  // namespace webmlive
@@ -0,0 +1,77 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_SCENE_CUT_DETECTOR_H_
+#define WEBMLIVE_ENCODER_SCENE_CUT_DETECTOR_H_
+
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+
+namespace webmlive {
+
+// Detects scene cuts in raw video from the luma plane alone, cheaply enough
+// to run on every frame. The plane is sampled every |kSampleStep| pixels in
+// both directions into a luma histogram of |kHistogramBins| bins and the
+// mean luma of a |kGridSize|x|kGridSize| grid of cells. A frame is a cut when
+// its histogram differs from that of the previous frame by at least the
+// threshold, and its cell means by at least half of it, since they change
+// less across a cut. Requiring both keeps out what each measure alone
+// mistakes for a cut: the cell means change with fast motion, and the
+// histogram with the exposure of a camera adapting to a new light.
+class SceneCutDetector {
+ public:
+  enum {
+    kInvalidArg = -1,
+    kSuccess = 0,
+  };
+
+  static const int kHistogramBins = 32;
+  static const int kGridSize = 8;
+  static const int kSampleStep = 4;
+
+  SceneCutDetector();
+  ~SceneCutDetector() {}
+
+  // Sets the change, in percent of the largest possible, above which a frame
+  // is a cut. Returns |kInvalidArg| unless |threshold| is in [1, 100].
+  int Init(int threshold);
+
+  // Analyzes the |width|x|height| luma plane at |ptr_luma| and returns true
+  // when it starts a new scene. The first frame, and the first after a size
+  // change or |Reset()|, is not a cut.
+  bool Detect(const uint8* ptr_luma, int32 stride, int32 width,
+              int32 height);
+
+  // Forgets the previous frame.
+  void Reset() { have_reference_ = false; }
+
+  // Histogram and cell changes of the last frame passed to |Detect()|, in
+  // percent.
+  int histogram_change() const { return histogram_change_; }
+  int cell_change() const { return cell_change_; }
+
+ private:
+  static const int kNumCells = kGridSize * kGridSize;
+
+  int threshold_;
+  bool have_reference_;
+  int32 width_;
+  int32 height_;
+  int histogram_change_;
+  int cell_change_;
+
+  // Histogram and cell luma sums of the previous frame, and the samples of
+  // each cell.
+  uint32 histogram_[kHistogramBins];
+  uint32 cell_sums_[kNumCells];
+  uint32 cell_samples_[kNumCells];
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(SceneCutDetector);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_SCENE_CUT_DETECTOR_H_
@@ -0,0 +1,71 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/segment_aligner.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+#include "encoder/log_util.h"
+#include "glog/logging.h"
+
+namespace webmlive {
+
+void SegmentAligner::AddBoundary(int64 timestamp) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  boundaries_.push_back(timestamp);
+  ++stats_.boundaries;
+}
+
+bool SegmentAligner::StartsSegment(int64 timestamp, int64 duration) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  // Compares doubled times so that odd durations keep their exact middle.
+  const int64 twice_midpoint = 2 * timestamp + std::max<int64>(duration, 0);
+  int consumed = 0;
+  int64 boundary = 0;
+  while (!boundaries_.empty() && 2 * boundaries_.front() < twice_midpoint) {
+    boundary = boundaries_.front();
+    boundaries_.pop_front();
+    ++consumed;
+  }
+
+  if (!audio_started_) {
+    // The first packet starts the first cluster on its own. When video has
+    // not started yet, the first video cluster joins this one.
+    audio_started_ = true;
+    video_unmatched_ = consumed == 0;
+    stats_.merged_boundaries += std::max(consumed - 1, 0);
+    return false;
+  }
+  if (consumed > 0 && video_unmatched_) {
+    video_unmatched_ = false;
+    --consumed;
+  }
+  if (consumed == 0) {
+    return false;
+  }
+  if (consumed > 1) {
+    stats_.merged_boundaries += consumed - 1;
+    WEBMLIVE_LOG_EVERY_MS(WARNING, kLogIntervalMs)
+        << consumed << " video segment boundaries before audio at "
+        << timestamp << ", audio and video segment numbers differ.";
+  }
+  const int64 offset = std::abs(timestamp - boundary);
+  ++stats_.audio_cuts;
+  stats_.max_offset_ms = std::max(stats_.max_offset_ms, offset);
+  stats_.total_offset_ms += offset;
+  return true;
+}
+
+void SegmentAligner::GetStats(SegmentAlignerStats* ptr_stats) const {
+  if (ptr_stats) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    *ptr_stats = stats_;
+  }
+}
+
+}  // namespace webmlive
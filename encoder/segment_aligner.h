@@ -0,0 +1,93 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_SEGMENT_ALIGNER_H_
+#define WEBMLIVE_ENCODER_SEGMENT_ALIGNER_H_
+
+#include <deque>
+#include <mutex>
+
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+
+namespace webmlive {
+
+struct SegmentAlignerStats {
+  SegmentAlignerStats()
+      : boundaries(0), audio_cuts(0), merged_boundaries(0), max_offset_ms(0),
+        total_offset_ms(0) {}
+
+  // Video cluster starts recorded, and audio clusters started for them.
+  int64 boundaries;
+  int64 audio_cuts;
+
+  // Boundaries that fell before the same audio packet as a later boundary,
+  // or before the first audio packet, and got no audio cluster of their own.
+  // Each one shifts audio segment numbers against video segment numbers.
+  int64 merged_boundaries;
+
+  // Largest and summed distance between an audio cut and its boundary, in
+  // milliseconds.
+  int64 max_offset_ms;
+  int64 total_offset_ms;
+};
+
+// Places the audio cluster boundaries of a DASH audio muxer at those of the
+// video muxer, so that audio and video segment N cover the same time span.
+// The video muxer decides where clusters start: at keyframes, and at the
+// segment boundaries of |WebmEncoderConfig::segment_duration|. Each start is
+// recorded with |AddBoundary()|, and the audio muxer starts a cluster at the
+// audio packet whose start is nearest it.
+//
+// The first audio cluster, started by the first audio packet, stands for
+// the first video cluster when audio starts first.
+//
+// Boundaries must be recorded before the audio packets around them are
+// checked: audio must reach |StartsSegment()| ordered by the middle of each
+// packet against video timestamps, as |AVInterleaver::set_audio_midpoints()|
+// releases packets.
+//
+// Notes:
+// - |AddBoundary()| and |StartsSegment()| are called by the thread muxing
+//   both streams.
+// - |GetStats()| may be called from any thread.
+class SegmentAligner {
+ public:
+  SegmentAligner() : audio_started_(false), video_unmatched_(false) {}
+  ~SegmentAligner() {}
+
+  // Records a video cluster starting at |timestamp|.
+  void AddBoundary(int64 timestamp);
+
+  // Returns true when the audio packet starting at |timestamp| and lasting
+  // |duration| milliseconds must start a new audio cluster: a recorded
+  // boundary lies before the middle of the packet, so that no later packet
+  // starts nearer it. Consumes the boundaries before the middle of the
+  // packet.
+  bool StartsSegment(int64 timestamp, int64 duration);
+
+  // Copies the current stats to |ptr_stats|.
+  void GetStats(SegmentAlignerStats* ptr_stats) const;
+
+ private:
+  // Recorded boundaries not yet consumed, oldest first.
+  std::deque<int64> boundaries_;
+
+  // True once the first audio packet, which starts the first audio cluster
+  // on its own, has been checked. |video_unmatched_| is set when the first
+  // video cluster started after it: that audio cluster then also stands for
+  // the first video cluster.
+  bool audio_started_;
+  bool video_unmatched_;
+  SegmentAlignerStats stats_;
+  mutable std::mutex mutex_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(SegmentAligner);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_SEGMENT_ALIGNER_H_
@@ -0,0 +1,143 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/segment_duration_controller.h"
+
+#include <algorithm>
+
+#include "glog/logging.h"
+
+namespace webmlive {
+
+namespace {
+
+// Returns true when |duration| is |min_duration| times a power of two.
+bool IsPowerOfTwoMultiple(int64 duration, int64 min_duration) {
+  if (min_duration <= 0 || duration < min_duration ||
+      duration % min_duration != 0) {
+    return false;
+  }
+  const int64 factor = duration / min_duration;
+  return (factor & (factor - 1)) == 0;
+}
+
+}  // namespace
+
+SegmentDurationController::SegmentDurationController()
+    : latest_timestamp_(0),
+      window_end_(-1),
+      window_load_(0),
+      slow_windows_(0),
+      fast_windows_(0) {}
+
+int SegmentDurationController::Init(const SegmentDurationSettings& settings,
+                                    int segment_duration) {
+  if (!IsPowerOfTwoMultiple(settings.max_duration, settings.min_duration) ||
+      !IsPowerOfTwoMultiple(segment_duration, settings.min_duration) ||
+      segment_duration > settings.max_duration || settings.low_load < 0 ||
+      settings.high_load <= settings.low_load || settings.windows <= 0) {
+    LOG(ERROR) << "invalid segment duration settings: " << segment_duration
+               << " within " << settings.min_duration << "-"
+               << settings.max_duration;
+    return kInvalidArg;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  settings_ = settings;
+  epochs_.clear();
+  const Epoch epoch = {0, segment_duration};
+  epochs_.push_back(epoch);
+  latest_timestamp_ = 0;
+  window_end_ = -1;
+  window_load_ = 0;
+  slow_windows_ = fast_windows_ = 0;
+  stats_ = SegmentDurationStats();
+  stats_.duration = segment_duration;
+  return kSuccess;
+}
+
+void SegmentDurationController::AddUpload(int64 timestamp, int64 duration,
+                                          int64 upload_ms) {
+  if (duration <= 0) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++stats_.uploads;
+  if (window_end_ >= 0 && timestamp >= window_end_) {
+    EndWindow();
+  }
+  if (window_end_ < 0 || timestamp >= window_end_) {
+    window_end_ = timestamp + epochs_.back().duration;
+    window_load_ = 0;
+  }
+  window_load_ = std::max(window_load_, upload_ms * 100 / duration);
+}
+
+int64 SegmentDurationController::NextBoundary(int64 timestamp) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  latest_timestamp_ = std::max(latest_timestamp_, timestamp);
+  size_t epoch = epochs_.size() - 1;
+  while (epoch > 0 && epochs_[epoch].start > timestamp) {
+    --epoch;
+  }
+  const int64 duration = epochs_[epoch].duration;
+  int64 boundary = (timestamp / duration + 1) * duration;
+  if (epoch + 1 < epochs_.size()) {
+    boundary = std::min(boundary, epochs_[epoch + 1].start);
+  }
+  return boundary;
+}
+
+void SegmentDurationController::GetStats(
+    SegmentDurationStats* ptr_stats) const {
+  if (ptr_stats) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    *ptr_stats = stats_;
+  }
+}
+
+void SegmentDurationController::EndWindow() {
+  ++stats_.windows;
+  stats_.last_load = static_cast<int>(window_load_);
+  VLOG(1) << "segment period load " << window_load_ << "%";
+  if (epochs_.back().start > latest_timestamp_) {
+    // Periods measured before a scheduled change say nothing about it.
+    return;
+  }
+  if (window_load_ > settings_.high_load) {
+    ++slow_windows_;
+    fast_windows_ = 0;
+  } else if (window_load_ <= settings_.low_load) {
+    ++fast_windows_;
+    slow_windows_ = 0;
+  } else {
+    slow_windows_ = fast_windows_ = 0;
+  }
+  const int64 duration = epochs_.back().duration;
+  if (slow_windows_ >= settings_.windows &&
+      duration * 2 <= settings_.max_duration) {
+    ScheduleDuration(duration * 2);
+    ++stats_.lengthened;
+  } else if (fast_windows_ >= settings_.windows &&
+             duration / 2 >= settings_.min_duration) {
+    ScheduleDuration(duration / 2);
+    ++stats_.shortened;
+  }
+}
+
+void SegmentDurationController::ScheduleDuration(int64 duration) {
+  const int64 step = std::max(epochs_.back().duration, duration);
+  const Epoch epoch = {(latest_timestamp_ / step + 1) * step, duration};
+  epochs_.push_back(epoch);
+  while (epochs_.size() > kMaxEpochs) {
+    epochs_.pop_front();
+  }
+  slow_windows_ = fast_windows_ = 0;
+  stats_.duration = static_cast<int>(duration);
+  LOG(INFO) << "segment duration " << duration << " ms from " << epoch.start;
+}
+
+}  // namespace webmlive
@@ -0,0 +1,158 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_SEGMENT_DURATION_CONTROLLER_H_
+#define WEBMLIVE_ENCODER_SEGMENT_DURATION_CONTROLLER_H_
+
+#include <deque>
+#include <mutex>
+
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+
+namespace webmlive {
+
+struct SegmentDurationSettings {
+  static const int kDefaultLowLoad = 25;
+  static const int kDefaultHighLoad = 75;
+  static const int kDefaultWindows = 3;
+
+  SegmentDurationSettings()
+      : enabled(false),
+        min_duration(0),
+        max_duration(0),
+        low_load(kDefaultLowLoad),
+        high_load(kDefaultHighLoad),
+        windows(kDefaultWindows) {}
+
+  // Adapt the segment duration to the time segments take to upload.
+  bool enabled;
+
+  // Bounds of the segment duration, in milliseconds. |max_duration| must be
+  // |min_duration| times a power of two; durations are doubled and halved
+  // between them, so the segment boundaries of every duration fall on
+  // those of the longer ones.
+  int min_duration;
+  int max_duration;
+
+  // Upload time of a segment in percent of its duration, its load, at or
+  // below which segments are shortened, and above which they are
+  // lengthened.
+  int low_load;
+  int high_load;
+
+  // Consecutive segment periods beyond one of the load thresholds that
+  // change the duration.
+  int windows;
+};
+
+struct SegmentDurationStats {
+  SegmentDurationStats()
+      : uploads(0), windows(0), lengthened(0), shortened(0), duration(0),
+        last_load(0) {}
+
+  // Segment uploads measured, and the segment periods they were grouped in.
+  int64 uploads;
+  int64 windows;
+
+  // Duration changes made.
+  int64 lengthened;
+  int64 shortened;
+
+  // Segment duration last scheduled, in milliseconds.
+  int duration;
+
+  // Highest load of the last segment period, in percent.
+  int last_load;
+};
+
+// Chooses the segment duration from delivery latency. Short segments cut
+// latency, but each costs a request: on a link with a long round trip their
+// uploads take a large part of their duration and leave no room for a
+// bitrate spike. The upload time of each completed chunk is reported; the
+// highest load of the chunks of each segment period is compared with the
+// thresholds, and after |SegmentDurationSettings::windows| periods beyond
+// one the duration is doubled or halved.
+//
+// The controller is also the segment schedule every muxer and video encoder
+// follows: |NextBoundary()| returns where the segment after a timestamp
+// starts. A new duration takes effect at a boundary common to the old and
+// new durations past every timestamp queried so far, so that streams behind
+// the others still cut their segments, and force their keyframes, at the
+// same times.
+//
+// Notes:
+// - |Init()| must be called before any other method.
+// - Thread safe.
+class SegmentDurationController {
+ public:
+  enum {
+    kInvalidArg = -1,
+    kSuccess = 0,
+  };
+
+  SegmentDurationController();
+  ~SegmentDurationController() {}
+
+  // Starts the schedule with |segment_duration| millisecond segments, which
+  // must be |settings.min_duration| times a power of two within the bounds.
+  // Returns |kInvalidArg| when a setting is out of range.
+  int Init(const SegmentDurationSettings& settings, int segment_duration);
+
+  // Folds in the upload of a chunk starting at |timestamp| and lasting
+  // |duration| milliseconds, which took |upload_ms| milliseconds.
+  void AddUpload(int64 timestamp, int64 duration, int64 upload_ms);
+
+  // Returns the start time of the first segment after the one containing
+  // |timestamp|, in milliseconds.
+  int64 NextBoundary(int64 timestamp);
+
+  // Copies the counters to |ptr_stats|.
+  void GetStats(SegmentDurationStats* ptr_stats) const;
+
+ private:
+  // Number of schedule changes kept for streams behind the others.
+  static const size_t kMaxEpochs = 8;
+
+  // Part of the schedule with one duration, from |start| on.
+  struct Epoch {
+    int64 start;
+    int64 duration;
+  };
+
+  // Classifies the segment period that ended, and changes the duration
+  // when enough of them were beyond a threshold. Called with |mutex_| held.
+  void EndWindow();
+
+  // Starts |duration| millisecond segments at the first boundary common to
+  // the current and new durations past |latest_timestamp_|. Called with
+  // |mutex_| held.
+  void ScheduleDuration(int64 duration);
+
+  SegmentDurationSettings settings_;
+  std::deque<Epoch> epochs_;
+
+  // Latest timestamp passed to |NextBoundary()|.
+  int64 latest_timestamp_;
+
+  // End of the current segment period, and its highest load in percent. The
+  // period is -1 before the first upload.
+  int64 window_end_;
+  int64 window_load_;
+
+  // Consecutive periods above |settings_.high_load|, and at or below
+  // |settings_.low_load|.
+  int slow_windows_;
+  int fast_windows_;
+  SegmentDurationStats stats_;
+  mutable std::mutex mutex_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(SegmentDurationController);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_SEGMENT_DURATION_CONTROLLER_H_
@@ -0,0 +1,70 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/segment_index.h"
+
+#include <new>
+
+#include "glog/logging.h"
+
+namespace webmlive {
+
+namespace {
+
+void PutLe32(uint32 value, uint8* ptr_data) {
+  for (int i = 0; i < 4; ++i) {
+    ptr_data[i] = static_cast<uint8>(value >> (8 * i));
+  }
+}
+
+void PutLe64(uint64 value, uint8* ptr_data) {
+  for (int i = 0; i < 8; ++i) {
+    ptr_data[i] = static_cast<uint8>(value >> (8 * i));
+  }
+}
+
+}  // namespace
+
+void SegmentIndexRecordForChunk(int64 chunk_num, const WebmChunk& chunk,
+                                SegmentIndexRecord* ptr_record) {
+  CHECK_NOTNULL(ptr_record);
+  ptr_record->number = chunk_num;
+  ptr_record->timestamp = chunk.timestamp();
+  ptr_record->duration = static_cast<int32>(chunk.duration());
+  ptr_record->length = chunk.length();
+  ptr_record->keyframe_offset = chunk.descriptor().keyframe_offset;
+}
+
+void SerializeSegmentIndexRecord(const SegmentIndexRecord& record,
+                                 uint8* ptr_data) {
+  CHECK_NOTNULL(ptr_data);
+  PutLe64(static_cast<uint64>(record.number), ptr_data);
+  PutLe64(static_cast<uint64>(record.timestamp), ptr_data + 8);
+  PutLe32(static_cast<uint32>(record.duration), ptr_data + 16);
+  PutLe32(static_cast<uint32>(record.length), ptr_data + 20);
+  PutLe32(static_cast<uint32>(record.keyframe_offset), ptr_data + 24);
+}
+
+SharedWebmChunk MakeSegmentIndexChunk(const std::string& id,
+                                      const SegmentIndexRecord* ptr_record) {
+  WebmChunk::Data data;
+  if (ptr_record) {
+    data.resize(kSegmentIndexRecordSize);
+    SerializeSegmentIndexRecord(*ptr_record, &data[0]);
+  }
+  WebmChunkDescriptor descriptor;
+  descriptor.length = static_cast<int32>(data.size());
+  SharedWebmChunk chunk(
+      new (std::nothrow) WebmChunk(id, descriptor, 0, &data,  // NOLINT
+                                   SharedWebmChunkDataPool()));
+  if (!chunk) {
+    LOG(ERROR) << "out of memory.";
+  }
+  return chunk;
+}
+
+}  // namespace webmlive
@@ -0,0 +1,59 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_SEGMENT_INDEX_H_
+#define WEBMLIVE_ENCODER_SEGMENT_INDEX_H_
+
+#include <string>
+
+#include "encoder/basictypes.h"
+#include "encoder/webm_chunk.h"
+
+namespace webmlive {
+
+// Sidecar index of the media segments of a DASH Representation. The index
+// file is append-only: each media segment written adds one record, so that
+// an origin finds a segment by its number, or by time, by reading fixed size
+// records instead of parsing the segments or the MPD.
+//
+// Record layout, |kSegmentIndexRecordSize| bytes, all fields little endian:
+//   offset  0: int64 segment number, as in the segment's chunk id.
+//   offset  8: int64 start timecode, in milliseconds.
+//   offset 16: int32 duration, in milliseconds.
+//   offset 20: int32 segment length, in bytes.
+//   offset 24: int32 position of the keyframe block element within the
+//              segment, or -1 when the segment does not begin with one.
+struct SegmentIndexRecord {
+  SegmentIndexRecord()
+      : number(0), timestamp(0), duration(0), length(0), keyframe_offset(-1) {}
+
+  int64 number;
+  int64 timestamp;
+  int32 duration;
+  int32 length;
+  int32 keyframe_offset;
+};
+
+const int32 kSegmentIndexRecordSize = 28;
+
+// Fills |ptr_record| from media segment |chunk_num| held in |chunk|.
+void SegmentIndexRecordForChunk(int64 chunk_num, const WebmChunk& chunk,
+                                SegmentIndexRecord* ptr_record);
+
+// Writes |record| to the |kSegmentIndexRecordSize| bytes at |ptr_data|.
+void SerializeSegmentIndexRecord(const SegmentIndexRecord& record,
+                                 uint8* ptr_data);
+
+// Returns a chunk named |id| holding |ptr_record|, for appending to the
+// index file, or NULL when out of memory. An empty chunk, which starts a new
+// index file, is returned when |ptr_record| is NULL.
+SharedWebmChunk MakeSegmentIndexChunk(const std::string& id,
+                                      const SegmentIndexRecord* ptr_record);
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_SEGMENT_INDEX_H_
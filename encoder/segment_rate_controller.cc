@@ -0,0 +1,112 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/segment_rate_controller.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+#include "glog/logging.h"
+
+namespace webmlive {
+
+SegmentRateController::SegmentRateController()
+    : segment_duration_(0),
+      segment_start_(-1),
+      segment_bytes_(0),
+      segment_budget_(0),
+      bitrate_(0),
+      base_bitrate_(0) {}
+
+int SegmentRateController::Init(const SegmentRateSettings& settings,
+                                int segment_duration) {
+  if (settings.tolerance <= 0 || settings.tolerance > 100 ||
+      settings.max_adjustment <= 0 || settings.max_adjustment >= 100 ||
+      segment_duration <= 0) {
+    LOG(ERROR) << "invalid segment rate settings.";
+    return kInvalidArg;
+  }
+  settings_ = settings;
+  segment_duration_ = segment_duration;
+  segment_start_ = -1;
+  segment_bytes_ = segment_budget_ = 0;
+  bitrate_ = base_bitrate_ = 0;
+  std::lock_guard<std::mutex> lock(mutex_);
+  stats_ = SegmentRateStats();
+  return kSuccess;
+}
+
+int SegmentRateController::Update(int64 timestamp, int64 duration,
+                                  int32 length, bool segment_start,
+                                  int base_bitrate) {
+  if (base_bitrate <= 0) {
+    return 0;
+  }
+  if (base_bitrate != base_bitrate_) {
+    // A new configured bitrate replaces any correction in effect.
+    base_bitrate_ = bitrate_ = base_bitrate;
+  }
+  if (segment_start || segment_start_ < 0) {
+    if (segment_start_ >= 0) {
+      EndSegment();
+    }
+    segment_start_ = timestamp;
+    segment_bytes_ = 0;
+    // Kilobits per second are bytes per millisecond times 8.
+    segment_budget_ = static_cast<int64>(base_bitrate_) * segment_duration_ / 8;
+  }
+  segment_bytes_ += length;
+
+  const int64 elapsed = timestamp + std::max<int64>(duration, 1) -
+                        segment_start_;
+  const int64 remaining =
+      std::max(segment_duration_ - elapsed, std::max<int64>(duration, 1));
+  const int64 projected =
+      segment_bytes_ + static_cast<int64>(base_bitrate_) * remaining / 8;
+  int target = base_bitrate_;
+  if (std::llabs(projected - segment_budget_) * 200 >
+      segment_budget_ * settings_.tolerance) {
+    const int64 remaining_budget = segment_budget_ - segment_bytes_;
+    const int64 spread = base_bitrate_ * settings_.max_adjustment / 100;
+    target = static_cast<int>(std::max<int64>(
+        base_bitrate_ - spread,
+        std::min<int64>(remaining_budget * 8 / remaining,
+                        base_bitrate_ + spread)));
+  }
+  // Returns to the base bitrate are always made.
+  if (target == bitrate_ ||
+      (target != base_bitrate_ &&
+       std::abs(target - bitrate_) * 100 < bitrate_ * kMinChangePercent)) {
+    return 0;
+  }
+  bitrate_ = target;
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++stats_.bitrate_changes;
+  return target;
+}
+
+void SegmentRateController::GetStats(SegmentRateStats* ptr_stats) const {
+  if (ptr_stats) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    *ptr_stats = stats_;
+  }
+}
+
+void SegmentRateController::EndSegment() {
+  VLOG(1) << "segment of " << segment_bytes_ << " bytes, budget "
+          << segment_budget_;
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++stats_.segments;
+  if (std::llabs(segment_bytes_ - segment_budget_) * 100 <=
+      segment_budget_ * settings_.tolerance) {
+    ++stats_.segments_within_tolerance;
+  }
+  stats_.last_segment_bytes = segment_bytes_;
+  stats_.last_segment_budget = segment_budget_;
+}
+
+}  // namespace webmlive
@@ -0,0 +1,126 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_SEGMENT_RATE_CONTROLLER_H_
+#define WEBMLIVE_ENCODER_SEGMENT_RATE_CONTROLLER_H_
+
+#include <mutex>
+
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+
+namespace webmlive {
+
+struct SegmentRateSettings {
+  static const int kDefaultTolerance = 10;
+  static const int kDefaultMaxAdjustment = 50;
+
+  SegmentRateSettings()
+      : enabled(false),
+        tolerance(kDefaultTolerance),
+        max_adjustment(kDefaultMaxAdjustment) {}
+
+  // Steer the video bitrate within each segment so that the segment size
+  // lands near the configured bitrate times the segment duration.
+  bool enabled;
+
+  // Allowed difference between a segment's size and its budget, in percent
+  // of the budget. Segments projected to land within half of it are left to
+  // libvpx rate control.
+  int tolerance;
+
+  // Largest change of the encoder bitrate from the configured bitrate, in
+  // percent.
+  int max_adjustment;
+};
+
+struct SegmentRateStats {
+  SegmentRateStats()
+      : segments(0), segments_within_tolerance(0), last_segment_bytes(0),
+        last_segment_budget(0), bitrate_changes(0) {}
+
+  // Segments completed, and those whose size was within the tolerance of
+  // their budget.
+  int64 segments;
+  int64 segments_within_tolerance;
+
+  // Size and byte budget of the last completed segment.
+  int64 last_segment_bytes;
+  int64 last_segment_budget;
+
+  // Encoder bitrate changes requested.
+  int64 bitrate_changes;
+};
+
+// Rate control above the encoder that works in segment byte budgets instead
+// of the milliseconds of libvpx's buffer model. The muxer decides where
+// segments start; each compressed frame is reported with whether it started
+// one. The budget of a segment is the base bitrate over the segment
+// duration. After each frame the controller projects the segment size from
+// the bytes spent and the base bitrate over the time left, and when the
+// projection misses the budget by more than half the tolerance, asks for
+// the bitrate that spends the remaining budget in the time left: a costly
+// keyframe is paid back by the frames that follow it, and a cheap static
+// scene leaves room for the motion that ends it.
+//
+// Notes:
+// - |Init()| must be called before any other method.
+// - |Update()| is called by the thread muxing the video; |GetStats()| may be
+//   called from any thread.
+class SegmentRateController {
+ public:
+  // Smallest relative change of the requested bitrate, in percent; smaller
+  // corrections are not worth a libvpx reconfiguration.
+  static const int kMinChangePercent = 5;
+
+  enum {
+    kInvalidArg = -1,
+    kSuccess = 0,
+  };
+
+  SegmentRateController();
+  ~SegmentRateController() {}
+
+  // Sets up control of |segment_duration| millisecond segments within
+  // |settings|. Returns |kInvalidArg| when a setting is out of range.
+  int Init(const SegmentRateSettings& settings, int segment_duration);
+
+  // Folds in a compressed frame of |length| bytes at |timestamp| lasting
+  // |duration| milliseconds, which starts a segment when |segment_start| is
+  // true. |base_bitrate| is the configured bitrate, in kilobits. Returns the
+  // bitrate the encoder should use from the next frame on, or 0 when it
+  // should keep its current bitrate.
+  int Update(int64 timestamp, int64 duration, int32 length,
+             bool segment_start, int base_bitrate);
+
+  // Copies the counters to |ptr_stats|.
+  void GetStats(SegmentRateStats* ptr_stats) const;
+
+ private:
+  // Records the completed segment in |stats_|.
+  void EndSegment();
+
+  SegmentRateSettings settings_;
+  int segment_duration_;
+
+  // Start time, bytes written and byte budget of the current segment.
+  // |segment_start_| is -1 before the first segment starts.
+  int64 segment_start_;
+  int64 segment_bytes_;
+  int64 segment_budget_;
+
+  // Bitrate last requested, in kilobits; the base bitrate when none is.
+  int bitrate_;
+  int base_bitrate_;
+  SegmentRateStats stats_;
+  mutable std::mutex mutex_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(SegmentRateController);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_SEGMENT_RATE_CONTROLLER_H_
@@ -0,0 +1,71 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/segment_retention.h"
+
+#include "glog/logging.h"
+
+namespace webmlive {
+
+SegmentRetention::SegmentRetention()
+    : window_(0),
+      segments_retained_(0),
+      bytes_retained_(0),
+      segments_expired_(0) {
+}
+
+SegmentRetention::~SegmentRetention() {
+}
+
+int SegmentRetention::Init(int64 window) {
+  if (window < 0) {
+    LOG(ERROR) << "invalid retention window: " << window;
+    return kInvalidArg;
+  }
+  window_ = window;
+  return kSuccess;
+}
+
+void SegmentRetention::AddSegment(AdaptationSet::MediaType media_type,
+                                  int rendition, const std::string& path,
+                                  int64 timestamp, int64 duration,
+                                  int64 length) {
+  if (!enabled()) {
+    return;
+  }
+  Segment segment;
+  segment.path = path;
+  segment.end_time = timestamp + duration;
+  segment.length = length;
+  segments_[RepresentationKey(media_type, rendition)].push_back(segment);
+  ++segments_retained_;
+  bytes_retained_ += length;
+}
+
+void SegmentRetention::TakeExpiredSegments(
+    std::vector<std::string>* ptr_paths) {
+  if (!ptr_paths) {
+    return;
+  }
+  std::map<RepresentationKey, SegmentList>::iterator it = segments_.begin();
+  for (; it != segments_.end(); ++it) {
+    SegmentList& segments = it->second;
+    if (segments.empty()) {
+      continue;
+    }
+    const int64 window_start = segments.back().end_time - window_;
+    while (!segments.empty() && segments.front().end_time <= window_start) {
+      ptr_paths->push_back(segments.front().path);
+      bytes_retained_ -= segments.front().length;
+      --segments_retained_;
+      ++segments_expired_;
+      segments.pop_front();
+    }
+  }
+}
+
+}  // namespace webmlive
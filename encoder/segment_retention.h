@@ -0,0 +1,88 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_SEGMENT_RETENTION_H_
+#define WEBMLIVE_ENCODER_SEGMENT_RETENTION_H_
+
+#include <deque>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "encoder/basictypes.h"
+#include "encoder/dash_writer.h"
+
+namespace webmlive {
+
+// In-memory index of the DASH media segment files on disk, kept per
+// Representation of each |AdaptationSet|. Segments that end more than
+// |window| milliseconds before the end of the newest segment of their
+// Representation expire, and |TakeExpiredSegments()| hands their paths to the
+// caller for deletion. Disk use is bounded by the window times the bitrate of
+// all Representations.
+//
+// Notes:
+// - Not thread safe.
+// - Initialization segments are not indexed, and never expire.
+class SegmentRetention {
+ public:
+  enum {
+    kInvalidArg = -1,
+    kSuccess = 0,
+  };
+
+  SegmentRetention();
+  ~SegmentRetention();
+
+  // Sets the retention window in milliseconds. A |window| of 0 keeps every
+  // segment. Returns |kSuccess| upon success.
+  int Init(int64 window);
+
+  // Records the segment file at |path| of the Representation selected by
+  // |media_type| and |rendition|, as in |DashWriter::IdForChunk()|.
+  // |timestamp| and |duration| are in milliseconds, and |length| in bytes.
+  // Does nothing when the window is 0.
+  void AddSegment(AdaptationSet::MediaType media_type, int rendition,
+                  const std::string& path, int64 timestamp, int64 duration,
+                  int64 length);
+
+  // Removes expired segments from the index and appends their paths to
+  // |ptr_paths|, oldest first within each Representation.
+  void TakeExpiredSegments(std::vector<std::string>* ptr_paths);
+
+  bool enabled() const { return window_ > 0; }
+
+  // Number and total size of the segments in the index.
+  int64 segments_retained() const { return segments_retained_; }
+  int64 bytes_retained() const { return bytes_retained_; }
+
+  // Number of segments returned by |TakeExpiredSegments()|.
+  int64 segments_expired() const { return segments_expired_; }
+
+ private:
+  struct Segment {
+    std::string path;
+    int64 end_time;
+    int64 length;
+  };
+
+  // Segments of one Representation, oldest first.
+  typedef std::deque<Segment> SegmentList;
+  typedef std::pair<int, int> RepresentationKey;
+
+  int64 window_;
+  std::map<RepresentationKey, SegmentList> segments_;
+  int64 segments_retained_;
+  int64 bytes_retained_;
+  int64 segments_expired_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(SegmentRetention);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_SEGMENT_RETENTION_H_
@@ -0,0 +1,387 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/segment_ring_writer.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+#include <atomic>
+#include <climits>
+#include <cstring>
+
+#include "glog/logging.h"
+
+namespace webmlive {
+
+namespace {
+
+// Alignment of the data area, and of the index.
+const uint64 kRingPageSize = 4096;
+
+uint64 RoundUpToPage(uint64 size) {
+  return (size + kRingPageSize - 1) / kRingPageSize * kRingPageSize;
+}
+
+}  // namespace
+
+SegmentRingWriter::SegmentRingWriter()
+    : ptr_map_(NULL),
+      map_size_(0),
+#ifdef _WIN32
+      file_(INVALID_HANDLE_VALUE),
+      mapping_(NULL),
+      ready_event_(NULL),
+#else
+      fd_(-1),
+#endif
+      ptr_header_(NULL),
+      ptr_index_(NULL),
+      write_offset_(0),
+      next_segment_id_(1) {
+}
+
+SegmentRingWriter::~SegmentRingWriter() {
+  Close();
+}
+
+int SegmentRingWriter::Init(const SegmentRingSettings& settings) {
+  if ((settings.path.empty() && settings.shm_name.empty()) ||
+      settings.size <= 0 || settings.index_slots <= 0) {
+    LOG(ERROR) << "invalid segment ring settings.";
+    return kInvalidArg;
+  }
+  if (ptr_map_) {
+    LOG(ERROR) << "segment ring already initialized.";
+    return kInvalidArg;
+  }
+  const uint64 index_offset = RoundUpToPage(sizeof(SegmentRingHeader));
+  const uint64 data_offset = index_offset + RoundUpToPage(
+      static_cast<uint64>(settings.index_slots) * sizeof(SegmentRingEntry));
+  const uint64 data_size =
+      RoundUpToPage(static_cast<uint64>(settings.size) * 1024 * 1024);
+  const uint64 map_size = data_offset + data_size;
+  const bool use_shm = !settings.shm_name.empty();
+  const std::string& ring_name = use_shm ? settings.shm_name : settings.path;
+
+#ifdef _WIN32
+  // A shared memory ring is a mapping backed by the paging file.
+  if (!use_shm) {
+    file_ = CreateFileA(settings.path.c_str(), GENERIC_READ | GENERIC_WRITE,
+                        FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                        CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file_ == INVALID_HANDLE_VALUE) {
+      LOG(ERROR) << "Unable to create segment ring: " << settings.path
+                 << " error " << GetLastError();
+      return kMapFailed;
+    }
+  }
+  mapping_ = CreateFileMappingA(file_, NULL, PAGE_READWRITE,
+                                static_cast<DWORD>(map_size >> 32),
+                                static_cast<DWORD>(map_size),
+                                use_shm ? settings.shm_name.c_str() : NULL);
+  if (mapping_) {
+    ptr_map_ = reinterpret_cast<uint8*>(
+        MapViewOfFile(mapping_, FILE_MAP_WRITE, 0, 0,
+                      static_cast<SIZE_T>(map_size)));
+  }
+  if (!ptr_map_) {
+    LOG(ERROR) << "Unable to map segment ring: " << ring_name
+               << " error " << GetLastError();
+    Close();
+    return kMapFailed;
+  }
+  if (use_shm) {
+    const std::string event_name = settings.shm_name + "_ready";
+    ready_event_ = CreateEventA(NULL, TRUE, FALSE, event_name.c_str());
+    if (!ready_event_) {
+      LOG(ERROR) << "Unable to create segment ring event: " << event_name
+                 << " error " << GetLastError();
+      Close();
+      return kMapFailed;
+    }
+  }
+#else
+  if (use_shm) {
+    // POSIX shared memory object names begin with a slash.
+    shm_path_ = settings.shm_name[0] == '/' ?
+        settings.shm_name : "/" + settings.shm_name;
+    fd_ = shm_open(shm_path_.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  } else {
+    fd_ = open(settings.path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  }
+  if (fd_ < 0) {
+    LOG(ERROR) << "Unable to create segment ring: " << ring_name;
+    shm_path_.clear();
+    return kMapFailed;
+  }
+  void* ptr_map = MAP_FAILED;
+  if (ftruncate(fd_, static_cast<off_t>(map_size)) == 0) {
+    ptr_map = mmap(NULL, static_cast<size_t>(map_size),
+                   PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  }
+  if (ptr_map == MAP_FAILED) {
+    LOG(ERROR) << "Unable to map segment ring: " << ring_name;
+    Close();
+    return kMapFailed;
+  }
+  ptr_map_ = reinterpret_cast<uint8*>(ptr_map);
+#endif
+  map_size_ = map_size;
+  settings_ = settings;
+
+  // The new file reads as zeros: every entry is empty. Write the header last,
+  // so that a reader that finds the magic sees the complete layout.
+  ptr_header_ = reinterpret_cast<SegmentRingHeader*>(ptr_map_);
+  ptr_index_ = reinterpret_cast<SegmentRingEntry*>(ptr_map_ + index_offset);
+  memset(ptr_map_, 0, static_cast<size_t>(data_offset));
+  SegmentRingHeader header = {};
+  header.version = kSegmentRingVersion;
+  header.index_offset = static_cast<uint32>(index_offset);
+  header.index_slots = static_cast<uint32>(settings.index_slots);
+  header.entry_size = sizeof(SegmentRingEntry);
+  header.data_offset = data_offset;
+  header.data_size = data_size;
+  *ptr_header_ = header;
+  std::atomic_thread_fence(std::memory_order_release);
+  ptr_header_->magic = kSegmentRingMagic;
+  LOG(INFO) << "segment ring " << ring_name << ": " << data_size
+            << " data bytes, " << settings.index_slots << " index slots.";
+  return kSuccess;
+}
+
+int SegmentRingWriter::WriteChunk(const SharedWebmChunk& chunk,
+                                  bool init_segment) {
+  if (!chunk || !chunk->data()) {
+    return kInvalidArg;
+  }
+  const uint32 flags =
+      (init_segment ? SegmentRingEntry::kInitSegment : 0) |
+      (chunk->keyframe() ? SegmentRingEntry::kKeyframe : 0);
+  std::lock_guard<std::mutex> lock(mutex_);
+  return WriteSegment(chunk->data(), static_cast<uint32>(chunk->length()),
+                      chunk->id(), flags, &chunk->descriptor(),
+                      chunk->duration());
+}
+
+bool SegmentRingWriter::WriteData(const uint8* ptr_data, int32 data_length,
+                                  const std::string& id) {
+  if (!ptr_data || data_length <= 0) {
+    return false;
+  }
+  const uint32 flags = IsInitId(id) ? SegmentRingEntry::kInitSegment : 0;
+  std::lock_guard<std::mutex> lock(mutex_);
+  return WriteSegment(ptr_data, static_cast<uint32>(data_length), id, flags,
+                      NULL, 0) != kInvalidArg;
+}
+
+bool SegmentRingWriter::WriteChunk(const SharedWebmChunk& chunk) {
+  return chunk && WriteChunk(chunk, IsInitId(chunk->id())) != kInvalidArg;
+}
+
+bool SegmentRingWriter::IsInitId(const std::string& id) {
+  const size_t length = id.length();
+  return id == "header" ||
+      (length > 4 && id.compare(length - 4, 4, ".hdr") == 0);
+}
+
+int SegmentRingWriter::WriteSegment(const uint8* ptr_data, uint32 length,
+                                    const std::string& name, uint32 flags,
+                                    const WebmChunkDescriptor* ptr_descriptor,
+                                    int64 duration) {
+  if (!ptr_map_) {
+    return kInvalidArg;
+  }
+  const uint64 data_size = ptr_header_->data_size;
+  if (length > data_size ||
+      name.length() >= SegmentRingEntry::kMaxNameLength) {
+    LOG(WARNING) << "segment " << name << " does not fit the ring.";
+    ++stats_.segments_dropped;
+    return kSegmentDropped;
+  }
+
+  // Segments are never split at the end of the data area: a segment that
+  // does not fit before the end starts again at its beginning.
+  uint64 offset = write_offset_;
+  const bool wrapped = offset + length > data_size;
+  if (wrapped) {
+    offset = 0;
+  }
+  if (settings_.overrun == SegmentRingSettings::kOverrunSkip &&
+      EvictsUnread(offset, length, wrapped)) {
+    VLOG(1) << "segment " << name << " skipped, the ring reader is behind.";
+    ++stats_.segments_skipped;
+    return kSegmentDropped;
+  }
+  EvictSegments(offset, length, wrapped);
+
+  // The entry is odd while the segment data and the entry change.
+  const uint64 segment_id = next_segment_id_++;
+  SegmentRingEntry* const ptr_entry = Entry(segment_id);
+  ++ptr_entry->sequence;
+  std::atomic_thread_fence(std::memory_order_release);
+  memcpy(ptr_map_ + ptr_header_->data_offset + offset, ptr_data, length);
+  ptr_entry->flags = flags;
+  ptr_entry->segment_id = segment_id;
+  ptr_entry->offset = ptr_header_->data_offset + offset;
+  ptr_entry->length = length;
+  ptr_entry->first_timecode =
+      ptr_descriptor ? ptr_descriptor->first_timestamp : 0;
+  ptr_entry->last_timecode =
+      ptr_descriptor ? ptr_descriptor->last_timestamp : 0;
+  ptr_entry->duration = duration;
+  memset(ptr_entry->name, 0, sizeof(ptr_entry->name));
+  memcpy(ptr_entry->name, name.data(), name.length());
+  std::atomic_thread_fence(std::memory_order_release);
+  ++ptr_entry->sequence;
+  std::atomic_thread_fence(std::memory_order_release);
+  ptr_header_->last_segment_id = segment_id;
+  NotifyReaders();
+
+  const Placement placement = {segment_id, offset, length};
+  placements_.push_back(placement);
+  write_offset_ = offset + length;
+  ++stats_.segments_written;
+  stats_.bytes_written += length;
+  stats_.last_segment_id = static_cast<int64>(segment_id);
+  return kSuccess;
+}
+
+int SegmentRingWriter::GetStats(SegmentRingStats* ptr_stats) const {
+  if (!ptr_stats) {
+    return kInvalidArg;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  *ptr_stats = stats_;
+  return kSuccess;
+}
+
+SegmentRingEntry* SegmentRingWriter::Entry(uint64 segment_id) const {
+  return ptr_index_ + (segment_id - 1) % ptr_header_->index_slots;
+}
+
+bool SegmentRingWriter::MustEvict(const Placement& oldest, uint64 offset,
+                                  uint32 length, bool wrapped) const {
+  const bool slot_reused =
+      next_segment_id_ - oldest.segment_id >= ptr_header_->index_slots;
+  const bool in_tail = wrapped && oldest.offset >= write_offset_;
+  const bool overlaps =
+      oldest.offset < offset + length && offset < oldest.offset + oldest.length;
+  return slot_reused || in_tail || overlaps;
+}
+
+// Segments are placed in id order, each after the last, so the segments a
+// write overwrites are always the oldest ones, and the newest of them is the
+// last one to evict.
+bool SegmentRingWriter::EvictsUnread(uint64 offset, uint32 length,
+                                     bool wrapped) const {
+  const uint64 reader_segment_id = ReaderSegmentId();
+  if (reader_segment_id == 0) {
+    return false;
+  }
+  for (size_t i = 0; i < placements_.size(); ++i) {
+    if (!MustEvict(placements_[i], offset, length, wrapped)) {
+      break;
+    }
+    if (placements_[i].segment_id > reader_segment_id) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void SegmentRingWriter::EvictSegments(uint64 offset, uint32 length,
+                                      bool wrapped) {
+  const uint64 reader_segment_id = ReaderSegmentId();
+  while (!placements_.empty()) {
+    const Placement& oldest = placements_.front();
+    if (!MustEvict(oldest, offset, length, wrapped)) {
+      break;
+    }
+    if (reader_segment_id != 0 && oldest.segment_id > reader_segment_id) {
+      ++stats_.segments_overrun;
+    }
+    SegmentRingEntry* const ptr_entry = Entry(oldest.segment_id);
+    ++ptr_entry->sequence;
+    std::atomic_thread_fence(std::memory_order_release);
+    ptr_entry->segment_id = 0;
+    std::atomic_thread_fence(std::memory_order_release);
+    ++ptr_entry->sequence;
+    ++stats_.segments_evicted;
+    placements_.pop_front();
+  }
+}
+
+uint64 SegmentRingWriter::ReaderSegmentId() const {
+  // Written by the reader process.
+  const uint64 reader_segment_id =
+      *static_cast<volatile uint64*>(&ptr_header_->reader_segment_id);
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return reader_segment_id;
+}
+
+void SegmentRingWriter::NotifyReaders() {
+  ++ptr_header_->notify_sequence;
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+#ifdef _WIN32
+  if (ready_event_) {
+    SetEvent(ready_event_);
+  }
+#elif defined(__linux__)
+  // Readers in other processes wait on the word, so the wake is not private.
+  syscall(SYS_futex, &ptr_header_->notify_sequence, FUTEX_WAKE, INT_MAX,
+          NULL, NULL, 0);
+#endif
+}
+
+void SegmentRingWriter::Close() {
+#ifdef _WIN32
+  if (ptr_map_) {
+    UnmapViewOfFile(ptr_map_);
+  }
+  if (ready_event_) {
+    CloseHandle(ready_event_);
+    ready_event_ = NULL;
+  }
+  if (mapping_) {
+    CloseHandle(mapping_);
+    mapping_ = NULL;
+  }
+  if (file_ != INVALID_HANDLE_VALUE) {
+    CloseHandle(file_);
+    file_ = INVALID_HANDLE_VALUE;
+  }
+#else
+  if (ptr_map_) {
+    munmap(ptr_map_, static_cast<size_t>(map_size_));
+  }
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+  // Readers that have the object mapped keep it until they unmap it.
+  if (!shm_path_.empty()) {
+    shm_unlink(shm_path_.c_str());
+    shm_path_.clear();
+  }
+#endif
+  ptr_map_ = NULL;
+  ptr_header_ = NULL;
+  ptr_index_ = NULL;
+  map_size_ = 0;
+}
+
+}  // namespace webmlive
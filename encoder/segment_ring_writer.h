@@ -0,0 +1,309 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_SEGMENT_RING_WRITER_H_
+#define WEBMLIVE_ENCODER_SEGMENT_RING_WRITER_H_
+
+#include <deque>
+#include <mutex>
+#include <string>
+
+#include "encoder/basictypes.h"
+#include "encoder/data_sink.h"
+#include "encoder/encoder_base.h"
+#include "encoder/webm_chunk.h"
+
+namespace webmlive {
+
+struct SegmentRingSettings {
+  // Default size of the ring data area, in megabytes.
+  static const int kDefaultSize = 64;
+
+  // Default number of index entries.
+  static const int kDefaultIndexSlots = 256;
+
+  // What a segment that would evict segments the reader has not consumed
+  // does. Neither policy waits for the reader.
+  enum OverrunPolicy {
+    // Evict the unread segments, counted in
+    // |SegmentRingStats::segments_overrun|.
+    kOverrunEvict = 0,
+
+    // Skip the new segment, counted in |SegmentRingStats::segments_skipped|.
+    kOverrunSkip = 1,
+  };
+
+  SegmentRingSettings()
+      : size(kDefaultSize), index_slots(kDefaultIndexSlots),
+        overrun(kOverrunEvict) {}
+
+  // Ring file path.
+  std::string path;
+
+  // Name of a shared memory object that holds the ring instead of a file:
+  // a named file mapping on Windows, and a POSIX shared memory object
+  // elsewhere. The ring is disabled when both |path| and |shm_name| are
+  // empty.
+  std::string shm_name;
+
+  // Size of the data area, in megabytes.
+  int size;
+
+  // Number of index entries: the most segments the ring holds at once.
+  int index_slots;
+
+  // Applies while a reader reports its position in
+  // |SegmentRingHeader::reader_segment_id|.
+  OverrunPolicy overrun;
+};
+
+struct SegmentRingStats {
+  SegmentRingStats()
+      : segments_written(0), bytes_written(0), segments_evicted(0),
+        segments_dropped(0), segments_overrun(0), segments_skipped(0),
+        last_segment_id(0) {}
+
+  // Segments written to the ring, and their total length.
+  int64 segments_written;
+  int64 bytes_written;
+
+  // Segments removed from the index to make room for newer ones.
+  int64 segments_evicted;
+
+  // Segments not written because they were larger than the data area or
+  // their names were too long.
+  int64 segments_dropped;
+
+  // Segments evicted before the reader consumed them, and segments not
+  // written because they would have evicted unread segments.
+  int64 segments_overrun;
+  int64 segments_skipped;
+
+  // Id of the newest segment.
+  int64 last_segment_id;
+};
+
+// Ring file layout. All fields are little endian, and the file is laid out
+// as a |SegmentRingHeader|, |SegmentRingHeader::index_slots| entries starting
+// at |SegmentRingHeader::index_offset|, then the data area of
+// |SegmentRingHeader::data_size| bytes at |SegmentRingHeader::data_offset|.
+struct SegmentRingHeader {
+  // |kSegmentRingMagic| and |kSegmentRingVersion|.
+  uint32 magic;
+  uint32 version;
+
+  // Position and count of the index entries, and the size of each.
+  uint32 index_offset;
+  uint32 index_slots;
+  uint32 entry_size;
+  uint32 reserved;
+
+  // Position and size of the data area, in bytes from the start of the file.
+  uint64 data_offset;
+  uint64 data_size;
+
+  // Id of the newest complete segment, or 0 before the first is written.
+  // Updated after the segment's entry.
+  uint64 last_segment_id;
+
+  // Incremented after |last_segment_id| changes. On Linux, readers wait for
+  // a change with FUTEX_WAIT on this word; on Windows, the writer of a
+  // shared memory ring also sets the manual-reset event named
+  // "<shm_name>_ready", which readers reset before they check
+  // |last_segment_id|.
+  uint32 notify_sequence;
+  uint32 reserved2;
+
+  // Id of the newest segment the reader has consumed, written by the
+  // reader, or 0 when it does not report its position.
+  uint64 reader_segment_id;
+};
+
+// Index entry of a segment. Segment ids start at 1 and increase by 1 for
+// each segment; segment |id| is described by entry (id - 1) % index_slots.
+struct SegmentRingEntry {
+  enum {
+    // Maximum length of |name|, including its terminating NUL.
+    kMaxNameLength = 64,
+  };
+
+  // |flags| bits.
+  enum {
+    // The segment is an initialization segment.
+    kInitSegment = 1,
+
+    // The segment begins with a keyframe.
+    kKeyframe = 2,
+  };
+
+  // Even while the entry and its data are stable. The writer makes it odd
+  // before it changes either, and even again when done.
+  uint32 sequence;
+  uint32 flags;
+
+  // Segment id, or 0 when the entry is empty.
+  uint64 segment_id;
+
+  // Position of the segment data, in bytes from the start of the file, and
+  // its length. Segment data is never split at the end of the data area.
+  uint64 offset;
+  uint32 length;
+  uint32 reserved;
+
+  // Times of the first and last frames, and the segment duration, in
+  // milliseconds.
+  int64 first_timecode;
+  int64 last_timecode;
+  int64 duration;
+
+  // Segment file name, as it would be written to the DASH directory.
+  char name[kMaxNameLength];
+};
+
+// 'WMSR'.
+const uint32 kSegmentRingMagic = 0x52534D57;
+const uint32 kSegmentRingVersion = 2;
+
+// Writes DASH segments into a fixed-size, memory-mapped ring file or shared
+// memory object, so that packagers and origin processes on the same host can
+// consume segments by mapping one object instead of opening a file per
+// segment, and read segment data in place. The ring keeps the newest
+// segments that fit in its data area and index; older segments are evicted
+// as new ones are written. The writer never waits for a reader: a reader
+// that falls behind loses segments, as |SegmentRingSettings::overrun| says.
+//
+// Readers follow a sequence lock protocol per entry:
+// - Read |SegmentRingHeader::last_segment_id| to learn the newest segment.
+// - For segment |id|, read the entry's |sequence|; retry later when odd.
+// - Check |segment_id| == |id|, then copy out the entry and segment data.
+// - Read |sequence| again: when it changed the segment was overwritten while
+//   it was copied, and the copy must be discarded.
+//
+// Notes:
+// - |Init()| must be called before |WriteChunk()|.
+// - |WriteChunk()| is thread safe.
+// - As a |DataSinkInterface|, the ring takes the chunks of the muxed stream;
+//   chunks named "header", or ending in ".hdr", are initialization segments.
+class SegmentRingWriter : public DataSinkInterface {
+ public:
+  enum {
+    // Segment not written, see |SegmentRingStats::segments_dropped| and
+    // |SegmentRingStats::segments_skipped|.
+    kSegmentDropped = -703,
+
+    // Invalid argument supplied to method call.
+    kInvalidArg = -702,
+
+    // The ring file or shared memory object cannot be created or mapped.
+    kMapFailed = -701,
+
+    // Success.
+    kSuccess = 0,
+  };
+
+  SegmentRingWriter();
+  virtual ~SegmentRingWriter();
+
+  // Creates the shared memory object named |settings.shm_name| when set, or
+  // else the ring file at |settings.path|, replacing any object there, and
+  // maps it. Returns |kSuccess| when successful.
+  int Init(const SegmentRingSettings& settings);
+
+  // Copies |chunk| into the ring as the next segment, evicting the oldest
+  // segments it overwrites. |init_segment| marks DASH initialization
+  // segments. Returns |kSuccess| when successful, and |kSegmentDropped| when
+  // |chunk| does not fit in the ring, its id is too long, or the overrun
+  // policy skips it.
+  int WriteChunk(const SharedWebmChunk& chunk, bool init_segment);
+
+  // Locks |mutex_| and copies current stats to |ptr_stats|.
+  int GetStats(SegmentRingStats* ptr_stats) const;
+
+  // DataSinkInterface methods. The ring is always ready, and segments it
+  // drops or skips are counted in its stats, not reported as failures.
+  virtual bool Ready() const { return true; }
+  virtual bool WriteData(const uint8* ptr_data, int32 data_length,
+                         const std::string& id);
+  virtual bool WriteChunk(const SharedWebmChunk& chunk);
+
+ private:
+  // Data area placement of a segment held in the ring.
+  struct Placement {
+    uint64 segment_id;
+    uint64 offset;
+    uint32 length;
+  };
+
+  // Returns true when |id| names an initialization segment of the muxed
+  // stream.
+  static bool IsInitId(const std::string& id);
+
+  // Copies the |length| bytes at |ptr_data| into the ring as segment |name|,
+  // with the timecodes of |ptr_descriptor| when not NULL. Must be called
+  // with |mutex_| held.
+  int WriteSegment(const uint8* ptr_data, uint32 length,
+                   const std::string& name, uint32 flags,
+                   const WebmChunkDescriptor* ptr_descriptor, int64 duration);
+
+  // Returns the index entry for |segment_id|.
+  SegmentRingEntry* Entry(uint64 segment_id) const;
+
+  // Returns true when the oldest segment of the ring, |oldest|, must be
+  // evicted before the |length| bytes at |offset| of the data area are
+  // written: it overlaps them, the next segment reuses its entry, or
+  // |wrapped| is set and it lies between |write_offset_| and the end of the
+  // data area.
+  bool MustEvict(const Placement& oldest, uint64 offset, uint32 length,
+                 bool wrapped) const;
+
+  // Returns true when writing the |length| bytes at |offset| would evict a
+  // segment the reader has not consumed.
+  bool EvictsUnread(uint64 offset, uint32 length, bool wrapped) const;
+
+  // Evicts segments from the front of |placements_| until |MustEvict()| is
+  // false.
+  void EvictSegments(uint64 offset, uint32 length, bool wrapped);
+
+  // Returns the newest segment id reported by the reader, 0 when none.
+  uint64 ReaderSegmentId() const;
+
+  // Wakes readers waiting for the next segment.
+  void NotifyReaders();
+
+  // Unmaps and closes the ring file or shared memory object.
+  void Close();
+
+  SegmentRingSettings settings_;
+  uint8* ptr_map_;
+  uint64 map_size_;
+#ifdef _WIN32
+  void* file_;
+  void* mapping_;
+  void* ready_event_;
+#else
+  int fd_;
+  std::string shm_path_;
+#endif
+  SegmentRingHeader* ptr_header_;
+  SegmentRingEntry* ptr_index_;
+
+  // Data area offset at which the next segment is written, and the id it
+  // gets.
+  uint64 write_offset_;
+  uint64 next_segment_id_;
+
+  // Segments in the ring, oldest first.
+  std::deque<Placement> placements_;
+
+  SegmentRingStats stats_;
+  mutable std::mutex mutex_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(SegmentRingWriter);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_SEGMENT_RING_WRITER_H_
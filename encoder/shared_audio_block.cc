@@ -0,0 +1,195 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/shared_audio_block.h"
+
+#include <algorithm>
+#include <new>
+
+#include "glog/logging.h"
+
+namespace webmlive {
+
+///////////////////////////////////////////////////////////////////////////////
+// PlanarAudioBlock
+//
+
+PlanarAudioBlock::PlanarAudioBlock()
+    : capacity_(0),
+      channels_(0),
+      num_frames_(0),
+      timestamp_(0),
+      silent_(false) {
+  std::fill(planes_, planes_ + AudioConverter::kMaxChannels,
+            static_cast<float*>(NULL));
+}
+
+int PlanarAudioBlock::Resize(int channels, int num_frames) {
+  if (channels <= 0 || channels > AudioConverter::kMaxChannels ||
+      num_frames <= 0) {
+    return kInvalidArg;
+  }
+  const int32 required = channels * num_frames;
+  if (required > capacity_) {
+    samples_.reset(new (std::nothrow) float[required]);  // NOLINT
+    if (!samples_) {
+      capacity_ = 0;
+      channels_ = 0;
+      num_frames_ = 0;
+      return kNoMemory;
+    }
+    capacity_ = required;
+  }
+  for (int c = 0; c < AudioConverter::kMaxChannels; ++c) {
+    planes_[c] = c < channels ? samples_.get() + c * num_frames : NULL;
+  }
+  channels_ = channels;
+  num_frames_ = num_frames;
+  return kSuccess;
+}
+
+// |planes_| points into |samples_|, so the plane pointers move with it.
+void PlanarAudioBlock::Swap(PlanarAudioBlock* ptr_other) {
+  if (!ptr_other) {
+    return;
+  }
+  samples_.swap(ptr_other->samples_);
+  std::swap(capacity_, ptr_other->capacity_);
+  std::swap_ranges(planes_, planes_ + AudioConverter::kMaxChannels,
+                   ptr_other->planes_);
+  std::swap(channels_, ptr_other->channels_);
+  std::swap(num_frames_, ptr_other->num_frames_);
+  std::swap(timestamp_, ptr_other->timestamp_);
+  std::swap(silent_, ptr_other->silent_);
+}
+
+PlanarPcm PlanarAudioBlock::pcm() const {
+  PlanarPcm pcm;
+  pcm.ptr_planes = planes_;
+  pcm.channels = channels_;
+  pcm.num_frames = num_frames_;
+  pcm.timestamp = timestamp_;
+  return pcm;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SharedAudioBlock
+//
+
+SharedAudioBlock::SharedAudioBlock(SharedAudioBlockSlot* ptr_slot)
+    : ptr_slot_(ptr_slot) {
+  ptr_slot_->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+SharedAudioBlock::SharedAudioBlock(const SharedAudioBlock& other)
+    : ptr_slot_(other.ptr_slot_) {
+  if (ptr_slot_) {
+    ptr_slot_->refs.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+SharedAudioBlock& SharedAudioBlock::operator=(const SharedAudioBlock& other) {
+  if (other.ptr_slot_ != ptr_slot_) {
+    SharedAudioBlock copy(other);
+    Swap(&copy);
+  }
+  return *this;
+}
+
+SharedAudioBlock::~SharedAudioBlock() {
+  Reset();
+}
+
+// Same ordering as |SharedVideoFrame::Reset()|: the last release sees every
+// consumer's reads of the block.
+void SharedAudioBlock::Reset() {
+  if (!ptr_slot_) {
+    return;
+  }
+  SharedAudioBlockSlot* const ptr_slot = ptr_slot_;
+  ptr_slot_ = NULL;
+  if (ptr_slot->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    ptr_slot->ptr_pool->Release(ptr_slot);
+  }
+}
+
+void SharedAudioBlock::Swap(SharedAudioBlock* ptr_other) {
+  if (ptr_other) {
+    SharedAudioBlockSlot* const ptr_slot = ptr_slot_;
+    ptr_slot_ = ptr_other->ptr_slot_;
+    ptr_other->ptr_slot_ = ptr_slot;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SharedAudioBlockPool
+//
+
+SharedAudioBlockPool::SharedAudioBlockPool() : num_slots_(0) {
+}
+
+SharedAudioBlockPool::~SharedAudioBlockPool() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (static_cast<int>(free_slots_.size()) != num_slots_) {
+    LOG(ERROR) << "SharedAudioBlockPool destroyed with "
+               << num_slots_ - free_slots_.size() << " blocks referenced.";
+  }
+}
+
+int SharedAudioBlockPool::Init(int num_blocks) {
+  if (num_blocks <= 0) {
+    return kInvalidArg;
+  }
+  if (slots_) {
+    return kAlreadyInitialized;
+  }
+  slots_.reset(
+      new (std::nothrow) SharedAudioBlockSlot[num_blocks]);  // NOLINT
+  if (!slots_) {
+    return kNoMemory;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  free_slots_.reserve(num_blocks);
+  for (int i = 0; i < num_blocks; ++i) {
+    slots_[i].ptr_pool = this;
+    free_slots_.push_back(&slots_[i]);
+  }
+  num_slots_ = num_blocks;
+  return kSuccess;
+}
+
+int SharedAudioBlockPool::Wrap(PlanarAudioBlock* ptr_block,
+                               SharedAudioBlock* ptr_handle) {
+  if (!ptr_block || ptr_block->num_frames() <= 0 || !ptr_handle) {
+    return kInvalidArg;
+  }
+  SharedAudioBlockSlot* ptr_slot = NULL;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (free_slots_.empty()) {
+      return kFull;
+    }
+    ptr_slot = free_slots_.back();
+    free_slots_.pop_back();
+  }
+  ptr_slot->block.Swap(ptr_block);
+  SharedAudioBlock handle(ptr_slot);
+  ptr_handle->Swap(&handle);
+  return kSuccess;
+}
+
+int SharedAudioBlockPool::FreeCount() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return static_cast<int>(free_slots_.size());
+}
+
+void SharedAudioBlockPool::Release(SharedAudioBlockSlot* ptr_slot) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  free_slots_.push_back(ptr_slot);
+}
+
+}  // namespace webmlive
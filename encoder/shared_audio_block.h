@@ -0,0 +1,186 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_SHARED_AUDIO_BLOCK_H_
+#define WEBMLIVE_ENCODER_SHARED_AUDIO_BLOCK_H_
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "encoder/audio_converter.h"
+#include "encoder/audio_encoder.h"
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+
+namespace webmlive {
+
+// Deinterleaved float samples: one plane per channel, stored back to back in
+// one allocation.
+class PlanarAudioBlock {
+ public:
+  enum {
+    kNoMemory = -2,
+    kInvalidArg = -1,
+    kSuccess = 0,
+  };
+
+  PlanarAudioBlock();
+  ~PlanarAudioBlock() {}
+
+  // Sets the block to |channels| planes of |num_frames| samples. Storage is
+  // reallocated only when it is too small. Sample values are undefined
+  // afterwards. Returns |kInvalidArg| when |channels| is not within 1 and
+  // |AudioConverter::kMaxChannels| or |num_frames| is not positive.
+  int Resize(int channels, int num_frames);
+
+  // Exchanges the storage and properties of the blocks.
+  void Swap(PlanarAudioBlock* ptr_other);
+
+  // Returns the planes as the input of |AudioEncoder::EncodePlanar()|.
+  PlanarPcm pcm() const;
+
+  // Accessors.
+  float* const* planes() const { return planes_; }
+  int channels() const { return channels_; }
+  int num_frames() const { return num_frames_; }
+  int64 timestamp() const { return timestamp_; }
+  void set_timestamp(int64 timestamp) { timestamp_ = timestamp; }
+
+  // True when the samples are to be encoded as silence. See
+  // |AudioEncoder::SetSilent()|.
+  bool silent() const { return silent_; }
+  void set_silent(bool silent) { silent_ = silent; }
+
+  // Storage size in bytes.
+  int32 buffer_capacity() const {
+    return capacity_ * static_cast<int32>(sizeof(float));  // NOLINT
+  }
+
+ private:
+  std::unique_ptr<float[]> samples_;
+  int32 capacity_;
+  float* planes_[AudioConverter::kMaxChannels];
+  int channels_;
+  int num_frames_;
+  int64 timestamp_;
+  bool silent_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(PlanarAudioBlock);
+};
+
+class SharedAudioBlockPool;
+
+// A |SharedAudioBlockPool| block and its reference count.
+struct SharedAudioBlockSlot {
+  SharedAudioBlockSlot() : refs(0), ptr_pool(NULL) {}
+  PlanarAudioBlock block;
+  std::atomic<int> refs;
+  SharedAudioBlockPool* ptr_pool;
+};
+
+// Counted, read-only reference to a block held by a |SharedAudioBlockPool|,
+// the audio counterpart of |SharedVideoFrame|: copies reference the same
+// block, which returns to its pool when the last reference is released.
+// References may be copied and released on any thread, and queued in
+// |SpscBufferPool|s with the same |Reset()| rules as |SharedVideoFrame|.
+class SharedAudioBlock {
+ public:
+  SharedAudioBlock() : ptr_slot_(NULL) {}
+  SharedAudioBlock(const SharedAudioBlock& other);
+  SharedAudioBlock& operator=(const SharedAudioBlock& other);
+  ~SharedAudioBlock();
+
+  // Releases the reference, leaving the handle empty.
+  void Reset();
+
+  // Exchanges the blocks of the handles. Either handle may be empty.
+  void Swap(SharedAudioBlock* ptr_other);
+
+  bool empty() const { return ptr_slot_ == NULL; }
+
+  // The referenced block. Must not be called on an empty handle.
+  const PlanarAudioBlock& block() const { return ptr_slot_->block; }
+  const PlanarAudioBlock& operator*() const { return block(); }
+  const PlanarAudioBlock* operator->() const { return &block(); }
+
+  // Block accessors for |SpscBufferPool|. An empty handle has no buffer.
+  uint8* buffer() const {
+    return ptr_slot_ ? reinterpret_cast<uint8*>(block().planes()[0]) : NULL;
+  }
+  int32 buffer_capacity() const {
+    return ptr_slot_ ? block().buffer_capacity() : 0;
+  }
+  int64 timestamp() const { return ptr_slot_ ? block().timestamp() : 0; }
+
+ private:
+  friend class SharedAudioBlockPool;
+
+  // Takes a reference to |ptr_slot|.
+  explicit SharedAudioBlock(SharedAudioBlockSlot* ptr_slot);
+
+  SharedAudioBlockSlot* ptr_slot_;
+};
+
+// Fixed set of blocks handed out through |SharedAudioBlock| references. Like
+// |SharedFramePool|, a producer fills a |PlanarAudioBlock| of its own and
+// |Wrap()|s it: the block's storage is swapped into a free slot, and the
+// producer gets back the storage of the slot's previous block, so a steady
+// cycle of blocks allocates nothing.
+//
+// Notes:
+// - |Wrap()| and the release of references are thread safe.
+// - The pool must outlive every reference to its blocks.
+class SharedAudioBlockPool {
+ public:
+  enum {
+    kAlreadyInitialized = -3,
+    kNoMemory = -2,
+    kInvalidArg = -1,
+    kSuccess = 0,
+
+    // Every block is referenced.
+    kFull = 2,
+  };
+
+  SharedAudioBlockPool();
+  ~SharedAudioBlockPool();
+
+  // Allocates |num_blocks| slots and returns |kSuccess|. Returns
+  // |kInvalidArg| when |num_blocks| is not positive, |kNoMemory| when
+  // allocation fails, and |kAlreadyInitialized| when |Init()| has already
+  // been called.
+  int Init(int num_blocks);
+
+  // Swaps the contents of |ptr_block| into a free slot, points |ptr_handle|
+  // at it, and returns |kSuccess|. |ptr_block| receives the storage of the
+  // slot's previous block. Returns |kFull| when every block is referenced,
+  // and |kInvalidArg| when an argument is NULL or |ptr_block| is empty.
+  int Wrap(PlanarAudioBlock* ptr_block, SharedAudioBlock* ptr_handle);
+
+  // Returns the number of blocks with no references.
+  int FreeCount() const;
+
+ private:
+  friend class SharedAudioBlock;
+
+  // Returns |ptr_slot|, whose last reference was released, to |free_slots_|.
+  void Release(SharedAudioBlockSlot* ptr_slot);
+
+  std::unique_ptr<SharedAudioBlockSlot[]> slots_;
+  int num_slots_;
+
+  // Unreferenced slots. Reserved to |num_slots_| by |Init()|, so returning a
+  // slot never allocates. Protected by |mutex_|.
+  std::vector<SharedAudioBlockSlot*> free_slots_;
+  mutable std::mutex mutex_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(SharedAudioBlockPool);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_SHARED_AUDIO_BLOCK_H_
@@ -0,0 +1,141 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/shared_video_frame.h"
+
+#include <new>
+
+#include "encoder/memory_accounting.h"
+#include "glog/logging.h"
+
+namespace webmlive {
+
+///////////////////////////////////////////////////////////////////////////////
+// SharedVideoFrame
+//
+
+SharedVideoFrame::SharedVideoFrame(SharedFrameSlot* ptr_slot)
+    : ptr_slot_(ptr_slot) {
+  ptr_slot_->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+SharedVideoFrame::SharedVideoFrame(const SharedVideoFrame& other)
+    : ptr_slot_(other.ptr_slot_) {
+  if (ptr_slot_) {
+    ptr_slot_->refs.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+SharedVideoFrame& SharedVideoFrame::operator=(const SharedVideoFrame& other) {
+  if (other.ptr_slot_ != ptr_slot_) {
+    SharedVideoFrame copy(other);
+    Swap(&copy);
+  }
+  return *this;
+}
+
+SharedVideoFrame::~SharedVideoFrame() {
+  Reset();
+}
+
+// The release that drops the count to zero synchronizes with the earlier
+// releases, so every consumer's reads of the frame are done before the slot is
+// reused.
+void SharedVideoFrame::Reset() {
+  if (!ptr_slot_) {
+    return;
+  }
+  SharedFrameSlot* const ptr_slot = ptr_slot_;
+  ptr_slot_ = NULL;
+  if (ptr_slot->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    ptr_slot->ptr_pool->Release(ptr_slot);
+  }
+}
+
+void SharedVideoFrame::Swap(SharedVideoFrame* ptr_other) {
+  if (ptr_other) {
+    SharedFrameSlot* const ptr_slot = ptr_slot_;
+    ptr_slot_ = ptr_other->ptr_slot_;
+    ptr_other->ptr_slot_ = ptr_slot;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SharedFramePool
+//
+
+SharedFramePool::SharedFramePool() : num_slots_(0), memory_subsystem_(-1) {
+}
+
+SharedFramePool::~SharedFramePool() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (static_cast<int>(free_slots_.size()) != num_slots_) {
+    LOG(ERROR) << "SharedFramePool destroyed with "
+               << num_slots_ - free_slots_.size() << " frames referenced.";
+  }
+}
+
+int SharedFramePool::Init(int num_frames) {
+  if (num_frames <= 0) {
+    return kInvalidArg;
+  }
+  if (slots_) {
+    return kAlreadyInitialized;
+  }
+  slots_.reset(new (std::nothrow) SharedFrameSlot[num_frames]);  // NOLINT
+  if (!slots_) {
+    return kNoMemory;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  free_slots_.reserve(num_frames);
+  for (int i = 0; i < num_frames; ++i) {
+    slots_[i].ptr_pool = this;
+    free_slots_.push_back(&slots_[i]);
+  }
+  num_slots_ = num_frames;
+  return kSuccess;
+}
+
+int SharedFramePool::Wrap(VideoFrame* ptr_frame,
+                          SharedVideoFrame* ptr_handle) {
+  if (!ptr_frame || !ptr_frame->buffer() || !ptr_handle) {
+    return kInvalidArg;
+  }
+  SharedFrameSlot* ptr_slot = NULL;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (free_slots_.empty()) {
+      return kFull;
+    }
+    ptr_slot = free_slots_.back();
+    free_slots_.pop_back();
+  }
+  ptr_slot->frame.Swap(ptr_frame);
+  if (memory_subsystem_ >= 0) {
+    MemoryAccountant::Instance()->Add(memory_subsystem_,
+                                      ptr_slot->frame.buffer_capacity());
+  }
+  SharedVideoFrame handle(ptr_slot);
+  ptr_handle->Swap(&handle);
+  return kSuccess;
+}
+
+int SharedFramePool::FreeCount() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return static_cast<int>(free_slots_.size());
+}
+
+void SharedFramePool::Release(SharedFrameSlot* ptr_slot) {
+  if (memory_subsystem_ >= 0) {
+    MemoryAccountant::Instance()->Add(memory_subsystem_,
+                                      -ptr_slot->frame.buffer_capacity());
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  free_slots_.push_back(ptr_slot);
+}
+
+}  // namespace webmlive
@@ -0,0 +1,146 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_SHARED_VIDEO_FRAME_H_
+#define WEBMLIVE_ENCODER_SHARED_VIDEO_FRAME_H_
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+#include "encoder/video_encoder.h"
+
+namespace webmlive {
+
+class SharedFramePool;
+
+// A |SharedFramePool| frame and its reference count.
+struct SharedFrameSlot {
+  SharedFrameSlot() : refs(0), ptr_pool(NULL) {}
+  VideoFrame frame;
+  std::atomic<int> refs;
+  SharedFramePool* ptr_pool;
+};
+
+// Counted, read-only reference to a frame held by a |SharedFramePool|. Copies
+// reference the same frame, so a frame reaches any number of consumers
+// without a copy of its data; the frame returns to its pool when the last
+// reference is released. References may be copied and released on any
+// thread.
+//
+// Handles can be queued in |SpscBufferPool|s: |Swap()| and the buffer
+// accessors are those the pool requires. Swapping a handle into a queue
+// leaves the caller with whatever the queue slot held, so consumers should
+// |Reset()| their handle before |Decommit()|, and producers after |Commit()|,
+// to keep idle slots from holding frames.
+class SharedVideoFrame {
+ public:
+  SharedVideoFrame() : ptr_slot_(NULL) {}
+  SharedVideoFrame(const SharedVideoFrame& other);
+  SharedVideoFrame& operator=(const SharedVideoFrame& other);
+  ~SharedVideoFrame();
+
+  // Releases the reference, leaving the handle empty.
+  void Reset();
+
+  // Exchanges the frames of the handles. Either handle may be empty.
+  void Swap(SharedVideoFrame* ptr_other);
+
+  bool empty() const { return ptr_slot_ == NULL; }
+
+  // The referenced frame. Must not be called on an empty handle.
+  const VideoFrame& frame() const { return ptr_slot_->frame; }
+  const VideoFrame& operator*() const { return frame(); }
+  const VideoFrame* operator->() const { return &frame(); }
+
+  // Frame accessors for |SpscBufferPool|. An empty handle has no buffer.
+  uint8* buffer() const { return ptr_slot_ ? frame().buffer() : NULL; }
+  int32 buffer_capacity() const {
+    return ptr_slot_ ? frame().buffer_capacity() : 0;
+  }
+  int64 timestamp() const { return ptr_slot_ ? frame().timestamp() : 0; }
+
+ private:
+  friend class SharedFramePool;
+
+  // Takes a reference to |ptr_slot|.
+  explicit SharedVideoFrame(SharedFrameSlot* ptr_slot);
+
+  SharedFrameSlot* ptr_slot_;
+};
+
+// Fixed set of frames handed out through |SharedVideoFrame| references. A
+// producer fills a |VideoFrame| of its own and |Wrap()|s it: the frame's
+// storage is swapped into a free slot, and the producer gets back the
+// storage of the slot's previous frame, so a steady cycle of frames of one
+// size allocates nothing.
+//
+// Notes:
+// - |Wrap()| and the release of references are thread safe.
+// - The pool must outlive every reference to its frames.
+// - Frames of one size should share a pool: storage is recycled between the
+//   producer's frame and the slots, and a smaller buffer is reallocated when
+//   a larger frame is stored in it.
+class SharedFramePool {
+ public:
+  enum {
+    kAlreadyInitialized = -3,
+    kNoMemory = -2,
+    kInvalidArg = -1,
+    kSuccess = 0,
+
+    // Every frame is referenced.
+    kFull = 2,
+  };
+
+  SharedFramePool();
+  ~SharedFramePool();
+
+  // Allocates |num_frames| slots and returns |kSuccess|. Slots hold only
+  // storage swapped in by |Wrap()|, and never allocate frame storage.
+  // Returns |kInvalidArg| when |num_frames| is not positive, |kNoMemory| when
+  // allocation fails, and |kAlreadyInitialized| when |Init()| has already
+  // been called.
+  int Init(int num_frames);
+
+  // Swaps the contents of |ptr_frame| into a free slot, points |ptr_handle|
+  // at it, and returns |kSuccess|. |ptr_frame| receives the storage of the
+  // slot's previous frame. Returns |kFull| when every frame is referenced,
+  // and |kInvalidArg| when an argument is NULL or |ptr_frame| is empty.
+  int Wrap(VideoFrame* ptr_frame, SharedVideoFrame* ptr_handle);
+
+  // Returns the number of frames with no references.
+  int FreeCount() const;
+
+  // Also accounts the storage of referenced frames to |subsystem| of
+  // |MemoryAccountant|, once per frame however many references it has. Must
+  // be called before frames are wrapped.
+  void set_memory_subsystem(int subsystem) { memory_subsystem_ = subsystem; }
+
+ private:
+  friend class SharedVideoFrame;
+
+  // Returns |ptr_slot|, whose last reference was released, to |free_slots_|.
+  void Release(SharedFrameSlot* ptr_slot);
+
+  std::unique_ptr<SharedFrameSlot[]> slots_;
+  int num_slots_;
+  int memory_subsystem_;
+
+  // Unreferenced slots. Reserved to |num_slots_| by |Init()|, so returning a
+  // slot never allocates. Protected by |mutex_|.
+  std::vector<SharedFrameSlot*> free_slots_;
+  mutable std::mutex mutex_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(SharedFramePool);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_SHARED_VIDEO_FRAME_H_
@@ -0,0 +1,163 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/sink_spill_file.h"
+
+#include <new>
+
+#include "glog/logging.h"
+
+namespace webmlive {
+
+namespace {
+
+// Suffix of the index file name, and the key of its lines. Each line holds
+// the position and length of a chunk in the data file, its duration and
+// descriptor, and its id, last since it ends the line.
+const char kIndexSuffix[] = ".idx";
+const char kChunkKey[] = "chunk";
+
+}  // namespace
+
+SinkSpillFile::SinkSpillFile() : write_offset_(0), next_chunk_credit_(0) {
+}
+
+SinkSpillFile::~SinkSpillFile() {
+}
+
+int SinkSpillFile::Init(const SinkSpillSettings& settings) {
+  if (settings.path.empty() || settings.catchup_kbps < 0) {
+    LOG(ERROR) << "empty spill file name, or negative catch-up rate.";
+    return kInvalidArg;
+  }
+  settings_ = settings;
+  pacer_.SetRate(settings_.catchup_kbps, UploadPacer::kDefaultBurstMs);
+  return Truncate();
+}
+
+int SinkSpillFile::Append(const SharedWebmChunk& chunk) {
+  IndexEntry entry;
+  entry.file_offset = write_offset_;
+  entry.length = chunk->length();
+  entry.id = chunk->id();
+  entry.descriptor = chunk->descriptor();
+  entry.duration = chunk->duration();
+
+  data_file_.clear();
+  data_file_.seekp(entry.file_offset);
+  data_file_.write(reinterpret_cast<const char*>(chunk->data()),
+                   entry.length);
+  data_file_.flush();
+  const WebmChunkDescriptor& descriptor = entry.descriptor;
+  index_file_ << kChunkKey << " " << entry.file_offset << " " << entry.length
+              << " " << entry.duration << " " << descriptor.offset << " "
+              << descriptor.first_timestamp << " "
+              << descriptor.last_timestamp << " " << descriptor.keyframe << " "
+              << descriptor.continuation << " " << descriptor.block_count
+              << " " << descriptor.keyframe_offset << " " << entry.id << "\n";
+  index_file_.flush();
+  if (!data_file_ || !index_file_) {
+    LOG(ERROR) << "cannot write spill file " << settings_.path << ": "
+               << entry.id;
+    index_file_.clear();
+    ++stats_.file_errors;
+    return kFileError;
+  }
+  write_offset_ += entry.length;
+  index_.push_back(entry);
+  ++stats_.spilled_chunks;
+  stats_.spilled_bytes += entry.length;
+  ++stats_.pending_chunks;
+  stats_.pending_bytes += entry.length;
+  return kSuccess;
+}
+
+int SinkSpillFile::NextChunk(SharedWebmChunk* ptr_chunk) {
+  if (index_.empty()) {
+    return kEmpty;
+  }
+  if (!next_chunk_) {
+    const int status = ReadChunk(index_.front(), &next_chunk_);
+    if (status) {
+      ++stats_.file_errors;
+      PopChunk();
+      return status;
+    }
+  }
+  // Chunks larger than the burst allowance take their tokens over several
+  // calls.
+  const int64 length = next_chunk_->length();
+  next_chunk_credit_ += pacer_.Take(length - next_chunk_credit_);
+  if (next_chunk_credit_ < length) {
+    return kPaced;
+  }
+  *ptr_chunk = next_chunk_;
+  return kSuccess;
+}
+
+void SinkSpillFile::PopChunk() {
+  if (index_.empty()) {
+    return;
+  }
+  const int32 length = index_.front().length;
+  if (next_chunk_) {
+    ++stats_.replayed_chunks;
+  }
+  --stats_.pending_chunks;
+  stats_.pending_bytes -= length;
+  index_.pop_front();
+  next_chunk_.reset();
+  next_chunk_credit_ = 0;
+  if (index_.empty()) {
+    LOG(INFO) << "spill file " << settings_.path << " replayed.";
+    Truncate();
+  }
+}
+
+int SinkSpillFile::Truncate() {
+  data_file_.close();
+  data_file_.clear();
+  data_file_.open(settings_.path.c_str(), std::ios::in | std::ios::out |
+                  std::ios::binary | std::ios::trunc);
+  const std::string index_path = settings_.path + kIndexSuffix;
+  index_file_.close();
+  index_file_.clear();
+  index_file_.open(index_path.c_str(), std::ios::trunc);
+  write_offset_ = 0;
+  if (!data_file_ || !index_file_) {
+    LOG(ERROR) << "cannot create spill file " << settings_.path << " or "
+               << index_path;
+    return kFileError;
+  }
+  return kSuccess;
+}
+
+int SinkSpillFile::ReadChunk(const IndexEntry& entry,
+                             SharedWebmChunk* ptr_chunk) {
+  WebmChunk::Data data(entry.length);
+  data_file_.clear();
+  data_file_.seekg(entry.file_offset);
+  if (entry.length > 0) {
+    data_file_.read(reinterpret_cast<char*>(&data[0]), entry.length);
+  }
+  if (!data_file_) {
+    LOG(ERROR) << "cannot read spill file " << settings_.path << ": "
+               << entry.id;
+    return kFileError;
+  }
+  ptr_chunk->reset(
+      new (std::nothrow) WebmChunk(entry.id, entry.descriptor,  // NOLINT
+                                   entry.duration, &data,
+                                   SharedWebmChunkDataPool()));
+  if (!*ptr_chunk) {
+    LOG(ERROR) << "out of memory.";
+    return kFileError;
+  }
+  return kSuccess;
+}
+
+}  // namespace webmlive
@@ -0,0 +1,134 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_SINK_SPILL_FILE_H_
+#define WEBMLIVE_ENCODER_SINK_SPILL_FILE_H_
+
+#include <deque>
+#include <fstream>
+#include <string>
+
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+#include "encoder/upload_pacer.h"
+#include "encoder/webm_chunk.h"
+
+namespace webmlive {
+
+struct SinkSpillSettings {
+  SinkSpillSettings() : catchup_kbps(0) {}
+
+  // Data file chunks are spilled to. Its index is written next to it, to
+  // |path| with ".idx" appended.
+  std::string path;
+
+  // Rate spilled chunks are replayed at, in kilobits per second; 0 replays
+  // them as fast as the data sink accepts them.
+  int catchup_kbps;
+};
+
+// Counters of a |SinkSpillFile|.
+struct SinkSpillStats {
+  SinkSpillStats()
+      : spilled_chunks(0), spilled_bytes(0), replayed_chunks(0),
+        pending_chunks(0), pending_bytes(0), file_errors(0) {}
+
+  // Chunks written to the spill file, and their total length.
+  int64 spilled_chunks;
+  int64 spilled_bytes;
+
+  // Spilled chunks replayed.
+  int64 replayed_chunks;
+
+  // Spilled chunks not replayed yet, and their total length.
+  int64 pending_chunks;
+  int64 pending_bytes;
+
+  // Chunks that could not be written to, or read back from, the file.
+  int64 file_errors;
+};
+
+// Overflow of a chunk queue to disk. Chunks are appended to a data file, and
+// a line describing each, its position in the file, id, descriptor and
+// duration, to an index file; they are read back oldest first, at up to
+// |SinkSpillSettings::catchup_kbps|. Both files are truncated whenever every
+// chunk spilled has been replayed, so that they only grow with the backlog.
+//
+// Notes:
+// - Not thread safe: the muxed stream is queued and drained by one thread.
+// - The files are recreated by |Init()|: chunks left by a previous run are
+//   not replayed.
+class SinkSpillFile {
+ public:
+  enum {
+    kFileError = -2,
+    kInvalidArg = -1,
+    kSuccess = 0,
+
+    // |NextChunk()| status when no chunk is spilled, and when the catch-up
+    // rate holds back the oldest.
+    kEmpty = 1,
+    kPaced = 2,
+  };
+
+  SinkSpillFile();
+  ~SinkSpillFile();
+
+  // Copies |settings| and creates the data and index files. Returns
+  // |kSuccess|, |kInvalidArg| when |settings.path| is empty, or |kFileError|.
+  int Init(const SinkSpillSettings& settings);
+
+  // Appends |chunk| to the spill file. Returns |kSuccess|, or |kFileError|,
+  // in which case |chunk| is not spilled.
+  int Append(const SharedWebmChunk& chunk);
+
+  // Stores the oldest spilled chunk in |ptr_chunk|, read back from the data
+  // file, and returns |kSuccess| when the catch-up rate allows sending it;
+  // it remains the oldest until |PopChunk()|. Returns |kEmpty|, |kPaced|, or
+  // |kFileError|, in which case the chunk is discarded.
+  int NextChunk(SharedWebmChunk* ptr_chunk);
+
+  // Removes the chunk returned by |NextChunk()| once it has been sent.
+  void PopChunk();
+
+  bool empty() const { return index_.empty(); }
+  const SinkSpillStats& stats() const { return stats_; }
+
+ private:
+  // Position and metadata of a spilled chunk.
+  struct IndexEntry {
+    IndexEntry() : file_offset(0), length(0), duration(0) {}
+    int64 file_offset;
+    int32 length;
+    std::string id;
+    WebmChunkDescriptor descriptor;
+    int64 duration;
+  };
+
+  // (Re)creates empty data and index files.
+  int Truncate();
+
+  // Reads the chunk of |entry| from the data file into |ptr_chunk|.
+  int ReadChunk(const IndexEntry& entry, SharedWebmChunk* ptr_chunk);
+
+  SinkSpillSettings settings_;
+  std::fstream data_file_;
+  std::ofstream index_file_;
+  int64 write_offset_;
+  std::deque<IndexEntry> index_;
+
+  // Oldest chunk once read back, and the catch-up rate tokens taken for it.
+  SharedWebmChunk next_chunk_;
+  int64 next_chunk_credit_;
+  UploadPacer pacer_;
+  SinkSpillStats stats_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(SinkSpillFile);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_SINK_SPILL_FILE_H_
@@ -0,0 +1,203 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/static_block_detector.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include "encoder/pcm_deinterleave.h"
+#include "glog/logging.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || \
+    defined(__i386__)
+#define WEBMLIVE_HAVE_X86 1
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(_M_ARM64)
+#define WEBMLIVE_HAVE_NEON 1
+#include <arm_neon.h>
+#endif
+
+// See pcm_deinterleave.cc.
+#if defined(WEBMLIVE_HAVE_X86) && !defined(_MSC_VER)
+#define WEBMLIVE_TARGET(isa) __attribute__((target(isa)))
+#else
+#define WEBMLIVE_TARGET(isa)
+#endif
+
+namespace {
+
+// Returns the SAD of the |width|x|height| blocks at |ptr_a| and |ptr_b|.
+uint32 BlockSadC(const uint8* ptr_a, int32 stride_a, const uint8* ptr_b,
+                 int32 stride_b, int32 width, int32 height) {
+  uint32 sad = 0;
+  for (int32 y = 0; y < height; ++y) {
+    for (int32 x = 0; x < width; ++x) {
+      sad += std::abs(ptr_a[x] - ptr_b[x]);
+    }
+    ptr_a += stride_a;
+    ptr_b += stride_b;
+  }
+  return sad;
+}
+
+uint32 BlockSad16x16C(const uint8* ptr_a, int32 stride_a, const uint8* ptr_b,
+                      int32 stride_b) {
+  return BlockSadC(ptr_a, stride_a, ptr_b, stride_b, 16, 16);
+}
+
+#if defined(WEBMLIVE_HAVE_X86)
+
+// _mm_sad_epu8 sums each half of a row into one 64 bit lane.
+WEBMLIVE_TARGET("sse2")
+uint32 BlockSad16x16Sse2(const uint8* ptr_a, int32 stride_a,
+                         const uint8* ptr_b, int32 stride_b) {
+  __m128i sum = _mm_setzero_si128();
+  for (int y = 0; y < 16; ++y) {
+    const __m128i a =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr_a));
+    const __m128i b =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr_b));
+    sum = _mm_add_epi64(sum, _mm_sad_epu8(a, b));
+    ptr_a += stride_a;
+    ptr_b += stride_b;
+  }
+  return static_cast<uint32>(_mm_cvtsi128_si32(sum) +
+                             _mm_cvtsi128_si32(_mm_srli_si128(sum, 8)));
+}
+
+#elif defined(WEBMLIVE_HAVE_NEON)
+
+// Sixteen rows of absolute differences fit in 16 bit lanes.
+uint32 BlockSad16x16Neon(const uint8* ptr_a, int32 stride_a,
+                         const uint8* ptr_b, int32 stride_b) {
+  uint16x8_t sum = vdupq_n_u16(0);
+  for (int y = 0; y < 16; ++y) {
+    sum = vpadalq_u8(sum, vabdq_u8(vld1q_u8(ptr_a), vld1q_u8(ptr_b)));
+    ptr_a += stride_a;
+    ptr_b += stride_b;
+  }
+  const uint64x2_t total = vpaddlq_u32(vpaddlq_u16(sum));
+  return static_cast<uint32>(vgetq_lane_u64(total, 0) +
+                             vgetq_lane_u64(total, 1));
+}
+
+#endif  // WEBMLIVE_HAVE_X86
+
+}  // anonymous namespace
+
+namespace webmlive {
+
+const int32 StaticBlockDetector::kBlockSize;
+
+BlockSadFunc SelectBlockSad(int cpu_features) {
+#if defined(WEBMLIVE_HAVE_X86)
+  if (cpu_features & kCpuFeatureSse2) return &BlockSad16x16Sse2;
+#elif defined(WEBMLIVE_HAVE_NEON)
+  if (cpu_features & kCpuFeatureNeon) return &BlockSad16x16Neon;
+#endif
+  return &BlockSad16x16C;
+}
+
+StaticBlockDetector::StaticBlockDetector()
+    : block_sad_(SelectBlockSad(GetCpuFeatures())),
+      width_(0),
+      height_(0),
+      rows_(0),
+      cols_(0),
+      threshold_(0),
+      have_reference_(false) {}
+
+int StaticBlockDetector::Init(int32 width, int32 height, int threshold) {
+  if (width <= 0 || height <= 0 || threshold < 0) {
+    LOG(ERROR) << "invalid static block detector setup " << width << "x"
+               << height << " threshold " << threshold;
+    return kInvalidArg;
+  }
+  const int32 rows = (height + kBlockSize - 1) / kBlockSize;
+  const int32 cols = (width + kBlockSize - 1) / kBlockSize;
+  reference_.reset(new (std::nothrow) uint8[width * height]);  // NOLINT
+  active_map_.reset(new (std::nothrow) uint8[rows * cols]);  // NOLINT
+  if (!reference_ || !active_map_) {
+    LOG(ERROR) << "cannot allocate static block detector buffers.";
+    reference_.reset();
+    active_map_.reset();
+    width_ = height_ = rows_ = cols_ = 0;
+    return kNoMemory;
+  }
+  width_ = width;
+  height_ = height;
+  rows_ = rows;
+  cols_ = cols;
+  threshold_ = threshold;
+  have_reference_ = false;
+  SetAllActive();
+  return kSuccess;
+}
+
+int32 StaticBlockDetector::Detect(const uint8* ptr_luma, int32 stride) {
+  if (!have_reference_) {
+    SetAllActive();
+    return rows_ * cols_;
+  }
+  int32 active_blocks = 0;
+  for (int32 row = 0; row < rows_; ++row) {
+    for (int32 col = 0; col < cols_; ++col) {
+      const int32 block_width =
+          std::min(kBlockSize, width_ - col * kBlockSize);
+      const int32 block_height =
+          std::min(kBlockSize, height_ - row * kBlockSize);
+      const uint32 limit =
+          static_cast<uint32>(threshold_) * block_width * block_height;
+      const bool active = BlockSad(ptr_luma, stride, row, col) > limit;
+      active_map_[row * cols_ + col] = active ? 1 : 0;
+      active_blocks += active ? 1 : 0;
+    }
+  }
+  return active_blocks;
+}
+
+void StaticBlockDetector::SetAllActive() {
+  memset(active_map_.get(), 1, rows_ * cols_);
+}
+
+void StaticBlockDetector::Update(const uint8* ptr_luma, int32 stride) {
+  for (int32 row = 0; row < rows_; ++row) {
+    const int32 top = row * kBlockSize;
+    const int32 block_height = std::min(kBlockSize, height_ - top);
+    for (int32 col = 0; col < cols_; ++col) {
+      if (!active_map_[row * cols_ + col]) {
+        continue;
+      }
+      const int32 left = col * kBlockSize;
+      const int32 block_width = std::min(kBlockSize, width_ - left);
+      for (int32 y = top; y < top + block_height; ++y) {
+        memcpy(&reference_[y * width_ + left], ptr_luma + y * stride + left,
+               block_width);
+      }
+    }
+  }
+  have_reference_ = true;
+}
+
+uint32 StaticBlockDetector::BlockSad(const uint8* ptr_luma, int32 stride,
+                                     int32 row, int32 col) const {
+  const int32 top = row * kBlockSize;
+  const int32 left = col * kBlockSize;
+  const uint8* const ptr_block = ptr_luma + top * stride + left;
+  const uint8* const ptr_reference = &reference_[top * width_ + left];
+  if (top + kBlockSize <= height_ && left + kBlockSize <= width_) {
+    return block_sad_(ptr_block, stride, ptr_reference, width_);
+  }
+  return BlockSadC(ptr_block, stride, ptr_reference, width_,
+                   std::min(kBlockSize, width_ - left),
+                   std::min(kBlockSize, height_ - top));
+}
+
+}  // namespace webmlive
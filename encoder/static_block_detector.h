@@ -0,0 +1,93 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_STATIC_BLOCK_DETECTOR_H_
+#define WEBMLIVE_ENCODER_STATIC_BLOCK_DETECTOR_H_
+
+#include <memory>
+
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+
+namespace webmlive {
+
+// Returns the sum of absolute differences of the 16x16 blocks at |ptr_a| and
+// |ptr_b|.
+typedef uint32 (*BlockSadFunc)(const uint8* ptr_a, int32 stride_a,
+                               const uint8* ptr_b, int32 stride_b);
+
+// Returns the fastest 16x16 SAD function on a CPU supporting
+// |cpu_features|, a mask of |CpuFeature| values.
+BlockSadFunc SelectBlockSad(int cpu_features);
+
+// Finds the 16x16 luma blocks of a frame that have not changed since they
+// were last encoded. Each frame is compared with a reference holding the
+// latest encoded content of every block: blocks within the threshold are
+// inactive, and keep their reference content; the others are active, and
+// are copied into the reference by |Update()| once the frame is encoded.
+// Comparing with the encoded content, not the previous frame, keeps slow
+// changes from accumulating unencoded. |active_map()| has the layout of
+// |vpx_active_map_t::active_map|.
+class StaticBlockDetector {
+ public:
+  enum {
+    kNoMemory = -2,
+    kInvalidArg = -1,
+    kSuccess = 0,
+  };
+
+  static const int32 kBlockSize = 16;
+
+  StaticBlockDetector();
+  ~StaticBlockDetector() {}
+
+  // Sets up detection for |width|x|height| frames. Blocks whose mean
+  // absolute difference per pixel is at most |threshold| are inactive.
+  // Every block of the first frame is active. Returns |kSuccess|, or
+  // |kInvalidArg| or |kNoMemory| on failure.
+  int Init(int32 width, int32 height, int threshold);
+
+  // Compares the luma plane at |ptr_luma| with the reference and sets
+  // |active_map()|. Returns the number of active blocks.
+  int32 Detect(const uint8* ptr_luma, int32 stride);
+
+  // Marks every block active, for frames encoded in full.
+  void SetAllActive();
+
+  // Copies the active blocks of the luma plane at |ptr_luma|, the frame last
+  // passed to |Detect()|, into the reference.
+  void Update(const uint8* ptr_luma, int32 stride);
+
+  // Forgets the reference, so that every block of the next frame is active.
+  void Reset() { have_reference_ = false; }
+
+  int32 width() const { return width_; }
+  int32 height() const { return height_; }
+  int32 rows() const { return rows_; }
+  int32 cols() const { return cols_; }
+  uint8* active_map() { return active_map_.get(); }
+
+ private:
+  // Returns the SAD of the block at |row|, |col|, which may be partial.
+  uint32 BlockSad(const uint8* ptr_luma, int32 stride, int32 row,
+                  int32 col) const;
+
+  BlockSadFunc block_sad_;
+  int32 width_;
+  int32 height_;
+  int32 rows_;
+  int32 cols_;
+  int threshold_;
+  bool have_reference_;
+  std::unique_ptr<uint8[]> reference_;
+  std::unique_ptr<uint8[]> active_map_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(StaticBlockDetector);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_STATIC_BLOCK_DETECTOR_H_
@@ -0,0 +1,347 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/task_scheduler.h"
+
+#include <algorithm>
+#include <new>
+#include <sstream>
+
+#include "encoder/thread_util.h"
+#include "glog/logging.h"
+
+namespace webmlive {
+
+namespace {
+
+// Scheduler and index of the worker running on the calling thread.
+thread_local const TaskScheduler* t_scheduler = NULL;
+thread_local int t_worker = -1;
+
+}  // namespace
+
+const int TaskScheduler::kMaxPriority;
+
+TaskScheduler::TaskScheduler()
+    : num_workers_(0),
+      pending_(0),
+      virtual_pass_(0),
+      steals_(0),
+      running_(false),
+      stop_(false) {
+}
+
+TaskScheduler::~TaskScheduler() {
+  Stop();
+}
+
+TaskScheduler* TaskScheduler::Instance() {
+  static TaskScheduler scheduler;
+  return &scheduler;
+}
+
+int TaskScheduler::Init(int workers) {
+  if (workers < 0) {
+    LOG(ERROR) << "invalid task scheduler worker count: " << workers;
+    return kInvalidArg;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (running_) {
+    LOG(ERROR) << "task scheduler already running.";
+    return kInvalidArg;
+  }
+  if (workers == 0) {
+    workers = static_cast<int>(std::thread::hardware_concurrency());
+  }
+  num_workers_ = std::max(workers, 1);
+  return kSuccess;
+}
+
+int TaskScheduler::Run() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (running_ || num_workers_ == 0) {
+      LOG(ERROR) << "task scheduler not initialized, or already running.";
+      return kNotRunning;
+    }
+    running_ = true;
+    stop_ = false;
+  }
+  // Workers look at each other's queues, so all exist before any starts.
+  workers_.clear();
+  for (int i = 0; i < num_workers_; ++i) {
+    std::unique_ptr<Worker> worker(new (std::nothrow) Worker());  // NOLINT
+    if (!worker) {
+      LOG(ERROR) << "cannot construct task scheduler worker.";
+      workers_.clear();
+      std::lock_guard<std::mutex> lock(mutex_);
+      running_ = false;
+      return kNotRunning;
+    }
+    workers_.push_back(std::move(worker));
+  }
+  for (int i = 0; i < num_workers_; ++i) {
+    workers_[i]->thread.reset(
+        new (std::nothrow) std::thread(  // NOLINT
+            &TaskScheduler::WorkerThread, this, i));
+    if (!workers_[i]->thread) {
+      LOG(ERROR) << "cannot construct task scheduler worker thread.";
+      Stop();
+      return kNotRunning;
+    }
+  }
+  LOG(INFO) << "task scheduler running " << num_workers_ << " workers.";
+  return kSuccess;
+}
+
+void TaskScheduler::Stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!running_) {
+      return;
+    }
+    stop_ = true;
+    running_ = false;
+  }
+  task_ready_.notify_all();
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    if (workers_[i]->thread) {
+      workers_[i]->thread->join();
+    }
+  }
+  workers_.clear();
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (size_t i = 0; i < channels_.size(); ++i) {
+    channels_[i].tasks.clear();
+    channels_[i].stats.queued_tasks = 0;
+  }
+  delayed_.clear();
+  pending_ = 0;
+}
+
+bool TaskScheduler::running() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return running_;
+}
+
+int TaskScheduler::AddChannel(const std::string& name, int priority) {
+  if (priority < 1 || priority > kMaxPriority) {
+    LOG(ERROR) << "invalid task channel priority: " << priority;
+    return kInvalidArg;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  Channel channel;
+  channel.stats.name = name;
+  channel.stats.priority = priority;
+  channel.priority = priority;
+  channel.pass = virtual_pass_;
+  channels_.push_back(channel);
+  return static_cast<int>(channels_.size()) - 1;
+}
+
+bool TaskScheduler::Post(int channel, const Task& task) {
+  const int worker = CurrentWorker();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!running_ || channel < 0 ||
+        channel >= static_cast<int>(channels_.size())) {
+      return false;
+    }
+    Channel& target = channels_[channel];
+    if (worker < 0) {
+      if (target.tasks.empty()) {
+        // A channel that was idle does not bank the time it did not use.
+        target.pass = std::max(target.pass, virtual_pass_);
+      }
+      target.tasks.push_back(task);
+    }
+    ++target.stats.queued_tasks;
+    ++pending_;
+  }
+  if (worker >= 0) {
+    Entry entry = {channel, task};
+    std::lock_guard<std::mutex> lock(workers_[worker]->mutex);
+    workers_[worker]->tasks.push_back(entry);
+  }
+  task_ready_.notify_one();
+  return true;
+}
+
+bool TaskScheduler::PostAfter(int channel, int delay_ms, const Task& task) {
+  if (delay_ms <= 0) {
+    return Post(channel, task);
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!running_ || channel < 0 ||
+        channel >= static_cast<int>(channels_.size())) {
+      return false;
+    }
+    Entry entry = {channel, task};
+    delayed_.insert(std::make_pair(
+        std::chrono::steady_clock::now() +
+            std::chrono::milliseconds(delay_ms),
+        entry));
+    ++channels_[channel].stats.queued_tasks;
+  }
+  // A worker waiting for a later delayed task must wait for this one.
+  task_ready_.notify_one();
+  return true;
+}
+
+int TaskScheduler::GetStats(std::vector<TaskChannelStats>* ptr_stats,
+                            int64* ptr_steals) const {
+  if (!ptr_stats || !ptr_steals) {
+    return kInvalidArg;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  ptr_stats->clear();
+  for (size_t i = 0; i < channels_.size(); ++i) {
+    ptr_stats->push_back(channels_[i].stats);
+  }
+  *ptr_steals = steals_;
+  return kSuccess;
+}
+
+void TaskScheduler::WorkerThread(int index) {
+  std::ostringstream thread_name;
+  thread_name << "scheduler" << index;
+  ScopedThreadRegistration registration(thread_name.str());
+  t_scheduler = this;
+  t_worker = index;
+  Entry entry;
+  while (NextTask(index, &entry)) {
+    const std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    entry.task();
+    const int64 time_us = std::chrono::duration_cast<
+        std::chrono::microseconds>(std::chrono::steady_clock::now() -
+                                   start).count();
+    RecordTask(entry.channel, time_us);
+    entry.task = Task();
+  }
+  t_scheduler = NULL;
+  t_worker = -1;
+}
+
+bool TaskScheduler::NextTask(int index, Entry* ptr_entry) {
+  Worker& worker = *workers_[index];
+  for (;;) {
+    // The tasks of the worker's own tasks first, for locality, then the
+    // channel queues by fairness.
+    if (worker.local_run < kMaxLocalRun &&
+        TakeLocal(index, false, ptr_entry)) {
+      ++worker.local_run;
+      return true;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (stop_) {
+        return false;
+      }
+      if (TakeChannelTask(ptr_entry)) {
+        worker.local_run = 0;
+        return true;
+      }
+    }
+    if (TakeLocal(index, false, ptr_entry)) {
+      worker.local_run = 0;
+      return true;
+    }
+    for (int i = 1; i < num_workers_; ++i) {
+      if (TakeLocal((index + i) % num_workers_, true, ptr_entry)) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++steals_;
+        return true;
+      }
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    const std::function<bool()> ready = [this] {
+      return stop_ || pending_ > 0 ||
+             (!delayed_.empty() &&
+              delayed_.begin()->first <= std::chrono::steady_clock::now());
+    };
+    if (delayed_.empty()) {
+      task_ready_.wait(lock, ready);
+    } else {
+      task_ready_.wait_until(lock, delayed_.begin()->first, ready);
+    }
+    if (stop_) {
+      return false;
+    }
+  }
+}
+
+bool TaskScheduler::TakeLocal(int index, bool steal, Entry* ptr_entry) {
+  Worker& worker = *workers_[index];
+  {
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    if (worker.tasks.empty()) {
+      return false;
+    }
+    if (steal) {
+      *ptr_entry = worker.tasks.front();
+      worker.tasks.pop_front();
+    } else {
+      *ptr_entry = worker.tasks.back();
+      worker.tasks.pop_back();
+    }
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  --pending_;
+  return true;
+}
+
+bool TaskScheduler::TakeChannelTask(Entry* ptr_entry) {
+  const TimePoint now = std::chrono::steady_clock::now();
+  while (!delayed_.empty() && delayed_.begin()->first <= now) {
+    Channel& channel = channels_[delayed_.begin()->second.channel];
+    if (channel.tasks.empty()) {
+      channel.pass = std::max(channel.pass, virtual_pass_);
+    }
+    channel.tasks.push_back(delayed_.begin()->second.task);
+    delayed_.erase(delayed_.begin());
+    ++pending_;
+  }
+  int next = -1;
+  for (size_t i = 0; i < channels_.size(); ++i) {
+    if (!channels_[i].tasks.empty() &&
+        (next < 0 || channels_[i].pass < channels_[next].pass)) {
+      next = static_cast<int>(i);
+    }
+  }
+  if (next < 0) {
+    return false;
+  }
+  Channel& channel = channels_[next];
+  ptr_entry->channel = next;
+  ptr_entry->task = channel.tasks.front();
+  channel.tasks.pop_front();
+  virtual_pass_ = channel.pass;
+  --pending_;
+  return true;
+}
+
+void TaskScheduler::RecordTask(int channel, int64 time_us) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (channel < 0 || channel >= static_cast<int>(channels_.size())) {
+    return;
+  }
+  Channel& target = channels_[channel];
+  ++target.stats.tasks_run;
+  target.stats.task_time_us += time_us;
+  --target.stats.queued_tasks;
+  target.pass += static_cast<double>(std::max<int64>(time_us, 1)) /
+                 target.priority;
+}
+
+int TaskScheduler::CurrentWorker() const {
+  return t_scheduler == this ? t_worker : -1;
+}
+
+}  // namespace webmlive
@@ -0,0 +1,198 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_TASK_SCHEDULER_H_
+#define WEBMLIVE_ENCODER_TASK_SCHEDULER_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+
+namespace webmlive {
+
+// Tasks run for one channel of a |TaskScheduler|.
+struct TaskChannelStats {
+  TaskChannelStats()
+      : priority(0), tasks_run(0), task_time_us(0), queued_tasks(0) {}
+
+  std::string name;
+  int priority;
+
+  // Tasks run, and the time they took, in microseconds.
+  int64 tasks_run;
+  int64 task_time_us;
+
+  // Tasks waiting to run, including delayed tasks.
+  int32 queued_tasks;
+};
+
+// Work-stealing task scheduler shared by the channels of a process. A fixed
+// set of worker threads runs short tasks posted for channels, such as the
+// sink writes of each channel's |AsyncSinkAdapter|, in place of a thread for
+// each.
+//
+// Tasks posted from outside the workers wait in their channel's queue.
+// Workers take the next of those from the channel that has used the least
+// worker time for its priority, so that a channel of priority 2 gets twice
+// the worker time of a channel of priority 1 while both have tasks waiting.
+// Tasks posted by a running task go to the queue of its worker, which runs
+// them next, for locality, up to |kMaxLocalRun| in a row before it serves
+// the channel queues again; idle workers steal from the other end of a busy
+// worker's queue.
+//
+// Notes:
+// - |Init()| must be called before any other method, and |Run()| starts the
+//   workers.
+// - Tasks must not block for long: a blocked task holds its worker.
+// - |Stop()| discards the tasks that have not run; their owners must not
+//   wait for them after it.
+// - Thread safe.
+class TaskScheduler {
+ public:
+  typedef std::function<void()> Task;
+
+  // Default and largest channel priorities.
+  static const int kDefaultPriority = 1;
+  static const int kMaxPriority = 16;
+
+  // Tasks a worker runs from its own queue in a row.
+  static const int kMaxLocalRun = 4;
+
+  enum {
+    // The scheduler is not running.
+    kNotRunning = -2,
+
+    // Invalid argument supplied to method call.
+    kInvalidArg = -1,
+
+    kSuccess = 0,
+  };
+
+  TaskScheduler();
+  ~TaskScheduler();
+
+  // Returns the scheduler shared by the channels of the process.
+  static TaskScheduler* Instance();
+
+  // Sets the number of workers; 0 runs one per hardware thread. Returns
+  // |kSuccess| when successful.
+  int Init(int workers);
+
+  // Starts the workers.
+  int Run();
+
+  // Stops the workers after the tasks they are running. Tasks not yet run
+  // are discarded.
+  void Stop();
+
+  // Returns true between |Run()| and |Stop()|.
+  bool running() const;
+
+  // Adds a channel named |name| with |priority|, 1 to |kMaxPriority|, and
+  // returns its id, or |kInvalidArg|.
+  int AddChannel(const std::string& name, int priority);
+
+  // Posts |task| for |channel|. Returns false when the scheduler is not
+  // running, or |channel| is not a channel id.
+  bool Post(int channel, const Task& task);
+
+  // Posts |task| for |channel| once |delay_ms| milliseconds have passed.
+  bool PostAfter(int channel, int delay_ms, const Task& task);
+
+  // Replaces the contents of |ptr_stats| with the stats of each channel, in
+  // channel id order, and sets |ptr_steals| to the number of tasks stolen.
+  int GetStats(std::vector<TaskChannelStats>* ptr_stats,
+               int64* ptr_steals) const;
+
+ private:
+  typedef std::chrono::steady_clock::time_point TimePoint;
+
+  struct Entry {
+    int channel;
+    Task task;
+  };
+
+  struct Channel {
+    Channel() : priority(kDefaultPriority), pass(0) {}
+    TaskChannelStats stats;
+    int priority;
+
+    // Tasks waiting to run, oldest first.
+    std::deque<Task> tasks;
+
+    // Worker time used, in microseconds, divided by |priority|. The channel
+    // with the lowest |pass| and a task waiting runs next.
+    double pass;
+  };
+
+  struct Worker {
+    Worker() : local_run(0) {}
+
+    // Tasks posted by the worker's tasks. The worker takes them from the
+    // back, and thieves from the front. Protected by |mutex|.
+    std::deque<Entry> tasks;
+    std::mutex mutex;
+
+    // Tasks run in a row from |tasks|. Used only by the worker.
+    int local_run;
+
+    std::unique_ptr<std::thread> thread;
+  };
+
+  // Worker thread function.
+  void WorkerThread(int index);
+
+  // Waits for the next task of worker |index|, and moves it to
+  // |ptr_entry|. Returns false when stopped.
+  bool NextTask(int index, Entry* ptr_entry);
+
+  // Takes the next task from the local queue of worker |index| into
+  // |ptr_entry|. Thieves take the oldest task; the worker the newest.
+  bool TakeLocal(int index, bool steal, Entry* ptr_entry);
+
+  // Moves the delayed tasks that are due to their channel queues, and takes
+  // the next task of the channel with the lowest pass into |ptr_entry|.
+  // Must be called with |mutex_| held.
+  bool TakeChannelTask(Entry* ptr_entry);
+
+  // Charges |time_us| of worker time to |channel|.
+  void RecordTask(int channel, int64 time_us);
+
+  // Returns the index of the calling worker of this scheduler, or -1.
+  int CurrentWorker() const;
+
+  int num_workers_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+
+  // Channels by id, delayed tasks by due time, tasks posted and not yet
+  // taken, the pass of the last channel served, and the stop flag.
+  // Protected by |mutex_|.
+  std::vector<Channel> channels_;
+  std::multimap<TimePoint, Entry> delayed_;
+  int pending_;
+  double virtual_pass_;
+  int64 steals_;
+  bool running_;
+  bool stop_;
+  mutable std::mutex mutex_;
+  std::condition_variable task_ready_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(TaskScheduler);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_TASK_SCHEDULER_H_
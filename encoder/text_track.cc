@@ -0,0 +1,303 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/text_track.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include <cctype>
+#include <new>
+#include <utility>
+
+#include "encoder/thread_util.h"
+#include "glog/logging.h"
+
+namespace webmlive {
+
+namespace {
+
+// Longest line read from a WebVTT stream; longer lines are split.
+const int kMaxLineLength = 4096;
+
+// Separator of the start and end times of a cue timing line.
+const char kTimingArrow[] = "-->";
+
+// Parses the decimal digits at |*ptr_offset| in |line|, of which there must
+// be at least |min_digits|, into |ptr_value|.
+bool ParseDigits(const std::string& line, size_t min_digits,
+                 size_t* ptr_offset, int64* ptr_value) {
+  size_t offset = *ptr_offset;
+  int64 value = 0;
+  while (offset < line.length() &&
+         isdigit(static_cast<unsigned char>(line[offset]))) {
+    value = value * 10 + (line[offset] - '0');
+    ++offset;
+  }
+  if (offset - *ptr_offset < min_digits) {
+    return false;
+  }
+  *ptr_offset = offset;
+  *ptr_value = value;
+  return true;
+}
+
+// Skips spaces and tabs at |*ptr_offset| in |line|.
+void SkipBlanks(const std::string& line, size_t* ptr_offset) {
+  while (*ptr_offset < line.length() &&
+         (line[*ptr_offset] == ' ' || line[*ptr_offset] == '\t')) {
+    ++*ptr_offset;
+  }
+}
+
+}  // namespace
+
+void MakeWebVttFrame(const TextCue& cue, std::string* ptr_frame) {
+  std::string& frame = *ptr_frame;
+  frame.clear();
+  frame.reserve(cue.identifier.length() + cue.settings.length() +
+                cue.payload.length() + 2);
+  frame += cue.identifier;
+  frame += '\n';
+  frame += cue.settings;
+  frame += '\n';
+  frame += cue.payload;
+}
+
+bool ParseWebVttTime(const std::string& line, size_t* ptr_offset,
+                     int64* ptr_time) {
+  // Two or three fields before the milliseconds: [hh:]mm:ss.ttt.
+  size_t offset = *ptr_offset;
+  int64 fields[3] = {0, 0, 0};
+  int num_fields = 0;
+  for (;;) {
+    if (!ParseDigits(line, 2, &offset, &fields[num_fields])) {
+      return false;
+    }
+    ++num_fields;
+    if (offset >= line.length() || line[offset] != ':' || num_fields == 3) {
+      break;
+    }
+    ++offset;
+  }
+  if (num_fields < 2 || offset >= line.length() || line[offset] != '.') {
+    return false;
+  }
+  ++offset;
+  int64 milliseconds = 0;
+  const size_t milliseconds_offset = offset;
+  if (!ParseDigits(line, 3, &offset, &milliseconds) ||
+      offset - milliseconds_offset != 3) {
+    return false;
+  }
+  const int64 hours = num_fields == 3 ? fields[0] : 0;
+  const int64 minutes = fields[num_fields - 2];
+  const int64 seconds = fields[num_fields - 1];
+  if (minutes > 59 || seconds > 59) {
+    return false;
+  }
+  *ptr_time = ((hours * 60 + minutes) * 60 + seconds) * 1000 + milliseconds;
+  *ptr_offset = offset;
+  return true;
+}
+
+TextTrackSource::TextTrackSource() : ptr_file_(NULL), stop_(false) {
+}
+
+TextTrackSource::~TextTrackSource() {
+  Stop();
+}
+
+int TextTrackSource::Init(const TextTrackSettings& settings) {
+  if (!settings.enabled || (settings.kind != TextTrackSettings::kSubtitles &&
+                            settings.kind != TextTrackSettings::kCaptions)) {
+    LOG(ERROR) << "invalid text track settings.";
+    return kInvalidArg;
+  }
+  settings_ = settings;
+  return kSuccess;
+}
+
+int TextTrackSource::Run() {
+  if (settings_.input_file.empty()) {
+    return kSuccess;
+  }
+  if (reader_thread_) {
+    LOG(ERROR) << "text track reader already running.";
+    return kRunFailed;
+  }
+  ptr_file_ = fopen(settings_.input_file.c_str(), "rb");
+  if (!ptr_file_) {
+    LOG(ERROR) << "cannot open text track input " << settings_.input_file;
+    return kOpenFailed;
+  }
+  stop_ = false;
+  reader_thread_.reset(
+      new (std::nothrow) std::thread(  // NOLINT
+          &TextTrackSource::ReaderThread, this));
+  if (!reader_thread_) {
+    LOG(ERROR) << "cannot construct text track reader thread.";
+    fclose(ptr_file_);
+    ptr_file_ = NULL;
+    return kRunFailed;
+  }
+  return kSuccess;
+}
+
+void TextTrackSource::Stop() {
+  if (!reader_thread_) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+#ifdef _WIN32
+  // A pipe read blocks until the writer writes; cancel it.
+  CancelSynchronousIo(reader_thread_->native_handle());
+#endif
+  reader_thread_->join();
+  reader_thread_.reset();
+  fclose(ptr_file_);
+  ptr_file_ = NULL;
+}
+
+bool TextTrackSource::AddCue(const TextCue& cue) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (cue.payload.empty() || cue.duration <= 0 ||
+      cues_.size() >= static_cast<size_t>(TextTrackSettings::kMaxQueuedCues)) {
+    ++stats_.cues_dropped;
+    return false;
+  }
+  // Cues mostly arrive in order; insert from the back.
+  std::deque<TextCue>::iterator position = cues_.end();
+  while (position != cues_.begin() && (position - 1)->start > cue.start) {
+    --position;
+  }
+  cues_.insert(position, cue);
+  ++stats_.cues_queued;
+  return true;
+}
+
+bool TextTrackSource::ReadDueCue(int64 timestamp, TextCue* ptr_cue) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (cues_.empty() || cues_.front().start > timestamp) {
+    return false;
+  }
+  std::swap(*ptr_cue, cues_.front());
+  cues_.pop_front();
+  if (ptr_cue->start == TextCue::kStartNow) {
+    ptr_cue->start = timestamp;
+  }
+  return true;
+}
+
+void TextTrackSource::NoteCueWritten(bool late) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++stats_.cues_written;
+  if (late) {
+    ++stats_.cues_late;
+  }
+}
+
+void TextTrackSource::GetStats(TextTrackStats* ptr_stats) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  *ptr_stats = stats_;
+}
+
+void TextTrackSource::ReaderThread() {
+  ScopedThreadRegistration registration("text");
+  std::deque<std::string> block;
+  char line[kMaxLineLength];
+  for (;;) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (stop_) {
+        break;
+      }
+    }
+    const bool have_line = fgets(line, sizeof(line), ptr_file_) != NULL;
+    std::string text = have_line ? line : "";
+    while (!text.empty() &&
+           (text[text.length() - 1] == '\n' ||
+            text[text.length() - 1] == '\r')) {
+      text.erase(text.length() - 1);
+    }
+    // A blank line, or the end of the input, ends the block.
+    if (text.empty()) {
+      if (!block.empty()) {
+        ParseBlock(block);
+        block.clear();
+      }
+      if (!have_line) {
+        break;
+      }
+      continue;
+    }
+    block.push_back(text);
+  }
+  VLOG(1) << "text track input ended.";
+}
+
+void TextTrackSource::ParseBlock(const std::deque<std::string>& block) {
+  std::string first = block.front();
+  if (first.compare(0, 3, "\xEF\xBB\xBF") == 0) {
+    first.erase(0, 3);
+  }
+  if (first.compare(0, 6, "WEBVTT") == 0 || first.compare(0, 4, "NOTE") == 0 ||
+      first.compare(0, 5, "STYLE") == 0 ||
+      first.compare(0, 6, "REGION") == 0) {
+    return;
+  }
+
+  // An identifier line may precede the timing line.
+  TextCue cue;
+  size_t timing_line = 0;
+  if (first.find(kTimingArrow) == std::string::npos) {
+    cue.identifier = first;
+    timing_line = 1;
+  }
+  bool valid = timing_line < block.size();
+  int64 start = 0;
+  int64 end = 0;
+  if (valid) {
+    const std::string& timing = block[timing_line];
+    size_t offset = 0;
+    SkipBlanks(timing, &offset);
+    valid = ParseWebVttTime(timing, &offset, &start);
+    SkipBlanks(timing, &offset);
+    valid = valid && timing.compare(offset, 3, kTimingArrow) == 0;
+    offset += 3;
+    SkipBlanks(timing, &offset);
+    valid = valid && ParseWebVttTime(timing, &offset, &end) && end > start;
+    if (valid) {
+      SkipBlanks(timing, &offset);
+      cue.settings = timing.substr(offset);
+    }
+  }
+  if (valid) {
+    for (size_t i = timing_line + 1; i < block.size(); ++i) {
+      if (!cue.payload.empty()) {
+        cue.payload += '\n';
+      }
+      cue.payload += block[i];
+    }
+    valid = !cue.payload.empty();
+  }
+  if (!valid) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++stats_.parse_errors;
+    LOG(WARNING) << "skipping malformed WebVTT cue block: " << first;
+    return;
+  }
+  cue.start = settings_.live_timing ? TextCue::kStartNow : start;
+  cue.duration = end - start;
+  AddCue(cue);
+}
+
+}  // namespace webmlive
@@ -0,0 +1,172 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_TEXT_TRACK_H_
+#define WEBMLIVE_ENCODER_TEXT_TRACK_H_
+
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+
+namespace webmlive {
+
+// A WebVTT cue: the text shown from |start| for |duration| milliseconds.
+struct TextCue {
+  // |start| of a cue shown as soon as it is muxed.
+  static const int64 kStartNow = -1;
+
+  TextCue() : start(kStartNow), duration(0) {}
+
+  int64 start;
+  int64 duration;
+
+  // Optional cue identifier, the cue settings list ("align:start line:0",
+  // for example), and the cue text, whose lines are separated by '\n'.
+  std::string identifier;
+  std::string settings;
+  std::string payload;
+};
+
+// Formats |cue| as the payload of a WebVTT-in-WebM block: the identifier
+// line, the settings line and the payload, separated by line feeds, as
+// libwebm's |SampleMuxerMetadata| writes them.
+void MakeWebVttFrame(const TextCue& cue, std::string* ptr_frame);
+
+// Parses a WebVTT timestamp, "hh:mm:ss.ttt" or "mm:ss.ttt", starting at
+// |*ptr_offset| in |line|. On success stores it in |ptr_time|, in
+// milliseconds, moves |*ptr_offset| past it and returns true.
+bool ParseWebVttTime(const std::string& line, size_t* ptr_offset,
+                     int64* ptr_time);
+
+struct TextTrackSettings {
+  // Cues waiting to be muxed beyond which new cues are dropped.
+  static const int kMaxQueuedCues = 256;
+
+  enum Kind {
+    kSubtitles = 0,
+    kCaptions = 1,
+  };
+
+  TextTrackSettings() : enabled(false), kind(kCaptions), live_timing(true) {}
+
+  // Mux a WebVTT text track in the muxed stream.
+  bool enabled;
+
+  // Kind of the track, which selects its CodecID: D_WEBVTT/SUBTITLES or
+  // D_WEBVTT/CAPTIONS.
+  Kind kind;
+
+  // ISO 639-2 language code and name of the track. Empty values are not
+  // written.
+  std::string language;
+  std::string name;
+
+  // WebVTT file or named pipe read for cues while the encoder runs. Cues may
+  // also be passed to |WebmEncoder::AddTextCue()|.
+  std::string input_file;
+
+  // Show cues read from |input_file| when they arrive, for |end - start| of
+  // their WebVTT timings. When false the timings are stream times.
+  bool live_timing;
+};
+
+struct TextTrackStats {
+  TextTrackStats()
+      : cues_queued(0), cues_written(0), cues_dropped(0), cues_late(0),
+        parse_errors(0) {}
+
+  // Cues accepted, muxed, and dropped while |kMaxQueuedCues| cues waited.
+  int64 cues_queued;
+  int64 cues_written;
+  int64 cues_dropped;
+
+  // Cues muxed after their start time because they arrived late.
+  int64 cues_late;
+
+  // Malformed cue blocks skipped in |TextTrackSettings::input_file|.
+  int64 parse_errors;
+};
+
+// Queue of cues for a live WebVTT track. Cues are added by |AddCue()| from
+// any thread, and by a reader thread parsing |TextTrackSettings::input_file|
+// as a WebVTT stream, block by block as they arrive. The muxing thread takes
+// the cues due by the time of each frame it muxes with |ReadDueCue()|, so
+// cues are written into the clusters of the audio and video around them.
+//
+// Notes:
+// - |Init()| must be called before any other method, and |Run()| starts the
+//   reader thread when there is an input file.
+// - |ReadDueCue()| must be called from one thread.
+class TextTrackSource {
+ public:
+  enum {
+    kOpenFailed = -3,
+    kRunFailed = -2,
+    kInvalidArg = -1,
+    kSuccess = 0,
+  };
+
+  TextTrackSource();
+  ~TextTrackSource();
+
+  // Stores |settings|. Returns |kSuccess|, or |kInvalidArg| when |settings|
+  // are not enabled or the kind is unknown.
+  int Init(const TextTrackSettings& settings);
+
+  // Opens |TextTrackSettings::input_file| and starts reading it, when set.
+  // Returns |kOpenFailed| when the file cannot be opened.
+  int Run();
+
+  // Stops the reader thread.
+  void Stop();
+
+  // Queues |cue|, ordered by start time. Returns false, and counts a dropped
+  // cue, when |TextTrackSettings::kMaxQueuedCues| cues are waiting or |cue|
+  // is empty. Thread safe.
+  bool AddCue(const TextCue& cue);
+
+  // Moves the oldest cue due by |timestamp|, in milliseconds, to |ptr_cue|
+  // and returns true. A |TextCue::kStartNow| cue starts at |timestamp|.
+  // Returns false when no cue is due.
+  bool ReadDueCue(int64 timestamp, TextCue* ptr_cue);
+
+  // Counts a cue written by the muxer; |late| when it was written after its
+  // start time.
+  void NoteCueWritten(bool late);
+
+  // Copies the counters to |ptr_stats|. Thread safe.
+  void GetStats(TextTrackStats* ptr_stats) const;
+
+ private:
+  // Reader thread function: parses |ptr_file_| until it ends or |Stop()|.
+  void ReaderThread();
+
+  // Parses the WebVTT block in |block|, one line per entry, and queues its
+  // cue. Header, NOTE, STYLE and REGION blocks are skipped.
+  void ParseBlock(const std::deque<std::string>& block);
+
+  TextTrackSettings settings_;
+  FILE* ptr_file_;
+  std::unique_ptr<std::thread> reader_thread_;
+
+  // Cues waiting to be muxed, and the counters. Protected by |mutex_|.
+  std::deque<TextCue> cues_;
+  TextTrackStats stats_;
+  bool stop_;
+  mutable std::mutex mutex_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(TextTrackSource);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_TEXT_TRACK_H_
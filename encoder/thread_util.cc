@@ -0,0 +1,314 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/thread_util.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <avrt.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#endif
+
+#include "encoder/allocation_tracker.h"
+#include "glog/logging.h"
+
+namespace {
+
+struct PriorityName {
+  const char* name;
+  webmlive::ThreadPriority priority;
+};
+
+const PriorityName kPriorityNames[] = {
+  { "idle", webmlive::kThreadPriorityIdle },
+  { "lowest", webmlive::kThreadPriorityLowest },
+  { "below_normal", webmlive::kThreadPriorityBelowNormal },
+  { "normal", webmlive::kThreadPriorityNormal },
+  { "above_normal", webmlive::kThreadPriorityAboveNormal },
+  { "highest", webmlive::kThreadPriorityHighest },
+  { "time_critical", webmlive::kThreadPriorityTimeCritical },
+};
+
+// Returns |name| without its trailing digits.
+std::string strip_index(const std::string& name) {
+  size_t length = name.length();
+  while (length > 0 && name[length - 1] >= '0' && name[length - 1] <= '9') {
+    --length;
+  }
+  return name.substr(0, length);
+}
+
+#ifdef _WIN32
+// |SetThreadDescription()| is missing before Windows 10 version 1607, and is
+// looked up at run time.
+typedef HRESULT (WINAPI* SetThreadDescriptionFunc)(HANDLE, PCWSTR);
+
+std::wstring string_to_wstring(const std::string& str) {
+  return std::wstring(str.begin(), str.end());
+}
+
+int windows_priority(webmlive::ThreadPriority priority) {
+  switch (priority) {
+    case webmlive::kThreadPriorityIdle:
+      return THREAD_PRIORITY_IDLE;
+    case webmlive::kThreadPriorityLowest:
+      return THREAD_PRIORITY_LOWEST;
+    case webmlive::kThreadPriorityBelowNormal:
+      return THREAD_PRIORITY_BELOW_NORMAL;
+    case webmlive::kThreadPriorityAboveNormal:
+      return THREAD_PRIORITY_ABOVE_NORMAL;
+    case webmlive::kThreadPriorityHighest:
+      return THREAD_PRIORITY_HIGHEST;
+    case webmlive::kThreadPriorityTimeCritical:
+      return THREAD_PRIORITY_TIME_CRITICAL;
+    default:
+      return THREAD_PRIORITY_NORMAL;
+  }
+}
+
+// Returns |file_time|, in 100 nanosecond units, in microseconds.
+int64 file_time_us(const FILETIME& file_time) {
+  ULARGE_INTEGER time;
+  time.LowPart = file_time.dwLowDateTime;
+  time.HighPart = file_time.dwHighDateTime;
+  return static_cast<int64>(time.QuadPart / 10);
+}
+#endif  // _WIN32
+
+}  // anonymous namespace
+
+namespace webmlive {
+
+bool ParseThreadPriority(const std::string& name,
+                         ThreadPriority* ptr_priority) {
+  const int kNumNames = sizeof(kPriorityNames) / sizeof(kPriorityNames[0]);
+  for (int i = 0; i < kNumNames; ++i) {
+    if (name == kPriorityNames[i].name) {
+      *ptr_priority = kPriorityNames[i].priority;
+      return true;
+    }
+  }
+  return false;
+}
+
+ThreadRegistry::ThreadRegistry()
+    : next_id_(0), default_numa_node_(NumaTopology::kNoNode) {
+}
+
+ThreadRegistry::~ThreadRegistry() {
+#ifdef _WIN32
+  for (ThreadMap::iterator iter = threads_.begin(); iter != threads_.end();
+       ++iter) {
+    CloseHandle(iter->second.handle);
+  }
+#endif
+}
+
+ThreadRegistry* ThreadRegistry::Instance() {
+  static ThreadRegistry registry;
+  return &registry;
+}
+
+void ThreadRegistry::SetSettings(const std::string& name,
+                                 const ThreadSettings& settings) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  settings_[name] = settings;
+}
+
+void ThreadRegistry::set_default_numa_node(int node) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  default_numa_node_ = node;
+}
+
+int ThreadRegistry::default_numa_node() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return default_numa_node_;
+}
+
+int ThreadRegistry::Register(const std::string& name) {
+  Thread thread;
+  thread.name = name;
+#ifdef _WIN32
+  static const SetThreadDescriptionFunc set_thread_description =
+      reinterpret_cast<SetThreadDescriptionFunc>(GetProcAddress(
+          GetModuleHandleW(L"kernel32.dll"), "SetThreadDescription"));
+  if (set_thread_description) {
+    set_thread_description(GetCurrentThread(),
+                           string_to_wstring(name).c_str());
+  }
+  HANDLE handle = NULL;
+  if (!DuplicateHandle(GetCurrentProcess(), GetCurrentThread(),
+                       GetCurrentProcess(), &handle,
+                       THREAD_QUERY_LIMITED_INFORMATION, FALSE, 0)) {
+    LOG(WARNING) << "cannot account for CPU use of thread " << name;
+  }
+  thread.handle = handle;
+#elif defined(__linux__)
+  // Linux limits thread names to 15 characters.
+  pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
+#endif
+
+  ThreadSettings settings;
+  bool have_settings = false;
+  int id = 0;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const ThreadSettings* const ptr_settings = FindSettings(name);
+    if (ptr_settings) {
+      settings = *ptr_settings;
+      have_settings = true;
+    }
+    if (settings.affinity_mask == 0 &&
+        settings.numa_node == NumaTopology::kNoNode &&
+        default_numa_node_ != NumaTopology::kNoNode) {
+      settings.numa_node = default_numa_node_;
+      have_settings = true;
+    }
+    id = next_id_++;
+  }
+  if (have_settings) {
+    ApplySettings(settings, &thread);
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    threads_[id] = thread;
+  }
+  AllocationTracker::TrackThread(name);
+  return id;
+}
+
+void ThreadRegistry::Unregister(int id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  ThreadMap::iterator iter = threads_.find(id);
+  if (iter == threads_.end()) {
+    LOG(ERROR) << "unregistering unknown thread " << id;
+    return;
+  }
+  Thread& thread = iter->second;
+  ThreadCpuStats& totals = exited_[thread.name];
+  totals.name = thread.name;
+  ++totals.threads;
+  AddCpuUse(thread.handle, &totals);
+#ifdef _WIN32
+  if (thread.mmcss_handle && !AvRevertMmThreadCharacteristics(
+                                 static_cast<HANDLE>(thread.mmcss_handle))) {
+    LOG(WARNING) << "cannot leave MMCSS task, thread " << thread.name;
+  }
+  if (thread.handle) {
+    CloseHandle(thread.handle);
+  }
+#endif
+  threads_.erase(iter);
+}
+
+void ThreadRegistry::RegisterSystemThread(const char* name) {
+  thread_local bool registered = false;
+  if (!registered) {
+    registered = true;
+    Instance()->Register(name);
+  }
+}
+
+void ThreadRegistry::GetCpuStats(std::vector<ThreadCpuStats>* ptr_stats) {
+  CpuStatsMap stats_by_name;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_by_name = exited_;
+    for (ThreadMap::const_iterator iter = threads_.begin();
+         iter != threads_.end(); ++iter) {
+      ThreadCpuStats& stats = stats_by_name[iter->second.name];
+      stats.name = iter->second.name;
+      ++stats.threads;
+      ++stats.running;
+      AddCpuUse(iter->second.handle, &stats);
+    }
+  }
+  ptr_stats->clear();
+  for (CpuStatsMap::const_iterator iter = stats_by_name.begin();
+       iter != stats_by_name.end(); ++iter) {
+    ptr_stats->push_back(iter->second);
+  }
+}
+
+const ThreadSettings* ThreadRegistry::FindSettings(
+    const std::string& name) const {
+  SettingsMap::const_iterator iter = settings_.find(name);
+  if (iter == settings_.end()) {
+    iter = settings_.find(strip_index(name));
+  }
+  return iter == settings_.end() ? NULL : &iter->second;
+}
+
+void ThreadRegistry::ApplySettings(const ThreadSettings& settings,
+                                   Thread* ptr_thread) {
+  const std::string& name = ptr_thread->name;
+#ifdef _WIN32
+  if (settings.affinity_mask &&
+      !SetThreadAffinityMask(GetCurrentThread(),
+                             static_cast<DWORD_PTR>(settings.affinity_mask))) {
+    LOG(WARNING) << "cannot set affinity mask 0x" << std::hex
+                 << settings.affinity_mask << std::dec << " of thread "
+                 << name << ", error " << GetLastError();
+  }
+  if (!settings.affinity_mask &&
+      settings.numa_node != NumaTopology::kNoNode &&
+      !NumaTopology::Instance()->RunOnNode(settings.numa_node)) {
+    LOG(WARNING) << "thread " << name << " is not placed on NUMA node "
+                 << settings.numa_node;
+  }
+  if (!settings.mmcss_task.empty()) {
+    DWORD task_index = 0;
+    const HANDLE mmcss_handle = AvSetMmThreadCharacteristicsW(
+        string_to_wstring(settings.mmcss_task).c_str(), &task_index);
+    if (mmcss_handle) {
+      ptr_thread->mmcss_handle = mmcss_handle;
+      LOG(INFO) << "thread " << name << " joined MMCSS task "
+                << settings.mmcss_task;
+      return;
+    }
+    LOG(WARNING) << "cannot join MMCSS task " << settings.mmcss_task
+                 << ", thread " << name << ", error " << GetLastError();
+  }
+  if (settings.priority != kThreadPriorityDefault &&
+      !SetThreadPriority(GetCurrentThread(),
+                         windows_priority(settings.priority))) {
+    LOG(WARNING) << "cannot set priority of thread " << name << ", error "
+                 << GetLastError();
+  }
+#else
+  // Other platforms report a single node, which every thread runs on.
+  if (settings.affinity_mask || !settings.mmcss_task.empty() ||
+      settings.priority != kThreadPriorityDefault) {
+    LOG(WARNING) << "thread settings are not supported on this platform, "
+                 << "thread " << name;
+  }
+#endif
+}
+
+void ThreadRegistry::AddCpuUse(void* handle, ThreadCpuStats* ptr_stats) {
+#ifdef _WIN32
+  if (!handle) {
+    return;
+  }
+  ULONG64 cycles = 0;
+  if (QueryThreadCycleTime(static_cast<HANDLE>(handle), &cycles)) {
+    ptr_stats->cycles += cycles;
+  }
+  FILETIME creation_time, exit_time, kernel_time, user_time;
+  if (GetThreadTimes(static_cast<HANDLE>(handle), &creation_time, &exit_time,
+                     &kernel_time, &user_time)) {
+    ptr_stats->cpu_time_us +=
+        file_time_us(kernel_time) + file_time_us(user_time);
+  }
+#else
+  (void)handle;
+  (void)ptr_stats;
+#endif
+}
+
+}  // namespace webmlive
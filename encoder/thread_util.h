@@ -0,0 +1,181 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_THREAD_UTIL_H_
+#define WEBMLIVE_ENCODER_THREAD_UTIL_H_
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+#include "encoder/numa_topology.h"
+
+namespace webmlive {
+
+enum ThreadPriority {
+  // Leave the priority the thread was created with.
+  kThreadPriorityDefault = 0,
+
+  kThreadPriorityIdle = 1,
+  kThreadPriorityLowest = 2,
+  kThreadPriorityBelowNormal = 3,
+  kThreadPriorityNormal = 4,
+  kThreadPriorityAboveNormal = 5,
+  kThreadPriorityHighest = 6,
+  kThreadPriorityTimeCritical = 7,
+};
+
+// Parses |name|, one of idle, lowest, below_normal, normal, above_normal,
+// highest or time_critical, into |ptr_priority|. Returns false when |name| is
+// none of them.
+bool ParseThreadPriority(const std::string& name, ThreadPriority* ptr_priority);
+
+struct ThreadSettings {
+  ThreadSettings()
+      : priority(kThreadPriorityDefault),
+        affinity_mask(0),
+        numa_node(NumaTopology::kNoNode) {}
+
+  // Scheduling priority of the thread.
+  ThreadPriority priority;
+
+  // Processors the thread may run on, one bit per processor. 0 leaves the
+  // thread on all processors of the process.
+  uint64 affinity_mask;
+
+  // NUMA node whose processors the thread runs on, or
+  // |NumaTopology::kNoNode|. Ignored when |affinity_mask| is set.
+  int numa_node;
+
+  // Multimedia Class Scheduler Service task the thread joins, for example
+  // "Capture" or "Pro Audio". Empty leaves the thread out of MMCSS. MMCSS
+  // raises the priority of the thread itself, so |priority| is not applied
+  // to a thread in an MMCSS task.
+  std::string mmcss_task;
+};
+
+// CPU use of the threads registered with one name.
+struct ThreadCpuStats {
+  ThreadCpuStats() : threads(0), running(0), cycles(0), cpu_time_us(0) {}
+
+  std::string name;
+
+  // Threads registered with |name|, and those still registered.
+  int threads;
+  int running;
+
+  // CPU cycles charged to the threads, from |QueryThreadCycleTime()|, and
+  // their user and kernel time in microseconds.
+  uint64 cycles;
+  int64 cpu_time_us;
+};
+
+// Names the encoder's threads, applies the |ThreadSettings| configured for
+// them, and accounts for their CPU use.
+//
+// Settings are looked up by the thread name, then by the thread name without
+// trailing digits: settings for "converter" apply to "converter0" and
+// "converter1" unless those have settings of their own. Threads whose
+// settings name neither processors nor a node run on the default NUMA node,
+// when one is set.
+//
+// Notes:
+// - Settings apply to threads registered after |SetSettings()|; configure all
+//   threads before the encoder is started.
+// - Threads that exit keep counting in |GetCpuStats()|, under their name.
+class ThreadRegistry {
+ public:
+  static ThreadRegistry* Instance();
+
+  // Stores |settings| for threads named |name|. Thread safe.
+  void SetSettings(const std::string& name, const ThreadSettings& settings);
+
+  // Places threads without a node or affinity of their own on |node|, the
+  // node of the channel. |NumaTopology::kNoNode| leaves them unplaced. Thread
+  // safe.
+  void set_default_numa_node(int node);
+  int default_numa_node();
+
+  // Names the calling thread |name|, applies its settings, and starts
+  // accounting for its CPU use. Returns an ID for |Unregister()|. Thread
+  // safe. Use |ScopedThreadRegistration|, or |RegisterSystemThread()| for
+  // threads not created by the encoder.
+  int Register(const std::string& name);
+
+  // Leaves the MMCSS task joined by |Register()|, and adds the CPU use of
+  // the thread to the totals of its name. Must be called from the thread
+  // registered as |id|.
+  void Unregister(int id);
+
+  // Registers the calling thread as |name| on its first call from the thread,
+  // and does nothing after. For threads owned by the system, such as the
+  // DirectShow streaming threads, that call into the encoder repeatedly and
+  // are never unregistered.
+  static void RegisterSystemThread(const char* name);
+
+  // Replaces the contents of |ptr_stats| with the CPU use of all threads
+  // registered so far, by name, in name order. Thread safe.
+  void GetCpuStats(std::vector<ThreadCpuStats>* ptr_stats);
+
+ private:
+  struct Thread {
+    Thread() : handle(NULL), mmcss_handle(NULL) {}
+    std::string name;
+
+    // Duplicated handle of the thread, kept open while it is registered, and
+    // the handle returned when it joined an MMCSS task.
+    void* handle;
+    void* mmcss_handle;
+  };
+  typedef std::map<int, Thread> ThreadMap;
+  typedef std::map<std::string, ThreadSettings> SettingsMap;
+  typedef std::map<std::string, ThreadCpuStats> CpuStatsMap;
+
+  ThreadRegistry();
+  ~ThreadRegistry();
+
+  // Returns the settings for |name|, or NULL when there are none. Must be
+  // called with |mutex_| held.
+  const ThreadSettings* FindSettings(const std::string& name) const;
+
+  // Applies |settings| to the calling thread, and stores the MMCSS handle in
+  // |ptr_thread|.
+  void ApplySettings(const ThreadSettings& settings, Thread* ptr_thread);
+
+  // Adds the CPU use of the thread with |handle| to |ptr_stats|.
+  static void AddCpuUse(void* handle, ThreadCpuStats* ptr_stats);
+
+  // Settings, registered threads and the totals of unregistered threads by
+  // name, protected by |mutex_|.
+  SettingsMap settings_;
+  ThreadMap threads_;
+  CpuStatsMap exited_;
+  int next_id_;
+  int default_numa_node_;
+  std::mutex mutex_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(ThreadRegistry);
+};
+
+// Registers the calling thread with |ThreadRegistry| for its lifetime. Put
+// one at the top of each thread function.
+class ScopedThreadRegistration {
+ public:
+  explicit ScopedThreadRegistration(const std::string& name)
+      : id_(ThreadRegistry::Instance()->Register(name)) {}
+  ~ScopedThreadRegistration() { ThreadRegistry::Instance()->Unregister(id_); }
+
+ private:
+  const int id_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(ScopedThreadRegistration);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_THREAD_UTIL_H_
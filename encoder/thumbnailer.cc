@@ -0,0 +1,310 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+
+#if defined _MSC_VER
+// Disable warning C4505(unreferenced local function has been removed) in MSVC,
+// emitted for vp8cx.h.
+#pragma warning(disable:4505)
+#endif
+#include "encoder/thumbnailer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include "encoder/thread_util.h"
+#include "glog/logging.h"
+#include "libvpx/vpx/vp8cx.h"
+
+namespace webmlive {
+
+namespace {
+
+// Largest VP8 quantizer index.
+const int kMaxQuantizer = 63;
+
+// Sizes of the RIFF and "VP8 " chunk headers of a simple lossy WebP file.
+const int kRiffHeaderSize = 12;
+const int kChunkHeaderSize = 8;
+
+// Appends |value| to |ptr_data| in little endian byte order.
+void AppendLe32(uint32 value, WebmChunk::Data* ptr_data) {
+  for (int i = 0; i < 4; ++i) {
+    ptr_data->push_back(static_cast<uint8>(value >> (8 * i)));
+  }
+}
+
+// Appends the four character code |fourcc| to |ptr_data|.
+void AppendFourcc(const char* fourcc, WebmChunk::Data* ptr_data) {
+  ptr_data->insert(ptr_data->end(), fourcc, fourcc + 4);
+}
+
+}  // namespace
+
+const char Thumbnailer::kThumbnailId[] = "thumbnail.webp";
+
+Thumbnailer::Thumbnailer()
+    : next_timestamp_(0),
+      codec_ready_(false),
+      codec_width_(0),
+      codec_height_(0),
+      frame_count_(0),
+      busy_(false),
+      stop_(false) {
+  memset(&vpx_context_, 0, sizeof(vpx_context_));
+}
+
+Thumbnailer::~Thumbnailer() {
+  Stop();
+  if (codec_ready_) {
+    vpx_codec_destroy(&vpx_context_);
+  }
+}
+
+int Thumbnailer::Init(const ThumbnailSettings& settings) {
+  if (settings.interval <= 0 || settings.width < 2 || settings.quality < 0 ||
+      settings.quality > 100) {
+    LOG(ERROR) << "invalid thumbnail settings.";
+    return kInvalidArg;
+  }
+  settings_ = settings;
+  return kSuccess;
+}
+
+int Thumbnailer::Run() {
+  if (settings_.interval <= 0 || worker_thread_) {
+    LOG(ERROR) << "thumbnailer not initialized, or already running.";
+    return kRunFailed;
+  }
+  stop_ = false;
+  worker_thread_.reset(
+      new (std::nothrow) std::thread(  // NOLINT
+          &Thumbnailer::WorkerThread, this));
+  if (!worker_thread_) {
+    LOG(ERROR) << "cannot construct thumbnail thread.";
+    return kRunFailed;
+  }
+  return kSuccess;
+}
+
+void Thumbnailer::Stop() {
+  if (!worker_thread_) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  frame_ready_.notify_one();
+  worker_thread_->join();
+  worker_thread_.reset();
+  frame_.Reset();
+}
+
+bool Thumbnailer::Due(int64 timestamp) const {
+  return worker_thread_ && timestamp >= next_timestamp_;
+}
+
+bool Thumbnailer::SubmitFrame(const SharedVideoFrame& frame) {
+  if (frame.empty()) {
+    return false;
+  }
+  // Thumbnails keep their cadence when one is skipped.
+  next_timestamp_ = frame->timestamp() + settings_.interval;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (busy_) {
+      ++stats_.thumbnails_skipped;
+      return false;
+    }
+    frame_ = frame;
+    busy_ = true;
+  }
+  frame_ready_.notify_one();
+  return true;
+}
+
+bool Thumbnailer::ReadThumbnail(SharedWebmChunk* ptr_chunk) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!thumbnail_) {
+    return false;
+  }
+  *ptr_chunk = thumbnail_;
+  thumbnail_.reset();
+  return true;
+}
+
+void Thumbnailer::GetStats(ThumbnailStats* ptr_stats) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  *ptr_stats = stats_;
+}
+
+void Thumbnailer::WorkerThread() {
+  ScopedThreadRegistration registration("thumbnail");
+  for (;;) {
+    SharedVideoFrame frame;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      frame_ready_.wait(lock, [this] { return stop_ || !frame_.empty(); });
+      if (stop_) {
+        break;
+      }
+      frame.Swap(&frame_);
+    }
+    const std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    SharedWebmChunk chunk;
+    const int status = EncodeThumbnail(*frame, &chunk);
+    frame.Reset();
+    const int64 time_us = std::chrono::duration_cast<
+        std::chrono::microseconds>(std::chrono::steady_clock::now() -
+                                   start).count();
+    if (status) {
+      LOG(ERROR) << "thumbnail encode failed: " << status;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    busy_ = false;
+    stats_.encode_time_us += time_us;
+    if (chunk) {
+      ++stats_.thumbnails_encoded;
+      stats_.thumbnail_bytes += chunk->length();
+      thumbnail_ = chunk;
+    }
+  }
+}
+
+int Thumbnailer::EncodeThumbnail(const VideoFrame& frame,
+                                 SharedWebmChunk* ptr_chunk) {
+  const VideoFrame* ptr_source = &frame;
+  if (frame.format() == kVideoFormatNV12) {
+    if (converted_frame_.InitConverted(frame)) {
+      return kEncoderError;
+    }
+    ptr_source = &converted_frame_;
+  }
+  const int32 source_height = abs(ptr_source->height());
+  int32 width = std::min(settings_.width, ptr_source->width()) & ~1;
+  int32 height = static_cast<int32>(
+      static_cast<int64>(width) * source_height / ptr_source->width()) & ~1;
+  if (width < 2 || height < 2) {
+    LOG(ERROR) << "frame too small for a thumbnail: " << ptr_source->width()
+               << "x" << source_height;
+    return kInvalidArg;
+  }
+  if (scaled_frame_.InitScaled(*ptr_source, width, height) ||
+      InitCodec(width, height)) {
+    return kEncoderError;
+  }
+
+  vpx_image_t vpx_image;
+  if (!vpx_img_wrap(&vpx_image, VPX_IMG_FMT_I420, width, height, 1,
+                    scaled_frame_.buffer())) {
+    LOG(ERROR) << "cannot wrap thumbnail frame for libvpx.";
+    return kEncoderError;
+  }
+  VideoPlanes planes;
+  VideoFrame::GetPlanes(scaled_frame_.config(), scaled_frame_.buffer(),
+                        &planes);
+  vpx_image.planes[VPX_PLANE_Y] = planes.data[0];
+  vpx_image.stride[VPX_PLANE_Y] = planes.stride[0];
+  vpx_image.planes[VPX_PLANE_U] = planes.data[1];
+  vpx_image.stride[VPX_PLANE_U] = planes.stride[1];
+  vpx_image.planes[VPX_PLANE_V] = planes.data[2];
+  vpx_image.stride[VPX_PLANE_V] = planes.stride[2];
+  if (vpx_codec_encode(&vpx_context_, &vpx_image, frame_count_++, 1,
+                       VPX_EFLAG_FORCE_KF, VPX_DL_GOOD_QUALITY)) {
+    LOG(ERROR) << "thumbnail vpx_codec_encode failed: "
+               << vpx_codec_error(&vpx_context_);
+    return kEncoderError;
+  }
+
+  // A simple lossy WebP file is a VP8 keyframe in a RIFF container.
+  vpx_codec_iter_t iter = NULL;
+  const vpx_codec_cx_pkt_t* pkt = NULL;
+  while ((pkt = vpx_codec_get_cx_data(&vpx_context_, &iter)) != NULL) {
+    if (pkt->kind != VPX_CODEC_CX_FRAME_PKT ||
+        !(pkt->data.frame.flags & VPX_FRAME_IS_KEY)) {
+      continue;
+    }
+    const uint32 frame_size = static_cast<uint32>(pkt->data.frame.sz);
+    const uint32 padding = frame_size & 1;
+    WebmChunk::Data data;
+    data.reserve(kRiffHeaderSize + kChunkHeaderSize + frame_size + padding);
+    AppendFourcc("RIFF", &data);
+    AppendLe32(4 + kChunkHeaderSize + frame_size + padding, &data);
+    AppendFourcc("WEBP", &data);
+    AppendFourcc("VP8 ", &data);
+    AppendLe32(frame_size, &data);
+    const uint8* const ptr_frame =
+        reinterpret_cast<const uint8*>(pkt->data.frame.buf);
+    data.insert(data.end(), ptr_frame, ptr_frame + frame_size);
+    if (padding) {
+      data.push_back(0);
+    }
+
+    WebmChunkDescriptor descriptor;
+    descriptor.length = static_cast<int32>(data.size());
+    descriptor.first_timestamp = frame.timestamp();
+    descriptor.last_timestamp = frame.timestamp();
+    descriptor.keyframe = true;
+    descriptor.block_count = 1;
+    ptr_chunk->reset(
+        new (std::nothrow) WebmChunk(kThumbnailId, descriptor, 0,  // NOLINT
+                                     &data, SharedWebmChunkDataPool()));
+    if (!*ptr_chunk) {
+      LOG(ERROR) << "out of memory.";
+      return kEncoderError;
+    }
+  }
+  return *ptr_chunk ? kSuccess : kEncoderError;
+}
+
+int Thumbnailer::InitCodec(int32 width, int32 height) {
+  if (codec_ready_) {
+    if (width == codec_width_ && height == codec_height_) {
+      return kSuccess;
+    }
+    vpx_codec_destroy(&vpx_context_);
+    codec_ready_ = false;
+  }
+  vpx_codec_enc_cfg_t libvpx_config;
+  if (vpx_codec_enc_config_default(vpx_codec_vp8_cx(), &libvpx_config, 0)) {
+    LOG(ERROR) << "thumbnail vpx_codec_enc_config_default failed.";
+    return kEncoderError;
+  }
+  // Every image is a keyframe at a fixed quantizer, encoded on one thread.
+  const int quantizer =
+      (100 - settings_.quality) * kMaxQuantizer / 100;
+  libvpx_config.g_w = width;
+  libvpx_config.g_h = height;
+  libvpx_config.g_threads = 1;
+  libvpx_config.g_lag_in_frames = 0;
+  libvpx_config.g_pass = VPX_RC_ONE_PASS;
+  libvpx_config.rc_end_usage = VPX_Q;
+  libvpx_config.rc_min_quantizer = quantizer;
+  libvpx_config.rc_max_quantizer = quantizer;
+  libvpx_config.kf_mode = VPX_KF_DISABLED;
+  if (vpx_codec_enc_init(&vpx_context_, vpx_codec_vp8_cx(), &libvpx_config,
+                         0)) {
+    LOG(ERROR) << "thumbnail vpx_codec_enc_init failed: "
+               << vpx_codec_error(&vpx_context_);
+    return kEncoderError;
+  }
+  codec_ready_ = true;
+  if (vpx_codec_control(&vpx_context_, VP8E_SET_CQ_LEVEL, quantizer)) {
+    LOG(ERROR) << "thumbnail vpx_codec_control (VP8E_SET_CQ_LEVEL) failed.";
+    return kEncoderError;
+  }
+  codec_width_ = width;
+  codec_height_ = height;
+  return kSuccess;
+}
+
+}  // namespace webmlive
@@ -0,0 +1,163 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_THUMBNAILER_H_
+#define WEBMLIVE_ENCODER_THUMBNAILER_H_
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+#include "encoder/shared_video_frame.h"
+#include "encoder/video_encoder.h"
+#include "encoder/webm_chunk.h"
+#include "libvpx/vpx/vpx_encoder.h"
+
+namespace webmlive {
+
+struct ThumbnailSettings {
+  static const int kDefaultWidth = 320;
+  static const int kDefaultQuality = 75;
+
+  ThumbnailSettings()
+      : interval(0), width(kDefaultWidth), quality(kDefaultQuality) {}
+
+  // Time between thumbnails, in milliseconds of stream time. 0, the default,
+  // disables thumbnails.
+  int interval;
+
+  // Thumbnail width; the height follows the aspect ratio of the frames. Both
+  // are rounded down to even numbers, and the width is capped at the frame
+  // width.
+  int width;
+
+  // Image quality, 0 to 100.
+  int quality;
+};
+
+struct ThumbnailStats {
+  ThumbnailStats()
+      : thumbnails_encoded(0), thumbnails_skipped(0), thumbnail_bytes(0),
+        encode_time_us(0) {}
+
+  // Thumbnails encoded, and those skipped because the previous one was
+  // still being encoded.
+  int64 thumbnails_encoded;
+  int64 thumbnails_skipped;
+
+  // Size of the thumbnails encoded, and the time spent scaling and encoding
+  // them, in microseconds.
+  int64 thumbnail_bytes;
+  int64 encode_time_us;
+};
+
+// Makes poster images of a video stream: every |ThumbnailSettings::interval|
+// milliseconds a reference to a raw frame is passed to a worker thread named
+// "thumbnail", which box filters it down to the thumbnail size and encodes
+// it as a lossy WebP image, a VP8 keyframe in a RIFF container. The newest
+// image is read back as a |SharedWebmChunk| identified by |kThumbnailId|,
+// for the data sink.
+//
+// The encoder thread only takes a frame reference and compares timestamps;
+// the worker sleeps between thumbnails. A frame arriving while the worker
+// is still busy is skipped.
+//
+// Notes:
+// - |Init()| must be called before any other method, and |Run()| starts the
+//   worker thread.
+// - |Due()| and |SubmitFrame()| must be called from one thread.
+class Thumbnailer {
+ public:
+  // Chunk id of the thumbnails.
+  static const char kThumbnailId[];
+
+  enum {
+    kEncoderError = -3,
+    kRunFailed = -2,
+    kInvalidArg = -1,
+    kSuccess = 0,
+  };
+
+  Thumbnailer();
+  ~Thumbnailer();
+
+  // Stores |settings|, and returns |kSuccess|, or |kInvalidArg| when the
+  // interval is not positive, or the width or quality is out of range.
+  int Init(const ThumbnailSettings& settings);
+
+  // Starts the worker thread.
+  int Run();
+
+  // Stops the worker thread after the thumbnail in progress, if any.
+  void Stop();
+
+  // Returns true when a thumbnail is due for a frame at |timestamp|, in
+  // milliseconds.
+  bool Due(int64 timestamp) const;
+
+  // Passes |frame|, an I420, YV12 or NV12 frame, to the worker, and makes
+  // the next thumbnail due an interval after it. Returns false, and counts
+  // a skipped thumbnail, when the worker is still busy.
+  bool SubmitFrame(const SharedVideoFrame& frame);
+
+  // Moves the newest thumbnail not read yet to |ptr_chunk|. Returns false
+  // when there is none.
+  bool ReadThumbnail(SharedWebmChunk* ptr_chunk);
+
+  // Copies the thumbnail counters to |ptr_stats|. Thread safe.
+  void GetStats(ThumbnailStats* ptr_stats) const;
+
+ private:
+  // Worker thread function.
+  void WorkerThread();
+
+  // Scales |frame| and encodes it into |ptr_chunk|. Returns |kSuccess| when
+  // successful.
+  int EncodeThumbnail(const VideoFrame& frame, SharedWebmChunk* ptr_chunk);
+
+  // Sets up |vpx_context_| for |width|x|height| images, unless it is set up
+  // for that size already.
+  int InitCodec(int32 width, int32 height);
+
+  ThumbnailSettings settings_;
+  std::unique_ptr<std::thread> worker_thread_;
+
+  // Timestamp from which the next thumbnail is due. Used only by the
+  // submitting thread.
+  int64 next_timestamp_;
+
+  // Used only by the worker thread: the VP8 encoder and its image size, the
+  // frame converted to I420 when submitted as NV12, the scaled frame, and
+  // the number of images encoded.
+  vpx_codec_ctx_t vpx_context_;
+  bool codec_ready_;
+  int32 codec_width_;
+  int32 codec_height_;
+  VideoFrame converted_frame_;
+  VideoFrame scaled_frame_;
+  int64 frame_count_;
+
+  // Frame waiting for the worker, or being encoded by it, the newest
+  // thumbnail not read yet, and the counters. Protected by |mutex_|.
+  SharedVideoFrame frame_;
+  bool busy_;
+  SharedWebmChunk thumbnail_;
+  ThumbnailStats stats_;
+
+  bool stop_;
+  mutable std::mutex mutex_;
+  std::condition_variable frame_ready_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(Thumbnailer);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_THUMBNAILER_H_
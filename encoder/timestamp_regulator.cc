@@ -0,0 +1,109 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/timestamp_regulator.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace webmlive {
+
+namespace {
+
+// Loop gains: the fraction of each input's deviation applied to the output
+// phase, and to the rate estimate per nominal period. A rate gain of half
+// the square of the phase gain critically damps the loop, which settles in
+// roughly 20 inputs and passes a tenth of the input jitter to the output.
+const double kPhaseGain = 0.1;
+const double kRateGain = kPhaseGain * kPhaseGain / 2;
+
+// Bounds of the rate estimate. A capture clock outside them is treated as
+// running at the bound.
+const double kMinRate = 0.5;
+const double kMaxRate = 2.0;
+
+// Weight of a new deviation in the smoothed jitter.
+const double kJitterGain = 1.0 / 16;
+
+}  // namespace
+
+TimestampRegulator::TimestampRegulator()
+    : initialized_(false),
+      rate_(1.0),
+      last_period_(0),
+      predicted_(0),
+      last_input_(0),
+      last_output_(0) {
+}
+
+int64 TimestampRegulator::Regulate(int64 timestamp, double period,
+                                   int64* ptr_duration) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (period > 0) {
+    last_period_ = period;
+  }
+  period = last_period_;
+  const double estimated_period = rate_ * period;
+  ++stats_.inputs;
+  double output = static_cast<double>(timestamp);
+  double error = timestamp - predicted_;
+  if (!initialized_ || period <= 0 ||
+      std::fabs(error) > kResyncThreshold) {
+    // First input, no period to track, or a discontinuity: start over from
+    // the input timestamp.
+    if (initialized_ && period > 0) {
+      ++stats_.resyncs;
+    }
+    initialized_ = true;
+  } else if (timestamp <= last_input_) {
+    // A repeated timestamp carries no phase information; continue at the
+    // estimated period.
+    ++stats_.duplicates;
+    output = predicted_;
+  } else {
+    // Inputs a whole number of periods late follow inputs the source never
+    // delivered.
+    const double missing = std::floor(error / estimated_period + 0.5);
+    if (missing >= 1) {
+      stats_.skips += static_cast<int64>(missing);
+      predicted_ += missing * estimated_period;
+      error -= missing * estimated_period;
+    }
+    output = predicted_ + kPhaseGain * error;
+    rate_ = std::min(kMaxRate,
+                     std::max(kMinRate, rate_ + kRateGain * error / period));
+    const double deviation = std::fabs(error);
+    stats_.jitter_ms += (deviation - stats_.jitter_ms) * kJitterGain;
+    stats_.max_jitter_ms = std::max(stats_.max_jitter_ms, deviation);
+  }
+
+  int64 regulated = static_cast<int64>(std::floor(output + 0.5));
+  if (stats_.inputs > 1) {
+    regulated = std::max(regulated, last_output_ + 1);
+  }
+  const double next_period = rate_ * period;
+  if (ptr_duration) {
+    *ptr_duration = period <= 0 ? 0 :
+        std::max<int64>(1, static_cast<int64>(std::floor(next_period + 0.5)));
+  }
+  predicted_ = output + next_period;
+  last_input_ = timestamp;
+  last_output_ = regulated;
+  stats_.drift_ppm = (rate_ - 1.0) * 1000000.0;
+  stats_.period_ms = next_period;
+  stats_.offset_ms = regulated - timestamp;
+  return regulated;
+}
+
+void TimestampRegulator::GetStats(TimestampRegulatorStats* ptr_stats) const {
+  if (ptr_stats) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    *ptr_stats = stats_;
+  }
+}
+
+}  // namespace webmlive
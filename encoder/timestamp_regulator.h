@@ -0,0 +1,104 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_TIMESTAMP_REGULATOR_H_
+#define WEBMLIVE_ENCODER_TIMESTAMP_REGULATOR_H_
+
+#include <mutex>
+
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+
+namespace webmlive {
+
+struct TimestampRegulatorStats {
+  TimestampRegulatorStats()
+      : inputs(0), duplicates(0), skips(0), resyncs(0), jitter_ms(0),
+        max_jitter_ms(0), drift_ppm(0), period_ms(0), offset_ms(0) {}
+
+  // Timestamps regulated.
+  int64 inputs;
+
+  // Inputs whose timestamps did not advance, and inputs missing from the
+  // capture source: gaps of whole periods.
+  int64 duplicates;
+  int64 skips;
+
+  // Discontinuities too large to track, after which the regulator restarted
+  // from the input timestamp.
+  int64 resyncs;
+
+  // Mean and largest deviation of input timestamps from the predicted ones,
+  // in milliseconds. The mean is smoothed like RFC 3550 interarrival jitter.
+  double jitter_ms;
+  double max_jitter_ms;
+
+  // Deviation of the estimated period from the nominal one, in parts per
+  // million, and the estimated period.
+  double drift_ppm;
+  double period_ms;
+
+  // Last output timestamp minus its input timestamp.
+  int64 offset_ms;
+};
+
+// Smooths capture timestamps with a second order phase locked loop. The loop
+// predicts each input timestamp from the previous output and an estimate of
+// the true input period, then moves the output, and the period estimate, a
+// fraction of the way toward the input. Outputs are strictly increasing;
+// durations are the estimated period.
+//
+// The nominal period of each input is passed to |Regulate()|: the frame
+// period for video, or the duration of the samples for audio. The period
+// estimate is kept as the ratio of the true period to the nominal one, so
+// inputs of varying length share one clock drift estimate.
+//
+// Notes:
+// - |Regulate()| is not reentrant; each stream has its own regulator.
+// - |GetStats()| may be called from any thread.
+class TimestampRegulator {
+ public:
+  // Input time deviation, in milliseconds, beyond which the regulator
+  // restarts from the input timestamp.
+  static const int kResyncThreshold = 1000;
+
+  TimestampRegulator();
+  ~TimestampRegulator() {}
+
+  // Returns the regulated timestamp for an input captured at |timestamp|
+  // with a nominal period of |period| milliseconds, and stores the regulated
+  // duration in |ptr_duration|. Non-positive |period|s use the period of
+  // previous inputs. Until an input has a period, timestamps are only made
+  // increasing, and the duration stored is 0.
+  int64 Regulate(int64 timestamp, double period, int64* ptr_duration);
+
+  // Copies the current stats to |ptr_stats|.
+  void GetStats(TimestampRegulatorStats* ptr_stats) const;
+
+ private:
+  bool initialized_;
+
+  // Estimated true period divided by the nominal period.
+  double rate_;
+
+  // Nominal period of the last input with one, used for inputs without one.
+  double last_period_;
+
+  // Predicted time of the next input, and the last input and output
+  // timestamps.
+  double predicted_;
+  int64 last_input_;
+  int64 last_output_;
+
+  TimestampRegulatorStats stats_;
+  mutable std::mutex mutex_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(TimestampRegulator);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_TIMESTAMP_REGULATOR_H_
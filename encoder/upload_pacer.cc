@@ -0,0 +1,82 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/upload_pacer.h"
+
+#include <algorithm>
+
+namespace webmlive {
+
+namespace {
+
+// Shortest burst allowance, in milliseconds at the rate. Tokens accrued
+// between two wakes of the upload thread must fit in the bucket.
+const int kMinBurstMs = 10;
+
+}  // namespace
+
+UploadPacer::UploadPacer()
+    : kbps_(0),
+      tokens_(0),
+      max_tokens_(0),
+      refill_time_(std::chrono::steady_clock::now()) {
+}
+
+UploadPacer* UploadPacer::Instance() {
+  static UploadPacer pacer;
+  return &pacer;
+}
+
+void UploadPacer::SetRate(int kbps, int burst_ms) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Refill();
+  kbps_ = std::max(kbps, 0);
+  // Kilobits per second are bytes per 8 milliseconds.
+  max_tokens_ = kbps_ * std::max(burst_ms, kMinBurstMs) / 8.0;
+  tokens_ = std::min(tokens_, max_tokens_);
+}
+
+int64 UploadPacer::Take(int64 bytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (kbps_ == 0) {
+    return bytes;
+  }
+  Refill();
+  const int64 taken = std::min(bytes, static_cast<int64>(tokens_));
+  tokens_ -= taken;
+  return taken;
+}
+
+void UploadPacer::Return(int64 bytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  tokens_ = std::min(tokens_ + bytes, max_tokens_);
+}
+
+bool UploadPacer::Available(int64 bytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (kbps_ == 0) {
+    return true;
+  }
+  Refill();
+  return tokens_ >= std::min<double>(bytes, max_tokens_);
+}
+
+int UploadPacer::kbps() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return kbps_;
+}
+
+void UploadPacer::Refill() {
+  const std::chrono::steady_clock::time_point now =
+      std::chrono::steady_clock::now();
+  const double elapsed_ms =
+      std::chrono::duration<double, std::milli>(now - refill_time_).count();
+  refill_time_ = now;
+  tokens_ = std::min(tokens_ + elapsed_ms * kbps_ / 8.0, max_tokens_);
+}
+
+}  // namespace webmlive
@@ -0,0 +1,78 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_UPLOAD_PACER_H_
+#define WEBMLIVE_ENCODER_UPLOAD_PACER_H_
+
+#include <chrono>
+#include <mutex>
+
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+
+namespace webmlive {
+
+// Token bucket that paces uploads to a send rate. Tokens, one per byte,
+// accrue at the rate up to the burst allowance; a sender takes tokens before
+// it sends, and waits while the bucket is empty. A keyframe segment many
+// times the size of the others then leaves at the rate instead of as fast as
+// TCP allows, after the allowance.
+//
+// Each |HttpUploader| paces with a pacer of its own, tied to its stream's
+// bitrate, and |Instance()| returns the pacer shared by all uploaders of the
+// process, which bounds their aggregate rate.
+//
+// Notes:
+// - A pacer with a rate of 0, the default, is unlimited.
+// - Thread safe.
+class UploadPacer {
+ public:
+  // Default burst allowance, as milliseconds of sending at the rate.
+  static const int kDefaultBurstMs = 200;
+
+  UploadPacer();
+  ~UploadPacer() {}
+
+  // Returns the pacer shared by the uploaders of the process.
+  static UploadPacer* Instance();
+
+  // Paces to |kbps| kilobits per second, with a burst allowance of
+  // |burst_ms| milliseconds at that rate, at least the rate of 10
+  // milliseconds. A |kbps| of 0 removes the limit. The bucket keeps its
+  // tokens, up to the new allowance.
+  void SetRate(int kbps, int burst_ms);
+
+  // Takes up to |bytes| tokens, and returns the number taken: |bytes| when
+  // unlimited, 0 when the bucket is empty.
+  int64 Take(int64 bytes);
+
+  // Puts back |bytes| tokens taken but not used.
+  void Return(int64 bytes);
+
+  // Returns true when |bytes| tokens are available, or the pacer is
+  // unlimited.
+  bool Available(int64 bytes);
+
+  // Rate, in kilobits per second; 0 when unlimited.
+  int kbps() const;
+
+ private:
+  // Accrues the tokens of the time elapsed since |refill_time_|. Must be
+  // called with |mutex_| held.
+  void Refill();
+
+  int kbps_;
+  double tokens_;
+  double max_tokens_;
+  std::chrono::steady_clock::time_point refill_time_;
+  mutable std::mutex mutex_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(UploadPacer);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_UPLOAD_PACER_H_
@@ -0,0 +1,706 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+//
+// Uploader benchmark. Runs |webmlive::HttpUploader| against an HTTP receiver
+// in the same process, which reads each request body and discards it, and
+// reports for each upload mode:
+// - requests per second, and MB/s of buffer data delivered,
+// - median, 90th and 99th percentile and largest request time: from the
+//   first byte of a request, or the connection that carries it, to the
+//   response, as the receiver sees it,
+// - connections opened by the uploader.
+// Modes are |HTTP_POST| and |HTTP_FORM_POST|, one request slot or
+// --uploads of them, with the receiver keeping connections alive or
+// closing each after its response. The receiver delays each new connection
+// and each response, and each 100 Continue, by --rtt milliseconds, standing
+// in for the round trips of a remote server. Used in place of
+// testing/webmstreamserver.py, which writes every body to disk, to measure
+// uploader changes.
+#include "encoder/encoder_base.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "encoder/http_uploader.h"
+#include "encoder/webm_chunk.h"
+#include "glog/logging.h"
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+#ifdef _WIN32
+typedef SOCKET Socket;
+typedef int SocketLength;
+const Socket kInvalidSocket = INVALID_SOCKET;
+const int kShutdownBoth = SD_BOTH;
+#else
+typedef int Socket;
+typedef socklen_t SocketLength;
+const Socket kInvalidSocket = -1;
+const int kShutdownBoth = SHUT_RDWR;
+#endif
+
+// Limit on the size of request headers, and of a chunked body's chunk size
+// line, in bytes.
+const size_t kMaxRequestLength = 8192;
+
+// Time |ListenerThread()| waits for a connection before checking |stop_|, in
+// milliseconds.
+const int kAcceptPollInterval = 200;
+
+// Longest wait for the requests of a case, on top of their injected round
+// trips, in milliseconds.
+const int kCaseTimeout = 60000;
+
+const char kHeaderEnd[] = "\r\n\r\n";
+const char kLineEnd[] = "\r\n";
+
+void CloseSocket(Socket socket) {
+#ifdef _WIN32
+  closesocket(socket);
+#else
+  close(socket);
+#endif
+}
+
+void SleepMs(int milliseconds) {
+  if (milliseconds > 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(milliseconds));
+  }
+}
+
+// Returns |str| in lower case.
+std::string ToLower(const std::string& str) {
+  std::string lower(str);
+  for (size_t i = 0; i < lower.length(); ++i) {
+    lower[i] =
+        static_cast<char>(tolower(static_cast<unsigned char>(lower[i])));
+  }
+  return lower;
+}
+
+// Returns the value of header |name|, in lower case, of the lower case
+// request headers |headers|, or an empty string. Header lines follow the
+// request line, so each starts after a line end.
+std::string HeaderValue(const std::string& headers, const char* name) {
+  const std::string field = std::string(kLineEnd) + name + ":";
+  const size_t start = headers.find(field);
+  if (start == std::string::npos) {
+    return std::string();
+  }
+  size_t value_start = start + field.length();
+  const size_t value_end = headers.find(kLineEnd, value_start);
+  while (value_start < value_end && headers[value_start] == ' ') {
+    ++value_start;
+  }
+  return headers.substr(value_start, value_end - value_start);
+}
+
+// HTTP receiver for |HttpUploader| requests. Answers each request with an
+// empty 200 response once its body has been read and discarded. Each
+// connection is served by its own thread.
+//
+// Notes:
+// - |Init| must be called before any other method.
+// - Bodies are accepted with a Content-Length or chunked transfer encoding,
+//   and an "Expect: 100-continue" request is answered with 100 Continue
+//   before its body is read.
+class UploadReceiver {
+ public:
+  UploadReceiver()
+      : rtt_ms_(0), keep_alive_(true), listen_socket_(kInvalidSocket),
+        port_(0), stop_(false), requests_(0), bytes_(0), connections_(0) {}
+  ~UploadReceiver() {
+    Stop();
+    if (listen_socket_ != kInvalidSocket) {
+      CloseSocket(listen_socket_);
+    }
+  }
+
+  // Listens on a loopback port chosen by the system. Connections and
+  // responses are delayed by |rtt_ms|, and closed after each response
+  // unless |keep_alive|. Returns false when the socket cannot be set up.
+  bool Init(int rtt_ms, bool keep_alive) {
+    rtt_ms_ = rtt_ms;
+    keep_alive_ = keep_alive;
+    listen_socket_ = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listen_socket_ == kInvalidSocket) {
+      LOG(ERROR) << "cannot create receiver socket.";
+      return false;
+    }
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = 0;
+    SocketLength address_length = sizeof(address);
+    if (bind(listen_socket_, reinterpret_cast<const sockaddr*>(&address),
+             sizeof(address)) ||
+        listen(listen_socket_, SOMAXCONN) ||
+        getsockname(listen_socket_, reinterpret_cast<sockaddr*>(&address),
+                    &address_length)) {
+      LOG(ERROR) << "cannot listen on a loopback port.";
+      return false;
+    }
+    port_ = ntohs(address.sin_port);
+    return true;
+  }
+
+  // Starts the listener thread.
+  bool Run() {
+    stop_ = false;
+    listener_thread_.reset(
+        new (std::nothrow) std::thread(  // NOLINT
+            &UploadReceiver::ListenerThread, this));
+    return listener_thread_ != NULL;
+  }
+
+  // Stops the listener and closes the connections.
+  void Stop() {
+    stop_ = true;
+    if (listener_thread_) {
+      listener_thread_->join();
+      listener_thread_.reset();
+    }
+    for (std::list<std::unique_ptr<Connection>>::iterator connection =
+             connections_list_.begin();
+         connection != connections_list_.end(); ++connection) {
+      // Unblocks the connection's read.
+      shutdown((*connection)->socket, kShutdownBoth);
+      (*connection)->thread.join();
+      CloseSocket((*connection)->socket);
+    }
+    connections_list_.clear();
+  }
+
+  // Waits up to |timeout_ms| for |count| requests with a body to be
+  // answered. Returns false on timeout.
+  bool WaitForRequests(int64 count, int timeout_ms) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return request_done_.wait_for(
+        lock, std::chrono::milliseconds(timeout_ms),
+        [this, count] { return requests_ >= count; });
+  }
+
+  int port() const { return port_; }
+
+  // Requests with a body answered, their body bytes, and connections
+  // accepted.
+  int64 requests() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return requests_;
+  }
+  int64 bytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return bytes_;
+  }
+  int64 connections() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return connections_;
+  }
+
+  // Copies the time of each request with a body, in microseconds.
+  void GetRequestTimes(std::vector<int64>* ptr_times) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    *ptr_times = request_us_;
+  }
+
+ private:
+  struct Connection {
+    Connection() : socket(kInvalidSocket), done(false) {}
+    Socket socket;
+    Clock::time_point accept_time;
+    std::atomic<bool> done;
+    std::thread thread;
+  };
+
+  void ListenerThread() {
+    while (!stop_) {
+      ReapConnections();
+      fd_set read_set;
+      FD_ZERO(&read_set);
+      FD_SET(listen_socket_, &read_set);
+      timeval timeout;
+      timeout.tv_sec = 0;
+      timeout.tv_usec = kAcceptPollInterval * 1000;
+      const int ready = select(static_cast<int>(listen_socket_) + 1,
+                               &read_set, NULL, NULL, &timeout);
+      if (ready <= 0) {
+        continue;
+      }
+      const Socket client_socket = accept(listen_socket_, NULL, NULL);
+      if (client_socket == kInvalidSocket) {
+        continue;
+      }
+      std::unique_ptr<Connection> connection(
+          new (std::nothrow) Connection());  // NOLINT
+      if (!connection) {
+        LOG(ERROR) << "out of memory.";
+        CloseSocket(client_socket);
+        continue;
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++connections_;
+      }
+      connection->socket = client_socket;
+      connection->accept_time = Clock::now();
+      connection->thread = std::thread(&UploadReceiver::ConnectionThread,
+                                       this, connection.get());
+      connections_list_.push_back(std::move(connection));
+    }
+  }
+
+  void ReapConnections() {
+    std::list<std::unique_ptr<Connection>>::iterator connection =
+        connections_list_.begin();
+    while (connection != connections_list_.end()) {
+      if ((*connection)->done) {
+        (*connection)->thread.join();
+        CloseSocket((*connection)->socket);
+        connection = connections_list_.erase(connection);
+      } else {
+        ++connection;
+      }
+    }
+  }
+
+  void ConnectionThread(Connection* ptr_connection) {
+    const Socket socket = ptr_connection->socket;
+    // The connection handshake.
+    SleepMs(rtt_ms_);
+    Clock::time_point start = ptr_connection->accept_time;
+    std::string buffer;
+    std::string request;
+    bool first_request = true;
+    bool open = true;
+    while (open && !stop_ &&
+           ReadRequest(socket, first_request, &buffer, &request, &start)) {
+      const std::string headers = ToLower(request);
+      const bool head = headers.compare(0, 5, "head ") == 0;
+      int64 body_bytes = 0;
+      if (!head) {
+        if (HeaderValue(headers, "expect") == "100-continue") {
+          SleepMs(rtt_ms_);
+          const char kContinue[] = "HTTP/1.1 100 Continue\r\n\r\n";
+          if (!SendAll(socket, kContinue, strlen(kContinue))) {
+            break;
+          }
+        }
+        const bool body_read =
+            HeaderValue(headers, "transfer-encoding") == "chunked" ?
+                DiscardChunkedBody(socket, &buffer, &body_bytes) :
+                DiscardBytes(socket, &buffer,
+                             strtoll(HeaderValue(headers,
+                                                 "content-length").c_str(),
+                                     NULL, 10),
+                             &body_bytes);
+        if (!body_read) {
+          break;
+        }
+      }
+      SleepMs(rtt_ms_);
+      std::string response = "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n";
+      if (!keep_alive_) {
+        response += "Connection: close\r\n";
+      }
+      response += kLineEnd;
+      if (!SendAll(socket, response.data(), response.length())) {
+        break;
+      }
+      if (!head) {
+        const int64 request_us =
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                Clock::now() - start).count();
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++requests_;
+        bytes_ += body_bytes;
+        request_us_.push_back(request_us);
+        request_done_.notify_all();
+      }
+      open = keep_alive_;
+      first_request = false;
+    }
+    ptr_connection->done = true;
+  }
+
+  // Reads the headers of the next request into |ptr_request|. Unless it is
+  // the |first_request| of its connection, whose time starts with the
+  // connection, sets |ptr_start| to the arrival of its first byte. Bytes
+  // read past the headers are kept in |ptr_buffer|.
+  static bool ReadRequest(Socket socket, bool first_request,
+                          std::string* ptr_buffer, std::string* ptr_request,
+                          Clock::time_point* ptr_start) {
+    bool started = first_request;
+    if (!started && !ptr_buffer->empty()) {
+      *ptr_start = Clock::now();
+      started = true;
+    }
+    size_t header_end = ptr_buffer->find(kHeaderEnd);
+    while (header_end == std::string::npos) {
+      if (ptr_buffer->length() > kMaxRequestLength) {
+        LOG(WARNING) << "request headers too long.";
+        return false;
+      }
+      const size_t search_start =
+          ptr_buffer->length() > 3 ? ptr_buffer->length() - 3 : 0;
+      if (!ReadMore(socket, ptr_buffer)) {
+        return false;
+      }
+      if (!started) {
+        *ptr_start = Clock::now();
+        started = true;
+      }
+      header_end = ptr_buffer->find(kHeaderEnd, search_start);
+    }
+    header_end += strlen(kHeaderEnd);
+    ptr_request->assign(*ptr_buffer, 0, header_end);
+    ptr_buffer->erase(0, header_end);
+    return true;
+  }
+
+  // Appends the next bytes received on |socket| to |ptr_buffer|.
+  static bool ReadMore(Socket socket, std::string* ptr_buffer) {
+    char data[4096];
+    const int bytes_read = recv(socket, data, sizeof(data), 0);
+    if (bytes_read <= 0) {
+      return false;
+    }
+    ptr_buffer->append(data, bytes_read);
+    return true;
+  }
+
+  // Reads and discards |length| body bytes, starting with those in
+  // |ptr_buffer|, and adds them to |ptr_body_bytes|. Nothing past the body
+  // is read from |socket|.
+  static bool DiscardBytes(Socket socket, std::string* ptr_buffer,
+                           int64 length, int64* ptr_body_bytes) {
+    if (length < 0) {
+      return false;
+    }
+    *ptr_body_bytes += length;
+    const size_t buffered =
+        static_cast<size_t>(std::min<int64>(length, ptr_buffer->length()));
+    ptr_buffer->erase(0, buffered);
+    length -= buffered;
+    char data[16 * 1024];
+    while (length > 0) {
+      const int bytes_read = recv(
+          socket, data,
+          static_cast<int>(std::min<int64>(length, sizeof(data))), 0);
+      if (bytes_read <= 0) {
+        return false;
+      }
+      length -= bytes_read;
+    }
+    return true;
+  }
+
+  // Reads the line at the start of |ptr_buffer| into |ptr_line|.
+  static bool ReadLine(Socket socket, std::string* ptr_buffer,
+                       std::string* ptr_line) {
+    size_t line_end = ptr_buffer->find(kLineEnd);
+    while (line_end == std::string::npos) {
+      if (ptr_buffer->length() > kMaxRequestLength ||
+          !ReadMore(socket, ptr_buffer)) {
+        return false;
+      }
+      line_end = ptr_buffer->find(kLineEnd);
+    }
+    ptr_line->assign(*ptr_buffer, 0, line_end);
+    ptr_buffer->erase(0, line_end + strlen(kLineEnd));
+    return true;
+  }
+
+  // Reads and discards a chunked body, and its trailers.
+  static bool DiscardChunkedBody(Socket socket, std::string* ptr_buffer,
+                                 int64* ptr_body_bytes) {
+    std::string line;
+    for (;;) {
+      if (!ReadLine(socket, ptr_buffer, &line)) {
+        return false;
+      }
+      const int64 chunk_length = strtoll(line.c_str(), NULL, 16);
+      if (chunk_length == 0) {
+        break;
+      }
+      if (!DiscardBytes(socket, ptr_buffer, chunk_length, ptr_body_bytes) ||
+          !ReadLine(socket, ptr_buffer, &line)) {
+        return false;
+      }
+    }
+    // Trailers end with an empty line.
+    do {
+      if (!ReadLine(socket, ptr_buffer, &line)) {
+        return false;
+      }
+    } while (!line.empty());
+    return true;
+  }
+
+  static bool SendAll(Socket socket, const char* ptr_data, size_t length) {
+#ifdef MSG_NOSIGNAL
+    const int kSendFlags = MSG_NOSIGNAL;
+#else
+    const int kSendFlags = 0;
+#endif
+    while (length > 0) {
+      const int bytes_sent =
+          send(socket, ptr_data, static_cast<int>(length), kSendFlags);
+      if (bytes_sent <= 0) {
+        return false;
+      }
+      ptr_data += bytes_sent;
+      length -= bytes_sent;
+    }
+    return true;
+  }
+
+  int rtt_ms_;
+  bool keep_alive_;
+  Socket listen_socket_;
+  int port_;
+  std::atomic<bool> stop_;
+  std::unique_ptr<std::thread> listener_thread_;
+
+  // Used only by |ListenerThread()|, and by |Stop()| once it has joined it.
+  std::list<std::unique_ptr<Connection>> connections_list_;
+
+  // Request counters and times. Protected by |mutex_|.
+  int64 requests_;
+  int64 bytes_;
+  int64 connections_;
+  std::vector<int64> request_us_;
+  mutable std::mutex mutex_;
+  std::condition_variable request_done_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(UploadReceiver);
+};
+
+// Upload mode of one benchmark case.
+struct BenchCase {
+  const char* name;
+  webmlive::UploadMode mode;
+  bool multi;
+  bool keep_alive;
+};
+
+const BenchCase kCases[] = {
+  {"post", webmlive::HTTP_POST, false, true},
+  {"post", webmlive::HTTP_POST, true, true},
+  {"post", webmlive::HTTP_POST, false, false},
+  {"post", webmlive::HTTP_POST, true, false},
+  {"form", webmlive::HTTP_FORM_POST, false, true},
+  {"form", webmlive::HTTP_FORM_POST, true, true},
+  {"form", webmlive::HTTP_FORM_POST, false, false},
+  {"form", webmlive::HTTP_FORM_POST, true, false},
+};
+const int kNumCases = sizeof(kCases) / sizeof(kCases[0]);
+
+// Benchmark parameters.
+struct BenchOptions {
+  BenchOptions()
+      : count(200), size(256 * 1024), rtt_ms(0),
+        uploads(webmlive::HttpUploaderSettings::kDefaultMaxUploads) {}
+  int count;
+  int size;
+  int rtt_ms;
+  int uploads;
+};
+
+// Returns the |percentile| percent time of |sorted_us|, in milliseconds.
+double percentile_ms(const std::vector<int64>& sorted_us, double percentile) {
+  if (sorted_us.empty()) {
+    return 0;
+  }
+  const size_t index = std::min(
+      sorted_us.size() - 1,
+      static_cast<size_t>(sorted_us.size() * percentile / 100));
+  return sorted_us[index] / 1000.0;
+}
+
+void print_header() {
+  printf("%-26s %9s %9s %9s %9s %9s %9s %6s\n", "case", "req/s", "MB/s",
+         "p50 ms", "p90 ms", "p99 ms", "max ms", "conns");
+}
+
+// Uploads |options.count| chunks of |options.size| bytes in the mode of
+// |bench_case|, and prints the results.
+void bench_case(const BenchCase& bench_case, const BenchOptions& options) {
+  const int uploads = bench_case.multi ? options.uploads : 1;
+  std::ostringstream name;
+  name << bench_case.name << " x" << uploads << " "
+       << (bench_case.keep_alive ? "keep-alive" : "close");
+
+  UploadReceiver receiver;
+  if (!receiver.Init(options.rtt_ms, bench_case.keep_alive) ||
+      !receiver.Run()) {
+    printf("%-26s failed\n", name.str().c_str());
+    return;
+  }
+  std::ostringstream url;
+  url << "http://127.0.0.1:" << receiver.port() << "/upload";
+  webmlive::HttpUploaderSettings settings;
+  settings.target_url = url.str();
+  settings.post_mode = bench_case.mode;
+  settings.max_uploads = uploads;
+  settings.warm_connections = std::min(settings.warm_connections, uploads);
+  settings.local_file = "bench.webm";
+  settings.stream_name = "bench";
+  settings.stream_id = "bench";
+  webmlive::HttpUploader uploader;
+  if (uploader.Init(settings) || uploader.Run()) {
+    printf("%-26s failed\n", name.str().c_str());
+    return;
+  }
+
+  // Every chunk shares one buffer of data; the uploader reads request
+  // bodies straight from the chunk.
+  webmlive::WebmChunk::Data data(options.size);
+  for (size_t i = 0; i < data.size(); ++i) {
+    data[i] = static_cast<uint8>(i * 31);
+  }
+  std::vector<webmlive::SharedWebmChunk> chunks;
+  for (int i = 0; i < options.count; ++i) {
+    std::ostringstream id;
+    id << "bench_" << i << ".chk";
+    webmlive::WebmChunk::Data chunk_data(data);
+    chunks.push_back(webmlive::SharedWebmChunk(
+        new (std::nothrow) webmlive::WebmChunk(  // NOLINT
+            id.str(), webmlive::WebmChunkDescriptor(), 0, &chunk_data,
+            webmlive::SharedWebmChunkDataPool())));
+    if (!chunks.back()) {
+      printf("%-26s failed\n", name.str().c_str());
+      return;
+    }
+  }
+
+  const Clock::time_point start = Clock::now();
+  for (int i = 0; i < options.count; ++i) {
+    int status;
+    while ((status = uploader.UploadChunk(chunks[i])) ==
+           webmlive::HttpUploader::kQueueFull) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    if (status) {
+      LOG(ERROR) << "UploadChunk failed: " << status;
+      break;
+    }
+  }
+  const int timeout_ms = kCaseTimeout + 3 * options.rtt_ms * options.count;
+  const bool complete = receiver.WaitForRequests(options.count, timeout_ms);
+  const double seconds =
+      std::chrono::duration_cast<std::chrono::microseconds>(
+          Clock::now() - start).count() / 1e6;
+  uploader.Stop();
+  receiver.Stop();
+  if (!complete || seconds <= 0) {
+    printf("%-26s failed: %d of %d requests\n", name.str().c_str(),
+           static_cast<int>(receiver.requests()), options.count);
+    return;
+  }
+
+  std::vector<int64> request_us;
+  receiver.GetRequestTimes(&request_us);
+  std::sort(request_us.begin(), request_us.end());
+  printf("%-26s %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %6d\n",
+         name.str().c_str(), receiver.requests() / seconds,
+         receiver.bytes() / seconds / (1024 * 1024),
+         percentile_ms(request_us, 50), percentile_ms(request_us, 90),
+         percentile_ms(request_us, 99), request_us.back() / 1000.0,
+         static_cast<int>(receiver.connections()));
+  fflush(stdout);
+}
+
+void usage(const char** argv) {
+  printf("Usage: %s [--count <chunks>] [--size <bytes>] [--rtt <ms>]\n",
+         argv[0]);
+  printf("              [--uploads <slots>]\n");
+  printf("  --count <chunks>   Chunks uploaded per case. Default is 200.\n");
+  printf("  --size <bytes>     Chunk size. Default is 262144.\n");
+  printf("  --rtt <ms>         Round trip time injected by the receiver\n");
+  printf("                     for each connection, response and 100\n");
+  printf("                     Continue. Default is 0.\n");
+  printf("  --uploads <slots>  Request slots of the multi cases. Default\n");
+  printf("                     is %d.\n",
+         webmlive::HttpUploaderSettings::kDefaultMaxUploads);
+}
+
+}  // namespace
+
+int main(int argc, const char** argv) {
+  google::InitGoogleLogging(argv[0]);
+  BenchOptions options;
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp("--count", argv[i]) && i + 1 < argc) {
+      options.count = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--size", argv[i]) && i + 1 < argc) {
+      options.size = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--rtt", argv[i]) && i + 1 < argc) {
+      options.rtt_ms = strtol(argv[++i], NULL, 10);
+    } else if (!strcmp("--uploads", argv[i]) && i + 1 < argc) {
+      options.uploads = strtol(argv[++i], NULL, 10);
+    } else {
+      usage(argv);
+      google::ShutdownGoogleLogging();
+      return (!strcmp("-h", argv[i]) || !strcmp("--help", argv[i])) ?
+          EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+  if (options.count <= 0 || options.size <= 0 || options.rtt_ms < 0 ||
+      options.uploads <= 0) {
+    usage(argv);
+    google::ShutdownGoogleLogging();
+    return EXIT_FAILURE;
+  }
+
+#ifdef _WIN32
+  WSADATA wsa_data;
+  if (WSAStartup(MAKEWORD(2, 2), &wsa_data)) {
+    LOG(ERROR) << "WSAStartup failed.";
+    google::ShutdownGoogleLogging();
+    return EXIT_FAILURE;
+  }
+#endif
+  printf("%d chunks of %d bytes per case, %d ms round trip.\n", options.count,
+         options.size, options.rtt_ms);
+  print_header();
+  for (int i = 0; i < kNumCases; ++i) {
+    bench_case(kCases[i], options);
+  }
+#ifdef _WIN32
+  WSACleanup();
+#endif
+  google::ShutdownGoogleLogging();
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,228 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/video_converter.h"
+
+#include <functional>
+#include <new>
+#include <utility>
+
+#include "encoder/buffer_pool-inl.h"
+#include "encoder/thread_util.h"
+#include "glog/logging.h"
+
+namespace webmlive {
+
+VideoConverter::VideoConverter()
+    : head_(0),
+      tail_(0),
+      stop_(false),
+      frames_dropped_(0),
+      num_threads_(0),
+      ptr_output_(NULL),
+      ptr_deinterlacer_(NULL) {
+}
+
+VideoConverter::~VideoConverter() {
+  Stop();
+}
+
+int VideoConverter::Init(int num_threads,
+                         const std::shared_ptr<MediaArena>& arena,
+                         SpscBufferPool<VideoFrame>* ptr_output) {
+  if (num_threads <= 0 || !ptr_output) {
+    LOG(ERROR) << "VideoConverter Init: invalid argument.";
+    return kInvalidArg;
+  }
+  num_threads_ = num_threads;
+  ptr_output_ = ptr_output;
+
+  // Two slots per worker: one being converted, and one waiting.
+  const int num_slots = num_threads * 2;
+  slots_.clear();
+  for (int i = 0; i < num_slots; ++i) {
+    std::unique_ptr<Slot> slot(new (std::nothrow) Slot());  // NOLINT
+    if (!slot) {
+      LOG(ERROR) << "VideoConverter Init: out of memory.";
+      return kNoMemory;
+    }
+    slot->converted_frame.set_arena(arena);
+    slots_.push_back(std::move(slot));
+  }
+  head_ = 0;
+  tail_ = 0;
+  return kSuccess;
+}
+
+int VideoConverter::Run() {
+  if (slots_.empty() || !threads_.empty()) {
+    LOG(ERROR) << "VideoConverter cannot Run: not Init'd or running.";
+    return kInvalidArg;
+  }
+  stop_ = false;
+  for (int i = 0; i < num_threads_; ++i) {
+    std::shared_ptr<std::thread> worker(
+        new (std::nothrow) std::thread(  // NOLINT
+            std::bind(&VideoConverter::WorkerThread, this)));
+    if (!worker) {
+      LOG(ERROR) << "VideoConverter cannot create worker thread.";
+      Stop();
+      return kInvalidArg;
+    }
+    threads_.push_back(worker);
+  }
+  std::shared_ptr<std::thread> committer(
+      new (std::nothrow) std::thread(  // NOLINT
+          std::bind(&VideoConverter::CommitThread, this)));
+  if (!committer) {
+    LOG(ERROR) << "VideoConverter cannot create commit thread.";
+    Stop();
+    return kInvalidArg;
+  }
+  threads_.push_back(committer);
+  return kSuccess;
+}
+
+void VideoConverter::Stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  work_ready_.notify_all();
+  commit_ready_.notify_all();
+  for (size_t i = 0; i < threads_.size(); ++i) {
+    threads_[i]->join();
+  }
+  threads_.clear();
+}
+
+int VideoConverter::Submit(VideoFrame* ptr_frame) {
+  return Enqueue(ptr_frame, false);
+}
+
+int VideoConverter::SubmitConverted(VideoFrame* ptr_frame) {
+  return Enqueue(ptr_frame, true);
+}
+
+int64 VideoConverter::frames_dropped() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return frames_dropped_;
+}
+
+int VideoConverter::Enqueue(VideoFrame* ptr_frame, bool converted) {
+  if (!ptr_frame || !ptr_frame->buffer()) {
+    return kInvalidArg;
+  }
+  Slot* ptr_slot = NULL;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (slots_.empty() || slots_[tail_]->state != kSlotFree) {
+      return kFull;
+    }
+    ptr_slot = slots_[tail_].get();
+  }
+
+  // Free slots are touched only by |Submit|, so the frame is moved in without
+  // holding |mutex_|.
+  ptr_slot->native_frame.Swap(ptr_frame);
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ptr_slot->converted = converted;
+    ptr_slot->state = converted ? kSlotDone : kSlotPending;
+    tail_ = (tail_ + 1) % slots_.size();
+  }
+  if (converted) {
+    commit_ready_.notify_one();
+  } else {
+    work_ready_.notify_one();
+  }
+  return kSuccess;
+}
+
+void VideoConverter::WorkerThread() {
+  ScopedThreadRegistration registration("converter");
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    // Take the oldest pending slot. Slots from |head_| to |tail_| are in
+    // submission order, so old frames finish first.
+    Slot* ptr_slot = NULL;
+    while (!stop_ && !ptr_slot) {
+      for (size_t i = 0; i < slots_.size(); ++i) {
+        Slot* const ptr_candidate =
+            slots_[(head_ + i) % slots_.size()].get();
+        if (ptr_candidate->state == kSlotPending) {
+          ptr_slot = ptr_candidate;
+          break;
+        }
+      }
+      if (!ptr_slot) {
+        work_ready_.wait(lock);
+      }
+    }
+    if (stop_) {
+      break;
+    }
+    ptr_slot->state = kSlotConverting;
+    lock.unlock();
+
+    int status =
+        ptr_slot->converted_frame.InitConverted(ptr_slot->native_frame);
+    if (!status && ptr_deinterlacer_) {
+      status = ptr_deinterlacer_->Deinterlace(&ptr_slot->converted_frame);
+    }
+    if (status) {
+      LOG(ERROR) << "VideoConverter frame conversion failed: " << status;
+    }
+
+    lock.lock();
+    ptr_slot->state = status ? kSlotFailed : kSlotDone;
+    commit_ready_.notify_one();
+  }
+}
+
+void VideoConverter::CommitThread() {
+  ScopedThreadRegistration registration("converter_commit");
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    while (!stop_ && !HeadCompleted()) {
+      commit_ready_.wait(lock);
+    }
+    if (stop_) {
+      break;
+    }
+    CommitCompletedSlots();
+  }
+}
+
+bool VideoConverter::HeadCompleted() const {
+  const SlotState state = slots_[head_]->state;
+  return state == kSlotDone || state == kSlotFailed;
+}
+
+void VideoConverter::CommitCompletedSlots() {
+  while (HeadCompleted()) {
+    Slot* const ptr_slot = slots_[head_].get();
+    if (ptr_slot->state == kSlotDone) {
+      VideoFrame* const ptr_frame = ptr_slot->converted ?
+          &ptr_slot->native_frame : &ptr_slot->converted_frame;
+      const int status = ptr_output_->Commit(ptr_frame);
+      if (status) {
+        if (status != SpscBufferPool<VideoFrame>::kFull) {
+          LOG(ERROR) << "VideoFrame pool Commit failed: " << status;
+        }
+        ++frames_dropped_;
+      }
+    } else {
+      ++frames_dropped_;
+    }
+    ptr_slot->state = kSlotFree;
+    head_ = (head_ + 1) % slots_.size();
+  }
+}
+
+}  // namespace webmlive
@@ -0,0 +1,154 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_VIDEO_CONVERTER_H_
+#define WEBMLIVE_ENCODER_VIDEO_CONVERTER_H_
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "encoder/basictypes.h"
+#include "encoder/buffer_pool.h"
+#include "encoder/encoder_base.h"
+#include "encoder/video_deinterlacer.h"
+#include "encoder/video_encoder.h"
+
+namespace webmlive {
+
+// Converts captured frames to I420 on a small pool of worker threads, so the
+// capture thread only hands frames off. Frames are held in a ring of slots:
+// |Submit()| swaps a frame into the next free slot, any idle worker converts
+// it, and a commit thread commits converted frames to the output pool in
+// submission order. Several workers let conversion of one frame overlap the
+// encode of the previous one, and keep up with sources that convert slower
+// than realtime on a single core.
+//
+// Notes:
+// - |Init| must be called before any other method.
+// - |Submit| and |SubmitConverted| must always be called from the same
+//   thread.
+// - Only the commit thread calls |ptr_output->Commit()|, so while the
+//   converter runs the output pool keeps a single producer: frames that need
+//   no conversion must be passed to |SubmitConverted| rather than committed
+//   directly.
+class VideoConverter {
+ public:
+  enum {
+    kNoMemory = -2,
+
+    // Invalid argument supplied to method call.
+    kInvalidArg = -1,
+    kSuccess = 0,
+
+    // |Submit| found no free slot; the frame was not accepted.
+    kFull = 1,
+  };
+
+  VideoConverter();
+  ~VideoConverter();
+
+  // Prepares |num_threads| workers and twice as many slots. Converted frames
+  // are allocated from |arena|, which may be NULL, and committed to
+  // |ptr_output|, which must outlive the converter. Returns |kSuccess| upon
+  // success.
+  int Init(int num_threads, const std::shared_ptr<MediaArena>& arena,
+           SpscBufferPool<VideoFrame>* ptr_output);
+
+  // Deinterlaces converted frames with |ptr_deinterlacer|, which must outlive
+  // the converter, on the worker threads. Must be called before |Run()|.
+  void set_deinterlacer(const VideoDeinterlacer* ptr_deinterlacer) {
+    ptr_deinterlacer_ = ptr_deinterlacer;
+  }
+
+  // Starts the worker threads and the commit thread.
+  int Run();
+
+  // Stops the threads. Frames not yet committed are discarded.
+  void Stop();
+
+  // Takes |ptr_frame|'s contents for conversion. Returns |kFull| when all
+  // slots are busy. |ptr_frame| may be left holding a recycled buffer.
+  int Submit(VideoFrame* ptr_frame);
+
+  // Same as |Submit()| for a frame that needs no conversion: it is committed
+  // by the commit thread after the frames submitted before it.
+  int SubmitConverted(VideoFrame* ptr_frame);
+
+  // Returns the number of converted frames dropped because the output pool
+  // was full, or because their conversion failed.
+  int64 frames_dropped() const;
+
+ private:
+  enum SlotState {
+    kSlotFree,
+    kSlotPending,
+    kSlotConverting,
+    kSlotDone,
+    kSlotFailed,
+  };
+
+  struct Slot {
+    Slot() : state(kSlotFree), converted(false) {}
+    SlotState state;
+    // True when |native_frame| was passed to |SubmitConverted()|, and is
+    // committed as is.
+    bool converted;
+    VideoFrame native_frame;
+    VideoFrame converted_frame;
+  };
+
+  // Moves |ptr_frame| into the slot at |tail_|, pending conversion or, when
+  // |converted| is true, done. Returns |kFull| when the slot is busy.
+  int Enqueue(VideoFrame* ptr_frame, bool converted);
+
+  // Converts slots until |stop_| is set.
+  void WorkerThread();
+
+  // Commits completed slots until |stop_| is set.
+  void CommitThread();
+
+  // Returns true when the slot at |head_| is converted or failed. Called with
+  // |mutex_| held.
+  bool HeadCompleted() const;
+
+  // Commits completed slots at the head of |slots_| to |ptr_output_|. Called
+  // by the commit thread with |mutex_| held.
+  void CommitCompletedSlots();
+
+  // Slot ring. |head_| is the oldest slot not yet committed, and |tail_| is
+  // the slot |Submit| fills next. State changes are protected by |mutex_|.
+  std::vector<std::unique_ptr<Slot>> slots_;
+  size_t head_;
+  size_t tail_;
+
+  // Set by |Stop|. Protected by |mutex_|.
+  bool stop_;
+
+  // Frames dropped on output or failed conversion. Protected by |mutex_|.
+  int64 frames_dropped_;
+
+  int num_threads_;
+  SpscBufferPool<VideoFrame>* ptr_output_;
+  const VideoDeinterlacer* ptr_deinterlacer_;
+
+  // Signalled when a slot becomes pending, or when |stop_| is set.
+  std::condition_variable work_ready_;
+
+  // Signalled when a slot is completed, or when |stop_| is set.
+  std::condition_variable commit_ready_;
+
+  mutable std::mutex mutex_;
+  std::vector<std::shared_ptr<std::thread>> threads_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(VideoConverter);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_VIDEO_CONVERTER_H_
@@ -0,0 +1,202 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/video_deinterlacer.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+#include "encoder/pcm_deinterleave.h"
+#include "glog/logging.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || \
+    defined(__i386__)
+#define WEBMLIVE_HAVE_X86 1
+#include <emmintrin.h>
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(_M_ARM64)
+#define WEBMLIVE_HAVE_NEON 1
+#include <arm_neon.h>
+#endif
+
+// See pcm_deinterleave.cc.
+#if defined(WEBMLIVE_HAVE_X86) && !defined(_MSC_VER)
+#define WEBMLIVE_TARGET(isa) __attribute__((target(isa)))
+#else
+#define WEBMLIVE_TARGET(isa)
+#endif
+
+namespace {
+
+void DeinterlaceRowC(const uint8* ptr_above, const uint8* ptr_below,
+                     int32 width, int threshold, uint8* ptr_row) {
+  for (int32 x = 0; x < width; ++x) {
+    const int above = ptr_above[x];
+    const int below = ptr_below[x];
+    const int pixel = ptr_row[x];
+    if (pixel > std::max(above, below) + threshold ||
+        pixel < std::min(above, below) - threshold) {
+      ptr_row[x] = static_cast<uint8>((above + below + 1) >> 1);
+    }
+  }
+}
+
+#if defined(WEBMLIVE_HAVE_X86)
+
+// A pixel is combed when the saturated distance beyond its neighbors, less
+// |threshold|, is not 0. _mm_avg_epu8 rounds as the C version does.
+WEBMLIVE_TARGET("sse2")
+void DeinterlaceRowSse2(const uint8* ptr_above, const uint8* ptr_below,
+                        int32 width, int threshold, uint8* ptr_row) {
+  const __m128i limit = _mm_set1_epi8(static_cast<char>(threshold));
+  const __m128i zero = _mm_setzero_si128();
+  int32 x = 0;
+  for (; x + 16 <= width; x += 16) {
+    const __m128i above =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr_above + x));
+    const __m128i below =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr_below + x));
+    __m128i* const ptr_pixels = reinterpret_cast<__m128i*>(ptr_row + x);
+    const __m128i pixels = _mm_loadu_si128(ptr_pixels);
+    const __m128i high = _mm_subs_epu8(
+        _mm_subs_epu8(pixels, _mm_max_epu8(above, below)), limit);
+    const __m128i low = _mm_subs_epu8(
+        _mm_subs_epu8(_mm_min_epu8(above, below), pixels), limit);
+    const __m128i keep = _mm_cmpeq_epi8(_mm_or_si128(high, low), zero);
+    _mm_storeu_si128(
+        ptr_pixels,
+        _mm_or_si128(_mm_and_si128(keep, pixels),
+                     _mm_andnot_si128(keep, _mm_avg_epu8(above, below))));
+  }
+  DeinterlaceRowC(ptr_above + x, ptr_below + x, width - x, threshold,
+                  ptr_row + x);
+}
+
+WEBMLIVE_TARGET("avx2")
+void DeinterlaceRowAvx2(const uint8* ptr_above, const uint8* ptr_below,
+                        int32 width, int threshold, uint8* ptr_row) {
+  const __m256i limit = _mm256_set1_epi8(static_cast<char>(threshold));
+  const __m256i zero = _mm256_setzero_si256();
+  int32 x = 0;
+  for (; x + 32 <= width; x += 32) {
+    const __m256i above =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ptr_above + x));
+    const __m256i below =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ptr_below + x));
+    __m256i* const ptr_pixels = reinterpret_cast<__m256i*>(ptr_row + x);
+    const __m256i pixels = _mm256_loadu_si256(ptr_pixels);
+    const __m256i high = _mm256_subs_epu8(
+        _mm256_subs_epu8(pixels, _mm256_max_epu8(above, below)), limit);
+    const __m256i low = _mm256_subs_epu8(
+        _mm256_subs_epu8(_mm256_min_epu8(above, below), pixels), limit);
+    const __m256i keep = _mm256_cmpeq_epi8(_mm256_or_si256(high, low), zero);
+    _mm256_storeu_si256(
+        ptr_pixels,
+        _mm256_blendv_epi8(_mm256_avg_epu8(above, below), pixels, keep));
+  }
+  DeinterlaceRowSse2(ptr_above + x, ptr_below + x, width - x, threshold,
+                     ptr_row + x);
+}
+
+#elif defined(WEBMLIVE_HAVE_NEON)
+
+void DeinterlaceRowNeon(const uint8* ptr_above, const uint8* ptr_below,
+                        int32 width, int threshold, uint8* ptr_row) {
+  const uint8x16_t limit = vdupq_n_u8(static_cast<uint8>(threshold));
+  int32 x = 0;
+  for (; x + 16 <= width; x += 16) {
+    const uint8x16_t above = vld1q_u8(ptr_above + x);
+    const uint8x16_t below = vld1q_u8(ptr_below + x);
+    const uint8x16_t pixels = vld1q_u8(ptr_row + x);
+    const uint8x16_t high =
+        vqsubq_u8(vqsubq_u8(pixels, vmaxq_u8(above, below)), limit);
+    const uint8x16_t low =
+        vqsubq_u8(vqsubq_u8(vminq_u8(above, below), pixels), limit);
+    const uint8x16_t keep = vceqq_u8(vorrq_u8(high, low), vdupq_n_u8(0));
+    vst1q_u8(ptr_row + x,
+             vbslq_u8(keep, pixels, vrhaddq_u8(above, below)));
+  }
+  DeinterlaceRowC(ptr_above + x, ptr_below + x, width - x, threshold,
+                  ptr_row + x);
+}
+
+#endif  // WEBMLIVE_HAVE_X86
+
+}  // anonymous namespace
+
+namespace webmlive {
+
+DeinterlaceRowFunc SelectDeinterlaceRow(int cpu_features) {
+#if defined(WEBMLIVE_HAVE_X86)
+  if (cpu_features & kCpuFeatureAvx2) return &DeinterlaceRowAvx2;
+  if (cpu_features & kCpuFeatureSse2) return &DeinterlaceRowSse2;
+#elif defined(WEBMLIVE_HAVE_NEON)
+  if (cpu_features & kCpuFeatureNeon) return &DeinterlaceRowNeon;
+#endif
+  return &DeinterlaceRowC;
+}
+
+VideoDeinterlacer::VideoDeinterlacer()
+    : row_func_(SelectDeinterlaceRow(GetCpuFeatures())),
+      field_order_(kVideoProgressive),
+      threshold_(DeinterlaceSettings::kDefaultThreshold) {}
+
+int VideoDeinterlacer::Init(VideoFieldOrder field_order, int threshold) {
+  if ((field_order != kVideoTopFieldFirst &&
+       field_order != kVideoBottomFieldFirst) ||
+      threshold < 0 || threshold > 255) {
+    LOG(ERROR) << "invalid deinterlacer setup: field order " << field_order
+               << " threshold " << threshold;
+    return kInvalidArg;
+  }
+  field_order_ = field_order;
+  threshold_ = threshold;
+  return kSuccess;
+}
+
+int VideoDeinterlacer::Deinterlace(VideoFrame* ptr_frame) const {
+  VideoPlanes planes;
+  if (!ptr_frame ||
+      !VideoFrame::GetPlanes(ptr_frame->config(), ptr_frame->buffer(),
+                             &planes)) {
+    return kInvalidArg;
+  }
+  const int32 width = ptr_frame->width();
+  const int32 height = abs(ptr_frame->height());
+  const int32 uv_width = (width + 1) / 2;
+  const int32 uv_height = (height + 1) / 2;
+  DeinterlacePlane(planes.data[0], planes.stride[0], width, height);
+  if (ptr_frame->format() == kVideoFormatNV12) {
+    DeinterlacePlane(planes.data[1], planes.stride[1], uv_width * 2,
+                     uv_height);
+  } else {
+    DeinterlacePlane(planes.data[1], planes.stride[1], uv_width, uv_height);
+    DeinterlacePlane(planes.data[2], planes.stride[2], uv_width, uv_height);
+  }
+  return kSuccess;
+}
+
+void VideoDeinterlacer::DeinterlacePlane(uint8* ptr_plane, int32 stride,
+                                         int32 width, int32 height) const {
+  if (height < 2) {
+    return;
+  }
+  // Rows of the second field, which are odd when the top field comes first.
+  // Their neighbors belong to the first field and are not modified, so rows
+  // are processed in place. Edge rows use their one neighbor twice.
+  const int32 first_row = field_order_ == kVideoTopFieldFirst ? 1 : 0;
+  for (int32 y = first_row; y < height; y += 2) {
+    const uint8* const ptr_above =
+        ptr_plane + (y > 0 ? y - 1 : y + 1) * stride;
+    const uint8* const ptr_below =
+        ptr_plane + (y + 1 < height ? y + 1 : y - 1) * stride;
+    row_func_(ptr_above, ptr_below, width, threshold_,
+              ptr_plane + y * stride);
+  }
+}
+
+}  // namespace webmlive
@@ -0,0 +1,98 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_VIDEO_DEINTERLACER_H_
+#define WEBMLIVE_ENCODER_VIDEO_DEINTERLACER_H_
+
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+#include "encoder/video_encoder.h"
+
+namespace webmlive {
+
+// Replaces the combed pixels of the |width| pixel row at |ptr_row|, a row of
+// the second field, with the average of the rows of the first field at
+// |ptr_above| and |ptr_below|. A pixel is combed when it is above both of its
+// neighbors, or below both, by more than |threshold|.
+typedef void (*DeinterlaceRowFunc)(const uint8* ptr_above,
+                                   const uint8* ptr_below, int32 width,
+                                   int threshold, uint8* ptr_row);
+
+// Returns the fastest row function for a CPU supporting |cpu_features|, a
+// mask of |CpuFeature| values.
+DeinterlaceRowFunc SelectDeinterlaceRow(int cpu_features);
+
+struct DeinterlaceSettings {
+  enum Mode {
+    // Frames are encoded as captured.
+    kOff = 0,
+
+    // Frames are deinterlaced when the source reports interlaced video.
+    kAuto = 1,
+
+    // Frames are always deinterlaced, as top field first when the source
+    // reports progressive video.
+    kForce = 2,
+  };
+
+  // Default comb detection threshold, in 8 bit sample levels.
+  static const int kDefaultThreshold = 10;
+
+  DeinterlaceSettings() : mode(kOff), threshold(kDefaultThreshold) {}
+
+  Mode mode;
+
+  // Difference from both vertical neighbors beyond which a pixel of the
+  // second field is combed and interpolated. 0 interpolates every pixel
+  // that is not between its neighbors.
+  int threshold;
+};
+
+// Motion adaptive single rate deinterlacer: keeps the first field of each
+// frame, and each pixel of the second field that lies between its neighbors
+// in the first field, where fields agree and there is no motion. Pixels of
+// the second field that comb, where the scene moved between the fields, are
+// interpolated from the first field. Static areas keep full vertical
+// resolution, and moving areas lose the combing.
+//
+// Works in place on the planes of I420, YV12 and NV12 frames, on independent
+// frames: |Deinterlace()| is const and may run on several frames at once, as
+// the |VideoConverter| workers do.
+class VideoDeinterlacer {
+ public:
+  enum {
+    kInvalidArg = -1,
+    kSuccess = 0,
+  };
+
+  VideoDeinterlacer();
+  ~VideoDeinterlacer() {}
+
+  // Prepares deinterlacing of |field_order| frames. Returns |kInvalidArg|
+  // when |field_order| is progressive or |threshold| is outside [0, 255].
+  int Init(VideoFieldOrder field_order, int threshold);
+
+  // Deinterlaces |ptr_frame| in place. Returns |kInvalidArg| for frames that
+  // are not I420, YV12 or NV12.
+  int Deinterlace(VideoFrame* ptr_frame) const;
+
+  VideoFieldOrder field_order() const { return field_order_; }
+
+ private:
+  // Deinterlaces the |width| byte by |height| row plane at |ptr_plane|.
+  void DeinterlacePlane(uint8* ptr_plane, int32 stride, int32 width,
+                        int32 height) const;
+
+  DeinterlaceRowFunc row_func_;
+  VideoFieldOrder field_order_;
+  int threshold_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(VideoDeinterlacer);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_VIDEO_DEINTERLACER_H_
@@ -7,11 +7,17 @@
 // be found in the AUTHORS file in the root of the source tree.
 #include "encoder/video_encoder.h"
 
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
 #include <new>
+#include <utility>
 
 #include "glog/logging.h"
 #include "libyuv/convert.h"
+#include "libyuv/cpu_id.h"
 #include "libyuv/planar_functions.h"
+#include "libyuv/scale.h"
 #include "libyuv/video_common.h"
 
 #if defined _MSC_VER
@@ -20,10 +26,107 @@
 // vp8.h and vp8cx.h (included by vpx_encoder.h).
 #pragma warning(disable:4505)
 #endif
+#include "encoder/parallel_gop_encoder.h"
 #include "encoder/vpx_encoder.h"
+#include "encoder/webm_encoder.h"
+#ifdef _WIN32
+#include "encoder/win/mft_video_encoder.h"
+#endif
 
 namespace webmlive {
 
+namespace {
+
+// Rounds |size| up to a multiple of |kVideoFrameAlignment|.
+int32 AlignSize(int32 size) {
+  return (size + kVideoFrameAlignment - 1) & ~(kVideoFrameAlignment - 1);
+}
+
+// Returns true when |regions| meet the limits documented with
+// |VideoEncoder::SetRegionsOfInterest()|.
+bool ValidRegionsOfInterest(const std::vector<RegionOfInterest>& regions) {
+  std::vector<int> levels;
+  for (size_t i = 0; i < regions.size(); ++i) {
+    const RegionOfInterest& region = regions[i];
+    if (region.left < 0 || region.top < 0 || region.width <= 0 ||
+        region.height <= 0 || region.left + region.width > 1 ||
+        region.top + region.height > 1 ||
+        std::abs(region.delta_q) > RegionOfInterest::kMaxDeltaQ) {
+      LOG(ERROR) << "invalid region of interest " << region.left << ","
+                 << region.top << " " << region.width << "x" << region.height
+                 << " delta_q " << region.delta_q;
+      return false;
+    }
+    if (region.delta_q != 0 &&
+        std::find(levels.begin(), levels.end(), region.delta_q) ==
+            levels.end()) {
+      levels.push_back(region.delta_q);
+    }
+  }
+  if (levels.size() > RegionOfInterest::kMaxQualityLevels) {
+    LOG(ERROR) << "regions of interest use " << levels.size()
+               << " quality levels, at most "
+               << RegionOfInterest::kMaxQualityLevels << " are supported.";
+    return false;
+  }
+  return true;
+}
+
+// Returns true when |config| has a crop rectangle.
+bool HasVideoCrop(const VideoConfig& config) {
+  return config.crop_width > 0 && config.crop_height > 0;
+}
+
+}  // namespace
+
+const int RegionOfInterest::kMaxQualityLevels;
+
+bool ValidVideoCrop(const VideoConfig& config) {
+  if (config.pad_alignment < 0 ||
+      config.pad_alignment > kMaxVideoPadAlignment) {
+    return false;
+  }
+  if (!config.crop_left && !config.crop_top && !config.crop_width &&
+      !config.crop_height) {
+    return true;
+  }
+  // Chroma planes are subsampled, so the rectangle starts on a chroma
+  // sample.
+  return HasVideoCrop(config) && config.crop_left >= 0 &&
+         config.crop_top >= 0 && !(config.crop_left & 1) &&
+         !(config.crop_top & 1) &&
+         config.crop_left + config.crop_width <= config.width &&
+         config.crop_top + config.crop_height <= abs(config.height);
+}
+
+int32 VisibleWidth(const VideoConfig& config) {
+  return HasVideoCrop(config) ? config.crop_width : config.width;
+}
+
+int32 VisibleHeight(const VideoConfig& config) {
+  return HasVideoCrop(config) ? config.crop_height : abs(config.height);
+}
+
+VideoConfig EncodedVideoConfig(const VideoConfig& config) {
+  if (!HasVideoCrop(config) && config.pad_alignment <= 1) {
+    return config;
+  }
+  const int32 alignment = std::max(config.pad_alignment, 1);
+  const int32 visible_width = VisibleWidth(config);
+  const int32 visible_height = VisibleHeight(config);
+  VideoConfig encoded = config;
+  encoded.width = (visible_width + alignment - 1) / alignment * alignment;
+  encoded.height = (visible_height + alignment - 1) / alignment * alignment;
+  const bool padded =
+      encoded.width != visible_width || encoded.height != visible_height;
+  encoded.crop_left = 0;
+  encoded.crop_top = 0;
+  encoded.crop_width = padded ? visible_width : 0;
+  encoded.crop_height = padded ? visible_height : 0;
+  encoded.pad_alignment = 0;
+  return encoded;
+}
+
 bool FourCCToVideoFormat(uint32 fourcc,
                          uint16 bits_per_pixel,
                          VideoFormat* ptr_format) {
@@ -69,6 +172,19 @@ bool FourCCToVideoFormat(uint32 fourcc,
           converted = true;
         }
         break;
+      case libyuv::FOURCC_NV12:
+        if (bits_per_pixel == kNV12BitCount) {
+          *ptr_format = kVideoFormatNV12;
+          converted = true;
+        }
+        break;
+      case libyuv::FOURCC_MJPG:
+        // Devices report 0, 16 or 24 bits for MJPEG: any bit count will do.
+        if (VideoConversionPlan::CanConvert(kVideoFormatMJPG)) {
+          *ptr_format = kVideoFormatMJPG;
+          converted = true;
+        }
+        break;
       default:
         LOG(WARNING) << "Unknown four char code.";
     }
@@ -76,14 +192,167 @@ bool FourCCToVideoFormat(uint32 fourcc,
   return converted;
 }
 
+VideoConversionPlan::VideoConversionPlan()
+    : packed_func_(NULL),
+      biplanar_func_(NULL),
+      mjpeg_func_(NULL),
+      target_size_(0),
+      convert_height_(0),
+      cpu_flags_(0) {
+  memset(source_offset_, 0, sizeof(source_offset_));
+  memset(source_stride_, 0, sizeof(source_stride_));
+  memset(target_offset_, 0, sizeof(target_offset_));
+  memset(target_stride_, 0, sizeof(target_stride_));
+}
+
+int VideoConversionPlan::Init(const VideoConfig& source_config) {
+  const int32 width = source_config.width;
+  const int32 height = abs(source_config.height);
+  if (width <= 0 || height <= 0) {
+    LOG(ERROR) << "cannot plan the conversion of a " << width << "x"
+               << height << " frame.";
+    return kInvalidArg;
+  }
+  packed_func_ = NULL;
+  biplanar_func_ = NULL;
+  mjpeg_func_ = NULL;
+  convert_height_ = height;
+  source_offset_[0] = 0;
+  source_offset_[1] = 0;
+  source_stride_[0] = source_config.stride;
+  source_stride_[1] = 0;
+  switch (source_config.format) {
+    case kVideoFormatYUY2:
+    case kVideoFormatYUYV:
+      packed_func_ = libyuv::YUY2ToI420;
+      break;
+    case kVideoFormatUYVY:
+      packed_func_ = libyuv::UYVYToI420;
+      break;
+
+    // Note that RGB conversions always negate the height to ensure correct
+    // image orientation.
+    case kVideoFormatRGB:
+      packed_func_ = libyuv::RGB24ToI420;
+      convert_height_ = -source_config.height;
+      break;
+    case kVideoFormatRGBA:
+      packed_func_ = libyuv::BGRAToI420;
+      convert_height_ = -source_config.height;
+      break;
+
+    // Same layout as |VideoFrame::GetPlanes()|.
+    case kVideoFormatNV12: {
+      const bool padded = source_config.uv_stride > 0;
+      source_stride_[0] = padded ? source_config.stride : width;
+      source_stride_[1] =
+          padded ? source_config.uv_stride : (width + 1) / 2 * 2;
+      const int32 y_size = source_stride_[0] * height;
+      source_offset_[1] = padded ? AlignSize(y_size) : y_size;
+      biplanar_func_ = libyuv::NV12ToI420;
+      break;
+    }
+
+    // JPEG images are top down, whatever the sign of the height.
+    case kVideoFormatMJPG:
+#ifdef HAVE_JPEG
+      mjpeg_func_ = libyuv::MJPGToI420;
+      break;
+#else
+      LOG(ERROR) << "Cannot plan MJPEG decoding: libyuv lacks JPEG support.";
+      return kInvalidArg;
+#endif
+
+    case kVideoFormatI420:
+    case kVideoFormatVP8:
+    case kVideoFormatVP9:
+    case kVideoFormatYV12:
+    case kVideoFormatCount:
+      LOG(ERROR) << "Cannot plan conversion to I420: invalid video format.";
+      return kInvalidArg;
+  }
+
+  // Same layout as |VideoFrame::ReserveI420()|.
+  target_stride_[0] = AlignSize(width);
+  target_stride_[1] = target_stride_[0] / 2;
+  target_stride_[2] = target_stride_[1];
+  target_offset_[0] = 0;
+  target_offset_[1] = AlignSize(target_stride_[0] * height);
+  target_offset_[2] =
+      target_offset_[1] + AlignSize(target_stride_[1] * ((height + 1) / 2));
+  target_size_ = VideoFrame::I420BufferSize(width, height);
+  source_config_ = source_config;
+  cpu_flags_ = libyuv::InitCpuFlags();
+  return kSuccess;
+}
+
+bool VideoConversionPlan::CanConvert(VideoFormat format) {
+#ifndef HAVE_JPEG
+  if (format == kVideoFormatMJPG) {
+    return false;
+  }
+#endif
+  return VideoFrame::NeedsConversion(format) || format == kVideoFormatNV12;
+}
+
+bool VideoConversionPlan::Matches(const VideoConfig& config) const {
+  return (packed_func_ || biplanar_func_ || mjpeg_func_) &&
+         config.format == source_config_.format &&
+         config.width == source_config_.width &&
+         config.height == source_config_.height &&
+         config.stride == source_config_.stride &&
+         config.uv_stride == source_config_.uv_stride;
+}
+
+int VideoConversionPlan::Convert(const uint8* ptr_source,
+                                 int32 source_length,
+                                 uint8* ptr_target) const {
+  uint8* const ptr_y = ptr_target + target_offset_[0];
+  uint8* const ptr_u = ptr_target + target_offset_[1];
+  uint8* const ptr_v = ptr_target + target_offset_[2];
+  if (mjpeg_func_) {
+    return mjpeg_func_(ptr_source, source_length,
+                       ptr_y, target_stride_[0],
+                       ptr_u, target_stride_[1],
+                       ptr_v, target_stride_[2],
+                       source_config_.width, convert_height_,
+                       source_config_.width, convert_height_);
+  }
+  if (packed_func_) {
+    return packed_func_(ptr_source, source_stride_[0],
+                        ptr_y, target_stride_[0],
+                        ptr_u, target_stride_[1],
+                        ptr_v, target_stride_[2],
+                        source_config_.width, convert_height_);
+  }
+  return biplanar_func_(ptr_source + source_offset_[0], source_stride_[0],
+                        ptr_source + source_offset_[1], source_stride_[1],
+                        ptr_y, target_stride_[0],
+                        ptr_u, target_stride_[1],
+                        ptr_v, target_stride_[2],
+                        source_config_.width, convert_height_);
+}
+
 VideoFrame::VideoFrame()
     : keyframe_(false),
       timestamp_(0),
       duration_(0),
+      capture_time_(0),
+      temporal_layer_(0),
       buffer_capacity_(0),
       buffer_length_(0) {
 }
 
+VideoFrame::VideoFrame(VideoFrame&& other) noexcept
+    : VideoFrame() {
+  Swap(&other);
+}
+
+VideoFrame& VideoFrame::operator=(VideoFrame&& other) noexcept {
+  Swap(&other);
+  return *this;
+}
+
 VideoFrame::~VideoFrame() {
 }
 
@@ -98,212 +367,739 @@ int VideoFrame::Init(const VideoConfig& config,
     return kInvalidArg;
   }
 
-  const bool needs_conversion =
-      (config.format != kVideoFormatI420 &&
-       config.format != kVideoFormatYV12 &&
-       config.format != kVideoFormatVP8 &&
-       config.format != kVideoFormatVP9);
-
-  if (needs_conversion) {
+  if (NeedsConversion(config.format)) {
     // Convert the video frame to I420.
-    const int32 status = ConvertToI420(config, ptr_data);
+    const int32 status = ConvertToI420(config, ptr_data, data_length,
+                                       NULL);
     if (status) {
       LOG(ERROR) << "Video format conversion failed " << status;
       return status;
     }
   } else {
     // Data does not need conversion: copy directly into |buffer_|.
-    if (data_length > buffer_capacity_) {
-      buffer_.reset(new (std::nothrow) uint8[data_length]);  // NOLINT
-      if (!buffer_) {
-        LOG(ERROR) << "VideoFrame Init cannot allocate buffer.";
-        return kNoMemory;
-      }
-      buffer_capacity_ = data_length;
-    }
-    memcpy(buffer_.get(), ptr_data, data_length);
-    buffer_length_ = data_length;
-    config_ = config;
+    return InitNative(config, keyframe, timestamp, duration, ptr_data,
+                      data_length);
   }
   keyframe_ = keyframe;
   timestamp_ = timestamp;
   duration_ = duration;
+  capture_time_ = 0;
+  temporal_layer_ = 0;
+  return kSuccess;
+}
+
+int VideoFrame::InitNative(const VideoConfig& config,
+                           bool keyframe,
+                           int64 timestamp,
+                           int64 duration,
+                           const uint8* ptr_data,
+                           int32 data_length) {
+  if (!ptr_data || data_length < 0) {
+    LOG(ERROR) << "VideoFrame can't InitNative with NULL data pointer.";
+    return kInvalidArg;
+  }
+  if (data_length > buffer_capacity_ && AllocateBuffer(data_length)) {
+    LOG(ERROR) << "VideoFrame InitNative cannot allocate buffer.";
+    return kNoMemory;
+  }
+  memcpy(buffer_.get(), ptr_data, data_length);
+  buffer_length_ = data_length;
+  config_ = config;
+  keyframe_ = keyframe;
+  timestamp_ = timestamp;
+  duration_ = duration;
+  capture_time_ = 0;
+  temporal_layer_ = 0;
+  return kSuccess;
+}
+
+int VideoFrame::InitConverted(const VideoFrame& source) {
+  if (&source == this || !source.buffer() || source.buffer_length() <= 0) {
+    LOG(ERROR) << "VideoFrame can't InitConverted from an empty or aliased "
+               << "frame.";
+    return kInvalidArg;
+  }
+  if (!NeedsConversion(source.format()) &&
+      source.format() != kVideoFormatNV12) {
+    return source.Clone(this);
+  }
+  // The converted frame keeps the crop and padding of |source|, so it needs
+  // room for the padding.
+  const VideoConfig& source_config = source.config();
+  if (Reserve(I420BufferSize(source_config.width, abs(source_config.height)) +
+              PaddingSize(source_config))) {
+    return kNoMemory;
+  }
+  int status = ConvertToI420(source_config, source.buffer(),
+                             source.buffer_length(),
+                             source.conversion_plan().get());
+  if (status) {
+    LOG(ERROR) << "Video format conversion failed " << status;
+    return status;
+  }
+  status = SetCrop(source_config);
+  if (status) {
+    return status;
+  }
+  conversion_plan_.reset();
+  keyframe_ = source.keyframe();
+  timestamp_ = source.timestamp();
+  duration_ = source.duration();
+  capture_time_ = source.capture_time();
+  temporal_layer_ = source.temporal_layer();
+  return kSuccess;
+}
+
+int VideoFrame::InitInPlace(const VideoConfig& config,
+                            bool keyframe,
+                            int64 timestamp,
+                            int64 duration,
+                            int32 data_length) {
+  if (!buffer_ || data_length < 0 || data_length > buffer_capacity_) {
+    LOG(ERROR) << "VideoFrame can't InitInPlace with length=" << data_length
+               << " capacity=" << buffer_capacity_;
+    return kInvalidArg;
+  }
+  buffer_length_ = data_length;
+  config_ = config;
+  keyframe_ = keyframe;
+  timestamp_ = timestamp;
+  duration_ = duration;
+  capture_time_ = 0;
+  temporal_layer_ = 0;
+  return kSuccess;
+}
+
+int VideoFrame::Reserve(int32 capacity) {
+  if (capacity > buffer_capacity_ && AllocateBuffer(capacity)) {
+    LOG(ERROR) << "VideoFrame Reserve cannot allocate buffer.";
+    return kNoMemory;
+  }
   return kSuccess;
 }
 
+bool VideoFrame::NeedsConversion(VideoFormat format) {
+  return (format != kVideoFormatI420 &&
+          format != kVideoFormatYV12 &&
+          format != kVideoFormatNV12 &&
+          format != kVideoFormatVP8 &&
+          format != kVideoFormatVP9);
+}
+
+bool VideoFrame::IsVpxKeyframe(VideoFormat format, const uint8* ptr_data,
+                               int32 length) {
+  if (!ptr_data) {
+    return false;
+  }
+  if (format == kVideoFormatVP8) {
+    // The frame tag's low bit is 0 for keyframes, which are followed by the
+    // start code 9d 01 2a and the frame size.
+    const int32 kKeyframeHeaderLength = 10;
+    return length >= kKeyframeHeaderLength && (ptr_data[0] & 1) == 0 &&
+           ptr_data[3] == 0x9d && ptr_data[4] == 0x01 && ptr_data[5] == 0x2a;
+  }
+  if (format == kVideoFormatVP9) {
+    // Uncompressed header: frame_marker (2), profile_low_bit,
+    // profile_high_bit, reserved_zero in profile 3, show_existing_frame,
+    // then frame_type, which is 0 for keyframes. The first frame of a
+    // superframe decides.
+    if (length < 1 || (ptr_data[0] >> 6) != 2) {
+      return false;
+    }
+    const int profile = ((ptr_data[0] >> 5) & 1) | ((ptr_data[0] >> 3) & 2);
+    const int show_existing_bit = (profile == 3) ? 2 : 3;
+    if ((ptr_data[0] >> show_existing_bit) & 1) {
+      return false;
+    }
+    return ((ptr_data[0] >> (show_existing_bit - 1)) & 1) == 0;
+  }
+  return false;
+}
+
 int VideoFrame::Clone(VideoFrame* ptr_frame) const {
   if (!ptr_frame) {
     LOG(ERROR) << "cannot Clone to a NULL VideoFrame.";
     return kInvalidArg;
   }
-  if (buffer_.get() && buffer_capacity_ > 0) {
-    ptr_frame->buffer_.reset(
-        new (std::nothrow) uint8[buffer_capacity_]);  // NOLINT
-    if (!ptr_frame->buffer_) {
-      LOG(ERROR) << "VideoFrame Clone cannot allocate buffer.";
-      return kNoMemory;
-    }
+  if (ptr_frame == this) {
+    return kSuccess;
+  }
+  if (buffer_length_ > ptr_frame->buffer_capacity_ &&
+      ptr_frame->AllocateBuffer(buffer_capacity_)) {
+    LOG(ERROR) << "VideoFrame Clone cannot allocate buffer.";
+    return kNoMemory;
+  }
+  if (buffer_length_ > 0) {
     memcpy(ptr_frame->buffer_.get(), buffer_.get(), buffer_length_);
   }
-  ptr_frame->buffer_capacity_ = buffer_capacity_;
   ptr_frame->buffer_length_ = buffer_length_;
   ptr_frame->config_ = config_;
   ptr_frame->keyframe_ = keyframe_;
   ptr_frame->timestamp_ = timestamp_;
   ptr_frame->duration_ = duration_;
+  ptr_frame->capture_time_ = capture_time_;
+  ptr_frame->temporal_layer_ = temporal_layer_;
+  ptr_frame->conversion_plan_ = conversion_plan_;
   return kSuccess;
 }
 
 void VideoFrame::Swap(VideoFrame* ptr_frame) {
-  CHECK_NOTNULL(buffer_.get());
-  CHECK_NOTNULL(ptr_frame->buffer_.get());
-
-  const VideoConfig temp_config = config_;
-  config_ = ptr_frame->config_;
-  ptr_frame->config_ = temp_config;
-
-  const bool temp_keyframe = keyframe_;
-  keyframe_ = ptr_frame->keyframe_;
-  ptr_frame->keyframe_ = temp_keyframe;
-
-  int64 temp_time = timestamp_;
-  timestamp_ = ptr_frame->timestamp_;
-  ptr_frame->timestamp_ = temp_time;
+  std::swap(keyframe_, ptr_frame->keyframe_);
+  std::swap(timestamp_, ptr_frame->timestamp_);
+  std::swap(duration_, ptr_frame->duration_);
+  std::swap(capture_time_, ptr_frame->capture_time_);
+  std::swap(temporal_layer_, ptr_frame->temporal_layer_);
+  buffer_.swap(ptr_frame->buffer_);
+  std::swap(buffer_capacity_, ptr_frame->buffer_capacity_);
+  std::swap(buffer_length_, ptr_frame->buffer_length_);
+  std::swap(config_, ptr_frame->config_);
+  conversion_plan_.swap(ptr_frame->conversion_plan_);
+}
 
-  temp_time = duration_;
-  duration_ = ptr_frame->duration_;
-  ptr_frame->duration_ = temp_time;
+int VideoFrame::ConvertToI420(const VideoConfig& source_config,
+                              const uint8* ptr_data,
+                              int32 data_length,
+                              const VideoConversionPlan* ptr_plan) {
+  if (!ptr_plan || !ptr_plan->Matches(source_config)) {
+    if (!cached_plan_ || !cached_plan_->Matches(source_config)) {
+      if (!cached_plan_) {
+        cached_plan_.reset(
+            new (std::nothrow) VideoConversionPlan());  // NOLINT
+        if (!cached_plan_) {
+          LOG(ERROR) << "VideoFrame ConvertToI420 cannot allocate plan.";
+          return kNoMemory;
+        }
+      }
+      if (cached_plan_->Init(source_config)) {
+        cached_plan_.reset();
+        return kInvalidArg;
+      }
+    }
+    ptr_plan = cached_plan_.get();
+  }
+  if (ReserveI420(source_config.width, abs(source_config.height))) {
+    LOG(ERROR) << "VideoFrame ConvertToI420 cannot allocate buffer.";
+    return kNoMemory;
+  }
+  return ptr_plan->Convert(ptr_data, data_length, buffer_.get()) ?
+      kConversionFailed : kSuccess;
+}
 
-  buffer_.swap(ptr_frame->buffer_);
+int32 VideoFrame::I420BufferSize(int32 width, int32 height) {
+  // The Y stride is a multiple of |kVideoFrameAlignment|, so the U plane is
+  // aligned without padding between the planes.
+  const int32 y_stride = AlignSize(width);
+  const int32 uv_size = AlignSize(y_stride / 2 * ((height + 1) / 2));
+  return y_stride * height + uv_size * 2;
+}
 
-  int32 temp = buffer_capacity_;
-  buffer_capacity_ = ptr_frame->buffer_capacity_;
-  ptr_frame->buffer_capacity_ = temp;
+int VideoFrame::ReserveI420(int32 width, int32 height) {
+  const int32 size_required = I420BufferSize(width, height);
+  if (Reserve(size_required)) {
+    return kNoMemory;
+  }
+  buffer_length_ = size_required;
+  config_.format = kVideoFormatI420;
+  config_.width = width;
+  config_.height = height;
+  config_.stride = AlignSize(width);
+  config_.uv_stride = config_.stride / 2;
+  config_.crop_left = 0;
+  config_.crop_top = 0;
+  config_.crop_width = 0;
+  config_.crop_height = 0;
+  config_.pad_alignment = 0;
+  return kSuccess;
+}
 
-  temp = buffer_length_;
-  buffer_length_ = ptr_frame->buffer_length_;
-  ptr_frame->buffer_length_ = temp;
+int VideoFrame::AllocateBuffer(int32 size) {
+  // Free the current buffer first, so that its block can be reused.
+  buffer_.reset();
+  buffer_length_ = 0;
+  buffer_ = AllocateMediaBuffer(arena_, size, &buffer_capacity_);
+  return buffer_ ? kSuccess : kNoMemory;
 }
 
-int VideoFrame::ConvertToI420(const VideoConfig& source_config,
-                              const uint8* ptr_data) {
-  // Allocate storage for the I420 frame.
-  const int32 size_required =
-      source_config.width * source_config.height * 3 / 2;
-  if (size_required > buffer_capacity_) {
-    buffer_.reset(new (std::nothrow) uint8[size_required]);  // NOLINT
-    if (!buffer_) {
-      LOG(ERROR) << "VideoFrame ConvertToI420 cannot allocate buffer.";
-      return kNoMemory;
+bool VideoFrame::GetPlanes(const VideoConfig& config, const uint8* ptr_data,
+                           VideoPlanes* ptr_planes) {
+  if (!ptr_data || !ptr_planes) {
+    return false;
+  }
+  const int32 height = abs(config.height);
+  const int32 uv_height = (height + 1) / 2;
+  const bool padded = config.uv_stride > 0;
+  uint8* const ptr_y = const_cast<uint8*>(ptr_data);
+  ptr_planes->data[0] = ptr_y;
+  switch (config.format) {
+    case kVideoFormatI420:
+    case kVideoFormatYV12: {
+      const int32 y_stride = padded ? config.stride : config.width;
+      const int32 uv_stride =
+          padded ? config.uv_stride : (config.width + 1) / 2;
+      const int32 y_size = y_stride * height;
+      const int32 uv_size = uv_stride * uv_height;
+      uint8* ptr_u = ptr_y + (padded ? AlignSize(y_size) : y_size);
+      uint8* ptr_v = ptr_u + (padded ? AlignSize(uv_size) : uv_size);
+      if (config.format == kVideoFormatYV12) {
+        std::swap(ptr_u, ptr_v);
+      }
+      ptr_planes->data[1] = ptr_u;
+      ptr_planes->data[2] = ptr_v;
+      ptr_planes->stride[0] = y_stride;
+      ptr_planes->stride[1] = uv_stride;
+      ptr_planes->stride[2] = uv_stride;
+      return true;
+    }
+    case kVideoFormatNV12: {
+      const int32 y_stride = padded ? config.stride : config.width;
+      const int32 uv_stride =
+          padded ? config.uv_stride : (config.width + 1) / 2 * 2;
+      const int32 y_size = y_stride * height;
+      ptr_planes->data[1] = ptr_y + (padded ? AlignSize(y_size) : y_size);
+      ptr_planes->data[2] = NULL;
+      ptr_planes->stride[0] = y_stride;
+      ptr_planes->stride[1] = uv_stride;
+      ptr_planes->stride[2] = 0;
+      return true;
     }
-    buffer_capacity_ = size_required;
+    default:
+      return false;
   }
-  buffer_length_ = size_required;
+}
 
-  VideoConfig& target_config = config_;
-  target_config.format = kVideoFormatI420;
-  target_config.width = source_config.width;
-  target_config.height = abs(source_config.height);
-  target_config.stride = source_config.width;
+bool VideoFrame::GetVisiblePlanes(const VideoConfig& config,
+                                  const uint8* ptr_data,
+                                  VideoPlanes* ptr_planes) {
+  if (!GetPlanes(config, ptr_data, ptr_planes)) {
+    return false;
+  }
+  const int32 left = config.crop_left;
+  const int32 top = config.crop_top;
+  ptr_planes->data[0] += top * ptr_planes->stride[0] + left;
+  if (config.format == kVideoFormatNV12) {
+    // Each chroma sample pair holds U and V.
+    ptr_planes->data[1] += top / 2 * ptr_planes->stride[1] + left;
+  } else {
+    ptr_planes->data[1] += top / 2 * ptr_planes->stride[1] + left / 2;
+    ptr_planes->data[2] += top / 2 * ptr_planes->stride[2] + left / 2;
+  }
+  return true;
+}
 
-  // Calculate length and stride for the I420 planes.
-  const int32 y_length = source_config.width * target_config.height;
-  const int32 uv_stride = target_config.stride / 2;
-  const int32 uv_length = uv_stride * (target_config.height / 2);
-  CHECK_EQ(buffer_length_, y_length + (uv_length * 2));
+int32 VideoFrame::PaddingSize(const VideoConfig& config) {
+  if (config.pad_alignment <= 1) {
+    return 0;
+  }
+  // Bounds the padding rows of the last plane and the padding columns of
+  // its last row.
+  return 2 * config.pad_alignment * std::max(config.stride, config.width);
+}
 
-  // Assign the pointers to the I420 planes.
-  uint8* const ptr_i420_y = buffer_.get();
-  uint8* const ptr_i420_u = ptr_i420_y + y_length;
-  uint8* const ptr_i420_v = ptr_i420_u + uv_length;
+int VideoFrame::SetCrop(const VideoConfig& crop_config) {
+  VideoConfig config = config_;
+  config.crop_left = crop_config.crop_left;
+  config.crop_top = crop_config.crop_top;
+  config.crop_width = crop_config.crop_width;
+  config.crop_height = crop_config.crop_height;
+  config.pad_alignment = crop_config.pad_alignment;
+  VideoPlanes planes;
+  if (!ValidVideoCrop(config) ||
+      !GetVisiblePlanes(config, buffer_.get(), &planes)) {
+    LOG(ERROR) << "cannot crop " << config_.width << "x" << config_.height
+               << " frame to " << config.crop_width << "x"
+               << config.crop_height << " at " << config.crop_left << ","
+               << config.crop_top << ", padding " << config.pad_alignment;
+    return kInvalidArg;
+  }
 
-  int status = kConversionFailed;
-  switch (source_config.format) {
-    case kVideoFormatYUY2:
-    case kVideoFormatYUYV:
-      status = libyuv::YUY2ToI420(ptr_data, source_config.stride,
-                                  ptr_i420_y, target_config.stride,
-                                  ptr_i420_u, uv_stride,
-                                  ptr_i420_v, uv_stride,
-                                  source_config.width, target_config.height);
-      break;
-    case kVideoFormatUYVY:
-      status = libyuv::UYVYToI420(ptr_data, source_config.stride,
-                                  ptr_i420_y, target_config.stride,
-                                  ptr_i420_u, uv_stride,
-                                  ptr_i420_v, uv_stride,
-                                  source_config.width, target_config.height);
-      break;
+  // The encoders read every row of each plane of the encoded frame.
+  const VideoConfig encoded = EncodedVideoConfig(config);
+  const int32 uv_width = (encoded.width + 1) / 2;
+  const int32 uv_height = (encoded.height + 1) / 2;
+  const bool nv12 = config.format == kVideoFormatNV12;
+  const int32 rows[3] = {encoded.height, uv_height, uv_height};
+  const int32 row_bytes[3] = {encoded.width, nv12 ? uv_width * 2 : uv_width,
+                              uv_width};
+  int32 read_size = buffer_length_;
+  for (int i = 0; i < (nv12 ? 2 : 3); ++i) {
+    const int32 plane_end = static_cast<int32>(
+        planes.data[i] + (rows[i] - 1) * planes.stride[i] + row_bytes[i] -
+        buffer_.get());
+    read_size = std::max(read_size, plane_end);
+  }
 
-    // Note that RGB conversions always negate the height to ensure correct
-    // image orientation.
-    case kVideoFormatRGB:
-      status = libyuv::RGB24ToI420(ptr_data, source_config.stride,
-                                   ptr_i420_y, target_config.stride,
-                                   ptr_i420_u, uv_stride,
-                                   ptr_i420_v, uv_stride,
-                                   source_config.width, -source_config.height);
-      break;
-    case kVideoFormatRGBA:
-      status = libyuv::BGRAToI420(ptr_data, source_config.stride,
-                                  ptr_i420_y, target_config.stride,
-                                  ptr_i420_u, uv_stride,
-                                  ptr_i420_v, uv_stride,
-                                  source_config.width, -source_config.height);
-      break;
+  // Frames from buffers sized before the padding was configured, such as
+  // converted frames, grow once; the pools keep the larger buffers.
+  if (read_size > buffer_capacity_) {
+    int32 capacity = 0;
+    MediaBuffer buffer = AllocateMediaBuffer(arena_, read_size, &capacity);
+    if (!buffer) {
+      LOG(ERROR) << "cannot allocate padded frame buffer.";
+      return kNoMemory;
+    }
+    memcpy(buffer.get(), buffer_.get(), buffer_length_);
+    buffer_ = std::move(buffer);
+    buffer_capacity_ = capacity;
+  }
+  config_ = config;
+  return kSuccess;
+}
 
-    case kVideoFormatI420:
-    case kVideoFormatVP8:
-    case kVideoFormatYV12:
-    case kVideoFormatCount:
-      LOG(ERROR) << "Cannot convert to I420: invalid video format.";
-      status = kInvalidArg;
+int VideoFrame::InitScaled(const VideoFrame& source, int32 width,
+                           int32 height) {
+  if (&source == this || !source.buffer()) {
+    LOG(ERROR) << "VideoFrame can't scale a NULL or aliased frame.";
+    return kInvalidArg;
+  }
+  if (source.format() != kVideoFormatI420 &&
+      source.format() != kVideoFormatYV12) {
+    LOG(ERROR) << "VideoFrame can scale only I420 and YV12 frames.";
+    return kInvalidArg;
+  }
+  if (width <= 0 || height <= 0 || (width & 1) || (height & 1)) {
+    LOG(ERROR) << "Invalid scaled frame size: " << width << "x" << height;
+    return kInvalidArg;
   }
 
-  return status;
+  VideoPlanes source_planes;
+  GetVisiblePlanes(source.config(), source.buffer(), &source_planes);
+  const VideoConfig source_config = source.config();
+  if (ReserveI420(width, height)) {
+    return kNoMemory;
+  }
+  VideoPlanes planes;
+  GetPlanes(config_, buffer_.get(), &planes);
+  if (libyuv::I420Scale(source_planes.data[0], source_planes.stride[0],
+                        source_planes.data[1], source_planes.stride[1],
+                        source_planes.data[2], source_planes.stride[2],
+                        VisibleWidth(source_config),
+                        VisibleHeight(source_config),
+                        planes.data[0], planes.stride[0],
+                        planes.data[1], planes.stride[1],
+                        planes.data[2], planes.stride[2],
+                        width, height,
+                        libyuv::kFilterBox)) {
+    LOG(ERROR) << "I420Scale failed.";
+    return kConversionFailed;
+  }
+
+  config_.frame_rate = source_config.frame_rate;
+  keyframe_ = source.keyframe();
+  timestamp_ = source.timestamp();
+  duration_ = source.duration();
+  capture_time_ = source.capture_time();
+  temporal_layer_ = source.temporal_layer();
+  return kSuccess;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 // VideoEncoder
 //
 
-VideoEncoder::VideoEncoder() {
+VideoEncoder::VideoEncoder()
+    : frames_in_offset_(0),
+      frames_out_offset_(0),
+      using_hardware_(false),
+      keyframe_requests_(0),
+      answered_requests_(0),
+      forced_keyframes_(0),
+      scene_cut_keyframes_(0),
+      regions_changed_(false) {
 }
 
 VideoEncoder::~VideoEncoder() {
 }
 
 int VideoEncoder::Init(const WebmEncoderConfig& config) {
-  ptr_vpx_encoder_.reset(new (std::nothrow) VpxEncoder());  // NOLINT
-  if (!ptr_vpx_encoder_) {
+  if (!ValidRegionsOfInterest(config.vpx_config.regions_of_interest)) {
+    return kInvalidArg;
+  }
+  ptr_config_.reset(new (std::nothrow) WebmEncoderConfig(config));  // NOLINT
+  if (!ptr_config_) {
     return kNoMemory;
   }
-  return ptr_vpx_encoder_->Init(config);
+  VpxConfig& vpx_config = ptr_config_->vpx_config;
+  if (vpx_config.scene_cut_threshold != 0 &&
+      (vpx_config.aligned_keyframes || vpx_config.intra_refresh ||
+       vpx_config.min_scene_cut_interval < 0 ||
+       scene_cut_detector_.Init(vpx_config.scene_cut_threshold))) {
+    // Keyframes on cuts would leave the aligned grid, or break the flat
+    // frame sizes of intra refresh.
+    LOG(WARNING) << "scene cut keyframes require a threshold in [1, 100], "
+                 << "a non-negative interval, and neither aligned keyframes "
+                 << "nor intra refresh, disabling.";
+    vpx_config.scene_cut_threshold = 0;
+  }
+  const VideoEncoderBackendType backend = config.vpx_config.encoder_backend;
+#ifdef _WIN32
+  if (backend == kVideoEncoderHardware || backend == kVideoEncoderAuto) {
+    ptr_backend_.reset(new (std::nothrow) MftVideoEncoder());  // NOLINT
+    if (!ptr_backend_) {
+      return kNoMemory;
+    }
+    const int32 status = ptr_backend_->Init(config);
+    if (status == kSuccess) {
+      LOG(INFO) << "VideoEncoder using " << ptr_backend_->name();
+      using_hardware_ = true;
+      return kSuccess;
+    }
+    ptr_backend_.reset();
+    if (backend == kVideoEncoderHardware) {
+      LOG(ERROR) << "hardware video encoder Init failed: " << status;
+      return status;
+    }
+    LOG(INFO) << "no usable hardware video encoder, using libvpx.";
+  }
+#else
+  if (backend == kVideoEncoderHardware) {
+    LOG(ERROR) << "hardware video encoding requires Windows.";
+    return kInvalidArg;
+  }
+#endif  // _WIN32
+  return InitSoftwareEncoder();
 }
 
 int VideoEncoder::EncodeFrame(const VideoFrame& raw_frame,
                               VideoFrame* ptr_vpx_frame) {
-  if (!ptr_vpx_encoder_) {
+  if (!ptr_backend_) {
+    LOG(ERROR) << "VideoEncoder has NULL encoder, not Init'd";
+    return kEncoderError;
+  }
+  const int64 requests = keyframe_requests_.load();
+  const bool scene_cut = SceneCutDue(raw_frame);
+  if (KeyframeDue(raw_frame.timestamp(), requests)) {
+    ptr_backend_->ForceKeyframe();
+  } else if (scene_cut) {
+    ++scene_cut_keyframes_;
+    ptr_backend_->ForceKeyframe();
+  }
+  if (regions_changed_.exchange(false)) {
+    std::vector<RegionOfInterest> regions;
+    {
+      std::lock_guard<std::mutex> lock(regions_mutex_);
+      regions.swap(pending_regions_);
+    }
+    if (ptr_backend_->SetRegionsOfInterest(regions) == kSuccess) {
+      ptr_config_->vpx_config.regions_of_interest.swap(regions);
+    } else {
+      LOG(WARNING) << ptr_backend_->name()
+                   << " cannot encode regions of interest.";
+    }
+  }
+  int32 status = ptr_backend_->EncodeFrame(raw_frame, ptr_vpx_frame);
+  if ((status == kCodecError || status == kEncoderError) && using_hardware_ &&
+      ptr_config_->vpx_config.encoder_backend == kVideoEncoderAuto) {
+    // The hardware encoder failed; continue the stream with libvpx. Its
+    // first frame is a keyframe, so decoding resumes cleanly.
+    LOG(ERROR) << ptr_backend_->name() << " EncodeFrame failed (" << status
+               << "), falling back to libvpx.";
+    frames_in_offset_ += ptr_backend_->frames_in();
+    frames_out_offset_ += ptr_backend_->frames_out();
+    status = InitSoftwareEncoder();
+    if (status == kSuccess) {
+      status = ptr_backend_->EncodeFrame(raw_frame, ptr_vpx_frame);
+    }
+  }
+  if (status == kSuccess && ptr_vpx_frame->keyframe()) {
+    // Any keyframe answers the requests made before its frame was encoded.
+    answered_requests_ = requests;
+  }
+  return status;
+}
+
+void VideoEncoder::RequestKeyframe() {
+  ++keyframe_requests_;
+}
+
+bool VideoEncoder::KeyframeDue(int64 timestamp, int64 requests) {
+  const VpxConfig& config = ptr_config_->vpx_config;
+  const int64 last_keyframe = ptr_backend_->last_keyframe_time();
+  bool due = false;
+  if (requests != answered_requests_ &&
+      timestamp - last_keyframe >= config.min_keyframe_request_interval) {
+    // The backend keeps the keyframe pending across frames it drops.
+    answered_requests_ = requests;
+    ++forced_keyframes_;
+    due = true;
+  }
+  if (config.aligned_keyframes && !config.intra_refresh &&
+      config.keyframe_interval > 0 &&
+      ptr_backend_->frames_out() > 0 &&
+      timestamp / config.keyframe_interval >
+          last_keyframe / config.keyframe_interval) {
+    due = true;
+  }
+  return due;
+}
+
+bool VideoEncoder::SceneCutDue(const VideoFrame& raw_frame) {
+  const VpxConfig& config = ptr_config_->vpx_config;
+  VideoPlanes planes;
+  if (config.scene_cut_threshold <= 0 ||
+      !VideoFrame::GetVisiblePlanes(raw_frame.config(), raw_frame.buffer(),
+                                    &planes)) {
+    return false;
+  }
+  if (!scene_cut_detector_.Detect(planes.data[0], planes.stride[0],
+                                  VisibleWidth(raw_frame.config()),
+                                  VisibleHeight(raw_frame.config()))) {
+    return false;
+  }
+  const int64 time_since_keyframe =
+      raw_frame.timestamp() - ptr_backend_->last_keyframe_time();
+  VLOG(1) << "scene cut at " << raw_frame.timestamp() << ": histogram "
+          << scene_cut_detector_.histogram_change() << "%, cells "
+          << scene_cut_detector_.cell_change() << "%, "
+          << time_since_keyframe << " ms after the last keyframe.";
+  return ptr_backend_->frames_out() > 0 &&
+         time_since_keyframe >= config.min_scene_cut_interval;
+}
+
+void VideoEncoder::SetInputBacklog(int32 queued_frames, int32 capacity) {
+  if (ptr_backend_) {
+    ptr_backend_->SetInputBacklog(queued_frames, capacity);
+  }
+}
+
+int32 VideoEncoder::SetBitrate(int bitrate) {
+  if (!ptr_backend_) {
+    LOG(ERROR) << "VideoEncoder has NULL encoder, not Init'd";
+    return kEncoderError;
+  }
+  if (bitrate <= 0) {
+    return kInvalidArg;
+  }
+  const int32 status = ptr_backend_->SetBitrate(bitrate);
+  if (status == kSuccess) {
+    ptr_config_->vpx_config.bitrate = bitrate;
+  }
+  return status;
+}
+
+int32 VideoEncoder::SetFrameSize(int32 width, int32 height) {
+  if (!ptr_backend_) {
+    LOG(ERROR) << "VideoEncoder has NULL encoder, not Init'd";
+    return kEncoderError;
+  }
+  if (width <= 0 || height <= 0) {
+    return kInvalidArg;
+  }
+  return ptr_backend_->SetFrameSize(width, height);
+}
+
+int32 VideoEncoder::ReadPendingFrame(VideoFrame* ptr_vpx_frame) {
+  if (!ptr_backend_) {
+    LOG(ERROR) << "VideoEncoder has NULL encoder, not Init'd";
+    return kEncoderError;
+  }
+  return ptr_backend_->ReadPendingFrame(ptr_vpx_frame);
+}
+
+int32 VideoEncoder::Flush() {
+  if (!ptr_backend_) {
+    LOG(ERROR) << "VideoEncoder has NULL encoder, not Init'd";
+    return kEncoderError;
+  }
+  return ptr_backend_->Flush();
+}
+
+int32 VideoEncoder::pending_frames() const {
+  return ptr_backend_ ? ptr_backend_->pending_frames() : 0;
+}
+
+int32 VideoEncoder::SetSpeed(int speed) {
+  if (!ptr_backend_) {
     LOG(ERROR) << "VideoEncoder has NULL encoder, not Init'd";
     return kEncoderError;
   }
-  return ptr_vpx_encoder_->EncodeFrame(raw_frame, ptr_vpx_frame);
+  const int32 status = ptr_backend_->SetSpeed(speed);
+  if (status == kSuccess) {
+    ptr_config_->vpx_config.speed = speed;
+  }
+  return status;
+}
+
+int32 VideoEncoder::SetKeyframeInterval(int keyframe_interval) {
+  if (!ptr_backend_) {
+    LOG(ERROR) << "VideoEncoder has NULL encoder, not Init'd";
+    return kEncoderError;
+  }
+  if (keyframe_interval <= 0) {
+    return kInvalidArg;
+  }
+  const int32 status = ptr_backend_->SetKeyframeInterval(keyframe_interval);
+  if (status == kSuccess) {
+    ptr_config_->vpx_config.keyframe_interval = keyframe_interval;
+  }
+  return status;
+}
+
+int32 VideoEncoder::SetRegionsOfInterest(
+    const std::vector<RegionOfInterest>& regions) {
+  if (!ValidRegionsOfInterest(regions)) {
+    return kInvalidArg;
+  }
+  {
+    std::lock_guard<std::mutex> lock(regions_mutex_);
+    pending_regions_ = regions;
+  }
+  regions_changed_ = true;
+  return kSuccess;
+}
+
+int VideoEncoder::load_state() const {
+  return ptr_backend_ ? ptr_backend_->load_state() : kLoadNormal;
 }
 
 int64 VideoEncoder::frames_in() const {
-  return ptr_vpx_encoder_ ? ptr_vpx_encoder_->frames_in() : 0;
+  return frames_in_offset_ + (ptr_backend_ ? ptr_backend_->frames_in() : 0);
 }
 
 int64 VideoEncoder::frames_out() const {
-  return ptr_vpx_encoder_ ? ptr_vpx_encoder_->frames_out() : 0;
+  return frames_out_offset_ + (ptr_backend_ ? ptr_backend_->frames_out() : 0);
 }
 
 int64 VideoEncoder::last_keyframe_time() const {
-  return ptr_vpx_encoder_ ? ptr_vpx_encoder_->last_keyframe_time() : 0;
+  return ptr_backend_ ? ptr_backend_->last_keyframe_time() : 0;
 }
 
 int64 VideoEncoder::last_timestamp() const {
-  return ptr_vpx_encoder_ ? ptr_vpx_encoder_->last_timestamp() : 0;
+  return ptr_backend_ ? ptr_backend_->last_timestamp() : 0;
+}
+
+int VideoEncoder::speed() const {
+  return ptr_backend_ ? ptr_backend_->speed() : 0;
+}
+
+const char* VideoEncoder::backend_name() const {
+  return ptr_backend_ ? ptr_backend_->name() : "";
+}
+
+int32 VideoEncoder::InitialFrameBufferSize(const WebmEncoderConfig& config) {
+  return VpxEncoder::InitialOutputBufferSize(
+      config.vpx_config, config.actual_video_config.frame_rate);
+}
+
+int32 VideoEncoder::InitSoftwareEncoder() {
+  using_hardware_ = false;
+  if (ptr_config_->vpx_config.parallel_gops > 1) {
+    ParallelGopEncoder* const ptr_encoder =
+        new (std::nothrow) ParallelGopEncoder();  // NOLINT
+    if (ptr_encoder) {
+      ptr_encoder->set_frame_profiler(&frame_profiler_);
+    }
+    ptr_backend_.reset(ptr_encoder);
+  } else {
+    VpxEncoder* const ptr_encoder = new (std::nothrow) VpxEncoder();  // NOLINT
+    if (ptr_encoder) {
+      ptr_encoder->set_frame_profiler(&frame_profiler_);
+    }
+    ptr_backend_.reset(ptr_encoder);
+  }
+  if (!ptr_backend_) {
+    return kNoMemory;
+  }
+  return ptr_backend_->Init(*ptr_config_);
 }
 
 }  // namespace webmlive
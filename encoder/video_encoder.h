@@ -8,12 +8,17 @@
 #ifndef WEBMLIVE_ENCODER_VIDEO_ENCODER_H_
 #define WEBMLIVE_ENCODER_VIDEO_ENCODER_H_
 
+#include <atomic>
 #include <memory>
 #include <mutex>
 #include <queue>
+#include <vector>
 
 #include "encoder/basictypes.h"
 #include "encoder/encoder_base.h"
+#include "encoder/frame_type_profiler.h"
+#include "encoder/media_arena.h"
+#include "encoder/scene_cut_detector.h"
 
 namespace webmlive {
 
@@ -27,7 +32,19 @@ enum VideoFormat {
   kVideoFormatRGB = 6,
   kVideoFormatRGBA = 7,
   kVideoFormatVP9 = 8,
-  kVideoFormatCount = 9,
+  kVideoFormatNV12 = 9,
+
+  // Motion JPEG: each frame is a JPEG image, decoded to I420 by
+  // |VideoConversionPlan| when libyuv is built with JPEG support.
+  kVideoFormatMJPG = 10,
+  kVideoFormatCount = 11,
+};
+
+// Field order of interlaced video frames, or none for progressive frames.
+enum VideoFieldOrder {
+  kVideoProgressive = 0,
+  kVideoTopFieldFirst = 1,
+  kVideoBottomFieldFirst = 2,
 };
 
 // YUV bit count constants.
@@ -56,8 +73,9 @@ bool FourCCToVideoFormat(uint32 fourcc,
                          VideoFormat* ptr_format);
 
 // Video configuration control structure. Values set to 0 mean use default.
-// Only |width|, |height|, and |frame_rate| are configurable. |format| and
-// |stride| are controlled by the input device.
+// Only |width|, |height|, |frame_rate|, the crop rectangle and
+// |pad_alignment| are configurable. |format|, |stride| and |uv_stride| are
+// controlled by the input device.
 // TODO(tomfinegan): Write a VideoConfig validator.
 struct VideoConfig {
   VideoConfig()
@@ -65,25 +83,187 @@ struct VideoConfig {
         width(0),
         height(0),
         stride(0),
-        frame_rate(0) {}
+        uv_stride(0),
+        frame_rate(0),
+        field_order(kVideoProgressive),
+        crop_left(0),
+        crop_top(0),
+        crop_width(0),
+        crop_height(0),
+        pad_alignment(0) {}
 
   VideoFormat format;   // Video pixel format.
   int32 width;          // Width in pixels.
   int32 height;         // Height in pixels.
+
+  // Row length in bytes of packed formats, or of the Y plane of planar
+  // formats.
   int32 stride;
+
+  // Row length in bytes of the chroma planes of planar formats. When 0, the
+  // planes are packed back to back with |width| and |width / 2| byte rows.
+  // Otherwise each plane starts on a |kVideoFrameAlignment| boundary.
+  int32 uv_stride;
   double frame_rate;    // Frame rate in frames per second.
+
+  // Field order reported by the source for interlaced video.
+  VideoFieldOrder field_order;
+
+  // Visible region of the frame, in pixels. The video encoders read it in
+  // place and encode only it. The whole frame when |crop_width| or
+  // |crop_height| is 0. |crop_left| and |crop_top| must be even.
+  int32 crop_left;
+  int32 crop_top;
+  int32 crop_width;
+  int32 crop_height;
+
+  // Multiple, in pixels, that the encoded width and height are rounded up
+  // to, at most |kMaxVideoPadAlignment|. The padding is read in place from
+  // the stride and the rows past the visible region, and the WebM track's
+  // PixelCrop hides it from players. No padding when 0 or 1.
+  int32 pad_alignment;
+};
+
+const int32 kMaxVideoPadAlignment = 64;
+
+// Returns true when the crop rectangle of |config| lies within its frame,
+// and its |pad_alignment| is valid.
+bool ValidVideoCrop(const VideoConfig& config);
+
+// Returns the width and height of the visible region of |config| frames.
+int32 VisibleWidth(const VideoConfig& config);
+int32 VisibleHeight(const VideoConfig& config);
+
+// Returns |config| as encoded: the visible size rounded up to
+// |pad_alignment|, with the visible region at the top left corner when
+// padding was added, and no crop otherwise.
+VideoConfig EncodedVideoConfig(const VideoConfig& config);
+
+// Alignment in bytes of |VideoFrame| buffers, and of the planes and strides
+// of frames |VideoFrame| converts or scales.
+const int32 kVideoFrameAlignment = kMediaBufferAlignment;
+
+// Plane pointers and strides of an I420, YV12 or NV12 frame, always in Y, U, V
+// order. NV12 frames have a Y plane and an interleaved UV plane; |data[2]| is
+// NULL.
+struct VideoPlanes {
+  uint8* data[3];
+  int32 stride[3];
+};
+
+// Conversion of the frames of one capture format and size to I420: the
+// libyuv function, the source and target plane offsets and strides, and the
+// layout of the converted frame, settled when the format is negotiated. The
+// conversion of a frame is then a single indirect call into the buffer of
+// the target frame, which |VideoFrame| reuses from frame to frame.
+//
+// Notes:
+// - libyuv selects the SIMD row functions of its conversions from CPU flags
+//   it detects once per process. |Init()| runs the detection, so that the
+//   first frame converted does not pay for it.
+// - |VideoSinkPin| builds a plan when its media type is set, and attaches it
+//   to the frames it delivers. |VideoFrame::InitConverted()| builds and
+//   caches its own for frames that arrive without one.
+// - MJPEG frames are decoded by libyuv's libjpeg(-turbo) backed
+//   |MJPGToI420()|, which needs the length of each frame. Builds without
+//   |HAVE_JPEG| cannot convert them.
+// - Immutable once initialized, and so shared between threads.
+class VideoConversionPlan {
+ public:
+  enum {
+    kInvalidArg = -1,
+    kSuccess = 0,
+  };
+
+  VideoConversionPlan();
+  ~VideoConversionPlan() {}
+
+  // Plans the conversion of |source_config| frames to I420. Returns
+  // |kSuccess|, or |kInvalidArg| when |source_config| has no size, or a
+  // format other than NV12 and those |VideoFrame::NeedsConversion()| is true
+  // for.
+  int Init(const VideoConfig& source_config);
+
+  // Returns true when |Init()| can plan the conversion of |format| frames.
+  static bool CanConvert(VideoFormat format);
+
+  // Returns true when frames of |config| have the format, size and strides
+  // the plan was built for.
+  bool Matches(const VideoConfig& config) const;
+
+  // Converts the |source_length| byte source frame at |ptr_source| into the
+  // |target_size()| byte buffer at |ptr_target|. Returns 0, or the error
+  // returned by libyuv.
+  int Convert(const uint8* ptr_source, int32 source_length,
+              uint8* ptr_target) const;
+
+  const VideoConfig& source_config() const { return source_config_; }
+
+  // Size and strides of converted frames: I420, with |kVideoFrameAlignment|
+  // aligned planes and strides, and no crop.
+  int32 target_size() const { return target_size_; }
+  int32 target_y_stride() const { return target_stride_[0]; }
+  int32 target_uv_stride() const { return target_stride_[1]; }
+
+  // CPU flags libyuv detected when the plan was built.
+  int cpu_flags() const { return cpu_flags_; }
+
+ private:
+  // Signatures of the libyuv conversions of packed formats, and of formats
+  // with a Y plane and an interleaved chroma plane.
+  typedef int (*PackedToI420Func)(const uint8* src, int src_stride,
+                                  uint8* dst_y, int dst_stride_y,
+                                  uint8* dst_u, int dst_stride_u,
+                                  uint8* dst_v, int dst_stride_v,
+                                  int width, int height);
+  typedef int (*BiPlanarToI420Func)(const uint8* src_y, int src_stride_y,
+                                    const uint8* src_uv, int src_stride_uv,
+                                    uint8* dst_y, int dst_stride_y,
+                                    uint8* dst_u, int dst_stride_u,
+                                    uint8* dst_v, int dst_stride_v,
+                                    int width, int height);
+  typedef int (*MjpegToI420Func)(const uint8* sample, size_t sample_size,
+                                 uint8* dst_y, int dst_stride_y,
+                                 uint8* dst_u, int dst_stride_u,
+                                 uint8* dst_v, int dst_stride_v,
+                                 int src_width, int src_height,
+                                 int dst_width, int dst_height);
+
+  // Exactly one is set once |Init()| succeeds.
+  PackedToI420Func packed_func_;
+  BiPlanarToI420Func biplanar_func_;
+  MjpegToI420Func mjpeg_func_;
+
+  VideoConfig source_config_;
+  int32 source_offset_[2];
+  int32 source_stride_[2];
+  int32 target_offset_[3];
+  int32 target_stride_[3];
+  int32 target_size_;
+
+  // Height passed to libyuv: negated for the bottom-up RGB formats.
+  int32 convert_height_;
+  int cpu_flags_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(VideoConversionPlan);
 };
 
-// Storage class for I420, YV12, and VPx video frames. The main idea here is to
-// store frames in such a way that they can easily be obtained from the capture
-// source and passed to the libvpx VPx encoder.
+// Storage class for I420, YV12, NV12 and VPx video frames. The main idea here
+// is to store frames in such a way that they can easily be obtained from the
+// capture source and passed to the libvpx VPx encoder.
 //
 // Notes
-// - Libvpx's VP8 encoder supports only I420 and YV12 input.
-//   |VideoFrame::Init()| converts all uncompressed formats other than
-//   |kVideoFormatI420| and |kVideoFormatYV12| to |kVideoFormatI420|.
+// - Libvpx's VP8 encoder supports I420 and YV12 input, and NV12 input in
+//   libvpx versions that define |VPX_IMG_FMT_NV12|. |VideoFrame::Init()|
+//   converts all uncompressed formats other than |kVideoFormatI420|,
+//   |kVideoFormatYV12| and |kVideoFormatNV12| to |kVideoFormatI420|.
 // - Libvpx's VP9 encoder supports formats beyond those above, but support for
 //   those formats is not implemented here.
+// - Buffers are |kVideoFrameAlignment| aligned. Frames produced by conversion
+//   or scaling also have aligned planes and padded strides, described by
+//   |VideoConfig::stride| and |VideoConfig::uv_stride|.
+// - |VideoFrame::InitNative()| and |VideoFrame::InitInPlace()| store frames in
+//   their capture format. Such frames must pass through |InitConverted()|
+//   before they reach the encoder when |NeedsConversion()| is true.
 class VideoFrame {
  public:
   enum {
@@ -93,6 +273,11 @@ class VideoFrame {
     kSuccess = 0,
   };
   VideoFrame();
+
+  // Moving takes |other|'s storage and leaves it with this frame's previous
+  // storage, so recycled frames keep their buffers. Never allocates.
+  VideoFrame(VideoFrame&& other) noexcept;
+  VideoFrame& operator=(VideoFrame&& other) noexcept;
   ~VideoFrame();
 
   // Allocates storage for |ptr_data|, sets internal fields to values of
@@ -101,8 +286,8 @@ class VideoFrame {
   // |VideoFormat| enumeration value. Returns |kNoMemory| when unable to
   // allocate storage for |ptr_data|.
   // Note: When format is not one of |kVideoFormatI420|, |kVideoFormatYV12|,
-  //       |kVideoFormatVP8| or |kVideoFormatVP9|, |Init()| converts the frame
-  //       data to I420.
+  //       |kVideoFormatNV12|, |kVideoFormatVP8| or |kVideoFormatVP9|,
+  //       |Init()| converts the frame data to I420.
   int Init(const VideoConfig& config,
            bool keyframe,
            int64 timestamp,
@@ -110,13 +295,91 @@ class VideoFrame {
            const uint8* ptr_data,
            int32 data_length);
 
-  // Copies |VideoFrame| data to |ptr_frame|. Performs allocation if necessary.
-  // Returns |kSuccess| when successful. Returns |kInvalidArg| when |ptr_frame|
-  // is NULL. Returns |kNoMemory| when memory allocation fails.
+  // Copies |ptr_data| into |buffer()| without format conversion, and sets
+  // internal fields to values of caller's args. Returns |kSuccess| when
+  // successful, |kInvalidArg| when |ptr_data| is NULL, or |kNoMemory| when
+  // unable to allocate storage.
+  int InitNative(const VideoConfig& config,
+                 bool keyframe,
+                 int64 timestamp,
+                 int64 duration,
+                 const uint8* ptr_data,
+                 int32 data_length);
+
+  // Stores |source| converted to I420, reusing |buffer()| when it is large
+  // enough. I420, YV12 and compressed frames are copied. The frame keeps the
+  // crop and padding of |source|. Converts with |source.conversion_plan()|
+  // when it matches |source|, and otherwise with a plan the frame caches
+  // until the source format or size changes. Returns |kSuccess| when
+  // successful. Returns |kInvalidArg| when |source| is empty.
+  int InitConverted(const VideoFrame& source);
+
+  // Sets internal fields to values of caller's args for frame data already
+  // written to |buffer()| by the caller, and returns |kSuccess|. No data is
+  // copied or converted. Returns |kInvalidArg| when there is no buffer, or
+  // when |data_length| exceeds |buffer_capacity()|.
+  int InitInPlace(const VideoConfig& config,
+                  bool keyframe,
+                  int64 timestamp,
+                  int64 duration,
+                  int32 data_length);
+
+  // Ensures that |buffer()| can store at least |capacity| bytes. Existing
+  // frame data is discarded when reallocation is necessary. Returns |kSuccess|
+  // when successful, or |kNoMemory| when allocation fails.
+  int Reserve(int32 capacity);
+
+  // Scales the visible region of the I420 or YV12 frame |source| to
+  // |width|x|height| and stores the result, without crop or padding, in I420
+  // format, reusing |buffer()| when it is large enough. Copies
+  // the timestamp, duration and keyframe flag of |source|. Returns |kSuccess|
+  // when successful. Returns |kInvalidArg| when |source| is empty, or when
+  // |width| or |height| is not a positive even number.
+  int InitScaled(const VideoFrame& source, int32 width, int32 height);
+
+  // Returns true when |Init()| must convert frames in |format| to I420.
+  static bool NeedsConversion(VideoFormat format);
+
+  // Returns true when the |format| frame of |length| bytes at |ptr_data| is
+  // a VP8 or VP9 keyframe, as its frame header says. Returns false for other
+  // formats, and for data too short to hold a header.
+  static bool IsVpxKeyframe(VideoFormat format, const uint8* ptr_data,
+                            int32 length);
+
+  // Returns the buffer size of a |width|x|height| I420 frame produced by
+  // conversion or scaling, with padded strides.
+  static int32 I420BufferSize(int32 width, int32 height);
+
+  // Locates the planes of the I420, YV12 or NV12 frame described by |config|
+  // at |ptr_data|. Returns false for other formats.
+  static bool GetPlanes(const VideoConfig& config, const uint8* ptr_data,
+                        VideoPlanes* ptr_planes);
+
+  // As |GetPlanes()|, for the visible region of the frame.
+  static bool GetVisiblePlanes(const VideoConfig& config,
+                               const uint8* ptr_data,
+                               VideoPlanes* ptr_planes);
+
+  // Returns the most bytes the encoders read past the end of a frame of
+  // |config| to encode its padding.
+  static int32 PaddingSize(const VideoConfig& config);
+
+  // Sets the crop rectangle and |pad_alignment| of the frame to those of
+  // |crop_config|. The frame data stays in place, and moves to a larger
+  // buffer only when the padded region extends past |buffer_capacity()|.
+  // Returns |kSuccess| when successful, |kNoMemory| when the buffer cannot
+  // grow, and |kInvalidArg| when they do not fit the frame, or the frame is
+  // not I420, YV12 or NV12.
+  int SetCrop(const VideoConfig& crop_config);
+
+  // Copies |VideoFrame| data to |ptr_frame|, reusing |ptr_frame|'s buffer when
+  // it is large enough. Returns |kSuccess| when successful. Returns
+  // |kInvalidArg| when |ptr_frame| is NULL. Returns |kNoMemory| when memory
+  // allocation fails.
   int Clone(VideoFrame* ptr_frame) const;
 
-  // Swaps |VideoFrame| member data with |ptr_frame|'s. The |VideoFrame|s
-  // must have non-NULL buffers.
+  // Swaps |VideoFrame| member data with |ptr_frame|'s. Either buffer may be
+  // NULL.
   void Swap(VideoFrame* ptr_frame);
 
   // Accessors/Mutators.
@@ -127,27 +390,81 @@ class VideoFrame {
   int64 timestamp() const { return timestamp_; }
   void set_timestamp(int64 timestamp) { timestamp_ = timestamp; }
   int64 duration() const { return duration_; }
+  void set_duration(int64 duration) { duration_ = duration; }
+
+  // Wall clock time at which the frame was captured, in microseconds since
+  // the Unix epoch, or 0 when unknown. The |Init*()| methods that take frame
+  // properties from their arguments reset it; the others, |Clone()| and
+  // |Swap()| carry it with the frame.
+  int64 capture_time() const { return capture_time_; }
+  void set_capture_time(int64 capture_time) { capture_time_ = capture_time; }
+
+  // Temporal scalability layer of a compressed frame, 0 for the base layer
+  // and for streams without layers. Frames of a layer only reference frames
+  // of the same or lower layers, so removing the upper layers leaves a
+  // decodable stream at a lower frame rate. Handled like |capture_time()|.
+  int temporal_layer() const { return temporal_layer_; }
+  void set_temporal_layer(int layer) { temporal_layer_ = layer; }
   uint8* buffer() const { return buffer_.get(); }
   int32 buffer_length() const { return buffer_length_; }
   int32 buffer_capacity() const { return buffer_capacity_; }
   VideoFormat format() const { return config_.format; }
   const VideoConfig& config() const { return config_; }
 
+  // Arena the frame allocates storage from, or NULL for the heap. The arena
+  // belongs to the frame object: |Swap()| exchanges storage, which is freed
+  // to wherever it came from, but not arenas.
+  const std::shared_ptr<MediaArena>& arena() const { return arena_; }
+  void set_arena(const std::shared_ptr<MediaArena>& arena) { arena_ = arena; }
+
+  // Plan converting the frame to I420, attached by the source that produced
+  // it, or NULL. Carried like |capture_time()|, but only |InitConverted()|,
+  // which converts the frame, resets it. |InitConverted()| ignores a plan
+  // that does not match its source.
+  const std::shared_ptr<const VideoConversionPlan>& conversion_plan() const {
+    return conversion_plan_;
+  }
+  void set_conversion_plan(
+      const std::shared_ptr<const VideoConversionPlan>& plan) {
+    conversion_plan_ = plan;
+  }
+
  private:
-  // Converts video frame from |config.format| to I420, and stores the I420
-  // frame in |buffer_|. Returns |kSuccess| when successful. Returns
-  // |kNoMemory| if unable to allocate storage for the converted video frame.
-  // Note: Output stride is equal to |config.width| after conversion, and stored
-  //       in |config_.stride|.
-  int ConvertToI420(const VideoConfig& config, const uint8* ptr_data);
+  // Converts the |data_length| byte video frame at |ptr_data| from
+  // |config.format| to I420 with |ptr_plan|, or with |cached_plan_| when
+  // |ptr_plan| is NULL or does not match |config|, and stores the I420 frame
+  // in |buffer_|. Returns |kSuccess| when successful. Returns |kNoMemory| if
+  // unable to allocate storage for the converted video frame.
+  // Note: Output strides are padded, and stored in |config_.stride| and
+  //       |config_.uv_stride|.
+  int ConvertToI420(const VideoConfig& config, const uint8* ptr_data,
+                    int32 data_length, const VideoConversionPlan* ptr_plan);
+
+  // Sets up |config_| and |buffer_| for a |width|x|height| I420 frame with
+  // strides padded to |kVideoFrameAlignment|. Returns |kSuccess| when
+  // successful, or |kNoMemory| when allocation fails.
+  int ReserveI420(int32 width, int32 height);
+
+  // Replaces |buffer_| with a |kVideoFrameAlignment| aligned buffer of at
+  // least |size| bytes from |arena_|, discarding the frame data. Returns
+  // |kSuccess| when successful, or |kNoMemory| when allocation fails.
+  int AllocateBuffer(int32 size);
 
   bool keyframe_;
   int64 timestamp_;
   int64 duration_;
-  std::unique_ptr<uint8[]> buffer_;
+  int64 capture_time_;
+  int temporal_layer_;
+  MediaBuffer buffer_;
   int32 buffer_capacity_;
   int32 buffer_length_;
   VideoConfig config_;
+  std::shared_ptr<MediaArena> arena_;
+  std::shared_ptr<const VideoConversionPlan> conversion_plan_;
+
+  // Plan of the last conversion of a frame that had no matching plan of its
+  // own. Belongs to the frame object, like |arena_|.
+  std::unique_ptr<VideoConversionPlan> cached_plan_;
   WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(VideoFrame);
 };
 
@@ -170,19 +487,67 @@ class VideoFrameCallbackInterface {
   virtual int OnVideoFrameReceived(VideoFrame* ptr_frame) = 0;
 };
 
+// Region of a frame encoded at a different quality than the rest. The
+// position and size are fractions of the frame width and height, so a
+// region applies to every frame size of the stream.
+struct RegionOfInterest {
+  // Largest |delta_q| magnitude, and the number of distinct non-zero
+  // |delta_q| values a set of regions may use.
+  static const int kMaxDeltaQ = 63;
+  static const int kMaxQualityLevels = 3;
+
+  RegionOfInterest() : left(0), top(0), width(0), height(0), delta_q(0) {}
+
+  double left;
+  double top;
+  double width;
+  double height;
+
+  // Quantizer offset of the region. Negative values spend more bits on the
+  // region than on the rest of the frame, positive values fewer.
+  int delta_q;
+};
+
+// Video encoder implementations |VideoEncoder| can select.
+enum VideoEncoderBackendType {
+  // Software VPx encoding with libvpx.
+  kVideoEncoderSoftware = 0,
+
+  // A hardware VPx encoder exposed as a Media Foundation transform (MFT).
+  // |VideoEncoder::Init()| fails when no usable hardware encoder is present.
+  kVideoEncoderHardware = 1,
+
+  // Use a hardware encoder when one is available, and libvpx otherwise. Falls
+  // back to libvpx when the hardware encoder fails mid-stream.
+  kVideoEncoderAuto = 2,
+};
+
 struct VpxConfig {
   // Special value that means use the default value for the current option.
   static const int kUseDefault = -200;
   VpxConfig()
       : keyframe_interval(1000),
+        aligned_keyframes(false),
+        intra_refresh(false),
+        min_keyframe_request_interval(500),
+        scene_cut_threshold(0),
+        min_scene_cut_interval(500),
         bitrate(500),
         codec(kVideoFormatVP8),
         decimate(kUseDefault),
         min_quantizer(2),
         max_quantizer(52),
         speed(-6),
+        adaptive_speed(false),
+        max_speed(kUseDefault),
+        latency_budget(0),
+        temporal_layers(1),
+        spatial_layers(1),
         static_threshold(kUseDefault),
+        static_detection(kUseDefault),
+        regions_of_interest(),
         thread_count(kUseDefault),
+        cpu_cores(kUseDefault),
         token_partitions(kUseDefault),
         undershoot(kUseDefault),
         noise_sensitivity(kUseDefault),
@@ -195,19 +560,55 @@ struct VpxConfig {
         error_resilient(false),
         goldenframe_cbr_boost(300),
         adaptive_quantization_mode(3),
-        tile_columns(4),
-        frame_parallel_mode(true) {}
+        tile_columns(kUseDefault),
+        frame_parallel_mode(true),
+        warmup_frames(0),
+        parallel_gops(0),
+        encoder_backend(kVideoEncoderSoftware) {}
 
   // Time between keyframes, in milliseconds.
   int keyframe_interval;
 
+  // Place keyframes at the first frame at or after each multiple of
+  // |keyframe_interval| in stream time, instead of |keyframe_interval| after
+  // the previous keyframe. Keyframes of encoders sharing a timeline then
+  // line up, and stay on the grid after forced keyframes.
+  bool aligned_keyframes;
+
+  // Refresh the picture progressively instead of with periodic keyframes,
+  // which keeps frame sizes flat: libvpx codes a band of blocks intra in
+  // every frame, and the bands cover the picture over each refresh cycle,
+  // which is its recovery period. VP9 uses cyclic refresh adaptive
+  // quantization, VP8 the cyclic background refresh of its error resilient
+  // mode. Keyframes are encoded only when requested with
+  // |VideoEncoder::RequestKeyframe()|, for example for a new viewer.
+  // |WebmEncoder| allows it only for muxed output without DASH.
+  bool intra_refresh;
+
+  // Shortest time, in milliseconds, from a keyframe to one forced by
+  // |VideoEncoder::RequestKeyframe()|. Requests arriving sooner wait for it.
+  int min_keyframe_request_interval;
+
+  // Place a keyframe on each scene cut, from which the |keyframe_interval|
+  // restarts, instead of spending the bits of a near intra inter frame on the
+  // cut and of a keyframe moments later. A frame is a cut when it differs
+  // from the previous one by at least |scene_cut_threshold| percent, see
+  // |SceneCutDetector|. Cuts less than |min_scene_cut_interval| milliseconds
+  // after a keyframe get none, which bounds the shortest keyframe interval,
+  // and so segment, that cuts produce. 0 disables detection. Not used with
+  // |aligned_keyframes| or |intra_refresh|.
+  int scene_cut_threshold;
+  int min_scene_cut_interval;
+
   // Video bitrate, in kilobits.
   int bitrate;
 
   // Video codec, kVideoFormatVP8 or kVideoFormatVP9.
   VideoFormat codec;
 
-  // Video frame rate decimation factor.
+  // Video frame rate decimation factor. |WebmEncoder| converts the frame
+  // rate to the capture rate divided by it, unless
+  // |WebmEncoderConfig::output_frame_rate| is set.
   int decimate;
 
   // Minimum quantizer value.
@@ -219,13 +620,63 @@ struct VpxConfig {
   // Encoder complexity.
   int speed;
 
+  // Adaptive speed control. When enabled |VpxEncoder| raises the encoder speed
+  // from |speed| (the best quality allowed) toward |max_speed| when encoding
+  // cannot keep up with realtime, and lowers it again when load drops.
+  bool adaptive_speed;
+
+  // Fastest speed used by adaptive speed control. |kUseDefault| uses the
+  // fastest realtime speed of |codec|.
+  int max_speed;
+
+  // Encoder latency allowed in exchange for compression efficiency, in
+  // milliseconds. libvpx holds that much video for lookahead, up to 25
+  // frames; from 8 frames on it also encodes alternate reference frames,
+  // with VBR rate control and the good quality deadline. 0 encodes each
+  // frame as it arrives.
+  int latency_budget;
+
+  // Number of temporal scalability layers, 1 to 3. With 2 layers every
+  // other frame is in the base layer, which gets 60% of |bitrate|; with 3
+  // the base layer has every fourth frame and 40% of |bitrate|, and the
+  // middle layer 20% more. Upper layers can be removed from the stream to
+  // halve or quarter its frame rate. Disables |latency_budget|.
+  int temporal_layers;
+
+  // Number of VP9 spatial scalability layers, 1 to 3. Each layer has half
+  // the width and height of the one above it, and predicts from it, so one
+  // encode analyzes the frame for every size. The layers of a frame are
+  // written as one VP9 superframe: decoders show the full size frame, and
+  // SVC-aware packagers can cut superframes down to the smaller sizes.
+  // Disables |latency_budget|.
+  int spatial_layers;
+
   // Threshold at which a macroblock is considered static.
   int static_threshold;
 
-  // Encoder thead count.
+  // Static content detection. A 16x16 luma block whose mean absolute
+  // difference per pixel from its last encoded content is at most
+  // |static_detection| is unchanged: unchanged blocks are marked inactive
+  // in the libvpx active map, which skips them, and frames without changed
+  // blocks are not encoded for up to half a second, the previous frame
+  // staying on screen. 0 only skips identical blocks. |kUseDefault|
+  // disables detection. Requires realtime output and one spatial layer.
+  int static_detection;
+
+  // Regions encoded at a different quality from the start of the stream;
+  // see |VideoEncoder::SetRegionsOfInterest()|.
+  std::vector<RegionOfInterest> regions_of_interest;
+
+  // Encoder thead count. |kUseDefault| lets |VpxEncoder| choose a count from
+  // the frame size and |cpu_cores|.
   int thread_count;
 
-  // Number of token partitions.
+  // Number of CPU cores available to this encoder. Used to choose
+  // |thread_count|, |token_partitions| and |tile_columns| when they are
+  // |kUseDefault|. |kUseDefault| means all hardware threads of the host.
+  int cpu_cores;
+
+  // Number of token partitions, log2. |kUseDefault| lets |VpxEncoder| choose.
   int token_partitions;
 
   // Percentage to undershoot the requested datarate.
@@ -262,19 +713,106 @@ struct VpxConfig {
   // 3: cyclic refresh (default)
   int adaptive_quantization_mode;
 
-  // Number of tile columns, log2.
+  // Number of tile columns, log2. |kUseDefault| lets |VpxEncoder| choose.
   int tile_columns;
 
   // Enables frame parallel decoding features.
   bool frame_parallel_mode;
+
+  // Synthetic frames |VpxEncoder::Init()| encodes and discards, so that
+  // libvpx allocates its buffers and threads before the first real frame,
+  // which is then encoded as a keyframe at steady-state latency. 0 disables
+  // the warmup. Ignored with lookahead or scalability layers.
+  int warmup_frames;
+
+  // Closed GOPs encoded at once, each by a libvpx encoder of its own, for
+  // input that need not be encoded in real time. Values below 2 encode frames
+  // one at a time. |WebmEncoder| allows it only for free running input files
+  // and capture dumps. See |ParallelGopEncoder|.
+  int parallel_gops;
+
+  // Encoder implementation. Hardware encoders honor |codec|, |bitrate|,
+  // |keyframe_interval| and |decimate|; the remaining settings apply only to
+  // libvpx.
+  VideoEncoderBackendType encoder_backend;
 };
 
-// Forward declaration of |VpxEncoder| class for use in |VideoEncoder|. The
-// libvpx implementation details are kept hidden because use of the includes
-// produces C4505 warnings with MSVC at warning level 4.
-class VpxEncoder;
 struct WebmEncoderConfig;
 
+// Interface implemented by each VPx encoder |VideoEncoder| can use. Error
+// codes are those of |VideoEncoder|.
+class VideoEncoderBackend {
+ public:
+  virtual ~VideoEncoderBackend() {}
+
+  // Prepares the encoder for |config| and returns |VideoEncoder::kSuccess|.
+  virtual int Init(const WebmEncoderConfig& config) = 0;
+
+  // Encodes |raw_frame| and returns the oldest compressed frame not yet
+  // returned via |ptr_vpx_frame|. Returns |VideoEncoder::kDropped| when no
+  // compressed frame is ready.
+  virtual int EncodeFrame(const VideoFrame& raw_frame,
+                          VideoFrame* ptr_vpx_frame) = 0;
+
+  // Moves the oldest of the |pending_frames()| to |ptr_vpx_frame|. Returns
+  // |VideoEncoder::kDropped| when there are none.
+  virtual int ReadPendingFrame(VideoFrame* ptr_vpx_frame) = 0;
+
+  // Ends the input: the frames the encoder still holds become
+  // |pending_frames()|. Returns |VideoEncoder::kSuccess| when successful.
+  virtual int Flush() = 0;
+
+  // Returns the number of compressed frames ready beyond those returned by
+  // |EncodeFrame()|.
+  virtual int32 pending_frames() const = 0;
+
+  // Reports input queue occupancy. Encoders without speed control ignore it.
+  virtual void SetInputBacklog(int32 queued_frames, int32 capacity) = 0;
+
+  // Makes the next frame encoded by |EncodeFrame()| a keyframe.
+  virtual void ForceKeyframe() = 0;
+
+  // Changes the target bitrate, in kilobits, of frames encoded from now on.
+  // Returns |VideoEncoder::kSuccess| when successful.
+  virtual int SetBitrate(int bitrate) = 0;
+
+  // Changes the size of frames encoded from now on to |width|x|height|,
+  // which must not exceed the size passed to |Init()|. Returns
+  // |VideoEncoder::kSuccess| when successful.
+  virtual int SetFrameSize(int32 width, int32 height) = 0;
+
+  // Changes the |VpxConfig::speed| of frames encoded from now on. Returns
+  // |VideoEncoder::kSuccess| when successful.
+  virtual int SetSpeed(int speed) = 0;
+
+  // Changes |VpxConfig::keyframe_interval|, in milliseconds, from the next
+  // frame on. Returns |VideoEncoder::kSuccess| when successful.
+  virtual int SetKeyframeInterval(int keyframe_interval) = 0;
+
+  // Replaces the regions of interest, validated by |VideoEncoder|, from the
+  // next frame on. Returns |VideoEncoder::kSuccess| when successful.
+  virtual int SetRegionsOfInterest(
+      const std::vector<RegionOfInterest>& regions) = 0;
+
+  // Returns a |VideoEncoder::LoadState| value describing whether the
+  // encoder keeps up with its input.
+  virtual int load_state() const = 0;
+
+  // Returns a short name identifying the implementation, for logging.
+  virtual const char* name() const = 0;
+
+  // Accessors.
+  virtual int64 frames_in() const = 0;
+  virtual int64 frames_out() const = 0;
+  virtual int64 last_keyframe_time() const = 0;
+  virtual int64 last_timestamp() const = 0;
+  virtual int speed() const = 0;
+};
+
+// VPx encoder facade. Selects libvpx or a hardware encoder in |Init()| using
+// |VpxConfig::encoder_backend|. The backend implementation details are kept
+// hidden because use of the libvpx includes produces C4505 warnings with MSVC
+// at warning level 4.
 class VideoEncoder {
  public:
   enum {
@@ -287,19 +825,156 @@ class VideoEncoder {
     kSuccess = 0,
     kDropped = 1,
   };
+
+  // Encoder load, as reported by |load_state()|.
+  enum LoadState {
+    // The encoder keeps up with its input, or does not measure its load.
+    kLoadNormal = 0,
+    // Encoding has stayed slower than realtime at the fastest speed setting.
+    kLoadSaturated = 1,
+    // Encoding has stayed well within realtime at the slowest speed setting.
+    kLoadIdle = 2,
+  };
+
   VideoEncoder();
   ~VideoEncoder();
   int32 Init(const WebmEncoderConfig& config);
+
+  // Encodes |raw_frame| with the selected backend. In |kVideoEncoderAuto|
+  // mode a hardware encoder failure switches to libvpx; the next frame
+  // returned is a keyframe from libvpx.
   int32 EncodeFrame(const VideoFrame& raw_frame, VideoFrame* ptr_vpx_frame);
 
+  // Encoders may produce more than one compressed frame from one raw frame,
+  // and may hold frames back: |VpxConfig::latency_budget| delays output and
+  // adds alternate reference frames. Callers read the frames beyond the one
+  // |EncodeFrame()| returns with |ReadPendingFrame()| while
+  // |pending_frames()| is non-zero, and call |Flush()| once input ends.
+  // |ReadPendingFrame()| returns |kDropped| when no frame is pending.
+  int32 ReadPendingFrame(VideoFrame* ptr_vpx_frame);
+  int32 Flush();
+  int32 pending_frames() const;
+
+  // Reports the number of raw frames waiting for |EncodeFrame()| and the
+  // capacity of their queue. Used by adaptive speed control.
+  void SetInputBacklog(int32 queued_frames, int32 capacity);
+
+  // Changes the target bitrate, in kilobits, of frames encoded from now on.
+  // The new bitrate survives a fallback to libvpx. Returns |kSuccess| when
+  // successful.
+  int32 SetBitrate(int bitrate);
+
+  // Changes the size of frames encoded from now on. |width|x|height| must not
+  // exceed the configured frame size, and frames passed to |EncodeFrame()|
+  // must have the new size. Returns |kSuccess| when successful.
+  int32 SetFrameSize(int32 width, int32 height);
+
+  // Changes the speed setting of frames encoded from now on; with
+  // |VpxConfig::adaptive_speed| it becomes the slowest speed adaptive
+  // control uses. Hardware encoders have no speed setting, and return
+  // |kInvalidArg|. Returns |kSuccess| when successful.
+  int32 SetSpeed(int speed);
+
+  // Changes the time between keyframes, in milliseconds, from the next frame
+  // on. Aligned keyframes move to the grid of the new interval. Survives a
+  // fallback to libvpx. Returns |kSuccess| when successful.
+  int32 SetKeyframeInterval(int keyframe_interval);
+
+  // Replaces the regions of interest of the frames encoded from the next
+  // |EncodeFrame()| call on; an empty |regions| encodes whole frames alike.
+  // Where regions overlap the later one applies. For hints from an analysis
+  // stage, which may call it per frame. Thread safe. Returns |kInvalidArg|
+  // when a region lies outside the frame, or the regions use more than
+  // |RegionOfInterest::kMaxQualityLevels| distinct |delta_q| values or a
+  // |delta_q| beyond |RegionOfInterest::kMaxDeltaQ|, and |kSuccess|
+  // otherwise.
+  int32 SetRegionsOfInterest(const std::vector<RegionOfInterest>& regions);
+
+  // Requests a keyframe at the next frame passed to |EncodeFrame()|, or at
+  // the first one |VpxConfig::min_keyframe_request_interval| after the last
+  // keyframe. Requests made before a keyframe is encoded are all answered by
+  // it. Thread safe.
+  void RequestKeyframe();
+
+  // Returns the |LoadState| of the active backend.
+  int load_state() const;
+
   // Accessors.
   int64 frames_in() const;
   int64 frames_out() const;
   int64 last_keyframe_time() const;
   int64 last_timestamp() const;
+  int speed() const;
+
+  // Keyframe requests received, keyframes forced to answer them, and
+  // keyframes placed on scene cuts. Thread safe.
+  int64 keyframes_requested() const { return keyframe_requests_.load(); }
+  int64 keyframes_forced() const { return forced_keyframes_.load(); }
+  int64 scene_cut_keyframes() const { return scene_cut_keyframes_.load(); }
+
+  // Copies the per frame type profile of the frames libvpx encoded to
+  // |ptr_stats|. Hardware encoders are not profiled. Thread safe.
+  void GetFrameProfileStats(FrameProfileStats* ptr_stats) const {
+    frame_profiler_.GetStats(ptr_stats);
+  }
+
+  // Returns the name of the active backend, or an empty string before
+  // |Init()|.
+  const char* backend_name() const;
+
+  // Returns the size of the compressed frame buffers the encoder starts with
+  // for |config|. Used to size the |MediaArena| classes of compressed frames.
+  static int32 InitialFrameBufferSize(const WebmEncoderConfig& config);
 
  private:
-  std::unique_ptr<VpxEncoder> ptr_vpx_encoder_;
+  // Creates and initializes a libvpx backend in |ptr_backend_|: a
+  // |ParallelGopEncoder| with |VpxConfig::parallel_gops|, and a |VpxEncoder|
+  // otherwise.
+  int32 InitSoftwareEncoder();
+
+  // Returns true when the frame at |timestamp| must be a keyframe to answer
+  // |requests| keyframe requests, or to start an aligned keyframe interval.
+  bool KeyframeDue(int64 timestamp, int64 requests);
+
+  // Passes |raw_frame| to |scene_cut_detector_|, and returns true when it is a
+  // scene cut |VpxConfig::min_scene_cut_interval| or more after the last
+  // keyframe.
+  bool SceneCutDue(const VideoFrame& raw_frame);
+
+  // Profile of the frames encoded by the libvpx backends. Declared before
+  // |ptr_backend_|, whose GOP encoder threads use it until it is destroyed.
+  FrameTypeProfiler frame_profiler_;
+
+  std::unique_ptr<VideoEncoderBackend> ptr_backend_;
+
+  // Settings from |Init()|, kept for hardware to software fallback.
+  std::unique_ptr<WebmEncoderConfig> ptr_config_;
+
+  // Frame counts from backends that have been replaced.
+  int64 frames_in_offset_;
+  int64 frames_out_offset_;
+
+  // True when |ptr_backend_| is a hardware encoder.
+  bool using_hardware_;
+
+  // Keyframe requests received by |RequestKeyframe()|, and the number of
+  // them answered by a keyframe. |answered_requests_| is owned by the thread
+  // calling |EncodeFrame()|.
+  std::atomic<int64> keyframe_requests_;
+  int64 answered_requests_;
+  std::atomic<int64> forced_keyframes_;
+
+  // Scene cut detection of |VpxConfig::scene_cut_threshold|, and the
+  // keyframes it placed. |scene_cut_detector_| is owned by the thread calling
+  // |EncodeFrame()|.
+  SceneCutDetector scene_cut_detector_;
+  std::atomic<int64> scene_cut_keyframes_;
+
+  // Regions passed to |SetRegionsOfInterest()| and not yet given to the
+  // backend, protected by |regions_mutex_|, and whether there are any.
+  std::vector<RegionOfInterest> pending_regions_;
+  std::mutex regions_mutex_;
+  std::atomic<bool> regions_changed_;
   WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(VideoEncoder);
 };
 
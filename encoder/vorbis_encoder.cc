@@ -7,15 +7,24 @@
 // be found in the AUTHORS file in the root of the source tree.
 #include "encoder/vorbis_encoder.h"
 
+#include <algorithm>
+#include <chrono>
 #include <cstring>
 #include <memory>
 #include <new>
 #include <string>
+#include <vector>
 
+#include "encoder/log_util.h"
+#include "encoder/webm_encoder.h"
 #include "glog/logging.h"
 
 namespace {
 
+// Initial packet arena sizes. Both grow as needed.
+const int kInitialPacketCount = 16;
+const int32 kInitialPayloadCapacity = 16 * 1024;
+
 bool ValidOggPacket(const ogg_packet& packet) {
   return (packet.bytes > 0 && packet.packet);
 }
@@ -45,45 +54,12 @@ int StorePacketPayload(const ogg_packet& packet,
   return VorbisEncoder::kSuccess;
 }
 
-// Stores payload data from |packet| in |ptr_storage|. Returns |kSuccess| after
-// successful allocation of storage and copy of ogg_packet data.
-int StorePacketPayload(const ogg_packet& packet,
-                       std::vector<uint8>* ptr_storage) {
-  using namespace webmlive;
-  if (!ptr_storage) {
-    LOG(ERROR) << "cannot StoreDataPacket with NULL storage.";
-    return VorbisEncoder::kInvalidArg;
-  }
-  if (!ValidOggPacket(packet)) {
-    LOG(ERROR) << "cannot StoreDataPacket with invalid packet.";
-    return VorbisEncoder::kInvalidArg;
-  }
-  std::copy(packet.packet, packet.packet + packet.bytes,
-            std::back_inserter(*ptr_storage));
-  return VorbisEncoder::kSuccess;
-}
-
-// Stores |packet| in |ptr_storage|. Returns |kSuccess| after successful
-// allocation of storage and copy of ogg_packet data.
-int StorePacket(const ogg_packet& packet, std::vector<uint8>* ptr_storage) {
-  using namespace webmlive;
-  if (!ptr_storage) {
-    LOG(ERROR) << "cannot StoreDataPacket with NULL storage.";
-    return VorbisEncoder::kInvalidArg;
-  }
-  if (!ValidOggPacket(packet)) {
-    LOG(ERROR) << "cannot StoreDataPacket with invalid packet.";
-    return VorbisEncoder::kInvalidArg;
-  }
-  const uint8* p = reinterpret_cast<const uint8*>(&packet);
-  std::copy(p, p + sizeof(ogg_packet), std::back_inserter(*ptr_storage));
-  return VorbisEncoder::kSuccess;
-}
-
 }  // namespace
 
 namespace webmlive {
 
+const int VorbisEncoder::kWarmupMs;
+
 VorbisEncoder::VorbisEncoder()
     : ident_header_length_(0),
       comments_header_length_(0),
@@ -93,6 +69,11 @@ VorbisEncoder::VorbisEncoder()
       last_timestamp_(0),
       time_encoded_(0),
       first_input_timestamp_(-1),
+      payload_capacity_(0),
+      payload_length_(0),
+      deinterleave_(NULL),
+      convert_(false),
+      silent_(false),
       block_initialized_(false),
       dsp_initialized_(false),
       info_initialized_(false) {
@@ -114,11 +95,16 @@ VorbisEncoder::~VorbisEncoder() {
   }
 }
 
+int VorbisEncoder::Init(const WebmEncoderConfig& config) {
+  return Init(config.actual_audio_config, config.vorbis_config);
+}
+
 // Bitrate values are multiplied by 1000. |WebmEncoderConfig| and its children
 // express bitrates in kilobits. Libvorbis bitrates are in bits.
 int VorbisEncoder::Init(const AudioConfig& audio_config,
                         const VorbisConfig& vorbis_config) {
-  if (audio_config.channels <= 0 || audio_config.channels > 2) {
+  if (audio_config.channels <= 0 ||
+      audio_config.channels > AudioConverter::kMaxChannels) {
     LOG(ERROR) << "invalid/unsupported number of audio channels.";
     return kUnsupportedFormat;
   }
@@ -137,9 +123,34 @@ int VorbisEncoder::Init(const AudioConfig& audio_config,
     LOG(ERROR) << "IEEE floating point input must be 32 bits per sample.";
     return kUnsupportedFormat;
   }
+  const int cpu_features = GetCpuFeatures();
+  deinterleave_ = SelectPcmDeinterleave(
+      static_cast<AudioFormat>(format_tag), audio_config.channels,
+      cpu_features);
+  if (!deinterleave_) {
+    LOG(ERROR) << "no PCM deinterleave function for format " << format_tag;
+    return kUnsupportedFormat;
+  }
+  input_config_ = audio_config;
+  LOG(INFO) << "VorbisEncoder CPU features: " << cpu_features;
+
+  const VorbisConfig& vc = vorbis_config;
+  const int sample_rate = vc.sample_rate == VorbisConfig::kUseDefault ?
+      static_cast<int>(audio_config.sample_rate) : vc.sample_rate;
+  const int channels = vc.channels == VorbisConfig::kUseDefault ?
+      audio_config.channels : vc.channels;
+  convert_ = sample_rate != static_cast<int>(audio_config.sample_rate) ||
+             channels != audio_config.channels;
+  if (convert_ &&
+      converter_.Init(audio_config.channels, audio_config.sample_rate,
+                      audio_config.channel_mask, channels, sample_rate)) {
+    LOG(ERROR) << "cannot convert audio to " << channels << " channels at "
+               << sample_rate << " Hz.";
+    return kUnsupportedFormat;
+  }
+
   vorbis_info_init(&info_);
   info_initialized_ = true;
-  const VorbisConfig& vc = vorbis_config;
   int minimum_bitrate = -1;
   int maximum_bitrate = -1;
   if (vc.minimum_bitrate != VorbisConfig::kUseDefault &&
@@ -148,8 +159,8 @@ int VorbisEncoder::Init(const AudioConfig& audio_config,
     maximum_bitrate = vc.maximum_bitrate * 1000;
   }
   int status = vorbis_encode_setup_managed(&info_,
-                                           audio_config.channels,
-                                           audio_config.sample_rate,
+                                           channels,
+                                           sample_rate,
                                            minimum_bitrate,
                                            vc.average_bitrate * 1000,
                                            maximum_bitrate);
@@ -192,25 +203,126 @@ int VorbisEncoder::Init(const AudioConfig& audio_config,
     LOG(ERROR) << "GenerateHeaders failed: " << status;
     return kCodecError;
   }
+  if (vc.warmup) {
+    status = WarmUp();
+    if (status) {
+      return status;
+    }
+  }
+  packets_.reserve(kInitialPacketCount);
+  if (ReservePayload(kInitialPayloadCapacity)) {
+    return kNoMemory;
+  }
+
   audio_config_ = audio_config;
   audio_config_.format_tag = kAudioFormatVorbis;
+  if (convert_) {
+    audio_config_.sample_rate = sample_rate;
+    audio_config_.channels = static_cast<uint16>(channels);
+    if (channels != audio_config.channels) {
+      audio_config_.channel_mask = 0;
+    }
+  }
   vorbis_config_ = vorbis_config;
   return kSuccess;
 }
 
+int VorbisEncoder::WarmUp() {
+  const int num_samples = static_cast<int>(
+      static_cast<int64>(info_.rate) * kWarmupMs / 1000);
+  const std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  vorbis_dsp_state dsp_state;
+  vorbis_block block;
+  memset(&dsp_state, 0, sizeof(dsp_state));
+  memset(&block, 0, sizeof(block));
+  if (vorbis_analysis_init(&dsp_state, &info_)) {
+    LOG(ERROR) << "warmup vorbis_analysis_init failed.";
+    return kCodecError;
+  }
+  int status = kSuccess;
+  if (vorbis_block_init(&dsp_state, &block)) {
+    LOG(ERROR) << "warmup vorbis_block_init failed.";
+    status = kCodecError;
+  } else {
+    float** const ptr_buffer = vorbis_analysis_buffer(&dsp_state,
+                                                      num_samples);
+    if (ptr_buffer) {
+      for (int c = 0; c < info_.channels; ++c) {
+        std::fill(ptr_buffer[c], ptr_buffer[c] + num_samples, 0.0f);
+      }
+      vorbis_analysis_wrote(&dsp_state, num_samples);
+    }
+    // Ending the scratch stream flushes every block it holds.
+    vorbis_analysis_wrote(&dsp_state, 0);
+    ogg_packet packet;
+    while (status == kSuccess &&
+           vorbis_analysis_blockout(&dsp_state, &block) == 1) {
+      if (vorbis_analysis(&block, NULL) || vorbis_bitrate_addblock(&block)) {
+        LOG(ERROR) << "warmup vorbis_analysis failed.";
+        status = kCodecError;
+        break;
+      }
+      while (vorbis_bitrate_flushpacket(&dsp_state, &packet) == 1) {
+      }
+    }
+    vorbis_block_clear(&block);
+  }
+  vorbis_dsp_clear(&dsp_state);
+  if (status) {
+    return status;
+  }
+
+  // Growing the input buffer of |dsp_state_| without writing to it leaves
+  // the stream as it is.
+  if (!vorbis_analysis_buffer(&dsp_state_, num_samples)) {
+    LOG(ERROR) << "cannot reserve libvorbis input buffer.";
+    return kNoMemory;
+  }
+  LOG(INFO) << "VorbisEncoder warmup: " << kWarmupMs << " ms of silence in "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now() - start).count()
+            << " ms.";
+  return kSuccess;
+}
+
 int VorbisEncoder::Encode(const AudioBuffer& input_buffer) {
   if (!input_buffer.buffer()) {
     LOG(ERROR) << "cannot Encode empty input buffer!";
     return kInvalidArg;
   }
+  const AudioConfig& ac = input_buffer.config();
+  if (ac.format_tag != input_config_.format_tag ||
+      ac.channels != input_config_.channels) {
+    LOG(ERROR) << "cannot Encode, input format differs from Init format.";
+    return kInvalidArg;
+  }
+  PcmSpan span;
+  span.ptr_data = input_buffer.buffer();
+  span.length = input_buffer.buffer_length();
+  span.timestamp = input_buffer.timestamp();
+  return EncodeSpan(span);
+}
+
+int VorbisEncoder::EncodeSpan(const PcmSpan& span) {
+  if (!span.ptr_data) {
+    LOG(ERROR) << "cannot Encode empty input span!";
+    return kInvalidArg;
+  }
   if (first_input_timestamp_ == -1) {
-    first_input_timestamp_ = input_buffer.timestamp();
+    first_input_timestamp_ = span.timestamp;
     LOG(INFO) << "VorbisEncoder first_input_timestamp_="
               << first_input_timestamp_;
   }
-  const AudioConfig& ac = input_buffer.config();
-  const AudioBuffer& ib = input_buffer;
-  const int num_blocks = ib.buffer_length() / ac.block_align;
+  const int num_blocks = span.length / input_config_.block_align;
+  const int channels = input_config_.channels;
+  if (convert_) {
+    // Deinterleave into the converter, which writes libvorbis's buffer.
+    deinterleave_(span.ptr_data, num_blocks, channels,
+                  converter_.InputPlanes(num_blocks));
+    return EncodeConverted(num_blocks);
+  }
+
   float** const ptr_encoder_buffer =
       vorbis_analysis_buffer(&dsp_state_, num_blocks);
   if (!ptr_encoder_buffer) {
@@ -218,39 +330,141 @@ int VorbisEncoder::Encode(const AudioBuffer& input_buffer) {
     return kNoMemory;
   }
 
-  // TODO(tomfinegan): Add a channel number to offset mapping similar to what
-  //                   the ffmpeg libvorbis plugin uses to handle channel order
-  //                   differences between uncompressed and vorbis audio.
-  const int channels = ac.channels;
-  if (ac.format_tag == kAudioFormatPcm) {
-    // Deinterleave input samples, convert them to float, and store them in
-    // |ptr_encoder_buffer|.
-    const int16* const s16_pcm_samples = reinterpret_cast<int16*>(ib.buffer());
-    for (int i = 0; i < num_blocks; ++i) {
-      for (int c = 0; c < channels; ++c) {
-        ptr_encoder_buffer[c][i] = s16_pcm_samples[i * channels + c] / 32768.f;
-      }
+  // Deinterleave input samples, convert them to float, and store them in
+  // |ptr_encoder_buffer| in Vorbis channel order.
+  float* planes[AudioConverter::kMaxChannels];
+  for (int c = 0; c < channels; ++c) {
+    planes[c] = ptr_encoder_buffer[VorbisChannelIndex(channels, c)];
+  }
+  if (silent_) {
+    for (int c = 0; c < channels; ++c) {
+      std::fill(planes[c], planes[c] + num_blocks, 0.0f);
     }
   } else {
-    // Deinterleave input samples into |ptr_encoder_buffer|.
-    const float* const ieee_float_samples =
-        reinterpret_cast<float*>(ib.buffer());
-    for (int i = 0; i < num_blocks; ++i) {
-      for (int c = 0; c < channels; ++c) {
-        ptr_encoder_buffer[c][i] = ieee_float_samples[i * channels + c];
-      }
-    }
+    deinterleave_(span.ptr_data, num_blocks, channels, planes);
   }
   vorbis_analysis_wrote(&dsp_state_, num_blocks);
   return kSuccess;
 }
 
+int VorbisEncoder::EncodePlanar(const PlanarPcm& pcm) {
+  if (!pcm.ptr_planes || pcm.num_frames <= 0) {
+    LOG(ERROR) << "cannot Encode empty input planes!";
+    return kInvalidArg;
+  }
+  const int channels = input_config_.channels;
+  if (pcm.channels != channels) {
+    LOG(ERROR) << "cannot Encode, input channels differ from Init channels.";
+    return kInvalidArg;
+  }
+  if (first_input_timestamp_ == -1) {
+    first_input_timestamp_ = pcm.timestamp;
+    LOG(INFO) << "VorbisEncoder first_input_timestamp_="
+              << first_input_timestamp_;
+  }
+  const int num_frames = pcm.num_frames;
+  const size_t plane_size = num_frames * sizeof(float);  // NOLINT
+  if (convert_) {
+    float* const* const ptr_input = converter_.InputPlanes(num_frames);
+    for (int c = 0; c < channels; ++c) {
+      memcpy(ptr_input[c], pcm.ptr_planes[c], plane_size);
+    }
+    return EncodeConverted(num_frames);
+  }
+
+  float** const ptr_encoder_buffer =
+      vorbis_analysis_buffer(&dsp_state_, num_frames);
+  if (!ptr_encoder_buffer) {
+    LOG(ERROR) << "cannot EncodeBuffer, no memory from libvorbis.";
+    return kNoMemory;
+  }
+  for (int c = 0; c < channels; ++c) {
+    float* const ptr_plane =
+        ptr_encoder_buffer[VorbisChannelIndex(channels, c)];
+    if (silent_) {
+      std::fill(ptr_plane, ptr_plane + num_frames, 0.0f);
+    } else {
+      memcpy(ptr_plane, pcm.ptr_planes[c], plane_size);
+    }
+  }
+  vorbis_analysis_wrote(&dsp_state_, num_frames);
+  return kSuccess;
+}
+
+int VorbisEncoder::EncodeConverted(int num_frames) {
+  float** const ptr_encoder_buffer = vorbis_analysis_buffer(
+      &dsp_state_, converter_.MaxOutputSamples(num_frames));
+  if (!ptr_encoder_buffer) {
+    LOG(ERROR) << "cannot EncodeBuffer, no memory from libvorbis.";
+    return kNoMemory;
+  }
+  const int num_samples = converter_.Convert(num_frames, ptr_encoder_buffer);
+  if (silent_) {
+    for (int c = 0; c < audio_config_.channels; ++c) {
+      std::fill(ptr_encoder_buffer[c], ptr_encoder_buffer[c] + num_samples,
+                0.0f);
+    }
+  }
+
+  // Zero samples would tell libvorbis the stream has ended.
+  if (num_samples > 0) {
+    vorbis_analysis_wrote(&dsp_state_, num_samples);
+  }
+  return kSuccess;
+}
+
+int VorbisEncoder::SetSilent(bool silent) {
+  silent_ = silent;
+  return kSuccess;
+}
+
 int VorbisEncoder::ReadCompressedAudio(AudioBuffer* ptr_buffer) {
   if (!ptr_buffer) {
     LOG(ERROR) << "ReadCompressedAudio requires a non-NULL ptr_buffer.";
     return kInvalidArg;
   }
-  ogg_packet packet = {0};
+  const int status = ReadBlock(ptr_buffer);
+  if (status == kSuccess) {
+    WEBMLIVE_HOT_LOG(INFO) << "ReadCompressedAudio\n"
+        << "   samples_encoded_=" << samples_encoded_ << "\n"
+        << "   timestamp(sec)=" << (last_timestamp_ / 1000.0) << "\n"
+        << "   timestamp="      << last_timestamp_ << "\n"
+        << "   duration(sec)= " << (ptr_buffer->duration() / 1000.0) << "\n"
+        << "   duration= "      << ptr_buffer->duration() << "\n";
+  }
+  return status;
+}
+
+// Drains every block libvorbis has ready with one call per block to the
+// analysis and bitrate management functions, and logs the batch once.
+int VorbisEncoder::ReadCompressedAudioBatch(AudioPacketBatch* ptr_batch) {
+  if (!ptr_batch) {
+    LOG(ERROR) << "ReadCompressedAudioBatch requires a non-NULL ptr_batch.";
+    return kInvalidArg;
+  }
+  const int initial_size = ptr_batch->size();
+  AudioBuffer* ptr_buffer;
+  while ((ptr_buffer = ptr_batch->next_buffer()) != NULL) {
+    const int status = ReadBlock(ptr_buffer);
+    if (status == kNoSamples) {
+      break;
+    } else if (status) {
+      return status;
+    }
+    ptr_batch->Append();
+  }
+  const int num_read = ptr_batch->size() - initial_size;
+  if (num_read == 0) {
+    return kNoSamples;
+  }
+  WEBMLIVE_HOT_LOG(INFO) << "ReadCompressedAudioBatch packets=" << num_read
+                         << " samples_encoded_=" << samples_encoded_
+                         << " last_timestamp=" << last_timestamp_;
+  return kSuccess;
+}
+
+int VorbisEncoder::ReadBlock(AudioBuffer* ptr_buffer) {
+  ogg_packet packet = {};
   if (SamplesAvailable()) {
     // There's a compressed block available-- give libvorbis a chance to
     // optimize distribution of data for the current encode settings.
@@ -265,32 +479,22 @@ int VorbisEncoder::ReadCompressedAudio(AudioBuffer* ptr_buffer) {
       return kCodecError;
     }
     while ((status = vorbis_bitrate_flushpacket(&dsp_state_, &packet)) == 1) {
-      if (StorePacket(packet, &ogg_packets_)) {
+      status = StorePacket(packet);
+      if (status) {
         LOG(ERROR) << "StorePacket failed: " << status;
         return kCodecError;
       }
-      if (StorePacketPayload(packet, &vorbis_samples_)) {
-        LOG(ERROR) << "StorePacketPayload failed: " << status;
-        return kCodecError;
-      }
     }
   }
-  if (ogg_packets_.size() < sizeof(packet) || vorbis_samples_.size() == 0) {
+  if (packets_.empty() || payload_length_ == 0) {
     return kNoSamples;
   }
-  if (vorbis_samples_.size() < static_cast<size_t>(packet.bytes)) {
-    LOG(ERROR) << "Error reading packets from libvorbis.";
-    return kEncoderError;
-  }
 
   // Use first packet with non-zero |granualpos| for delay.
   if (audio_delay_ == 0) {
-    const int num_packets = ogg_packets_.size() / sizeof(packet);
-    for (int i = 0; i < num_packets; ++i ) {
-      const ogg_packet* const p =
-          reinterpret_cast<ogg_packet*>(&ogg_packets_[i * sizeof(packet)]);
-      if (packet.granulepos > 0) {
-        audio_delay_ = SamplesToMilliseconds(p->granulepos);
+    for (size_t i = 0; i < packets_.size(); ++i) {
+      if (packets_[i].granulepos > 0) {
+        audio_delay_ = SamplesToMilliseconds(packets_[i].granulepos);
         LOG(INFO) << "VorbisEncoder audio_delay_=" << audio_delay_;
         break;
       }
@@ -299,34 +503,72 @@ int VorbisEncoder::ReadCompressedAudio(AudioBuffer* ptr_buffer) {
 
   // Use |granualpos| from the first packet returned by
   // |vorbis_bitrate_flushpacket()| to calculate |timestamp|.
-  const ogg_packet* const p = reinterpret_cast<ogg_packet*>(&ogg_packets_[0]);
   const int64 timestamp =
-      SamplesToMilliseconds(p->granulepos) + first_input_timestamp_;
+      SamplesToMilliseconds(packets_.front().granulepos) +
+      first_input_timestamp_;
 
-  // |packet.granulepos| is the last complete sample in the packet, use it to
-  // calculate |duration|.
+  // The last packet's |granulepos| is the last complete sample in the batch,
+  // use it to calculate |duration|.
+  const int64 last_granulepos = packets_.back().granulepos;
   const int64 duration =
-      SamplesToMilliseconds(packet.granulepos - samples_encoded_);
-  const int status = ptr_buffer->Init(audio_config_,
-                                      timestamp,
-                                      duration,
-                                      &vorbis_samples_[0],
-                                      vorbis_samples_.size());
+      SamplesToMilliseconds(last_granulepos - samples_encoded_);
+
+  // Hand the payload storage to |ptr_buffer|; its previous storage becomes the
+  // arena's.
+  const int status = ptr_buffer->InitFromStorage(audio_config_,
+                                                 timestamp,
+                                                 duration,
+                                                 &payload_,
+                                                 &payload_capacity_,
+                                                 payload_length_);
   if (status) {
     LOG(ERROR) << "AudioBuffer Init failed: " << status;
     return kCodecError;
   }
-  LOG(INFO) << "ReadCompressedAudio\n"
-      << "   samples_encoded_=" << samples_encoded_ << "\n"
-      << "   timestamp(sec)=" << (timestamp / 1000.0) << "\n"
-      << "   timestamp="      << timestamp << "\n"
-      << "   duration(sec)= " << (duration / 1000.0) << "\n"
-      << "   duration= "      << duration << "\n";
   last_timestamp_ = timestamp;
-  samples_encoded_ = packet.granulepos;
+  samples_encoded_ = last_granulepos;
   time_encoded_ = SamplesToMilliseconds(samples_encoded_);
-  ogg_packets_.clear();
-  vorbis_samples_.clear();
+  packets_.clear();
+  payload_length_ = 0;
+  return kSuccess;
+}
+
+int VorbisEncoder::StorePacket(const ogg_packet& packet) {
+  if (!ValidOggPacket(packet)) {
+    LOG(ERROR) << "cannot StorePacket with invalid packet.";
+    return kInvalidArg;
+  }
+  const int32 length = static_cast<int32>(packet.bytes);
+  const int status = ReservePayload(length);
+  if (status) {
+    return status;
+  }
+  memcpy(payload_.get() + payload_length_, packet.packet, length);
+  payload_length_ += length;
+  const PacketInfo info = {packet.granulepos, length};
+  packets_.push_back(info);
+  return kSuccess;
+}
+
+int VorbisEncoder::ReservePayload(int32 length) {
+  const int32 required = payload_length_ + length;
+  if (payload_ && required <= payload_capacity_) {
+    return kSuccess;
+  }
+  int32 capacity = std::max(payload_capacity_, kInitialPayloadCapacity);
+  while (capacity < required) {
+    capacity *= 2;
+  }
+  MediaBuffer payload = AllocateMediaBuffer(arena_, capacity, &capacity);
+  if (!payload) {
+    LOG(ERROR) << "cannot ReservePayload, no memory.";
+    return kNoMemory;
+  }
+  if (payload_length_ > 0) {
+    memcpy(payload.get(), payload_.get(), payload_length_);
+  }
+  payload_.swap(payload);
+  payload_capacity_ = capacity;
   return kSuccess;
 }
 
@@ -338,6 +580,42 @@ void ClearVorbisComments(vorbis_comment* ptr_comments) {
   }
 }
 
+int VorbisEncoder::GetCodecPrivate(AudioCodecPrivate* ptr_private) const {
+  if (!ptr_private) {
+    LOG(ERROR) << "cannot GetCodecPrivate with NULL out param.";
+    return kInvalidArg;
+  }
+  if (!ident_header_ || !comments_header_ || !setup_header_) {
+    LOG(ERROR) << "cannot GetCodecPrivate: headers not generated.";
+    return kInvalidArg;
+  }
+  if (ident_header_length_ > 255 || comments_header_length_ > 255) {
+    LOG(ERROR) << "cannot GetCodecPrivate: over maximum ident/comment length.";
+    return kInvalidArg;
+  }
+
+  // Xiph lacing: 1 byte to store header count (total headers - 1 = 2), then
+  // 1 byte each for ident and comment length values. The length of setup data
+  // is implied by the total length.
+  std::vector<uint8>& data = ptr_private->data;
+  data.clear();
+  data.reserve(1 + 1 + 1 + ident_header_length_ + comments_header_length_ +
+               setup_header_length_);
+  data.push_back(2);
+  data.push_back(static_cast<uint8>(ident_header_length_));
+  data.push_back(static_cast<uint8>(comments_header_length_));
+  data.insert(data.end(), ident_header_.get(),
+              ident_header_.get() + ident_header_length_);
+  data.insert(data.end(), comments_header_.get(),
+              comments_header_.get() + comments_header_length_);
+  data.insert(data.end(), setup_header_.get(),
+              setup_header_.get() + setup_header_length_);
+  ptr_private->format = kAudioFormatVorbis;
+  ptr_private->codec_delay = 0;
+  ptr_private->seek_pre_roll = 0;
+  return kSuccess;
+}
+
 int64 VorbisEncoder::time_encoded() const {
   if (first_input_timestamp_ < 0) {
     return 0;
@@ -346,7 +624,7 @@ int64 VorbisEncoder::time_encoded() const {
 }
 
 int VorbisEncoder::GenerateHeaders() {
-  vorbis_comment comments = {0};
+  vorbis_comment comments = {};
   vorbis_comment_init(&comments);
   // Abuse |std::shared_ptr| to avoid repeating the call to
   // |vorbis_comment_clear| for every failure in this method.
@@ -363,7 +641,7 @@ int VorbisEncoder::GenerateHeaders() {
                          encoder_id.c_str());
 
   // Generate the vorbis header packets.
-  ogg_packet ident_packet = {0}, comments_packet = {0}, setup_packet = {0};
+  ogg_packet ident_packet = {}, comments_packet = {}, setup_packet = {};
   int status = vorbis_analysis_headerout(&dsp_state_,
                                          &comments,
                                          &ident_packet,
@@ -11,8 +11,10 @@
 #include <memory>
 #include <vector>
 
+#include "encoder/audio_converter.h"
 #include "encoder/audio_encoder.h"
 #include "encoder/basictypes.h"
+#include "encoder/pcm_deinterleave.h"
 #include "libvorbis/vorbis/codec.h"
 #include "libvorbis/vorbis/vorbisenc.h"
 
@@ -21,41 +23,83 @@ namespace webmlive {
 // Libvorbis wrapper class providing a simplified interface to the Vorbis
 // encoding library.
 // Note: users must call |Init()| before any other method.
-class VorbisEncoder {
+class VorbisEncoder : public AudioEncoder {
  public:
+  // Duration of the silence encoded by |VorbisConfig::warmup|, in
+  // milliseconds.
+  static const int kWarmupMs = 250;
+
   enum {
     // A libvorbis function returned an error.
-    kCodecError = -202,
+    kCodecError = AudioEncoder::kCodecError,
 
     // Internal error within |VorbisEncoder|.
-    kEncoderError = -201,
+    kEncoderError = AudioEncoder::kEncoderError,
 
     // |audio_config| or |vorbis_config| format is not supported.
-    kUnsupportedFormat = -200,
-    kNoMemory = -2,
-    kInvalidArg = -1,
-    kSuccess = 0,
+    kUnsupportedFormat = AudioEncoder::kUnsupportedFormat,
+    kNoMemory = AudioEncoder::kNoMemory,
+    kInvalidArg = AudioEncoder::kInvalidArg,
+    kSuccess = AudioEncoder::kSuccess,
 
     // |ReadCompressedAudio()| has no samples available.
-    kNoSamples = 1,
+    kNoSamples = AudioEncoder::kNoSamples,
   };
 
   VorbisEncoder();
-  ~VorbisEncoder();
+  virtual ~VorbisEncoder();
+
+  // |AudioEncoder| method. Calls |Init()| with |config.actual_audio_config|
+  // and |config.vorbis_config|.
+  virtual int Init(const WebmEncoderConfig& config);
 
   // Initializes libvorbis using the settings stored in |audio_config| and
   // |vorbis_config|. Returns |kSuccess| after successful libvorbis
-  // initialization.
+  // initialization. Input of up to |AudioConverter::kMaxChannels| channels is
+  // accepted, and converted to the |vorbis_config| sample rate and channel
+  // count. |audio_config()| reports the encoded rate and channels.
   int Init(const AudioConfig& audio_config, const VorbisConfig& vorbis_config);
 
   // Passes the samples in |uncompressed_buffer| to libvorbis. Returns
   // |kSuccess| after successful handoff of samples to the encoder.
-  int Encode(const AudioBuffer& uncompressed_buffer);
+  virtual int Encode(const AudioBuffer& uncompressed_buffer);
+
+  // Passes the samples in |span| to libvorbis, deinterleaving them straight
+  // from the caller's storage.
+  virtual int EncodeSpan(const PcmSpan& span);
+
+  // Passes the planes of |pcm|, which must have the channel count of the
+  // input format passed to |Init()|, to libvorbis.
+  virtual int EncodePlanar(const PlanarPcm& pcm);
 
   // Returns vorbis audio samples via |ptr_buffer| when libvorbis is able to
   // provide compressed data. Returns |kNoSamples| when libvorbis has no data
   // ready. Returns |kSuccess| when samples are written to |ptr_buffer|.
-  int ReadCompressedAudio(AudioBuffer* ptr_buffer);
+  virtual int ReadCompressedAudio(AudioBuffer* ptr_buffer);
+
+  // Reads every compressed block libvorbis has ready into |ptr_batch|, one
+  // |AudioBuffer| per block, up to the capacity of |ptr_batch|. Returns
+  // |kNoSamples| when no block is ready.
+  virtual int ReadCompressedAudioBatch(AudioPacketBatch* ptr_batch);
+
+  // libvorbis fixes its rate management settings when encoding starts, so
+  // the bitrate cannot change. Always returns |kUnsupportedFormat|.
+  virtual int SetBitrate(int) { return kUnsupportedFormat; }
+
+  // For the same reason silence cannot switch libvorbis to a lower bitrate;
+  // instead silent input is encoded as digital zeros, which libvorbis codes
+  // in a few bytes per block. Always returns |kSuccess|.
+  virtual int SetSilent(bool silent);
+
+  // Allocates packet payload storage from |arena|.
+  virtual void set_arena(const std::shared_ptr<MediaArena>& arena) {
+    arena_ = arena;
+  }
+
+  // Stores the ident, comments and setup headers in Xiph lacing format in
+  // |ptr_private|. Returns |kInvalidArg| when the headers are missing or too
+  // long to lace.
+  virtual int GetCodecPrivate(AudioCodecPrivate* ptr_private) const;
 
   // Accessors.
   const uint8* ident_header() const { return ident_header_.get(); }
@@ -64,18 +108,18 @@ class VorbisEncoder {
   int32 comments_header_length() const { return comments_header_length_; }
   const uint8* setup_header() const { return setup_header_.get(); }
   int32 setup_header_length() const { return setup_header_length_; }
-  const AudioConfig* audio_config() const { return &audio_config_; }
+  virtual const AudioConfig* audio_config() const { return &audio_config_; }
   const VorbisConfig* vorbis_config() const { return &vorbis_config_; }
   int64 audio_delay() const { return audio_delay_; }
 
   // Returns the timestamp of the last encoded buffer read from
   // |ReadCompressedAudio()|.
-  int64 last_timestamp() const { return last_timestamp_; }
+  virtual int64 last_timestamp() const { return last_timestamp_; }
 
   // Returns |samples_encoded_| converted to milliseconds, which will always be
   // slightly higher than the value returned by |last_timestamp()|. Allows user
   // to determine the timestamp of the next output packet from |VorbisEncoder|.
-  int64 time_encoded() const;
+  virtual int64 time_encoded() const;
 
  private:
   // Reads the vorbis headers used to generate the WebM Vorbis track Codec
@@ -84,6 +128,28 @@ class VorbisEncoder {
   // successful header generation.
   int GenerateHeaders();
 
+  // Runs |kWarmupMs| of silence through a libvorbis analysis state set up
+  // from |info_| and released afterwards, and reserves as many samples of
+  // input buffer in |dsp_state_|. Returns |kSuccess| when successful.
+  int WarmUp();
+
+  // Converts the |num_frames| input samples stored in |converter_|'s input
+  // planes and writes them to libvorbis. Returns |kSuccess| when successful.
+  int EncodeConverted(int num_frames);
+
+  // Runs the analysis of the next block libvorbis has ready, and hands its
+  // packets to |ptr_buffer|. Returns |kNoSamples| when no block is ready.
+  // Shared by |ReadCompressedAudio()| and |ReadCompressedAudioBatch()|.
+  int ReadBlock(AudioBuffer* ptr_buffer);
+
+  // Appends |packet|'s granule position and payload to the packet arena.
+  // Returns |kSuccess| when successful.
+  int StorePacket(const ogg_packet& packet);
+
+  // Ensures that |payload_| can hold |length| more bytes. Existing payload
+  // data is preserved. Returns |kSuccess| when successful.
+  int ReservePayload(int32 length);
+
   // Returns true when libvorbis has compressed samples available.
   bool SamplesAvailable();
 
@@ -114,8 +180,33 @@ class VorbisEncoder {
   std::unique_ptr<uint8[]> comments_header_;
   std::unique_ptr<uint8[]> setup_header_;
 
-  std::vector<uint8> ogg_packets_;
-  std::vector<uint8> vorbis_samples_;
+  // Packet arena. Holds the packets produced by one |ReadCompressedAudio()|
+  // call: a descriptor per packet in |packets_|, and the packet payloads
+  // stored back to back in |payload_|. The payload storage is handed to the
+  // output |AudioBuffer| without a copy, and the buffer's previous storage is
+  // reused for the next batch.
+  struct PacketInfo {
+    int64 granulepos;
+    int32 length;
+  };
+  std::vector<PacketInfo> packets_;
+  MediaBuffer payload_;
+  int32 payload_capacity_;
+  int32 payload_length_;
+  std::shared_ptr<MediaArena> arena_;
+
+  // Converts input samples for libvorbis. Chosen by |Init()| for the
+  // |input_config_| format, the channel count and the CPU.
+  PcmDeinterleaveFunc deinterleave_;
+  AudioConfig input_config_;
+
+  // Resamples and remixes input when the encoded rate or channel count
+  // differs from |input_config_|'s. Unused when |convert_| is false.
+  AudioConverter converter_;
+  bool convert_;
+
+  // True while input samples are replaced by zeros. See |SetSilent()|.
+  bool silent_;
   bool block_initialized_;
   bool dsp_initialized_;
   bool info_initialized_;
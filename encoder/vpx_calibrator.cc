@@ -0,0 +1,381 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/vpx_calibrator.h"
+
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#include <intrin.h>
+#elif defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#include <cpuid.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include "encoder/vpx_encoder.h"
+#include "encoder/webm_encoder.h"
+#include "glog/logging.h"
+
+namespace webmlive {
+
+namespace {
+
+// Key of the cache file lines. Each line holds the cache key, then, after
+// " | ", the codec, speed, thread count, encode rate and realtime flag
+// chosen.
+const char kCalibrationKey[] = "calibration";
+
+// Speeds tried, slowest and best quality first. A speed of VP9 encodes
+// better than the same speed of VP8, so all of VP9's come first.
+const int kVp9Speeds[] = {5, 6, 7, 8};
+const int kVp8Speeds[] = {4, 6, 8, 10, 12, 14, 16};
+
+// Frame rate assumed when the capture rate is unknown.
+const double kDefaultFrameRate = 30;
+
+// A candidate codec and speed.
+struct Candidate {
+  VideoFormat codec;
+  int speed;
+};
+
+// Fills |ptr_data| with I420 frame |frame_num| of the calibration clip: a
+// gradient moving diagonally, with noise so that the encoder has detail to
+// code, like a camera image.
+void GenerateClipFrame(int width, int height, int64 frame_num,
+                       uint32* ptr_seed, std::vector<uint8>* ptr_data) {
+  std::vector<uint8>& data = *ptr_data;
+  const int offset = static_cast<int>(frame_num * 3);
+  const size_t luma_size = static_cast<size_t>(width) * height;
+  for (size_t i = 0; i < data.size(); ++i) {
+    *ptr_seed = *ptr_seed * 1103515245 + 12345;
+    const int noise = (*ptr_seed >> 16) & 0xf;
+    if (i < luma_size) {
+      const int x = static_cast<int>(i % width);
+      const int y = static_cast<int>(i / width);
+      data[i] = static_cast<uint8>(x + y + offset + noise);
+    } else {
+      data[i] = static_cast<uint8>(128 + (offset & 0x1f) + noise);
+    }
+  }
+}
+
+// Returns the CPU brand string, or "unknown".
+std::string CpuModel() {
+  char brand[3 * 16 + 1] = {0};
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+  int registers[4] = {0};
+  __cpuid(registers, 0x80000000);
+  if (static_cast<unsigned int>(registers[0]) >= 0x80000004) {
+    for (int i = 0; i < 3; ++i) {
+      __cpuid(registers, 0x80000002 + i);
+      memcpy(brand + i * 16, registers, 16);
+    }
+  }
+#elif defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+  unsigned int registers[4] = {0};
+  if (__get_cpuid(0x80000000, &registers[0], &registers[1], &registers[2],
+                  &registers[3]) &&
+      registers[0] >= 0x80000004) {
+    for (unsigned int i = 0; i < 3; ++i) {
+      __get_cpuid(0x80000002 + i, &registers[0], &registers[1],
+                  &registers[2], &registers[3]);
+      memcpy(brand + i * 16, registers, 16);
+    }
+  }
+#endif
+  std::string model;
+  for (const char* ptr = brand; *ptr; ++ptr) {
+    if (*ptr != ' ' || (!model.empty() && model[model.length() - 1] != '_')) {
+      model += *ptr == ' ' ? '_' : *ptr;
+    }
+  }
+  while (!model.empty() && model[model.length() - 1] == '_') {
+    model.erase(model.length() - 1);
+  }
+  return model.empty() ? "unknown" : model;
+}
+
+// Returns the frame rate the primary encoder of |config| encodes at.
+double EncodedFrameRate(const WebmEncoderConfig& config) {
+  if (config.output_frame_rate > 0) {
+    return config.output_frame_rate;
+  }
+  const double frame_rate = config.actual_video_config.frame_rate;
+  return frame_rate > 0 ? frame_rate : kDefaultFrameRate;
+}
+
+}  // namespace
+
+int VpxCalibrator::Init(const VpxCalibrationSettings& settings) {
+  if (settings.clip_frames < 2 || settings.safety_margin < 0) {
+    LOG(ERROR) << "calibration needs 2 clip frames or more, and a margin of "
+               << "0 or more.";
+    return kInvalidArg;
+  }
+  settings_ = settings;
+  cache_.clear();
+  if (settings_.cache_path.empty()) {
+    return kSuccess;
+  }
+  return LoadCache();
+}
+
+int VpxCalibrator::Calibrate(const WebmEncoderConfig& config,
+                             VpxCalibration* ptr_calibration) {
+  const std::string key = CacheKey(config);
+  const std::map<std::string, VpxCalibration>::const_iterator cached =
+      cache_.find(key);
+  if (cached != cache_.end()) {
+    *ptr_calibration = cached->second;
+    ptr_calibration->cached = true;
+    return kSuccess;
+  }
+
+  const VpxConfig& vpx_config = config.vpx_config;
+  std::vector<Candidate> candidates;
+  const bool try_vp9 = vpx_config.codec == kVideoFormatVP9 ||
+      settings_.choose_codec;
+  const bool try_vp8 = vpx_config.codec == kVideoFormatVP8 ||
+      (settings_.choose_codec && vpx_config.spatial_layers == 1);
+  for (size_t i = 0; try_vp9 && i < sizeof(kVp9Speeds) / sizeof(int); ++i) {
+    const Candidate candidate = {kVideoFormatVP9, kVp9Speeds[i]};
+    candidates.push_back(candidate);
+  }
+  for (size_t i = 0; try_vp8 && i < sizeof(kVp8Speeds) / sizeof(int); ++i) {
+    const Candidate candidate = {kVideoFormatVP8, kVp8Speeds[i]};
+    candidates.push_back(candidate);
+  }
+  if (candidates.empty()) {
+    LOG(ERROR) << "no calibration candidate for codec " << vpx_config.codec;
+    return kCodecError;
+  }
+
+  const double frame_rate = EncodedFrameRate(config);
+  const double required_fps =
+      frame_rate * (100 + settings_.safety_margin) / 100;
+  const int speed_sign = vpx_config.speed < 0 ? -1 : 1;
+  const VideoConfig encoded = EncodedVideoConfig(config.actual_video_config);
+
+  // Trials encode the clip as captured frames of the encoded size.
+  WebmEncoderConfig trial = config;
+  VideoConfig& clip_config = trial.actual_video_config;
+  clip_config = VideoConfig();
+  clip_config.format = kVideoFormatI420;
+  clip_config.width = encoded.width;
+  clip_config.height = abs(encoded.height);
+  clip_config.stride = clip_config.width;
+  clip_config.frame_rate = frame_rate;
+  VpxConfig& trial_vpx = trial.vpx_config;
+  trial_vpx.adaptive_speed = false;
+  trial_vpx.static_detection = VpxConfig::kUseDefault;
+  trial_vpx.warmup_frames = 0;
+
+  VpxCalibration calibration;
+  bool found = false;
+  for (size_t i = 0; i < candidates.size() && !found; ++i) {
+    trial_vpx.codec = candidates[i].codec;
+    trial_vpx.speed = speed_sign * candidates[i].speed;
+    trial_vpx.thread_count = vpx_config.thread_count;
+    trial_vpx.tile_columns = vpx_config.tile_columns;
+    trial_vpx.token_partitions = vpx_config.token_partitions;
+    VpxEncoder::PlanThreads(clip_config.width, clip_config.height,
+                            &trial_vpx);
+    double fps = 0;
+    if (MeasureFrameRate(trial, required_fps, &fps)) {
+      continue;
+    }
+    LOG(INFO) << "calibration: " << (trial_vpx.codec == kVideoFormatVP9 ?
+                                     "VP9" : "VP8")
+              << " speed " << trial_vpx.speed << " threads "
+              << trial_vpx.thread_count << ": " << fps << " fps.";
+    calibration.codec = trial_vpx.codec;
+    calibration.speed = trial_vpx.speed;
+    calibration.thread_count = trial_vpx.thread_count;
+    calibration.frames_per_second = fps;
+    found = fps >= required_fps;
+  }
+  if (calibration.thread_count == 0) {
+    LOG(ERROR) << "calibration could not encode any candidate.";
+    return kCodecError;
+  }
+  calibration.realtime = found;
+
+  // Fewer threads leave cores to the other encoders of the host, unless
+  // the thread count is set.
+  if (found && vpx_config.thread_count == VpxConfig::kUseDefault) {
+    trial_vpx.codec = calibration.codec;
+    trial_vpx.speed = calibration.speed;
+    for (int threads = calibration.thread_count / 2; threads >= 1;
+         threads /= 2) {
+      trial_vpx.thread_count = threads;
+      trial_vpx.tile_columns = vpx_config.tile_columns;
+      trial_vpx.token_partitions = vpx_config.token_partitions;
+      VpxEncoder::PlanThreads(clip_config.width, clip_config.height,
+                              &trial_vpx);
+      double fps = 0;
+      if (MeasureFrameRate(trial, required_fps, &fps) ||
+          fps < required_fps) {
+        break;
+      }
+      calibration.thread_count = threads;
+      calibration.frames_per_second = fps;
+    }
+  }
+  if (!found) {
+    LOG(WARNING) << "no calibration candidate encodes " << required_fps
+                 << " fps, using the fastest.";
+  }
+
+  *ptr_calibration = calibration;
+  cache_[key] = calibration;
+  if (!settings_.cache_path.empty() && SaveCache()) {
+    LOG(WARNING) << "calibration not cached.";
+  }
+  return kSuccess;
+}
+
+std::string VpxCalibrator::HostFingerprint() {
+  std::ostringstream fingerprint;
+  fingerprint << CpuModel() << "/" << std::thread::hardware_concurrency();
+  return fingerprint.str();
+}
+
+int VpxCalibrator::MeasureFrameRate(const WebmEncoderConfig& config,
+                                    double required_fps,
+                                    double* ptr_frames_per_second) {
+  *ptr_frames_per_second = 0;
+  VpxEncoder encoder;
+  if (encoder.Init(config)) {
+    LOG(WARNING) << "calibration candidate rejected by libvpx.";
+    return kCodecError;
+  }
+  const VideoConfig& clip_config = config.actual_video_config;
+  std::vector<uint8> data(VideoFrame::I420BufferSize(clip_config.width,
+                                                     clip_config.height));
+  const int64 duration =
+      static_cast<int64>(1000 / clip_config.frame_rate + 0.5);
+
+  // The first frame is a keyframe, slower than the others: it is not timed.
+  // The clip is abandoned once it takes longer than the whole clip may.
+  const std::chrono::nanoseconds budget(static_cast<int64>(
+      (settings_.clip_frames - 1) * 1e9 / required_fps));
+  std::chrono::nanoseconds encode_time(0);
+  int timed_frames = 0;
+  uint32 seed = 1;
+  VideoFrame raw_frame;
+  VideoFrame vpx_frame;
+  for (int i = 0; i < settings_.clip_frames; ++i) {
+    GenerateClipFrame(clip_config.width, clip_config.height, i, &seed, &data);
+    if (raw_frame.Init(clip_config, false, i * duration, duration, &data[0],
+                       static_cast<int32>(data.size()))) {
+      LOG(ERROR) << "cannot store calibration frame.";
+      return kCodecError;
+    }
+    const std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    const int status = encoder.EncodeFrame(raw_frame, &vpx_frame);
+    if (status && status != VpxEncoder::kDropped) {
+      LOG(WARNING) << "calibration encode failed: " << status;
+      return kCodecError;
+    }
+    if (i == 0) {
+      continue;
+    }
+    encode_time += std::chrono::steady_clock::now() - start;
+    ++timed_frames;
+    if (encode_time > budget) {
+      break;
+    }
+  }
+  const double seconds = encode_time.count() / 1e9;
+  *ptr_frames_per_second = timed_frames / std::max(seconds, 1e-6);
+  return kSuccess;
+}
+
+std::string VpxCalibrator::CacheKey(const WebmEncoderConfig& config) const {
+  const VideoConfig encoded = EncodedVideoConfig(config.actual_video_config);
+  const VpxConfig& vpx_config = config.vpx_config;
+  std::ostringstream key;
+  key.precision(10);
+  key << HostFingerprint() << " " << encoded.width << "x"
+      << abs(encoded.height) << "@" << EncodedFrameRate(config) << " "
+      << vpx_config.bitrate << "kbps cores=" << vpx_config.cpu_cores
+      << " threads=" << vpx_config.thread_count << " codec="
+      << (settings_.choose_codec ? -1 : vpx_config.codec) << " layers="
+      << vpx_config.temporal_layers << "," << vpx_config.spatial_layers
+      << " margin=" << settings_.safety_margin;
+  return key.str();
+}
+
+int VpxCalibrator::LoadCache() {
+  std::ifstream file(settings_.cache_path.c_str());
+  if (!file) {
+    LOG(INFO) << "no calibrations in " << settings_.cache_path << " yet.";
+    return kSuccess;
+  }
+  std::string line;
+  for (int line_number = 1; std::getline(file, line); ++line_number) {
+    // The key has a fixed number of fields, the result follows it.
+    const size_t result_start = line.rfind(" | ");
+    std::istringstream line_stream(line);
+    std::string line_key;
+    if (!(line_stream >> line_key) || line_key != kCalibrationKey ||
+        result_start == std::string::npos) {
+      continue;
+    }
+    const size_t key_start = strlen(kCalibrationKey) + 1;
+    std::istringstream result_stream(line.substr(result_start + 3));
+    VpxCalibration calibration;
+    int codec = 0;
+    if (result_start <= key_start ||
+        !(result_stream >> codec >> calibration.speed >>
+          calibration.thread_count >> calibration.frames_per_second >>
+          calibration.realtime) ||
+        (codec != kVideoFormatVP8 && codec != kVideoFormatVP9) ||
+        calibration.thread_count < 1) {
+      LOG(WARNING) << "dropping calibration on line " << line_number
+                   << " of " << settings_.cache_path;
+      continue;
+    }
+    calibration.codec = static_cast<VideoFormat>(codec);
+    cache_[line.substr(key_start, result_start - key_start)] = calibration;
+  }
+  LOG(INFO) << "loaded " << cache_.size() << " calibrations from "
+            << settings_.cache_path;
+  return kSuccess;
+}
+
+int VpxCalibrator::SaveCache() const {
+  std::ofstream file(settings_.cache_path.c_str(), std::ios::trunc);
+  if (!file) {
+    LOG(ERROR) << "cannot open calibration file: " << settings_.cache_path;
+    return kFileError;
+  }
+  typedef std::map<std::string, VpxCalibration>::const_iterator Iterator;
+  for (Iterator iter = cache_.begin(); iter != cache_.end(); ++iter) {
+    const VpxCalibration& calibration = iter->second;
+    file << kCalibrationKey << " " << iter->first << " | "
+         << calibration.codec << " " << calibration.speed << " "
+         << calibration.thread_count << " " << calibration.frames_per_second
+         << " " << calibration.realtime << "\n";
+  }
+  file.flush();
+  if (!file) {
+    LOG(ERROR) << "cannot write calibration file: " << settings_.cache_path;
+    return kFileError;
+  }
+  return kSuccess;
+}
+
+}  // namespace webmlive
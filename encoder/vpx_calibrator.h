@@ -0,0 +1,132 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_VPX_CALIBRATOR_H_
+#define WEBMLIVE_ENCODER_VPX_CALIBRATOR_H_
+
+#include <map>
+#include <string>
+
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+#include "encoder/video_encoder.h"
+
+namespace webmlive {
+
+struct WebmEncoderConfig;
+
+struct VpxCalibrationSettings {
+  // Default number of frames of the synthetic clip of each candidate.
+  static const int kDefaultClipFrames = 30;
+
+  // Default encode speed required above the frame rate, in percent.
+  static const int kDefaultSafetyMargin = 25;
+
+  VpxCalibrationSettings()
+      : enabled(false), choose_codec(false),
+        clip_frames(kDefaultClipFrames),
+        safety_margin(kDefaultSafetyMargin) {}
+
+  // Calibrate the primary video encoder at startup.
+  bool enabled;
+
+  // Try VP9 and VP8 instead of |VpxConfig::codec| only.
+  bool choose_codec;
+
+  // Frames encoded per candidate setting.
+  int clip_frames;
+
+  // Percentage by which a candidate must encode faster than the frame rate.
+  int safety_margin;
+
+  // File results are cached in across runs. Empty calibrates every run.
+  std::string cache_path;
+};
+
+// Settings chosen by |VpxCalibrator::Calibrate()|.
+struct VpxCalibration {
+  VpxCalibration()
+      : codec(kVideoFormatVP8), speed(0), thread_count(0),
+        frames_per_second(0), realtime(false), cached(false) {}
+
+  VideoFormat codec;
+  int speed;
+  int thread_count;
+
+  // Encode rate of the clip with these settings.
+  double frames_per_second;
+
+  // False when no candidate kept up with the frame rate and its margin: the
+  // fastest candidate, the last tried, is chosen then.
+  bool realtime;
+
+  // True when the settings come from the cache file.
+  bool cached;
+};
+
+// Chooses the codec, speed and thread count of a libvpx encoder for the
+// host it runs on. Candidates are tried from the best quality down, the
+// slower speeds of VP9 first, then those of VP8, on a synthetic clip at the
+// encoder's size, bitrate and frame rate; the first that encodes at least
+// |VpxCalibrationSettings::safety_margin| percent faster than realtime is
+// chosen, with the fewest threads that still keep it so. Results are cached
+// per host fingerprint, CPU model and hardware threads, and per encoder
+// size, rate, bitrate and cores, so that only the first run on a host type
+// pays for the trials.
+//
+// Notes:
+// - Not thread safe: calibration runs once, in |WebmEncoder::Init()|.
+// - Trials run alone on the host: other encoders of the process are not
+//   running yet, which the safety margin makes up for.
+class VpxCalibrator {
+ public:
+  enum {
+    kFileError = -3,
+    kCodecError = -2,
+    kInvalidArg = -1,
+    kSuccess = 0,
+  };
+
+  VpxCalibrator() {}
+  ~VpxCalibrator() {}
+
+  // Copies |settings| and loads the cache file, when set. Returns |kSuccess|,
+  // also when the cache file does not exist yet, or |kInvalidArg|.
+  int Init(const VpxCalibrationSettings& settings);
+
+  // Chooses settings for the primary video encoder of |config|, from the
+  // cache or by calibrating, and stores them in |ptr_calibration|. Results
+  // calibrated are saved to the cache file. Returns |kSuccess|, or
+  // |kCodecError| when no candidate can be encoded.
+  int Calibrate(const WebmEncoderConfig& config,
+                VpxCalibration* ptr_calibration);
+
+  // Returns the CPU model and number of hardware threads of the host, with
+  // no spaces.
+  static std::string HostFingerprint();
+
+ private:
+  // Encodes the clip with |config| and stores its encode rate in
+  // |ptr_frames_per_second|. Stops early, with the rate so far, once the
+  // clip cannot reach |required_fps|. Returns |kSuccess| or |kCodecError|.
+  int MeasureFrameRate(const WebmEncoderConfig& config, double required_fps,
+                       double* ptr_frames_per_second);
+
+  // Returns the cache key of |config|.
+  std::string CacheKey(const WebmEncoderConfig& config) const;
+
+  int LoadCache();
+  int SaveCache() const;
+
+  VpxCalibrationSettings settings_;
+  std::map<std::string, VpxCalibration> cache_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(VpxCalibrator);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_VPX_CALIBRATOR_H_
@@ -0,0 +1,108 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/vpx_context_pool.h"
+
+#include <new>
+
+#include "glog/logging.h"
+
+#if defined _MSC_VER
+// Disable warning C4505(unreferenced local function has been removed) in MSVC.
+// The warning is emitted for vp8.h and vp8cx.h (included by vpx_encoder.h).
+#pragma warning(disable:4505)
+#endif
+#include "encoder/vpx_encoder.h"
+
+namespace webmlive {
+
+VpxContextPool* VpxContextPool::Instance() {
+  static VpxContextPool pool;
+  return &pool;
+}
+
+VpxContextPool::VpxContextPool() : capacity_(0) {
+}
+
+VpxContextPool::~VpxContextPool() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  capacity_ = 0;
+  Evict();
+}
+
+void VpxContextPool::set_capacity(int capacity) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  capacity_ = capacity > 0 ? capacity : 0;
+  Evict();
+}
+
+int VpxContextPool::capacity() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return capacity_;
+}
+
+bool VpxContextPool::Acquire(const Key& key, vpx_codec_ctx* ptr_context,
+                             int64* ptr_next_pts, uint32* ptr_controls) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (capacity_ == 0) {
+    return false;
+  }
+  for (size_t i = entries_.size(); i > 0; --i) {
+    Entry& entry = entries_[i - 1];
+    if (entry.key == key) {
+      // The context is moved by value; libvpx keeps no pointer to the
+      // context struct itself.
+      *ptr_context = *entry.ptr_context;
+      *ptr_next_pts = entry.next_pts;
+      *ptr_controls = entry.controls;
+      delete entry.ptr_context;
+      entries_.erase(entries_.begin() + (i - 1));
+      ++stats_.reused;
+      stats_.idle = static_cast<int32>(entries_.size());
+      return true;
+    }
+  }
+  ++stats_.created;
+  return false;
+}
+
+void VpxContextPool::Release(const Key& key, const vpx_codec_ctx& context,
+                             int64 next_pts, uint32 controls) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Entry entry;
+  entry.ptr_context = capacity_ > 0 ?
+      new (std::nothrow) vpx_codec_ctx_t(context) : NULL;  // NOLINT
+  if (!entry.ptr_context) {
+    vpx_codec_ctx_t destroyed_context = context;
+    vpx_codec_destroy(&destroyed_context);
+    return;
+  }
+  entry.key = key;
+  entry.next_pts = next_pts;
+  entry.controls = controls;
+  entries_.push_back(entry);
+  ++stats_.released;
+  Evict();
+}
+
+void VpxContextPool::GetStats(VpxContextPoolStats* ptr_stats) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  *ptr_stats = stats_;
+}
+
+void VpxContextPool::Evict() {
+  while (entries_.size() > static_cast<size_t>(capacity_)) {
+    Entry& entry = entries_.front();
+    vpx_codec_destroy(entry.ptr_context);
+    delete entry.ptr_context;
+    entries_.pop_front();
+    ++stats_.evicted;
+  }
+  stats_.idle = static_cast<int32>(entries_.size());
+}
+
+}  // namespace webmlive
@@ -0,0 +1,114 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_VPX_CONTEXT_POOL_H_
+#define WEBMLIVE_ENCODER_VPX_CONTEXT_POOL_H_
+
+#include <deque>
+#include <mutex>
+
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+#include "encoder/video_encoder.h"
+
+struct vpx_codec_ctx;
+
+namespace webmlive {
+
+struct VpxContextPoolStats {
+  VpxContextPoolStats()
+      : reused(0), created(0), released(0), evicted(0), idle(0) {}
+
+  // Contexts |VpxEncoder::Init()| took from the pool, and those it created
+  // while the pool had none to give.
+  int64 reused;
+  int64 created;
+
+  // Contexts returned to the pool, those destroyed to make room, and those
+  // held now.
+  int64 released;
+  int64 evicted;
+  int32 idle;
+};
+
+// Idle libvpx encoder contexts, kept after their |VpxEncoder| is destroyed
+// so that the next encoder with the same codec, frame size and thread count
+// reconfigures one with vpx_codec_enc_config_set instead of allocating the
+// codec state, lookahead buffers and threads again. A channel restarted in
+// service mode then starts in milliseconds.
+//
+// Notes:
+// - The pool is disabled, and |VpxEncoder| creates and destroys its context
+//   as usual, until |set_capacity()| is called; |service_main()| enables it.
+// - Thread safe.
+class VpxContextPool {
+ public:
+  // Settings a context keeps for its lifetime.
+  struct Key {
+    Key() : codec(kVideoFormatVP8), width(0), height(0), threads(0) {}
+    bool operator==(const Key& other) const {
+      return codec == other.codec && width == other.width &&
+             height == other.height && threads == other.threads;
+    }
+    VideoFormat codec;
+    int32 width;
+    int32 height;
+    int32 threads;
+  };
+
+  // Returns the pool shared by all encoders of the process.
+  static VpxContextPool* Instance();
+
+  // Keeps up to |capacity| idle contexts, destroying the least recently
+  // released beyond it. 0 disables the pool.
+  void set_capacity(int capacity);
+  int capacity() const;
+
+  // Moves the most recently released idle context for |key| to
+  // |ptr_context|. Sets |*ptr_next_pts| to the timestamp, in the encoder
+  // timebase, that follows the last frame the context encoded, and
+  // |*ptr_controls| to the controls its encoder changed from the library
+  // defaults. Returns false when the pool holds no context for |key|.
+  bool Acquire(const Key& key, vpx_codec_ctx* ptr_context,
+               int64* ptr_next_pts, uint32* ptr_controls);
+
+  // Takes over |context|, an initialized context of |key| that no encoder
+  // uses, and whose last frame is followed by |next_pts|. Destroys it when
+  // the pool is disabled.
+  void Release(const Key& key, const vpx_codec_ctx& context, int64 next_pts,
+               uint32 controls);
+
+  // Copies the pool counters to |ptr_stats|.
+  void GetStats(VpxContextPoolStats* ptr_stats) const;
+
+ private:
+  struct Entry {
+    Key key;
+    vpx_codec_ctx* ptr_context;
+    int64 next_pts;
+    uint32 controls;
+  };
+
+  VpxContextPool();
+  ~VpxContextPool();
+
+  // Destroys the oldest idle contexts until no more than |capacity_| are
+  // left. Must be called with |mutex_| held.
+  void Evict();
+
+  // Idle contexts, least recently released first, the number kept, and the
+  // counters, protected by |mutex_|.
+  std::deque<Entry> entries_;
+  int capacity_;
+  VpxContextPoolStats stats_;
+  mutable std::mutex mutex_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(VpxContextPool);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_VPX_CONTEXT_POOL_H_
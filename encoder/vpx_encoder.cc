@@ -14,27 +14,277 @@
 #endif
 #include "encoder/vpx_encoder.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <limits>
+#include <memory>
+#include <thread>
+
+#include "encoder/vpx_context_pool.h"
 #include "encoder/webm_encoder.h"
 #include "glog/logging.h"
 
+namespace {
+
+// Minimum width of a VP9 tile column, in pixels.
+const int kVp9MinTileWidth = 256;
+
+// Maximum number of VP9 tile columns, log2.
+const int kVp9MaxTileColumns = 6;
+
+// Maximum number of VP8 token partitions, log2.
+const int kVp8MaxTokenPartitions = 3;
+
+// VP9E_SET_AQ_MODE value of cyclic refresh.
+const int kVp9CyclicRefreshAqMode = 3;
+
+// Fastest realtime VP8E_SET_CPUUSED magnitudes.
+const int kVp8MaxSpeed = 16;
+const int kVp9MaxSpeed = 8;
+
+// Adaptive speed control thresholds. Load is encode time divided by frame
+// duration; backlog is input queue occupancy divided by queue capacity.
+const double kLoadHigh = 0.9;
+const double kLoadLow = 0.6;
+const double kBacklogHigh = 0.5;
+
+// Weight of the newest sample in the load moving average.
+const double kLoadSmoothing = 0.1;
+
+// Consecutive frames required before the speed is raised or lowered.
+const int kSpeedUpFrames = 5;
+const int kSpeedDownFrames = 60;
+
+// Consecutive overloaded frames at the fastest speed, or underloaded frames
+// at the slowest speed, before |load_state()| reports them.
+const int kSaturatedFrames = 30;
+const int kIdleFrames = 180;
+
+// Largest lookahead libvpx supports, in frames, and the smallest lookahead
+// with which |VpxConfig::latency_budget| enables alternate reference frames.
+const int kMaxLagInFrames = 25;
+const int kMinAltRefLagInFrames = 8;
+
+// Temporal layer patterns, indexed by layer count: the layer of each frame
+// in the repeating pattern, and the share of the total bitrate spent on each
+// layer and the ones below it, in percent.
+const int kMaxTemporalLayers = 3;
+const int kLayerPeriodicity[kMaxTemporalLayers + 1] = {0, 1, 2, 4};
+const int kLayerPattern[kMaxTemporalLayers + 1][4] = {
+  {0}, {0}, {0, 1}, {0, 2, 1, 2}
+};
+const int kLayerBitratePercent[kMaxTemporalLayers + 1][kMaxTemporalLayers] = {
+  {0}, {100}, {60, 100}, {40, 60, 100}
+};
+
+// Spatial layer setups, indexed by layer count: the share of the total
+// bitrate spent on each layer, in percent, smallest layer first. Each layer
+// has half the width and height of the one above it.
+const int kMaxSpatialLayers = 3;
+const int kSpatialBitratePercent[kMaxSpatialLayers + 1][kMaxSpatialLayers] = {
+  {0}, {100}, {30, 70}, {15, 30, 55}
+};
+
+// Number of VP8 ROI map segments.
+const int kRoiSegments = 4;
+
+// Longest time static content detection goes without encoding a frame, in
+// milliseconds.
+const int64 kMaxStaticFrameGap = 500;
+
+// Smallest compressed frame buffer size class, in bytes.
+const int32 kMinOutputBufferSize = 4096;
+
+// Keyframe size relative to the average frame size assumed when the keyframe
+// bitrate is not limited.
+const int kDefaultKeyframeSizePercent = 1000;
+
+// Returns the largest n for which (1 << n) <= |value|.
+int FloorLog2(int value) {
+  int log2 = 0;
+  while (value > 1) {
+    value >>= 1;
+    ++log2;
+  }
+  return log2;
+}
+
+// Returns the bit of the controls a |VpxEncoder| has changed from the libvpx
+// defaults that stands for |control_id|, or 0 for other controls.
+uint32 ControlBit(int control_id) {
+  switch (control_id) {
+    case VP8E_SET_CPUUSED:
+      return 1 << 0;
+    case VP8E_SET_GF_CBR_BOOST_PCT:
+      return 1 << 1;
+    case VP8E_SET_MAX_INTRA_BITRATE_PCT:
+      return 1 << 2;
+    case VP8E_SET_NOISE_SENSITIVITY:
+      return 1 << 3;
+    case VP8E_SET_SHARPNESS:
+      return 1 << 4;
+    case VP8E_SET_STATIC_THRESHOLD:
+      return 1 << 5;
+    case VP8E_SET_TOKEN_PARTITIONS:
+      return 1 << 6;
+    case VP8E_SET_ENABLEAUTOALTREF:
+      return 1 << 7;
+    case VP9E_SET_AQ_MODE:
+      return 1 << 8;
+    case VP9E_SET_FRAME_PARALLEL_DECODING:
+      return 1 << 9;
+    case VP9E_SET_TILE_COLUMNS:
+      return 1 << 10;
+#ifdef VPX_CTRL_VP9E_SET_ROW_MT
+    case VP9E_SET_ROW_MT:
+      return 1 << 11;
+#endif
+    default:
+      return 0;
+  }
+}
+
+// Returns the |FrameProfileType| of a compressed frame with libvpx packet
+// |flags|.
+int ProfileType(vpx_codec_frame_flags_t flags) {
+  if (flags & VPX_FRAME_IS_KEY) {
+    return webmlive::kFrameProfileKey;
+  }
+  if (flags & VPX_FRAME_IS_INVISIBLE) {
+    return webmlive::kFrameProfileInvisible;
+  }
+  if (flags & VPX_FRAME_IS_DROPPABLE) {
+    return webmlive::kFrameProfileDroppable;
+  }
+  return webmlive::kFrameProfileInter;
+}
+
+// Returns the most threads libvpx puts to use at |height|; beyond this count
+// the threads mostly wait on each other.
+int MaxUsefulThreads(int height) {
+  if (height <= 360)
+    return 2;
+  if (height <= 720)
+    return 4;
+  return 8;
+}
+
+}  // anonymous namespace
+
 namespace webmlive {
 
+void VpxEncoder::PlanThreads(int width, int height, VpxConfig* ptr_config) {
+  VpxConfig& config = *ptr_config;
+  int cores = config.cpu_cores;
+  if (cores == VpxConfig::kUseDefault) {
+    cores = static_cast<int>(std::thread::hardware_concurrency());
+  }
+  cores = std::max(cores, 1);
+
+  if (config.codec == kVideoFormatVP9 &&
+      config.tile_columns == VpxConfig::kUseDefault) {
+    // Tile columns let VP9 encode (and decode) a frame on several threads, but
+    // tiles narrower than |kVp9MinTileWidth| are not allowed, and extra tiles
+    // cost compression efficiency without adding speed.
+    const int max_tiles_log2 =
+        std::min(FloorLog2(std::max(width / kVp9MinTileWidth, 1)),
+                 kVp9MaxTileColumns);
+    config.tile_columns = std::min(max_tiles_log2, FloorLog2(cores));
+  }
+
+  if (config.thread_count == VpxConfig::kUseDefault) {
+    int threads = std::min(cores, MaxUsefulThreads(height));
+    if (config.codec == kVideoFormatVP9) {
+#ifndef VPX_CTRL_VP9E_SET_ROW_MT
+      // Without row based multi-threading VP9 uses one thread per tile.
+      threads = std::min(threads, 1 << std::max(config.tile_columns, 0));
+#endif
+    }
+    config.thread_count = threads;
+  }
+
+  if (config.codec == kVideoFormatVP8 &&
+      config.token_partitions == VpxConfig::kUseDefault) {
+    // Token partitions allow the VP8 bitstream to be packed on each thread.
+    config.token_partitions =
+        std::min(FloorLog2(config.thread_count), kVp8MaxTokenPartitions);
+  }
+
+  LOG(INFO) << "VPx thread plan for " << width << "x" << height
+            << " cores=" << cores
+            << " threads=" << config.thread_count
+            << " tile_columns(log2)=" << config.tile_columns
+            << " token_partitions(log2)=" << config.token_partitions;
+}
+
 VpxEncoder::VpxEncoder()
     : frames_in_(0),
       frames_out_(0),
       last_keyframe_time_(0),
-      last_timestamp_(0) {
+      deadline_(VPX_DL_REALTIME),
+      last_timestamp_(0),
+      speed_(0),
+      speed_sign_(1),
+      min_speed_(0),
+      max_speed_(0),
+      load_average_(0),
+      backlog_(0),
+      overload_frames_(0),
+      underload_frames_(0),
+      max_width_(0),
+      max_height_(0),
+      force_keyframe_(false),
+      layer_frame_index_(0),
+      active_map_enabled_(false),
+      last_encoded_time_(0),
+      roi_width_(0),
+      roi_height_(0),
+      output_buffer_size_(kMinOutputBufferSize),
+      poolable_(false),
+      context_from_pool_(false),
+      pool_controls_(0),
+      applied_controls_(0),
+      pts_offset_pending_(false),
+      pts_offset_(0),
+      next_pts_(0),
+      ptr_frame_profiler_(NULL),
+      profile_pending_us_(0) {
   memset(&vpx_context_, 0, sizeof(vpx_context_));
+  memset(&libvpx_config_, 0, sizeof(libvpx_config_));
 }
 
 VpxEncoder::~VpxEncoder() {
-  vpx_codec_destroy(&vpx_context_);
+  VpxContextPool* const pool = VpxContextPool::Instance();
+  if (poolable_ && pool->capacity() > 0 && ClearMaps()) {
+    pool->Release(PoolKey(), vpx_context_, next_pts_, applied_controls_);
+  } else {
+    vpx_codec_destroy(&vpx_context_);
+  }
+}
+
+int VpxEncoder::Init(const WebmEncoderConfig& user_config) {
+  int status = InitContext(user_config, true);
+  if (status == kSuccess && context_from_pool_ &&
+      (pool_controls_ & ~applied_controls_)) {
+    // libvpx cannot return a control to its default: a context with controls
+    // this encoder leaves alone is not reused.
+    LOG(INFO) << "pooled VPx context has other controls set, creating a "
+              << "new one.";
+    vpx_codec_destroy(&vpx_context_);
+    memset(&vpx_context_, 0, sizeof(vpx_context_));
+    status = InitContext(user_config, false);
+  }
+  poolable_ = status == kSuccess && libvpx_config_.g_lag_in_frames == 0 &&
+              config_.temporal_layers == 1 && config_.spatial_layers == 1;
+  return status;
 }
 
 // Populates libvpx configuration structure with user values, and initializes
 // the library for VPx encoding.
-int VpxEncoder::Init(const WebmEncoderConfig& user_config) {
-  vpx_codec_enc_cfg_t libvpx_config = {0};
+int VpxEncoder::InitContext(const WebmEncoderConfig& user_config,
+                            bool use_pool) {
+  vpx_codec_enc_cfg_t libvpx_config = {};
   vpx_codec_err_t status = VPX_CODEC_INVALID_PARAM;
 
   if (user_config.vpx_config.codec == kVideoFormatVP8) {
@@ -50,25 +300,119 @@ int VpxEncoder::Init(const WebmEncoderConfig& user_config) {
     return VideoEncoder::kCodecError;
   }
   config_ = user_config.vpx_config;
+  const VideoConfig encoded_config =
+      EncodedVideoConfig(user_config.actual_video_config);
+  PlanThreads(encoded_config.width, encoded_config.height, &config_);
   libvpx_config.g_pass = VPX_RC_ONE_PASS;
   libvpx_config.g_timebase.num = 1;
   libvpx_config.g_timebase.den = kTimebase;
   libvpx_config.rc_end_usage = VPX_CBR;
   libvpx_config.g_lag_in_frames = 0;
+  deadline_ = VPX_DL_REALTIME;
+  if (config_.temporal_layers < 1 ||
+      config_.temporal_layers > kMaxTemporalLayers) {
+    LOG(ERROR) << "invalid temporal layer count " << config_.temporal_layers;
+    return VideoEncoder::kInvalidArg;
+  }
+  if (config_.spatial_layers < 1 ||
+      config_.spatial_layers > kMaxSpatialLayers ||
+      (config_.spatial_layers > 1 && config_.codec != kVideoFormatVP9)) {
+    LOG(ERROR) << "invalid spatial layer count " << config_.spatial_layers
+               << ", spatial layers require VP9.";
+    return VideoEncoder::kInvalidArg;
+  }
+  if ((config_.temporal_layers > 1 || config_.spatial_layers > 1) &&
+      config_.latency_budget > 0) {
+    // Layer references are set per frame, which lookahead would reorder, and
+    // libvpx encodes spatial layers in one pass only without lookahead.
+    LOG(WARNING) << "scalability layers require realtime output, ignoring "
+                 << "the latency budget.";
+    config_.latency_budget = 0;
+  }
+  if (config_.static_detection != VpxConfig::kUseDefault &&
+      (config_.static_detection < 0 || config_.latency_budget > 0 ||
+       config_.spatial_layers > 1)) {
+    // Blocks are marked for the frame passed to libvpx, so detection needs
+    // output in input order, and one frame size.
+    LOG(WARNING) << "static detection requires a non-negative threshold, "
+                 << "realtime output and one spatial layer, disabling.";
+    config_.static_detection = VpxConfig::kUseDefault;
+  }
+  static_detector_.Reset();
+  active_map_enabled_ = false;
+  if (!config_.regions_of_interest.empty() &&
+      SetRegionsOfInterest(config_.regions_of_interest)) {
+    LOG(WARNING) << "ignoring regions of interest.";
+  }
+
+  // A latency budget buys lookahead for rate control and, once it covers
+  // enough frames, alternate reference frames. Those need the good quality
+  // deadline, and VBR for VP9.
+  const double frame_rate = user_config.actual_video_config.frame_rate;
+  bool auto_alt_ref = false;
+  if (config_.latency_budget > 0 && frame_rate > 0) {
+    const int lag = std::min(
+        kMaxLagInFrames,
+        static_cast<int>(config_.latency_budget * frame_rate / 1000));
+    libvpx_config.g_lag_in_frames = lag;
+    if (lag >= kMinAltRefLagInFrames) {
+      auto_alt_ref = true;
+      libvpx_config.rc_end_usage = VPX_VBR;
+      deadline_ = VPX_DL_GOOD_QUALITY;
+    }
+    LOG(INFO) << "latency budget " << config_.latency_budget << "ms: " << lag
+              << " frames of lookahead, alt-ref "
+              << (auto_alt_ref ? "on." : "off.");
+  }
+  if (user_config.vpx_config.aligned_keyframes) {
+    // Only forced keyframes stay on the grid.
+    libvpx_config.kf_mode = VPX_KF_DISABLED;
+  }
+  if (config_.intra_refresh) {
+    // Cyclic refresh replaces the periodic keyframes; VP8 refreshes only in
+    // error resilient mode.
+    libvpx_config.kf_mode = VPX_KF_DISABLED;
+    if (config_.codec == kVideoFormatVP8) {
+      libvpx_config.g_error_resilient = 1;
+    }
+    LOG(INFO) << "intra refresh: keyframes on request only.";
+  }
 
   // TODO(tomfinegan): Add user settings validation-- v1 was relying on the
   //                   DShow filter to check settings.
 
   // Copy user configuration values into libvpx configuration struct
-  libvpx_config.g_h = user_config.actual_video_config.height;
-  libvpx_config.g_w = user_config.actual_video_config.width;
+  libvpx_config.g_h = encoded_config.height;
+  libvpx_config.g_w = encoded_config.width;
+  output_config_ = encoded_config;
+  max_width_ = libvpx_config.g_w;
+  max_height_ = libvpx_config.g_h;
   libvpx_config.rc_target_bitrate = config_.bitrate;
   libvpx_config.rc_min_quantizer = config_.min_quantizer;
   libvpx_config.rc_max_quantizer = config_.max_quantizer;
+  if (config_.temporal_layers > 1) {
+    const int layers = config_.temporal_layers;
+    libvpx_config.ts_number_layers = layers;
+    libvpx_config.ts_periodicity = kLayerPeriodicity[layers];
+    for (int i = 0; i < kLayerPeriodicity[layers]; ++i) {
+      libvpx_config.ts_layer_id[i] = kLayerPattern[layers][i];
+    }
+    for (int i = 0; i < layers; ++i) {
+      libvpx_config.ts_rate_decimator[i] = 1 << (layers - 1 - i);
+    }
+    layer_frame_index_ = 0;
+  }
+  if (config_.spatial_layers > 1) {
+    libvpx_config.ss_number_layers = config_.spatial_layers;
+  }
+  SetLayerBitrates(config_.bitrate, &libvpx_config);
 
   if (config_.thread_count != VpxConfig::kUseDefault) {
     libvpx_config.g_threads = config_.thread_count;
   }
+
+  output_buffer_size_ = InitialOutputBufferSize(
+      config_, user_config.actual_video_config.frame_rate);
   if (config_.undershoot != VpxConfig::kUseDefault) {
     libvpx_config.rc_undershoot_pct = config_.undershoot;
   }
@@ -88,14 +432,23 @@ int VpxEncoder::Init(const WebmEncoderConfig& user_config) {
     libvpx_config.rc_buf_optimal_sz = config_.optimal_buffer_time;
   }
 
-  // Configure the codec library.
-  status = VPX_CODEC_INVALID_PARAM;
-  if (config_.codec == kVideoFormatVP8) {
+  // Configure the codec library, with an idle context of the same codec,
+  // size and threads when the pool holds one. Contexts with lookahead or
+  // layers carry frames or layer state from their stream, and are not pooled.
+  libvpx_config_ = libvpx_config;
+  applied_controls_ = 0;
+  context_from_pool_ = use_pool && libvpx_config_.g_lag_in_frames == 0 &&
+                       config_.temporal_layers == 1 &&
+                       config_.spatial_layers == 1 && AcquirePooledContext();
+  status = context_from_pool_ ? VPX_CODEC_OK : VPX_CODEC_INVALID_PARAM;
+  if (context_from_pool_) {
+    LOG(INFO) << "reusing pooled VPx context.";
+  } else if (config_.codec == kVideoFormatVP8) {
     status = vpx_codec_enc_init(&vpx_context_, vpx_codec_vp8_cx(),
-                                &libvpx_config, 0);
+                                &libvpx_config_, 0);
   } else if (config_.codec == kVideoFormatVP9) {
     status = vpx_codec_enc_init(&vpx_context_, vpx_codec_vp9_cx(),
-                                &libvpx_config, 0);
+                                &libvpx_config_, 0);
   }
   if (status) {
     LOG(ERROR) << "vpx_codec_enc_init failed: "
@@ -103,12 +456,56 @@ int VpxEncoder::Init(const WebmEncoderConfig& user_config) {
     return VideoEncoder::kCodecError;
   }
 
+  if (config_.speed != VpxConfig::kUseDefault) {
+    speed_ = std::abs(config_.speed);
+    speed_sign_ = config_.speed < 0 ? -1 : 1;
+  }
+  min_speed_ = speed_;
+  max_speed_ = config_.max_speed != VpxConfig::kUseDefault ?
+      std::abs(config_.max_speed) :
+      (config_.codec == kVideoFormatVP9 ? kVp9MaxSpeed : kVp8MaxSpeed);
+  max_speed_ = std::max(max_speed_, min_speed_);
+  if (config_.adaptive_speed && config_.speed == VpxConfig::kUseDefault) {
+    LOG(WARNING) << "adaptive speed requires a speed setting, disabling.";
+    config_.adaptive_speed = false;
+  }
+
   // Pass the remaining configuration settings into libvpx, but leave them at
   // the library defaults if not specified by the user or set to a value
   // other than VpxConfig::kUseDefault by VpxConfig::VpxConfig().
   if (CodecControl(VP8E_SET_CPUUSED, config_.speed, VpxConfig::kUseDefault)) {
     return VideoEncoder::kCodecError;
   }
+  if (config_.temporal_layers > 1 || config_.spatial_layers > 1) {
+    // VP9 takes scalability layers through its SVC interface.
+    if (config_.codec == kVideoFormatVP9 &&
+        vpx_codec_control(&vpx_context_, VP9E_SET_SVC, 1)) {
+      LOG(ERROR) << "vpx_codec_control (VP9E_SET_SVC) failed: "
+                 << vpx_codec_error(&vpx_context_);
+      return VideoEncoder::kCodecError;
+    }
+    if (config_.spatial_layers > 1) {
+      // Layer i is scaled by 1/2^(layers - 1 - i), and shares the quantizer
+      // range of the stream.
+      vpx_svc_extra_cfg_t svc_params;
+      memset(&svc_params, 0, sizeof(svc_params));
+      for (int i = 0; i < config_.spatial_layers; ++i) {
+        svc_params.min_quantizers[i] = config_.min_quantizer;
+        svc_params.max_quantizers[i] = config_.max_quantizer;
+        svc_params.scaling_factor_num[i] = 1;
+        svc_params.scaling_factor_den[i] =
+            1 << (config_.spatial_layers - 1 - i);
+      }
+      if (vpx_codec_control(&vpx_context_, VP9E_SET_SVC_PARAMETERS,
+                            &svc_params)) {
+        LOG(ERROR) << "vpx_codec_control (VP9E_SET_SVC_PARAMETERS) failed: "
+                   << vpx_codec_error(&vpx_context_);
+        return VideoEncoder::kCodecError;
+      }
+    }
+    LOG(INFO) << config_.temporal_layers << " temporal and "
+              << config_.spatial_layers << " spatial layers.";
+  }
   if (CodecControl(VP8E_SET_STATIC_THRESHOLD, config_.static_threshold,
                    VpxConfig::kUseDefault)) {
     return VideoEncoder::kCodecError;
@@ -126,6 +523,10 @@ int VpxEncoder::Init(const WebmEncoderConfig& user_config) {
                    VpxConfig::kUseDefault)) {
     return VideoEncoder::kCodecError;
   }
+  if (auto_alt_ref &&
+      CodecControl(VP8E_SET_ENABLEAUTOALTREF, 1, VpxConfig::kUseDefault)) {
+    return VideoEncoder::kCodecError;
+  }
 
   // Set VP8 specific options.
   if (config_.codec == kVideoFormatVP8) {
@@ -137,14 +538,21 @@ int VpxEncoder::Init(const WebmEncoderConfig& user_config) {
 
   // Set VP9 specific options.
   if (config_.codec == kVideoFormatVP9) {
-    if (CodecControl(VP9E_SET_AQ_MODE, config_.adaptive_quantization_mode,
-                     VpxConfig::kUseDefault)) {
+    const int aq_mode = config_.intra_refresh ?
+        kVp9CyclicRefreshAqMode : config_.adaptive_quantization_mode;
+    if (CodecControl(VP9E_SET_AQ_MODE, aq_mode, VpxConfig::kUseDefault)) {
       return VideoEncoder::kCodecError;
     }
     if (CodecControl(VP9E_SET_TILE_COLUMNS, config_.tile_columns,
                      VpxConfig::kUseDefault)) {
       return VideoEncoder::kCodecError;
     }
+#ifdef VPX_CTRL_VP9E_SET_ROW_MT
+    if (CodecControl(VP9E_SET_ROW_MT, config_.thread_count > 1 ? 1 : 0,
+                     VpxConfig::kUseDefault)) {
+      return VideoEncoder::kCodecError;
+    }
+#endif
     if (CodecControl(VP9E_SET_FRAME_PARALLEL_DECODING,
                      config_.frame_parallel_mode ? 1 : 0,
                      VpxConfig::kUseDefault)) {
@@ -158,6 +566,73 @@ int VpxEncoder::Init(const WebmEncoderConfig& user_config) {
       return VideoEncoder::kCodecError;
     }
   }
+  if (config_.warmup_frames > 0 && !context_from_pool_) {
+    return WarmUp(frame_rate);
+  }
+  return kSuccess;
+}
+
+int VpxEncoder::WarmUp(double frame_rate) {
+  if (libvpx_config_.g_lag_in_frames > 0 || config_.temporal_layers > 1 ||
+      config_.spatial_layers > 1) {
+    // Lookahead would hold the warmup frames until the stream ends, and
+    // layered frames need the layer pattern from the first real frame.
+    LOG(INFO) << "encoder warmup requires realtime output without "
+              << "scalability layers, skipping.";
+    return kSuccess;
+  }
+  const int width = libvpx_config_.g_w;
+  const int height = libvpx_config_.g_h;
+  const int uv_size = ((width + 1) / 2) * ((height + 1) / 2);
+  const size_t frame_size = static_cast<size_t>(width) * height + 2 * uv_size;
+  std::unique_ptr<uint8[]> frame(
+      new (std::nothrow) uint8[frame_size]);  // NOLINT
+  if (!frame) {
+    LOG(ERROR) << "out of memory.";
+    return kNoMemory;
+  }
+  memset(frame.get(), 128, frame_size);
+  vpx_image_t vpx_image;
+  if (!vpx_img_wrap(&vpx_image, VPX_IMG_FMT_I420, width, height,
+                    1,  // Alignment.
+                    frame.get())) {
+    LOG(ERROR) << "cannot wrap warmup frame for libvpx.";
+    return kEncoderError;
+  }
+
+  // The first stream frame normally has the lowest timestamp libvpx sees;
+  // the warmup frames come before it so that timestamps keep increasing.
+  const int64 duration = (frame_rate > 0) ?
+      std::max(static_cast<int64>(kTimebase / frame_rate),
+               static_cast<int64>(1)) : 1;
+  const std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  for (int i = 0; i < config_.warmup_frames; ++i) {
+    const vpx_codec_pts_t pts = (i - config_.warmup_frames) * duration;
+    const vpx_codec_err_t status =
+        vpx_codec_encode(&vpx_context_, &vpx_image, pts,
+                         static_cast<uint32>(duration), 0, deadline_);
+    if (status) {
+      LOG(ERROR) << "warmup vpx_codec_encode failed: "
+                 << vpx_codec_err_to_string(status);
+      return kCodecError;
+    }
+    vpx_codec_iter_t iter = NULL;
+    while (vpx_codec_get_cx_data(&vpx_context_, &iter)) {
+    }
+  }
+  const vpx_codec_err_t status =
+      vpx_codec_enc_config_set(&vpx_context_, &libvpx_config_);
+  if (status) {
+    LOG(ERROR) << "vpx_codec_enc_config_set failed after warmup: "
+               << vpx_codec_err_to_string(status);
+    return kCodecError;
+  }
+  force_keyframe_ = true;
+  LOG(INFO) << "encoder warmup: " << config_.warmup_frames << " frames in "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now() - start).count()
+            << " ms.";
   return kSuccess;
 }
 
@@ -173,52 +648,255 @@ int VpxEncoder::EncodeFrame(const VideoFrame& raw_frame,
     return kInvalidArg;
   }
   if (raw_frame.format() != kVideoFormatI420 &&
-      raw_frame.format() != kVideoFormatYV12) {
+      raw_frame.format() != kVideoFormatYV12 &&
+      raw_frame.format() != kVideoFormatNV12) {
     LOG(ERROR) << "Unsupported VideoFrame format!";
     return kInvalidArg;
   }
   ++frames_in_;
 
-  // If decimation is enabled, determine if it's time to drop a frame.
-  if (config_.decimate > 1) {
-    const int drop_frame = frames_in_ % config_.decimate;
-
-    // Non-zero |drop_frame| values mean drop the frame.
-    if (drop_frame) {
-      return kDropped;
-    }
-  }
-
-  // Determine if it's time to force a keyframe.
+  // Determine if it's time to force a keyframe. Aligned keyframes are
+  // scheduled by |VideoEncoder|, and intra refresh has only requested ones.
   const int64 time_since_keyframe =
       raw_frame.timestamp() - last_keyframe_time_;
-  const bool force_keyframe = time_since_keyframe > config_.keyframe_interval;
+  const bool force_keyframe =
+      force_keyframe_ || (!config_.aligned_keyframes &&
+                          !config_.intra_refresh &&
+                          time_since_keyframe > config_.keyframe_interval);
+  force_keyframe_ = false;
+  if (force_keyframe) {
+    last_keyframe_time_ = raw_frame.timestamp();
+  }
 
   // Use the |vpx_img_wrap| to wrap the buffer within |ptr_raw_frame| in
   // |vpx_image| for passing the buffer to libvpx.
-  const VideoFormat video_format = raw_frame.format();
-  const vpx_img_fmt vpx_image_format =
-      (video_format == kVideoFormatI420) ? VPX_IMG_FMT_I420 : VPX_IMG_FMT_YV12;
+  const VideoFrame* ptr_input_frame = &raw_frame;
+  vpx_img_fmt vpx_image_format = VPX_IMG_FMT_I420;
+  switch (raw_frame.format()) {
+    case kVideoFormatYV12:
+      vpx_image_format = VPX_IMG_FMT_YV12;
+      break;
+    case kVideoFormatNV12:
+#ifdef WEBMLIVE_VPX_HAS_NV12
+      vpx_image_format = VPX_IMG_FMT_NV12;
+#else
+      if (i420_frame_.InitConverted(raw_frame)) {
+        LOG(ERROR) << "cannot convert NV12 frame for libvpx.";
+        return kEncoderError;
+      }
+      ptr_input_frame = &i420_frame_;
+#endif
+      break;
+    default:
+      break;
+  }
+  // Cropped frames are encoded from their visible region in place, and
+  // padded frames read the padding from the stride and the rows that follow
+  // the region.
+  const VideoConfig encoded_config =
+      EncodedVideoConfig(ptr_input_frame->config());
+  const int32 encoded_width = encoded_config.width;
+  const int32 encoded_height = encoded_config.height;
   vpx_image_t vpx_image;
   vpx_image_t* const ptr_vpx_image = vpx_img_wrap(&vpx_image,
                                                   vpx_image_format,
-                                                  raw_frame.width(),
-                                                  raw_frame.height(),
+                                                  encoded_width,
+                                                  encoded_height,
                                                   1,  // Alignment.
-                                                  raw_frame.buffer());
+                                                  ptr_input_frame->buffer());
+
+  // |vpx_img_wrap| assumes packed planes; point libvpx at the frame's actual
+  // planes and strides, which are padded for converted and scaled frames.
+  // |vpx_img_set_rect| would compute the visible planes from that packed
+  // layout, so the planes of the visible region are set here instead.
+  VideoPlanes planes;
+  if (!ptr_vpx_image ||
+      !VideoFrame::GetVisiblePlanes(ptr_input_frame->config(),
+                                    ptr_input_frame->buffer(), &planes)) {
+    LOG(ERROR) << "cannot wrap VideoFrame planes for libvpx.";
+    return kEncoderError;
+  }
+  if (ptr_input_frame->format() == kVideoFormatNV12) {
+    // libvpx addresses the interleaved V samples one byte past the U samples.
+    planes.data[2] = planes.data[1] + 1;
+    planes.stride[2] = planes.stride[1];
+  }
+  ptr_vpx_image->planes[VPX_PLANE_Y] = planes.data[0];
+  ptr_vpx_image->stride[VPX_PLANE_Y] = planes.stride[0];
+  ptr_vpx_image->planes[VPX_PLANE_U] = planes.data[1];
+  ptr_vpx_image->stride[VPX_PLANE_U] = planes.stride[1];
+  ptr_vpx_image->planes[VPX_PLANE_V] = planes.data[2];
+  ptr_vpx_image->stride[VPX_PLANE_V] = planes.stride[2];
 
-  const vpx_enc_frame_flags_t flags = force_keyframe ? VPX_EFLAG_FORCE_KF : 0;
+  if (config_.static_detection != VpxConfig::kUseDefault) {
+    bool skip = false;
+    const int status = DetectStaticBlocks(*ptr_input_frame, encoded_width,
+                                          encoded_height, planes,
+                                          force_keyframe, &skip);
+    if (status) {
+      return status;
+    }
+    if (skip) {
+      return kDropped;
+    }
+  }
+
+  if (roi_width_ != encoded_width || roi_height_ != encoded_height) {
+    // Regions only change how bits are spent; the stream goes on without
+    // them.
+    if (ApplyRegionsOfInterest(encoded_width, encoded_height)) {
+      LOG(WARNING) << "dropping regions of interest.";
+      regions_.clear();
+      roi_map_.reset();
+    }
+  }
+
+  vpx_enc_frame_flags_t flags = force_keyframe ? VPX_EFLAG_FORCE_KF : 0;
+  int temporal_layer = 0;
+  if (config_.temporal_layers > 1) {
+    temporal_layer = NextTemporalLayer(force_keyframe, &flags);
+    vpx_codec_err_t layer_status = VPX_CODEC_OK;
+    if (config_.codec == kVideoFormatVP9) {
+      vpx_svc_layer_id_t layer_id = {0, temporal_layer};
+      layer_status = vpx_codec_control(&vpx_context_, VP9E_SET_SVC_LAYER_ID,
+                                       &layer_id);
+    } else {
+      layer_status = vpx_codec_control(&vpx_context_,
+                                       VP8E_SET_TEMPORAL_LAYER_ID,
+                                       temporal_layer);
+    }
+    if (layer_status) {
+      LOG(ERROR) << "cannot set temporal layer id: "
+                 << vpx_codec_err_to_string(layer_status);
+      return kCodecError;
+    }
+  }
   const uint32 duration = static_cast<uint32>(raw_frame.duration());
 
+  // Have libvpx write the compressed frame directly into |ptr_vpx_frame|.
+  // Packets that do not fit are returned in libvpx's own storage, and are
+  // copied below instead.
+  if (ptr_vpx_frame->Reserve(OutputBufferSize(
+          ptr_vpx_frame->buffer_capacity()))) {
+    LOG(ERROR) << "cannot reserve compressed VideoFrame buffer.";
+    return kNoMemory;
+  }
+  vpx_fixed_buf_t output_buffer;
+  output_buffer.buf = ptr_vpx_frame->buffer();
+  output_buffer.sz = ptr_vpx_frame->buffer_capacity();
+  if (vpx_codec_set_cx_data_buf(&vpx_context_, &output_buffer, 0, 0)) {
+    LOG(ERROR) << "vpx_codec_set_cx_data_buf failed.";
+    return kCodecError;
+  }
+
   // Pass |ptr_raw_frame|'s data to libvpx.
+  const InputRecord record = {raw_frame.timestamp(), raw_frame.capture_time(),
+                              encoded_config, temporal_layer};
+  input_records_.push_back(record);
+  if (pts_offset_pending_) {
+    // A pooled context continues the timeline of its last stream.
+    pts_offset_ = next_pts_ - raw_frame.timestamp();
+    pts_offset_pending_ = false;
+  }
+  const vpx_codec_pts_t pts = raw_frame.timestamp() + pts_offset_;
+  const std::chrono::steady_clock::time_point encode_start =
+      std::chrono::steady_clock::now();
   const vpx_codec_err_t vpx_status =
-      vpx_codec_encode(&vpx_context_, ptr_vpx_image, raw_frame.timestamp(),
-                       duration, flags, VPX_DL_REALTIME);
+      vpx_codec_encode(&vpx_context_, ptr_vpx_image, pts, duration, flags,
+                       deadline_);
   if (vpx_status) {
+    vpx_codec_set_cx_data_buf(&vpx_context_, NULL, 0, 0);
     LOG(ERROR) << "EncodeFrame vpx_codec_encode failed: "
                << vpx_codec_err_to_string(vpx_status);
     return kCodecError;
   }
+  next_pts_ = pts + duration;
+  if (ptr_frame_profiler_) {
+    profile_pending_us_ +=
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - encode_start).count();
+  }
+  const int64 frames_out = frames_out_;
+  bool stored = false;
+  const int status = ReadPackets(ptr_vpx_frame, &stored);
+  if (config_.static_detection != VpxConfig::kUseDefault) {
+    // Frames dropped by rate control leave their blocks unencoded.
+    if (frames_out_ != frames_out) {
+      static_detector_.Update(planes.data[0], planes.stride[0]);
+    } else {
+      static_detector_.Reset();
+    }
+    last_encoded_time_ = raw_frame.timestamp();
+  }
+
+  // |ptr_vpx_frame| belongs to the caller once this method returns.
+  vpx_codec_set_cx_data_buf(&vpx_context_, NULL, 0, 0);
+  if (status) {
+    return status;
+  }
+  if (!stored && !output_frames_.empty()) {
+    ptr_vpx_frame->Swap(&output_frames_.front());
+    output_frames_.pop_front();
+    stored = true;
+  }
+
+  if (config_.adaptive_speed) {
+    const std::chrono::duration<double, std::milli> encode_time =
+        std::chrono::steady_clock::now() - encode_start;
+    const int speed_status =
+        AdaptSpeed(encode_time.count(), raw_frame.duration());
+    if (speed_status) {
+      return speed_status;
+    }
+  }
+  return stored ? kSuccess : kDropped;
+}
+
+int VpxEncoder::ReadPendingFrame(VideoFrame* ptr_vpx_frame) {
+  if (output_frames_.empty()) {
+    return kDropped;
+  }
+  ptr_vpx_frame->Swap(&output_frames_.front());
+  output_frames_.pop_front();
+  return kSuccess;
+}
+
+int VpxEncoder::Flush() {
+  if (libvpx_config_.g_lag_in_frames == 0) {
+    return kSuccess;
+  }
+  for (;;) {
+    const size_t queued_frames = output_frames_.size();
+    const std::chrono::steady_clock::time_point encode_start =
+        std::chrono::steady_clock::now();
+    const vpx_codec_err_t vpx_status =
+        vpx_codec_encode(&vpx_context_, NULL, 0, 0, 0, deadline_);
+    if (vpx_status) {
+      LOG(ERROR) << "Flush vpx_codec_encode failed: "
+                 << vpx_codec_err_to_string(vpx_status);
+      return kCodecError;
+    }
+    if (ptr_frame_profiler_) {
+      profile_pending_us_ +=
+          std::chrono::duration_cast<std::chrono::microseconds>(
+              std::chrono::steady_clock::now() - encode_start).count();
+    }
+    bool stored = false;
+    const int status = ReadPackets(NULL, &stored);
+    if (status) {
+      return status;
+    }
+    if (output_frames_.size() == queued_frames) {
+      break;
+    }
+  }
+  input_records_.clear();
+  return kSuccess;
+}
+
+int VpxEncoder::ReadPackets(VideoFrame* ptr_vpx_frame, bool* ptr_stored) {
+  *ptr_stored = false;
+  profiled_packets_.clear();
 
   // Consume output packets from libvpx. Note that the library may emit stats
   // packets in addition to the compressed data.
@@ -229,35 +907,468 @@ int VpxEncoder::EncodeFrame(const VideoFrame& raw_frame,
     if (!pkt) {
       break;
     }
-    const bool compressed_frame_packet = pkt->kind == VPX_CODEC_CX_FRAME_PKT;
-
-    // Copy the compressed data to |ptr_vpx_frame|.
-    if (compressed_frame_packet) {
-      const bool is_keyframe = !!(pkt->data.frame.flags & VPX_FRAME_IS_KEY);
-      uint8* const ptr_vpx_frame_buf =
-          reinterpret_cast<uint8*>(pkt->data.frame.buf);
-      VideoConfig vpx_config = raw_frame.config();
-      vpx_config.format = config_.codec;
-      const int32 status = ptr_vpx_frame->Init(vpx_config,
-                                               is_keyframe,
-                                               raw_frame.timestamp(),
-                                               raw_frame.duration(),
-                                               ptr_vpx_frame_buf,
-                                               pkt->data.frame.sz);
+    if (pkt->kind != VPX_CODEC_CX_FRAME_PKT) {
+      continue;
+    }
+    const bool is_keyframe = !!(pkt->data.frame.flags & VPX_FRAME_IS_KEY);
+    const int64 timestamp = pkt->data.frame.pts - pts_offset_;
+    const int64 duration = pkt->data.frame.duration;
+
+    // Visible frames come out in input order; inputs skipped by libvpx's
+    // rate control are passed over. Alternate reference frames are invisible
+    // and get the properties of the previous frame.
+    int64 capture_time = 0;
+    int temporal_layer = 0;
+    if (!(pkt->data.frame.flags & VPX_FRAME_IS_INVISIBLE)) {
+      while (!input_records_.empty() &&
+             input_records_.front().timestamp <= timestamp) {
+        if (input_records_.front().timestamp == timestamp) {
+          capture_time = input_records_.front().capture_time;
+          output_config_ = input_records_.front().config;
+          temporal_layer = input_records_.front().temporal_layer;
+        }
+        input_records_.pop_front();
+      }
+    }
+    VideoConfig vpx_config = output_config_;
+    vpx_config.format = config_.codec;
+    const uint8* const ptr_vpx_frame_buf =
+        reinterpret_cast<const uint8*>(pkt->data.frame.buf);
+    const int32 frame_length = static_cast<int32>(pkt->data.frame.sz);
+
+    // Store the compressed data in |ptr_vpx_frame|. The data is already in
+    // place when libvpx used the buffer passed to vpx_codec_set_cx_data_buf.
+    VideoFrame* ptr_frame = NULL;
+    int32 status = VideoFrame::kSuccess;
+    if (ptr_vpx_frame && !*ptr_stored && output_frames_.empty()) {
+      ptr_frame = ptr_vpx_frame;
+      *ptr_stored = true;
+      if (ptr_vpx_frame_buf == ptr_vpx_frame->buffer()) {
+        status = ptr_vpx_frame->InitInPlace(vpx_config,
+                                            is_keyframe,
+                                            timestamp,
+                                            duration,
+                                            frame_length);
+      } else {
+        // Grow by a whole size class so that the next frame of similar size
+        // is written in place.
+        status = ptr_vpx_frame->Reserve(OutputBufferSize(frame_length));
+        if (status == VideoFrame::kSuccess) {
+          status = ptr_vpx_frame->Init(vpx_config,
+                                       is_keyframe,
+                                       timestamp,
+                                       duration,
+                                       ptr_vpx_frame_buf,
+                                       frame_length);
+        }
+      }
+    } else {
+      output_frames_.emplace_back();
+      ptr_frame = &output_frames_.back();
+      status = ptr_frame->Init(vpx_config, is_keyframe, timestamp, duration,
+                               ptr_vpx_frame_buf, frame_length);
       if (status) {
-        LOG(ERROR) << "VideoFrame Init failed: " << status;
-        return kEncoderError;
+        output_frames_.pop_back();
+      }
+    }
+    if (status) {
+      LOG(ERROR) << "VideoFrame Init failed: " << status;
+      return kEncoderError;
+    }
+    ptr_frame->set_capture_time(capture_time);
+    ptr_frame->set_temporal_layer(temporal_layer);
+    if (is_keyframe) {
+      last_keyframe_time_ = std::max(last_keyframe_time_, timestamp);
+      LOG(INFO) << "keyframe @ " << timestamp / 1000.0 << "sec ("
+                << timestamp << "ms)";
+    }
+    last_timestamp_ = std::max(last_timestamp_, timestamp);
+    ++frames_out_;
+    if (ptr_frame_profiler_) {
+      const ProfiledPacket packet = {ProfileType(pkt->data.frame.flags),
+                                     timestamp, frame_length};
+      profiled_packets_.push_back(packet);
+    }
+  }
+  ProfilePackets();
+  return kSuccess;
+}
+
+void VpxEncoder::ProfilePackets() {
+  if (!ptr_frame_profiler_ || profiled_packets_.empty()) {
+    return;
+  }
+  int quantizer = -1;
+  if (vpx_codec_control(&vpx_context_, VP8E_GET_LAST_QUANTIZER_64,
+                        &quantizer)) {
+    quantizer = -1;
+  }
+  const int64 num_packets = static_cast<int64>(profiled_packets_.size());
+  for (size_t i = 0; i < profiled_packets_.size(); ++i) {
+    const ProfiledPacket& packet = profiled_packets_[i];
+    const bool last = i + 1 == profiled_packets_.size();
+    ptr_frame_profiler_->Add(packet.type, packet.timestamp,
+                             profile_pending_us_ / num_packets, packet.bytes,
+                             last ? quantizer : -1);
+  }
+  profile_pending_us_ = 0;
+  profiled_packets_.clear();
+}
+
+int32 VpxEncoder::InitialOutputBufferSize(const VpxConfig& config,
+                                          double frame_rate) {
+  // Size compressed frame buffers to hold a keyframe at the target bitrate.
+  int32 size = kMinOutputBufferSize;
+  if (frame_rate > 0 && config.bitrate > 0) {
+    const int keyframe_percent =
+        config.max_keyframe_bitrate > 0 ?
+        std::max(config.max_keyframe_bitrate, 100) :
+        kDefaultKeyframeSizePercent;
+    const double frame_bytes = config.bitrate * 1000.0 / 8.0 / frame_rate;
+    const double keyframe_bytes = frame_bytes * keyframe_percent / 100.0;
+    while (size < keyframe_bytes &&
+           size <= std::numeric_limits<int32>::max() / 2) {
+      size *= 2;
+    }
+  }
+  return size;
+}
+
+int32 VpxEncoder::OutputBufferSize(int32 length) const {
+  int32 size = output_buffer_size_;
+  while (size < length && size <= std::numeric_limits<int32>::max() / 2) {
+    size *= 2;
+  }
+  return size;
+}
+
+void VpxEncoder::SetInputBacklog(int32 queued_frames, int32 capacity) {
+  backlog_ = (capacity > 0) ?
+      static_cast<double>(queued_frames) / capacity : 0;
+}
+
+int VpxEncoder::SetBitrate(int bitrate) {
+  if (bitrate <= 0) {
+    return kInvalidArg;
+  }
+  if (bitrate == config_.bitrate) {
+    return kSuccess;
+  }
+  vpx_codec_enc_cfg_t libvpx_config = libvpx_config_;
+  libvpx_config.rc_target_bitrate = bitrate;
+  SetLayerBitrates(bitrate, &libvpx_config);
+  const vpx_codec_err_t status =
+      vpx_codec_enc_config_set(&vpx_context_, &libvpx_config);
+  if (status) {
+    LOG(ERROR) << "vpx_codec_enc_config_set failed: "
+               << vpx_codec_err_to_string(status);
+    return kCodecError;
+  }
+  libvpx_config_ = libvpx_config;
+  config_.bitrate = bitrate;
+  return kSuccess;
+}
+
+void VpxEncoder::SetLayerBitrates(
+    int bitrate, vpx_codec_enc_cfg_t* ptr_libvpx_config) const {
+  const int temporal_layers = config_.temporal_layers;
+  if (temporal_layers > 1) {
+    for (int i = 0; i < temporal_layers; ++i) {
+      ptr_libvpx_config->ts_target_bitrate[i] =
+          bitrate * kLayerBitratePercent[temporal_layers][i] / 100;
+    }
+  }
+  const int spatial_layers = config_.spatial_layers;
+  if (spatial_layers > 1) {
+    for (int i = 0; i < spatial_layers; ++i) {
+      ptr_libvpx_config->ss_target_bitrate[i] =
+          bitrate * kSpatialBitratePercent[spatial_layers][i] / 100;
+    }
+  }
+}
+
+int VpxEncoder::NextTemporalLayer(bool keyframe,
+                                  vpx_enc_frame_flags_t* ptr_flags) {
+  const int layers = config_.temporal_layers;
+  if (keyframe) {
+    layer_frame_index_ = 0;
+  }
+  const int layer =
+      kLayerPattern[layers][layer_frame_index_ % kLayerPeriodicity[layers]];
+  ++layer_frame_index_;
+
+  // The base layer predicts from and updates the last frame buffer only. The
+  // layer above it also predicts from the golden frame buffer, which only it
+  // updates. The top layer of a 3 layer stream predicts from both and
+  // updates neither. Frames above the base layer leave the entropy context
+  // alone, so that removing them does not change how the base layer decodes.
+  vpx_enc_frame_flags_t flags = VP8_EFLAG_NO_REF_ARF | VP8_EFLAG_NO_UPD_ARF;
+  if (layer == 0) {
+    flags |= VP8_EFLAG_NO_REF_GF | VP8_EFLAG_NO_UPD_GF;
+  } else {
+    flags |= VP8_EFLAG_NO_UPD_LAST | VP8_EFLAG_NO_UPD_ENTROPY;
+    if (layer == 2) {
+      flags |= VP8_EFLAG_NO_UPD_GF;
+    }
+  }
+  if (!keyframe) {
+    *ptr_flags |= flags;
+  }
+  return layer;
+}
+
+int VpxEncoder::DetectStaticBlocks(const VideoFrame& frame, int32 width,
+                                   int32 height, const VideoPlanes& planes,
+                                   bool keyframe, bool* ptr_skip) {
+  *ptr_skip = false;
+  if (static_detector_.width() != width ||
+      static_detector_.height() != height) {
+    if (static_detector_.Init(width, height, config_.static_detection)) {
+      return kEncoderError;
+    }
+  }
+  const int32 blocks = static_detector_.rows() * static_detector_.cols();
+  int32 active_blocks = blocks;
+  if (keyframe) {
+    static_detector_.SetAllActive();
+  } else {
+    active_blocks = static_detector_.Detect(planes.data[0], planes.stride[0]);
+  }
+  if (active_blocks == 0 &&
+      frame.timestamp() - last_encoded_time_ < kMaxStaticFrameGap) {
+    *ptr_skip = true;
+    return kSuccess;
+  }
+
+  // An all active map is the same as none.
+  const bool use_map = active_blocks < blocks;
+  if (!use_map && !active_map_enabled_) {
+    return kSuccess;
+  }
+  vpx_active_map_t active_map;
+  active_map.active_map = use_map ? static_detector_.active_map() : NULL;
+  active_map.rows = static_detector_.rows();
+  active_map.cols = static_detector_.cols();
+  if (vpx_codec_control(&vpx_context_, VP8E_SET_ACTIVEMAP, &active_map)) {
+    LOG(WARNING) << "vpx_codec_control (VP8E_SET_ACTIVEMAP) failed: "
+                 << vpx_codec_error(&vpx_context_)
+                 << ", disabling static detection.";
+    config_.static_detection = VpxConfig::kUseDefault;
+    return kSuccess;
+  }
+  active_map_enabled_ = use_map;
+  return kSuccess;
+}
+
+int VpxEncoder::SetRegionsOfInterest(
+    const std::vector<RegionOfInterest>& regions) {
+  if (config_.codec != kVideoFormatVP8 && !regions.empty()) {
+    LOG(ERROR) << "regions of interest require VP8.";
+    return kInvalidArg;
+  }
+  regions_ = regions;
+  roi_width_ = 0;
+  return kSuccess;
+}
+
+int VpxEncoder::ApplyRegionsOfInterest(int32 width, int32 height) {
+  roi_width_ = width;
+  roi_height_ = height;
+  if (config_.codec != kVideoFormatVP8) {
+    return kSuccess;
+  }
+  const int32 kMacroblockSize = 16;
+  const int32 rows = (height + kMacroblockSize - 1) / kMacroblockSize;
+  const int32 cols = (width + kMacroblockSize - 1) / kMacroblockSize;
+  vpx_roi_map_t roi_map;
+  memset(&roi_map, 0, sizeof(roi_map));
+  roi_map.rows = rows;
+  roi_map.cols = cols;
+  if (regions_.empty()) {
+    if (!roi_map_) {
+      // libvpx has no map to turn off.
+      return kSuccess;
+    }
+    roi_map_.reset();
+  } else {
+    roi_map_.reset(new (std::nothrow) uint8[rows * cols]);  // NOLINT
+    if (!roi_map_) {
+      LOG(ERROR) << "cannot allocate ROI map.";
+      return kNoMemory;
+    }
+    memset(roi_map_.get(), 0, rows * cols);
+
+    // Segment 0 is the rest of the frame; each distinct |delta_q| gets the
+    // next segment. A macroblock belongs to the last region covering its
+    // center.
+    int segments = 1;
+    for (size_t i = 0; i < regions_.size(); ++i) {
+      const RegionOfInterest& region = regions_[i];
+      int segment = 0;
+      if (region.delta_q != 0) {
+        segment = 1;
+        while (segment < segments &&
+               roi_map.delta_q[segment] != region.delta_q) {
+          ++segment;
+        }
+        if (segment == segments) {
+          if (segments == kRoiSegments) {
+            LOG(ERROR) << "too many region of interest quality levels.";
+            return kInvalidArg;
+          }
+          roi_map.delta_q[segment] = region.delta_q;
+          ++segments;
+        }
       }
-      if (is_keyframe) {
-        last_keyframe_time_ = ptr_vpx_frame->timestamp();
-        LOG(INFO) << "keyframe @ " << last_keyframe_time_ / 1000.0 << "sec ("
-                  << last_keyframe_time_ << "ms)";
+      for (int32 row = 0; row < rows; ++row) {
+        const double y = (row + 0.5) * kMacroblockSize / height;
+        if (y < region.top || y >= region.top + region.height) {
+          continue;
+        }
+        for (int32 col = 0; col < cols; ++col) {
+          const double x = (col + 0.5) * kMacroblockSize / width;
+          if (x >= region.left && x < region.left + region.width) {
+            roi_map_[row * cols + col] = static_cast<uint8>(segment);
+          }
+        }
       }
-      ++frames_out_;
-      break;
     }
+    roi_map.roi_map = roi_map_.get();
+  }
+
+  // A NULL map turns segmentation off.
+  if (vpx_codec_control(&vpx_context_, VP8E_SET_ROI_MAP, &roi_map)) {
+    LOG(ERROR) << "vpx_codec_control (VP8E_SET_ROI_MAP) failed: "
+               << vpx_codec_error(&vpx_context_);
+    return kCodecError;
+  }
+  if (!regions_.empty()) {
+    LOG(INFO) << regions_.size() << " regions of interest on " << width << "x"
+              << height << " frames.";
+  }
+  return kSuccess;
+}
+
+int VpxEncoder::SetFrameSize(int32 width, int32 height) {
+  if (width <= 0 || height <= 0 || width > max_width_ ||
+      height > max_height_) {
+    LOG(ERROR) << "invalid VPx frame size " << width << "x" << height;
+    return kInvalidArg;
+  }
+  if (static_cast<uint32>(width) != libvpx_config_.g_w ||
+      static_cast<uint32>(height) != libvpx_config_.g_h) {
+    vpx_codec_enc_cfg_t libvpx_config = libvpx_config_;
+    libvpx_config.g_w = width;
+    libvpx_config.g_h = height;
+    const vpx_codec_err_t status =
+        vpx_codec_enc_config_set(&vpx_context_, &libvpx_config);
+    if (status) {
+      LOG(ERROR) << "vpx_codec_enc_config_set failed: "
+                 << vpx_codec_err_to_string(status);
+      return kCodecError;
+    }
+    LOG(INFO) << "VPx frame size " << libvpx_config_.g_w << "x"
+              << libvpx_config_.g_h << " -> " << width << "x" << height;
+    libvpx_config_ = libvpx_config;
+
+    // VP8 references cannot be scaled; its next frame must be a keyframe.
+    force_keyframe_ = config_.codec == kVideoFormatVP8;
+  }
+
+  // Load measured before the change says nothing about the new input, so
+  // |load_state()| starts over even when only the caller's frame rate
+  // changed.
+  overload_frames_ = 0;
+  underload_frames_ = 0;
+  return kSuccess;
+}
+
+int VpxEncoder::SetSpeed(int speed) {
+  const int status = vpx_codec_control(&vpx_context_, VP8E_SET_CPUUSED,
+                                       speed);
+  if (status) {
+    LOG(ERROR) << "vpx_codec_control (VP8E_SET_CPUUSED) failed: "
+               << vpx_codec_err_to_string(
+                      static_cast<vpx_codec_err_t>(status));
+    return kCodecError;
+  }
+  applied_controls_ |= ControlBit(VP8E_SET_CPUUSED);
+  LOG(INFO) << "VPx speed " << speed_sign_ * speed_ << " -> " << speed;
+  config_.speed = speed;
+  speed_ = std::abs(speed);
+  speed_sign_ = speed < 0 ? -1 : 1;
+  min_speed_ = speed_;
+  max_speed_ = std::max(max_speed_, min_speed_);
+  overload_frames_ = 0;
+  underload_frames_ = 0;
+  return kSuccess;
+}
+
+int VpxEncoder::SetKeyframeInterval(int keyframe_interval) {
+  if (keyframe_interval <= 0) {
+    return kInvalidArg;
   }
-  last_timestamp_ = ptr_vpx_frame->timestamp();
+  config_.keyframe_interval = keyframe_interval;
+  return kSuccess;
+}
+
+int VpxEncoder::load_state() const {
+  if (!config_.adaptive_speed) {
+    return VideoEncoder::kLoadNormal;
+  }
+  if (speed_ >= max_speed_ && overload_frames_ >= kSaturatedFrames) {
+    return VideoEncoder::kLoadSaturated;
+  }
+  if (speed_ <= min_speed_ && underload_frames_ >= kIdleFrames) {
+    return VideoEncoder::kLoadIdle;
+  }
+  return VideoEncoder::kLoadNormal;
+}
+
+int VpxEncoder::AdaptSpeed(double encode_ms, int64 frame_duration) {
+  if (frame_duration <= 0) {
+    return kSuccess;
+  }
+  const double load = encode_ms / frame_duration;
+  load_average_ = (frames_out_ <= 1) ? load :
+      load_average_ + kLoadSmoothing * (load - load_average_);
+
+  if (load_average_ > kLoadHigh || backlog_ > kBacklogHigh) {
+    ++overload_frames_;
+    underload_frames_ = 0;
+  } else if (load_average_ < kLoadLow && backlog_ == 0) {
+    ++underload_frames_;
+    overload_frames_ = 0;
+  } else {
+    overload_frames_ = 0;
+    underload_frames_ = 0;
+  }
+
+  int new_speed = speed_;
+  if (overload_frames_ >= kSpeedUpFrames && speed_ < max_speed_) {
+    new_speed = speed_ + 1;
+  } else if (underload_frames_ >= kSpeedDownFrames && speed_ > min_speed_) {
+    new_speed = speed_ - 1;
+  }
+  if (new_speed == speed_) {
+    return kSuccess;
+  }
+
+  const vpx_codec_err_t status =
+      vpx_codec_control(&vpx_context_, VP8E_SET_CPUUSED,
+                        speed_sign_ * new_speed);
+  if (status) {
+    LOG(ERROR) << "vpx_codec_control (VP8E_SET_CPUUSED) failed: "
+               << vpx_codec_err_to_string(status);
+    return kCodecError;
+  }
+  applied_controls_ |= ControlBit(VP8E_SET_CPUUSED);
+  LOG(INFO) << "VPx speed " << speed_sign_ * speed_ << " -> "
+            << speed_sign_ * new_speed << " load=" << load_average_
+            << " backlog=" << backlog_;
+  speed_ = new_speed;
+  overload_frames_ = 0;
+  underload_frames_ = 0;
   return kSuccess;
 }
 
@@ -276,6 +1387,9 @@ int VpxEncoder::CodecControl(int control_id, T val, T default_val) {
       case VP9E_SET_AQ_MODE:
       case VP9E_SET_FRAME_PARALLEL_DECODING:
       case VP9E_SET_TILE_COLUMNS:
+#ifdef VPX_CTRL_VP9E_SET_ROW_MT
+      case VP9E_SET_ROW_MT:
+#endif
         status = vpx_codec_control(&vpx_context_, control_id, val);
         break;
       default:
@@ -287,8 +1401,70 @@ int VpxEncoder::CodecControl(int control_id, T val, T default_val) {
                  << vpx_codec_err_to_string(status);
       return VideoEncoder::kCodecError;
     }
+    applied_controls_ |= ControlBit(control_id);
   }
   return kSuccess;
 }
 
+VpxContextPool::Key VpxEncoder::PoolKey() const {
+  VpxContextPool::Key key;
+  key.codec = config_.codec;
+  key.width = max_width_;
+  key.height = max_height_;
+  key.threads = libvpx_config_.g_threads;
+  return key;
+}
+
+bool VpxEncoder::AcquirePooledContext() {
+  vpx_codec_ctx_t context;
+  int64 next_pts = 0;
+  uint32 controls = 0;
+  if (!VpxContextPool::Instance()->Acquire(PoolKey(), &context, &next_pts,
+                                           &controls)) {
+    return false;
+  }
+  const vpx_codec_err_t status =
+      vpx_codec_enc_config_set(&context, &libvpx_config_);
+  if (status) {
+    LOG(WARNING) << "cannot reconfigure pooled VPx context: "
+                 << vpx_codec_err_to_string(status)
+                 << ", creating a new one.";
+    vpx_codec_destroy(&context);
+    return false;
+  }
+  vpx_context_ = context;
+  pool_controls_ = controls;
+  next_pts_ = next_pts;
+  pts_offset_pending_ = true;
+
+  // The references belong to the last stream of the context.
+  force_keyframe_ = true;
+  return true;
+}
+
+bool VpxEncoder::ClearMaps() {
+  if (active_map_enabled_) {
+    vpx_active_map_t active_map;
+    active_map.active_map = NULL;
+    active_map.rows = static_detector_.rows();
+    active_map.cols = static_detector_.cols();
+    if (vpx_codec_control(&vpx_context_, VP8E_SET_ACTIVEMAP, &active_map)) {
+      return false;
+    }
+    active_map_enabled_ = false;
+  }
+  if (roi_map_) {
+    const int32 kMacroblockSize = 16;
+    vpx_roi_map_t roi_map;
+    memset(&roi_map, 0, sizeof(roi_map));
+    roi_map.rows = (roi_height_ + kMacroblockSize - 1) / kMacroblockSize;
+    roi_map.cols = (roi_width_ + kMacroblockSize - 1) / kMacroblockSize;
+    if (vpx_codec_control(&vpx_context_, VP8E_SET_ROI_MAP, &roi_map)) {
+      return false;
+    }
+    roi_map_.reset();
+  }
+  return true;
+}
+
 }  // namespace webmlive
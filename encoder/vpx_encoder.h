@@ -9,9 +9,16 @@
 #ifndef WEBMLIVE_ENCODER_VPX_ENCODER_H_
 #define WEBMLIVE_ENCODER_VPX_ENCODER_H_
 
+#include <deque>
+#include <memory>
+#include <vector>
+
 #include "encoder/basictypes.h"
 #include "encoder/encoder_base.h"
+#include "encoder/frame_type_profiler.h"
+#include "encoder/static_block_detector.h"
 #include "encoder/video_encoder.h"
+#include "encoder/vpx_context_pool.h"
 
 #define VPX_CODEC_DISABLE_COMPAT 1
 #define VPX_DISABLE_CTRL_TYPECHECKS 1
@@ -19,12 +26,18 @@
 #include "libvpx/vpx/vpx_encoder.h"
 #include "libvpx/vpx/vp8cx.h"
 
+// libvpx added |VPX_IMG_FMT_NV12| in image ABI version 5. Older versions are
+// given I420 frames converted once by |VpxEncoder|.
+#if VPX_IMAGE_ABI_VERSION >= 5
+#define WEBMLIVE_VPX_HAS_NV12 1
+#endif
+
 namespace webmlive {
 class VideoFrame;
 struct WebmEncoderConfig;
 
-// Simple wrapper class for VP8 encoding using libvpx.
-class VpxEncoder {
+// Simple wrapper class for VPx encoding using libvpx.
+class VpxEncoder : public VideoEncoderBackend {
  public:
   enum {
     // libvpx reported an error.
@@ -38,27 +51,102 @@ class VpxEncoder {
     kDropped = VideoEncoder::kDropped,
   };
   VpxEncoder();
-  ~VpxEncoder();
+  virtual ~VpxEncoder();
+
+  // Returns the size of the compressed frame buffers |Init()| chooses for
+  // |config|: a keyframe at the target bitrate, rounded up to a size class.
+  static int32 InitialOutputBufferSize(const VpxConfig& config,
+                                       double frame_rate);
 
   // Initializes libvpx for VPx encoding and returns |kSuccess|. Returns
   // |kCodecError| if a libvpx operation fails.
-  int Init(const WebmEncoderConfig& config);
+  virtual int Init(const WebmEncoderConfig& config);
 
-  // Encodes |ptr_raw_frame| using libvpx and returns the compressed data via
-  // |ptr_vpx_frame|.
+  // Encodes |ptr_raw_frame| using libvpx and returns the oldest compressed
+  // frame not yet returned via |ptr_vpx_frame|. With a
+  // |VpxConfig::latency_budget| that frame was captured earlier, and one
+  // input can produce more than one frame; the others are kept for
+  // |ReadPendingFrame()|.
   // Return values:
   // |kSuccess| - frame encoded successfully.
-  // |kDropped| - decimation is enabled and the frame stored in
-  //              |ptr_raw_frame| was dropped.
+  // |kDropped| - no compressed frame is ready: libvpx holds the frame for
+  //              lookahead.
   // |kCodecError| - a libvpx operation failed.
   // |kEncoderError| - compressed data cannot be stored in |ptr_vpx_frame|.
-  int EncodeFrame(const VideoFrame& raw_frame, VideoFrame* ptr_vpx_frame);
+  virtual int EncodeFrame(const VideoFrame& raw_frame,
+                          VideoFrame* ptr_vpx_frame);
+
+  // Moves the oldest frame kept by |EncodeFrame()| or |Flush()| to
+  // |ptr_vpx_frame|. Returns |kDropped| when none is kept.
+  virtual int ReadPendingFrame(VideoFrame* ptr_vpx_frame);
+
+  // Has libvpx compress the frames it holds for lookahead, and keeps them
+  // for |ReadPendingFrame()|. Does nothing without lookahead.
+  virtual int Flush();
+  virtual int32 pending_frames() const {
+    return static_cast<int32>(output_frames_.size());
+  }
+
+  // Stores the input queue occupancy used by |AdaptSpeed()|.
+  virtual void SetInputBacklog(int32 queued_frames, int32 capacity);
+
+  virtual void ForceKeyframe() { force_keyframe_ = true; }
+
+  // Passes |bitrate| to libvpx as |rc_target_bitrate| with
+  // vpx_codec_enc_config_set. Returns |kCodecError| when libvpx rejects it.
+  virtual int SetBitrate(int bitrate);
+
+  // Passes |width| and |height| to libvpx as |g_w| and |g_h| with
+  // vpx_codec_enc_config_set. VP9 changes size in place; VP8 starts over
+  // with a keyframe. Restarts the load measurements of |load_state()|.
+  // Returns |kInvalidArg| when the size exceeds the one passed to |Init()|,
+  // and |kCodecError| when libvpx rejects it.
+  virtual int SetFrameSize(int32 width, int32 height);
+
+  // Passes |speed| to libvpx as VP8E_SET_CPUUSED. With adaptive speed the
+  // magnitude of |speed| becomes |min_speed_|, and |max_speed_| is raised to
+  // it when lower. Restarts the load measurements of |load_state()|. Returns
+  // |kCodecError| when libvpx rejects it.
+  virtual int SetSpeed(int speed);
+
+  // Stores |keyframe_interval| for the keyframe check of |EncodeFrame()|.
+  virtual int SetKeyframeInterval(int keyframe_interval);
+
+  // Regions of interest become segments of a VP8E_SET_ROI_MAP map: the
+  // frame outside them is segment 0, and each distinct |delta_q| has a
+  // segment of its own. VP9 ROI maps are not supported by the libvpx in the
+  // tree, and are rejected with |kInvalidArg|.
+  virtual int SetRegionsOfInterest(
+      const std::vector<RegionOfInterest>& regions);
+
+  // Returns |VideoEncoder::kLoadSaturated| after |AdaptSpeed()| has seen
+  // overload for |kSaturatedFrames| frames at |max_speed_|, and
+  // |VideoEncoder::kLoadIdle| after underload for |kIdleFrames| frames at
+  // |min_speed_|. Always |VideoEncoder::kLoadNormal| without adaptive speed.
+  virtual int load_state() const;
+
+  virtual const char* name() const { return "libvpx"; }
 
   // Accessors.
-  int64 frames_in() const { return frames_in_; }
-  int64 frames_out() const { return frames_out_; }
-  int64 last_keyframe_time() const { return last_keyframe_time_; }
-  int64 last_timestamp() const { return last_timestamp_; }
+  virtual int64 frames_in() const { return frames_in_; }
+  virtual int64 frames_out() const { return frames_out_; }
+  virtual int64 last_keyframe_time() const { return last_keyframe_time_; }
+  virtual int64 last_timestamp() const { return last_timestamp_; }
+
+  // Returns the current VP8E_SET_CPUUSED value.
+  virtual int speed() const { return speed_sign_ * speed_; }
+
+  // Profiles the compressed frames in |ptr_profiler|, which must outlive the
+  // encoder, from the next frame on; NULL stops profiling.
+  void set_frame_profiler(FrameTypeProfiler* ptr_profiler) {
+    ptr_frame_profiler_ = ptr_profiler;
+  }
+
+  // Chooses |thread_count|, |tile_columns| and |token_partitions| values left
+  // at |VpxConfig::kUseDefault| in |ptr_config| for a |width|x|height| frame
+  // and |cpu_cores| cores. VP9 row based multi-threading is enabled when the
+  // libvpx headers provide it.
+  static void PlanThreads(int width, int height, VpxConfig* ptr_config);
 
  private:
   // Utility function for passing values to libvpx's vpx_codec_control
@@ -68,23 +156,209 @@ class VpxEncoder {
   template <typename T> int32 CodecControl(int control_id, T val,
                                            T default_val);
 
+  // Does the work of |Init()|, taking the context from |VpxContextPool|
+  // when |use_pool| is true and the pool holds one for the settings.
+  int InitContext(const WebmEncoderConfig& user_config, bool use_pool);
+
+  // Returns the pool key of the context for the current settings.
+  VpxContextPool::Key PoolKey() const;
+
+  // Takes an idle context from |VpxContextPool| and reconfigures it with
+  // |libvpx_config_|. The next frame is forced to a keyframe. Returns false
+  // when the pool has none, or libvpx rejects the settings for it.
+  bool AcquirePooledContext();
+
+  // Removes the active and ROI maps from the context, so that the next
+  // encoder of a pooled context starts without them. Returns false when
+  // libvpx fails.
+  bool ClearMaps();
+
+  // Encodes |config_.warmup_frames| gray frames at the negative timestamps
+  // before the stream start, discards the output, and restores the rate
+  // control state by reapplying |libvpx_config_|. The next frame is forced
+  // to a keyframe. Returns |kCodecError| when libvpx fails.
+  int WarmUp(double frame_rate);
+
+  // Raw frame properties libvpx does not carry through to the compressed
+  // frame.
+  struct InputRecord {
+    int64 timestamp;
+    int64 capture_time;
+    VideoConfig config;
+    int temporal_layer;
+  };
+
+  // Reads the compressed frames libvpx has ready. The first is stored in
+  // |ptr_vpx_frame| when no older frame waits in |output_frames_|, and
+  // |*ptr_stored| is set; the others are appended to |output_frames_|.
+  // |ptr_vpx_frame| may be NULL to append all of them. Returns
+  // |kEncoderError| when a frame cannot be stored.
+  int ReadPackets(VideoFrame* ptr_vpx_frame, bool* ptr_stored);
+
+  // Passes the frames |ReadPackets()| read to |ptr_frame_profiler_|, which
+  // share |profile_pending_us_| equally. The last gets the quantizer libvpx
+  // reports. Does nothing when no frame was read, so the encode time of
+  // frames held in the lookahead goes to the frames read next.
+  void ProfilePackets();
+
+  // Adaptive speed control. Folds |encode_ms|, the wall time spent encoding a
+  // frame lasting |frame_duration| milliseconds, into |load_average_|. Raises
+  // |speed_| after |load_average_| or the input backlog has stayed high for a
+  // few frames, and lowers it after load has stayed low for much longer; the
+  // gap between the thresholds and the frame counts provides hysteresis.
+  // Returns |kCodecError| when libvpx rejects the new speed.
+  int AdaptSpeed(double encode_ms, int64 frame_duration);
+
+  // Sets the target bitrate of each temporal and spatial layer in
+  // |ptr_libvpx_config| from the total |bitrate|, in kilobits.
+  void SetLayerBitrates(int bitrate,
+                        vpx_codec_enc_cfg_t* ptr_libvpx_config) const;
+
+  // Returns the temporal layer of the next frame, and the libvpx flags that
+  // keep its references within that layer and the ones below; advances
+  // |layer_frame_index_|. |keyframe| restarts the pattern.
+  int NextTemporalLayer(bool keyframe, vpx_enc_frame_flags_t* ptr_flags);
+
+  // Runs static content detection on |frame|, whose luma plane is |planes|.
+  // Sets |*ptr_skip| when |frame|, encoded as the |width|x|height| image at
+  // |planes|, has no changed blocks and need not be encoded; otherwise
+  // passes the blocks to encode to libvpx as an active map. Every block of a
+  // |keyframe| is encoded. Returns |kEncoderError| when detection cannot be
+  // set up for the frame size.
+  int DetectStaticBlocks(const VideoFrame& frame, int32 width, int32 height,
+                         const VideoPlanes& planes, bool keyframe,
+                         bool* ptr_skip);
+
+  // Passes |regions_| to libvpx as the ROI map of |width|x|height| frames.
+  // Returns |kCodecError| when libvpx rejects the map, and |kNoMemory| or
+  // |kInvalidArg| when it cannot be built.
+  int ApplyRegionsOfInterest(int32 width, int32 height);
+
+  // Returns the compressed frame buffer size class for |length| bytes: the
+  // next power of two that is at least |output_buffer_size_|. Buffers only
+  // grow in whole size classes, so a keyframe spike reallocates a buffer once
+  // instead of every time a slightly larger frame arrives.
+  int32 OutputBufferSize(int32 length) const;
+
   // Number of raw frames passed to |EncodeFrame|.
   int64 frames_in_;
 
-  // Number of compressed frames returned from |EncodeFrame|.
+  // Number of compressed frames produced by libvpx.
   int64 frames_out_;
 
-  // Time of last keyframe reported by libvpx in |EncodeFrame|.
+  // Time of the last keyframe forced by |EncodeFrame|, or reported by libvpx
+  // when later. Forced keyframes count from their input, so that lookahead
+  // does not delay the keyframe checks.
   int64 last_keyframe_time_;
 
+  // vpx_codec_encode deadline: VPX_DL_REALTIME, or VPX_DL_GOOD_QUALITY when
+  // |VpxConfig::latency_budget| allows alternate reference frames.
+  unsigned long deadline_;  // NOLINT
+
+  // Inputs whose compressed frames libvpx has not returned, oldest first,
+  // and the properties of the last one returned, used for alternate
+  // reference frames, which have no input of their own.
+  std::deque<InputRecord> input_records_;
+  VideoConfig output_config_;
+
+  // Compressed frames produced beyond the one each |EncodeFrame()| call
+  // returns.
+  std::deque<VideoFrame> output_frames_;
+
   // Webmlive libvpx settings structure.
   VpxConfig config_;
 
-  // libvpx VPx configuration structure.
+  // libvpx VPx encoder context, and the configuration it was initialized
+  // with. The configuration is kept for |SetBitrate()|.
   vpx_codec_ctx_t vpx_context_;
+  vpx_codec_enc_cfg_t libvpx_config_;
 
   // Timestamp of most recent compressed frame.
   int64 last_timestamp_;
+
+  // Magnitude and sign of the current VP8E_SET_CPUUSED value. Negative values
+  // select VP8's own complexity adjustment, so the user's sign is kept.
+  int speed_;
+  int speed_sign_;
+
+  // Speed range used by |AdaptSpeed()|.
+  int min_speed_;
+  int max_speed_;
+
+  // Moving average of encode time divided by frame duration.
+  double load_average_;
+
+  // Input queue occupancy as a fraction of its capacity.
+  double backlog_;
+
+  // Consecutive frames encoded while overloaded or underloaded.
+  int overload_frames_;
+  int underload_frames_;
+
+  // Frame size passed to |Init()|, the largest |SetFrameSize()| accepts.
+  int32 max_width_;
+  int32 max_height_;
+
+  // Set by |ForceKeyframe()| and |SetFrameSize()| to force a keyframe at the
+  // next frame.
+  bool force_keyframe_;
+
+  // Position of the next frame in the temporal layer pattern.
+  int64 layer_frame_index_;
+
+  // Static content detection state: the detector, whether libvpx has an
+  // active map, and the timestamp of the last frame passed to libvpx.
+  StaticBlockDetector static_detector_;
+  bool active_map_enabled_;
+  int64 last_encoded_time_;
+
+  // Regions of interest, and the frame size of the map libvpx has for them;
+  // |roi_width_| is 0 when the map must be rebuilt.
+  std::vector<RegionOfInterest> regions_;
+  int32 roi_width_;
+  int32 roi_height_;
+  std::unique_ptr<uint8[]> roi_map_;
+
+  // Minimum compressed frame buffer size, estimated from the target bitrate
+  // and keyframe size limit.
+  int32 output_buffer_size_;
+
+  // Whether the context is returned to |VpxContextPool| on destruction, and
+  // whether it came from the pool. |pool_controls_| and |applied_controls_|
+  // are |ControlBit()| masks of the controls the context's last encoder and
+  // this one changed from the libvpx defaults.
+  bool poolable_;
+  bool context_from_pool_;
+  uint32 pool_controls_;
+  uint32 applied_controls_;
+
+  // Offset added to frame timestamps to keep the timeline of a pooled
+  // context increasing, whose value is taken from the first frame when
+  // |pts_offset_pending_|, and the timestamp after the last frame encoded,
+  // in the encoder timebase.
+  bool pts_offset_pending_;
+  int64 pts_offset_;
+  int64 next_pts_;
+
+  // Compressed frame read by |ReadPackets()| and not yet profiled.
+  struct ProfiledPacket {
+    int type;
+    int64 timestamp;
+    int64 bytes;
+  };
+
+  // Profile of the frames encoded, or NULL, the encode wall time not yet
+  // given to a frame in microseconds, and the frames of the last
+  // |ReadPackets()| call.
+  FrameTypeProfiler* ptr_frame_profiler_;
+  int64 profile_pending_us_;
+  std::vector<ProfiledPacket> profiled_packets_;
+
+#ifndef WEBMLIVE_VPX_HAS_NV12
+  // I420 copy of the current NV12 input frame. Unused when libvpx accepts NV12
+  // directly.
+  VideoFrame i420_frame_;
+#endif
   WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(VpxEncoder);
 };
 
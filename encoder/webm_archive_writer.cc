@@ -0,0 +1,567 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/webm_archive_writer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include "encoder/thread_util.h"
+#include "encoder/webm_mux.h"
+#include "glog/logging.h"
+#include "libwebm/mkvmuxer.hpp"
+#include "libwebm/webmids.hpp"
+
+namespace {
+
+const int32 kAutoAssignTrackNum = 0;
+
+// Moves the position of |file| to |position|. Returns true when successful.
+bool SeekFile(FILE* file, int64 position) {
+#ifdef _WIN32
+  return _fseeki64(file, position, SEEK_SET) == 0;
+#else
+  return fseeko(file, static_cast<off_t>(position), SEEK_SET) == 0;
+#endif
+}
+
+}  // namespace
+
+namespace webmlive {
+
+///////////////////////////////////////////////////////////////////////////////
+// ArchiveFileWriter
+//
+
+// Seekable IMkvWriter that gathers data written by libwebm in |block_|, and
+// hands batches of complete clusters to |WriterThread()|. Writes and seeks
+// land in |block_| until |Drain()|; after it, they go to the file directly,
+// so that |mkvmuxer::Segment::Finalize()| can update the headers.
+class ArchiveFileWriter : public mkvmuxer::IMkvWriter {
+ public:
+  ArchiveFileWriter();
+  virtual ~ArchiveFileWriter();
+
+  // Creates the file at |path| and starts |WriterThread()|.
+  int Open(const std::string& path);
+
+  // Queues |block_|, waits for |WriterThread()| to write all queued data,
+  // and switches to direct writes. Returns |kWriteFailed| when any write
+  // failed.
+  int Drain();
+
+  // Drains, stops |WriterThread()| and closes the file.
+  int Close();
+
+  // Returns true once a write has failed.
+  bool failed();
+
+  // Locks |mutex_| and copies current stats to |ptr_stats|.
+  void GetStats(WebmArchiveStats* ptr_stats);
+
+  // mkvmuxer::IMkvWriter methods
+  virtual int32 Write(const void* ptr_buffer, uint32 buffer_length);
+  virtual int64 Position() const { return position_; }
+  virtual int32 Position(int64 position);
+  virtual bool Seekable() const { return true; }
+
+  // Queues the data before a cluster that starts at the end of |block_|
+  // once |block_| holds at least |WebmArchiveWriter::kWriteSize| bytes. The
+  // clusters in it have ended, so libwebm has already written their sizes.
+  virtual void ElementStartNotify(uint64 element_id, int64 position);
+
+ private:
+  typedef std::vector<uint8> Block;
+  enum {
+    kSuccess = WebmArchiveWriter::kSuccess,
+    kWriteFailed = WebmArchiveWriter::kWriteFailed,
+  };
+
+  // Passes |block_| to |WriterThread()|, blocking while the queue is full,
+  // and starts a new block at the current end of data.
+  int QueueBlock();
+
+  // Writes |length| bytes from |ptr_data| to |file_| at |position_|.
+  int WriteDirect(const uint8* ptr_data, uint32 length);
+
+  // Writes queued blocks until |stop_| is set and the queue is empty.
+  void WriterThread();
+
+  FILE* file_;
+
+  // Data not yet queued, which begins at |block_start_| in the file, and the
+  // position of the next write.
+  Block block_;
+  int64 block_start_;
+  int64 position_;
+
+  // Set by |Drain()|: writes go to |file_| at |position_|. |file_position_|
+  // is the position of |file_| once |WriterThread()| is idle.
+  bool direct_;
+  int64 file_position_;
+
+  std::shared_ptr<std::thread> writer_thread_;
+
+  // Blocks waiting for |WriterThread()|, and written blocks kept for reuse.
+  // Protected by |mutex_|, as are the fields below.
+  std::deque<Block> queue_;
+  std::vector<Block> free_blocks_;
+
+  // True while |WriterThread()| writes a block it took from |queue_|.
+  bool writing_;
+  bool stop_;
+  bool write_failed_;
+  WebmArchiveStats stats_;
+
+  std::mutex mutex_;
+  std::condition_variable block_ready_;
+  std::condition_variable block_done_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(ArchiveFileWriter);
+};
+
+ArchiveFileWriter::ArchiveFileWriter()
+    : file_(NULL),
+      block_start_(0),
+      position_(0),
+      direct_(false),
+      file_position_(0),
+      writing_(false),
+      stop_(false),
+      write_failed_(false) {
+}
+
+ArchiveFileWriter::~ArchiveFileWriter() {
+  if (file_) {
+    Close();
+  }
+}
+
+int ArchiveFileWriter::Open(const std::string& path) {
+  file_ = fopen(path.c_str(), "wb");
+  if (!file_) {
+    LOG(ERROR) << "cannot create archive file " << path;
+    return WebmArchiveWriter::kOpenFailed;
+  }
+  block_.reserve(WebmArchiveWriter::kWriteSize);
+  using std::bind;
+  using std::nothrow;
+  using std::shared_ptr;
+  using std::thread;
+  writer_thread_ = shared_ptr<thread>(
+      new (nothrow) thread(bind(&ArchiveFileWriter::WriterThread,  // NOLINT
+                                this)));
+  if (!writer_thread_) {
+    LOG(ERROR) << "cannot construct archive writer thread.";
+    fclose(file_);
+    file_ = NULL;
+    return WebmArchiveWriter::kOpenFailed;
+  }
+  return kSuccess;
+}
+
+int ArchiveFileWriter::Drain() {
+  if (direct_) {
+    return failed() ? kWriteFailed : kSuccess;
+  }
+  if (!block_.empty() && QueueBlock()) {
+    return kWriteFailed;
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  block_done_.wait(lock, [this] { return queue_.empty() && !writing_; });
+  direct_ = true;
+  file_position_ = block_start_;
+  return write_failed_ ? kWriteFailed : kSuccess;
+}
+
+int ArchiveFileWriter::Close() {
+  const int status = Drain();
+  if (writer_thread_) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    block_ready_.notify_one();
+    writer_thread_->join();
+    writer_thread_.reset();
+  }
+  bool close_ok = true;
+  if (file_) {
+    close_ok = fclose(file_) == 0;
+    file_ = NULL;
+  }
+  if (!close_ok) {
+    LOG(ERROR) << "archive file close failed.";
+    return kWriteFailed;
+  }
+  return status;
+}
+
+bool ArchiveFileWriter::failed() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return write_failed_;
+}
+
+void ArchiveFileWriter::GetStats(WebmArchiveStats* ptr_stats) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  *ptr_stats = stats_;
+}
+
+int32 ArchiveFileWriter::Write(const void* ptr_buffer, uint32 buffer_length) {
+  if (!ptr_buffer || !buffer_length) {
+    LOG(ERROR) << "returning kInvalidArg to libwebm: NULL/0 length buffer.";
+    return WebmArchiveWriter::kInvalidArg;
+  }
+  const uint8* const ptr_data = reinterpret_cast<const uint8*>(ptr_buffer);
+  if (direct_) {
+    return WriteDirect(ptr_data, buffer_length);
+  }
+
+  // Overwrite what the write overlaps, and append the rest.
+  const size_t offset = static_cast<size_t>(position_ - block_start_);
+  if (offset > block_.size()) {
+    block_.resize(offset);
+  }
+  const size_t overlap =
+      std::min(block_.size() - offset, static_cast<size_t>(buffer_length));
+  if (overlap > 0) {
+    memcpy(&block_[offset], ptr_data, overlap);
+  }
+  block_.insert(block_.end(), ptr_data + overlap, ptr_data + buffer_length);
+  position_ += buffer_length;
+  return kSuccess;
+}
+
+int32 ArchiveFileWriter::Position(int64 position) {
+  if (position < 0) {
+    return WebmArchiveWriter::kInvalidArg;
+  }
+  if (!direct_ && position < block_start_) {
+    // Only |mkvmuxer::Segment::Finalize()| seeks to queued data, and it is
+    // preceded by |Drain()|; drain now in case libwebm ever does otherwise.
+    LOG(WARNING) << "archive seek to written data, writing directly.";
+    if (Drain()) {
+      return kWriteFailed;
+    }
+  }
+  position_ = position;
+  return kSuccess;
+}
+
+void ArchiveFileWriter::ElementStartNotify(uint64 element_id,
+                                           int64 position) {
+  if (!direct_ && element_id == mkvmuxer::kMkvCluster &&
+      position == block_start_ + static_cast<int64>(block_.size()) &&
+      block_.size() >= static_cast<size_t>(WebmArchiveWriter::kWriteSize)) {
+    // A failure is reported by the next frame write.
+    QueueBlock();
+  }
+}
+
+int ArchiveFileWriter::QueueBlock() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (static_cast<int>(queue_.size()) >= WebmArchiveWriter::kMaxQueuedWrites) {
+    ++stats_.queue_full_waits;
+    LOG(WARNING) << "archive write queue full, waiting.";
+    block_done_.wait(lock, [this] {
+      return write_failed_ ||
+          static_cast<int>(queue_.size()) < WebmArchiveWriter::kMaxQueuedWrites;
+    });
+  }
+  if (write_failed_) {
+    return kWriteFailed;
+  }
+  Block next;
+  if (!free_blocks_.empty()) {
+    next.swap(free_blocks_.back());
+    free_blocks_.pop_back();
+  }
+  block_start_ += block_.size();
+  queue_.push_back(Block());
+  queue_.back().swap(block_);
+  block_.swap(next);
+  block_.clear();
+  lock.unlock();
+  block_ready_.notify_one();
+  return kSuccess;
+}
+
+int ArchiveFileWriter::WriteDirect(const uint8* ptr_data, uint32 length) {
+  if (failed()) {
+    return kWriteFailed;
+  }
+  bool write_ok = true;
+  if (position_ != file_position_) {
+    write_ok = SeekFile(file_, position_);
+  }
+  write_ok = write_ok && fwrite(ptr_data, 1, length, file_) == length;
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!write_ok) {
+    LOG(ERROR) << "archive file write failed at " << position_;
+    write_failed_ = true;
+    return kWriteFailed;
+  }
+  position_ += length;
+  file_position_ = position_;
+  stats_.bytes_written += length;
+  return kSuccess;
+}
+
+void ArchiveFileWriter::WriterThread() {
+  ScopedThreadRegistration registration("archive_writer");
+  LOG(INFO) << "archive WriterThread started.";
+  for (;;) {
+    Block block;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      block_ready_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+      if (queue_.empty()) {
+        break;
+      }
+      block.swap(queue_.front());
+      queue_.pop_front();
+      writing_ = true;
+    }
+
+    typedef std::chrono::steady_clock Clock;
+    const Clock::time_point start = Clock::now();
+    const bool write_ok =
+        fwrite(&block[0], 1, block.size(), file_) == block.size();
+    const int64 write_ms = std::chrono::duration_cast<
+        std::chrono::milliseconds>(Clock::now() - start).count();
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      writing_ = false;
+      stats_.max_write_ms = std::max(stats_.max_write_ms, write_ms);
+      if (write_ok) {
+        ++stats_.writes;
+        stats_.bytes_written += block.size();
+      } else if (!write_failed_) {
+        LOG(ERROR) << "archive file write failed.";
+        write_failed_ = true;
+      }
+      if (static_cast<int>(free_blocks_.size()) <
+          WebmArchiveWriter::kMaxQueuedWrites) {
+        block.clear();
+        free_blocks_.push_back(Block());
+        free_blocks_.back().swap(block);
+      }
+    }
+    block_done_.notify_all();
+    VLOG(1) << "archive WriterThread wrote " << block.size() << " bytes in "
+            << write_ms << "ms";
+  }
+  LOG(INFO) << "archive WriterThread finished.";
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// WebmArchiveWriter
+//
+
+WebmArchiveWriter::WebmArchiveWriter()
+    : audio_track_num_(0),
+      video_track_num_(0) {
+}
+
+WebmArchiveWriter::~WebmArchiveWriter() {
+  Close();
+}
+
+int WebmArchiveWriter::Init(const std::string& path) {
+  if (path.empty()) {
+    LOG(ERROR) << "empty archive path.";
+    return kInvalidArg;
+  }
+  path_ = path;
+  ptr_writer_.reset(new (std::nothrow) ArchiveFileWriter());  // NOLINT
+  if (!ptr_writer_) {
+    LOG(ERROR) << "cannot construct ArchiveFileWriter.";
+    return kOpenFailed;
+  }
+  int status = ptr_writer_->Open(path);
+  if (status) {
+    ptr_writer_.reset();
+    return status;
+  }
+
+  ptr_segment_.reset(new (std::nothrow) mkvmuxer::Segment());  // NOLINT
+  if (!ptr_segment_ || !ptr_segment_->Init(ptr_writer_.get())) {
+    LOG(ERROR) << "cannot construct or Init archive Segment.";
+    ptr_segment_.reset();
+    ptr_writer_->Close();
+    ptr_writer_.reset();
+    return kMuxerError;
+  }
+
+  // File mode: libwebm writes element sizes, Cues and the duration.
+  ptr_segment_->set_mode(mkvmuxer::Segment::kFile);
+  ptr_segment_->OutputCues(true);
+  mkvmuxer::SegmentInfo* const ptr_segment_info =
+      ptr_segment_->GetSegmentInfo();
+  ptr_segment_info->set_timecode_scale(LiveWebmMuxer::kTimecodeScale);
+  std::string app_name = kEncoderName;
+  app_name += " v";
+  app_name += kEncoderVersion;
+  ptr_segment_info->set_writing_app(app_name.c_str());
+  return kSuccess;
+}
+
+int WebmArchiveWriter::AddTrack(const VideoConfig& video_config) {
+  if (!ptr_segment_ || video_track_num_ != 0) {
+    LOG(ERROR) << "cannot add archive video track.";
+    return kInvalidArg;
+  }
+  video_track_num_ = ptr_segment_->AddVideoTrack(video_config.width,
+                                                 video_config.height,
+                                                 kAutoAssignTrackNum);
+  mkvmuxer::VideoTrack* const ptr_video_track =
+      static_cast<mkvmuxer::VideoTrack*>(
+          ptr_segment_->GetTrackByNumber(video_track_num_));
+  if (!video_track_num_ || !ptr_video_track) {
+    LOG(ERROR) << "cannot AddVideoTrack on archive segment.";
+    return kMuxerError;
+  }
+  if (video_config.format != kVideoFormatVP8) {
+    ptr_video_track->set_codec_id(mkvmuxer::Tracks::kVp9CodecId);
+  }
+  if (video_config.crop_width > 0 && video_config.crop_height > 0) {
+    // As in the live stream, players show only the visible region.
+    ptr_video_track->set_crop_left(video_config.crop_left);
+    ptr_video_track->set_crop_top(video_config.crop_top);
+    ptr_video_track->set_crop_right(
+        video_config.width - video_config.crop_left - video_config.crop_width);
+    ptr_video_track->set_crop_bottom(abs(video_config.height) -
+                                     video_config.crop_top -
+                                     video_config.crop_height);
+    ptr_video_track->set_display_width(video_config.crop_width);
+    ptr_video_track->set_display_height(video_config.crop_height);
+  }
+  if (!ptr_segment_->CuesTrack(video_track_num_)) {
+    LOG(ERROR) << "cannot index archive video track.";
+    return kMuxerError;
+  }
+  return kSuccess;
+}
+
+int WebmArchiveWriter::AddTrack(const AudioConfig& audio_config,
+                                const AudioCodecPrivate& codec_private) {
+  if (!ptr_segment_ || audio_track_num_ != 0 || codec_private.data.empty()) {
+    LOG(ERROR) << "cannot add archive audio track.";
+    return kInvalidArg;
+  }
+  audio_track_num_ = ptr_segment_->AddAudioTrack(audio_config.sample_rate,
+                                                 audio_config.channels,
+                                                 kAutoAssignTrackNum);
+  mkvmuxer::AudioTrack* const ptr_audio_track =
+      static_cast<mkvmuxer::AudioTrack*>(
+          ptr_segment_->GetTrackByNumber(audio_track_num_));
+  if (!audio_track_num_ || !ptr_audio_track) {
+    LOG(ERROR) << "cannot AddAudioTrack on archive segment.";
+    return kMuxerError;
+  }
+  if (codec_private.format == kAudioFormatOpus) {
+    ptr_audio_track->set_codec_id(mkvmuxer::Tracks::kOpusCodecId);
+    ptr_audio_track->set_codec_delay(codec_private.codec_delay);
+    ptr_audio_track->set_seek_pre_roll(codec_private.seek_pre_roll);
+  }
+  if (!ptr_audio_track->SetCodecPrivate(
+          &codec_private.data[0],
+          static_cast<uint64>(codec_private.data.size()))) {
+    LOG(ERROR) << "cannot set archive audio codec private data.";
+    return kMuxerError;
+  }
+
+  // Audio only archives index the audio track.
+  if (video_track_num_ == 0 && !ptr_segment_->CuesTrack(audio_track_num_)) {
+    LOG(ERROR) << "cannot index archive audio track.";
+    return kMuxerError;
+  }
+  return kSuccess;
+}
+
+int WebmArchiveWriter::WriteVideoFrame(const VideoFrame& vpx_frame) {
+  if (video_track_num_ == 0 || !vpx_frame.buffer()) {
+    return kInvalidArg;
+  }
+  if (ptr_writer_->failed()) {
+    return kWriteFailed;
+  }
+  if (!ptr_segment_->AddFrame(
+          vpx_frame.buffer(), vpx_frame.buffer_length(), video_track_num_,
+          vpx_frame.timestamp() * LiveWebmMuxer::kTimecodeScale,
+          vpx_frame.keyframe())) {
+    LOG(ERROR) << "archive AddFrame (video) failed.";
+    return ptr_writer_->failed() ? kWriteFailed : kMuxerError;
+  }
+  return kSuccess;
+}
+
+int WebmArchiveWriter::WriteAudioBuffer(const AudioBuffer& audio_buffer) {
+  if (audio_track_num_ == 0 || !audio_buffer.buffer()) {
+    return kInvalidArg;
+  }
+  if (ptr_writer_->failed()) {
+    return kWriteFailed;
+  }
+  if (!ptr_segment_->AddFrame(
+          audio_buffer.buffer(), audio_buffer.buffer_length(),
+          audio_track_num_,
+          audio_buffer.timestamp() * LiveWebmMuxer::kTimecodeScale, true)) {
+    LOG(ERROR) << "archive AddFrame (audio) failed.";
+    return ptr_writer_->failed() ? kWriteFailed : kMuxerError;
+  }
+  return kSuccess;
+}
+
+// Drains the writer before finalizing, so that libwebm's header updates are
+// written in place rather than gathered for the writer thread.
+int WebmArchiveWriter::Close() {
+  if (!ptr_writer_) {
+    return kSuccess;
+  }
+  int status = ptr_writer_->Drain();
+  if (status == kSuccess && ptr_segment_ && !ptr_segment_->Finalize()) {
+    LOG(ERROR) << "archive Segment Finalize failed.";
+    status = kMuxerError;
+  }
+  const int close_status = ptr_writer_->Close();
+  if (status == kSuccess) {
+    status = close_status;
+  }
+  WebmArchiveStats stats;
+  ptr_writer_->GetStats(&stats);
+  LOG(INFO) << "archive " << path_ << " closed: status=" << status
+            << " bytes_written=" << stats.bytes_written
+            << " writes=" << stats.writes
+            << " max_write_ms=" << stats.max_write_ms
+            << " queue_full_waits=" << stats.queue_full_waits;
+  ptr_segment_.reset();
+  ptr_writer_.reset();
+  return status;
+}
+
+void WebmArchiveWriter::GetStats(WebmArchiveStats* ptr_stats) const {
+  if (!ptr_stats) {
+    return;
+  }
+  if (ptr_writer_) {
+    ptr_writer_->GetStats(ptr_stats);
+  } else {
+    *ptr_stats = WebmArchiveStats();
+  }
+}
+
+}  // namespace webmlive
@@ -0,0 +1,127 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_WEBM_ARCHIVE_WRITER_H_
+#define WEBMLIVE_ENCODER_WEBM_ARCHIVE_WRITER_H_
+
+#include <memory>
+#include <string>
+
+#include "encoder/audio_encoder.h"
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+#include "encoder/video_encoder.h"
+
+// Forward declarations of libwebm muxer types used by |WebmArchiveWriter|.
+namespace mkvmuxer {
+class Segment;
+}
+
+namespace webmlive {
+
+// Forward declaration of the seekable IMkvWriter that buffers archive data.
+class ArchiveFileWriter;
+
+struct WebmArchiveStats {
+  WebmArchiveStats()
+      : bytes_written(0), writes(0), max_write_ms(0), queue_full_waits(0) {}
+
+  // Bytes written to the archive file, and the writes that wrote them.
+  int64 bytes_written;
+  int64 writes;
+
+  // Longest duration of a single write, in milliseconds.
+  int64 max_write_ms;
+
+  // Number of times a frame write waited for the writer thread.
+  int64 queue_full_waits;
+};
+
+// Records the encoded streams to a seekable WebM file, for playback and
+// seeking once the live stream has ended. Unlike |LiveWebmMuxer| output, the
+// file has element sizes, Cues indexing each cluster, and a duration, all
+// written by |Close()|.
+//
+// Notes:
+// - Muxed data is gathered in memory until at least |kWriteSize| bytes of
+//   complete clusters are buffered, and each batch is written by a writer
+//   thread with one large sequential write. libwebm sets each cluster's size
+//   when the cluster ends; the open cluster is always in memory, so the file
+//   is only written sequentially until |Close()|.
+// - At most |kMaxQueuedWrites| batches wait for the writer thread; frame
+//   writes block while the queue is full, which keeps memory use bounded
+//   when the disk cannot keep up.
+// - The methods must be called from one thread. Frames must be written in
+//   timestamp order across tracks, as for |LiveWebmMuxer|.
+class WebmArchiveWriter {
+ public:
+  enum {
+    // libwebm rejected a track or frame, or could not finalize the file.
+    kMuxerError = -804,
+
+    // A write to the archive file failed. The archive is incomplete.
+    kWriteFailed = -803,
+
+    // Invalid argument supplied to method call.
+    kInvalidArg = -802,
+
+    // The archive file cannot be created.
+    kOpenFailed = -801,
+
+    // Success.
+    kSuccess = 0,
+  };
+
+  // Bytes of complete clusters gathered before they are written.
+  static const int32 kWriteSize = 4 * 1024 * 1024;
+
+  // Batches waiting for the writer thread before frame writes block.
+  static const int kMaxQueuedWrites = 4;
+
+  WebmArchiveWriter();
+
+  // Closes the archive when |Close()| has not been called.
+  ~WebmArchiveWriter();
+
+  // Creates the archive file at |path|, replacing any file there, and starts
+  // the writer thread. Returns |kSuccess| when successful.
+  int Init(const std::string& path);
+
+  // Adds the video track. Cues index the video track when there is one.
+  int AddTrack(const VideoConfig& video_config);
+
+  // Adds the audio track, described as for |LiveWebmMuxer::AddTrack()|.
+  int AddTrack(const AudioConfig& audio_config,
+               const AudioCodecPrivate& codec_private);
+
+  // Adds a compressed frame or audio buffer to the archive. Returns
+  // |kSuccess|, |kMuxerError|, or |kWriteFailed| once any write has failed.
+  int WriteVideoFrame(const VideoFrame& vpx_frame);
+  int WriteAudioBuffer(const AudioBuffer& audio_buffer);
+
+  // Writes the buffered data, then has libwebm write the Cues, duration and
+  // element sizes, and closes the file. Does nothing when the archive is not
+  // open. Returns |kSuccess| when the archive is complete.
+  int Close();
+
+  // Copies current stats to |ptr_stats|.
+  void GetStats(WebmArchiveStats* ptr_stats) const;
+
+  const std::string& path() const { return path_; }
+
+ private:
+  std::string path_;
+  std::unique_ptr<ArchiveFileWriter> ptr_writer_;
+  std::unique_ptr<mkvmuxer::Segment> ptr_segment_;
+  uint64 audio_track_num_;
+  uint64 video_track_num_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(WebmArchiveWriter);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_WEBM_ARCHIVE_WRITER_H_
@@ -7,99 +7,93 @@
 // be found in the AUTHORS file in the root of the source tree.
 #include "encoder/webm_buffer_parser.h"
 
-#include <cassert>
+#include <algorithm>
+#include <ios>
 
 #include "glog/logging.h"
-#include "libwebm/mkvparser.hpp"
+#include "libwebm/webmids.hpp"
 
 namespace webmlive {
-// Provides a moving window into a buffer, and implements libwebm's IMkvReader
-// interface.  |WebmBufferParser| sets the window into a buffer by calling
-// |SetBufferWindow|, and libwebm parses the data using the |Read| and |Length|
-// methods.
-class WebmBufferReader : public mkvparser::IMkvReader {
- public:
-  enum {
-    kInvalidArg   = WebmBufferParser::kInvalidArg,
-    kSuccess      = WebmBufferParser::kSuccess,
-    kNeedMoreData = WebmBufferParser::kNeedMoreData,
-  };
-  WebmBufferReader();
-  virtual ~WebmBufferReader();
-  // Updates the buffer window and returns |kSuccess|.
-  int SetBufferWindow(const uint8* ptr_buffer, int32 length,
-                      int64 bytes_consumed);
-  // IMkvReader methods.
-  virtual int Read(int64 read_pos, long length_requested,  // NOLINT
-                   uint8* ptr_buf);
-  virtual int Length(int64* ptr_total, int64* ptr_available);
- private:
-  // Buffer window pointer.
-  const uint8* ptr_buffer_;
-  // Length of the buffer window to which |ptr_buffer_| provides access.
-  int32 length_;
-  // Sum of all parsed element lengths.
-  int64 bytes_consumed_;
-  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(WebmBufferReader);
-};
 
-WebmBufferReader::WebmBufferReader()
-    : ptr_buffer_(NULL),
-      length_(0),
-      bytes_consumed_(0) {
-}
+// Maximum lengths of EBML element IDs and sizes allowed by WebM.
+const int32 kMaxIdLength = 4;
+const int32 kMaxSizeLength = 8;
+
+// Top level elements, the children of the segment, all have 4 byte IDs; no
+// descendant of a cluster does.
+const uint64 kMinTopLevelId = 0x10000000;
+
+///////////////////////////////////////////////////////////////////////////////
+// EbmlScanner
+//
 
-WebmBufferReader::~WebmBufferReader() {
+EbmlScanner::EbmlScanner()
+    : reading_size_(false),
+      value_(0),
+      bytes_left_(0),
+      size_all_ones_(false),
+      bytes_read_(0),
+      id_(0),
+      size_(0),
+      header_length_(0) {
 }
 
-// Updates the buffer window.
-int WebmBufferReader::SetBufferWindow(const uint8* ptr_buffer, int32 length,
-                                      int64 bytes_consumed) {
-  if (!ptr_buffer || !length) {
-    LOG(ERROR) << "invalid arg(s)";
-    return kInvalidArg;
-  }
-  ptr_buffer_ = ptr_buffer;
-  length_ = length;
-  bytes_consumed_ = bytes_consumed;
-  return kSuccess;
+EbmlScanner::~EbmlScanner() {
 }
 
-// Called by libwebm to read data from |ptr_buffer_|.
-int WebmBufferReader::Read(int64 read_pos, long length_requested,  // NOLINT
-                           uint8* ptr_buf) {
-  if (!ptr_buf) {
-    LOG(ERROR) << "NULL ptr_buf";
-    return 0;
-  }
-  // |read_pos| includes |bytes_consumed_|, which is not going to work with the
-  // buffer window-- calculate actual offset within |ptr_buf|.
-  const int64 window_pos = read_pos - bytes_consumed_;
-  assert(window_pos >= 0);
-  // Is enough data in the buffer?
-  const int64 bytes_available = length_ - window_pos;
-  if (bytes_available < length_requested) {
-    // No, not enough data buffered.
-    return mkvparser::E_BUFFER_NOT_FULL;
-  }
-  VLOG(4) << "read_pos=" << read_pos << " window_pos=" << window_pos
-          << " length_=" << length_ << " length_requested=" << length_requested
-          << " available=" << bytes_available;
-  // Yes, there's enough data in the buffer.
-  memcpy(ptr_buf, ptr_buffer_ + window_pos, length_requested);
-  return kSuccess;
+int EbmlScanner::ReadHeader(const uint8* ptr_data, int32 length,
+                            int32* ptr_bytes_used) {
+  int32 pos = 0;
+  while (pos < length) {
+    const uint8 byte = ptr_data[pos++];
+    ++bytes_read_;
+    if (bytes_left_ == 0) {
+      // First byte of the ID or size: its marker bit gives the length. The
+      // marker is part of an ID, and is masked off a size.
+      const int32 vint_length = VintLength(byte);
+      if (vint_length == 0 ||
+          vint_length > (reading_size_ ? kMaxSizeLength : kMaxIdLength)) {
+        *ptr_bytes_used = pos;
+        return kInvalidElement;
+      }
+      bytes_left_ = vint_length - 1;
+      if (reading_size_) {
+        const uint8 mask = static_cast<uint8>(0xFF >> vint_length);
+        value_ = byte & mask;
+        size_all_ones_ = (value_ == mask);
+      } else {
+        value_ = byte;
+      }
+    } else {
+      value_ = (value_ << 8) | byte;
+      --bytes_left_;
+      size_all_ones_ = size_all_ones_ && (byte == 0xFF);
+    }
+    if (bytes_left_ > 0) {
+      continue;
+    }
+    if (!reading_size_) {
+      id_ = value_;
+      reading_size_ = true;
+      continue;
+    }
+    size_ = size_all_ones_ ? kUnknownSize : static_cast<int64>(value_);
+    header_length_ = bytes_read_;
+    reading_size_ = false;
+    bytes_read_ = 0;
+    *ptr_bytes_used = pos;
+    return kSuccess;
+  }
+  *ptr_bytes_used = pos;
+  return kNeedMoreData;
 }
 
-// Called by libwebm to obtain length of readable data.  Returns
-// |bytes_consumed_| + |length_| as available amount, which is the size of the
-// buffer current window plus the sum of the sizes of all parsed elements.
-int WebmBufferReader::Length(int64* ptr_total, int64* ptr_available) {
-  if (!ptr_total || !ptr_available) {
-    LOG(ERROR) << "invalid arg(s)";
-    return -1;
+int32 EbmlScanner::VintLength(uint8 byte) {
+  for (int32 length = 1; length <= kMaxSizeLength; ++length) {
+    if (byte & (0x80 >> (length - 1))) {
+      return length;
+    }
   }
-  *ptr_total = -1;  // Total file size is unknown.
-  *ptr_available = bytes_consumed_ + length_;
   return 0;
 }
 
@@ -108,157 +102,136 @@ int WebmBufferReader::Length(int64* ptr_total, int64* ptr_available) {
 //
 
 WebmBufferParser::WebmBufferParser()
-    : ptr_cluster_(NULL),
-      cluster_parse_offset_(0),
-      total_bytes_parsed_(0),
-      parse_func_(&WebmBufferParser::ParseSegmentHeaders) {
+    : scan_pos_(0),
+      skip_left_(0),
+      cluster_end_(-1),
+      in_cluster_(false),
+      headers_done_(false),
+      total_bytes_parsed_(0) {
 }
 
 WebmBufferParser::~WebmBufferParser() {
 }
 
-// Constructs |reader_|.
 int WebmBufferParser::Init() {
-  reader_.reset(new (std::nothrow) WebmBufferReader());  // NOLINT
-  if (!reader_) {
-    LOG(ERROR) << "out of memory";
-    return kOutOfMemory;
-  }
+  scan_pos_ = 0;
+  skip_left_ = 0;
+  cluster_end_ = -1;
+  in_cluster_ = false;
+  headers_done_ = false;
+  total_bytes_parsed_ = 0;
   return kSuccess;
 }
 
-// Tries to parse data in |buf|.  Sets |ptr_element_size| to the size of the
-// parsed element when parsing of the segment headers or a cluster is
-// successful.
+// Resumes scanning where the previous call stopped, and stops at the first
+// chunk boundary.
 int WebmBufferParser::Parse(const Buffer& buf, int32* ptr_element_size) {
-  if (!ptr_element_size) {
-    LOG(ERROR) << "NULL element size pointer!";
-    return kInvalidArg;
-  }
-  if (buf.empty()) {
-    return kNeedMoreData;
-  }
-  // Update |reader_|'s buffer window...
-  if (reader_->SetBufferWindow(&buf[0], buf.size(), total_bytes_parsed_)) {
-    LOG(ERROR) << "could not update buffer window";
-    return kParseError;
-  }
-  // Just return the result of the parsing attempt.
-  return (this->*parse_func_)(ptr_element_size);
+  return Parse(buf.empty() ? NULL : &buf[0], static_cast<int32>(buf.size()),
+               ptr_element_size);
 }
 
-// Tries to parse the segment headers, segment info and segment tracks.
-// Returns |kNeedMoreData| if unable to parse them.  Returns |kSuccess| and
-// sets |ptr_element_size| when successful.
-int WebmBufferParser::ParseSegmentHeaders(int32* ptr_element_size) {
-  mkvparser::EBMLHeader ebml_header;
-  int64 pos = 0;
-  int64 parse_status = ebml_header.Parse(reader_.get(), pos);
-  if (parse_status) {
-    LOG(INFO) << "EBML header parse failed, parse_status=" << parse_status;
-    return kNeedMoreData;
-  }
-  // |pos| is equal to the length of the EBML header; start a running total now
-  // since |ebml_header| doesn't store a length.
-  int64 headers_length = pos;
-  // Create and start parse of the segment...
-  mkvparser::Segment* ptr_segment = NULL;
-  parse_status = mkvparser::Segment::CreateInstance(reader_.get(), pos,
-                                                    ptr_segment);
-  if (parse_status) {
-    LOG(INFO) << "segment creation failed, parse_status=" << parse_status;
-    return kNeedMoreData;
-  }
-  segment_.reset(ptr_segment);
-  // Add the segment header length to the running total. The position argument
-  // to the |CreateInstance| call above is not passed by reference (as is the
-  // case with |ebml_header|), so |pos| is still correct.
-  headers_length += segment_->m_start - pos;
-  // |ParseHeaders| reads data until it runs out or finds a cluster. If it
-  // finds a cluster, it returns 0 ONLY if segment info and segment tracks
-  // elements were found as well.
-  parse_status = segment_->ParseHeaders();
-  if (parse_status) {
-    LOG(INFO) << "segment header parse failed, parse_status=" << parse_status;
-    return kNeedMoreData;
-  }
-  // Get the segment info to obtain its length.
-  const mkvparser::SegmentInfo* ptr_segment_info = segment_->GetInfo();
-  if (!ptr_segment_info) {
-    LOG(ERROR) << "missing MKV segment info";
-    return kParseError;
-  }
-  if (headers_length != ptr_segment_info->m_element_start) {
-    LOG(ERROR) << "ERROR: unexpected segment info offset (expected="
-               << headers_length << " actual="
-               << ptr_segment_info->m_element_start << ")";
-    return kParseError;
+int WebmBufferParser::Parse(const uint8* ptr_data, int32 length,
+                            int32* ptr_element_size) {
+  if (!ptr_element_size || (!ptr_data && length > 0)) {
+    LOG(ERROR) << "invalid arg(s).";
+    return kInvalidArg;
   }
-  VLOG(4) << "segment info size=" << ptr_segment_info->m_element_size;
-  headers_length += ptr_segment_info->m_element_size;
-  // Get the segment tracks to obtain its length.
-  const mkvparser::Tracks* ptr_tracks = segment_->GetTracks();
-  if (!ptr_tracks) {
-    LOG(ERROR) << "missing MKV segment tracks";
+  const int64 buf_length = length;
+  int64 pos = scan_pos_ - total_bytes_parsed_;
+  if (pos > buf_length) {
+    LOG(ERROR) << "buffer shorter than scanned data.";
     return kParseError;
   }
-  VLOG(4) << "segment tracks size=" << ptr_tracks->m_element_size;
-  headers_length += ptr_tracks->m_element_size;
-  VLOG(4) << "element_size=" << headers_length;
-  total_bytes_parsed_ = headers_length;
-  *ptr_element_size = static_cast<int32>(headers_length);
-  parse_func_ = &WebmBufferParser::ParseCluster;
-  return kSuccess;
-}
-
-// Tries to parse a cluster.  Loads and parses the cluster header, and then
-// attempts to walk through the cluster block entries.  Returns |kNeedMoreData|
-// when unable to walk through all blocks in the cluster.  Returns |kSuccess|
-// and sets |ptr_element_size| when successful.
-int WebmBufferParser::ParseCluster(int32* ptr_element_size) {
-  // A NULL |ptr_cluster_| means either:
-  // - No clusters have been parsed, or...
-  // - The last cluster was parsed.
-  // In either case it's time to load a new one...
-  int status;
-  long length = 0;  // NOLINT
-  if (!ptr_cluster_) {
-    // Load/parse a cluster header...
-    int64 current_pos = total_bytes_parsed_;
-    status = segment_->LoadCluster(current_pos, length);
-    if (status) {
-      return kNeedMoreData;
+  for (;;) {
+    if (skip_left_ == 0 && cluster_end_ >= 0 && scan_pos_ == cluster_end_) {
+      cluster_end_ = -1;
+      *ptr_element_size = EndChunk(scan_pos_);
+      return kSuccess;
     }
-    const mkvparser::Cluster* ptr_cluster = segment_->GetLast();
-    if (!ptr_cluster || ptr_cluster->EOS()) {
+    if (pos >= buf_length) {
       return kNeedMoreData;
     }
-    cluster_parse_offset_ = current_pos;
-    ptr_cluster_ = ptr_cluster;
-  }
-  const int kClusterComplete = 1;
-  for (;;) {
-    status = ptr_cluster_->Parse(cluster_parse_offset_, length);
-    if (status == kClusterComplete) {
-      break;
+    if (skip_left_ > 0) {
+      const int64 skip = std::min(skip_left_, buf_length - pos);
+      pos += skip;
+      scan_pos_ += skip;
+      skip_left_ -= skip;
+      continue;
     }
-    if (status < 0) {
+    int32 bytes_used = 0;
+    const int status = scanner_.ReadHeader(
+        ptr_data + pos,
+        static_cast<int32>(buf_length - pos),
+        &bytes_used);
+    pos += bytes_used;
+    scan_pos_ += bytes_used;
+    if (status == EbmlScanner::kNeedMoreData) {
       return kNeedMoreData;
     }
+    if (status != EbmlScanner::kSuccess) {
+      LOG(ERROR) << "invalid EBML element header at " << scan_pos_;
+      return kParseError;
+    }
+    int parse_status = kSuccess;
+    if (OnElement(scan_pos_ - scanner_.header_length(), ptr_element_size,
+                  &parse_status)) {
+      return kSuccess;
+    }
+    if (parse_status != kSuccess) {
+      return parse_status;
+    }
   }
-  const int64 cluster_size = ptr_cluster_->GetElementSize();
-  if (cluster_size == -1) {
-    // Should never happen... the parser should never report a complete cluster
-    // without setting its length.
-    return kParseError;
-  }
-  ptr_cluster_ = NULL;
-  cluster_parse_offset_ = 0;
-  total_bytes_parsed_ += cluster_size;
-  *ptr_element_size = static_cast<int32>(cluster_size);
-  VLOG(4) << "cluster_size=" << cluster_size << " total_bytes_parsed_="
+}
+
+int32 WebmBufferParser::EndChunk(int64 chunk_end) {
+  const int32 chunk_length =
+      static_cast<int32>(chunk_end - total_bytes_parsed_);
+  total_bytes_parsed_ = chunk_end;
+  VLOG(4) << "chunk_length=" << chunk_length << " total_bytes_parsed_="
           << total_bytes_parsed_;
-  return kSuccess;
+  return chunk_length;
+}
+
+bool WebmBufferParser::OnElement(int64 element_start,
+                                 int32* ptr_chunk_length, int* ptr_status) {
+  const uint64 id = scanner_.id();
+  const int64 size = scanner_.size();
+
+  // The segment is entered, not skipped: its children are the top level
+  // elements.
+  if (id == mkvmuxer::kMkvSegment) {
+    return false;
+  }
+
+  // A cluster, or any top level element, ends an unknown size cluster. The
+  // first cluster ends the headers chunk.
+  const bool top_level = (id >= kMinTopLevelId);
+  bool chunk_ended = false;
+  if ((top_level && in_cluster_) ||
+      (id == mkvmuxer::kMkvCluster && !headers_done_)) {
+    chunk_ended = element_start > total_bytes_parsed_;
+    in_cluster_ = false;
+  }
+  if (id == mkvmuxer::kMkvCluster) {
+    headers_done_ = true;
+    if (size == EbmlScanner::kUnknownSize) {
+      // Scan the children of the cluster for the element that ends it.
+      in_cluster_ = true;
+    } else {
+      skip_left_ = size;
+      cluster_end_ = scan_pos_ + size;
+    }
+  } else if (size == EbmlScanner::kUnknownSize) {
+    LOG(ERROR) << "unknown size element, id=0x" << std::hex << id;
+    *ptr_status = kParseError;
+    return false;
+  } else {
+    skip_left_ = size;
+  }
+  if (chunk_ended) {
+    *ptr_chunk_length = EndChunk(element_start);
+  }
+  return chunk_ended;
 }
 
 }  // namespace webmlive
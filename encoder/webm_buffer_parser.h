@@ -8,23 +8,71 @@
 #ifndef WEBMLIVE_ENCODER_WEBM_BUFFER_PARSER_H_
 #define WEBMLIVE_ENCODER_WEBM_BUFFER_PARSER_H_
 
-#include <memory>
-#include <string>
 #include <vector>
 
 #include "encoder/basictypes.h"
 #include "encoder/encoder_base.h"
 
-namespace mkvparser {
+namespace webmlive {
 
-class Cluster;
-class Segment;
+// Incremental decoder of EBML element headers. The ID and size of an element
+// are decoded one byte at a time, so a header split across buffers resumes
+// where the previous buffer ended, and no byte is examined twice.
+class EbmlScanner {
+ public:
+  enum {
+    // The element ID or size is not a valid EBML variable length integer.
+    kInvalidElement = -1,
+    kSuccess = 0,
+    // All data was used before the end of the element header.
+    kNeedMoreData = 1,
+  };
 
-}  // namespace mkvparser
+  // |size()| of an element whose size field is all ones.
+  static const int64 kUnknownSize = -1;
 
-namespace webmlive {
+  EbmlScanner();
+  ~EbmlScanner();
+
+  // Decodes element header bytes from the |length| bytes at |ptr_data|, and
+  // stores the number of bytes used in |ptr_bytes_used|. Returns |kSuccess|
+  // when the header is complete, |kNeedMoreData| when all |length| bytes
+  // have been used, or |kInvalidElement|. The call that follows |kSuccess|
+  // begins a new header.
+  int ReadHeader(const uint8* ptr_data, int32 length, int32* ptr_bytes_used);
+
+  // Header decoded by the last |ReadHeader()| call that returned |kSuccess|.
+  // |id()| includes the length marker bits, as in libwebm's |MkvId|.
+  uint64 id() const { return id_; }
+  int64 size() const { return size_; }
+  int32 header_length() const { return header_length_; }
 
-class WebmBufferReader;
+ private:
+  // Returns the length of the variable length integer that begins with
+  // |byte|, or 0 when |byte| has no length marker.
+  static int32 VintLength(uint8 byte);
+
+  // Decoding state of the current header: the value of the ID or size read
+  // so far, the bytes of it still to read, and the header bytes already
+  // read.
+  bool reading_size_;
+  uint64 value_;
+  int32 bytes_left_;
+  bool size_all_ones_;
+  int32 bytes_read_;
+
+  uint64 id_;
+  int64 size_;
+  int32 header_length_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(EbmlScanner);
+};
+
+// Splits a WebM stream into chunks: the first chunk holds the EBML header,
+// the segment header, and every element before the first cluster; each
+// following chunk is one cluster. Only element headers are decoded, with
+// |EbmlScanner|: element payloads are skipped, and an unknown size cluster is
+// scanned only to its children's headers, until the next top level element
+// ends it.
 class WebmBufferParser {
  public:
   typedef std::vector<uint8> Buffer;
@@ -42,41 +90,44 @@ class WebmBufferParser {
   };
   WebmBufferParser();
   ~WebmBufferParser();
-  // Constructs |reader_|.
+  // Resets the parser to the start of a stream.
   int Init();
-  // Tries to parse some data in |buf| using |ParseSegmentHeaders| or
-  // |ParseCluster|, depending on the |mode_| value.
+  // Scans the data in |buf| that has not been scanned by earlier calls.
+  // |buf| must begin with the first byte after the last chunk returned, and
+  // hold the data passed to the previous call followed by new data.
   // Returns |kNeedMoreData| when more data is needed. Returns |kSuccess| and
-  // sets |ptr_element_size| when all data has been parsed.
+  // sets |ptr_element_size| to the chunk length when a chunk is complete.
   int Parse(const Buffer& buf, int32* ptr_element_size);
 
+  // Scans the |length| bytes at |ptr_data|, with the same requirements and
+  // results as |Parse()| above. |ptr_data| may move between calls.
+  int Parse(const uint8* ptr_data, int32 length, int32* ptr_element_size);
+
  private:
-  // Parse function pointer type.
-  typedef int (WebmBufferParser::*ParseFunc)(int32* ptr_element_size);
-  // Tries to parse the segment headers: segment info and segment tracks.
-  // Returns |kNeedMoreData| if more data is needed.  Returns |kSuccess| and
-  // sets |ptr_element_size| when successful.
-  int ParseSegmentHeaders(int32* ptr_element_size);
-  // Tries to parse a cluster.  Returns |kNeedMoreData| when more data is
-  // needed. Returns |kSuccess| and sets |ptr_element_size| when all cluster
-  // data has been parsed.
-  int ParseCluster(int32* ptr_element_size);
-  // Pointer to current cluster when |ParseCluster| only partially parses
-  // cluster data.  NULL otherwise. Note that |ptr_cluster_| is memory owned by
-  // libwebm's mkvparser.
-  const mkvparser::Cluster* ptr_cluster_;
-  // Pointer to libwebm segment; needed for cluster parsing operations.
-  std::unique_ptr<mkvparser::Segment> segment_;
-  // Buffer object that implements the IMkvReader interface required by
-  // libwebm's mkvparser using a window into the |buf| argument passed to
-  // |Parse|.
-  std::unique_ptr<WebmBufferReader> reader_;
-  // Bytes read in partially parsed cluster.
-  int64 cluster_parse_offset_;
-  // Sum of parsed element lengths.  Used to update |parser_| window.
+  // Ends the chunk that began at |total_bytes_parsed_| at |chunk_end|.
+  int32 EndChunk(int64 chunk_end);
+
+  // Updates the parser state for the element just decoded by |scanner_|,
+  // which began at |element_start|. Returns true and stores the length of
+  // the chunk the element ends in |ptr_chunk_length| when it ends a chunk.
+  // Returns false and sets |ptr_status| to |kParseError| when the element
+  // cannot be handled.
+  bool OnElement(int64 element_start, int32* ptr_chunk_length,
+                 int* ptr_status);
+
+  EbmlScanner scanner_;
+  // Stream position of the next byte to scan.
+  int64 scan_pos_;
+  // Payload bytes of the current element still to skip.
+  int64 skip_left_;
+  // End of the current cluster when its size is known, or -1.
+  int64 cluster_end_;
+  // True while inside a cluster of unknown size.
+  bool in_cluster_;
+  // True once the first cluster has been found.
+  bool headers_done_;
+  // Sum of parsed element lengths; the stream position of |buf[0]|.
   int64 total_bytes_parsed_;
-  // Parsing function-- either |ParseSegmentHeaders| or |ParseCluster|.
-  ParseFunc parse_func_;
   WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(WebmBufferParser);
 };
 
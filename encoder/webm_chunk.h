@@ -0,0 +1,255 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_WEBM_CHUNK_H_
+#define WEBMLIVE_ENCODER_WEBM_CHUNK_H_
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "encoder/basictypes.h"
+
+namespace webmlive {
+
+// Layout and timing of a chunk, recorded by |LiveWebmMuxer| as it writes the
+// chunk so that consumers need not parse it. Times are in milliseconds.
+struct WebmChunkDescriptor {
+  WebmChunkDescriptor()
+      : offset(0), length(0), first_timestamp(0), last_timestamp(0),
+        keyframe(false), continuation(false), block_count(0),
+        keyframe_offset(-1) {}
+
+  // Position of the first byte of the chunk within the muxer output, and the
+  // chunk length in bytes.
+  int64 offset;
+  int32 length;
+
+  // Timestamps of the first and last frames in the chunk.
+  int64 first_timestamp;
+  int64 last_timestamp;
+
+  // True when the chunk begins with a keyframe.
+  bool keyframe;
+
+  // True when the chunk's cluster was started by the muxer's cluster size
+  // limit rather than at a segment boundary: the chunk continues the
+  // segment of the chunk before it.
+  bool continuation;
+
+  // Number of frames written to the chunk.
+  int32 block_count;
+
+  // Position within the chunk of the block element of the keyframe that
+  // begins it, or -1 when |keyframe| is false.
+  int32 keyframe_offset;
+};
+
+// Counters of a |WebmChunkDataPool|.
+struct WebmChunkDataPoolStats {
+  WebmChunkDataPoolStats()
+      : acquires(0), reuses(0), drops(0), free_buffers(0), free_bytes(0) {}
+
+  // Buffers handed out by |Acquire()|, and those that reused the storage of
+  // a released buffer instead of allocating.
+  int64 acquires;
+  int64 reuses;
+
+  // Released buffers freed because their size class was full, or their
+  // storage was smaller than every class.
+  int64 drops;
+
+  // Free buffers held, and their total capacity.
+  int64 free_buffers;
+  int64 free_bytes;
+};
+
+// Thread safe pool of chunk data buffers, shared by the muxers of an encoder.
+// |LiveWebmMuxer| writes chunks into buffers taken from the pool, and each
+// |WebmChunk| built from one returns it when the last reference to the chunk
+// is released, after the sinks are done with it. Chunk storage is thus reused
+// instead of reallocated once the muxers reach a steady state, and the audio
+// and video muxers can have any number of chunks in flight at once.
+//
+// Buffers are kept in power of two size classes from |kMinClassShift| to
+// |kMaxClassShift|, so that muxers with similar chunk sizes share storage: a
+// request takes the smallest class that holds it, and a released buffer goes
+// to the largest class its storage holds.
+class WebmChunkDataPool {
+ public:
+  typedef std::vector<uint8> Data;
+
+  // Maximum number of free buffers kept per size class.
+  static const size_t kMaxFreeBuffers = 8;
+
+  // Capacity of the smallest and largest size classes, as powers of two:
+  // 4 KB and 16 MB.
+  static const int kMinClassShift = 12;
+  static const int kMaxClassShift = 24;
+  static const int kNumSizeClasses = kMaxClassShift - kMinClassShift + 1;
+
+  WebmChunkDataPool() {
+    for (int i = 0; i < kNumSizeClasses; ++i) {
+      free_buffers_[i].reserve(kMaxFreeBuffers);
+    }
+  }
+  ~WebmChunkDataPool() {}
+
+  // Returns the capacity of buffers for requests of |capacity| bytes: that of
+  // the smallest class holding |capacity|, or |capacity| itself when it
+  // exceeds every class.
+  static size_t ClassCapacity(size_t capacity) {
+    const int size_class = AcquireClass(capacity);
+    return size_class < 0 ? capacity :
+        static_cast<size_t>(1) << (size_class + kMinClassShift);
+  }
+
+  // Swaps an empty buffer into |ptr_data|, with room for at least
+  // |capacity| bytes. The previous contents of |ptr_data| are released to
+  // the pool.
+  void Acquire(size_t capacity, Data* ptr_data) {
+    Release(ptr_data);
+    const int size_class = AcquireClass(capacity);
+    Data data;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ++stats_.acquires;
+      if (size_class >= 0 && !free_buffers_[size_class].empty()) {
+        data.swap(free_buffers_[size_class].back());
+        free_buffers_[size_class].pop_back();
+        ++stats_.reuses;
+        --stats_.free_buffers;
+        stats_.free_bytes -= data.capacity();
+      }
+    }
+    if (data.capacity() < capacity) {
+      data.reserve(ClassCapacity(capacity));
+    }
+    ptr_data->swap(data);
+  }
+
+  // Takes the storage of |ptr_data| when its size class has room; |ptr_data|
+  // is left empty.
+  void Release(Data* ptr_data) {
+    if (ptr_data->capacity() == 0) {
+      return;
+    }
+    ptr_data->clear();
+    const int size_class = ReleaseClass(ptr_data->capacity());
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (size_class < 0 ||
+        free_buffers_[size_class].size() >= kMaxFreeBuffers) {
+      ++stats_.drops;
+      Data().swap(*ptr_data);
+      return;
+    }
+    ++stats_.free_buffers;
+    stats_.free_bytes += ptr_data->capacity();
+    free_buffers_[size_class].push_back(Data());
+    free_buffers_[size_class].back().swap(*ptr_data);
+  }
+
+  // Adds up to |count| free buffers for requests of |capacity| bytes, as
+  // room in their class allows. The buffers are written once so that their
+  // pages are mapped before the first chunks are written to them.
+  void Prefill(size_t capacity, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+      Data data;
+      data.resize(ClassCapacity(capacity));
+      data.clear();
+      Release(&data);
+    }
+  }
+
+  // Copies the pool counters to |ptr_stats|.
+  void GetStats(WebmChunkDataPoolStats* ptr_stats) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    *ptr_stats = stats_;
+  }
+
+ private:
+  // Returns the smallest class holding |capacity| bytes, or -1 when
+  // |capacity| exceeds every class.
+  static int AcquireClass(size_t capacity) {
+    for (int i = 0; i < kNumSizeClasses; ++i) {
+      if (capacity <= static_cast<size_t>(1) << (i + kMinClassShift)) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  // Returns the largest class that storage of |capacity| bytes holds, or -1
+  // when it is smaller than every class.
+  static int ReleaseClass(size_t capacity) {
+    for (int i = kNumSizeClasses - 1; i >= 0; --i) {
+      if (capacity >= static_cast<size_t>(1) << (i + kMinClassShift)) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  std::mutex mutex_;
+  std::vector<Data> free_buffers_[kNumSizeClasses];
+  WebmChunkDataPoolStats stats_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(WebmChunkDataPool);
+};
+
+typedef std::shared_ptr<WebmChunkDataPool> SharedWebmChunkDataPool;
+
+// Immutable WebM chunk produced by |LiveWebmMuxer|. Chunks are handed out as
+// |SharedWebmChunk|s so that the muxer, the file writer and data sinks can all
+// hold the same chunk data without copying it.
+class WebmChunk {
+ public:
+  typedef WebmChunkDataPool::Data Data;
+
+  // Takes ownership of the contents of |ptr_data| by swapping it with
+  // |data_|; |ptr_data| is left empty. |duration| is in milliseconds, and
+  // runs from |descriptor.first_timestamp| to the start of the next chunk
+  // when known. The data is released to |pool| on destruction when |pool| is
+  // non-NULL.
+  WebmChunk(const std::string& id, const WebmChunkDescriptor& descriptor,
+            int64 duration, Data* ptr_data,
+            const SharedWebmChunkDataPool& pool)
+      : id_(id),
+        descriptor_(descriptor),
+        duration_(duration),
+        pool_(pool) {
+    data_.swap(*ptr_data);
+  }
+  ~WebmChunk() {
+    if (pool_) {
+      pool_->Release(&data_);
+    }
+  }
+
+  // Accessors.
+  const std::string& id() const { return id_; }
+  const WebmChunkDescriptor& descriptor() const { return descriptor_; }
+  int64 timestamp() const { return descriptor_.first_timestamp; }
+  int64 duration() const { return duration_; }
+  bool keyframe() const { return descriptor_.keyframe; }
+  const uint8* data() const { return data_.empty() ? NULL : &data_[0]; }
+  int32 length() const { return static_cast<int32>(data_.size()); }
+
+ private:
+  const std::string id_;
+  const WebmChunkDescriptor descriptor_;
+  const int64 duration_;
+  Data data_;
+  const SharedWebmChunkDataPool pool_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(WebmChunk);
+};
+
+typedef std::shared_ptr<const WebmChunk> SharedWebmChunk;
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_WEBM_CHUNK_H_
@@ -12,13 +12,33 @@
 #include <functional>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <sstream>
+#include <thread>
 
 #include "encoder/buffer_pool-inl.h"
+#include "encoder/capture_replay_source.h"
 #include "encoder/dash_writer.h"
+#include "encoder/file_media_source.h"
+#include "encoder/latency_tracer.h"
+#include "encoder/log_util.h"
+#include "encoder/media_source.h"
+#include "encoder/memory_accounting.h"
+#ifdef WEBMLIVE_HAVE_OPUS
+#include "encoder/opus_encoder.h"
+#endif
+#include "encoder/segment_index.h"
+#include "encoder/segment_retention.h"
+#include "encoder/task_scheduler.h"
+#include "encoder/thread_util.h"
+#include "encoder/webm_archive_writer.h"
 #include "encoder/webm_mux.h"
+#include "encoder/webm_splice_clip.h"
 #ifdef _WIN32
+#include "encoder/win/d3d11_video_processor.h"
 #include "encoder/win/media_source_dshow.h"
+#elif defined(__linux__)
+#include "encoder/linux/media_source_linux.h"
 #endif
 #include "glog/logging.h"
 
@@ -28,6 +48,15 @@ const char kMuxedId[] = "muxed";
 const char kAudioId[] = "audio";
 const char kVideoId[] = "video";
 
+// File name of the DASH manifest within |WebmEncoderConfig::dash_dir|.
+const char kManifestFile[] = "webmlive.mpd";
+
+// Maximum number of chunk and manifest files waiting in |FileWriter|'s queue.
+const int32 kFileWriterQueueDepth = 32;
+
+// Compressed video frames moved out of |vpx_pool_| per |DecommitBatch()|.
+const int32 kVideoBatchSize = 8;
+
 // Adds |timestamp_offset| to the timestamp value of |ptr_sample|, and returns
 // |WebmEncoder::kSuccess|. Returns |WebmEncoder::kInvalidArg| when |ptr_sample|
 // is NULL.
@@ -43,7 +72,83 @@ int OffsetTimestamp(int64 timestamp_offset, T* ptr_sample) {
   return WebmEncoder::kSuccess;
 }
 
-int InitMuxer(int chunk_duration, const std::string& muxer_id,
+// Upper limit of the chunk size reserved by |InitMuxer()|, in bytes.
+const int64 kMaxExpectedChunkSize = 16 * 1024 * 1024;
+
+// Returns the expected size in bytes of a chunk lasting |duration|
+// milliseconds at |bitrate| kilobits per second. Half again is added for
+// keyframes and rate control overshoot.
+int32 ExpectedChunkSize(int bitrate, int duration) {
+  if (bitrate <= 0 || duration <= 0) {
+    return 0;
+  }
+  const int64 size = static_cast<int64>(bitrate) * duration / 8;
+  return static_cast<int32>(std::min(size + size / 2, kMaxExpectedChunkSize));
+}
+
+// Blocks per |MediaArena| slab for raw frames, compressed frames and audio
+// buffers. Slabs are added as the pools fill, so slabs of raw frames are
+// kept small.
+const int kRawFramesPerSlab = 2;
+const int kCompressedFramesPerSlab = 8;
+const int kAudioBuffersPerSlab = 16;
+
+// Arena block sizes for compressed audio: an Opus packet, and the initial
+// packet payload of |VorbisEncoder|.
+const int32 kOpusBlockSize = 4 * 1024;
+const int32 kVorbisBlockSize = 16 * 1024;
+
+// Returns the buffer size of a frame in the capture format |config|.
+int32 NativeFrameSize(const webmlive::VideoConfig& config) {
+  int32 size = config.stride * abs(config.height);
+  if (config.format == webmlive::kVideoFormatI420 ||
+      config.format == webmlive::kVideoFormatYV12 ||
+      config.format == webmlive::kVideoFormatNV12) {
+    size += size / 2;
+  }
+  return size;
+}
+
+// Returns the buffer size of the frames queued for the video encoder when
+// capturing in |config|: frames in formats the encoder cannot read are
+// converted to I420 first.
+int32 RawFrameSize(const webmlive::VideoConfig& config) {
+  // Padded frames leave the encoder room to read the padding in place.
+  const int32 padding = webmlive::VideoFrame::PaddingSize(config);
+  if (webmlive::VideoFrame::NeedsConversion(config.format)) {
+    return webmlive::VideoFrame::I420BufferSize(config.width,
+                                                abs(config.height)) +
+           padding;
+  }
+  return NativeFrameSize(config) + padding;
+}
+
+// Adds a |block_size| class to |ptr_arena| when |block_size| is known. Buffers
+// without a class come from the heap, so failures are not fatal.
+void AddArenaSizeClass(webmlive::MediaArena* ptr_arena, int32 block_size,
+                       int blocks_per_slab, bool large_pages) {
+  if (block_size > 0 &&
+      ptr_arena->AddSizeClass(block_size, blocks_per_slab, large_pages)) {
+    LOG(WARNING) << "media buffers of " << block_size
+                 << " bytes are allocated from the heap.";
+  }
+}
+
+// Returns the bitrate of the audio encoder selected by |config|, in kilobits
+// per second.
+int AudioBitrate(const webmlive::WebmEncoderConfig& config) {
+  if (config.audio_codec == webmlive::kAudioFormatOpus) {
+    return config.opus_config.bitrate;
+  }
+  return config.vorbis_config.average_bitrate;
+}
+
+int InitMuxer(int chunk_duration, int32 max_cluster_bytes,
+              const std::string& muxer_id,
+              bool stream_chunks, int32 expected_chunk_size,
+              const webmlive::SharedWebmChunkDataPool& chunk_pool,
+              webmlive::InitSegmentCache* ptr_init_segments,
+              const webmlive::EncryptionSettings& encryption,
               std::unique_ptr<webmlive::LiveWebmMuxer>* muxer) {
   CHECK_NOTNULL(muxer);
   (*muxer).reset(new (std::nothrow) webmlive::LiveWebmMuxer());  // NOLINT
@@ -51,54 +156,179 @@ int InitMuxer(int chunk_duration, const std::string& muxer_id,
     LOG(ERROR) << "cannot construct live muxer!";
     return webmlive::WebmEncoder::kInitFailed;
   }
-  const int status = (*muxer)->Init(chunk_duration, muxer_id);
+  const int status =
+      (*muxer)->Init(chunk_duration, max_cluster_bytes, muxer_id);
   if (status) {
     LOG(ERROR) << "live muxer Init failed " << status;
     return webmlive::WebmEncoder::kInitFailed;
   }
+  (*muxer)->SetChunkPool(chunk_pool);
+  (*muxer)->SetInitSegmentCache(ptr_init_segments);
+  (*muxer)->ReserveChunkSize(expected_chunk_size);
+  if (stream_chunks) {
+    (*muxer)->EnableStreaming();
+  }
+  if (encryption.enabled && (*muxer)->EnableEncryption(encryption)) {
+    LOG(ERROR) << "live muxer EnableEncryption failed.";
+    return webmlive::WebmEncoder::kInitFailed;
+  }
   return status;
 }
 
-bool WriteManifest(const std::string& name, const std::string& manifest) {
-  FILE* manifest_file = fopen(name.c_str(), "w");
-  if (!manifest_file) {
-    LOG(ERROR) << "Unable to open manifest file.";
-    return false;
+// Adaptive resolution ladder. Level n scales the primary video stream by
+// |scale_num| / |scale_den| and encodes one of every |frame_divisor| frames.
+struct DegradationLevel {
+  int scale_num;
+  int scale_den;
+  int frame_divisor;
+};
+const DegradationLevel kDegradationLevels[] = {
+  {1, 1, 1}, {3, 4, 1}, {1, 2, 1}, {1, 2, 2},
+};
+const int kNumDegradationLevels =
+    sizeof(kDegradationLevels) / sizeof(kDegradationLevels[0]);
+
+// Returns the frame size of |level| for video captured in |config|: the
+// encoded size at full scale, and otherwise the visible size scaled and
+// rounded down to even dimensions for I420.
+void DegradedFrameSize(const webmlive::VideoConfig& config,
+                       const DegradationLevel& level, int32* ptr_width,
+                       int32* ptr_height) {
+  if (level.scale_num == level.scale_den) {
+    const webmlive::VideoConfig encoded_config =
+        webmlive::EncodedVideoConfig(config);
+    *ptr_width = encoded_config.width;
+    *ptr_height = abs(encoded_config.height);
+    return;
   }
-  const int bytes_written =
-    fprintf(manifest_file, "%s", manifest.c_str());
-  fclose(manifest_file);
-  return (bytes_written == manifest.length());
+  *ptr_width = std::max<int32>(
+      2, (webmlive::VisibleWidth(config) * level.scale_num /
+          level.scale_den) & ~1);
+  *ptr_height = std::max<int32>(
+      2, (webmlive::VisibleHeight(config) * level.scale_num /
+          level.scale_den) & ~1);
 }
 
-bool WriteChunkFile(const std::string& chunk_name,
-                    const uint8* chunk_buffer, int32 chunk_length) {
-  FILE* chunk_file = fopen(chunk_name.c_str(), "wb");
-  if (!chunk_file) {
-    LOG(ERROR) << "Unable to open chunk file.";
-    return false;
+// Returns a hash of |manifest| that ignores the value of its publishTime
+// attribute, which changes on every write of a dynamic manifest.
+size_t ManifestHash(const std::string& manifest) {
+  const char kPublishTime[] = "publishTime=\"";
+  const size_t start = manifest.find(kPublishTime);
+  const size_t value = start + sizeof(kPublishTime) - 1;
+  const size_t end = start == std::string::npos ?
+      std::string::npos : manifest.find('"', value);
+  if (end == std::string::npos) {
+    return std::hash<std::string>()(manifest);
+  }
+  return std::hash<std::string>()(manifest.substr(0, value) +
+                                  manifest.substr(end));
+}
+
+#ifdef _WIN32
+// Returns a GPU video processor, or NULL when none is available. |use|
+// describes the processor's work in the log.
+std::unique_ptr<webmlive::D3D11VideoProcessor> CreateGpuVideoProcessor(
+    const char* use) {
+  std::unique_ptr<webmlive::D3D11VideoProcessor> processor(
+      new (std::nothrow) webmlive::D3D11VideoProcessor());  // NOLINT
+  if (!processor || processor->Init()) {
+    LOG(WARNING) << "GPU " << use << " unavailable, using libyuv.";
+    processor.reset();
+  } else {
+    LOG(INFO) << "GPU " << use << " enabled.";
   }
-  const size_t bytes_written =
-      fwrite(reinterpret_cast<const void*>(chunk_buffer),
-             1, chunk_length, chunk_file);
-  fclose(chunk_file);
-  return (bytes_written == chunk_length);
+  return processor;
 }
+#endif  // _WIN32
 
 }  // anonymous namespace
 
 namespace webmlive {
 
+const int WebmEncoder::kInputWaitTimeout;
+
 WebmEncoder::WebmEncoder()
     : initialized_(false),
       stop_(false),
-      chunk_buffer_size_(0),
+      shutdown_stats_(),
+      paused_(false),
+      resumes_(0),
+      pause_offset_(0),
+      paused_frames_(0),
+      paused_audio_buffers_(0),
+      resume_pending_(false),
+      pauses_(0),
+      splice_active_(false),
+      resume_floor_(-1),
+      slate_start_time_(-1),
+      slate_running_(false),
+      slate_loops_(0),
+      text_track_(0),
       encoded_duration_(0),
+      audio_encoder_silent_(false),
+      pipeline_status_(kSuccess),
       ptr_encode_func_(NULL),
-      timestamp_offset_(0) {
+      manifest_update_period_(0),
+      timestamp_offset_(0),
+      newest_video_timestamp_(0),
+      frames_captured_(0),
+      queue_full_drops_(0),
+      stale_drops_(0),
+      encoder_drops_(0),
+      passthrough_keyframe_seen_(false),
+      degradation_level_(0),
+      degradation_frames_(0),
+      degradation_drops_(0),
+      degradation_changes_(0),
+      video_frames_encoded_(0),
+      video_encode_us_(0),
+      video_bytes_(0),
+      audio_buffers_encoded_(0),
+      audio_encode_us_(0),
+      audio_bytes_(0),
+      finished_(false),
+      requested_video_bitrate_(0),
+      video_base_bitrate_(0),
+      segment_video_bitrate_(0),
+      requested_audio_bitrate_(0),
+      requested_video_speed_(EncoderReconfiguration::kUnchanged),
+      requested_keyframe_interval_(EncoderReconfiguration::kUnchanged),
+      next_segment_time_(0),
+      device_open_ms_(-1),
+      graph_run_ms_(-1),
+      first_audio_ms_(-1),
+      first_video_ms_(-1),
+      first_chunk_ms_(-1),
+      manifest_hash_(0),
+      manifest_queued_(false),
+      muxed_stream_open_(false),
+      drop_muxed_video_(false),
+      sink_blocked_(false),
+      sink_stats_(),
+      sink_credit_(0),
+      sink_failed_(false) {
 }
 
 WebmEncoder::~WebmEncoder() {
+  MemoryAccountant::Instance()->Add(kMemorySinkQueue,
+                                    -sink_stats_.queued_bytes);
+}
+
+WebmEncoder::VideoRendition::VideoRendition()
+    : index(0),
+      camera(0),
+      requested_speed(EncoderReconfiguration::kUnchanged),
+      requested_keyframe_interval(EncoderReconfiguration::kUnchanged),
+      next_segment_time(0) {
+}
+
+WebmEncoder::VideoRendition::~VideoRendition() {
+}
+
+WebmEncoder::AudioRendition::AudioRendition() : index(0) {
+}
+
+WebmEncoder::AudioRendition::~AudioRendition() {
 }
 
 // Constructs media source object and calls its |Init| method.
@@ -115,141 +345,841 @@ int WebmEncoder::Init(const WebmEncoderConfig& config,
 
   config_ = config;
   ptr_data_sink_ = ptr_data_sink;
+  startup_time_ = std::chrono::steady_clock::now();
 
-  // Allocate the chunk buffer.
-  chunk_buffer_.reset(
-      new (std::nothrow) uint8[kDefaultChunkBufferSize]);  // NOLINT
-  if (!chunk_buffer_) {
-    LOG(ERROR) << "Unable to allocate chunk buffer!";
-    return kNoMemory;
+  if (file_writer_.Init(kFileWriterQueueDepth, config_.file_sync_policy)) {
+    LOG(ERROR) << "cannot initialize file writer!";
+    return kInitFailed;
   }
-  chunk_buffer_size_ = kDefaultChunkBufferSize;
 
-  // Construct and initialize the media source(s).
-  ptr_media_source_.reset(new (std::nothrow) MediaSourceImpl());  // NOLINT
+  // Construct and initialize the media source(s). A capture dump or input
+  // files replace the capture devices; a stream without an input file is
+  // disabled.
+  CaptureReplaySource* ptr_replay_source = NULL;
+  if (!config_.replay_file.empty()) {
+    ptr_replay_source = new (std::nothrow) CaptureReplaySource();  // NOLINT
+    ptr_media_source_.reset(ptr_replay_source);
+  } else if (!config_.video_input_file.empty() ||
+             !config_.audio_input_file.empty()) {
+    if (config_.video_input_file.empty() && !config_.disable_video) {
+      LOG(INFO) << "No video input file, disabling video.";
+      config_.disable_video = true;
+    }
+    if (config_.audio_input_file.empty() && !config_.disable_audio) {
+      LOG(INFO) << "No audio input file, disabling audio.";
+      config_.disable_audio = true;
+    }
+    if (config_.disable_audio && config_.disable_video) {
+      LOG(ERROR) << "Input files are set only for disabled streams!";
+      return kInvalidArg;
+    }
+    ptr_media_source_.reset(new (std::nothrow) FileMediaSource());  // NOLINT
+  } else {
+    ptr_media_source_.reset(new (std::nothrow) MediaSourceImpl());  // NOLINT
+  }
   if (!ptr_media_source_) {
     LOG(ERROR) << "cannot construct media source!";
     return kInitFailed;
   }
-  int status = ptr_media_source_->Init(config_, this, this);
+
+  // Cameras are encoded like renditions, and are captured by the graph of
+  // the capture devices. DASH output is on unless only muxed output is
+  // requested.
+  if (!config_.video_cameras.empty() &&
+      (config_.disable_video || config_.video_passthrough ||
+       (config_.muxed_output && !config_.dash_encode) ||
+       config_.video_source != WebmEncoderConfig::kVideoSourceDevice ||
+       ptr_replay_source || !config_.video_input_file.empty() ||
+       !config_.audio_input_file.empty())) {
+    LOG(WARNING) << "Additional cameras require DASH output of encoded "
+                 << "video from capture devices, disabling.";
+    config_.video_cameras.clear();
+  }
+  int status = CreateCameras();
+  if (status) {
+    return status;
+  }
+  status = ptr_media_source_->Init(config_, this, this);
   if (status) {
     LOG(ERROR) << "media source Init failed " << status;
     return kInitFailed;
   }
+  if (ptr_replay_source) {
+    if (!ptr_replay_source->has_video() && !config_.disable_video) {
+      LOG(INFO) << "No video in capture dump, disabling video.";
+      config_.disable_video = true;
+    }
+    if (!ptr_replay_source->has_audio() && !config_.disable_audio) {
+      LOG(INFO) << "No audio in capture dump, disabling audio.";
+      config_.disable_audio = true;
+    }
+  }
+  if (!config_.capture_dump_file.empty() &&
+      capture_dump_.Open(config_.capture_dump_file)) {
+    LOG(ERROR) << "cannot open capture dump " << config_.capture_dump_file;
+    return kInitFailed;
+  }
+
+  // Files and dumps end rather than stall; only capture devices are watched.
+  // Restarts move the timestamps of the primary devices only, so cameras
+  // would lose their alignment.
+  if (config_.capture_watchdog.enabled) {
+    if (ptr_replay_source || !config_.video_input_file.empty() ||
+        !config_.audio_input_file.empty()) {
+      LOG(WARNING) << "capture watchdog ignored: input is not captured.";
+    } else if (!config_.video_cameras.empty()) {
+      LOG(WARNING) << "capture watchdog ignored: additional cameras.";
+    } else {
+      watchdog_.reset(new (std::nothrow) CaptureWatchdog());  // NOLINT
+      if (!watchdog_) {
+        LOG(ERROR) << "cannot construct capture watchdog!";
+        return kNoMemory;
+      }
+      // Passed through video cannot be continued from an encoded slate.
+      if (config_.capture_watchdog.slate && config_.video_passthrough &&
+          !config_.disable_video) {
+        LOG(WARNING) << "capture slate ignored: video is passed through.";
+        config_.capture_watchdog.slate = false;
+      }
+
+      // A slate replaces the filler frames.
+      const double frame_rate =
+          config_.disable_video || config_.capture_watchdog.slate ?
+          0 : ptr_media_source_->actual_video_config().frame_rate;
+      status = watchdog_->Init(
+          config_.capture_watchdog, frame_rate,
+          [this]() { return ptr_media_source_->CheckStatus(); },
+          [this]() { return ptr_media_source_->Restart(); },
+          [this](VideoFrame* ptr_frame) {
+            return ReceiveVideoFrame(ptr_frame);
+          });
+      if (status) {
+        LOG(ERROR) << "capture watchdog Init failed " << status;
+        return kInvalidArg;
+      }
+    }
+  }
+  RecordStartupPhase(&device_open_ms_);
+
+  // DASH file output is on unless the muxed stream alone was requested.
+  if (!config_.muxed_output) {
+    config_.dash_encode = true;
+  }
+
+  if (config_.pipeline_encode && !config_.dash_encode) {
+    // Muxed output interleaves audio and video in a single muxer, which
+    // requires the encode order provided by |AVEncode()|.
+    LOG(WARNING) << "Pipelined encoding requires DASH output, disabling.";
+    config_.pipeline_encode = false;
+  }
+
+  if (!config_.dash_encode && !config_.video_renditions.empty()) {
+    // Renditions are written as separate DASH Representations.
+    LOG(WARNING) << "Video renditions require DASH output, disabling.";
+    config_.video_renditions.clear();
+  }
+  if (!config_.audio_renditions.empty() &&
+      (!config_.dash_encode || config_.disable_audio ||
+       config_.audio_codec != kAudioFormatVorbis)) {
+    LOG(WARNING) << "Audio renditions require DASH output and Vorbis audio, "
+                 << "disabling.";
+    config_.audio_renditions.clear();
+  }
+
+  if (config_.video_passthrough && !config_.disable_video) {
+    const VideoFormat source_format =
+        ptr_media_source_->actual_video_config().format;
+    if (source_format != kVideoFormatVP8 &&
+        source_format != kVideoFormatVP9) {
+      LOG(WARNING) << "Video passthrough requires VP8 or VP9 input, "
+                   << "encoding video.";
+      config_.video_passthrough = false;
+    } else {
+      // Without an encoder there is nothing to scale frames, encode
+      // renditions from them, or split them in layers.
+      config_.vpx_config.codec = source_format;
+      if (!config_.video_renditions.empty() || config_.adaptive_resolution ||
+          config_.vpx_config.temporal_layers > 1) {
+        LOG(WARNING) << "Video passthrough disables renditions, adaptive "
+                     << "resolution and temporal layers.";
+        config_.video_renditions.clear();
+        config_.adaptive_resolution = false;
+        config_.vpx_config.temporal_layers = 1;
+      }
+    }
+  }
+
+  // DASH segments and adaptive segment boundaries start with keyframes, and
+  // cyclic refresh needs realtime CBR encoding with libvpx.
+  VpxConfig& vpx_config = config_.vpx_config;
+  if (vpx_config.intra_refresh &&
+      (config_.dash_encode || config_.video_passthrough ||
+       config_.adaptive_segments.enabled || vpx_config.latency_budget > 0 ||
+       vpx_config.encoder_backend != kVideoEncoderSoftware)) {
+    LOG(WARNING) << "intra refresh requires muxed output alone, without "
+                 << "adaptive segments, encoded by libvpx without a latency "
+                 << "budget, disabling.";
+    vpx_config.intra_refresh = false;
+  }
+  // GOPs are encoded ahead of the input, which only free running files and
+  // dumps allow, and cyclic refresh has no keyframes to cut GOPs at.
+  if (vpx_config.parallel_gops > 1 &&
+      (!config_.free_run || config_.video_passthrough ||
+       vpx_config.intra_refresh ||
+       vpx_config.encoder_backend != kVideoEncoderSoftware ||
+       (config_.video_input_file.empty() && config_.replay_file.empty()))) {
+    LOG(WARNING) << "parallel GOP encoding requires free running video "
+                 << "input files or capture dumps encoded by libvpx without "
+                 << "intra refresh, disabling.";
+    vpx_config.parallel_gops = 0;
+    for (size_t i = 0; i < config_.video_renditions.size(); ++i) {
+      config_.video_renditions[i].vpx_config.parallel_gops = 0;
+    }
+  }
+  if (vpx_config.intra_refresh && config_.segment_duration <= 0) {
+    // Without periodic keyframes chunks are cut on time.
+    config_.segment_duration = vpx_config.keyframe_interval;
+  }
+  if (vpx_config.scene_cut_threshold != 0 && config_.dash_encode &&
+      !config_.video_renditions.empty()) {
+    // Players switch representations at segment boundaries, which keyframes
+    // placed on the primary stream alone would move.
+    LOG(WARNING) << "scene cut keyframes are not available with DASH "
+                 << "renditions, disabling.";
+    vpx_config.scene_cut_threshold = 0;
+  }
+
+  if (config_.dash_single_file &&
+      (!config_.dash_encode || !config_.dash_dynamic ||
+       !config_.dash_write_files || config_.dash_server.port > 0)) {
+    // Static MPDs have no per-segment byte ranges, and the origin server
+    // serves segments by name.
+    LOG(WARNING) << "single-file DASH output requires a dynamic MPD written "
+                 << "to files, without the DASH origin server, disabling.";
+    config_.dash_single_file = false;
+  }
+  if (config_.dash_segment_index &&
+      (!config_.dash_encode || !config_.dash_write_files)) {
+    LOG(WARNING) << "DASH segment index requires DASH output written to "
+                 << "files, disabling.";
+    config_.dash_segment_index = false;
+  }
+  if (config_.dash_encode && config_.dash_server.port > 0 &&
+      config_.dash_server.time_shift_window == 0 && config_.dash_window > 0) {
+    // The server holds the segments of the MPD's time-shift window. As for
+    // segment files, a player may fetch a manifest one update period after
+    // its oldest segment is dropped; hold segments that much longer.
+    int update_period = config_.dash_update_period;
+    if (update_period <= 0) {
+      update_period = config_.segment_duration > 0 ?
+          config_.segment_duration : config_.vpx_config.keyframe_interval;
+    }
+    config_.dash_server.time_shift_window =
+        config_.dash_window + update_period;
+  }
+  if (config_.dash_encode && config_.dash_server.port > 0) {
+    dash_server_.reset(new (std::nothrow) DashOriginServer());  // NOLINT
+    if (!dash_server_) {
+      LOG(ERROR) << "cannot construct DASH origin server!";
+      return kNoMemory;
+    }
+    if (dash_server_->Init(config_.dash_server)) {
+      LOG(ERROR) << "DASH origin server Init failed!";
+      return kInitFailed;
+    }
+  }
+  if (config_.dash_encode && (!config_.segment_ring.path.empty() ||
+                              !config_.segment_ring.shm_name.empty())) {
+    segment_ring_.reset(new (std::nothrow) SegmentRingWriter());  // NOLINT
+    if (!segment_ring_) {
+      LOG(ERROR) << "cannot construct segment ring writer!";
+      return kNoMemory;
+    }
+    if (segment_ring_->Init(config_.segment_ring)) {
+      LOG(ERROR) << "segment ring Init failed!";
+      return kInitFailed;
+    }
+  }
+  if (!config_.archive_file.empty()) {
+    archive_.reset(new (std::nothrow) WebmArchiveWriter());  // NOLINT
+    if (!archive_) {
+      LOG(ERROR) << "cannot construct archive writer!";
+      return kNoMemory;
+    }
+    if (archive_->Init(config_.archive_file)) {
+      LOG(ERROR) << "archive writer Init failed!";
+      return kInitFailed;
+    }
+  }
+  if (config_.align_segments &&
+      (!config_.dash_encode || config_.disable_audio ||
+       config_.disable_video)) {
+    LOG(WARNING) << "segment alignment requires DASH audio and video, "
+                 << "disabling.";
+    config_.align_segments = false;
+  }
+  if (config_.align_segments) {
+    segment_aligner_.reset(new (std::nothrow) SegmentAligner());  // NOLINT
+    if (!segment_aligner_) {
+      LOG(ERROR) << "cannot construct segment aligner!";
+      return kNoMemory;
+    }
+  }
+  if (config_.segment_rate.enabled &&
+      (config_.disable_video || config_.video_passthrough)) {
+    LOG(WARNING) << "segment rate control requires encoded video, "
+                 << "disabling.";
+    config_.segment_rate.enabled = false;
+  }
+  if (config_.segment_rate.enabled) {
+    segment_rate_.reset(new (std::nothrow) SegmentRateController());  // NOLINT
+    if (!segment_rate_) {
+      LOG(ERROR) << "cannot construct segment rate controller!";
+      return kNoMemory;
+    }
+    const int segment_duration = config_.segment_duration > 0 ?
+        config_.segment_duration : config_.vpx_config.keyframe_interval;
+    if (segment_rate_->Init(config_.segment_rate, segment_duration)) {
+      LOG(ERROR) << "SegmentRateController Init failed!";
+      return kInvalidArg;
+    }
+    video_base_bitrate_.store(config_.vpx_config.bitrate);
+  }
+  SegmentDurationSettings& adaptive_segments = config_.adaptive_segments;
+  if (adaptive_segments.enabled &&
+      (!config_.async_sink || !config_.muxed_output ||
+       config_.segment_duration <= 0 || config_.video_passthrough ||
+       (config_.dash_encode && !config_.dash_dynamic))) {
+    LOG(WARNING) << "adaptive segment durations require the asynchronous "
+                 << "data sink, muxed output, a segment duration, encoded "
+                 << "video and a dynamic MPD, disabling.";
+    adaptive_segments.enabled = false;
+  }
+  if (adaptive_segments.enabled) {
+    if (!config_.disable_video &&
+        adaptive_segments.min_duration <
+            config_.vpx_config.min_keyframe_request_interval) {
+      LOG(ERROR) << "minimum segment duration "
+                 << adaptive_segments.min_duration
+                 << " is shorter than the keyframe request interval.";
+      return kInvalidArg;
+    }
+    segment_durations_.reset(
+        new (std::nothrow) SegmentDurationController());  // NOLINT
+    if (!segment_durations_) {
+      LOG(ERROR) << "cannot construct segment duration controller!";
+      return kNoMemory;
+    }
+    if (segment_durations_->Init(adaptive_segments,
+                                 config_.segment_duration)) {
+      LOG(ERROR) << "SegmentDurationController Init failed!";
+      return kInvalidArg;
+    }
+    // Keyframes are forced at each boundary; the longest duration bounds
+    // the distance between them, and its grid is on every schedule.
+    config_.vpx_config.keyframe_interval = adaptive_segments.max_duration;
+    for (size_t i = 0; i < config_.video_renditions.size(); ++i) {
+      config_.video_renditions[i].vpx_config.keyframe_interval =
+          adaptive_segments.max_duration;
+    }
+    for (size_t i = 0; i < config_.video_cameras.size(); ++i) {
+      config_.video_cameras[i].vpx_config.keyframe_interval =
+          adaptive_segments.max_duration;
+    }
+  }
+  if (!dash_server_ && !segment_ring_ && !config_.dash_write_files) {
+    LOG(WARNING) << "DASH output requires files without the DASH origin "
+                 << "server or segment ring, enabling.";
+    config_.dash_write_files = true;
+  }
+  dash_sinks_.clear();
+  if (config_.dash_write_files) {
+    if (dash_file_sink_.Init(&file_writer_, config_.dash_dir)) {
+      LOG(ERROR) << "DASH file sink Init failed!";
+      return kInitFailed;
+    }
+    dash_sinks_.push_back(&dash_file_sink_);
+  }
+  if (dash_server_) {
+    dash_sinks_.push_back(dash_server_.get());
+  }
 
-  // TODO(tomfinegan): Obey the command line instead of hard coding DASH output.
-  config_.dash_encode = true;
+  // A DASH encode uses two muxers: One for each stream. Muxed output uses one
+  // more, which receives both streams. Each compressed buffer is passed to
+  // every muxer of its stream in |audio_muxers_| or |video_muxers_|.
+  audio_muxers_.clear();
+  video_muxers_.clear();
 
-  // When doing a DASH encode two muxers are used: One for each stream.
-  // Otherwise there's only one. Configure the muxers via local pointers-- the
-  // muxer actually being configured isn't really a concern of the code below as
-  // long as the configuration attempt succeeds.
-  LiveWebmMuxer* audio_muxer = NULL;
-  LiveWebmMuxer* video_muxer = NULL;
+  // All muxers take chunk buffers from one pool, which the sinks return them
+  // to.
+  chunk_pool_.reset(new (std::nothrow) WebmChunkDataPool());  // NOLINT
+  if (!chunk_pool_) {
+    LOG(ERROR) << "cannot construct WebmChunkDataPool!";
+    return kNoMemory;
+  }
 
   // Construct and initialize the muxer(s).
+  if (config_.segment_duration > 0 &&
+      config_.vpx_config.keyframe_interval % config_.segment_duration != 0) {
+    LOG(WARNING) << "keyframe interval " << config_.vpx_config.keyframe_interval
+                 << " is not a multiple of segment duration "
+                 << config_.segment_duration << ", segment durations vary.";
+  }
+  // Chunk buffers are sized for the expected segment length: a segment, or
+  // a keyframe interval when segments follow keyframes.
+  const int chunk_duration = config_.segment_duration > 0 ?
+      config_.segment_duration : config_.vpx_config.keyframe_interval;
+  const int audio_bitrate =
+      config_.disable_audio ? 0 : AudioBitrate(config_);
+  const int video_bitrate =
+      config_.disable_video ? 0 : config_.vpx_config.bitrate;
   if (config_.dash_encode) {
-    status = InitMuxer(config_.vpx_config.keyframe_interval, kAudioId,
+    // Aligned audio segments start only where |segment_aligner_| says.
+    status = InitMuxer(config_.align_segments ? 0 : chunk_duration, 0,
+                       kAudioId,
+                       config_.stream_chunks,
+                       ExpectedChunkSize(audio_bitrate, chunk_duration),
+                       chunk_pool_, &init_segments_, config_.encryption,
                        &ptr_muxer_aud_);
     if (status) {
       LOG(ERROR) << "InitMuxer (A) failed: " << status;
       return status;
     }
-    status = InitMuxer(0, kVideoId, &ptr_muxer_vid_);
+    status = InitMuxer(config_.segment_duration, 0, kVideoId,
+                       config_.stream_chunks,
+                       ExpectedChunkSize(video_bitrate, chunk_duration),
+                       chunk_pool_, &init_segments_, config_.encryption,
+                       &ptr_muxer_vid_);
     if (status) {
       LOG(ERROR) << "InitMuxer (V) failed: " << status;
       return status;
     }
-    audio_muxer = ptr_muxer_aud_.get();
-    video_muxer = ptr_muxer_vid_.get();
-  } else {
-    status = InitMuxer(0, kMuxedId, &ptr_muxer_);
+    FollowSegmentSchedule(ptr_muxer_aud_.get());
+    FollowSegmentSchedule(ptr_muxer_vid_.get());
+    audio_muxers_.push_back(ptr_muxer_aud_.get());
+    video_muxers_.push_back(ptr_muxer_vid_.get());
+  }
+  if (config_.muxed_output && !config_.stream_chunks &&
+      config_.sink_policy != WebmEncoderConfig::kSinkQueueUnbounded) {
+    if (config_.sink_queue_limit < 1) {
+      LOG(ERROR) << "invalid sink queue limit: " << config_.sink_queue_limit;
+      return kInvalidArg;
+    }
+    if (config_.sink_policy == WebmEncoderConfig::kSinkDropVideo &&
+        (config_.disable_audio || config_.disable_video)) {
+      LOG(WARNING) << "Dropping video from the muxed stream requires audio "
+                   << "and video, dropping the oldest chunks instead.";
+      config_.sink_policy = WebmEncoderConfig::kSinkDropOldest;
+    }
+    if (config_.sink_policy == WebmEncoderConfig::kSinkSpill) {
+      sink_spill_.reset(new (std::nothrow) SinkSpillFile);  // NOLINT
+      if (!sink_spill_ || sink_spill_->Init(config_.sink_spill)) {
+        LOG(ERROR) << "cannot initialize sink spill file!";
+        return kInitFailed;
+      }
+    }
+  }
+  if (config_.async_sink) {
+    if (config_.stream_chunks) {
+      LOG(ERROR) << "async_sink is not supported with stream_chunks.";
+      return kInvalidArg;
+    }
+    async_sink_.reset(new (std::nothrow) AsyncSinkAdapter);  // NOLINT
+    const int credit = AsyncSinkAdapter::kDefaultCredit;
+    if (!async_sink_ ||
+        (config_.task_channel < 0 ?
+            async_sink_->Init(ptr_data_sink_, credit) :
+            async_sink_->Init(ptr_data_sink_, credit,
+                              TaskScheduler::Instance(),
+                              config_.task_channel))) {
+      LOG(ERROR) << "cannot initialize async sink adapter!";
+      return kInitFailed;
+    }
+    sink_credit_ = async_sink_->SetCallback(this);
+  }
+  if (config_.thumbnail.interval > 0) {
+    if (config_.video_passthrough || config_.disable_video) {
+      LOG(ERROR) << "thumbnails require encoded video.";
+      return kInvalidArg;
+    }
+    thumbnailer_.reset(new (std::nothrow) Thumbnailer);  // NOLINT
+    if (!thumbnailer_ || thumbnailer_->Init(config_.thumbnail)) {
+      LOG(ERROR) << "cannot initialize thumbnailer!";
+      return kInitFailed;
+    }
+    // Frames are referenced by |raw_shared_frame_|, the thumbnailer and the
+    // quality monitor.
+    if (thumbnail_source_frames_.Init(config_.quality.interval > 0 ? 4 : 3)) {
+      LOG(ERROR) << "SharedFramePool (thumbnail) Init failed!";
+      return kInitFailed;
+    }
+  }
+  if (config_.quality.interval > 0) {
+    if (config_.video_passthrough || config_.disable_video) {
+      LOG(ERROR) << "the quality monitor requires encoded video.";
+      return kInvalidArg;
+    }
+    quality_monitor_.reset(new (std::nothrow) QualityMonitor);  // NOLINT
+    if (!quality_monitor_ || quality_monitor_->Init(config_.quality)) {
+      LOG(ERROR) << "cannot initialize quality monitor!";
+      return kInitFailed;
+    }
+    // Frames are referenced by |raw_shared_frame_| and the quality monitor.
+    if (quality_source_frames_.Init(3)) {
+      LOG(ERROR) << "SharedFramePool (quality) Init failed!";
+      return kInitFailed;
+    }
+  }
+  if (config_.memory_budget < 0) {
+    LOG(ERROR) << "invalid memory budget: " << config_.memory_budget;
+    return kInvalidArg;
+  }
+  if (config_.max_cluster_bytes < 0) {
+    LOG(ERROR) << "invalid max cluster size: " << config_.max_cluster_bytes;
+    return kInvalidArg;
+  }
+  if (config_.muxed_output) {
+    // Muxed clusters normally start at keyframes; while video is dropped by
+    // |kSinkDropVideo| there are none, so clusters are started per segment.
+    int muxed_segment_duration = config_.segment_duration;
+    if (config_.sink_policy == WebmEncoderConfig::kSinkDropVideo &&
+        muxed_segment_duration == 0) {
+      muxed_segment_duration = chunk_duration;
+    }
+    // A size limited cluster can exceed the limit by a frame; a quarter of
+    // the limit is reserved for it.
+    int32 muxed_chunk_size =
+        ExpectedChunkSize(audio_bitrate + video_bitrate, chunk_duration);
+    if (config_.max_cluster_bytes > 0) {
+      muxed_chunk_size = std::min(
+          muxed_chunk_size,
+          config_.max_cluster_bytes + config_.max_cluster_bytes / 4);
+    }
+    status = InitMuxer(muxed_segment_duration, config_.max_cluster_bytes,
+                       kMuxedId, config_.stream_chunks, muxed_chunk_size,
+                       chunk_pool_, &init_segments_, config_.encryption,
+                       &ptr_muxer_);
     if (status) {
       LOG(ERROR) << "InitMuxer failed: " << status;
       return status;
     }
-    audio_muxer = ptr_muxer_.get();
-    video_muxer = ptr_muxer_.get();
+    FollowSegmentSchedule(ptr_muxer_.get());
+    audio_muxers_.push_back(ptr_muxer_.get());
+    video_muxers_.push_back(ptr_muxer_.get());
+  }
+
+  status = InitArena();
+  if (status) {
+    LOG(ERROR) << "InitArena failed: " << status;
+    return status;
   }
 
   if (config_.disable_video == false) {
     config_.actual_video_config = ptr_media_source_->actual_video_config();
 
+    // Crop and padding apply to the captured frames.
+    const VideoConfig& requested = config_.requested_video_config;
+    VideoConfig& actual = config_.actual_video_config;
+    actual.crop_left = requested.crop_left;
+    actual.crop_top = requested.crop_top;
+    actual.crop_width = requested.crop_width;
+    actual.crop_height = requested.crop_height;
+    actual.pad_alignment = requested.pad_alignment;
+    if (!ValidVideoCrop(actual)) {
+      LOG(ERROR) << "video crop " << actual.crop_width << "x"
+                 << actual.crop_height << " at " << actual.crop_left << ","
+                 << actual.crop_top << " or padding " << actual.pad_alignment
+                 << " invalid for " << actual.width << "x" << actual.height
+                 << " capture.";
+      return kInvalidArg;
+    }
+
     // Initialize the video frame pool.
-    const int default_count = BufferPool<VideoFrame>::kDefaultBufferCount;
+    const int default_count = SpscBufferPool<VideoFrame>::kDefaultBufferCount;
     const double& fps = config_.actual_video_config.frame_rate;
 
-    // Buffer up to half a second of video when audio is enabled.
-    // TODO(tomfinegan): Add a VPx frame pool to store compressed frames while
-    //                   waiting for audio instead of throwing memory at the
-    //                   problem.
-    const int num_video_buffers =
-        config_.disable_audio ? default_count : static_cast<int>(fps / 2.0);
-    if (video_pool_.Init(false, num_video_buffers)) {
-      LOG(ERROR) << "BufferPool<VideoFrame> Init failed!";
+    // Decimation is frame rate conversion to a fraction of the capture
+    // rate.
+    if (config_.output_frame_rate <= 0 && config_.vpx_config.decimate > 1) {
+      if (fps > 0) {
+        config_.output_frame_rate = fps / config_.vpx_config.decimate;
+      } else {
+        LOG(WARNING) << "capture frame rate unknown, decimation disabled.";
+      }
+    }
+    if (config_.output_frame_rate > 0 &&
+        frame_rate_converter_.Init(config_.output_frame_rate)) {
+      LOG(ERROR) << "FrameRateConverter Init failed!";
+      return kInitFailed;
+    }
+
+    // Raw frames are compressed as soon as they are read from |video_pool_|,
+    // so only a few uncompressed frames are needed. The frames are allocated
+    // now, sized to the negotiated format, so that the capture thread's first
+    // commits do not allocate. An adaptive depth allocates its largest depth,
+    // and limits the pool to the current one.
+    const PoolDepthSettings& depth_settings = config_.video_pool_depth;
+    if (depth_settings.enabled &&
+        video_pool_depth_.Init(depth_settings, fps, default_count)) {
+      LOG(ERROR) << "PoolDepthController Init failed!";
+      return kInvalidArg;
+    }
+    const int pool_count =
+        depth_settings.enabled ? depth_settings.max_depth : default_count;
+    if (video_pool_.InitPrewarmed(false, pool_count,
+                                  RawFrameSize(config_.actual_video_config),
+                                  arena_)) {
+      LOG(ERROR) << "SpscBufferPool<VideoFrame> Init failed!";
+      return kInitFailed;
+    }
+    video_pool_.set_memory_subsystem(kMemoryVideoInput);
+    if (depth_settings.enabled) {
+      video_pool_.set_limit(video_pool_depth_.depth());
+    }
+    if (config_.video_conversion_threads > 0 &&
+        video_converter_.Init(config_.video_conversion_threads, arena_,
+                              &video_pool_)) {
+      LOG(ERROR) << "VideoConverter Init failed!";
       return kInitFailed;
     }
+    status = InitDeinterlacer();
+    if (status) {
+      return status;
+    }
+#ifdef _WIN32
+    const VideoFormat capture_format = config_.actual_video_config.format;
+    if (config_.gpu_video_processing &&
+        VideoFrame::NeedsConversion(capture_format) &&
+        D3D11VideoProcessor::SupportsFormat(capture_format)) {
+      gpu_converter_ = CreateGpuVideoProcessor("video conversion");
+    }
+#else
+    if (config_.gpu_video_processing) {
+      LOG(WARNING) << "GPU video processing requires Windows, using libyuv.";
+    }
+#endif
 
-    // Initialize the video encoder.
-    status = video_encoder_.Init(config_);
+    // Queue up to one second of compressed video. Video waiting for audio
+    // during interleaving is stored here.
+    const int num_vpx_frames = std::max(default_count, static_cast<int>(fps));
+    if (vpx_pool_.InitPrewarmed(false, num_vpx_frames,
+                                VideoEncoder::InitialFrameBufferSize(config_),
+                                arena_)) {
+      LOG(ERROR) << "SpscBufferPool<VideoFrame> (VPx) Init failed!";
+      return kInitFailed;
+    }
+    vpx_pool_.set_memory_subsystem(kMemoryVideoOutput);
+
+    ResolveRenditionSizes();
+    AssignEncoderCores();
+    status = CalibrateVideoEncoder();
     if (status) {
-      LOG(ERROR) << "video encoder Init failed " << status;
+      return status;
+    }
+
+    // Initialize the video encoder.
+    if (config_.adaptive_resolution && !config_.vpx_config.adaptive_speed) {
+      LOG(INFO) << "adaptive resolution enables adaptive speed.";
+      config_.vpx_config.adaptive_speed = true;
+    }
+    if (!config_.video_passthrough) {
+      status = video_encoder_.Init(config_);
+      if (status) {
+        LOG(ERROR) << "video encoder Init failed " << status;
+        return kInitFailed;
+      }
+    }
+    if (SlateEnabled() && slate_.EncodeVideo(config_)) {
+      LOG(ERROR) << "slate video encode failed.";
       return kInitFailed;
     }
 
     // Add the video track.
-    VideoConfig vpx_video_config = config_.actual_video_config;
+    VideoConfig vpx_video_config =
+        EncodedVideoConfig(config_.actual_video_config);
     vpx_video_config.format = config_.vpx_config.codec;
-    status = video_muxer->AddTrack(vpx_video_config);
-    if (status) {
-      LOG(ERROR) << "live muxer AddTrack(video) failed " << status;
+    for (size_t i = 0; i < video_muxers_.size(); ++i) {
+      if (config_.capture_time_watermarks) {
+        video_muxers_[i]->EnableCaptureTimes();
+      }
+      if (config_.vpx_config.temporal_layers > 1) {
+        video_muxers_[i]->EnableTemporalLayerIds();
+      }
+      status = video_muxers_[i]->AddTrack(vpx_video_config);
+      if (status) {
+        LOG(ERROR) << "live muxer AddTrack(video) failed " << status;
+        return kInitFailed;
+      }
+    }
+    if (archive_ && archive_->AddTrack(vpx_video_config)) {
+      LOG(ERROR) << "archive AddTrack(video) failed.";
       return kInitFailed;
     }
+
+    status = InitRenditions();
+    if (status) {
+      LOG(ERROR) << "InitRenditions failed: " << status;
+      return status;
+    }
+    status = InitCameras();
+    if (status) {
+      LOG(ERROR) << "InitCameras failed: " << status;
+      return status;
+    }
   }
 
   if (config_.disable_audio == false) {
     config_.actual_audio_config = ptr_media_source_->actual_audio_config();
 
-    // Initialize the audio buffer pool.
-    const int num_audio_buffers = BufferPool<AudioBuffer>::kDefaultBufferCount;
-    if (audio_pool_.Init(true, num_audio_buffers)) {
-      LOG(ERROR) << "BufferPool<AudioBuffer> Init failed!";
+    // Initialize the sample ring. It is allocated once, at its full size.
+    if (audio_ring_.Init(config_.actual_audio_config,
+                         config_.audio_ring_duration,
+                         config_.audio_overflow_policy)) {
+      LOG(ERROR) << "PcmRingBuffer Init failed!";
       return kInitFailed;
     }
+    audio_ring_.set_memory_subsystem(kMemoryAudioInput);
 
-    // Initialize the vorbis encoder.
-    status = vorbis_encoder_.Init(config_.actual_audio_config,
-                                  config_.vorbis_config);
+    const int32 compressed_audio_size =
+        config_.audio_codec == kAudioFormatOpus ? kOpusBlockSize :
+                                                  kVorbisBlockSize;
+    if (config_.pipeline_encode &&
+        vorbis_pool_.InitPrewarmed(false, kCompressedAudioPoolSize,
+                                   compressed_audio_size, arena_)) {
+      LOG(ERROR) << "SpscBufferPool<AudioBuffer> (Vorbis) Init failed!";
+      return kInitFailed;
+    }
+    vorbis_pool_.set_memory_subsystem(kMemoryAudioOutput);
+
+    // Create and initialize the audio encoder.
+    if (config_.audio_codec == kAudioFormatOpus) {
+#ifdef WEBMLIVE_HAVE_OPUS
+      audio_encoder_.reset(new (std::nothrow) OpusEncoder());  // NOLINT
+#else
+      LOG(ERROR) << "Opus audio requested, but Opus support is not built.";
+      return kInitFailed;
+#endif
+    } else if (config_.audio_codec == kAudioFormatVorbis) {
+      audio_encoder_.reset(new (std::nothrow) VorbisEncoder());  // NOLINT
+    } else {
+      LOG(ERROR) << "unsupported audio codec " << config_.audio_codec;
+      return kInitFailed;
+    }
+    if (!audio_encoder_) {
+      LOG(ERROR) << "cannot create audio encoder, no memory.";
+      return kNoMemory;
+    }
+    audio_encoder_->set_arena(arena_);
+    status = audio_encoder_->Init(config_);
     if (status) {
       LOG(ERROR) << "audio encoder Init failed " << status;
       return kInitFailed;
     }
+    config_.encoded_audio_config = *audio_encoder_->audio_config();
+
+    if (config_.audio_levels.enabled) {
+      audio_level_meter_.reset(new (std::nothrow) AudioLevelMeter);  // NOLINT
+      if (!audio_level_meter_) {
+        LOG(ERROR) << "cannot create audio level meter, no memory.";
+        return kNoMemory;
+      }
+      if (audio_level_meter_->Init(config_.actual_audio_config,
+                                   config_.audio_levels)) {
+        LOG(ERROR) << "AudioLevelMeter Init failed!";
+        return kInitFailed;
+      }
+    }
+
+    if (config_.audio_drift.enabled) {
+      audio_drift_corrector_.reset(
+          new (std::nothrow) AudioDriftCorrector);  // NOLINT
+      if (!audio_drift_corrector_) {
+        LOG(ERROR) << "cannot create audio drift corrector, no memory.";
+        return kNoMemory;
+      }
+      if (audio_drift_corrector_->Init(config_.actual_audio_config,
+                                       config_.audio_drift)) {
+        LOG(ERROR) << "AudioDriftCorrector Init failed!";
+        return kInitFailed;
+      }
+    }
 
     // Fill in the private data structure.
-    VorbisCodecPrivate codec_private;
-    codec_private.ptr_ident = vorbis_encoder_.ident_header();
-    codec_private.ident_length = vorbis_encoder_.ident_header_length();
-    codec_private.ptr_comments = vorbis_encoder_.comments_header();
-    codec_private.comments_length = vorbis_encoder_.comments_header_length();
-    codec_private.ptr_setup = vorbis_encoder_.setup_header();
-    codec_private.setup_length = vorbis_encoder_.setup_header_length();
-
-    // Add the vorbis track.
-    status = audio_muxer->AddTrack(config_.actual_audio_config, codec_private);
-    if (status) {
-      LOG(ERROR) << "live muxer AddTrack(audio) failed " << status;
+    AudioCodecPrivate codec_private;
+    status = audio_encoder_->GetCodecPrivate(&codec_private);
+    if (status) {
+      LOG(ERROR) << "audio encoder GetCodecPrivate failed " << status;
+      return kInitFailed;
+    }
+    if (SlateEnabled()) {
+      status = InitAudioSlate();
+      if (status) {
+        return status;
+      }
+    }
+
+    // Add the audio track.
+    for (size_t i = 0; i < audio_muxers_.size(); ++i) {
+      status = audio_muxers_[i]->AddTrack(config_.encoded_audio_config,
+                                          codec_private);
+      if (status) {
+        LOG(ERROR) << "live muxer AddTrack(audio) failed " << status;
+        return kInitFailed;
+      }
+    }
+    if (archive_ &&
+        archive_->AddTrack(config_.encoded_audio_config, codec_private)) {
+      LOG(ERROR) << "archive AddTrack(audio) failed.";
       return kInitFailed;
     }
+    status = InitAudioRenditions();
+    if (status) {
+      LOG(ERROR) << "InitAudioRenditions failed: " << status;
+      return status;
+    }
   }
 
-  if (config_.dash_encode) {
-    ptr_encode_func_ = &WebmEncoder::DashEncode;
+  if (config_.text_track.enabled) {
+    if (!ptr_muxer_) {
+      LOG(ERROR) << "a text track requires the muxed stream.";
+      return kInvalidArg;
+    }
+    text_source_.reset(new (std::nothrow) TextTrackSource);  // NOLINT
+    if (!text_source_ || text_source_->Init(config_.text_track)) {
+      LOG(ERROR) << "cannot initialize text track source!";
+      return kInitFailed;
+    }
+    status = ptr_muxer_->AddTrack(config_.text_track, &text_track_);
+    if (status) {
+      LOG(ERROR) << "live muxer AddTrack(text) failed " << status;
+      return kInitFailed;
+    }
+  }
+
+  interleaver_.set_audio_midpoints(config_.align_segments);
+  if (interleaver_.Init(!config_.disable_audio, !config_.disable_video,
+                        config_.max_interleave_latency,
+                        config_.interleave_stream_timeout)) {
+    LOG(ERROR) << "cannot initialize A/V interleaver!";
+    return kInitFailed;
+  }
+
+  if (config_.pipeline_encode) {
+    ptr_encode_func_ = &WebmEncoder::PipelineMux;
+  } else if (config_.dash_encode) {
+    ptr_encode_func_ = &WebmEncoder::InterleavedEncode;
   } else if (config_.disable_audio) {
-    ptr_encode_func_ = &WebmEncoder::EncodeVideoFrame;
+    ptr_encode_func_ = &WebmEncoder::EncodeVideoOnly;
   } else if (config_.disable_video) {
     ptr_encode_func_ = &WebmEncoder::EncodeAudioOnly;
   } else {
-    ptr_encode_func_ = &WebmEncoder::AVEncode;
+    ptr_encode_func_ = &WebmEncoder::InterleavedEncode;
+  }
+
+  status = InitChunkDrains();
+  if (status) {
+    LOG(ERROR) << "InitChunkDrains failed: " << status;
+    return status;
   }
 
   initialized_ = true;
@@ -279,627 +1209,4488 @@ int WebmEncoder::Run() {
 }
 
 // Sets |stop_| to true and calls join on |encode_thread_| to wait for
-// |EncoderThread| to finish.
+// |EncoderThread| to finish. |EncoderThread| stops waiting on its outputs
+// once |WebmEncoderConfig::stop_timeout| expires.
 void WebmEncoder::Stop() {
   CHECK(encode_thread_);
   mutex_.lock();
   stop_ = true;
+  stop_time_ = std::chrono::steady_clock::now();
   mutex_.unlock();
   encode_thread_->join();
+  ShutdownStats shutdown_stats;
+  GetShutdownStats(&shutdown_stats);
+  LOG(INFO) << "shutdown: flushed in " << shutdown_stats.flush_ms << " ms,"
+            << " final_chunks=" << shutdown_stats.final_chunks;
+  if (shutdown_stats.timed_out) {
+    LOG(WARNING) << "shutdown deadline of " << config_.stop_timeout
+                 << " ms expired, abandoned:"
+                 << " frames=" << shutdown_stats.frames_abandoned
+                 << " sink_chunks=" << shutdown_stats.sink_chunks_abandoned
+                 << " sink_bytes=" << shutdown_stats.sink_bytes_abandoned
+                 << " files=" << shutdown_stats.files_abandoned;
+  }
+  if (ptr_muxer_ && config_.max_cluster_bytes > 0) {
+    LOG(INFO) << "muxed clusters: started=" << ptr_muxer_->clusters_started()
+              << " split=" << ptr_muxer_->clusters_split();
+  }
+  if (dash_server_) {
+    DashOriginServerStats server_stats;
+    dash_server_->GetStats(&server_stats);
+    LOG(INFO) << "DashOriginServer stats:"
+              << " requests=" << server_stats.requests
+              << " not_found=" << server_stats.not_found
+              << " waits=" << server_stats.waits
+              << " time_requests=" << server_stats.time_requests
+              << " segments_held=" << server_stats.segments_held
+              << " bytes_held=" << server_stats.bytes_held
+              << " bytes_sent=" << server_stats.bytes_sent;
+    dash_server_->Stop();
+  }
+  if (segment_ring_) {
+    SegmentRingStats ring_stats;
+    segment_ring_->GetStats(&ring_stats);
+    LOG(INFO) << "SegmentRingWriter stats:"
+              << " segments_written=" << ring_stats.segments_written
+              << " bytes_written=" << ring_stats.bytes_written
+              << " segments_evicted=" << ring_stats.segments_evicted
+              << " segments_dropped=" << ring_stats.segments_dropped
+              << " segments_overrun=" << ring_stats.segments_overrun
+              << " segments_skipped=" << ring_stats.segments_skipped
+              << " last_segment_id=" << ring_stats.last_segment_id;
+  }
+  SegmentAlignerStats align_stats;
+  if (GetSegmentAlignmentStats(&align_stats) == kSuccess) {
+    LOG(INFO) << "SegmentAligner stats:"
+              << " boundaries=" << align_stats.boundaries
+              << " audio_cuts=" << align_stats.audio_cuts
+              << " merged_boundaries=" << align_stats.merged_boundaries
+              << " max_offset_ms=" << align_stats.max_offset_ms;
+  }
+  MediaArenaStats arena_stats;
+  if (GetArenaStats(&arena_stats) == kSuccess) {
+    LOG(INFO) << "MediaArena stats:"
+              << " slabs=" << arena_stats.slabs
+              << " slab_bytes=" << arena_stats.slab_bytes
+              << " large_page_bytes=" << arena_stats.large_page_bytes
+              << " huge_page_bytes=" << arena_stats.huge_page_bytes
+              << " large_page_fallbacks=" << arena_stats.large_page_fallbacks
+              << " node_bytes=" << arena_stats.node_bytes
+              << " blocks_in_use=" << arena_stats.blocks_in_use
+              << " heap_allocations=" << arena_stats.heap_allocations;
+  }
+  if (chunk_pool_) {
+    WebmChunkDataPoolStats chunk_pool_stats;
+    chunk_pool_->GetStats(&chunk_pool_stats);
+    LOG(INFO) << "WebmChunkDataPool stats:"
+              << " acquires=" << chunk_pool_stats.acquires
+              << " reuses=" << chunk_pool_stats.reuses
+              << " drops=" << chunk_pool_stats.drops
+              << " free_buffers=" << chunk_pool_stats.free_buffers
+              << " free_bytes=" << chunk_pool_stats.free_bytes;
+  }
+  InitSegmentCacheStats init_segment_stats;
+  init_segments_.GetStats(&init_segment_stats);
+  LOG(INFO) << "InitSegmentCache stats:"
+            << " versions=" << init_segment_stats.versions
+            << " shared=" << init_segment_stats.shared
+            << " evicted=" << init_segment_stats.evicted;
 }
 
-// Returns encoded duration in seconds.
-int64 WebmEncoder::encoded_duration() const {
+int WebmEncoder::Pause() {
   std::lock_guard<std::mutex> lock(mutex_);
-  return encoded_duration_;
-}
+  if (!paused_) {
+    paused_ = true;
+    ++pauses_;
+    LOG(INFO) << "encoder paused.";
+  }
+  return kSuccess;
+}
+
+int WebmEncoder::Resume() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (paused_) {
+    resume_pending_ = true;
+    ++resumes_;
+    paused_ = false;
+    LOG(INFO) << "encoder resumed; " << paused_frames_.load()
+              << " frames and " << paused_audio_buffers_.load()
+              << " audio buffers discarded while paused.";
+  }
+  return kSuccess;
+}
+
+int WebmEncoder::SpliceClip(const std::string& path) {
+  if (!initialized_) {
+    LOG(ERROR) << "cannot splice before Init.";
+    return kInvalidArg;
+  }
+  std::shared_ptr<WebmSpliceClip> clip(
+      new (std::nothrow) WebmSpliceClip());  // NOLINT
+  if (!clip) {
+    LOG(ERROR) << "out of memory.";
+    return kNoMemory;
+  }
+  if (clip->Load(path)) {
+    LOG(ERROR) << "cannot load splice clip " << path;
+    return kInvalidArg;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (paused_ || pending_splice_) {
+    LOG(ERROR) << "cannot splice " << path << " while paused or splicing.";
+    return kInvalidArg;
+  }
+  pending_splice_ = clip;
+  paused_ = true;
+  ++pauses_;
+  LOG(INFO) << "encoder paused to splice " << path << ".";
+  return kSuccess;
+}
+
+int WebmEncoder::GetPauseStats(PauseStats* ptr_stats) const {
+  if (!ptr_stats) {
+    return kInvalidArg;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  ptr_stats->paused = paused_;
+  ptr_stats->pauses = pauses_;
+  ptr_stats->removed_ms = pause_offset_;
+  ptr_stats->frames_discarded = paused_frames_;
+  ptr_stats->audio_buffers_discarded = paused_audio_buffers_;
+  return kSuccess;
+}
+
+// Returns encoded duration in seconds.
+int64 WebmEncoder::encoded_duration() const {
+  return encoded_duration_.load(std::memory_order_relaxed);
+}
+
+int WebmEncoder::GetFileWriterStats(FileWriterStats* ptr_stats) {
+  if (file_writer_.GetStats(ptr_stats)) {
+    return kInvalidArg;
+  }
+  return kSuccess;
+}
+
+int WebmEncoder::GetDashServerStats(DashOriginServerStats* ptr_stats) {
+  if (!dash_server_ || dash_server_->GetStats(ptr_stats)) {
+    return kInvalidArg;
+  }
+  return kSuccess;
+}
+
+int WebmEncoder::GetVideoDropStats(VideoDropStats* ptr_stats) const {
+  if (!ptr_stats) {
+    return kInvalidArg;
+  }
+  ptr_stats->frames_captured = frames_captured_.load();
+  ptr_stats->queue_full_drops =
+      queue_full_drops_.load() + video_converter_.frames_dropped();
+  ptr_stats->stale_drops = stale_drops_.load();
+  ptr_stats->encoder_drops = encoder_drops_.load();
+  ptr_stats->degradation_drops = degradation_drops_.load();
+  return kSuccess;
+}
+
+int WebmEncoder::GetTimestampStats(CaptureTimestampStats* ptr_stats) const {
+  if (!ptr_stats) {
+    return kInvalidArg;
+  }
+  video_regulator_.GetStats(&ptr_stats->video);
+  audio_regulator_.GetStats(&ptr_stats->audio);
+  return kSuccess;
+}
+
+int WebmEncoder::GetFrameRateStats(FrameRateConverterStats* ptr_stats) const {
+  if (!ptr_stats || config_.output_frame_rate <= 0) {
+    return kInvalidArg;
+  }
+  frame_rate_converter_.GetStats(ptr_stats);
+  return kSuccess;
+}
+
+int WebmEncoder::GetSegmentAlignmentStats(
+    SegmentAlignerStats* ptr_stats) const {
+  if (!ptr_stats || !segment_aligner_) {
+    return kInvalidArg;
+  }
+  segment_aligner_->GetStats(ptr_stats);
+  return kSuccess;
+}
+
+int WebmEncoder::GetSegmentRateStats(SegmentRateStats* ptr_stats) const {
+  if (!ptr_stats || !segment_rate_) {
+    return kInvalidArg;
+  }
+  segment_rate_->GetStats(ptr_stats);
+  return kSuccess;
+}
+
+int WebmEncoder::GetSegmentDurationStats(
+    SegmentDurationStats* ptr_stats) const {
+  if (!ptr_stats || !segment_durations_) {
+    return kInvalidArg;
+  }
+  segment_durations_->GetStats(ptr_stats);
+  return kSuccess;
+}
+
+int WebmEncoder::GetThumbnailStats(ThumbnailStats* ptr_stats) const {
+  if (!ptr_stats || !thumbnailer_) {
+    return kInvalidArg;
+  }
+  thumbnailer_->GetStats(ptr_stats);
+  return kSuccess;
+}
+
+int WebmEncoder::GetQualityStats(QualityStats* ptr_stats) const {
+  if (!ptr_stats || !quality_monitor_) {
+    return kInvalidArg;
+  }
+  quality_monitor_->GetStats(ptr_stats);
+  return kSuccess;
+}
+
+int WebmEncoder::GetAudioLevelStats(AudioLevelStats* ptr_stats) const {
+  if (!ptr_stats || !audio_level_meter_) {
+    return kInvalidArg;
+  }
+  audio_level_meter_->GetStats(ptr_stats);
+  return kSuccess;
+}
+
+int WebmEncoder::GetAudioDriftStats(AudioDriftStats* ptr_stats) const {
+  if (!ptr_stats || !audio_drift_corrector_) {
+    return kInvalidArg;
+  }
+  audio_drift_corrector_->GetStats(ptr_stats);
+  return kSuccess;
+}
+
+int WebmEncoder::GetEncryptionStats(EncryptionStats* ptr_stats) const {
+  if (!ptr_stats || !config_.encryption.enabled) {
+    return kInvalidArg;
+  }
+  // Every muxer encrypts its own blocks and rotates the same keys.
+  *ptr_stats = EncryptionStats();
+  std::vector<const LiveWebmMuxer*> muxers(audio_muxers_.begin(),
+                                           audio_muxers_.end());
+  muxers.insert(muxers.end(), video_muxers_.begin(), video_muxers_.end());
+  for (size_t i = 0; i < renditions_.size(); ++i) {
+    muxers.push_back(renditions_[i]->muxer.get());
+  }
+  for (size_t i = 0; i < audio_renditions_.size(); ++i) {
+    muxers.push_back(audio_renditions_[i]->muxer.get());
+  }
+  std::sort(muxers.begin(), muxers.end());
+  muxers.erase(std::unique(muxers.begin(), muxers.end()), muxers.end());
+  for (size_t i = 0; i < muxers.size(); ++i) {
+    EncryptionStats stats;
+    if (muxers[i]->GetEncryptionStats(&stats) != LiveWebmMuxer::kSuccess) {
+      continue;
+    }
+    ptr_stats->blocks_encrypted += stats.blocks_encrypted;
+    ptr_stats->bytes_encrypted += stats.bytes_encrypted;
+    ptr_stats->key_rotations =
+        std::max(ptr_stats->key_rotations, stats.key_rotations);
+  }
+  return kSuccess;
+}
+
+int WebmEncoder::GetTextTrackStats(TextTrackStats* ptr_stats) const {
+  if (!ptr_stats || !text_source_) {
+    return kInvalidArg;
+  }
+  text_source_->GetStats(ptr_stats);
+  return kSuccess;
+}
+
+int WebmEncoder::GetCaptureWatchdogStats(
+    CaptureWatchdogStats* ptr_stats) const {
+  if (!ptr_stats || !watchdog_) {
+    return kInvalidArg;
+  }
+  watchdog_->GetStats(ptr_stats);
+  return kSuccess;
+}
+
+int WebmEncoder::GetRepresentationStats(
+    std::vector<RepresentationStats>* ptr_stats) const {
+  if (!ptr_stats) {
+    return kInvalidArg;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!dash_writer_ || !config_.dash_encode) {
+    return kInvalidArg;
+  }
+  dash_writer_->GetRepresentationStats(ptr_stats);
+  return kSuccess;
+}
+
+int WebmEncoder::GetMuxerStats(std::vector<MuxerStats>* ptr_stats) const {
+  if (!ptr_stats) {
+    return kInvalidArg;
+  }
+  // Without DASH one muxer holds the audio and video tracks; each muxer is
+  // reported once, in order.
+  std::vector<const LiveWebmMuxer*> candidates(audio_muxers_.begin(),
+                                               audio_muxers_.end());
+  candidates.insert(candidates.end(), video_muxers_.begin(),
+                    video_muxers_.end());
+  for (size_t i = 0; i < renditions_.size(); ++i) {
+    candidates.push_back(renditions_[i]->muxer.get());
+  }
+  for (size_t i = 0; i < audio_renditions_.size(); ++i) {
+    candidates.push_back(audio_renditions_[i]->muxer.get());
+  }
+  std::vector<const LiveWebmMuxer*> muxers;
+  for (size_t i = 0; i < candidates.size(); ++i) {
+    if (candidates[i] &&
+        std::find(muxers.begin(), muxers.end(), candidates[i]) ==
+            muxers.end()) {
+      muxers.push_back(candidates[i]);
+    }
+  }
+  ptr_stats->resize(muxers.size());
+  for (size_t i = 0; i < muxers.size(); ++i) {
+    muxers[i]->GetMuxerStats(&(*ptr_stats)[i]);
+  }
+  return kSuccess;
+}
+
+int WebmEncoder::GetEncodeStats(EncodeStats* ptr_stats) const {
+  if (!ptr_stats) {
+    return kInvalidArg;
+  }
+  ptr_stats->video_frames_encoded = video_frames_encoded_.load();
+  ptr_stats->video_encode_us = video_encode_us_.load();
+  ptr_stats->audio_buffers_encoded = audio_buffers_encoded_.load();
+  ptr_stats->audio_encode_us = audio_encode_us_.load();
+  ptr_stats->video_bytes = video_bytes_.load();
+  ptr_stats->audio_bytes = audio_bytes_.load();
+  ptr_stats->video_degradation_level = degradation_level_.load();
+  ptr_stats->video_degradation_changes = degradation_changes_.load();
+  ptr_stats->video_keyframe_requests = video_encoder_.keyframes_requested();
+  ptr_stats->video_forced_keyframes = video_encoder_.keyframes_forced();
+  ptr_stats->video_scene_cut_keyframes = video_encoder_.scene_cut_keyframes();
+  return kSuccess;
+}
+
+int WebmEncoder::GetFrameProfileStats(FrameProfileStats* ptr_stats) const {
+  if (!ptr_stats) {
+    return kInvalidArg;
+  }
+  video_encoder_.GetFrameProfileStats(ptr_stats);
+  return kSuccess;
+}
+
+int WebmEncoder::GetStartupStats(StartupStats* ptr_stats) const {
+  if (!ptr_stats) {
+    return kInvalidArg;
+  }
+  ptr_stats->device_open_ms = device_open_ms_.load();
+  ptr_stats->graph_run_ms = graph_run_ms_.load();
+  ptr_stats->first_audio_ms = first_audio_ms_.load();
+  ptr_stats->first_video_ms = first_video_ms_.load();
+  ptr_stats->first_chunk_ms = first_chunk_ms_.load();
+  return kSuccess;
+}
+
+int WebmEncoder::GetSinkStats(SinkStats* ptr_stats) const {
+  if (!ptr_stats) {
+    return kInvalidArg;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  *ptr_stats = sink_stats_;
+  return kSuccess;
+}
+
+int WebmEncoder::GetPoolStats(EncoderPoolStats* ptr_stats) const {
+  if (!ptr_stats) {
+    return kInvalidArg;
+  }
+  video_pool_.GetStats(&ptr_stats->video_input);
+  audio_ring_.GetStats(&ptr_stats->audio_input);
+  vpx_pool_.GetStats(&ptr_stats->video_output);
+  vorbis_pool_.GetStats(&ptr_stats->audio_output);
+  scale_pool_.GetStats(&ptr_stats->scaler);
+  audio_encode_stage_.GetStats(&ptr_stats->audio_encoder);
+  video_encode_stage_.GetStats(&ptr_stats->video_encoder);
+  return kSuccess;
+}
+
+int WebmEncoder::GetArenaStats(MediaArenaStats* ptr_stats) const {
+  if (!ptr_stats || !arena_) {
+    return kInvalidArg;
+  }
+  arena_->GetStats(ptr_stats);
+  for (size_t i = 0; i < renditions_.size(); ++i) {
+    const MediaArena* const ptr_arena = renditions_[i]->arena.get();
+    if (ptr_arena == arena_.get()) {
+      continue;
+    }
+    MediaArenaStats rendition_stats;
+    ptr_arena->GetStats(&rendition_stats);
+    ptr_stats->slabs += rendition_stats.slabs;
+    ptr_stats->slab_bytes += rendition_stats.slab_bytes;
+    ptr_stats->large_page_bytes += rendition_stats.large_page_bytes;
+    ptr_stats->huge_page_bytes += rendition_stats.huge_page_bytes;
+    ptr_stats->large_page_fallbacks += rendition_stats.large_page_fallbacks;
+    ptr_stats->node_bytes += rendition_stats.node_bytes;
+    ptr_stats->blocks_in_use += rendition_stats.blocks_in_use;
+    ptr_stats->bytes_in_use += rendition_stats.bytes_in_use;
+    ptr_stats->heap_allocations += rendition_stats.heap_allocations;
+  }
+  return kSuccess;
+}
+
+int WebmEncoder::GetShutdownStats(ShutdownStats* ptr_stats) const {
+  if (!ptr_stats) {
+    return kInvalidArg;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  *ptr_stats = shutdown_stats_;
+  return kSuccess;
+}
+
+int WebmEncoder::SetTargetBitrate(int video_bitrate, int audio_bitrate) {
+  if (video_bitrate < 0 || audio_bitrate < 0) {
+    return kInvalidArg;
+  }
+  if (video_bitrate > 0 && !config_.disable_video) {
+    requested_video_bitrate_.store(video_bitrate);
+  }
+  if (audio_bitrate > 0 && !config_.disable_audio) {
+    requested_audio_bitrate_.store(audio_bitrate);
+  }
+  return kSuccess;
+}
+
+int WebmEncoder::RotateEncryptionKey(const std::string& key) {
+  if (!config_.encryption.enabled ||
+      key.length() != EncryptionSettings::kKeySize) {
+    LOG(ERROR) << "cannot RotateEncryptionKey: "
+               << (config_.encryption.enabled ? "invalid key." :
+                   "encryption is disabled.");
+    return kInvalidArg;
+  }
+  for (size_t i = 0; i < audio_muxers_.size(); ++i) {
+    audio_muxers_[i]->RotateEncryptionKey(key);
+  }
+  for (size_t i = 0; i < video_muxers_.size(); ++i) {
+    video_muxers_[i]->RotateEncryptionKey(key);
+  }
+  for (size_t i = 0; i < renditions_.size(); ++i) {
+    renditions_[i]->muxer->RotateEncryptionKey(key);
+  }
+  for (size_t i = 0; i < audio_renditions_.size(); ++i) {
+    audio_renditions_[i]->muxer->RotateEncryptionKey(key);
+  }
+  return kSuccess;
+}
+
+int WebmEncoder::AddTextCue(const TextCue& cue) {
+  if (!text_source_) {
+    LOG(ERROR) << "cannot AddTextCue without a text track.";
+    return kInvalidArg;
+  }
+  return text_source_->AddCue(cue) ? kSuccess : kNoMemory;
+}
+
+int WebmEncoder::Reconfigure(const EncoderReconfiguration& reconfig) {
+  // VP8 and VP9 speeds range from -16 to 16.
+  const int kMaxSpeed = 16;
+  const int kUnchanged = EncoderReconfiguration::kUnchanged;
+  if ((reconfig.video_bitrate != kUnchanged && reconfig.video_bitrate <= 0) ||
+      (reconfig.audio_bitrate != kUnchanged && reconfig.audio_bitrate <= 0) ||
+      (reconfig.video_speed != kUnchanged &&
+       std::abs(reconfig.video_speed) > kMaxSpeed) ||
+      (reconfig.keyframe_interval != kUnchanged &&
+       reconfig.keyframe_interval <= 0)) {
+    LOG(ERROR) << "invalid encoder reconfiguration.";
+    return kInvalidArg;
+  }
+  if (reconfig.audio_bitrate != kUnchanged && !config_.disable_audio) {
+    requested_audio_bitrate_.store(reconfig.audio_bitrate);
+  }
+  if (config_.disable_video) {
+    return kSuccess;
+  }
+  if (reconfig.video_bitrate != kUnchanged) {
+    requested_video_bitrate_.store(reconfig.video_bitrate);
+  }
+  if (reconfig.video_speed != kUnchanged) {
+    requested_video_speed_.store(reconfig.video_speed);
+    for (size_t i = 0; i < renditions_.size(); ++i) {
+      renditions_[i]->requested_speed.store(reconfig.video_speed);
+    }
+  }
+  if (reconfig.keyframe_interval != kUnchanged) {
+    requested_keyframe_interval_.store(reconfig.keyframe_interval);
+    for (size_t i = 0; i < renditions_.size(); ++i) {
+      renditions_[i]->requested_keyframe_interval.store(
+          reconfig.keyframe_interval);
+    }
+  }
+  return kSuccess;
+}
+
+int WebmEncoder::RequestKeyframe() {
+  // Passed through video has the source's keyframes.
+  if (config_.disable_video || config_.video_passthrough) {
+    return kInvalidArg;
+  }
+  video_encoder_.RequestKeyframe();
+  for (size_t i = 0; i < renditions_.size(); ++i) {
+    renditions_[i]->encoder.RequestKeyframe();
+  }
+  return kSuccess;
+}
+
+int WebmEncoder::SetRegionsOfInterest(
+    const std::vector<RegionOfInterest>& regions) {
+  if (config_.disable_video) {
+    return kInvalidArg;
+  }
+  if (video_encoder_.SetRegionsOfInterest(regions)) {
+    return kInvalidArg;
+  }
+  // Regions are in the coordinates of the primary capture, which cameras do
+  // not share.
+  for (size_t i = 0; i < renditions_.size(); ++i) {
+    if (renditions_[i]->camera == 0) {
+      renditions_[i]->encoder.SetRegionsOfInterest(regions);
+    }
+  }
+  return kSuccess;
+}
+
+int WebmEncoder::GetBitrateChanges(
+    std::vector<BitrateChange>* ptr_changes) const {
+  if (!ptr_changes) {
+    return kInvalidArg;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  *ptr_changes = bitrate_changes_;
+  return kSuccess;
+}
+
+// AudioSamplesCallbackInterface
+int WebmEncoder::OnSamplesReceived(AudioBuffer* ptr_buffer) {
+  if (watchdog_) {
+    watchdog_->OnAudioBuffer(ptr_buffer);
+  }
+  if (paused_) {
+    ++paused_audio_buffers_;
+    return kSuccess;
+  }
+
+  // The nominal period of a buffer is the duration of its samples.
+  const AudioConfig& audio_config = ptr_buffer->config();
+  const int block_align = audio_config.block_align ?
+      audio_config.block_align :
+      audio_config.channels * audio_config.bits_per_sample / 8;
+  const double period =
+      block_align > 0 && audio_config.sample_rate > 0 ?
+      ptr_buffer->buffer_length() / block_align * 1000.0 /
+          audio_config.sample_rate : 0;
+  ptr_buffer->set_timestamp(
+      ShiftCaptureTimestamp(ptr_buffer->timestamp(),
+                            static_cast<int64>(period + 0.5),
+                            &audio_timeline_));
+  if (config_.regulate_timestamps) {
+    ptr_buffer->set_timestamp(
+        audio_regulator_.Regulate(ptr_buffer->timestamp(), period, NULL));
+  }
+  const int64 timestamp = ptr_buffer->timestamp();
+  WEBMLIVE_TRACE_LATENCY(kLatencyAudio, kLatencyReceived, timestamp);
+  if (capture_dump_.is_open()) {
+    capture_dump_.WriteAudioBuffer(*ptr_buffer);
+  }
+  const int status = audio_ring_.Write(timestamp, ptr_buffer->buffer(),
+                                       ptr_buffer->buffer_length());
+  if (status == PcmRingBuffer::kDroppedOldest) {
+    WEBMLIVE_LOG_EVERY_MS(WARNING, kLogIntervalMs)
+        << "PCM ring full, dropped the oldest audio.";
+  } else if (status) {
+    if (status == PcmRingBuffer::kFull) {
+      WEBMLIVE_LOG_ERROR_EVERY_MS(kLogIntervalMs)
+          << "PCM ring full, dropped audio buffer.";
+    } else {
+      LOG(ERROR) << "PCM ring Write failed! " << status;
+    }
+    return AudioSamplesCallbackInterface::kNoMemory;
+  }
+  WEBMLIVE_TRACE_LATENCY(kLatencyAudio, kLatencyCommitted, timestamp);
+  if (first_audio_ms_.load(std::memory_order_relaxed) < 0) {
+    RecordStartupPhase(&first_audio_ms_);
+  }
+  WEBMLIVE_HOT_LOG(INFO) << "OnSamplesReceived committed an audio buffer.";
+  return kSuccess;
+}
+
+// VideoFrameCallbackInterface
+int WebmEncoder::OnVideoFrameReceived(VideoFrame* ptr_frame) {
+  ++frames_captured_;
+  if (watchdog_) {
+    return watchdog_->DeliverVideoFrame(ptr_frame);
+  }
+  return ReceiveVideoFrame(ptr_frame);
+}
+
+int WebmEncoder::ReceiveVideoFrame(VideoFrame* ptr_frame) {
+  if (paused_) {
+    ++paused_frames_;
+    return kSuccess;
+  }
+
+  // Sources that report no frame rate fall back to the frame's duration.
+  const double frame_rate = config_.actual_video_config.frame_rate;
+  const double period = frame_rate > 0 ?
+      1000.0 / frame_rate : static_cast<double>(ptr_frame->duration());
+  ptr_frame->set_timestamp(
+      ShiftCaptureTimestamp(ptr_frame->timestamp(),
+                            static_cast<int64>(period + 0.5),
+                            &video_timeline_));
+  if (config_.regulate_timestamps) {
+    int64 duration = 0;
+    ptr_frame->set_timestamp(
+        video_regulator_.Regulate(ptr_frame->timestamp(), period, &duration));
+    if (duration > 0) {
+      ptr_frame->set_duration(duration);
+    }
+  }
+
+  // Frames beyond the output rate are dropped before any work is spent
+  // converting or queueing them.
+  if (config_.output_frame_rate > 0) {
+    int64 timestamp = 0;
+    int64 duration = 0;
+    if (!frame_rate_converter_.Convert(ptr_frame->timestamp(), &timestamp,
+                                       &duration)) {
+      return VideoFrameCallbackInterface::kDropped;
+    }
+    ptr_frame->set_timestamp(timestamp);
+    ptr_frame->set_duration(duration);
+  }
+
+  // |Commit()| and |Submit()| may swap |ptr_frame|'s contents; read the
+  // timestamp first.
+  const int64 timestamp = ptr_frame->timestamp();
+  WEBMLIVE_TRACE_LATENCY(kLatencyVideo, kLatencyReceived, timestamp);
+  if (capture_dump_.is_open()) {
+    capture_dump_.WriteVideoFrame(*ptr_frame);
+  }
+  if (config_.capture_time_watermarks) {
+    ptr_frame->set_capture_time(
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count());
+  }
+  VideoFrame* ptr_input_frame = ptr_frame;
+#ifdef _WIN32
+  if (gpu_converter_ && VideoFrame::NeedsConversion(ptr_frame->format())) {
+    D3D11VideoProcessor::Target target;
+    target.width = ptr_frame->width();
+    target.height = abs(ptr_frame->height());
+    target.ptr_frame = &converted_frame_;
+    const int status = gpu_converter_->Process(*ptr_frame, 1, &target);
+    if (status == D3D11VideoProcessor::kSuccess) {
+      ptr_input_frame = &converted_frame_;
+    } else {
+      LOG(WARNING) << "GPU video conversion failed (" << status
+                   << "), using libyuv.";
+      gpu_converter_.reset();
+    }
+  }
+#endif  // _WIN32
+  if (ptr_input_frame == ptr_frame &&
+      VideoFrame::NeedsConversion(ptr_frame->format())) {
+    if (config_.video_conversion_threads > 0) {
+      if (video_converter_.Submit(ptr_frame)) {
+        ++queue_full_drops_;
+        WEBMLIVE_LOG_EVERY_MS(WARNING, kLogIntervalMs)
+            << "VideoConverter dropped frame (no free slots).";
+        return VideoFrameCallbackInterface::kDropped;
+      }
+      newest_video_timestamp_.store(timestamp, std::memory_order_release);
+      if (first_video_ms_.load(std::memory_order_relaxed) < 0) {
+        RecordStartupPhase(&first_video_ms_);
+      }
+      WEBMLIVE_HOT_LOG(INFO)
+          << "OnVideoFrameReceived submitted a frame for conversion.";
+      return kSuccess;
+    }
+    if (converted_frame_.InitConverted(*ptr_frame)) {
+      LOG(ERROR) << "OnVideoFrameReceived frame conversion failed.";
+      ++queue_full_drops_;
+      return VideoFrameCallbackInterface::kDropped;
+    }
+    ptr_input_frame = &converted_frame_;
+  }
+  // Frames that went through |video_converter_| were deinterlaced by its
+  // workers.
+  if (deinterlacer_) {
+    deinterlacer_->Deinterlace(ptr_input_frame);
+  }
+  if (config_.video_conversion_threads > 0) {
+    // |video_pool_| has a single producer: the converter's commit thread
+    // commits these frames too, after those still converting.
+    if (video_converter_.SubmitConverted(ptr_input_frame)) {
+      ++queue_full_drops_;
+      WEBMLIVE_LOG_EVERY_MS(WARNING, kLogIntervalMs)
+          << "VideoConverter dropped frame (no free slots).";
+      return VideoFrameCallbackInterface::kDropped;
+    }
+    newest_video_timestamp_.store(timestamp, std::memory_order_release);
+    if (first_video_ms_.load(std::memory_order_relaxed) < 0) {
+      RecordStartupPhase(&first_video_ms_);
+    }
+    WEBMLIVE_HOT_LOG(INFO)
+        << "OnVideoFrameReceived passed a frame to the converter.";
+    return kSuccess;
+  }
+  const int status = video_pool_.Commit(ptr_input_frame);
+  if (status) {
+    if (status != SpscBufferPool<VideoFrame>::kFull) {
+      LOG(ERROR) << "VideoFrame pool Commit failed: " << status;
+    }
+    ++queue_full_drops_;
+    WEBMLIVE_LOG_EVERY_MS(WARNING, kLogIntervalMs)
+        << "VideoFrame pool dropped frame (no buffers).";
+    return VideoFrameCallbackInterface::kDropped;
+  }
+  WEBMLIVE_TRACE_LATENCY(kLatencyVideo, kLatencyCommitted, timestamp);
+  newest_video_timestamp_.store(timestamp, std::memory_order_release);
+  if (first_video_ms_.load(std::memory_order_relaxed) < 0) {
+    RecordStartupPhase(&first_video_ms_);
+  }
+  WEBMLIVE_HOT_LOG(INFO) << "OnVideoFrameReceived committed a frame.";
+  return kSuccess;
+}
+
+int WebmEncoder::ReceiveCameraFrame(VideoRendition* ptr_camera,
+                                    VideoFrame* ptr_frame) {
+  if (paused_) {
+    return kSuccess;
+  }
+  VideoRendition& camera = *ptr_camera;
+  const double frame_rate = camera.video_config.frame_rate;
+  const double period = frame_rate > 0 ?
+      1000.0 / frame_rate : static_cast<double>(ptr_frame->duration());
+  ptr_frame->set_timestamp(
+      ShiftCaptureTimestamp(ptr_frame->timestamp(),
+                            static_cast<int64>(period + 0.5),
+                            &camera.camera_timeline));
+  if (config_.capture_time_watermarks) {
+    ptr_frame->set_capture_time(
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count());
+  }
+  VideoFrame* ptr_input_frame = ptr_frame;
+  if (VideoFrame::NeedsConversion(ptr_frame->format())) {
+    if (camera.input_frame.InitConverted(*ptr_frame)) {
+      LOG(ERROR) << "camera " << camera.camera << " frame conversion failed.";
+      ++queue_full_drops_;
+      return VideoFrameCallbackInterface::kDropped;
+    }
+    ptr_input_frame = &camera.input_frame;
+  }
+  SharedVideoFrame frame;
+  int status = camera.camera_frames.Wrap(ptr_input_frame, &frame);
+  if (status == kSuccess) {
+    status = camera.frame_pool.Commit(&frame);
+  }
+  if (status) {
+    if (status != SharedFramePool::kFull &&
+        status != SpscBufferPool<SharedVideoFrame>::kFull) {
+      LOG(ERROR) << "camera " << camera.camera << " frame Commit failed: "
+                 << status;
+    }
+    ++queue_full_drops_;
+    WEBMLIVE_LOG_EVERY_MS(WARNING, kLogIntervalMs)
+        << "camera " << camera.camera << " dropped frame (no buffers).";
+    return VideoFrameCallbackInterface::kDropped;
+  }
+  return kSuccess;
+}
+
+int64 WebmEncoder::ShiftCaptureTimestamp(int64 timestamp, int64 duration,
+                                         CaptureTimeline* ptr_timeline) {
+  CaptureTimeline& timeline = *ptr_timeline;
+  const int64 resumes = resumes_.load();
+  const bool resumed = resumes != timeline.resumes;
+  if (resumed) {
+    timeline.resumes = resumes;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (resume_pending_ && timeline.started) {
+      resume_pending_ = false;
+      // After a splice, input follows the end of the clip, which can come
+      // later than the time paused.
+      const int64 resume_time = timeline.last_timestamp + timeline.duration;
+      const int64 floor = resume_floor_.exchange(-1);
+      const int64 gap = timestamp - std::max(resume_time, floor);
+      if (gap > pause_offset_ || floor > resume_time) {
+        pause_offset_ = gap;
+      }
+    }
+  }
+  int64 shifted = timestamp - pause_offset_.load();
+  if (resumed && timeline.started && shifted <= timeline.last_timestamp) {
+    shifted = timeline.last_timestamp + 1;
+  }
+  timeline.started = true;
+  timeline.last_timestamp = shifted;
+  timeline.duration = duration;
+  return shifted;
+}
+
+int WebmEncoder::RunSplice() {
+  std::shared_ptr<const WebmSpliceClip> clip;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    clip = pending_splice_;
+  }
+  if (!clip) {
+    return kSuccess;
+  }
+  if (splice_active_) {
+    if (std::chrono::steady_clock::now() < splice_resume_time_) {
+      return kSuccess;
+    }
+    splice_active_ = false;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      pending_splice_.reset();
+    }
+    Resume();
+    RequestKeyframe();
+    return kSuccess;
+  }
+
+  const std::vector<LiveWebmMuxer*> muxers = PrimaryMuxers();
+  int64 start_time = 0;
+  bool can_splice = !muxers.empty();
+  for (size_t i = 0; i < muxers.size(); ++i) {
+    start_time = std::max(start_time, muxers[i]->muxer_time() + 1);
+    can_splice = can_splice && muxers[i]->CanSplice(*clip);
+  }
+  if (!can_splice) {
+    LOG(ERROR) << "splice clip " << clip->path()
+               << " does not match the output, resuming.";
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      pending_splice_.reset();
+    }
+    return Resume();
+  }
+  int64 end_time = start_time;
+  for (size_t i = 0; i < muxers.size(); ++i) {
+    const int status = muxers[i]->SpliceClip(*clip, start_time, &end_time);
+    if (status) {
+      LOG(ERROR) << "muxer " << muxers[i]->muxer_id()
+                 << " SpliceClip failed: " << status;
+      return status;
+    }
+  }
+
+  // The clip's timestamps include |timestamp_offset_|; capture timestamps
+  // do not.
+  resume_floor_ = end_time - timestamp_offset_;
+  splice_resume_time_ = std::chrono::steady_clock::now() +
+                        std::chrono::milliseconds(clip->duration());
+  splice_active_ = true;
+  UpdateEncodedDuration(end_time);
+  return kSuccess;
+}
+
+std::vector<LiveWebmMuxer*> WebmEncoder::PrimaryMuxers() const {
+  // The muxed output is in both lists.
+  std::vector<LiveWebmMuxer*> muxers = audio_muxers_;
+  for (size_t i = 0; i < video_muxers_.size(); ++i) {
+    if (std::find(muxers.begin(), muxers.end(), video_muxers_[i]) ==
+        muxers.end()) {
+      muxers.push_back(video_muxers_[i]);
+    }
+  }
+  return muxers;
+}
+
+bool WebmEncoder::SlateEnabled() const {
+  return watchdog_ && config_.capture_watchdog.slate;
+}
+
+int WebmEncoder::InitAudioSlate() {
+  std::unique_ptr<AudioEncoder> slate_encoder;
+#ifdef WEBMLIVE_HAVE_OPUS
+  if (config_.audio_codec == kAudioFormatOpus) {
+    slate_encoder.reset(new (std::nothrow) OpusEncoder());  // NOLINT
+  }
+#endif
+  if (config_.audio_codec == kAudioFormatVorbis) {
+    slate_encoder.reset(new (std::nothrow) VorbisEncoder());  // NOLINT
+  }
+  if (!slate_encoder) {
+    LOG(ERROR) << "cannot create slate audio encoder.";
+    return kNoMemory;
+  }
+  if (slate_encoder->Init(config_) ||
+      slate_.EncodeAudio(config_.actual_audio_config, slate_encoder.get())) {
+    LOG(ERROR) << "slate audio encode failed.";
+    return kInitFailed;
+  }
+  return kSuccess;
+}
+
+int WebmEncoder::RunSlate() {
+  if (!SlateEnabled()) {
+    return kSuccess;
+  }
+  const std::chrono::steady_clock::time_point now =
+      std::chrono::steady_clock::now();
+  if (watchdog_->source_lost()) {
+    if (!slate_running_) {
+      // A clip playing out already covers the output.
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (pending_splice_) {
+          return kSuccess;
+        }
+      }
+      const std::vector<LiveWebmMuxer*> muxers = PrimaryMuxers();
+      int64 start_time = 0;
+      for (size_t i = 0; i < muxers.size(); ++i) {
+        start_time = std::max(start_time, muxers[i]->muxer_time() + 1);
+      }
+      slate_start_time_ = start_time;
+      slate_running_ = true;
+      slate_loops_ = 0;
+      slate_due_ = now;
+      LOG(WARNING) << "capture source lost, muxing the fallback slate from "
+                   << start_time << " ms.";
+    }
+
+    // Loop ends are reserved on the capture timeline of the watchdog.
+    if (now >= slate_due_) {
+      const int64 loop_end = slate_start_time_ +
+                             (slate_loops_ + 1) * FallbackSlate::kLoopDuration;
+      if (watchdog_->ExtendSourceLoss(loop_end - timestamp_offset_ +
+                                      pause_offset_)) {
+        ++slate_loops_;
+        slate_due_ += std::chrono::milliseconds(FallbackSlate::kLoopDuration);
+      }
+    }
+  } else if (slate_running_) {
+    slate_running_ = false;
+    LOG(INFO) << "capture source back after " << slate_loops_
+              << " slate loops.";
+    RequestKeyframe();
+  }
+  const int64 end_time = SlateEndTime();
+  if (!slate_.LoopsDue(slate_start_time_, end_time)) {
+    return kSuccess;
+  }
+  return slate_.Follow(slate_start_time_, end_time, PrimaryMuxers());
+}
+
+int64 WebmEncoder::SlateEndTime() const {
+  const int64 end_time = watchdog_->slate_end();
+  if (end_time < 0) {
+    return -1;
+  }
+  return end_time + timestamp_offset_ - pause_offset_;
+}
+
+int WebmEncoder::FollowSlate(FallbackSlate* ptr_slate,
+                             std::unique_ptr<LiveWebmMuxer>* ptr_muxer) {
+  if (!SlateEnabled()) {
+    return kSuccess;
+  }
+  // The end is read first: a new schedule's start is stored before its end.
+  const int64 end_time = SlateEndTime();
+  const int64 start_time = slate_start_time_;
+  if (!ptr_slate->LoopsDue(start_time, end_time)) {
+    return kSuccess;
+  }
+  const int status = ptr_slate->Follow(
+      start_time, end_time, std::vector<LiveWebmMuxer*>(1, ptr_muxer->get()));
+  if (status) {
+    return status;
+  }
+  return WriteMuxerChunkToDataSink(ptr_muxer);
+}
+
+// Returns the value of |stop_|. Does not take |mutex_|, which the encoding
+// threads would otherwise contend for on every pass.
+bool WebmEncoder::StopRequested() {
+  return stop_;
+}
+
+void WebmEncoder::UpdateEncodedDuration(int64 timestamp) {
+  int64 duration = encoded_duration_.load(std::memory_order_relaxed);
+  while (timestamp > duration &&
+         !encoded_duration_.compare_exchange_weak(
+             duration, timestamp, std::memory_order_relaxed)) {
+  }
+}
+
+int WebmEncoder::StopTimeRemaining() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!stop_ || config_.stop_timeout <= 0) {
+    return -1;
+  }
+  const int64 elapsed_ms = std::chrono::duration_cast<
+      std::chrono::milliseconds>(std::chrono::steady_clock::now() -
+                                 stop_time_).count();
+  return static_cast<int>(
+      std::max<int64>(config_.stop_timeout - elapsed_ms, 0));
+}
+
+bool WebmEncoder::StopDeadlinePassed() {
+  if (StopTimeRemaining() != 0) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  shutdown_stats_.timed_out = true;
+  return true;
+}
+
+bool WebmEncoder::RecordStartupPhase(std::atomic<int64>* ptr_phase) {
+  const int64 elapsed_ms =
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::steady_clock::now() - startup_time_).count();
+  int64 unset = -1;
+  return ptr_phase->compare_exchange_strong(unset, elapsed_ms);
+}
+
+bool WebmEncoder::ReadChunkFromMuxer(std::unique_ptr<LiveWebmMuxer>* muxer,
+                                     const std::string& id,
+                                     SharedWebmChunk* ptr_chunk) {
+  // The chunk data moves from |muxer|'s buffer into |ptr_chunk|; it is shared,
+  // not copied, by the file writer and data sink.
+  const int status = (*muxer)->ReadChunk(id, ptr_chunk);
+  if (status) {
+    LOG(ERROR) << "error reading chunk: " << status;
+    return false;
+  }
+
+  return true;
+}
+
+void WebmEncoder::EncoderThread() {
+  ScopedThreadRegistration registration("encoder");
+  LOG(INFO) << "EncoderThread started.";
+
+  // Set to true the encode loop breaks because |StopRequested()| returns true.
+  bool user_initiated_stop = false;
+
+  if (!ptr_encode_func_) {
+    // NULL encode function pointer; fatal/die:
+    LOG(FATAL) << "NULL encode function pointer!";
+  }
+
+  // Start the chunk and manifest writer. The manifest and initialization
+  // segments are published before the media source runs: the writers
+  // deliver them while the capture graph starts.
+  if (file_writer_.Run()) {
+    LOG(FATAL) << "cannot run file writer!";
+  }
+  if (async_sink_ && async_sink_->Run()) {
+    LOG(FATAL) << "cannot run async sink adapter!";
+  }
+  if (dash_server_ && dash_server_->Run()) {
+    LOG(FATAL) << "cannot run DASH origin server!";
+  }
+
+  // Send the DASH manifest. The writer is published under |mutex_| once
+  // initialized, for |GetRepresentationStats()|.
+  std::unique_ptr<DashWriter> dash_writer(
+      new (std::nothrow) DashWriter);  // NOLINT
+  if (!dash_writer) {
+    LOG(FATAL) << "cannot construct dash writer!";
+  }
+  if (!dash_writer->Init(config_)) {
+    LOG(ERROR) << "DashWriter::Init failed.";
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    dash_writer_.swap(dash_writer);
+  }
+  if (PublishInitSegments()) {
+    LOG(ERROR) << "initialization segments not published ahead of capture.";
+  }
+  if (dash_writer_->dynamic()) {
+    // The dynamic manifest is first written once it lists a segment.
+    manifest_update_period_ = dash_writer_->config().minimum_update_period;
+    last_manifest_time_ = std::chrono::steady_clock::now();
+  } else {
+    std::string dash_manifest;
+    if (!dash_writer_->WriteManifest(&dash_manifest)) {
+      LOG(ERROR) << "DashWriter::WriteManifest failed.";
+    }
+
+    QueueSinkManifest(dash_manifest);
+    if (WriteSinkManifest()) {
+      LOG(ERROR) << "data sink manifest write failed.";
+    }
+
+    if (WriteDashManifest(dash_manifest)) {
+      LOG(ERROR) << "DASH manifest write failed.";
+    }
+  }
+
+  if (config_.dash_window > 0 && !config_.dash_single_file) {
+    // A dynamic manifest drops a segment up to |manifest_update_period_|
+    // before players fetch the manifest that no longer lists it; keep the
+    // file that much longer.
+    segment_retention_.reset(new (std::nothrow) SegmentRetention);  // NOLINT
+    if (!segment_retention_ ||
+        segment_retention_->Init(config_.dash_window +
+                                 manifest_update_period_)) {
+      LOG(FATAL) << "cannot construct segment retention index!";
+    }
+  }
+
+  // Start the frame converter before samples begin flowing.
+  if (config_.video_conversion_threads > 0 && !config_.disable_video &&
+      video_converter_.Run()) {
+    LOG(FATAL) << "Unable to run the video converter!";
+  }
+
+  // Run the media source to get samples flowing.
+  int status = ptr_media_source_->Run();
+  if (status) {
+    // media source Run failed; fatal/die:
+    LOG(FATAL) << "Unable to run the media source! " << status;
+  }
+  if (watchdog_ && watchdog_->Run()) {
+    LOG(FATAL) << "Unable to run the capture watchdog!";
+  }
+  RecordStartupPhase(&graph_run_ms_);
+  if (thumbnailer_ && thumbnailer_->Run()) {
+    LOG(FATAL) << "cannot run thumbnailer!";
+  }
+  if (quality_monitor_ && quality_monitor_->Run()) {
+    LOG(FATAL) << "cannot run quality monitor!";
+  }
+  if (text_source_ && text_source_->Run()) {
+    LOG(ERROR) << "cannot read text track input, continuing without it.";
+  }
+
+  // Wait for an input sample from each input stream-- this sets the
+  // |timestamp_offset_| value when one or both streams starts with a negative
+  // timestamp to avoid passing negative timestamps to libvpx and libwebm.
+  status = WaitForSamples();
+  if (status) {
+    LOG(ERROR) << "WaitForSamples failed: " << status;
+  } else if (config_.pipeline_encode &&
+             (status = StartPipelineThreads()) != kSuccess) {
+    LOG(ERROR) << "StartPipelineThreads failed: " << status;
+    StopPipelineThreads();
+  } else if ((status = StartRenditionThreads()) != kSuccess) {
+    LOG(ERROR) << "StartRenditionThreads failed: " << status;
+    StopPipelineThreads();
+    StopRenditionThreads();
+  } else {
+    for (;;) {
+      if (StopRequested()) {
+        LOG(INFO) << "StopRequested returned true, stopping...";
+        user_initiated_stop = true;
+        break;
+      }
+      WaitForInput();
+
+      // The watchdog checks and restarts a capture source on its own thread;
+      // the encode stops only once it gives up.
+      if (watchdog_) {
+        status = watchdog_->exhausted() ? kAVCaptureStopped : kSuccess;
+      } else {
+        status = ptr_media_source_->CheckStatus();
+      }
+      if (status == kAVCaptureEnded) {
+        // Input files are exhausted; finalize once the queued samples are
+        // encoded.
+        if (audio_ring_.IsEmpty() && video_pool_.IsEmpty()) {
+          LOG(INFO) << "Media source input ended, stopping...";
+          user_initiated_stop = true;
+          break;
+        }
+        status = kSuccess;
+      }
+      if (status) {
+        LOG(ERROR) << "Media source in a bad state, stopping: " << status;
+        break;
+      }
+      status = (this->*ptr_encode_func_)();
+      if (status) {
+        LOG(ERROR) << "encoding failed: " << status;
+        break;
+      }
+      status = RunSplice();
+      if (status) {
+        LOG(ERROR) << "splice failed: " << status;
+        break;
+      }
+      status = RunSlate();
+      if (status) {
+        LOG(ERROR) << "fallback slate failed: " << status;
+        break;
+      }
+      WEBMLIVE_COLLECT_LATENCY();
+      status = pipeline_status();
+      if (status) {
+        LOG(ERROR) << "encoder thread failed: " << status;
+        break;
+      }
+      if (config_.dash_encode) {
+        if (!config_.disable_audio) {
+          status = WriteMuxerChunkToDataSink(&ptr_muxer_aud_);
+          if (status) {
+            LOG(ERROR) << "chunk write (A) failed: " << status;
+            break;
+          }
+        }
+        if (!config_.disable_video) {
+          status = WriteMuxerChunkToDataSink(&ptr_muxer_vid_);
+          if (status) {
+            LOG(ERROR) << "chunk write (V) failed: " << status;
+            break;
+          }
+        }
+        status = PublishDashManifest(false);
+        if (status) {
+          LOG(ERROR) << "manifest write failed: " << status;
+          break;
+        }
+      }
+      if (config_.muxed_output) {
+        status = WriteMuxerChunkToDataSink(&ptr_muxer_);
+        if (status) {
+          LOG(ERROR) << "muxed chunk write failed: " << status;
+          break;
+        }
+      }
+    }
+
+    if (config_.pipeline_encode) {
+      StopPipelineThreads();
+
+      // Mux the compressed buffers left in the queues by the encoder threads,
+      // and those held by |interleaver_|.
+      if (user_initiated_stop &&
+          (PipelineMux() != kSuccess ||
+           (!config_.disable_video && QueueFlushedVideo() != kSuccess) ||
+           MuxInterleaved(true) != kSuccess)) {
+        LOG(ERROR) << "Failed to mux remaining pipelined buffers";
+      }
+    } else if (user_initiated_stop &&
+               ptr_encode_func_ == &WebmEncoder::InterleavedEncode) {
+      // Mux the compressed frames left in |vpx_pool_|, and the buffers held
+      // by |interleaver_|.
+      const bool mux_failed =
+          (!config_.disable_video && QueueFlushedVideo() != kSuccess) ||
+          MuxInterleaved(true) != kSuccess;
+      if (mux_failed) {
+        LOG(ERROR) << "Failed to mux remaining interleaved buffers";
+      }
+    } else if (user_initiated_stop && !config_.disable_video) {
+      // Mux the compressed frames left in |vpx_pool_|, and those the encoder
+      // held for lookahead.
+      if (!config_.video_passthrough && video_encoder_.Flush() != kSuccess) {
+        LOG(ERROR) << "Failed to flush the video encoder";
+      }
+      while (!vpx_pool_.IsEmpty() || video_encoder_.pending_frames() > 0) {
+        if (StopDeadlinePassed()) {
+          std::lock_guard<std::mutex> lock(mutex_);
+          shutdown_stats_.frames_abandoned =
+              vpx_pool_.ActiveCount() + video_encoder_.pending_frames();
+          break;
+        }
+        if (EncodeVideoFrames() != kSuccess) {
+          LOG(ERROR) << "Failed to mux remaining compressed video";
+          break;
+        }
+      }
+    }
+
+    StopRenditionThreads();
+
+    if (user_initiated_stop) {
+      // When |user_initiated_stop| is true the encode loop has been broken
+      // cleanly (without error). Call |LiveWebmMuxer::Finalize()| to flush any
+      // buffered samples, and upload the final chunk if one becomes available.
+      if (config_.dash_encode) {
+        if (!config_.disable_audio) {
+          status = WriteLastMuxerChunkToDataSink(&ptr_muxer_aud_);
+          if (status) {
+            LOG(ERROR) << "Failed to write last dash audio chunk";
+          }
+        }
+        if (!config_.disable_video) {
+          status = WriteLastMuxerChunkToDataSink(&ptr_muxer_vid_);
+          if (status) {
+            LOG(ERROR) << "Failed to write last dash video chunk";
+          }
+        }
+        if (!scale_levels_.empty() && ScaleRenditionFrames() != kSuccess) {
+          LOG(ERROR) << "Failed to scale remaining rendition frames";
+        }
+        for (size_t i = 0; i < renditions_.size(); ++i) {
+          VideoRendition* const rendition = renditions_[i].get();
+          status = EncodeRenditionFrames(rendition);
+          if (status == kSuccess) {
+            status = WriteLastMuxerChunkToDataSink(&rendition->muxer);
+          }
+          if (status) {
+            LOG(ERROR) << "Failed to write last dash video chunk, rendition "
+                       << rendition->index;
+          }
+        }
+        for (size_t i = 0; i < audio_renditions_.size(); ++i) {
+          AudioRendition* const rendition = audio_renditions_[i].get();
+          status = EncodeAudioRenditionBlocks(rendition);
+          if (status == kSuccess) {
+            status = WriteLastMuxerChunkToDataSink(&rendition->muxer);
+          }
+          if (status) {
+            LOG(ERROR) << "Failed to write last dash audio chunk, rendition "
+                       << rendition->index;
+          }
+        }
+        if (PublishDashManifest(true)) {
+          LOG(ERROR) << "Failed to write final dash manifest";
+        }
+      }
+      if (config_.muxed_output) {
+        status = WriteLastMuxerChunkToDataSink(&ptr_muxer_);
+        if (status) {
+          LOG(ERROR) << "Failed to write last non-dash chunk";
+        }
+      }
+    }
+
+    // The archive is finalized after errors too; it holds everything muxed.
+    if (archive_ && archive_->Close()) {
+      LOG(ERROR) << "archive " << archive_->path() << " is incomplete.";
+    }
+    archive_.reset();
+
+    if (watchdog_) {
+      watchdog_->Stop();
+    }
+    ptr_media_source_->Stop();
+    video_converter_.Stop();
+    capture_dump_.Close();
+  }
+
+  if (thumbnailer_) {
+    thumbnailer_->Stop();
+  }
+  if (quality_monitor_) {
+    quality_monitor_->Stop();
+  }
+  if (text_source_) {
+    text_source_->Stop();
+  }
+
+  // Drain tasks write to |file_writer_| and the DASH sinks, and must finish
+  // before they stop.
+  WaitForChunkDrains("");
+
+  // Chunks the adapter has not written by now are abandoned.
+  if (async_sink_) {
+    async_sink_->Stop();
+  }
+
+  // Wait for queued chunks to reach the disk, until the stop deadline.
+  const int remaining_ms = StopTimeRemaining();
+  const int writer_status = remaining_ms < 0 ?
+      file_writer_.Stop() : file_writer_.Stop(remaining_ms);
+  if (writer_status) {
+    LOG(ERROR) << "file writer failed to write one or more files.";
+  }
+  FileWriterStats writer_stats;
+  if (file_writer_.GetStats(&writer_stats) == FileWriter::kSuccess) {
+    if (writer_stats.files_abandoned > 0) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      shutdown_stats_.timed_out = true;
+      shutdown_stats_.files_abandoned = writer_stats.files_abandoned;
+    }
+    LOG(INFO) << "FileWriter stats:"
+              << " files_written=" << writer_stats.files_written
+              << " bytes_written=" << writer_stats.bytes_written
+              << " files_removed=" << writer_stats.files_removed
+              << " max_queue_depth=" << writer_stats.max_queue_depth
+              << " queue_full_waits=" << writer_stats.queue_full_waits
+              << " max_write_ms=" << writer_stats.max_write_ms
+              << " total_write_ms=" << writer_stats.total_write_ms
+              << " files_abandoned=" << writer_stats.files_abandoned;
+  }
+  if (config_.dash_write_files) {
+    FileSinkStats sink_stats;
+    dash_file_sink_.GetStats(&sink_stats);
+    LOG(INFO) << "DASH FileSink stats:"
+              << " chunks_written=" << sink_stats.chunks_written
+              << " data_written=" << sink_stats.data_written
+              << " bytes_written=" << sink_stats.bytes_written
+              << " write_errors=" << sink_stats.write_errors;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stop_) {
+      shutdown_stats_.flush_ms = std::chrono::duration_cast<
+          std::chrono::milliseconds>(std::chrono::steady_clock::now() -
+                                     stop_time_).count();
+    }
+  }
+  LOG(INFO) << "EncoderThread finished.";
+  finished_ = true;
+}
+
+// On each encoding pass:
+// - Attempts to read one span of uncompressed audio from |audio_ring_|, and
+//   feeds it |audio_encoder_| for compression when successful.
+// - Passes all available compressed audio produced by |audio_encoder_| to
+//   the audio muxers for muxing, a batch at a time.
+int WebmEncoder::EncodeAudioOnly() {
+  // Encode a single audio buffer.
+  int status = EncodeAudioBuffer();
+  if (status) {
+    LOG(ERROR) << "EncodeAudioBuffer failed: " << status;
+    return status;
+  }
+
+  // Read and mux compressed audio until |audio_encoder_| has no more.
+  AudioPacketBatch* batch = &audio_batch_;
+  AudioEncoder* ve = audio_encoder_.get();
+  batch->Clear();
+  while ((status = ve->ReadCompressedAudioBatch(batch)) == kSuccess) {
+    // Mux the compressed audio.
+    const int mux_status = MuxAudioBuffers(*batch);
+    if (mux_status) {
+      LOG(ERROR) << "Audio buffer mux failed " << mux_status;
+      return mux_status;
+    }
+    const int64 timestamp = batch->at(batch->size() - 1)->timestamp();
+    VLOG(4) << "muxed (A) " << batch->size() << " to " << timestamp / 1000.0;
+    batch->Clear();
+    UpdateEncodedDuration(timestamp);
+  }
+  if (status < 0) {
+    LOG(ERROR) << "Error reading vorbis samples: " << status;
+    return kAudioEncoderError;
+  }
+  return kSuccess;
+}
+
+// On each encoding pass:
+// - Attempts to read a span of uncompressed audio from |audio_ring_|, and
+//   passes it to |audio_encoder_| when samples are available.
+// - Compresses the video frames available in |video_pool_|.
+// - Passes all compressed audio and video to |interleaver_|, and muxes the
+//   packets it releases in timestamp order.
+int WebmEncoder::InterleavedEncode() {
+  int status = kSuccess;
+  if (!config_.disable_audio) {
+    status = EncodeAudioBuffer();
+    if (status) {
+      LOG(ERROR) << "EncodeAudioBuffer failed: " << status;
+      return status;
+    }
+    status = QueueCompressedAudio();
+    if (status) {
+      return status;
+    }
+  }
+  if (!config_.disable_video) {
+    status = BufferVideoFrames();
+    if (status) {
+      LOG(ERROR) << "BufferVideoFrames failed: " << status;
+      return status;
+    }
+    status = QueueCompressedVideo();
+    if (status) {
+      return status;
+    }
+  }
+  return MuxInterleaved(false);
+}
+
+// Moves compressed audio from |vorbis_pool_| and compressed video from
+// |vpx_pool_| into |interleaver_|, and muxes the packets it releases. Returns
+// the status stored by |SetPipelineStatus()| when an encoder thread has
+// failed.
+int WebmEncoder::PipelineMux() {
+  int status = pipeline_status();
+  if (status) {
+    LOG(ERROR) << "pipeline encoder thread failed: " << status;
+    return status;
+  }
+
+  if (!config_.disable_audio) {
+    while ((status = vorbis_pool_.Decommit(&mux_audio_buffer_)) == kSuccess) {
+      status = interleaver_.PushAudio(&mux_audio_buffer_);
+      if (status) {
+        LOG(ERROR) << "audio interleave failed: " << status;
+        return kAudioEncoderError;
+      }
+    }
+    if (status != SpscBufferPool<AudioBuffer>::kEmpty) {
+      LOG(ERROR) << "AudioBuffer pool (Vorbis) Decommit failed! " << status;
+      return kAudioEncoderError;
+    }
+  }
+
+  if (!config_.disable_video) {
+    status = QueueCompressedVideo();
+    if (status) {
+      return status;
+    }
+  }
+  return MuxInterleaved(false);
+}
+
+int WebmEncoder::QueueCompressedAudio() {
+  int status;
+  audio_batch_.Clear();
+  while ((status = audio_encoder_->ReadCompressedAudioBatch(&audio_batch_)) ==
+         kSuccess) {
+    for (int i = 0; i < audio_batch_.size(); ++i) {
+      status = interleaver_.PushAudio(audio_batch_.at(i));
+      if (status) {
+        LOG(ERROR) << "audio interleave failed: " << status;
+        return kAudioEncoderError;
+      }
+    }
+    audio_batch_.Clear();
+  }
+  if (status < 0) {
+    LOG(ERROR) << "Error reading compressed audio: " << status;
+    return kAudioEncoderError;
+  }
+  return kSuccess;
+}
+
+int WebmEncoder::QueueCompressedVideo() {
+  int status;
+  int32 num_frames = 0;
+  while ((status = vpx_pool_.DecommitBatch(kVideoBatchSize, vpx_batch_.get(),
+                                           &num_frames)) == kSuccess) {
+    for (int32 i = 0; i < num_frames; ++i) {
+      status = interleaver_.PushVideo(&vpx_batch_[i]);
+      if (status) {
+        LOG(ERROR) << "video interleave failed: " << status;
+        return kVideoEncoderError;
+      }
+    }
+  }
+  if (status != SpscBufferPool<VideoFrame>::kEmpty) {
+    LOG(ERROR) << "VideoFrame pool (VPx) Decommit failed! " << status;
+    return kVideoEncoderError;
+  }
+  return kSuccess;
+}
+
+int WebmEncoder::QueueFlushedVideo() {
+  if (!config_.video_passthrough && video_encoder_.Flush() != kSuccess) {
+    LOG(ERROR) << "video encoder flush failed.";
+    return kVideoEncoderError;
+  }
+  int status = QueueCompressedVideo();
+  while (status == kSuccess && video_encoder_.pending_frames() > 0) {
+    if (video_encoder_.ReadPendingFrame(&vpx_frame_) != kSuccess) {
+      LOG(ERROR) << "cannot read pending video frame.";
+      return kVideoEncoderError;
+    }
+    status = interleaver_.PushVideo(&vpx_frame_);
+    if (status) {
+      LOG(ERROR) << "video interleave failed: " << status;
+      return kVideoEncoderError;
+    }
+  }
+  return status;
+}
+
+int WebmEncoder::MuxInterleaved(bool flush) {
+  int64 timestamp = -1;
+  AVInterleaver::PacketType packet_type;
+  while ((packet_type = interleaver_.NextPacket(flush)) !=
+         AVInterleaver::kNoPacket) {
+    int status;
+    if (packet_type == AVInterleaver::kAudioPacket) {
+      interleaver_.PopAudio(&mux_audio_buffer_);
+      status = MuxAudioBuffer(mux_audio_buffer_);
+      if (status) {
+        return status;
+      }
+      timestamp = mux_audio_buffer_.timestamp();
+      VLOG(4) << "muxed (A) " << timestamp / 1000.0;
+    } else {
+      interleaver_.PopVideo(&mux_video_frame_);
+      status = MuxVideoFrame(mux_video_frame_);
+      if (status) {
+        return status;
+      }
+      timestamp = mux_video_frame_.timestamp();
+      VLOG(3) << "muxed (V) " << timestamp / 1000.0;
+    }
+  }
+
+  if (timestamp >= 0) {
+    UpdateEncodedDuration(timestamp);
+  }
+  return kSuccess;
+}
+
+int WebmEncoder::MuxAudioBuffer(const AudioBuffer& audio_buffer) {
+  MuxTextCues(audio_buffer.timestamp());
+  if (segment_aligner_ &&
+      segment_aligner_->StartsSegment(audio_buffer.timestamp(),
+                                      audio_buffer.duration())) {
+    ptr_muxer_aud_->StartCluster();
+  }
+  for (size_t i = 0; i < audio_muxers_.size(); ++i) {
+    const int status = audio_muxers_[i]->WriteAudioBuffer(audio_buffer);
+    if (status) {
+      LOG(ERROR) << "audio mux failed, muxer_id: "
+                 << audio_muxers_[i]->muxer_id() << " status: " << status;
+      return status;
+    }
+  }
+  if (archive_) {
+    const int status = archive_->WriteAudioBuffer(audio_buffer);
+    if (status) {
+      AbandonArchive(status);
+    }
+  }
+  audio_bytes_ += audio_buffer.buffer_length();
+  WEBMLIVE_TRACE_LATENCY(kLatencyAudio, kLatencyMuxed,
+                         audio_buffer.timestamp() - timestamp_offset_);
+  return kSuccess;
+}
+
+int WebmEncoder::MuxAudioBuffers(const AudioPacketBatch& batch) {
+  if (!batch.empty()) {
+    MuxTextCues(batch.at(0)->timestamp());
+  }
+  for (size_t i = 0; i < audio_muxers_.size(); ++i) {
+    const int status = audio_muxers_[i]->WriteAudioBuffers(batch);
+    if (status) {
+      LOG(ERROR) << "audio mux failed, muxer_id: "
+                 << audio_muxers_[i]->muxer_id() << " status: " << status;
+      return status;
+    }
+  }
+  for (int i = 0; archive_ && i < batch.size(); ++i) {
+    const int status = archive_->WriteAudioBuffer(*batch.at(i));
+    if (status) {
+      AbandonArchive(status);
+    }
+  }
+  for (int i = 0; i < batch.size(); ++i) {
+    audio_bytes_ += batch.at(i)->buffer_length();
+    WEBMLIVE_TRACE_LATENCY(kLatencyAudio, kLatencyMuxed,
+                           batch.at(i)->timestamp() - timestamp_offset_);
+  }
+  return kSuccess;
+}
+
+int WebmEncoder::MuxVideoFrame(const VideoFrame& video_frame) {
+  MuxTextCues(video_frame.timestamp());
+  // Segments of the DASH video stream, or chunks of the muxed stream, are
+  // the segments of |segment_rate_|.
+  const LiveWebmMuxer* const segment_muxer =
+      ptr_muxer_vid_ ? ptr_muxer_vid_.get() : ptr_muxer_.get();
+  bool segment_start = false;
+  for (size_t i = 0; i < video_muxers_.size(); ++i) {
+    if (video_muxers_[i] == ptr_muxer_.get() &&
+        SkipMuxedVideoFrame(video_frame)) {
+      continue;
+    }
+    LiveWebmMuxer* const muxer = video_muxers_[i];
+    const int64 clusters = muxer->clusters_started();
+    const int64 splits = muxer->clusters_split();
+    const int status = muxer->WriteVideoFrame(video_frame);
+    if (status) {
+      LOG(ERROR) << "Video frame mux failed, muxer_id: "
+                 << muxer->muxer_id() << " status: " << status;
+      return status;
+    }
+    if (segment_aligner_ && muxer == ptr_muxer_vid_.get() &&
+        muxer->clusters_started() != clusters) {
+      segment_aligner_->AddBoundary(video_frame.timestamp());
+    }
+    // Clusters split by the size limit continue their segment.
+    if (muxer == segment_muxer && muxer->clusters_started() != clusters &&
+        muxer->clusters_split() == splits) {
+      segment_start = true;
+    }
+  }
+  if (segment_rate_) {
+    const int bitrate = segment_rate_->Update(
+        video_frame.timestamp(), video_frame.duration(),
+        video_frame.buffer_length(), segment_start,
+        video_base_bitrate_.load());
+    if (bitrate > 0) {
+      segment_video_bitrate_.store(bitrate);
+    }
+  }
+  if (archive_) {
+    const int status = archive_->WriteVideoFrame(video_frame);
+    if (status) {
+      AbandonArchive(status);
+    }
+  }
+  video_bytes_ += video_frame.buffer_length();
+  WEBMLIVE_TRACE_LATENCY(kLatencyVideo, kLatencyMuxed,
+                         video_frame.timestamp() - timestamp_offset_);
+  return kSuccess;
+}
+
+void WebmEncoder::MuxTextCues(int64 timestamp) {
+  if (!text_source_) {
+    return;
+  }
+  while (text_source_->ReadDueCue(timestamp, &text_cue_)) {
+    const int64 muxer_time = ptr_muxer_->muxer_time();
+    const bool late = text_cue_.start < muxer_time;
+    if (late) {
+      text_cue_.start = muxer_time;
+    }
+    const int status = ptr_muxer_->WriteTextCue(text_track_, text_cue_);
+    if (status) {
+      LOG(WARNING) << "text cue mux failed, status: " << status;
+      continue;
+    }
+    text_source_->NoteCueWritten(late);
+  }
+}
+
+void WebmEncoder::AbandonArchive(int status) {
+  LOG(ERROR) << "archive " << archive_->path() << " write failed: " << status
+             << ", archiving stopped.";
+  archive_->Close();
+  archive_.reset();
+}
+
+int WebmEncoder::AudioEncodeStep() {
+  if (audio_ring_.WaitForData(kInputWaitTimeout)) {
+    return PipelineStage::kIdle;
+  }
+  int status = EncodeAudioBuffer();
+  if (status) {
+    LOG(ERROR) << "EncodeAudioBuffer failed: " << status;
+    SetPipelineStatus(status);
+    return status;
+  }
+  audio_batch_.Clear();
+  while ((status = audio_encoder_->ReadCompressedAudioBatch(
+              &audio_batch_)) == kSuccess) {
+    for (int i = 0; i < audio_batch_.size() && status == kSuccess; ++i) {
+      // Waits for the mux thread when |vorbis_pool_| is full.
+      status = audio_encode_stage_.Push(&vorbis_pool_, audio_batch_.at(i));
+    }
+    audio_batch_.Clear();
+    if (status) {
+      break;
+    }
+  }
+  if (status == SpscBufferPool<AudioBuffer>::kFull) {
+    LOG(INFO) << "audio encoder stage stopping with a full queue.";
+    return PipelineStage::kFinished;
+  } else if (status < 0) {
+    LOG(ERROR) << "Vorbis buffer queue failed: " << status;
+    SetPipelineStatus(kAudioEncoderError);
+    return kAudioEncoderError;
+  }
+  return kSuccess;
+}
+
+int WebmEncoder::VideoEncodeStep() {
+  if (video_encoder_.pending_frames() == 0 &&
+      video_pool_.WaitForActive(kInputWaitTimeout)) {
+    return PipelineStage::kIdle;
+  }
+  bool frame_ready = false;
+  int status = CompressVideoFrame(&frame_ready);
+  if (status) {
+    SetPipelineStatus(status);
+    return status;
+  }
+  if (!frame_ready) {
+    return kSuccess;
+  }
+
+  // Waits for the mux thread when |vpx_pool_| is full.
+  status = video_encode_stage_.Push(&vpx_pool_, &vpx_frame_);
+  if (status == SpscBufferPool<VideoFrame>::kFull) {
+    LOG(INFO) << "video encoder stage stopping with a full queue.";
+    return PipelineStage::kFinished;
+  } else if (status) {
+    LOG(ERROR) << "VPx frame queue failed: " << status;
+    SetPipelineStatus(kVideoEncoderError);
+    return kVideoEncoderError;
+  }
+  return kSuccess;
+}
+
+int WebmEncoder::StartPipelineThreads() {
+  const PipelineStage::StopFunc stop_requested =
+      std::bind(&WebmEncoder::StopRequested, this);
+  int status = kSuccess;
+  if (!config_.disable_audio &&
+      (status = audio_encode_stage_.Start(
+           "audio_encoder", stop_requested,
+           std::bind(&WebmEncoder::AudioEncodeStep, this))) != kSuccess) {
+    LOG(ERROR) << "cannot start audio encoder stage: " << status;
+    return kNoMemory;
+  }
+  if (!config_.disable_video &&
+      (status = video_encode_stage_.Start(
+           "video_encoder", stop_requested,
+           std::bind(&WebmEncoder::VideoEncodeStep, this))) != kSuccess) {
+    LOG(ERROR) << "cannot start video encoder stage: " << status;
+    return kNoMemory;
+  }
+  return kSuccess;
+}
+
+// Sets |stop_| to true to stop the pipeline threads even when |EncoderThread()|
+// is stopping because of an error, and joins them.
+void WebmEncoder::StopPipelineThreads() {
+  stop_ = true;
+  audio_encode_stage_.Stop();
+  video_encode_stage_.Stop();
+}
+
+void WebmEncoder::SetPipelineStatus(int status) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (pipeline_status_ == kSuccess) {
+    pipeline_status_ = status;
+  }
+}
+
+int WebmEncoder::pipeline_status() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return pipeline_status_;
+}
+
+int WebmEncoder::InitDeinterlacer() {
+  const VideoConfig& video_config = config_.actual_video_config;
+  VideoFieldOrder field_order = video_config.field_order;
+  switch (config_.deinterlace.mode) {
+    case DeinterlaceSettings::kOff:
+      return kSuccess;
+    case DeinterlaceSettings::kAuto:
+      if (field_order == kVideoProgressive) {
+        LOG(INFO) << "capture is progressive, deinterlacing disabled.";
+        return kSuccess;
+      }
+      break;
+    case DeinterlaceSettings::kForce:
+      if (field_order == kVideoProgressive) {
+        field_order = kVideoTopFieldFirst;
+      }
+      break;
+  }
+  if (video_config.format == kVideoFormatVP8 ||
+      video_config.format == kVideoFormatVP9) {
+    LOG(WARNING) << "compressed capture cannot be deinterlaced.";
+    return kSuccess;
+  }
+  deinterlacer_.reset(new (std::nothrow) VideoDeinterlacer());  // NOLINT
+  if (!deinterlacer_) {
+    LOG(ERROR) << "cannot construct video deinterlacer!";
+    return kNoMemory;
+  }
+  if (deinterlacer_->Init(field_order, config_.deinterlace.threshold)) {
+    LOG(ERROR) << "VideoDeinterlacer Init failed!";
+    deinterlacer_.reset();
+    return kInvalidArg;
+  }
+  video_converter_.set_deinterlacer(deinterlacer_.get());
+  LOG(INFO) << "deinterlacing "
+            << (field_order == kVideoTopFieldFirst ? "top" : "bottom")
+            << " field first capture.";
+  return kSuccess;
+}
+
+int WebmEncoder::InitArena() {
+  arena_.reset(new (std::nothrow) MediaArena());  // NOLINT
+  if (!arena_) {
+    LOG(ERROR) << "cannot construct media arena!";
+    return kNoMemory;
+  }
+  arena_->set_numa_node(config_.numa_node);
+
+  // Each stream gets classes sized for its buffers. Buffers of other sizes
+  // take the next larger class.
+  if (!config_.disable_video) {
+    const VideoConfig video_config = ptr_media_source_->actual_video_config();
+    const int32 height = abs(video_config.height);
+    WebmEncoderConfig video_encoder_config = config_;
+    video_encoder_config.actual_video_config = video_config;
+    AddArenaSizeClass(arena_.get(), NativeFrameSize(video_config),
+                      kRawFramesPerSlab, config_.large_pages);
+    AddArenaSizeClass(arena_.get(),
+                      VideoFrame::I420BufferSize(video_config.width, height),
+                      kRawFramesPerSlab, config_.large_pages);
+    AddArenaSizeClass(
+        arena_.get(),
+        VideoEncoder::InitialFrameBufferSize(video_encoder_config),
+        kCompressedFramesPerSlab, false);
+  }
+  if (!config_.disable_audio) {
+    // Raw audio is held by |audio_ring_|, which allocates its own storage.
+    AddArenaSizeClass(arena_.get(), kOpusBlockSize, kAudioBuffersPerSlab,
+                      false);
+    AddArenaSizeClass(arena_.get(), kVorbisBlockSize, kAudioBuffersPerSlab,
+                      false);
+  }
+
+  converted_frame_.set_arena(arena_);
+  raw_frame_.set_arena(arena_);
+  vpx_frame_.set_arena(arena_);
+  vpx_batch_.reset(new (std::nothrow) VideoFrame[kVideoBatchSize]);  // NOLINT
+  if (!vpx_batch_) {
+    LOG(ERROR) << "cannot allocate compressed video batch!";
+    return kNoMemory;
+  }
+  for (int32 i = 0; i < kVideoBatchSize; ++i) {
+    vpx_batch_[i].set_arena(arena_);
+  }
+  scale_i420_frame_.set_arena(arena_);
+  mux_audio_buffer_.set_arena(arena_);
+  mux_video_frame_.set_arena(arena_);
+  if (!config_.disable_audio &&
+      audio_batch_.Init(AudioPacketBatch::kDefaultCapacity, arena_)) {
+    LOG(ERROR) << "cannot init audio packet batch!";
+    return kNoMemory;
+  }
+  return kSuccess;
+}
+
+void WebmEncoder::ResolveRenditionSizes() {
+  for (size_t i = 0; i < config_.video_renditions.size(); ++i) {
+    VideoRenditionConfig& rendition_config = config_.video_renditions[i];
+    if (!rendition_config.width) {
+      rendition_config.width = VisibleWidth(config_.actual_video_config);
+    }
+    if (!rendition_config.height) {
+      rendition_config.height = VisibleHeight(config_.actual_video_config);
+    }
+  }
+}
+
+void WebmEncoder::AssignEncoderCores() {
+  if (config_.video_renditions.empty()) {
+    return;
+  }
+  int cores = config_.vpx_config.cpu_cores;
+  if (cores == VpxConfig::kUseDefault) {
+    cores = static_cast<int>(std::thread::hardware_concurrency());
+  }
+  cores = std::max(cores, 1);
+
+  const VideoConfig primary_config =
+      EncodedVideoConfig(config_.actual_video_config);
+  const double primary_area =
+      static_cast<double>(primary_config.width) * abs(primary_config.height);
+  double total_area = primary_area;
+  for (size_t i = 0; i < config_.video_renditions.size(); ++i) {
+    const VideoRenditionConfig& rendition_config = config_.video_renditions[i];
+    total_area +=
+        static_cast<double>(rendition_config.width) * rendition_config.height;
+  }
+  if (total_area <= 0) {
+    return;
+  }
+
+  // Every encoder gets at least one core; the host is oversubscribed when
+  // there are more encoders than cores.
+  config_.vpx_config.cpu_cores =
+      std::max(1, static_cast<int>(cores * primary_area / total_area + 0.5));
+  for (size_t i = 0; i < config_.video_renditions.size(); ++i) {
+    VideoRenditionConfig& rendition_config = config_.video_renditions[i];
+    const double area =
+        static_cast<double>(rendition_config.width) * rendition_config.height;
+    rendition_config.vpx_config.cpu_cores =
+        std::max(1, static_cast<int>(cores * area / total_area + 0.5));
+  }
+}
+
+int WebmEncoder::CalibrateVideoEncoder() {
+  if (!config_.vpx_calibration.enabled) {
+    return kSuccess;
+  }
+  VpxConfig& vpx_config = config_.vpx_config;
+  if (config_.video_passthrough ||
+      vpx_config.encoder_backend != kVideoEncoderSoftware) {
+    LOG(WARNING) << "calibration requires software video encoding, "
+                 << "disabling.";
+    return kSuccess;
+  }
+  VpxCalibrator calibrator;
+  VpxCalibration calibration;
+  if (calibrator.Init(config_.vpx_calibration) ||
+      calibrator.Calibrate(config_, &calibration)) {
+    LOG(ERROR) << "video encoder calibration failed!";
+    return kInvalidArg;
+  }
+  vpx_config.codec = calibration.codec;
+  vpx_config.speed = calibration.speed;
+  vpx_config.thread_count = calibration.thread_count;
+  LOG(INFO) << "calibrated video encoder for "
+            << VpxCalibrator::HostFingerprint() << ": "
+            << (calibration.codec == kVideoFormatVP9 ? "VP9" : "VP8")
+            << " speed " << calibration.speed << " threads "
+            << calibration.thread_count << ", "
+            << calibration.frames_per_second << " fps"
+            << (calibration.cached ? " (cached)" : "")
+            << (calibration.realtime ? "" : ", below realtime margin");
+  return kSuccess;
+}
+
+int WebmEncoder::InitRenditions() {
+  if (config_.video_renditions.empty()) {
+    return kSuccess;
+  }
+  const VideoConfig& capture_config = config_.actual_video_config;
+  for (size_t i = 0; i < config_.video_renditions.size(); ++i) {
+    const VideoRenditionConfig& rendition_config = config_.video_renditions[i];
+    VideoConfig rendition_video_config = capture_config;
+    rendition_video_config.width = rendition_config.width;
+    rendition_video_config.height = rendition_config.height;
+    rendition_video_config.stride = rendition_video_config.width;
+    rendition_video_config.crop_left = 0;
+    rendition_video_config.crop_top = 0;
+    rendition_video_config.crop_width = 0;
+    rendition_video_config.crop_height = 0;
+    rendition_video_config.pad_alignment = 0;
+    const int32 width = rendition_video_config.width;
+    const int32 height = rendition_video_config.height;
+    if (width <= 0 || height <= 0 || (width & 1) || (height & 1)) {
+      LOG(ERROR) << "rendition " << i + 1 << " size " << width << "x"
+                 << height << " invalid; dimensions must be even.";
+      return kInvalidArg;
+    }
+
+    std::unique_ptr<VideoRendition> rendition(
+        new (std::nothrow) VideoRendition());  // NOLINT
+    if (!rendition) {
+      LOG(ERROR) << "cannot construct video rendition!";
+      return kNoMemory;
+    }
+    rendition->index = static_cast<int>(i) + 1;
+    rendition->video_config = rendition_video_config;
+    rendition->arena = arena_;
+    if (rendition_config.numa_node != NumaTopology::kNoNode &&
+        rendition_config.numa_node != config_.numa_node) {
+      rendition->arena.reset(new (std::nothrow) MediaArena());  // NOLINT
+      if (!rendition->arena) {
+        LOG(ERROR) << "cannot construct rendition media arena!";
+        return kNoMemory;
+      }
+      rendition->arena->set_numa_node(rendition_config.numa_node);
+    }
+    const int status =
+        InitRenditionEncoder(rendition_config.vpx_config, rendition.get());
+    if (status) {
+      return status;
+    }
+    renditions_.push_back(std::move(rendition));
+  }
+
+  if (scale_pool_.Init(false, kRenditionPoolSize)) {
+    LOG(ERROR) << "SpscBufferPool<SharedVideoFrame> (scaler) Init failed!";
+    return kInitFailed;
+  }
+
+  // Captured frames are referenced by |scale_pool_|, |scale_frame_|, its I420
+  // conversion and |raw_shared_frame_|, and, when a rendition has the
+  // captured size, by the rendition queues, the thumbnailer and the quality
+  // monitor.
+  const int num_source_frames =
+      2 * (kRenditionPoolSize + 2) + static_cast<int>(renditions_.size()) +
+      (thumbnailer_ ? 1 : 0) + (quality_monitor_ ? 1 : 0);
+  if (scale_source_frames_.Init(num_source_frames)) {
+    LOG(ERROR) << "SharedFramePool (scaler) Init failed!";
+    return kInitFailed;
+  }
+  scale_source_frames_.set_memory_subsystem(kMemoryScaler);
+  return InitScaleLevels();
+}
+
+int WebmEncoder::InitRenditionEncoder(const VpxConfig& vpx_config,
+                                      VideoRendition* ptr_rendition) {
+  VideoRendition& rendition = *ptr_rendition;
+  const VideoConfig& rendition_video_config = rendition.video_config;
+  rendition.input_frame.set_arena(rendition.arena);
+  rendition.vpx_frame.set_arena(rendition.arena);
+
+  // The encoder reads only the capture and VPx settings.
+  WebmEncoderConfig rendition_encoder_config = config_;
+  rendition_encoder_config.actual_video_config = rendition_video_config;
+  rendition_encoder_config.vpx_config = vpx_config;
+  int status = rendition.encoder.Init(rendition_encoder_config);
+  if (status) {
+    LOG(ERROR) << "rendition " << rendition.index
+               << " video encoder Init failed " << status;
+    return kInitFailed;
+  }
+
+  AddArenaSizeClass(rendition.arena.get(),
+                    VideoFrame::I420BufferSize(rendition_video_config.width,
+                                               rendition_video_config.height),
+                    kRawFramesPerSlab, config_.large_pages);
+  AddArenaSizeClass(
+      rendition.arena.get(),
+      VideoEncoder::InitialFrameBufferSize(rendition_encoder_config),
+      kCompressedFramesPerSlab, false);
+
+  std::ostringstream muxer_id;
+  muxer_id << kVideoId << "_" << rendition.index;
+  const int rendition_chunk_duration = config_.segment_duration > 0 ?
+      config_.segment_duration : vpx_config.keyframe_interval;
+  status = InitMuxer(config_.segment_duration, 0, muxer_id.str(),
+                     config_.stream_chunks,
+                     ExpectedChunkSize(vpx_config.bitrate,
+                                       rendition_chunk_duration),
+                     chunk_pool_, &init_segments_, config_.encryption,
+                     &rendition.muxer);
+  if (status) {
+    LOG(ERROR) << "InitMuxer (V" << rendition.index << ") failed: "
+               << status;
+    return status;
+  }
+  FollowSegmentSchedule(rendition.muxer.get());
+  VideoConfig vpx_video_config = rendition_video_config;
+  vpx_video_config.format = vpx_config.codec;
+  if (config_.capture_time_watermarks) {
+    rendition.muxer->EnableCaptureTimes();
+  }
+  if (vpx_config.temporal_layers > 1) {
+    rendition.muxer->EnableTemporalLayerIds();
+  }
+  status = rendition.muxer->AddTrack(vpx_video_config);
+  if (status) {
+    LOG(ERROR) << "live muxer AddTrack(video " << rendition.index
+               << ") failed " << status;
+    return kInitFailed;
+  }
+  if (SlateEnabled() &&
+      rendition.slate.EncodeVideo(rendition_encoder_config)) {
+    LOG(ERROR) << "rendition " << rendition.index
+               << " slate video encode failed.";
+    return kInitFailed;
+  }
+
+  if (rendition.frame_pool.Init(false, kRenditionPoolSize)) {
+    LOG(ERROR) << "SpscBufferPool<SharedVideoFrame> (rendition) Init failed!";
+    return kInitFailed;
+  }
+  return kSuccess;
+}
+
+int WebmEncoder::CreateCameras() {
+  for (size_t i = 0; i < config_.video_cameras.size(); ++i) {
+    std::unique_ptr<VideoRendition> camera(
+        new (std::nothrow) VideoRendition());  // NOLINT
+    if (!camera) {
+      LOG(ERROR) << "cannot construct camera rendition!";
+      return kNoMemory;
+    }
+    camera->camera = static_cast<int>(i) + 1;
+    camera->camera_callback.reset(
+        new (std::nothrow) CameraCallback(this, camera.get()));  // NOLINT
+    if (!camera->camera_callback) {
+      LOG(ERROR) << "cannot construct camera callback!";
+      return kNoMemory;
+    }
+    const int status = ptr_media_source_->SetCameraCallback(
+        static_cast<int>(i), camera->camera_callback.get());
+    if (status) {
+      LOG(ERROR) << "media source cannot capture camera " << camera->camera
+                 << ": " << status;
+      return kInitFailed;
+    }
+    cameras_.push_back(std::move(camera));
+  }
+  return kSuccess;
+}
+
+int WebmEncoder::InitCameras() {
+  const int first_index =
+      static_cast<int>(config_.video_renditions.size()) + 1;
+  for (size_t i = 0; i < cameras_.size(); ++i) {
+    VideoRendition& camera = *cameras_[i];
+    VideoCameraConfig& camera_config = config_.video_cameras[i];
+    const VideoConfig capture_config =
+        ptr_media_source_->actual_camera_config(static_cast<int>(i));
+    camera_config.actual_video_config = capture_config;
+    if (capture_config.format == kVideoFormatVP8 ||
+        capture_config.format == kVideoFormatVP9 ||
+        capture_config.width <= 0 || capture_config.height == 0) {
+      LOG(ERROR) << "camera " << camera.camera << " delivers no raw video.";
+      return kNoVideoSource;
+    }
+
+    // Frames are encoded as I420 or NV12, top down.
+    camera.index = first_index + static_cast<int>(i);
+    camera.video_config = capture_config;
+    camera.video_config.height = abs(capture_config.height);
+    camera.video_config.stride = capture_config.width;
+    camera.video_config.uv_stride = 0;
+    camera.arena = arena_;
+    int status = InitRenditionEncoder(camera_config.vpx_config, &camera);
+    if (status) {
+      return status;
+    }
+
+    // Shared frames are referenced by |frame_pool|, the encoder, and the
+    // frame being committed.
+    if (camera.camera_frames.Init(kRenditionPoolSize + 2)) {
+      LOG(ERROR) << "SharedFramePool (camera) Init failed!";
+      return kInitFailed;
+    }
+    camera.camera_frames.set_memory_subsystem(kMemoryVideoInput);
+    LOG(INFO) << "camera " << camera.camera << " is rendition "
+              << camera.index << ": " << camera.video_config.width << "x"
+              << camera.video_config.height << " at "
+              << camera.video_config.frame_rate << " fps.";
+    renditions_.push_back(std::move(cameras_[i]));
+  }
+  cameras_.clear();
+  return kSuccess;
+}
+
+int WebmEncoder::InitScaleLevels() {
+  // Order the renditions by area, largest first, and group equal sizes.
+  std::vector<VideoRendition*> by_size;
+  for (size_t i = 0; i < renditions_.size(); ++i) {
+    by_size.push_back(renditions_[i].get());
+  }
+  std::stable_sort(by_size.begin(), by_size.end(),
+                   [](const VideoRendition* a, const VideoRendition* b) {
+    const VideoConfig& a_config = a->video_config;
+    const VideoConfig& b_config = b->video_config;
+    return a_config.width * a_config.height >
+           b_config.width * b_config.height;
+  });
+
+  scale_levels_.clear();
+  for (size_t i = 0; i < by_size.size(); ++i) {
+    const VideoConfig& size = by_size[i]->video_config;
+    if (!scale_levels_.empty() &&
+        scale_levels_.back().width == size.width &&
+        scale_levels_.back().height == size.height) {
+      scale_levels_.back().renditions.push_back(by_size[i]);
+      continue;
+    }
+
+    // Cascade: scale from the smallest level that is no smaller than this one
+    // in either dimension.
+    ScaleLevel level;
+    level.width = size.width;
+    level.height = size.height;
+    level.source_level = -1;
+    for (int j = static_cast<int>(scale_levels_.size()) - 1; j >= 0; --j) {
+      if (scale_levels_[j].width >= level.width &&
+          scale_levels_[j].height >= level.height) {
+        level.source_level = j;
+        break;
+      }
+    }
+    level.renditions.push_back(by_size[i]);
+    level.ptr_frames = NULL;
+    scale_levels_.push_back(level);
+    LOG(INFO) << "rendition scale level " << level.width << "x"
+              << level.height << " source_level=" << level.source_level;
+  }
+
+  // A scaled frame is referenced by each rendition queue and encoder of its
+  // level, by the level, and by the scaler while smaller levels are scaled.
+  scale_level_frames_.clear();
+  for (size_t i = 0; i < scale_levels_.size(); ++i) {
+    ScaleLevel& level = scale_levels_[i];
+    std::unique_ptr<SharedFramePool> frames(
+        new (std::nothrow) SharedFramePool());  // NOLINT
+    if (!frames) {
+      LOG(ERROR) << "cannot construct rendition frame pool!";
+      return kNoMemory;
+    }
+    const int num_frames =
+        kRenditionPoolSize + static_cast<int>(level.renditions.size()) + 2;
+    if (frames->Init(num_frames)) {
+      LOG(ERROR) << "SharedFramePool (rendition) Init failed!";
+      return kInitFailed;
+    }
+    frames->set_memory_subsystem(kMemoryScaler);
+    level.ptr_frames = frames.get();
+    scale_level_frames_.push_back(std::move(frames));
+  }
+#ifdef _WIN32
+  if (config_.gpu_video_processing && !scale_levels_.empty()) {
+    gpu_scaler_ = CreateGpuVideoProcessor("rendition scaling");
+  }
+#endif
+  return kSuccess;
+}
+
+void WebmEncoder::ScalerThread() {
+  ScopedThreadRegistration registration("scaler");
+  LOG(INFO) << "ScalerThread started.";
+  while (!StopRequested()) {
+    if (scale_pool_.WaitForActive(kInputWaitTimeout)) {
+      continue;
+    }
+    const int status = ScaleRenditionFrames();
+    if (status) {
+      LOG(ERROR) << "ScaleRenditionFrames failed: " << status;
+      SetPipelineStatus(status);
+      break;
+    }
+  }
+  LOG(INFO) << "ScalerThread finished.";
+}
+
+int WebmEncoder::ScaleRenditionFrames() {
+  int status;
+  for (;;) {
+    // Release the previous frame before |Decommit()| swaps it into the queue.
+    scale_frame_.Reset();
+    status = scale_pool_.Decommit(&scale_frame_);
+    if (status) {
+      break;
+    }
+    status = ScaleRenditionFrame();
+    if (status) {
+      return status;
+    }
+  }
+  if (status != SpscBufferPool<SharedVideoFrame>::kEmpty) {
+    LOG(ERROR) << "VideoFrame pool (scaler) Decommit failed! " << status;
+    return kVideoEncoderError;
+  }
+  return kSuccess;
+}
+
+int WebmEncoder::ScaleRenditionFrame() {
+  // The GPU scales every level from |scale_frame_|, NV12 frames included.
+  const bool gpu_scaled = ScaleLevelsOnGpu();
+  if (!gpu_scaled && scale_frame_->format() == kVideoFormatNV12) {
+    if (scale_i420_frame_.InitConverted(*scale_frame_)) {
+      LOG(ERROR) << "cannot convert NV12 frame for rendition scaling.";
+      return kVideoEncoderError;
+    }
+    const int status =
+        scale_source_frames_.Wrap(&scale_i420_frame_, &scale_frame_);
+    if (status == SharedFramePool::kFull) {
+      WEBMLIVE_LOG_EVERY_MS(WARNING, kLogIntervalMs)
+          << "rendition scaler dropped frame (no free shared frames).";
+      return kSuccess;
+    } else if (status) {
+      LOG(ERROR) << "cannot share converted rendition frame: " << status;
+      return kVideoEncoderError;
+    }
+  }
+
+  // Scale each level once, larger levels first, since smaller levels are
+  // scaled from them. A level of its source's size shares the source frame.
+  for (size_t i = 0; i < scale_levels_.size(); ++i) {
+    ScaleLevel& level = scale_levels_[i];
+    const SharedVideoFrame& source =
+        (gpu_scaled || level.source_level < 0) ? scale_frame_ :
+        scale_levels_[level.source_level].frame;
+    level.frame.Reset();
+    if (source.empty()) {
+      continue;
+    }
+    if (source->width() == level.width && source->height() == level.height) {
+      level.frame = source;
+      continue;
+    }
+    VideoFrame& target = level.renditions[0]->input_frame;
+    int status = gpu_scaled ? VideoFrame::kSuccess :
+        target.InitScaled(*source, level.width, level.height);
+    if (status) {
+      LOG(ERROR) << "rendition frame scale to " << level.width << "x"
+                 << level.height << " failed: " << status;
+      return kVideoEncoderError;
+    }
+    status = level.ptr_frames->Wrap(&target, &level.frame);
+    if (status == SharedFramePool::kFull) {
+      WEBMLIVE_LOG_EVERY_MS(WARNING, kLogIntervalMs)
+          << "rendition scale level " << level.width << "x" << level.height
+          << " dropped frame (no free shared frames).";
+    } else if (status) {
+      LOG(ERROR) << "cannot share rendition frame: " << status;
+      return kVideoEncoderError;
+    }
+  }
+
+  // Pass a reference to each level's frame to the renditions of its size.
+  for (size_t i = 0; i < scale_levels_.size(); ++i) {
+    ScaleLevel& level = scale_levels_[i];
+    for (size_t j = 0; !level.frame.empty() && j < level.renditions.size();
+         ++j) {
+      VideoRendition& rendition = *level.renditions[j];
+      SharedVideoFrame frame(level.frame);
+      const int status = rendition.frame_pool.Commit(&frame);
+      if (status == SpscBufferPool<SharedVideoFrame>::kFull) {
+        WEBMLIVE_LOG_EVERY_MS(WARNING, kLogIntervalMs)
+            << "rendition " << rendition.index << " dropped frame.";
+      } else if (status) {
+        LOG(ERROR) << "VideoFrame pool (rendition) Commit failed! " << status;
+        return kVideoEncoderError;
+      }
+    }
+  }
+  for (size_t i = 0; i < scale_levels_.size(); ++i) {
+    scale_levels_[i].frame.Reset();
+  }
+  return kSuccess;
+}
+
+bool WebmEncoder::ScaleLevelsOnGpu() {
+#ifdef _WIN32
+  if (!gpu_scaler_) {
+    return false;
+  }
+  std::vector<D3D11VideoProcessor::Target> targets;
+  targets.reserve(scale_levels_.size());
+  for (size_t i = 0; i < scale_levels_.size(); ++i) {
+    ScaleLevel& level = scale_levels_[i];
+    if (scale_frame_->width() == level.width &&
+        scale_frame_->height() == level.height) {
+      continue;
+    }
+    D3D11VideoProcessor::Target target;
+    target.width = level.width;
+    target.height = level.height;
+    target.ptr_frame = &level.renditions[0]->input_frame;
+    targets.push_back(target);
+  }
+  if (targets.empty()) {
+    return true;
+  }
+  const int status =
+      gpu_scaler_->Process(*scale_frame_, static_cast<int>(targets.size()),
+                           &targets[0]);
+  if (status) {
+    LOG(WARNING) << "GPU rendition scaling failed (" << status
+                 << "), using libyuv.";
+    gpu_scaler_.reset();
+    return false;
+  }
+  return true;
+#else
+  return false;
+#endif  // _WIN32
+}
+
+void WebmEncoder::RenditionThread(VideoRendition* ptr_rendition) {
+  std::ostringstream thread_name;
+  thread_name << "rendition" << ptr_rendition->index;
+  ScopedThreadRegistration registration(thread_name.str());
+  LOG(INFO) << "RenditionThread " << ptr_rendition->index << " started.";
+  while (!StopRequested()) {
+    const bool idle =
+        ptr_rendition->frame_pool.WaitForActive(kInputWaitTimeout) != 0;
+
+    // Slate loops due precede the frames that follow them.
+    int status = FollowSlate(&ptr_rendition->slate, &ptr_rendition->muxer);
+    if (status) {
+      LOG(ERROR) << "rendition " << ptr_rendition->index
+                 << " slate failed: " << status;
+      SetPipelineStatus(status);
+      break;
+    }
+    if (idle) {
+      continue;
+    }
+    status = EncodeRenditionFrames(ptr_rendition);
+    if (status) {
+      LOG(ERROR) << "EncodeRenditionFrames failed: " << status;
+      SetPipelineStatus(status);
+      break;
+    }
+  }
+
+  // Mux the frames the encoder held for lookahead.
+  if (pipeline_status() == kSuccess &&
+      (ptr_rendition->encoder.Flush() != kSuccess ||
+       MuxRenditionFrames(ptr_rendition) != kSuccess)) {
+    LOG(ERROR) << "rendition " << ptr_rendition->index << " flush failed.";
+  }
+  LOG(INFO) << "RenditionThread " << ptr_rendition->index << " finished.";
+}
+
+int WebmEncoder::StartRenditionThreads() {
+  using std::bind;
+  using std::shared_ptr;
+  using std::thread;
+  using std::nothrow;
+  for (size_t i = 0; i < audio_renditions_.size(); ++i) {
+    AudioRendition* const rendition = audio_renditions_[i].get();
+    rendition->thread = shared_ptr<thread>(
+        new (nothrow) thread(bind(&WebmEncoder::AudioRenditionThread,  // NOLINT
+                                  this, rendition)));
+    if (!rendition->thread) {
+      LOG(ERROR) << "cannot construct audio rendition thread!";
+      return kNoMemory;
+    }
+  }
+  if (renditions_.empty()) {
+    return kSuccess;
+  }
+  if (!scale_levels_.empty()) {
+    scaler_thread_ = shared_ptr<thread>(
+        new (nothrow) thread(bind(&WebmEncoder::ScalerThread,  // NOLINT
+                                  this)));
+    if (!scaler_thread_) {
+      LOG(ERROR) << "cannot construct scaler thread!";
+      return kNoMemory;
+    }
+  }
+  for (size_t i = 0; i < renditions_.size(); ++i) {
+    VideoRendition* const rendition = renditions_[i].get();
+    rendition->thread = shared_ptr<thread>(
+        new (nothrow) thread(bind(&WebmEncoder::RenditionThread,  // NOLINT
+                                  this, rendition)));
+    if (!rendition->thread) {
+      LOG(ERROR) << "cannot construct rendition thread!";
+      return kNoMemory;
+    }
+  }
+  return kSuccess;
+}
+
+// Sets |stop_| to true for the same reason as |StopPipelineThreads()|, and
+// joins the scaler and rendition threads. Frames left in the queues remain
+// there for |EncoderThread()|.
+void WebmEncoder::StopRenditionThreads() {
+  stop_ = true;
+  if (scaler_thread_) {
+    scaler_thread_->join();
+    scaler_thread_.reset();
+  }
+  for (size_t i = 0; i < renditions_.size(); ++i) {
+    VideoRendition* const rendition = renditions_[i].get();
+    if (rendition->thread) {
+      rendition->thread->join();
+      rendition->thread.reset();
+    }
+  }
+  for (size_t i = 0; i < audio_renditions_.size(); ++i) {
+    AudioRendition* const rendition = audio_renditions_[i].get();
+    if (rendition->thread) {
+      rendition->thread->join();
+      rendition->thread.reset();
+    }
+  }
+}
+
+int WebmEncoder::InitAudioRenditions() {
+  if (config_.audio_renditions.empty()) {
+    return kSuccess;
+  }
+  const AudioConfig& input_config = config_.actual_audio_config;
+  audio_deinterleave_ = SelectPcmDeinterleave(
+      static_cast<AudioFormat>(input_config.format_tag),
+      input_config.channels, GetCpuFeatures());
+  if (!audio_deinterleave_) {
+    LOG(ERROR) << "no PCM deinterleave function for audio renditions.";
+    return kInitFailed;
+  }
+  if (config_.align_segments) {
+    LOG(WARNING) << "audio rendition segments are not aligned to video.";
+  }
+  const int chunk_duration = config_.segment_duration > 0 ?
+      config_.segment_duration : config_.vpx_config.keyframe_interval;
+  for (size_t i = 0; i < config_.audio_renditions.size(); ++i) {
+    std::unique_ptr<AudioRendition> rendition(
+        new (std::nothrow) AudioRendition());  // NOLINT
+    if (!rendition) {
+      LOG(ERROR) << "cannot construct audio rendition!";
+      return kNoMemory;
+    }
+    rendition->index = static_cast<int>(i) + 1;
+
+    // Renditions differ from the primary stream in bitrate only.
+    VorbisConfig vorbis_config = config_.audio_renditions[i].vorbis_config;
+    vorbis_config.sample_rate = config_.encoded_audio_config.sample_rate;
+    vorbis_config.channels = config_.encoded_audio_config.channels;
+    rendition->encoder.set_arena(arena_);
+    int status = rendition->encoder.Init(input_config, vorbis_config);
+    if (status) {
+      LOG(ERROR) << "audio rendition " << rendition->index
+                 << " encoder Init failed: " << status;
+      return kInitFailed;
+    }
+    AudioCodecPrivate codec_private;
+    status = rendition->encoder.GetCodecPrivate(&codec_private);
+    if (status) {
+      LOG(ERROR) << "audio rendition " << rendition->index
+                 << " GetCodecPrivate failed: " << status;
+      return kInitFailed;
+    }
+
+    std::ostringstream muxer_id;
+    muxer_id << kAudioId << "_" << rendition->index;
+    status = InitMuxer(chunk_duration, 0, muxer_id.str(),
+                       config_.stream_chunks,
+                       ExpectedChunkSize(vorbis_config.average_bitrate,
+                                         chunk_duration),
+                       chunk_pool_, &init_segments_, config_.encryption,
+                       &rendition->muxer);
+    if (status) {
+      LOG(ERROR) << "InitMuxer (A" << rendition->index << ") failed: "
+                 << status;
+      return status;
+    }
+    FollowSegmentSchedule(rendition->muxer.get());
+    status = rendition->muxer->AddTrack(*rendition->encoder.audio_config(),
+                                        codec_private);
+    if (status) {
+      LOG(ERROR) << "live muxer AddTrack(audio " << rendition->index
+                 << ") failed " << status;
+      return kInitFailed;
+    }
+    if (SlateEnabled()) {
+      VorbisEncoder slate_encoder;
+      if (slate_encoder.Init(input_config, vorbis_config) ||
+          rendition->slate.EncodeAudio(input_config, &slate_encoder)) {
+        LOG(ERROR) << "audio rendition " << rendition->index
+                   << " slate audio encode failed.";
+        return kInitFailed;
+      }
+    }
+    if (rendition->block_pool.Init(false, kAudioRenditionPoolSize)) {
+      LOG(ERROR) << "SpscBufferPool<SharedAudioBlock> Init failed!";
+      return kInitFailed;
+    }
+    if (rendition->batch.Init(AudioPacketBatch::kDefaultCapacity, arena_)) {
+      LOG(ERROR) << "cannot init audio rendition packet batch!";
+      return kNoMemory;
+    }
+    audio_renditions_.push_back(std::move(rendition));
+  }
+
+  // Every queue can be full while the encoder holds a block, and one more is
+  // being filled.
+  const int num_blocks =
+      static_cast<int>(audio_renditions_.size()) * kAudioRenditionPoolSize + 2;
+  if (audio_blocks_.Init(num_blocks)) {
+    LOG(ERROR) << "SharedAudioBlockPool Init failed!";
+    return kNoMemory;
+  }
+  LOG(INFO) << audio_renditions_.size() << " audio renditions share "
+            << num_blocks << " planar blocks.";
+  return kSuccess;
+}
+
+int WebmEncoder::EncodeAudioRenditions(const PcmSpan& span) {
+  const AudioConfig& input_config = config_.actual_audio_config;
+  const int channels = input_config.channels;
+  const int num_frames = span.length / input_config.block_align;
+  if (num_frames <= 0) {
+    return kSuccess;
+  }
+  if (audio_planar_block_.Resize(channels, num_frames)) {
+    LOG(ERROR) << "cannot size planar audio block, no memory.";
+    return kNoMemory;
+  }
+
+  // The one deinterleave pass of the span: every encoder copies its planes.
+  audio_deinterleave_(span.ptr_data, num_frames, channels,
+                      audio_planar_block_.planes());
+  audio_planar_block_.set_timestamp(span.timestamp);
+  audio_planar_block_.set_silent(audio_encoder_silent_);
+  SharedAudioBlock block;
+  int status = audio_blocks_.Wrap(&audio_planar_block_, &block);
+  if (status) {
+    LOG(ERROR) << "cannot share planar audio block: " << status;
+    return kAudioEncoderError;
+  }
+  status = audio_encoder_->EncodePlanar(block->pcm());
+  if (status) {
+    return status;
+  }
+
+  // Samples cannot be dropped from a rendition without breaking its
+  // timeline: wait for a rendition that falls behind.
+  for (size_t i = 0; i < audio_renditions_.size(); ++i) {
+    AudioRendition& rendition = *audio_renditions_[i];
+    for (;;) {
+      SharedAudioBlock rendition_block(block);
+      status = rendition.block_pool.Commit(&rendition_block);
+      if (status != SpscBufferPool<SharedAudioBlock>::kFull) {
+        break;
+      }
+      if (StopRequested()) {
+        LOG(WARNING) << "audio rendition " << rendition.index
+                     << " dropped samples at stop.";
+        status = kSuccess;
+        break;
+      }
+      rendition.block_pool.WaitForInactive(kInputWaitTimeout);
+    }
+    if (status) {
+      LOG(ERROR) << "SharedAudioBlock pool Commit failed! " << status;
+      return kAudioEncoderError;
+    }
+  }
+  return kSuccess;
+}
+
+void WebmEncoder::AudioRenditionThread(AudioRendition* ptr_rendition) {
+  std::ostringstream thread_name;
+  thread_name << "audio_rendition" << ptr_rendition->index;
+  ScopedThreadRegistration registration(thread_name.str());
+  LOG(INFO) << "AudioRenditionThread " << ptr_rendition->index << " started.";
+  while (!StopRequested()) {
+    const bool idle =
+        ptr_rendition->block_pool.WaitForActive(kInputWaitTimeout) != 0;
+    int status = FollowSlate(&ptr_rendition->slate, &ptr_rendition->muxer);
+    if (status) {
+      LOG(ERROR) << "audio rendition " << ptr_rendition->index
+                 << " slate failed: " << status;
+      SetPipelineStatus(status);
+      break;
+    }
+    if (idle) {
+      continue;
+    }
+    status = EncodeAudioRenditionBlocks(ptr_rendition);
+    if (status) {
+      LOG(ERROR) << "EncodeAudioRenditionBlocks failed: " << status;
+      SetPipelineStatus(status);
+      break;
+    }
+  }
+  LOG(INFO) << "AudioRenditionThread " << ptr_rendition->index
+            << " finished.";
+}
+
+int WebmEncoder::EncodeAudioRenditionBlocks(AudioRendition* ptr_rendition) {
+  AudioRendition& rendition = *ptr_rendition;
+  int status;
+  for (;;) {
+    // Release the previous block before |Decommit()| swaps it into the queue.
+    rendition.block.Reset();
+    status = rendition.block_pool.Decommit(&rendition.block);
+    if (status) {
+      break;
+    }
+    rendition.encoder.SetSilent(rendition.block->silent());
+    status = rendition.encoder.EncodePlanar(rendition.block->pcm());
+    rendition.block.Reset();
+    if (status) {
+      LOG(ERROR) << "audio rendition " << rendition.index
+                 << " encode failed: " << status;
+      return kAudioEncoderError;
+    }
+    for (;;) {
+      rendition.batch.Clear();
+      status = rendition.encoder.ReadCompressedAudioBatch(&rendition.batch);
+      if (status == VorbisEncoder::kNoSamples) {
+        break;
+      } else if (status) {
+        LOG(ERROR) << "audio rendition " << rendition.index
+                   << " read failed: " << status;
+        return kAudioEncoderError;
+      }
+      status = rendition.muxer->WriteAudioBuffers(rendition.batch);
+      if (status) {
+        LOG(ERROR) << "audio rendition " << rendition.index
+                   << " mux failed: " << status;
+        return status;
+      }
+      status = WriteMuxerChunkToDataSink(&rendition.muxer);
+      if (status) {
+        LOG(ERROR) << "chunk write (A" << rendition.index << ") failed: "
+                   << status;
+        return status;
+      }
+    }
+  }
+  if (status != SpscBufferPool<SharedAudioBlock>::kEmpty) {
+    LOG(ERROR) << "SharedAudioBlock pool Decommit failed! " << status;
+    return kAudioEncoderError;
+  }
+  return kSuccess;
+}
+
+int WebmEncoder::EncodeRenditionFrames(VideoRendition* ptr_rendition) {
+  VideoRendition& rendition = *ptr_rendition;
+  int status;
+  for (;;) {
+    // Release the previous frame before |Decommit()| swaps it into the queue.
+    rendition.raw_frame.Reset();
+    status = rendition.frame_pool.Decommit(&rendition.raw_frame);
+    if (status) {
+      break;
+    }
+    ApplyVideoSettings(&rendition.requested_speed,
+                       &rendition.requested_keyframe_interval,
+                       &rendition.encoder);
+    RequestSegmentKeyframe(rendition.raw_frame->timestamp(),
+                           &rendition.next_segment_time, &rendition.encoder);
+    rendition.encoder.SetInputBacklog(rendition.frame_pool.ActiveCount(),
+                                      rendition.frame_pool.Capacity());
+    status = rendition.encoder.EncodeFrame(*rendition.raw_frame,
+                                           &rendition.vpx_frame);
+    if (status == VideoEncoder::kDropped) {
+      status = MuxRenditionFrames(ptr_rendition);
+      if (status) {
+        return status;
+      }
+      continue;
+    } else if (status) {
+      LOG(ERROR) << "rendition " << rendition.index
+                 << " video frame encode failed: " << status;
+      return kVideoEncoderError;
+    }
+
+    // Frames held for lookahead carry their own capture times.
+    if (rendition.vpx_frame.timestamp() == rendition.raw_frame->timestamp()) {
+      rendition.vpx_frame.set_capture_time(
+          rendition.raw_frame->capture_time());
+    }
+    status = rendition.muxer->WriteVideoFrame(rendition.vpx_frame);
+    if (status) {
+      LOG(ERROR) << "rendition " << rendition.index
+                 << " video frame mux failed: " << status;
+      return status;
+    }
+    VLOG(3) << "muxed (V" << rendition.index << ") "
+            << rendition.vpx_frame.timestamp() / 1000.0;
+    status = WriteMuxerChunkToDataSink(&rendition.muxer);
+    if (status) {
+      LOG(ERROR) << "chunk write (V" << rendition.index << ") failed: "
+                 << status;
+      return status;
+    }
+    status = MuxRenditionFrames(ptr_rendition);
+    if (status) {
+      return status;
+    }
+  }
+  if (status != SpscBufferPool<SharedVideoFrame>::kEmpty) {
+    LOG(ERROR) << "VideoFrame pool (rendition) Decommit failed! " << status;
+    return kVideoEncoderError;
+  }
+  return kSuccess;
+}
+
+int WebmEncoder::MuxRenditionFrames(VideoRendition* ptr_rendition) {
+  VideoRendition& rendition = *ptr_rendition;
+  while (rendition.encoder.pending_frames() > 0) {
+    if (rendition.encoder.ReadPendingFrame(&rendition.vpx_frame)) {
+      LOG(ERROR) << "rendition " << rendition.index
+                 << " cannot read pending video frame.";
+      return kVideoEncoderError;
+    }
+    int status = rendition.muxer->WriteVideoFrame(rendition.vpx_frame);
+    if (status) {
+      LOG(ERROR) << "rendition " << rendition.index
+                 << " video frame mux failed: " << status;
+      return status;
+    }
+    status = WriteMuxerChunkToDataSink(&rendition.muxer);
+    if (status) {
+      LOG(ERROR) << "chunk write (V" << rendition.index << ") failed: "
+                 << status;
+      return status;
+    }
+  }
+  return kSuccess;
+}
+
+int WebmEncoder::QueueRenditionFrames() {
+  if (scale_levels_.empty()) {
+    return kSuccess;
+  }
+
+  // Share |raw_frame_| with |ScalerThread()| instead of copying it. The
+  // caller encodes the frame through |raw_shared_frame_|.
+  int status = scale_source_frames_.Wrap(&raw_frame_, &raw_shared_frame_);
+  if (status == SharedFramePool::kFull) {
+    WEBMLIVE_LOG_EVERY_MS(WARNING, kLogIntervalMs)
+        << "rendition scaler dropped frame (no free shared frames).";
+    return kSuccess;
+  } else if (status) {
+    LOG(ERROR) << "cannot share rendition frame: " << status;
+    return kVideoEncoderError;
+  }
+  SharedVideoFrame frame(raw_shared_frame_);
+  status = scale_pool_.Commit(&frame);
+  if (status == SpscBufferPool<SharedVideoFrame>::kFull) {
+    WEBMLIVE_LOG_EVERY_MS(WARNING, kLogIntervalMs)
+        << "rendition scaler dropped frame.";
+  } else if (status) {
+    LOG(ERROR) << "VideoFrame pool (scaler) Commit failed! " << status;
+    return kVideoEncoderError;
+  }
+  return kSuccess;
+}
+
+int WebmEncoder::QueueThumbnailFrame() {
+  const int64 timestamp = raw_shared_frame_.empty() ?
+      raw_frame_.timestamp() : raw_shared_frame_->timestamp();
+  if (!thumbnailer_ || !thumbnailer_->Due(timestamp)) {
+    return kSuccess;
+  }
+  if (raw_shared_frame_.empty()) {
+    const int status =
+        thumbnail_source_frames_.Wrap(&raw_frame_, &raw_shared_frame_);
+    if (status == SharedFramePool::kFull) {
+      // The thumbnail is taken from a later frame.
+      return kSuccess;
+    } else if (status) {
+      LOG(ERROR) << "cannot share thumbnail frame: " << status;
+      return kVideoEncoderError;
+    }
+  }
+  thumbnailer_->SubmitFrame(raw_shared_frame_);
+  return kSuccess;
+}
+
+int WebmEncoder::QueueQualitySample(bool source_encoded) {
+  const int64 timestamp = raw_shared_frame_.empty() ?
+      raw_frame_.timestamp() : raw_shared_frame_->timestamp();
+  // Only a keyframe encoded from the frame just passed in is compared with
+  // it.
+  if (!quality_monitor_ || !source_encoded || !vpx_frame_.keyframe() ||
+      vpx_frame_.timestamp() != timestamp || !quality_monitor_->Due()) {
+    return kSuccess;
+  }
+  if (raw_shared_frame_.empty()) {
+    const int status =
+        quality_source_frames_.Wrap(&raw_frame_, &raw_shared_frame_);
+    if (status == SharedFramePool::kFull) {
+      return kSuccess;
+    } else if (status) {
+      LOG(ERROR) << "cannot share quality sample frame: " << status;
+      return kVideoEncoderError;
+    }
+  }
+  quality_monitor_->SubmitFrame(raw_shared_frame_, vpx_frame_);
+  return kSuccess;
+}
+
+// Compresses available video frames and muxes all of them.
+int WebmEncoder::EncodeVideoOnly() {
+  int status = BufferVideoFrames();
+  while (status == kSuccess && !vpx_pool_.IsEmpty()) {
+    status = EncodeVideoFrames();
+  }
+  return status;
+}
+
+// Compresses and muxes a batch of video frames.
+// - Compresses all frames available in |video_pool_| into |vpx_pool_| via
+//   |BufferVideoFrames()|.
+// - Reads up to |kVideoBatchSize| compressed frames from |vpx_pool_| at once,
+//   and passes them to the video muxers for muxing.
+int WebmEncoder::EncodeVideoFrames() {
+  int status = BufferVideoFrames();
+  if (status) {
+    return status;
+  }
+  int32 num_frames = 0;
+  status = vpx_pool_.DecommitBatch(kVideoBatchSize, vpx_batch_.get(),
+                                   &num_frames);
+  if (status) {
+    if (status != SpscBufferPool<VideoFrame>::kEmpty) {
+      LOG(ERROR) << "VideoFrame pool (VPx) Decommit failed! " << status;
+      return kVideoEncoderError;
+    }
+    return kSuccess;
+  }
+  for (int32 i = 0; i < num_frames; ++i) {
+    status = MuxVideoFrame(vpx_batch_[i]);
+    if (status) {
+      return status;
+    }
+  }
+  const int64 timestamp = vpx_batch_[num_frames - 1].timestamp();
+  VLOG(3) << "muxed (V) " << num_frames << " to " << timestamp / 1000.0;
+
+  // Update encoded duration once per batch.
+  UpdateEncodedDuration(timestamp);
+  return kSuccess;
+}
+
+int WebmEncoder::CompressVideoFrame(bool* ptr_frame_ready) {
+  CHECK_NOTNULL(ptr_frame_ready);
+  *ptr_frame_ready = false;
+
+  // Frames the encoder produced beyond one per input go out first.
+  if (video_encoder_.pending_frames() > 0) {
+    if (video_encoder_.ReadPendingFrame(&vpx_frame_) != kSuccess) {
+      LOG(ERROR) << "cannot read pending video frame.";
+      return kVideoEncoderError;
+    }
+    *ptr_frame_ready = true;
+    return kSuccess;
+  }
+
+  if (config_.video_drop_policy == WebmEncoderConfig::kDropStaleFrames) {
+    DropStaleVideoFrames();
+  }
+
+  // Try reading a video frame from the pool. The previous frame, when shared
+  // with the renditions, is released first.
+  raw_shared_frame_.Reset();
+  int status = video_pool_.Decommit(&raw_frame_);
+  if (status) {
+    if (status != SpscBufferPool<VideoFrame>::kEmpty) {
+      LOG(ERROR) << "VideoFrame pool Decommit failed! " << status;
+      return kVideoSinkError;
+    }
+    VLOG(4) << "No frames in VideoFrame pool";
+    return kSuccess;
+  }
+
+  VLOG(4) << "Encoder thread read raw frame.";
+  WEBMLIVE_TRACE_LATENCY(kLatencyVideo, kLatencyDecommitted,
+                         raw_frame_.timestamp());
+
+  status = OffsetTimestamp(timestamp_offset_, &raw_frame_);
+  if (status) {
+    LOG(ERROR) << "Video frame timestamp offset failed: " << status;
+    return kVideoEncoderError;
+  }
+  if (config_.video_passthrough) {
+    return PassThroughVideoFrame(ptr_frame_ready);
+  }
+  const VideoConfig& video_config = config_.actual_video_config;
+  if (video_config.crop_width || video_config.pad_alignment > 1) {
+    status = raw_frame_.SetCrop(video_config);
+    if (status) {
+      LOG(ERROR) << "Video frame crop failed: " << status;
+      return kVideoEncoderError;
+    }
+  }
+
+  // Pass the frame to the additional renditions and the thumbnailer before
+  // it is compressed.
+  status = QueueRenditionFrames();
+  if (status == kSuccess) {
+    status = QueueThumbnailFrame();
+  }
+  if (status) {
+    return status;
+  }
+  const VideoFrame& raw_frame =
+      raw_shared_frame_.empty() ? raw_frame_ : *raw_shared_frame_;
+
+  // Only the primary stream is degraded; the renditions got |raw_frame|.
+  const VideoFrame* ptr_input_frame = &raw_frame;
+  if (degradation_level_ > 0) {
+    status = DegradeVideoFrame(raw_frame, &ptr_input_frame);
+    if (status) {
+      return status;
+    }
+    if (!ptr_input_frame) {
+      return kSuccess;
+    }
+  }
+
+  // Encode the video frame.
+  ApplyVideoBitrate(raw_frame.timestamp());
+  ApplyVideoSettings(&requested_video_speed_, &requested_keyframe_interval_,
+                     &video_encoder_);
+  RequestSegmentKeyframe(ptr_input_frame->timestamp(), &next_segment_time_,
+                         &video_encoder_);
+  video_encoder_.SetInputBacklog(video_pool_.ActiveCount(),
+                                 video_pool_.limit());
+  WEBMLIVE_TRACE_LATENCY(kLatencyVideo, kLatencyEncodeStart,
+                         raw_frame.timestamp() - timestamp_offset_);
+  const std::chrono::steady_clock::time_point encode_start =
+      std::chrono::steady_clock::now();
+  status = video_encoder_.EncodeFrame(*ptr_input_frame, &vpx_frame_);
+  if (config_.video_pool_depth.enabled) {
+    const int64 encode_us =
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - encode_start).count();
+    UpdateVideoPoolDepth(raw_frame, encode_us);
+  }
+  if (config_.adaptive_resolution &&
+      (status == kSuccess || status == kDropped)) {
+    AdaptVideoDegradation();
+  }
+  if (status == kDropped) {
+    ++encoder_drops_;
+    return kSuccess;
+  } else if (status) {
+    LOG(ERROR) << "Video frame encode failed: " << status;
+    return kVideoEncoderError;
+  }
+  ++video_frames_encoded_;
+
+  // Frames held for lookahead carry their own capture times.
+  if (vpx_frame_.timestamp() == raw_frame.timestamp()) {
+    vpx_frame_.set_capture_time(raw_frame.capture_time());
+  }
+  video_encode_us_ += std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - encode_start).count();
+  WEBMLIVE_TRACE_LATENCY(kLatencyVideo, kLatencyEncodeEnd,
+                         raw_frame.timestamp() - timestamp_offset_);
+  // |raw_frame| is not used past this point: sharing it may move it.
+  status = QueueQualitySample(ptr_input_frame == &raw_frame);
+  if (status) {
+    return status;
+  }
+  *ptr_frame_ready = true;
+  return kSuccess;
+}
+
+int WebmEncoder::PassThroughVideoFrame(bool* ptr_frame_ready) {
+  const bool keyframe = VideoFrame::IsVpxKeyframe(
+      raw_frame_.format(), raw_frame_.buffer(), raw_frame_.buffer_length());
+  if (!keyframe && !passthrough_keyframe_seen_) {
+    ++encoder_drops_;
+    return kSuccess;
+  }
+  passthrough_keyframe_seen_ = true;
+  if (raw_frame_.Clone(&vpx_frame_) ||
+      vpx_frame_.InitInPlace(raw_frame_.config(), keyframe,
+                             raw_frame_.timestamp(), raw_frame_.duration(),
+                             raw_frame_.buffer_length())) {
+    LOG(ERROR) << "cannot copy passthrough video frame.";
+    return kVideoEncoderError;
+  }
+  vpx_frame_.set_capture_time(raw_frame_.capture_time());
+  ++video_frames_encoded_;
+  *ptr_frame_ready = true;
+  return kSuccess;
+}
+
+int WebmEncoder::DegradeVideoFrame(const VideoFrame& raw_frame,
+                                   const VideoFrame** ptr_frame) {
+  const DegradationLevel& level = kDegradationLevels[degradation_level_];
+  *ptr_frame = NULL;
+  if (degradation_frames_++ % level.frame_divisor) {
+    ++degradation_drops_;
+    return kSuccess;
+  }
+
+  // libyuv scales only planar frames.
+  const VideoFrame* ptr_source = &raw_frame;
+  if (raw_frame.format() == kVideoFormatNV12) {
+    if (degraded_i420_frame_.InitConverted(raw_frame)) {
+      LOG(ERROR) << "cannot convert NV12 frame for adaptive resolution.";
+      return kVideoEncoderError;
+    }
+    ptr_source = &degraded_i420_frame_;
+  }
+  int32 width = 0;
+  int32 height = 0;
+  DegradedFrameSize(config_.actual_video_config, level, &width, &height);
+  const int status = degraded_frame_.InitScaled(*ptr_source, width, height);
+  if (status) {
+    LOG(ERROR) << "adaptive resolution scale to " << width << "x" << height
+               << " failed: " << status;
+    return kVideoEncoderError;
+  }
+
+  // The encoded frame stands in for the frames skipped after it.
+  degraded_frame_.set_duration(raw_frame.duration() * level.frame_divisor);
+  *ptr_frame = &degraded_frame_;
+  return kSuccess;
+}
+
+void WebmEncoder::AdaptVideoDegradation() {
+  const int load = video_encoder_.load_state();
+  int level = degradation_level_;
+  if (load == VideoEncoder::kLoadSaturated &&
+      level + 1 < kNumDegradationLevels) {
+    ++level;
+  } else if (load == VideoEncoder::kLoadIdle && level > 0) {
+    --level;
+  }
+  if (level == degradation_level_) {
+    return;
+  }
+  const DegradationLevel& next = kDegradationLevels[level];
+  int32 width = 0;
+  int32 height = 0;
+  DegradedFrameSize(config_.actual_video_config, next, &width, &height);
+  const int status = video_encoder_.SetFrameSize(width, height);
+  if (status) {
+    WEBMLIVE_LOG_EVERY_MS(WARNING, kLogIntervalMs)
+        << "adaptive resolution cannot change video frame size to " << width
+        << "x" << height << ": " << status;
+    return;
+  }
+  LOG(INFO) << "adaptive resolution level " << degradation_level_ << " -> "
+            << level << ": " << width << "x" << height << ", 1/"
+            << next.frame_divisor << " frame rate.";
+  degradation_level_ = level;
+  degradation_frames_ = 0;
+  ++degradation_changes_;
+}
+
+void WebmEncoder::DropStaleVideoFrames() {
+  const int64 newest_timestamp =
+      newest_video_timestamp_.load(std::memory_order_acquire);
+  int64 dropped = 0;
+  int64 timestamp = 0;
+  while (video_pool_.ActiveCount() > 1 &&
+         video_pool_.ActiveBufferTimestamp(&timestamp) ==
+             SpscBufferPool<VideoFrame>::kSuccess &&
+         newest_timestamp - timestamp > config_.video_latency_budget) {
+    video_pool_.DropActiveBuffer();
+    ++dropped;
+  }
+  if (dropped > 0) {
+    stale_drops_ += dropped;
+    WEBMLIVE_LOG_EVERY_MS(WARNING, kLogIntervalMs)
+        << "dropped " << dropped << " stale video frame(s), "
+        << "newest timestamp " << newest_timestamp;
+  }
+}
+
+void WebmEncoder::UpdateVideoPoolDepth(const VideoFrame& frame,
+                                       int64 encode_us) {
+  // Capture times are on the capture clock; frames without one arrive by
+  // their timestamps.
+  const int64 arrival_us = (frame.capture_time() > 0) ?
+      frame.capture_time() : frame.timestamp() * 1000;
+  BufferPoolStats stats;
+  video_pool_.GetStats(&stats);
+  const int depth = video_pool_depth_.Update(arrival_us, encode_us,
+                                             stats.full_rejections);
+  if (depth != video_pool_.limit()) {
+    video_pool_.set_limit(depth);
+  }
+}
+
+int WebmEncoder::BufferVideoFrames() {
+  // Leave frames in |video_pool_| when no space remains for their compressed
+  // counterparts; |video_pool_| drops frames once it also fills.
+  while ((!video_pool_.IsEmpty() || video_encoder_.pending_frames() > 0) &&
+         !vpx_pool_.IsFull()) {
+    bool frame_ready = false;
+    int status = CompressVideoFrame(&frame_ready);
+    if (status) {
+      return status;
+    }
+    if (frame_ready) {
+      status = vpx_pool_.Commit(&vpx_frame_);
+      if (status) {
+        LOG(ERROR) << "VideoFrame pool (VPx) Commit failed! " << status;
+        return kVideoEncoderError;
+      }
+    }
+  }
+  return kSuccess;
+}
+
+int WebmEncoder::EncodeAudioBuffer() {
+  // Try reading samples from the ring.
+  PcmSpan span;
+  int status = audio_ring_.Read(&span);
+  if (status) {
+    if (status != PcmRingBuffer::kEmpty) {
+      // Really an error; not just an empty ring.
+      LOG(ERROR) << "PCM ring Read failed! " << status;
+      return kAudioSinkError;
+    }
+    VLOG(4) << "No samples in PCM ring";
+    return kSuccess;
+  }
+  VLOG(4) << "Encoder thread read raw audio samples.";
+  WEBMLIVE_TRACE_LATENCY(kLatencyAudio, kLatencyDecommitted, span.timestamp);
+  span.timestamp += timestamp_offset_;
+
+  // Pass the uncompressed audio to the audio encoder, which reads it from
+  // the ring. The span is released once the encoder is done with it.
+  ApplyAudioBitrate(span.timestamp);
+  MeasureAudioLevels(span);
+  WEBMLIVE_TRACE_LATENCY(kLatencyAudio, kLatencyEncodeStart,
+                         span.timestamp - timestamp_offset_);
+  const std::chrono::steady_clock::time_point encode_start =
+      std::chrono::steady_clock::now();
+
+  // The corrector copies the samples; an empty result is not encoded, as
+  // libvorbis takes no samples for the end of the stream.
+  PcmSpan encoder_span = span;
+  if (audio_drift_corrector_) {
+    status = audio_drift_corrector_->Correct(span, &encoder_span);
+    if (status == kSuccess && encoder_span.length == 0) {
+      audio_ring_.Release();
+      return kSuccess;
+    }
+  }
+  if (status == kSuccess) {
+    status = audio_renditions_.empty() ?
+        audio_encoder_->EncodeSpan(encoder_span) :
+        EncodeAudioRenditions(encoder_span);
+  }
+  audio_ring_.Release();
+  if (status) {
+    LOG(ERROR) << "audio encode failed " << status;
+    return kAudioEncoderError;
+  }
+  ++audio_buffers_encoded_;
+  audio_encode_us_ += std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - encode_start).count();
+  WEBMLIVE_TRACE_LATENCY(kLatencyAudio, kLatencyEncodeEnd,
+                         span.timestamp - timestamp_offset_);
+  return kSuccess;
+}
+
+void WebmEncoder::ApplyVideoBitrate(int64 timestamp) {
+  const int bitrate = requested_video_bitrate_.exchange(0);
+  if (bitrate == 0) {
+    // Segment budget corrections apply between configured changes.
+    const int segment_bitrate = segment_video_bitrate_.exchange(0);
+    if (segment_bitrate > 0 && video_encoder_.SetBitrate(segment_bitrate)) {
+      LOG(WARNING) << "segment video bitrate change to " << segment_bitrate
+                   << " kbps failed.";
+    }
+    return;
+  }
+  const int status = video_encoder_.SetBitrate(bitrate);
+  if (status) {
+    LOG(WARNING) << "video bitrate change to " << bitrate
+                 << " kbps failed: " << status;
+    return;
+  }
+  segment_video_bitrate_.store(0);
+  video_base_bitrate_.store(bitrate);
+  RecordBitrateChange(timestamp, false, bitrate);
+}
+
+void WebmEncoder::ApplyAudioBitrate(int64 timestamp) {
+  const int bitrate = requested_audio_bitrate_.exchange(0);
+  if (bitrate == 0) {
+    return;
+  }
+  const int status = audio_encoder_->SetBitrate(bitrate);
+  if (status) {
+    LOG(WARNING) << "audio bitrate change to " << bitrate
+                 << " kbps failed: " << status;
+    return;
+  }
+  RecordBitrateChange(timestamp, true, bitrate);
+}
+
+void WebmEncoder::MeasureAudioLevels(const PcmSpan& span) {
+  if (!audio_level_meter_) {
+    return;
+  }
+  audio_level_meter_->Measure(span);
+  const bool silent = audio_level_meter_->silent();
+  if (!config_.audio_levels.silence_encoding ||
+      silent == audio_encoder_silent_) {
+    return;
+  }
+  const int status = audio_encoder_->SetSilent(silent);
+  if (status) {
+    LOG(WARNING) << "audio encoder silence change failed: " << status;
+    return;
+  }
+  audio_encoder_silent_ = silent;
+  LOG(INFO) << "audio input " << (silent ? "silent" : "no longer silent")
+            << " at " << span.timestamp << " ms.";
+}
+
+void WebmEncoder::ApplyVideoSettings(std::atomic<int>* ptr_requested_speed,
+                                     std::atomic<int>* ptr_requested_interval,
+                                     VideoEncoder* ptr_encoder) {
+  const int kUnchanged = EncoderReconfiguration::kUnchanged;
+  const int speed = ptr_requested_speed->exchange(kUnchanged);
+  if (speed != kUnchanged) {
+    const int status = ptr_encoder->SetSpeed(speed);
+    if (status) {
+      LOG(WARNING) << "video speed change to " << speed << " failed: "
+                   << status;
+    }
+  }
+  const int interval = ptr_requested_interval->exchange(kUnchanged);
+  if (interval != kUnchanged) {
+    const int status = ptr_encoder->SetKeyframeInterval(interval);
+    if (status) {
+      LOG(WARNING) << "keyframe interval change to " << interval
+                   << "ms failed: " << status;
+    } else {
+      LOG(INFO) << "keyframe interval " << interval << "ms.";
+    }
+  }
+}
+
+void WebmEncoder::FollowSegmentSchedule(LiveWebmMuxer* ptr_muxer) {
+  if (segment_durations_) {
+    ptr_muxer->SetSegmentSchedule(segment_durations_.get(),
+                                  config_.adaptive_segments.max_duration);
+  }
+}
+
+void WebmEncoder::RequestSegmentKeyframe(int64 timestamp,
+                                         int64* ptr_next_segment_time,
+                                         VideoEncoder* ptr_encoder) {
+  if (!segment_durations_ || timestamp < *ptr_next_segment_time) {
+    return;
+  }
+  // The first frame is a keyframe without asking.
+  if (*ptr_next_segment_time > 0) {
+    ptr_encoder->RequestKeyframe();
+  }
+  *ptr_next_segment_time = segment_durations_->NextBoundary(timestamp);
+}
+
+void WebmEncoder::RecordBitrateChange(int64 timestamp, bool audio,
+                                      int bitrate) {
+  LOG(INFO) << (audio ? "audio" : "video") << " bitrate " << bitrate
+            << " kbps from " << timestamp << "ms.";
+  if (config_.dash_encode) {
+    dash_writer_->SetBandwidth(
+        audio ? AdaptationSet::kAudio : AdaptationSet::kVideo, 0,
+        bitrate * 1000);
+  }
+  BitrateChange change;
+  change.timestamp = timestamp;
+  change.audio = audio;
+  change.bitrate = bitrate;
+  std::lock_guard<std::mutex> lock(mutex_);
+  bitrate_changes_.push_back(change);
+}
+
+int WebmEncoder::WaitForSamples() {
+  // Wait for samples from the input stream(s).
+  bool got_audio = config_.disable_audio;
+  bool got_video = config_.disable_video;
+  for (;;) {
+    if (StopRequested()) {
+      return kSuccess;
+    }
+    if (!got_audio) {
+      got_audio = !audio_ring_.IsEmpty();
+    }
+    if (!got_video) {
+      got_video = !video_pool_.IsEmpty();
+    }
+    if (got_audio && got_video) {
+      break;
+    }
+    // Sleep on the pool still lacking input. The wait is bounded by
+    // |kInputWaitTimeout| so that |StopRequested()| is checked regularly.
+    if (!got_video) {
+      video_pool_.WaitForActive(kInputWaitTimeout);
+    } else {
+      audio_ring_.WaitForData(kInputWaitTimeout);
+    }
+  }
+
+  int64 first_audio_timestamp = 0;
+  if (!config_.disable_audio) {
+    int64& a_ts = first_audio_timestamp;
+    const int status = audio_ring_.FrontTimestamp(&a_ts);
+    if (status) {
+      LOG(ERROR) << "cannot read first audio timestamp: " << status;
+      return status;
+    }
+  }
+
+  int64 first_video_timestamp = 0;
+  if (!config_.disable_video) {
+    int64& v_ts = first_video_timestamp;
+    const int status = video_pool_.ActiveBufferTimestamp(&v_ts);
+    if (status) {
+      LOG(ERROR) << "cannot read first video timestamp: " << status;
+      return status;
+    }
+  }
+
+  if (first_audio_timestamp < 0 && first_video_timestamp < 0) {
+    const int first_a_ts = std::abs(static_cast<int>(first_audio_timestamp));
+    const int first_v_ts = std::abs(static_cast<int>(first_video_timestamp));
+    timestamp_offset_ = std::max(first_a_ts, first_v_ts);
+  } else if (first_audio_timestamp < 0) {
+    const int first_a_ts = std::abs(static_cast<int>(first_audio_timestamp));
+    timestamp_offset_ = first_a_ts;
+  } else if (first_video_timestamp < 0) {
+    const int first_v_ts = std::abs(static_cast<int>(first_video_timestamp));
+    timestamp_offset_ = first_v_ts;
+  }
+  LOG(INFO) << "WebmEncoder timestamp_offset_=" << timestamp_offset_;
+  return kSuccess;
+}
 
-// AudioSamplesCallbackInterface
-int WebmEncoder::OnSamplesReceived(AudioBuffer* ptr_buffer) {
-  const int status = audio_pool_.Commit(ptr_buffer);
-  if (status) {
-    LOG(ERROR) << "AudioBuffer pool Commit failed! " << status;
-    return AudioSamplesCallbackInterface::kNoMemory;
+void WebmEncoder::WaitForInput() {
+  // In pipelined mode |EncoderThread()| consumes compressed buffers.
+  SpscBufferPool<VideoFrame>& video_pool =
+      config_.pipeline_encode ? vpx_pool_ : video_pool_;
+
+  // Packets held by |interleaver_| are released by input of the other stream
+  // only; more input of their own stream would not let the encode step mux
+  // them, and waking on it would spin the encode loop.
+  bool wait_audio = !config_.disable_audio;
+  bool wait_video = !config_.disable_video;
+  if (interleaver_.WaitingForAudio()) {
+    wait_video = false;
+  } else if (interleaver_.WaitingForVideo()) {
+    wait_audio = false;
+  }
+
+  const bool audio_empty = config_.pipeline_encode ? vorbis_pool_.IsEmpty() :
+                                                     audio_ring_.IsEmpty();
+  const bool audio_ready = wait_audio && !audio_empty;
+  const bool video_ready = wait_video && !video_pool.IsEmpty();
+  if (audio_ready || video_ready) {
+    return;
+  }
+
+  // Video frames arrive at a steady rate and are the more frequent input when
+  // both streams are awaited, so sleep on |video_pool_| unless only audio is.
+  // Input of the other stream committed during the wait is picked up on
+  // wakeup, at most |kInputWaitTimeout| later.
+  if (!wait_video && config_.pipeline_encode) {
+    vorbis_pool_.WaitForActive(kInputWaitTimeout);
+  } else if (!wait_video) {
+    audio_ring_.WaitForData(kInputWaitTimeout);
+  } else {
+    video_pool.WaitForActive(kInputWaitTimeout);
+  }
+}
+
+int WebmEncoder::WriteMuxerChunkToDataSink(
+    std::unique_ptr<LiveWebmMuxer>* muxer) {
+  if (config_.stream_chunks) {
+    const int status = StreamMuxerData(muxer);
+    if (status) {
+      return status;
+    }
+  }
+  // Complete chunks leave the muxer as soon as they are ready; muxed stream
+  // chunks wait for |ptr_data_sink_| in |sink_queue_|, where
+  // |config_.sink_policy| bounds them.
+  int32 chunk_length = 0;
+  const bool chunk_ready = (*muxer)->ChunkReady(&chunk_length);
+  if (chunk_ready) {
+    const int64 chunk_num = (*muxer)->chunks_read();
+    std::string id = NextChunkId((*muxer)->muxer_id(), chunk_num);
+    // A complete chunk is waiting in |muxer|'s buffer.
+    SharedWebmChunk chunk;
+    if (!ReadChunkFromMuxer(muxer, id, &chunk)) {
+      LOG(ERROR) << "cannot read WebM chunk from muxer_id: "
+                 << (*muxer)->muxer_id();
+      return kWebmMuxerError;
+    }
+    if (chunk_num > 0) {
+      WEBMLIVE_TRACE_LATENCY(LatencyTraceStream((*muxer)->muxer_id()),
+                             kLatencyChunkReady,
+                             chunk->timestamp() - timestamp_offset_);
+    }
+    const int status = QueueChunk((*muxer)->muxer_id(), chunk_num, chunk);
+    if (status) {
+      return status;
+    }
+    if (first_chunk_ms_.load(std::memory_order_relaxed) < 0 &&
+        RecordStartupPhase(&first_chunk_ms_)) {
+      LOG(INFO) << "startup: device open " << device_open_ms_.load()
+                << " ms, graph run " << graph_run_ms_.load()
+                << " ms, first audio " << first_audio_ms_.load()
+                << " ms, first video " << first_video_ms_.load()
+                << " ms, first chunk " << first_chunk_ms_.load() << " ms.";
+    }
+  }
+  if (muxer->get() == ptr_muxer_.get()) {
+    return DrainSinkQueue();
   }
-  LOG(INFO) << "OnSamplesReceived committed an audio buffer.";
   return kSuccess;
 }
 
-// VideoFrameCallbackInterface
-int WebmEncoder::OnVideoFrameReceived(VideoFrame* ptr_frame) {
-  const int status = video_pool_.Commit(ptr_frame);
+int WebmEncoder::WriteLastMuxerChunkToDataSink(
+    std::unique_ptr<LiveWebmMuxer>* muxer) {
+  // The last chunks follow those still waiting for the muxer's drain task.
+  WaitForChunkDrains((*muxer)->muxer_id());
+  int status = (*muxer)->Finalize();
   if (status) {
-    if (status != BufferPool<VideoFrame>::kFull) {
-      LOG(ERROR) << "VideoFrame pool Commit failed: " << status;
+    LOG(ERROR) << "muxer Finalize failed, muxer_id: " << (*muxer)->muxer_id()
+               << " status: " << status;
+    return status;
+  }
+  if (config_.stream_chunks) {
+    status = StreamMuxerData(muxer);
+    if (status) {
+      return status;
     }
-    LOG(INFO) << "VideoFrame pool dropped frame (no buffers).";
-    return VideoFrameCallbackInterface::kDropped;
   }
-  LOG(INFO) << "OnVideoFrameReceived committed a frame.";
+  // Clusters are read as separate chunks; write every chunk still buffered.
+  int32 chunk_length = 0;
+  while (status == kSuccess && (*muxer)->ChunkReady(&chunk_length)) {
+    LOG(INFO) << "mkvmuxer Finalize produced a chunk.";
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ++shutdown_stats_.final_chunks;
+    }
+    const int64 chunk_num = (*muxer)->chunks_read();
+    std::string id = NextChunkId((*muxer)->muxer_id(), chunk_num);
+    SharedWebmChunk chunk;
+    if (ReadChunkFromMuxer(muxer, id, &chunk)) {
+      status = OutputChunk((*muxer)->muxer_id(), chunk_num, chunk);
+      if (status) {
+        LOG(ERROR) << "cannot write final chunk: " << id;
+      }
+    } else {
+      status = kWebmMuxerError;
+    }
+  }
+  if (muxer->get() != ptr_muxer_.get()) {
+    return status;
+  }
+
+  // Wait for the data sink to accept the queued muxed stream chunks, and a
+  // manifest held back by an open stream chunk, until the stop deadline.
+  // Chunks submitted to |async_sink_| are waited for until complete.
+  for (;;) {
+    bool sink_busy = !sink_queue_.empty() || pending_manifest_ ||
+                     (sink_spill_ && !sink_spill_->empty());
+    if (async_sink_) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      sink_busy = sink_busy || sink_stats_.in_flight_chunks > 0;
+    }
+    if (status != kSuccess || !sink_busy) {
+      break;
+    }
+    if (StopDeadlinePassed()) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      shutdown_stats_.sink_chunks_abandoned =
+          sink_stats_.queued_chunks + sink_stats_.in_flight_chunks;
+      shutdown_stats_.sink_bytes_abandoned = sink_stats_.queued_bytes;
+      if (sink_spill_) {
+        shutdown_stats_.sink_chunks_abandoned +=
+            sink_spill_->stats().pending_chunks;
+        shutdown_stats_.sink_bytes_abandoned +=
+            sink_spill_->stats().pending_bytes;
+      }
+      break;
+    }
+    status = DrainSinkQueue();
+    if (status == kSuccess) {
+      WaitForDataSink();
+    }
+  }
+  return status;
+}
+
+int WebmEncoder::InitChunkDrains() {
+  if (!config_.dash_encode || config_.dash_drain_channel < 0) {
+    return kSuccess;
+  }
+  std::vector<std::string> muxer_ids;
+  if (ptr_muxer_aud_) {
+    muxer_ids.push_back(ptr_muxer_aud_->muxer_id());
+  }
+  if (ptr_muxer_vid_) {
+    muxer_ids.push_back(ptr_muxer_vid_->muxer_id());
+  }
+  for (size_t i = 0; i < renditions_.size(); ++i) {
+    muxer_ids.push_back(renditions_[i]->muxer->muxer_id());
+  }
+  for (size_t i = 0; i < audio_renditions_.size(); ++i) {
+    muxer_ids.push_back(audio_renditions_[i]->muxer->muxer_id());
+  }
+  for (size_t i = 0; i < muxer_ids.size(); ++i) {
+    std::unique_ptr<ChunkDrain> drain(
+        new (std::nothrow) ChunkDrain);  // NOLINT
+    if (!drain) {
+      return kNoMemory;
+    }
+    drain->muxer_id = muxer_ids[i];
+    chunk_drains_.push_back(std::move(drain));
+  }
+  LOG(INFO) << "DASH chunks of " << chunk_drains_.size()
+            << " muxers drain on scheduler channel "
+            << config_.dash_drain_channel;
   return kSuccess;
 }
 
-// Tries to obtain lock on |mutex_| and returns value of |stop_| if lock is
-// obtained. Assumes no stop requested and returns false if unable to obtain
-// the lock.
-bool WebmEncoder::StopRequested() {
-  bool stop_requested = false;
-  std::unique_lock<std::mutex> lock(mutex_, std::try_to_lock);
-  if (lock.owns_lock()) {
-    stop_requested = stop_;
+WebmEncoder::ChunkDrain* WebmEncoder::FindChunkDrain(
+    const std::string& muxer_id) const {
+  for (size_t i = 0; i < chunk_drains_.size(); ++i) {
+    if (chunk_drains_[i]->muxer_id == muxer_id) {
+      return chunk_drains_[i].get();
+    }
   }
-  return stop_requested;
+  return NULL;
 }
 
-bool WebmEncoder::ReadChunkFromMuxer(std::unique_ptr<LiveWebmMuxer>* muxer,
-                                     int32 chunk_length) {
-  // Confirm that there's enough space in the chunk buffer.
-  if (chunk_length > chunk_buffer_size_) {
-    const int32 new_size = chunk_length * 2;
-    chunk_buffer_.reset(new (std::nothrow) uint8[new_size]);  // NOLINT
-    if (!chunk_buffer_) {
-      LOG(ERROR) << "chunk buffer reallocation failed!";
-      return false;
+int WebmEncoder::QueueChunk(const std::string& muxer_id, int64 chunk_num,
+                            const SharedWebmChunk& chunk) {
+  ChunkDrain* const ptr_drain = FindChunkDrain(muxer_id);
+  if (!ptr_drain) {
+    return WriteChunk(muxer_id, chunk_num, chunk);
+  }
+  ChunkDrain::Entry entry;
+  entry.chunk_num = chunk_num;
+  entry.chunk = chunk;
+  {
+    std::lock_guard<std::mutex> lock(ptr_drain->mutex);
+    ptr_drain->chunks.push_back(entry);
+    if (ptr_drain->scheduled) {
+      return kSuccess;
     }
-    chunk_buffer_size_ = new_size;
+    ptr_drain->scheduled = true;
   }
+  const TaskScheduler::Task task = [this, ptr_drain] {
+    DrainChunks(ptr_drain);
+  };
+  if (!TaskScheduler::Instance()->Post(config_.dash_drain_channel, task)) {
+    WEBMLIVE_LOG_EVERY_MS(WARNING, kLogIntervalMs)
+        << "scheduler not running, writing " << muxer_id << " chunks inline.";
+    DrainChunks(ptr_drain);
+  }
+  // Errors of the drain task stop |EncoderThread()| through
+  // |pipeline_status()|.
+  return kSuccess;
+}
 
-  // Read the chunk into |chunk_buffer_|.
-  const int status = (*muxer)->ReadChunk(chunk_buffer_size_,
-                                         chunk_buffer_.get());
+int WebmEncoder::WriteChunk(const std::string& muxer_id, int64 chunk_num,
+                            const SharedWebmChunk& chunk) {
+  const int status = OutputChunk(muxer_id, chunk_num, chunk);
   if (status) {
-    LOG(ERROR) << "error reading chunk: " << status;
-    return false;
+    return status;
   }
-
-  return true;
+  if (!dash_writer_->dynamic() && RemoveExpiredSegments()) {
+    return kFileWriteError;
+  }
+  return kSuccess;
 }
 
-void WebmEncoder::EncoderThread() {
-  LOG(INFO) << "EncoderThread started.";
-
-  // Set to true the encode loop breaks because |StopRequested()| returns true.
-  bool user_initiated_stop = false;
-
-  if (!ptr_encode_func_) {
-    // NULL encode function pointer; fatal/die:
-    LOG(FATAL) << "NULL encode function pointer!";
+void WebmEncoder::DrainChunks(ChunkDrain* ptr_drain) {
+  for (;;) {
+    ChunkDrain::Entry entry;
+    {
+      std::lock_guard<std::mutex> lock(ptr_drain->mutex);
+      if (ptr_drain->chunks.empty()) {
+        ptr_drain->scheduled = false;
+        ptr_drain->idle.notify_all();
+        return;
+      }
+      entry = ptr_drain->chunks.front();
+      ptr_drain->chunks.pop_front();
+    }
+    const int status =
+        WriteChunk(ptr_drain->muxer_id, entry.chunk_num, entry.chunk);
+    if (status) {
+      LOG(ERROR) << "chunk write (" << ptr_drain->muxer_id << ") failed: "
+                 << status;
+      SetPipelineStatus(status);
+    }
   }
+}
 
-  // Run the media source to get samples flowing.
-  int status = ptr_media_source_->Run();
-  if (status) {
-    // media source Run failed; fatal/die:
-    LOG(FATAL) << "Unable to run the media source! " << status;
+void WebmEncoder::WaitForChunkDrains(const std::string& muxer_id) {
+  for (size_t i = 0; i < chunk_drains_.size(); ++i) {
+    ChunkDrain& drain = *chunk_drains_[i];
+    if (!muxer_id.empty() && drain.muxer_id != muxer_id) {
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(drain.mutex);
+    while (drain.scheduled) {
+      drain.idle.wait(lock);
+    }
   }
+}
 
-  // Send the DASH manifest.
-  dash_writer_.reset(new (std::nothrow) DashWriter);  // NOLINT
-  if (!dash_writer_) {
-    LOG(FATAL) << "cannot construct dash writer!";
+int WebmEncoder::PublishInitSegments() {
+  if (!config_.dash_encode) {
+    return kSuccess;
   }
-  if (!dash_writer_->Init(config_)) {
-    LOG(ERROR) << "DashWriter::Init failed.";
+  std::vector<LiveWebmMuxer*> muxers;
+  muxers.push_back(ptr_muxer_aud_.get());
+  muxers.push_back(ptr_muxer_vid_.get());
+  for (size_t i = 0; i < renditions_.size(); ++i) {
+    muxers.push_back(renditions_[i]->muxer.get());
   }
-  std::string dash_manifest;
-  if (!dash_writer_->WriteManifest(&dash_manifest)) {
-    LOG(ERROR) << "DashWriter::WriteManifest failed.";
+  for (size_t i = 0; i < audio_renditions_.size(); ++i) {
+    muxers.push_back(audio_renditions_[i]->muxer.get());
+  }
+  for (size_t i = 0; i < muxers.size(); ++i) {
+    // Muxers of disabled streams have no tracks.
+    if (!muxers[i] || muxers[i]->track_config_key().empty()) {
+      continue;
+    }
+    const std::string muxer_id = muxers[i]->muxer_id();
+    SharedWebmChunk chunk;
+    int status =
+        muxers[i]->WriteInitSegment(NextChunkId(muxer_id, 0), &chunk);
+    if (status) {
+      LOG(ERROR) << "WriteInitSegment failed, muxer_id: " << muxer_id
+                 << " status: " << status;
+      return kWebmMuxerError;
+    }
+    status = OutputChunk(muxer_id, 0, chunk);
+    if (status) {
+      LOG(ERROR) << "cannot publish init segment: " << chunk->id();
+      return status;
+    }
+    early_init_segments_[muxer_id] = chunk;
   }
+  LOG(INFO) << early_init_segments_.size()
+            << " init segment(s) published ahead of capture.";
+  return kSuccess;
+}
 
+int WebmEncoder::OutputChunk(const std::string& muxer_id, int64 chunk_num,
+                             const SharedWebmChunk& chunk) {
+  if (muxer_id == kMuxedId) {
+    if (chunk_num == 0) {
+      // Sinks that resend the initialization segment use the muxer's copy.
+      ptr_data_sink_->SetInitSegment(ptr_muxer_->init_segment());
+    }
+    // Streamed chunks have already been passed to |ptr_data_sink_|.
+    if (!config_.stream_chunks) {
+      QueueSinkChunk(chunk, chunk_num == 0);
+    } else if (chunk_num > 0) {
+      WEBMLIVE_TRACE_LATENCY(LatencyTraceStream(muxer_id),
+                             kLatencySinkWritten,
+                             chunk->timestamp() - timestamp_offset_);
+    }
+    return kSuccess;
+  }
+  if (chunk_num == 0) {
+    const std::map<std::string, SharedWebmChunk>::const_iterator early =
+        early_init_segments_.find(muxer_id);
+    if (early != early_init_segments_.end() && early->second != chunk) {
+      const SharedWebmChunk& published = early->second;
+      if (published->length() == chunk->length() &&
+          !memcmp(published->data(), chunk->data(), chunk->length())) {
+        return kSuccess;
+      }
+      LOG(WARNING) << "init segment of " << muxer_id << " differs from the "
+                   << "one published ahead of capture, replacing it.";
+    }
+  }
 #if 0
-  ptr_data_sink_->WriteData(
-      reinterpret_cast<const uint8*>(dash_manifest.data()),
-      dash_manifest.length(), "manifest");
+  // Pass the chunk to |ptr_data_sink_|.
+  if (!ptr_data_sink_->WriteChunk(chunk)) {
+    LOG(ERROR) << "data sink write failed!";
+    return kDataSinkWriteFail;
+  }
 #endif
+  if (config_.dash_single_file) {
+    // The initialization segment starts the Representation's file, and each
+    // media segment is appended to it.
+    const AdaptationSet::MediaType media_type = IsAudioMuxer(muxer_id) ?
+        AdaptationSet::kAudio : AdaptationSet::kVideo;
+    const int rendition = RenditionForMuxer(muxer_id);
+    const std::string name =
+        dash_writer_->FileForRepresentation(media_type, rendition);
+    const bool written = (chunk_num == 0) ?
+        dash_file_sink_.WriteChunkToFile(name, chunk) :
+        dash_file_sink_.AppendChunkToFile(name, chunk);
+    if (!written) {
+      LOG(ERROR) << "cannot enqueue chunk for " << name << ": "
+                 << chunk->id();
+      return kFileWriteError;
+    }
+    if (chunk_num == 0) {
+      dash_writer_->AddInitialization(media_type, rendition, chunk->length());
+    }
+  }
+  for (size_t i = 0; i < dash_sinks_.size(); ++i) {
+    const bool file_sink = (dash_sinks_[i] == &dash_file_sink_);
+    // Single-file output appends the chunk to its Representation's file
+    // above.
+    if (file_sink && config_.dash_single_file) {
+      continue;
+    }
+    if (!dash_sinks_[i]->WriteChunk(chunk)) {
+      LOG(ERROR) << "DASH sink write failed: " << chunk->id();
+      return file_sink ? kFileWriteError : kDataSinkWriteFail;
+    }
+  }
+  // A segment too large for the ring is logged and skipped by the writer;
+  // the other outputs still carry it.
+  if (segment_ring_) {
+    segment_ring_->WriteChunk(chunk, chunk_num == 0);
+  }
+  if (config_.dash_segment_index) {
+    const int status = WriteSegmentIndex(muxer_id, chunk_num, chunk);
+    if (status) {
+      return status;
+    }
+  }
+  if (chunk_num > 0) {
+    WEBMLIVE_TRACE_LATENCY(LatencyTraceStream(muxer_id), kLatencySinkWritten,
+                           chunk->timestamp() - timestamp_offset_);
+    RecordDashSegment(muxer_id, chunk->id(), chunk);
+  }
+  return kSuccess;
+}
 
-  // HACK: HERE BE DRAGONS
-  CHECK(WriteManifest(config_.dash_dir + "webmlive.mpd", dash_manifest));
+int WebmEncoder::WriteSegmentIndex(const std::string& muxer_id,
+                                   int64 chunk_num,
+                                   const SharedWebmChunk& chunk) {
+  const AdaptationSet::MediaType media_type = IsAudioMuxer(muxer_id) ?
+      AdaptationSet::kAudio : AdaptationSet::kVideo;
+  const std::string name = dash_writer_->IndexForRepresentation(
+      media_type, RenditionForMuxer(muxer_id));
+  // The initialization segment replaces the index of an earlier run with an
+  // empty file.
+  SegmentIndexRecord record;
+  SegmentIndexRecordForChunk(chunk_num, *chunk, &record);
+  const SharedWebmChunk index_chunk =
+      MakeSegmentIndexChunk(name, (chunk_num == 0) ? NULL : &record);
+  if (!index_chunk) {
+    return kNoMemory;
+  }
+  const bool written = (chunk_num == 0) ?
+      dash_file_sink_.WriteChunkToFile(name, index_chunk) :
+      dash_file_sink_.AppendChunkToFile(name, index_chunk);
+  if (!written) {
+    LOG(ERROR) << "cannot enqueue segment index record for " << name << ": "
+               << chunk->id();
+    return kFileWriteError;
+  }
+  return kSuccess;
+}
 
-  // Wait for an input sample from each input stream-- this sets the
-  // |timestamp_offset_| value when one or both streams starts with a negative
-  // timestamp to avoid passing negative timestamps to libvpx and libwebm.
-  status = WaitForSamples();
-  if (status) {
-    LOG(ERROR) << "WaitForSamples failed: " << status;
-  } else {
-    for (;;) {
-      if (StopRequested()) {
-        LOG(INFO) << "StopRequested returned true, stopping...";
-        user_initiated_stop = true;
-        break;
-      }
-      status = ptr_media_source_->CheckStatus();
-      if (status) {
-        LOG(ERROR) << "Media source in a bad state, stopping: " << status;
-        break;
-      }
-      status = (this->*ptr_encode_func_)();
-      if (status) {
-        LOG(ERROR) << "encoding failed: " << status;
-        break;
-      }
-      if (config_.dash_encode) {
-        if (!config_.disable_audio) {
-          status = WriteMuxerChunkToDataSink(&ptr_muxer_aud_);
-          if (status) {
-            LOG(ERROR) << "chunk write (A) failed: " << status;
-            break;
-          }
-        }
-        if (!config_.disable_video) {
-          status = WriteMuxerChunkToDataSink(&ptr_muxer_vid_);
-          if (status) {
-            LOG(ERROR) << "chunk write (V) failed: " << status;
-            break;
-          }
-        }
-      } else {
-        status = WriteMuxerChunkToDataSink(&ptr_muxer_);
-        if (status) {
-          LOG(ERROR) << "muxed chunk write failed: " << status;
-          break;
-        }
-      }
-    }
+void WebmEncoder::QueueSinkChunk(const SharedWebmChunk& chunk, bool header) {
+  SinkChunk sink_chunk;
+  sink_chunk.chunk = chunk;
+  sink_chunk.header = header;
+  sink_queue_.push_back(sink_chunk);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    sink_stats_.queued_chunks = static_cast<int32>(sink_queue_.size());
+    sink_stats_.queued_bytes += chunk->length();
+    sink_stats_.max_queued_bytes =
+        std::max(sink_stats_.max_queued_bytes, sink_stats_.queued_bytes);
+  }
+  MemoryAccountant::Instance()->Add(kMemorySinkQueue, chunk->length());
 
-    if (user_initiated_stop) {
-      // When |user_initiated_stop| is true the encode loop has been broken
-      // cleanly (without error). Call |LiveWebmMuxer::Finalize()| to flush any
-      // buffered samples, and upload the final chunk if one becomes available.
-      if (config_.dash_encode) {
-        if (!config_.disable_audio) {
-          status = WriteLastMuxerChunkToDataSink(&ptr_muxer_aud_);
-          if (status) {
-            LOG(ERROR) << "Failed to write last dash audio chunk";
-          }
-        }
-        if (!config_.disable_video) {
-          status = WriteLastMuxerChunkToDataSink(&ptr_muxer_vid_);
-          if (status) {
-            LOG(ERROR) << "Failed to write last dash video chunk";
-          }
-        }
-      } else {
-        status = WriteLastMuxerChunkToDataSink(&ptr_muxer_);
-        if (status) {
-          LOG(ERROR) << "Failed to write last non-dash chunk";
-        }
+  const int64 limit = SinkQueueLimit();
+  switch (config_.sink_policy) {
+    case WebmEncoderConfig::kSinkDropOldest:
+    case WebmEncoderConfig::kSinkSpill:
+      DropSinkChunks(limit);
+      break;
+    case WebmEncoderConfig::kSinkDropVideo:
+      if (!drop_muxed_video_ && sink_stats_.queued_bytes > limit) {
+        LOG(WARNING) << "data sink backlog of " << sink_stats_.queued_bytes
+                     << " bytes, dropping video from the muxed stream.";
+        drop_muxed_video_ = true;
       }
+      DropSinkChunks(limit * 2);
+      break;
+    case WebmEncoderConfig::kSinkSignal:
+      DropSinkChunks(limit * 2);
+      break;
+    case WebmEncoderConfig::kSinkQueueUnbounded:
+      break;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  sink_stats_.congested = sink_stats_.queued_bytes > limit;
+}
+
+int WebmEncoder::DrainSinkQueue() {
+  if (async_sink_) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (sink_failed_) {
+      LOG(ERROR) << "data sink write failed.";
+      return kDataSinkWriteFail;
     }
+  }
+  // The manifest and the thumbnail take priority over media chunks.
+  int status = WriteSinkManifest();
+  if (status == kSuccess) {
+    status = WriteSinkThumbnail();
+  }
+  while (status == kSuccess && !sink_queue_.empty() && SinkAcceptsChunk()) {
+    const SharedWebmChunk chunk = sink_queue_.front().chunk;
+    if (!PassChunkToSink(chunk)) {
+      LOG(ERROR) << "data sink write failed: " << chunk->id();
+      status = kDataSinkWriteFail;
+      break;
+    }
+    if (!sink_queue_.front().header) {
+      WEBMLIVE_TRACE_LATENCY(LatencyTraceStream(kMuxedId),
+                             kLatencySinkWritten,
+                             chunk->timestamp() - timestamp_offset_);
+    }
+    sink_queue_.pop_front();
+    MemoryAccountant::Instance()->Add(kMemorySinkQueue, -chunk->length());
+    std::lock_guard<std::mutex> lock(mutex_);
+    sink_stats_.queued_chunks = static_cast<int32>(sink_queue_.size());
+    sink_stats_.queued_bytes -= chunk->length();
+  }
+  // Spilled chunks only go once the live ones are out.
+  if (status == kSuccess && sink_spill_ && sink_queue_.empty()) {
+    status = ReplaySpilledChunks();
+  }
 
-    ptr_media_source_->Stop();
+  // Blocked time is accounted in whole milliseconds; the remainder carries
+  // over to the next call.
+  const std::chrono::steady_clock::time_point now =
+      std::chrono::steady_clock::now();
+  const int64 limit = SinkQueueLimit();
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (sink_blocked_) {
+    const int64 blocked_ms =
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+            now - sink_blocked_time_).count();
+    sink_stats_.blocked_ms += blocked_ms;
+    sink_blocked_time_ += std::chrono::milliseconds(blocked_ms);
+  } else {
+    sink_blocked_time_ = now;
+  }
+  sink_blocked_ = !sink_queue_.empty();
+  sink_stats_.congested = sink_stats_.queued_bytes > limit;
+  return status;
+}
+
+void WebmEncoder::DropSinkChunks(int64 limit) {
+  // The continuations of a dropped chunk are dropped with it, so that what
+  // remains of the stream resumes at a segment start. Spilled chunks keep
+  // the same order, and so replay whole segments.
+  bool dropped = false;
+  std::deque<SinkChunk>::iterator it = sink_queue_.begin();
+  while (it != sink_queue_.end() &&
+         (sink_stats_.queued_bytes > limit ||
+          (dropped && it->chunk->descriptor().continuation))) {
+    if (it->header) {
+      ++it;
+      continue;
+    }
+    dropped = true;
+    const bool spilled = sink_spill_ &&
+        sink_spill_->Append(it->chunk) == SinkSpillFile::kSuccess;
+    const int32 length = it->chunk->length();
+    it = sink_queue_.erase(it);
+    MemoryAccountant::Instance()->Add(kMemorySinkQueue, -length);
+    std::lock_guard<std::mutex> lock(mutex_);
+    sink_stats_.queued_chunks = static_cast<int32>(sink_queue_.size());
+    sink_stats_.queued_bytes -= length;
+    if (spilled) {
+      CopySpillStats();
+      WEBMLIVE_LOG_EVERY_MS(WARNING, kLogIntervalMs)
+          << "data sink is falling behind, " << sink_stats_.spilled_chunks
+          << " muxed chunk(s) spilled to " << config_.sink_spill.path;
+      continue;
+    }
+    ++sink_stats_.dropped_chunks;
+    WEBMLIVE_LOG_EVERY_MS(WARNING, kLogIntervalMs)
+        << "data sink is falling behind, " << sink_stats_.dropped_chunks
+        << " muxed chunk(s) dropped.";
   }
-  LOG(INFO) << "EncoderThread finished.";
 }
 
-// On each encoding pass:
-// - Attempts to read one uncompressed audio buffer from |audio_pool_|, and
-//   feeds it |vorbis_encoder_| for compression when successful.
-// - Passes all available compressed audio produced by |vorbis_encoder_| to
-//   |ptr_muxer_| for muxing.
-int WebmEncoder::EncodeAudioOnly() {
-  // Encode a single audio buffer.
-  int status = EncodeAudioBuffer();
-  if (status) {
-    LOG(ERROR) << "EncodeAudioBuffer failed: " << status;
-    return status;
+int WebmEncoder::ReplaySpilledChunks() {
+  int status = kSuccess;
+  while (SinkAcceptsChunk()) {
+    SharedWebmChunk chunk;
+    const int spill_status = sink_spill_->NextChunk(&chunk);
+    if (spill_status == SinkSpillFile::kFileError) {
+      LOG(WARNING) << "spilled chunk lost.";
+      continue;
+    }
+    if (spill_status != SinkSpillFile::kSuccess) {
+      break;
+    }
+    if (!PassChunkToSink(chunk)) {
+      LOG(ERROR) << "data sink write failed: " << chunk->id();
+      status = kDataSinkWriteFail;
+      break;
+    }
+    sink_spill_->PopChunk();
   }
+  std::lock_guard<std::mutex> lock(mutex_);
+  CopySpillStats();
+  return status;
+}
 
-  // Read and mux vorbis data until no more is available from |vorbis_encoder_|.
-  AudioBuffer* vb = &vorbis_audio_buffer_;
-  VorbisEncoder* ve = &vorbis_encoder_;
-  while ((status = ve->ReadCompressedAudio(vb)) == kSuccess) {
-    // Mux the vorbis data.
-    const int mux_status = ptr_muxer_->WriteAudioBuffer(*vb);
-    if (mux_status) {
-      LOG(ERROR) << "Audio buffer mux failed " << mux_status;
-      return mux_status;
-    }
-    VLOG(4) << "muxed (A) " << vorbis_audio_buffer_.timestamp() / 1000.0;
+void WebmEncoder::CopySpillStats() {
+  const SinkSpillStats& spill_stats = sink_spill_->stats();
+  sink_stats_.spilled_chunks = spill_stats.spilled_chunks;
+  sink_stats_.spilled_bytes = spill_stats.spilled_bytes;
+  sink_stats_.replayed_chunks = spill_stats.replayed_chunks;
+  sink_stats_.spill_pending_bytes = spill_stats.pending_bytes;
+}
 
-    // Update encoded duration if able to obtain the lock.
-    std::unique_lock<std::mutex> lock(mutex_, std::try_to_lock);
-    if (lock.owns_lock()) {
-      encoded_duration_ = vb->timestamp();
+int64 WebmEncoder::SinkQueueLimit() {
+  const int64 limit = config_.sink_queue_limit;
+  if (config_.memory_budget == 0) {
+    return limit;
+  }
+  const int64 excess =
+      MemoryAccountant::Instance()->total_bytes() - config_.memory_budget;
+  const bool over_budget = excess > 0;
+  if (over_budget != sink_stats_.over_memory_budget) {
+    if (over_budget) {
+      LOG(WARNING) << "media data exceeds the memory budget of "
+                   << config_.memory_budget << " bytes by " << excess
+                   << " bytes, applying the sink policy.";
+    } else {
+      LOG(INFO) << "media data back within the memory budget.";
     }
+    std::lock_guard<std::mutex> lock(mutex_);
+    sink_stats_.over_memory_budget = over_budget;
   }
-  if (status < 0) {
-    LOG(ERROR) << "Error reading vorbis samples: " << status;
-    return kAudioEncoderError;
+  if (!over_budget) {
+    return limit;
   }
-  return kSuccess;
+  return std::max<int64>(std::min(limit, sink_stats_.queued_bytes - excess),
+                         0);
 }
 
-// On each encoding pass:
-// - Attempts to read an uncompressed audio buffer from |audio_pool_|, and
-//   passes it to |vorbis_encoder_| when a buffer is available.
-// - Stores the timestamp of the first available video frame from |video_pool_|
-//   in |video_timestamp|, or uses the last encoded timestamp added to the
-//   calculated time per frame if no frame is available.
-// - Reads one compressed audio buffer from |vorbis_encoder_| into
-//   |vorbis_audio_buffer_|, and
-//   - Passes it to |ptr_muxer_| when the compressed audio buffer timestamp is
-//     less than the stored video timestamp, or
-//   - Stores the compressed audio buffer and sets the |vorbis_buffered| flag
-//     to true, and then waits to mux the audio until:
-// - When the stored |video_timestamp| is less than or equal to the _estimated_
-//   timestamp of the next compressed audio buffer from |vorbis_encoder_|, calls
-//   |EncodeVideoFrame()| to attempt to read and encode a video frame. This is
-//   repeated until no video frames are available, or the next frame available
-//   would cause video to get ahead of audio.
-// - When the |vorbis_buffered| flag was set because the audio timestamp
-//   produced by |vorbis_encoder_| was greater than |video_timestamp|, passes
-//   |vorbis_audio_buffer_| to |ptr_muxer_|.
-int WebmEncoder::AVEncode() {
-  // Encode a single audio buffer.
-  int status = EncodeAudioBuffer();
-  if (status) {
-    LOG(ERROR) << "EncodeAudioBuffer failed: " << status;
-    return status;
+bool WebmEncoder::SkipMuxedVideoFrame(const VideoFrame& video_frame) {
+  if (!drop_muxed_video_) {
+    return false;
   }
-
-  // Store the next video timestamp.
-  int64 video_timestamp = 0;
-  status = PeekVideoTimestamp(&video_timestamp);
-  if (status < 0) {
-    LOG(ERROR) << "Video timestamp peek failed: " << status;
-    return status;
+  if (video_frame.keyframe() &&
+      sink_stats_.queued_bytes <= SinkQueueLimit() / 2) {
+    LOG(INFO) << "data sink caught up, muxing video again at "
+              << video_frame.timestamp() << " ms.";
+    drop_muxed_video_ = false;
+    return false;
   }
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++sink_stats_.dropped_video_frames;
+  return true;
+}
 
-  // Read compressed audio until no more remains, or the compressed buffer
-  // timestamp is greater than |video_timestamp|.
-  bool vorbis_buffered = false;
-  AudioBuffer& vorb_buf = vorbis_audio_buffer_;
-  VorbisEncoder& vorb_enc = vorbis_encoder_;
-  if (vorb_enc.time_encoded() <= video_timestamp) {
-    while ((status = vorb_enc.ReadCompressedAudio(&vorb_buf)) == kSuccess) {
-      if (video_timestamp < vorb_buf.timestamp()) {
-        vorbis_buffered = true;
-        break;
+int WebmEncoder::StreamMuxerData(std::unique_ptr<LiveWebmMuxer>* muxer) {
+  LiveWebmMuxer::WriteBuffer::StreamData data;
+  int64 chunk_num = (*muxer)->chunks_streamed();
+  std::string id;
+  while ((*muxer)->ReadStreamData(&data)) {
+    if (id.empty()) {
+      id = NextChunkId((*muxer)->muxer_id(), chunk_num);
+    }
+    if (data.chunk_start) {
+      if (!ptr_data_sink_->BeginStream(id)) {
+        LOG(ERROR) << "data sink cannot begin stream: " << id;
+        return kDataSinkWriteFail;
+      }
+      muxed_stream_open_ = true;
+    }
+    if (data.length > 0 &&
+        !ptr_data_sink_->WriteStreamData(id, data.ptr_data, data.length)) {
+      LOG(ERROR) << "data sink stream write failed: " << id;
+      return kDataSinkWriteFail;
+    }
+    if (data.chunk_end) {
+      if (!ptr_data_sink_->EndStream(id)) {
+        LOG(ERROR) << "data sink cannot end stream: " << id;
+        return kDataSinkWriteFail;
+      }
+      muxed_stream_open_ = false;
+      ++chunk_num;
+      id.clear();
+
+      // A pending manifest and thumbnail go out between stream chunks.
+      int status = WriteSinkManifest();
+      if (status == kSuccess) {
+        status = WriteSinkThumbnail();
       }
-      status = ptr_muxer_->WriteAudioBuffer(vorb_buf);
       if (status) {
-        LOG(ERROR) << "audio mux failed: " << status;
         return status;
       }
-      vorbis_buffered = false;
-      VLOG(4) << "muxed (A) " << vorbis_audio_buffer_.timestamp() / 1000.0;
     }
   }
+  return kSuccess;
+}
 
-  // Attempt to encode video frames when |video_timestamp| is less than the
-  // next estimated compressed audio buffer timestamp.
-  while (status != BufferPool<VideoFrame>::kEmpty &&
-         video_timestamp <= vorb_enc.time_encoded()) {
-    VLOG(3) << "attempting video mux vid_ts=" << video_timestamp
-              << " vorb_enc time_encoded=" << vorb_enc.time_encoded();
-    status = EncodeVideoFrame();
-    if (status) {
-      LOG(ERROR) << "EncodeVideoFrame failed: " << status;
-      return status;
-    }
-    status = PeekVideoTimestamp(&video_timestamp);
-    if (status < 0) {
-      LOG(ERROR) << "Video timestamp peek failed: " << status;
-      return status;
+int WebmEncoder::LatencyTraceStream(const std::string& muxer_id) const {
+  if (config_.muxed_output) {
+    if (muxer_id != kMuxedId) {
+      return -1;
     }
+    return config_.disable_video ? kLatencyAudio : kLatencyVideo;
   }
-
-  // TODO(tomfinegan): Update libwebm to handle non-monotonic timestamps on
-  //                   audio by buffering samples in some way, and get rid
-  //                   of this extra bit of audio handling code.
-
-  // Mux compressed audio stored because its buffer timestamp was greater than
-  // |video_timestamp|.
-  if (vorbis_buffered) {
-    status = ptr_muxer_->WriteAudioBuffer(vorb_buf);
-    if (status) {
-      LOG(ERROR) << "buffered audio mux failed: " << status;
-      return status;
-    }
-    VLOG(4) << "muxed (buf, A) " << vorbis_audio_buffer_.timestamp() / 1000.0;
+  if (muxer_id == kAudioId) {
+    return kLatencyAudio;
   }
-  return kSuccess;
+  return (muxer_id == kVideoId) ? kLatencyVideo : -1;
 }
 
-int WebmEncoder::DashEncode() {
-  // Encode a single audio buffer.
-  int status = EncodeAudioBuffer();
-  if (status) {
-    LOG(ERROR) << "EncodeAudioBuffer failed: " << status;
-    return status;
-  }
-
-  int64 video_timestamp;
-  status = PeekVideoTimestamp(&video_timestamp);
-  if (status < 0) {
-    LOG(ERROR) << "Video timestamp peek failed: " << status;
-    return status;
+std::string WebmEncoder::NextChunkId(const std::string& muxer_id,
+                                     int64 chunk_num) const {
+  std::string id;
+  if (config_.dash_encode && muxer_id != kMuxedId) {
+    AdaptationSet::MediaType media_type = IsAudioMuxer(muxer_id) ?
+        AdaptationSet::kAudio : AdaptationSet::kVideo;
+    id = dash_writer_->IdForChunk(media_type, RenditionForMuxer(muxer_id),
+                                  chunk_num);
+  } else {
+    const char kHeader[] = "header";
+    const char kChunk[] = "chunk";
+    if (chunk_num == 0)
+      id = kHeader;
+    else
+      id = kChunk;
   }
+  WEBMLIVE_HOT_LOG(INFO) << "chunk id: " << id;
+  return id;
+}
 
-  // Read compressed audio until no more remains, or the compressed buffer
-  // timestamp is greater than |video_timestamp|.
-  bool vorbis_buffered = false;
-  AudioBuffer& vorb_buf = vorbis_audio_buffer_;
-  VorbisEncoder& vorb_enc = vorbis_encoder_;
-  while ((status = vorb_enc.ReadCompressedAudio(&vorb_buf)) == kSuccess) {
-    status = ptr_muxer_aud_->WriteAudioBuffer(vorb_buf);
-    if (status) {
-      LOG(ERROR) << "audio mux failed: " << status;
-      return status;
+int WebmEncoder::RenditionForMuxer(const std::string& muxer_id) const {
+  for (size_t i = 0; i < renditions_.size(); ++i) {
+    if (renditions_[i]->muxer->muxer_id() == muxer_id) {
+      return renditions_[i]->index;
     }
-    VLOG(4) << "muxed (A) " << vorbis_audio_buffer_.timestamp() / 1000.0;
-
-    // Keep stream time reasonably close.
-    if (vorb_enc.time_encoded() > video_timestamp)
-      break;
   }
-
-  // Attempt to encode video frames when |video_timestamp| is less than the
-  // next estimated compressed audio buffer timestamp.
-  while (status != BufferPool<VideoFrame>::kEmpty) {
-    VLOG(3) << "attempting video mux vid_ts=" << video_timestamp
-            << " vorb_enc time_encoded=" << vorb_enc.time_encoded();
-    status = EncodeVideoFrame();
-    if (status) {
-      LOG(ERROR) << "EncodeVideoFrame failed: " << status;
-      return status;
-    }
-    status = PeekVideoTimestamp(&video_timestamp);
-    if (status < 0) {
-      LOG(ERROR) << "Video timestamp peek failed: " << status;
-      return status;
+  for (size_t i = 0; i < audio_renditions_.size(); ++i) {
+    if (audio_renditions_[i]->muxer->muxer_id() == muxer_id) {
+      return audio_renditions_[i]->index;
     }
-
-    // Keep stream time reasonably close.
-    if (video_timestamp > vorb_enc.time_encoded())
-      break;
   }
-  return kSuccess;
+  return 0;
 }
 
+bool WebmEncoder::IsAudioMuxer(const std::string& muxer_id) {
+  const std::string rendition_prefix = std::string(kAudioId) + "_";
+  return muxer_id == kAudioId ||
+         muxer_id.compare(0, rendition_prefix.length(),
+                          rendition_prefix) == 0;
+}
 
-// Reads, compresses and muxes one video frame.
-// - Attempts to read one frame from |video_pool_|, and compresses it using
-//   |video_encoder_| when a frame is available.
-// - Passes the compressed frame to the video muxer for muxing.
-int WebmEncoder::EncodeVideoFrame() {
-  LiveWebmMuxer* video_muxer;
-  if (config_.dash_encode) {
-    video_muxer = ptr_muxer_vid_.get();
-  } else {
-    video_muxer = ptr_muxer_.get();
+void WebmEncoder::RecordDashSegment(const std::string& muxer_id,
+                                    const std::string& id,
+                                    const SharedWebmChunk& chunk) {
+  if (!config_.dash_encode) {
+    return;
+  }
+  AdaptationSet::MediaType media_type = IsAudioMuxer(muxer_id) ?
+      AdaptationSet::kAudio : AdaptationSet::kVideo;
+  const int rendition = RenditionForMuxer(muxer_id);
+  dash_writer_->AddSegment(media_type, rendition, chunk->timestamp(),
+                           chunk->duration(), chunk->length());
+  if (segment_retention_) {
+    std::lock_guard<std::mutex> lock(retention_mutex_);
+    segment_retention_->AddSegment(media_type, rendition,
+                                   config_.dash_dir + id, chunk->timestamp(),
+                                   chunk->duration(), chunk->length());
   }
+}
 
-  // Try reading a video frame from the pool.
-  int status = video_pool_.Decommit(&raw_frame_);
-  if (status) {
-    if (status != BufferPool<VideoFrame>::kEmpty) {
-      LOG(ERROR) << "VideoFrame pool Decommit failed! " << status;
-      return kVideoSinkError;
-    }
-    VLOG(4) << "No frames in VideoFrame pool";
+int WebmEncoder::RemoveExpiredSegments() {
+  if (!segment_retention_) {
     return kSuccess;
   }
+  std::vector<std::string> expired;
+  {
+    std::lock_guard<std::mutex> lock(retention_mutex_);
+    segment_retention_->TakeExpiredSegments(&expired);
+  }
+  if (!config_.dash_write_files) {
+    return kSuccess;
+  }
+  for (size_t i = 0; i < expired.size(); ++i) {
+    if (file_writer_.EnqueueRemoval(expired[i])) {
+      LOG(ERROR) << "cannot enqueue segment removal: " << expired[i];
+      return kFileWriteError;
+    }
+  }
+  return kSuccess;
+}
 
-  VLOG(4) << "Encoder thread read raw frame.";
-
-  status = OffsetTimestamp(timestamp_offset_, &raw_frame_);
+int WebmEncoder::PublishDashManifest(bool force) {
+  int status = WriteSinkManifest();
   if (status) {
-    LOG(ERROR) << "Video frame timestamp offset failed: " << status;
-    return kVideoEncoderError;
+    return status;
   }
-
-  // Encode the video frame, and pass it to the muxer.
-  status = video_encoder_.EncodeFrame(raw_frame_, &vpx_frame_);
-  if (status == kDropped) {
+  if (!dash_writer_->dynamic() || dash_writer_->segments_added() == 0) {
     return kSuccess;
-  } else if (status) {
-    LOG(ERROR) << "Video frame encode failed: " << status;
-    return kVideoEncoderError;
   }
-
-  // Update encoded duration if able to obtain the lock.
-  std::unique_lock<std::mutex> lock(mutex_, std::try_to_lock);
-  if (lock.owns_lock()) {
-    encoded_duration_ = std::max(vpx_frame_.timestamp(), encoded_duration_);
+  const std::chrono::steady_clock::time_point now =
+      std::chrono::steady_clock::now();
+  const int64 elapsed_ms =
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+          now - last_manifest_time_).count();
+  if (!force && elapsed_ms < manifest_update_period_) {
+    return kSuccess;
   }
-
-  status = video_muxer->WriteVideoFrame(vpx_frame_);
+  last_manifest_time_ = now;
+  std::string dash_manifest;
+  if (!dash_writer_->WriteManifest(&dash_manifest)) {
+    LOG(ERROR) << "DashWriter::WriteManifest failed.";
+    return kFileWriteError;
+  }
+  status = WriteDashManifest(dash_manifest);
   if (status) {
-    LOG(ERROR) << "Video frame mux failed: " << status;
+    return status;
   }
-  VLOG(3) << "muxed (V) " << vpx_frame_.timestamp() / 1000.0;
-  return status;
-}
+  QueueSinkManifest(dash_manifest);
+  status = WriteSinkManifest();
 
-int WebmEncoder::EncodeAudioBuffer() {
-  // Try reading an audio buffer from the pool.
-  int status = audio_pool_.Decommit(&raw_audio_buffer_);
+  // The final manifest waits for the data sink, unless an open stream chunk
+  // holds it back; it is then written once the stream chunk ends.
+  while (status == kSuccess && force && pending_manifest_ &&
+         !muxed_stream_open_) {
+    WaitForDataSink();
+    status = WriteSinkManifest();
+  }
   if (status) {
-    if (status != BufferPool<AudioBuffer>::kEmpty) {
-      // Really an error; not just an empty pool.
-      LOG(ERROR) << "AudioBuffer pool Decommit failed! " << status;
-      return kAudioSinkError;
-    }
-    VLOG(4) << "No buffers in AudioBuffer pool";
-  } else {
-    VLOG(4) << "Encoder thread read raw audio buffer.";
+    return status;
+  }
 
-    status = OffsetTimestamp(timestamp_offset_, &raw_audio_buffer_);
-    if (status) {
-      LOG(ERROR) << "audio timestamp offset failed: " << status;
-      return kAudioEncoderError;
-    }
+  // Removals are queued behind the manifest that no longer lists them.
+  return RemoveExpiredSegments();
+}
 
-    // Pass the uncompressed audio to libvorbis.
-    status = vorbis_encoder_.Encode(raw_audio_buffer_);
-    if (status) {
-      LOG(ERROR) << "vorbis encode failed " << status;
-      return kAudioEncoderError;
+int WebmEncoder::WriteDashManifest(const std::string& dash_manifest) {
+  for (size_t i = 0; i < dash_sinks_.size(); ++i) {
+    if (!dash_sinks_[i]->WriteData(
+            reinterpret_cast<const uint8*>(dash_manifest.data()),
+            static_cast<int32>(dash_manifest.length()), kManifestFile)) {
+      LOG(ERROR) << "DASH sink manifest write failed.";
+      return (dash_sinks_[i] == &dash_file_sink_) ?
+          kFileWriteError : kDataSinkWriteFail;
     }
   }
   return kSuccess;
 }
 
-int WebmEncoder::WaitForSamples() {
-  // Wait for samples from the input stream(s).
-  bool got_audio = config_.disable_audio;
-  bool got_video = config_.disable_video;
-  for (;;) {
-    if (StopRequested()) {
-      return kSuccess;
-    }
-    if (!got_audio) {
-      got_audio = !audio_pool_.IsEmpty();
-    }
-    if (!got_video) {
-      got_video = !video_pool_.IsEmpty();
-    }
-    if (got_audio && got_video) {
-      break;
-    }
-    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+void WebmEncoder::QueueSinkManifest(const std::string& manifest) {
+  if (!config_.dash_sink_manifest) {
+    return;
   }
+  const size_t hash = ManifestHash(manifest);
+  if (manifest_queued_ && hash == manifest_hash_) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++sink_stats_.manifests_unchanged;
+    return;
+  }
+  WebmChunk::Data data(manifest.begin(), manifest.end());
+  WebmChunkDescriptor descriptor;
+  descriptor.length = static_cast<int32>(manifest.length());
+  SharedWebmChunk chunk(
+      new (std::nothrow) WebmChunk(kManifestFile, descriptor, 0,  // NOLINT
+                                   &data, SharedWebmChunkDataPool()));
+  if (!chunk) {
+    LOG(ERROR) << "out of memory.";
+    return;
+  }
+  // A newer manifest replaces one still pending.
+  pending_manifest_ = chunk;
+  manifest_hash_ = hash;
+  manifest_queued_ = true;
+}
 
-  int64 first_audio_timestamp = 0;
-  if (!config_.disable_audio) {
-    int64& a_ts = first_audio_timestamp;
-    const int status = audio_pool_.ActiveBufferTimestamp(&a_ts);
-    if (status) {
-      LOG(ERROR) << "cannot read first audio timestamp: " << status;
-      return status;
-    }
+bool WebmEncoder::SinkAcceptsChunk() {
+  if (!async_sink_) {
+    return ptr_data_sink_->Ready();
   }
+  std::lock_guard<std::mutex> lock(mutex_);
+  return sink_credit_ > 0;
+}
 
-  int64 first_video_timestamp = 0;
-  if (!config_.disable_video) {
-    int64& v_ts = first_video_timestamp;
-    const int status = video_pool_.ActiveBufferTimestamp(&v_ts);
-    if (status) {
-      LOG(ERROR) << "cannot read first video timestamp: " << status;
-      return status;
+bool WebmEncoder::PassChunkToSink(const SharedWebmChunk& chunk) {
+  if (!async_sink_) {
+    return ptr_data_sink_->WriteChunk(chunk);
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (sink_failed_) {
+      return false;
+    }
+    --sink_credit_;
+    ++sink_stats_.in_flight_chunks;
+    if (segment_durations_ && chunk->duration() > 0) {
+      upload_start_times_[chunk.get()] = std::chrono::steady_clock::now();
     }
   }
-
-  if (first_audio_timestamp < 0 && first_video_timestamp < 0) {
-    const int first_a_ts = std::abs(static_cast<int>(first_audio_timestamp));
-    const int first_v_ts = std::abs(static_cast<int>(first_video_timestamp));
-    timestamp_offset_ = std::max(first_a_ts, first_v_ts);
-  } else if (first_audio_timestamp < 0) {
-    const int first_a_ts = std::abs(static_cast<int>(first_audio_timestamp));
-    timestamp_offset_ = first_a_ts;
-  } else if (first_video_timestamp < 0) {
-    const int first_v_ts = std::abs(static_cast<int>(first_video_timestamp));
-    timestamp_offset_ = first_v_ts;
+  if (async_sink_->SubmitChunk(chunk)) {
+    return true;
   }
-  LOG(INFO) << "WebmEncoder timestamp_offset_=" << timestamp_offset_;
-  return kSuccess;
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++sink_credit_;
+  --sink_stats_.in_flight_chunks;
+  upload_start_times_.erase(chunk.get());
+  return false;
 }
 
-int WebmEncoder::PeekVideoTimestamp(int64* timestamp) {
-  CHECK_NOTNULL(timestamp);
-  const int status = video_pool_.ActiveBufferTimestamp(timestamp);
-  if (status < 0) {
-    LOG(ERROR) << "VideoFrame pool timestamp check failed: " << status;
-    return kVideoSinkError;
-  }
-  if (status == BufferPool<VideoFrame>::kEmpty) {
-    // When |video_pool_| is empty use the timestamp of the last encoded video
-    // frame added to the calculated time per frame.
-    const int time_per_frame =
-        static_cast<int>(kTimebase / config_.actual_video_config.frame_rate);
-    *timestamp = video_encoder_.last_timestamp() + time_per_frame;
-    VLOG(3) << "NO video frame available ts=" << *timestamp;
-  } else {
-    *timestamp += timestamp_offset_;
-    VLOG(3) << "video frame available ts=" << *timestamp;
+void WebmEncoder::WaitForDataSink() {
+  if (!async_sink_) {
+    // |DataSinkInterface| signals nothing when the sink becomes ready, so the
+    // encoder thread sleeps on input commits as |WaitForInput()| does, and
+    // checks |Ready()| again on wakeup. Input already queued does not end the
+    // wait: the final drains leave it queued.
+    if (config_.disable_video) {
+      audio_ring_.WaitForWrite(kInputWaitTimeout);
+    } else {
+      video_pool_.WaitForCommit(kInputWaitTimeout);
+    }
+    return;
   }
-  return status;
+  std::unique_lock<std::mutex> lock(mutex_);
+  sink_completed_.wait_for(
+      lock, std::chrono::milliseconds(kInputWaitTimeout), [this] {
+        return sink_failed_ || sink_stats_.in_flight_chunks == 0 ||
+               (sink_credit_ > 0 &&
+                (!sink_queue_.empty() || pending_manifest_));
+      });
 }
 
-int WebmEncoder::WriteMuxerChunkToDataSink(
-    std::unique_ptr<LiveWebmMuxer>* muxer) {
-  if (ptr_data_sink_->Ready()) {
-    int32 chunk_length = 0;
-    const bool chunk_ready = (*muxer)->ChunkReady(&chunk_length);
-    if (chunk_ready) {
-      const int64 chunk_num = (*muxer)->chunks_read();
-      std::string id = NextChunkId((*muxer)->muxer_id(), chunk_num);
-      // A complete chunk is waiting in |muxer|'s buffer.
-      if (!ReadChunkFromMuxer(muxer, chunk_length)) {
-        LOG(ERROR) << "cannot read WebM chunk from muxer_id: "
-                   << (*muxer)->muxer_id();
-        return kWebmMuxerError;
-      }
-#if 0
-      // Pass the chunk to |ptr_data_sink_|.
-      if (!ptr_data_sink_->WriteData(chunk_buffer_.get(), chunk_length, id)) {
-        LOG(ERROR) << "data sink write failed!";
-        return kDataSinkWriteFail;
-      }
-#endif
-      // HACK: HERE BE DRAGONS
-      CHECK(WriteChunkFile(config_.dash_dir + id,
-                           chunk_buffer_.get(), chunk_length));
+void WebmEncoder::OnChunkComplete(const SharedWebmChunk& chunk,
+                                  bool success) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++sink_credit_;
+  --sink_stats_.in_flight_chunks;
+  if (!success) {
+    VLOG(1) << "data sink did not write " << chunk->id();
+    sink_failed_ = true;
+  }
+  typedef std::map<const WebmChunk*,
+                   std::chrono::steady_clock::time_point>::iterator Iterator;
+  const Iterator upload = upload_start_times_.find(chunk.get());
+  if (upload != upload_start_times_.end()) {
+    if (success) {
+      const int64 upload_ms =
+          std::chrono::duration_cast<std::chrono::milliseconds>(
+              std::chrono::steady_clock::now() - upload->second).count();
+      segment_durations_->AddUpload(chunk->timestamp(), chunk->duration(),
+                                    upload_ms);
     }
+    upload_start_times_.erase(upload);
   }
-  return kSuccess;
+  sink_completed_.notify_one();
 }
 
-int WebmEncoder::WriteLastMuxerChunkToDataSink(
-    std::unique_ptr<LiveWebmMuxer>* muxer) {
-  int status = (*muxer)->Finalize();
-  if (status) {
-    LOG(ERROR) << "muxer Finalize failed, muxer_id: " << (*muxer)->muxer_id()
-               << " status: " << status;
-    return status;
+int WebmEncoder::WriteSinkManifest() {
+  if (!pending_manifest_ || muxed_stream_open_ || !SinkAcceptsChunk()) {
+    return kSuccess;
   }
-  int32 chunk_length = 0;
-  if ((*muxer)->ChunkReady(&chunk_length)) {
-    LOG(INFO) << "mkvmuxer Finalize produced a chunk.";
-    const int64 chunk_num = (*muxer)->chunks_read();
-    std::string id = NextChunkId((*muxer)->muxer_id(), chunk_num);
-
-    while (!ptr_data_sink_->Ready())
-      std::this_thread::sleep_for(std::chrono::milliseconds(1));
-
-    if (ReadChunkFromMuxer(muxer, chunk_length)) {
-#if 0
-      const bool sink_write_ok =
-          ptr_data_sink_->WriteData(chunk_buffer_.get(), chunk_length, id);
-      if (!sink_write_ok) {
-        LOG(ERROR) << "data sink write fail on final chunk for muxer_id:"
-                   << (*muxer)->muxer_id();
-      } else {
-        LOG(INFO) << "Final chunk upload initiated.";
-      }
-#endif
-      // HACK: HERE BE DRAGONS
-      CHECK(WriteChunkFile(config_.dash_dir + id,
-                           chunk_buffer_.get(), chunk_length));
-    }
+  if (!PassChunkToSink(pending_manifest_)) {
+    LOG(ERROR) << "data sink manifest write failed.";
+    return kDataSinkWriteFail;
   }
-  return status;
+  pending_manifest_.reset();
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++sink_stats_.manifests_written;
+  return kSuccess;
 }
 
-std::string WebmEncoder::NextChunkId(const std::string& muxer_id,
-                                     int64 chunk_num) const {
-  std::string id;
-  if (config_.dash_encode) {
-    AdaptationSet::MediaType media_type = (muxer_id == kAudioId) ?
-        AdaptationSet::kAudio : AdaptationSet::kVideo;
-    id = dash_writer_->IdForChunk(media_type, chunk_num);
-  } else {
-    const char kHeader[] = "header";
-    const char kChunk[] = "chunk";
-    if (chunk_num == 0)
-      id = kHeader;
-    else
-      id = kChunk;
+int WebmEncoder::WriteSinkThumbnail() {
+  if (!thumbnailer_) {
+    return kSuccess;
   }
-  LOG(INFO) << "chunk id: " << id;
-  return id;
+  // A newer thumbnail replaces one still pending.
+  SharedWebmChunk thumbnail;
+  if (thumbnailer_->ReadThumbnail(&thumbnail)) {
+    pending_thumbnail_ = thumbnail;
+  }
+  if (!pending_thumbnail_ || pending_manifest_ || muxed_stream_open_ ||
+      !SinkAcceptsChunk()) {
+    return kSuccess;
+  }
+  if (!PassChunkToSink(pending_thumbnail_)) {
+    LOG(ERROR) << "data sink thumbnail write failed.";
+    return kDataSinkWriteFail;
+  }
+  pending_thumbnail_.reset();
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++sink_stats_.thumbnails_written;
+  return kSuccess;
 }
 
 }  // namespace webmlive
@@ -8,17 +8,56 @@
 #ifndef WEBMLIVE_ENCODER_WEBM_ENCODER_H_
 #define WEBMLIVE_ENCODER_WEBM_ENCODER_H_
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
 #include <memory>
 #include <string>
 #include <thread>
+#include <vector>
 
+#include "encoder/async_sink_adapter.h"
+#include "encoder/audio_drift_corrector.h"
+#include "encoder/audio_level_meter.h"
 #include "encoder/audio_encoder.h"
+#include "encoder/av_interleaver.h"
 #include "encoder/basictypes.h"
 #include "encoder/buffer_pool.h"
+#include "encoder/capture_dump.h"
+#include "encoder/capture_watchdog.h"
+#include "encoder/dash_origin_server.h"
 #include "encoder/encoder_base.h"
 #include "encoder/data_sink.h"
+#include "encoder/fallback_slate.h"
+#include "encoder/file_sink.h"
+#include "encoder/file_writer.h"
+#include "encoder/frame_rate_converter.h"
+#include "encoder/init_segment_cache.h"
+#include "encoder/media_arena.h"
+#include "encoder/numa_topology.h"
+#include "encoder/pcm_ring_buffer.h"
+#include "encoder/pipeline_stage.h"
+#include "encoder/pool_depth_controller.h"
+#include "encoder/quality_monitor.h"
+#include "encoder/segment_aligner.h"
+#include "encoder/segment_duration_controller.h"
+#include "encoder/segment_rate_controller.h"
+#include "encoder/segment_ring_writer.h"
+#include "encoder/shared_audio_block.h"
+#include "encoder/shared_video_frame.h"
+#include "encoder/sink_spill_file.h"
+#include "encoder/text_track.h"
+#include "encoder/webm_encryptor.h"
+#include "encoder/thumbnailer.h"
+#include "encoder/timestamp_regulator.h"
+#include "encoder/video_converter.h"
+#include "encoder/video_deinterlacer.h"
 #include "encoder/video_encoder.h"
+#include "encoder/webm_chunk.h"
 #include "encoder/vorbis_encoder.h"
+#include "encoder/vpx_calibrator.h"
 
 namespace webmlive {
 // All timestamps are in milliseconds.
@@ -26,7 +65,449 @@ const int kTimebase = 1000;
 // Special value meaning use system default device.
 const int kUseDefaultDevice = -1;
 
+// Additional video rendition. Renditions are encoded from the same captured
+// frames as the primary video stream, which is configured by
+// |WebmEncoderConfig::vpx_config|.
+struct VideoRenditionConfig {
+  VideoRenditionConfig()
+      : width(0), height(0), numa_node(NumaTopology::kNoNode) {}
+
+  // Output frame size in pixels. 0 uses the capture size.
+  int width;
+  int height;
+
+  // NUMA node of the rendition's frames and compressed output, or
+  // |NumaTopology::kNoNode| for the node of the channel. A rendition on
+  // another node gets a |MediaArena| of its own there; its thread is placed
+  // through the "rendition<N>" |ThreadSettings|.
+  int numa_node;
+
+  // VPx encoder settings.
+  VpxConfig vpx_config;
+};
+
+// Additional audio rendition. Renditions are encoded from the same captured
+// samples as the primary audio stream, which is configured by
+// |WebmEncoderConfig::vorbis_config|, and are deinterleaved once for all
+// encoders.
+struct AudioRenditionConfig {
+  // Vorbis encoder settings. The sample rate and channel count are those of
+  // the primary stream.
+  VorbisConfig vorbis_config;
+};
+
+// Additional video capture device. Cameras are captured by the filter graph of
+// the primary devices, so their timestamps share its reference clock, and
+// each is encoded at its capture size into a DASH AdaptationSet of its own.
+struct VideoCameraConfig {
+  VideoCameraConfig() : device_index(kUseDefaultDevice) {}
+
+  // Device name, or when empty the device at |device_index|.
+  std::string device_name;
+  int device_index;
+
+  // VPx encoder settings.
+  VpxConfig vpx_config;
+
+  // Negotiated capture settings. Set by |WebmEncoder::Init()|.
+  VideoConfig actual_video_config;
+};
+
+// Capture timestamp regulation counters of each stream. Streams report no
+// inputs unless |WebmEncoderConfig::regulate_timestamps| is set.
+struct CaptureTimestampStats {
+  TimestampRegulatorStats video;
+  TimestampRegulatorStats audio;
+};
+
+// Video frame drop counters.
+struct VideoDropStats {
+  // Number of frames delivered by the capture source.
+  int64 frames_captured;
+
+  // Frames dropped because the raw video frame queue was full.
+  int64 queue_full_drops;
+
+  // Frames discarded by |WebmEncoderConfig::kDropStaleFrames|.
+  int64 stale_drops;
+
+  // Frames dropped by the VPx encoder (decimation).
+  int64 encoder_drops;
+
+  // Frames skipped to lower the frame rate under
+  // |WebmEncoderConfig::adaptive_resolution|.
+  int64 degradation_drops;
+};
+
+// Encoder output counters of the primary video stream and the audio stream.
+struct EncodeStats {
+  // Frames and audio buffers passed to the encoders, and the time spent
+  // encoding them, in microseconds. Video frames dropped by the encoder are
+  // not counted.
+  int64 video_frames_encoded;
+  int64 video_encode_us;
+  int64 audio_buffers_encoded;
+  int64 audio_encode_us;
+
+  // Compressed bytes muxed.
+  int64 video_bytes;
+  int64 audio_bytes;
+
+  // Current |WebmEncoderConfig::adaptive_resolution| level of the primary
+  // video stream, 0 at full size and frame rate, and the number of level
+  // changes.
+  int video_degradation_level;
+  int64 video_degradation_changes;
+
+  // Keyframe requests made with |WebmEncoder::RequestKeyframe()|, and the
+  // keyframes the primary video encoder forced to answer them.
+  int64 video_keyframe_requests;
+  int64 video_forced_keyframes;
+
+  // Keyframes the primary video encoder placed on scene cuts. See
+  // |VpxConfig::scene_cut_threshold|.
+  int64 video_scene_cut_keyframes;
+};
+
+// Startup timeline, in milliseconds from the start of |WebmEncoder::Init()|.
+// Phases not yet reached are -1.
+struct StartupStats {
+  // Media source |Init()| completed: device enumeration, graph construction
+  // and format negotiation.
+  int64 device_open_ms;
+
+  // Media source |Run()| returned.
+  int64 graph_run_ms;
+
+  // First audio buffer and video frame committed to the raw sample queues.
+  int64 first_audio_ms;
+  int64 first_video_ms;
+
+  // First chunk queued for writing.
+  int64 first_chunk_ms;
+};
+
+// A target bitrate change requested with |WebmEncoder::SetTargetBitrate()|
+// and applied by an encoder.
+struct BitrateChange {
+  // Timestamp of the first frame or buffer encoded at |bitrate|, in
+  // milliseconds.
+  int64 timestamp;
+
+  // True for the audio stream, false for the primary video stream.
+  bool audio;
+
+  // New target bitrate, in kilobits.
+  int bitrate;
+};
+
+// Encoder settings changed while encoding by |WebmEncoder::Reconfigure()|.
+// Fields left set to |kUnchanged| keep their current values.
+struct EncoderReconfiguration {
+  static const int kUnchanged = VpxConfig::kUseDefault;
+  EncoderReconfiguration()
+      : video_bitrate(kUnchanged), audio_bitrate(kUnchanged),
+        video_speed(kUnchanged), keyframe_interval(kUnchanged) {}
+
+  // Target bitrates, in kilobits, of the primary video stream and the audio
+  // stream. Only Opus changes its audio bitrate: Vorbis fixes its rate
+  // management when its headers are written.
+  int video_bitrate;
+  int audio_bitrate;
+
+  // |VpxConfig::speed| of the primary video stream and each rendition.
+  // libvpx only; hardware encoders reject it.
+  int video_speed;
+
+  // |VpxConfig::keyframe_interval| of the primary video stream and each
+  // rendition, in milliseconds.
+  int keyframe_interval;
+};
+
+// Backpressure counters of the muxed stream, which is written to the data
+// sink passed to |WebmEncoder::Init()|.
+struct SinkStats {
+  // Chunks, and their bytes, waiting for the data sink to become ready.
+  int32 queued_chunks;
+  int64 queued_bytes;
+
+  // Chunks submitted to the data sink and not yet complete. Used only with
+  // |WebmEncoderConfig::async_sink|.
+  int32 in_flight_chunks;
+
+  // Largest |queued_bytes| seen.
+  int64 max_queued_bytes;
+
+  // Chunks dropped from the queue by |WebmEncoderConfig::sink_policy|.
+  int64 dropped_chunks;
+
+  // Chunks moved to the spill file by |WebmEncoderConfig::kSinkSpill|, and
+  // their bytes; those written to the data sink since; and the bytes still
+  // in the file.
+  int64 spilled_chunks;
+  int64 spilled_bytes;
+  int64 replayed_chunks;
+  int64 spill_pending_bytes;
+
+  // Video frames left out of the muxed stream by
+  // |WebmEncoderConfig::kSinkDropVideo|.
+  int64 dropped_video_frames;
+
+  // Total time the data sink spent not ready while chunks were waiting, in
+  // milliseconds.
+  int64 blocked_ms;
+
+  // DASH manifests written to the data sink, and manifest updates not
+  // written because their content matched the last manifest queued. Counted
+  // only with |WebmEncoderConfig::dash_sink_manifest|.
+  int64 manifests_written;
+  int64 manifests_unchanged;
+
+  // Thumbnails written to the data sink. Counted only with
+  // |WebmEncoderConfig::thumbnail|.
+  int64 thumbnails_written;
+
+  // True while |queued_bytes| exceeds |WebmEncoderConfig::sink_queue_limit|,
+  // or the limit lowered by |WebmEncoderConfig::memory_budget|.
+  bool congested;
+
+  // True while the media data held by the process exceeds
+  // |WebmEncoderConfig::memory_budget|.
+  bool over_memory_budget;
+};
+
+// Counters of the buffer pools between the capture, encoder and mux stages.
+// Pools of disabled streams, and of stages not in use, report no activity.
+struct EncoderPoolStats {
+  // Captured frames and audio buffers waiting for the encoders.
+  BufferPoolStats video_input;
+  BufferPoolStats audio_input;
+
+  // Compressed frames and audio buffers waiting for the muxers.
+  BufferPoolStats video_output;
+  BufferPoolStats audio_output;
+
+  // Frames waiting for the rendition scaler.
+  BufferPoolStats scaler;
+
+  // Pipelined mode encoder stages, between the input and output pools.
+  PipelineStageStats audio_encoder;
+  PipelineStageStats video_encoder;
+};
+
+// Outcome of the final flush of |WebmEncoder::Stop()|.
+struct ShutdownStats {
+  // Time from the stop request until the encoder thread exited, in
+  // milliseconds. 0 when the encoder thread exited on its own.
+  int64 flush_ms;
+
+  // True when |WebmEncoderConfig::stop_timeout| expired before the flush
+  // completed, and some output was abandoned.
+  bool timed_out;
+
+  // Chunks produced by finalizing the muxers.
+  int64 final_chunks;
+
+  // Compressed video frames left unmuxed at the deadline.
+  int64 frames_abandoned;
+
+  // Muxed stream chunks, and their bytes, never passed to the data sink.
+  int64 sink_chunks_abandoned;
+  int64 sink_bytes_abandoned;
+
+  // Chunk and manifest files, and removals, left unwritten. See
+  // |FileWriterStats::files_abandoned|.
+  int64 files_abandoned;
+};
+
+// Measured media segments of one DASH Representation. Bandwidths are in bits
+// per second.
+struct RepresentationStats {
+  RepresentationStats()
+      : segments(0), bytes(0), duration(0), configured_bandwidth(0),
+        average_bandwidth(0), peak_bandwidth(0), window_peak_bandwidth(0) {}
+
+  // Representation id in the MPD.
+  std::string rep_id;
+
+  // Media segments written, their bytes, and their duration in milliseconds.
+  int64 segments;
+  int64 bytes;
+  int64 duration;
+
+  // Bandwidth of the configured bitrate.
+  int64 configured_bandwidth;
+
+  // Bitrate of all segments, and of the largest segment for its duration.
+  int64 average_bandwidth;
+  int64 peak_bandwidth;
+
+  // Peak of the segments of the last |WebmEncoderConfig::dash_bandwidth_window|
+  // milliseconds, which a dynamic MPD then advertises.
+  int64 window_peak_bandwidth;
+};
+
+// Container statistics of one |LiveWebmMuxer|. Sizes are in bytes, and
+// times in milliseconds unless named otherwise.
+struct MuxerStats {
+  // Cluster size histogram buckets: bucket |i| counts the clusters under
+  // |kFirstClusterSizeBound| << (2 * |i|) bytes, and the last bucket those
+  // larger.
+  static const int kClusterSizeBuckets = 6;
+  static const int64 kFirstClusterSizeBound = 16 * 1024;
+
+  MuxerStats()
+      : metadata_bytes(0), cluster_header_bytes(0), block_header_bytes(0),
+        block_payload_bytes(0), clusters(0), min_cluster_bytes(0),
+        max_cluster_bytes(0), cluster_bytes(0), blocks(0),
+        max_cluster_blocks(0), audio_interleave_gap(0),
+        max_audio_interleave_gap(0), video_interleave_gap(0),
+        max_video_interleave_gap(0), chunks_read(0), read_latency_us(0),
+        max_read_latency_us(0), splices(0), splice_dropped_frames(0) {
+    for (int i = 0; i < kClusterSizeBuckets; ++i) {
+      cluster_size_counts[i] = 0;
+    }
+  }
+
+  std::string muxer_id;
+
+  // Bytes written by element type: the EBML header, segment info, tracks
+  // and everything else outside clusters; cluster IDs, sizes and timecodes;
+  // block elements other than their frame data; and frame data. Frames
+  // libwebm holds back for interleaving count as payload when passed to it,
+  // so |block_header_bytes| trails by the headers of the frames queued.
+  int64 metadata_bytes;
+  int64 cluster_header_bytes;
+  int64 block_header_bytes;
+  int64 block_payload_bytes;
+
+  // Completed clusters, their smallest, largest and total size, and their
+  // size distribution.
+  int64 clusters;
+  int64 min_cluster_bytes;
+  int64 max_cluster_bytes;
+  int64 cluster_bytes;
+  int64 cluster_size_counts[kClusterSizeBuckets];
+
+  // Blocks written, and the most in one cluster.
+  int64 blocks;
+  int64 max_cluster_blocks;
+
+  // Timestamp of the last audio frame written minus that of the last video
+  // frame before it, and the reverse for video, with their largest
+  // magnitude. 0 until the muxer has written both.
+  int64 audio_interleave_gap;
+  int64 max_audio_interleave_gap;
+  int64 video_interleave_gap;
+  int64 max_video_interleave_gap;
+
+  // Chunks read, and the total and largest time from the end of a chunk
+  // until it was read, in microseconds.
+  int64 chunks_read;
+  int64 read_latency_us;
+  int64 max_read_latency_us;
+
+  // Clips spliced by |LiveWebmMuxer::SpliceClip()|, and the live frames
+  // dropped after them.
+  int64 splices;
+  int64 splice_dropped_frames;
+};
+
+// Counters of |WebmEncoder::Pause()|.
+struct PauseStats {
+  // True between |WebmEncoder::Pause()| and |WebmEncoder::Resume()|.
+  bool paused;
+
+  // Pauses started, and the capture time they removed from the output
+  // timeline, in milliseconds.
+  int64 pauses;
+  int64 removed_ms;
+
+  // Video frames and audio buffers captured while paused, and discarded.
+  int64 frames_discarded;
+  int64 audio_buffers_discarded;
+};
+
 struct WebmEncoderConfig {
+  // Default |sink_queue_limit|, in bytes.
+  static const int64 kDefaultSinkQueueLimit = 8 * 1024 * 1024;
+
+  // Default |stop_timeout|, in milliseconds.
+  static const int kDefaultStopTimeout = 5000;
+
+  // Policy applied when video encoding falls behind capture.
+  enum VideoDropPolicy {
+    // Encode queued frames in order; newly captured frames are dropped while
+    // the raw frame queue is full. Latency grows with queue depth.
+    kDropNewestFrames = 0,
+
+    // Before each encode, discard queued frames captured more than
+    // |video_latency_budget| milliseconds before the most recently captured
+    // frame. A budget of 0 always skips to the most recent frame.
+    kDropStaleFrames = 1,
+  };
+
+  // Source of captured video frames.
+  enum VideoSource {
+    // A DirectShow capture device, selected by |video_device_name| or
+    // |video_device_index|.
+    kVideoSourceDevice = 0,
+
+    // The desktop, captured with DXGI Desktop Duplication. The monitor is
+    // selected by |video_device_index|.
+    kVideoSourceDesktop = 1,
+  };
+
+  // API capturing audio from the device selected by |audio_device_name| or
+  // |audio_device_index|.
+  enum AudioSource {
+    // A DirectShow audio capture filter, or the audio pin of the video
+    // capture device.
+    kAudioSourceDirectShow = 0,
+
+    // A WASAPI capture endpoint in shared mode, event driven, timestamped on
+    // the clock of the video graph. |audio_buffer_period| is the delivery
+    // period.
+    kAudioSourceWasapi = 1,
+
+    // As |kAudioSourceWasapi|, in exclusive mode: the device must support
+    // |requested_audio_config|.
+    kAudioSourceWasapiExclusive = 2,
+  };
+
+  // Policy applied to muxed stream chunks while the data sink is not ready.
+  // In every policy the WebM header chunk is kept.
+  enum SinkPolicy {
+    // Queue chunks until the data sink accepts them, however long that
+    // takes. Memory use grows with the backlog.
+    kSinkQueueUnbounded = 0,
+
+    // Drop the oldest queued chunks while more than |sink_queue_limit| bytes
+    // are queued.
+    kSinkDropOldest = 1,
+
+    // While more than |sink_queue_limit| bytes are queued, leave video out
+    // of the muxed stream so that audio keeps flowing. Video resumes at the
+    // first keyframe once the queue drains below half of the limit. Chunks
+    // are dropped as with |kSinkDropOldest| past twice the limit. Requires
+    // audio and video.
+    kSinkDropVideo = 2,
+
+    // Report the backlog through |SinkStats::congested| and
+    // |SinkStats::queued_chunks| for a rate controller to act on, and queue
+    // chunks up to twice |sink_queue_limit|; older chunks are dropped as
+    // with |kSinkDropOldest| past that.
+    kSinkSignal = 3,
+
+    // Move the oldest queued chunks to |sink_spill| while more than
+    // |sink_queue_limit| bytes are queued, and write them to the data sink,
+    // oldest first at up to |SinkSpillSettings::catchup_kbps|, whenever the
+    // queue is empty: live chunks go first, and spilled ones fill the gap
+    // once the data sink catches up. Chunks that cannot be spilled are
+    // dropped as with |kSinkDropOldest|.
+    kSinkSpill = 4,
+  };
+
   // User interface control structure. |MediaSourceImpl| will attempt to
   // display configuration control dialogs when fields are set to true.
   struct UserInterfaceOptions {
@@ -43,10 +524,52 @@ struct WebmEncoderConfig {
         disable_video(false),
         audio_device_index(kUseDefaultDevice),
         video_device_index(kUseDefaultDevice),
+        video_source(kVideoSourceDevice),
+        audio_source(kAudioSourceDirectShow),
+        free_run(false),
         dash_encode(false),
+        muxed_output(false),
+        pipeline_encode(false),
+        video_drop_policy(kDropNewestFrames),
+        video_latency_budget(0),
+        video_conversion_threads(2),
+        gpu_video_processing(false),
+        video_passthrough(false),
+        max_interleave_latency(AVInterleaver::kDefaultMaxLatency),
+        interleave_stream_timeout(AVInterleaver::kDefaultStreamTimeout),
+        stream_chunks(false),
+        async_sink(false),
+        task_channel(-1),
+        dash_drain_channel(-1),
+        capture_time_watermarks(false),
+        regulate_timestamps(false),
+        output_frame_rate(0),
+        adaptive_resolution(false),
+        segment_duration(0),
+        max_cluster_bytes(0),
+        align_segments(false),
+        audio_codec(kAudioFormatVorbis),
+        audio_buffer_period(0),
+        audio_ring_duration(PcmRingBuffer::kDefaultDuration),
+        audio_overflow_policy(PcmRingBuffer::kDropNewest),
         dash_name("webmlive"),
         dash_dir("./"),
-        dash_start_number("1") {}
+        dash_start_number("1"),
+        dash_dynamic(false),
+        dash_update_period(0),
+        dash_window(0),
+        dash_single_file(false),
+        dash_segment_index(false),
+        dash_bandwidth_window(0),
+        file_sync_policy(FileWriter::kSyncNone),
+        dash_write_files(true),
+        dash_sink_manifest(false),
+        sink_policy(kSinkQueueUnbounded),
+        sink_queue_limit(kDefaultSinkQueueLimit),
+        memory_budget(0),
+        stop_timeout(kDefaultStopTimeout),
+        large_pages(false),
+        numa_node(NumaTopology::kNoNode) {}
 
   // Audio/Video disable flags.
   bool disable_audio;
@@ -64,12 +587,52 @@ struct WebmEncoderConfig {
   // Video device index. Leave set to |kUseDefaultDevice| to use system default.
   int video_device_index;
 
+  // Video capture source.
+  VideoSource video_source;
+
+  // Audio capture API. Windows only.
+  AudioSource audio_source;
+
+  // File keeping a |CaptureProfile| of each DirectShow video capture device
+  // across runs: devices connect with their cached format, and are probed
+  // only when it fails. Empty probes every device on every start.
+  std::string capture_profile_file;
+
+  // Input files that replace the capture devices: Y4M or raw I420 video, and
+  // WAV audio. "-" reads standard input. When either is set, a stream without
+  // an input file is disabled.
+  std::string video_input_file;
+  std::string audio_input_file;
+
+  // Deliver input file samples as fast as the encoder accepts them instead
+  // of in real time.
+  bool free_run;
+
+  // Capture dump recording the samples delivered by the media source, in
+  // their capture format, for replay with |replay_file|. Empty disables
+  // recording.
+  std::string capture_dump_file;
+
+  // Seekable WebM file that also receives the encoded audio and video, with
+  // Cues and a duration written when encoding stops. Renditions are not
+  // archived. Empty disables the archive.
+  std::string archive_file;
+
+  // Capture dump that replaces the capture devices and input files. Samples
+  // are replayed at their recorded pace, or as fast as the encoder accepts
+  // them with |free_run|. A stream missing from the dump is disabled.
+  std::string replay_file;
+
   // Requested audio capture settings.
   AudioConfig requested_audio_config;
 
   // Actual audio capture settings.
   AudioConfig actual_audio_config;
 
+  // Encoded audio settings: |actual_audio_config| after the audio encoder's
+  // sample rate and channel conversion.
+  AudioConfig encoded_audio_config;
+
   // Requested video capture settings.
   VideoConfig requested_video_config;
 
@@ -79,15 +642,188 @@ struct WebmEncoderConfig {
   // Vorbis audio encoder settings.
   VorbisConfig vorbis_config;
 
+  // Opus audio encoder settings.
+  OpusConfig opus_config;
+
   // VPx encoder settings.
   VpxConfig vpx_config;
 
+  // Startup calibration of the codec, speed and thread count of the primary
+  // video encoder, which replaces those of |vpx_config|. Requires software
+  // encoding. Renditions keep their own settings.
+  VpxCalibrationSettings vpx_calibration;
+
+  // Additional video renditions. Requires |dash_encode|. Each rendition is
+  // written as a separate Representation in the video AdaptationSet of its
+  // |VpxConfig::codec|: renditions in another codec than |vpx_config| go to
+  // an AdaptationSet of their own. Renditions of the same size share their
+  // scaled frames, whatever their codec.
+  std::vector<VideoRenditionConfig> video_renditions;
+
+  // Additional audio renditions. Requires |dash_encode| and Vorbis audio.
+  // Each rendition is written as a separate Representation in the audio
+  // AdaptationSet.
+  std::vector<AudioRenditionConfig> audio_renditions;
+
+  // Additional cameras, captured with the primary video device and sharing
+  // its audio. Requires |dash_encode| and a capture device as
+  // |video_source|, and is not supported with passthrough, input files or
+  // capture dumps. Their Representations follow those of
+  // |video_renditions|.
+  std::vector<VideoCameraConfig> video_cameras;
+
   // Source device options.
   UserInterfaceOptions ui_opts;
 
   // Enable DASH encoding mode.
   bool dash_encode;
 
+  // Mux audio and video into a single WebM stream written to the data sink.
+  // With |dash_encode| both outputs are fed by the same encoders.
+  bool muxed_output;
+
+  // Enable pipelined encoding: audio encoding, video encoding, and muxing run
+  // on separate threads. Requires |dash_encode|.
+  bool pipeline_encode;
+
+  // Video frame drop policy, and the latency budget in milliseconds used by
+  // |kDropStaleFrames|.
+  VideoDropPolicy video_drop_policy;
+  int64 video_latency_budget;
+
+  // Depth of the raw video pool between capture and the video encoder: a
+  // fixed |SpscBufferPool::kDefaultBufferCount| frames, or, when
+  // |video_pool_depth.enabled|, a depth that follows the encode time and
+  // capture jitter within its bounds.
+  PoolDepthSettings video_pool_depth;
+
+  // Segment byte budgets for the primary video stream: its bitrate is
+  // steered within each segment of the DASH video stream, or chunk of the
+  // muxed stream, so that the segment size lands within
+  // |segment_rate.tolerance| of |vpx_config.bitrate| times the segment
+  // duration. Bitrates set by |WebmEncoder::SetTargetBitrate()| or
+  // |WebmEncoder::Reconfigure()| become the base.
+  SegmentRateSettings segment_rate;
+
+  // Segment durations that follow delivery latency: the upload time of each
+  // muxed stream chunk through the |async_sink| is measured against its
+  // duration, and every stream's segments are lengthened or shortened
+  // within |adaptive_segments| bounds; video keyframes are forced at the
+  // segment boundaries, and the keyframe interval becomes the longest
+  // duration. Requires |async_sink|, |muxed_output|, a |segment_duration|
+  // within the bounds, and with DASH output |dash_dynamic|, whose
+  // SegmentTimeline lists the durations produced.
+  SegmentDurationSettings adaptive_segments;
+
+  // Number of threads converting captured frames to I420. When 0, frames are
+  // converted on the capture thread.
+  int video_conversion_threads;
+
+  // Convert captured frames and scale rendition frames with the GPU's
+  // Direct3D 11 video processor. Formats and GPUs it does not support fall
+  // back to libyuv, as does all processing after a GPU failure.
+  bool gpu_video_processing;
+
+  // Deinterlacing of interlaced capture, done after conversion to I420 on
+  // the |video_conversion_threads| workers, or on the capture thread when
+  // there are none. Compressed capture formats are never deinterlaced.
+  DeinterlaceSettings deinterlace;
+
+  // Mux the video source's frames as they are when it delivers VP8 or VP9,
+  // instead of encoding video: keyframes are those of the source, read from
+  // the bitstream. Ignored for other formats. Disables renditions, adaptive
+  // resolution and temporal layers, and |vpx_config| settings other than
+  // |codec|, which is set to the source's format, have no effect.
+  bool video_passthrough;
+
+  // A/V interleaving limits, in milliseconds: the longest a compressed packet
+  // waits for the other stream, measured in stream time, and the wall clock
+  // time after which a stream that delivers nothing stops holding up the
+  // other. See |AVInterleaver|.
+  int64 max_interleave_latency;
+  int64 interleave_stream_timeout;
+
+  // Pass chunk data to the data sink as it is muxed, instead of waiting for
+  // each chunk to complete. Requires a data sink that supports streaming.
+  bool stream_chunks;
+
+  // Submit muxed stream chunks and manifests to the data sink through an
+  // |AsyncSinkAdapter|, which writes them on its own thread, instead of
+  // polling |DataSinkInterface::Ready()| and writing them from the encoder
+  // thread. Not supported with |stream_chunks|.
+  bool async_sink;
+
+  // Channel of |TaskScheduler::Instance()| on which the |async_sink| writes
+  // run, in place of a writer thread of their own; -1, the default, gives
+  // the adapter its thread. The scheduler must be running.
+  int task_channel;
+
+  // Channel of |TaskScheduler::Instance()| on which the chunks of each DASH
+  // muxer are written, by a drain task of the muxer's own, so that the
+  // segment writes of the audio, video and rendition muxers run
+  // concurrently instead of in turn on the threads that mux them; -1, the
+  // default, writes them from those threads. The scheduler must be running.
+  int dash_drain_channel;
+
+  // Record the wall clock time at which each video frame reaches
+  // |OnVideoFrameReceived()|, and write it with the frame in every video
+  // stream. See |LiveWebmMuxer::EnableCaptureTimes()|.
+  bool capture_time_watermarks;
+
+  // Pass capture timestamps through a |TimestampRegulator| per stream, which
+  // removes capture jitter and duplicate timestamps before the encoders see
+  // them. Video frame durations become the estimated frame period.
+  bool regulate_timestamps;
+
+  // Frame rate of the encoded video. Captured frames are dropped and retimed
+  // to it by a |FrameRateConverter| before they are converted or queued, so
+  // the output cadence is even whatever the capture cadence. 0 encodes every
+  // captured frame, unless |vpx_config.decimate| is above 1.
+  double output_frame_rate;
+
+  // Step the primary video stream down a fixed ladder of smaller frame sizes,
+  // and then half the frame rate, while the video encoder stays saturated at
+  // its fastest speed; step back up once it idles at its slowest speed. Frame
+  // sizes change in-band, so the track headers and manifest keep the
+  // configured size. Enables |vpx_config.adaptive_speed|, which measures the
+  // load. Renditions keep their sizes.
+  bool adaptive_resolution;
+
+  // Segment (cluster) duration in milliseconds. Every muxer starts a cluster
+  // at each multiple of it in stream time, independently of keyframe
+  // placement; video keyframes also start clusters. When 0, DASH audio
+  // segments last |vpx_config.keyframe_interval|, and video clusters start
+  // only at keyframes.
+  int segment_duration;
+
+  // Size limit of muxed stream clusters in bytes, 0 for none. A cluster that
+  // reaches the limit ends at the next frame, so chunks and their delivery
+  // to |ptr_data_sink_| stay small at high bitrates; the chunks that follow
+  // within a segment are |WebmChunkDescriptor::continuation|s. DASH segments
+  // are one chunk each, and are not split.
+  int32 max_cluster_bytes;
+
+  // Start each DASH audio segment at the audio packet nearest the start of
+  // the video segment of the same number, instead of on a timer of its own.
+  // Video clusters, at keyframes and segment boundaries, decide where both
+  // streams' segments start. Requires |dash_encode| with audio and video.
+  bool align_segments;
+
+  // Compressed audio format: |kAudioFormatVorbis| or |kAudioFormatOpus|.
+  // Opus requires a build with WEBMLIVE_HAVE_OPUS defined.
+  AudioFormat audio_codec;
+
+  // Length in milliseconds of the audio buffers delivered to the encoder.
+  // The capture pin is asked for buffers of this length, and captured buffers
+  // are split or combined to match. 0 uses the buffers the device delivers.
+  int audio_buffer_period;
+
+  // Captured audio the encoder can fall behind by, in milliseconds, which
+  // sizes the preallocated |PcmRingBuffer| between capture and the audio
+  // encoder, and the handling of audio captured while it is full.
+  int audio_ring_duration;
+  PcmRingBuffer::OverflowPolicy audio_overflow_policy;
+
   // MPD name and DASH chunk ID prefix.
   std::string dash_name;
 
@@ -96,19 +832,158 @@ struct WebmEncoderConfig {
 
   // MPD SegmentTemplate startNumber value.
   std::string dash_start_number;
+
+  // Publish a dynamic MPD with a SegmentTimeline built from the segments
+  // produced, replacing the MPD file every |dash_update_period|
+  // milliseconds. A |dash_update_period| of 0 uses the segment duration.
+  bool dash_dynamic;
+  int dash_update_period;
+
+  // Time-shift window in milliseconds. Media segments older than the window
+  // are deleted from |dash_dir|, and dropped from a dynamic MPD. 0 keeps all
+  // segments.
+  int dash_window;
+
+  // Append the segments of each Representation to one file in |dash_dir|,
+  // after its initialization segment, instead of writing a file per segment.
+  // The dynamic MPD lists segments by byte range. Requires |dash_dynamic| and
+  // |dash_write_files|, and is not used with the DASH origin server. The
+  // files are not trimmed to |dash_window|.
+  bool dash_single_file;
+
+  // Append a |SegmentIndexRecord| for each media segment to the index file
+  // of its Representation in |dash_dir|, named by
+  // |DashWriter::IndexForRepresentation()|. Requires |dash_write_files|.
+  // The index is started anew with its initialization segment, and is not
+  // trimmed to |dash_window|.
+  bool dash_segment_index;
+
+  // Advertise the measured bandwidth in a dynamic MPD: the peak bitrate of
+  // the segments of the last |dash_bandwidth_window| milliseconds, instead of
+  // the configured bitrate. 0 advertises configured bitrates.
+  int dash_bandwidth_window;
+
+  // Output files flushed to storage before they are published.
+  FileWriter::SyncPolicy file_sync_policy;
+
+  // Built-in HTTP origin for DASH output, which serves the MPD and the most
+  // recent segments from memory. Disabled when |dash_server.port| is 0. A
+  // |dash_server.time_shift_window| of 0 holds the |dash_window|, plus one
+  // MPD update period, when |dash_window| is set.
+  DashOriginServerSettings dash_server;
+
+  // Memory-mapped ring file, or shared memory object, that also receives
+  // each DASH chunk, for readers on the same host. Disabled when
+  // |segment_ring.path| and |segment_ring.shm_name| are empty.
+  SegmentRingSettings segment_ring;
+
+  // Write the MPD and DASH chunks to |dash_dir|. May be false only when the
+  // DASH origin server or the segment ring is enabled.
+  bool dash_write_files;
+
+  // Also write the MPD to the data sink passed to |WebmEncoder::Init()|,
+  // under the MPD file name, whenever its content changes. A pending MPD is
+  // written before queued muxed stream chunks.
+  bool dash_sink_manifest;
+
+  // Also write a WebP thumbnail of the video to the data sink, under
+  // |Thumbnailer::kThumbnailId|, every |thumbnail.interval| milliseconds.
+  // Like the MPD, the newest thumbnail replaces one not yet written.
+  ThumbnailSettings thumbnail;
+
+  // Decode every |quality.interval|th keyframe of the video and measure its
+  // PSNR and SSIM against the frame it was encoded from, within
+  // |quality.max_cpu| percent of one core. Frames the encoder holds for
+  // lookahead, and frames degraded by |adaptive_resolution|, are not
+  // measured.
+  QualitySettings quality;
+
+  // Per-channel level metering and silence detection of the audio input.
+  // With |audio_levels.silence_encoding| the audio encoder is told while the
+  // input is silent; see |AudioEncoder::SetSilent()|.
+  AudioLevelSettings audio_levels;
+
+  // Resampling of the audio input that keeps its sample count on the clock
+  // of the capture timestamps, and the audio in sync with the video, when
+  // the audio device clock drifts. Applied before the audio encoder.
+  AudioDriftSettings audio_drift;
+
+  // Live WebVTT text track of the muxed stream. Cues come from
+  // |text_track.input_file| and |WebmEncoder::AddTextCue()|, and are written
+  // into the clusters of the audio and video muxed around them. Requires
+  // |muxed_output|.
+  TextTrackSettings text_track;
+
+  // WebM encryption of the audio and video blocks of every live muxer: the
+  // muxed stream, DASH streams and renditions. The archive stays clear.
+  EncryptionSettings encryption;
+
+  // Restart of stalled or failed capture devices, with repeated frames or a
+  // fallback slate filling the gap, while the encode carries on. Only
+  // applies to capture devices.
+  CaptureWatchdogSettings capture_watchdog;
+
+  // Muxed stream backpressure policy, and the queued byte count above which
+  // it applies. Unused with |stream_chunks|: streamed data is passed to the
+  // data sink as it is muxed.
+  SinkPolicy sink_policy;
+  int64 sink_queue_limit;
+
+  // Spill file of |kSinkSpill|.
+  SinkSpillSettings sink_spill;
+
+  // Media data the process may hold, in bytes, as accounted by
+  // |MemoryAccountant|; 0 for no budget. While the total is over budget,
+  // |sink_policy| applies with |sink_queue_limit| lowered by the excess, so
+  // that the muxed stream backlog gives way first. With
+  // |kSinkQueueUnbounded| the excess only sets |SinkStats::congested|.
+  int64 memory_budget;
+
+  // Milliseconds |WebmEncoder::Stop()| allows for the final flush: muxing
+  // the frames the pipeline holds, and delivering the last chunks to the
+  // data sink and to |dash_dir|. What is not delivered by then is abandoned
+  // and reported in |ShutdownStats|. 0 waits without limit.
+  int stop_timeout;
+
+  // Backs the |MediaArena| slabs of raw video frames with large pages when
+  // the system grants them. See media_arena.h.
+  bool large_pages;
+
+  // NUMA node the channel's media buffers are allocated from, or
+  // |NumaTopology::kNoNode|. The channel's threads are placed on it through
+  // |ThreadRegistry::set_default_numa_node()|.
+  int numa_node;
 };
 
+#ifdef _WIN32
+class D3D11VideoProcessor;
+#endif
 class DashWriter;
-class MediaSourceImpl;
+class WebmArchiveWriter;
+class MediaSourceInterface;
 class LiveWebmMuxer;
+class SegmentRetention;
+class WebmSpliceClip;
 
 // Top level WebM encoder class. Manages capture from A/V input devices, VPx
 // encoding, Vorbis encoding, and muxing into a WebM stream.
 class WebmEncoder : public AudioSamplesCallbackInterface,
-                    public VideoFrameCallbackInterface {
+                    public VideoFrameCallbackInterface,
+                    public DataSinkCallbackInterface {
  public:
-  // Default size of |chunk_buffer_|.
-  static const int kDefaultChunkBufferSize = 100 * 1024;
+  // Maximum time in milliseconds |EncoderThread()| sleeps while waiting for
+  // input. Bounds the delay between a call to |Stop()| and encoder shutdown.
+  static const int kInputWaitTimeout = 10;
+
+  // Capacity of the compressed audio queue used in pipelined mode.
+  static const int kCompressedAudioPoolSize = 64;
+
+  // Capacity of the raw frame queue of each additional video rendition.
+  static const int kRenditionPoolSize = 8;
+
+  // Capacity of the planar sample queue of each additional audio rendition.
+  static const int kAudioRenditionPoolSize = 32;
+
   enum {
     // Data sink write failed.
     kDataSinkWriteFail = -117,
@@ -166,6 +1041,9 @@ class WebmEncoder : public AudioSamplesCallbackInterface,
     kNoMemory = -2,
     kInvaligArg = -1,
     kSuccess = 0,
+
+    // Media source delivered all of its input.
+    kAVCaptureEnded = 1,
   };
 
   WebmEncoder();
@@ -180,12 +1058,203 @@ class WebmEncoder : public AudioSamplesCallbackInterface,
   // status codes upon failure.
   int Run();
 
-  // Stops the encoder.
+  // Stops the encoder, and waits for the encoder thread to flush its output
+  // for at most |WebmEncoderConfig::stop_timeout| milliseconds. The outcome
+  // is logged, and available from |GetShutdownStats()|.
   void Stop();
 
+  // Pauses output, for example during an ad break. Capture keeps running
+  // and its input is discarded; the encoders, muxers and sinks stay
+  // initialized, and the frames already captured are still encoded. Thread
+  // safe. Returns |kSuccess| when successful, also when already paused.
+  int Pause();
+
+  // Resumes output after |Pause()|, from the next captured frame. The time
+  // spent paused is removed from the timestamps of all later input, so the
+  // output timeline continues without a gap. Thread safe. Returns |kSuccess|
+  // when successful, also when not paused.
+  int Resume();
+
+  // Splices the pre-encoded WebM clip at |path|, a slate or an ad, into the
+  // output without encoding it. Output pauses as with |Pause()|; the
+  // encoder thread writes the clip after the last frame muxed, see
+  // |LiveWebmMuxer::SpliceClip()|, and output resumes once the clip has
+  // played out, from a forced keyframe, with live timestamps following the
+  // clip. The clip must match the codec configuration of the muxed and
+  // DASH streams. Renditions and the archive do not receive it, and pause
+  // for its duration. Thread safe. Returns |kSuccess| once the clip is
+  // queued, and |kInvalidArg| when it cannot be read, or while paused or
+  // splicing.
+  int SpliceClip(const std::string& path);
+
+  // Copies the |Pause()| counters to |ptr_stats|. Thread safe. Returns
+  // |kSuccess| when successful.
+  int GetPauseStats(PauseStats* ptr_stats) const;
+
   // Returns encoded duration in milliseconds.
   int64 encoded_duration() const;
 
+  // Returns true once the encoder thread has exited: after |Stop()|, after
+  // an error, or after the media source delivered all of its input. |Stop()|
+  // must still be called.
+  bool finished() const { return finished_; }
+
+  // Copies chunk and manifest file writer queue depth and write latency
+  // counters to |ptr_stats|. Returns |kSuccess| when successful.
+  int GetFileWriterStats(FileWriterStats* ptr_stats);
+
+  // Copies DASH origin server request counters to |ptr_stats|. Returns
+  // |kSuccess| when successful, or |kInvalidArg| when the server is
+  // disabled.
+  int GetDashServerStats(DashOriginServerStats* ptr_stats);
+
+  // Copies video frame drop counters to |ptr_stats|. Returns |kSuccess| when
+  // successful.
+  int GetVideoDropStats(VideoDropStats* ptr_stats) const;
+
+  // Copies the capture timestamp regulation counters to |ptr_stats|. Thread
+  // safe. Returns |kSuccess| when successful.
+  int GetTimestampStats(CaptureTimestampStats* ptr_stats) const;
+
+  // Copies the |WebmEncoderConfig::output_frame_rate| conversion counters to
+  // |ptr_stats|. Thread safe. Returns |kSuccess| when successful, and
+  // |kInvalidArg| when the frame rate is not converted.
+  int GetFrameRateStats(FrameRateConverterStats* ptr_stats) const;
+
+  // Copies the |WebmEncoderConfig::align_segments| counters to |ptr_stats|.
+  // Thread safe. Returns |kSuccess| when successful, and |kInvalidArg| when
+  // segments are not aligned.
+  int GetSegmentAlignmentStats(SegmentAlignerStats* ptr_stats) const;
+
+  // Copies the |WebmEncoderConfig::segment_rate| counters to |ptr_stats|.
+  // Thread safe. Returns |kSuccess| when successful, and |kInvalidArg| when
+  // segment rate control is disabled.
+  int GetSegmentRateStats(SegmentRateStats* ptr_stats) const;
+
+  // Copies the |WebmEncoderConfig::adaptive_segments| counters to
+  // |ptr_stats|. Thread safe. Returns |kSuccess| when successful, and
+  // |kInvalidArg| when segment durations are fixed.
+  int GetSegmentDurationStats(SegmentDurationStats* ptr_stats) const;
+
+  // Copies the |WebmEncoderConfig::thumbnail| counters to |ptr_stats|.
+  // Thread safe. Returns |kSuccess| when successful, and |kInvalidArg| when
+  // thumbnails are disabled.
+  int GetThumbnailStats(ThumbnailStats* ptr_stats) const;
+
+  // Copies the |WebmEncoderConfig::quality| measurements to |ptr_stats|.
+  // Thread safe. Returns |kSuccess| when successful, and |kInvalidArg| when
+  // the quality monitor is disabled.
+  int GetQualityStats(QualityStats* ptr_stats) const;
+
+  // Copies the |WebmEncoderConfig::audio_levels| levels and silence counters
+  // to |ptr_stats|. Thread safe. Returns |kSuccess| when successful, and
+  // |kInvalidArg| when audio levels are not measured.
+  int GetAudioLevelStats(AudioLevelStats* ptr_stats) const;
+
+  // Copies the |WebmEncoderConfig::audio_drift| estimate and counters to
+  // |ptr_stats|. Thread safe. Returns |kSuccess| when successful, and
+  // |kInvalidArg| when drift is not corrected.
+  int GetAudioDriftStats(AudioDriftStats* ptr_stats) const;
+
+  // Copies the |WebmEncoderConfig::text_track| counters to |ptr_stats|.
+  // Thread safe. Returns |kSuccess| when successful, and |kInvalidArg| when
+  // there is no text track.
+  int GetTextTrackStats(TextTrackStats* ptr_stats) const;
+
+  // Copies the |WebmEncoderConfig::encryption| counters of all muxers to
+  // |ptr_stats|. Thread safe. Returns |kSuccess| when successful, and
+  // |kInvalidArg| when encryption is disabled.
+  int GetEncryptionStats(EncryptionStats* ptr_stats) const;
+
+  // Copies the |WebmEncoderConfig::capture_watchdog| counters to
+  // |ptr_stats|. Thread safe. Returns |kSuccess| when successful, and
+  // |kInvalidArg| when there is no watchdog.
+  int GetCaptureWatchdogStats(CaptureWatchdogStats* ptr_stats) const;
+
+  // Copies the measured segment statistics of each DASH Representation to
+  // |ptr_stats|, audio first. Thread safe. Returns |kSuccess| when
+  // successful, and |kInvalidArg| without DASH output.
+  int GetRepresentationStats(std::vector<RepresentationStats>* ptr_stats) const;
+
+  // Copies the container statistics of each muxer to |ptr_stats|, audio
+  // muxers first, then video muxers and renditions. Thread safe. Returns
+  // |kSuccess| when successful.
+  int GetMuxerStats(std::vector<MuxerStats>* ptr_stats) const;
+
+  // Copies the encoder output counters to |ptr_stats|. Thread safe. Returns
+  // |kSuccess| when successful.
+  int GetEncodeStats(EncodeStats* ptr_stats) const;
+
+  // Copies the per frame type profile of the primary video encoder to
+  // |ptr_stats|. Thread safe. Returns |kSuccess| when successful.
+  int GetFrameProfileStats(FrameProfileStats* ptr_stats) const;
+
+  // Copies the startup timeline to |ptr_stats|. Returns |kSuccess| when
+  // successful.
+  int GetStartupStats(StartupStats* ptr_stats) const;
+
+  // Copies the muxed stream backpressure counters to |ptr_stats|. Thread
+  // safe. Returns |kSuccess| when successful.
+  int GetSinkStats(SinkStats* ptr_stats) const;
+
+  // Copies the buffer pool counters to |ptr_stats|. Thread safe. Returns
+  // |kSuccess| when successful.
+  int GetPoolStats(EncoderPoolStats* ptr_stats) const;
+
+  // Copies the media buffer arena counters to |ptr_stats|, summed over the
+  // channel's arena and those of renditions on other NUMA nodes. Thread safe.
+  // Returns |kSuccess| when successful.
+  int GetArenaStats(MediaArenaStats* ptr_stats) const;
+
+  // Copies the outcome of the final flush to |ptr_stats|. Complete once
+  // |Stop()| returns. Thread safe. Returns |kSuccess| when successful.
+  int GetShutdownStats(ShutdownStats* ptr_stats) const;
+
+  // Requests new target bitrates, in kilobits, for the primary video stream
+  // and the audio stream. 0 leaves a stream unchanged. Each encoder applies
+  // the request before it encodes its next frame or buffer; a dynamic DASH
+  // manifest advertises the new bandwidth from its next update. Thread safe.
+  // Returns |kSuccess| when successful.
+  int SetTargetBitrate(int video_bitrate, int audio_bitrate);
+
+  // Requests the changes in |reconfig| without stopping capture or the
+  // encoders. Each encoder applies them between frames, before it encodes
+  // its next frame or buffer; bitrate changes are applied and recorded as
+  // by |SetTargetBitrate()|. Changes to a disabled stream are ignored.
+  // Thread safe. Returns |kInvalidArg| when a value is out of range, and
+  // |kSuccess| otherwise.
+  int Reconfigure(const EncoderReconfiguration& reconfig);
+
+  // Queues |cue| for the text track. A |TextCue::kStartNow| start shows the
+  // cue from the next frame muxed. Thread safe. Returns |kInvalidArg| when
+  // there is no text track, and |kNoMemory| when the cue queue is full or
+  // |cue| is empty.
+  int AddTextCue(const TextCue& cue);
+
+  // Makes |key| the content key of every muxer from its next segment on.
+  // The key id in the track headers stays |WebmEncoderConfig::encryption|'s,
+  // so the key schedule reaches players out of band, through the license
+  // server. Thread safe. Returns |kInvalidArg| when encryption is disabled
+  // or |key| is not |EncryptionSettings::kKeySize| bytes.
+  int RotateEncryptionKey(const std::string& key);
+
+  // Requests a keyframe from the primary video encoder and each rendition,
+  // for example when a player joins or an origin restarts. Each encoder
+  // forces one at its next frame, subject to
+  // |VpxConfig::min_keyframe_request_interval|. Thread safe. Returns
+  // |kSuccess| when successful.
+  int RequestKeyframe();
+
+  // Replaces the regions of interest of the primary video encoder and each
+  // rendition; see |VideoEncoder::SetRegionsOfInterest()|. The entry point
+  // for hints from an analysis stage. Thread safe. Returns |kSuccess| when
+  // successful.
+  int SetRegionsOfInterest(const std::vector<RegionOfInterest>& regions);
+
+  // Copies the bitrate changes applied so far, oldest first, to
+  // |ptr_changes|. Returns |kSuccess| when successful.
+  int GetBitrateChanges(std::vector<BitrateChange>* ptr_changes) const;
+
   // Returns |WebmEncoderConfig| with fields set to default values.
   static WebmEncoderConfig DefaultConfig();
   WebmEncoderConfig config() const { return config_; }
@@ -200,18 +1269,222 @@ class WebmEncoder : public AudioSamplesCallbackInterface,
   // |EncoderThread()|.
   virtual int OnVideoFrameReceived(VideoFrame* ptr_frame);
 
+  // |DataSinkCallbackInterface| methods
+  // Method used by |async_sink_| to report a muxed stream chunk or manifest
+  // written.
+  virtual void OnChunkComplete(const SharedWebmChunk& chunk, bool success);
+
  private:
   // Function pointer type used for indirect access to the encoder loop
   // methods from |EncoderThread()|.
   typedef int (WebmEncoder::*EncoderLoopFunc)();
 
+  // Output timeline of one captured stream, kept by its capture callback to
+  // close the gap left by |Pause()|.
+  struct CaptureTimeline {
+    CaptureTimeline()
+        : resumes(0), started(false), last_timestamp(0), duration(0) {}
+
+    // |resumes_| when the last input was shifted.
+    int64 resumes;
+
+    // True once the stream has delivered input, and the shifted timestamp
+    // and duration of the last input, in milliseconds.
+    bool started;
+    int64 last_timestamp;
+    int64 duration;
+  };
+
+  struct VideoRendition;
+
+  // Passes the frames of an additional camera to |ReceiveCameraFrame()|.
+  class CameraCallback : public VideoFrameCallbackInterface {
+   public:
+    CameraCallback(WebmEncoder* ptr_encoder, VideoRendition* ptr_camera)
+        : ptr_encoder_(ptr_encoder), ptr_camera_(ptr_camera) {}
+    virtual ~CameraCallback() {}
+    virtual int OnVideoFrameReceived(VideoFrame* ptr_frame) {
+      return ptr_encoder_->ReceiveCameraFrame(ptr_camera_, ptr_frame);
+    }
+
+   private:
+    WebmEncoder* ptr_encoder_;
+    VideoRendition* ptr_camera_;
+    WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(CameraCallback);
+  };
+
+  // State of an additional video rendition. Frames are scaled into
+  // |frame_pool| by |ScalerThread()|, or for a camera delivered there by
+  // |ReceiveCameraFrame()|, and are compressed and muxed by
+  // |RenditionThread()|.
+  struct VideoRendition {
+    // Defined out of line: |LiveWebmMuxer| is incomplete here.
+    VideoRendition();
+    ~VideoRendition();
+
+    // Position of the rendition in |config_.video_renditions| plus one; the
+    // primary video stream is rendition 0. Cameras follow the renditions.
+    int index;
+
+    // Position of the camera in |config_.video_cameras| plus one, or 0 for
+    // a rendition scaled from the primary capture.
+    int camera;
+
+    // Rendition frame size and rate.
+    VideoConfig video_config;
+
+    // Camera state: the callback passed to the media source, the pool that
+    // shares captured frames with |frame_pool|, and the camera's timeline.
+    // Used by the capture thread of the camera.
+    std::unique_ptr<CameraCallback> camera_callback;
+    SharedFramePool camera_frames;
+    CaptureTimeline camera_timeline;
+
+    VideoEncoder encoder;
+    std::unique_ptr<LiveWebmMuxer> muxer;
+
+    // Raw frames waiting for |encoder|, shared with the other renditions of
+    // the same size.
+    SpscBufferPool<SharedVideoFrame> frame_pool;
+
+    // Storage of |input_frame| and |vpx_frame|: |arena_|, or an arena on the
+    // rendition's NUMA node. Frames are scaled into it across nodes once, and
+    // read locally by |encoder|.
+    std::shared_ptr<MediaArena> arena;
+
+    // Staging frame scaled by |ScalerThread()| when the rendition is the
+    // first of its |ScaleLevel|, or converted from a camera's capture format.
+    VideoFrame input_frame;
+
+    // Most recent frames from |frame_pool| and |encoder|. Owned by
+    // |RenditionThread()|.
+    SharedVideoFrame raw_frame;
+    VideoFrame vpx_frame;
+
+    // Speed and keyframe interval requested by |Reconfigure()| and not yet
+    // applied to |encoder|, or |EncoderReconfiguration::kUnchanged|.
+    std::atomic<int> requested_speed;
+    std::atomic<int> requested_keyframe_interval;
+
+    // Start of the next segment in the schedule of |segment_durations_|, at
+    // which |encoder| is asked for a keyframe. Owned by |RenditionThread()|.
+    int64 next_segment_time;
+
+    // Loop muxed while the capture source is lost, in the rendition's size.
+    // Prepared by |Init()| with |WebmEncoderConfig::capture_watchdog| slates,
+    // and muxed by |RenditionThread()|.
+    FallbackSlate slate;
+
+    std::shared_ptr<std::thread> thread;
+    WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(VideoRendition);
+  };
+
+  // An additional audio rendition. Encodes the planar blocks shared by
+  // |EncodeAudioRenditions()| on its own thread.
+  struct AudioRendition {
+    // Defined out of line: |LiveWebmMuxer| is incomplete here.
+    AudioRendition();
+    ~AudioRendition();
+
+    // Position of the rendition in |config_.audio_renditions| plus one; the
+    // primary audio stream is rendition 0.
+    int index;
+
+    VorbisEncoder encoder;
+    std::unique_ptr<LiveWebmMuxer> muxer;
+
+    // Planar samples waiting for |encoder|, and the most recent block read
+    // from it. |block| is owned by |AudioRenditionThread()|.
+    SpscBufferPool<SharedAudioBlock> block_pool;
+    SharedAudioBlock block;
+
+    // Compressed audio most recently read from |encoder|.
+    AudioPacketBatch batch;
+
+    // Silent loop muxed while the capture source is lost, as |slate| of
+    // |VideoRendition|.
+    FallbackSlate slate;
+
+    std::shared_ptr<std::thread> thread;
+    WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(AudioRendition);
+  };
+
+  // A rendition frame size produced by |ScalerThread()|. Each size is scaled
+  // once per source frame, into the |input_frame| of the first entry in
+  // |renditions|, which is wrapped in |ptr_frames| and shared by all entries.
+  // A level of the captured size shares the captured frame.
+  struct ScaleLevel {
+    int32 width;
+    int32 height;
+
+    // Index of the |scale_levels_| entry this level is scaled from, or -1 to
+    // scale from the captured frame.
+    int source_level;
+
+    std::vector<VideoRendition*> renditions;
+
+    // Pool of the level's scaled frames, owned by |scale_level_frames_|, and
+    // the frame scaled from the current source frame. Used by
+    // |ScalerThread()|.
+    SharedFramePool* ptr_frames;
+    SharedVideoFrame frame;
+  };
+
+  // A muxed stream chunk waiting for |ptr_data_sink_|.
+  struct SinkChunk {
+    SharedWebmChunk chunk;
+
+    // True for the WebM header chunk, which is never dropped.
+    bool header;
+  };
+
+  // Chunks of one DASH muxer, read by the thread that muxes them, waiting
+  // for the muxer's drain task on |config_.dash_drain_channel|. One drain
+  // task per muxer runs at a time, so the chunks of a muxer are written in
+  // order while those of different muxers are written concurrently.
+  struct ChunkDrain {
+    struct Entry {
+      int64 chunk_num;
+      SharedWebmChunk chunk;
+    };
+    ChunkDrain() : scheduled(false) {}
+
+    std::string muxer_id;
+
+    // Chunks waiting, oldest first, and whether a drain task is posted or
+    // running. Protected by |mutex|.
+    std::deque<Entry> chunks;
+    bool scheduled;
+    std::mutex mutex;
+
+    // Signalled when the drain task has written every queued chunk.
+    std::condition_variable idle;
+  };
+
   // Returns true when user wants the encode thread to stop.
   bool StopRequested();
 
-  // Reads chunk from |muxer| and reallocates |chunk_buffer_| when necessary.
-  // Returns true when successful.
+  // Raises |encoded_duration_| to |timestamp|, in milliseconds.
+  void UpdateEncodedDuration(int64 timestamp);
+
+  // Returns the milliseconds left before |WebmEncoderConfig::stop_timeout|
+  // expires, 0 once it has, or -1 when there is no deadline: before |Stop()|,
+  // or when the timeout is 0.
+  int StopTimeRemaining();
+
+  // Returns true once the stop deadline has passed, and marks the flush as
+  // timed out in |shutdown_stats_|.
+  bool StopDeadlinePassed();
+
+  // Stores the time elapsed since |startup_time_| in |*ptr_phase| unless the
+  // phase was already recorded. Returns true when the phase is recorded.
+  bool RecordStartupPhase(std::atomic<int64>* ptr_phase);
+
+  // Reads chunk from |muxer| into |ptr_chunk| and assigns it |id|. Returns
+  // true when successful.
   bool ReadChunkFromMuxer(std::unique_ptr<LiveWebmMuxer>* muxer,
-                          int32 chunk_length);
+                          const std::string& id,
+                          SharedWebmChunk* ptr_chunk);
 
   // Encoding thread function.
   void EncoderThread();
@@ -220,57 +1493,607 @@ class WebmEncoder : public AudioSamplesCallbackInterface,
   // |ptr_encode_func_|. All loop functions return |kSuccess| when the encode
   // pass succeeds.
   int EncodeAudioOnly();
-  int AVEncode();
-  int EncodeVideoFrame();
-  int DashEncode();
-
-  // Utility function used to encode a single audio input buffer.
+  int InterleavedEncode();
+  int EncodeVideoOnly();
+  int EncodeVideoFrames();
+  int PipelineMux();
+
+  // Passes all compressed audio available from |audio_encoder_|, or all
+  // compressed video in |vpx_pool_|, to |interleaver_|.
+  int QueueCompressedAudio();
+  int QueueCompressedVideo();
+
+  // Flushes |video_encoder_|, then passes the compressed video in
+  // |vpx_pool_| and the frames the encoder held to |interleaver_|.
+  int QueueFlushedVideo();
+
+  // Muxes the packets |interleaver_| releases with |MuxAudioBuffer()| and
+  // |MuxVideoFrame()|. Muxes every queued packet when |flush| is true.
+  int MuxInterleaved(bool flush);
+
+  // Writes |audio_buffer| to every muxer in |audio_muxers_|, or
+  // |video_frame| to every muxer in |video_muxers_|. Returns |kSuccess| when
+  // all muxers accept it.
+  int MuxAudioBuffer(const AudioBuffer& audio_buffer);
+  int MuxVideoFrame(const VideoFrame& video_frame);
+
+  // Writes the packets in |batch| to every muxer in |audio_muxers_| with one
+  // |LiveWebmMuxer::WriteAudioBuffers()| call each. Returns |kSuccess| when
+  // all muxers accept them.
+  int MuxAudioBuffers(const AudioPacketBatch& batch);
+
+  // Writes the text cues due by |timestamp| to the muxed stream, ahead of
+  // the audio or video at |timestamp|. Cues that arrive late start at the
+  // muxer's time. Write failures are logged and the cue dropped.
+  void MuxTextCues(int64 timestamp);
+
+  // Closes |archive_| after a write returned |status|, keeping the data
+  // already archived. Live output continues without the archive.
+  void AbandonArchive(int status);
+
+  // Pipelined mode encoder stage steps, run by |audio_encode_stage_| and
+  // |video_encode_stage_|. |AudioEncodeStep()| compresses samples from
+  // |audio_ring_| into |vorbis_pool_|, and |VideoEncodeStep()| compresses a
+  // frame from |video_pool_| into |vpx_pool_|. The compressed buffers are
+  // muxed by |EncoderThread()| via |PipelineMux()|. Return a
+  // |PipelineStage| step result.
+  int AudioEncodeStep();
+  int VideoEncodeStep();
+
+  // Starts and stops the pipelined mode encoder threads.
+  int StartPipelineThreads();
+  void StopPipelineThreads();
+
+  // Creates |arena_| with size classes for the raw and compressed frames and
+  // audio buffers of the enabled streams, and hands it to the frames and
+  // buffers the encoder allocates into. Must be called before the pools and
+  // encoders are initialized.
+  int InitArena();
+
+  // Creates |deinterlacer_| when |config_.deinterlace| applies to the
+  // capture, and hands it to |video_converter_|.
+  int InitDeinterlacer();
+
+  // Replaces rendition sizes of 0 in |config_.video_renditions| with the
+  // capture size.
+  void ResolveRenditionSizes();
+
+  // Divides the cores available for video encoding between the primary
+  // encoder and the renditions in proportion to frame area, and stores the
+  // shares in their |VpxConfig::cpu_cores|.
+  void AssignEncoderCores();
+
+  // Replaces the codec, speed and thread count of |config_.vpx_config| with
+  // those |VpxCalibrator| chooses, when |config_.vpx_calibration| is
+  // enabled. Returns |kSuccess|, or |kInvalidArg| when calibration fails.
+  int CalibrateVideoEncoder();
+
+  // Initializes the encoder, muxer and frame pool of |ptr_rendition|, whose
+  // |index|, |video_config| and |arena| are set, for |vpx_config|.
+  int InitRenditionEncoder(const VpxConfig& vpx_config,
+                           VideoRendition* ptr_rendition);
+
+  // Creates a rendition per entry in |config_.video_cameras|, and passes
+  // their callbacks to |ptr_media_source_|. Must be called before the media
+  // source is initialized.
+  int CreateCameras();
+
+  // Initializes the renditions made by |CreateCameras()| for the negotiated
+  // camera settings, and moves them to |renditions_|.
+  int InitCameras();
+
+  // Initializes |renditions_| from |config_.video_renditions|, and builds
+  // |scale_levels_|.
+  int InitRenditions();
+
+  // Groups |renditions_| by size into |scale_levels_|, largest first, and
+  // initializes the shared frame pools of the levels.
+  int InitScaleLevels();
+
+  // Rendition scaler thread. Scales frames from |scale_pool_| to each size in
+  // |scale_levels_|, and passes them to the |RenditionThread()|s. Runs
+  // alongside the primary video encode, which never waits on it.
+  void ScalerThread();
+
+  // Scales all frames available in |scale_pool_| via |ScaleRenditionFrame()|.
+  int ScaleRenditionFrames();
+
+  // Scales |scale_frame_| to each size in |scale_levels_|, and commits a
+  // reference to each scaled frame to the |frame_pool|s of the renditions of
+  // its size. Frames are dropped, not waited on, when a rendition falls
+  // behind.
+  int ScaleRenditionFrame();
+
+  // Scales |scale_frame_| on |gpu_scaler_| into the |input_frame| of each
+  // |scale_levels_| entry not of its size. Returns false, and releases
+  // |gpu_scaler_| when it fails, when the levels must be scaled by libyuv.
+  bool ScaleLevelsOnGpu();
+
+  // Rendition encoder thread. Compresses frames from |ptr_rendition|'s
+  // |frame_pool| and writes its chunks.
+  void RenditionThread(VideoRendition* ptr_rendition);
+
+  // Initializes |audio_renditions_| from |config_.audio_renditions| for the
+  // negotiated audio input, and |audio_blocks_| to share their input.
+  int InitAudioRenditions();
+
+  // Deinterleaves |span| once into a block of |audio_blocks_|, encodes it
+  // with |audio_encoder_|, and commits a reference to it to the
+  // |block_pool| of each audio rendition. Waits, instead of dropping
+  // samples, when a rendition falls behind.
+  int EncodeAudioRenditions(const PcmSpan& span);
+
+  // Audio rendition encoder thread. Compresses blocks from
+  // |ptr_rendition|'s |block_pool| and writes its chunks.
+  void AudioRenditionThread(AudioRendition* ptr_rendition);
+
+  // Compresses and muxes all blocks available in |ptr_rendition|'s
+  // |block_pool|, and writes chunks as they complete.
+  int EncodeAudioRenditionBlocks(AudioRendition* ptr_rendition);
+
+  // Starts and stops |ScalerThread()|, the |RenditionThread()|s and the
+  // |AudioRenditionThread()|s.
+  int StartRenditionThreads();
+  void StopRenditionThreads();
+
+  // Compresses and muxes all frames available in |ptr_rendition|'s
+  // |frame_pool|, and writes chunks as they complete.
+  int EncodeRenditionFrames(VideoRendition* ptr_rendition);
+
+  // Muxes |ptr_rendition|'s |vpx_frame|, and the frames pending in its
+  // encoder, and writes chunks as they complete.
+  int MuxRenditionFrames(VideoRendition* ptr_rendition);
+
+  // Wraps |raw_frame_| in |raw_shared_frame_| and commits a reference to
+  // |scale_pool_| when renditions are enabled, so the primary encoder and
+  // |ScalerThread()| share the frame. The frame is not passed on, and not
+  // waited on, when |ScalerThread()| falls behind.
+  int QueueRenditionFrames();
+
+  // Passes the frame being encoded to |thumbnailer_| when a thumbnail is
+  // due, sharing it through |thumbnail_source_frames_| unless the
+  // renditions have shared it already.
+  int QueueThumbnailFrame();
+
+  // Passes the frame just encoded and its keyframe |vpx_frame_| to
+  // |quality_monitor_| when a sample is due, sharing the frame through
+  // |quality_source_frames_| unless it is shared already. |source_encoded|
+  // is false when the encoder was given a degraded copy of the frame.
+  int QueueQualitySample(bool source_encoded);
+
+  // Stores the first error reported by a pipeline or rendition thread.
+  // Checked by |EncoderThread()|, which stops when an error is stored.
+  void SetPipelineStatus(int status);
+  int pipeline_status() const;
+
+  // Reads and compresses one video frame from |video_pool_|. Sets
+  // |ptr_frame_ready| to true when |vpx_frame_| holds a new compressed frame.
+  int CompressVideoFrame(bool* ptr_frame_ready);
+
+  // Copies |raw_frame_|, compressed by the source, to |vpx_frame_| for
+  // |WebmEncoderConfig::video_passthrough|, flagged as a keyframe when its
+  // header says so. Frames before the first keyframe cannot be decoded, and
+  // are dropped. Sets |ptr_frame_ready| as |CompressVideoFrame()| does.
+  int PassThroughVideoFrame(bool* ptr_frame_ready);
+
+  // Applies the current |WebmEncoderConfig::adaptive_resolution| level to
+  // |raw_frame|. Points |ptr_frame| at the frame to encode: |raw_frame|
+  // scaled to the level's size, or NULL when the level skips it.
+  int DegradeVideoFrame(const VideoFrame& raw_frame,
+                        const VideoFrame** ptr_frame);
+
+  // Moves to the next |WebmEncoderConfig::adaptive_resolution| level when
+  // |video_encoder_| reports saturation or idleness, and passes the level's
+  // frame size to |video_encoder_|. Failures are logged; the level is kept.
+  void AdaptVideoDegradation();
+
+  // Applies |WebmEncoderConfig::kDropStaleFrames| to |video_pool_|: drops
+  // queued frames older than the latency budget, but always leaves at least
+  // one frame.
+  void DropStaleVideoFrames();
+
+  // Folds the encode of |frame|, which took |encode_us| microseconds, into
+  // |video_pool_depth_|, and applies the resulting depth to |video_pool_|.
+  void UpdateVideoPoolDepth(const VideoFrame& frame, int64 encode_us);
+
+  // Compresses all frames available in |video_pool_|, and passes the frames
+  // pending in |video_encoder_|, into |vpx_pool_|, or until |vpx_pool_| is
+  // full. Used outside of pipelined mode.
+  int BufferVideoFrames();
+
+  // Returns |timestamp| minus the capture time removed by |Pause()|, for an
+  // input lasting |duration| milliseconds. The first input of either stream
+  // after |Resume()| sets the time removed, so that it directly follows the
+  // last input of its stream; the other stream is shifted alike, so the
+  // streams stay in sync. The first input of each stream after a resume is
+  // kept after the last one.
+  int64 ShiftCaptureTimestamp(int64 timestamp, int64 duration,
+                              CaptureTimeline* ptr_timeline);
+
+  // Splices |pending_splice_| into each distinct muxer of |audio_muxers_|
+  // and |video_muxers_|, and resumes output once the spliced clip has
+  // played out. Called by |EncoderThread()| after each encode pass.
+  // Returns |kSuccess|, also when the clip does not match the streams and
+  // is skipped, or the status of the muxer write that failed.
+  int RunSplice();
+
+  // Returns the distinct muxers of |audio_muxers_| and |video_muxers_|.
+  std::vector<LiveWebmMuxer*> PrimaryMuxers() const;
+
+  // Returns true when the gaps of a lost capture source are covered by the
+  // fallback slates.
+  bool SlateEnabled() const;
+
+  // Encodes the silent loop of |slate_| with an encoder configured like
+  // |audio_encoder_|.
+  int InitAudioSlate();
+
+  // Schedules the slate loops while |watchdog_| reports the source lost,
+  // one loop ahead of the wall clock, muxes them into |PrimaryMuxers()|,
+  // and asks for keyframes once the source is back. Called by
+  // |EncoderThread()| after each encode pass. Returns |kSuccess|, or the
+  // status of the muxer write that failed.
+  int RunSlate();
+
+  // Returns the end of the slate schedule on the muxer timeline, or -1
+  // when no loop was scheduled since the source was last lost.
+  int64 SlateEndTime() const;
+
+  // Muxes the loops of |ptr_slate| due in the schedule of |RunSlate()|
+  // into |ptr_muxer|, and passes on its chunks. Called by the rendition
+  // threads before they mux frames. Returns |kSuccess|, or the status of the
+  // muxer or chunk write that failed.
+  int FollowSlate(FallbackSlate* ptr_slate,
+                  std::unique_ptr<LiveWebmMuxer>* ptr_muxer);
+
+  // Queues a captured or filler frame for |EncoderThread()|. Called by
+  // |OnVideoFrameReceived()|, through |watchdog_| when there is one.
+  int ReceiveVideoFrame(VideoFrame* ptr_frame);
+
+  // Queues a frame captured by |ptr_camera| for its |RenditionThread()|,
+  // converted to I420 when needed. Called on the camera's capture thread.
+  int ReceiveCameraFrame(VideoRendition* ptr_camera, VideoFrame* ptr_frame);
+
+  // Utility function used to encode the samples of one span read from
+  // |audio_ring_|.
   int EncodeAudioBuffer();
 
+  // Passes a bitrate requested with |SetTargetBitrate()| to |video_encoder_|
+  // or |audio_encoder_|, and records the change when it is applied.
+  // |timestamp| is that of the frame or buffer about to be encoded. Failures
+  // are logged; the encoder keeps its bitrate.
+  void ApplyVideoBitrate(int64 timestamp);
+  void ApplyAudioBitrate(int64 timestamp);
+
+  // Measures the levels of |span| with |audio_level_meter_|, and with
+  // |WebmEncoderConfig::audio_levels.silence_encoding| tells |audio_encoder_|
+  // when the input becomes silent, or stops being silent.
+  void MeasureAudioLevels(const PcmSpan& span);
+
+  // Passes a speed and keyframe interval requested with |Reconfigure()| to
+  // |ptr_encoder|. Failures are logged; the encoder keeps its settings.
+  static void ApplyVideoSettings(std::atomic<int>* ptr_requested_speed,
+                                 std::atomic<int>* ptr_requested_interval,
+                                 VideoEncoder* ptr_encoder);
+
+  // Makes |ptr_muxer| place its clusters on the schedule of
+  // |segment_durations_|, when there is one.
+  void FollowSegmentSchedule(LiveWebmMuxer* ptr_muxer);
+
+  // Asks |ptr_encoder| for a keyframe when the frame at |timestamp| starts a
+  // segment of |segment_durations_|, and then moves |ptr_next_segment_time|
+  // to the start of the next one. Does nothing with fixed segments.
+  void RequestSegmentKeyframe(int64 timestamp, int64* ptr_next_segment_time,
+                              VideoEncoder* ptr_encoder);
+
+  // Appends a |BitrateChange| to |bitrate_changes_|, and updates the
+  // Representation bandwidth in |dash_writer_|.
+  void RecordBitrateChange(int64 timestamp, bool audio, int bitrate);
+
   // Waits for input samples from |ptr_media_source_| and sets
   // |timestamp_offset_| when one or both streams start with a negative
   // timestamp.
   int WaitForSamples();
 
-  // Returns the timestamp of the next available video frame via |timestamp|.
-  int PeekVideoTimestamp(int64* timestamp);
+  // Idles the encoder thread until input is available in |audio_ring_| or
+  // |video_pool_| (|vorbis_pool_| or |vpx_pool_| in pipelined mode), or until
+  // |kInputWaitTimeout| expires. When |interleaver_| holds packets of one
+  // stream for the other, only the input of the other stream ends the wait.
+  // Returns immediately when a queue the encode step waits on is non-empty.
+  void WaitForInput();
 
-  // Writes |muxer| chunk to |ptr_data_sink_| when |muxer->ChunkReady()|
-  // returns true.
+  // Outputs |muxer| chunk when |muxer->ChunkReady()| returns true, and
+  // writes the queued muxed stream chunks that |ptr_data_sink_| is ready for.
+  // Streams data first when |config_.stream_chunks| is true.
   int WriteMuxerChunkToDataSink(std::unique_ptr<LiveWebmMuxer>* muxer);
 
-  // Writes last chunk from |muxer| to |ptr_data_sink_| and finalizes |muxer|.
+  // Passes the chunk data |muxer| has written since the last call to the
+  // streaming interface of |ptr_data_sink_|.
+  int StreamMuxerData(std::unique_ptr<LiveWebmMuxer>* muxer);
+
+  // Finalizes |muxer| and outputs its last chunks. For |ptr_muxer_|, waits
+  // until |ptr_data_sink_| accepts every queued chunk.
   int WriteLastMuxerChunkToDataSink(std::unique_ptr<LiveWebmMuxer>* muxer);
 
+  // Adds a |ChunkDrain| to |chunk_drains_| for each DASH muxer when
+  // |config_.dash_drain_channel| is set. Returns |kSuccess| when successful.
+  int InitChunkDrains();
+
+  // Returns the |ChunkDrain| of the muxer identified by |muxer_id|, or NULL
+  // when its chunks are written by the thread that reads them.
+  ChunkDrain* FindChunkDrain(const std::string& muxer_id) const;
+
+  // Outputs |chunk|, number |chunk_num| of the muxer identified by
+  // |muxer_id|, through the muxer's |ChunkDrain| when it has one, and
+  // directly otherwise.
+  int QueueChunk(const std::string& muxer_id, int64 chunk_num,
+                 const SharedWebmChunk& chunk);
+
+  // Outputs |chunk| and removes the segments it expires.
+  int WriteChunk(const std::string& muxer_id, int64 chunk_num,
+                 const SharedWebmChunk& chunk);
+
+  // Drain task of |ptr_drain|: writes its queued chunks in order. Stores
+  // write errors with |SetPipelineStatus()|.
+  void DrainChunks(ChunkDrain* ptr_drain);
+
+  // Waits until the drain task of the muxer identified by |muxer_id|, or of
+  // every muxer when |muxer_id| is empty, has written its queued chunks.
+  void WaitForChunkDrains(const std::string& muxer_id);
+
+  // Builds the initialization segment of each DASH muxer with
+  // |LiveWebmMuxer::WriteInitSegment()| and delivers it with
+  // |OutputChunk()|, so that it is published before the first frame is
+  // captured. Records each in |early_init_segments_|.
+  int PublishInitSegments();
+
+  // Delivers |chunk|, number |chunk_num| from the muxer identified by
+  // |muxer_id|: chunks of the muxed stream are queued for |ptr_data_sink_|,
+  // unless they have been streamed, and DASH chunks go to |dash_sinks_|. A
+  // DASH initialization segment identical to the one published by
+  // |PublishInitSegments()| is not delivered again.
+  int OutputChunk(const std::string& muxer_id, int64 chunk_num,
+                  const SharedWebmChunk& chunk);
+
+  // Appends the |SegmentIndexRecord| of DASH chunk |chunk_num| to the index
+  // file of its Representation, or starts the file for an initialization
+  // segment.
+  int WriteSegmentIndex(const std::string& muxer_id, int64 chunk_num,
+                        const SharedWebmChunk& chunk);
+
+  // Appends |chunk| to |sink_queue_| and applies |config_.sink_policy|.
+  // |header| is true for the WebM header chunk.
+  void QueueSinkChunk(const SharedWebmChunk& chunk, bool header);
+
+  // Writes chunks from |sink_queue_| to |ptr_data_sink_| while it is ready,
+  // and accounts the time it is not. Returns |kSuccess| when successful.
+  int DrainSinkQueue();
+
+  // Drops the oldest chunks other than the header from |sink_queue_| while
+  // it holds more than |limit| bytes. Moves them to |sink_spill_| instead
+  // when there is one.
+  void DropSinkChunks(int64 limit);
+
+  // Writes chunks from |sink_spill_| to |ptr_data_sink_| while it is ready
+  // and the catch-up rate allows. Returns |kSuccess| when successful.
+  int ReplaySpilledChunks();
+
+  // Copies the counters of |sink_spill_| to |sink_stats_|. Must be called
+  // with |mutex_| held.
+  void CopySpillStats();
+
+  // Returns |config_.sink_queue_limit|, lowered by the bytes the process
+  // holds over |config_.memory_budget|, down to 0. Updates
+  // |sink_stats_.over_memory_budget|.
+  int64 SinkQueueLimit();
+
+  // Makes |manifest| the manifest pending for |ptr_data_sink_|, replacing an
+  // older one not yet written, unless its content matches the last manifest
+  // queued. Does nothing unless |config_.dash_sink_manifest| is true.
+  void QueueSinkManifest(const std::string& manifest);
+
+  // Returns true when |ptr_data_sink_| accepts a chunk now: while it is
+  // ready, or while |async_sink_| has credit.
+  bool SinkAcceptsChunk();
+
+  // Writes |chunk| to |ptr_data_sink_|, or submits it to |async_sink_|.
+  // Returns true when successful.
+  bool PassChunkToSink(const SharedWebmChunk& chunk);
+
+  // Waits a little for |ptr_data_sink_| to make progress: for a completion
+  // from |async_sink_|, or for the next input commit, at most
+  // |kInputWaitTimeout|.
+  void WaitForDataSink();
+
+  // Writes |pending_manifest_| to |ptr_data_sink_| when the sink is ready and
+  // no muxed stream chunk is open on it. Returns |kSuccess| when successful.
+  int WriteSinkManifest();
+
+  // Writes the newest thumbnail of |thumbnailer_| to |ptr_data_sink_| like
+  // |WriteSinkManifest()|, after the manifest. Returns |kSuccess| when
+  // successful.
+  int WriteSinkThumbnail();
+
+  // Returns true when |video_frame| is left out of |ptr_muxer_| by
+  // |WebmEncoderConfig::kSinkDropVideo|.
+  bool SkipMuxedVideoFrame(const VideoFrame& video_frame);
+
+  // Returns the |LatencyStream| traced for chunks of |muxer_id|, or -1 when
+  // they are not traced. Chunk stages are traced for one muxer per stream:
+  // the muxed stream's when enabled, else the DASH audio and video streams.
+  int LatencyTraceStream(const std::string& muxer_id) const;
+
   // Returns a chunk identifier for |chunk_num| from |muxer|.
   std::string NextChunkId(const std::string& muxer_id,
                           int64 chunk_num) const;
 
-  // Set to true when |Init()| is successful.
-  bool initialized_;
+  // Returns the index of the video or audio rendition muxed by the muxer
+  // identified by |muxer_id|, or 0 for the primary video or audio muxer.
+  int RenditionForMuxer(const std::string& muxer_id) const;
+
+  // Returns true when the DASH muxer identified by |muxer_id| muxes the
+  // primary audio stream or an audio rendition.
+  static bool IsAudioMuxer(const std::string& muxer_id);
+
+  // Adds the media segment in |chunk|, written to the file identified by
+  // |id| by the muxer identified by |muxer_id|, to the dynamic DASH manifest
+  // and to |segment_retention_|.
+  void RecordDashSegment(const std::string& muxer_id, const std::string& id,
+                         const SharedWebmChunk& chunk);
+
+  // Enqueues removal of the segment files that have left the retention
+  // window. Returns |kSuccess| upon success.
+  int RemoveExpiredSegments();
 
-  // Flag protected by |mutex_| and used by |EncoderThread()| via
-  // |StopRequested()| to determine when to terminate.
-  bool stop_;
+  // Writes the DASH manifest to |config_.dash_dir| with
+  // |FileWriter::EnqueueReplacement()| when it is dynamic and
+  // |manifest_update_period_| has elapsed since the last write, or when
+  // |force| is true. Does nothing before the first segment is recorded.
+  // Also queues the manifest for the data sink, and retries a pending one.
+  int PublishDashManifest(bool force);
 
-  // Temporary storage for chunks about to be passed to |ptr_data_sink_|.
-  std::unique_ptr<uint8[]> chunk_buffer_;
-  int32 chunk_buffer_size_;
+  // Writes |dash_manifest| to each of |dash_sinks_|. Returns |kSuccess| when
+  // successful.
+  int WriteDashManifest(const std::string& dash_manifest);
 
-  // Pointer to platform specific audio/video source object implementation.
-  std::unique_ptr<MediaSourceImpl> ptr_media_source_;
+  // Set to true when |Init()| is successful.
+  bool initialized_;
+
+  // Flag used by |EncoderThread()| and the pipeline threads via
+  // |StopRequested()| to determine when to terminate. Set with |mutex_| held
+  // by |Stop()|, together with |stop_time_|, and read without it.
+  std::atomic<bool> stop_;
+
+  // Time |Stop()| was called, from which |WebmEncoderConfig::stop_timeout|
+  // runs, and the outcome of the flush. Protected by |mutex_|.
+  std::chrono::steady_clock::time_point stop_time_;
+  ShutdownStats shutdown_stats_;
+
+  // |Pause()| state. Capture callbacks discard their input while |paused_|
+  // is set. |Resume()| increments |resumes_| and sets |resume_pending_|,
+  // which the first input to see it clears when it sets |pause_offset_|.
+  // |resume_pending_| and |pauses_| are protected by |mutex_|; the
+  // timelines are owned by the capture callbacks.
+  std::atomic<bool> paused_;
+  std::atomic<int64> resumes_;
+  std::atomic<int64> pause_offset_;
+  std::atomic<int64> paused_frames_;
+  std::atomic<int64> paused_audio_buffers_;
+  bool resume_pending_;
+  int64 pauses_;
+
+  // |SpliceClip()| state: the clip queued for |RunSplice()|, protected by
+  // |mutex_|; whether a clip is playing out, and when output resumes, both
+  // owned by the encoder thread; and the capture time the first input
+  // after the clip must not precede, -1 when none.
+  std::shared_ptr<const WebmSpliceClip> pending_splice_;
+  bool splice_active_;
+  std::chrono::steady_clock::time_point splice_resume_time_;
+  std::atomic<int64> resume_floor_;
+
+  // Fallback slate state: the loop of the primary streams; the start of the
+  // schedule on the muxer timeline, -1 before the first loss, shared with
+  // the rendition threads; and the schedule's state, owned by the encoder
+  // thread: whether it runs, the loops scheduled, and the wall clock time
+  // the next loop is due.
+  FallbackSlate slate_;
+  std::atomic<int64> slate_start_time_;
+  bool slate_running_;
+  int64 slate_loops_;
+  std::chrono::steady_clock::time_point slate_due_;
+  CaptureTimeline video_timeline_;
+  CaptureTimeline audio_timeline_;
+
+  // Audio/video source: capture devices, or media files.
+  std::unique_ptr<MediaSourceInterface> ptr_media_source_;
+
+  // Checks and restarts |ptr_media_source_|, when
+  // |WebmEncoderConfig::capture_watchdog| is enabled. Declared after the
+  // source, which it uses until destroyed.
+  std::unique_ptr<CaptureWatchdog> watchdog_;
+
+  // Chunk buffers of all muxers. Declared before the muxers, which hold
+  // buffers from it.
+  SharedWebmChunkDataPool chunk_pool_;
+
+  // Initialization segments of all muxers, shared by muxers whose tracks
+  // are configured alike. Declared before the muxers.
+  InitSegmentCache init_segments_;
 
   // Pointer to live WebM muxer. |ptr_muxer_| is used for muxed A/V output and
-  // single stream output.
+  // single stream output when |config_.muxed_output| is true.
   std::unique_ptr<LiveWebmMuxer> ptr_muxer_;
 
   // Pointers to live WebM muxers. |ptr_muxer_aud_| and |ptr_muxer_vid_| are
   // used for DASH encodes that do not mux audio and video into the same WebM
   // chunks.
-  // TODO(tomfinegan): Support multiple streams of each media type.
+  // Additional video renditions use the muxers in |renditions_|.
   std::unique_ptr<LiveWebmMuxer> ptr_muxer_aud_;
   std::unique_ptr<LiveWebmMuxer> ptr_muxer_vid_;
 
+  // Muxers fed by each compressed audio buffer and video frame: |ptr_muxer_|
+  // and the DASH muxer of the stream, when enabled. Set by |Init()|.
+  std::vector<LiveWebmMuxer*> audio_muxers_;
+  std::vector<LiveWebmMuxer*> video_muxers_;
+
+  // Captured frames shared by the primary video encoder and
+  // |ScalerThread()|, and the scaled frames of each |scale_levels_| entry.
+  // Declared ahead of the members holding references to their frames.
+  SharedFramePool scale_source_frames_;
+  std::vector<std::unique_ptr<SharedFramePool>> scale_level_frames_;
+
+  // Captured frames shared with |thumbnailer_| when the renditions have not
+  // shared them, and the thumbnail maker, which references frames of both
+  // pools. Set up by |Init()| with |config_.thumbnail|.
+  SharedFramePool thumbnail_source_frames_;
+  std::unique_ptr<Thumbnailer> thumbnailer_;
+
+  // Captured frames shared with |quality_monitor_| when no other user has
+  // shared them, and the quality monitor. Set up by |Init()| with
+  // |config_.quality|.
+  SharedFramePool quality_source_frames_;
+  std::unique_ptr<QualityMonitor> quality_monitor_;
+
+  // Text cue queue and reader, the |LiveWebmMuxer::TrackHandle| of the text
+  // track, and the cue being muxed. Set up by |Init()| with
+  // |config_.text_track|.
+  std::unique_ptr<TextTrackSource> text_source_;
+  uint64 text_track_;
+  TextCue text_cue_;
+
+  // Additional video renditions, and the cameras among them. Sized by
+  // |Init()|.
+  std::vector<std::unique_ptr<VideoRendition>> renditions_;
+
+  // Cameras made by |CreateCameras()|, until |InitCameras()| moves them to
+  // |renditions_|.
+  std::vector<std::unique_ptr<VideoRendition>> cameras_;
+
+  // Rendition sizes, ordered largest first. Each level is scaled from the
+  // smallest larger level, not from the captured frame.
+  std::vector<ScaleLevel> scale_levels_;
+
+  // Raw frames waiting for |ScalerThread()|. Filled by the thread reading
+  // |video_pool_| via |QueueRenditionFrames()|.
+  SpscBufferPool<SharedVideoFrame> scale_pool_;
+
+  // Most recent frame from |scale_pool_|. Owned by |ScalerThread()|.
+  SharedVideoFrame scale_frame_;
+
+  // I420 copy of |scale_frame_| when it is NV12, which libyuv cannot scale.
+  // Owned by |ScalerThread()|.
+  VideoFrame scale_i420_frame_;
+
+  // GPU scaler of all levels from |scale_frame_| in one upload. NULL unless
+  // |config_.gpu_video_processing| is set and a GPU video processor is
+  // available. Owned by |ScalerThread()|. Windows only.
+#ifdef _WIN32
+  std::unique_ptr<D3D11VideoProcessor> gpu_scaler_;
+#endif
+
+  // Rendition scaler thread.
+  std::shared_ptr<std::thread> scaler_thread_;
+
   // Mutex providing synchronization between user interface and encoder thread.
   mutable std::mutex mutex_;
 
@@ -280,34 +2103,136 @@ class WebmEncoder : public AudioSamplesCallbackInterface,
   // Data sink to which WebM chunks are written.
   DataSinkInterface* ptr_data_sink_;
 
+  // Writes DASH chunks and the manifest to |config_.dash_dir| from its own
+  // thread, keeping file I/O off of |EncoderThread()|.
+  FileWriter file_writer_;
+
+  // Writes DASH chunks and manifests to |config_.dash_dir| through
+  // |file_writer_|. Used when |config_.dash_write_files| is true.
+  FileSink dash_file_sink_;
+
+  // Sinks that receive each DASH chunk and manifest: |dash_file_sink_| and
+  // |dash_server_|, when used. Not owned.
+  std::vector<DataSinkInterface*> dash_sinks_;
+
+  // Records the samples delivered to |OnVideoFrameReceived()| and
+  // |OnSamplesReceived()| when |config_.capture_dump_file| is set.
+  CaptureDumpWriter capture_dump_;
+
+  // Storage of the encoder's frames and audio buffers. Captured samples are
+  // swapped into the pools, so once the pipeline is warm the capture
+  // source's frames also hold arena storage.
+  std::shared_ptr<MediaArena> arena_;
+
   // Buffer object used to push |VideoFrame|s from |MediaSourceImpl| into
-  // |EncoderThread()|.
-  BufferPool<VideoFrame> video_pool_;
+  // |EncoderThread()|. Lock free: the capture thread never waits on the
+  // encoder thread.
+  SpscBufferPool<VideoFrame> video_pool_;
+
+  // Chooses the |video_pool_| limit when |config_.video_pool_depth| is
+  // enabled. Used only by the encoder thread.
+  PoolDepthController video_pool_depth_;
+
+  // Deinterlaces captured frames before they enter |video_pool_|. NULL when
+  // |config_.deinterlace| is off or the capture is progressive. Declared
+  // ahead of |video_converter_|, whose workers use it.
+  std::unique_ptr<VideoDeinterlacer> deinterlacer_;
+
+  // Converts captured frames that are not I420 or YV12 before they enter
+  // |video_pool_|. Unused when |config_.video_conversion_threads| is 0.
+  VideoConverter video_converter_;
+
+  // Frame converted on the capture thread when |video_converter_| is unused,
+  // or by |gpu_converter_|.
+  VideoFrame converted_frame_;
+
+  // GPU converter of captured frames, used on the capture thread ahead of
+  // |video_converter_|. NULL unless |config_.gpu_video_processing| is set,
+  // the capture format needs conversion and a GPU video processor supports
+  // it. Windows only.
+#ifdef _WIN32
+  std::unique_ptr<D3D11VideoProcessor> gpu_converter_;
+#endif
 
   // Most recent frame from |video_pool_|.
   VideoFrame raw_frame_;
 
+  // |raw_frame_| once |QueueRenditionFrames()| has shared it, encoded in its
+  // place. Empty when renditions are disabled or the frame was not shared.
+  SharedVideoFrame raw_shared_frame_;
+
   // Most recent frame from |video_encoder_|.
   VideoFrame vpx_frame_;
 
+  // Compressed frames read from |vpx_pool_| by one |DecommitBatch()| call.
+  // Their storage goes back to the pool with the next batch.
+  std::unique_ptr<VideoFrame[]> vpx_batch_;
+
   // Video encoder.
   VideoEncoder video_encoder_;
 
-  // Encoded duration in milliseconds.
-  int64 encoded_duration_;
-
-  // Buffer object used to push |AudioBuffer|s from |MediaSourceImpl| into
+  // Encoded duration in milliseconds: the newest timestamp muxed. Raised by
+  // |UpdateEncodedDuration()| from the muxing thread, and read without a
+  // lock.
+  std::atomic<int64> encoded_duration_;
+
+  // Ring that carries captured audio samples from |MediaSourceImpl| to the
+  // audio encoder.
+  PcmRingBuffer audio_ring_;
+
+  // Compressed audio most recently read from |audio_encoder_|, a batch at a
+  // time. Owned by the thread that reads |audio_encoder_|.
+  AudioPacketBatch audio_batch_;
+
+  // Audio encoder object, selected by |WebmEncoderConfig::audio_codec|.
+  std::unique_ptr<AudioEncoder> audio_encoder_;
+
+  // Audio input level meter, and the silence state last passed to
+  // |audio_encoder_|. Used by the thread that encodes audio.
+  std::unique_ptr<AudioLevelMeter> audio_level_meter_;
+  bool audio_encoder_silent_;
+
+  // Additional audio renditions, the pool of planar blocks they share with
+  // |audio_encoder_|, the block deinterleaved from the current span, and the
+  // deinterleave function for the negotiated input. Empty unless
+  // |config_.audio_renditions| is set.
+  std::vector<std::unique_ptr<AudioRendition>> audio_renditions_;
+  SharedAudioBlockPool audio_blocks_;
+  PlanarAudioBlock audio_planar_block_;
+  PcmDeinterleaveFunc audio_deinterleave_;
+
+  // Audio input resampler of |WebmEncoderConfig::audio_drift|. Used by the
+  // thread that encodes audio.
+  std::unique_ptr<AudioDriftCorrector> audio_drift_corrector_;
+
+  // Pipelined mode queues used to pass compressed audio and video from the
+  // encoder threads to |EncoderThread()|. Outside of pipelined mode
+  // |vpx_pool_| holds compressed video until it is muxed or passed to
+  // |interleaver_|.
+  SpscBufferPool<AudioBuffer> vorbis_pool_;
+  SpscBufferPool<VideoFrame> vpx_pool_;
+
+  // Compressed buffers most recently released by |interleaver_|, also used
+  // in pipelined mode to read from |vorbis_pool_| and |vpx_pool_|. Owned by
   // |EncoderThread()|.
-  BufferPool<AudioBuffer> audio_pool_;
+  AudioBuffer mux_audio_buffer_;
+  VideoFrame mux_video_frame_;
 
-  // Most recent uncompressed audio buffer from |audio_pool_|.
-  AudioBuffer raw_audio_buffer_;
+  // Orders compressed audio and video by timestamp for muxing when both
+  // streams are enabled. Owned by |EncoderThread()|.
+  AVInterleaver interleaver_;
 
-  // Most recent vorbis audio buffer from |vorbis_encoder_|.
-  AudioBuffer vorbis_audio_buffer_;
+  // Pipelined mode encoder stages.
+  PipelineStage audio_encode_stage_;
+  PipelineStage video_encode_stage_;
 
-  // Vorbis encoder object.
-  VorbisEncoder vorbis_encoder_;
+  // First error reported by a pipeline or rendition thread. Protected by
+  // |mutex_|.
+  int pipeline_status_;
+
+  // Chunk queues of the DASH muxers, and their drain tasks. The list is
+  // built by |Init()| and not changed after.
+  std::vector<std::unique_ptr<ChunkDrain>> chunk_drains_;
 
   // Encoder configuration.
   WebmEncoderConfig config_;
@@ -318,9 +2243,183 @@ class WebmEncoder : public AudioSamplesCallbackInterface,
   // DASH manifest writer.
   std::unique_ptr<DashWriter> dash_writer_;
 
+  // Initialization segments published by |PublishInitSegments()|, by muxer
+  // id. Written before capture starts, and only read afterwards.
+  std::map<std::string, SharedWebmChunk> early_init_segments_;
+
+  // Dynamic DASH manifest update period in milliseconds, and the time of the
+  // last manifest write. Used only by |EncoderThread()|.
+  int64 manifest_update_period_;
+  std::chrono::steady_clock::time_point last_manifest_time_;
+
+  // Index of the DASH segment files in |config_.dash_dir|. NULL when
+  // |config_.dash_window| is 0. Used with |retention_mutex_| held, since
+  // the chunks of the muxers are written from several threads.
+  std::unique_ptr<SegmentRetention> segment_retention_;
+  std::mutex retention_mutex_;
+
+  // In-memory DASH origin. Receives the MPD and each DASH chunk alongside
+  // |dash_file_sink_|. NULL when |config_.dash_server.port| is 0.
+  std::unique_ptr<DashOriginServer> dash_server_;
+
+  // Memory-mapped DASH chunk ring. Receives each DASH chunk alongside
+  // |file_writer_|. NULL when the ring is disabled.
+  std::unique_ptr<SegmentRingWriter> segment_ring_;
+
+  // Places DASH audio segment boundaries at the video ones. NULL unless
+  // |config_.align_segments| is set.
+  std::unique_ptr<SegmentAligner> segment_aligner_;
+
+  // Segment byte budget control of the primary video stream. NULL unless
+  // |config_.segment_rate.enabled|. Updated by the thread muxing video,
+  // which passes its bitrates to the video encoder through
+  // |segment_video_bitrate_|.
+  std::unique_ptr<SegmentRateController> segment_rate_;
+
+  // Segment schedule of every muxer and video encoder, and the judge of
+  // muxed stream upload times. NULL unless |config_.adaptive_segments| is
+  // enabled.
+  std::unique_ptr<SegmentDurationController> segment_durations_;
+
+  // Seekable recording of the encoded streams, fed by |MuxAudioBuffer()|,
+  // |MuxAudioBuffers()| and |MuxVideoFrame()|. NULL when
+  // |config_.archive_file| is empty, or after an archive write fails.
+  std::unique_ptr<WebmArchiveWriter> archive_;
+
   // Timestamp adjustment value. Expressed in milliseconds. Used to change
   // input buffer timestamps when a stream starts with a timestamp less than 0.
   int64 timestamp_offset_;
+
+  // Timestamp of the frame most recently committed to |video_pool_|. Written
+  // by the capture thread.
+  std::atomic<int64> newest_video_timestamp_;
+
+  // Video frame drop counters. |frames_captured_| and |queue_full_drops_| are
+  // written by the capture thread, the others by the video encoding thread.
+  std::atomic<int64> frames_captured_;
+  std::atomic<int64> queue_full_drops_;
+  std::atomic<int64> stale_drops_;
+  std::atomic<int64> encoder_drops_;
+
+  // True once |PassThroughVideoFrame()| has passed a keyframe.
+  bool passthrough_keyframe_seen_;
+
+  // |WebmEncoderConfig::adaptive_resolution| state, owned by the video
+  // encoding thread: the level, frames read at that level, and the scaled
+  // frame passed to |video_encoder_| with its I420 source when frames are
+  // NV12. The counters are read by |GetVideoDropStats()| and
+  // |GetEncodeStats()|.
+  std::atomic<int> degradation_level_;
+  int64 degradation_frames_;
+  VideoFrame degraded_frame_;
+  VideoFrame degraded_i420_frame_;
+  std::atomic<int64> degradation_drops_;
+  std::atomic<int64> degradation_changes_;
+
+  // Capture timestamp regulators, used by the capture callbacks when
+  // |config_.regulate_timestamps| is set.
+  TimestampRegulator video_regulator_;
+  TimestampRegulator audio_regulator_;
+
+  // Output frame rate converter, used by the video capture callback when
+  // |config_.output_frame_rate| is set.
+  FrameRateConverter frame_rate_converter_;
+
+  // Encoder output counters. The encode counters are written by the thread
+  // encoding each stream, and the byte counters by |EncoderThread()|.
+  std::atomic<int64> video_frames_encoded_;
+  std::atomic<int64> video_encode_us_;
+  std::atomic<int64> video_bytes_;
+  std::atomic<int64> audio_buffers_encoded_;
+  std::atomic<int64> audio_encode_us_;
+  std::atomic<int64> audio_bytes_;
+
+  // Set by |EncoderThread()| when it exits.
+  std::atomic<bool> finished_;
+
+  // Bitrates requested by |SetTargetBitrate()| and not yet applied, in
+  // kilobits. 0 when no change is pending.
+  std::atomic<int> requested_video_bitrate_;
+
+  // Configured video bitrate, in kilobits, written by the encoder thread
+  // when a bitrate change is applied, and the bitrate |segment_rate_| asks
+  // for, or 0 when none is pending.
+  std::atomic<int> video_base_bitrate_;
+  std::atomic<int> segment_video_bitrate_;
+  std::atomic<int> requested_audio_bitrate_;
+
+  // Primary video stream speed and keyframe interval requested by
+  // |Reconfigure()| and not yet applied, or
+  // |EncoderReconfiguration::kUnchanged|.
+  std::atomic<int> requested_video_speed_;
+  std::atomic<int> requested_keyframe_interval_;
+
+  // Start of the next segment of the primary video stream, see
+  // |RequestSegmentKeyframe()|. Owned by the thread encoding video.
+  int64 next_segment_time_;
+
+  // Bitrate changes applied. Protected by |mutex_|.
+  std::vector<BitrateChange> bitrate_changes_;
+
+  // Start of |Init()|, and the |StartupStats| phases measured from it. The
+  // first sample phases are recorded by the capture threads.
+  std::chrono::steady_clock::time_point startup_time_;
+  std::atomic<int64> device_open_ms_;
+  std::atomic<int64> graph_run_ms_;
+  std::atomic<int64> first_audio_ms_;
+  std::atomic<int64> first_video_ms_;
+  std::atomic<int64> first_chunk_ms_;
+
+  // Muxed stream chunks waiting for |ptr_data_sink_|. Owned by
+  // |EncoderThread()|.
+  std::deque<SinkChunk> sink_queue_;
+
+  // Overflow of |sink_queue_| with |WebmEncoderConfig::kSinkSpill|. Owned by
+  // |EncoderThread()|.
+  std::unique_ptr<SinkSpillFile> sink_spill_;
+
+  // Manifest waiting for |ptr_data_sink_|, and the hash of the last manifest
+  // queued; |manifest_hash_| is valid once |manifest_queued_| is set. Owned
+  // by |EncoderThread()|.
+  SharedWebmChunk pending_manifest_;
+  size_t manifest_hash_;
+  bool manifest_queued_;
+
+  // Thumbnail waiting for |ptr_data_sink_|. Owned by |EncoderThread()|.
+  SharedWebmChunk pending_thumbnail_;
+
+  // True between |BeginStream()| and |EndStream()| calls on |ptr_data_sink_|
+  // for a muxed stream chunk. Owned by |EncoderThread()|.
+  bool muxed_stream_open_;
+
+  // True while |WebmEncoderConfig::kSinkDropVideo| leaves video out of
+  // |ptr_muxer_|. Owned by |EncoderThread()|.
+  bool drop_muxed_video_;
+
+  // Set while |ptr_data_sink_| is not ready and chunks are waiting, and the
+  // time blocking was last accounted in |sink_stats_|. Owned by
+  // |EncoderThread()|.
+  bool sink_blocked_;
+  std::chrono::steady_clock::time_point sink_blocked_time_;
+
+  // Muxed stream backpressure counters. Written by |EncoderThread()|, and by
+  // |OnChunkComplete()|, under |mutex_|.
+  SinkStats sink_stats_;
+
+  // Credit of |async_sink_|, and whether it failed a chunk, and the signal
+  // of its completions. Protected by |mutex_|.
+  int sink_credit_;
+  bool sink_failed_;
+  std::condition_variable sink_completed_;
+
+  // Time each chunk with a duration was submitted to |async_sink_|, while
+  // |segment_durations_| measures uploads. Protected by |mutex_|.
+  std::map<const WebmChunk*, std::chrono::steady_clock::time_point>
+      upload_start_times_;
+
+  // Writer of |ptr_data_sink_| with |config_.async_sink|; declared last so
+  // that its thread stops before the members |OnChunkComplete()| uses go.
+  std::unique_ptr<AsyncSinkAdapter> async_sink_;
   WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(WebmEncoder);
 };
 
@@ -0,0 +1,230 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/webm_encryptor.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <bcrypt.h>
+#endif
+
+#include "glog/logging.h"
+
+namespace webmlive {
+
+namespace {
+
+// AES block size, and the length of the IV and of the block counter that
+// make up a counter block.
+const int kAesBlockSize = 16;
+const int kIvSize = 8;
+
+// First byte of an encrypted block.
+const uint8 kEncryptedSignal = 0x01;
+
+// Writes |value| to |ptr_out| as an 8 byte big endian integer.
+void WriteUint64BigEndian(uint64 value, uint8* ptr_out) {
+  for (int i = 7; i >= 0; --i) {
+    ptr_out[i] = static_cast<uint8>(value & 0xff);
+    value >>= 8;
+  }
+}
+
+int HexDigitValue(char digit) {
+  if (digit >= '0' && digit <= '9') return digit - '0';
+  if (digit >= 'a' && digit <= 'f') return digit - 'a' + 10;
+  if (digit >= 'A' && digit <= 'F') return digit - 'A' + 10;
+  return -1;
+}
+
+}  // namespace
+
+const int EncryptionSettings::kKeySize;
+
+bool ParseHexBytes(const std::string& hex, std::string* ptr_bytes) {
+  if (!ptr_bytes || hex.empty() || hex.length() % 2 != 0) {
+    return false;
+  }
+  std::string bytes;
+  bytes.reserve(hex.length() / 2);
+  for (size_t i = 0; i < hex.length(); i += 2) {
+    const int high = HexDigitValue(hex[i]);
+    const int low = HexDigitValue(hex[i + 1]);
+    if (high < 0 || low < 0) {
+      return false;
+    }
+    bytes += static_cast<char>(high << 4 | low);
+  }
+  ptr_bytes->swap(bytes);
+  return true;
+}
+
+WebmEncryptor::WebmEncryptor()
+    : algorithm_(NULL), key_handle_(NULL), next_iv_(0) {
+}
+
+WebmEncryptor::~WebmEncryptor() {
+#ifdef _WIN32
+  if (key_handle_) {
+    BCryptDestroyKey(key_handle_);
+  }
+  if (algorithm_) {
+    BCryptCloseAlgorithmProvider(algorithm_, 0);
+  }
+#endif
+}
+
+int WebmEncryptor::Init(const EncryptionSettings& settings) {
+  if (settings.key.length() != EncryptionSettings::kKeySize ||
+      settings.key_id.empty()) {
+    LOG(ERROR) << "encryption needs a key id and a "
+               << EncryptionSettings::kKeySize << " byte key.";
+    return kInvalidArg;
+  }
+#ifdef _WIN32
+  BCRYPT_ALG_HANDLE algorithm = NULL;
+  NTSTATUS status =
+      BCryptOpenAlgorithmProvider(&algorithm, BCRYPT_AES_ALGORITHM, NULL, 0);
+  if (!BCRYPT_SUCCESS(status)) {
+    LOG(ERROR) << "cannot open the AES provider: " << std::hex << status;
+    return kCryptoError;
+  }
+  algorithm_ = algorithm;
+
+  // Counter mode is ECB over the counter blocks.
+  status = BCryptSetProperty(
+      algorithm, BCRYPT_CHAINING_MODE,
+      reinterpret_cast<PUCHAR>(const_cast<wchar_t*>(BCRYPT_CHAIN_MODE_ECB)),
+      sizeof(BCRYPT_CHAIN_MODE_ECB), 0);
+  if (!BCRYPT_SUCCESS(status)) {
+    LOG(ERROR) << "cannot set AES ECB mode: " << std::hex << status;
+    return kCryptoError;
+  }
+#else
+  LOG(ERROR) << "WebM encryption requires the Windows CNG AES provider.";
+  return kUnsupported;
+#endif
+  key_id_ = settings.key_id;
+  if (!SetKey(settings.key)) {
+    return kCryptoError;
+  }
+  return kSuccess;
+}
+
+bool WebmEncryptor::Encrypt(const uint8* ptr_data, int32 length,
+                            const uint8** ptr_block,
+                            int32* ptr_block_length) {
+  if (!key_handle_ || !ptr_data || length <= 0 || !ptr_block ||
+      !ptr_block_length) {
+    return false;
+  }
+  const int32 num_counters = (length + kAesBlockSize - 1) / kAesBlockSize;
+  const int32 keystream_length = num_counters * kAesBlockSize;
+  block_.resize(kBlockHeaderSize + keystream_length);
+  const uint64 iv = next_iv_++;
+  block_[0] = kEncryptedSignal;
+  WriteUint64BigEndian(iv, &block_[1]);
+
+  // The keystream is built in the block itself, after the header.
+  uint8* const ptr_keystream = &block_[kBlockHeaderSize];
+  for (int32 i = 0; i < num_counters; ++i) {
+    uint8* const ptr_counter = ptr_keystream + i * kAesBlockSize;
+    WriteUint64BigEndian(iv, ptr_counter);
+    WriteUint64BigEndian(static_cast<uint64>(i), ptr_counter + kIvSize);
+  }
+#ifdef _WIN32
+  ULONG encrypted_length = 0;
+  const NTSTATUS status =
+      BCryptEncrypt(key_handle_, ptr_keystream, keystream_length, NULL, NULL,
+                    0, ptr_keystream, keystream_length, &encrypted_length, 0);
+  if (!BCRYPT_SUCCESS(status) ||
+      encrypted_length != static_cast<ULONG>(keystream_length)) {
+    LOG(ERROR) << "AES encryption failed: " << std::hex << status;
+    return false;
+  }
+#endif
+  for (int32 i = 0; i < length; ++i) {
+    ptr_keystream[i] ^= ptr_data[i];
+  }
+  *ptr_block = &block_[0];
+  *ptr_block_length = kBlockHeaderSize + length;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++stats_.blocks_encrypted;
+  stats_.bytes_encrypted += length;
+  return true;
+}
+
+bool WebmEncryptor::QueueKey(const std::string& key) {
+  if (key.length() != EncryptionSettings::kKeySize) {
+    LOG(ERROR) << "encryption keys are " << EncryptionSettings::kKeySize
+               << " bytes.";
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  queued_key_ = key;
+  return true;
+}
+
+bool WebmEncryptor::StartSegment() {
+  std::string key;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (queued_key_.empty()) {
+      return true;
+    }
+    key.swap(queued_key_);
+  }
+  if (!SetKey(key)) {
+    return false;
+  }
+  VLOG(1) << "encryption key rotated.";
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++stats_.key_rotations;
+  return true;
+}
+
+void WebmEncryptor::GetStats(EncryptionStats* ptr_stats) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  *ptr_stats = stats_;
+}
+
+bool WebmEncryptor::SetKey(const std::string& key) {
+#ifdef _WIN32
+  BCRYPT_KEY_HANDLE key_handle = NULL;
+  NTSTATUS status = BCryptGenerateSymmetricKey(
+      algorithm_, &key_handle, NULL, 0,
+      reinterpret_cast<PUCHAR>(const_cast<char*>(key.data())),
+      static_cast<ULONG>(key.length()), 0);
+  if (!BCRYPT_SUCCESS(status)) {
+    LOG(ERROR) << "cannot set the AES key: " << std::hex << status;
+    return false;
+  }
+
+  // A new key restarts the IVs at a random value.
+  uint64 iv = 0;
+  status = BCryptGenRandom(NULL, reinterpret_cast<PUCHAR>(&iv), sizeof(iv),
+                           BCRYPT_USE_SYSTEM_PREFERRED_RNG);
+  if (!BCRYPT_SUCCESS(status)) {
+    LOG(ERROR) << "cannot draw an IV: " << std::hex << status;
+    BCryptDestroyKey(key_handle);
+    return false;
+  }
+  if (key_handle_) {
+    BCryptDestroyKey(key_handle_);
+  }
+  key_handle_ = key_handle;
+  next_iv_ = iv;
+  return true;
+#else
+  (void)key;
+  LOG(ERROR) << "WebM encryption is not supported on this platform.";
+  return false;
+#endif
+}
+
+}  // namespace webmlive
@@ -0,0 +1,133 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_WEBM_ENCRYPTOR_H_
+#define WEBMLIVE_ENCODER_WEBM_ENCRYPTOR_H_
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+
+namespace webmlive {
+
+// Stores the bytes of |hex|, an even number of hex digits, in |ptr_bytes|.
+// Returns false when |hex| is not valid.
+bool ParseHexBytes(const std::string& hex, std::string* ptr_bytes);
+
+struct EncryptionSettings {
+  // Length of an AES-128 key, in bytes.
+  static const int kKeySize = 16;
+
+  EncryptionSettings() : enabled(false) {}
+
+  // Encrypt the audio and video blocks of the muxer outputs.
+  bool enabled;
+
+  // ContentEncKeyID written to the encrypted tracks, which players pass to
+  // the license server, and the initial AES-128 content key. Raw bytes.
+  std::string key_id;
+  std::string key;
+};
+
+struct EncryptionStats {
+  EncryptionStats() : blocks_encrypted(0), bytes_encrypted(0),
+                      key_rotations(0) {}
+
+  // Blocks encrypted, and their payload bytes.
+  int64 blocks_encrypted;
+  int64 bytes_encrypted;
+
+  // Keys queued by |WebmEncryptor::QueueKey()| and put in use.
+  int64 key_rotations;
+};
+
+// Encrypts WebM blocks as the WebM Encryption specification describes for
+// ContentEncAlgo 5 (AES) with AESSettingsCipherMode 1 (CTR): each block is
+// the signal byte 0x01, an 8 byte IV, and the frame encrypted with AES-128 in
+// counter mode, the counter block being the IV followed by an 8 byte block
+// counter starting at 0. IVs count up from a random value, and each new key
+// draws a new one.
+//
+// AES runs through the Windows CNG provider, which uses AES-NI where the CPU
+// has it. The counter blocks of a frame are written to the output buffer and
+// encrypted in place in one call, then the frame is XORed into the
+// keystream, so a block is encrypted in one pass over one buffer.
+//
+// Keys rotate at segment boundaries: a key queued by |QueueKey()| from any
+// thread is used from the next |StartSegment()| on. The key id written in
+// the track headers does not change.
+//
+// Notes:
+// - |Init()| must be called before any other method.
+// - |Encrypt()| and |StartSegment()| must be called from one thread.
+class WebmEncryptor {
+ public:
+  // Bytes added to each block: the signal byte and the IV.
+  static const int kBlockHeaderSize = 9;
+
+  enum {
+    kUnsupported = -3,
+    kCryptoError = -2,
+    kInvalidArg = -1,
+    kSuccess = 0,
+  };
+
+  WebmEncryptor();
+  ~WebmEncryptor();
+
+  // Opens the AES provider and sets |settings.key| as the content key.
+  // Returns |kInvalidArg| when the key is not |EncryptionSettings::kKeySize|
+  // bytes or there is no key id, |kUnsupported| when the platform has no AES
+  // provider, and |kCryptoError| when the provider fails.
+  int Init(const EncryptionSettings& settings);
+
+  // Encrypts the |length| bytes at |ptr_data| into a buffer owned by the
+  // encryptor. On success stores the block, which is valid until the next
+  // call, in |ptr_block| and |ptr_block_length|, and returns true.
+  bool Encrypt(const uint8* ptr_data, int32 length, const uint8** ptr_block,
+               int32* ptr_block_length);
+
+  // Queues |key| for the next segment. Returns false when |key| is not
+  // |EncryptionSettings::kKeySize| bytes. Thread safe.
+  bool QueueKey(const std::string& key);
+
+  // Puts the queued key in use, when there is one. Returns false when the
+  // provider rejects the key, which leaves the current key in use.
+  bool StartSegment();
+
+  // Copies the counters to |ptr_stats|. Thread safe.
+  void GetStats(EncryptionStats* ptr_stats) const;
+
+  const std::string& key_id() const { return key_id_; }
+
+ private:
+  // Replaces the content key with |key| and draws a new IV.
+  bool SetKey(const std::string& key);
+
+  // Opaque CNG algorithm and key handles.
+  void* algorithm_;
+  void* key_handle_;
+  std::string key_id_;
+
+  // Counter of the next IV, and the block being written.
+  uint64 next_iv_;
+  std::vector<uint8> block_;
+
+  // Key waiting for |StartSegment()|, and the counters. Protected by
+  // |mutex_|.
+  std::string queued_key_;
+  EncryptionStats stats_;
+  mutable std::mutex mutex_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(WebmEncryptor);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_WEBM_ENCRYPTOR_H_
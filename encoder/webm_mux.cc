@@ -8,15 +8,100 @@
 
 #include "encoder/webm_mux.h"
 
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
 #include <new>
+#include <sstream>
+#include <utility>
 #include <vector>
 
+#include "encoder/init_segment_cache.h"
+#include "encoder/log_util.h"
+#include "encoder/memory_accounting.h"
+#include "encoder/segment_duration_controller.h"
+#include "encoder/webm_splice_clip.h"
 #include "glog/logging.h"
 #include "libwebm/mkvmuxer.hpp"
+#include "libwebm/mkvmuxerutil.hpp"
 #include "libwebm/webmids.hpp"
 
 namespace {
 const int kAutoAssignTrackNum = 0;
+
+// Matroska TrackType of subtitle tracks, and the WebVTT CodecIDs of the
+// WebM text track kinds.
+const uint64 kSubtitleTrackType = 0x11;
+const char kWebVttSubtitlesCodecId[] = "D_WEBVTT/SUBTITLES";
+const char kWebVttCaptionsCodecId[] = "D_WEBVTT/CAPTIONS";
+
+// Chunk buffers allocated by |ReserveChunkSize()|: one for the chunk after
+// the open one, and one held by the writer or a data sink.
+const size_t kPrefilledChunkBuffers = 2;
+
+// 64 bit FNV-1a parameters.
+const uint64 kFnvOffsetBasis = 14695981039346656037ULL;
+const uint64 kFnvPrime = 1099511628211ULL;
+
+// Returns the FNV-1a hash of |length| bytes at |ptr_data|, continued from
+// |hash|.
+uint64 HashBytes(const uint8* ptr_data, size_t length, uint64 hash) {
+  for (size_t i = 0; i < length; ++i) {
+    hash = (hash ^ ptr_data[i]) * kFnvPrime;
+  }
+  return hash;
+}
+
+// Returns a track UID for the track described by |config_key|. libwebm picks
+// random UIDs, which would make every metadata chunk unique. UIDs are kept to
+// 56 bits, as libwebm's are, and are never 0.
+uint64 TrackUid(const std::string& config_key) {
+  const uint64 uid =
+      HashBytes(reinterpret_cast<const uint8*>(config_key.data()),
+                config_key.length(), kFnvOffsetBasis) &
+      0x00FFFFFFFFFFFFFFULL;
+  return uid ? uid : 1;
+}
+
+bool HasTrack(const std::vector<uint64>& tracks, uint64 track) {
+  return std::find(tracks.begin(), tracks.end(), track) != tracks.end();
+}
+// Returns the |MuxerStats::cluster_size_counts| bucket of a cluster of
+// |size| bytes.
+int ClusterSizeBucket(int64 size) {
+  int bucket = 0;
+  int64 bound = webmlive::MuxerStats::kFirstClusterSizeBound;
+  while (bucket < webmlive::MuxerStats::kClusterSizeBuckets - 1 &&
+         size >= bound) {
+    ++bucket;
+    bound <<= 2;
+  }
+  return bucket;
+}
+
+// Returns true for the elements libwebm writes outside clusters at the top
+// level of the file or segment.
+bool IsTopLevelElement(uint64 element_id) {
+  switch (element_id) {
+    case mkvmuxer::kMkvEBML:
+    case mkvmuxer::kMkvSegment:
+    case mkvmuxer::kMkvSeekHead:
+    case mkvmuxer::kMkvInfo:
+    case mkvmuxer::kMkvTracks:
+    case mkvmuxer::kMkvCues:
+    case mkvmuxer::kMkvChapters:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Returns a config key for the key id |key_id|.
+uint64 EncryptionKey(const std::string& key_id) {
+  return HashBytes(reinterpret_cast<const uint8*>(key_id.data()),
+                   key_id.length(), kFnvOffsetBasis);
+}
+
 }  // namespace
 
 namespace webmlive {
@@ -26,8 +111,190 @@ T milliseconds_to_timecode_ticks(T milliseconds) {
   return milliseconds * LiveWebmMuxer::kTimecodeScale;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// MuxerWriteBuffer
+//
+
+MuxerWriteBuffer::MuxerWriteBuffer()
+    : reserve_size_(0),
+      bytes_buffered_(0),
+      bytes_accounted_(0),
+      bytes_written_(0),
+      chunks_closed_(0),
+      read_latency_us_(0),
+      max_read_latency_us_(0),
+      streaming_(false),
+      stream_chunk_(0),
+      stream_pos_(0) {
+}
+
+MuxerWriteBuffer::~MuxerWriteBuffer() {
+  bytes_buffered_ = 0;
+  UpdateMemoryAccounting();
+}
+
+void MuxerWriteBuffer::SetPool(const SharedWebmChunkDataPool& pool) {
+  pool_ = pool;
+  if (pool_ && open_chunk_.data.empty()) {
+    pool_->Acquire(reserve_size_, &open_chunk_.data);
+  }
+}
+
+void MuxerWriteBuffer::ReserveOpenBlock(size_t capacity) {
+  reserve_size_ = capacity;
+  Block& block = open_chunk_.data;
+  const size_t length = block.size();
+  block.reserve(WebmChunkDataPool::ClassCapacity(capacity));
+  block.resize(std::max(length, block.capacity()));
+  block.resize(length);
+}
+
+void MuxerWriteBuffer::Write(const uint8* ptr_data, int32 length) {
+  Block& block = open_chunk_.data;
+  block.insert(block.end(), ptr_data, ptr_data + length);
+  bytes_buffered_ += length;
+  bytes_written_ += length;
+}
+
+void MuxerWriteBuffer::NoteFrame(int64 timestamp, bool keyframe) {
+  UpdateMemoryAccounting();
+  ChunkInfo& info = open_chunk_.info;
+  if (!info.has_frames) {
+    info.timestamp = timestamp;
+    info.keyframe = keyframe;
+    info.has_frames = true;
+  }
+  info.last_timestamp = std::max(info.last_timestamp, timestamp);
+  info.end_timestamp = info.last_timestamp;
+  ++info.block_count;
+}
+
+void MuxerWriteBuffer::NoteBlockStart() {
+  ChunkInfo& info = open_chunk_.info;
+  if (info.first_block_offset < 0) {
+    info.first_block_offset = static_cast<int32>(open_chunk_.data.size());
+  }
+}
+
+void MuxerWriteBuffer::CloseChunk() {
+  if (open_chunk_.data.empty()) {
+    return;
+  }
+  ++chunks_closed_;
+  chunks_.push_back(Chunk());
+  chunks_.back().data.swap(open_chunk_.data);
+  chunks_.back().info = open_chunk_.info;
+  chunks_.back().info.close_time = std::chrono::steady_clock::now();
+  open_chunk_.info = ChunkInfo();
+  open_chunk_.info.offset = bytes_written_;
+  if (pool_) {
+    pool_->Acquire(reserve_size_, &open_chunk_.data);
+  }
+  UpdateMemoryAccounting();
+}
+
+bool MuxerWriteBuffer::ChunkReady(int32* ptr_chunk_length) const {
+  // In streaming mode the oldest chunk is ready once it has been streamed.
+  if (chunks_.empty() || (streaming_ && stream_chunk_ == 0)) {
+    return false;
+  }
+  *ptr_chunk_length = static_cast<int32>(chunks_.front().data.size());
+  return true;
+}
+
+bool MuxerWriteBuffer::ReadChunk(int32 buffer_capacity, uint8* ptr_buf) {
+  int32 chunk_length = 0;
+  if (!ChunkReady(&chunk_length) || buffer_capacity < chunk_length) {
+    return false;
+  }
+  Block& chunk = chunks_.front().data;
+  memcpy(ptr_buf, &chunk[0], chunk_length);
+  NoteChunkRead(chunks_.front().info);
+  bytes_buffered_ -= chunk_length;
+  UpdateMemoryAccounting();
+  RecycleBlock(&chunk);
+  chunks_.pop_front();
+  if (streaming_) {
+    --stream_chunk_;
+  }
+  return true;
+}
+
+bool MuxerWriteBuffer::DetachChunk(Block* ptr_block, ChunkInfo* ptr_info) {
+  int32 chunk_length = 0;
+  if (!ChunkReady(&chunk_length)) {
+    return false;
+  }
+  Block& chunk = chunks_.front().data;
+  bytes_buffered_ -= chunk_length;
+  UpdateMemoryAccounting();
+  ptr_block->swap(chunk);
+  *ptr_info = chunks_.front().info;
+  NoteChunkRead(*ptr_info);
+  const ChunkInfo& next_info =
+      chunks_.size() > 1 ? chunks_[1].info : open_chunk_.info;
+  if (ptr_info->has_frames && next_info.has_frames &&
+      next_info.timestamp > ptr_info->end_timestamp) {
+    ptr_info->end_timestamp = next_info.timestamp;
+  }
+  RecycleBlock(&chunk);
+  chunks_.pop_front();
+  if (streaming_) {
+    --stream_chunk_;
+  }
+  return true;
+}
+
+bool MuxerWriteBuffer::ReadStreamData(StreamData* ptr_data) {
+  if (!streaming_) {
+    return false;
+  }
+  // A closed chunk is streamed to its end. |CloseChunk()| moves
+  // |open_chunk_| to the back of |chunks_|, so |stream_chunk_| and
+  // |stream_pos_| stay valid when the chunk being streamed is closed.
+  const bool chunk_end = stream_chunk_ < chunks_.size();
+  const Block& block =
+      chunk_end ? chunks_[stream_chunk_].data : open_chunk_.data;
+  if (block.size() == stream_pos_ && !chunk_end) {
+    return false;
+  }
+  ptr_data->ptr_data = block.empty() ? NULL : &block[0] + stream_pos_;
+  ptr_data->length = static_cast<int32>(block.size() - stream_pos_);
+  ptr_data->chunk_start = (stream_pos_ == 0);
+  ptr_data->chunk_end = chunk_end;
+  if (chunk_end) {
+    ++stream_chunk_;
+    stream_pos_ = 0;
+  } else {
+    stream_pos_ = block.size();
+  }
+  return true;
+}
+
+void MuxerWriteBuffer::UpdateMemoryAccounting() {
+  if (bytes_buffered_ != bytes_accounted_) {
+    MemoryAccountant::Instance()->Add(kMemoryMuxer,
+                                      bytes_buffered_ - bytes_accounted_);
+    bytes_accounted_ = bytes_buffered_;
+  }
+}
+
+void MuxerWriteBuffer::RecycleBlock(Block* ptr_block) {
+  if (pool_) {
+    pool_->Release(ptr_block);
+  }
+}
+
+void MuxerWriteBuffer::NoteChunkRead(const ChunkInfo& info) {
+  const int64 latency_us =
+      std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - info.close_time).count();
+  read_latency_us_ += latency_us;
+  max_read_latency_us_ = std::max(max_read_latency_us_, latency_us);
+}
+
 // Buffer object implementing libwebm's IMkvWriter interface. Constructed from
-// user's |WebmChunkBuffer| to store data written by libwebm.
+// user's |MuxerWriteBuffer| to store data written by libwebm.
 class WebmMuxWriter : public mkvmuxer::IMkvWriter {
  public:
   enum {
@@ -45,11 +312,10 @@ class WebmMuxWriter : public mkvmuxer::IMkvWriter {
 
   // Accessors.
   int64 bytes_written() const { return bytes_written_; }
-  int64 chunk_end() const { return chunk_end_; }
 
-  // Erases chunk from |ptr_write_buffer_|, resets |chunk_end_| to 0, and
-  // updates |bytes_buffered_|.
-  void EraseChunk();
+  // Returns the byte, cluster and block counts of |MuxerStats|, with all
+  // bytes of block elements in |block_header_bytes|.
+  const MuxerStats& stats() const { return stats_; }
 
   // mkvmuxer::IMkvWriter methods
   // Returns total bytes of data passed to |Write|.
@@ -59,29 +325,49 @@ class WebmMuxWriter : public mkvmuxer::IMkvWriter {
   virtual int32 Position(int64) { return kNotImplemented; }  // NOLINT
 
   // Always returns false: |WebmMuxWriter| is never seekable. Written data
-  // goes into a vector, and data is buffered only until a chunk is completed.
+  // goes into a |MuxerWriteBuffer|, and data is buffered only until a chunk is
+  // read.
   virtual bool Seekable() const { return false; }
 
   // Writes |ptr_buffer| contents to |ptr_write_buffer_|.
   virtual int32 Write(const void* ptr_buffer, uint32 buffer_length);
 
-  // Called by libwebm, and notifies writer of element start position.
+  // Called by libwebm, and notifies writer of element start position. Closes
+  // the current chunk in |ptr_write_buffer_| when a cluster starts.
   virtual void ElementStartNotify(uint64 element_id, int64 position);
 
  private:
-  int64 bytes_buffered_;
+  // Element types counted by |Write()|.
+  enum ElementType {
+    kMetadataElement,
+    kClusterHeaderElement,
+    kBlockElement,
+  };
+
+  // Records the cluster open until |position|, if any.
+  void EndCluster(int64 position);
+
   int64 bytes_written_;
-  int64 chunk_end_;
   LiveWebmMuxer::WriteBuffer* ptr_write_buffer_;
   std::string id_;
+
+  // Type of the element being written, and the start position and block
+  // count of the open cluster.
+  ElementType element_type_;
+  bool in_cluster_;
+  int64 cluster_start_;
+  int64 cluster_blocks_;
+  MuxerStats stats_;
   WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(WebmMuxWriter);
 };
 
 WebmMuxWriter::WebmMuxWriter()
-    : bytes_buffered_(0),
-      bytes_written_(0),
-      chunk_end_(0),
-      ptr_write_buffer_(NULL) {
+    : bytes_written_(0),
+      ptr_write_buffer_(NULL),
+      element_type_(kMetadataElement),
+      in_cluster_(false),
+      cluster_start_(0),
+      cluster_blocks_(0) {
 }
 
 WebmMuxWriter::~WebmMuxWriter() {
@@ -98,16 +384,6 @@ int32 WebmMuxWriter::Init(LiveWebmMuxer::WriteBuffer* ptr_write_buffer,
   return kSuccess;
 }
 
-void WebmMuxWriter::EraseChunk() {
-  if (ptr_write_buffer_) {
-    LiveWebmMuxer::WriteBuffer::iterator erase_end_pos =
-        ptr_write_buffer_->begin() + static_cast<int32>(chunk_end_);
-    ptr_write_buffer_->erase(ptr_write_buffer_->begin(), erase_end_pos);
-    bytes_buffered_ = ptr_write_buffer_->size();
-    chunk_end_ = 0;
-  }
-}
-
 int32 WebmMuxWriter::Write(const void* ptr_buffer, uint32 buffer_length) {
   if (!ptr_write_buffer_) {
     LOG(ERROR) << "Cannot Write, not Initialized.";
@@ -118,23 +394,99 @@ int32 WebmMuxWriter::Write(const void* ptr_buffer, uint32 buffer_length) {
     return kInvalidArg;
   }
   const uint8* ptr_data = reinterpret_cast<const uint8*>(ptr_buffer);
-  ptr_write_buffer_->insert(ptr_write_buffer_->end(),
-                            ptr_data,
-                            ptr_data + buffer_length);
+  ptr_write_buffer_->Write(ptr_data, buffer_length);
   bytes_written_ += buffer_length;
-  bytes_buffered_ = ptr_write_buffer_->size();
+  switch (element_type_) {
+    case kMetadataElement:
+      stats_.metadata_bytes += buffer_length;
+      break;
+    case kClusterHeaderElement:
+      stats_.cluster_header_bytes += buffer_length;
+      break;
+    case kBlockElement:
+      stats_.block_header_bytes += buffer_length;
+      break;
+  }
   return kSuccess;
 }
 
+// libwebm notifies the start of every element it writes, children included,
+// so the elements of a BlockGroup count as block bytes.
 void WebmMuxWriter::ElementStartNotify(uint64 element_id, int64 position) {
   if (element_id == mkvmuxer::kMkvCluster) {
-    chunk_end_ = bytes_buffered_;
+    EndCluster(position);
+    in_cluster_ = true;
+    cluster_start_ = position;
+    element_type_ = kClusterHeaderElement;
+    ptr_write_buffer_->CloseChunk();
     if (id_ == "video") {
-      LOG(INFO) << "video chunk_end_=" << chunk_end_<< " position=" << position;
+      LOG(INFO) << "video chunk closed, position=" << position;
     }
+  } else if (IsTopLevelElement(element_id)) {
+    EndCluster(position);
+    in_cluster_ = false;
+    element_type_ = kMetadataElement;
+  } else if (in_cluster_) {
+    if (element_id == mkvmuxer::kMkvSimpleBlock ||
+        element_id == mkvmuxer::kMkvBlockGroup) {
+      element_type_ = kBlockElement;
+      ptr_write_buffer_->NoteBlockStart();
+      ++cluster_blocks_;
+      ++stats_.blocks;
+    } else if (element_id == mkvmuxer::kMkvTimecode ||
+               element_id == mkvmuxer::kMkvPrevSize) {
+      element_type_ = kClusterHeaderElement;
+    }
+  }
+}
+
+void WebmMuxWriter::EndCluster(int64 position) {
+  if (!in_cluster_ || position <= cluster_start_) {
+    return;
   }
+  const int64 cluster_bytes = position - cluster_start_;
+  stats_.min_cluster_bytes = stats_.clusters == 0 ?
+      cluster_bytes : std::min(stats_.min_cluster_bytes, cluster_bytes);
+  stats_.max_cluster_bytes = std::max(stats_.max_cluster_bytes,
+                                      cluster_bytes);
+  stats_.cluster_bytes += cluster_bytes;
+  ++stats_.cluster_size_counts[ClusterSizeBucket(cluster_bytes)];
+  ++stats_.clusters;
+  stats_.max_cluster_blocks = std::max(stats_.max_cluster_blocks,
+                                       cluster_blocks_);
+  cluster_blocks_ = 0;
+  in_cluster_ = false;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// InitSegmentWriter
+//
+
+// |mkvmuxer::IMkvWriter| that collects the metadata elements written by
+// |LiveWebmMuxer::WriteInitSegment()| in memory.
+class InitSegmentWriter : public mkvmuxer::IMkvWriter {
+ public:
+  InitSegmentWriter() {}
+  virtual ~InitSegmentWriter() {}
+
+  WebmChunk::Data* data() { return &data_; }
+
+  // mkvmuxer::IMkvWriter methods
+  virtual int64 Position() const { return static_cast<int64>(data_.size()); }
+  virtual int32 Position(int64) { return -1; }  // NOLINT
+  virtual bool Seekable() const { return false; }
+  virtual int32 Write(const void* ptr_buffer, uint32 buffer_length) {
+    const uint8* ptr_data = reinterpret_cast<const uint8*>(ptr_buffer);
+    data_.insert(data_.end(), ptr_data, ptr_data + buffer_length);
+    return 0;
+  }
+  virtual void ElementStartNotify(uint64, int64) {}  // NOLINT
+
+ private:
+  WebmChunk::Data data_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(InitSegmentWriter);
+};
+
 ///////////////////////////////////////////////////////////////////////////////
 // LiveWebmMuxer
 //
@@ -143,7 +495,28 @@ LiveWebmMuxer::LiveWebmMuxer()
     : audio_track_num_(0),
       video_track_num_(0),
       muxer_time_(0),
-      chunks_read_(0) {
+      chunks_read_(0),
+      chunks_streamed_(0),
+      cluster_duration_(0),
+      next_cluster_time_(0),
+      ptr_segment_schedule_(NULL),
+      max_cluster_bytes_(0),
+      split_pending_(false),
+      clusters_split_(0),
+      splice_end_time_(0),
+      splice_audio_shift_(0),
+      splices_(0),
+      splice_dropped_frames_(0),
+      payload_bytes_(0),
+      last_audio_timestamp_(-1),
+      last_video_timestamp_(-1),
+      audio_interleave_gap_(0),
+      max_audio_interleave_gap_(0),
+      video_interleave_gap_(0),
+      max_video_interleave_gap_(0),
+      capture_times_(false),
+      temporal_layer_ids_(false),
+      ptr_init_segments_(NULL) {
 }
 
 LiveWebmMuxer::~LiveWebmMuxer() {
@@ -151,7 +524,25 @@ LiveWebmMuxer::~LiveWebmMuxer() {
 
 int LiveWebmMuxer::Init(int32 cluster_duration_milliseconds,
                         const std::string& muxer_id) {
+  return Init(cluster_duration_milliseconds, 0, muxer_id);
+}
+
+int LiveWebmMuxer::Init(int32 cluster_duration_milliseconds,
+                        int32 max_cluster_bytes,
+                        const std::string& muxer_id) {
+  if (max_cluster_bytes < 0) {
+    LOG(ERROR) << "invalid max cluster size: " << max_cluster_bytes;
+    return kInvalidArg;
+  }
   muxer_id_ = muxer_id;
+  max_cluster_bytes_ = max_cluster_bytes;
+
+  pool_.reset(new (std::nothrow) WebmChunkDataPool());  // NOLINT
+  if (!pool_) {
+    LOG(ERROR) << "cannot construct WebmChunkDataPool.";
+    return kNoMemory;
+  }
+  buffer_.SetPool(pool_);
 
   // Construct and Init |WebmMuxWriter|-- it handles writes coming from libwebm.
   ptr_writer_.reset(new (std::nothrow) WebmMuxWriter());  // NOLINT
@@ -178,6 +569,11 @@ int LiveWebmMuxer::Init(int32 cluster_duration_milliseconds,
 
   ptr_segment_->set_mode(mkvmuxer::Segment::kLive);
   if (cluster_duration_milliseconds > 0) {
+    // libwebm measures |max_cluster_duration| from the start of each cluster,
+    // which drifts away from the segment grid after each keyframe; cluster
+    // boundaries are placed by |StartClusterIfDue()|. The libwebm limit is
+    // kept as a backstop.
+    cluster_duration_ = cluster_duration_milliseconds;
     const uint64 max_cluster_duration =
         milliseconds_to_timecode_ticks(cluster_duration_milliseconds);
     ptr_segment_->set_max_cluster_duration(max_cluster_duration);
@@ -200,71 +596,136 @@ int LiveWebmMuxer::Init(int32 cluster_duration_milliseconds,
   return kSuccess;
 }
 
+int LiveWebmMuxer::EnableEncryption(const EncryptionSettings& settings) {
+  encryptor_.reset(new (std::nothrow) WebmEncryptor());  // NOLINT
+  if (!encryptor_) {
+    LOG(ERROR) << "cannot construct WebmEncryptor.";
+    return kNoMemory;
+  }
+  const int status = encryptor_->Init(settings);
+  if (status) {
+    LOG(ERROR) << "cannot Init WebmEncryptor: " << status;
+    encryptor_.reset();
+    return kEncryptionError;
+  }
+  return kSuccess;
+}
+
+bool LiveWebmMuxer::RotateEncryptionKey(const std::string& key) {
+  return encryptor_ && encryptor_->QueueKey(key);
+}
+
+int LiveWebmMuxer::GetEncryptionStats(EncryptionStats* ptr_stats) const {
+  if (!encryptor_ || !ptr_stats) {
+    return kInvalidArg;
+  }
+  encryptor_->GetStats(ptr_stats);
+  return kSuccess;
+}
+
+void LiveWebmMuxer::GetMuxerStats(MuxerStats* ptr_stats) const {
+  {
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    *ptr_stats = stats_;
+  }
+  ptr_stats->muxer_id = muxer_id_;
+}
+
+void LiveWebmMuxer::SetChunkPool(const SharedWebmChunkDataPool& pool) {
+  if (!pool) {
+    return;
+  }
+  pool_ = pool;
+  buffer_.SetPool(pool_);
+}
+
+void LiveWebmMuxer::ReserveChunkSize(int32 expected_chunk_size) {
+  if (!pool_ || expected_chunk_size <= 0) {
+    return;
+  }
+  pool_->Prefill(expected_chunk_size, kPrefilledChunkBuffers);
+  buffer_.ReserveOpenBlock(expected_chunk_size);
+}
+
 int LiveWebmMuxer::AddTrack(const AudioConfig& audio_config,
-                            const VorbisCodecPrivate& codec_private) {
+                            const AudioCodecPrivate& codec_private) {
   if (audio_track_num_ != 0) {
     LOG(ERROR) << "Cannot add audio track: it already exists.";
     return kAudioTrackAlreadyExists;
   }
-  const VorbisCodecPrivate& vcp = codec_private;
+  TrackHandle track = 0;
+  return AddTrack(audio_config, codec_private, &track);
+}
+
+int LiveWebmMuxer::AddTrack(const AudioConfig& audio_config,
+                            const AudioCodecPrivate& codec_private,
+                            TrackHandle* ptr_track) {
+  if (!ptr_track) {
+    LOG(ERROR) << "NULL track pointer.";
+    return kInvalidArg;
+  }
 
   // Perform minimal private data validation.
-  if (!vcp.ptr_ident || !vcp.ptr_comments || !vcp.ptr_setup) {
-    LOG(ERROR) << "Cannot add audio track: NULL private data contents.";
+  if (codec_private.data.empty()) {
+    LOG(ERROR) << "Cannot add audio track: empty private data.";
     return kAudioPrivateDataInvalid;
   }
-  if (vcp.ident_length > 255 || vcp.comments_length > 255) {
-    LOG(ERROR) << "Cannot add audio track: over maximum ident/comment length.";
+  if (codec_private.format != kAudioFormatVorbis &&
+      codec_private.format != kAudioFormatOpus) {
+    LOG(ERROR) << "Cannot add audio track: unsupported audio format.";
     return kAudioPrivateDataInvalid;
   }
-  const int data_length =
-      vcp.ident_length + vcp.comments_length + vcp.setup_length;
-
-  // Calculate total bytes of storage required for the private data chunk.
-  // 1 byte to store header count (total headers - 1 = 2).
-  // 1 byte each for ident and comment length values.
-  // The length of setup data is implied by the total length.
-  const int header_length = 1 + 1 + 1 + data_length;
-  std::unique_ptr<uint8[]> private_data;
-  private_data.reset(new (std::nothrow) uint8[header_length]);
-  if (!private_data) {
-    LOG(ERROR) << "Cannot allocate private data block";
-    return kNoMemory;
-  }
-  uint8* ptr_private_data = private_data.get();
-
-  // Write header count. As above, number of headers - 1.
-  *ptr_private_data++ = 2;
 
-  // Write ident length, comment length.
-  *ptr_private_data++ = static_cast<uint8>(vcp.ident_length);
-  *ptr_private_data++ = static_cast<uint8>(vcp.comments_length);
-
-  // Write the data blocks.
-  memcpy(ptr_private_data, vcp.ptr_ident, vcp.ident_length);
-  ptr_private_data += vcp.ident_length;
-  memcpy(ptr_private_data, vcp.ptr_comments, vcp.comments_length);
-  ptr_private_data += vcp.comments_length;
-  memcpy(ptr_private_data, vcp.ptr_setup, vcp.setup_length);
-
-  audio_track_num_ = ptr_segment_->AddAudioTrack(audio_config.sample_rate,
-                                                 audio_config.channels,
-                                                 kAutoAssignTrackNum);
-  if (!audio_track_num_) {
+  const uint64 track_num =
+      ptr_segment_->AddAudioTrack(audio_config.sample_rate,
+                                  audio_config.channels,
+                                  kAutoAssignTrackNum);
+  if (!track_num) {
     LOG(ERROR) << "cannot AddAudioTrack on segment.";
-    return kVideoTrackError;
+    return kAudioTrackError;
   }
   mkvmuxer::AudioTrack* const ptr_audio_track =
       static_cast<mkvmuxer::AudioTrack*>(
-          ptr_segment_->GetTrackByNumber(audio_track_num_));
+          ptr_segment_->GetTrackByNumber(track_num));
   if (!ptr_audio_track) {
     LOG(ERROR) << "Unable to access audio track.";
     return kAudioTrackError;
   }
-  if (!ptr_audio_track->SetCodecPrivate(private_data.get(), header_length)) {
+  if (codec_private.format == kAudioFormatOpus) {
+    ptr_audio_track->set_codec_id(mkvmuxer::Tracks::kOpusCodecId);
+    ptr_audio_track->set_codec_delay(codec_private.codec_delay);
+    ptr_audio_track->set_seek_pre_roll(codec_private.seek_pre_roll);
+  }
+  if (!ptr_audio_track->SetCodecPrivate(
+          &codec_private.data[0],
+          static_cast<uint64>(codec_private.data.size()))) {
     LOG(ERROR) << "Unable to write audio track codec private data.";
     return kAudioTrackError;
   }
+
+  // The codec private data is keyed by its hash. The track number keeps the
+  // UIDs of alike tracks in one muxer unique.
+  std::ostringstream config_key;
+  config_key << "audio" << track_num << ":" << ptr_audio_track->codec_id()
+             << ":"
+             << audio_config.sample_rate << ":" << audio_config.channels
+             << ":" << codec_private.codec_delay << ":"
+             << codec_private.seek_pre_roll << ":" << std::hex
+             << HashBytes(&codec_private.data[0], codec_private.data.size(),
+                          kFnvOffsetBasis);
+  if (encryptor_) {
+    if (!ProtectTrack(ptr_audio_track)) {
+      return kAudioTrackError;
+    }
+    config_key << ":enc:" << EncryptionKey(encryptor_->key_id());
+  }
+  ptr_audio_track->set_uid(TrackUid(config_key.str()));
+  track_config_key_ += config_key.str() + ";";
+  audio_tracks_.push_back(track_num);
+  if (audio_track_num_ == 0) {
+    audio_track_num_ = track_num;
+  }
+  *ptr_track = track_num;
   return kSuccess;
 }
 
@@ -273,25 +734,171 @@ int LiveWebmMuxer::AddTrack(const VideoConfig& video_config) {
     LOG(ERROR) << "Cannot add video track: it already exists.";
     return kVideoTrackAlreadyExists;
   }
-  video_track_num_ = ptr_segment_->AddVideoTrack(video_config.width,
-                                                 video_config.height,
-                                                 kAutoAssignTrackNum);
-  if (!video_track_num_) {
+  TrackHandle track = 0;
+  return AddTrack(video_config, &track);
+}
+
+int LiveWebmMuxer::AddTrack(const VideoConfig& video_config,
+                            TrackHandle* ptr_track) {
+  if (!ptr_track) {
+    LOG(ERROR) << "NULL track pointer.";
+    return kInvalidArg;
+  }
+  const uint64 track_num =
+      ptr_segment_->AddVideoTrack(video_config.width, video_config.height,
+                                  kAutoAssignTrackNum);
+  if (!track_num) {
     LOG(ERROR) << "cannot AddVideoTrack on segment.";
     return kVideoTrackError;
   }
 
+  mkvmuxer::VideoTrack* const video_track =
+      static_cast<mkvmuxer::VideoTrack*>(
+          ptr_segment_->GetTrackByNumber(track_num));
+  if (!video_track) {
+    LOG(ERROR) << "cannot get video track to set codec.\n";
+    return kVideoTrackError;
+  }
   if (video_config.format != kVideoFormatVP8) {
-    mkvmuxer::VideoTrack* const video_track =
-        static_cast<mkvmuxer::VideoTrack*>(
-            ptr_segment_->GetTrackByNumber(video_track_num_));
-    if (!video_track) {
-      LOG(ERROR) << "cannot get video track to set codec.\n";
+    video_track->set_codec_id(mkvmuxer::Tracks::kVp9CodecId);
+  }
+  if (temporal_layer_ids_) {
+    video_track->set_max_block_additional_id(kTemporalLayerAddId);
+  } else if (capture_times_) {
+    video_track->set_max_block_additional_id(kCaptureTimeAddId);
+  }
+
+  std::ostringstream config_key;
+  config_key << "video" << track_num << ":" << video_track->codec_id() << ":"
+             << video_config.width << "x" << video_config.height << ":"
+             << video_track->max_block_additional_id();
+  if (video_config.crop_width > 0 && video_config.crop_height > 0) {
+    // Players show only the visible region of padded frames.
+    const int32 crop_right =
+        video_config.width - video_config.crop_left - video_config.crop_width;
+    const int32 crop_bottom = abs(video_config.height) -
+        video_config.crop_top - video_config.crop_height;
+    video_track->set_crop_left(video_config.crop_left);
+    video_track->set_crop_top(video_config.crop_top);
+    video_track->set_crop_right(crop_right);
+    video_track->set_crop_bottom(crop_bottom);
+    video_track->set_display_width(video_config.crop_width);
+    video_track->set_display_height(video_config.crop_height);
+    config_key << ":crop:" << video_config.crop_left << ","
+               << video_config.crop_top << "," << crop_right << ","
+               << crop_bottom;
+  }
+  if (encryptor_) {
+    if (!ProtectTrack(video_track)) {
       return kVideoTrackError;
     }
-    video_track->set_codec_id(mkvmuxer::Tracks::kVp9CodecId);
+    config_key << ":enc:" << EncryptionKey(encryptor_->key_id());
+  }
+  video_track->set_uid(TrackUid(config_key.str()));
+  track_config_key_ += config_key.str() + ";";
+  video_tracks_.push_back(track_num);
+  if (video_track_num_ == 0) {
+    video_track_num_ = track_num;
+  }
+  *ptr_track = track_num;
+  return kSuccess;
+}
+
+int LiveWebmMuxer::AddTrack(const TextTrackSettings& settings,
+                            TrackHandle* ptr_track) {
+  if (!ptr_track) {
+    LOG(ERROR) << "NULL track pointer.";
+    return kInvalidArg;
+  }
+  mkvmuxer::Track* const text_track =
+      ptr_segment_->AddTrack(kAutoAssignTrackNum);
+  if (!text_track) {
+    LOG(ERROR) << "cannot AddTrack (text) on segment.";
+    return kTextTrackError;
+  }
+  text_track->set_type(kSubtitleTrackType);
+  text_track->set_codec_id(settings.kind == TextTrackSettings::kSubtitles ?
+                           kWebVttSubtitlesCodecId : kWebVttCaptionsCodecId);
+  if (!settings.language.empty()) {
+    text_track->set_language(settings.language.c_str());
+  }
+  if (!settings.name.empty()) {
+    text_track->set_name(settings.name.c_str());
   }
 
+  const uint64 track_num = text_track->number();
+  std::ostringstream config_key;
+  config_key << "text" << track_num << ":" << text_track->codec_id() << ":"
+             << settings.language << ":" << settings.name;
+  text_track->set_uid(TrackUid(config_key.str()));
+  track_config_key_ += config_key.str() + ";";
+  text_tracks_.push_back(track_num);
+  *ptr_track = track_num;
+  return kSuccess;
+}
+
+int LiveWebmMuxer::WriteInitSegment(const std::string& id,
+                                    SharedWebmChunk* ptr_chunk) {
+  if (!ptr_chunk) {
+    LOG(ERROR) << "NULL chunk pointer.";
+    return kInvalidArg;
+  }
+  if (chunks_read_ > 0 || buffer_.bytes_buffered() > 0 ||
+      track_config_key_.empty()) {
+    LOG(ERROR) << "init segment requested without tracks, or after the "
+               << "first frame.";
+    return kInvalidArg;
+  }
+
+  // The elements |mkvmuxer::Segment| writes ahead of the first cluster of a
+  // live segment: the EBML header, with the DocTypeVersion tracks with a
+  // codec delay or seek pre-roll need, the Segment with an unknown size, its
+  // Info and its Tracks, in the order the tracks were added.
+  std::vector<uint64> tracks(audio_tracks_);
+  tracks.insert(tracks.end(), video_tracks_.begin(), video_tracks_.end());
+  tracks.insert(tracks.end(), text_tracks_.begin(), text_tracks_.end());
+  std::sort(tracks.begin(), tracks.end());
+  uint64 doc_type_version = mkvmuxer::Segment::kDefaultDocTypeVersion;
+  uint64 tracks_size = 0;
+  for (size_t i = 0; i < tracks.size(); ++i) {
+    const mkvmuxer::Track* const ptr_track =
+        ptr_segment_->GetTrackByNumber(tracks[i]);
+    if (!ptr_track) {
+      LOG(ERROR) << "cannot access track " << tracks[i];
+      return kMuxerError;
+    }
+    if (ptr_track->codec_delay() || ptr_track->seek_pre_roll()) {
+      doc_type_version = 4;
+    }
+    tracks_size += ptr_track->Size();
+  }
+  InitSegmentWriter writer;
+  bool written =
+      mkvmuxer::WriteEbmlHeader(&writer, doc_type_version) &&
+      !mkvmuxer::WriteID(&writer, mkvmuxer::kMkvSegment) &&
+      !mkvmuxer::SerializeInt(&writer, mkvmuxer::kEbmlUnknownValue, 8) &&
+      ptr_segment_->GetSegmentInfo()->Write(&writer) &&
+      mkvmuxer::WriteEbmlMasterElement(&writer, mkvmuxer::kMkvTracks,
+                                       tracks_size);
+  for (size_t i = 0; written && i < tracks.size(); ++i) {
+    written = ptr_segment_->GetTrackByNumber(tracks[i])->Write(&writer);
+  }
+  if (!written) {
+    LOG(ERROR) << "cannot write init segment of " << muxer_id_;
+    return kMuxerError;
+  }
+
+  WebmChunkDescriptor descriptor;
+  descriptor.length = static_cast<int32>(writer.data()->size());
+  ptr_chunk->reset(new (std::nothrow) WebmChunk(id,  // NOLINT
+                                                descriptor,
+                                                0,
+                                                writer.data(),
+                                                pool_));
+  if (!*ptr_chunk) {
+    LOG(ERROR) << "cannot construct WebmChunk.";
+    return kNoMemory;
+  }
   return kSuccess;
 }
 
@@ -301,7 +908,7 @@ int LiveWebmMuxer::Finalize() {
     return kMuxerError;
   }
 
-  if (buffer_.size() > 0) {
+  if (buffer_.bytes_buffered() > 0) {
     // When data is in |buffer_| after the |mkvmuxer::Segment::Finalize()|
     // call, make the last chunk available to the user by forcing
     // |ChunkReady()| to return true one final time. This last chunk will
@@ -310,7 +917,7 @@ int LiveWebmMuxer::Finalize() {
     ptr_writer_->ElementStartNotify(mkvmuxer::kMkvCluster,
                                     ptr_writer_->bytes_written());
   }
-
+  UpdateStats();
   return kSuccess;
 }
 
@@ -319,6 +926,15 @@ int LiveWebmMuxer::WriteVideoFrame(const VideoFrame& vpx_frame) {
     LOG(ERROR) << "Cannot WriteVideoFrame without a video track.";
     return kNoVideoTrack;
   }
+  return WriteVideoFrame(video_track_num_, vpx_frame);
+}
+
+int LiveWebmMuxer::WriteVideoFrame(TrackHandle track,
+                                   const VideoFrame& vpx_frame) {
+  if (!HasTrack(video_tracks_, track)) {
+    LOG(ERROR) << "Cannot WriteVideoFrame to unknown video track " << track;
+    return kNoVideoTrack;
+  }
   if (!vpx_frame.buffer()) {
     LOG(ERROR) << "cannot write empty frame.";
     return kInvalidArg;
@@ -328,61 +944,490 @@ int LiveWebmMuxer::WriteVideoFrame(const VideoFrame& vpx_frame) {
     LOG(ERROR) << "cannot write non-VPx frame.";
     return kInvalidArg;
   }
+  if (DropAfterSplice(track, vpx_frame.timestamp(), vpx_frame.keyframe())) {
+    return kSuccess;
+  }
+  StartClusterIfDue(vpx_frame.timestamp(), vpx_frame.keyframe());
+  const int64 clusters = clusters_started();
   const int64 timecode = milliseconds_to_timecode_ticks(vpx_frame.timestamp());
-  if (!ptr_segment_->AddFrame(vpx_frame.buffer(),
-                              vpx_frame.buffer_length(),
-                              video_track_num_,
-                              timecode,
-                              vpx_frame.keyframe())) {
+  const uint8* ptr_frame = vpx_frame.buffer();
+  int32 frame_length = vpx_frame.buffer_length();
+  if (!ProtectFrame(&ptr_frame, &frame_length)) {
+    return kVideoWriteError;
+  }
+  if (temporal_layer_ids_ && vpx_frame.temporal_layer() > 0) {
+    const uint8 layer = static_cast<uint8>(vpx_frame.temporal_layer());
+    if (!ptr_segment_->AddFrameWithAdditional(ptr_frame,
+                                              frame_length,
+                                              &layer,
+                                              sizeof(layer),
+                                              kTemporalLayerAddId,
+                                              track,
+                                              timecode,
+                                              vpx_frame.keyframe())) {
+      LOG(ERROR) << "AddFrameWithAdditional (video) failed.";
+      return kVideoWriteError;
+    }
+  } else if (capture_times_ && vpx_frame.capture_time() != 0) {
+    uint8 capture_time[kCaptureTimeLength];
+    uint64 value = static_cast<uint64>(vpx_frame.capture_time());
+    for (int i = kCaptureTimeLength - 1; i >= 0; --i) {
+      capture_time[i] = static_cast<uint8>(value & 0xff);
+      value >>= 8;
+    }
+    if (!ptr_segment_->AddFrameWithAdditional(ptr_frame,
+                                              frame_length,
+                                              capture_time,
+                                              sizeof(capture_time),
+                                              kCaptureTimeAddId,
+                                              track,
+                                              timecode,
+                                              vpx_frame.keyframe())) {
+      LOG(ERROR) << "AddFrameWithAdditional (video) failed.";
+      return kVideoWriteError;
+    }
+  } else if (!ptr_segment_->AddFrame(ptr_frame,
+                                     frame_length,
+                                     track,
+                                     timecode,
+                                     vpx_frame.keyframe())) {
     LOG(ERROR) << "AddFrame (video) failed.";
     return kVideoWriteError;
   }
+  NoteClusterSplit(clusters);
+  buffer_.NoteFrame(vpx_frame.timestamp(), vpx_frame.keyframe());
   muxer_time_ = vpx_frame.timestamp();
+  NoteFrameWritten(false, vpx_frame.timestamp(), frame_length);
+  return kSuccess;
+}
+
+int LiveWebmMuxer::WriteTextCue(TrackHandle track, const TextCue& cue) {
+  if (!HasTrack(text_tracks_, track)) {
+    LOG(ERROR) << "Cannot WriteTextCue to unknown text track " << track;
+    return kNoTextTrack;
+  }
+  if (cue.start < 0 || cue.duration <= 0) {
+    LOG(ERROR) << "cannot write text cue without start time or duration.";
+    return kInvalidArg;
+  }
+  if (DropAfterSplice(track, cue.start, true)) {
+    return kSuccess;
+  }
+  // Cues end no cluster of their own; audio and video keep cluster timing.
+  StartClusterIfDue(cue.start, false);
+  const int64 clusters = clusters_started();
+  MakeWebVttFrame(cue, &cue_frame_);
+  if (!ptr_segment_->AddMetadata(
+          reinterpret_cast<const uint8*>(cue_frame_.data()),
+          cue_frame_.length(), track,
+          milliseconds_to_timecode_ticks(cue.start),
+          milliseconds_to_timecode_ticks(cue.duration))) {
+    LOG(ERROR) << "AddMetadata (text) failed.";
+    return kTextWriteError;
+  }
+  NoteClusterSplit(clusters);
+  buffer_.NoteFrame(cue.start, true);
+  muxer_time_ = cue.start;
+  payload_bytes_ += cue_frame_.length();
+  UpdateStats();
   return kSuccess;
 }
 
-int LiveWebmMuxer::WriteAudioBuffer(const AudioBuffer& vorbis_buffer) {
+int LiveWebmMuxer::WriteAudioBuffer(const AudioBuffer& audio_buffer) {
   if (audio_track_num_ == 0) {
     LOG(ERROR) << "Cannot WriteAudioBuffer without an audio track.";
     return kNoAudioTrack;
   }
-  if (!vorbis_buffer.buffer()) {
+  return WriteAudioBuffer(audio_track_num_, audio_buffer);
+}
+
+int LiveWebmMuxer::WriteAudioBuffer(TrackHandle track,
+                                    const AudioBuffer& audio_buffer) {
+  if (!HasTrack(audio_tracks_, track)) {
+    LOG(ERROR) << "Cannot WriteAudioBuffer to unknown audio track " << track;
+    return kNoAudioTrack;
+  }
+  if (!audio_buffer.buffer()) {
     LOG(ERROR) << "cannot write empty audio buffer.";
     return kInvalidArg;
   }
-  if (vorbis_buffer.config().format_tag != kAudioFormatVorbis) {
-    LOG(ERROR) << "cannot write non-Vorbis audio buffer.";
+  const uint16 format_tag = audio_buffer.config().format_tag;
+  if (format_tag != kAudioFormatVorbis && format_tag != kAudioFormatOpus) {
+    LOG(ERROR) << "cannot write non-Vorbis/Opus audio buffer.";
     return kInvalidArg;
   }
-  const int64 timecode =
-      milliseconds_to_timecode_ticks(vorbis_buffer.timestamp());
-  if (!ptr_segment_->AddFrame(vorbis_buffer.buffer(),
-                              vorbis_buffer.buffer_length(),
-                              audio_track_num_,
+  const int64 timestamp = audio_buffer.timestamp() + splice_audio_shift_;
+  if (DropAfterSplice(track, timestamp, true)) {
+    return kSuccess;
+  }
+  // Audio frames never start clusters in libwebm.
+  StartClusterIfDue(timestamp, false);
+  const int64 clusters = clusters_started();
+  const int64 timecode = milliseconds_to_timecode_ticks(timestamp);
+  const uint8* ptr_frame = audio_buffer.buffer();
+  int32 frame_length = audio_buffer.buffer_length();
+  if (!ProtectFrame(&ptr_frame, &frame_length)) {
+    return kAudioWriteError;
+  }
+  if (!ptr_segment_->AddFrame(ptr_frame,
+                              frame_length,
+                              track,
                               timecode,
                               true)) {
     LOG(ERROR) << "AddFrame (audio) failed.";
     return kAudioWriteError;
   }
-  muxer_time_ = vorbis_buffer.timestamp();
+  NoteClusterSplit(clusters);
+  buffer_.NoteFrame(timestamp, true);
+  muxer_time_ = timestamp;
+  NoteFrameWritten(true, timestamp, frame_length);
   return kSuccess;
 }
 
-// A chunk is ready when |WebmMuxWriter::chunk_length()| returns a value
-// greater than 0.
+int LiveWebmMuxer::WriteAudioBuffers(const AudioPacketBatch& batch) {
+  if (audio_track_num_ == 0) {
+    LOG(ERROR) << "Cannot WriteAudioBuffers without an audio track.";
+    return kNoAudioTrack;
+  }
+  return WriteAudioBuffers(audio_track_num_, batch);
+}
+
+// Validates the track and format once for the batch, then adds each packet.
+int LiveWebmMuxer::WriteAudioBuffers(TrackHandle track,
+                                     const AudioPacketBatch& batch) {
+  if (!HasTrack(audio_tracks_, track)) {
+    LOG(ERROR) << "Cannot WriteAudioBuffers to unknown audio track " << track;
+    return kNoAudioTrack;
+  }
+  if (batch.empty()) {
+    return kSuccess;
+  }
+  const uint16 format_tag = batch.at(0)->config().format_tag;
+  if (format_tag != kAudioFormatVorbis && format_tag != kAudioFormatOpus) {
+    LOG(ERROR) << "cannot write non-Vorbis/Opus audio buffers.";
+    return kInvalidArg;
+  }
+  for (int i = 0; i < batch.size(); ++i) {
+    const AudioBuffer& audio_buffer = *batch.at(i);
+    if (!audio_buffer.buffer()) {
+      LOG(ERROR) << "cannot write empty audio buffer.";
+      return kInvalidArg;
+    }
+    const int64 timestamp = audio_buffer.timestamp() + splice_audio_shift_;
+    if (DropAfterSplice(track, timestamp, true)) {
+      continue;
+    }
+    StartClusterIfDue(timestamp, false);
+    const int64 clusters = clusters_started();
+    const int64 timecode = milliseconds_to_timecode_ticks(timestamp);
+    const uint8* ptr_frame = audio_buffer.buffer();
+    int32 frame_length = audio_buffer.buffer_length();
+    if (!ProtectFrame(&ptr_frame, &frame_length)) {
+      return kAudioWriteError;
+    }
+    if (!ptr_segment_->AddFrame(ptr_frame,
+                                frame_length,
+                                track,
+                                timecode,
+                                true)) {
+      LOG(ERROR) << "AddFrame (audio) failed.";
+      return kAudioWriteError;
+    }
+    NoteClusterSplit(clusters);
+    buffer_.NoteFrame(timestamp, true);
+    muxer_time_ = timestamp;
+    NoteFrameWritten(true, timestamp, frame_length);
+  }
+  return kSuccess;
+}
+
+int LiveWebmMuxer::SpliceClip(const WebmSpliceClip& clip, int64 start_time,
+                              int64* ptr_end_time) {
+  if (!ptr_end_time || start_time < muxer_time_) {
+    LOG(ERROR) << "cannot splice at " << start_time << ", muxer time is "
+               << muxer_time_;
+    return kInvalidArg;
+  }
+  if (!CanSplice(clip)) {
+    return kSpliceMismatch;
+  }
+  const std::vector<WebmSpliceClip::Frame>& video = clip.video().frames;
+  const std::vector<WebmSpliceClip::Frame>& audio = clip.audio().frames;
+  const size_t video_count = video_tracks_.empty() ? 0 : video.size();
+  const size_t audio_count = audio_tracks_.empty() ? 0 : audio.size();
+  StartCluster();
+
+  // Frames are interleaved by timestamp. Video goes first on a tie, so that
+  // the clip's first keyframe begins its cluster.
+  size_t v = 0;
+  size_t a = 0;
+  while (v < video_count || a < audio_count) {
+    const bool is_video = v < video_count &&
+        (a == audio_count || video[v].timestamp <= audio[a].timestamp);
+    const WebmSpliceClip::Frame& frame = is_video ? video[v++] : audio[a++];
+    const std::vector<TrackHandle>& tracks =
+        is_video ? video_tracks_ : audio_tracks_;
+    for (size_t i = 0; i < tracks.size(); ++i) {
+      const int status = WriteSpliceFrame(
+          tracks[i], !is_video, clip.frame_data(frame), frame.length,
+          start_time + frame.timestamp, !is_video || frame.keyframe);
+      if (status) {
+        return status;
+      }
+    }
+  }
+  splice_end_time_ = start_time + clip.duration();
+
+  // Live audio timestamps count the samples encoded, and so resume from
+  // where the clip began, while the capture timeline moves past it.
+  splice_audio_shift_ += clip.duration();
+  keyframe_pending_tracks_ = video_tracks_;
+  ++splices_;
+  *ptr_end_time = splice_end_time_;
+  UpdateStats();
+  LOG(INFO) << "muxer " << muxer_id_ << " spliced " << clip.path()
+            << " from " << start_time << " to " << splice_end_time_ << " ms.";
+  return kSuccess;
+}
+
+bool LiveWebmMuxer::CanSplice(const WebmSpliceClip& clip) const {
+  const WebmSpliceClip::Track& video = clip.video();
+  const WebmSpliceClip::Track& audio = clip.audio();
+  for (size_t i = 0; i < video_tracks_.size(); ++i) {
+    const mkvmuxer::VideoTrack* const ptr_track =
+        static_cast<const mkvmuxer::VideoTrack*>(
+            ptr_segment_->GetTrackByNumber(video_tracks_[i]));
+    if (video.frames.empty()) {
+      LOG(ERROR) << clip.path() << " has no video for the video tracks.";
+      return false;
+    }
+    if (!ptr_track || video.codec_id != ptr_track->codec_id() ||
+        video.width != static_cast<int32>(ptr_track->width()) ||
+        video.height != static_cast<int32>(ptr_track->height())) {
+      LOG(ERROR) << clip.path() << " video is " << video.codec_id << " "
+                 << video.width << "x" << video.height
+                 << ", unlike video track " << video_tracks_[i];
+      return false;
+    }
+  }
+  for (size_t i = 0; i < audio_tracks_.size() && !audio.frames.empty();
+       ++i) {
+    const mkvmuxer::AudioTrack* const ptr_track =
+        static_cast<const mkvmuxer::AudioTrack*>(
+            ptr_segment_->GetTrackByNumber(audio_tracks_[i]));
+    // Vorbis headers hold the codebooks: the clip's packets decode only
+    // with the same headers.
+    if (!ptr_track || audio.codec_id != ptr_track->codec_id() ||
+        audio.sample_rate !=
+            static_cast<int32>(ptr_track->sample_rate() + 0.5) ||
+        audio.channels != static_cast<int32>(ptr_track->channels()) ||
+        audio.codec_private.size() != ptr_track->codec_private_length() ||
+        (!audio.codec_private.empty() &&
+         memcmp(&audio.codec_private[0], ptr_track->codec_private(),
+                audio.codec_private.size()))) {
+      LOG(ERROR) << clip.path() << " audio is " << audio.codec_id << " "
+                 << audio.channels << " channels at " << audio.sample_rate
+                 << " Hz, or has other codec private data, unlike audio "
+                 << "track " << audio_tracks_[i];
+      return false;
+    }
+  }
+  if (!audio_tracks_.empty() && audio.frames.empty()) {
+    LOG(INFO) << clip.path() << " has no audio, leaving a gap in audio.";
+  }
+  return true;
+}
+
+int LiveWebmMuxer::WriteSpliceFrame(TrackHandle track, bool audio,
+                                    const uint8* ptr_data, int32 length,
+                                    int64 timestamp, bool keyframe) {
+  const int write_error = audio ? kAudioWriteError : kVideoWriteError;
+  StartClusterIfDue(timestamp, !audio && keyframe);
+  const int64 clusters = clusters_started();
+  const uint8* ptr_frame = ptr_data;
+  int32 frame_length = length;
+  if (!ProtectFrame(&ptr_frame, &frame_length)) {
+    return write_error;
+  }
+  if (!ptr_segment_->AddFrame(ptr_frame,
+                              frame_length,
+                              track,
+                              milliseconds_to_timecode_ticks(timestamp),
+                              keyframe)) {
+    LOG(ERROR) << "AddFrame (splice) failed.";
+    return write_error;
+  }
+  NoteClusterSplit(clusters);
+  buffer_.NoteFrame(timestamp, keyframe);
+  muxer_time_ = timestamp;
+  NoteFrameWritten(audio, timestamp, frame_length);
+  return kSuccess;
+}
+
+bool LiveWebmMuxer::DropAfterSplice(TrackHandle track, int64 timestamp,
+                                    bool keyframe) {
+  if (splices_ == 0) {
+    return false;
+  }
+  bool drop = timestamp < splice_end_time_;
+  if (!drop && !keyframe_pending_tracks_.empty()) {
+    const std::vector<TrackHandle>::iterator pending =
+        std::find(keyframe_pending_tracks_.begin(),
+                  keyframe_pending_tracks_.end(), track);
+    if (pending != keyframe_pending_tracks_.end()) {
+      if (keyframe) {
+        keyframe_pending_tracks_.erase(pending);
+      } else {
+        drop = true;
+      }
+    }
+  }
+  if (drop) {
+    ++splice_dropped_frames_;
+    WEBMLIVE_LOG_EVERY_MS(WARNING, kLogIntervalMs)
+        << "muxer " << muxer_id_ << " dropped a frame of track " << track
+        << " at " << timestamp << " ms after a splice.";
+  }
+  return drop;
+}
+
+void LiveWebmMuxer::StartCluster() {
+  if (clusters_started() > 0) {
+    ptr_segment_->ForceNewClusterOnNextFrame();
+    StartEncryptionSegment();
+  }
+}
+
+void LiveWebmMuxer::SetSegmentSchedule(
+    SegmentDurationController* ptr_schedule,
+    int32 max_cluster_duration_milliseconds) {
+  if (cluster_duration_ <= 0 || !ptr_schedule) {
+    return;
+  }
+  ptr_segment_schedule_ = ptr_schedule;
+  ptr_segment_->set_max_cluster_duration(
+      milliseconds_to_timecode_ticks(max_cluster_duration_milliseconds));
+}
+
+void LiveWebmMuxer::StartClusterIfDue(int64 timestamp, bool keyframe) {
+  if (cluster_duration_ > 0 && timestamp >= next_cluster_time_) {
+    // The first frame starts the first cluster on its own.
+    if (next_cluster_time_ > 0) {
+      ptr_segment_->ForceNewClusterOnNextFrame();
+      split_pending_ = false;
+    }
+    next_cluster_time_ = ptr_segment_schedule_ ?
+        ptr_segment_schedule_->NextBoundary(timestamp) :
+        (timestamp / cluster_duration_ + 1) * cluster_duration_;
+    StartEncryptionSegment();
+    return;
+  }
+  if (keyframe) {
+    // libwebm starts a cluster, and so a segment, at each video keyframe.
+    split_pending_ = false;
+    StartEncryptionSegment();
+    return;
+  }
+  // The open block holds the metadata until the first cluster starts.
+  if (max_cluster_bytes_ > 0 && !split_pending_ && clusters_started() > 0 &&
+      buffer_.open_chunk_size() >= max_cluster_bytes_) {
+    ptr_segment_->ForceNewClusterOnNextFrame();
+    split_pending_ = true;
+  }
+}
+
+void LiveWebmMuxer::NoteClusterSplit(int64 clusters) {
+  if (split_pending_ && clusters_started() > clusters) {
+    buffer_.MarkContinuation();
+    split_pending_ = false;
+    ++clusters_split_;
+  }
+}
+
+bool LiveWebmMuxer::ProtectTrack(mkvmuxer::Track* ptr_track) {
+  const std::string& key_id = encryptor_->key_id();
+  if (!ptr_track->AddContentEncoding()) {
+    LOG(ERROR) << "cannot add ContentEncoding to track.";
+    return false;
+  }
+  // libwebm defaults to AES in CTR mode.
+  mkvmuxer::ContentEncoding* const ptr_encoding =
+      ptr_track->GetContentEncodingByIndex(0);
+  if (!ptr_encoding ||
+      !ptr_encoding->SetEncryptionID(
+          reinterpret_cast<const uint8*>(key_id.data()), key_id.length())) {
+    LOG(ERROR) << "cannot set the track's ContentEncKeyID.";
+    return false;
+  }
+  return true;
+}
+
+bool LiveWebmMuxer::ProtectFrame(const uint8** ptr_data, int32* ptr_length) {
+  if (!encryptor_) {
+    return true;
+  }
+  if (!encryptor_->Encrypt(*ptr_data, *ptr_length, ptr_data, ptr_length)) {
+    LOG(ERROR) << "cannot encrypt block.";
+    return false;
+  }
+  return true;
+}
+
+void LiveWebmMuxer::StartEncryptionSegment() {
+  if (encryptor_ && !encryptor_->StartSegment()) {
+    LOG(ERROR) << "encryption key rotation failed, keeping the current key.";
+  }
+}
+
+void LiveWebmMuxer::NoteFrameWritten(bool audio, int64 timestamp,
+                                     int32 length) {
+  payload_bytes_ += length;
+  int64& last_timestamp =
+      audio ? last_audio_timestamp_ : last_video_timestamp_;
+  const int64 other_timestamp =
+      audio ? last_video_timestamp_ : last_audio_timestamp_;
+  last_timestamp = timestamp;
+  if (other_timestamp >= 0) {
+    const int64 gap = timestamp - other_timestamp;
+    int64& current_gap =
+        audio ? audio_interleave_gap_ : video_interleave_gap_;
+    int64& max_gap =
+        audio ? max_audio_interleave_gap_ : max_video_interleave_gap_;
+    current_gap = gap;
+    max_gap = std::max(max_gap, std::abs(gap));
+  }
+  UpdateStats();
+}
+
+void LiveWebmMuxer::UpdateStats() {
+  MuxerStats stats = ptr_writer_->stats();
+  // The writer counts whole block elements; the muxer knows their payload.
+  stats.block_header_bytes =
+      std::max<int64>(stats.block_header_bytes - payload_bytes_, 0);
+  stats.block_payload_bytes = payload_bytes_;
+  stats.audio_interleave_gap = audio_interleave_gap_;
+  stats.max_audio_interleave_gap = max_audio_interleave_gap_;
+  stats.video_interleave_gap = video_interleave_gap_;
+  stats.max_video_interleave_gap = max_video_interleave_gap_;
+  stats.chunks_read = chunks_read_;
+  stats.read_latency_us = buffer_.read_latency_us();
+  stats.max_read_latency_us = buffer_.max_read_latency_us();
+  stats.splices = splices_;
+  stats.splice_dropped_frames = splice_dropped_frames_;
+  std::lock_guard<std::mutex> lock(stats_mutex_);
+  stats_ = stats;
+}
+
+// A chunk is ready when |buffer_| holds a closed chunk.
 bool LiveWebmMuxer::ChunkReady(int32* ptr_chunk_length) {
   if (ptr_chunk_length) {
-    const int32 chunk_length = static_cast<int32>(ptr_writer_->chunk_end());
-    if (chunk_length > 0) {
-      *ptr_chunk_length = chunk_length;
-      return true;
-    }
+    return buffer_.ChunkReady(ptr_chunk_length);
   }
   return false;
 }
 
-// Copies the buffered chunk data into |ptr_buf|, erases it from |buffer_|, and
-// calls |WebmMuxWriter::ResetChunkEnd()| to zero the chunk end position.
+// Copies the oldest buffered chunk into |ptr_buf| and discards it from
+// |buffer_|.
 int LiveWebmMuxer::ReadChunk(int32 buffer_capacity, uint8* ptr_buf) {
   if (!ptr_buf) {
     LOG(ERROR) << "NULL buffer pointer.";
@@ -404,12 +1449,66 @@ int LiveWebmMuxer::ReadChunk(int32 buffer_capacity, uint8* ptr_buf) {
 
   LOG(INFO) << "ReadChunk capacity=" << buffer_capacity
             << " length=" << chunk_length
-            << " total buffered=" << buffer_.size();
+            << " total buffered=" << buffer_.bytes_buffered();
+
+  // Copy chunk to user buffer, and discard it from |buffer_|.
+  if (!buffer_.ReadChunk(buffer_capacity, ptr_buf)) {
+    LOG(ERROR) << "MuxerWriteBuffer ReadChunk failed.";
+    return kMuxerError;
+  }
+  ++chunks_read_;
+  UpdateStats();
+  return kSuccess;
+}
 
-  // Copy chunk to user buffer, and erase it from |buffer_|.
-  memcpy(ptr_buf, &buffer_[0], chunk_length);
-  ptr_writer_->EraseChunk();
+bool LiveWebmMuxer::ReadStreamData(WriteBuffer::StreamData* ptr_data) {
+  if (!ptr_data || !buffer_.ReadStreamData(ptr_data)) {
+    return false;
+  }
+  if (ptr_data->chunk_end) {
+    ++chunks_streamed_;
+  }
+  return true;
+}
+
+int LiveWebmMuxer::ReadChunk(const std::string& id,
+                             SharedWebmChunk* ptr_chunk) {
+  if (!ptr_chunk) {
+    LOG(ERROR) << "NULL chunk pointer.";
+    return kInvalidArg;
+  }
+  MuxerWriteBuffer::Block data;
+  MuxerWriteBuffer::ChunkInfo info;
+  if (!buffer_.DetachChunk(&data, &info)) {
+    LOG(ERROR) << "No chunk ready.";
+    return kNoChunkReady;
+  }
+  WebmChunkDescriptor descriptor;
+  descriptor.offset = info.offset;
+  descriptor.length = static_cast<int32>(data.size());
+  descriptor.first_timestamp = info.timestamp;
+  descriptor.last_timestamp = info.last_timestamp;
+  descriptor.keyframe = info.keyframe;
+  descriptor.continuation = info.continuation;
+  descriptor.block_count = info.block_count;
+  descriptor.keyframe_offset = info.keyframe ? info.first_block_offset : -1;
+  const int64 duration = info.end_timestamp - info.timestamp;
+  ptr_chunk->reset(new (std::nothrow) WebmChunk(id,  // NOLINT
+                                                descriptor,
+                                                duration,
+                                                &data,
+                                                pool_));
+  if (!*ptr_chunk) {
+    LOG(ERROR) << "cannot construct WebmChunk.";
+    return kNoMemory;
+  }
+  if (chunks_read_ == 0) {
+    init_segment_ = ptr_init_segments_ ?
+        ptr_init_segments_->Intern(track_config_key_, *ptr_chunk) :
+        *ptr_chunk;
+  }
   ++chunks_read_;
+  UpdateStats();
   return kSuccess;
 }
 
@@ -8,38 +8,199 @@
 #ifndef WEBMLIVE_ENCODER_WEBM_MUX_H_
 #define WEBMLIVE_ENCODER_WEBM_MUX_H_
 
+#include <chrono>
+#include <deque>
 #include <memory>
+#include <mutex>
+#include <string>
 #include <vector>
 
 #include "encoder/basictypes.h"
 #include "encoder/encoder_base.h"
+#include "encoder/text_track.h"
+#include "encoder/webm_chunk.h"
+#include "encoder/webm_encryptor.h"
 #include "encoder/webm_encoder.h"
 
 // Forward declarations of libwebm muxer types used by |LiveWebmMuxer|.
 namespace mkvmuxer {
 class Segment;
+class Track;
 }
 
 namespace webmlive {
 
+class InitSegmentCache;
+class SegmentDurationController;
+class WebmSpliceClip;
+
 // Forward declaration of class implementing IMkvWriter interface for libwebm.
 class WebmMuxWriter;
 
-struct VorbisCodecPrivate {
-  VorbisCodecPrivate()
-      : ptr_ident(NULL),
-        ident_length(0),
-        ptr_comments(NULL),
-        comments_length(0),
-        ptr_setup(NULL),
-        setup_length(0) {}
-
-  const uint8* ptr_ident;
-  int32 ident_length;
-  const uint8* ptr_comments;
-  int32 comments_length;
-  const uint8* ptr_setup;
-  int32 setup_length;
+// Write buffer for data produced by libwebm. Data is appended to an open
+// block, and |CloseChunk()| turns the open block into a complete chunk. Chunks
+// are kept as separate blocks, so reading a chunk never moves the data that
+// follows it. Blocks are taken from a |WebmChunkDataPool|, which receives the
+// storage of chunks once they have been read, so steady state muxing reuses
+// the storage of earlier chunks.
+//
+// In streaming mode the data of each chunk is also handed out as it is
+// written, via |ReadStreamData()|, and a complete chunk is not ready until all
+// of its data has been streamed.
+class MuxerWriteBuffer {
+ public:
+  typedef WebmChunkDataPool::Data Block;
+
+  // Chunk data not yet streamed. |ptr_data| points into the buffer, and is
+  // valid until the next call to a non-const method. |chunk_start| is true
+  // when the data begins a chunk, and |chunk_end| when it ends the chunk.
+  struct StreamData {
+    StreamData() : ptr_data(NULL), length(0), chunk_start(false),
+                   chunk_end(false) {}
+    const uint8* ptr_data;
+    int32 length;
+    bool chunk_start;
+    bool chunk_end;
+  };
+
+  // Layout and frame timing of a chunk, in bytes and milliseconds. |offset|
+  // is the position of the chunk within all data written. |last_timestamp|
+  // is the timestamp of the last frame, and |end_timestamp| is the same, or
+  // the start of the following chunk when |DetachChunk()| knows it.
+  // |first_block_offset| is the position of the first block element within
+  // the chunk, or -1 before one is written. |close_time| is when
+  // |CloseChunk()| completed the chunk.
+  struct ChunkInfo {
+    ChunkInfo() : offset(0), timestamp(0), last_timestamp(0),
+                  end_timestamp(0), keyframe(false), continuation(false),
+                  has_frames(false), block_count(0), first_block_offset(-1) {}
+    int64 offset;
+    int64 timestamp;
+    int64 last_timestamp;
+    int64 end_timestamp;
+    bool keyframe;
+    bool continuation;
+    bool has_frames;
+    int32 block_count;
+    int32 first_block_offset;
+    std::chrono::steady_clock::time_point close_time;
+  };
+
+  MuxerWriteBuffer();
+  ~MuxerWriteBuffer();
+
+  // Sets the pool that provides blocks and receives their storage, and takes
+  // a block from it for the open block. Must be called before the first
+  // |Write()|.
+  void SetPool(const SharedWebmChunkDataPool& pool);
+
+  // Sets the capacity of blocks taken from the pool to at least |capacity|
+  // bytes, and grows the open block to it, writing the added storage so that
+  // its pages are mapped.
+  void ReserveOpenBlock(size_t capacity);
+
+  // Appends |length| bytes from |ptr_data| to the open block.
+  void Write(const uint8* ptr_data, int32 length);
+
+  // Records a frame passed to libwebm in the open block's |ChunkInfo|. The
+  // first frame recorded sets |timestamp| and |keyframe|, and each frame
+  // counts as a block.
+  void NoteFrame(int64 timestamp, bool keyframe);
+
+  // Records the start of a block element at the end of the open block. The
+  // first one sets |ChunkInfo::first_block_offset|.
+  void NoteBlockStart();
+
+  // Ends the open block at a chunk boundary. Does nothing when the open block
+  // is empty.
+  void CloseChunk();
+
+  // Marks the open block's chunk as continuing the segment of the chunk
+  // before it. See |WebmChunkDescriptor::continuation|.
+  void MarkContinuation() { open_chunk_.info.continuation = true; }
+
+  // Returns the number of bytes in the open block.
+  int64 open_chunk_size() const {
+    return static_cast<int64>(open_chunk_.data.size());
+  }
+
+  // Returns true and writes the length of the oldest complete chunk to
+  // |ptr_chunk_length| when a complete chunk is buffered.
+  bool ChunkReady(int32* ptr_chunk_length) const;
+
+  // Copies the oldest complete chunk to |ptr_buf| and discards it. Returns
+  // false when no chunk is ready or |buffer_capacity| is too small.
+  bool ReadChunk(int32 buffer_capacity, uint8* ptr_buf);
+
+  // Swaps the oldest complete chunk into |ptr_block| without copying, and
+  // copies its timing to |ptr_info|. When a frame of the following chunk has
+  // been recorded, |ptr_info->end_timestamp| is that chunk's start, so that
+  // chunk durations add up to the stream duration. The storage previously held
+  // by |ptr_block| is released to the pool. Returns false when no chunk is
+  // ready.
+  bool DetachChunk(Block* ptr_block, ChunkInfo* ptr_info);
+
+  // Returns true and stores the data written since the last call in
+  // |ptr_data| when there is chunk data to stream. Data of the oldest chunk
+  // not completely streamed is returned first. Returns false when streaming
+  // is disabled or all data has been streamed.
+  bool ReadStreamData(StreamData* ptr_data);
+
+  // Enables streaming mode. Must be called before the first |Write()|.
+  void set_streaming(bool streaming) { streaming_ = streaming; }
+
+  // Returns total bytes held in complete chunks and the open block.
+  int64 bytes_buffered() const { return bytes_buffered_; }
+
+  // Returns the number of chunks closed by |CloseChunk()|.
+  int64 chunks_closed() const { return chunks_closed_; }
+
+  // Returns the total and the largest time from |CloseChunk()| until a
+  // chunk was read or detached, in microseconds.
+  int64 read_latency_us() const { return read_latency_us_; }
+  int64 max_read_latency_us() const { return max_read_latency_us_; }
+
+  // Reports the change in |bytes_buffered()| since the last call to
+  // |MemoryAccountant|. Called once per frame and chunk rather than on each
+  // |Write()|, which libwebm calls many times per frame.
+  void UpdateMemoryAccounting();
+
+ private:
+  struct Chunk {
+    Block data;
+    ChunkInfo info;
+  };
+
+  // Releases |block| storage to |pool_|.
+  void RecycleBlock(Block* ptr_block);
+
+  // Adds the time since |info.close_time| to the read latencies.
+  void NoteChunkRead(const ChunkInfo& info);
+
+  std::deque<Chunk> chunks_;
+  Chunk open_chunk_;
+  SharedWebmChunkDataPool pool_;
+
+  // Capacity requested for blocks taken from |pool_|.
+  size_t reserve_size_;
+  int64 bytes_buffered_;
+
+  // |bytes_buffered_| as last reported to |MemoryAccountant|.
+  int64 bytes_accounted_;
+
+  // Total bytes passed to |Write()|.
+  int64 bytes_written_;
+  int64 chunks_closed_;
+  int64 read_latency_us_;
+  int64 max_read_latency_us_;
+
+  // Streaming state: the index in |chunks_| of the chunk being streamed, which
+  // is |chunks_.size()| while streaming |open_chunk_|, and the number of its
+  // bytes already streamed.
+  bool streaming_;
+  size_t stream_chunk_;
+  size_t stream_pos_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(MuxerWriteBuffer);
 };
 
 // WebM muxing object built atop libwebm. Provides buffers containing WebM
@@ -51,6 +212,16 @@ struct VorbisCodecPrivate {
 //
 // Notes:
 // - Only the first chunk written is metadata. All other chunks are clusters.
+//   The muxer keeps the metadata chunk once it has been read, see
+//   |init_segment()|, so that it can be sent again without re-muxing it.
+//
+// - Track UIDs are derived from the track configuration, so muxers with
+//   identically configured tracks write identical metadata chunks.
+//
+// - A muxer can hold several audio and video tracks, for example audio in
+//   several languages, each written through the |TrackHandle| returned when
+//   it is added. The methods without a handle use the first track of the
+//   type. Frames of all tracks are written in timestamp order.
 //
 // - All element size values are set to unknown (an EBML encoded -1).
 //
@@ -63,25 +234,67 @@ struct VorbisCodecPrivate {
 // - Users are responsible for keeping memory usage reasonable by calling
 //   |ChunkReady()| periodically-- when |ChunkReady| returns true,
 //   |ReadChunk()| will return the complete chunk and discard it from the
-//   buffer.
+//   buffer. Each cluster is returned as its own chunk.
+//
+// - With a cluster size limit, a cluster that reaches the limit is ended
+//   at the next frame that would not start a cluster anyway, and the chunk
+//   that follows is marked |WebmChunkDescriptor::continuation|. Segments
+//   still start only at segment boundaries and video keyframes; a segment
+//   is a chunk and the continuations that follow it.
+//
+// - When streaming is enabled, users must also read chunk data as libwebm
+//   writes it via |ReadStreamData()|: a chunk is ready only after all of its
+//   data has been streamed.
 //
 class LiveWebmMuxer {
  public:
-  typedef std::vector<uint8> WriteBuffer;
+  typedef MuxerWriteBuffer WriteBuffer;
+
+  // Identifies a track of the muxer: its track number. Never 0.
+  typedef uint64 TrackHandle;
+
   static const uint64 kTimecodeScale = 1000000;
 
+  // BlockAddID and length of the BlockAdditional that carries the capture
+  // time of a video frame: |VideoFrame::capture_time()| as an 8 byte big
+  // endian integer, in microseconds since the Unix epoch. See
+  // |EnableCaptureTimes()|.
+  static const uint64 kCaptureTimeAddId = 2;
+  static const int kCaptureTimeLength = 8;
+
+  // BlockAddID of the BlockAdditional that carries the temporal layer of a
+  // video frame, |VideoFrame::temporal_layer()|, as one byte. See
+  // |EnableTemporalLayerIds()|.
+  static const uint64 kTemporalLayerAddId = 3;
+
   // Status codes returned by class methods.
   enum {
     // Temporary return code for unimplemented operations.
     kNotImplemented = -200,
 
+    // |SpliceClip()| called with a clip whose codec configuration differs
+    // from the muxer's tracks.
+    kSpliceMismatch = -18,
+
+    // |EnableEncryption()| failed to set up the encryptor.
+    kEncryptionError = -17,
+
+    // Unable to write text cue.
+    kTextWriteError = -16,
+
+    // |WriteTextCue()| called for a track that is not a text track.
+    kNoTextTrack = -15,
+
+    // Addition of a text track to |ptr_segment_| failed.
+    kTextTrackError = -14,
+
     // Unable to write audio buffer.
     kAudioWriteError = -13,
 
     // |WriteAudioBuffer()| called without adding an audio track.
     kNoAudioTrack = -12,
 
-    // Invalid |VorbisCodecPrivate| passed to |AddTrack()|.
+    // Invalid |AudioCodecPrivate| passed to |AddTrack()|.
     kAudioPrivateDataInvalid = -11,
 
     // |AddTrack()| called for audio, but the audio track has already been
@@ -122,23 +335,121 @@ class LiveWebmMuxer {
   ~LiveWebmMuxer();
 
   // Initializes libwebm for muxing in live mode.
-  // Ignores |cluster_duration| when it's less than 1. |muxer_id| is a user data
-  // string that can be used to identify the muxer when using multiple
-  // instances of the muxer.
+  // When |cluster_duration_milliseconds| is greater than 0 a new cluster is
+  // started by the first frame at or after each multiple of it in stream
+  // time, whether or not the frame is a keyframe, so the clusters of muxers
+  // sharing a duration are aligned. libwebm also starts a cluster at every
+  // video keyframe. |muxer_id| is a user data string that can be used to
+  // identify the muxer when using multiple instances of the muxer.
   // Returns |kSuccess| when successful.
   int Init(int32 cluster_duration_milliseconds, const std::string& muxer_id);
 
-  // Adds an audio track to |ptr_segment_| and returns |kSuccess|. Returns
-  // |kAudioTrackAlreadyExists| when the audio track has already been added.
-  // Returns |kAudioTrackError| when adding the track to the segment fails.
+  // As above, and bounds clusters to about |max_cluster_bytes|: once the
+  // open cluster holds that many bytes, the next frame that would not start
+  // a cluster starts one, which continues the segment. A cluster can exceed
+  // the limit by a frame. No limit when |max_cluster_bytes| is 0.
+  int Init(int32 cluster_duration_milliseconds, int32 max_cluster_bytes,
+           const std::string& muxer_id);
+
+  // Enables streaming of chunk data as libwebm writes it. Must be called
+  // after |Init()| and before any track is added. Frames stream whole: a
+  // block's size is written before its data, and libvpx returns every
+  // partition of a frame from the same vpx_codec_encode call, so partition
+  // output would not get the first bytes of a frame out any sooner.
+  void EnableStreaming() { buffer_.set_streaming(true); }
+
+  // Enables capture time watermarks: |WriteVideoFrame()| attaches the
+  // capture time of each frame that has one to its block, in a BlockGroup
+  // with a |kCaptureTimeAddId| BlockAdditional. Players ignore the addition.
+  // Must be called after |Init()| and before the video track is added.
+  void EnableCaptureTimes() { capture_times_ = true; }
+
+  // Enables temporal layer ids: |WriteVideoFrame()| attaches the layer of
+  // each frame above the base layer to its block, in a |kTemporalLayerAddId|
+  // BlockAdditional, so that a packager can remove upper layers without
+  // parsing the bitstream. Blocks without one are in the base layer. A block
+  // holds one BlockAdditional; upper layer frames carry the layer id instead
+  // of the capture time. Must be called after |Init()| and before the video
+  // track is added.
+  void EnableTemporalLayerIds() { temporal_layer_ids_ = true; }
+
+  // Places cluster boundaries where |ptr_schedule| says instead of on the
+  // fixed grid of the cluster duration, and raises the libwebm backstop to
+  // |max_cluster_duration_milliseconds|, the longest duration the schedule
+  // uses. Ignored when the muxer was initialized without a cluster duration.
+  // |ptr_schedule| must outlive the muxer. Must be called before the first
+  // frame is written.
+  void SetSegmentSchedule(SegmentDurationController* ptr_schedule,
+                          int32 max_cluster_duration_milliseconds);
+
+  // Enables WebM encryption of the audio and video tracks with |settings|:
+  // each track gets a ContentEncoding with |settings.key_id|, and each block
+  // is encrypted with AES-128 in counter mode, see |WebmEncryptor|. Text
+  // tracks stay clear. Must be called after |Init()| and before any track is
+  // added. Returns |kEncryptionError| when the encryptor cannot be set up.
+  int EnableEncryption(const EncryptionSettings& settings);
+
+  // Queues |key| as the content key from the next segment on: the next
+  // cluster boundary, video keyframe, or |StartCluster()|. Returns false
+  // without encryption or when |key| is not a valid key. Thread safe.
+  bool RotateEncryptionKey(const std::string& key);
+
+  // Copies the encryption counters to |ptr_stats|. Thread safe. Returns
+  // |kInvalidArg| when encryption is not enabled.
+  int GetEncryptionStats(EncryptionStats* ptr_stats) const;
+
+  // Copies the container statistics to |ptr_stats|, as of the last frame
+  // written or chunk read. Thread safe.
+  void GetMuxerStats(MuxerStats* ptr_stats) const;
+
+  // Replaces the muxer's own chunk buffer pool with |pool|, shared with other
+  // muxers and the sinks of their chunks. Must be called after |Init()|,
+  // before |ReserveChunkSize()| and before any track is added.
+  void SetChunkPool(const SharedWebmChunkDataPool& pool);
+
+  // Keeps the metadata chunk through |ptr_cache|, which is not owned and
+  // must outlive the muxer, so that muxers with identical tracks share one
+  // copy. Must be called before the first chunk is read.
+  void SetInitSegmentCache(InitSegmentCache* ptr_cache) {
+    ptr_init_segments_ = ptr_cache;
+  }
+
+  // Reserves |expected_chunk_size| bytes for each chunk buffer, so that
+  // chunks up to that size are written without growing their storage, and
+  // prefills the chunk buffer pool so that the first chunks are written
+  // without allocating. Must be called after |Init()|.
+  void ReserveChunkSize(int32 expected_chunk_size);
+
+  // Adds an audio track to |ptr_segment_| and returns |kSuccess|. The CodecID
+  // is selected by |codec_private.format|. Returns |kAudioTrackAlreadyExists|
+  // when the audio track has already been added. Returns
+  // |kAudioPrivateDataInvalid| when |codec_private| is empty or not Vorbis or
+  // Opus. Returns |kAudioTrackError| when adding the track to the segment
+  // fails.
+  int AddTrack(const AudioConfig& audio_config,
+               const AudioCodecPrivate& codec_private);
+
+  // Adds an audio track, as above, whether or not one exists, and stores
+  // its handle in |ptr_track|. Never returns |kAudioTrackAlreadyExists|.
   int AddTrack(const AudioConfig& audio_config,
-               const VorbisCodecPrivate& codec_private);
+               const AudioCodecPrivate& codec_private, TrackHandle* ptr_track);
 
-  // Adds a video track to |ptr_segment_|, and returns |kSuccess|. Returns
-  // |kVideoTrackAlreadyExists| when the video track has already been added.
-  // Returns |kVideoTrackError| when adding the track to the segment fails.
+  // Adds a video track to |ptr_segment_|, and returns |kSuccess|. A crop
+  // rectangle in |video_config| is written as the track's PixelCrop and
+  // display size. Returns |kVideoTrackAlreadyExists| when the video track has
+  // already been added. Returns |kVideoTrackError| when adding the track to
+  // the segment fails.
   int AddTrack(const VideoConfig& video_config);
 
+  // Adds a video track, as above, whether or not one exists, and stores
+  // its handle in |ptr_track|. Never returns |kVideoTrackAlreadyExists|.
+  int AddTrack(const VideoConfig& video_config, TrackHandle* ptr_track);
+
+  // Adds a WebVTT text track of |settings.kind| to |ptr_segment_|, stores
+  // its handle in |ptr_track|, and returns |kSuccess|. Returns
+  // |kTextTrackError| when adding the track to the segment fails.
+  int AddTrack(const TextTrackSettings& settings, TrackHandle* ptr_track);
+
   // Flushes any queued frames. Users MUST call this method to ensure that all
   // buffered frames are flushed out of libwebm. To determine if calling
   // |Finalize()| resulted in production of a chunk, call |ChunkReady()| after
@@ -146,16 +457,74 @@ class LiveWebmMuxer {
   // returns without error.
   int Finalize();
 
-  // Writes |vorbis_buffer| to the audio track and returns |kSuccess|. Returns
-  // |kInvalidArg| when |vorbis_buffer| is empty or contains non-Vorbis audio.
-  // Returns |kAudioWriteError| when libwebm returns an error.
-  int WriteAudioBuffer(const AudioBuffer& vorbis_buffer);
-
-  // Writes |vpx_frame| to the video track and returns |kSuccess|. Returns
+  // Writes |audio_buffer| to the audio track and returns |kSuccess|. Returns
+  // |kInvalidArg| when |audio_buffer| is empty or contains audio that is not
+  // Vorbis or Opus. Returns |kAudioWriteError| when libwebm returns an error.
+  int WriteAudioBuffer(const AudioBuffer& audio_buffer);
+
+  // Writes |audio_buffer| to the audio track |track|, as above. Returns
+  // |kNoAudioTrack| when |track| is not an audio track of the muxer.
+  int WriteAudioBuffer(TrackHandle track, const AudioBuffer& audio_buffer);
+
+  // Writes the packets in |batch| to the audio track in order, as
+  // |WriteAudioBuffer()| would one at a time, and returns |kSuccess|. The
+  // track and format are checked once for the batch, which must hold packets
+  // of one format. Stops at the first packet that fails, with the status
+  // |WriteAudioBuffer()| would return.
+  int WriteAudioBuffers(const AudioPacketBatch& batch);
+  int WriteAudioBuffers(TrackHandle track, const AudioPacketBatch& batch);
+
+  // Starts a new cluster, and so a new chunk, at the next frame written.
+  // Does nothing before the first cluster has started.
+  void StartCluster();
+
+  // Writes |vpx_frame| to the video track and returns |kSuccess|. With
+  // |EnableCaptureTimes()|, the frame's capture time is written with it when
+  // |vpx_frame.capture_time()| is not 0. Returns
   // |kInvalidArg| when |vpx_frame| is empty or contains a non-VPx frame.
   // Returns |kVideoWriteError| when libwebm returns an error.
   int WriteVideoFrame(const VideoFrame& vpx_frame);
 
+  // Writes |vpx_frame| to the video track |track|, as above. Returns
+  // |kNoVideoTrack| when |track| is not a video track of the muxer.
+  int WriteVideoFrame(TrackHandle track, const VideoFrame& vpx_frame);
+
+  // Writes |cue| to the text track |track| as a BlockGroup lasting
+  // |cue.duration|, and returns |kSuccess|. |cue.start| must not precede
+  // the last frame written. Returns |kNoTextTrack| when |track| is not a
+  // text track of the muxer, |kInvalidArg| when |cue| has no start time or
+  // duration, and |kTextWriteError| when libwebm returns an error.
+  int WriteTextCue(TrackHandle track, const TextCue& cue);
+
+  // Splices the frames of |clip| into the stream from |start_time|, in
+  // milliseconds, and stores the time the clip ends in |ptr_end_time|. The
+  // clip starts a cluster, and so a segment, of its own; its frames are
+  // written as they were encoded, with timestamps rebased onto
+  // |start_time|, through the cluster grid and encryption of live frames.
+  // Every video track of the muxer receives the clip's video, and every
+  // audio track its audio. Live audio written after the splice is moved
+  // later by the clip's duration. After the splice, live frames before the
+  // end time are dropped, and so is video until each track's next keyframe,
+  // so that live encoding must resume with a forced keyframe. Returns
+  // |kSpliceMismatch| when the clip's codec, frame size, sample rate,
+  // channel count or codec private data differs from a track's, or when
+  // the clip has no video for the muxer's video tracks, |kInvalidArg| when
+  // |start_time| precedes the last frame written or |ptr_end_time| is
+  // NULL, or the status of the write that failed.
+  int SpliceClip(const WebmSpliceClip& clip, int64 start_time,
+                 int64* ptr_end_time);
+
+  // Returns true when |clip| matches the codec configuration of the tracks,
+  // as |SpliceClip()| requires. Logs the difference otherwise.
+  bool CanSplice(const WebmSpliceClip& clip) const;
+
+  // Builds the metadata chunk from the tracks added, without waiting for the
+  // first frame, and stores it in a new |WebmChunk| identified by |id| in
+  // |ptr_chunk|. The data is what libwebm writes once the first frame is;
+  // the muxer still produces its own metadata chunk then. Returns
+  // |kInvalidArg| before a track is added or after a frame is written.
+  int WriteInitSegment(const std::string& id, SharedWebmChunk* ptr_chunk);
+
   // Returns true and writes chunk length to |ptr_chunk_length| when |buffer_|
   // contains a complete WebM chunk.
   bool ChunkReady(int32* ptr_chunk_length);
@@ -165,19 +534,155 @@ class LiveWebmMuxer {
   // |buffer_capacity| is less than |chunk_length|.
   int ReadChunk(int32 buffer_capacity, uint8* ptr_buf);
 
+  // Moves WebM chunk data into a new |WebmChunk| identified by |id| without
+  // copying, and stores it in |ptr_chunk|. The chunk's |WebmChunkDescriptor|
+  // is filled from what the muxer recorded while writing it. The chunk's
+  // storage returns to the muxer's pool once the chunk is released. Returns
+  // |kNoChunkReady| when no chunk is ready. The metadata chunk read this way
+  // is kept as |init_segment()|.
+  int ReadChunk(const std::string& id, SharedWebmChunk* ptr_chunk);
+
+  // Returns the metadata chunk, or NULL before it has been read by
+  // |ReadChunk(const std::string&, SharedWebmChunk*)|. With an
+  // |InitSegmentCache|, the chunk may be another muxer's identical one, and
+  // carry its id.
+  const SharedWebmChunk& init_segment() const { return init_segment_; }
+
+  // Describes the tracks added; equal keys mean identical metadata chunks.
+  const std::string& track_config_key() const { return track_config_key_; }
+
+  // Returns true and stores the chunk data written since the last call in
+  // |ptr_data| when streaming is enabled and data is waiting. The chunk
+  // number of the data is |chunks_streamed()| before the call. Each
+  // chunk is streamed as one or more calls, the last with
+  // |ptr_data->chunk_end| set.
+  bool ReadStreamData(WriteBuffer::StreamData* ptr_data);
+
   // Accessors.
   int64 muxer_time() const { return muxer_time_; }
   int64 chunks_read() const { return chunks_read_; }
+  int64 chunks_streamed() const { return chunks_streamed_; }
+
+  // Number of clusters started, each ending the chunk before it.
+  int64 clusters_started() const { return buffer_.chunks_closed(); }
+
+  // Number of clusters started by the cluster size limit.
+  int64 clusters_split() const { return clusters_split_; }
+
+  // Clips spliced, and live frames dropped after them.
+  int64 splices() const { return splices_; }
+  int64 splice_dropped_frames() const { return splice_dropped_frames_; }
   std::string muxer_id() const { return muxer_id_; }
 
  private:
+  // Starts a new cluster before a frame at |timestamp| when the frame crosses
+  // the next cluster boundary, or, unless |keyframe| is a video keyframe
+  // that starts one anyway, when the open cluster has reached
+  // |max_cluster_bytes_|.
+  void StartClusterIfDue(int64 timestamp, bool keyframe);
+
+  // Marks the open chunk as a continuation when the size limit started a
+  // cluster since |clusters| clusters had been started.
+  void NoteClusterSplit(int64 clusters);
+
+  // Adds the ContentEncoding of |encryptor_| to |ptr_track|. Returns false
+  // when libwebm fails.
+  bool ProtectTrack(mkvmuxer::Track* ptr_track);
+
+  // Replaces |*ptr_data| and |*ptr_length| with the encrypted block when
+  // encryption is enabled. Returns false when encryption fails.
+  bool ProtectFrame(const uint8** ptr_data, int32* ptr_length);
+
+  // Puts a rotated key in use at the start of a segment.
+  void StartEncryptionSegment();
+
+  // Writes a frame of a spliced clip to |track| at |timestamp|, as
+  // |WriteAudioBuffer()| or |WriteVideoFrame()| write live frames.
+  int WriteSpliceFrame(TrackHandle track, bool audio, const uint8* ptr_data,
+                       int32 length, int64 timestamp, bool keyframe);
+
+  // Returns true, and counts the frame, when a live frame of |track| at
+  // |timestamp| must be dropped after a splice: it precedes the end of the
+  // clip, or it is not a keyframe and |track| awaits one.
+  bool DropAfterSplice(TrackHandle track, int64 timestamp, bool keyframe);
+
+  // Records an audio or video frame of |length| bytes at |timestamp| for
+  // the payload and interleave statistics.
+  void NoteFrameWritten(bool audio, int64 timestamp, int32 length);
+
+  // Publishes the counters of |ptr_writer_|, |buffer_| and the muxer to
+  // |stats_|. Called once per frame and chunk.
+  void UpdateStats();
+
   std::unique_ptr<WebmMuxWriter> ptr_writer_;
   std::unique_ptr<mkvmuxer::Segment> ptr_segment_;
+  // First audio and video tracks, used by the methods without a
+  // |TrackHandle|, and all tracks by type, in the order added.
   uint64 audio_track_num_;
   uint64 video_track_num_;
+  std::vector<TrackHandle> audio_tracks_;
+  std::vector<TrackHandle> video_tracks_;
+  std::vector<TrackHandle> text_tracks_;
+
+  // Block payload of the text cue being written.
+  std::string cue_frame_;
   WriteBuffer buffer_;
+  SharedWebmChunkDataPool pool_;
   int64 muxer_time_;
   int64 chunks_read_;
+  int64 chunks_streamed_;
+
+  // Cluster duration, and the stream time at which the next cluster starts,
+  // in milliseconds. |cluster_duration_| is 0 when disabled. Boundaries come
+  // from |ptr_segment_schedule_| when there is one.
+  int64 cluster_duration_;
+  int64 next_cluster_time_;
+  SegmentDurationController* ptr_segment_schedule_;
+
+  // Cluster size limit, 0 when disabled. |split_pending_| is set while a
+  // cluster started by the limit has been requested from libwebm.
+  int64 max_cluster_bytes_;
+  bool split_pending_;
+  int64 clusters_split_;
+
+  // End time of the last clip spliced, the time added to live audio
+  // timestamps for the clips spliced, the video tracks still waiting for
+  // their first live keyframe after the last clip, and the |splices()|
+  // counters.
+  int64 splice_end_time_;
+  int64 splice_audio_shift_;
+  std::vector<TrackHandle> keyframe_pending_tracks_;
+  int64 splices_;
+  int64 splice_dropped_frames_;
+
+  // Frame data passed to libwebm, and the timestamps of the last audio and
+  // video frames, -1 until one is written. See |MuxerStats|.
+  int64 payload_bytes_;
+  int64 last_audio_timestamp_;
+  int64 last_video_timestamp_;
+  int64 audio_interleave_gap_;
+  int64 max_audio_interleave_gap_;
+  int64 video_interleave_gap_;
+  int64 max_video_interleave_gap_;
+
+  // Statistics for |GetMuxerStats()|.
+  MuxerStats stats_;
+  mutable std::mutex stats_mutex_;
+
+  // True when |EnableCaptureTimes()| was called.
+  bool capture_times_;
+
+  // True when |EnableTemporalLayerIds()| was called.
+  bool temporal_layer_ids_;
+
+  // Block encryptor, set by |EnableEncryption()|.
+  std::unique_ptr<WebmEncryptor> encryptor_;
+
+  // Metadata chunk, the cache it is kept through, and the key of the track
+  // configuration it describes.
+  InitSegmentCache* ptr_init_segments_;
+  SharedWebmChunk init_segment_;
+  std::string track_config_key_;
   std::string muxer_id_;
   friend class WebmMuxWriter;
   WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(LiveWebmMuxer);
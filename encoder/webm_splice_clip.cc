@@ -0,0 +1,259 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/webm_splice_clip.h"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <new>
+
+#include "glog/logging.h"
+#include "libwebm/mkvmuxer.hpp"
+#include "libwebm/mkvparser.hpp"
+#include "libwebm/mkvreader.hpp"
+
+namespace webmlive {
+
+namespace {
+
+const int64 kNanosecondsPerMillisecond = 1000000;
+
+bool IsVideoCodec(const char* ptr_codec_id) {
+  return ptr_codec_id &&
+         (!strcmp(ptr_codec_id, mkvmuxer::Tracks::kVp8CodecId) ||
+          !strcmp(ptr_codec_id, mkvmuxer::Tracks::kVp9CodecId));
+}
+
+bool IsAudioCodec(const char* ptr_codec_id) {
+  return ptr_codec_id &&
+         (!strcmp(ptr_codec_id, mkvmuxer::Tracks::kVorbisCodecId) ||
+          !strcmp(ptr_codec_id, mkvmuxer::Tracks::kOpusCodecId));
+}
+
+// Copies the codec configuration of |track| to |ptr_clip_track|.
+void CopyCodecConfig(const mkvparser::Track& track,
+                     WebmSpliceClip::Track* ptr_clip_track) {
+  ptr_clip_track->codec_id = track.GetCodecId();
+  size_t private_length = 0;
+  const unsigned char* const ptr_private =
+      track.GetCodecPrivate(private_length);
+  if (ptr_private && private_length > 0) {
+    ptr_clip_track->codec_private.assign(ptr_private,
+                                         ptr_private + private_length);
+  }
+}
+
+}  // namespace
+
+WebmSpliceClip::WebmSpliceClip() : duration_(0) {
+}
+
+WebmSpliceClip::~WebmSpliceClip() {
+}
+
+int WebmSpliceClip::Load(const std::string& path) {
+  mkvparser::MkvReader reader;
+  if (path.empty() || reader.Open(path.c_str())) {
+    LOG(ERROR) << "cannot open splice clip " << path;
+    return kInvalidArg;
+  }
+  video_ = Track();
+  audio_ = Track();
+  data_.clear();
+  duration_ = 0;
+  path_ = path;
+
+  long long pos = 0;  // NOLINT
+  mkvparser::EBMLHeader ebml_header;
+  if (ebml_header.Parse(&reader, pos) < 0) {
+    LOG(ERROR) << path << " is not an EBML file.";
+    return kParseError;
+  }
+  mkvparser::Segment* ptr_segment = NULL;
+  if (mkvparser::Segment::CreateInstance(&reader, pos, ptr_segment)) {
+    LOG(ERROR) << "cannot find the segment of " << path;
+    return kParseError;
+  }
+  const std::unique_ptr<mkvparser::Segment> segment(ptr_segment);
+  if (segment->Load() < 0) {
+    LOG(ERROR) << "cannot parse the segment of " << path;
+    return kParseError;
+  }
+
+  // The first VPx and first Vorbis or Opus track are kept.
+  const mkvparser::Tracks* const ptr_tracks = segment->GetTracks();
+  long long video_number = 0;  // NOLINT
+  long long audio_number = 0;  // NOLINT
+  const unsigned long track_count =  // NOLINT
+      ptr_tracks ? ptr_tracks->GetTracksCount() : 0;
+  for (unsigned long i = 0; i < track_count; ++i) {  // NOLINT
+    const mkvparser::Track* const ptr_track = ptr_tracks->GetTrackByIndex(i);
+    if (!ptr_track) {
+      continue;
+    }
+    if (ptr_track->GetType() == mkvparser::Track::kVideo && !video_number &&
+        IsVideoCodec(ptr_track->GetCodecId())) {
+      const mkvparser::VideoTrack* const ptr_video =
+          static_cast<const mkvparser::VideoTrack*>(ptr_track);
+      CopyCodecConfig(*ptr_track, &video_);
+      video_.width = static_cast<int32>(ptr_video->GetWidth());
+      video_.height = static_cast<int32>(ptr_video->GetHeight());
+      video_number = ptr_track->GetNumber();
+    } else if (ptr_track->GetType() == mkvparser::Track::kAudio &&
+               !audio_number && IsAudioCodec(ptr_track->GetCodecId())) {
+      const mkvparser::AudioTrack* const ptr_audio =
+          static_cast<const mkvparser::AudioTrack*>(ptr_track);
+      CopyCodecConfig(*ptr_track, &audio_);
+      audio_.sample_rate =
+          static_cast<int32>(ptr_audio->GetSamplingRate() + 0.5);
+      audio_.channels = static_cast<int32>(ptr_audio->GetChannels());
+      audio_number = ptr_track->GetNumber();
+    }
+  }
+  if (!video_number && !audio_number) {
+    LOG(ERROR) << path << " has no VP8, VP9, Vorbis or Opus track.";
+    return kParseError;
+  }
+
+  // Frames are read in file order, which is timestamp order in WebM.
+  int64 first_time = -1;
+  for (const mkvparser::Cluster* ptr_cluster = segment->GetFirst();
+       ptr_cluster && !ptr_cluster->EOS();
+       ptr_cluster = segment->GetNext(ptr_cluster)) {
+    const mkvparser::BlockEntry* ptr_entry = NULL;
+    if (ptr_cluster->GetFirst(ptr_entry) < 0) {
+      LOG(ERROR) << "cannot parse a cluster of " << path;
+      return kParseError;
+    }
+    while (ptr_entry && !ptr_entry->EOS()) {
+      const mkvparser::Block* const ptr_block = ptr_entry->GetBlock();
+      const long long number = ptr_block->GetTrackNumber();  // NOLINT
+      Track* const ptr_track =
+          number == video_number ? &video_ :
+          number == audio_number ? &audio_ : NULL;
+      if (ptr_track) {
+        const int64 time_ns = ptr_block->GetTime(ptr_cluster);
+        if (first_time < 0) {
+          first_time = time_ns;
+        }
+        for (int i = 0; i < ptr_block->GetFrameCount(); ++i) {
+          const mkvparser::Block::Frame& block_frame = ptr_block->GetFrame(i);
+          Frame frame;
+          frame.timestamp =
+              (time_ns - first_time) / kNanosecondsPerMillisecond;
+          frame.offset = data_.size();
+          frame.length = static_cast<int32>(block_frame.len);
+          frame.keyframe = ptr_block->IsKey();
+          if (frame.length <= 0) {
+            continue;
+          }
+          data_.resize(data_.size() + frame.length);
+          if (block_frame.Read(&reader, &data_[frame.offset])) {
+            LOG(ERROR) << "cannot read a frame of " << path;
+            return kParseError;
+          }
+          ptr_track->frames.push_back(frame);
+        }
+      }
+      if (ptr_cluster->GetNext(ptr_entry, ptr_entry) < 0) {
+        LOG(ERROR) << "cannot parse a block of " << path;
+        return kParseError;
+      }
+    }
+  }
+  if (!video_.frames.empty() && !video_.frames[0].keyframe) {
+    LOG(ERROR) << path << " does not start with a video keyframe.";
+    return kParseError;
+  }
+  if (video_.frames.empty() && audio_.frames.empty()) {
+    LOG(ERROR) << path << " holds no frames.";
+    return kParseError;
+  }
+  if (video_.frames.empty()) {
+    video_ = Track();
+  }
+  if (audio_.frames.empty()) {
+    audio_ = Track();
+  }
+  SetFrameDurations(&video_);
+  SetFrameDurations(&audio_);
+  if (!video_.frames.empty()) {
+    duration_ = video_.frames.back().timestamp + video_.frames.back().duration;
+  }
+  if (!audio_.frames.empty()) {
+    duration_ = std::max(duration_, audio_.frames.back().timestamp +
+                                         audio_.frames.back().duration);
+  }
+  // The segment duration covers a last frame that lasts longer than those
+  // before it, as a still slate's does.
+  const int64 segment_duration = segment->GetDuration();
+  if (segment_duration > first_time) {
+    duration_ = std::max(duration_, (segment_duration - first_time) /
+                                        kNanosecondsPerMillisecond);
+  }
+  LOG(INFO) << "splice clip " << path << ": " << video_.frames.size()
+            << " video and " << audio_.frames.size() << " audio frames, "
+            << duration_ << " ms.";
+  return kSuccess;
+}
+
+void WebmSpliceClip::Reset(const std::string& name) {
+  video_ = Track();
+  audio_ = Track();
+  data_.clear();
+  duration_ = 0;
+  path_ = name;
+}
+
+void WebmSpliceClip::SetVideoTrack(const std::string& codec_id, int32 width,
+                                   int32 height) {
+  video_.codec_id = codec_id;
+  video_.width = width;
+  video_.height = height;
+}
+
+void WebmSpliceClip::SetAudioTrack(const std::string& codec_id,
+                                   const std::vector<uint8>& codec_private,
+                                   int32 sample_rate, int32 channels) {
+  audio_.codec_id = codec_id;
+  audio_.codec_private = codec_private;
+  audio_.sample_rate = sample_rate;
+  audio_.channels = channels;
+}
+
+int WebmSpliceClip::AddFrame(bool audio, const uint8* ptr_data, int32 length,
+                             int64 timestamp, int64 duration, bool keyframe) {
+  Track& track = audio ? audio_ : video_;
+  if (track.codec_id.empty() || !ptr_data || length <= 0 ||
+      (!audio && track.frames.empty() && !keyframe)) {
+    LOG(ERROR) << "cannot add frame to clip " << path_;
+    return kInvalidArg;
+  }
+  Frame frame;
+  frame.timestamp = timestamp;
+  frame.duration = duration;
+  frame.offset = data_.size();
+  frame.length = length;
+  frame.keyframe = audio || keyframe;
+  data_.insert(data_.end(), ptr_data, ptr_data + length);
+  track.frames.push_back(frame);
+  duration_ = std::max(duration_, timestamp + duration);
+  return kSuccess;
+}
+
+void WebmSpliceClip::SetFrameDurations(Track* ptr_track) {
+  std::vector<Frame>& frames = ptr_track->frames;
+  for (size_t i = 0; i + 1 < frames.size(); ++i) {
+    frames[i].duration = frames[i + 1].timestamp - frames[i].timestamp;
+  }
+  if (frames.size() > 1) {
+    frames.back().duration = frames[frames.size() - 2].duration;
+  }
+}
+
+}  // namespace webmlive
@@ -0,0 +1,126 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_WEBM_SPLICE_CLIP_H_
+#define WEBMLIVE_ENCODER_WEBM_SPLICE_CLIP_H_
+
+#include <string>
+#include <vector>
+
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+
+namespace webmlive {
+
+// A pre-encoded WebM clip, for example a slate or an ad, held in memory so
+// that |LiveWebmMuxer::SpliceClip()| can write its frames into a live
+// stream without decoding or encoding them. |Load()| parses the clusters of
+// a file and keeps the frames of its first video and first audio track,
+// with their codec configuration. A clip encoded by the caller, such as the
+// |FallbackSlate|, is built in memory with |Reset()|, the track setters and
+// |AddFrame()| instead.
+//
+// Notes:
+// - Frame timestamps are relative to the first frame of the clip, so the
+//   clip starts at 0 whatever its own timeline.
+// - The first video frame must be a keyframe: a splice starts a segment.
+class WebmSpliceClip {
+ public:
+  enum {
+    // The file is not WebM, or has no VP8, VP9, Vorbis or Opus track.
+    kParseError = -3,
+    kNoMemory = -2,
+    kInvalidArg = -1,
+    kSuccess = 0,
+  };
+
+  // A frame of the clip: its timestamp and duration in milliseconds, and
+  // the location of its data in |frame_data()|.
+  struct Frame {
+    Frame() : timestamp(0), duration(0), offset(0), length(0),
+              keyframe(false) {}
+    int64 timestamp;
+    int64 duration;
+    size_t offset;
+    int32 length;
+    bool keyframe;
+  };
+
+  // Codec configuration and frames of a track of the clip. |codec_id| is
+  // empty when the clip has no track of the type.
+  struct Track {
+    Track() : width(0), height(0), sample_rate(0), channels(0) {}
+    std::string codec_id;
+    std::vector<uint8> codec_private;
+    int32 width;
+    int32 height;
+    int32 sample_rate;
+    int32 channels;
+    std::vector<Frame> frames;
+  };
+
+  WebmSpliceClip();
+  ~WebmSpliceClip();
+
+  // Reads the WebM file at |path|. Returns |kSuccess|, |kInvalidArg| when
+  // |path| cannot be opened, |kParseError| when the file cannot be parsed,
+  // has no usable track, or its first video frame is not a keyframe, and
+  // |kNoMemory|.
+  int Load(const std::string& path);
+
+  // Empties the clip, which |path()| then reports as |name|.
+  void Reset(const std::string& name);
+
+  // Set the codec configuration of the video or audio track of a clip built
+  // in memory.
+  void SetVideoTrack(const std::string& codec_id, int32 width, int32 height);
+  void SetAudioTrack(const std::string& codec_id,
+                     const std::vector<uint8>& codec_private,
+                     int32 sample_rate, int32 channels);
+
+  // Appends a copy of the |length| bytes at |ptr_data| to the video or audio
+  // track as a frame at |timestamp| lasting |duration|, and extends
+  // |duration()| to its end. Frames of a track must be added in timestamp
+  // order. Returns |kSuccess|, or |kInvalidArg| when the track has no
+  // codec, the frame is empty, or the first video frame is not a keyframe.
+  int AddFrame(bool audio, const uint8* ptr_data, int32 length,
+               int64 timestamp, int64 duration, bool keyframe);
+
+  // Overrides the end of the clip, for a clip that loops at a fixed length.
+  void set_duration(int64 duration) { duration_ = duration; }
+
+  const Track& video() const { return video_; }
+  const Track& audio() const { return audio_; }
+
+  // Returns the data of |frame|.
+  const uint8* frame_data(const Frame& frame) const {
+    return &data_[frame.offset];
+  }
+
+  // Time from the first frame to the end of the last, in milliseconds.
+  int64 duration() const { return duration_; }
+
+  const std::string& path() const { return path_; }
+
+ private:
+  // Sets the duration of each frame of |ptr_track| from the frame that
+  // follows it; the last frame lasts as long as the one before it.
+  static void SetFrameDurations(Track* ptr_track);
+
+  std::string path_;
+  Track video_;
+  Track audio_;
+
+  // Data of all frames, in file order.
+  std::vector<uint8> data_;
+  int64 duration_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(WebmSpliceClip);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_WEBM_SPLICE_CLIP_H_
@@ -11,6 +11,8 @@
 #include <mmreg.h>
 #include <vfwmsgs.h>
 
+#include "encoder/log_util.h"
+#include "encoder/thread_util.h"
 #include "encoder/win/dshow_util.h"
 #include "encoder/win/media_source_dshow.h"
 #include "encoder/win/media_type_dshow.h"
@@ -139,6 +141,7 @@ HRESULT AudioSinkPin::CheckMediaType(const CMediaType* ptr_media_type) {
 // Calls CBaseInputPin::Receive and then passes |ptr_sample| to
 // |AudioSinkFilter::OnSamplesReceived|.
 HRESULT AudioSinkPin::Receive(IMediaSample* ptr_sample) {
+  ThreadRegistry::RegisterSystemThread("audio_capture");
   CHECK_NOTNULL(m_pFilter);
   CHECK_NOTNULL(ptr_sample);
   AudioSinkFilter* const ptr_filter =
@@ -189,7 +192,9 @@ AudioSinkFilter::AudioSinkFilter(
     : CBaseFilter(ptr_filter_name,
                   ptr_iunknown,
                   &filter_lock_,
-                  CLSID_AudioSinkFilter) {
+                  CLSID_AudioSinkFilter),
+      buffer_period_(0),
+      pending_timestamp_(0) {
   if (!ptr_samples_callback) {
     *ptr_result = E_INVALIDARG;
     return;
@@ -224,6 +229,12 @@ HRESULT AudioSinkFilter::set_config(const AudioConfig& config) {
   return sink_pin_->set_config(config);
 }
 
+void AudioSinkFilter::set_buffer_period(int buffer_period) {
+  CAutoLock lock(&filter_lock_);
+  buffer_period_ = (buffer_period > 0) ? buffer_period : 0;
+  pending_samples_.clear();
+}
+
 // Locks filter and returns AudioSinkPin pointer wrapped by |sink_pin_|.
 CBasePin* AudioSinkFilter::GetPin(int index) {
   CBasePin* ptr_pin = NULL;
@@ -265,7 +276,15 @@ HRESULT AudioSinkFilter::OnSamplesReceived(IMediaSample* ptr_sample) {
   if (hr != VFW_S_NO_STOP_TIME) {
     duration = media_time_to_milliseconds(end_time) - timestamp;
   } else {
-    LOG(WARNING) << "OnSamplesReceived sample has no stop time.";
+    WEBMLIVE_LOG_EVERY_MS(WARNING, kLogIntervalMs)
+        << "OnSamplesReceived sample has no stop time.";
+  }
+
+  const AudioConfig& sink_config = sink_pin_->actual_config_;
+  if (buffer_period_ > 0 && sink_config.block_align > 0 &&
+      sink_config.bytes_per_second > 0) {
+    return DeliverBufferPeriods(sink_config, timestamp, ptr_sample_buffer,
+                                sample_length);
   }
 
   // Copy sample data into |sample_buffer_|.
@@ -280,7 +299,7 @@ HRESULT AudioSinkFilter::OnSamplesReceived(IMediaSample* ptr_sample) {
   }
 
   const AudioConfig& config = sink_pin_->actual_config_;
-  LOG(INFO)
+  WEBMLIVE_HOT_LOG(INFO)
       << "OnSamplesReceived\n"
       << "   format_tag=" << config.format_tag << "\n"
       << "   channels=" << config.channels << "\n"
@@ -303,4 +322,51 @@ HRESULT AudioSinkFilter::OnSamplesReceived(IMediaSample* ptr_sample) {
   return S_OK;
 }
 
+// Lock owned by |AudioSinkPin::Receive|.
+HRESULT AudioSinkFilter::DeliverBufferPeriods(const AudioConfig& config,
+                                              int64 timestamp,
+                                              const uint8* ptr_data,
+                                              int32 length) {
+  // Whole sample frames only, and at least one.
+  const int64 bytes_per_second = config.bytes_per_second;
+  const int32 block_align = config.block_align;
+  int32 period_bytes = static_cast<int32>(
+      bytes_per_second * buffer_period_ / 1000 / block_align) * block_align;
+  if (period_bytes < block_align) {
+    period_bytes = block_align;
+  }
+  const int64 period_duration = period_bytes * 1000 / bytes_per_second;
+
+  // Anchor the pending samples to the newest capture timestamp, so device
+  // clock drift and capture gaps do not accumulate.
+  const int64 pending_bytes = pending_samples_.size();
+  pending_timestamp_ = timestamp - pending_bytes * 1000 / bytes_per_second;
+  pending_samples_.insert(pending_samples_.end(), ptr_data, ptr_data + length);
+
+  size_t offset = 0;
+  while (pending_samples_.size() - offset >=
+         static_cast<size_t>(period_bytes)) {
+    const int status = sample_buffer_.Init(config,
+                                           pending_timestamp_,
+                                           period_duration,
+                                           &pending_samples_[offset],
+                                           period_bytes);
+    if (status) {
+      LOG(ERROR) << "OnSamplesReceived sample buffer init failed: " << status;
+      pending_samples_.clear();
+      return E_FAIL;
+    }
+    const int callback_status =
+        ptr_samples_callback_->OnSamplesReceived(&sample_buffer_);
+    if (callback_status) {
+      LOG(ERROR) << "OnSamplesReceived failed, status=" << callback_status;
+    }
+    offset += period_bytes;
+    pending_timestamp_ += period_duration;
+  }
+  pending_samples_.erase(pending_samples_.begin(),
+                         pending_samples_.begin() + offset);
+  return S_OK;
+}
+
 }  // namespace webmlive
@@ -13,6 +13,7 @@
 #define WEBMLIVE_ENCODER_WIN_AUDIO_SINK_FILTER_H_
 
 #include <memory>
+#include <vector>
 
 // Wrap include of streams.h with include guard used in the file: including the
 // file twice results in the output "STREAMS.H included TWICE" for debug
@@ -126,6 +127,12 @@ class AudioSinkFilter : public CBaseFilter {
   // Sets requested audio configuration and returns S_OK.
   HRESULT set_config(const AudioConfig& config);
 
+  // Sets the length in milliseconds of the |AudioBuffer|s passed to the
+  // callback. Captured samples are split or combined into buffers of that
+  // length. 0 passes each captured sample on as is. Must be called while the
+  // filter is stopped.
+  void set_buffer_period(int buffer_period);
+
   // IUnknown
   DECLARE_IUNKNOWN;
 
@@ -141,9 +148,26 @@ class AudioSinkFilter : public CBaseFilter {
   // Returns S_OK when successful.
   HRESULT OnSamplesReceived(IMediaSample* ptr_sample);
 
+  // Appends |length| bytes at |ptr_data|, captured at |timestamp|, to
+  // |pending_samples_|, and passes each complete |buffer_period_| of samples
+  // to the callback. Returns S_OK when successful.
+  HRESULT DeliverBufferPeriods(const AudioConfig& config,
+                               int64 timestamp,
+                               const uint8* ptr_data,
+                               int32 length);
+
   mutable CCritSec filter_lock_;
   std::unique_ptr<AudioSinkPin> sink_pin_;
   AudioBuffer sample_buffer_;
+
+  // Requested buffer length in milliseconds, or 0.
+  int buffer_period_;
+
+  // Captured samples not yet delivered when |buffer_period_| is non-zero, and
+  // the timestamp of the first of them.
+  std::vector<uint8> pending_samples_;
+  int64 pending_timestamp_;
+
   AudioSamplesCallbackInterface* ptr_samples_callback_;
   WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(AudioSinkFilter);
 
@@ -0,0 +1,400 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/win/d3d11_video_processor.h"
+
+#include <cstdlib>
+#include <cstring>
+
+#include "encoder/win/dshow_util.h"
+#include "glog/logging.h"
+#include "libyuv/convert.h"
+#include "libyuv/convert_from.h"
+
+namespace {
+
+// Frame rate given to the video processor enumerator. It only guides the
+// driver's choice of processing; frames are converted one at a time.
+const UINT kNominalFrameRate = 30;
+
+// Rounds |size| up to a multiple of |kVideoFrameAlignment|, as |VideoFrame|
+// does for the strides of the frames it converts.
+int32 AlignStride(int32 size) {
+  return (size + webmlive::kVideoFrameAlignment - 1) &
+         ~(webmlive::kVideoFrameAlignment - 1);
+}
+
+// Returns the texture format |format| frames are uploaded in.
+DXGI_FORMAT TextureFormat(webmlive::VideoFormat format) {
+  switch (format) {
+    case webmlive::kVideoFormatI420:
+    case webmlive::kVideoFormatYV12:
+    case webmlive::kVideoFormatNV12:
+      return DXGI_FORMAT_NV12;
+    case webmlive::kVideoFormatYUY2:
+    case webmlive::kVideoFormatYUYV:
+      return DXGI_FORMAT_YUY2;
+    case webmlive::kVideoFormatRGBA:
+      return DXGI_FORMAT_B8G8R8A8_UNORM;
+    default:
+      return DXGI_FORMAT_UNKNOWN;
+  }
+}
+
+// Copies |rows| rows of |row_bytes| bytes between buffers with different
+// strides.
+void CopyRows(const uint8* ptr_source, int32 source_stride,
+              uint8* ptr_dest, int32 dest_stride,
+              int32 row_bytes, int32 rows) {
+  for (int32 row = 0; row < rows; ++row) {
+    memcpy(ptr_dest + row * dest_stride, ptr_source + row * source_stride,
+           row_bytes);
+  }
+}
+
+}  // anonymous namespace
+
+namespace webmlive {
+
+D3D11VideoProcessor::D3D11VideoProcessor() {
+}
+
+D3D11VideoProcessor::~D3D11VideoProcessor() {
+}
+
+int D3D11VideoProcessor::Init() {
+  const D3D_FEATURE_LEVEL kFeatureLevels[] = {
+    D3D_FEATURE_LEVEL_11_0,
+    D3D_FEATURE_LEVEL_10_1,
+    D3D_FEATURE_LEVEL_10_0,
+  };
+  ID3D11Device* ptr_device = NULL;
+  ID3D11DeviceContext* ptr_context = NULL;
+  HRESULT hr = D3D11CreateDevice(NULL, D3D_DRIVER_TYPE_HARDWARE, NULL,
+                                 D3D11_CREATE_DEVICE_VIDEO_SUPPORT,
+                                 kFeatureLevels, ARRAYSIZE(kFeatureLevels),
+                                 D3D11_SDK_VERSION, &ptr_device, NULL,
+                                 &ptr_context);
+  if (FAILED(hr)) {
+    LOG(ERROR) << "D3D11CreateDevice failed: " << HRLOG(hr);
+    return kD3DError;
+  }
+  device_.Attach(ptr_device);
+  context_.Attach(ptr_context);
+
+  hr = device_->QueryInterface(IID_PPV_ARGS(&video_device_));
+  if (SUCCEEDED(hr)) {
+    hr = context_->QueryInterface(IID_PPV_ARGS(&video_context_));
+  }
+  if (FAILED(hr)) {
+    LOG(ERROR) << "D3D11 video processing unavailable: " << HRLOG(hr);
+    return kD3DError;
+  }
+  return kSuccess;
+}
+
+bool D3D11VideoProcessor::SupportsFormat(VideoFormat format) {
+  return TextureFormat(format) != DXGI_FORMAT_UNKNOWN;
+}
+
+int D3D11VideoProcessor::Process(const VideoFrame& source, int num_targets,
+                                 const Target* ptr_targets) {
+  if (!video_device_ || num_targets <= 0 || !ptr_targets) {
+    return kInvalidArg;
+  }
+  const VideoConfig& config = source.config();
+  if (!SupportsFormat(config.format) || (config.width & 1) ||
+      (abs(config.height) & 1)) {
+    // The input textures store chroma at half resolution.
+    return kUnsupportedFormat;
+  }
+  if (config.format != input_config_.format ||
+      config.width != input_config_.width ||
+      abs(config.height) != abs(input_config_.height)) {
+    const int status = CreateInput(config);
+    if (status) {
+      return status;
+    }
+  }
+  int status = Upload(source);
+  if (status) {
+    return status;
+  }
+
+  // Convert to every size before reading any of them back, so the GPU works
+  // through all conversions while the CPU waits for the first.
+  // |GetOutput()| appends to |outputs_|; reserving first keeps the pointers
+  // valid.
+  outputs_.reserve(outputs_.size() + num_targets);
+  std::vector<Output*> outputs(num_targets);
+  for (int i = 0; i < num_targets; ++i) {
+    const Target& target = ptr_targets[i];
+    if (!target.ptr_frame || target.width <= 0 || target.height <= 0 ||
+        (target.width & 1) || (target.height & 1)) {
+      return kInvalidArg;
+    }
+    outputs[i] = GetOutput(target.width, target.height);
+    if (!outputs[i]) {
+      return kD3DError;
+    }
+    D3D11_VIDEO_PROCESSOR_STREAM stream = {};
+    stream.Enable = TRUE;
+    stream.pInputSurface = outputs[i]->input_view;
+    const HRESULT hr = video_context_->VideoProcessorBlt(
+        outputs[i]->processor, outputs[i]->output_view, 0, 1, &stream);
+    if (FAILED(hr)) {
+      LOG(ERROR) << "VideoProcessorBlt failed: " << HRLOG(hr);
+      return kD3DError;
+    }
+    context_->CopyResource(outputs[i]->staging, outputs[i]->target);
+  }
+  for (int i = 0; i < num_targets; ++i) {
+    status = ReadOutput(*outputs[i], source, ptr_targets[i].ptr_frame);
+    if (status) {
+      return status;
+    }
+  }
+  return kSuccess;
+}
+
+int D3D11VideoProcessor::CreateInput(const VideoConfig& config) {
+  input_config_ = VideoConfig();
+  outputs_.clear();
+  upload_ = 0;
+  input_ = 0;
+
+  D3D11_TEXTURE2D_DESC desc = {};
+  desc.Width = config.width;
+  desc.Height = abs(config.height);
+  desc.MipLevels = 1;
+  desc.ArraySize = 1;
+  desc.Format = TextureFormat(config.format);
+  desc.SampleDesc.Count = 1;
+  desc.Usage = D3D11_USAGE_STAGING;
+  desc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+  HRESULT hr = device_->CreateTexture2D(&desc, NULL, &upload_);
+  if (SUCCEEDED(hr)) {
+    desc.Usage = D3D11_USAGE_DEFAULT;
+    desc.CPUAccessFlags = 0;
+    hr = device_->CreateTexture2D(&desc, NULL, &input_);
+  }
+  if (FAILED(hr)) {
+    LOG(ERROR) << "cannot create " << desc.Width << "x" << desc.Height
+               << " video processor input: " << HRLOG(hr);
+    upload_ = 0;
+    return kD3DError;
+  }
+  input_config_ = config;
+  return kSuccess;
+}
+
+D3D11VideoProcessor::Output* D3D11VideoProcessor::GetOutput(int32 width,
+                                                            int32 height) {
+  for (size_t i = 0; i < outputs_.size(); ++i) {
+    if (outputs_[i].width == width && outputs_[i].height == height) {
+      return &outputs_[i];
+    }
+  }
+
+  Output output;
+  output.width = width;
+  output.height = height;
+  D3D11_VIDEO_PROCESSOR_CONTENT_DESC content = {};
+  content.InputFrameFormat = D3D11_VIDEO_FRAME_FORMAT_PROGRESSIVE;
+  content.InputFrameRate.Numerator = kNominalFrameRate;
+  content.InputFrameRate.Denominator = 1;
+  content.InputWidth = input_config_.width;
+  content.InputHeight = abs(input_config_.height);
+  content.OutputFrameRate = content.InputFrameRate;
+  content.OutputWidth = width;
+  content.OutputHeight = height;
+  content.Usage = D3D11_VIDEO_USAGE_OPTIMAL_SPEED;
+  HRESULT hr = video_device_->CreateVideoProcessorEnumerator(
+      &content, &output.enumerator);
+  if (FAILED(hr)) {
+    LOG(ERROR) << "CreateVideoProcessorEnumerator failed: " << HRLOG(hr);
+    return NULL;
+  }
+  UINT input_support = 0;
+  UINT output_support = 0;
+  hr = output.enumerator->CheckVideoProcessorFormat(
+      TextureFormat(input_config_.format), &input_support);
+  if (SUCCEEDED(hr)) {
+    hr = output.enumerator->CheckVideoProcessorFormat(DXGI_FORMAT_NV12,
+                                                      &output_support);
+  }
+  if (FAILED(hr) ||
+      !(input_support & D3D11_VIDEO_PROCESSOR_FORMAT_SUPPORT_INPUT) ||
+      !(output_support & D3D11_VIDEO_PROCESSOR_FORMAT_SUPPORT_OUTPUT)) {
+    LOG(ERROR) << "video processor cannot convert format "
+               << input_config_.format << " to NV12.";
+    return NULL;
+  }
+  hr = video_device_->CreateVideoProcessor(output.enumerator, 0,
+                                           &output.processor);
+  if (SUCCEEDED(hr)) {
+    D3D11_VIDEO_PROCESSOR_INPUT_VIEW_DESC input_desc = {};
+    input_desc.ViewDimension = D3D11_VPIV_DIMENSION_TEXTURE2D;
+    hr = video_device_->CreateVideoProcessorInputView(
+        input_, output.enumerator, &input_desc, &output.input_view);
+  }
+  D3D11_TEXTURE2D_DESC desc = {};
+  desc.Width = width;
+  desc.Height = height;
+  desc.MipLevels = 1;
+  desc.ArraySize = 1;
+  desc.Format = DXGI_FORMAT_NV12;
+  desc.SampleDesc.Count = 1;
+  desc.Usage = D3D11_USAGE_DEFAULT;
+  desc.BindFlags = D3D11_BIND_RENDER_TARGET;
+  if (SUCCEEDED(hr)) {
+    hr = device_->CreateTexture2D(&desc, NULL, &output.target);
+  }
+  if (SUCCEEDED(hr)) {
+    D3D11_VIDEO_PROCESSOR_OUTPUT_VIEW_DESC output_desc = {};
+    output_desc.ViewDimension = D3D11_VPOV_DIMENSION_TEXTURE2D;
+    hr = video_device_->CreateVideoProcessorOutputView(
+        output.target, output.enumerator, &output_desc, &output.output_view);
+  }
+  if (SUCCEEDED(hr)) {
+    desc.Usage = D3D11_USAGE_STAGING;
+    desc.BindFlags = 0;
+    desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+    hr = device_->CreateTexture2D(&desc, NULL, &output.staging);
+  }
+  if (FAILED(hr)) {
+    LOG(ERROR) << "cannot create " << width << "x" << height
+               << " video processor output: " << HRLOG(hr);
+    return NULL;
+  }
+
+  // BT.601 limited range in and out, like libyuv. RGB input is full range.
+  // The driver is left no room for enhancements that would make output
+  // differ from the CPU path.
+  D3D11_VIDEO_PROCESSOR_COLOR_SPACE color_space = {};
+  color_space.Nominal_Range = D3D11_VIDEO_PROCESSOR_NOMINAL_RANGE_16_235;
+  ID3D11VideoProcessor* const ptr_processor = output.processor;
+  video_context_->VideoProcessorSetStreamFrameFormat(
+      ptr_processor, 0, D3D11_VIDEO_FRAME_FORMAT_PROGRESSIVE);
+  video_context_->VideoProcessorSetStreamAutoProcessingMode(ptr_processor, 0,
+                                                            FALSE);
+  video_context_->VideoProcessorSetStreamColorSpace(ptr_processor, 0,
+                                                    &color_space);
+  video_context_->VideoProcessorSetOutputColorSpace(ptr_processor,
+                                                    &color_space);
+  outputs_.push_back(output);
+  return &outputs_.back();
+}
+
+int D3D11VideoProcessor::Upload(const VideoFrame& source) {
+  const VideoConfig& config = source.config();
+  const int32 width = config.width;
+  const int32 height = abs(config.height);
+  D3D11_MAPPED_SUBRESOURCE mapped = {};
+  const HRESULT hr = context_->Map(upload_, 0, D3D11_MAP_WRITE, 0, &mapped);
+  if (FAILED(hr)) {
+    LOG(ERROR) << "cannot map video processor input: " << HRLOG(hr);
+    return kD3DError;
+  }
+  uint8* const ptr_dest = static_cast<uint8*>(mapped.pData);
+  const int32 dest_stride = mapped.RowPitch;
+
+  // NV12 textures store their chroma plane below the luma plane.
+  uint8* const ptr_dest_uv = ptr_dest + dest_stride * height;
+  VideoPlanes planes;
+  int status = kSuccess;
+  switch (config.format) {
+    case kVideoFormatI420:
+    case kVideoFormatYV12:
+      VideoFrame::GetPlanes(config, source.buffer(), &planes);
+      if (libyuv::I420ToNV12(planes.data[0], planes.stride[0],
+                             planes.data[1], planes.stride[1],
+                             planes.data[2], planes.stride[2],
+                             ptr_dest, dest_stride,
+                             ptr_dest_uv, dest_stride,
+                             width, height)) {
+        status = kUnsupportedFormat;
+      }
+      break;
+    case kVideoFormatNV12:
+      VideoFrame::GetPlanes(config, source.buffer(), &planes);
+      CopyRows(planes.data[0], planes.stride[0], ptr_dest, dest_stride,
+               width, height);
+      CopyRows(planes.data[1], planes.stride[1], ptr_dest_uv, dest_stride,
+               width, height / 2);
+      break;
+    case kVideoFormatYUY2:
+    case kVideoFormatYUYV:
+      CopyRows(source.buffer(), config.stride, ptr_dest, dest_stride,
+               width * 2, height);
+      break;
+    case kVideoFormatRGBA:
+      if (config.height > 0) {
+        // Bottom-up, like all DirectShow RGB frames: flip while copying.
+        CopyRows(source.buffer() + config.stride * (height - 1),
+                 -config.stride, ptr_dest, dest_stride, width * 4, height);
+      } else {
+        CopyRows(source.buffer(), config.stride, ptr_dest, dest_stride,
+                 width * 4, height);
+      }
+      break;
+    default:
+      status = kUnsupportedFormat;
+  }
+  context_->Unmap(upload_, 0);
+  if (status == kSuccess) {
+    context_->CopyResource(input_, upload_);
+  }
+  return status;
+}
+
+int D3D11VideoProcessor::ReadOutput(const Output& output,
+                                    const VideoFrame& source,
+                                    VideoFrame* ptr_frame) {
+  // Same layout as the frames |VideoFrame| converts and scales.
+  VideoConfig config;
+  config.format = kVideoFormatI420;
+  config.width = output.width;
+  config.height = output.height;
+  config.stride = AlignStride(output.width);
+  config.uv_stride = config.stride / 2;
+  const int32 frame_size =
+      VideoFrame::I420BufferSize(output.width, output.height);
+  if (ptr_frame->Reserve(frame_size)) {
+    return kNoMemory;
+  }
+  int status = ptr_frame->InitInPlace(config, source.keyframe(),
+                                      source.timestamp(), source.duration(),
+                                      frame_size);
+  if (status) {
+    LOG(ERROR) << "video processor frame InitInPlace failed: " << status;
+    return kNoMemory;
+  }
+  ptr_frame->set_capture_time(source.capture_time());
+
+  D3D11_MAPPED_SUBRESOURCE mapped = {};
+  const HRESULT hr =
+      context_->Map(output.staging, 0, D3D11_MAP_READ, 0, &mapped);
+  if (FAILED(hr)) {
+    LOG(ERROR) << "cannot map video processor output: " << HRLOG(hr);
+    return kD3DError;
+  }
+  const uint8* const ptr_y = static_cast<const uint8*>(mapped.pData);
+  const int32 stride = mapped.RowPitch;
+  VideoPlanes planes;
+  VideoFrame::GetPlanes(ptr_frame->config(), ptr_frame->buffer(), &planes);
+  status = libyuv::NV12ToI420(ptr_y, stride,
+                              ptr_y + stride * output.height, stride,
+                              planes.data[0], planes.stride[0],
+                              planes.data[1], planes.stride[1],
+                              planes.data[2], planes.stride[2],
+                              output.width, output.height);
+  context_->Unmap(output.staging, 0);
+  return status ? kD3DError : kSuccess;
+}
+
+}  // namespace webmlive
@@ -0,0 +1,133 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_WIN_D3D11_VIDEO_PROCESSOR_H_
+#define WEBMLIVE_ENCODER_WIN_D3D11_VIDEO_PROCESSOR_H_
+
+#include <comdef.h>
+#include <d3d11.h>
+
+#include <vector>
+
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+#include "encoder/video_encoder.h"
+
+namespace webmlive {
+
+#ifndef COMPTR_TYPEDEF
+// A slightly more brief version of the com_ptr_t definition macro.
+#define COMPTR_TYPEDEF(InterfaceName) \
+  _COM_SMARTPTR_TYPEDEF(InterfaceName, IID_##InterfaceName)
+#endif
+COMPTR_TYPEDEF(ID3D11Device);
+COMPTR_TYPEDEF(ID3D11DeviceContext);
+COMPTR_TYPEDEF(ID3D11Texture2D);
+COMPTR_TYPEDEF(ID3D11VideoContext);
+COMPTR_TYPEDEF(ID3D11VideoDevice);
+COMPTR_TYPEDEF(ID3D11VideoProcessor);
+COMPTR_TYPEDEF(ID3D11VideoProcessorEnumerator);
+COMPTR_TYPEDEF(ID3D11VideoProcessorInputView);
+COMPTR_TYPEDEF(ID3D11VideoProcessorOutputView);
+
+// Colour conversion and scaling with the Direct3D 11 video processor.
+// |Process()| uploads a frame to the GPU once, has the video processor
+// convert it to NV12 at the size of each target, and reads the results back
+// into I420 |VideoFrame|s. All reads are issued after all conversions, so the
+// CPU waits for the GPU once per frame.
+//
+// Notes:
+// - NV12, YUY2 and BGRA frames are uploaded as they are. I420 and YV12
+//   frames have their chroma planes interleaved into NV12 during the upload.
+//   Other formats are not supported; see |SupportsFormat()|.
+// - Output is BT.601 limited range, like libyuv's conversions.
+// - An instance must be used from one thread at a time.
+class D3D11VideoProcessor {
+ public:
+  enum {
+    // |Process()| was passed a frame format the processor cannot upload.
+    kUnsupportedFormat = -4,
+
+    // A Direct3D call failed, or the GPU has no video processor.
+    kD3DError = -3,
+    kNoMemory = -2,
+    kInvalidArg = -1,
+    kSuccess = 0,
+  };
+
+  // Output size of a conversion, and the frame that receives its I420 result.
+  struct Target {
+    int32 width;
+    int32 height;
+    VideoFrame* ptr_frame;
+  };
+
+  D3D11VideoProcessor();
+  ~D3D11VideoProcessor();
+
+  // Creates a video capable Direct3D device on the default adapter. Returns
+  // |kSuccess|, or |kD3DError| when there is no hardware video processor.
+  int Init();
+
+  // Returns true when frames in |format| can be passed to |Process()|.
+  static bool SupportsFormat(VideoFormat format);
+
+  // Converts |source| to I420 at the size of each of the |num_targets|
+  // targets at |ptr_targets|, and stores the results in the target frames
+  // with the timestamps and capture time of |source|. Pipelines are created
+  // on first use and kept for later frames of the same size and format.
+  // Returns |kSuccess|, |kUnsupportedFormat| for formats |SupportsFormat()|
+  // rejects, or |kD3DError| when the GPU fails.
+  int Process(const VideoFrame& source, int num_targets,
+              const Target* ptr_targets);
+
+ private:
+  // Video processor and textures converting the input to one output size.
+  struct Output {
+    Output() : width(0), height(0) {}
+    int32 width;
+    int32 height;
+    ID3D11VideoProcessorEnumeratorPtr enumerator;
+    ID3D11VideoProcessorPtr processor;
+    ID3D11VideoProcessorInputViewPtr input_view;
+    ID3D11Texture2DPtr target;
+    ID3D11VideoProcessorOutputViewPtr output_view;
+    ID3D11Texture2DPtr staging;
+  };
+
+  // Creates |upload_| and |input_| for |config|'s size and format, and drops
+  // the outputs made for the previous input.
+  int CreateInput(const VideoConfig& config);
+
+  // Returns the output for |width|x|height|, created on first use, or NULL
+  // when it cannot be created.
+  Output* GetOutput(int32 width, int32 height);
+
+  // Copies |source| into |upload_|, and then into |input_|.
+  int Upload(const VideoFrame& source);
+
+  // Copies the NV12 staging texture of |output| into |ptr_frame| as I420.
+  int ReadOutput(const Output& output, const VideoFrame& source,
+                 VideoFrame* ptr_frame);
+
+  ID3D11DevicePtr device_;
+  ID3D11DeviceContextPtr context_;
+  ID3D11VideoDevicePtr video_device_;
+  ID3D11VideoContextPtr video_context_;
+
+  // Input format and size of |input_|, and the staging texture frames are
+  // written to before they are copied to it.
+  VideoConfig input_config_;
+  ID3D11Texture2DPtr upload_;
+  ID3D11Texture2DPtr input_;
+  std::vector<Output> outputs_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(D3D11VideoProcessor);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_WIN_D3D11_VIDEO_PROCESSOR_H_
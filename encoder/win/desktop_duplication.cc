@@ -0,0 +1,687 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/win/desktop_duplication.h"
+
+#include <d3dcompiler.h>
+
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <new>
+
+#include "encoder/log_util.h"
+#include "encoder/thread_util.h"
+#include "encoder/win/dshow_util.h"
+#include "glog/logging.h"
+
+namespace {
+
+// Frame rate used when none is requested.
+const double kDefaultFrameRate = 30.0;
+
+// Above this many changed regions, a single bounding region is converted.
+const size_t kMaxChangedRegions = 16;
+
+// Draws a triangle covering the render target, and converts the desktop to
+// BT.601 limited range luma and interleaved chroma. The chroma target is
+// half size, so each chroma sample filters a 2x2 block of desktop pixels.
+const char kConversionShaders[] =
+    "Texture2D desktop : register(t0);\n"
+    "SamplerState desktop_sampler : register(s0);\n"
+    "struct VertexOut {\n"
+    "  float4 position : SV_POSITION;\n"
+    "  float2 uv : TEXCOORD0;\n"
+    "};\n"
+    "VertexOut FullScreenVS(uint id : SV_VertexID) {\n"
+    "  VertexOut output;\n"
+    "  output.uv = float2((id << 1) & 2, id & 2);\n"
+    "  output.position =\n"
+    "      float4(output.uv * float2(2, -2) + float2(-1, 1), 0, 1);\n"
+    "  return output;\n"
+    "}\n"
+    "float LumaPS(VertexOut input) : SV_TARGET {\n"
+    "  float3 rgb = desktop.Sample(desktop_sampler, input.uv).rgb;\n"
+    "  return dot(rgb, float3(0.257, 0.504, 0.098)) + 0.0625;\n"
+    "}\n"
+    "float2 ChromaPS(VertexOut input) : SV_TARGET {\n"
+    "  float3 rgb = desktop.Sample(desktop_sampler, input.uv).rgb;\n"
+    "  return float2(dot(rgb, float3(-0.148, -0.291, 0.439)),\n"
+    "                dot(rgb, float3(0.439, -0.368, -0.071))) + 0.5;\n"
+    "}\n";
+
+// Compiles |entry_point| of |kConversionShaders| for |target|.
+HRESULT CompileShader(const char* entry_point, const char* target,
+                      webmlive::ID3D10BlobPtr* ptr_code) {
+  ID3D10Blob* ptr_blob = NULL;
+  ID3D10Blob* ptr_errors = NULL;
+  const HRESULT hr = D3DCompile(kConversionShaders,
+                                sizeof(kConversionShaders) - 1,
+                                NULL, NULL, NULL, entry_point, target,
+                                D3DCOMPILE_OPTIMIZATION_LEVEL3, 0,
+                                &ptr_blob, &ptr_errors);
+  if (ptr_errors) {
+    LOG(ERROR) << "shader " << entry_point << ": "
+               << static_cast<const char*>(ptr_errors->GetBufferPointer());
+    ptr_errors->Release();
+  }
+  if (SUCCEEDED(hr)) {
+    ptr_code->Attach(ptr_blob);
+  }
+  return hr;
+}
+
+// Returns |value| * |scale_num| / |scale_den|, rounded down or up.
+LONG ScaleCoordinate(LONG value, int32 scale_num, int32 scale_den,
+                     bool round_up) {
+  const int64 scaled = static_cast<int64>(value) * scale_num;
+  return static_cast<LONG>(
+      round_up ? (scaled + scale_den - 1) / scale_den : scaled / scale_den);
+}
+
+// Copies |rows| rows of |row_bytes| bytes between buffers with different
+// strides.
+void CopyRows(const uint8* ptr_source, int32 source_stride,
+              uint8* ptr_dest, int32 dest_stride,
+              int32 row_bytes, int32 rows) {
+  for (int32 row = 0; row < rows; ++row) {
+    memcpy(ptr_dest + row * dest_stride, ptr_source + row * source_stride,
+           row_bytes);
+  }
+}
+
+}  // anonymous namespace
+
+namespace webmlive {
+
+DesktopDuplicationSource::DesktopDuplicationSource()
+    : desktop_width_(0),
+      desktop_height_(0),
+      full_update_(true),
+      have_image_(false),
+      ptr_callback_(NULL),
+      stop_(false),
+      thread_status_(kSuccess) {
+}
+
+DesktopDuplicationSource::~DesktopDuplicationSource() {
+  Stop();
+}
+
+int DesktopDuplicationSource::Init(const VideoConfig& requested_config,
+                                   int output_index,
+                                   VideoFrameCallbackInterface* ptr_callback) {
+  if (!ptr_callback || output_index < 0) {
+    LOG(ERROR) << "DesktopDuplicationSource Init: invalid argument.";
+    return kInvalidArg;
+  }
+  ptr_callback_ = ptr_callback;
+  int status = CreateDevice(output_index);
+  if (status) {
+    return status;
+  }
+  DXGI_OUTPUT_DESC output_desc;
+  HRESULT hr = output_->GetDesc(&output_desc);
+  if (FAILED(hr)) {
+    LOG(ERROR) << "IDXGIOutput GetDesc failed: " << HRLOG(hr);
+    return kD3DError;
+  }
+  const RECT& coords = output_desc.DesktopCoordinates;
+  desktop_width_ = coords.right - coords.left;
+  desktop_height_ = coords.bottom - coords.top;
+
+  // NV12 chroma is subsampled in both directions; keep dimensions even.
+  actual_config_.format = kVideoFormatNV12;
+  actual_config_.width = requested_config.width > 0 ?
+      requested_config.width : desktop_width_;
+  actual_config_.height = requested_config.height > 0 ?
+      requested_config.height : desktop_height_;
+  actual_config_.width &= ~1;
+  actual_config_.height &= ~1;
+  actual_config_.stride = actual_config_.width;
+  actual_config_.uv_stride = 0;
+  actual_config_.frame_rate = requested_config.frame_rate > 0 ?
+      requested_config.frame_rate : kDefaultFrameRate;
+  if (actual_config_.width <= 0 || actual_config_.height <= 0) {
+    LOG(ERROR) << "invalid desktop capture size " << actual_config_.width
+               << "x" << actual_config_.height;
+    return kInvalidArg;
+  }
+
+  status = CreateShaders();
+  if (status) {
+    return status;
+  }
+  status = CreateDuplication();
+  if (status) {
+    return status;
+  }
+  LOG(INFO) << "desktop output " << output_index << ": " << desktop_width_
+            << "x" << desktop_height_ << " captured at "
+            << actual_config_.width << "x" << actual_config_.height << " @ "
+            << actual_config_.frame_rate << " fps";
+  return kSuccess;
+}
+
+int DesktopDuplicationSource::Run() {
+  if (!duplication_ || thread_) {
+    LOG(ERROR) << "DesktopDuplicationSource cannot Run: not Init'd or "
+               << "running.";
+    return kInvalidArg;
+  }
+  stop_ = false;
+  thread_status_ = kSuccess;
+  thread_.reset(
+      new (std::nothrow) std::thread(  // NOLINT
+          std::bind(&DesktopDuplicationSource::CaptureThread, this)));
+  if (!thread_) {
+    LOG(ERROR) << "DesktopDuplicationSource cannot create capture thread.";
+    return kNoMemory;
+  }
+  return kSuccess;
+}
+
+int DesktopDuplicationSource::CheckStatus() const {
+  return thread_status_;
+}
+
+void DesktopDuplicationSource::Stop() {
+  stop_ = true;
+  if (thread_) {
+    thread_->join();
+    thread_.reset();
+  }
+}
+
+int DesktopDuplicationSource::CreateDevice(int output_index) {
+  IDXGIFactory1* ptr_factory = NULL;
+  HRESULT hr = CreateDXGIFactory1(IID_PPV_ARGS(&ptr_factory));
+  if (FAILED(hr)) {
+    LOG(ERROR) << "CreateDXGIFactory1 failed: " << HRLOG(hr);
+    return kD3DError;
+  }
+  IDXGIFactory1Ptr factory(ptr_factory, false);
+
+  // Outputs are numbered across adapters in enumeration order.
+  IDXGIAdapter1Ptr adapter;
+  IDXGIOutputPtr output;
+  int index = 0;
+  IDXGIAdapter1* ptr_adapter = NULL;
+  for (UINT a = 0; !output &&
+       factory->EnumAdapters1(a, &ptr_adapter) != DXGI_ERROR_NOT_FOUND; ++a) {
+    adapter.Attach(ptr_adapter);
+    IDXGIOutput* ptr_output = NULL;
+    for (UINT o = 0;
+         adapter->EnumOutputs(o, &ptr_output) != DXGI_ERROR_NOT_FOUND; ++o) {
+      if (index++ == output_index) {
+        output.Attach(ptr_output);
+        break;
+      }
+      ptr_output->Release();
+    }
+  }
+  if (!output) {
+    LOG(ERROR) << "desktop output " << output_index << " not found.";
+    return kNoOutput;
+  }
+  hr = output->QueryInterface(IID_PPV_ARGS(&output_));
+  if (FAILED(hr)) {
+    LOG(ERROR) << "IDXGIOutput1 unavailable, Desktop Duplication requires "
+               << "Windows 8: " << HRLOG(hr);
+    return kD3DError;
+  }
+
+  const D3D_FEATURE_LEVEL kFeatureLevels[] = {
+    D3D_FEATURE_LEVEL_11_0,
+    D3D_FEATURE_LEVEL_10_1,
+    D3D_FEATURE_LEVEL_10_0,
+  };
+  ID3D11Device* ptr_device = NULL;
+  ID3D11DeviceContext* ptr_context = NULL;
+  hr = D3D11CreateDevice(adapter, D3D_DRIVER_TYPE_UNKNOWN, NULL, 0,
+                         kFeatureLevels, ARRAYSIZE(kFeatureLevels),
+                         D3D11_SDK_VERSION, &ptr_device, NULL, &ptr_context);
+  if (FAILED(hr)) {
+    LOG(ERROR) << "D3D11CreateDevice failed: " << HRLOG(hr);
+    return kD3DError;
+  }
+  device_.Attach(ptr_device);
+  context_.Attach(ptr_context);
+  return kSuccess;
+}
+
+int DesktopDuplicationSource::CreateDuplication() {
+  duplication_ = 0;
+  IDXGIOutputDuplication* ptr_duplication = NULL;
+  HRESULT hr = output_->DuplicateOutput(device_, &ptr_duplication);
+  if (FAILED(hr)) {
+    // Retried while access is lost, so failures are rate limited.
+    WEBMLIVE_LOG_ERROR_EVERY_MS(kLogIntervalMs)
+        << "DuplicateOutput failed: " << HRLOG(hr);
+    return kD3DError;
+  }
+  duplication_.Attach(ptr_duplication);
+  full_update_ = true;
+
+  if (!luma_target_) {
+    const int32 width = actual_config_.width;
+    const int32 height = actual_config_.height;
+    int status = CreateTarget(width, height, DXGI_FORMAT_R8_UNORM,
+                              &luma_target_, &luma_view_, &luma_staging_);
+    if (status) {
+      return status;
+    }
+    status = CreateTarget(width / 2, height / 2, DXGI_FORMAT_R8G8_UNORM,
+                          &chroma_target_, &chroma_view_, &chroma_staging_);
+    if (status) {
+      return status;
+    }
+  }
+  return kSuccess;
+}
+
+int DesktopDuplicationSource::CreateShaders() {
+  ID3D10BlobPtr code;
+  HRESULT hr = CompileShader("FullScreenVS", "vs_4_0", &code);
+  if (SUCCEEDED(hr)) {
+    hr = device_->CreateVertexShader(code->GetBufferPointer(),
+                                     code->GetBufferSize(), NULL,
+                                     &vertex_shader_);
+  }
+  if (SUCCEEDED(hr)) {
+    code = 0;
+    hr = CompileShader("LumaPS", "ps_4_0", &code);
+  }
+  if (SUCCEEDED(hr)) {
+    hr = device_->CreatePixelShader(code->GetBufferPointer(),
+                                    code->GetBufferSize(), NULL,
+                                    &luma_shader_);
+  }
+  if (SUCCEEDED(hr)) {
+    code = 0;
+    hr = CompileShader("ChromaPS", "ps_4_0", &code);
+  }
+  if (SUCCEEDED(hr)) {
+    hr = device_->CreatePixelShader(code->GetBufferPointer(),
+                                    code->GetBufferSize(), NULL,
+                                    &chroma_shader_);
+  }
+  if (FAILED(hr)) {
+    LOG(ERROR) << "cannot create conversion shaders: " << HRLOG(hr);
+    return kD3DError;
+  }
+
+  D3D11_SAMPLER_DESC sampler_desc = {};
+  sampler_desc.Filter = D3D11_FILTER_MIN_MAG_MIP_LINEAR;
+  sampler_desc.AddressU = D3D11_TEXTURE_ADDRESS_CLAMP;
+  sampler_desc.AddressV = D3D11_TEXTURE_ADDRESS_CLAMP;
+  sampler_desc.AddressW = D3D11_TEXTURE_ADDRESS_CLAMP;
+  sampler_desc.ComparisonFunc = D3D11_COMPARISON_NEVER;
+  sampler_desc.MaxLOD = D3D11_FLOAT32_MAX;
+  hr = device_->CreateSamplerState(&sampler_desc, &sampler_);
+  if (FAILED(hr)) {
+    LOG(ERROR) << "CreateSamplerState failed: " << HRLOG(hr);
+    return kD3DError;
+  }
+
+  // Scissor rectangles limit conversion to the changed regions.
+  D3D11_RASTERIZER_DESC rasterizer_desc = {};
+  rasterizer_desc.FillMode = D3D11_FILL_SOLID;
+  rasterizer_desc.CullMode = D3D11_CULL_NONE;
+  rasterizer_desc.DepthClipEnable = TRUE;
+  rasterizer_desc.ScissorEnable = TRUE;
+  hr = device_->CreateRasterizerState(&rasterizer_desc, &rasterizer_);
+  if (FAILED(hr)) {
+    LOG(ERROR) << "CreateRasterizerState failed: " << HRLOG(hr);
+    return kD3DError;
+  }
+  return kSuccess;
+}
+
+int DesktopDuplicationSource::CreateTarget(int32 width, int32 height,
+                                           DXGI_FORMAT format,
+                                           ID3D11Texture2DPtr* ptr_target,
+                                           ID3D11RenderTargetViewPtr* ptr_view,
+                                           ID3D11Texture2DPtr* ptr_staging) {
+  D3D11_TEXTURE2D_DESC desc = {};
+  desc.Width = width;
+  desc.Height = height;
+  desc.MipLevels = 1;
+  desc.ArraySize = 1;
+  desc.Format = format;
+  desc.SampleDesc.Count = 1;
+  desc.Usage = D3D11_USAGE_DEFAULT;
+  desc.BindFlags = D3D11_BIND_RENDER_TARGET;
+  HRESULT hr = device_->CreateTexture2D(&desc, NULL, &(*ptr_target));
+  if (SUCCEEDED(hr)) {
+    hr = device_->CreateRenderTargetView(*ptr_target, NULL, &(*ptr_view));
+  }
+  if (SUCCEEDED(hr)) {
+    desc.Usage = D3D11_USAGE_STAGING;
+    desc.BindFlags = 0;
+    desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+    hr = device_->CreateTexture2D(&desc, NULL, &(*ptr_staging));
+  }
+  if (FAILED(hr)) {
+    LOG(ERROR) << "cannot create " << width << "x" << height
+               << " conversion target: " << HRLOG(hr);
+    return kD3DError;
+  }
+  return kSuccess;
+}
+
+int DesktopDuplicationSource::UpdateDesktop(UINT timeout_ms) {
+  if (!duplication_) {
+    // Access was lost earlier; the desktop may be available again.
+    if (CreateDuplication()) {
+      Sleep(timeout_ms);
+      return kSuccess;
+    }
+  }
+  DXGI_OUTDUPL_FRAME_INFO frame_info;
+  IDXGIResource* ptr_resource = NULL;
+  HRESULT hr = duplication_->AcquireNextFrame(timeout_ms, &frame_info,
+                                               &ptr_resource);
+  if (hr == DXGI_ERROR_WAIT_TIMEOUT) {
+    return kSuccess;
+  }
+  if (hr == DXGI_ERROR_ACCESS_LOST) {
+    // Mode changes, desktop switches and full screen applications invalidate
+    // the duplication. Keep delivering the last image until it is recreated.
+    LOG(WARNING) << "desktop duplication access lost, recreating.";
+    duplication_ = 0;
+    return kSuccess;
+  }
+  if (FAILED(hr)) {
+    LOG(ERROR) << "AcquireNextFrame failed: " << HRLOG(hr);
+    return kD3DError;
+  }
+  IDXGIResourcePtr resource(ptr_resource, false);
+
+  // A zero |LastPresentTime| means only the mouse pointer changed.
+  int status = kSuccess;
+  if (frame_info.LastPresentTime.QuadPart != 0) {
+    status = ReadChangedRects(frame_info);
+    if (status == kSuccess && !dirty_rects_.empty()) {
+      ID3D11Texture2D* ptr_desktop = NULL;
+      hr = resource->QueryInterface(IID_PPV_ARGS(&ptr_desktop));
+      if (FAILED(hr)) {
+        LOG(ERROR) << "desktop image is not a texture: " << HRLOG(hr);
+        status = kD3DError;
+      } else {
+        ID3D11Texture2DPtr desktop(ptr_desktop, false);
+        status = ConvertRegions(desktop);
+      }
+    }
+  }
+  hr = duplication_->ReleaseFrame();
+  if (FAILED(hr) && hr != DXGI_ERROR_ACCESS_LOST) {
+    LOG(ERROR) << "ReleaseFrame failed: " << HRLOG(hr);
+    return kD3DError;
+  }
+  return status;
+}
+
+int DesktopDuplicationSource::ReadChangedRects(
+    const DXGI_OUTDUPL_FRAME_INFO& frame_info) {
+  dirty_rects_.clear();
+  if (full_update_) {
+    const RECT desktop = {0, 0, desktop_width_, desktop_height_};
+    dirty_rects_.push_back(desktop);
+    return kSuccess;
+  }
+  if (frame_info.TotalMetadataBufferSize == 0) {
+    return kSuccess;
+  }
+  if (metadata_.size() < frame_info.TotalMetadataBufferSize) {
+    metadata_.resize(frame_info.TotalMetadataBufferSize);
+  }
+
+  // Moved regions are already in place in the new desktop image, so their
+  // destinations are converted like dirty regions.
+  UINT move_bytes = 0;
+  HRESULT hr = duplication_->GetFrameMoveRects(
+      static_cast<UINT>(metadata_.size()),
+      reinterpret_cast<DXGI_OUTDUPL_MOVE_RECT*>(&metadata_[0]), &move_bytes);
+  if (FAILED(hr)) {
+    LOG(ERROR) << "GetFrameMoveRects failed: " << HRLOG(hr);
+    return kD3DError;
+  }
+  const DXGI_OUTDUPL_MOVE_RECT* const ptr_moves =
+      reinterpret_cast<const DXGI_OUTDUPL_MOVE_RECT*>(&metadata_[0]);
+  const UINT num_moves = move_bytes / sizeof(DXGI_OUTDUPL_MOVE_RECT);
+  for (UINT i = 0; i < num_moves; ++i) {
+    dirty_rects_.push_back(ptr_moves[i].DestinationRect);
+  }
+
+  UINT dirty_bytes = 0;
+  hr = duplication_->GetFrameDirtyRects(
+      static_cast<UINT>(metadata_.size()),
+      reinterpret_cast<RECT*>(&metadata_[0]), &dirty_bytes);
+  if (FAILED(hr)) {
+    LOG(ERROR) << "GetFrameDirtyRects failed: " << HRLOG(hr);
+    return kD3DError;
+  }
+  const RECT* const ptr_dirty = reinterpret_cast<const RECT*>(&metadata_[0]);
+  const UINT num_dirty = dirty_bytes / sizeof(RECT);
+  dirty_rects_.insert(dirty_rects_.end(), ptr_dirty, ptr_dirty + num_dirty);
+
+  if (dirty_rects_.size() > kMaxChangedRegions) {
+    RECT bounds = dirty_rects_[0];
+    for (size_t i = 1; i < dirty_rects_.size(); ++i) {
+      UnionRect(&bounds, &bounds, &dirty_rects_[i]);
+    }
+    dirty_rects_.assign(1, bounds);
+  }
+  return kSuccess;
+}
+
+int DesktopDuplicationSource::ConvertRegions(ID3D11Texture2D* ptr_desktop) {
+  ID3D11ShaderResourceView* ptr_view = NULL;
+  HRESULT hr = device_->CreateShaderResourceView(ptr_desktop, NULL,
+                                                 &ptr_view);
+  if (FAILED(hr)) {
+    LOG(ERROR) << "CreateShaderResourceView failed: " << HRLOG(hr);
+    return kD3DError;
+  }
+  ID3D11ShaderResourceViewPtr desktop_view(ptr_view, false);
+
+  const int32 width = actual_config_.width;
+  const int32 height = actual_config_.height;
+  const bool scaled = width != desktop_width_ || height != desktop_height_;
+
+  // Map the changed regions to output coordinates. Bounds are rounded to
+  // even values so luma and chroma regions line up, and grown by a pixel
+  // when scaling to cover the reach of the filter.
+  std::vector<D3D11_RECT> regions;
+  regions.reserve(dirty_rects_.size());
+  for (size_t i = 0; i < dirty_rects_.size(); ++i) {
+    const RECT& rect = dirty_rects_[i];
+    D3D11_RECT region;
+    region.left = ScaleCoordinate(rect.left, width, desktop_width_, false);
+    region.top = ScaleCoordinate(rect.top, height, desktop_height_, false);
+    region.right = ScaleCoordinate(rect.right, width, desktop_width_, true);
+    region.bottom =
+        ScaleCoordinate(rect.bottom, height, desktop_height_, true);
+    if (scaled) {
+      --region.left;
+      --region.top;
+      ++region.right;
+      ++region.bottom;
+    }
+    region.left = region.left < 0 ? 0 : region.left & ~1;
+    region.top = region.top < 0 ? 0 : region.top & ~1;
+    region.right = region.right > width ? width : (region.right + 1) & ~1;
+    region.bottom =
+        region.bottom > height ? height : (region.bottom + 1) & ~1;
+    if (region.right > region.left && region.bottom > region.top) {
+      regions.push_back(region);
+    }
+  }
+
+  ID3D11ShaderResourceView* const ptr_views[] = {
+    desktop_view.GetInterfacePtr()
+  };
+  ID3D11SamplerState* const ptr_samplers[] = {sampler_.GetInterfacePtr()};
+  context_->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+  context_->IASetInputLayout(NULL);
+  context_->VSSetShader(vertex_shader_, NULL, 0);
+  context_->PSSetShaderResources(0, 1, ptr_views);
+  context_->PSSetSamplers(0, 1, ptr_samplers);
+  context_->RSSetState(rasterizer_);
+
+  // Luma at full size, then chroma at half size.
+  for (int plane = 0; plane < 2; ++plane) {
+    const int32 shift = plane;
+    ID3D11RenderTargetView* const ptr_target_views[] = {
+      plane == 0 ? luma_view_.GetInterfacePtr() :
+          chroma_view_.GetInterfacePtr()
+    };
+    ID3D11Texture2D* const ptr_target =
+        plane == 0 ? luma_target_ : chroma_target_;
+    ID3D11Texture2D* const ptr_staging =
+        plane == 0 ? luma_staging_ : chroma_staging_;
+    D3D11_VIEWPORT viewport = {};
+    viewport.Width = static_cast<FLOAT>(width >> shift);
+    viewport.Height = static_cast<FLOAT>(height >> shift);
+    viewport.MaxDepth = 1.0f;
+    context_->OMSetRenderTargets(1, ptr_target_views, NULL);
+    context_->RSSetViewports(1, &viewport);
+    context_->PSSetShader(plane == 0 ? luma_shader_ : chroma_shader_,
+                          NULL, 0);
+    for (size_t i = 0; i < regions.size(); ++i) {
+      D3D11_RECT scissor = regions[i];
+      scissor.left >>= shift;
+      scissor.top >>= shift;
+      scissor.right >>= shift;
+      scissor.bottom >>= shift;
+      context_->RSSetScissorRects(1, &scissor);
+      context_->Draw(3, 0);
+
+      // Read back only the converted region; the rest of the staging
+      // texture still holds the previous image.
+      const D3D11_BOX box = {
+        static_cast<UINT>(scissor.left), static_cast<UINT>(scissor.top), 0,
+        static_cast<UINT>(scissor.right), static_cast<UINT>(scissor.bottom), 1
+      };
+      context_->CopySubresourceRegion(ptr_staging, 0, box.left, box.top, 0,
+                                      ptr_target, 0, &box);
+    }
+  }
+
+  // Unbind the desktop image before the frame is released.
+  ID3D11ShaderResourceView* const ptr_null_views[] = {NULL};
+  context_->PSSetShaderResources(0, 1, ptr_null_views);
+  context_->OMSetRenderTargets(0, NULL, NULL);
+
+  if (full_update_ && !regions.empty()) {
+    full_update_ = false;
+    have_image_ = true;
+  }
+  return kSuccess;
+}
+
+int DesktopDuplicationSource::DeliverFrame(int64 timestamp, int64 duration) {
+  const int32 width = actual_config_.width;
+  const int32 height = actual_config_.height;
+  const int32 luma_size = width * height;
+  const int32 frame_size = luma_size + luma_size / 2;
+  if (frame_.Reserve(frame_size)) {
+    return kNoMemory;
+  }
+  uint8* const ptr_luma = frame_.buffer();
+  uint8* const ptr_chroma = ptr_luma + luma_size;
+
+  D3D11_MAPPED_SUBRESOURCE mapped;
+  HRESULT hr = context_->Map(luma_staging_, 0, D3D11_MAP_READ, 0, &mapped);
+  if (FAILED(hr)) {
+    LOG(ERROR) << "luma staging Map failed: " << HRLOG(hr);
+    return kD3DError;
+  }
+  CopyRows(static_cast<const uint8*>(mapped.pData), mapped.RowPitch,
+           ptr_luma, width, width, height);
+  context_->Unmap(luma_staging_, 0);
+
+  hr = context_->Map(chroma_staging_, 0, D3D11_MAP_READ, 0, &mapped);
+  if (FAILED(hr)) {
+    LOG(ERROR) << "chroma staging Map failed: " << HRLOG(hr);
+    return kD3DError;
+  }
+  CopyRows(static_cast<const uint8*>(mapped.pData), mapped.RowPitch,
+           ptr_chroma, width, width, height / 2);
+  context_->Unmap(chroma_staging_, 0);
+
+  int status = frame_.InitInPlace(actual_config_, true, timestamp, duration,
+                                  frame_size);
+  if (status) {
+    LOG(ERROR) << "desktop frame InitInPlace failed: " << status;
+    return status;
+  }
+  status = ptr_callback_->OnVideoFrameReceived(&frame_);
+  if (status && status != VideoFrameCallbackInterface::kDropped) {
+    LOG(ERROR) << "OnVideoFrameReceived failed, status=" << status;
+  }
+  WEBMLIVE_HOT_LOG(INFO) << "desktop frame delivered, timestamp="
+                         << timestamp;
+  return kSuccess;
+}
+
+void DesktopDuplicationSource::CaptureThread() {
+  ScopedThreadRegistration registration("desktop_capture");
+  typedef std::chrono::steady_clock Clock;
+  const std::chrono::microseconds frame_interval(
+      static_cast<int64>(1000000 / actual_config_.frame_rate));
+  const int64 duration_ms =
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+          frame_interval).count();
+  const Clock::time_point start = Clock::now();
+  Clock::time_point next_frame_time = start;
+
+  while (!stop_) {
+    // Collect desktop updates until the next frame is due.
+    const Clock::time_point now = Clock::now();
+    if (now < next_frame_time) {
+      const int64 wait_ms =
+          std::chrono::duration_cast<std::chrono::milliseconds>(
+              next_frame_time - now).count();
+      const int status = UpdateDesktop(static_cast<UINT>(wait_ms));
+      if (status) {
+        thread_status_ = status;
+        break;
+      }
+      continue;
+    }
+
+    if (have_image_) {
+      const int64 timestamp =
+          std::chrono::duration_cast<std::chrono::milliseconds>(
+              next_frame_time - start).count();
+      const int status = DeliverFrame(timestamp, duration_ms);
+      if (status) {
+        thread_status_ = status;
+        break;
+      }
+    } else {
+      // No image yet; poll without waiting for the first desktop frame.
+      const int status = UpdateDesktop(0);
+      if (status) {
+        thread_status_ = status;
+        break;
+      }
+    }
+
+    // Skip frames missed while the thread was delayed, rather than
+    // delivering a burst.
+    next_frame_time += frame_interval;
+    if (Clock::now() > next_frame_time + frame_interval) {
+      next_frame_time = Clock::now() + frame_interval;
+    }
+  }
+  LOG(INFO) << "DesktopDuplicationSource CaptureThread finished.";
+}
+
+}  // namespace webmlive
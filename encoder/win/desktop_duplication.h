@@ -0,0 +1,187 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_WIN_DESKTOP_DUPLICATION_H_
+#define WEBMLIVE_ENCODER_WIN_DESKTOP_DUPLICATION_H_
+
+#include <comdef.h>
+#include <d3d11.h>
+#include <dxgi1_2.h>
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+#include "encoder/video_encoder.h"
+
+namespace webmlive {
+
+#ifndef COMPTR_TYPEDEF
+// A slightly more brief version of the com_ptr_t definition macro.
+#define COMPTR_TYPEDEF(InterfaceName) \
+  _COM_SMARTPTR_TYPEDEF(InterfaceName, IID_##InterfaceName)
+#endif
+COMPTR_TYPEDEF(ID3D10Blob);
+COMPTR_TYPEDEF(ID3D11Device);
+COMPTR_TYPEDEF(ID3D11DeviceContext);
+COMPTR_TYPEDEF(ID3D11PixelShader);
+COMPTR_TYPEDEF(ID3D11RasterizerState);
+COMPTR_TYPEDEF(ID3D11RenderTargetView);
+COMPTR_TYPEDEF(ID3D11SamplerState);
+COMPTR_TYPEDEF(ID3D11ShaderResourceView);
+COMPTR_TYPEDEF(ID3D11Texture2D);
+COMPTR_TYPEDEF(ID3D11VertexShader);
+COMPTR_TYPEDEF(IDXGIAdapter1);
+COMPTR_TYPEDEF(IDXGIFactory1);
+COMPTR_TYPEDEF(IDXGIOutput);
+COMPTR_TYPEDEF(IDXGIOutput1);
+COMPTR_TYPEDEF(IDXGIOutputDuplication);
+COMPTR_TYPEDEF(IDXGIResource);
+
+// Screen capture with DXGI Desktop Duplication. Desktop images stay on the
+// GPU: a pixel shader converts the BGRA desktop to NV12 luma and chroma
+// render targets, scaling to the requested size, and only the regions DXGI
+// reports as dirty or moved are converted and copied back to the CPU.
+// Frames are delivered to a |VideoFrameCallbackInterface| at the configured
+// frame rate from a capture thread; the most recent desktop image is
+// repeated when the desktop has not changed.
+//
+// Notes:
+// - Requires Windows 8 or later, and a Direct3D 10 capable GPU.
+// - The mouse pointer is not drawn, and rotated outputs are captured in
+//   their unrotated orientation.
+class DesktopDuplicationSource {
+ public:
+  enum {
+    // The requested output does not exist.
+    kNoOutput = -4,
+
+    // A Direct3D or DXGI call failed.
+    kD3DError = -3,
+    kNoMemory = -2,
+    kInvalidArg = -1,
+    kSuccess = 0,
+  };
+
+  DesktopDuplicationSource();
+  ~DesktopDuplicationSource();
+
+  // Prepares capture of the desktop output (monitor) at index |output_index|,
+  // counting outputs of all adapters. |requested_config| supplies the output
+  // size, where 0 uses the desktop size, and the frame rate, where 0 uses
+  // 30 frames per second. Frames are passed to |ptr_callback|, which must
+  // outlive the source. Returns |kSuccess| upon success.
+  int Init(const VideoConfig& requested_config,
+           int output_index,
+           VideoFrameCallbackInterface* ptr_callback);
+
+  // Starts the capture thread.
+  int Run();
+
+  // Returns |kSuccess| while capture is running, or the error that stopped
+  // the capture thread.
+  int CheckStatus() const;
+
+  // Stops the capture thread.
+  void Stop();
+
+  // Settings of delivered frames: NV12 at the output size.
+  VideoConfig actual_config() const { return actual_config_; }
+
+ private:
+  // Creates |device_| on the adapter that owns output |output_index|, and
+  // stores the output in |output_|.
+  int CreateDevice(int output_index);
+
+  // Creates |duplication_| for |output_|, and the conversion targets and
+  // staging textures. Called again after DXGI reports loss of access.
+  int CreateDuplication();
+
+  // Compiles the conversion shaders and creates the fixed pipeline state.
+  int CreateShaders();
+
+  // Creates a |width|x|height| render target of |format|, a view of it, and
+  // a staging texture for reading it back.
+  int CreateTarget(int32 width, int32 height, DXGI_FORMAT format,
+                   ID3D11Texture2DPtr* ptr_target,
+                   ID3D11RenderTargetViewPtr* ptr_view,
+                   ID3D11Texture2DPtr* ptr_staging);
+
+  // Waits up to |timeout_ms| for a desktop update, and converts the changed
+  // regions when one arrives.
+  int UpdateDesktop(UINT timeout_ms);
+
+  // Reads the dirty and move rectangles of the current desktop frame into
+  // |dirty_rects_|.
+  int ReadChangedRects(const DXGI_OUTDUPL_FRAME_INFO& frame_info);
+
+  // Converts |dirty_rects_| of |desktop| into the NV12 targets, and copies
+  // the converted regions to the staging textures.
+  int ConvertRegions(ID3D11Texture2D* ptr_desktop);
+
+  // Copies the staging textures into |frame_| and passes it to
+  // |ptr_callback_|.
+  int DeliverFrame(int64 timestamp, int64 duration);
+
+  // Captures and delivers frames until |stop_| is set.
+  void CaptureThread();
+
+  // Direct3D device and immediate context. Used only by the capture thread
+  // once |Run| has been called.
+  ID3D11DevicePtr device_;
+  ID3D11DeviceContextPtr context_;
+  IDXGIOutput1Ptr output_;
+  IDXGIOutputDuplicationPtr duplication_;
+
+  // Conversion pipeline.
+  ID3D11VertexShaderPtr vertex_shader_;
+  ID3D11PixelShaderPtr luma_shader_;
+  ID3D11PixelShaderPtr chroma_shader_;
+  ID3D11SamplerStatePtr sampler_;
+  ID3D11RasterizerStatePtr rasterizer_;
+
+  // NV12 planes: an R8 luma target and an R8G8 chroma target, each with a
+  // staging copy that keeps the last frame between updates.
+  ID3D11Texture2DPtr luma_target_;
+  ID3D11RenderTargetViewPtr luma_view_;
+  ID3D11Texture2DPtr luma_staging_;
+  ID3D11Texture2DPtr chroma_target_;
+  ID3D11RenderTargetViewPtr chroma_view_;
+  ID3D11Texture2DPtr chroma_staging_;
+
+  // Desktop size in pixels.
+  int32 desktop_width_;
+  int32 desktop_height_;
+
+  // Set when the next update must convert the whole desktop.
+  bool full_update_;
+
+  // Set once the staging textures hold a desktop image.
+  bool have_image_;
+
+  // Desktop frame metadata, and the changed regions of the current update
+  // in desktop coordinates.
+  std::vector<uint8> metadata_;
+  std::vector<RECT> dirty_rects_;
+
+  VideoConfig actual_config_;
+  VideoFrame frame_;
+  VideoFrameCallbackInterface* ptr_callback_;
+
+  // Set by |Stop|, and status of the capture thread.
+  std::atomic<bool> stop_;
+  std::atomic<int> thread_status_;
+  std::unique_ptr<std::thread> thread_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(DesktopDuplicationSource);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_WIN_DESKTOP_DUPLICATION_H_
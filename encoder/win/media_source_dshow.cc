@@ -13,15 +13,20 @@
                        // DEFINE_GUID macro.
 #include <vfwmsgs.h>
 
+#include <algorithm>
+#include <chrono>
 #include <memory>
 #include <sstream>
+#include <thread>
 
 #include "encoder/video_encoder.h"
 #include "encoder/webm_encoder.h"
 #include "encoder/win/audio_sink_filter.h"
+#include "encoder/win/desktop_duplication.h"
 #include "encoder/win/dshow_util.h"
 #include "encoder/win/media_type_dshow.h"
 #include "encoder/win/video_sink_filter.h"
+#include "encoder/win/wasapi_audio_capture.h"
 #include "encoder/win/webm_guids.h"
 #include "glog/logging.h"
 
@@ -120,20 +125,30 @@ REFERENCE_TIME seconds_to_media_time(double seconds) {
 
 MediaSourceImpl::MediaSourceImpl()
     : audio_from_video_source_(false),
+      capture_audio_(false),
+      capture_video_(false),
+      capture_desktop_(false),
+      graph_in_use_(false),
+      prefer_compressed_video_(false),
+      audio_api_(WebmEncoderConfig::kAudioSourceDirectShow),
       media_event_handle_(INVALID_HANDLE_VALUE),
       ptr_audio_callback_(NULL),
       ptr_video_callback_(NULL),
       audio_device_index_(0),
-      video_device_index_(0) {
+      video_device_index_(0),
+      use_capture_profiles_(false),
+      audio_buffer_period_(0) {
 }
 
 MediaSourceImpl::~MediaSourceImpl() {
   // Manually release directshow interfaces to avoid problems related to
   // destruction order of com_ptr_t members.
+  wasapi_capture_.reset();
   audio_source_ = 0;
   audio_sink_ = 0;
   video_source_ = 0;
   video_sink_ = 0;
+  cameras_.clear();
   media_event_handle_ = INVALID_HANDLE_VALUE;
   media_control_ = 0;
   media_event_ = 0;
@@ -142,8 +157,30 @@ MediaSourceImpl::~MediaSourceImpl() {
   CoUninitialize();
 }
 
+int MediaSourceImpl::SetCameraCallback(
+    int camera, VideoFrameCallbackInterface* ptr_callback) {
+  if (camera < 0 || !ptr_callback) {
+    LOG(ERROR) << "invalid camera " << camera << " or callback.";
+    return kInvalidArg;
+  }
+  if (cameras_.size() <= static_cast<size_t>(camera)) {
+    cameras_.resize(camera + 1);
+  }
+  cameras_[camera].ptr_callback = ptr_callback;
+  return kSuccess;
+}
+
+VideoConfig MediaSourceImpl::actual_camera_config(int camera) const {
+  if (camera < 0 || static_cast<size_t>(camera) >= cameras_.size()) {
+    return VideoConfig();
+  }
+  return cameras_[camera].actual_config;
+}
+
 // Builds a DirectShow filter graph that looks like this:
 // video source -> video sink
+// Each additional camera adds a video source -> video sink pair.
+// When capturing the desktop, the graph holds only the audio filters.
 int MediaSourceImpl::Init(const WebmEncoderConfig& config,
                           AudioSamplesCallbackInterface* ptr_audio_callback,
                           VideoFrameCallbackInterface* ptr_video_callback) {
@@ -164,61 +201,115 @@ int MediaSourceImpl::Init(const WebmEncoderConfig& config,
   requested_audio_config_ = config.requested_audio_config;
   requested_video_config_ = config.requested_video_config;
   ui_opts_ = config.ui_opts;
+  audio_buffer_period_ = config.audio_buffer_period;
+  prefer_compressed_video_ = config.video_passthrough;
+  use_capture_profiles_ = !config.capture_profile_file.empty() &&
+      capture_profiles_.Load(config.capture_profile_file) ==
+          CaptureProfileCache::kSuccess;
+  capture_audio_ = !config.disable_audio;
+  capture_video_ = !config.disable_video;
+  capture_desktop_ =
+      config.video_source == WebmEncoderConfig::kVideoSourceDesktop;
+  audio_api_ = config.audio_source;
+  if (!config.video_device_name.empty()) {
+    video_device_name_ = string_to_wstring(config.video_device_name);
+  }
+  if (config.video_device_index != kUseDefaultDevice) {
+    video_device_index_ = config.video_device_index;
+  }
+  if (!config.audio_device_name.empty()) {
+    audio_device_name_ = string_to_wstring(config.audio_device_name);
+  }
+  if (config.audio_device_index != kUseDefaultDevice) {
+    audio_device_index_ = config.audio_device_index;
+  } else if (audio_api_ != WebmEncoderConfig::kAudioSourceDirectShow) {
+    // The default WASAPI endpoint is not the first one.
+    audio_device_index_ = kUseDefaultDevice;
+  }
+  if (cameras_.size() != config.video_cameras.size()) {
+    LOG(ERROR) << "camera callbacks do not match the configured cameras.";
+    return kInvalidArg;
+  }
+  for (size_t i = 0; i < cameras_.size(); ++i) {
+    const VideoCameraConfig& camera_config = config.video_cameras[i];
+    Camera& camera = cameras_[i];
+    if (!camera.ptr_callback || capture_desktop_ || !capture_video_) {
+      LOG(ERROR) << "camera " << i + 1 << " cannot be captured.";
+      return kInvalidArg;
+    }
+    if (!camera_config.device_name.empty()) {
+      camera.device_name = string_to_wstring(camera_config.device_name);
+    }
+    // Cameras without a device default to the devices following the
+    // primary one.
+    camera.device_index = camera_config.device_index != kUseDefaultDevice ?
+        camera_config.device_index :
+        video_device_index_ + static_cast<int>(i) + 1;
+  }
   const HRESULT hr = CoInitialize(NULL);
   if (FAILED(hr)) {
     LOG(ERROR) << "CoInitialize failed: " << HRLOG(hr);
     return WebmEncoder::kInitFailed;
   }
+  return BuildGraph();
+}
+
+// Creates the capture filters, or the desktop source, for the streams
+// |Init| enabled, and the graph holding them.
+int MediaSourceImpl::BuildGraph() {
   int status = CreateGraph();
   if (status) {
     LOG(ERROR) << "CreateGraphInterfaces failed: " << status;
     return WebmEncoder::kInitFailed;
   }
-  if (config.disable_video == false) {
-    if (!config.video_device_name.empty()) {
-      video_device_name_ = string_to_wstring(config.video_device_name);
-    }
-    if (config.video_device_index != kUseDefaultDevice) {
-      video_device_index_ = config.video_device_index;
-    }
-    status = CreateVideoSource();
-    if (status) {
-      LOG(ERROR) << "CreateVideoSource failed: " << status;
-      return WebmEncoder::kNoVideoSource;
-    }
-    status = CreateVideoSink();
-    if (status) {
-      LOG(ERROR) << "CreateVideoSink failed: " << status;
-      return WebmEncoder::kNoVideoSource;
-    }
-    status = ConnectVideoSourceToVideoSink();
-    if (status) {
-      LOG(ERROR) << "ConnectVideoSourceToVideoSink failed: " << status;
-      return WebmEncoder::kVideoSinkError;
+  // Desktop capture setup, Direct3D device creation and shader compilation,
+  // does not touch the filter graph; run it while the audio graph is built.
+  // Likewise the audio device is looked up while the video branch is built,
+  // and its filter is added to the graph once the video branch is connected
+  // and has no audio pin of its own.
+  std::thread desktop_thread;
+  int desktop_status = kSuccess;
+  std::thread audio_thread;
+  int audio_lookup_status = kSuccess;
+  const bool audio_graph =
+      capture_audio_ && audio_api_ == WebmEncoderConfig::kAudioSourceDirectShow;
+  if (audio_graph) {
+    const std::wstring device_name = audio_device_name_;
+    const int device_index = audio_device_index_;
+    audio_thread = std::thread(
+        [this, device_name, device_index, &audio_lookup_status]() {
+          audio_lookup_status =
+              FindAudioDevice(device_name, device_index, &audio_device_);
+        });
+  }
+  if (capture_video_) {
+    if (capture_desktop_) {
+      desktop_thread = std::thread([this, &desktop_status]() {
+        desktop_status = CreateDesktopSource();
+      });
+    } else {
+      graph_in_use_ = true;
+      status = CreateVideoGraph();
     }
   }
-  if (config.disable_audio == false) {
-    if (!config.audio_device_name.empty()) {
-      audio_device_name_ = string_to_wstring(config.audio_device_name);
-    }
-    if (config.audio_device_index != kUseDefaultDevice) {
-      audio_device_index_ = config.audio_device_index;
-    }
-    status = CreateAudioSource();
-    if (status) {
-      LOG(ERROR) << "CreateAudioSource failed: " << status;
-      return WebmEncoder::kNoAudioSource;
-    }
-    status = CreateAudioSink();
-    if (status) {
-      LOG(ERROR) << "CreateAudioSink failed: " << status;
-      return WebmEncoder::kNoAudioSource;
-    }
-    status = ConnectAudioSourceToAudioSink();
-    if (status) {
-      LOG(ERROR) << "ConnectAudioSourceToAudioSink failed: " << status;
-      return WebmEncoder::kAudioSinkError;
-    }
+  if (audio_thread.joinable()) {
+    audio_thread.join();
+  }
+  if (audio_graph && status == kSuccess) {
+    graph_in_use_ = true;
+    status = CreateAudioGraph(audio_lookup_status);
+  } else if (capture_audio_ && status == kSuccess) {
+    status = CreateWasapiCapture();
+  }
+  if (desktop_thread.joinable()) {
+    desktop_thread.join();
+  }
+  if (desktop_status) {
+    LOG(ERROR) << "CreateDesktopSource failed: " << desktop_status;
+    return WebmEncoder::kNoVideoSource;
+  }
+  if (status) {
+    return status;
   }
   status = InitGraphControl();
   if (status) {
@@ -228,17 +319,120 @@ int MediaSourceImpl::Init(const WebmEncoderConfig& config,
   return kSuccess;
 }
 
+int MediaSourceImpl::CreateVideoGraph() {
+  int status = CreateVideoSource(kVideoSourceName, video_device_index_,
+                                 &video_device_name_, &video_device_path_,
+                                 &video_source_);
+  if (status) {
+    LOG(ERROR) << "CreateVideoSource failed: " << status;
+    return WebmEncoder::kNoVideoSource;
+  }
+  status = CreateVideoSink(kVideoSinkName, ptr_video_callback_,
+                           &video_sink_);
+  if (status) {
+    LOG(ERROR) << "CreateVideoSink failed: " << status;
+    return WebmEncoder::kNoVideoSource;
+  }
+  status = ConnectVideoSourceToVideoSink(video_source_, video_sink_,
+                                         video_device_path_,
+                                         &actual_video_config_);
+  if (status) {
+    LOG(ERROR) << "ConnectVideoSourceToVideoSink failed: " << status;
+    return WebmEncoder::kVideoSinkError;
+  }
+  return CreateCameraGraphs();
+}
+
+int MediaSourceImpl::CreateAudioGraph(int audio_lookup_status) {
+  int status = CreateAudioSource(audio_lookup_status);
+  if (status) {
+    LOG(ERROR) << "CreateAudioSource failed: " << status;
+    return WebmEncoder::kNoAudioSource;
+  }
+  status = CreateAudioSink();
+  if (status) {
+    LOG(ERROR) << "CreateAudioSink failed: " << status;
+    return WebmEncoder::kNoAudioSource;
+  }
+  status = ConnectAudioSourceToAudioSink();
+  if (status) {
+    LOG(ERROR) << "ConnectAudioSourceToAudioSink failed: " << status;
+    return WebmEncoder::kAudioSinkError;
+  }
+  return kSuccess;
+}
+
+int MediaSourceImpl::CreateWasapiCapture() {
+  wasapi_capture_.reset(new (std::nothrow) WasapiAudioCapture());  // NOLINT
+  if (!wasapi_capture_) {
+    LOG(ERROR) << "cannot create WASAPI capture.";
+    return WebmEncoder::kNoAudioSource;
+  }
+  const bool exclusive =
+      audio_api_ == WebmEncoderConfig::kAudioSourceWasapiExclusive;
+  const int status = wasapi_capture_->Init(
+      audio_device_name_, audio_device_index_, requested_audio_config_,
+      audio_buffer_period_, exclusive, ptr_audio_callback_);
+  if (status == WasapiAudioCapture::kNoDevice) {
+    return WebmEncoder::kNoAudioSource;
+  } else if (status) {
+    LOG(ERROR) << "WASAPI capture Init failed: " << status;
+    return WebmEncoder::kAudioConfigureError;
+  }
+  audio_device_name_ = wasapi_capture_->device_name();
+  actual_audio_config_ = wasapi_capture_->actual_config();
+  return kSuccess;
+}
+
+// Stream time of the graph is the time of its reference clock less the start
+// time the filters were run with.
+int MediaSourceImpl::RunWasapiCapture() {
+  WasapiAudioCapture::StreamTimeFunction stream_time;
+  IReferenceClockPtr clock;
+  IMediaFilterPtr media_filter(graph_builder_);
+  if (graph_in_use_ && video_sink_ && media_filter &&
+      SUCCEEDED(media_filter->GetSyncSource(&clock)) && clock) {
+    const REFERENCE_TIME stream_start =
+        static_cast<VideoSinkFilter*>(video_sink_.GetInterfacePtr())->
+            stream_start();
+    stream_time = [clock, stream_start](REFERENCE_TIME* ptr_time) {
+      REFERENCE_TIME now = 0;
+      if (FAILED(clock->GetTime(&now))) {
+        return false;
+      }
+      *ptr_time = now - stream_start;
+      return true;
+    };
+  }
+  if (wasapi_capture_->Run(stream_time)) {
+    LOG(ERROR) << "WASAPI capture Run failed, cannot run capture!";
+    return WebmEncoder::kRunFailed;
+  }
+  return kSuccess;
+}
+
 // Runs the filter graph via |IMediaControl::Run|. Note that the Run call is
 // asynchronous, and typically returns S_FALSE to report that the run request
 // is in progress but has not completed.
 int MediaSourceImpl::Run() {
   CoInitialize(NULL);
-  HRESULT hr = media_control_->Run();
-  if (FAILED(hr)) {
-    LOG(ERROR) << "media control Run failed, cannot run capture!" << HRLOG(hr);
+  return RunGraph();
+}
+
+int MediaSourceImpl::RunGraph() {
+  if (desktop_source_ && desktop_source_->Run()) {
+    LOG(ERROR) << "desktop source Run failed, cannot run capture!";
     return WebmEncoder::kRunFailed;
   }
-  return kSuccess;
+  if (graph_in_use_) {
+    const HRESULT hr = media_control_->Run();
+    if (FAILED(hr)) {
+      LOG(ERROR) << "media control Run failed, cannot run capture!"
+                 << HRLOG(hr);
+      return WebmEncoder::kRunFailed;
+    }
+  }
+  return wasapi_capture_ ? RunWasapiCapture() : kSuccess;
 }
 
 // Confirms that the filter graph is running via use of |HandleMediaEvent| to
@@ -247,6 +441,18 @@ int MediaSourceImpl::Run() {
 // with code that waits for the transition from |State_Stopped| to
 // |State_Running|.
 int MediaSourceImpl::CheckStatus() {
+  if (desktop_source_ && desktop_source_->CheckStatus()) {
+    LOG(ERROR) << "Desktop capture stopped: "
+               << desktop_source_->CheckStatus();
+    return WebmEncoder::kAVCaptureStopped;
+  }
+  if (wasapi_capture_ && wasapi_capture_->status()) {
+    LOG(ERROR) << "WASAPI capture stopped: " << wasapi_capture_->status();
+    return WebmEncoder::kAVCaptureStopped;
+  }
+  if (!graph_in_use_) {
+    return kSuccess;
+  }
   int status = HandleMediaEvent();
   if (status == kGraphAborted || status == kGraphCompleted) {
     LOG(ERROR) << "Capture graph stopped!";
@@ -257,13 +463,100 @@ int MediaSourceImpl::CheckStatus() {
 
 // Stops the filter graph via call to |IMediaControl::Stop|.
 void MediaSourceImpl::Stop() {
-  const HRESULT hr = media_control_->Stop();
+  StopGraph();
+  CoUninitialize();
+}
+
+void MediaSourceImpl::StopGraph() {
+  // Audio stops first: its timestamps read the graph's clock.
+  if (wasapi_capture_) {
+    wasapi_capture_->Stop();
+  }
+  if (desktop_source_) {
+    desktop_source_->Stop();
+  }
+  if (graph_in_use_ && media_control_) {
+    const HRESULT hr = media_control_->Stop();
+    if (FAILED(hr)) {
+      LOG(ERROR) << "media control Stop failed! error=" << HRLOG(hr);
+    } else {
+      LOG(INFO) << "graph stopping. status=" << HRLOG(hr);
+    }
+  }
+}
+
+// Stops and releases the graph and the desktop source, and builds and runs
+// them again. The devices must come back with the settings they had: the
+// encoders were configured for them.
+int MediaSourceImpl::Restart() {
+  const HRESULT hr = CoInitialize(NULL);
   if (FAILED(hr)) {
-    LOG(ERROR) << "media control Stop failed! error=" << HRLOG(hr);
-  } else {
-    LOG(INFO) << "graph stopping. status=" << HRLOG(hr);
+    LOG(ERROR) << "CoInitialize failed: " << HRLOG(hr);
+    return WebmEncoder::kInitFailed;
+  }
+  const AudioConfig audio_config = actual_audio_config_;
+  const VideoConfig video_config = actual_video_config_;
+  std::vector<VideoConfig> camera_configs;
+  for (size_t i = 0; i < cameras_.size(); ++i) {
+    camera_configs.push_back(cameras_[i].actual_config);
+  }
+  StopGraph();
+  ReleaseGraph();
+  int status = BuildGraph();
+  if (status == kSuccess &&
+      (audio_config.channels != actual_audio_config_.channels ||
+       audio_config.sample_rate != actual_audio_config_.sample_rate ||
+       audio_config.bits_per_sample != actual_audio_config_.bits_per_sample ||
+       video_config.format != actual_video_config_.format ||
+       video_config.width != actual_video_config_.width ||
+       video_config.height != actual_video_config_.height)) {
+    LOG(ERROR) << "capture devices restarted with different settings.";
+    status = WebmEncoder::kAVCaptureStopped;
+  }
+  for (size_t i = 0; status == kSuccess && i < cameras_.size(); ++i) {
+    const VideoConfig& camera_config = cameras_[i].actual_config;
+    if (camera_configs[i].format != camera_config.format ||
+        camera_configs[i].width != camera_config.width ||
+        camera_configs[i].height != camera_config.height) {
+      LOG(ERROR) << "camera " << i + 1 << " restarted with different "
+                 << "settings.";
+      status = WebmEncoder::kAVCaptureStopped;
+    }
+  }
+  if (status == kSuccess) {
+    status = RunGraph();
+  }
+  if (status) {
+    StopGraph();
+    ReleaseGraph();
+    actual_audio_config_ = audio_config;
+    actual_video_config_ = video_config;
+    for (size_t i = 0; i < cameras_.size(); ++i) {
+      cameras_[i].actual_config = camera_configs[i];
+    }
   }
   CoUninitialize();
+  return status;
+}
+
+void MediaSourceImpl::ReleaseGraph() {
+  desktop_source_.reset();
+  wasapi_capture_.reset();
+  audio_source_ = 0;
+  audio_sink_ = 0;
+  video_source_ = 0;
+  video_sink_ = 0;
+  for (size_t i = 0; i < cameras_.size(); ++i) {
+    cameras_[i].source = 0;
+    cameras_[i].sink = 0;
+  }
+  media_event_handle_ = INVALID_HANDLE_VALUE;
+  media_control_ = 0;
+  media_event_ = 0;
+  capture_graph_builder_ = 0;
+  graph_builder_ = 0;
+  audio_from_video_source_ = false;
+  graph_in_use_ = false;
 }
 
 // Creates the graph builder, |graph_builder_|, and capture graph builder,
@@ -288,31 +581,53 @@ int MediaSourceImpl::CreateGraph() {
   return kSuccess;
 }
 
+// Creates |desktop_source_| and copies its frame settings to
+// |actual_video_config_|. The desktop source delivers frames to
+// |ptr_video_callback_| from its own thread once |Run| is called.
+int MediaSourceImpl::CreateDesktopSource() {
+  desktop_source_.reset(
+      new (std::nothrow) DesktopDuplicationSource());  // NOLINT
+  if (!desktop_source_) {
+    LOG(ERROR) << "cannot construct desktop source!";
+    return WebmEncoder::kInitFailed;
+  }
+  const int status = desktop_source_->Init(requested_video_config_,
+                                           video_device_index_,
+                                           ptr_video_callback_);
+  if (status) {
+    LOG(ERROR) << "desktop source Init failed: " << status;
+    desktop_source_.reset();
+    return WebmEncoder::kNoVideoSource;
+  }
+  actual_video_config_ = desktop_source_->actual_config();
+  return kSuccess;
+}
+
 // Uses |CaptureSourceLoader| to find a video capture source.  If successful
 // an instance of the source filter is created and added to the filter graph.
-// Note: the first device found is used unconditionally.
-int MediaSourceImpl::CreateVideoSource() {
+// Enumeration stops at the device requested.
+int MediaSourceImpl::CreateVideoSource(const std::wstring& filter_name,
+                                       int device_index,
+                                       std::wstring* ptr_device_name,
+                                       std::wstring* ptr_device_path,
+                                       IBaseFilterPtr* ptr_source) {
   CaptureSourceLoader loader;
-  int status = loader.Init(CLSID_VideoInputDeviceCategory);
-  if (status) {
+  CaptureSourceInfo device;
+  if (loader.Init(CLSID_VideoInputDeviceCategory) ||
+      loader.FindSource(*ptr_device_name, device_index, &device)) {
     LOG(ERROR) << "no video source!";
     return WebmEncoder::kNoVideoSource;
   }
-  for (int i = 0; i < loader.GetNumSources(); ++i) {
-    LOG(INFO) << "vdev" << i << ": "
-              << wstring_to_string(loader.GetSourceName(i).c_str());
-  }
-  if (video_device_name_.empty()) {
-    video_device_name_ = loader.GetSourceName(video_device_index_);
-  }
-  video_source_ = loader.GetSource(video_device_name_);
-  LOG(INFO) << "Using vdev: " << wstring_to_string(video_device_name_);
-  if (!video_source_) {
+  *ptr_device_name = device.name;
+  *ptr_device_path = device.path;
+  *ptr_source = CaptureSourceLoader::BindSource(device.moniker_name);
+  LOG(INFO) << "Using vdev: " << wstring_to_string(device.name);
+  if (!*ptr_source) {
     LOG(ERROR) << "cannot create video source!";
     return WebmEncoder::kNoVideoSource;
   }
-  const HRESULT hr = graph_builder_->AddFilter(video_source_,
-                                               kVideoSourceName);
+  const HRESULT hr = graph_builder_->AddFilter(*ptr_source,
+                                               filter_name.c_str());
   if (FAILED(hr)) {
     LOG(ERROR) << "cannot add video source to graph." << HRLOG(hr);
     return kCannotAddFilter;
@@ -321,21 +636,23 @@ int MediaSourceImpl::CreateVideoSource() {
   return kSuccess;
 }
 
-int MediaSourceImpl::CreateVideoSink() {
+int MediaSourceImpl::CreateVideoSink(const std::wstring& filter_name,
+                                     VideoFrameCallbackInterface* ptr_callback,
+                                     IBaseFilterPtr* ptr_sink) {
   HRESULT status = E_FAIL;
-  const std::string filter_name = wstring_to_string(kVideoSinkName);
+  const std::string sink_name = wstring_to_string(filter_name);
   VideoSinkFilter* const ptr_filter =
-      new (std::nothrow) VideoSinkFilter(filter_name.c_str(),  // NOLINT
+      new (std::nothrow) VideoSinkFilter(sink_name.c_str(),  // NOLINT
                                          NULL,
-                                         ptr_video_callback_,
+                                         ptr_callback,
                                          &status);
   if (!ptr_filter || FAILED(status)) {
     delete ptr_filter;
     LOG(ERROR) << "VideoSinkFilter construction failed" << HRLOG(status);
     return kVideoSinkCreateError;
   }
-  video_sink_ = ptr_filter;
-  status = graph_builder_->AddFilter(video_sink_, kVideoSinkName);
+  *ptr_sink = ptr_filter;
+  status = graph_builder_->AddFilter(*ptr_sink, filter_name.c_str());
   if (FAILED(status)) {
     LOG(ERROR) << "cannot add video sink to graph" << HRLOG(status);
     return kCannotAddFilter;
@@ -343,9 +660,103 @@ int MediaSourceImpl::CreateVideoSink() {
   return kSuccess;
 }
 
-int MediaSourceImpl::ConnectVideoSourceToVideoSink() {
+void MediaSourceImpl::RankVideoFormats(
+    const IPinPtr& pin, std::vector<VideoFormat>* ptr_formats,
+    std::vector<double>* ptr_costs,
+    std::vector<CaptureMediaType>* ptr_media_types) {
+  // Order of formats of equal rank; lists every |VideoFormat| value.
+  // Passthrough tries the compressed formats first.
+  const VideoFormat kFormatPreference[kVideoFormatCount] = {
+    kVideoFormatI420, kVideoFormatYV12, kVideoFormatNV12, kVideoFormatVP8,
+    kVideoFormatYUY2, kVideoFormatYUYV, kVideoFormatUYVY, kVideoFormatRGB,
+    kVideoFormatRGBA, kVideoFormatMJPG, kVideoFormatVP9,
+  };
+  const VideoFormat kCompressedFormatPreference[kVideoFormatCount] = {
+    kVideoFormatVP8, kVideoFormatVP9, kVideoFormatI420, kVideoFormatYV12,
+    kVideoFormatNV12, kVideoFormatYUY2, kVideoFormatYUYV, kVideoFormatUYVY,
+    kVideoFormatRGB, kVideoFormatRGBA, kVideoFormatMJPG,
+  };
+  const VideoFormat* const preference = prefer_compressed_video_ ?
+      kCompressedFormatPreference : kFormatPreference;
+
+  // Ranks, from best: compressed formats for passthrough, offered formats
+  // matching the request, other offered formats, and the rest.
+  enum { kRankCompressed, kRankMatching, kRankOffered, kRankOther };
+  const VideoConfig& requested = requested_video_config_;
+  std::vector<int> ranks(kVideoFormatCount, kRankOther);
+  std::vector<int> widths(kVideoFormatCount, requested.width);
+  std::vector<int> heights(kVideoFormatCount, requested.height);
+  ptr_media_types->clear();
+  IEnumMediaTypesPtr media_types;
+  if (SUCCEEDED(pin->EnumMediaTypes(&media_types))) {
+    MediaTypePtr media_type;
+    while (media_types->Next(1, media_type.GetPtr(), NULL) == S_OK) {
+      VideoMediaType video_type;
+      VideoFormat format = kVideoFormatI420;
+      if (video_type.Init(*media_type.get()) ||
+          !SubTypeGuidToVideoFormat(media_type.get()->subtype, &format)) {
+        continue;
+      }
+      CaptureMediaType offered;
+      offered.format = format;
+      offered.width = video_type.width();
+      offered.height = video_type.height();
+      offered.frame_rate = video_type.frame_rate();
+      ptr_media_types->push_back(offered);
+      const bool matching =
+          (requested.width == 0 || video_type.width() == requested.width) &&
+          (requested.height == 0 ||
+           video_type.height() == requested.height) &&
+          (requested.frame_rate == 0 ||
+           video_type.frame_rate() >= requested.frame_rate * 0.99);
+      const int rank = matching ? kRankMatching : kRankOffered;
+      if (rank < ranks[format]) {
+        ranks[format] = rank;
+        widths[format] = video_type.width();
+        heights[format] = video_type.height();
+      }
+    }
+  }
+
+  ptr_costs->assign(kVideoFormatCount, 0);
+  ptr_formats->assign(preference, preference + kVideoFormatCount);
+  for (int i = 0; i < kVideoFormatCount; ++i) {
+    const VideoFormat format = static_cast<VideoFormat>(i);
+    const bool compressed =
+        format == kVideoFormatVP8 || format == kVideoFormatVP9;
+    if (compressed && prefer_compressed_video_) {
+      ranks[i] = kRankCompressed;
+    } else if (compressed ||
+               (VideoFrame::NeedsConversion(format) &&
+                !VideoConversionPlan::CanConvert(format))) {
+      ranks[i] = kRankOther;
+    }
+    (*ptr_costs)[i] = EstimateVideoFormatCost(format, widths[i], heights[i]);
+  }
+  const std::vector<double>& costs = *ptr_costs;
+  std::stable_sort(ptr_formats->begin(), ptr_formats->end(),
+                   [&ranks, &costs](VideoFormat a, VideoFormat b) {
+    if (ranks[a] != ranks[b]) {
+      return ranks[a] < ranks[b];
+    }
+    return ranks[a] != kRankOther && costs[a] < costs[b];
+  });
+  std::ostringstream order;
+  for (size_t f = 0; f < ptr_formats->size(); ++f) {
+    const VideoFormat format = (*ptr_formats)[f];
+    order << " " << format << "(" << ranks[format] << ", " << costs[format]
+          << " us)";
+  }
+  LOG(INFO) << "video formats by rank and estimated cost:" << order.str();
+}
+
+int MediaSourceImpl::ConnectVideoSourceToVideoSink(
+    const IBaseFilterPtr& source, const IBaseFilterPtr& sink,
+    const std::wstring& device_path, VideoConfig* ptr_actual_config) {
+  const std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
   PinFinder pin_finder;
-  int status = pin_finder.Init(video_source_);
+  int status = pin_finder.Init(source);
   if (status) {
     LOG(ERROR) << "cannot look for pins on video source!";
     return kVideoConnectError;
@@ -355,7 +766,7 @@ int MediaSourceImpl::ConnectVideoSourceToVideoSink() {
     LOG(ERROR) << "cannot find output pin on video source!";
     return kVideoConnectError;
   }
-  status = pin_finder.Init(video_sink_);
+  status = pin_finder.Init(sink);
   if (status) {
     LOG(ERROR) << "cannot look for pins on video sink!";
     return kVideoConnectError;
@@ -365,19 +776,60 @@ int MediaSourceImpl::ConnectVideoSourceToVideoSink() {
     LOG(ERROR) << "cannot find video input pin on video sink filter!";
     return kVideoConnectError;
   }
-  status = kVideoConnectError;
+
+  // A device connected before goes straight to the format it connected
+  // with, skipping the media type queries some devices are slow to answer.
+  const std::string profile_key = wstring_to_string(device_path);
+  CaptureProfile profile;
+  const bool cached = use_capture_profiles_ &&
+      !ui_opts_.manual_video_config &&
+      capture_profiles_.Find(profile_key, &profile) &&
+      CaptureProfileCache::Matches(profile, requested_video_config_,
+                                   prefer_compressed_video_);
   HRESULT hr = E_FAIL;
-  for (int i = 0; i < kVideoFormatCount && hr != S_OK; ++i) {
-    MediaTypePtr accepted_type;
-    status = ConfigureVideoSource(video_source_pin, i, &accepted_type);
+  bool profile_connected = false;
+  if (cached) {
+    status = ConnectCachedVideoFormat(source, video_source_pin,
+                                      sink_input_pin, profile);
     if (status == kSuccess) {
-      LOG(INFO) << "Format " << i << " configuration OK.";
+      hr = S_OK;
+      profile_connected = true;
+      LOG(INFO) << "Connected " << profile_key << " with its cached format "
+                << profile.format << " in "
+                << std::chrono::duration_cast<std::chrono::milliseconds>(
+                       std::chrono::steady_clock::now() - start).count()
+                << " ms; the full probe took " << profile.startup_ms
+                << " ms.";
     } else {
-      continue;
+      LOG(WARNING) << "cached capture profile of " << profile_key
+                   << " failed, probing the device.";
+    }
+  }
+  std::vector<CaptureMediaType> media_types;
+  if (!profile_connected) {
+    std::vector<VideoFormat> formats;
+    std::vector<double> costs;
+    RankVideoFormats(video_source_pin, &formats, &costs, &media_types);
+    status = kVideoConnectError;
+    for (size_t f = 0; f < formats.size() && hr != S_OK; ++f) {
+      const int i = formats[f];
+      MediaTypePtr accepted_type;
+      status = ConfigureVideoSource(source, video_source_pin, i,
+                                    &accepted_type);
+      if (status == kSuccess) {
+        LOG(INFO) << "Format " << i << " configuration OK.";
+      } else {
+        continue;
+      }
+      hr = graph_builder_->ConnectDirect(video_source_pin, sink_input_pin,
+                                         accepted_type.get());
+      LOG(INFO) << "Format " << i
+                << ((hr == S_OK) ? " connected." : " failed.");
+      if (hr == S_OK) {
+        LOG(INFO) << "capture format " << i << " estimated cost "
+                  << costs[i] << " us per frame.";
+      }
     }
-    hr = graph_builder_->ConnectDirect(video_source_pin, sink_input_pin,
-                                       accepted_type.get());
-    LOG(INFO) << "Format " << i << ((hr == S_OK) ? " connected." : " failed.");
   }
   if (status || hr != S_OK) {
     // All previous connection attempts failed. Try one last time using
@@ -406,11 +858,33 @@ int MediaSourceImpl::ConnectVideoSourceToVideoSink() {
                   << "  width=" << video_format.width() << "\n"
                   << "  height=" << video_format.height() << "\n"
                   << "  stride=" << video_format.stride() << "\n"
-                  << "  frame_rate=" << video_format.frame_rate() << "\n";
-        actual_video_config_.width = video_format.width();
-        actual_video_config_.height = video_format.height();
-        actual_video_config_.stride = video_format.stride();
-        actual_video_config_.frame_rate = video_format.frame_rate();
+                  << "  frame_rate=" << video_format.frame_rate() << "\n"
+                  << "  field_order=" << video_format.field_order() << "\n";
+        ptr_actual_config->width = video_format.width();
+        ptr_actual_config->height = video_format.height();
+        ptr_actual_config->stride = video_format.stride();
+        ptr_actual_config->frame_rate = video_format.frame_rate();
+        ptr_actual_config->field_order = video_format.field_order();
+
+        // Remember what the probe found for the next start.
+        VideoFormat format = kVideoFormatI420;
+        if (use_capture_profiles_ && !profile_connected &&
+            SubTypeGuidToVideoFormat(media_type.subtype, &format)) {
+          profile = CaptureProfile();
+          profile.requested_config = requested_video_config_;
+          profile.passthrough = prefer_compressed_video_;
+          profile.media_types.swap(media_types);
+          profile.format = format;
+          profile.actual_config = *ptr_actual_config;
+          profile.actual_config.format = format;
+          profile.startup_ms =
+              std::chrono::duration_cast<std::chrono::milliseconds>(
+                  std::chrono::steady_clock::now() - start).count();
+          capture_profiles_.Store(profile_key, profile);
+          if (capture_profiles_.Save()) {
+            LOG(WARNING) << "cannot save capture profiles.";
+          }
+        }
       }
     }
     MediaType::FreeMediaTypeData(&media_type);
@@ -418,12 +892,70 @@ int MediaSourceImpl::ConnectVideoSourceToVideoSink() {
   return status;
 }
 
+int MediaSourceImpl::ConnectCachedVideoFormat(const IBaseFilterPtr& source,
+                                              const IPinPtr& pin,
+                                              const IPinPtr& sink_pin,
+                                              const CaptureProfile& profile) {
+  MediaTypePtr accepted_type;
+  int status = ConfigureVideoSource(source, pin, profile.format,
+                                    &accepted_type);
+  if (status) {
+    return status;
+  }
+  const HRESULT hr = graph_builder_->ConnectDirect(pin, sink_pin,
+                                                   accepted_type.get());
+  if (hr != S_OK) {
+    LOG(WARNING) << "cached format " << profile.format << " failed."
+                 << HRLOG(hr);
+    return kVideoConnectError;
+  }
+  return kSuccess;
+}
+
+// Adds the filters of each camera to the graph, named after the primary
+// filters and the camera number. Cameras are configured with the requested
+// video settings of the primary source.
+int MediaSourceImpl::CreateCameraGraphs() {
+  for (size_t i = 0; i < cameras_.size(); ++i) {
+    Camera& camera = cameras_[i];
+    std::wostringstream source_name;
+    source_name << kVideoSourceName << i + 1;
+    std::wostringstream sink_name;
+    sink_name << kVideoSinkName << i + 1;
+    int status = CreateVideoSource(source_name.str(), camera.device_index,
+                                   &camera.device_name, &camera.device_path,
+                                   &camera.source);
+    if (status) {
+      LOG(ERROR) << "CreateVideoSource (camera " << i + 1 << ") failed: "
+                 << status;
+      return WebmEncoder::kNoVideoSource;
+    }
+    status = CreateVideoSink(sink_name.str(), camera.ptr_callback,
+                             &camera.sink);
+    if (status) {
+      LOG(ERROR) << "CreateVideoSink (camera " << i + 1 << ") failed: "
+                 << status;
+      return WebmEncoder::kNoVideoSource;
+    }
+    status = ConnectVideoSourceToVideoSink(camera.source, camera.sink,
+                                           camera.device_path,
+                                           &camera.actual_config);
+    if (status) {
+      LOG(ERROR) << "ConnectVideoSourceToVideoSink (camera " << i + 1
+                 << ") failed: " << status;
+      return WebmEncoder::kVideoSinkError;
+    }
+  }
+  return kSuccess;
+}
+
 // Attempts to configure |video_source_pin| media type through use of user
 // settings stored in |config_.requested_video_config| with |VideoMediaType|
 // to produce an AM_MEDIA_TYPE struct suitable for use with
 // IAMStreamConfig::SetFormat. Returns |kSuccess| upon successful
 // configuration.
-int MediaSourceImpl::ConfigureVideoSource(const IPinPtr& pin,
+int MediaSourceImpl::ConfigureVideoSource(const IBaseFilterPtr& source,
+                                          const IPinPtr& pin,
                                           int sub_type,
                                           MediaTypePtr* ptr_type) {
   if (!ptr_type) {
@@ -437,7 +969,7 @@ int MediaSourceImpl::ConfigureVideoSource(const IPinPtr& pin,
     // with the video sink filter.
     ui_opts_.manual_video_config = false;
     const int status =
-        DoManualFilterConfiguration(video_source_, pin, true, ptr_type);
+        DoManualFilterConfiguration(source, pin, true, ptr_type);
     if (status == kSuccess) {
       LOG(INFO) << "Manual video configuration successful.";
       return kSuccess;
@@ -518,9 +1050,9 @@ int MediaSourceImpl::InitGraphControl() {
 // If there is no audio output pin |CaptureSourceLoader| is used to find an
 // audio capture source.  If successful an instance of the source filter is
 // created and added to the filter graph.
-// Note: in the |CaptureSourceLoader| case, the first device found is used
-// unconditionally.
-int MediaSourceImpl::CreateAudioSource() {
+// The audio capture device was found by |FindAudioDevice()| while the video
+// branch was built.
+int MediaSourceImpl::CreateAudioSource(int audio_lookup_status) {
   // Check for an audio pin on the video source.
   // TODO(tomfinegan): We assume that the user wants to use the audio feed
   //                   exposed by the video capture source. This behavior
@@ -542,22 +1074,14 @@ int MediaSourceImpl::CreateAudioSource() {
     }
   }
 
-  // The video source doesn't have an audio output pin. Find an audio
-  // capture source.
-  CaptureSourceLoader loader;
-  status = loader.Init(CLSID_AudioInputDeviceCategory);
-  if (status) {
+  // The video source doesn't have an audio output pin. Use the audio
+  // capture source found.
+  if (audio_lookup_status) {
     LOG(ERROR) << "no audio source!";
     return WebmEncoder::kNoAudioSource;
   }
-  for (int i = 0; i < loader.GetNumSources(); ++i) {
-    LOG(INFO) << "adev" << i << ": "
-              << wstring_to_string(loader.GetSourceName(i).c_str());
-  }
-  if (audio_device_name_.empty()) {
-    audio_device_name_ = loader.GetSourceName(audio_device_index_);
-  }
-  audio_source_ = loader.GetSource(audio_device_name_);
+  audio_device_name_ = audio_device_.name;
+  audio_source_ = CaptureSourceLoader::BindSource(audio_device_.moniker_name);
   LOG(INFO) << "Using adev: " << wstring_to_string(audio_device_name_);
   if (!audio_source_) {
     LOG(ERROR) << "cannot create audio source!";
@@ -573,6 +1097,27 @@ int MediaSourceImpl::CreateAudioSource() {
   return kSuccess;
 }
 
+int MediaSourceImpl::FindAudioDevice(const std::wstring& device_name,
+                                     int device_index,
+                                     CaptureSourceInfo* ptr_device) const {
+  const HRESULT hr = CoInitialize(NULL);
+  if (FAILED(hr)) {
+    LOG(ERROR) << "CoInitialize failed: " << HRLOG(hr);
+    return WebmEncoder::kNoAudioSource;
+  }
+  int status;
+  {
+    // |loader| releases its enumerator before the apartment is left.
+    CaptureSourceLoader loader;
+    status = loader.Init(CLSID_AudioInputDeviceCategory);
+    if (status == kSuccess) {
+      status = loader.FindSource(device_name, device_index, ptr_device);
+    }
+  }
+  CoUninitialize();
+  return status;
+}
+
 // Configures audio source pin to match user settings.  Attempts to find a
 // matching media type, and uses it if successful. Constructs |AudioMediaType|
 // to configure pin with an AM_MEDIA_TYPE matching the user's settings if no
@@ -650,6 +1195,7 @@ int MediaSourceImpl::CreateAudioSink() {
     LOG(ERROR) << "AudioSinkFilter construction failed" << HRLOG(status);
     return kAudioSinkCreateError;
   }
+  ptr_filter->set_buffer_period(audio_buffer_period_);
   audio_sink_ = ptr_filter;
   status = graph_builder_->AddFilter(audio_sink_, kAudioSinkName);
   if (FAILED(status)) {
@@ -659,6 +1205,49 @@ int MediaSourceImpl::CreateAudioSink() {
   return kSuccess;
 }
 
+void MediaSourceImpl::SuggestAudioBufferSize(const IPinPtr& pin,
+                                             const AM_MEDIA_TYPE& type) {
+  if (audio_buffer_period_ <= 0) {
+    return;
+  }
+  AudioMediaType audio_format;
+  if (audio_format.Init(type) != kSuccess ||
+      audio_format.block_align() == 0) {
+    LOG(WARNING) << "cannot suggest audio buffer size: unknown format.";
+    return;
+  }
+  IAMBufferNegotiationPtr buffer_negotiation(pin);
+  if (!buffer_negotiation) {
+    LOG(WARNING) << "audio source pin does not support IAMBufferNegotiation.";
+    return;
+  }
+
+  // Round the buffer down to whole sample frames. Negative values leave the
+  // other allocator properties to the pin.
+  const int32 block_align = audio_format.block_align();
+  const int64 period_bytes =
+      static_cast<int64>(audio_format.bytes_per_second()) *
+      audio_buffer_period_ / 1000;
+  int32 buffer_size =
+      static_cast<int32>(period_bytes / block_align) * block_align;
+  if (buffer_size < block_align) {
+    buffer_size = block_align;
+  }
+  ALLOCATOR_PROPERTIES properties;
+  properties.cBuffers = -1;
+  properties.cbBuffer = buffer_size;
+  properties.cbAlign = -1;
+  properties.cbPrefix = -1;
+  const HRESULT hr = buffer_negotiation->SuggestAllocatorProperties(
+      &properties);
+  if (FAILED(hr)) {
+    LOG(WARNING) << "SuggestAllocatorProperties failed: " << HRLOG(hr);
+    return;
+  }
+  LOG(INFO) << "suggested audio buffer size " << properties.cbBuffer
+            << " bytes (" << audio_buffer_period_ << " ms).";
+}
+
 int MediaSourceImpl::ConnectAudioSourceToAudioSink() {
   PinFinder pin_finder;
   int status = pin_finder.Init(audio_source_);
@@ -689,6 +1278,7 @@ int MediaSourceImpl::ConnectAudioSourceToAudioSink() {
   status = ConfigureAudioSource(audio_source_pin, &accepted_type);
   if (status == kSuccess) {
     LOG(INFO) << "audio source configuration OK.";
+    SuggestAudioBufferSize(audio_source_pin, *accepted_type.get());
     hr = graph_builder_->ConnectDirect(audio_source_pin, sink_input_pin,
                                        accepted_type.get());
     if (hr == S_OK) {
@@ -798,7 +1388,7 @@ CaptureSourceLoader::CaptureSourceLoader()
 CaptureSourceLoader::~CaptureSourceLoader() {
 }
 
-// Verifies that |source_type| is known and calls |FindAllSources|.
+// Verifies that |source_type| is known and creates |source_enum_|.
 int CaptureSourceLoader::Init(CLSID source_type) {
   if (source_type != CLSID_AudioInputDeviceCategory &&
       source_type != CLSID_VideoInputDeviceCategory) {
@@ -806,12 +1396,6 @@ int CaptureSourceLoader::Init(CLSID source_type) {
     return WebmEncoder::kInvalidArg;
   }
   source_type_ = source_type;
-  return FindAllSources();
-}
-
-// Enumerates input devices of type |source_type_| and adds them to the map of
-// sources, |sources_|.
-int CaptureSourceLoader::FindAllSources() {
   ICreateDevEnumPtr sys_enum;
   HRESULT hr = sys_enum.CreateInstance(CLSID_SystemDeviceEnum);
   if (FAILED(hr)) {
@@ -825,67 +1409,77 @@ int CaptureSourceLoader::FindAllSources() {
     LOG(ERROR) << "moniker creation failed (no devices)." << HRLOG(hr);
     return kNoDeviceFound;
   }
+  return kSuccess;
+}
+
+// Enumerates input devices of type |source_type_| until the one requested.
+// Devices without a name are skipped, and do not count in |index|.
+int CaptureSourceLoader::FindSource(const std::wstring& name, int index,
+                                    CaptureSourceInfo* ptr_info) {
+  if (!source_enum_ || !ptr_info) {
+    return kNoDeviceFound;
+  }
+  HRESULT hr = source_enum_->Reset();
+  if (FAILED(hr)) {
+    LOG(ERROR) << "cannot reset source enumerator!" << HRLOG(hr);
+    return kNoDeviceFound;
+  }
+  const char* const kPrefix =
+      source_type_ == CLSID_AudioInputDeviceCategory ? "adev" : "vdev";
   int source_index = 0;
   for (;;) {
     IMonikerPtr source_moniker;
     hr = source_enum_->Next(1, &source_moniker, NULL);
     if (FAILED(hr) || hr == S_FALSE || !source_moniker) {
-      LOG(INFO) << "Done enumerating sources, found " << source_index
-                << " sources.";
-      break;
+      LOG(ERROR) << "device not found after " << source_index
+                 << " sources!";
+      return kNoDeviceFound;
     }
-    std::wstring name = GetMonikerFriendlyName(source_moniker);
-    if (name.empty()) {
+    const std::wstring source_name = GetMonikerFriendlyName(source_moniker);
+    if (source_name.empty()) {
       LOG(WARNING) << "source=" << source_index << " has no name, skipping.";
       continue;
     }
-    VLOG(4) << "source=" << source_index << " name="
-            << wstring_to_string(name.c_str());
-    sources_[source_index] = name;
+    LOG(INFO) << kPrefix << source_index << ": "
+              << wstring_to_string(source_name.c_str());
+    if (name.empty() ? source_index == index : source_name == name) {
+      ptr_info->name = source_name;
+      ptr_info->path = GetMonikerDevicePath(source_moniker);
+      if (ptr_info->path.empty()) {
+        ptr_info->path = source_name;
+      }
+      ptr_info->moniker_name = GetMonikerDisplayName(source_moniker);
+      if (ptr_info->moniker_name.empty()) {
+        return kNoDeviceFound;
+      }
+      return kSuccess;
+    }
     ++source_index;
   }
-  if (sources_.size() == 0) {
-    LOG(ERROR) << "No devices found!";
-    return kNoDeviceFound;
-  }
-  return kSuccess;
-}
-
-// Obtains source name for |index| and returns result of
-// |GetSource(std::wstring)|.
-IBaseFilterPtr CaptureSourceLoader::GetSource(int index) {
-  if (static_cast<size_t>(index) >= sources_.size()) {
-    LOG(ERROR) << "" << index << " is not a valid source index";
-    return NULL;
-  }
-  return GetSource(GetSourceName(index));
 }
 
-// Resets |source_enum_| and enumerates video input sources until one matching
-// |name| is found. Then creates an instance of the filter by calling
-// |BindToObject| on the device moniker (|source_moniker|) returned by the
-// enumerator.
-IBaseFilterPtr CaptureSourceLoader::GetSource(const std::wstring name) {
-  if (name.empty()) {
-    LOG(ERROR) << "empty source name.";
+// Parses |moniker_name| back into a device moniker, and creates an instance of
+// the filter by calling |BindToObject| on it.
+IBaseFilterPtr CaptureSourceLoader::BindSource(
+    const std::wstring& moniker_name) {
+  if (moniker_name.empty()) {
+    LOG(ERROR) << "empty source moniker name.";
     return NULL;
   }
-  HRESULT hr = source_enum_->Reset();
+  IBindCtx* ptr_bind_context = NULL;
+  HRESULT hr = CreateBindCtx(0, &ptr_bind_context);
   if (FAILED(hr)) {
-    LOG(ERROR) << "cannot reset source enumerator!" << HRLOG(hr);
+    LOG(ERROR) << "cannot create bind context!" << HRLOG(hr);
     return NULL;
   }
   IMonikerPtr source_moniker;
-  for (;;) {
-    hr = source_enum_->Next(1, &source_moniker, NULL);
-    if (FAILED(hr) || hr == S_FALSE || !source_moniker) {
-      LOG(ERROR) << "device not found!";
-      return NULL;
-    }
-    std::wstring source_name = GetMonikerFriendlyName(source_moniker);
-    if (source_name == name) {
-      break;
-    }
+  ULONG chars_eaten = 0;
+  hr = MkParseDisplayName(ptr_bind_context, moniker_name.c_str(),
+                          &chars_eaten, &source_moniker);
+  ptr_bind_context->Release();
+  if (FAILED(hr) || !source_moniker) {
+    LOG(ERROR) << "device not found!" << HRLOG(hr);
+    return NULL;
   }
   IBaseFilterPtr filter = NULL;
   hr = source_moniker->BindToObject(NULL, NULL, IID_IBaseFilter,
@@ -931,6 +1525,48 @@ std::wstring CaptureSourceLoader::GetMonikerFriendlyName(
   return name;
 }
 
+// Returns the value of |moniker|'s device path property, which virtual
+// devices may not have. Returns an empty std::wstring on failure.
+std::wstring CaptureSourceLoader::GetMonikerDevicePath(
+    const IMonikerPtr& moniker) {
+  std::wstring path;
+  if (moniker) {
+    IPropertyBagPtr props;
+    HRESULT hr = moniker->BindToStorage(0, 0, IID_IPropertyBag,
+                                        reinterpret_cast<void**>(&props));
+    if (hr == S_OK) {
+      const wchar_t* const kDevicePath = L"DevicePath";
+      path = GetStringProperty(props, kDevicePath);
+    }
+  }
+  return path;
+}
+
+// Returns the display name of |moniker|, which |MkParseDisplayName| turns back
+// into the moniker on any thread. Returns an empty std::wstring on failure.
+std::wstring CaptureSourceLoader::GetMonikerDisplayName(
+    const IMonikerPtr& moniker) {
+  std::wstring name;
+  if (!moniker) {
+    return name;
+  }
+  IBindCtx* ptr_bind_context = NULL;
+  if (FAILED(CreateBindCtx(0, &ptr_bind_context))) {
+    return name;
+  }
+  LPOLESTR ptr_display_name = NULL;
+  const HRESULT hr = moniker->GetDisplayName(ptr_bind_context, NULL,
+                                             &ptr_display_name);
+  if (SUCCEEDED(hr) && ptr_display_name) {
+    name = ptr_display_name;
+    CoTaskMemFree(ptr_display_name);
+  } else {
+    LOG(WARNING) << "moniker display name missing." << HRLOG(hr);
+  }
+  ptr_bind_context->Release();
+  return name;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // PinFinder
 //
@@ -15,15 +15,19 @@
 #include <memory>
 #include <string>
 #include <thread>
+#include <vector>
 
 #include "encoder/basictypes.h"
+#include "encoder/capture_profile_cache.h"
 #include "encoder/encoder_base.h"
+#include "encoder/media_source.h"
 #include "encoder/webm_encoder.h"
 
 namespace webmlive {
 // A slightly more brief version of the com_ptr_t definition macro.
 #define COMPTR_TYPEDEF(InterfaceName) \
   _COM_SMARTPTR_TYPEDEF(InterfaceName, IID_##InterfaceName)
+COMPTR_TYPEDEF(IAMBufferNegotiation);
 COMPTR_TYPEDEF(IAMStreamConfig);
 COMPTR_TYPEDEF(IBaseFilter);
 COMPTR_TYPEDEF(ICaptureGraphBuilder2);
@@ -35,10 +39,12 @@ COMPTR_TYPEDEF(IFilterGraph);
 COMPTR_TYPEDEF(IGraphBuilder);
 COMPTR_TYPEDEF(IMediaControl);
 COMPTR_TYPEDEF(IMediaEvent);
+COMPTR_TYPEDEF(IMediaFilter);
 COMPTR_TYPEDEF(IMediaSeeking);
 COMPTR_TYPEDEF(IMoniker);
 COMPTR_TYPEDEF(IPin);
 COMPTR_TYPEDEF(IPropertyBag);
+COMPTR_TYPEDEF(IReferenceClock);
 COMPTR_TYPEDEF(ISpecifyPropertyPages);
 
 
@@ -81,15 +87,33 @@ int64 media_time_to_milliseconds(REFERENCE_TIME media_time);
 double media_time_to_seconds(REFERENCE_TIME media_time);
 REFERENCE_TIME seconds_to_media_time(double seconds);
 
+class DesktopDuplicationSource;
 class MediaTypePtr;
 class PinInfo;
 class VideoFrameCallbackInterface;
+class WasapiAudioCapture;
+
+// A capture device found by |CaptureSourceLoader::FindSource()|.
+struct CaptureSourceInfo {
+  // Friendly name, and device path, or the name when the device has none.
+  std::wstring name;
+  std::wstring path;
+
+  // Display name of the device moniker, passed to
+  // |CaptureSourceLoader::BindSource()|. Being a string, it may be passed
+  // between COM threads.
+  std::wstring moniker_name;
+};
 
 // Platform specific media source object. Currently supports only video.
 //
 // Captures video frames using a custom sink filter and passes them back to
-// users through VideoFrameCallbackInterface.
-class MediaSourceImpl {
+// users through VideoFrameCallbackInterface. When the desktop is the video
+// source, frames come from a |DesktopDuplicationSource| instead, and the
+// filter graph only captures audio. With a WASAPI |audio_source|, audio
+// comes from a |WasapiAudioCapture| timestamped on the graph's clock, and
+// the graph holds no audio filters.
+class MediaSourceImpl : public MediaSourceInterface {
  public:
   typedef WebmEncoderConfig::UserInterfaceOptions UserInterfaceOptions;
   enum {
@@ -139,23 +163,33 @@ class MediaSourceImpl {
     kGraphCompleted = 1,
   };
   MediaSourceImpl();
-  ~MediaSourceImpl();
+  virtual ~MediaSourceImpl();
 
   // Creates video capture graph. Returns |kSuccess| upon success, or a
   // |WebmEncoder| status code upon failure.
-  int Init(const WebmEncoderConfig& config,
-           AudioSamplesCallbackInterface* ptr_audio_callback,
-           VideoFrameCallbackInterface* ptr_video_callback);
+  virtual int Init(const WebmEncoderConfig& config,
+                   AudioSamplesCallbackInterface* ptr_audio_callback,
+                   VideoFrameCallbackInterface* ptr_video_callback);
+
+  // Each camera is captured by a source and sink pair of its own, in the
+  // graph of the primary video source.
+  virtual int SetCameraCallback(int camera,
+                                VideoFrameCallbackInterface* ptr_callback);
 
   // Runs filter graph. Returns |kSuccess| upon success, or a |WebmEncoder|
   // status code upon failure.
-  int Run();
+  virtual int Run();
 
   // Monitors filter graph state.
-  int CheckStatus();
+  virtual int CheckStatus();
 
   // Stops filter graph.
-  void Stop();
+  virtual void Stop();
+
+  // Rebuilds and runs the filter graph and the desktop source. Returns
+  // |WebmEncoder::kAVCaptureStopped| when the devices come back with other
+  // settings.
+  virtual int Restart();
 
   // Returns encoded duration in seconds.
   double encoded_duration();
@@ -164,33 +198,104 @@ class MediaSourceImpl {
   AudioConfig requested_audio_config() const {
     return requested_audio_config_;
   };
-  AudioConfig actual_audio_config() const {
+  virtual AudioConfig actual_audio_config() const {
     return actual_audio_config_;
   };
   VideoConfig requested_video_config() const {
     return requested_video_config_;
   };
-  VideoConfig actual_video_config() const {
+  virtual VideoConfig actual_video_config() const {
     return actual_video_config_;
   };
+  virtual VideoConfig actual_camera_config(int camera) const;
 
  private:
-  // Creates filter graph and graph builder interfaces.
-  int CreateGraph();
+  // Capture filters and settings of an additional camera.
+  struct Camera {
+    Camera() : device_index(0), ptr_callback(NULL) {}
+    std::wstring device_name;
+    std::wstring device_path;
+    int device_index;
+    VideoFrameCallbackInterface* ptr_callback;
+    IBaseFilterPtr source;
+    IBaseFilterPtr sink;
+    VideoConfig actual_config;
+  };
+
+  // Creates the filter graph, or the desktop source, for the streams
+  // enabled by |Init|.
+  int BuildGraph();
 
-  // Creates video capture source filter instance and adds it to the graph.
-  int CreateVideoSource();
+  // Runs and stops the graph and the desktop source.
+  int RunGraph();
+  void StopGraph();
 
-  // Creates the video sink filter instance and adds it to the graph.
-  int CreateVideoSink();
+  // Releases the graph interfaces, its filters and the desktop source.
+  void ReleaseGraph();
 
-  // Connects the video source and sink filters.
-  int ConnectVideoSourceToVideoSink();
+  // Creates filter graph and graph builder interfaces.
+  int CreateGraph();
 
-  // Configures the video capture source using |sub_type| and
+  // Creates |desktop_source_| for the monitor at |video_device_index_|.
+  int CreateDesktopSource();
+
+  // Creates the video capture source filter of the device named
+  // |*ptr_device_name|, or of the device at |device_index| when the name is
+  // empty, stores it in |ptr_source| and adds it to the graph as
+  // |filter_name|. Stores the name and path of the device in
+  // |ptr_device_name| and |ptr_device_path|.
+  int CreateVideoSource(const std::wstring& filter_name, int device_index,
+                        std::wstring* ptr_device_name,
+                        std::wstring* ptr_device_path,
+                        IBaseFilterPtr* ptr_source);
+
+  // Creates a video sink filter delivering frames to |ptr_callback|, stores
+  // it in |ptr_sink| and adds it to the graph as |filter_name|.
+  int CreateVideoSink(const std::wstring& filter_name,
+                      VideoFrameCallbackInterface* ptr_callback,
+                      IBaseFilterPtr* ptr_sink);
+
+  // Connects |source|, the device at |device_path|, to |sink|, and stores
+  // the negotiated frame settings in |ptr_actual_config|. With
+  // |capture_profiles_|, a matching profile of the device is tried first;
+  // the full probe runs only when it fails, and its result is stored as the
+  // device's profile.
+  int ConnectVideoSourceToVideoSink(const IBaseFilterPtr& source,
+                                    const IBaseFilterPtr& sink,
+                                    const std::wstring& device_path,
+                                    VideoConfig* ptr_actual_config);
+
+  // Configures |source| with the format of |profile| and connects |pin| to
+  // |sink_pin|. Returns |kSuccess| when connected.
+  int ConnectCachedVideoFormat(const IBaseFilterPtr& source,
+                               const IPinPtr& pin, const IPinPtr& sink_pin,
+                               const CaptureProfile& profile);
+
+  // Stores every |VideoFormat| in |ptr_formats|, in the order the video
+  // source is configured with on |pin|: first the uncompressed formats |pin|
+  // offers at the requested size and frame rate, cheapest first by
+  // |EstimateVideoFormatCost()|, then the other formats it offers, then
+  // those it does not offer, which some devices accept anyway. For
+  // passthrough the compressed formats come first. Stores the estimated
+  // cost of each format, by |VideoFormat| value, in |ptr_costs|, and the
+  // media types |pin| offers in |ptr_media_types|.
+  void RankVideoFormats(const IPinPtr& pin,
+                        std::vector<VideoFormat>* ptr_formats,
+                        std::vector<double>* ptr_costs,
+                        std::vector<CaptureMediaType>* ptr_media_types);
+
+  // Creates the primary video source and sink filters and connects them,
+  // then does the same for |cameras_|.
+  int CreateVideoGraph();
+
+  // Creates the source and sink filters of |cameras_|, and connects them.
+  int CreateCameraGraphs();
+
+  // Configures the video capture source |source| using |sub_type| and
   // |config_.requested_video_config|. Returns |kSuccess| and stores
   // |AM_MEDIA_TYPE| accepted by |pin| in |ptr_type|.
-  int ConfigureVideoSource(const IPinPtr& pin,
+  int ConfigureVideoSource(const IBaseFilterPtr& source,
+                           const IPinPtr& pin,
                            int sub_type,
                            MediaTypePtr* ptr_type);
 
@@ -198,25 +303,74 @@ class MediaSourceImpl {
   int InitGraphControl();
 
   // Copies |video_source_| to |audio_source_| if |video_source_| has an audio
-  // output pin, or creates an audio capture source filter instance and adds
-  // it to the graph.
-  int CreateAudioSource();
+  // output pin, or creates the audio capture source filter of
+  // |audio_device_| and adds it to the graph. |audio_lookup_status| is the
+  // result of the |FindAudioDevice()| that found |audio_device_|.
+  int CreateAudioSource(int audio_lookup_status);
+
+  // Finds the audio capture device named |audio_device_name_|, or the one at
+  // |audio_device_index_|, and stores it in |ptr_device|. Runs on a thread of
+  // its own, in its own COM apartment, while |BuildGraph()| creates the video
+  // branch: it touches neither the graph nor any other member.
+  int FindAudioDevice(const std::wstring& device_name, int device_index,
+                      CaptureSourceInfo* ptr_device) const;
 
   // Configures the audio capture source.
   int ConfigureAudioSource(const IPinPtr& pin, MediaTypePtr* ptr_type);
 
+  // Asks |pin| for buffers holding |audio_buffer_period_| milliseconds of
+  // audio in the format described by |type|. Must be called before |pin| is
+  // connected. Failure is logged and ignored: |AudioSinkFilter| resizes the
+  // buffers it receives.
+  void SuggestAudioBufferSize(const IPinPtr& pin, const AM_MEDIA_TYPE& type);
+
   // Creates the audio sink filter instance and adds it to the graph.
   int CreateAudioSink();
 
   // Connects the audio source and sink filters.
   int ConnectAudioSourceToAudioSink();
 
+  // Creates the audio source and sink filters, and connects them. See
+  // |CreateAudioSource()| for |audio_lookup_status|.
+  int CreateAudioGraph(int audio_lookup_status);
+
+  // Creates |wasapi_capture_| for the audio device, in place of the audio
+  // graph.
+  int CreateWasapiCapture();
+
+  // Starts |wasapi_capture_| on the clock of the running graph, or on its
+  // own without a graph.
+  int RunWasapiCapture();
+
   // Checks graph media event for error or completion.
   int HandleMediaEvent();
 
   // Flag set to true when audio is captured from the same filter as video.
   bool audio_from_video_source_;
 
+  // Flags set to true for each stream |Init| enabled, and when video comes
+  // from the desktop.
+  bool capture_audio_;
+  bool capture_video_;
+  bool capture_desktop_;
+
+  // Flag set to true when the filter graph contains capture filters. False
+  // when only the desktop is captured.
+  bool graph_in_use_;
+
+  // Flag set to true when VP8 and VP9 are tried before uncompressed video,
+  // for |WebmEncoderConfig::video_passthrough|.
+  bool prefer_compressed_video_;
+
+  // Desktop capture source, used in place of |video_source_| and
+  // |video_sink_| when capturing the desktop.
+  std::unique_ptr<DesktopDuplicationSource> desktop_source_;
+
+  // Audio capture API, and the WASAPI capture used in place of
+  // |audio_source_| and |audio_sink_| when it is not DirectShow.
+  WebmEncoderConfig::AudioSource audio_api_;
+  std::unique_ptr<WasapiAudioCapture> wasapi_capture_;
+
   // Handle to graph media event. Used to check for graph error and completion.
   HANDLE media_event_handle_;
 
@@ -239,15 +393,25 @@ class MediaSourceImpl {
   // Audio device friendly name.
   std::wstring audio_device_name_;
 
+  // Audio device found by |FindAudioDevice()|.
+  CaptureSourceInfo audio_device_;
+
   // Audio device index.
   int audio_device_index_;
 
-  // Video device friendly name.
+  // Video device friendly name, and device path.
   std::wstring video_device_name_;
+  std::wstring video_device_path_;
 
   // Video device index.
   int video_device_index_;
 
+  // Additional cameras, from |WebmEncoderConfig::video_cameras|.
+  std::vector<Camera> cameras_;
+
+  // Audio buffer length in milliseconds, or 0 for the device default.
+  int audio_buffer_period_;
+
   // Requested audio settings.
   AudioConfig requested_audio_config_;
 
@@ -263,6 +427,12 @@ class MediaSourceImpl {
   // Controls display of device configuration dialogs.
   UserInterfaceOptions ui_opts_;
 
+  // Profiles of the video capture devices, from
+  // |WebmEncoderConfig::capture_profile_file|, used when
+  // |use_capture_profiles_| is true.
+  CaptureProfileCache capture_profiles_;
+  bool use_capture_profiles_;
+
   // Callback interface used by audio sink filter to deliver audio buffers
   // to |WebmEncoder::EncoderThread|.
   AudioSamplesCallbackInterface* ptr_audio_callback_;
@@ -286,24 +456,21 @@ class CaptureSourceLoader {
 
   // Initialize the loader for audio or video devices.  Must specify either
   // CLSID_AudioInputDeviceCategory or CLSID_VideoInputDeviceCategory.
+  // Devices are enumerated by |FindSource()|, not here.
   int Init(CLSID source_type);
 
-  // Returns number of sources found by Init.
-  int GetNumSources() const { return sources_.size(); }
-
-  // Return source name for specified index.
-  std::wstring GetSourceName(int index) { return sources_[index]; }
+  // Enumerates devices until the one named |name| is found, or the one at
+  // |index| when |name| is empty, and stores it in |ptr_info|. Devices after
+  // it are not enumerated. Returns |kNoDeviceFound| when there is no such
+  // device.
+  int FindSource(const std::wstring& name, int index,
+                 CaptureSourceInfo* ptr_info);
 
-  // Returns filter for capture source at specified |index|.
-  IBaseFilterPtr GetSource(int index);
-
-  // Returns filter for capture source specified by |name|.
-  IBaseFilterPtr GetSource(const std::wstring name);
+  // Returns filter for the capture device whose moniker display name is
+  // |moniker_name|, or NULL. See |CaptureSourceInfo::moniker_name|.
+  static IBaseFilterPtr BindSource(const std::wstring& moniker_name);
 
  private:
-  // Finds and stores all source devices of |source_type_| in |sources_|.
-  int FindAllSources();
-
   // Utility for returning the string property specified by |prop_name| stored
   // in |prop_bag|.
   std::wstring GetStringProperty(const IPropertyBagPtr& prop_bag,
@@ -312,14 +479,18 @@ class CaptureSourceLoader {
   // Returns the value of |moniker|'s friendly name property.
   std::wstring GetMonikerFriendlyName(const IMonikerPtr& moniker);
 
+  // Returns the value of |moniker|'s device path property, or an empty
+  // string when it has none.
+  std::wstring GetMonikerDevicePath(const IMonikerPtr& moniker);
+
+  // Returns the display name of |moniker|, or an empty string on failure.
+  std::wstring GetMonikerDisplayName(const IMonikerPtr& moniker);
+
   // Type of sources to find.
   CLSID source_type_;
 
   // System input device enumerator.
   IEnumMonikerPtr source_enum_;
-
-  // Map of sources.
-  std::map<int, std::wstring> sources_;
   WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(CaptureSourceLoader);
 };
 
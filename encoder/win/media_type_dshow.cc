@@ -51,6 +51,14 @@ bool VideoFormatToSubTypeGuid(VideoFormat format, GUID* ptr_sub_type) {
         *ptr_sub_type = MEDIASUBTYPE_RGB32;
         converted = true;
         break;
+      case kVideoFormatNV12:
+        *ptr_sub_type = MEDIASUBTYPE_NV12;
+        converted = true;
+        break;
+      case kVideoFormatMJPG:
+        *ptr_sub_type = MEDIASUBTYPE_MJPG;
+        converted = true;
+        break;
       default:
         LOG(WARNING) << "Unknown video format value.";
     }
@@ -58,6 +66,84 @@ bool VideoFormatToSubTypeGuid(VideoFormat format, GUID* ptr_sub_type) {
   return converted;
 }
 
+bool SubTypeGuidToVideoFormat(const GUID& sub_type, VideoFormat* ptr_format) {
+  if (!ptr_format) {
+    return false;
+  }
+  for (int i = 0; i < kVideoFormatCount; ++i) {
+    const VideoFormat format = static_cast<VideoFormat>(i);
+    GUID format_sub_type = GUID_NULL;
+    if (format != kVideoFormatVP9 &&
+        VideoFormatToSubTypeGuid(format, &format_sub_type) &&
+        format_sub_type == sub_type) {
+      *ptr_format = format;
+      return true;
+    }
+  }
+  return false;
+}
+
+double EstimateVideoFormatCost(VideoFormat format, int width, int height) {
+  // Conversion time per pixel, in nanoseconds, of the libyuv conversions to
+  // I420 used by |VideoConverter|, and memory time per byte at about 10
+  // GB/s.
+  const double kMemoryNsPerByte = 0.1;
+  double convert_ns = 0;
+  int bits_per_pixel = 0;
+  switch (format) {
+    case kVideoFormatI420:
+    case kVideoFormatYV12:
+      bits_per_pixel = kI420BitCount;
+      break;
+    case kVideoFormatNV12:
+      convert_ns = 0.3;
+      bits_per_pixel = kNV12BitCount;
+      break;
+    case kVideoFormatYUY2:
+    case kVideoFormatYUYV:
+    case kVideoFormatUYVY:
+      convert_ns = 0.6;
+      bits_per_pixel = kYUY2BitCount;
+      break;
+    case kVideoFormatRGB:
+      convert_ns = 2.5;
+      bits_per_pixel = kRGBBitCount;
+      break;
+    case kVideoFormatRGBA:
+      convert_ns = 2.0;
+      bits_per_pixel = kRGBABitCount;
+      break;
+    case kVideoFormatMJPG:
+      // libjpeg-turbo decoding; memory traffic is mostly the I420 output.
+      convert_ns = 3.0;
+      bits_per_pixel = kI420BitCount;
+      break;
+    default:
+      return 0;
+  }
+  const double pixels = static_cast<double>(width) * height;
+  const double bytes = pixels * bits_per_pixel / 8;
+  return (pixels * convert_ns + 2 * bytes * kMemoryNsPerByte) / 1000.0;
+}
+
+VideoFieldOrder VideoFieldOrderFromFormat(const GUID& format_type,
+                                          const uint8* ptr_format,
+                                          uint32 length) {
+  if (format_type != FORMAT_VideoInfo2 || !ptr_format ||
+      length < sizeof(VIDEOINFOHEADER2)) {
+    return kVideoProgressive;
+  }
+  const VIDEOINFOHEADER2* ptr_header =
+      reinterpret_cast<const VIDEOINFOHEADER2*>(ptr_format);
+  const DWORD flags = ptr_header->dwInterlaceFlags;
+  if (!(flags & AMINTERLACE_IsInterlaced) ||
+      (flags & AMINTERLACE_1FieldPerSample)) {
+    return kVideoProgressive;
+  }
+  return (flags & AMINTERLACE_Field1First) ? kVideoTopFieldFirst :
+      kVideoBottomFieldFirst;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // MediaType
 //
@@ -241,12 +327,17 @@ int VideoMediaType::ConfigureSubType(VideoFormat sub_type,
       ptr_type_->bTemporalCompression = TRUE;
       ptr_type_->bFixedSizeSamples = FALSE;
       break;
+    case kVideoFormatMJPG:
+      ptr_type_->bTemporalCompression = FALSE;
+      ptr_type_->bFixedSizeSamples = FALSE;
+      break;
     case kVideoFormatI420:
     case kVideoFormatYV12:
     case kVideoFormatYUY2:
     case kVideoFormatUYVY:
     case kVideoFormatRGB:
     case kVideoFormatRGBA:
+    case kVideoFormatNV12:
       ptr_type_->bTemporalCompression = FALSE;
       ptr_type_->bFixedSizeSamples = TRUE;
       break;
@@ -360,6 +451,15 @@ int VideoMediaType::stride() const {
   return stride;
 }
 
+VideoFieldOrder VideoMediaType::field_order() const {
+  if (!ptr_type_) {
+    return kVideoProgressive;
+  }
+  return VideoFieldOrderFromFormat(ptr_type_->formattype,
+                                   ptr_type_->pbFormat,
+                                   ptr_type_->cbFormat);
+}
+
 // Returns pointer to BITMAPINFOHEADER stored within |ptr_type_|'s format
 // blob.
 const BITMAPINFOHEADER* VideoMediaType::bitmap_header() const {
@@ -429,6 +529,17 @@ int VideoMediaType::ConfigureFormatInfo(const VideoConfig& config,
       header.biCompression = BI_RGB;
       header.biBitCount = kRGBABitCount;
       break;
+    case kVideoFormatNV12:
+      ptr_type_->subtype = MEDIASUBTYPE_NV12;
+      header.biCompression = MAKEFOURCC('N', 'V', '1', '2');
+      header.biBitCount = kNV12BitCount;
+      break;
+    case kVideoFormatMJPG:
+      // Cameras report MJPEG as 24 bits, and size the samples for that.
+      ptr_type_->subtype = MEDIASUBTYPE_MJPG;
+      header.biCompression = MAKEFOURCC('M', 'J', 'P', 'G');
+      header.biBitCount = kRGBBitCount;
+      break;
     default:
       return kUnsupportedSubType;
   }
@@ -22,6 +22,25 @@ namespace webmlive {
 // values.
 bool VideoFormatToSubTypeGuid(VideoFormat format, GUID* ptr_sub_type);
 
+// Converts the AM_MEDIA_TYPE subtype |sub_type| to its |VideoFormat|, copies
+// it to |ptr_format|, and returns true. Returns false when |ptr_format| is
+// NULL, and for subtypes without a |VideoFormat|.
+bool SubTypeGuidToVideoFormat(const GUID& sub_type, VideoFormat* ptr_format);
+
+// Returns the estimated cost, in microseconds, of a |width|x|height| frame of
+// uncompressed |format| on its way to the video encoder: its conversion to
+// I420, plus reading and writing its bytes once. Returns 0 for compressed
+// formats, which have no conversion cost model.
+double EstimateVideoFormatCost(VideoFormat format, int width, int height);
+
+// Returns the field order from the interlace flags of the |length| byte
+// VIDEOINFOHEADER2 format blob at |ptr_format|. Returns |kVideoProgressive|
+// for other format types and for video delivered one field per sample, which
+// needs no deinterlacing.
+VideoFieldOrder VideoFieldOrderFromFormat(const GUID& format_type,
+                                          const uint8* ptr_format,
+                                          uint32 length);
+
 // Base class for audio and video AM_MEDIA_TYPE management classes.
 class MediaType {
  public:
@@ -106,6 +125,10 @@ class VideoMediaType : public MediaType {
   int height() const;
   int stride() const;
 
+  // Returns the field order of the format blob; see
+  // |VideoFieldOrderFromFormat()|.
+  VideoFieldOrder field_order() const;
+
  private:
   // Easy access helper for obtaining values from the BITMAPINFOHEADER within
   // |ptr_type_|'s format blob.
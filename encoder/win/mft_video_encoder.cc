@@ -0,0 +1,630 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/win/mft_video_encoder.h"
+
+#include <codecapi.h>
+#include <mferror.h>
+
+#include "encoder/webm_encoder.h"
+#include "encoder/win/dshow_util.h"
+#include "glog/logging.h"
+#include "libyuv/convert_from.h"
+#include "libyuv/planar_functions.h"
+
+namespace {
+
+// Media Foundation times are in 100 nanosecond units.
+const int64 kMfTimePerMillisecond = 10000;
+
+// Frame rate denominator used to express fractional rates as a ratio.
+const UINT32 kFrameRateDenominator = 1000;
+
+// Releases the |IMFActivate| array returned by |MFTEnumEx()|.
+void ReleaseActivates(IMFActivate** ptr_activates, UINT32 count) {
+  for (UINT32 i = 0; i < count; ++i) {
+    ptr_activates[i]->Release();
+  }
+  CoTaskMemFree(ptr_activates);
+}
+
+// Creates a video media type of |subtype| for a |width|x|height| stream at
+// |frame_rate| in |ptr_type|.
+HRESULT CreateVideoType(const GUID& subtype, int32 width, int32 height,
+                        double frame_rate, UINT32 bitrate,
+                        webmlive::IMFMediaTypePtr* ptr_type) {
+  IMFMediaType* ptr_media_type = NULL;
+  HRESULT hr = MFCreateMediaType(&ptr_media_type);
+  if (FAILED(hr)) {
+    return hr;
+  }
+  webmlive::IMFMediaTypePtr media_type(ptr_media_type, false);
+  hr = media_type->SetGUID(MF_MT_MAJOR_TYPE, MFMediaType_Video);
+  if (SUCCEEDED(hr)) {
+    hr = media_type->SetGUID(MF_MT_SUBTYPE, subtype);
+  }
+  if (SUCCEEDED(hr)) {
+    hr = MFSetAttributeSize(media_type, MF_MT_FRAME_SIZE, width, height);
+  }
+  if (SUCCEEDED(hr)) {
+    const UINT32 numerator =
+        static_cast<UINT32>(frame_rate * kFrameRateDenominator + 0.5);
+    hr = MFSetAttributeRatio(media_type, MF_MT_FRAME_RATE, numerator,
+                             kFrameRateDenominator);
+  }
+  if (SUCCEEDED(hr)) {
+    hr = MFSetAttributeRatio(media_type, MF_MT_PIXEL_ASPECT_RATIO, 1, 1);
+  }
+  if (SUCCEEDED(hr)) {
+    hr = media_type->SetUINT32(MF_MT_INTERLACE_MODE,
+                               MFVideoInterlace_Progressive);
+  }
+  if (SUCCEEDED(hr) && bitrate > 0) {
+    hr = media_type->SetUINT32(MF_MT_AVG_BITRATE, bitrate);
+  }
+  if (SUCCEEDED(hr)) {
+    *ptr_type = media_type;
+  }
+  return hr;
+}
+
+}  // namespace
+
+namespace webmlive {
+
+MftVideoEncoder::MftVideoEncoder()
+    : frames_in_(0),
+      frames_out_(0),
+      last_keyframe_time_(0),
+      last_timestamp_(0),
+      force_keyframe_(false),
+      input_stream_id_(0),
+      output_stream_id_(0),
+      output_sample_size_(0),
+      input_requests_(0),
+      async_(false),
+      mf_started_(false) {
+}
+
+MftVideoEncoder::~MftVideoEncoder() {
+  if (transform_) {
+    transform_->ProcessMessage(MFT_MESSAGE_NOTIFY_END_OF_STREAM, 0);
+    transform_->ProcessMessage(MFT_MESSAGE_NOTIFY_END_STREAMING, 0);
+    IMFShutdownPtr shutdown = transform_;
+    if (shutdown) {
+      shutdown->Shutdown();
+    }
+  }
+  codec_api_ = 0;
+  event_generator_ = 0;
+  transform_ = 0;
+  if (mf_started_) {
+    MFShutdown();
+  }
+}
+
+// |MFStartup()| creates the Media Foundation work queue threads, which join
+// the process wide MTA. The hardware MFTs are free threaded, so the encoder
+// thread can use |transform_| even though |Init()| runs on another thread.
+int MftVideoEncoder::Init(const WebmEncoderConfig& config) {
+  const VideoFormat codec = config.vpx_config.codec;
+  if (codec != kVideoFormatVP8 && codec != kVideoFormatVP9) {
+    LOG(ERROR) << "MftVideoEncoder supports only VP8 and VP9.";
+    return kInvalidArg;
+  }
+  // The MFT input is a copy of the whole frame.
+  const VideoConfig& video_config = config.actual_video_config;
+  const VideoConfig encoded_config = EncodedVideoConfig(video_config);
+  if (encoded_config.width != video_config.width ||
+      encoded_config.height != video_config.height) {
+    LOG(ERROR) << "MftVideoEncoder cannot crop or pad video.";
+    return kInvalidArg;
+  }
+  HRESULT hr = MFStartup(MF_VERSION, MFSTARTUP_LITE);
+  if (FAILED(hr)) {
+    LOG(ERROR) << "MFStartup failed: " << HRLOG(hr);
+    return kCodecError;
+  }
+  mf_started_ = true;
+  vpx_config_ = config.vpx_config;
+  input_config_ = config.actual_video_config;
+
+  MFT_REGISTER_TYPE_INFO input_info = {MFMediaType_Video, MFVideoFormat_NV12};
+  MFT_REGISTER_TYPE_INFO output_info = {MFMediaType_Video,
+                                        codec == kVideoFormatVP9 ?
+                                            MFVideoFormat_VP90 :
+                                            MFVideoFormat_VP80};
+  IMFActivate** ptr_activates = NULL;
+  UINT32 num_activates = 0;
+  hr = MFTEnumEx(MFT_CATEGORY_VIDEO_ENCODER,
+                 MFT_ENUM_FLAG_HARDWARE | MFT_ENUM_FLAG_SORTANDFILTER,
+                 &input_info, &output_info, &ptr_activates, &num_activates);
+  if (FAILED(hr)) {
+    LOG(ERROR) << "MFTEnumEx failed: " << HRLOG(hr);
+    return kCodecError;
+  }
+  if (num_activates == 0) {
+    CoTaskMemFree(ptr_activates);
+    LOG(INFO) << "no hardware "
+              << (codec == kVideoFormatVP9 ? "VP9" : "VP8") << " encoder.";
+    return kEncoderError;
+  }
+
+  // Use the first (highest merit) encoder that accepts the configuration.
+  int status = kEncoderError;
+  for (UINT32 i = 0; i < num_activates && status != kSuccess; ++i) {
+    IMFTransform* ptr_transform = NULL;
+    hr = ptr_activates[i]->ActivateObject(IID_PPV_ARGS(&ptr_transform));
+    if (FAILED(hr)) {
+      LOG(WARNING) << "MFT ActivateObject failed: " << HRLOG(hr);
+      continue;
+    }
+    transform_.Attach(ptr_transform);
+    status = ConfigureTransform(config);
+    if (status != kSuccess) {
+      codec_api_ = 0;
+      event_generator_ = 0;
+      transform_ = 0;
+      ptr_activates[i]->ShutdownObject();
+    }
+  }
+  ReleaseActivates(ptr_activates, num_activates);
+  if (status != kSuccess) {
+    LOG(ERROR) << "no hardware encoder accepted the video configuration.";
+  }
+  return status;
+}
+
+int MftVideoEncoder::EncodeFrame(const VideoFrame& raw_frame,
+                                 VideoFrame* ptr_vpx_frame) {
+  if (!raw_frame.buffer() || !ptr_vpx_frame) {
+    LOG(ERROR) << "NULL raw VideoFrame buffer or compressed VideoFrame!";
+    return kInvalidArg;
+  }
+  if (raw_frame.format() != kVideoFormatI420 &&
+      raw_frame.format() != kVideoFormatYV12 &&
+      raw_frame.format() != kVideoFormatNV12) {
+    LOG(ERROR) << "Unsupported VideoFrame format!";
+    return kInvalidArg;
+  }
+  if (!transform_) {
+    LOG(ERROR) << "MftVideoEncoder not Init'd.";
+    return kEncoderError;
+  }
+  ++frames_in_;
+
+  // Determine if it's time to force a keyframe. Aligned keyframes are
+  // scheduled by |VideoEncoder|.
+  const int64 time_since_keyframe =
+      raw_frame.timestamp() - last_keyframe_time_;
+  const bool interval_elapsed = !vpx_config_.aligned_keyframes &&
+      time_since_keyframe > vpx_config_.keyframe_interval;
+  if (force_keyframe_ || interval_elapsed) {
+    SetCodecProperty(CODECAPI_AVEncVideoForceKeyFrame, 1);
+  }
+  force_keyframe_ = false;
+
+  IMFSamplePtr sample;
+  int status = CreateInputSample(raw_frame, &sample);
+  if (status) {
+    return status;
+  }
+  status = WaitForInputRequest();
+  if (status) {
+    return status;
+  }
+  HRESULT hr = transform_->ProcessInput(input_stream_id_, sample, 0);
+  if (hr == MF_E_NOTACCEPTING && !async_) {
+    // Synchronous MFTs refuse input until pending output is read.
+    bool need_input = false;
+    while (!need_input && (status = ReadOutput(&need_input)) == kSuccess) {
+    }
+    if (status) {
+      return status;
+    }
+    hr = transform_->ProcessInput(input_stream_id_, sample, 0);
+  }
+  if (FAILED(hr)) {
+    LOG(ERROR) << "MFT ProcessInput failed: " << HRLOG(hr);
+    return kCodecError;
+  }
+
+  if (async_) {
+    --input_requests_;
+    status = ProcessEvents(false);
+  } else {
+    bool need_input = false;
+    while (!need_input && (status = ReadOutput(&need_input)) == kSuccess) {
+    }
+  }
+  if (status) {
+    return status;
+  }
+
+  return ReadPendingFrame(ptr_vpx_frame);
+}
+
+int MftVideoEncoder::ReadPendingFrame(VideoFrame* ptr_vpx_frame) {
+  if (output_frames_.empty()) {
+    return kDropped;
+  }
+  ptr_vpx_frame->Swap(&output_frames_.front());
+  output_frames_.pop_front();
+  if (ptr_vpx_frame->keyframe()) {
+    last_keyframe_time_ = ptr_vpx_frame->timestamp();
+    LOG(INFO) << "keyframe @ " << last_keyframe_time_ / 1000.0 << "sec ("
+              << last_keyframe_time_ << "ms)";
+  }
+  last_timestamp_ = ptr_vpx_frame->timestamp();
+  ++frames_out_;
+  return kSuccess;
+}
+
+int MftVideoEncoder::SetBitrate(int bitrate) {
+  if (bitrate <= 0) {
+    return kInvalidArg;
+  }
+  SetCodecProperty(CODECAPI_AVEncCommonMeanBitRate, bitrate * 1000);
+  vpx_config_.bitrate = bitrate;
+  return kSuccess;
+}
+
+int MftVideoEncoder::SetKeyframeInterval(int keyframe_interval) {
+  if (keyframe_interval <= 0) {
+    return kInvalidArg;
+  }
+  if (input_config_.frame_rate > 0) {
+    SetCodecProperty(CODECAPI_AVEncMPVGOPSize,
+                     static_cast<uint32>(keyframe_interval *
+                                         input_config_.frame_rate / 1000));
+  }
+  vpx_config_.keyframe_interval = keyframe_interval;
+  return kSuccess;
+}
+
+int MftVideoEncoder::ConfigureTransform(const WebmEncoderConfig& config) {
+  IMFAttributes* ptr_attributes = NULL;
+  HRESULT hr = transform_->GetAttributes(&ptr_attributes);
+  if (SUCCEEDED(hr)) {
+    IMFAttributesPtr attributes(ptr_attributes, false);
+    UINT32 is_async = FALSE;
+    async_ = SUCCEEDED(attributes->GetUINT32(MF_TRANSFORM_ASYNC, &is_async)) &&
+             is_async;
+    if (async_) {
+      hr = attributes->SetUINT32(MF_TRANSFORM_ASYNC_UNLOCK, TRUE);
+      if (FAILED(hr)) {
+        LOG(WARNING) << "cannot unlock async MFT: " << HRLOG(hr);
+        return kCodecError;
+      }
+      event_generator_ = transform_;
+      if (!event_generator_) {
+        LOG(WARNING) << "async MFT has no event generator.";
+        return kCodecError;
+      }
+    }
+  } else {
+    async_ = false;
+  }
+
+  hr = transform_->GetStreamIDs(1, &input_stream_id_, 1, &output_stream_id_);
+  if (hr == E_NOTIMPL) {
+    input_stream_id_ = 0;
+    output_stream_id_ = 0;
+  } else if (FAILED(hr)) {
+    LOG(WARNING) << "MFT GetStreamIDs failed: " << HRLOG(hr);
+    return kCodecError;
+  }
+
+  // Rate control settings go in before the media types, while the encoder is
+  // still allowed to apply them.
+  codec_api_ = transform_;
+  SetCodecProperty(CODECAPI_AVEncCommonRateControlMode,
+                   eAVEncCommonRateControlMode_CBR);
+  SetCodecProperty(CODECAPI_AVEncCommonMeanBitRate,
+                   vpx_config_.bitrate * 1000);
+  SetCodecProperty(CODECAPI_AVLowLatencyMode, TRUE);
+  const VideoConfig& vc = config.actual_video_config;
+  if (vc.frame_rate > 0) {
+    SetCodecProperty(CODECAPI_AVEncMPVGOPSize,
+                     static_cast<uint32>(vpx_config_.keyframe_interval *
+                                         vc.frame_rate / 1000));
+  }
+
+  // Encoders require the output type before the input type.
+  const GUID codec_subtype = vpx_config_.codec == kVideoFormatVP9 ?
+      MFVideoFormat_VP90 : MFVideoFormat_VP80;
+  IMFMediaTypePtr output_type;
+  hr = CreateVideoType(codec_subtype, vc.width, vc.height, vc.frame_rate,
+                       vpx_config_.bitrate * 1000, &output_type);
+  if (SUCCEEDED(hr)) {
+    hr = transform_->SetOutputType(output_stream_id_, output_type, 0);
+  }
+  if (FAILED(hr)) {
+    LOG(WARNING) << "MFT SetOutputType failed: " << HRLOG(hr);
+    return kCodecError;
+  }
+  IMFMediaTypePtr input_type;
+  hr = CreateVideoType(MFVideoFormat_NV12, vc.width, vc.height,
+                       vc.frame_rate, 0, &input_type);
+  if (SUCCEEDED(hr)) {
+    hr = transform_->SetInputType(input_stream_id_, input_type, 0);
+  }
+  if (FAILED(hr)) {
+    LOG(WARNING) << "MFT SetInputType failed: " << HRLOG(hr);
+    return kCodecError;
+  }
+
+  MFT_OUTPUT_STREAM_INFO stream_info = {0};
+  hr = transform_->GetOutputStreamInfo(output_stream_id_, &stream_info);
+  if (FAILED(hr)) {
+    LOG(WARNING) << "MFT GetOutputStreamInfo failed: " << HRLOG(hr);
+    return kCodecError;
+  }
+  const DWORD kMftSamples = MFT_OUTPUT_STREAM_PROVIDES_SAMPLES |
+                            MFT_OUTPUT_STREAM_CAN_PROVIDE_SAMPLES;
+  output_sample_size_ =
+      (stream_info.dwFlags & kMftSamples) ? 0 : stream_info.cbSize;
+
+  hr = transform_->ProcessMessage(MFT_MESSAGE_NOTIFY_BEGIN_STREAMING, 0);
+  if (SUCCEEDED(hr)) {
+    hr = transform_->ProcessMessage(MFT_MESSAGE_NOTIFY_START_OF_STREAM, 0);
+  }
+  if (FAILED(hr)) {
+    LOG(WARNING) << "MFT start streaming failed: " << HRLOG(hr);
+    return kCodecError;
+  }
+  input_requests_ = 0;
+  LOG(INFO) << "MftVideoEncoder configured " << vc.width << "x" << vc.height
+            << (async_ ? " (async)" : " (sync)");
+  return kSuccess;
+}
+
+void MftVideoEncoder::SetCodecProperty(const GUID& property, uint32 value) {
+  if (!codec_api_) {
+    return;
+  }
+  VARIANT var;
+  VariantInit(&var);
+  var.vt = VT_UI4;
+  var.ulVal = value;
+  const HRESULT hr = codec_api_->SetValue(&property, &var);
+  if (FAILED(hr)) {
+    VLOG(1) << "ICodecAPI SetValue failed: " << HRLOG(hr);
+  }
+}
+
+int MftVideoEncoder::CreateInputSample(const VideoFrame& raw_frame,
+                                       IMFSamplePtr* ptr_sample) {
+  const int32 width = raw_frame.width();
+  const int32 height = raw_frame.height();
+  const int32 y_size = width * height;
+  const int32 uv_stride = (width + 1) / 2;
+  const int32 uv_size = uv_stride * ((height + 1) / 2);
+  const int32 nv12_size = y_size + uv_size * 2;
+
+  IMFMediaBuffer* ptr_media_buffer = NULL;
+  HRESULT hr = MFCreateMemoryBuffer(nv12_size, &ptr_media_buffer);
+  if (FAILED(hr)) {
+    LOG(ERROR) << "MFCreateMemoryBuffer failed: " << HRLOG(hr);
+    return kNoMemory;
+  }
+  IMFMediaBufferPtr media_buffer(ptr_media_buffer, false);
+  BYTE* ptr_nv12 = NULL;
+  hr = media_buffer->Lock(&ptr_nv12, NULL, NULL);
+  if (FAILED(hr)) {
+    LOG(ERROR) << "IMFMediaBuffer Lock failed: " << HRLOG(hr);
+    return kCodecError;
+  }
+
+  // Hardware encoders take packed NV12: NV12 frames are copied plane by plane,
+  // and the chroma planes of I420 and YV12 frames are interleaved while
+  // copying.
+  int convert_status = 0;
+  VideoPlanes planes;
+  if (!VideoFrame::GetPlanes(raw_frame.config(), raw_frame.buffer(),
+                             &planes)) {
+    convert_status = kInvalidArg;
+  } else if (raw_frame.format() == kVideoFormatNV12) {
+    libyuv::CopyPlane(planes.data[0], planes.stride[0], ptr_nv12, width,
+                      width, height);
+    libyuv::CopyPlane(planes.data[1], planes.stride[1], ptr_nv12 + y_size,
+                      uv_stride * 2, uv_stride * 2, (height + 1) / 2);
+  } else {
+    convert_status =
+        libyuv::I420ToNV12(planes.data[0], planes.stride[0],
+                           planes.data[1], planes.stride[1],
+                           planes.data[2], planes.stride[2],
+                           ptr_nv12, width, ptr_nv12 + y_size, uv_stride * 2,
+                           width, height);
+  }
+  media_buffer->Unlock();
+  if (convert_status) {
+    LOG(ERROR) << "NV12 input copy failed: " << convert_status;
+    return kEncoderError;
+  }
+  media_buffer->SetCurrentLength(nv12_size);
+
+  IMFSample* ptr_mf_sample = NULL;
+  hr = MFCreateSample(&ptr_mf_sample);
+  if (FAILED(hr)) {
+    LOG(ERROR) << "MFCreateSample failed: " << HRLOG(hr);
+    return kNoMemory;
+  }
+  IMFSamplePtr sample(ptr_mf_sample, false);
+  hr = sample->AddBuffer(media_buffer);
+  if (SUCCEEDED(hr)) {
+    hr = sample->SetSampleTime(raw_frame.timestamp() * kMfTimePerMillisecond);
+  }
+  if (SUCCEEDED(hr)) {
+    hr = sample->SetSampleDuration(raw_frame.duration() *
+                                   kMfTimePerMillisecond);
+  }
+  if (FAILED(hr)) {
+    LOG(ERROR) << "cannot prepare input IMFSample: " << HRLOG(hr);
+    return kCodecError;
+  }
+  *ptr_sample = sample;
+  return kSuccess;
+}
+
+int MftVideoEncoder::WaitForInputRequest() {
+  if (!async_) {
+    return kSuccess;
+  }
+  while (input_requests_ == 0) {
+    const int status = ProcessEvents(true);
+    if (status) {
+      return status;
+    }
+  }
+  return kSuccess;
+}
+
+int MftVideoEncoder::ProcessEvents(bool wait) {
+  for (;;) {
+    IMFMediaEvent* ptr_event = NULL;
+    HRESULT hr = event_generator_->GetEvent(
+        wait ? 0 : MF_EVENT_FLAG_NO_WAIT, &ptr_event);
+    if (hr == MF_E_NO_EVENTS_AVAILABLE) {
+      return kSuccess;
+    }
+    if (FAILED(hr)) {
+      LOG(ERROR) << "MFT GetEvent failed: " << HRLOG(hr);
+      return kCodecError;
+    }
+    IMFMediaEventPtr event(ptr_event, false);
+    MediaEventType event_type = MEUnknown;
+    hr = event->GetType(&event_type);
+    if (FAILED(hr)) {
+      LOG(ERROR) << "IMFMediaEvent GetType failed: " << HRLOG(hr);
+      return kCodecError;
+    }
+    if (event_type == METransformNeedInput) {
+      ++input_requests_;
+    } else if (event_type == METransformHaveOutput) {
+      bool need_input = false;
+      const int status = ReadOutput(&need_input);
+      if (status) {
+        return status;
+      }
+    } else if (event_type == MEError) {
+      HRESULT event_status = S_OK;
+      event->GetStatus(&event_status);
+      LOG(ERROR) << "MFT reported an error: " << HRLOG(event_status);
+      return kCodecError;
+    }
+
+    // A blocking wait returns after the first event; callers loop.
+    if (wait) {
+      return kSuccess;
+    }
+  }
+}
+
+int MftVideoEncoder::ReadOutput(bool* ptr_need_input) {
+  *ptr_need_input = false;
+  MFT_OUTPUT_DATA_BUFFER output = {0};
+  output.dwStreamID = output_stream_id_;
+  IMFSamplePtr allocated_sample;
+  if (output_sample_size_ > 0) {
+    IMFSample* ptr_sample = NULL;
+    IMFMediaBuffer* ptr_buffer = NULL;
+    HRESULT hr = MFCreateSample(&ptr_sample);
+    if (FAILED(hr)) {
+      return kNoMemory;
+    }
+    allocated_sample.Attach(ptr_sample);
+    hr = MFCreateMemoryBuffer(output_sample_size_, &ptr_buffer);
+    if (FAILED(hr)) {
+      return kNoMemory;
+    }
+    IMFMediaBufferPtr buffer(ptr_buffer, false);
+    allocated_sample->AddBuffer(buffer);
+    output.pSample = allocated_sample;
+  }
+
+  DWORD process_status = 0;
+  HRESULT hr = transform_->ProcessOutput(0, 1, &output, &process_status);
+  if (output.pEvents) {
+    output.pEvents->Release();
+  }
+  if (hr == MF_E_TRANSFORM_NEED_MORE_INPUT) {
+    *ptr_need_input = true;
+    return kSuccess;
+  }
+  if (hr == MF_E_TRANSFORM_STREAM_CHANGE) {
+    // Accept the encoder's renegotiated output type and read again later.
+    IMFMediaType* ptr_type = NULL;
+    hr = transform_->GetOutputAvailableType(output_stream_id_, 0, &ptr_type);
+    if (SUCCEEDED(hr)) {
+      IMFMediaTypePtr output_type(ptr_type, false);
+      hr = transform_->SetOutputType(output_stream_id_, output_type, 0);
+    }
+    if (FAILED(hr)) {
+      LOG(ERROR) << "MFT output type change failed: " << HRLOG(hr);
+      return kCodecError;
+    }
+    return kSuccess;
+  }
+  if (FAILED(hr)) {
+    LOG(ERROR) << "MFT ProcessOutput failed: " << HRLOG(hr);
+    return kCodecError;
+  }
+
+  // Take ownership of MFT provided samples.
+  IMFSamplePtr sample;
+  if (allocated_sample) {
+    sample = allocated_sample;
+  } else {
+    sample.Attach(output.pSample);
+  }
+  if (!sample) {
+    LOG(ERROR) << "MFT ProcessOutput returned no sample.";
+    return kCodecError;
+  }
+
+  LONGLONG sample_time = 0;
+  LONGLONG sample_duration = 0;
+  sample->GetSampleTime(&sample_time);
+  sample->GetSampleDuration(&sample_duration);
+  UINT32 clean_point = FALSE;
+  sample->GetUINT32(MFSampleExtension_CleanPoint, &clean_point);
+
+  IMFMediaBuffer* ptr_buffer = NULL;
+  hr = sample->ConvertToContiguousBuffer(&ptr_buffer);
+  if (FAILED(hr)) {
+    LOG(ERROR) << "ConvertToContiguousBuffer failed: " << HRLOG(hr);
+    return kCodecError;
+  }
+  IMFMediaBufferPtr buffer(ptr_buffer, false);
+  BYTE* ptr_data = NULL;
+  DWORD data_length = 0;
+  hr = buffer->Lock(&ptr_data, NULL, &data_length);
+  if (FAILED(hr)) {
+    LOG(ERROR) << "IMFMediaBuffer Lock failed: " << HRLOG(hr);
+    return kCodecError;
+  }
+  VideoConfig vpx_config = input_config_;
+  vpx_config.format = vpx_config_.codec;
+  output_frames_.emplace_back();
+  const int status =
+      output_frames_.back().Init(vpx_config,
+                                 clean_point != FALSE,
+                                 sample_time / kMfTimePerMillisecond,
+                                 sample_duration / kMfTimePerMillisecond,
+                                 ptr_data,
+                                 static_cast<int32>(data_length));
+  buffer->Unlock();
+  if (status) {
+    output_frames_.pop_back();
+    LOG(ERROR) << "VideoFrame Init failed: " << status;
+    return kEncoderError;
+  }
+  return kSuccess;
+}
+
+}  // namespace webmlive
@@ -0,0 +1,179 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_WIN_MFT_VIDEO_ENCODER_H_
+#define WEBMLIVE_ENCODER_WIN_MFT_VIDEO_ENCODER_H_
+
+#include <comdef.h>
+#include <mfapi.h>
+#include <mftransform.h>
+#include <strmif.h>
+
+#include <deque>
+#include <vector>
+
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+#include "encoder/video_encoder.h"
+
+namespace webmlive {
+
+#ifndef COMPTR_TYPEDEF
+// A slightly more brief version of the com_ptr_t definition macro.
+#define COMPTR_TYPEDEF(InterfaceName) \
+  _COM_SMARTPTR_TYPEDEF(InterfaceName, IID_##InterfaceName)
+#endif
+COMPTR_TYPEDEF(ICodecAPI);
+COMPTR_TYPEDEF(IMFActivate);
+COMPTR_TYPEDEF(IMFAttributes);
+COMPTR_TYPEDEF(IMFMediaBuffer);
+COMPTR_TYPEDEF(IMFMediaEvent);
+COMPTR_TYPEDEF(IMFMediaEventGenerator);
+COMPTR_TYPEDEF(IMFMediaType);
+COMPTR_TYPEDEF(IMFSample);
+COMPTR_TYPEDEF(IMFShutdown);
+COMPTR_TYPEDEF(IMFTransform);
+
+// VPx encoding with a hardware Media Foundation transform. |Init()| picks the
+// first hardware encoder MFT that accepts NV12 input and produces |codec|
+// output at the configured size and frame rate. Asynchronous (vendor) MFTs
+// are driven through their event queue; each |EncodeFrame()| call feeds one
+// frame and returns at most one compressed frame.
+class MftVideoEncoder : public VideoEncoderBackend {
+ public:
+  enum {
+    // A Media Foundation call failed.
+    kCodecError = VideoEncoder::kCodecError,
+    // Error within |MftVideoEncoder|, or no hardware encoder is available.
+    kEncoderError = VideoEncoder::kEncoderError,
+    kNoMemory = VideoEncoder::kNoMemory,
+    kInvalidArg = VideoEncoder::kInvalidArg,
+    kSuccess = VideoEncoder::kSuccess,
+    // Frame dropped, or the MFT has not produced output yet.
+    kDropped = VideoEncoder::kDropped,
+  };
+
+  MftVideoEncoder();
+  virtual ~MftVideoEncoder();
+
+  // Starts Media Foundation, finds and configures a hardware encoder MFT, and
+  // returns |kSuccess|. Returns |kEncoderError| when no hardware encoder
+  // supports the configuration.
+  virtual int Init(const WebmEncoderConfig& config);
+
+  // Converts |raw_frame| to NV12 when necessary, passes it to the MFT, and
+  // returns the oldest compressed frame available via |ptr_vpx_frame|. Return
+  // values:
+  // |kSuccess| - a compressed frame was stored in |ptr_vpx_frame|.
+  // |kDropped| - no output is ready yet.
+  // |kCodecError| - a Media Foundation call failed.
+  virtual int EncodeFrame(const VideoFrame& raw_frame,
+                          VideoFrame* ptr_vpx_frame);
+
+  // Hardware encoders have no speed control, so the backlog is ignored.
+  virtual void SetInputBacklog(int32, int32) {}
+
+  // Sets |CODECAPI_AVEncCommonMeanBitRate|. Encoders that reject dynamic
+  // bitrate changes keep their bitrate; the failure is only logged.
+  virtual int SetBitrate(int bitrate);
+
+  virtual void ForceKeyframe() { force_keyframe_ = true; }
+
+  // Hardware encoders keep the frame size they were configured with, and
+  // have no speed setting or regions of interest.
+  virtual int SetFrameSize(int32, int32) { return kInvalidArg; }
+  virtual int SetSpeed(int) { return kInvalidArg; }
+  virtual int SetRegionsOfInterest(
+      const std::vector<RegionOfInterest>& regions) {
+    return regions.empty() ? kSuccess : kInvalidArg;
+  }
+
+  // Returns the frames read from the MFT beyond one per |EncodeFrame()|.
+  // Frames the MFT itself holds are not drained by |Flush()|.
+  virtual int ReadPendingFrame(VideoFrame* ptr_vpx_frame);
+  virtual int Flush() { return kSuccess; }
+  virtual int32 pending_frames() const {
+    return static_cast<int32>(output_frames_.size());
+  }
+
+  // Sets |CODECAPI_AVEncMPVGOPSize| for the new interval, and forces
+  // keyframes at it. Encoders that reject dynamic GOP size changes keep
+  // their GOP size; the failure is only logged.
+  virtual int SetKeyframeInterval(int keyframe_interval);
+  virtual int load_state() const { return VideoEncoder::kLoadNormal; }
+
+  virtual const char* name() const { return "mft"; }
+
+  // Accessors.
+  virtual int64 frames_in() const { return frames_in_; }
+  virtual int64 frames_out() const { return frames_out_; }
+  virtual int64 last_keyframe_time() const { return last_keyframe_time_; }
+  virtual int64 last_timestamp() const { return last_timestamp_; }
+  virtual int speed() const { return 0; }
+
+ private:
+  // Configures |transform_| for |config|. Returns |kSuccess| when the MFT
+  // accepts the input and output types.
+  int ConfigureTransform(const WebmEncoderConfig& config);
+
+  // Sets a |VT_UI4| |ICodecAPI| property. Failures are logged, not returned,
+  // because encoders support different subsets of the properties.
+  void SetCodecProperty(const GUID& property, uint32 value);
+
+  // Copies |raw_frame| into a new NV12 sample in |ptr_sample|. Only I420 and
+  // YV12 frames are converted.
+  int CreateInputSample(const VideoFrame& raw_frame, IMFSamplePtr* ptr_sample);
+
+  // Waits until an asynchronous MFT requests input, collecting any output it
+  // produces meanwhile. Returns immediately for synchronous MFTs.
+  int WaitForInputRequest();
+
+  // Handles MFT events: METransformNeedInput increments |input_requests_|,
+  // and METransformHaveOutput reads a frame into |output_frames_|. When |wait|
+  // is true, blocks for and handles a single event; otherwise handles queued
+  // events until the queue is empty. Returns |kSuccess| when successful.
+  int ProcessEvents(bool wait);
+
+  // Reads one compressed frame from the MFT into |output_frames_|. Sets
+  // |*ptr_need_input| when the MFT needs more input before producing output.
+  int ReadOutput(bool* ptr_need_input);
+
+  // Frame counters and timing, as in |VpxEncoder|.
+  int64 frames_in_;
+  int64 frames_out_;
+  int64 last_keyframe_time_;
+  int64 last_timestamp_;
+
+  // Set by |ForceKeyframe()| to force a keyframe at the next frame.
+  bool force_keyframe_;
+
+  VpxConfig vpx_config_;
+  VideoConfig input_config_;
+
+  IMFTransformPtr transform_;
+  IMFMediaEventGeneratorPtr event_generator_;
+  ICodecAPIPtr codec_api_;
+  DWORD input_stream_id_;
+  DWORD output_stream_id_;
+
+  // Output sample size for MFTs that do not allocate their own samples. Zero
+  // when the MFT provides samples.
+  DWORD output_sample_size_;
+
+  // Number of METransformNeedInput events not yet answered.
+  int input_requests_;
+
+  // Compressed frames read from the MFT and not yet returned.
+  std::deque<VideoFrame> output_frames_;
+  bool async_;
+  bool mf_started_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(MftVideoEncoder);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_WIN_MFT_VIDEO_ENCODER_H_
@@ -10,6 +10,8 @@
 #include <dvdmedia.h>
 #include <vfwmsgs.h>
 
+#include "encoder/log_util.h"
+#include "encoder/thread_util.h"
 #include "encoder/win/dshow_util.h"
 #include "encoder/win/media_source_dshow.h"
 #include "encoder/win/media_type_dshow.h"
@@ -18,6 +20,112 @@
 
 namespace webmlive {
 
+///////////////////////////////////////////////////////////////////////////////
+// VideoFrameSample
+//
+
+VideoFrameSample::VideoFrameSample(CBaseAllocator* ptr_allocator,
+                                   int32 buffer_size,
+                                   HRESULT* ptr_result)
+    : CMediaSample(NAME("VideoFrameSample"), ptr_allocator, ptr_result),
+      buffer_size_(buffer_size) {
+  if (FAILED(*ptr_result)) {
+    return;
+  }
+  *ptr_result = UpdatePointer();
+}
+
+VideoFrameSample::~VideoFrameSample() {
+}
+
+HRESULT VideoFrameSample::UpdatePointer() {
+  if (frame_.Reserve(buffer_size_)) {
+    LOG(ERROR) << "VideoFrameSample cannot allocate " << buffer_size_;
+    return E_OUTOFMEMORY;
+  }
+  return SetPointer(frame_.buffer(), buffer_size_);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// VideoFrameAllocator
+//
+
+VideoFrameAllocator::VideoFrameAllocator(LPUNKNOWN ptr_iunknown,
+                                         HRESULT* ptr_result)
+    : CBaseAllocator(NAME("VideoFrameAllocator"), ptr_iunknown, ptr_result) {
+}
+
+VideoFrameAllocator::~VideoFrameAllocator() {
+  Decommit();
+  ReallyFree();
+}
+
+STDMETHODIMP VideoFrameAllocator::SetProperties(
+    ALLOCATOR_PROPERTIES* ptr_request,
+    ALLOCATOR_PROPERTIES* ptr_actual) {
+  CheckPointer(ptr_request, E_POINTER);
+  ALLOCATOR_PROPERTIES request = *ptr_request;
+  request.cbPrefix = 0;
+  request.cbAlign = 1;
+  return CBaseAllocator::SetProperties(&request, ptr_actual);
+}
+
+VideoFrameSample* VideoFrameAllocator::FindSample(IMediaSample* ptr_sample) {
+  CAutoLock lock(this);
+  for (size_t i = 0; i < samples_.size(); ++i) {
+    if (static_cast<IMediaSample*>(samples_[i]) == ptr_sample) {
+      return samples_[i];
+    }
+  }
+  return NULL;
+}
+
+// Allocates |m_lCount| samples of |m_lSize| bytes when the allocator
+// properties have changed since the last call.
+HRESULT VideoFrameAllocator::Alloc() {
+  CAutoLock lock(this);
+  HRESULT hr = CBaseAllocator::Alloc();
+  if (FAILED(hr)) {
+    return hr;
+  }
+  if (hr == S_FALSE) {
+    // Requirements unchanged; keep the existing samples.
+    return S_OK;
+  }
+  ReallyFree();
+  for (; m_lAllocated < m_lCount; ++m_lAllocated) {
+    hr = S_OK;
+    VideoFrameSample* const ptr_sample =
+        new (std::nothrow) VideoFrameSample(this, m_lSize, &hr);  // NOLINT
+    if (!ptr_sample || FAILED(hr)) {
+      LOG(ERROR) << "VideoFrameSample construction failed" << HRLOG(hr);
+      delete ptr_sample;
+      return E_OUTOFMEMORY;
+    }
+    samples_.push_back(ptr_sample);
+    m_lFree.Add(ptr_sample);
+  }
+  m_bChanged = FALSE;
+  return S_OK;
+}
+
+// Samples are kept until the allocator is destroyed or reallocated, as in
+// CMemAllocator.
+void VideoFrameAllocator::Free() {
+}
+
+void VideoFrameAllocator::ReallyFree() {
+  for (;;) {
+    CMediaSample* const ptr_sample = m_lFree.RemoveHead();
+    if (!ptr_sample) {
+      break;
+    }
+    delete ptr_sample;
+  }
+  samples_.clear();
+  m_lAllocated = 0;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // VideoSinkPin
 //
@@ -31,10 +139,52 @@ VideoSinkPin::VideoSinkPin(TCHAR* ptr_object_name,
                     ptr_filter,
                     ptr_filter_lock,
                     ptr_result,
-                    ptr_pin_name) {
+                    ptr_pin_name),
+      frame_allocator_(NULL) {
 }
 
 VideoSinkPin::~VideoSinkPin() {
+  if (frame_allocator_) {
+    frame_allocator_->Release();
+    frame_allocator_ = NULL;
+  }
+}
+
+// Provides |frame_allocator_| in place of the CMemAllocator created by
+// CBaseInputPin::GetAllocator.
+STDMETHODIMP VideoSinkPin::GetAllocator(IMemAllocator** ptr_allocator) {
+  CheckPointer(ptr_allocator, E_POINTER);
+  CAutoLock lock(m_pLock);
+  if (!frame_allocator_) {
+    HRESULT hr = S_OK;
+    frame_allocator_ =
+        new (std::nothrow) VideoFrameAllocator(NULL, &hr);  // NOLINT
+    if (!frame_allocator_) {
+      return E_OUTOFMEMORY;
+    }
+    frame_allocator_->AddRef();
+    if (FAILED(hr)) {
+      LOG(ERROR) << "VideoFrameAllocator construction failed" << HRLOG(hr);
+      frame_allocator_->Release();
+      frame_allocator_ = NULL;
+      return hr;
+    }
+  }
+  if (!m_pAllocator) {
+    m_pAllocator = frame_allocator_;
+    m_pAllocator->AddRef();
+  }
+  *ptr_allocator = m_pAllocator;
+  m_pAllocator->AddRef();
+  return S_OK;
+}
+
+VideoFrameSample* VideoSinkPin::FrameSample(IMediaSample* ptr_sample) {
+  if (!frame_allocator_ ||
+      m_pAllocator != static_cast<IMemAllocator*>(frame_allocator_)) {
+    return NULL;
+  }
+  return frame_allocator_->FindSample(ptr_sample);
 }
 
 // Returns preferred media type.
@@ -43,7 +193,7 @@ HRESULT VideoSinkPin::GetMediaType(int32 type_index,
   if (type_index < 0 || !ptr_media_type) {
     return E_INVALIDARG;
   }
-  if (type_index > 1) {
+  if (type_index > 2) {
     return VFW_S_NO_MORE_ITEMS;
   }
   VIDEOINFOHEADER* const ptr_video_info =
@@ -77,11 +227,16 @@ HRESULT VideoSinkPin::GetMediaType(int32 type_index,
     ptr_video_info->bmiHeader.biCompression = MAKEFOURCC('I', '4', '2', '0');
     ptr_video_info->bmiHeader.biBitCount = kI420BitCount;
     ptr_media_type->SetSubtype(&MEDIASUBTYPE_I420);
-  } else {
+  } else if (type_index == 1) {
     // Set sub type and format data for YV12.
     ptr_video_info->bmiHeader.biCompression = MAKEFOURCC('Y', 'V', '1', '2');
     ptr_video_info->bmiHeader.biBitCount = kYV12BitCount;
     ptr_media_type->SetSubtype(&MEDIASUBTYPE_YV12);
+  } else {
+    // Set sub type and format data for NV12.
+    ptr_video_info->bmiHeader.biCompression = MAKEFOURCC('N', 'V', '1', '2');
+    ptr_video_info->bmiHeader.biBitCount = kNV12BitCount;
+    ptr_media_type->SetSubtype(&MEDIASUBTYPE_NV12);
   }
 
   // Set sample size.
@@ -155,8 +310,17 @@ HRESULT VideoSinkPin::CheckMediaType(const CMediaType* ptr_media_type) {
       actual_config_.height = ptr_header->biHeight;
 
       // Store the stride for use with |VideoFrame::Init()|-- it's needed for
-      // format conversion.
+      // format conversion. Planar formats arrive with packed planes, so the
+      // Y plane stride is the width.
       actual_config_.stride = DIBWIDTHBYTES(*ptr_header);
+      actual_config_.uv_stride = 0;
+      if (actual_config_.format == kVideoFormatI420 ||
+          actual_config_.format == kVideoFormatYV12 ||
+          actual_config_.format == kVideoFormatNV12) {
+        actual_config_.stride = ptr_header->biWidth;
+      }
+      actual_config_.field_order =
+          VideoFieldOrderFromFormat(format_guid, ptr_format, format_length);
     }
   }
 
@@ -164,13 +328,40 @@ HRESULT VideoSinkPin::CheckMediaType(const CMediaType* ptr_media_type) {
             << "   width=" << actual_config_.width << "\n"
             << "   height=" << actual_config_.height << "\n"
             << "   stride=" << actual_config_.stride << "\n"
-            << "   format=" << actual_config_.format;
+            << "   format=" << actual_config_.format << "\n"
+            << "   field_order=" << actual_config_.field_order;
+  return S_OK;
+}
+
+// Plans the conversion of the frames of the new media type once, so that
+// |VideoFrame::InitConverted()| does not revisit the format of every frame.
+HRESULT VideoSinkPin::SetMediaType(const CMediaType* ptr_media_type) {
+  const HRESULT hr = CBaseInputPin::SetMediaType(ptr_media_type);
+  if (FAILED(hr)) {
+    return hr;
+  }
+  conversion_plan_.reset();
+  if (VideoFrame::NeedsConversion(actual_config_.format) ||
+      actual_config_.format == kVideoFormatNV12) {
+    std::shared_ptr<VideoConversionPlan> plan =
+        std::make_shared<VideoConversionPlan>();
+    if (plan->Init(actual_config_)) {
+      LOG(WARNING) << "cannot plan the conversion of format "
+                   << actual_config_.format << " frames.";
+    } else {
+      LOG(INFO) << "planned the conversion of format "
+                << actual_config_.format << " frames to I420, CPU flags 0x"
+                << std::hex << plan->cpu_flags() << std::dec << ".";
+      conversion_plan_ = plan;
+    }
+  }
   return S_OK;
 }
 
 // Calls CBaseInputPin::Receive and then passes |ptr_sample| to
 // |VideoSinkFilter::OnFrameReceived|.
 HRESULT VideoSinkPin::Receive(IMediaSample* ptr_sample) {
+  ThreadRegistry::RegisterSystemThread("video_capture");
   CHECK_NOTNULL(m_pFilter);
   CHECK_NOTNULL(ptr_sample);
   VideoSinkFilter* ptr_filter = reinterpret_cast<VideoSinkFilter*>(m_pFilter);
@@ -192,8 +383,12 @@ HRESULT VideoSinkPin::Receive(IMediaSample* ptr_sample) {
 }
 
 bool VideoSinkPin::AcceptableSubType(const GUID& media_sub_type) {
+  if (media_sub_type == MEDIASUBTYPE_MJPG) {
+    return VideoConversionPlan::CanConvert(kVideoFormatMJPG);
+  }
   return (media_sub_type == MEDIASUBTYPE_I420 ||
           media_sub_type == MEDIASUBTYPE_YV12 ||
+          media_sub_type == MEDIASUBTYPE_NV12 ||
           media_sub_type == MEDIASUBTYPE_YUY2 ||
           media_sub_type == MEDIASUBTYPE_YUYV ||
           media_sub_type == MEDIASUBTYPE_UYVY ||
@@ -302,7 +497,8 @@ HRESULT VideoSinkFilter::OnFrameReceived(IMediaSample* ptr_sample) {
   if (hr != VFW_S_NO_STOP_TIME) {
     duration = media_time_to_milliseconds(end_time) - timestamp;
   } else {
-    LOG(WARNING) << "OnFrameReceived using time per frame for duration.";
+    WEBMLIVE_LOG_EVERY_MS(WARNING, kLogIntervalMs)
+        << "OnFrameReceived using time per frame for duration.";
     AM_MEDIA_TYPE media_type = {0};
     hr = sink_pin_->ConnectionMediaType(&media_type);
     if (FAILED(hr)) {
@@ -317,33 +513,60 @@ HRESULT VideoSinkFilter::OnFrameReceived(IMediaSample* ptr_sample) {
     duration = media_time_to_milliseconds(video_format.avg_time_per_frame());
   }
 
-  // TODO(tomfinegan): Write an allocator that retrieves frames from
-  //                   |WebmEncoder::EncoderThread| and avoid this extra copy.
-
-  const int status = frame_.Init(sink_pin_->actual_config_,
-                                 true,  // always "keyframes"
-                                 timestamp,
-                                 duration,
-                                 ptr_sample_buffer,
-                                 ptr_sample->GetActualDataLength());
+  // Frames are passed on in their capture format; the callback converts them,
+  // off this streaming thread, when necessary. When the upstream filter wrote
+  // the frame into a |VideoFrameSample|, hand the sample's |VideoFrame| to the
+  // callback directly. |BufferPool::Commit()| swaps buffers, so the frame data
+  // is not copied.
+  VideoFrameSample* const ptr_frame_sample = sink_pin_->FrameSample(ptr_sample);
+  const bool zero_copy =
+      ptr_frame_sample &&
+      ptr_frame_sample->frame()->buffer() == ptr_sample_buffer;
+  VideoFrame* const ptr_frame = zero_copy ? ptr_frame_sample->frame() : &frame_;
+  int status = VideoFrame::kSuccess;
+  if (zero_copy) {
+    status = ptr_frame->InitInPlace(sink_pin_->actual_config_,
+                                    true,  // always "keyframes"
+                                    timestamp,
+                                    duration,
+                                    ptr_sample->GetActualDataLength());
+  } else {
+    status = frame_.InitNative(sink_pin_->actual_config_,
+                               true,  // always "keyframes"
+                               timestamp,
+                               duration,
+                               ptr_sample_buffer,
+                               ptr_sample->GetActualDataLength());
+  }
   if (status) {
     LOG(ERROR) << "OnFrameReceived frame init failed: " << status;
     return E_FAIL;
   }
-  LOG(INFO) << "OnFrameReceived received a frame:"
-            << " width="  << sink_pin_->actual_config_.width
-            << " height=" << sink_pin_->actual_config_.height
-            << " format=" << sink_pin_->actual_config_.format
-            << " stride=" << sink_pin_->actual_config_.stride
-            << " timestamp(sec)=" << (timestamp / 1000.0)
-            << " timestamp="      << timestamp
-            << " duration(sec)= " << (duration / 1000.0)
-            << " duration= "      << duration
-            << " size=" << frame_.buffer_length();
-  int frame_status = ptr_frame_callback_->OnVideoFrameReceived(&frame_);
+  ptr_frame->set_conversion_plan(sink_pin_->conversion_plan_);
+  WEBMLIVE_HOT_LOG(INFO) << "OnFrameReceived received a frame:"
+      << " width="  << sink_pin_->actual_config_.width
+      << " height=" << sink_pin_->actual_config_.height
+      << " format=" << sink_pin_->actual_config_.format
+      << " stride=" << sink_pin_->actual_config_.stride
+      << " timestamp(sec)=" << (timestamp / 1000.0)
+      << " timestamp="      << timestamp
+      << " duration(sec)= " << (duration / 1000.0)
+      << " duration= "      << duration
+      << " size=" << ptr_frame->buffer_length()
+      << " zero_copy=" << zero_copy;
+  int frame_status = ptr_frame_callback_->OnVideoFrameReceived(ptr_frame);
   if (frame_status && frame_status != VideoFrameCallbackInterface::kDropped) {
     LOG(ERROR) << "OnVideoFrameReceived failed, status=" << frame_status;
   }
+  if (zero_copy) {
+    // The callback may have swapped the frame's buffer; point the sample at
+    // the buffer the frame now owns before it returns to the allocator.
+    hr = ptr_frame_sample->UpdatePointer();
+    if (FAILED(hr)) {
+      LOG(ERROR) << "VideoFrameSample UpdatePointer failed: " << HRLOG(hr);
+      return hr;
+    }
+  }
   return S_OK;
 }
 
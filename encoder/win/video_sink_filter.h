@@ -13,6 +13,7 @@
 #define WEBMLIVE_ENCODER_WIN_VIDEO_SINK_FILTER_H_
 
 #include <memory>
+#include <vector>
 
 // Wrap include of streams.h with include guard used in the file: including the
 // file twice results in the output "STREAMS.H included TWICE" for debug
@@ -38,6 +39,61 @@ namespace webmlive {
 // Forward declare |VideoSinkFilter| for use in |VideoSinkPin|.
 class VideoSinkFilter;
 
+// Media sample whose memory is the buffer of a |VideoFrame|. Allows upstream
+// filters to write frames directly into storage that the encoder consumes.
+class VideoFrameSample : public CMediaSample {
+ public:
+  // Allocates |buffer_size| bytes in |frame_| and points the sample at them.
+  // Returns result via |ptr_result|.
+  VideoFrameSample(CBaseAllocator* ptr_allocator,
+                   int32 buffer_size,
+                   HRESULT* ptr_result);
+  virtual ~VideoFrameSample();
+
+  // Points the sample at |frame_|'s current buffer. Must be called after
+  // |frame_| has been passed to |VideoFrameCallbackInterface|, which may swap
+  // the buffer out from under the sample. Reallocates when the new buffer is
+  // smaller than |buffer_size_|. Returns S_OK when successful.
+  HRESULT UpdatePointer();
+
+  VideoFrame* frame() { return &frame_; }
+
+ private:
+  VideoFrame frame_;
+  const int32 buffer_size_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(VideoFrameSample);
+};
+
+// Allocator used by |VideoSinkPin| to provide |VideoFrameSample|s to the
+// upstream filter. Mirrors CMemAllocator: samples are retained across
+// Decommit/Commit, and released only when properties change or the allocator
+// is destroyed.
+class VideoFrameAllocator : public CBaseAllocator {
+ public:
+  VideoFrameAllocator(LPUNKNOWN ptr_iunknown, HRESULT* ptr_result);
+  virtual ~VideoFrameAllocator();
+
+  // Forces |cbPrefix| to 0 and |cbAlign| to 1 (|VideoFrame| buffers support
+  // neither), and then calls |CBaseAllocator::SetProperties|.
+  STDMETHODIMP SetProperties(ALLOCATOR_PROPERTIES* ptr_request,
+                             ALLOCATOR_PROPERTIES* ptr_actual);
+
+  // Returns |ptr_sample| as a |VideoFrameSample| when it was allocated by
+  // this allocator, or NULL.
+  VideoFrameSample* FindSample(IMediaSample* ptr_sample);
+
+ private:
+  // CBaseAllocator methods.
+  virtual HRESULT Alloc();
+  virtual void Free();
+
+  // Deletes all samples. All samples must be in |m_lFree|.
+  void ReallyFree();
+
+  std::vector<VideoFrameSample*> samples_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(VideoFrameAllocator);
+};
+
 // Pin class used by |VideoSinkFilter|. Accepts only I420 video input.
 class VideoSinkPin : public CBaseInputPin {
  public:
@@ -54,11 +110,11 @@ class VideoSinkPin : public CBaseInputPin {
   // CBasePin methods
   //
 
-  // Stores preferred media type for |type_index| in |ptr_media_type|. Supports
-  // only a single type, I420.
+  // Stores preferred media type for |type_index| in |ptr_media_type|. Offers
+  // the types libvpx accepts without conversion: I420, YV12 and NV12.
   // Return values:
   // S_OK - success, |type_index| in range and |ptr_media_type| written.
-  // VFW_S_NO_MORE_ITEMS - |type_index| != 0.
+  // VFW_S_NO_MORE_ITEMS - |type_index| > 2.
   // E_OUTOFMEMORY - could not allocate format buffer.
   virtual HRESULT GetMediaType(int32 type_index, CMediaType* ptr_media_type);
 
@@ -71,6 +127,12 @@ class VideoSinkPin : public CBaseInputPin {
   // VFW_E_TYPE_NOT_ACCEPTED - |ptr_media_type| is not supported.
   virtual HRESULT CheckMediaType(const CMediaType* ptr_media_type);
 
+  // Calls CBaseInputPin::SetMediaType, and then plans the conversion to
+  // I420 of |actual_config_| frames, when they need one, in
+  // |conversion_plan_|. Returns S_OK, or the error returned by
+  // CBaseInputPin::SetMediaType.
+  virtual HRESULT SetMediaType(const CMediaType* ptr_media_type);
+
   //
   // IMemInputPin method(s).
   //
@@ -81,7 +143,15 @@ class VideoSinkPin : public CBaseInputPin {
   // if it fails.
   virtual HRESULT STDMETHODCALLTYPE Receive(IMediaSample* ptr_sample);
 
+  // Returns |frame_allocator_|, constructing it if necessary. Upstream filters
+  // that use the returned allocator deliver |VideoFrameSample|s.
+  STDMETHODIMP GetAllocator(IMemAllocator** ptr_allocator);
+
  private:
+  // Returns |ptr_sample| as a |VideoFrameSample| when the pin is using
+  // |frame_allocator_|, or NULL.
+  VideoFrameSample* FrameSample(IMediaSample* ptr_sample);
+
   // Copies |actual_config_| to |ptr_config| and returns S_OK. Returns
   // E_POINTER when |ptr_config| is NULL.
   HRESULT config(VideoConfig* ptr_config) const;
@@ -90,7 +160,8 @@ class VideoSinkPin : public CBaseInputPin {
   // then returns S_OK.
   HRESULT set_config(const VideoConfig& config);
 
-  // Returns true when |media_sub_type| is an acceptable video format.
+  // Returns true when |media_sub_type| is an acceptable video format. MJPEG
+  // is acceptable when |VideoConversionPlan| can decode it.
   bool AcceptableSubType(const GUID& media_sub_type);
 
   // Filter user's requested video config.
@@ -98,11 +169,18 @@ class VideoSinkPin : public CBaseInputPin {
 
   // Actual video config (from upstream filter).
   VideoConfig actual_config_;
+
+  // Conversion to I420 of the frames of the connection, attached to each
+  // frame delivered. NULL when they need none, or it cannot be planned.
+  std::shared_ptr<const VideoConversionPlan> conversion_plan_;
+
+  // Zero copy sample allocator. Holds a reference.
+  VideoFrameAllocator* frame_allocator_;
   WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(VideoSinkPin);
 
-  // |VideoSinkFilter| requires access to private member |actual_config_|, and
-  // private methods |config| and |set_config| for configuration retrieval and
-  // control.
+  // |VideoSinkFilter| requires access to private members |actual_config_|
+  // and |conversion_plan_|, and private methods |config| and |set_config|
+  // for configuration retrieval and control.
   friend class VideoSinkFilter;
 };
 
@@ -128,6 +206,10 @@ class VideoSinkFilter : public CBaseFilter {
   // Sets actual requested video configuration and returns S_OK.
   HRESULT set_config(const VideoConfig& config);
 
+  // Returns the reference clock time of stream time 0, passed to |Run()|.
+  // Valid while the filter runs.
+  REFERENCE_TIME stream_start() const { return m_tStart; }
+
   // IUnknown
   DECLARE_IUNKNOWN;
 
@@ -139,7 +221,9 @@ class VideoSinkFilter : public CBaseFilter {
 
  private:
   // Copes video frame from |ptr_sample| to |frame_|, and passes |frame_| to
-  // |VideoFrameCallbackInterface::OnVideoFrameReceived| for processing.
+  // |VideoFrameCallbackInterface::OnVideoFrameReceived| for processing. When
+  // |ptr_sample| is a |VideoFrameSample| holding a frame that needs no
+  // conversion, its |VideoFrame| is passed instead and no copy is made.
   // Returns S_OK when successful.
   HRESULT OnFrameReceived(IMediaSample* ptr_sample);
   mutable CCritSec filter_lock_;
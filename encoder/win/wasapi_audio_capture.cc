@@ -0,0 +1,504 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "encoder/win/wasapi_audio_capture.h"
+
+#include <initguid.h>  // MUST be included before functiondiscoverykeys to
+                       // define PKEY_Device_FriendlyName.
+#include <functiondiscoverykeys_devpkey.h>
+#include <ksmedia.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include "encoder/log_util.h"
+#include "encoder/thread_util.h"
+#include "encoder/webm_encoder.h"
+#include "encoder/win/dshow_util.h"
+#include "glog/logging.h"
+
+namespace webmlive {
+
+namespace {
+
+// 100 ns units per second and per millisecond.
+const int64 kTicksPerSecond = 10000000;
+const int64 kTicksPerMs = 10000;
+
+// Periods the shared mode endpoint buffers.
+const int kSharedBufferPeriods = 4;
+
+// Converts the QPC count |counter| to 100 ns units.
+int64 CounterToTicks(int64 counter, int64 frequency) {
+  const int64 seconds = counter / frequency;
+  const int64 remainder = counter % frequency;
+  return seconds * kTicksPerSecond + remainder * kTicksPerSecond / frequency;
+}
+
+int64 QpcNow() {
+  LARGE_INTEGER now = {0};
+  QueryPerformanceCounter(&now);
+  return now.QuadPart;
+}
+
+// Converts |wstr| to UTF-8 for logging.
+std::string WideToUtf8(const std::wstring& wstr) {
+  const int length = WideCharToMultiByte(CP_UTF8, 0, wstr.c_str(),
+                                         static_cast<int>(wstr.length()),
+                                         NULL, 0, NULL, NULL);
+  std::string str(length > 0 ? length : 0, '\0');
+  if (length > 0) {
+    WideCharToMultiByte(CP_UTF8, 0, wstr.c_str(),
+                        static_cast<int>(wstr.length()), &str[0], length,
+                        NULL, NULL);
+  }
+  return str;
+}
+
+// Returns the friendly name of |device|, or an empty string.
+std::wstring GetFriendlyName(IMMDevice* ptr_device) {
+  IPropertyStore* ptr_properties = NULL;
+  std::wstring name;
+  if (SUCCEEDED(ptr_device->OpenPropertyStore(STGM_READ, &ptr_properties))) {
+    PROPVARIANT value;
+    PropVariantInit(&value);
+    if (SUCCEEDED(ptr_properties->GetValue(PKEY_Device_FriendlyName,
+                                           &value)) &&
+        value.vt == VT_LPWSTR && value.pwszVal) {
+      name = value.pwszVal;
+    }
+    PropVariantClear(&value);
+    ptr_properties->Release();
+  }
+  return name;
+}
+
+}  // namespace
+
+WasapiAudioCapture::WasapiAudioCapture()
+    : event_(NULL),
+      exclusive_(false),
+      period_frames_(0),
+      qpc_start_(0),
+      qpc_frequency_(1),
+      anchor_time_(-1),
+      anchor_position_(0),
+      storage_capacity_(0),
+      pending_frames_(0),
+      pending_timestamp_(0),
+      ptr_callback_(NULL),
+      stop_(false),
+      status_(kSuccess) {
+  LARGE_INTEGER frequency = {0};
+  if (QueryPerformanceFrequency(&frequency) && frequency.QuadPart > 0) {
+    qpc_frequency_ = frequency.QuadPart;
+  }
+}
+
+WasapiAudioCapture::~WasapiAudioCapture() {
+  Stop();
+  capture_client_ = 0;
+  audio_client_ = 0;
+  device_ = 0;
+  if (event_) {
+    CloseHandle(event_);
+  }
+}
+
+int WasapiAudioCapture::Init(const std::wstring& device_name,
+                             int device_index, const AudioConfig& requested,
+                             int period_ms, bool exclusive,
+                             AudioSamplesCallbackInterface* ptr_callback) {
+  if (!ptr_callback || period_ms < 0) {
+    LOG(ERROR) << "NULL audio callback, or negative period.";
+    return kInvalidArg;
+  }
+  Stop();
+  capture_client_ = 0;
+  audio_client_ = 0;
+  ptr_callback_ = ptr_callback;
+  exclusive_ = exclusive;
+  int status = FindDevice(device_name, device_index);
+  if (status) {
+    return status;
+  }
+
+  // The engine converts to the requested format in shared mode; exclusive
+  // mode captures it from the device.
+  const bool capture_float = requested.format_tag == kAudioFormatIeeeFloat;
+  WAVEFORMATEXTENSIBLE format = {0};
+  format.Format.wFormatTag = WAVE_FORMAT_EXTENSIBLE;
+  format.Format.nChannels = requested.channels > 0 ? requested.channels : 2;
+  format.Format.nSamplesPerSec =
+      requested.sample_rate > 0 ? requested.sample_rate : 44100;
+  format.Format.wBitsPerSample = capture_float ? 32 :
+      (requested.bits_per_sample > 0 ? requested.bits_per_sample : 16);
+  format.Format.nBlockAlign =
+      format.Format.nChannels * format.Format.wBitsPerSample / 8;
+  format.Format.nAvgBytesPerSec =
+      format.Format.nSamplesPerSec * format.Format.nBlockAlign;
+  format.Format.cbSize =
+      sizeof(WAVEFORMATEXTENSIBLE) - sizeof(WAVEFORMATEX);
+  format.Samples.wValidBitsPerSample = format.Format.wBitsPerSample;
+  format.dwChannelMask = format.Format.nChannels == 1 ? KSAUDIO_SPEAKER_MONO :
+      format.Format.nChannels == 2 ? KSAUDIO_SPEAKER_STEREO : 0;
+  format.SubFormat = capture_float ? KSDATAFORMAT_SUBTYPE_IEEE_FLOAT :
+      KSDATAFORMAT_SUBTYPE_PCM;
+
+  const int period = period_ms > 0 ? period_ms : kDefaultPeriodMs;
+  status = InitAudioClient(format, period * kTicksPerMs);
+  if (status) {
+    return status;
+  }
+  if (!event_) {
+    event_ = CreateEvent(NULL, FALSE, FALSE, NULL);
+  }
+  HRESULT hr = event_ ? audio_client_->SetEventHandle(event_) : E_HANDLE;
+  if (SUCCEEDED(hr)) {
+    hr = audio_client_->GetService(__uuidof(IAudioCaptureClient),
+                                   reinterpret_cast<void**>(&capture_client_));
+  }
+  if (FAILED(hr)) {
+    LOG(ERROR) << "cannot create audio capture client." << HRLOG(hr);
+    audio_client_ = 0;
+    return kDeviceError;
+  }
+
+  actual_config_ = AudioConfig();
+  actual_config_.format_tag =
+      capture_float ? kAudioFormatIeeeFloat : kAudioFormatPcm;
+  actual_config_.channels = format.Format.nChannels;
+  actual_config_.sample_rate = format.Format.nSamplesPerSec;
+  actual_config_.bytes_per_second = format.Format.nAvgBytesPerSec;
+  actual_config_.block_align = format.Format.nBlockAlign;
+  actual_config_.bits_per_sample = format.Format.wBitsPerSample;
+  actual_config_.valid_bits_per_sample = format.Samples.wValidBitsPerSample;
+  actual_config_.channel_mask = format.dwChannelMask;
+  period_frames_ = std::max<int32>(
+      1, static_cast<int32>(static_cast<int64>(actual_config_.sample_rate) *
+                            period / 1000));
+  const int32 period_size = period_frames_ * actual_config_.block_align;
+  if (storage_capacity_ < period_size) {
+    storage_ = AllocateMediaBuffer(std::shared_ptr<MediaArena>(),
+                                   period_size, &storage_capacity_);
+    if (!storage_) {
+      storage_capacity_ = 0;
+      audio_client_ = 0;
+      capture_client_ = 0;
+      return kNoMemory;
+    }
+  }
+  LOG(INFO) << "WASAPI " << (exclusive_ ? "exclusive" : "shared")
+            << " capture from " << WideToUtf8(device_name_) << ": "
+            << actual_config_.channels << " channels at "
+            << actual_config_.sample_rate << " Hz, "
+            << actual_config_.bits_per_sample << " bits, periods of "
+            << period_frames_ << " frames.";
+  return kSuccess;
+}
+
+int WasapiAudioCapture::FindDevice(const std::wstring& device_name,
+                                   int device_index) {
+  IMMDeviceEnumeratorPtr enumerator;
+  HRESULT hr = enumerator.CreateInstance(__uuidof(MMDeviceEnumerator));
+  if (FAILED(hr)) {
+    LOG(ERROR) << "cannot create audio device enumerator." << HRLOG(hr);
+    return kDeviceError;
+  }
+  device_ = 0;
+  if (device_name.empty() && device_index == kUseDefaultDevice) {
+    hr = enumerator->GetDefaultAudioEndpoint(eCapture, eConsole, &device_);
+    if (FAILED(hr) || !device_) {
+      LOG(ERROR) << "no default audio capture endpoint." << HRLOG(hr);
+      return kNoDevice;
+    }
+    device_name_ = GetFriendlyName(device_);
+    return kSuccess;
+  }
+  IMMDeviceCollectionPtr devices;
+  hr = enumerator->EnumAudioEndpoints(eCapture, DEVICE_STATE_ACTIVE,
+                                      &devices);
+  UINT count = 0;
+  if (SUCCEEDED(hr)) {
+    hr = devices->GetCount(&count);
+  }
+  if (FAILED(hr)) {
+    LOG(ERROR) << "cannot enumerate audio capture endpoints." << HRLOG(hr);
+    return kDeviceError;
+  }
+  for (UINT i = 0; i < count; ++i) {
+    IMMDevicePtr device;
+    if (FAILED(devices->Item(i, &device))) {
+      continue;
+    }
+    const std::wstring name = GetFriendlyName(device);
+    LOG(INFO) << "wasapi" << i << ": " << WideToUtf8(name);
+    if (device_name.empty() ? static_cast<int>(i) == device_index :
+        name == device_name) {
+      device_ = device;
+      device_name_ = name;
+      return kSuccess;
+    }
+  }
+  LOG(ERROR) << "audio capture endpoint not found after " << count
+             << " endpoints!";
+  return kNoDevice;
+}
+
+int WasapiAudioCapture::InitAudioClient(const WAVEFORMATEXTENSIBLE& format,
+                                        REFERENCE_TIME period) {
+  const WAVEFORMATEX* const ptr_format = &format.Format;
+  for (int attempt = 0; attempt < 2; ++attempt) {
+    audio_client_ = 0;
+    HRESULT hr = device_->Activate(__uuidof(IAudioClient), CLSCTX_ALL, NULL,
+                                   reinterpret_cast<void**>(&audio_client_));
+    if (FAILED(hr)) {
+      LOG(ERROR) << "cannot activate audio client." << HRLOG(hr);
+      return kDeviceError;
+    }
+    if (exclusive_) {
+      REFERENCE_TIME default_period = 0;
+      REFERENCE_TIME min_period = 0;
+      if (SUCCEEDED(audio_client_->GetDevicePeriod(&default_period,
+                                                   &min_period))) {
+        period = std::max(period, min_period);
+      }
+      hr = audio_client_->Initialize(AUDCLNT_SHAREMODE_EXCLUSIVE,
+                                     AUDCLNT_STREAMFLAGS_EVENTCALLBACK,
+                                     period, period, ptr_format, NULL);
+      if (hr == AUDCLNT_E_BUFFER_SIZE_NOT_ALIGNED && attempt == 0) {
+        // The period must span a whole number of device buffers: use the
+        // aligned size the device reports.
+        UINT32 buffer_frames = 0;
+        if (FAILED(audio_client_->GetBufferSize(&buffer_frames))) {
+          break;
+        }
+        period = kTicksPerSecond * buffer_frames /
+                 ptr_format->nSamplesPerSec;
+        LOG(INFO) << "aligned WASAPI exclusive period to "
+                  << period / kTicksPerMs << " ms.";
+        continue;
+      }
+    } else {
+      hr = audio_client_->Initialize(
+          AUDCLNT_SHAREMODE_SHARED,
+          AUDCLNT_STREAMFLAGS_EVENTCALLBACK |
+              AUDCLNT_STREAMFLAGS_AUTOCONVERTPCM |
+              AUDCLNT_STREAMFLAGS_SRC_DEFAULT_QUALITY,
+          period * kSharedBufferPeriods, 0, ptr_format, NULL);
+    }
+    if (FAILED(hr)) {
+      LOG(ERROR) << "cannot initialize audio client for "
+                 << ptr_format->nChannels << " channels at "
+                 << ptr_format->nSamplesPerSec << " Hz." << HRLOG(hr);
+      audio_client_ = 0;
+      return kDeviceError;
+    }
+    return kSuccess;
+  }
+  audio_client_ = 0;
+  return kDeviceError;
+}
+
+int WasapiAudioCapture::Run(const StreamTimeFunction& stream_time) {
+  if (!capture_client_ || thread_) {
+    LOG(ERROR) << "WASAPI capture not initialized, or already running.";
+    return kDeviceError;
+  }
+  stream_time_ = stream_time;
+  qpc_start_ = QpcNow();
+  anchor_time_ = -1;
+  anchor_position_ = 0;
+  pending_frames_ = 0;
+  const HRESULT hr = audio_client_->Start();
+  if (FAILED(hr)) {
+    LOG(ERROR) << "cannot start WASAPI capture." << HRLOG(hr);
+    return kDeviceError;
+  }
+  stop_ = false;
+  status_ = kSuccess;
+  thread_.reset(new (std::nothrow) std::thread(  // NOLINT
+      &WasapiAudioCapture::CaptureThread, this));
+  if (!thread_) {
+    LOG(ERROR) << "out of memory.";
+    audio_client_->Stop();
+    return kNoMemory;
+  }
+  return kSuccess;
+}
+
+void WasapiAudioCapture::Stop() {
+  stop_ = true;
+  if (thread_) {
+    thread_->join();
+    thread_.reset();
+  }
+  if (audio_client_) {
+    audio_client_->Stop();
+    audio_client_->Reset();
+  }
+}
+
+REFERENCE_TIME WasapiAudioCapture::StreamTimeNow() {
+  REFERENCE_TIME stream_time = 0;
+  if (stream_time_ && stream_time_(&stream_time)) {
+    return stream_time;
+  }
+  return CounterToTicks(QpcNow() - qpc_start_, qpc_frequency_);
+}
+
+void WasapiAudioCapture::CaptureThread() {
+  ScopedThreadRegistration registration("audio_capture");
+  const HRESULT hr = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+  while (!stop_) {
+    const DWORD wait = WaitForSingleObject(event_, kWaitTimeoutMs);
+    if (wait == WAIT_TIMEOUT) {
+      continue;
+    }
+    if (wait != WAIT_OBJECT_0) {
+      LOG(ERROR) << "WASAPI event wait failed: " << GetLastError();
+      status_ = kDeviceError;
+      break;
+    }
+    const int status = ReadPackets();
+    if (status) {
+      status_ = status;
+      break;
+    }
+  }
+  if (SUCCEEDED(hr)) {
+    CoUninitialize();
+  }
+}
+
+int WasapiAudioCapture::ReadPackets() {
+  const int32 block_align = actual_config_.block_align;
+  UINT32 packet_frames = 0;
+  HRESULT hr = capture_client_->GetNextPacketSize(&packet_frames);
+  while (SUCCEEDED(hr) && packet_frames > 0) {
+    BYTE* ptr_data = NULL;
+    UINT32 frames = 0;
+    DWORD flags = 0;
+    UINT64 device_position = 0;
+    UINT64 qpc_position = 0;
+    hr = capture_client_->GetBuffer(&ptr_data, &frames, &flags,
+                                    &device_position, &qpc_position);
+    if (FAILED(hr) || hr == AUDCLNT_S_BUFFER_EMPTY) {
+      break;
+    }
+    const bool discontinuity =
+        (flags & AUDCLNT_BUFFERFLAGS_DATA_DISCONTINUITY) != 0;
+    if (discontinuity) {
+      WEBMLIVE_LOG_EVERY_MS(WARNING, kLogIntervalMs)
+          << "WASAPI capture discontinuity: samples were lost.";
+    }
+    UpdateTimestamp(device_position, qpc_position, discontinuity);
+
+    // Copy straight from the endpoint buffer into the storage the next
+    // |AudioBuffer| takes.
+    UINT32 offset = 0;
+    while (offset < frames) {
+      const int32 count = std::min<int32>(frames - offset,
+                                          period_frames_ - pending_frames_);
+      uint8* const ptr_target =
+          storage_.get() + pending_frames_ * block_align;
+      if (flags & AUDCLNT_BUFFERFLAGS_SILENT) {
+        memset(ptr_target, 0, count * block_align);
+      } else {
+        memcpy(ptr_target, ptr_data + offset * block_align,
+               count * block_align);
+      }
+      pending_frames_ += count;
+      offset += count;
+      if (pending_frames_ == period_frames_ && DeliverPeriod()) {
+        capture_client_->ReleaseBuffer(frames);
+        return kDeviceError;
+      }
+    }
+    hr = capture_client_->ReleaseBuffer(frames);
+    if (SUCCEEDED(hr)) {
+      hr = capture_client_->GetNextPacketSize(&packet_frames);
+    }
+  }
+  if (FAILED(hr)) {
+    LOG(ERROR) << "WASAPI capture failed." << HRLOG(hr);
+    return kDeviceError;
+  }
+  return kSuccess;
+}
+
+void WasapiAudioCapture::UpdateTimestamp(uint64 device_position,
+                                         uint64 qpc_position,
+                                         bool discontinuity) {
+  // QPC time of the packet, moved onto the stream clock by the offset
+  // between the clocks now.
+  const int64 qpc_now = CounterToTicks(QpcNow(), qpc_frequency_);
+  const REFERENCE_TIME mapped_time =
+      StreamTimeNow() - (qpc_now - static_cast<int64>(qpc_position));
+  const int64 sample_rate = actual_config_.sample_rate;
+  REFERENCE_TIME packet_time = mapped_time;
+  if (anchor_time_ >= 0 && !discontinuity &&
+      device_position >= anchor_position_) {
+    const REFERENCE_TIME position_time =
+        anchor_time_ + static_cast<int64>(device_position - anchor_position_) *
+                           kTicksPerSecond / sample_rate;
+    if (std::abs(position_time - mapped_time) <= kMaxDriftMs * kTicksPerMs) {
+      packet_time = position_time;
+    } else {
+      WEBMLIVE_LOG_EVERY_MS(WARNING, kLogIntervalMs)
+          << "WASAPI position drifted "
+          << (position_time - mapped_time) / kTicksPerMs
+          << " ms from the stream clock, anchoring again.";
+      anchor_time_ = -1;
+    }
+  }
+  if (anchor_time_ < 0 || discontinuity) {
+    anchor_time_ = mapped_time;
+    anchor_position_ = device_position;
+  }
+
+  // Collected samples precede the packet.
+  const int64 pending_ticks = pending_frames_ * kTicksPerSecond / sample_rate;
+  pending_timestamp_ =
+      std::max<int64>(0, (packet_time - pending_ticks) / kTicksPerMs);
+}
+
+int WasapiAudioCapture::DeliverPeriod() {
+  const int32 period_size = pending_frames_ * actual_config_.block_align;
+  const int64 duration =
+      pending_frames_ * 1000LL / actual_config_.sample_rate;
+  int status = buffer_.InitFromStorage(actual_config_, pending_timestamp_,
+                                       duration, &storage_,
+                                       &storage_capacity_, period_size);
+  if (status) {
+    LOG(ERROR) << "audio buffer init failed: " << status;
+    return kDeviceError;
+  }
+  pending_frames_ = 0;
+  pending_timestamp_ += duration;
+
+  // |storage_| now holds the buffer's previous storage.
+  if (storage_capacity_ < period_size) {
+    storage_ = AllocateMediaBuffer(std::shared_ptr<MediaArena>(),
+                                   period_size, &storage_capacity_);
+    if (!storage_) {
+      LOG(ERROR) << "cannot allocate audio capture storage.";
+      storage_capacity_ = 0;
+      return kNoMemory;
+    }
+  }
+  status = ptr_callback_->OnSamplesReceived(&buffer_);
+  if (status) {
+    WEBMLIVE_LOG_EVERY_MS(WARNING, kLogIntervalMs)
+        << "OnSamplesReceived failed: " << status;
+  }
+  return kSuccess;
+}
+
+}  // namespace webmlive
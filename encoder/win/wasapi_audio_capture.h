@@ -0,0 +1,186 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef WEBMLIVE_ENCODER_WIN_WASAPI_AUDIO_CAPTURE_H_
+#define WEBMLIVE_ENCODER_WIN_WASAPI_AUDIO_CAPTURE_H_
+
+#include <windows.h>
+#include <audioclient.h>
+#include <comdef.h>
+#include <mmdeviceapi.h>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "encoder/audio_encoder.h"
+#include "encoder/basictypes.h"
+#include "encoder/encoder_base.h"
+#include "encoder/media_arena.h"
+
+namespace webmlive {
+
+#ifndef COMPTR_TYPEDEF
+// A slightly more brief version of the com_ptr_t definition macro.
+#define COMPTR_TYPEDEF(InterfaceName) \
+  _COM_SMARTPTR_TYPEDEF(InterfaceName, IID_##InterfaceName)
+#endif
+COMPTR_TYPEDEF(IAudioCaptureClient);
+COMPTR_TYPEDEF(IAudioClient);
+COMPTR_TYPEDEF(IMMDevice);
+COMPTR_TYPEDEF(IMMDeviceCollection);
+COMPTR_TYPEDEF(IMMDeviceEnumerator);
+
+// Event-driven audio capture from a WASAPI endpoint, in shared or exclusive
+// mode. Packets are read from the capture client as the device signals
+// them, collected into |AudioBuffer|s of the configured period without an
+// intermediate allocator, and passed to an |AudioSamplesCallbackInterface|
+// from a capture thread.
+//
+// Timestamps follow the device position: a packet's time is the sample
+// count since an anchor, the first packet or the last discontinuity, whose
+// QPC capture time is mapped onto the stream time of the video graph. The
+// mapping is refreshed with each packet, so that audio and video timestamps
+// share the graph's clock.
+//
+// Notes:
+// - Shared mode captures 16 bit PCM, or the requested sample size, at the
+//   requested rate and channel count, converted by the audio engine.
+//   Exclusive mode requires the device to support that format.
+// - The capture thread registers as "audio_capture", which receives its
+//   MMCSS task and priority from the thread settings.
+class WasapiAudioCapture {
+ public:
+  enum {
+    // A WASAPI call failed.
+    kDeviceError = -4,
+
+    // The requested endpoint does not exist.
+    kNoDevice = -3,
+    kNoMemory = -2,
+    kInvalidArg = -1,
+    kSuccess = 0,
+  };
+
+  // Stores the stream time, in 100 ns units, of the clock timestamps follow
+  // in its argument, and returns true, or returns false when the clock is not
+  // running.
+  typedef std::function<bool(REFERENCE_TIME*)> StreamTimeFunction;
+
+  // Period length when none is requested, in milliseconds.
+  static const int kDefaultPeriodMs = 10;
+
+  // Longest time the capture thread waits for a packet before checking for
+  // |Stop()|, in milliseconds.
+  static const int kWaitTimeoutMs = 100;
+
+  // Largest difference, in milliseconds, between the position-based
+  // timestamp of a packet and its mapped QPC time before timestamps are
+  // anchored again.
+  static const int kMaxDriftMs = 20;
+
+  WasapiAudioCapture();
+  ~WasapiAudioCapture();
+
+  // Opens the capture endpoint with the friendly name |device_name|, or when
+  // |device_name| is empty the active endpoint at |device_index|, and the
+  // default endpoint for |kUseDefaultDevice|. Configures it for |requested|
+  // samples delivered every |period_ms|, or |kDefaultPeriodMs| when 0, in
+  // exclusive mode when |exclusive| is true. Must be called on a thread
+  // that initialized COM. Returns |kSuccess|, |kNoDevice|, |kDeviceError|
+  // when the endpoint cannot be configured, or |kInvalidArg| when
+  // |ptr_callback| is NULL or |period_ms| is negative.
+  int Init(const std::wstring& device_name, int device_index,
+           const AudioConfig& requested, int period_ms, bool exclusive,
+           AudioSamplesCallbackInterface* ptr_callback);
+
+  // Starts capture and the capture thread. Timestamps follow
+  // |stream_time|, or count from the call when it is empty. Returns
+  // |kSuccess|, |kDeviceError| or |kNoMemory|.
+  int Run(const StreamTimeFunction& stream_time);
+
+  // Stops the capture thread and the endpoint. |Run()| may be called again.
+  void Stop();
+
+  // Returns |kSuccess| while samples are captured, or the error that stopped
+  // the capture thread.
+  int status() const { return status_; }
+
+  const AudioConfig& actual_config() const { return actual_config_; }
+
+  // Name of the opened endpoint.
+  const std::wstring& device_name() const { return device_name_; }
+
+ private:
+  // Stores the endpoint selected by |device_name| and |device_index| in
+  // |device_|, and its friendly name in |device_name_|.
+  int FindDevice(const std::wstring& device_name, int device_index);
+
+  // Initializes |audio_client_| for |format| with |period|, in 100 ns units.
+  // Retries exclusive mode once with an aligned period when the device
+  // asks for one.
+  int InitAudioClient(const WAVEFORMATEXTENSIBLE& format,
+                      REFERENCE_TIME period);
+
+  // Returns the current stream time in 100 ns units.
+  REFERENCE_TIME StreamTimeNow();
+
+  // Reads and delivers packets until |stop_| is set or the device fails.
+  void CaptureThread();
+
+  // Reads the available packets into |storage_|, and delivers each complete
+  // period. Returns |kSuccess| or |kDeviceError|.
+  int ReadPackets();
+
+  // Sets |pending_timestamp_| for a packet captured at device position
+  // |device_position| and QPC time |qpc_position|, anchoring the device
+  // position again after |discontinuity| or too much drift.
+  void UpdateTimestamp(uint64 device_position, uint64 qpc_position,
+                       bool discontinuity);
+
+  // Delivers the |pending_frames_| in |storage_|.
+  int DeliverPeriod();
+
+  IMMDevicePtr device_;
+  IAudioClientPtr audio_client_;
+  IAudioCaptureClientPtr capture_client_;
+  HANDLE event_;
+  std::wstring device_name_;
+  bool exclusive_;
+  AudioConfig actual_config_;
+  int32 period_frames_;
+
+  // Clock of the timestamps, and the QPC time of timestamp 0 without one.
+  StreamTimeFunction stream_time_;
+  int64 qpc_start_;
+  int64 qpc_frequency_;
+
+  // Stream time, in 100 ns units, of the sample at device position
+  // |anchor_position_|, or -1 before the first packet.
+  REFERENCE_TIME anchor_time_;
+  uint64 anchor_position_;
+
+  // Samples collected for the next buffer, and the timestamp in
+  // milliseconds of the first of them.
+  MediaBuffer storage_;
+  int32 storage_capacity_;
+  int32 pending_frames_;
+  int64 pending_timestamp_;
+  AudioBuffer buffer_;
+
+  AudioSamplesCallbackInterface* ptr_callback_;
+  std::atomic<bool> stop_;
+  std::atomic<int> status_;
+  std::unique_ptr<std::thread> thread_;
+  WEBMLIVE_DISALLOW_COPY_AND_ASSIGN(WasapiAudioCapture);
+};
+
+}  // namespace webmlive
+
+#endif  // WEBMLIVE_ENCODER_WIN_WASAPI_AUDIO_CAPTURE_H_